@@ -0,0 +1,69 @@
+#! /bin/bash
+#
+# Run one problem of the benchmark suite and summarise it to bench.json.
+#
+# Usage: run-bench.sh problem scaling ntask prefix
+#   problem: dm, hydro or fullphysics (a directory in suite/)
+#   scaling: strong (fixed size) or weak (fixed size per rank)
+#   ntask:   number of MPI ranks
+#   prefix:  directory for the ICs, outputs and bench.json
+#
+# Environment:
+#   MPIRUN           launcher, called as "$MPIRUN ntask exe paramfile". Default "mpirun -np".
+#   OMP_NUM_THREADS  threads per rank. Default 2.
+#   STEPS            number of steps to run. Default 20 for dm, 10 otherwise.
+#   CODEDIR          top of the source tree with built binaries. Default the tree of this script.
+#
+# Compare two runs with: python3 tools/parsebench.py --compare old/bench.json new/bench.json
+
+if [ "x$4" == "x" ]; then
+    echo Usage $0 problem strong\|weak ntask prefix
+    exit 1;
+fi
+
+problem=$1
+scaling=$2
+ntask=$3
+prefix=$(mkdir -p $4 && cd $4 && pwd)
+
+benchdir=$(cd $(dirname $0) && pwd)
+codedir=${CODEDIR:-$(cd $benchdir/.. && pwd)}
+MPIRUN=${MPIRUN:-mpirun -np}
+export OMP_NUM_THREADS=${OMP_NUM_THREADS:-2}
+
+# Standard sizes: particle grid and box (kpc/h) of the strong scaling problem,
+# and particle grid per rank of the weak scaling problem, at the same resolution.
+case $problem in
+    dm)
+        ngrid0=512; box0=100000; ngridrank=64; steps=${STEPS:-20};;
+    hydro|fullphysics)
+        ngrid0=256; box0=25000; ngridrank=48; steps=${STEPS:-10};;
+    *)
+        echo Unknown problem $problem; exit 1;;
+esac
+
+case $scaling in
+    strong)
+        ngrid=$ngrid0;;
+    weak)
+        # ngridrank^3 particles per rank, rounded to a multiple of 8
+        ngrid=$(awk "BEGIN {print 8 * int($ngridrank * $ntask^(1./3) / 8 + 0.5)}");;
+    *)
+        echo Unknown scaling $scaling; exit 1;;
+esac
+box=$(awk "BEGIN {print $box0 * $ngrid / $ngrid0}")
+nmesh=$((2 * ngrid))
+
+for i in paramfile.genic paramfile.gadget; do
+    sed -e "s;@PREFIX@;$prefix;" -e "s;@EXAMPLES@;$codedir/examples;" \
+        -e "s;@NGRID@;$ngrid;" -e "s;@BOXSIZE@;$box;" -e "s;@NMESH@;$nmesh;" -e "s;@STEPS@;$steps;" \
+        $benchdir/suite/$problem/$i > $prefix/$i ;
+done
+
+cd $prefix
+rm -f cpu.txt memory.txt treewalk.jsonl
+$MPIRUN $ntask $codedir/genic/MP-GenIC paramfile.genic || exit 1
+$MPIRUN $ntask $codedir/gadget/MP-Gadget paramfile.gadget || exit 1
+
+python3 $codedir/tools/parsebench.py --json bench.json --problem $problem --scaling $scaling --ngrid $ngrid --steps $steps \
+    --version "$(cd $codedir && git describe --always --dirty --abbrev=10)" $prefix
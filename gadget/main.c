@@ -18,6 +18,7 @@
 #include <libgadget/forcetree.c>
 
 #include <libgadget/utils.h>
+#include <libgadget/treewalk.h>
 
 #include "params.h"
 
@@ -26,6 +27,69 @@ void gsl_handler (const char * reason, const char * file, int line, int gsl_errn
     endrun(2001,"GSL_ERROR in file: %s, line %d, errno:%d, error: %s\n",file, line, gsl_errno, reason);
 }
 
+/* Ensemble mode: the list file has one parameter file per line. The ranks are split into
+ * contiguous groups, one per line, and each group runs its own simulation on its own communicator.
+ * Returns the parameter file of this rank's simulation. Output is appended to paramfile.log.*/
+static char *
+ensemble_split(const char * listfile)
+{
+    int WorldTask, WorldNTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &WorldTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &WorldNTask);
+
+    char * list = NULL;
+    int size = 0;
+    if(WorldTask == 0) {
+        FILE * fd = fopen(listfile, "r");
+        if(!fd)
+            endrun(1, "Could not read ensemble list %s\n", listfile);
+        fseek(fd, 0, SEEK_END);
+        size = ftell(fd) + 1;
+        rewind(fd);
+        list = malloc(size);
+        size = fread(list, 1, size - 1, fd) + 1;
+        list[size - 1] = '\0';
+        fclose(fd);
+    }
+    MPI_Bcast(&size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(WorldTask != 0)
+        list = malloc(size);
+    MPI_Bcast(list, size, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    /* Non-empty lines are the parameter files*/
+    char ** files = NULL;
+    int nmember = 0;
+    char * saveptr = NULL;
+    char * line;
+    for(line = strtok_r(list, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        while(*line == ' ' || *line == '\t')
+            line++;
+        if(*line == '\0' || *line == '#')
+            continue;
+        files = realloc(files, (nmember + 1) * sizeof(char *));
+        files[nmember++] = line;
+    }
+    if(nmember == 0 || nmember > WorldNTask)
+        endrun(1, "Ensemble list %s has %d simulations for %d ranks\n", listfile, nmember, WorldNTask);
+
+    int color = (int64_t) WorldTask * nmember / WorldNTask;
+    MPI_Comm comm;
+    MPI_Comm_split(MPI_COMM_WORLD, color, WorldTask, &comm);
+    gadget_set_comm(comm);
+
+    char * paramfile = strdup(files[color]);
+    free(files);
+    free(list);
+
+    char * logfile = malloc(strlen(paramfile) + 5);
+    sprintf(logfile, "%s.log", paramfile);
+    if(!freopen(logfile, "a", stdout) || !freopen(logfile, "a", stderr))
+        endrun(1, "Could not open ensemble log %s\n", logfile);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    free(logfile);
+    return paramfile;
+}
+
 /*! \file main.c
  *  \brief start of the program
  */
@@ -40,10 +104,22 @@ int main(int argc, char **argv)
 {
     int NTask;
     int thread_provided;
-    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_provided);
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
-    if(thread_provided != MPI_THREAD_FUNNELED)
-        message(1, "MPI_Init_thread returned %d != MPI_THREAD_FUNNELED\n", thread_provided);
+    /* MPI_THREAD_MULTIPLE is only needed for the treewalk communication thread, and may be slower*/
+    const int thread_required = getenv("GADGET_MPI_THREAD_MULTIPLE") ? MPI_THREAD_MULTIPLE : MPI_THREAD_FUNNELED;
+    MPI_Init_thread(&argc, &argv, thread_required, &thread_provided);
+
+    /* Ensemble mode: shift the arguments so the rest is the same as a single simulation*/
+    char * paramfile = NULL;
+    if(argc >= 3 && strcmp(argv[1], "--ensemble") == 0) {
+        paramfile = ensemble_split(argv[2]);
+        argv[2] = paramfile;
+        argv++;
+        argc--;
+    }
+
+    MPI_Comm_size(GadgetComm, &NTask);
+    if(thread_provided != thread_required)
+        message(1, "MPI_Init_thread returned %d != %d\n", thread_provided, thread_required);
 
     message(0, "This is MP-Gadget, version %s.\n", GADGET_VERSION);
     message(0, "Running on %d MPI Ranks.\n", NTask);
@@ -59,12 +135,15 @@ int main(int argc, char **argv)
     if(argc < 2)
     {
         message(0, "Parameters are missing.\n");
-        message(0, "Call with <ParameterFile> [<RestartFlag>] [<RestartSnapNum>]\n\n");
+        message(0, "Call with <ParameterFile> [<RestartFlag>] [<RestartSnapNum>]\n");
+        message(0, "or with --ensemble <ListFile> [<RestartFlag>] [<RestartSnapNum>] to run one simulation\n");
+        message(0, "for each parameter file listed in ListFile, on an equal share of the ranks.\n\n");
         message(0, "   RestartFlag    Action\n");
         message(0, "       1          Restart from last snapshot (LastSnapNum.txt) and continue simulation\n");
         message(0, "       2          Restart from specified snapshot (-1 for Initial Condition) and continue simulation\n");
         message(0, "       3          Run FOF if enabled\n");
         message(0, "       4          Generate a power spectrum and exit\n");
+        message(0, "       5          Write the part of a snapshot selected by PartialReadTypes, PartialReadBlocks and PartialReadRegion and exit\n");
         message(0, "       99         Run Tests. \n\n");
         MPI_Finalize();
         return 1;
@@ -73,7 +152,7 @@ int main(int argc, char **argv)
     /* Avoid dumping core, except for the master process. For large jobs writing core
      * with all of main memory can be very bad. */
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask != 0) {
         struct rlimit rlim = {0};
         setrlimit(RLIMIT_CORE, &rlim);
@@ -111,14 +190,24 @@ int main(int argc, char **argv)
     gsl_set_error_handler(gsl_handler);
 
     /*Initialize the memory manager*/
-    mymalloc_init(MaxMemSizePerNode);
+    if(treewalk_shared_memory_on())
+        mymalloc_init_shared(MaxMemSizePerNode);
+    else
+        mymalloc_init(MaxMemSizePerNode);
 
     /* Make sure memory has finished initialising on all ranks before doing more.
      * This may improve stability */
-    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Barrier(GadgetComm);
 
     init_endrun(ShowBacktrace);
 
+    /* Reads only the selected particles, so does not set up the simulation*/
+    if(RestartFlag == 5) {
+        runsubset(RestartSnapNum);
+        MPI_Finalize();
+        return 0;
+    }
+
     struct header_data head = {0};
     inttime_t ti_init = begrun(RestartSnapNum, &head);
 
@@ -136,6 +225,9 @@ int main(int argc, char **argv)
             run(RestartSnapNum, ti_init, &head);        /* main simulation loop */
             break;
     }
+    /* Print diagnostics of the fof, power or test runs*/
+    diagnostics_finish();
+    free(paramfile);
     MPI_Finalize();		/* clean up & finalize MPI */
 
     return 0;
@@ -8,6 +8,8 @@
 #include <libgadget/timebinmgr.h>
 #include <libgadget/timestep.h>
 #include <libgadget/utils.h>
+#include <libgadget/utils/mpsort.h>
+#include <libgadget/walltime.h>
 #include <libgadget/treewalk.h>
 #include <libgadget/cooling_rates.h>
 #include <libgadget/winds.h>
@@ -16,6 +18,7 @@
 #include <libgadget/density.h>
 #include <libgadget/hydra.h>
 #include <libgadget/fof.h>
+#include <libgadget/subfind.h>
 #include <libgadget/init.h>
 #include <libgadget/run.h>
 #include <libgadget/timebinmgr.h>
@@ -25,6 +28,8 @@
 #include <libgadget/uvbg.h>
 #include <libgadget/stats.h>
 #include <libgadget/plane.h>
+#include <libgadget/lightcone.h>
+#include <libgadget/neutrinos_lra.h>
 
 static int
 BlackHoleFeedbackMethodAction (ParameterSet * ps, const char * name, void * data)
@@ -72,13 +77,22 @@ create_gadget_parameter_set()
     param_declare_string(ps, "EnergyFile", OPTIONAL, "energy.txt", "File to output energy statistics.");
     param_declare_int(ps,    "OutputEnergyDebug", OPTIONAL, 0, "Should we output energy statistics to energy.txt");
     param_declare_string(ps, "CpuFile", OPTIONAL, "cpu.txt", "File to output cpu usage information");
+    param_declare_string(ps, "MemoryFile", OPTIONAL, "memory.txt", "File to output the peak memory usage of each step, by allocated block");
+    param_declare_string(ps, "StatusFile", OPTIONAL, "status.json", "File rewritten every step with a JSON summary of the run for monitoring: the step, slowest clocks, imbalance, peak memory and projected time to TimeMax and the next snapshot. Empty disables.");
     param_declare_string(ps, "OutputList", REQUIRED, NULL, "List of output scale factors.");
 
+    param_declare_int(ps, "PartialReadTypes", OPTIONAL, 63, "With RestartFlag 5, bitmask of the particle types to write to the subset snapshot SUBSET_%03d.");
+    param_declare_string(ps, "PartialReadBlocks", OPTIONAL, "", "With RestartFlag 5, comma separated list of the blocks to write. Empty writes all blocks.");
+    param_declare_string(ps, "PartialReadRegion", OPTIONAL, "", "With RestartFlag 5, only write particles inside this region, given as 'xmin ymin zmin xmax ymax zmax' in internal units. Empty writes the whole box. Regions may not wrap around the box.");
+
     /*Potential plane parameters*/
+    param_declare_string(ps, "PowerSpectrumOutputList", OPTIONAL, NULL, "List of scale factors at which to measure the power spectra of the particle types in PowerSpectrumTypes, without a snapshot.");
+    param_declare_int(ps, "PowerSpectrumTypes", OPTIONAL, 1 + 2 + 16, "Bit field of the particle types (1 << type) measured at PowerSpectrumOutputList. The auto spectrum of each type and the cross spectrum of each pair are saved to OutputDir/powerspectrum-typeN[-typeM]-TIME.txt.");
     param_declare_string(ps, "PlaneOutputList", OPTIONAL, NULL, "List of potential plane output scale factors.");
     param_declare_int(ps, "PlaneResolution", OPTIONAL, 256, "Number of pixels per dimension in the potential plane (should be an even number).");
     param_declare_double(ps, "PlaneThickness", OPTIONAL, -1, "Thickness of the potential plane in the normal direction in internal gadget units (kpc/h by default).");
     param_declare_string(ps, "PlaneCutPoints", OPTIONAL, NULL, "List of potential plane cut points in the normal direction in internal gadget units (kpc/h by default).");
+    param_declare_int(ps, "PlaneDistributed", OPTIONAL, 0, "Split each potential plane in slabs over the ranks, solve it with a parallel FFT and write it as a bigfile (OutputDir/snapN_potentialPlaneM_normalK). Otherwise the plane is reduced to rank 0 and written as FITS.");
     param_declare_string(ps, "PlaneNormals", OPTIONAL, "\"0, 1, 2\"", "List of potential plane normal directions (0=x, 1=y, 2=z).");
 
     /*Cosmology parameters*/
@@ -96,32 +110,82 @@ create_gadget_parameter_set()
     /*End cosmology parameters*/
 
     param_declare_int(ps,    "OutputPotential", OPTIONAL, 1, "Save the potential in snapshots.");
+    param_declare_int(ps,    "OutputWorkCost", OPTIONAL, 0, "Save the gravity and neighbour interaction counts of each particle in snapshots, and read them back on restart so the first domain decomposition can use them.");
     param_declare_int(ps,    "OutputTimebins", OPTIONAL, 0, "Save the particle timebins in snapshots, for debugging.");
     param_declare_int(ps,    "OutputHeliumFractions", OPTIONAL, 0, "Save the helium ionic fractions in snapshots.");
+    param_declare_int(ps,    "OutputPositionBits", OPTIONAL, 0, "Mantissa bits (of 52) kept in saved positions; the rest are rounded to zero so snapshots compress well. 0 keeps full precision. Lossy: affects restarts.");
+    param_declare_int(ps,    "OutputVelocityBits", OPTIONAL, 0, "Mantissa bits (of 23) kept in saved velocities; the rest are rounded to zero so snapshots compress well. 0 keeps full precision. Lossy: affects restarts.");
     param_declare_int(ps,    "OutputDebugFields", OPTIONAL, 0, "Save a large number of debug fields in snapshots.");
     param_declare_int(ps,    "ShowBacktrace", OPTIONAL, 1, "Print a backtrace on crash. Hangs on stampede.");
     param_declare_double(ps,    "MaxMemSizePerNode", OPTIONAL, 0.6, "Pre-allocate this much memory per computing node/ host, in MB. Passing < 1 allocates a fraction of total available memory per node, defaults to 0.6 available memory.");
+    param_declare_int(ps,    "MemoryFirstTouch", OPTIONAL, 1, "Do not zero the main memory when it is allocated, so each page is placed by first touch on the NUMA node (socket) of the OpenMP thread which first uses it. The particle table is cleared with the same static schedule as the particle loops. Turn off to zero all memory from one thread at startup.");
+    param_declare_int(ps,    "MemoryHugePages", OPTIONAL, 0, "Back the main memory with huge pages, to reduce TLB misses in the tree walks. 0: normal pages. 1: transparent huge pages (madvise). 2: explicit 2MB huge pages from hugetlbfs. 3: explicit 1GB huge pages. Explicit huge pages must be reserved by the system; if none are free transparent huge pages are used.");
+    param_declare_int(ps,    "MemoryPinned", OPTIONAL, 0, "Allocate the main memory with MPI_Alloc_mem, so that the MPI library may register (pin) it once for RDMA and the particle exchanges and treewalk exports avoid copies. Explicit huge pages are not used with this.");
+    param_declare_int(ps,    "WallTimeCounters", OPTIONAL, 0, "Read the cycle, instruction and cache miss counters of each thread with perf_event, and report the instructions per cycle and cache misses of each timer in cpu.txt. Needs perf_event_paranoid <= 2.");
+    param_declare_int(ps,    "MPSortLeanMemory", OPTIONAL, 0, "Parallel sorts done in place exchange their data in rounds through a small scratch buffer, instead of allocating a second copy of the array. Slower, but lowers the peak memory of the FOF and snapshot sorts.");
     param_declare_double(ps, "AutoSnapshotTime", OPTIONAL, 0, "Seconds after which to automatically generate a snapshot if nothing is output.");
 
     param_declare_double(ps, "TimeMax", OPTIONAL, 1.0, "Scale factor to end run.");
     param_declare_double(ps, "TimeLimitCPU", REQUIRED, 0, "CPU time to run for in seconds. Code will stop if it notices that the time to end of the next PM step is longer than the remaining time.");
+    param_declare_int(ps, "MaxNumSteps", OPTIONAL, 0, "Stop after this many steps of this run, without writing a snapshot. For benchmarks with a fixed amount of work. 0 means no limit.");
 
     param_declare_int   (ps, "MaxDomainTimeBinDepth", OPTIONAL, 8, "Forces a domain decompositon every 2^MaxDomainTimeBinDepth timesteps.");
     param_declare_int   (ps, "DomainOverDecompositionFactor", OPTIONAL, -1, "Create on average this number of sub domains on a MPI rank. Higher numbers improve the load balancing. For optimal tree building efficiency, use one domain per thread (the default).");
     param_declare_double(ps, "RandomParticleOffset", OPTIONAL, 8., "Internally shift the particles within a periodic box by a random fraction of a PM grid cell each domain decomposition, ensuring that tree openings are decorrelated between timesteps. This shift is subtracted before particles are saved.");
 
     param_declare_int   (ps, "DomainUseGlobalSorting", OPTIONAL, 1, "Determining the initial refinement of chunks globally. Enabling this produces better domains at costs of slowing down the domain decomposition.");
+    param_declare_int   (ps, "DomainHistogramTopTree", OPTIONAL, 0, "Build the domain top tree by refining a global histogram of the Peano keys of all particles one level at a time, with an allreduce per level. Needs no sort or tree merge, so its cost does not grow with the number of ranks. Replaces DomainUseGlobalSorting.");
+    param_declare_int   (ps, "DomainUseGravCost", OPTIONAL, 0, "Balance the domains on the number of gravity interactions of each particle, measured on the last PM step, plus its density and hydro neighbour interactions when last active, rather than the number of particles. Falls back to the particle number if the memory bound is not met.");
+    param_declare_double(ps, "DomainWorkWeight", OPTIONAL, 0, "Weight of the gravity work (as for DomainUseGravCost) in a multi-constraint domain balance. If any of DomainWorkWeight, DomainGasWeight or DomainMemoryWeight is positive, the domains first balance their weighted sum, each objective normalised by its total.");
+    param_declare_double(ps, "DomainGasWeight", OPTIONAL, 0, "Weight of the number of gas particles, a proxy for the SPH work, in a multi-constraint domain balance.");
+    param_declare_int   (ps, "DomainIncremental", OPTIONAL, 0, "On PM steps, keep the top tree of the last domain decomposition and move only the domain boundaries along the Peano-Hilbert curve to restore the balance. Far fewer particles are exchanged. A full decomposition is still done if a top leaf has become too large or the memory bound is not met.");
+    param_declare_double(ps, "DomainEdgeBand", OPTIONAL, 0, "Width of a band at the edge of each domain top leaf, as a fraction of the smallest top leaf. Particles inside it are marked at each domain decomposition, and on later steps only they are checked for a move to another domain, until the fastest particle could have crossed the band. Zero checks every particle every step.");
+    param_declare_int   (ps, "DomainNodeAware", OPTIONAL, 1, "Assign consecutive Peano-Hilbert domains to the ranks of one shared memory node before moving on to the next node, so that most particle exchange and tree export stays within a node. Has no effect if the ranks are already placed on nodes in order.");
+    param_declare_double(ps, "DomainMemoryWeight", OPTIONAL, 0, "Weight of the memory used by the particles and their slots in a multi-constraint domain balance.");
     param_declare_double(ps, "ErrTolIntAccuracy", OPTIONAL, 0.02, "Controls the length of the short-range timestep. Smaller values are shorter timesteps.");
     param_declare_double(ps, "ErrTolForceAcc", OPTIONAL, 0.002, "Force accuracy required from tree. Controls tree opening criteria. Lower values are more accurate.");
     param_declare_double(ps, "BHOpeningAngle", OPTIONAL, 0.175, "Barnes-Hut opening angle. Alternative purely geometric tree opening angle. Lower values are more accurate.");
     param_declare_double(ps, "MaxBHOpeningAngle", OPTIONAL, 0.9, "Barnes-Hut opening angle, applied in addition to the relative aceleration criterion. Lower values are more accurate.");
     param_declare_double(ps, "TreeRcut", OPTIONAL, 6, "Number of mesh cells at which we cease walking.");
     param_declare_int(ps, "TreeUseBH", OPTIONAL, 2, "If 1, use Barnes-Hut opening angle rather than the standard Gadget acceleration based opening angle. If 2, use BH criterion for the first timestep only, before we have relative accelerations.");
+    param_declare_int(ps, "TreeQuadrupole", OPTIONAL, 0, "If true, compute quadrupole moments of the gravity tree nodes and use them in the short-range gravity walk. The relative acceleration opening criterion (TreeUseBH = 0) then bounds the octupole error, so fewer nodes are opened at the same ErrTolForceAcc.");
+    param_declare_int(ps, "TreeFMM", OPTIONAL, 0, "If true, on PM steps, where all particles are active, the short-range gravity between particles on the same rank is computed with a dual tree walk using local expansions about the tree nodes (the fast multipole method), rather than walking the tree for each particle. Mass on other ranks is still found by the tree walk.");
+    param_declare_int(ps, "TreeMixedPrecision", OPTIONAL, 0, "If true, the short-range gravity between particles is evaluated in single precision, in blocks of interactions which vectorise with twice the width of double precision. Separations are computed from the double precision positions and the accelerations are summed in double.");
+    param_declare_int(ps, "TreeOffload", OPTIONAL, 0, "If true, the short-range gravity from particles on the same rank is computed by walking the compact tree nodes on an accelerator, with OpenMP target offload, while the host walks the tree for the mass on other ranks. Needs a compiler with offload support, eg, OPTIMIZE += -foffload=nvptx-none. Without one the walk runs on the host.");
+    param_declare_int(ps, "TreePairSymmetric", OPTIONAL, 0, "If true, the pairwise short-range gravity (used to check the tree) evaluates each pair of local active particles once and adds the opposite force to the other particle, halving the work in dense regions.");
+    param_declare_double(ps, "ErrTolTargetRMS", OPTIONAL, 0, "If > 0, on PM steps the tree forces of a sample of particles are compared with the pairwise forces and ErrTolForceAcc is adjusted for the next steps so that the RMS force error, relative to the total acceleration, approaches this value. Only used with TreeUseBH = 0.");
+    param_declare_double(ps, "ErrTolForceAccMin", OPTIONAL, 0.0005, "Smallest ErrTolForceAcc allowed when ErrTolTargetRMS > 0.");
+    param_declare_double(ps, "ErrTolForceAccMax", OPTIONAL, 0.01, "Largest ErrTolForceAcc allowed when ErrTolTargetRMS > 0.");
+    param_declare_int(ps, "ErrTolSamples", OPTIONAL, 10000, "Total number of particles whose forces are checked on each PM step when ErrTolTargetRMS > 0.");
+    param_declare_int(ps, "TreeCompactWalk", OPTIONAL, 0, "If true, the short-range gravity walk uses a compact single precision copy of the tree nodes in depth-first order, made after the tree moments are computed. Faster to walk, but needs about 40% more tree memory during the walk.");
+    param_declare_int(ps, "TreeBucketWalk", OPTIONAL, 0, "If true, active particles in the same tree leaf walk the short-range gravity tree together, building one interaction list which is evaluated for each particle. Nodes are opened if any particle in the leaf would open them.");
+    param_declare_double(ps, "TreeRefitFraction", OPTIONAL, 0, "In the hierarchical gravity, refit the short-range gravity tree for lower timebins instead of building a new one, while they contain at least this fraction of the particles in the tree. 0 always builds a new tree.");
+    param_declare_double(ps, "TreeInteractionListSize", OPTIONAL, 0, "With TreeRefitFraction > 0, store for each particle the tree nodes at which its short-range gravity walk stopped, and start the walk on the refit tree for the next lower timebin from these nodes, opening them further where needed, instead of from the root. This is the number of nodes stored per tree particle: 2000 is enough for most. Lists which do not fit fall back to a walk from the root. Not used with TreeCompactWalk. 0 disables.");
     param_declare_int(ps, "SplitGravityTimestepsOn", OPTIONAL, 1, "This flag enables the momentum conserving hierarchical timestepping, where only active particles gravitate, from Gadget 4, for the short-range gravity, and splits the hydro and gravitational timesteps.");
+    param_declare_int(ps, "DeferDriftOn", OPTIONAL, 0, "With SplitGravityTimestepsOn, on steps which are not PM steps do not drift the inactive particles of types which are in no tree of the step, such as dark matter without black hole dynamical friction. They are drifted when next active, or at the next full drift.");
+    param_declare_int(ps, "HydroSubcycleOn", OPTIONAL, 0, "With SplitGravityTimestepsOn, steps on which only hydro timebins are active do no gravity work: they skip the extra domain decompositions forced by MaxDomainTimeBinDepth, which drift every particle, and the gravity section. The domain is only maintained. With DeferDriftOn the inactive particles in no tree of the step are not drifted.");
 
     param_declare_double(ps, "Asmth", OPTIONAL, 1.5, "The scale of the short-range/long-range force split in units of FFT-mesh cells."
                                                       "Larger values suppresses grid anisotropy. ShortRangeForceWindowType = erfc supports any value. 'exact' only supports 1.5. ");
+    param_declare_int(ps, "AdaptiveAsmth", OPTIONAL, 0, "If true, adjust Asmth on each PM step, within AsmthMin and AsmthMax, to minimise the measured time per unit log a of the PM and the gravity tree. A larger Asmth allows longer PM steps, but the tree walks out to TreeRcut * Asmth cells. Needs ShortRangeForceWindowType = erfc. Asmth restarts from its parameter value on a restart.");
+    param_declare_double(ps, "AsmthMin", OPTIONAL, 1.0, "Smallest Asmth used by AdaptiveAsmth.");
+    param_declare_double(ps, "AsmthMax", OPTIONAL, 2.5, "Largest Asmth used by AdaptiveAsmth. The short-range window table extends to 15 mesh cells, so AsmthMax * TreeRcut should not exceed this.");
     param_declare_int(ps,    "Nmesh", OPTIONAL, -1, "Size of the PM grid on which to compute the long-range force.");
+    param_declare_int(ps, "PMHighResTypes", OPTIONAL, 0, "Bit mask of particle types (1 << type) which define the high resolution region of a zoom simulation. If non-zero, a second PM mesh is placed around this region on each PM step, and particles inside it use a short-range tree force cut off at the split scale of that mesh, which is much smaller. Zero disables the high resolution mesh.");
+    param_declare_int(ps, "PMHighResNmesh", OPTIONAL, -1, "Size of the high resolution PM mesh. If negative, the same as Nmesh.");
+    param_declare_int(ps, "PMBatchTransforms", OPTIONAL, 0, "If 1, transform the PM potential and the three force components back to real space with one batched FFT and one cell exchange, rather than four. Uses four times the memory for the real and complex meshes.");
+    static ParameterEnum PMFFTBackendEnum [] = {
+        {"pencil", PETAPM_FFT_PENCIL},
+        {"slab", PETAPM_FFT_SLAB},
+        {NULL, PETAPM_FFT_PENCIL},
+    };
+    param_declare_enum(ps, "PMFFTBackend", PMFFTBackendEnum, OPTIONAL, "pencil", "Decomposition of the PM FFTs. pencil uses PFFT on a 2D process mesh. slab uses one slab per rank, transformed by FFTW-MPI, which needs fewer transposes and is faster for small numbers of ranks. Needs at most Nmesh ranks.");
+    param_declare_int(ps, "PMSinglePrecision", OPTIONAL, 0, "If 1, the backward FFTs of the PM potential and forces are done in single precision, halving the memory of their meshes and the bandwidth of their transposes. The density transform and the power spectrum stay in double precision. Batched transforms (PMBatchTransforms) stay in double precision.");
+    param_declare_int(ps, "PMInPlace", OPTIONAL, 0, "If 1, the PM FFTs are done in place, so the real and complex meshes share memory. Lowers the peak memory of the PM step by about a mesh. Not compatible with PMBatchTransforms.");
+    param_declare_int(ps, "PMExchangeChunks", OPTIONAL, 1, "Number of rounds in which the PM mesh cells are exchanged between the particle regions and the FFT mesh. More rounds need smaller exchange buffers, at the cost of more messages.");
+    param_declare_int(ps, "PMAssignmentOrder", OPTIONAL, 2, "Order of the PM mass assignment and force interpolation: 2 is cloud-in-cell, 3 is triangular shaped cloud, 4 is piecewise cubic spline. Higher orders alias less, so a coarser Nmesh gives the same force accuracy.");
+    param_declare_int(ps, "PMInterlace", OPTIONAL, 0, "If 1, the PM density is the mean of two meshes painted half a cell apart, which cancels the leading aliases. Costs a second mass assignment and forward FFT.");
+    param_declare_int(ps, "PMFiniteDifference", OPTIONAL, 0, "If 1, compute the PM forces by four point finite differences of the potential mesh in real space, as in Gadget-2, rather than by three more backward FFTs. The result is the same, but the mesh regions around the particles are padded by two cells, which are also exchanged.");
 
     static ParameterEnum ShortRangeForceWindowTypeEnum [] = {
         {"exact", SHORTRANGE_FORCE_WINDOW_TYPE_EXACT},
@@ -129,6 +193,7 @@ create_gadget_parameter_set()
         {NULL, SHORTRANGE_FORCE_WINDOW_TYPE_EXACT },
     };
     param_declare_enum(ps,    "ShortRangeForceWindowType", ShortRangeForceWindowTypeEnum, OPTIONAL, "exact", "type of shortrange window, exact or erfc (default is exact) ");
+    param_declare_int(ps, "ShortRangeForceWindowPolynomial", OPTIONAL, 0, "If true, evaluate the short-range window from a Chebyshev polynomial fitted to the window table at startup, rather than interpolating in the table. Needs no table lookups, so the single precision kernel vectorises fully. The run stops if the fit differs from the table by more than 1e-3.");
 
     param_declare_double(ps, "MinGasHsmlFractional", OPTIONAL, 0, "Minimal gas Hsml as a fraction of gravity softening.");
     param_declare_double(ps, "MaxGasVel", OPTIONAL, 3e5, "Maximal limit on the gas velocity in km/s. By default speed of light.");
@@ -142,19 +207,33 @@ create_gadget_parameter_set()
     param_declare_double(ps, "MaxRMSDisplacementFac", OPTIONAL, 0.2, "Controls the length of the PM timestep. Max RMS displacement per timestep in units of the mean particle separation.");
     param_declare_double(ps, "ArtBulkViscConst", OPTIONAL, 0.75, "Artificial viscosity constant for SPH.");
     param_declare_double(ps, "CourantFac", OPTIONAL, 0.15, "Courant factor for the timestepping.");
+    param_declare_int(ps, "TimeBinLimiter", OPTIONAL, 0, "Timestep limiter for gas: a gas particle may not be more than this many timebins (each a factor of 2) above the shortest hydro timebin of its neighbours, found in the hydro force. Stops particles in long timesteps being overrun by neighbours in short ones, eg, from feedback. Saitoh & Makino 2009 suggest 2. Applied when a particle next becomes active: there is no wakeup. 0 disables.");
     param_declare_double(ps, "DensityResolutionEta", OPTIONAL, 1.0, "Resolution eta factor (See Price 2008) 1 = 33 for Cubic Spline");
 
     param_declare_double(ps, "DensityContrastLimit", OPTIONAL, 100, "Has an effect only if DensityIndepndentSphOn=1. If = 0 enables the grad-h term in the SPH calculation. If > 0 also sets a maximum density contrast for hydro force calculation.");
     param_declare_double(ps, "MaxNumNgbDeviation", OPTIONAL, 2, "Maximal deviation from the desired number of neighbours for each SPH particle.");
+    param_declare_int(ps, "DensityHsmlCandidates", OPTIONAL, 1, "If true, measure the neighbour number at several trial smoothing lengths in each density iteration and interpolate to the next smoothing length. Reduces the number of density iterations.");
+    param_declare_int(ps, "DensityOffload", OPTIONAL, 0, "If true, the density of particles on the same rank is computed by walking the local gas tree on an accelerator, with OpenMP target offload, while the host walks the tree for the gas on other ranks. Needs a compiler with offload support, as for TreeOffload. Without one the walk runs on the host.");
     param_declare_double(ps, "HydroCostFactor", OPTIONAL, 1, "Unused.");
 
     param_declare_int(ps, "BytesPerFile", OPTIONAL, 1024 * 1024 * 1024, "number of bytes per file");
     param_declare_int(ps, "NumWriters", OPTIONAL, 0, "Max number of concurrent writer processes. 0 implies Number of Tasks; ");
     param_declare_int(ps, "MinNumWriters", OPTIONAL, 1, "Min number of concurrent writer processes. We increase number of Files to avoid too few writers. ");
+    param_declare_int(ps, "AdaptiveNumWriters", OPTIONAL, 0, "Measure the throughput of each snapshot block written and adjust the number of concurrent writers for the following blocks and snapshots, between MinNumWriters and NumWriters. Blocks smaller than 64 MB are not measured.");
     param_declare_int(ps, "WritersPerFile", OPTIONAL, 8, "Number of Writer groups assigned to a file; total number of writers is capped by NumWriters.");
 
     param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "Use the Aggregated IO policy for small data set (Experimental).");
     param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 256, "Max size (in MB) on a writer before reverting to throttled IO.");
+    param_declare_int(ps, "IOAggregatorsPerNode", OPTIONAL, 0, "If > 0, only this many ranks on each node write snapshot blocks; the other ranks send them their data. 0 means every rank writes, throttled by NumWriters.");
+    param_declare_int(ps, "AsyncSnapshotWrite", OPTIONAL, 0, "Copy checkpoints to a staging buffer and write them in a background thread while the run continues. The buffer is allocated outside the main memory arena and is about the size of the snapshot on each rank.");
+    param_declare_int(ps, "WriteChunkSize", OPTIONAL, 256, "Max size (in MB) of a snapshot block on one rank that is written in one go. Larger blocks are streamed to disk in chunks of this size. 0 disables streaming.");
+    param_declare_int(ps, "TrustedRestart", OPTIONAL, 0, "On restart from a snapshot, skip the startup checks of particle ID uniqueness, total mass, positions and smoothing lengths, which need collectives and a global sort. Instead every block read is compared with the checksums bigfile stored when it was written, and a mismatch stops the run. Blocks stored with a different type than in memory are not checked.");
+    param_declare_int(ps, "PipelinedRead", OPTIONAL, 0, "When reading a snapshot, read the next block in a background thread while the previous one is copied into the particles, so the file reads and the conversion overlap. Every rank reads its own rows at once, rather than NumWriters at a time. Ignored with MmapRead.");
+    param_declare_int(ps, "MmapRead", OPTIONAL, 0, "On restart, read the snapshot blocks by mapping the files, rather than through a buffer of each column. Blocks stored with a different type are still read through a buffer.");
+    param_declare_int(ps, "DifferentialCheckpoint", OPTIONAL, 0, "Hash each block of a snapshot as it is written. Blocks identical to those of the previous snapshot written or read are hard linked to it instead of written again. Only helps for columns whose values and particle order did not change.");
+    param_declare_string(ps, "LocalCheckpointDir", OPTIONAL, "", "Node-local directory (eg, NVMe or a burst buffer) to dump each rank's particles to at a checkpoint. The snapshot is then written from memory in the background. A restart with the same number of ranks reads the local copy instead, and can restart from a checkpoint whose snapshot was not finished. Empty disables.");
+    param_declare_int(ps, "HDF5Output", OPTIONAL, 0, "Also write each snapshot as a single Gadget format HDF5 file, OutputDir/SnapshotFileBase_%03d.hdf5, in parallel. Needs -DUSE_HDF5 and a parallel HDF5 library.");
+    param_declare_int(ps, "HDF5Compression", OPTIONAL, 0, "Deflate level (1-9) of the HDF5 snapshot datasets, with the shuffle filter. 0 does not compress. Compressed parallel writes need HDF5 >= 1.10.2.");
 
     /*Parameters of the cooling module*/
     param_declare_int(ps, "CoolingOn", REQUIRED, 0, "Enables cooling");
@@ -181,12 +260,20 @@ create_gadget_parameter_set()
     param_declare_int(ps, "SelfShieldingOn", OPTIONAL, 1, "Enable a correction in the cooling table for self-shielding.");
     param_declare_double(ps, "PhotoIonizeFactor", OPTIONAL, 1, "Scale the TreeCool table by this factor.");
     param_declare_int(ps, "PhotoIonizationOn", OPTIONAL, 1, "Should PhotoIonization be enabled.");
+    param_declare_double(ps, "CoolingTableTolerance", OPTIONAL, 0, "If > 0, interpolate cooling rates from a table at each redshift, with this relative error. Where the error is larger the rate network is used. 0 disables the table.");
     /* End cooling module parameters*/
 
     param_declare_int(ps, "HydroOn", OPTIONAL, 1, "Enables hydro force");
     param_declare_int(ps, "DensityOn", OPTIONAL, 1, "Enables SPH density computation.");
     param_declare_int(ps, "DensityIndependentSphOn", REQUIRED, 1, "Enables density-independent (pressure-entropy) SPH.");
     param_declare_int(ps, "LightconeOn", OPTIONAL, 0, "Enables a wildly experimental lightcone algorithm that writes particles crossing a lightcone boundary to a file. May not work!");
+    param_declare_int(ps, "LightconeBigFile", OPTIONAL, 1, "If true, buffer lightcone crossings and write them in parallel to bigfiles in OutputDir/lightcone. Otherwise append raw binary positions to one file per rank.");
+    param_declare_int(ps, "LightconeFlushSteps", OPTIONAL, 16, "Number of timesteps between writes of the buffered lightcone crossings. Crossings are also written before each snapshot and at the end of the run.");
+    param_declare_double(ps, "LightconeReferenceRedshift", OPTIONAL, 2.0, "Every particle crossing the lightcone below this redshift is written. Above it a random fraction is written, decreasing with the horizon volume. Set above 80 to write every particle.");
+    param_declare_int(ps, "LightconeOutputParticles", OPTIONAL, 1, "If false, do not write the particles crossing the lightcone. Useful if only the maps are wanted.");
+    param_declare_int(ps, "LightconeMapNside", OPTIONAL, 0, "If positive, deposit the mass of the particles crossing the lightcone into HEALPix maps (RING ordering) with this Nside, one per shell of comoving distance. 0 disables the maps.");
+    param_declare_double(ps, "LightconeMapShellWidth", OPTIONAL, 100000, "Comoving width of each lightcone map shell in internal length units (kpc/h by default). Each shell is written to OutputDir/lightcone/healpix-NNNN once the horizon has passed it.");
+    param_declare_int(ps, "LightconeMapVelocity", OPTIONAL, 0, "Also make lightcone maps of the mass weighted radial peculiar velocity.");
     param_declare_int(ps, "TreeGravOn", OPTIONAL, 1, "Enables tree gravity");
     param_declare_int(ps, "RadiationOn", OPTIONAL, 1, "Include radiation density in the background evolution.");
     param_declare_int(ps, "FastParticleType", OPTIONAL, 2, "Particles of this type will not decrease the long-range timestep. Default neutrinos.");
@@ -196,19 +283,41 @@ create_gadget_parameter_set()
     param_declare_int(ps, "GravitySofteningGas", OPTIONAL, 1, "Unused. Previously was for adaptive softening.");
 
     param_declare_double(ps, "ImportBufferBoost", OPTIONAL, 2., "Memory factor to allow for there being more particles imported during treewlk than exported. Increase this if code crashes during treewalk with out of memory.");
+    param_declare_int(ps, "TreeWalkOverlapImports", OPTIONAL, 1, "If true, evaluate ghost queries imported from other ranks while the local treewalk is running, instead of waiting until it is finished.");
+    param_declare_int(ps, "TreeWalkReuseExportPlan", OPTIONAL, 1, "If true, the SPH, black hole and feedback treewalks on the gas tree skip the toptree walk for particles which an earlier treewalk on the same tree found need no exports.");
+    param_declare_double(ps, "TreeWalkNgbCacheSkin", OPTIONAL, 0, "If positive, keep a list of the neighbours of each particle within (1 + TreeWalkNgbCacheSkin) times the search radius, made by the first asymmetric gas treewalk which needs it. Later density, hydro, wind and metal return treewalks on the same gas tree filter these lists instead of walking the tree. Hydro re-uses the lists made by density and only walks the tree nodes whose hmax exceeds the list radius. 0 disables the cache.");
+    param_declare_int(ps, "TreeWalkIntPositions", OPTIONAL, 0, "If true, store integer positions of the particles in the gas tree, spanning the box with 64 bits (32 if compiled with INTPOS_32BIT). Neighbour treewalks on the gas tree find pair separations from them by integer subtraction, where the periodic wrap is the integer overflow, instead of a branchy floating point wrap.");
+    param_declare_int(ps, "TreeWalkSortQueue", OPTIONAL, 0, "Order of the particles in the treewalk queue. 0 keeps the particle order. 1 sorts by the tree node containing the particle. 2 sorts by the Peano-Hilbert key of the particle position. 3 puts the particles which needed the most gravity and neighbour interactions when last active first, so the expensive particles do not form a tail on one thread. Sorting improves cache re-use when the active particles are scattered.");
+    param_declare_int(ps, "TreeWalkPackExports", OPTIONAL, 0, "If true, treewalks which support it send exported queries and results to other ranks in a compact single precision format, with positions relative to the top node. Reduces the communication volume of the hydro treewalk.");
+    param_declare_int(ps, "TreeWalkSharedMemory", OPTIONAL, 0, "If true, allocate main memory in an MPI shared memory window, so that treewalks which support it (currently short-range gravity) walk the trees of other ranks on the same node directly instead of exporting to them.");
+    param_declare_double(ps, "TreeWalkSparseThreshold", OPTIONAL, 1, "Treewalks with fewer active particles than this times the number of ranks, as on the deepest black hole timebins, send their export counts only to the ranks they export to instead of doing an alltoall over all ranks. 0 always uses the alltoall.");
+    param_declare_int(ps, "TreeWalkDeterministic", OPTIONAL, 0, "If true, treewalks give bitwise identical results at any thread count, for debugging. Exports are not merged, imports are evaluated in rank order, and treewalks which add to neighbouring particles (black hole feedback, metal return, pairwise gravity) run on one thread. The time of each single-threaded treewalk is printed. Implies TreeWalkOverlapImports = 0.");
+    param_declare_int(ps, "TreeWalkTuneThreads", OPTIONAL, 0, "If true, each treewalk (by label) is timed on its first calls with the full thread count, then half, and so on while the time per particle improves, and afterwards runs with the fastest thread count. The idle threads are not used by other work.");
+    param_declare_int(ps, "TreeWalkProgressThread", OPTIONAL, 0, "If true, a communication thread on each rank receives imported queries during the primary treewalk, hands them to the compute threads and sends back their results, so that imports are evaluated as soon as they arrive and the compute threads never wait in MPI. Needs MPI_THREAD_MULTIPLE, requested by setting GADGET_MPI_THREAD_MULTIPLE in the environment. The thread busy-polls, so leave it a core.");
+    param_declare_int(ps, "TreeWalkResultRMA", OPTIONAL, 0, "If true, the results of imported treewalk queries are written with one-sided MPI_Put into a window over the export result buffer of the exporting rank, completed by a flush and a barrier, instead of with sends matched by posted receives.");
+    param_declare_int(ps, "TreeWalkLogStats", OPTIONAL, 0, "If true, append timings, export counts and the spread of interactions over ranks for every treewalk to treewalk.jsonl in OutputDir, one JSON object per line.");
     param_declare_double(ps, "PartAllocFactor", OPTIONAL, 1.5, "Over-allocation factor of particles. The load can be imbalanced to allow for the work to be more balanced.");
     param_declare_double(ps, "TopNodeAllocFactor", OPTIONAL, 0.5, "Initial TopNode allocation as a fraction of maximum particle number.");
     param_declare_double(ps, "SlotsIncreaseFactor", OPTIONAL, 0.01, "Percentage factor to increase slot allocation by when requested.");
+    param_declare_double(ps, "SlotsVirtualReserveGB", OPTIONAL, 0, "If > 0, reserve this many GB of virtual address space for each type of particle slot, outside the memory heap. Slots are then grown in place, avoiding the reallocation and copy of the star and black hole slots when more gas slots are needed. Memory is only used as it is needed, but is not counted in MaxMemSizePerNode, which may need to be reduced.");
+    param_declare_string(ps, "SlotsSpillDir", OPTIONAL, "", "If set, with SlotsVirtualReserveGB > 0, the slots of the types in SlotsSpillTypes are stored in a memory mapped file in this directory, which should be on fast node-local storage. The kernel may then write these slots out when memory is short, and they are read back ahead of FOF, metal return and snapshot writing. The files are removed when the run ends.");
+    param_declare_int(ps, "SlotsSpillTypes", OPTIONAL, 48, "Bit field of the particle types whose slots are stored in SlotsSpillDir. The default is stars and black holes, whose slots are mostly only read by FOF, metal return and snapshots.");
+    param_declare_double(ps, "SlotsGCFraction", OPTIONAL, 0.1, "Fraction of the slots of a type which must be garbage before the domain exchange compacts them. Below this, garbage star and black hole slots are reused by new particles.");
 
     param_declare_double(ps, "InitGasTemp", OPTIONAL, -1, "Initial gas temperature. By default set to CMB temperature at starting redshift.");
     param_declare_double(ps, "MinGasTemp", OPTIONAL, 5, "Minimum gas temperature");
 
     param_declare_int(ps, "SnapshotWithFOF", REQUIRED, 0, "Enable Friends-of-Friends halo finder.");
+    param_declare_int(ps, "FOFReusePMTree", OPTIONAL, 0, "If FOF runs on a PM step, keep the tree of all particles built for the PM step and link with it, rather than building another tree for FOF. Uses more memory during the PM step.");
     param_declare_int(ps, "FOFPrimaryLinkTypes", OPTIONAL, 2, "2^ particle types to use as primary FOF targets.");
     param_declare_int(ps, "FOFSecondaryLinkTypes", OPTIONAL, 1+16+32, "2^ particle types to link to nearest primaries.");
-    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "Save particles in the FOF catalog.");
+    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "Save particles in the FOF catalog. 2 writes members in place, without a global sort by group, with a GroupIndex table of the rows of each group.");
     param_declare_double(ps, "FOFHaloLinkingLength", OPTIONAL, 0.2, "Linking length for Friends of Friends halos.");
     param_declare_int(ps, "FOFHaloMinLength", OPTIONAL, 32, "Minimum number of particles per FOF Halo.");
+    param_declare_int(ps, "FOFCellLinking", OPTIONAL, 0, "If 1, link the primary particles on each rank by sorting them into a grid of cells one linking length wide, instead of searching the tree. The tree is still used for particles near the edge of the domain.");
+    param_declare_int(ps, "SubfindOn", OPTIONAL, 0, "Find the gravitationally bound subhalos of each FOF group when writing the FOF catalogue, and write them to the Subhalos blocks. Group members are then ordered by subhalo. Needs FOFSaveParticles = 1.");
+    param_declare_int(ps, "SubfindDesLinkNgb", OPTIONAL, 20, "Number of neighbours used for the subhalo finder density estimate. At most 64.");
+    param_declare_int(ps, "SubfindMinLength", OPTIONAL, 20, "Minimum number of bound particles in a subhalo.");
     param_declare_double(ps, "MinFoFMassForNewSeed", OPTIONAL, 2, "Minimal halo mass for seeding tracer particles in internal mass units.");
     param_declare_double(ps, "MinMStarForNewSeed", OPTIONAL, 5e-4, "Minimal stellar mass in halo for seeding black holes in internal mass units.");
     param_declare_double(ps, "TimeBetweenSeedingSearch", OPTIONAL, 1.04, "Scale factor fraction increase between Seeding Attempts.");
@@ -241,6 +350,7 @@ create_gadget_parameter_set()
 
     param_declare_double(ps, "BlackHoleFeedbackRadiusMaxPhys", OPTIONAL, 0, "Unused.");
     param_declare_int(ps,"WriteBlackHoleDetails",OPTIONAL, 1, "If set, output BH details at every time step.");
+    param_declare_int(ps, "BlackHoleDetailsBufferMB", OPTIONAL, 0, "If non-zero, BH details are buffered in memory instead of written to a file per rank every step. They are appended to the bigfile BlackholeDetailsBigFile in OutputDir, with one row per record in the same format, at every snapshot and whenever the buffer on any rank exceeds this many MB. Records buffered since the last snapshot are lost if the run is killed.");
     param_declare_int(ps, "MaxBlackHoleDetails", OPTIONAL, 50, "Max number of GB to write to bh details file before opening a new one.");
 
     param_declare_int(ps,"BH_DynFrictionMethod",OPTIONAL, 1, "If set to non-zero, dynamical friction is applied through this method. Setting BH_DynFrictionMethod = 1, = 2, = 3 uses stars only (=1), dark matter + stars (=2), all mass (=3) to compute the DF force.");
@@ -344,6 +454,7 @@ create_gadget_parameter_set()
     param_declare_double(ps, "QSOMeanBubble", OPTIONAL, 20000, "Mean size of the ionizing bubble around a quasar. By default 20 Mpc/h = 28 Mpc. 0807.2799");
     param_declare_double(ps, "QSOVarBubble", OPTIONAL, 0, "Variance of the ionizing bubble around a quasar. By default zero so all bubbles are the same size");
     param_declare_double(ps, "QSOHeIIIReionFinishFrac", OPTIONAL, 0.995, "Reionization fraction at which all particles are flash-reionized instead of having quasar bubbles placed.");
+    param_declare_int(ps, "QSOMaxBatch", OPTIONAL, 64, "Maximum number of quasars with non-overlapping bubbles ionized in one treewalk. 1 places the quasar bubbles one at a time.");
 
     /* Parameters for the metal return model*/
     param_declare_double(ps, "MetalsSn1aN0", OPTIONAL, 1.3e-3, "Overall rate of SN1a per Msun");
@@ -357,6 +468,7 @@ create_gadget_parameter_set()
     param_declare_double(ps, "MNum", OPTIONAL, 0, "Second neutrino mass in eV.");
     param_declare_double(ps, "MNut", OPTIONAL, 0, "Third neutrino mass in eV.");
     param_declare_double(ps, "Vcrit", OPTIONAL, 500., "For hybrid neutrinos: Critical velocity (in km/s) in the Fermi-Dirac distribution below which the neutrinos are particles in the ICs.");
+    param_declare_double(ps, "MassiveNuLinRespHistoryTol", OPTIONAL, 0, "If > 0, the linear response integral for each mode skips early times where the free-streaming kernel is below this value. 0 integrates the whole history.");
     param_declare_double(ps, "NuPartTime", OPTIONAL, 0.3333333, "Scale factor at which to turn on hybrid neutrino particles.");
     /*End parameters for the massive neutrino model*/
 
@@ -378,6 +490,7 @@ create_gadget_parameter_set()
     param_declare_double(ps, "ExcursionSetZStop", OPTIONAL, 5., "Redshift at which we stop the excursion set and use global UVBG");
     param_declare_double(ps, "ExcursionSetZStart", OPTIONAL, 25., "Redshift at which we start the excursion set");
     param_declare_int(ps, "ReionUseParticleSFR", OPTIONAL, 0, "Use the gas particle SFR instead of the usual excursion set stellar mass / timescale");
+    param_declare_int(ps, "ReionInterpolateJ21", OPTIONAL, 0, "Interpolate J21 from the excursion set grid to the gas particles with the mesh assignment weights, instead of taking the maximum of the nearby cells. Useful with a coarse UVBGdim.");
     param_declare_double(ps, "ReionSFRTimescale", OPTIONAL, 0.1, "timescale to calculate the SFR from stellar mass filtered grids (units of Hubble time)");
     /*End Parameters for the Excursion Set Algorithm*/
 
@@ -398,7 +511,7 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
     ParameterSet * ps = create_gadget_parameter_set();
 
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
 
     if(0 != param_parse_file(ps, fname)) {
         endrun(1, "Parsing %s failed.\n", fname);
@@ -414,6 +527,12 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
 
     *ShowBacktrace = param_get_int(ps, "ShowBacktrace");
     *MaxMemSizePerNode = param_get_double(ps, "MaxMemSizePerNode");
+    mymalloc_set_first_touch(param_get_int(ps, "MemoryFirstTouch"));
+    mymalloc_set_page_backing(param_get_int(ps, "MemoryHugePages"), param_get_int(ps, "MemoryPinned"));
+    if(param_get_int(ps, "WallTimeCounters"))
+        walltime_enable_counters();
+    if(param_get_int(ps, "MPSortLeanMemory"))
+        mpsort_mpi_set_options(MPSORT_LEAN_MEMORY);
     if(*MaxMemSizePerNode <= 1) {
         *MaxMemSizePerNode *= get_physmem_bytes() / (1024. * 1024.);
     }
@@ -421,6 +540,8 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
     /*Initialize per-module parameters.*/
     set_all_global_params(ps);
     set_plane_params(ps);
+    set_lightcone_params(ps);
+    set_neutrinos_lra_params(ps);
     set_init_params(ps);
     set_petaio_params(ps);
     set_timestep_params(ps);
@@ -431,12 +552,14 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
     set_qso_lightup_params(ps);
     set_treewalk_params(ps);
     set_gravshort_tree_params(ps);
+    set_gravpm_params(ps);
     set_domain_params(ps);
     set_sfr_params(ps);
     set_sync_params(ps);
     set_uvbg_params(ps);
     set_winds_params(ps);
     set_fof_params(ps);
+    set_subfind_params(ps);
     set_blackhole_params(ps);
     set_metal_return_params(ps);
     set_stats_params(ps);
@@ -19,6 +19,8 @@
 #define GLASS_SEED_HASH(seed) ((seed) * 9999721L)
 
 static void print_spec(int ThisTask, const int Ngrid, struct genic_config All2, Cosmology * CP);
+static void add_thermal_velocities(IDGenerator * idgen, struct thermalvel * therm, unsigned int * seedtable, const int start, struct ic_part_data * ICP, const int NumPart);
+static void write_grid_particles(PetaPM * pm, IDGenerator * idgen, const int PType, enum TransferType Type, double shift, double mass, struct thermalvel * therm, int therm_seed, BigFile * bf, const uint64_t FirstID, Cosmology * CP, const struct genic_config All2);
 
 int main(int argc, char **argv)
 {
@@ -116,6 +118,7 @@ int main(int argc, char **argv)
   double Grav = GRAVITY / pow(All2.units.UnitLength_in_cm, 3) * All2.units.UnitMass_in_g * pow(UnitTime_in_s, 2);
 
   petapm_init(pm, All2.BoxSize, 0, All2.Nmesh, Grav, MPI_COMM_WORLD);
+  petapm_init_batch(pm, All2.PMBatchTransforms);
 
   /*First compute and write CDM*/
   double mass[6] = {0};
@@ -131,110 +134,78 @@ int main(int argc, char **argv)
   int NumPartCDM = idgen_cdm->NumPart;
   int NumPartGas = idgen_gas->NumPart;
 
-  /*Space for both CDM and baryons*/
-  struct ic_part_data * ICP = (struct ic_part_data *) mymalloc("PartTable", (NumPartCDM + All2.ProduceGas * NumPartGas)*sizeof(struct ic_part_data));
-
-  /* If we have incoherent glass files, we need to store both the particle tables
-   * to ensure that there are no close particle pairs*/
-  /*Make the table for the CDM*/
-  if(!All2.MakeGlassCDM) {
-      setup_grid(idgen_cdm, shift_dm, mass[1], ICP);
-  } else {
-      setup_glass(idgen_cdm, pm, 0, GLASS_SEED_HASH(All2.Seed), mass[1], ICP, All2.units.UnitLength_in_cm, All2.OutputDir);
+  /*Add a thermal velocity to WDM particles*/
+  struct thermalvel WDM;
+  if(All2.WDM_therm_mass > 0){
+      double v_th = WDM_V0(All2.TimeIC, All2.WDM_therm_mass, CP.Omega0 - CP.OmegaBaryon - get_omega_nu(&CP.ONu, 1), CP.HubbleParam, All2.units.UnitVelocity_in_cm_per_s);
+      if(!All2.UsePeculiarVelocity)
+          v_th /= sqrt(All2.TimeIC);
+      init_thermalvel(&WDM, v_th, 10000/v_th, 0);
   }
 
-  /*Make the table for the baryons if we need, using the second half of the memory.*/
-  if(All2.ProduceGas) {
-    if(!All2.MakeGlassGas) {
-        setup_grid(idgen_gas, shift_gas, mass[0], ICP+NumPartCDM);
-    } else {
-        setup_glass(idgen_gas, pm, 0, GLASS_SEED_HASH(All2.Seed + 1), mass[0], ICP+NumPartCDM, All2.units.UnitLength_in_cm, All2.OutputDir);
-    }
-    /*Do coherent glass evolution to avoid close pairs*/
-    if(All2.MakeGlassGas || All2.MakeGlassCDM)
-        glass_evolve(pm, 14, "powerspectrum-glass-tot", ICP, NumPartCDM+NumPartGas, All2.units.UnitLength_in_cm, All2.OutputDir);
+  if(!All2.MakeGlassCDM && !(All2.ProduceGas && All2.MakeGlassGas)) {
+      /*Grid particles do not interact, so each type can be made and written in chunks*/
+      if(TotNumPart > 0)
+          write_grid_particles(pm, idgen_cdm, 1, DMType, shift_dm, mass[1], All2.WDM_therm_mass > 0 ? &WDM : NULL, All2.Seed+1, &bf, 0, &CP, All2);
+      if(All2.ProduceGas)
+          write_grid_particles(pm, idgen_gas, 0, GasType, shift_gas, mass[0], NULL, 0, &bf, TotNumPart, &CP, All2);
   }
+  else {
+      /*Space for both CDM and baryons*/
+      struct ic_part_data * ICP = (struct ic_part_data *) mymalloc("PartTable", (NumPartCDM + All2.ProduceGas * NumPartGas)*sizeof(struct ic_part_data));
+
+      /* If we have incoherent glass files, we need to store both the particle tables
+       * to ensure that there are no close particle pairs*/
+      /*Make the table for the CDM*/
+      if(!All2.MakeGlassCDM) {
+          setup_grid(idgen_cdm, shift_dm, mass[1], ICP);
+      } else {
+          setup_glass(idgen_cdm, pm, 0, GLASS_SEED_HASH(All2.Seed), mass[1], ICP, All2.units.UnitLength_in_cm, All2.OutputDir, All2.GlassTolerance, All2.GlassCacheDir);
+      }
 
-  /*Write initial positions into ICP struct (for CDM and gas)*/
-  int j,k;
-  for(j=0; j<NumPartCDM+NumPartGas; j++)
-      for(k=0; k<3; k++)
-          ICP[j].PrePos[k] = ICP[j].Pos[k];
-
-  if(NumPartCDM > 0) {
-    displacement_fields(pm, DMType, ICP, NumPartCDM, &CP, All2);
-
-    /*Add a thermal velocity to WDM particles*/
-    if(All2.WDM_therm_mass > 0){
-        int i;
-        double v_th = WDM_V0(All2.TimeIC, All2.WDM_therm_mass, CP.Omega0 - CP.OmegaBaryon - get_omega_nu(&CP.ONu, 1), CP.HubbleParam, All2.units.UnitVelocity_in_cm_per_s);
-        if(!All2.UsePeculiarVelocity)
-           v_th /= sqrt(All2.TimeIC);
-        struct thermalvel WDM;
-        init_thermalvel(&WDM, v_th, 10000/v_th, 0);
-        unsigned int * seedtable = init_rng(All2.Seed+1,All2.Ngrid);
-        gsl_rng * g_rng = gsl_rng_alloc(gsl_rng_ranlxd1);
-        /*Seed the random number table with the Id.*/
-        gsl_rng_set(g_rng, seedtable[0]);
-
-        for(i = 0; i < NumPartCDM; i++) {
-             /*Find the slab, and reseed if it has zero z rank*/
-             if(i % All2.Ngrid == 0) {
-                  uint64_t id = idgen_create_id_from_index(idgen_cdm, i);
-                  /*Seed the random number table with x,y index.*/
-                  gsl_rng_set(g_rng, seedtable[id / All2.Ngrid]);
-             }
-             add_thermal_speeds(&WDM, g_rng, ICP[i].Vel);
+      /*Make the table for the baryons if we need, using the second half of the memory.*/
+      if(All2.ProduceGas) {
+        if(!All2.MakeGlassGas) {
+            setup_grid(idgen_gas, shift_gas, mass[0], ICP+NumPartCDM);
+        } else {
+            setup_glass(idgen_gas, pm, 0, GLASS_SEED_HASH(All2.Seed + 1), mass[0], ICP+NumPartCDM, All2.units.UnitLength_in_cm, All2.OutputDir, All2.GlassTolerance, All2.GlassCacheDir);
         }
-        gsl_rng_free(g_rng);
-        myfree(seedtable);
-    }
+        /*Do coherent glass evolution to avoid close pairs*/
+        if(All2.MakeGlassGas || All2.MakeGlassCDM)
+            glass_evolve(pm, 14, All2.GlassTolerance, "powerspectrum-glass-tot", ICP, NumPartCDM+NumPartGas, All2.units.UnitLength_in_cm, All2.OutputDir);
+      }
 
-    write_particle_data(idgen_cdm, 1, &bf, 0, All2.SavePrePos, All2.NumFiles, All2.NumWriters, ICP);
-  }
+      /*Write initial positions into ICP struct (for CDM and gas)*/
+      int j,k;
+      for(j=0; j<NumPartCDM+NumPartGas; j++)
+          for(k=0; k<3; k++)
+              ICP[j].PrePos[k] = ICP[j].Pos[k];
 
-  /*Now make the gas if required*/
-  if(All2.ProduceGas) {
-    displacement_fields(pm, GasType, ICP+NumPartCDM, NumPartGas, &CP, All2);
-    write_particle_data(idgen_gas, 0, &bf, TotNumPart, All2.SavePrePos, All2.NumFiles, All2.NumWriters, ICP+NumPartCDM);
+      if(NumPartCDM > 0) {
+        displacement_fields(pm, DMType, ICP, NumPartCDM, &CP, All2);
+
+        if(All2.WDM_therm_mass > 0){
+            unsigned int * seedtable = init_rng(All2.Seed+1,All2.Ngrid);
+            add_thermal_velocities(idgen_cdm, &WDM, seedtable, 0, ICP, NumPartCDM);
+            myfree(seedtable);
+        }
+
+        write_particle_data(idgen_cdm, 1, &bf, 0, All2.SavePrePos, All2.NumFiles, All2.NumWriters, ICP);
+      }
+
+      /*Now make the gas if required*/
+      if(All2.ProduceGas) {
+        displacement_fields(pm, GasType, ICP+NumPartCDM, NumPartGas, &CP, All2);
+        write_particle_data(idgen_gas, 0, &bf, TotNumPart, All2.SavePrePos, All2.NumFiles, All2.NumWriters, ICP+NumPartCDM);
+      }
+      myfree(ICP);
   }
-  myfree(ICP);
 
   /*Now add random velocity neutrino particles*/
   if(All2.NGridNu > 0) {
-      int i;
       IDGenerator idgen_nu[1];
       idgen_init(idgen_nu, pm, All2.NGridNu, All2.BoxSize);
-
-      int NumPartNu = idgen_nu->NumPart;
-      ICP = (struct ic_part_data *) mymalloc("PartTable", NumPartNu*sizeof(struct ic_part_data));
-
-      NumPartNu = setup_grid(idgen_nu, shift_nu, mass[2], ICP);
-
-	  /*Write initial positions into ICP struct (for neutrinos)*/
-	  for(j=0; j<NumPartNu; j++)
-		  for(k=0; k<3; k++)
-		      ICP[j].PrePos[k] = ICP[j].Pos[k];
-
-      displacement_fields(pm, NuType, ICP, NumPartNu, &CP, All2);
-      unsigned int * seedtable = init_rng(All2.Seed+2,All2.NGridNu);
-      gsl_rng * g_rng = gsl_rng_alloc(gsl_rng_ranlxd1);
-      /*Just in case*/
-      gsl_rng_set(g_rng, seedtable[0]);
-      for(i = 0; i < NumPartNu; i++) {
-           /*Find the slab, and reseed if it has zero z rank*/
-           if(i % All2.NGridNu == 0) {
-                uint64_t id = idgen_create_id_from_index(idgen_nu, i);
-                /*Seed the random number table with x,y index.*/
-                gsl_rng_set(g_rng, seedtable[id / All2.NGridNu]);
-           }
-           add_thermal_speeds(&nu_therm, g_rng, ICP[i].Vel);
-      }
-      gsl_rng_free(g_rng);
-      myfree(seedtable);
-
-      write_particle_data(idgen_nu, 2, &bf, TotNumPart+TotNumPartGas, All2.SavePrePos, All2.NumFiles, All2.NumWriters, ICP);
-      myfree(ICP);
+      write_grid_particles(pm, idgen_nu, 2, NuType, shift_nu, mass[2], &nu_therm, All2.Seed+2, &bf, TotNumPart+TotNumPartGas, &CP, All2);
   }
 
   petapm_destroy(pm);
@@ -252,6 +223,73 @@ int main(int argc, char **argv)
   return 0;
 }
 
+/* Add thermal velocities to NumPart particles starting at index start of idgen.
+ * The random number generator is reseeded at the start of each z-row, so the velocities do not depend on the chunking.*/
+static void
+add_thermal_velocities(IDGenerator * idgen, struct thermalvel * therm, unsigned int * seedtable, const int start, struct ic_part_data * ICP, const int NumPart)
+{
+    int i;
+    gsl_rng * g_rng = gsl_rng_alloc(gsl_rng_ranlxd1);
+    /*Just in case*/
+    gsl_rng_set(g_rng, seedtable[0]);
+    for(i = 0; i < NumPart; i++) {
+         /*Find the slab, and reseed if it has zero z rank*/
+         if((start + i) % idgen->Ngrid == 0) {
+              uint64_t id = idgen_create_id_from_index(idgen, start + i);
+              /*Seed the random number table with x,y index.*/
+              gsl_rng_set(g_rng, seedtable[id / idgen->Ngrid]);
+         }
+         add_thermal_speeds(therm, g_rng, ICP[i].Vel);
+    }
+    gsl_rng_free(g_rng);
+}
+
+/* Make the grid particles of one type, displace them, and write them to the ICs.
+ * This is done in All2.NumPartChunks chunks, so only one chunk of the particle table is in memory at a time.
+ * The Gaussian field is regenerated from the seed for each chunk. If therm is not NULL, thermal velocities are added.*/
+static void
+write_grid_particles(PetaPM * pm, IDGenerator * idgen, const int PType, enum TransferType Type, double shift, double mass, struct thermalvel * therm, int therm_seed, BigFile * bf, const uint64_t FirstID, Cosmology * CP, const struct genic_config All2)
+{
+    struct ic_writer w;
+    ic_writer_open(&w, idgen, PType, bf, FirstID, All2.SavePrePos, All2.NumFiles, All2.NumWriters);
+
+    /*Round the chunks up to whole z-rows, so the thermal velocities are reseeded as for the whole table.
+     * Every rank must do the same number of chunks, since the FFTs and writes are collective.*/
+    int chunksize = (idgen->NumPart + All2.NumPartChunks - 1) / All2.NumPartChunks;
+    chunksize = ((chunksize + idgen->Ngrid - 1) / idgen->Ngrid) * idgen->Ngrid;
+
+    struct ic_part_data * ICP = (struct ic_part_data *) mymalloc("PartTable", chunksize*sizeof(struct ic_part_data));
+    unsigned int * seedtable = NULL;
+    if(therm)
+        seedtable = init_rng(therm_seed, idgen->Ngrid);
+
+    int c;
+    for(c = 0; c < All2.NumPartChunks; c++) {
+        int start = c * chunksize;
+        if(start > idgen->NumPart)
+            start = idgen->NumPart;
+        int NumPart = idgen->NumPart - start;
+        if(NumPart > chunksize)
+            NumPart = chunksize;
+        setup_grid_range(idgen, start, NumPart, shift, mass, ICP);
+
+        /*Write initial positions into ICP struct*/
+        int j,k;
+        for(j=0; j<NumPart; j++)
+            for(k=0; k<3; k++)
+                ICP[j].PrePos[k] = ICP[j].Pos[k];
+
+        displacement_fields(pm, Type, ICP, NumPart, CP, All2);
+        if(therm)
+            add_thermal_velocities(idgen, therm, seedtable, start, ICP, NumPart);
+        ic_writer_write(&w, idgen, start, ICP, NumPart);
+    }
+    if(seedtable)
+        myfree(seedtable);
+    myfree(ICP);
+    ic_writer_close(&w);
+}
+
 void print_spec(int ThisTask, const int Nmesh, struct genic_config All2, Cosmology * CP)
 {
   if(ThisTask == 0)
@@ -26,12 +26,15 @@ create_parameters(void)
     param_declare_double(ps, "BoxSize", REQUIRED, 0, "Size of box in internal units.");
     param_declare_double(ps, "Redshift", REQUIRED, 99, "Starting redshift");
     param_declare_int(ps, "Nmesh", OPTIONAL, 0, "Size of the FFT grid used to estimate displacements. Should be > Ngrid.");
+    param_declare_int(ps, "PMBatchTransforms", OPTIONAL, 0, "If > 1, transform this many of the density, displacement and velocity fields back to real space with one batched FFT and one cell exchange. 4 does the density and the displacements together. Uses this many times the memory for the real and complex meshes.");
     param_declare_int(ps, "Ngrid", REQUIRED, 0, "Size of regular grid on which the undisplaced CDM particles are created.");
     param_declare_int(ps, "NgridGas", OPTIONAL, -1, "Size of regular grid on which the undisplaced gas particles are created.");
     param_declare_int(ps, "NgridNu", OPTIONAL, 0, "Number of neutrino particles created for hybrid neutrinos.");
     param_declare_int(ps, "Seed", REQUIRED, 0, "Random number generator seed used for the phases of the Gaussian random field.");
     param_declare_int(ps, "MakeGlassGas", OPTIONAL, -1, "Generate Glass IC for gas instead of Grid IC.");
     param_declare_int(ps, "MakeGlassCDM", OPTIONAL, 0, "Generate Glass IC for CDM instead of Grid IC.");
+    param_declare_double(ps, "GlassTolerance", OPTIONAL, 0, "Stop the glass relaxation early once the rms force has fallen below this fraction of its initial value. 0 always does the full 14 steps.");
+    param_declare_string(ps, "GlassCacheDir", OPTIONAL, "", "If set, glasses are saved to this directory and reused by later runs with the same Ngrid, Seed, Nmesh and number of ranks.");
 
     param_declare_int(ps, "UnitaryAmplitude", OPTIONAL, 1, "If 0, each Fourier mode in the initial power spectrum is scattered. If 1 each Fourier mode is not scattered and we generate unitary gaussians for the initial phases.");
     param_declare_int(ps, "WhichSpectrum", OPTIONAL, 2, "Type of spectrum, 2 for file ");
@@ -52,9 +55,16 @@ create_parameters(void)
     param_declare_double(ps, "MaxMemSizePerNode", OPTIONAL, 0.6, "Maximum memory per node, in fraction of total memory, or MB if > 1.");
     param_declare_double(ps, "CMBTemperature", OPTIONAL, 2.7255, "CMB temperature in K");
     param_declare_double(ps, "RadiationOn", OPTIONAL, 1, "Include radiation in the background.");
+    param_declare_int(ps, "LPTOrder", OPTIONAL, 1, "Order of Lagrangian perturbation theory for the displacements. 1 is the Zel'dovich approximation, 2 adds the second order (2LPT) displacements and velocities, allowing a later starting redshift.");
     param_declare_int(ps, "UsePeculiarVelocity", OPTIONAL, 1, "Snapshots will save peculiar velocities to the Velocity field. If 0, then v/sqrt(a) will be used in the ICs to match Gadget-2, but snapshots will save v * a.");
     param_declare_int(ps, "SavePrePos", OPTIONAL, 1, "Save the pre-displacement positions in the snapshot.");
     param_declare_int(ps, "InvertPhase", OPTIONAL, 0, "Flip phase for paired simulation");
+    static ParameterEnum GaussianRNGEnum [] = {
+        {"ngenic", GAUSSIAN_RNG_NGENIC},
+        {"philox", GAUSSIAN_RNG_PHILOX},
+        {NULL, GAUSSIAN_RNG_NGENIC},
+    };
+    param_declare_enum(ps, "GaussianRNG", GaussianRNGEnum, OPTIONAL, "ngenic", "Random number generator for the initial gaussian field. ngenic agrees with N-GenIC for the same Seed, but the seeds are drawn serially. philox draws each mode from a counter based generator keyed on Seed, which is threaded and does not depend on the number of ranks. The two give different fields for the same Seed.");
     param_declare_int(ps, "PrePosGridCenter", OPTIONAL, 0, "Set pre-displacement positions at the center of the grid");
     param_declare_int(ps, "ShowBacktrace", OPTIONAL, 1, "Print a backtrace on crash. Hangs on stampede.");
 
@@ -70,6 +80,7 @@ create_parameters(void)
 
     param_declare_int(ps, "NumPartPerFile", OPTIONAL, 1024 * 1024 * 128, "Number of particles per striped bigfile. Internal implementation detail.");
     param_declare_int(ps, "NumWriters", OPTIONAL, 0, "Number of processors allowed to write at one time.");
+    param_declare_int(ps, "NumPartChunks", OPTIONAL, 1, "Generate and write the grid particles of each type in this many chunks. Reduces the memory needed for the particle table, at the cost of repeating the FFTs for each chunk. Not used for glass ICs.");
     return ps;
 }
 
@@ -120,6 +131,7 @@ void read_parameterfile(char *fname, struct genic_config * GenicConfig, int * Sh
 
     GenicConfig->ProduceGas = param_get_int(ps, "ProduceGas");
     GenicConfig->InvertPhase = param_get_int(ps, "InvertPhase");
+    GenicConfig->GaussianRNG = param_get_enum(ps, "GaussianRNG");
     /*Unit system*/
     GenicConfig->units.UnitVelocity_in_cm_per_s = param_get_double(ps, "UnitVelocity_in_cm_per_s");
     GenicConfig->units.UnitLength_in_cm = param_get_double(ps, "UnitLength_in_cm");
@@ -152,10 +164,14 @@ void read_parameterfile(char *fname, struct genic_config * GenicConfig, int * Sh
 
     /*Simulation parameters*/
     GenicConfig->UsePeculiarVelocity = param_get_int(ps, "UsePeculiarVelocity");
+    GenicConfig->LPTOrder = param_get_int(ps, "LPTOrder");
+    if(GenicConfig->LPTOrder < 1 || GenicConfig->LPTOrder > 2)
+        endrun(0, "LPTOrder = %d: only Zel'dovich (1) and 2LPT (2) displacements are supported\n", GenicConfig->LPTOrder);
     GenicConfig->SavePrePos = param_get_int(ps, "SavePrePos");
     GenicConfig->PrePosGridCenter = param_get_int(ps, "PrePosGridCenter");
     GenicConfig->BoxSize = param_get_double(ps, "BoxSize");
     GenicConfig->Nmesh = param_get_int(ps, "Nmesh");
+    GenicConfig->PMBatchTransforms = param_get_int(ps, "PMBatchTransforms");
     GenicConfig->Ngrid = param_get_int(ps, "Ngrid");
     GenicConfig->NgridGas = param_get_int(ps, "NgridGas");
     if(GenicConfig->NgridGas < 0)
@@ -181,6 +197,8 @@ void read_parameterfile(char *fname, struct genic_config * GenicConfig, int * Sh
             GenicConfig->MakeGlassGas = 0;
     }
     GenicConfig->MakeGlassCDM = param_get_int(ps, "MakeGlassCDM");
+    GenicConfig->GlassTolerance = param_get_double(ps, "GlassTolerance");
+    param_get_string2(ps, "GlassCacheDir", GenicConfig->GlassCacheDir, sizeof(GenicConfig->GlassCacheDir));
 
     int64_t NumPartPerFile = param_get_int(ps, "NumPartPerFile");
 
@@ -189,6 +207,9 @@ void read_parameterfile(char *fname, struct genic_config * GenicConfig, int * Sh
         Ngrid = GenicConfig->NgridGas;
     GenicConfig->NumFiles = ( Ngrid*Ngrid*Ngrid + NumPartPerFile - 1) / NumPartPerFile;
     GenicConfig->NumWriters = param_get_int(ps, "NumWriters");
+    GenicConfig->NumPartChunks = param_get_int(ps, "NumPartChunks");
+    if(GenicConfig->NumPartChunks < 1)
+        GenicConfig->NumPartChunks = 1;
     if(GenicConfig->PowerP.DifferentTransferFunctions && GenicConfig->PowerP.InputPowerRedshift != Redshift
         && (GenicConfig->ProduceGas || CP->MNu[0] + CP->MNu[1] + CP->MNu[2]))
         message(0, "WARNING: Using different transfer functions but also rescaling power to account for linear growth. NOT what you want!\n");
@@ -19,14 +19,14 @@ static struct BlackholeDynFricParams
 void set_blackhole_dynfric_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         blackhole_dynfric_params.BH_DynFrictionMethod = param_get_int(ps, "BH_DynFrictionMethod");
         blackhole_dynfric_params.BH_DFBoostFactor = param_get_int(ps, "BH_DFBoostFactor");
         blackhole_dynfric_params.BH_DFbmax = param_get_double(ps, "BH_DFbmax");
         blackhole_dynfric_params.BlackHoleRepositionEnabled = param_get_int(ps, "BlackHoleRepositionEnabled");
     }
-    MPI_Bcast(&blackhole_dynfric_params, sizeof(struct BlackholeDynFricParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&blackhole_dynfric_params, sizeof(struct BlackholeDynFricParams), MPI_BYTE, 0, GadgetComm);
 }
 
 int
@@ -41,6 +41,9 @@ BHGetRepositionEnabled(void)
 typedef struct {
     TreeWalkQueryBase base;
     MyFloat Hsml;
+    MyFloat Vel[3];
+    int DynFric; /* Update the dynamic friction and potential minimum of this BH*/
+    int alignment; /* Ensure alignment*/
 } TreeWalkQueryBHDynfric;
 
 typedef struct {
@@ -53,6 +56,10 @@ typedef struct {
     MyFloat BH_MinPotPos[3];
     MyFloat BH_MinPotVel[3];
     MyFloat BH_MinPot;
+    /* DM velocity dispersion*/
+    MyFloat V2sumDM;
+    MyFloat V1sumDM[3];
+    MyFloat NumDM;
 } TreeWalkResultBHDynfric;
 
 typedef struct {
@@ -77,6 +84,37 @@ blackhole_dynfric_treemask(void)
     return treemask;
 }
 
+int
+blackhole_dynfric_gastree_mask(void)
+{
+    if(blackhole_dynfric_params.BH_DynFrictionMethod == 0 && !blackhole_dynfric_params.BlackHoleRepositionEnabled)
+        return 0;
+    const int treemask = blackhole_dynfric_treemask();
+    if(treemask & DMMASK)
+        return 0;
+    return treemask;
+}
+
+/* Use gasTree or the DM tree of this step if they contain all the types in treemask.
+ * Otherwise build the DM tree of the step, if it is not yet built, so it can be reused later on this step,
+ * or else a tree with them in newtree. The walks skip the tree nodes without the types they want.*/
+static ForceTree *
+blackhole_dynfric_get_tree(ForceTree * gasTree, ForceTree * DMTree, ForceTree * newtree, const int treemask, DomainDecomp * ddecomp)
+{
+    if(gasTree && force_tree_allocated(gasTree) && (gasTree->mask & treemask) == treemask) {
+        message(0, "Reusing gas tree with types %d for types %d\n", gasTree->mask, treemask);
+        return gasTree;
+    }
+    if(DMTree && force_tree_allocated(DMTree) && (DMTree->mask & treemask) == treemask) {
+        message(0, "Reusing DM tree with types %d for types %d\n", DMTree->mask, treemask);
+        return DMTree;
+    }
+    ForceTree * tree = (DMTree && !force_tree_allocated(DMTree)) ? DMTree : newtree;
+    message(0, "Building tree with types %d\n", treemask);
+    force_tree_rebuild_mask(tree, ddecomp, treemask, NULL);
+    return tree;
+}
+
 /*************************************************************************************/
 /* Compute the DF acceleration in the BH from stored quantities*/
 static void
@@ -141,9 +179,36 @@ blackhole_compute_dfaccel(const int n, const double atime, const double Grav)
     }
 }
 
+/* Does this BH update its dynamic friction and potential minimum on this step?*/
+static int
+blackhole_dynfric_active(int n, struct BHDynFricPriv * priv)
+{
+    /* Without dynamic friction, the potential minimum is found on every step for repositioning*/
+    if(blackhole_dynfric_params.BH_DynFrictionMethod == 0)
+        return blackhole_dynfric_params.BlackHoleRepositionEnabled;
+    return is_timebin_active(BHP(n).TimeBinDynFric, priv->Ti_Current);
+}
+
 static void
 blackhole_dynfric_postprocess(int n, TreeWalk * tw)
 {
+    struct BHDynFricPriv * priv = BHDYN_GET_PRIV(tw);
+    if(priv->VelDisp) {
+        int PI = P[n].PI;
+        double numdm = priv->NumDM[PI];
+        if(numdm > 0) {
+            double vdisp = priv->V2sumDM[PI]/numdm;
+            int d;
+            for(d = 0; d < 3; d++)
+                vdisp -= pow(priv->V1sumDM[PI][d]/numdm, 2);
+            if(vdisp > 0)
+                BHP(n).VDisp = sqrt(vdisp / 3);
+        }
+    }
+
+    if(blackhole_dynfric_params.BH_DynFrictionMethod == 0 || !blackhole_dynfric_active(n, priv))
+        return;
+
     if(BHP(n).DF_SurroundingDensity > 0){
         /* normalize velocity/dispersion */
         BHP(n).DF_SurroundingRmsVel /= BHP(n).DF_SurroundingDensity;
@@ -154,9 +219,9 @@ blackhole_dynfric_postprocess(int n, TreeWalk * tw)
     }
     else {
         #pragma omp atomic update
-        BHDYN_GET_PRIV(tw)->ZeroDF++;
+        priv->ZeroDF++;
         #pragma omp atomic update
-        BHDYN_GET_PRIV(tw)->ZeroDFMass += BHP(n).Mass;
+        priv->ZeroDFMass += BHP(n).Mass;
     }
 }
 
@@ -178,19 +243,35 @@ blackhole_repos_reduce(int place, TreeWalkResultBHDynfric * remote, enum TreeWal
 
 static void
 blackhole_dynfric_reduce(int place, TreeWalkResultBHDynfric * remote, enum TreeWalkReduceMode mode, TreeWalk * tw){
-    TREEWALK_REDUCE(BHP(place).DF_SurroundingDensity, remote->SurroundingDensity);
+    struct BHDynFricPriv * priv = BHDYN_GET_PRIV(tw);
     int j;
-    for(j = 0; j < 3; j++)
-        TREEWALK_REDUCE(BHP(place).DF_SurroundingVel[j], remote->SurroundingVel[j]);
-    TREEWALK_REDUCE(BHP(place).DF_SurroundingRmsVel, remote->SurroundingRmsVel);
+    if(priv->VelDisp) {
+        int PI = P[place].PI;
+        for(j = 0; j < 3; j++)
+            TREEWALK_REDUCE(priv->V1sumDM[PI][j], remote->V1sumDM[j]);
+        TREEWALK_REDUCE(priv->NumDM[PI], remote->NumDM);
+        TREEWALK_REDUCE(priv->V2sumDM[PI], remote->V2sumDM);
+    }
+    /* Leave the stored kernel quantities of BHs not on a dynfric step alone*/
+    if(!blackhole_dynfric_active(place, priv))
+        return;
+    if(blackhole_dynfric_params.BH_DynFrictionMethod > 0) {
+        TREEWALK_REDUCE(BHP(place).DF_SurroundingDensity, remote->SurroundingDensity);
+        for(j = 0; j < 3; j++)
+            TREEWALK_REDUCE(BHP(place).DF_SurroundingVel[j], remote->SurroundingVel[j]);
+        TREEWALK_REDUCE(BHP(place).DF_SurroundingRmsVel, remote->SurroundingRmsVel);
+    }
     /* Find minimum potential*/
     blackhole_repos_reduce(place, remote, mode, tw);
 }
 
 static void
 blackhole_dynfric_copy(int place, TreeWalkQueryBHDynfric * I, TreeWalk * tw){
-    /* SPH kernel width should be the only thing needed */
     I->Hsml = P[place].Hsml;
+    int k;
+    for(k = 0; k < 3; k++)
+        I->Vel[k] = P[place].Vel[k];
+    I->DynFric = blackhole_dynfric_active(place, BHDYN_GET_PRIV(tw));
 }
 
 static void
@@ -205,7 +286,7 @@ blackhole_minpot_ngbiter(TreeWalkQueryBHDynfric * I,
         for(d = 0; d < 3; d++) {
             O->BH_MinPotPos[d] = I->base.Pos[d];
         }
-        iter->base.mask = blackhole_dynfric_treemask();
+        iter->base.mask = BHDYN_GET_PRIV(lv->tw)->treemask;
         iter->base.Hsml = I->Hsml;
         iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
         density_kernel_init(&iter->dynfric_kernel, I->Hsml, GetDensityKernelType());
@@ -227,25 +308,55 @@ blackhole_minpot_ngbiter(TreeWalkQueryBHDynfric * I,
     }
 }
 
+static void
+blackhole_veldisp_ngbiter(TreeWalkQueryBHDynfric * I,
+        TreeWalkResultBHDynfric * O,
+        TreeWalkNgbIterBHDynfric * iter,
+        LocalTreeWalk * lv)
+{
+    int other = iter->base.other;
+    /* collect info for sigmaDM for kinetic feedback */
+    if(P[other].Type == 1 && iter->base.r2 < iter->dynfric_kernel.HH){
+        O->NumDM += 1;
+        MyFloat VelPred[3];
+        DM_VelPred(other, VelPred, BHDYN_GET_PRIV(lv->tw)->kf);
+        int d;
+        for(d = 0; d < 3; d++){
+            double vel = VelPred[d] - I->Vel[d];
+            O->V1sumDM[d] += vel;
+            O->V2sumDM += vel * vel;
+        }
+    }
+}
+
 static void
 blackhole_dynfric_ngbiter(TreeWalkQueryBHDynfric * I,
         TreeWalkResultBHDynfric * O,
         TreeWalkNgbIterBHDynfric * iter,
         LocalTreeWalk * lv) {
 
+    if(iter->base.other == -1) {
+        blackhole_minpot_ngbiter(I, O, iter, lv);
+        return;
+    }
+
+    if(BHDYN_GET_PRIV(lv->tw)->VelDisp)
+        blackhole_veldisp_ngbiter(I, O, iter, lv);
+
+    if(!I->DynFric)
+        return;
+
     /* Update potential minimum*/
     blackhole_minpot_ngbiter(I, O, iter, lv);
 
-   if(iter->base.other == -1)
-       return;
-
     int other = iter->base.other;
     double r = iter->base.r;
     double r2 = iter->base.r2;
 
     /* Collect Star/+DM/+Gas density/velocity for DF computation */
-    if(P[other].Type == 4 || (P[other].Type == 1 && blackhole_dynfric_params.BH_DynFrictionMethod > 1) ||
-        (P[other].Type == 0 && blackhole_dynfric_params.BH_DynFrictionMethod == 3) ){
+    if(blackhole_dynfric_params.BH_DynFrictionMethod > 0 &&
+        (P[other].Type == 4 || (P[other].Type == 1 && blackhole_dynfric_params.BH_DynFrictionMethod > 1) ||
+        (P[other].Type == 0 && blackhole_dynfric_params.BH_DynFrictionMethod == 3)) ){
         if(r2 < iter->dynfric_kernel.HH) {
             double u = r * iter->dynfric_kernel.Hinv;
             double wk = density_kernel_wk(&iter->dynfric_kernel, u);
@@ -270,6 +381,8 @@ blackhole_dynfric_ngbiter(TreeWalkQueryBHDynfric * I,
 static void
 blackhole_minpot_preprocess(int n, TreeWalk * tw)
 {
+    if(!blackhole_dynfric_active(n, BHDYN_GET_PRIV(tw)))
+        return;
     int j;
     /* Note that the potential is only updated when it is from all particles.
      * In particular this means that it is not updated for hierarchical gravity
@@ -282,59 +395,20 @@ blackhole_minpot_preprocess(int n, TreeWalk * tw)
     }
 }
 
-/* Simple treewalk that just finds the local potential minimum for BH repositioning.*/
-void
-blackhole_minpot(int * ActiveBlackHoles, const int64_t NumActiveBlackHoles, DomainDecomp * ddecomp, struct BHDynFricPriv * priv)
-{
-    /* Repositioning uses all particles: in practice it will usually be stars, gas or BH.*/
-    ForceTree tree[1] = {0};
-    message(0, "Building tree with all particles for repositioning\n");
-    force_tree_rebuild_mask(tree, ddecomp, blackhole_dynfric_treemask(), NULL);
-    walltime_measure("/BH/BuildRepos");
-
-
-    /*************************************************************************/
-    TreeWalk tw_repos[1] = {{0}};
-
-    tw_repos->ev_label = "BH_REPOS";
-    tw_repos->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
-    tw_repos->ngbiter_type_elsize = sizeof(TreeWalkNgbIterBHDynfric);
-    tw_repos->ngbiter = (TreeWalkNgbIterFunction) blackhole_minpot_ngbiter;
-    tw_repos->haswork = NULL;
-    tw_repos->postprocess = NULL;
-    tw_repos->preprocess = blackhole_minpot_preprocess;
-    tw_repos->fill = (TreeWalkFillQueryFunction) blackhole_dynfric_copy;
-    tw_repos->reduce = (TreeWalkReduceResultFunction) blackhole_repos_reduce;
-    tw_repos->query_type_elsize = sizeof(TreeWalkQueryBHDynfric);
-    tw_repos->result_type_elsize = sizeof(TreeWalkResultBHDynfric);
-    tw_repos->tree = tree;
-    tw_repos->priv = priv;
-
-    treewalk_run(tw_repos, ActiveBlackHoles, NumActiveBlackHoles);
-
-    force_tree_free(tree);
-    /*************************************************************************/
-    walltime_measure("/BH/Repos");
-}
-
 static int
 blackhole_dynfric_haswork(int n, TreeWalk * tw){
     /*Black hole not being swallowed*/
-    return (P[n].Type == 5) && (!P[n].Swallowed) &&
-    is_timebin_active(BHP(n).TimeBinDynFric, BHDYN_GET_PRIV(tw)->Ti_Current);
+    if(P[n].Type != 5 || P[n].Swallowed)
+        return 0;
+    return BHDYN_GET_PRIV(tw)->VelDisp || blackhole_dynfric_active(n, BHDYN_GET_PRIV(tw));
 }
 
-/* Returns total number of dynamic-friction active particles over all processors*/
-int
-blackhole_dynfric_num_active(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, inttime_t Ti_Current)
+/* Returns total number of particles over all processors with something to do in the neighbour walk*/
+static int64_t
+blackhole_dynfric_num_active(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, struct BHDynFricPriv * priv)
 {
-    if (blackhole_dynfric_params.BH_DynFrictionMethod == 0)
-        return 0;
-
     int64_t i, nactive = 0;
     TreeWalk tw_dynfric[1] = {{0}};
-    struct BHDynFricPriv priv[1] = {{0}};
-    priv->Ti_Current = Ti_Current;
     tw_dynfric->priv = priv;
     #pragma omp parallel for reduction(+: nactive)
     for(i = 0; i < NumActiveBlackHoles; i++)
@@ -343,32 +417,46 @@ blackhole_dynfric_num_active(int * ActiveBlackHoles, int64_t NumActiveBlackHoles
         nactive += blackhole_dynfric_haswork(n, tw_dynfric);
     }
     int64_t totactive;
-    MPI_Allreduce(&nactive, &totactive, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&nactive, &totactive, 1, MPI_INT64, MPI_SUM, GadgetComm);
     return totactive;
 }
 
+int
+blackhole_dynfric_ngb_treemask(const int VelDisp)
+{
+    int treemask = 0;
+    if(blackhole_dynfric_params.BH_DynFrictionMethod > 0 || blackhole_dynfric_params.BlackHoleRepositionEnabled)
+        treemask = blackhole_dynfric_treemask();
+    if(VelDisp)
+        treemask |= DMMASK;
+    return treemask;
+}
+
 void
-blackhole_dynfric(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, DomainDecomp * ddecomp, struct BHDynFricPriv * priv)
+blackhole_dynfric(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, DomainDecomp * ddecomp, ForceTree * gasTree, ForceTree * DMTree, struct BHDynFricPriv * priv)
 {
-    if (blackhole_dynfric_params.BH_DynFrictionMethod == 0) {
-        /* If there is no dynamic friction, do repositioning, and
-         * run a special walk to find the potential minimum.*/
-        if(blackhole_dynfric_params.BlackHoleRepositionEnabled)
-            blackhole_minpot(ActiveBlackHoles, NumActiveBlackHoles, ddecomp, priv);
+    /* Dynamic friction, repositioning and the velocity dispersion share one walk over one tree,
+     * so that the BHs pay the export latency once.*/
+    priv->treemask = blackhole_dynfric_ngb_treemask(priv->VelDisp);
+    if(!priv->treemask)
         return;
-    }
-    int64_t totdynfric = blackhole_dynfric_num_active(ActiveBlackHoles, NumActiveBlackHoles, priv->Ti_Current);
-    if(!totdynfric)
+
+    int64_t totactive = blackhole_dynfric_num_active(ActiveBlackHoles, NumActiveBlackHoles, priv);
+    if(!totactive)
         return;
 
     /* dynamical friction uses: stars, DM if BH_DynFrictionMethod > 1 gas if BH_DynFrictionMethod  == 3.
      * The DM in dynamic friction and accretion doesn't really do anything, so could perhaps be removed from the treebuild later.*/
-    ForceTree tree[1] = {0};
-    int treemask = blackhole_dynfric_treemask();
-    message(0, "Building dynamic friction tree with types %d\n", treemask);
-    force_tree_rebuild_mask(tree, ddecomp, treemask, NULL);
+    ForceTree newtree[1] = {0};
+    ForceTree * tree = blackhole_dynfric_get_tree(gasTree, DMTree, newtree, priv->treemask, ddecomp);
     walltime_measure("/BH/BuildDF");
 
+    if(priv->VelDisp) {
+        priv->NumDM = (MyFloat *) mymalloc("NumDM", SlotsManager->info[5].size * sizeof(MyFloat));
+        priv->V2sumDM = (MyFloat *) mymalloc("V2sumDM", SlotsManager->info[5].size * sizeof(MyFloat));
+        priv->V1sumDM = (MyFloat (*) [3]) mymalloc("V1sumDM", 3* SlotsManager->info[5].size * sizeof(priv->V1sumDM[0]));
+    }
+
     TreeWalk tw_dynfric[1] = {{0}};
     tw_dynfric->ev_label = "BH_DYNFRIC";
     tw_dynfric->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
@@ -385,11 +473,18 @@ blackhole_dynfric(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, DomainDec
     tw_dynfric->haswork = blackhole_dynfric_haswork;
 
     treewalk_run(tw_dynfric, ActiveBlackHoles, NumActiveBlackHoles);
-    force_tree_free(tree);
+
+    if(priv->VelDisp) {
+        myfree(priv->V1sumDM);
+        myfree(priv->V2sumDM);
+        myfree(priv->NumDM);
+    }
+    if(tree == newtree)
+        force_tree_free(newtree);
     size_t totalzerodf;
     double totalzeromass;
-    MPI_Reduce(&priv->ZeroDF, &totalzerodf, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&priv->ZeroDFMass, &totalzeromass, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&priv->ZeroDF, &totalzerodf, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&priv->ZeroDFMass, &totalzeromass, 1, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
     if(totalzerodf > 0)
         message(0, "Dynamic Friction density is zero for %ld BHs avg mass %g.\n", totalzerodf, totalzeromass/totalzerodf);
 }
@@ -12,20 +12,36 @@ struct BHDynFricPriv {
     inttime_t Ti_Current; /* current time*/
     size_t ZeroDF; // Counter for zero density BHs
     double ZeroDFMass; /* Total mass of BHs with zero DF density*/
+    /* If true, also find the DM velocity dispersion of every black hole
+     * in the same walk, for the kinetic feedback.*/
+    int VelDisp;
+    /* Particle types walked*/
+    int treemask;
+    /* Temporaries for the velocity dispersion*/
+    MyFloat * NumDM;
+    MyFloat (*V1sumDM)[3];
+    MyFloat * V2sumDM;
 };
 
-/* Do the dynamic friction treewalk if BH_DynFrictionMethod > 0.
- * Builds a private tree with the types needed for dynamic friction (mostly stars and DM).*/
-void blackhole_dynfric(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, DomainDecomp * ddecomp, struct BHDynFricPriv * priv);
+/* Do the black hole neighbour treewalk. This finds, in one walk:
+ * the dynamic friction kernel quantities if BH_DynFrictionMethod > 0 (for BHs on a dynfric timestep),
+ * the local potential minimum if dynamic friction or repositioning is on,
+ * the DM velocity dispersion if priv->VelDisp is set (for all BHs).
+ * Uses gasTree or DMTree if they contain all the types needed. Otherwise builds DMTree
+ * with those types (mostly stars and DM) if it is not allocated, leaving it for the caller to free,
+ * or a private tree. DMTree may be NULL.*/
+void blackhole_dynfric(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, DomainDecomp * ddecomp, ForceTree * gasTree, ForceTree * DMTree, struct BHDynFricPriv * priv);
 /* Compute the DF acceleration for all active black holes*/
 void blackhole_dfaccel(int * ActiveBlackHoles, size_t NumActiveBlackHoles, const double atime, const double GravInternal);
 void set_blackhole_dynfric_params(ParameterSet * ps);
 /* Get the particle types used in dynfric*/
 int blackhole_dynfric_treemask(void);
-
-/* Stand-alone function to find the black hole local potential minimum, when using the repositioning model. Uses its own treebuild.
- * The local potential minimum is also found by the dynamic friction treewalk.*/
-void blackhole_findminpot(int * ActiveBlackHoles, const int64_t NumActiveBlackHoles, DomainDecomp * ddecomp);
+/* Get the particle types used by the black hole neighbour walk, with the velocity dispersion if VelDisp is set.
+ * Zero if there is no walk.*/
+int blackhole_dynfric_ngb_treemask(const int VelDisp);
+/* Extra particle types to add to the gas tree so that dynfric can reuse it.
+ * Zero if dynfric is off or needs dark matter, which would slow the gas treewalks too much.*/
+int blackhole_dynfric_gastree_mask(void);
 
 /* Decide whether black hole repositioning is enabled. */
 int BHGetRepositionEnabled(void);
@@ -1,6 +1,9 @@
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <bigfile-mpi.h>
 #include "utils/mymalloc.h"
+#include "petaio.h"
 #include "partmanager.h"
 #include "slotsmanager.h"
 #include "blackhole.h"
@@ -62,6 +65,71 @@ struct __attribute__((__packed__)) BHinfo{
 };
 
 
+/* Records buffered in memory between bigfile appends. They live over many steps, so are outside the memory heap.*/
+static struct BHDetailBuffer
+{
+    struct BHinfo * infos;
+    int64_t N;
+    int64_t Max;
+    /* Append once the buffer on any rank is larger than this. 0 writes to the per-rank files instead.*/
+    size_t MaxBytes;
+    char * fname;
+} DetailBuffer;
+
+void
+bh_details_buffer_init(const size_t MaxBytes, const char * OutputDir)
+{
+    DetailBuffer.MaxBytes = MaxBytes;
+    if(MaxBytes > 0)
+    {
+        /* Not from the heap, as it lives for the whole run*/
+        DetailBuffer.fname = malloc(strlen(OutputDir) + 32);
+        sprintf(DetailBuffer.fname, "%s/BlackholeDetailsBigFile", OutputDir);
+    }
+}
+
+int
+bh_details_buffered(void)
+{
+    return DetailBuffer.MaxBytes > 0;
+}
+
+void
+bh_details_flush(void)
+{
+    if(!bh_details_buffered())
+        return;
+    BigFile bf;
+    if(0 != big_file_mpi_open(&bf, DetailBuffer.fname, GadgetComm)) {
+        if(0 != big_file_mpi_create(&bf, DetailBuffer.fname, GadgetComm))
+            endrun(0, "Failed to create BH details %s: %s\n", DetailBuffer.fname, big_file_get_error_message());
+    }
+    /* Rows are whole records in the format of the per-rank files*/
+    BigArray array = {0};
+    size_t dims[2] = {DetailBuffer.N, sizeof(struct BHinfo)};
+    big_array_init(&array, DetailBuffer.infos, "u1", 2, dims, NULL);
+    petaio_append_block(&bf, "BHinfo", &array);
+    if(0 != big_file_mpi_close(&bf, GadgetComm))
+        endrun(0, "Failed to close BH details %s: %s\n", DetailBuffer.fname, big_file_get_error_message());
+    DetailBuffer.N = 0;
+}
+
+/* Add records to the buffer, growing it if needed*/
+static void
+bh_details_buffer_add(const struct BHinfo * infos, const int64_t n)
+{
+    if(DetailBuffer.N + n > DetailBuffer.Max) {
+        DetailBuffer.Max = 2 * DetailBuffer.Max;
+        if(DetailBuffer.Max < DetailBuffer.N + n)
+            DetailBuffer.Max = DetailBuffer.N + n;
+        DetailBuffer.infos = (struct BHinfo *) realloc(DetailBuffer.infos, DetailBuffer.Max * sizeof(struct BHinfo));
+        if(!DetailBuffer.infos)
+            endrun(1, "Could not allocate %ld BH detail records\n", DetailBuffer.Max);
+    }
+    memcpy(DetailBuffer.infos + DetailBuffer.N, infos, n * sizeof(struct BHinfo));
+    DetailBuffer.N += n;
+}
+
 size_t
 collect_BH_info(const int * const ActiveBlackHoles, const int64_t NumActiveBlackHoles, struct BHPriv *priv, const struct part_manager_type * const PartManager, const struct bh_particle_data* const BHManager, FILE * FdBlackholeDetails)
 {
@@ -148,14 +216,20 @@ collect_BH_info(const int * const ActiveBlackHoles, const int64_t NumActiveBlack
         info->a = priv->atime;
     }
 
-    fwrite(infos,sizeof(struct BHinfo),NumActiveBlackHoles,FdBlackholeDetails);
+    if(FdBlackholeDetails)
+        fwrite(infos,sizeof(struct BHinfo),NumActiveBlackHoles,FdBlackholeDetails);
+    else
+        bh_details_buffer_add(infos, NumActiveBlackHoles);
     // fflush(FdBlackholeDetails);
     myfree(infos);
-    int64_t totalN;
 
-    MPI_Allreduce(&NumActiveBlackHoles, &totalN, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    message(0, "Written details of %ld blackholes in %lu bytes each.\n", totalN, sizeof(struct BHinfo));
-    return totalN * sizeof(struct BHinfo);
+    /* Total records, and the number of ranks with a full buffer*/
+    int64_t total[2] = {NumActiveBlackHoles, DetailBuffer.MaxBytes > 0 && DetailBuffer.N * sizeof(struct BHinfo) >= DetailBuffer.MaxBytes};
+    MPI_Allreduce(MPI_IN_PLACE, total, 2, MPI_INT64, MPI_SUM, GadgetComm);
+    if(total[1] > 0)
+        bh_details_flush();
+    message(0, "%s details of %ld blackholes in %lu bytes each.\n", FdBlackholeDetails ? "Written" : "Buffered", total[0], sizeof(struct BHinfo));
+    return total[0] * sizeof(struct BHinfo);
 }
 
 void
@@ -182,10 +256,10 @@ write_blackhole_txt(FILE * FdBlackHoles, const struct UnitSystem units, const do
         Local_BH_Medd += BhP[i].Mdot/BhP[i].Mass;
     }
 
-    MPI_Reduce(&Local_BH_mass, &total_mass_holes, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&Local_BH_Mdot, &total_mdot, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&Local_BH_Medd, &total_mdoteddington, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&Local_BH_num, &total_bh, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&Local_BH_mass, &total_mass_holes, 1, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&Local_BH_Mdot, &total_mdot, 1, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&Local_BH_Medd, &total_mdoteddington, 1, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&Local_BH_num, &total_bh, 1, MPI_INT, MPI_SUM, 0, GadgetComm);
 
     if(FdBlackHoles)
     {
@@ -4,9 +4,19 @@
 #include "bhdynfric.h"
 #include "blackhole.h"
 
-/* Writes a packed binary structure of detailed black hole information to disc. Returns bytes written (collective total from all ranks).*/
+/* Writes a packed binary structure of detailed black hole information to disc, or to the buffer if FdBlackholeDetails is NULL.
+ * Returns bytes written (collective total from all ranks).*/
 size_t collect_BH_info(const int * const ActiveBlackHoles, const int64_t NumActiveBlackHoles, struct BHPriv *priv, const struct part_manager_type * const PartManager, const struct bh_particle_data * const BHManager, FILE * FdBlackholeDetails);
 
+/* Buffer the detailed black hole information in memory instead of writing it every step,
+ * appending it to the BHinfo block of the bigfile BlackholeDetailsBigFile in OutputDir
+ * once the buffer on any rank reaches MaxBytes, and at bh_details_flush. MaxBytes = 0 disables buffering.*/
+void bh_details_buffer_init(const size_t MaxBytes, const char * OutputDir);
+/* True if collect_BH_info should be called with a NULL file, to buffer the records*/
+int bh_details_buffered(void);
+/* Append the buffered records to the bigfile. Collective.*/
+void bh_details_flush(void);
+
 void write_blackhole_txt(FILE * FdBlackHoles, const struct UnitSystem units, const double atime);
 
 #endif
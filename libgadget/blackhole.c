@@ -91,7 +91,7 @@ typedef struct {
 void set_blackhole_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         blackhole_params.BlackHoleAccretionFactor = param_get_double(ps, "BlackHoleAccretionFactor");
         blackhole_params.BlackHoleEddingtonFactor = param_get_double(ps, "BlackHoleEddingtonFactor");
@@ -119,7 +119,7 @@ void set_blackhole_params(ParameterSet * ps)
         blackhole_params.SeedBlackHoleMassIndex = param_get_double(ps,"SeedBlackHoleMassIndex");
         /***********************************************************************************/
     }
-    MPI_Bcast(&blackhole_params, sizeof(struct BlackholeParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&blackhole_params, sizeof(struct BlackholeParams), MPI_BYTE, 0, GadgetComm);
 
     set_blackhole_dynfric_params(ps);
 }
@@ -198,7 +198,7 @@ blackholes_active(const ActiveParticles * act, int ** ActiveBlackHoles, int64_t
     treewalk_build_queue(tw_bh, act->ActiveParticle, act->NumActiveParticle, 0);
     /* If this queue is empty, nothing to do.*/
     int64_t totbh;
-    MPI_Allreduce(&tw_bh->WorkSetSize, &totbh, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&tw_bh->WorkSetSize, &totbh, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
     /* Now we have a BH queue and we can re-use it. Create a new variable so that
      * treewalk_run does not mess with the pointer. */
@@ -213,11 +213,11 @@ blackholes_active(const ActiveParticles * act, int ** ActiveBlackHoles, int64_t
 }
 
 void
-blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree * tree, DomainDecomp * ddecomp, DriftKickTimes * times, RandTable * rnd, const struct UnitSystem units, FILE * FdBlackHoles, FILE * FdBlackholeDetails, size_t * bhdetailswritten)
+blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree * tree, ForceTree * DMTree, DomainDecomp * ddecomp, DriftKickTimes * times, RandTable * rnd, const struct UnitSystem units, FILE * FdBlackHoles, FILE * FdBlackholeDetails, size_t * bhdetailswritten)
 {
     /* Do nothing if no black holes*/
     int64_t totbh;
-    MPI_Allreduce(&SlotsManager->info[5].size, &totbh, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&SlotsManager->info[5].size, &totbh, 1, MPI_INT64, MPI_SUM, GadgetComm);
     if(totbh == 0)
         return;
 
@@ -246,12 +246,14 @@ blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree *
     struct BHDynFricPriv dynpriv[1] = {0};
     dynpriv->kf = &kf;
     dynpriv->Ti_Current = times->Ti_Current;
+    /* The DM velocity dispersion for kinetic feedback is updated on PM steps, when all BHs are active.*/
+    dynpriv->VelDisp = is_PM_timestep(times);
     /* Update the kernel quantities for dynamic friction, if required.
      * This takes place on a longer timestep than the hydro acceleration
      * to avoid extra treebuilds. Note this includes the potential minimum.
-     * If black hole repositioning is on, the treewalk to reposition
-     * to the local potential minimum is run.*/
-    blackhole_dynfric(ActiveBlackHoles, NumActiveBlackHoles, ddecomp, dynpriv);
+     * If black hole repositioning is on, the local potential minimum is found.
+     * All of these share one neighbour walk.*/
+    blackhole_dynfric(ActiveBlackHoles, NumActiveBlackHoles, ddecomp, tree, DMTree, dynpriv);
     /* Compute the DF acceleration for all active black holes*/
     blackhole_dfaccel(ActiveBlackHoles, NumActiveBlackHoles, atime, CP->GravInternal);
 
@@ -308,6 +310,7 @@ blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree *
     tw_accretion->query_type_elsize = sizeof(TreeWalkQueryBHAccretion);
     tw_accretion->result_type_elsize = sizeof(TreeWalkResultBHAccretion);
     tw_accretion->tree = tree;
+    tw_accretion->UseExportPlan = 1;
     tw_accretion->priv = priv;
 
     /* This treewalk marks all black holes and gas which can be swallowed with a SwllowID of a potential swallower.
@@ -343,7 +346,7 @@ blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree *
 
     walltime_measure("/BH/Feedback");
 
-    if(FdBlackholeDetails){
+    if(FdBlackholeDetails || bh_details_buffered()){
         *bhdetailswritten += collect_BH_info(ActiveBlackHoles, NumActiveBlackHoles, priv, PartManager, (struct bh_particle_data*) SlotsManager->info[5].ptr, FdBlackholeDetails);
     }
 
@@ -594,7 +597,7 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
                 p = (I->BH_Mass - BHPartMass) * wk / I->Density;
 
             /* compute random number, uniform in [0,1] */
-            const double w = get_random_number(P[other].ID, BH_GET_PRIV(lv->tw)->rnd);
+            const double w = get_random_number(P[other].ID, RND_BH_SWALLOW, BH_GET_PRIV(lv->tw)->rnd);
             if(w < p)
             {
                 MyIDType * SPH_SwallowID = BH_GET_PRIV(lv->tw)->SPH_SwallowID;
@@ -730,8 +733,8 @@ add_injected_BH_energy(double unew, double injected_BH_energy, double mass, doub
 static int
 get_random_dir(int i, double dir[3], const RandTable * const rnd)
 {
-    double theta = acos(2 * get_random_number(P[i].ID + 3, rnd) - 1);
-    double phi = 2 * M_PI * get_random_number(P[i].ID + 4, rnd);
+    double theta = acos(2 * get_random_number(P[i].ID, RND_DIR_THETA, rnd) - 1);
+    double phi = 2 * M_PI * get_random_number(P[i].ID, RND_DIR_PHI, rnd);
 
     dir[0] = sin(theta) * cos(phi);
     dir[1] = sin(theta) * sin(phi);
@@ -784,6 +787,7 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
          */
         BHP(other).SwallowID = BH_GET_PRIV(lv->tw)->BH_SwallowID[PI] - 1;
         BHP(other).SwallowTime = BH_GET_PRIV(lv->tw)->atime;
+        timebin_lists_remove_particle(PartManager, other);
         P[other].Swallowed = 1;
         /* Set encounter to zero when we merge*/
         BHP(other).encounter = 0;
@@ -894,6 +898,7 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
         for(d = 0; d < 3; d++)
             O->AccretedMomentum[d] += (P[other].Mass * VelPred[d]);
 
+        timebin_lists_remove_particle(PartManager, other);
         slots_mark_garbage(other, PartManager, SlotsManager);
 
         int tid = omp_get_thread_num();
@@ -1005,9 +1010,11 @@ blackhole_feedback(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, ForceTre
     tw_feedback->fill = (TreeWalkFillQueryFunction) blackhole_feedback_copy;
     tw_feedback->postprocess = (TreeWalkProcessFunction) blackhole_feedback_postprocess;
     tw_feedback->reduce = (TreeWalkReduceResultFunction) blackhole_feedback_reduce;
+    tw_feedback->WritesNeighbours = 1;
     tw_feedback->query_type_elsize = sizeof(TreeWalkQueryBHFeedback);
     tw_feedback->result_type_elsize = sizeof(TreeWalkResultBHFeedback);
     tw_feedback->tree = tree;
+    tw_feedback->UseExportPlan = 1;
     tw_feedback->priv = priv;
 
     /* Ionization counters*/
@@ -1028,8 +1035,8 @@ blackhole_feedback(int * ActiveBlackHoles, int64_t NumActiveBlackHoles, ForceTre
     ta_free(priv[0].N_BH_swallowed);
     ta_free(priv[0].N_sph_swallowed);
 
-    MPI_Reduce(&N_sph_swallowed, &Ntot_gas_swallowed, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&N_BH_swallowed, &Ntot_BH_swallowed, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&N_sph_swallowed, &Ntot_gas_swallowed, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&N_BH_swallowed, &Ntot_BH_swallowed, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
 
     message(0, "Accretion done: %ld gas particles swallowed, %ld BH particles swallowed\n", Ntot_gas_swallowed, Ntot_BH_swallowed);
 }
@@ -1039,7 +1046,7 @@ static double
 bh_powerlaw_seed_mass(const MyIDType ID, const RandTable * const rnd)
 {
     /* compute random number, uniform in [0,1] */
-    const double w = get_random_number(ID+23, rnd);
+    const double w = get_random_number(ID, RND_BH_SEED_MASS, rnd);
     /* Normalisation for this power law index*/
     double norm = pow(blackhole_params.MaxSeedBlackHoleMass, 1+blackhole_params.SeedBlackHoleMassIndex)
                 - pow(blackhole_params.SeedBlackHoleMass, 1+blackhole_params.SeedBlackHoleMassIndex);
@@ -59,8 +59,10 @@ void set_blackhole_params(ParameterSet * ps);
  * TimeNextSeedingCheck is the time of the BH next seeding check.
  * It will be compared to the current time and updated after seeding takes place.
  * tree is a valid ForceTree.
+ * DMTree is the DM tree of this step, reused for dynamic friction if allocated, or built for it if not.
+ * The caller frees it.
  */
-void blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree * tree, DomainDecomp * ddecomp, DriftKickTimes * times, RandTable * rnd, const struct UnitSystem units, FILE * FdBlackHoles, FILE * FdBlackholeDetails, size_t *bhdetailswritten);
+void blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree * tree, ForceTree * DMTree, DomainDecomp * ddecomp, DriftKickTimes * times, RandTable * rnd, const struct UnitSystem units, FILE * FdBlackHoles, FILE * FdBlackholeDetails, size_t *bhdetailswritten);
 
 /* Make a black hole from the particle at index. Random number generator used for the initial mass drawn from a power law.*/
 void blackhole_make_one(int index, const double atime, const RandTable * const rnd);
@@ -11,6 +11,8 @@
 #include "checkpoint.h"
 #include "walltime.h"
 #include "fof.h"
+#include "slotsmanager.h"
+#include "drift.h"
 
 #include "utils.h"
 
@@ -20,35 +22,110 @@
  *  This file delegates the functions to petaio and fof.
  */
 
+/* A checkpoint being written in the background: it is added to Snapshots.txt only once complete,
+ * so that a restart never picks up a partial snapshot.*/
+static struct {
+    int snapnum;
+    double Time;
+    char OutputDir[1024];
+} PendingCheckpoint = {-1};
+
+static void
+record_checkpoint(int snapnum, double Time, const char * OutputDir)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
+        FILE * fd = fopen(buf, "a");
+        fprintf(fd, "%03d %g\n", snapnum, Time);
+        fclose(fd);
+        myfree(buf);
+    }
+}
+
+static void
+record_local_checkpoint(int snapnum, double Time, const char * OutputDir)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "%s/LocalCheckpoint.txt", OutputDir);
+        FILE * fd = fopen(buf, "w");
+        if(!fd)
+            endrun(1, "Could not open %s\n", buf);
+        fprintf(fd, "%03d %g\n", snapnum, Time);
+        fclose(fd);
+    }
+}
+
 void
 write_checkpoint(int snapnum, int WriteGroupID, int MetalReturnOn, double Time, const Cosmology * CP, const char * OutputDir, const int OutputDebugFields)
 {
+    /* Finish any checkpoint still being written*/
+    wait_checkpoint();
+    /* Every slot is written*/
+    slots_prefetch(ALLMASK, SlotsManager);
+    /* Snapshots are on PM steps where all particles were drifted, but be sure*/
+    drift_deferred_particles();
+
     /* write snapshot of particles */
     struct IOTable IOTable = {0};
     register_io_blocks(&IOTable, WriteGroupID, MetalReturnOn);
     if(OutputDebugFields)
         register_debug_io_blocks(&IOTable);
+    /* With a local copy, the snapshot is always written in the background*/
+    const int local = GetLocalCheckpoint();
+    const int async = GetAsyncSnapshotWrite() || local;
+    if(local)
+        petaio_save_local(snapnum);
     char * fname = petaio_get_snapshot_fname(snapnum, OutputDir);
-    petaio_save_snapshot(fname, &IOTable, 1, Time, CP);
+    if(async)
+        petaio_save_snapshot_async(fname, &IOTable, 1, Time, CP);
+    else
+        petaio_save_snapshot(fname, &IOTable, 1, Time, CP);
+    /* A copy for analysis pipelines that read Gadget HDF5*/
+    if(GetHDF5Output()) {
+        char * hname = fastpm_strdup_printf("%s.hdf5", fname);
+        petaio_save_snapshot_hdf5(hname, &IOTable, 1, Time, CP, GetHDF5Compression());
+        myfree(hname);
+    }
     myfree(fname);
 
     destroy_io_blocks(&IOTable);
     walltime_measure("/WriteSnapshot");
 
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0) {
-        char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
-        FILE * fd = fopen(buf, "a");
-        fprintf(fd, "%03d %g\n", snapnum, Time);
-        fclose(fd);
-        myfree(buf);
+    /* The local copy and the snapshot header are complete, so a restart can use this checkpoint
+     * even if the job ends before the rest of the snapshot is written.*/
+    if(local)
+        record_local_checkpoint(snapnum, Time, OutputDir);
+
+    if(async) {
+        PendingCheckpoint.snapnum = snapnum;
+        PendingCheckpoint.Time = Time;
+        strncpy(PendingCheckpoint.OutputDir, OutputDir, sizeof(PendingCheckpoint.OutputDir) - 1);
+        return;
     }
+    record_checkpoint(snapnum, Time, OutputDir);
+}
+
+void
+wait_checkpoint(void)
+{
+    if(!petaio_wait_snapshot())
+        return;
+    walltime_measure("/WriteSnapshot");
+    if(PendingCheckpoint.snapnum >= 0)
+        record_checkpoint(PendingCheckpoint.snapnum, PendingCheckpoint.Time, PendingCheckpoint.OutputDir);
+    PendingCheckpoint.snapnum = -1;
 }
 
 void
 dump_snapshot(const char * dump, const double Time, const Cosmology * CP, const char * OutputDir)
 {
+    /* Particles whose drift was deferred are behind: write every particle at the same time*/
+    drift_deferred_particles();
     struct IOTable IOTable = {0};
     register_io_blocks(&IOTable, 0, 1);
     register_debug_io_blocks(&IOTable);
@@ -63,7 +140,7 @@ find_last_snapnum(const char * OutputDir)
     /* FIXME: this is very fragile; should be fine */
     int snapnumber = -1;
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
         FILE * fd = fopen(buf, "r");
@@ -90,6 +167,26 @@ find_last_snapnum(const char * OutputDir)
         myfree(buf);
     }
 
-    MPI_Bcast(&snapnumber, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&snapnumber, 1, MPI_INT, 0, GadgetComm);
+    return snapnumber;
+}
+
+int
+find_local_snapnum(const char * OutputDir)
+{
+    int snapnumber = -1;
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "%s/LocalCheckpoint.txt", OutputDir);
+        FILE * fd = fopen(buf, "r");
+        if(fd) {
+            if(1 != fscanf(fd, "%d", &snapnumber))
+                snapnumber = -1;
+            fclose(fd);
+        }
+    }
+    MPI_Bcast(&snapnumber, 1, MPI_INT, 0, GadgetComm);
     return snapnumber;
 }
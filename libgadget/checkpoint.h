@@ -4,7 +4,12 @@
 #include "cosmology.h"
 
 void write_checkpoint(int snapnum, int WriteGroupID, int MetalReturnOn, double Time, const Cosmology * CP, const char * OutputDir, const int OutputDebugFields);
+/* Finish a checkpoint being written in the background (AsyncSnapshotWrite), if any. Collective.*/
+void wait_checkpoint(void);
+/* Write an emergency snapshot. Particles whose drift was deferred are drifted to the current time first.*/
 void dump_snapshot(const char * dump, const double Time, const Cosmology * CP, const char * OutputDir);
 int find_last_snapnum(const char * OutputDir);
+/* Number of the last checkpoint with a complete local copy (LocalCheckpointDir), or -1. Its snapshot may be incomplete.*/
+int find_local_snapnum(const char * OutputDir);
 
 #endif
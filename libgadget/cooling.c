@@ -38,109 +38,207 @@ void init_cooling(const char * TreeCoolFile, const char * J21CoeffFile, const ch
 #define MAXITER 1000
 
 /* Wrapper function which returns the rate of change of internal energy in units of
- * erg/s/g. Arguments:
+ * erg/s/g for n <= COOLING_BLOCK particles. Arguments:
  * rho: density in protons/cm^3 (physical)
  * u: internal energy in units of erg/g
  * Z: metallicity
  * redshift: redshift
  * isHeIIIionized: flags whether the particle has been HeII reionized.
  */
-static double
-get_lambdanet(double rho, double u, double redshift, double Z, struct UVBG * uvbg, double * ne_guess, int isHeIIIionized)
+static void
+get_lambdanet_block(const int n, const double * rho, const double * u, double redshift, const double * Z, const struct UVBG * const * uvbg, double * ne_guess, const int * isHeIIIionized, double * LambdaNet)
 {
-    double LambdaNet = get_heatingcooling_rate(rho, u, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess);
-    if(!isHeIIIionized) {
-        /* get_long_mean_free_path_heating returns the heating in units of erg/s/cm^3,
-         * the factor of the mean density converts from erg/s/cm^3 to erg/s/g */
-        LambdaNet += get_long_mean_free_path_heating(redshift) / (coolunits.rho_crit_baryon * pow(1 + redshift,3));
+    int i;
+    get_heatingcooling_rate_block(n, rho, u, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess, LambdaNet);
+    for(i = 0; i < n; i++) {
+        if(!isHeIIIionized[i]) {
+            /* get_long_mean_free_path_heating returns the heating in units of erg/s/cm^3,
+             * the factor of the mean density converts from erg/s/cm^3 to erg/s/g */
+            LambdaNet[i] += get_long_mean_free_path_heating(redshift) / (coolunits.rho_crit_baryon * pow(1 + redshift,3));
+        }
     }
-    return LambdaNet;
 }
 
-/* returns new internal energy per unit mass.
- * Arguments are passed in code units, density is proper density.
- */
-double DoCooling(double redshift, double u_old, double rho, double dt, struct UVBG * uvbg, double *ne_guess, double Z, double MinEgySpec, int isHeIIIionized)
-{
-    if(!coolunits.CoolingOn) return 0;
+/* Stages of the implicit solve for the new internal energy of one particle.*/
+enum CoolStage {
+    COOL_START,     /* Net rate at the initial energy*/
+    COOL_BRACKET_UP,    /* Heating: raising u_upper until the energy change exceeds the heating*/
+    COOL_BRACKET_DOWN,  /* Cooling: lowering u_lower until the cooling exceeds the energy change*/
+    COOL_BISECT,
+    COOL_DONE,
+};
 
-    double u, du;
-    double u_lower, u_upper;
-    double LambdaNet;
-    int iter = 0;
+/* State of the solve for one particle, in cgs units. u is the energy at which the net rate is needed next.*/
+struct cool_state {
+    enum CoolStage stage;
+    int iter;
+    double u_old, u_lower, u_upper, u;
+    double rho, dt, MinEgySpec;
+};
 
-    rho *= coolunits.density_in_phys_cgs / PROTONMASS;	/* convert to (physical) protons/cm^3 */
-    u_old *= coolunits.uu_in_cgs;
-    MinEgySpec *= coolunits.uu_in_cgs;
-    if(u_old < MinEgySpec)
-        u_old = MinEgySpec;
-    dt *= coolunits.tt_in_s;
-
-    u = u_old;
-    u_lower = u;
-    u_upper = u;
-
-    LambdaNet = get_lambdanet(rho, u, redshift, Z, uvbg, ne_guess, isHeIIIionized);
-
-    /* bracketing */
-    if(u - u_old - LambdaNet * dt < 0)	/* heating */
-    {
-        do
-        {
-            u_lower = u_upper;
-            u_upper *= 1.1;
-        } while(u_upper - u_old - get_lambdanet(rho, u_upper, redshift, Z, uvbg, ne_guess, isHeIIIionized) * dt < 0);
-    }
-    else
-    {
-        do {
-            u_upper = u_lower;
-            u_lower /= 1.1;
-            /* This means that we don't need an initial bracket*/
-            if(u_upper <= MinEgySpec) {
-                break;
-            }
-        } while(u_lower - u_old - get_lambdanet(rho, u_lower, redshift, Z, uvbg, ne_guess, isHeIIIionized) * dt > 0);
+/* Start a bisection step, or finish if the new energy is known to be below the minimum.*/
+static void
+cool_bisect_step(struct cool_state * cs)
+{
+    cs->u = 0.5 * (cs->u_lower + cs->u_upper);
+    cs->stage = COOL_BISECT;
+    /* If we know that the new energy
+     * is below the minimum gas internal energy, we are done here.*/
+    if(cs->u_upper <= cs->MinEgySpec) {
+        cs->u = cs->MinEgySpec;
+        cs->stage = COOL_DONE;
     }
+}
 
-    do
-    {
-        u = 0.5 * (u_lower + u_upper);
-        /* If we know that the new energy
-         * is below the minimum gas internal energy, we are done here.*/
-        if(u_upper <= MinEgySpec) {
-            u = MinEgySpec;
-            break;
-        }
+static void
+cool_bracket_up(struct cool_state * cs)
+{
+    cs->u_lower = cs->u_upper;
+    cs->u_upper *= 1.1;
+    cs->u = cs->u_upper;
+    cs->stage = COOL_BRACKET_UP;
+}
 
-        LambdaNet = get_lambdanet(rho, u, redshift, Z, uvbg, ne_guess, isHeIIIionized);
+static void
+cool_bracket_down(struct cool_state * cs)
+{
+    cs->u_upper = cs->u_lower;
+    cs->u_lower /= 1.1;
+    cs->u = cs->u_lower;
+    cs->stage = COOL_BRACKET_DOWN;
+    /* This means that we don't need an initial bracket*/
+    if(cs->u_upper <= cs->MinEgySpec)
+        cool_bisect_step(cs);
+}
 
-        if(u - u_old - LambdaNet * dt > 0)
-        {
-            u_upper = u;
-        }
-        else
-        {
-            u_lower = u;
-        }
+/* Advance the solve for one particle, given the net heating rate at the energy cs->u.*/
+static void
+cool_advance(struct cool_state * cs, const double LambdaNet)
+{
+    const double du = cs->u - cs->u_old - LambdaNet * cs->dt;
+    switch(cs->stage) {
+        case COOL_START:
+            if(du < 0)
+                cool_bracket_up(cs);
+            else
+                cool_bracket_down(cs);
+            break;
+        case COOL_BRACKET_UP:
+            if(du < 0)
+                cool_bracket_up(cs);
+            else
+                cool_bisect_step(cs);
+            break;
+        case COOL_BRACKET_DOWN:
+            if(du > 0)
+                cool_bracket_down(cs);
+            else
+                cool_bisect_step(cs);
+            break;
+        case COOL_BISECT:
+            if(du > 0)
+                cs->u_upper = cs->u;
+            else
+                cs->u_lower = cs->u;
+            cs->iter++;
+            if(cs->iter >= (MAXITER - 10))
+                message(1, "u= %g\n", cs->u);
+            if(fabs((cs->u_upper - cs->u_lower) / cs->u) > 1.0e-6 && cs->iter < MAXITER)
+                cool_bisect_step(cs);
+            else if(cs->iter >= MAXITER)
+                endrun(10, "failed to converge in DoCooling()\n");
+            else
+                cs->stage = COOL_DONE;
+            break;
+        case COOL_DONE:
+            break;
+    }
+}
 
-        du = u_upper - u_lower;
+/* Cool n <= COOLING_BLOCK particles. Each particle is bracketed and then bisected on its own,
+ * but the net rates for all particles still iterating are computed together.*/
+static void
+cool_block(double redshift, struct CoolingBatch * cool, const int n)
+{
+    struct cool_state cs[COOLING_BLOCK];
+    int act[COOLING_BLOCK];
+    int i, j, nact = n;
 
-        iter++;
+    for(i = 0; i < n; i++) {
+        cs[i].rho = cool[i].rho * (coolunits.density_in_phys_cgs / PROTONMASS);	/* convert to (physical) protons/cm^3 */
+        cs[i].u_old = cool[i].u_old * coolunits.uu_in_cgs;
+        cs[i].MinEgySpec = cool[i].MinEgySpec * coolunits.uu_in_cgs;
+        if(cs[i].u_old < cs[i].MinEgySpec)
+            cs[i].u_old = cs[i].MinEgySpec;
+        cs[i].dt = cool[i].dt * coolunits.tt_in_s;
+        cs[i].u = cs[i].u_lower = cs[i].u_upper = cs[i].u_old;
+        cs[i].iter = 0;
+        cs[i].stage = COOL_START;
+        act[i] = i;
+    }
 
-        if(iter >= (MAXITER - 10))
-            message(1, "u= %g\n", u);
+    while(nact > 0) {
+        double rho[COOLING_BLOCK], u[COOLING_BLOCK], Z[COOLING_BLOCK], ne[COOLING_BLOCK], LambdaNet[COOLING_BLOCK];
+        const struct UVBG * uvbg[COOLING_BLOCK];
+        int isHeIIIionized[COOLING_BLOCK];
+        for(j = 0; j < nact; j++) {
+            const int k = act[j];
+            rho[j] = cs[k].rho;
+            u[j] = cs[k].u;
+            Z[j] = cool[k].Z;
+            ne[j] = cool[k].ne_guess;
+            uvbg[j] = &cool[k].uvbg;
+            isHeIIIionized[j] = cool[k].isHeIIIionized;
+        }
+        get_lambdanet_block(nact, rho, u, redshift, Z, uvbg, ne, isHeIIIionized, LambdaNet);
+        /* Advance each particle and drop those which are done*/
+        int nnext = 0;
+        for(j = 0; j < nact; j++) {
+            const int k = act[j];
+            cool[k].ne_guess = ne[j];
+            cool_advance(&cs[k], LambdaNet[j]);
+            if(cs[k].stage != COOL_DONE)
+                act[nnext++] = k;
+        }
+        nact = nnext;
     }
-    while(fabs(du / u) > 1.0e-6 && iter < MAXITER);
 
-    if(iter >= MAXITER)
-    {
-        endrun(10, "failed to converge in DoCooling()\n");
+    for(i = 0; i < n; i++)
+        cool[i].u = cs[i].u / coolunits.uu_in_cgs;   /*convert back to internal units */
+}
+
+void
+DoCoolingBatch(double redshift, struct CoolingBatch * cool, const int64_t n)
+{
+    int64_t i;
+    if(!coolunits.CoolingOn) {
+        for(i = 0; i < n; i++)
+            cool[i].u = 0;
+        return;
     }
+    for(i = 0; i < n; i += COOLING_BLOCK)
+        cool_block(redshift, cool + i, n - i < COOLING_BLOCK ? n - i : COOLING_BLOCK);
+}
 
-    u /= coolunits.uu_in_cgs;   /*convert back to internal units */
+/* returns new internal energy per unit mass.
+ * Arguments are passed in code units, density is proper density.
+ */
+double DoCooling(double redshift, double u_old, double rho, double dt, struct UVBG * uvbg, double *ne_guess, double Z, double MinEgySpec, int isHeIIIionized)
+{
+    if(!coolunits.CoolingOn) return 0;
 
-    return u;
+    struct CoolingBatch cool = {0};
+    cool.u_old = u_old;
+    cool.rho = rho;
+    cool.dt = dt;
+    cool.Z = Z;
+    cool.MinEgySpec = MinEgySpec;
+    cool.uvbg = *uvbg;
+    cool.ne_guess = *ne_guess;
+    cool.isHeIIIionized = isHeIIIionized;
+    DoCoolingBatch(redshift, &cool, 1);
+    *ne_guess = cool.ne_guess;
+    return cool.u;
 }
 
 /* returns cooling time.
@@ -1,6 +1,7 @@
 #ifndef _COOLING_H_
 #define _COOLING_H_
 
+#include <stdint.h>
 #include "cosmology.h"
 #include "utils/paramset.h"
 
@@ -56,6 +57,27 @@ double GetCoolingTime(double redshift, double u_old, double rho, struct UVBG * u
 /*Get the new internal energy per unit mass. ne_guess is set to the new internal equilibrium electron density*/
 double DoCooling(double redshift, double u_old, double rho, double dt, struct UVBG * uvbg, double *ne_guess, double Z, double MinEgySpec, int isHeIIIionized);
 
+/* Number of particles whose rate networks are solved together by DoCoolingBatch*/
+#define COOLING_BLOCK 8
+
+/* One particle for DoCoolingBatch. Inputs are as for DoCooling, in internal units with proper density.
+ * On return u is the new internal energy per unit mass and ne_guess the new equilibrium electron density.*/
+struct CoolingBatch {
+    double u_old;
+    double rho;
+    double dt;
+    double Z;
+    double MinEgySpec;
+    struct UVBG uvbg;
+    double ne_guess;
+    int isHeIIIionized;
+    double u;
+};
+
+/* Get the new internal energy of n particles. This is DoCooling, but the particles are cooled
+ * COOLING_BLOCK at a time, with the rates for all unconverged particles in a block evaluated together.*/
+void DoCoolingBatch(double redshift, struct CoolingBatch * cool, const int64_t n);
+
 /*Interpolates the ultra-violet background tables to the desired redshift and returns a cooling rate table*/
 struct UVBG get_global_UVBG(double redshift);
 
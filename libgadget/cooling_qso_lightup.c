@@ -42,6 +42,7 @@
 #include "utils/endrun.h"
 #include "utils/paramset.h"
 #include "utils/mymalloc.h"
+#include "utils/sharedtable.h"
 #include "cooling_qso_lightup.h"
 
 #define E0_HeII 54.4 /* HeII ionization potential in eV*/
@@ -51,6 +52,8 @@ typedef struct
 {
     TreeWalkQueryBase base;
     MyIDType ID;
+    /* Position of the quasar in the batch*/
+    int Slot;
 } TreeWalkQueryQSOLightup;
 
 /*Parameters for the quasar driven helium reionization model.*/
@@ -70,6 +73,8 @@ struct qso_lightup_params
     double heIIIreion_start; /* Time at which start_reionization is called and helium III reionization begins*/
 
     double ExcursionSetZStop; /* The stopping point of the excursion set, needs to be here to avoid overlap since the models aren't integrated*/
+
+    int max_batch; /* Maximum number of quasars with non-overlapping bubbles lit up in one treewalk.*/
 };
 
 static struct qso_lightup_params QSOLightupParams;
@@ -96,7 +101,7 @@ void
 set_qso_lightup_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         QSOLightupParams.QSOLightupOn = param_get_int(ps, "QSOLightupOn");
         QSOLightupParams.qso_candidate_max_mass = param_get_double(ps, "QSOMaxMass");
@@ -105,8 +110,9 @@ set_qso_lightup_params(ParameterSet * ps)
         QSOLightupParams.var_bubble = param_get_double(ps, "QSOVarBubble");
         QSOLightupParams.heIIIreion_finish_frac = param_get_double(ps, "QSOHeIIIReionFinishFrac");
         QSOLightupParams.ExcursionSetZStop = param_get_double(ps,"ExcursionSetZStop");
+        QSOLightupParams.max_batch = param_get_int(ps, "QSOMaxBatch");
     }
-    MPI_Bcast(&QSOLightupParams, sizeof(struct qso_lightup_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&QSOLightupParams, sizeof(struct qso_lightup_params), MPI_BYTE, 0, GadgetComm);
 }
 
 /* Instantaneous heat injection from HeII reionization
@@ -139,37 +145,33 @@ Q_inst(double Emax, double alpha_q)
 static void
 load_heii_reion_hist(const char * reion_hist_file)
 {
-    int ThisTask;
-    FILE * fd = NULL;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-
     message(0, "HeII: Loading HeII reionization history from file: %s\n",reion_hist_file);
-    if(ThisTask == 0) {
-        fd = fopen(reion_hist_file, "r");
-        if(!fd)
-            endrun(456, "HeII: Could not open reionization history file at: '%s'\n", reion_hist_file);
-
-        /*Find size of file*/
-        Nreionhist = 0;
-        while(1)
-        {
-            char buffer[1024];
-            char * retval = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!retval)
-                break;
-            retval = strtok(buffer, " \t\n");
-            /*Discard comments*/
-            if(!retval || retval[0] == '#')
-                continue;
-            Nreionhist++;
-        }
-        rewind(fd);
-        /* Discard first two lines*/
-        Nreionhist -=2;
+    /* The file is read once and shared with each node; every rank then parses its own copy.*/
+    struct shared_table st;
+    if(shared_table_load_file(&st, reion_hist_file, GadgetComm) || st.size == 0)
+        endrun(456, "HeII: Could not open reionization history file at: '%s'\n", reion_hist_file);
+    FILE * fd = fmemopen(st.data, st.size, "r");
+    if(!fd)
+        endrun(456, "HeII: Could not read reionization history file at: '%s'\n", reion_hist_file);
+
+    /*Find size of file*/
+    Nreionhist = 0;
+    while(1)
+    {
+        char buffer[1024];
+        char * retval = fgets(buffer, 1024, fd);
+        /*Happens on end of file*/
+        if(!retval)
+            break;
+        retval = strtok(buffer, " \t\n");
+        /*Discard comments*/
+        if(!retval || retval[0] == '#')
+            continue;
+        Nreionhist++;
     }
-
-    MPI_Bcast(&Nreionhist, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    rewind(fd);
+    /* Discard first two lines*/
+    Nreionhist -=2;
 
     if(Nreionhist<= 2)
         endrun(1, "HeII: Reionization history contains: %d entries, not enough.\n", Nreionhist);
@@ -179,53 +181,48 @@ load_heii_reion_hist(const char * reion_hist_file)
     XHeIII = He_zz + Nreionhist;
     LMFP = He_zz + 2 * Nreionhist;
 
-    if(ThisTask == 0)
+    double qso_spectral_index = 0, photon_threshold_energy = 0;
+    int prei = 0;
+    int i = 0;
+    while(i < Nreionhist)
     {
-        double qso_spectral_index = 0, photon_threshold_energy = 0;
-        int prei = 0;
-        int i = 0;
-        while(i < Nreionhist)
+        char buffer[1024];
+        char * line = fgets(buffer, 1024, fd);
+        /*Happens on end of file*/
+        if(!line)
+            break;
+        char * retval = strtok(line, " \t\n");
+        if(!retval || retval[0] == '#')
+            continue;
+        if(prei == 0)
         {
-            char buffer[1024];
-            char * line = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!line)
-                break;
-            char * retval = strtok(line, " \t\n");
-            if(!retval || retval[0] == '#')
-                continue;
-            if(prei == 0)
-            {
-                qso_spectral_index = atof(retval);
-                prei++;
-                continue;
-            }
-            else if(prei == 1)
-            {
-                photon_threshold_energy = atof(retval);
-                prei++;
-                continue;
-            }
-            /* First column: redshift. Convert to scale factor so it is increasing.*/
-            He_zz[i] = 1./(1+atof(retval));
-            /* Second column: HeIII fraction.*/
-            retval = strtok(NULL, " \t");
-            if(!retval)
-                endrun(12, "HeII: Line %s of reionization table was incomplete!\n", line);
-            XHeIII[i] = atof(retval);
-            /* Third column: long mean free path photons.*/
-            retval = strtok(NULL, " \t");
-            if(!retval)
-                endrun(12, "HeII: Line %s of reionization table was incomplete!\n", line);
-            LMFP[i] = atof(retval);
-            i++;
+            qso_spectral_index = atof(retval);
+            prei++;
+            continue;
         }
-        fclose(fd);
-        qso_inst_heating = Q_inst(photon_threshold_energy, qso_spectral_index);
+        else if(prei == 1)
+        {
+            photon_threshold_energy = atof(retval);
+            prei++;
+            continue;
+        }
+        /* First column: redshift. Convert to scale factor so it is increasing.*/
+        He_zz[i] = 1./(1+atof(retval));
+        /* Second column: HeIII fraction.*/
+        retval = strtok(NULL, " \t");
+        if(!retval)
+            endrun(12, "HeII: Line %s of reionization table was incomplete!\n", line);
+        XHeIII[i] = atof(retval);
+        /* Third column: long mean free path photons.*/
+        retval = strtok(NULL, " \t");
+        if(!retval)
+            endrun(12, "HeII: Line %s of reionization table was incomplete!\n", line);
+        LMFP[i] = atof(retval);
+        i++;
     }
-    /*Broadcast data to other processors*/
-    MPI_Bcast(He_zz, 3 * Nreionhist, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&qso_inst_heating, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    fclose(fd);
+    shared_table_free(&st);
+    qso_inst_heating = Q_inst(photon_threshold_energy, qso_spectral_index);
     /* Initialize the interpolators*/
     HeIII_intp = gsl_interp_alloc(gsl_interp_linear,Nreionhist);
     LMFP_intp = gsl_interp_alloc(gsl_interp_linear,Nreionhist);
@@ -245,6 +242,13 @@ load_heii_reion_hist(const char * reion_hist_file)
     }
 }
 
+void
+prefetch_qso_lightup(const char * reion_hist_file)
+{
+    if(QSOLightupParams.QSOLightupOn)
+        shared_table_prefetch(reion_hist_file);
+}
+
 void
 init_qso_lightup(char * reion_hist_file)
 {
@@ -279,14 +283,21 @@ get_long_mean_free_path_heating(double redshift)
 }
 
 /* This function gets a random number from a Gaussian distribution using the Box-Muller transform.*/
-static double gaussian_rng(double mu, double sigma, const int64_t seed, const RandTable * const rnd)
+static double gaussian_rng(double mu, double sigma, const int64_t seed, const int purpose, const RandTable * const rnd)
 {
-    double u1 = get_random_number(seed, rnd);
-    double u2 = get_random_number(seed + 1, rnd);
+    double u1 = get_random_number(seed, purpose, rnd);
+    double u2 = get_random_number(seed, purpose + 1, rnd);
     double z1 = sqrt(-2 * log(u1) ) * cos(2 * M_PI * u2);
     return mu + sigma * z1;
 }
 
+/* The radius of the bubble around the quasar in the halo with this MinID*/
+static double
+qso_bubble_radius(MyIDType ID, const RandTable * const rnd)
+{
+    return gaussian_rng(QSOLightupParams.mean_bubble, sqrt(QSOLightupParams.var_bubble), ID, RND_QSO_BUBBLE, rnd);
+}
+
 /* Build a list of halos which are candidates for becoming a quasar.
  * We use only halos with the right mass range.*/
 static int
@@ -350,7 +361,7 @@ count_QSO_halos(int ncand, int64_t * ncand_tot, MPI_Comm Comm)
 static int
 choose_QSO_halo(int64_t ncand, int64_t * ncand_before, int64_t * ncand_tot, int64_t randseed, const RandTable * const rnd)
 {
-    double drand = get_random_number(randseed, rnd);
+    double drand = get_random_number(randseed, RND_QSO_CHOOSE, rnd);
     int64_t qso = drand * (*ncand_tot);
     (*ncand_tot)--;
     /* No quasar on this processor*/
@@ -364,6 +375,69 @@ choose_QSO_halo(int64_t ncand, int64_t * ncand_before, int64_t * ncand_tot, int6
     return qso - *ncand_before;
 }
 
+/* Choose up to nbatch quasars, in the same sequence as one at a time with choose_QSO_halo,
+ * stopping before the first whose bubble overlaps the bubble of an earlier quasar in the batch.
+ * The chosen quasars are removed from the candidate list. Collective.
+ * Returns the number of quasars chosen. batch[j] is the FOF index of quasar j if it is on this rank, -1 otherwise.
+ * qso_pos[j] is the position and bubble radius of quasar j on all ranks.*/
+static int
+choose_QSO_batch(int nbatch, int * qso_cand, int * ncand, int64_t * ncand_before, int64_t * ncand_tot, int64_t randseed, FOFGroups * fof, const RandTable * const rnd, int * batch, double (*qso_pos)[4])
+{
+    /* Choose the quasars on a copy of the candidate list, as the batch may be shortened*/
+    int * cand = (int *) mymalloc("qso_cand_copy", sizeof(int) * (*ncand + 1));
+    memcpy(cand, qso_cand, sizeof(int) * (*ncand + 1));
+    int64_t before = *ncand_before, tot = *ncand_tot;
+    int nc = *ncand;
+    int j, k;
+    memset(qso_pos, 0, sizeof(qso_pos[0]) * nbatch);
+    for(j = 0; j < nbatch && tot > 0; j++) {
+        int new_qso = choose_QSO_halo(nc, &before, &tot, randseed + j, rnd);
+        if(new_qso >= nc)
+            endrun(12, "HeII: QSO %d > no. candidates %d! Cannot happen\n", new_qso, nc);
+        if(new_qso < 0)
+            continue;
+        int qplace = cand[new_qso];
+        for(k = 0; k < 3; k++)
+            qso_pos[j][k] = fof->Group[qplace].CM[k];
+        qso_pos[j][3] = qso_bubble_radius(fof->Group[qplace].base.MinID, rnd);
+        memmove(cand + new_qso, cand + new_qso + 1, sizeof(int) * (nc - new_qso));
+        nc--;
+    }
+    myfree(cand);
+    nbatch = j;
+    /* Each quasar is on one rank*/
+    MPI_Allreduce(MPI_IN_PLACE, qso_pos, 4 * nbatch, MPI_DOUBLE, MPI_SUM, GadgetComm);
+
+    /* Stop the batch at the first overlapping bubble, so no particle is ionized by two quasars in the same treewalk.*/
+    int nchosen;
+    for(nchosen = 1; nchosen < nbatch; nchosen++) {
+        for(k = 0; k < nchosen; k++) {
+            double r2 = 0;
+            int d;
+            for(d = 0; d < 3; d++) {
+                double dx = NEAREST(qso_pos[nchosen][d] - qso_pos[k][d], PartManager->BoxSize);
+                r2 += dx * dx;
+            }
+            double rsum = qso_pos[nchosen][3] + qso_pos[k][3];
+            if(r2 <= rsum * rsum)
+                break;
+        }
+        if(k < nchosen)
+            break;
+    }
+    /* Remove the chosen quasars from the candidate list. This repeats the choices above.*/
+    for(j = 0; j < nchosen; j++) {
+        int new_qso = choose_QSO_halo(*ncand, ncand_before, ncand_tot, randseed + j, rnd);
+        batch[j] = -1;
+        if(new_qso < 0)
+            continue;
+        batch[j] = qso_cand[new_qso];
+        memmove(qso_cand + new_qso, qso_cand + new_qso + 1, sizeof(int) * (*ncand - new_qso));
+        (*ncand)--;
+    }
+    return nchosen;
+}
+
 /* Calculates the total ionization fraction of the box.
  */
 static double
@@ -378,14 +452,14 @@ gas_ionization_fraction(void)
     }
     /* Get total ionization fraction: note this is only the current gas particles.
      * Particles that become stars are not counted.*/
-    MPI_Allreduce(&n_ionized, &n_ionized_tot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&SlotsManager->info[0].size, &n_gas_tot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&n_ionized, &n_ionized_tot, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(&SlotsManager->info[0].size, &n_gas_tot, 1, MPI_INT64, MPI_SUM, GadgetComm);
     return (double) n_ionized_tot / (double) n_gas_tot;
 }
 
 /* Do the ionization for a single particle, marking it and adding the heat.
  * No locking is performed so ensure the particle is not being edited in parallel.
- * This is satisfied here because there is only one bubble at a time anyway.
+ * This is satisfied here because the bubbles ionized together do not overlap.
  * Returns 1 if ionization was done, 0 otherwise.*/
 static int
 ionize_single_particle(int other, double a3inv, double uu_in_cgs)
@@ -411,6 +485,10 @@ ionize_single_particle(int other, double a3inv, double uu_in_cgs)
 
 struct QSOPriv {
     FOFGroups * fof;
+    /* Quasars in this batch, as from choose_QSO_batch*/
+    int * batch;
+    int nbatch;
+    /* Number ionized by each thread for each quasar*/
     int64_t * N_ionized;
     double a3inv;
     double uu_in_cgs;
@@ -432,8 +510,7 @@ ionize_ngbiter(TreeWalkQueryQSOLightup * I,
         /* Gas only ( 1 == 1 << 0, the bit for type 0)*/
         iter->mask = GASMASK;
         /* Bubble size*/
-        double bubble = gaussian_rng(QSOLightupParams.mean_bubble, sqrt(QSOLightupParams.var_bubble), I->ID, QSO_GET_PRIV(lv->tw)->rnd);
-        iter->Hsml = bubble;
+        iter->Hsml = qso_bubble_radius(I->ID, QSO_GET_PRIV(lv->tw)->rnd);
         /* Don't care about gas HSML */
         iter->symmetric = NGB_TREEFIND_ASYMMETRIC;
         return;
@@ -451,8 +528,8 @@ ionize_ngbiter(TreeWalkQueryQSOLightup * I,
         return;
 
     int tid = omp_get_thread_num();
-    /* Add to the ionization counter for this thread*/
-    QSO_GET_PRIV(lv->tw)->N_ionized[tid] ++;
+    /* Add to the ionization counter for this thread and quasar*/
+    QSO_GET_PRIV(lv->tw)->N_ionized[tid * QSO_GET_PRIV(lv->tw)->nbatch + I->Slot] ++;
 }
 
 static void
@@ -469,14 +546,17 @@ ionize_copy(int place, TreeWalkQueryQSOLightup * I, TreeWalk * tw)
         I->base.Pos[k] = fof->Group[place].CM[k];
     }
     I->ID = fof->Group[place].base.MinID;
+    for(k = 0; k < QSO_GET_PRIV(tw)->nbatch; k++)
+        if(QSO_GET_PRIV(tw)->batch[k] == place)
+            I->Slot = k;
 }
 
-/* Find all particles within the radius of the HeIII bubble,
+/* Find all particles within the radius of the HeIII bubbles of a batch of quasars,
  * flag each particle as ionized and add instantaneous heating.
- * Returns the number of particles ionized
+ * Sets N_ionized[j] to the total number of particles ionized by quasar j.
  */
-static int64_t
-ionize_all_part(int qso_ind, int * qso_cand, struct QSOPriv priv, ForceTree * tree)
+static void
+ionize_all_part(int * batch, int nbatch, struct QSOPriv priv, ForceTree * tree, int64_t * N_ionized)
 {
     /* This treewalk finds not yet ionized particles within the radius of the black hole, ionizes them and
      * adds an instantaneous heating to them. */
@@ -499,28 +579,35 @@ ionize_all_part(int qso_ind, int * qso_cand, struct QSOPriv priv, ForceTree * tr
     tw->query_type_elsize = sizeof(TreeWalkQueryQSOLightup);
     tw->result_type_elsize = sizeof(TreeWalkResultBase);
 
-    priv.N_ionized = ta_malloc("n_ionized", int64_t, omp_get_max_threads());
-    memset(priv.N_ionized, 0, sizeof(int64_t) * omp_get_max_threads());
+    const int nthreads = omp_get_max_threads();
+    priv.batch = batch;
+    priv.nbatch = nbatch;
+    priv.N_ionized = ta_malloc("n_ionized", int64_t, nthreads * nbatch);
+    memset(priv.N_ionized, 0, sizeof(int64_t) * nthreads * nbatch);
     tw->priv = &priv;
 
-    /* This runs only on one BH*/
-    if(qso_ind > 0)
-        treewalk_run(tw, &qso_cand[qso_ind], 1);
-    else
-        treewalk_run(tw, NULL, 0);
+    /* The quasars of the batch hosted on this rank*/
+    int * queue = ta_malloc("qso_queue", int, nbatch);
+    int i, j, nqueue = 0;
+    for(j = 0; j < nbatch; j++)
+        if(batch[j] >= 0)
+            queue[nqueue++] = batch[j];
 
-    int64_t N_ionized = 0;
-    int i;
-    for(i = 0; i < omp_get_max_threads(); i++)
-        N_ionized += priv.N_ionized[i];
+    treewalk_run(tw, queue, nqueue);
 
-    ta_free(priv.N_ionized);
+    ta_free(queue);
 
-    return N_ionized;
+    for(j = 0; j < nbatch; j++) {
+        N_ionized[j] = 0;
+        for(i = 0; i < nthreads; i++)
+            N_ionized[j] += priv.N_ionized[i * nbatch + j];
+    }
+    ta_free(priv.N_ionized);
+    MPI_Allreduce(MPI_IN_PLACE, N_ionized, nbatch, MPI_INT64, MPI_SUM, GadgetComm);
 }
 
-/* Sequentially turns on quasars.
- * Keeps adding new quasars until need_more_quasars() returns 0.
+/* Turns on quasars in batches with non-overlapping bubbles, each ionized by one treewalk.
+ * Keeps adding new quasars until the desired ionization fraction is reached.
  */
 static void
 turn_on_quasars(double atime, FOFGroups * fof, ForceTree * gasTree, Cosmology * CP, double uu_in_cgs, RandTable * rnd, FILE * FdHelium)
@@ -528,7 +615,7 @@ turn_on_quasars(double atime, FOFGroups * fof, ForceTree * gasTree, Cosmology *
     int ncand = 0;
     int * qso_cand = NULL;
     int64_t n_gas_tot=0, tot_n_ionized=0, ncand_tot=0;
-    MPI_Allreduce(&SlotsManager->info[0].size, &n_gas_tot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&SlotsManager->info[0].size, &n_gas_tot, 1, MPI_INT64, MPI_SUM, GadgetComm);
     double desired_ion_frac = gsl_interp_eval(HeIII_intp, He_zz, XHeIII, atime, NULL);
     struct QSOPriv priv;
     priv.fof = fof;
@@ -545,7 +632,7 @@ turn_on_quasars(double atime, FOFGroups * fof, ForceTree * gasTree, Cosmology *
             if (P[i].Type == 0)
                 nionized += ionize_single_particle(i, priv.a3inv, priv.uu_in_cgs);
         }
-        MPI_Reduce(&nionized, &nion_tot, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+        MPI_Reduce(&nionized, &nion_tot, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
         message(0, "HeII: Helium ionization finished, flash-ionizing %ld particles (%g of total)\n", nion_tot, (double) nion_tot /(double) n_gas_tot);
     }
 
@@ -563,8 +650,8 @@ turn_on_quasars(double atime, FOFGroups * fof, ForceTree * gasTree, Cosmology *
         walltime_measure("/HeIII/Find");
     }
 
-    int64_t ncand_before = count_QSO_halos(ncand, &ncand_tot, MPI_COMM_WORLD);
-    int iteration;
+    int64_t ncand_before = count_QSO_halos(ncand, &ncand_tot, GadgetComm);
+    int64_t iteration = 0;
 
     /* If there are no quasars this will be tough*/
     if(ncand_tot == 0) {
@@ -574,60 +661,65 @@ turn_on_quasars(double atime, FOFGroups * fof, ForceTree * gasTree, Cosmology *
     }
     message(0, "HeII: Built quasar candidate list from %ld quasars\n", ncand_tot);
     walltime_measure("/HeIII/Build");
-    for(iteration = 0; curionfrac < desired_ion_frac; iteration++){
-        /* Get a new quasar*/
-        int new_qso = choose_QSO_halo(ncand, &ncand_before, &ncand_tot, fof->TotNgroups+iteration, rnd);
-        if(new_qso >= ncand)
-            endrun(12, "HeII: QSO %d > no. candidates %d! Cannot happen\n", new_qso, ncand);
+
+    const int max_batch = QSOLightupParams.max_batch > 1 ? QSOLightupParams.max_batch : 1;
+    int * batch = (int *) mymalloc("qso_batch", sizeof(int) * max_batch);
+    double (*batch_pos)[4] = (double (*)[4]) mymalloc("qso_batch_pos", sizeof(batch_pos[0]) * max_batch);
+    int64_t * batch_ionized = (int64_t *) mymalloc("qso_batch_ionized", sizeof(int64_t) * max_batch);
+    int done = 0;
+    while(!done && curionfrac < desired_ion_frac) {
         /* Make sure someone has a quasar*/
         if(ncand_tot <= 0) {
             if(desired_ion_frac - curionfrac > 0.1)
                 message(0, "HeII: Ionization fraction %g less than desired ionization fraction of %g because not enough quasars\n", curionfrac, desired_ion_frac);
             break;
         }
-
-        int64_t n_ionized = ionize_all_part(new_qso, qso_cand, priv, gasTree);
-        int64_t tot_qso_ionized = 0;
-        /* Check that the ionization fraction changed*/
-        MPI_Allreduce(&n_ionized, &tot_qso_ionized, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-        curionfrac += (double) tot_qso_ionized / (double) n_gas_tot;
-        tot_n_ionized += tot_qso_ionized;
-        /* Get the quasar position on rank 0*/
-        double qso_pos[3] = {0};
-        if(new_qso > 0) {
-            int qplace = qso_cand[new_qso];
+        /* Light up enough quasars to reach the desired ionization fraction if their bubbles are at mean density
+         * and do not overlap ionized gas. Overdense bubbles may overshoot: the batch size limits this.*/
+        int nbatch = max_batch;
+        if(non_overlapping_bubble_number > 0)
+            nbatch = DMIN(nbatch, (desired_ion_frac - curionfrac) * n_gas_tot / non_overlapping_bubble_number);
+        nbatch = DMAX(nbatch, 1);
+        /* Get new quasars*/
+        nbatch = choose_QSO_batch(nbatch, qso_cand, &ncand, &ncand_before, &ncand_tot, fof->TotNgroups+iteration, fof, rnd, batch, batch_pos);
+        ionize_all_part(batch, nbatch, priv, gasTree, batch_ionized);
+
+        int j;
+        for(j = 0; j < nbatch; j++, iteration++) {
+            int64_t tot_qso_ionized = batch_ionized[j];
+            /* Check that the ionization fraction changed*/
+            curionfrac += (double) tot_qso_ionized / (double) n_gas_tot;
+            tot_n_ionized += tot_qso_ionized;
+            double qso_pos[3] = {0};
             int k;
             for(k = 0; k < 3; k++) {
-                qso_pos[k] = fof->Group[qplace].CM[k]- PartManager->CurrentParticleOffset[k];
+                qso_pos[k] = batch_pos[j][k] - PartManager->CurrentParticleOffset[k];
                 while(qso_pos[k] > PartManager->BoxSize) qso_pos[k] -= PartManager->BoxSize;
                 while(qso_pos[k] <= 0) qso_pos[k] += PartManager->BoxSize;
             }
-            message(1, "HeII: Quasar %d changed the HeIII ionization fraction to %g, ionizing %ld\n", qplace, curionfrac, tot_qso_ionized);
-        }
-        /* Format: Time = current scale factor,
-         * ID of the quasar (the index of the FOF halo)
-         * FOF halo position, x,y,z,
-         * Current ionized fraction
-         * total number of particles ionized by this quasar*/
-        MPI_Allreduce(MPI_IN_PLACE, qso_pos, 3, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
-        if(FdHelium) {
-            fprintf(FdHelium, "%g %g %g %g %g %ld\n", atime, qso_pos[0], qso_pos[1], qso_pos[2], curionfrac, tot_qso_ionized);
-            fflush(FdHelium);
-        }
-
-        /* Break the loop if we do not ionize enough particles this round.
-         * Try again next timestep when we will hopefully have new BHs.*/
-        if(tot_qso_ionized < 0.01 * non_overlapping_bubble_number && iteration > 10) {
-            message(0, "HeII: Stopping ionization at iteration %d because insufficient ionization happened.\n", iteration);
-            break;
-        }
+            if(batch[j] >= 0)
+                message(1, "HeII: Quasar %d changed the HeIII ionization fraction to %g, ionizing %ld\n", batch[j], curionfrac, tot_qso_ionized);
+            /* Format: Time = current scale factor,
+             * ID of the quasar (the index of the FOF halo)
+             * FOF halo position, x,y,z,
+             * Current ionized fraction
+             * total number of particles ionized by this quasar*/
+            if(FdHelium) {
+                fprintf(FdHelium, "%g %g %g %g %g %ld\n", atime, qso_pos[0], qso_pos[1], qso_pos[2], curionfrac, tot_qso_ionized);
+                fflush(FdHelium);
+            }
 
-        /* Remove this candidate from the list by moving the list down.*/
-        if( new_qso >= 0) {
-            memmove(qso_cand+new_qso, qso_cand+new_qso+1, ncand - new_qso+1);
-            ncand--;
+            /* Break the loop if we do not ionize enough particles this round.
+             * Try again next timestep when we will hopefully have new BHs.*/
+            if(tot_qso_ionized < 0.01 * non_overlapping_bubble_number && iteration > 10) {
+                message(0, "HeII: Stopping ionization at iteration %ld because insufficient ionization happened.\n", iteration);
+                done = 1;
+            }
         }
     }
+    myfree(batch_ionized);
+    myfree(batch_pos);
+    myfree(batch);
     if(qso_cand) {
         myfree(qso_cand);
     }
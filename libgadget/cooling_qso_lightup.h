@@ -7,6 +7,9 @@
 
 void set_qso_lightup_params(ParameterSet * ps);
 
+/* Start reading the reionization history in the background, ahead of init_qso_lightup*/
+void prefetch_qso_lightup(const char * reion_hist_file);
+
 /* Initialize the helium reionization cooling module*/
 void init_qso_lightup(char * reion_hist_file);
 
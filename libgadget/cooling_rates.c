@@ -64,6 +64,7 @@
 #include "utils/endrun.h"
 #include "utils/paramset.h"
 #include "utils/mymalloc.h"
+#include "utils/sharedtable.h"
 
 static struct cooling_params CoolingParams;
 
@@ -116,6 +117,18 @@ static double * cool_recombHp, * cool_recombHeP, * cool_recombHePP;
 /*For the Free-free cooling rate*/
 static double * cool_freefree1;
 
+/* The tables above are held once per node*/
+static struct shared_table TreeCoolMem = SHARED_TABLE_INIT, J21CoeffMem = SHARED_TABLE_INIT, RecombMem = SHARED_TABLE_INIT;
+
+/*The recombination and cooling rates interpolated at one temperature*/
+struct cool_rates
+{
+    double alphaHp, GammaeH0, alphaHep, alphaHepp, GammaHe0, GammaHep;
+    double collisH0, collisHe0, collisHeP, recombHp, recombHeP, recombHePP, freefree1;
+};
+
+static void get_rates_block(const int n, const double * logt, struct cool_rates * rt, const int cooling);
+
 static void
 init_itp_type(double * xarr, struct itp_type * Gamma, int Nelem)
 {
@@ -133,23 +146,21 @@ load_tree_value(char ** saveptr)
     return -9000;
 }
 
-/* This function loads the treecool file into the (global function) data arrays.
- * Format of the treecool table:
-    log_10(1+z), Gamma_HI, Gamma_HeI, Gamma_HeII,  Qdot_HI, Qdot_HeI, Qdot_HeII,
-    where 'Gamma' is the photoionization rate and 'Qdot' is the photoheating rate.
-    The Gamma's are in units of s^-1, and the Qdot's are in units of erg s^-1.
-*/
-static void
-load_treecool(const char * TreeCoolFile)
+/* Read a 7 column rate table (TREECOOL or J21 coefficients) into mem, an array of 7 * N doubles
+ * stored column by column and shared by the ranks of a node. Columns after the first are log10 of the rates.
+ * The file is read once and sent to each node, where one rank parses it.*/
+static double *
+load_rate_table(const char * file, const char * name, int * N, struct shared_table * mem)
 {
-    if(!CoolingParams.PhotoIonizationOn)
-        return;
-    FILE * fd = fopen(TreeCoolFile, "r");
+    struct shared_table st;
+    if(shared_table_load_file(&st, file, GadgetComm) || st.size == 0)
+        endrun(456, "Could not open %s file at: '%s'\n", name, file);
+    FILE * fd = fmemopen(st.data, st.size, "r");
     if(!fd)
-        endrun(456, "Could not open photon background (TREECOOL) file at: '%s'\n", TreeCoolFile);
+        endrun(456, "Could not read %s file at: '%s'\n", name, file);
 
     /*Find size of file*/
-    NTreeCool = 0;
+    int n = 0;
     do
     {
         char buffer[1024];
@@ -161,18 +172,67 @@ load_treecool(const char * TreeCoolFile)
         /*Discard comments*/
         if(!retval || retval[0] == '#')
             continue;
-        NTreeCool++;
+        n++;
     }
     while(1);
     rewind(fd);
 
-    MPI_Bcast(&(NTreeCool), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(n <= 2)
+        endrun(1, "%s contains: %d entries, not enough.\n", name, n);
+
+    shared_table_free(mem);
+    double * table = NULL;
+    if(shared_table_alloc(mem, 7 * n * sizeof(double), GadgetComm))
+        table = (double *) mem->data;
+    int i = 0;
+    while(table && i < n)
+    {
+        char buffer[1024];
+        char * saveptr;
+        char * line = fgets(buffer, 1024, fd);
+        /*Happens on end of file*/
+        if(!line)
+            break;
+        char * retval = strtok_r(line, " \t", &saveptr);
+        if(!retval || retval[0] == '#')
+            continue;
+        table[i] = atof(retval);
+        /*Get the rest*/
+        int j;
+        for(j = 1; j < 7; j++)
+            table[j * n + i] = load_tree_value(&saveptr);
+        table[4 * n + i] += CoolingParams.HydrogenHeatAmp;
+        i++;
+    }
+    fclose(fd);
+    shared_table_free(&st);
+    shared_table_ready(mem);
+    *N = n;
+    return (double *) mem->data;
+}
 
-    if(NTreeCool<= 2)
-        endrun(1, "Photon background contains: %d entries, not enough.\n", NTreeCool);
+/* Start reading the UVB tables in the background, so they are ready by init_cooling_rates.*/
+void
+prefetch_cooling_rates(const char * TreeCoolFile, const char * J21CoeffFile)
+{
+    shared_table_prefetch(TreeCoolFile);
+    shared_table_prefetch(J21CoeffFile);
+}
+
+/* This function loads the treecool file into the (global function) data arrays.
+ * Format of the treecool table:
+    log_10(1+z), Gamma_HI, Gamma_HeI, Gamma_HeII,  Qdot_HI, Qdot_HeI, Qdot_HeII,
+    where 'Gamma' is the photoionization rate and 'Qdot' is the photoheating rate.
+    The Gamma's are in units of s^-1, and the Qdot's are in units of erg s^-1.
+*/
+static void
+load_treecool(const char * TreeCoolFile)
+{
+    if(!CoolingParams.PhotoIonizationOn)
+        return;
 
     /*Allocate memory for the photon background table.*/
-    Gamma_log1z = (double *) mymalloc("TreeCoolTable", 7 * NTreeCool * sizeof(double));
+    Gamma_log1z = load_rate_table(TreeCoolFile, "TreeCoolTable", &NTreeCool, &TreeCoolMem);
     Gamma_HI.ydata = Gamma_log1z + NTreeCool;
     Gamma_HeI.ydata = Gamma_log1z + 2 * NTreeCool;
     Gamma_HeII.ydata = Gamma_log1z + 3 * NTreeCool;
@@ -180,38 +240,6 @@ load_treecool(const char * TreeCoolFile)
     Eps_HeI.ydata = Gamma_log1z + 5 * NTreeCool;
     Eps_HeII.ydata = Gamma_log1z + 6 * NTreeCool;
 
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
-    {
-        int i = 0;
-        while(i < NTreeCool)
-        {
-            char buffer[1024];
-            char * saveptr;
-            char * line = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!line)
-                break;
-            char * retval = strtok_r(line, " \t", &saveptr);
-            if(!retval || retval[0] == '#')
-                continue;
-            Gamma_log1z[i] = atof(retval);
-            /*Get the rest*/
-            Gamma_HI.ydata[i]   = load_tree_value(&saveptr);
-            Gamma_HeI.ydata[i]  = load_tree_value(&saveptr);
-            Gamma_HeII.ydata[i] = load_tree_value(&saveptr);
-            Eps_HI.ydata[i]     = load_tree_value(&saveptr)+ CoolingParams.HydrogenHeatAmp;
-            Eps_HeI.ydata[i]    = load_tree_value(&saveptr);
-            Eps_HeII.ydata[i]   = load_tree_value(&saveptr);
-            i++;
-        }
-
-        fclose(fd);
-    }
-
-    /*Broadcast data to other processors*/
-    MPI_Bcast(Gamma_log1z, 7 * NTreeCool, MPI_DOUBLE, 0, MPI_COMM_WORLD);
     /*Initialize the UVB redshift interpolation: reticulate the splines*/
     init_itp_type(Gamma_log1z, &Gamma_HI, NTreeCool);
     init_itp_type(Gamma_log1z, &Gamma_HeI, NTreeCool);
@@ -224,8 +252,7 @@ load_treecool(const char * TreeCoolFile)
 }
 
 /* This function loads the J21 rate coeff file into the (global function) data arrays.
- * very similar to load_treecool TODO: generalize this
- * Format of the treecool table:
+ * Format of the table:
     alpha, Gamma_HI, Gamma_HeI, Gamma_HeII,  Qdot_HI, Qdot_HeI, Qdot_HeII,
     where 'Gamma' is the photoionization rate and 'Qdot' is the photoheating rate.
     The Gamma's are in units of s^-1, and the Qdot's are in units of erg s^-1.
@@ -233,35 +260,8 @@ load_treecool(const char * TreeCoolFile)
 static void
 load_J21coeffs(const char * J21CoeffFile)
 {
-    FILE * fd = fopen(J21CoeffFile, "r");
-    if(!fd)
-        endrun(456, "Could not open rate coefficients file at: '%s'\n", J21CoeffFile);
-
-    /*Find size of file*/
-    NJ21Coeffs = 0;
-    do
-    {
-        char buffer[1024];
-        char * retval = fgets(buffer, 1024, fd);
-        /*Happens on end of file*/
-        if(!retval)
-            break;
-        retval = strtok(buffer, " \t");
-        /*Discard comments*/
-        if(!retval || retval[0] == '#')
-            continue;
-        NJ21Coeffs++;
-    }
-    while(1);
-    rewind(fd);
-
-    MPI_Bcast(&(NJ21Coeffs), 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-    if(NJ21Coeffs<= 2)
-        endrun(1, "Photon background contains: %d entries, not enough.\n", NJ21Coeffs);
-
     /*Allocate memory for the photon background table.*/
-    Gamma_alpha = (double *) mymalloc("J21CoeffTable", 7 * NJ21Coeffs * sizeof(double));
+    Gamma_alpha = load_rate_table(J21CoeffFile, "J21CoeffTable", &NJ21Coeffs, &J21CoeffMem);
     G_HI_coeff.ydata = Gamma_alpha + NJ21Coeffs;
     G_HeI_coeff.ydata = Gamma_alpha + 2 * NJ21Coeffs;
     G_HeII_coeff.ydata = Gamma_alpha + 3 * NJ21Coeffs;
@@ -269,38 +269,6 @@ load_J21coeffs(const char * J21CoeffFile)
     Eps_HeI_coeff.ydata = Gamma_alpha + 5 * NJ21Coeffs;
     Eps_HeII_coeff.ydata = Gamma_alpha + 6 * NJ21Coeffs;
 
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
-    {
-        int i = 0;
-        while(i < NJ21Coeffs)
-        {
-            char buffer[1024];
-            char * saveptr;
-            char * line = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!line)
-                break;
-            char * retval = strtok_r(line, " \t", &saveptr);
-            if(!retval || retval[0] == '#')
-                continue;
-            Gamma_alpha[i] = atof(retval);
-            /*Get the rest*/
-            G_HI_coeff.ydata[i]   = load_tree_value(&saveptr);
-            G_HeI_coeff.ydata[i]  = load_tree_value(&saveptr);
-            G_HeII_coeff.ydata[i] = load_tree_value(&saveptr);
-            Eps_HI_coeff.ydata[i]     = load_tree_value(&saveptr)+ CoolingParams.HydrogenHeatAmp;
-            Eps_HeI_coeff.ydata[i]    = load_tree_value(&saveptr);
-            Eps_HeII_coeff.ydata[i]   = load_tree_value(&saveptr);
-            i++;
-        }
-
-        fclose(fd);
-    }
-
-    /*Broadcast data to other processors*/
-    MPI_Bcast(Gamma_alpha, 7 * NJ21Coeffs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
     /*Initialize the UVB redshift interpolation: reticulate the splines*/
     init_itp_type(Gamma_alpha, &G_HI_coeff, NJ21Coeffs);
     init_itp_type(Gamma_alpha, &G_HeI_coeff, NJ21Coeffs);
@@ -655,13 +623,21 @@ get_interpolated_recomb(double logt, double * rec_tab, double rec_func(double))
     return rec_tab[index + 1] * (dind - index) + rec_tab[index] * (1 - (dind - index));
 }
 
-/*The neutral hydrogen number density, divided by the hydrogen number density.
- * Eq. 33 of KWH. Photofac is the self-shielding correction.*/
+/*Interpolate one of the recombination tables, given the table index and weight found by get_rates_block.*/
+static inline double
+get_interpolated_recomb_index(const double logt, const int index, const double frac, const double * rec_tab, double rec_func(double))
+{
+    /*Just call the function directly if we are out of interpolation range*/
+    if(!rec_tab || index < 0 || index >= NRECOMBTAB-1)
+        return rec_func(exp(logt));
+    return rec_tab[index + 1] * frac + rec_tab[index] * (1 - frac);
+}
+
+/*The neutral hydrogen number density, divided by the hydrogen number density, from the recombination
+ * and collisional ionization rates. Eq. 33 of KWH. Photofac is the self-shielding correction.*/
 static double
-nH0_internal(double logt, double ne, const struct UVBG * uvbg, double photofac)
+nH0_rates(double alphaHp, double GammaeH0, double ne, const struct UVBG * uvbg, double photofac)
 {
-    double alphaHp = get_interpolated_recomb(logt, rec_alphaHp, &recomb_alphaHp);
-    double GammaeH0 = get_interpolated_recomb(logt, rec_GammaH0, &recomb_GammaeH0);
     /*Be careful when there is no ionization.*/
     double photorate = 0;
     if(uvbg->gJH0 > 0. && ne > 1e-50)
@@ -669,6 +645,16 @@ nH0_internal(double logt, double ne, const struct UVBG * uvbg, double photofac)
     return alphaHp/ (alphaHp + GammaeH0 + photorate);
 }
 
+/*The neutral hydrogen number density, divided by the hydrogen number density.
+ * Eq. 33 of KWH. Photofac is the self-shielding correction.*/
+static double
+nH0_internal(double logt, double ne, const struct UVBG * uvbg, double photofac)
+{
+    double alphaHp = get_interpolated_recomb(logt, rec_alphaHp, &recomb_alphaHp);
+    double GammaeH0 = get_interpolated_recomb(logt, rec_GammaH0, &recomb_GammaeH0);
+    return nH0_rates(alphaHp, GammaeH0, ne, uvbg, photofac);
+}
+
 /*The ionised hydrogen number density, divided by the hydrogen number density. Eq. 34 of KWH.*/
 static double
 nHp_internal(double nH0)
@@ -686,14 +672,11 @@ struct he_ions
     double nHepp;
 };
 
-/*The helium ionic number densities, divided by the helium number fraction. Eq. 35, 36 and 37 of KWH. */
+/*The helium ionic number densities, divided by the helium number fraction, from the recombination
+ * and collisional ionization rates. Eq. 35, 36 and 37 of KWH. */
 static struct he_ions
-nHe_internal(double nh, double logt, double ne, const struct UVBG * uvbg, double photofac)
+nHe_rates(double nh, double alphaHep, double alphaHepp, double GammaHe0, double GammaHep, double ne, const struct UVBG * uvbg, double photofac)
 {
-    double alphaHep = get_interpolated_recomb(logt, rec_alphaHep, &recomb_alphaHepd);
-    double alphaHepp = get_interpolated_recomb(logt, rec_alphaHepp, &recomb_alphaHepp);
-    double GammaHe0 = get_interpolated_recomb(logt, rec_GammaHe0, &recomb_GammaeHe0);
-    double GammaHep = get_interpolated_recomb(logt, rec_GammaHep, &recomb_GammaeHep);
     struct he_ions He;
     /*Be careful when there is no ionization.*/
     if(uvbg->gJHe0 > 0. && ne > 1e-50) {
@@ -714,6 +697,17 @@ nHe_internal(double nh, double logt, double ne, const struct UVBG * uvbg, double
     return He;
 }
 
+/*The helium ionic number densities, divided by the helium number fraction. Eq. 35, 36 and 37 of KWH. */
+static struct he_ions
+nHe_internal(double nh, double logt, double ne, const struct UVBG * uvbg, double photofac)
+{
+    double alphaHep = get_interpolated_recomb(logt, rec_alphaHep, &recomb_alphaHepd);
+    double alphaHepp = get_interpolated_recomb(logt, rec_alphaHepp, &recomb_alphaHepp);
+    double GammaHe0 = get_interpolated_recomb(logt, rec_GammaHe0, &recomb_GammaeHe0);
+    double GammaHep = get_interpolated_recomb(logt, rec_GammaHep, &recomb_GammaeHep);
+    return nHe_rates(nh, alphaHep, alphaHepp, GammaHe0, GammaHep, ne, uvbg, photofac);
+}
+
 /*Compute temperature (in K) from internal energy and electron density.
     Uses: internal energy
             electron abundance per H atom (ne/nH)
@@ -764,6 +758,26 @@ ne_internal(double nh, double ienergy, double ne, double helium, double * logt,
     return nh * nHp + yy * He.nHep + 2 * yy * He.nHepp;
 }
 
+/*The electron number density for n <= COOLING_BLOCK particles, as ne_internal.
+ * The rates for all particles are interpolated together.*/
+static void
+ne_internal_block(const int n, const double * nh, const double * ienergy, const double * ne, double helium, double * logt, const struct UVBG * const * uvbg, double * neout)
+{
+    double yy = helium / 4 / (1 - helium);
+    struct cool_rates rt[COOLING_BLOCK];
+    int i;
+    for(i = 0; i < n; i++)
+        logt[i] = log(get_temp_internal(ne[i]/nh[i], ienergy[i], helium));
+    get_rates_block(n, logt, rt, 0);
+    for(i = 0; i < n; i++) {
+        double photofac = self_shield_corr(nh[i], logt[i], uvbg[i]->self_shield_dens);
+        double nH0 = nH0_rates(rt[i].alphaHp, rt[i].GammaeH0, ne[i], uvbg[i], photofac);
+        double nHp = nHp_internal(nH0);
+        struct he_ions He = nHe_rates(nh[i], rt[i].alphaHep, rt[i].alphaHepp, rt[i].GammaHe0, rt[i].GammaHep, ne[i], uvbg[i], photofac);
+        neout[i] = nh[i] * nHp + yy * He.nHep + 2 * yy * He.nHepp;
+    }
+}
+
 /*Maximum number of iterations to perform*/
 #define MAXITER 1000
 /* Absolute tolerance to converge the rate network. Absolute is ok because we are converging electon abundance, ne/nh,
@@ -808,6 +822,72 @@ scipy_optimize_fixed_point(double ne_init, double nh, double ienergy, double hel
     return ne0 * nh;
 }
 
+/* As scipy_optimize_fixed_point, but the network is solved for n <= COOLING_BLOCK particles together: each iteration evaluates
+    the particles which have not yet converged, and converged particles drop out.
+    On entry ne is the electron abundance in units of nh, not the cgs electron abundance as returned by ne_internal_block.
+    On exit it is the cgs electron abundance.
+*/
+static void
+scipy_optimize_fixed_point_block(const int n, double * ne, const double * nh, const double * ienergy, double helium, double *logt, const struct UVBG * const * uvbg)
+{
+    /* Unconverged particles, and their inputs packed for ne_internal_block*/
+    int act[COOLING_BLOCK];
+    double anh[COOLING_BLOCK], aienergy[COOLING_BLOCK], ane[COOLING_BLOCK], alogt[COOLING_BLOCK];
+    const struct UVBG * auvbg[COOLING_BLOCK];
+    double ne1[COOLING_BLOCK], ne2[COOLING_BLOCK], ne_init[COOLING_BLOCK];
+    int i, j, nact = n;
+    for(j = 0; j < n; j++) {
+        act[j] = j;
+        ne_init[j] = ne[j];
+        anh[j] = nh[j];
+        aienergy[j] = ienergy[j];
+        auvbg[j] = uvbg[j];
+    }
+    for(i = 0; i < MAXITER && nact > 0; i++)
+    {
+        for(j = 0; j < nact; j++)
+            ane[j] = ne[act[j]] * anh[j];
+        ne_internal_block(nact, anh, aienergy, ane, helium, alogt, auvbg, ne1);
+
+        int nnext = 0;
+        for(j = 0; j < nact; j++) {
+            const int k = act[j];
+            ne1[j] /= anh[j];
+            if(fabs(ne1[j] - ne[k]) < ITERCONV) {
+                logt[k] = alogt[j];
+                ne[k] = ne1[j];
+                continue;
+            }
+            act[nnext] = k;
+            anh[nnext] = anh[j];
+            aienergy[nnext] = aienergy[j];
+            auvbg[nnext] = auvbg[j];
+            ne1[nnext] = ne1[j];
+            ane[nnext] = ne1[j] * anh[j];
+            nnext++;
+        }
+        nact = nnext;
+
+        ne_internal_block(nact, anh, aienergy, ane, helium, alogt, auvbg, ne2);
+        for(j = 0; j < nact; j++) {
+            const int k = act[j];
+            ne2[j] /= anh[j];
+            double d = ne[k] + ne2[j] - 2.0 * ne1[j];
+            double pp = ne2[j];
+            /*This is del^2*/
+            if (d > 1e-15 || d < -1e-15)
+                pp = ne[k] - (ne1[j] - ne[k])*(ne1[j] - ne[k]) / d;
+            /*Enforce positivity*/
+            ne[k] = pp < 0 ? 0 : pp;
+        }
+    }
+    for(j = 0; j < n; j++) {
+        if (!isfinite(ne[j]) || (nact > 0 && j == act[0]))
+            endrun(1, "Ionization rate network failed to converge for nh = %g temp = %g helium=%g ienergy=%g: last ne = %g (init=%g)\n", nh[j], get_temp_internal(ne[j], ienergy[j], helium), helium, ienergy[j], ne[j], ne_init[j]);
+        ne[j] *= nh[j];
+    }
+}
+
 /*Solve the system of equations for photo-ionization equilibrium,
   starting with ne = nH and continuing until convergence.
   density is gas density in protons/cm^3
@@ -1067,6 +1147,37 @@ cool_he_reion_factor(double nHcgs, double helium, double redshift)
   return CoolingParams.HeliumHeatAmp*pow(overden, CoolingParams.HeliumHeatExp);
 }
 
+/* Table of the net heating rate for the uniform UVB at one redshift, on a grid in log density and
+ * log internal energy. Rates are found by bilinear interpolation, except in cells where the interpolation
+ * error, estimated at the centre of the cell, exceeds CoolingTableTolerance. These are the cells
+ * around the equilibrium temperature and the self-shielding threshold, and use the rate network.
+ * The table is held once per node and recomputed by update_cooling_table.*/
+/* Density from 1e-10 to 1e4 protons/cm^3 and internal energy from 1e9 to 1e18 erg/g, 16 points per decade*/
+#define COOLTAB_DLOG (M_LN10 / 16)
+#define COOLTAB_LOGDMIN (-10 * M_LN10)
+#define COOLTAB_NDENS (14 * 16 + 1)
+#define COOLTAB_LOGUMIN (9 * M_LN10)
+#define COOLTAB_NU (9 * 16 + 1)
+
+static struct {
+    struct shared_table Mem;
+    /* Set if this rank computes the table for its node*/
+    int fill;
+    int valid;
+    /* Redshift and UVB at which the table was computed*/
+    double log1z;
+    struct UVBG uvbg;
+    double helium;
+    /* Current redshift and global UVB. Lookups are only made for these.*/
+    double redshift;
+    struct UVBG curuvbg;
+    /* Net heating rate divided by density, and the electron abundance ne / nh, at the grid points*/
+    double * LambdaNet;
+    double * ne;
+    /* Cells which use the rate network*/
+    unsigned char * exact;
+} CoolTable = {SHARED_TABLE_INIT};
+
 /*This is a helper for the tests*/
 void set_coolpar(struct cooling_params cp)
 {
@@ -1077,7 +1188,7 @@ void
 set_cooling_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         /*Cooling rate network parameters*/
         CoolingParams.CMBTemperature = param_get_double(ps, "CMBTemperature");
@@ -1095,8 +1206,9 @@ set_cooling_params(ParameterSet * ps)
         CoolingParams.HeliumHeatThresh = param_get_double(ps, "HeliumHeatThresh");
         CoolingParams.HeliumHeatAmp = param_get_double(ps, "HeliumHeatAmp");
         CoolingParams.HeliumHeatExp = param_get_double(ps, "HeliumHeatExp");
+        CoolingParams.CoolingTableTolerance = param_get_double(ps, "CoolingTableTolerance");
     }
-    MPI_Bcast(&CoolingParams, sizeof(struct cooling_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&CoolingParams, sizeof(struct cooling_params), MPI_BYTE, 0, GadgetComm);
 }
 
 /*Initialize the cooling rate module. This builds a lot of interpolation tables.
@@ -1106,6 +1218,8 @@ init_cooling_rates(const char * TreeCoolFile, const char * J21CoeffFile, const c
 {
     CoolingParams.fBar = CP->OmegaBaryon / CP->OmegaCDM;
     CoolingParams.rho_crit_baryon = CP->OmegaBaryon * 3.0 * pow(CP->HubbleParam*HUBBLE,2.0) /(8.0*M_PI*GRAVITY);
+    /* The cooling table is for the old parameters*/
+    CoolTable.valid = 0;
 
     /* Initialize the interpolation for the self-shielding module as a function of redshift.
      * A crash has been observed in GSL with a cspline interpolator. */
@@ -1132,8 +1246,10 @@ init_cooling_rates(const char * TreeCoolFile, const char * J21CoeffFile, const c
         load_J21coeffs(J21CoeffFile);
     }
 
-    /*Initialize the recombination tables*/
-    temp_tab = (double *) mymalloc("Recombination_tables", NRECOMBTAB * sizeof(double) * 14);
+    /*Initialize the recombination tables. One rank on each node computes them.*/
+    shared_table_free(&RecombMem);
+    const int fill = shared_table_alloc(&RecombMem, NRECOMBTAB * sizeof(double) * 14, GadgetComm);
+    temp_tab = (double *) RecombMem.data;
 
     rec_GammaH0 = temp_tab + NRECOMBTAB;
     rec_GammaHe0 = temp_tab + 2 * NRECOMBTAB;
@@ -1150,7 +1266,7 @@ init_cooling_rates(const char * TreeCoolFile, const char * J21CoeffFile, const c
     cool_freefree1 = temp_tab + 13 * NRECOMBTAB;
 
     int i;
-    for(i = 0 ; i < NRECOMBTAB; i++)
+    for(i = 0 ; fill && i < NRECOMBTAB; i++)
     {
         temp_tab[i] = RECOMBTMIN + (RECOMBTMAX - RECOMBTMIN) * i / NRECOMBTAB;
         double tt = exp(temp_tab[i]);
@@ -1169,6 +1285,7 @@ init_cooling_rates(const char * TreeCoolFile, const char * J21CoeffFile, const c
         cool_recombHePP[i] = cool_RecombHePP(tt);
         cool_freefree1[i] = cool_FreeFree(tt, 1);
     }
+    shared_table_ready(&RecombMem);
 
     /*Initialize the metal cooling table*/
     InitMetalCooling(MetalCoolFile);
@@ -1237,19 +1354,41 @@ get_individual_cooling(enum CoolProcess process, double density, double ienergy,
     return Lambda * pow(1 - helium, 2) * density / PROTONMASS;
 }
 
-/*Get the total change in internal energy per unit time in erg/s/g for a given temperature (internal energy) and density.
-  density is total gas density in protons/cm^3
-  Internal energy is in ergs/g.
-  helium is a mass fraction, 1 - HYDROGEN_MASSFRAC = 0.24 for primordial gas.
-  Returns (heating - cooling) / nh^2.
-  ne_equilib is the equilibrium electron abundance in units of the hydrogen number density.
-  Note this is *not* the electron density in cgs units, as used internally.
- */
-double
-get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib)
+/*Interpolate the rate tables at n <= COOLING_BLOCK temperatures. The table index and weight are found
+ * once per temperature and shared by all the tables. The recombination and collisional ionization rates
+ * are always computed, the cooling rates only if cooling is set.*/
+static void
+get_rates_block(const int n, const double * logt, struct cool_rates * rt, const int cooling)
+{
+    int i;
+    for(i = 0; i < n; i++) {
+        /*Find the index to use in our temperature table, as in get_interpolated_recomb.*/
+        const double dind = (logt[i] - RECOMBTMIN) / (RECOMBTMAX - RECOMBTMIN) * NRECOMBTAB;
+        const int index = (int) dind;
+        const double frac = dind - index;
+        rt[i].alphaHp = get_interpolated_recomb_index(logt[i], index, frac, rec_alphaHp, &recomb_alphaHp);
+        rt[i].GammaeH0 = get_interpolated_recomb_index(logt[i], index, frac, rec_GammaH0, &recomb_GammaeH0);
+        rt[i].alphaHep = get_interpolated_recomb_index(logt[i], index, frac, rec_alphaHep, &recomb_alphaHepd);
+        rt[i].alphaHepp = get_interpolated_recomb_index(logt[i], index, frac, rec_alphaHepp, &recomb_alphaHepp);
+        rt[i].GammaHe0 = get_interpolated_recomb_index(logt[i], index, frac, rec_GammaHe0, &recomb_GammaeHe0);
+        rt[i].GammaHep = get_interpolated_recomb_index(logt[i], index, frac, rec_GammaHep, &recomb_GammaeHep);
+        if(!cooling)
+            continue;
+        rt[i].collisH0 = get_interpolated_recomb_index(logt[i], index, frac, cool_collisH0, &cool_CollisionalH0);
+        rt[i].collisHe0 = get_interpolated_recomb_index(logt[i], index, frac, cool_collisHe0, &cool_CollisionalHe0);
+        rt[i].collisHeP = get_interpolated_recomb_index(logt[i], index, frac, cool_collisHeP, &cool_CollisionalHeP);
+        rt[i].recombHp = get_interpolated_recomb_index(logt[i], index, frac, cool_recombHp, &cool_RecombHp);
+        rt[i].recombHeP = get_interpolated_recomb_index(logt[i], index, frac, cool_recombHeP, &cool_RecombHeP);
+        rt[i].recombHePP = get_interpolated_recomb_index(logt[i], index, frac, cool_recombHePP, &cool_RecombHePP);
+        rt[i].freefree1 = get_interpolated_recomb_index(logt[i], index, frac, cool_freefree1, &cool_FreeFree1);
+    }
+}
+
+/*Net heating rate in erg/s/g, given the equilibrium electron density ne (cgs), the temperature
+ * and the rates interpolated at that temperature. Sets ne_equilib to ne / nh.*/
+static double
+heatingcooling_rate_internal(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double ne, double logt, const struct cool_rates * rt, double *ne_equilib)
 {
-    double logt;
-    double ne = get_equilib_ne(density, ienergy, helium, &logt, uvbg, *ne_equilib);
     double nh = density * (1 - helium);
     double nebynh = ne/nh;
     /*Faster than running the exp.*/
@@ -1259,24 +1398,20 @@ get_heatingcooling_rate(double density, double ienergy, double helium, double re
     /*The helium number fraction*/
     double yy = helium / 4 / (1 - helium);
 
-    double nH0 = nH0_internal(logt, ne, uvbg, photofac);
+    double nH0 = nH0_rates(rt->alphaHp, rt->GammaeH0, ne, uvbg, photofac);
     double nHp = nHp_internal(nH0);
-    struct he_ions He = nHe_internal(nh, logt, ne, uvbg, photofac);
+    struct he_ions He = nHe_rates(nh, rt->alphaHep, rt->alphaHepp, rt->GammaHe0, rt->GammaHep, ne, uvbg, photofac);
     /*Put the abundances in units of nH to avoid underflows*/
     He.nHep*= yy/nh;
     He.nHe0*= yy/nh;
     He.nHepp*= yy/nh;
     /*Collisional ionization and excitation rate*/
-    double LambdaCollis = nebynh * (get_interpolated_recomb(logt, cool_collisH0, cool_CollisionalH0) * nH0 +
-            get_interpolated_recomb(logt, cool_collisHe0, cool_CollisionalHe0) * He.nHe0 +
-            get_interpolated_recomb(logt, cool_collisHeP, cool_CollisionalHeP) * He.nHep);
-    double LambdaRecomb = nebynh * (get_interpolated_recomb(logt, cool_recombHp, cool_RecombHp) * nHp +
-            get_interpolated_recomb(logt, cool_recombHeP, cool_RecombHeP) * He.nHep +
-            get_interpolated_recomb(logt, cool_recombHePP, cool_RecombHePP) * He.nHepp);
+    double LambdaCollis = nebynh * (rt->collisH0 * nH0 + rt->collisHe0 * He.nHe0 + rt->collisHeP * He.nHep);
+    double LambdaRecomb = nebynh * (rt->recombHp * nHp + rt->recombHeP * He.nHep + rt->recombHePP * He.nHepp);
     /*Free-free cooling rate*/
     double LambdaFF = 0;
 
-    double cff = get_interpolated_recomb(logt, cool_freefree1, cool_FreeFree1);
+    double cff = rt->freefree1;
 
     if(CoolingParams.cooling == Enzo2Nyx) {
         LambdaFF = nebynh * (cff * (nHp + He.nHep) + cool_FreeFree(temp, 2) * He.nHepp);
@@ -1309,6 +1444,194 @@ get_heatingcooling_rate(double density, double ienergy, double helium, double re
     return LambdaNet * pow(1 - helium, 2) * density / PROTONMASS;
 }
 
+/*The net heating rate from the rate network, as get_heatingcooling_rate, without the table lookup.*/
+static double
+heatingcooling_rate_exact(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib)
+{
+    double logt;
+    struct cool_rates rt;
+    double ne = get_equilib_ne(density, ienergy, helium, &logt, uvbg, *ne_equilib);
+    get_rates_block(1, &logt, &rt, 1);
+    return heatingcooling_rate_internal(density, ienergy, helium, redshift, metallicity, uvbg, ne, logt, &rt, ne_equilib);
+}
+
+/* Returns 1 if the rates of two UVBs differ by less than tol. The reionization redshift does not affect the rates.*/
+static int
+uvbg_rates_close(const struct UVBG * a, const struct UVBG * b, const double tol)
+{
+    const double ra[7] = {a->gJH0, a->gJHep, a->gJHe0, a->epsH0, a->epsHep, a->epsHe0, a->self_shield_dens};
+    const double rb[7] = {b->gJH0, b->gJHep, b->gJHe0, b->epsH0, b->epsHep, b->epsHe0, b->self_shield_dens};
+    int i;
+    for(i = 0; i < 7; i++)
+        if(fabs(ra[i] - rb[i]) > tol * fmax(fabs(ra[i]), fabs(rb[i])))
+            return 0;
+    return 1;
+}
+
+/* Look up the net heating rate and electron abundance in the table.
+ * Returns 0 if the table does not cover this particle and the rate network should be used.*/
+static int
+cooling_table_lookup(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double * ne_equilib, double * LambdaNet)
+{
+    if(!CoolTable.valid || redshift != CoolTable.redshift || helium != CoolTable.helium || !uvbg_rates_close(uvbg, &CoolTable.curuvbg, 0))
+        return 0;
+    const double x = (log(density) - COOLTAB_LOGDMIN) / COOLTAB_DLOG;
+    const double y = (log(ienergy) - COOLTAB_LOGUMIN) / COOLTAB_DLOG;
+    if(!(x >= 0 && x < COOLTAB_NDENS - 1 && y >= 0 && y < COOLTAB_NU - 1))
+        return 0;
+    const int ix = x, iy = y;
+    if(CoolTable.exact[ix * (COOLTAB_NU - 1) + iy])
+        return 0;
+    const double fx = x - ix, fy = y - iy;
+    const int c = ix * COOLTAB_NU + iy;
+    const double L = (1 - fx) * ((1 - fy) * CoolTable.LambdaNet[c] + fy * CoolTable.LambdaNet[c + 1])
+                    + fx * ((1 - fy) * CoolTable.LambdaNet[c + COOLTAB_NU] + fy * CoolTable.LambdaNet[c + COOLTAB_NU + 1]);
+    const double nebynh = (1 - fx) * ((1 - fy) * CoolTable.ne[c] + fy * CoolTable.ne[c + 1])
+                    + fx * ((1 - fy) * CoolTable.ne[c + COOLTAB_NU] + fy * CoolTable.ne[c + COOLTAB_NU + 1]);
+    /* The table is for primordial gas: add metal cooling as in heatingcooling_rate_internal*/
+    double MetalCooling = 0;
+    if(metallicity > 0)
+        MetalCooling = metallicity * TableMetalCoolingRate(redshift, get_temp_internal(nebynh, ienergy, helium), density * (1 - helium));
+    *ne_equilib = nebynh;
+    *LambdaNet = density * (L - MetalCooling * pow(1 - helium, 2) / PROTONMASS);
+    return 1;
+}
+
+/* Compute the table at one redshift. Called on one rank per node, which uses all its threads.*/
+static void
+build_cooling_table(double redshift, const struct UVBG * uvbg, double helium, double tol)
+{
+    int i;
+    int64_t nexact = 0;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(i = 0; i < COOLTAB_NDENS; i++) {
+        const double dens = exp(COOLTAB_LOGDMIN + i * COOLTAB_DLOG);
+        double ne = 1;
+        int j;
+        for(j = 0; j < COOLTAB_NU; j++) {
+            const double u = exp(COOLTAB_LOGUMIN + j * COOLTAB_DLOG);
+            CoolTable.LambdaNet[i * COOLTAB_NU + j] = heatingcooling_rate_exact(dens, u, helium, redshift, 0, uvbg, &ne) / dens;
+            CoolTable.ne[i * COOLTAB_NU + j] = ne;
+        }
+    }
+    /* Compare the exact rate at the centre of each cell to the interpolation.
+     * The electron abundance is ~ 1 when it matters, so its error is absolute.*/
+    const int ncell = (COOLTAB_NDENS - 1) * (COOLTAB_NU - 1);
+    unsigned char * bad = (unsigned char *) mymalloc("CoolTableBad", ncell);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(i = 0; i < COOLTAB_NDENS - 1; i++) {
+        const double dens = exp(COOLTAB_LOGDMIN + (i + 0.5) * COOLTAB_DLOG);
+        int j;
+        for(j = 0; j < COOLTAB_NU - 1; j++) {
+            const int c = i * COOLTAB_NU + j;
+            const double u = exp(COOLTAB_LOGUMIN + (j + 0.5) * COOLTAB_DLOG);
+            double ne = CoolTable.ne[c];
+            const double L = heatingcooling_rate_exact(dens, u, helium, redshift, 0, uvbg, &ne) / dens;
+            const double Lint = 0.25 * (CoolTable.LambdaNet[c] + CoolTable.LambdaNet[c + 1] + CoolTable.LambdaNet[c + COOLTAB_NU] + CoolTable.LambdaNet[c + COOLTAB_NU + 1]);
+            const double neint = 0.25 * (CoolTable.ne[c] + CoolTable.ne[c + 1] + CoolTable.ne[c + COOLTAB_NU] + CoolTable.ne[c + COOLTAB_NU + 1]);
+            bad[i * (COOLTAB_NU - 1) + j] = fabs(L - Lint) > tol * fabs(L) || fabs(ne - neint) > tol;
+        }
+    }
+    /* The centre of a cell may miss a feature which crosses its corner, so also use the network next to bad cells*/
+    #pragma omp parallel for reduction(+: nexact)
+    for(i = 0; i < COOLTAB_NDENS - 1; i++) {
+        int j;
+        for(j = 0; j < COOLTAB_NU - 1; j++) {
+            int exact = 0, ii, jj;
+            for(ii = (i > 0 ? i - 1 : 0); ii <= i + 1 && ii < COOLTAB_NDENS - 1; ii++)
+                for(jj = (j > 0 ? j - 1 : 0); jj <= j + 1 && jj < COOLTAB_NU - 1; jj++)
+                    exact |= bad[ii * (COOLTAB_NU - 1) + jj];
+            CoolTable.exact[i * (COOLTAB_NU - 1) + j] = exact;
+            nexact += exact;
+        }
+    }
+    myfree(bad);
+    if(!CoolTable.valid)
+        message(0, "Cooling table at z=%g: %g of cells use the rate network\n", redshift, nexact / (double) ncell);
+}
+
+void
+update_cooling_table(double redshift, const struct UVBG * GlobalUVBG)
+{
+    const double tol = CoolingParams.CoolingTableTolerance;
+    if(tol <= 0)
+        return;
+    CoolTable.redshift = redshift;
+    CoolTable.curuvbg = *GlobalUVBG;
+    /* Compton cooling goes as (1+z)^4, so keep its change below the tolerance.*/
+    if(CoolTable.valid && fabs(log(1 + redshift) - CoolTable.log1z) < tol / 4 && uvbg_rates_close(GlobalUVBG, &CoolTable.uvbg, tol / 4))
+        return;
+
+    if(!CoolTable.Mem.data) {
+        const size_t ngrid = COOLTAB_NDENS * COOLTAB_NU;
+        const size_t ncell = (COOLTAB_NDENS - 1) * (COOLTAB_NU - 1);
+        CoolTable.fill = shared_table_alloc(&CoolTable.Mem, 2 * ngrid * sizeof(double) + ncell, GadgetComm);
+        CoolTable.LambdaNet = (double *) CoolTable.Mem.data;
+        CoolTable.ne = CoolTable.LambdaNet + ngrid;
+        CoolTable.exact = (unsigned char *) (CoolTable.ne + ngrid);
+    }
+    /* Wait for the ranks of the node to finish with the old table*/
+    shared_table_ready(&CoolTable.Mem);
+    if(CoolTable.fill)
+        build_cooling_table(redshift, GlobalUVBG, 1 - HYDROGEN_MASSFRAC, tol);
+    shared_table_ready(&CoolTable.Mem);
+    CoolTable.valid = 1;
+    CoolTable.log1z = log(1 + redshift);
+    CoolTable.uvbg = *GlobalUVBG;
+    CoolTable.helium = 1 - HYDROGEN_MASSFRAC;
+}
+
+/*Net heating rate for n <= COOLING_BLOCK particles, each with its own UVB. Arguments as for get_heatingcooling_rate.
+ * Particles not covered by the table are solved together: their ionization equilibria are iterated together,
+ * and the rate tables interpolated together.*/
+void
+get_heatingcooling_rate_block(const int n, const double * density, const double * ienergy, double helium, double redshift, const double * metallicity, const struct UVBG * const * uvbg, double *ne_equilib, double * LambdaNet)
+{
+    double pdensity[COOLING_BLOCK], pienergy[COOLING_BLOCK], nh[COOLING_BLOCK], ne[COOLING_BLOCK], logt[COOLING_BLOCK];
+    const struct UVBG * puvbg[COOLING_BLOCK];
+    struct cool_rates rt[COOLING_BLOCK];
+    int exact[COOLING_BLOCK];
+    int i, nexact = 0;
+    if(n > COOLING_BLOCK)
+        endrun(5, "Asked for %d cooling rates, more than the block size %d\n", n, COOLING_BLOCK);
+    for(i = 0; i < n; i++) {
+        if(cooling_table_lookup(density[i], ienergy[i], helium, redshift, metallicity[i], uvbg[i], &ne_equilib[i], &LambdaNet[i]))
+            continue;
+        pdensity[nexact] = density[i];
+        pienergy[nexact] = ienergy[i];
+        puvbg[nexact] = uvbg[i];
+        nh[nexact] = density[i] * (1 - helium);
+        /* As in get_equilib_ne*/
+        ne[nexact] = ne_equilib[i] > 0 ? ne_equilib[i] : 1.0;
+        exact[nexact++] = i;
+    }
+    if(nexact == 0)
+        return;
+    scipy_optimize_fixed_point_block(nexact, ne, nh, pienergy, helium, logt, puvbg);
+    get_rates_block(nexact, logt, rt, 1);
+    for(i = 0; i < nexact; i++) {
+        const int k = exact[i];
+        LambdaNet[k] = heatingcooling_rate_internal(pdensity[i], pienergy[i], helium, redshift, metallicity[k], puvbg[i], ne[i], logt[i], &rt[i], &ne_equilib[k]);
+    }
+}
+
+/*Get the total change in internal energy per unit time in erg/s/g for a given temperature (internal energy) and density.
+  density is total gas density in protons/cm^3
+  Internal energy is in ergs/g.
+  helium is a mass fraction, 1 - HYDROGEN_MASSFRAC = 0.24 for primordial gas.
+  Returns (heating - cooling) / nh^2.
+  ne_equilib is the equilibrium electron abundance in units of the hydrogen number density.
+  Note this is *not* the electron density in cgs units, as used internally.
+ */
+double
+get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib)
+{
+    double LambdaNet;
+    if(cooling_table_lookup(density, ienergy, helium, redshift, metallicity, uvbg, ne_equilib, &LambdaNet))
+        return LambdaNet;
+    return heatingcooling_rate_exact(density, ienergy, helium, redshift, metallicity, uvbg, ne_equilib);
+}
+
 /*Get the equilibrium temperature at given internal energy.
     density is total gas density in protons/cm^3
     Internal energy is in ergs/g.
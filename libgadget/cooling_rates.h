@@ -55,6 +55,10 @@ struct cooling_params
     double HeliumHeatAmp;
     double HeliumHeatExp;
     double rho_crit_baryon;
+
+    /*Relative error of the tabulated net heating rate. If > 0, rates for the uniform UVB are
+     * interpolated from a table at each redshift, see update_cooling_table. Default: 0, disabled.*/
+    double CoolingTableTolerance;
 };
 
 /*Set the parameters for the cooling module from the parameter file.*/
@@ -62,6 +66,9 @@ void set_cooling_params(ParameterSet * ps);
 /*Set cooling module parameters from a cooling_params struct for the tests*/
 void set_coolpar(struct cooling_params cp);
 
+/* Start reading the UVB tables on rank 0 in the background. Optional: init_cooling_rates reads them if this was not called.*/
+void prefetch_cooling_rates(const char * TreeCoolFile, const char * J21CoeffFile);
+
 /*Initialize the cooling rate module. This builds a lot of interpolation tables.
  * Defaults: TCMB 2.7255, recomb = Verner96, cooling = Sherwood.*/
 void init_cooling_rates(const char * TreeCoolFile, const char * J21CoeffFile, const char * MetalCoolFile, Cosmology * CP);
@@ -91,6 +98,15 @@ double get_ne_by_nh(double density, double ienergy, double helium, const struct
  */
 double get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double * ne_equilib);
 
+/* Collective. If CoolingTableTolerance > 0, recompute the table of net heating rates for the uniform UVB
+ * if the redshift or the UVB has moved too far from the table. Rates for this redshift and UVB are then
+ * interpolated from the table, except where the interpolation error is too large.*/
+void update_cooling_table(double redshift, const struct UVBG * GlobalUVBG);
+
+/* As above for n <= COOLING_BLOCK particles, each with its own UVB. The rate network is solved and
+ * the rate tables interpolated for all particles together. Net rates are stored in LambdaNet.*/
+void get_heatingcooling_rate_block(const int n, const double * density, const double * ienergy, double helium, double redshift, const double * metallicity, const struct UVBG * const * uvbg, double * ne_equilib, double * LambdaNet);
+
 enum CoolProcess {
     RECOMB,
     COLLIS,
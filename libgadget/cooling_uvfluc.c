@@ -13,12 +13,15 @@
 #include "utils/mymalloc.h"
 #include "utils/interp.h"
 #include "utils/endrun.h"
+#include "utils/system.h"
 #include "utils/paramset.h"
+#include "utils/sharedtable.h"
 
 static struct {
     int enabled;
     Interp interp;
     double * Table;
+    struct shared_table TableMem;
     ptrdiff_t Nside;
 } UVF;
 
@@ -32,7 +35,7 @@ static struct UVFparams{
 //set the parameters we need for the excursion set option
 void set_uvf_params(ParameterSet * ps){
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask==0)
     {
         uvf_params.ExcursionSetReionOn = param_get_int(ps,"ExcursionSetReionOn");
@@ -40,19 +43,20 @@ void set_uvf_params(ParameterSet * ps){
         uvf_params.AlphaUV = param_get_double(ps,"AlphaUV");
     }
 
-    MPI_Bcast(&uvf_params, sizeof(struct UVFparams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&uvf_params, sizeof(struct UVFparams), MPI_BYTE, 0, GadgetComm);
     return;
 }
 
-/* Read a big array from filename/dataset into an array, allocating memory in buffer.
- * which is returned. Nread argument is set equal to number of elements read.*/
+/* Read a big array from filename/dataset into st, a table in memory shared by the ranks of each node,
+ * and return its data. Nread argument is set equal to number of elements read.
+ * The table is read on rank 0 and sent once to each node, rather than to every rank.*/
 static double *
-read_big_array(const char * filename, const char * dataset, int * Nread)
+read_big_array(const char * filename, const char * dataset, int * Nread, struct shared_table * st)
 {
-    int N;
+    int N = 0;
     double * buffer=NULL;
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
 
     if(ThisTask == 0) {
         BigFile bf[1];
@@ -82,19 +86,17 @@ read_big_array(const char * filename, const char * dataset, int * Nread)
 
         if(0 != big_block_read(bb, &ptr, array))
             endrun(1, "Failed to read %s %s: %s", filename, dataset, big_file_get_error_message());
-        /* steal the buffer */
         big_block_close(bb);
         big_file_close(bf);
     }
 
-    MPI_Bcast(&N, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    if(ThisTask != 0)
-        buffer = (double *) mymalloc("cooling_data",N * sizeof(double));
-
-    MPI_Bcast(buffer, N, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&N, 1, MPI_INT, 0, GadgetComm);
+    shared_table_bcast(st, buffer, N * sizeof(double), GadgetComm);
+    if(ThisTask == 0)
+        myfree(buffer);
 
     *Nread = N;
-    return buffer;
+    return (double *) st->data;
 }
 
 /* The UV fluctation file is a bigfile with these tables:
@@ -108,7 +110,7 @@ read_big_array(const char * filename, const char * dataset, int * Nread)
  * the reionization redshift as function of space, on a grid give by
  * XYZ_Bins.
  *
- * Notice that this table is broadcast to all MPI ranks, thus it can't be
+ * Notice that this table is held by every node, thus it can't be
  * too big. (400x400x400 is around 400 MBytes)
  *
  * */
@@ -123,12 +125,12 @@ init_uvf_table(const char * UVFluctuationFile, const int UVFlucLen, const double
     /* Open and validate the UV fluctuation file*/
     BigFile bf;
     BigBlock bh;
-    if(0 != big_file_mpi_open(&bf, UVFluctuationFile, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_open(&bf, UVFluctuationFile, GadgetComm)) {
         endrun(0, "Failed to open snapshot at %s:%s\n", UVFluctuationFile,
                     big_file_get_error_message());
     }
 
-    if(0 != big_file_mpi_open_block(&bf, &bh, "Zreion_Table", MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_open_block(&bf, &bh, "Zreion_Table", GadgetComm)) {
         endrun(0, "Failed to create block at %s:%s\n", "Header",
                     big_file_get_error_message());
     }
@@ -137,11 +139,11 @@ init_uvf_table(const char * UVFluctuationFile, const int UVFlucLen, const double
     if ((0 != big_block_get_attr(&bh, "Nmesh", &UVF.Nside, "u8", 1)) ||
         (0 != big_block_get_attr(&bh, "BoxSize", &TableBoxSize, "f8", 1)) ||
         (0 != big_block_get_attr(&bh, "Redshift", &ReionRedshift, "f8", 1)) ||
-        (0 != big_block_mpi_close(&bh, MPI_COMM_WORLD))) {
+        (0 != big_block_mpi_close(&bh, GadgetComm))) {
         endrun(0, "Failed to close block: %s\n",
                     big_file_get_error_message());
     }
-    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    big_file_mpi_close(&bf, GadgetComm);
     double BoxMpc = BoxSize * UnitLength_in_cm / CM_PER_MPC;
     if(fabs(TableBoxSize - BoxMpc) > BoxMpc * 1e-5)
         endrun(0, "Wrong UV fluctuation file! %s is for box size %g Mpc/h, but current box is %g Mpc/h\n", UVFluctuationFile, TableBoxSize, BoxMpc);
@@ -150,7 +152,7 @@ init_uvf_table(const char * UVFluctuationFile, const int UVFlucLen, const double
     UVF.enabled = 1;
 
     int size;
-    UVF.Table = read_big_array(UVFluctuationFile, "Zreion_Table", &size);
+    UVF.Table = read_big_array(UVFluctuationFile, "Zreion_Table", &size, &UVF.TableMem);
 
     if(UVF.Nside * UVF.Nside * UVF.Nside != size)
         endrun(0, "Corrupt UV Fluctuation table: Nside = %ld, but table is %d != %ld^3\n", UVF.Nside, size, UVF.Nside);
@@ -258,6 +260,8 @@ struct {
     double * Temperature_bins;
 
     double * Lmet_table; /* metal cooling @ one solar metalicity*/
+    /* Node shared memory holding the tables above*/
+    struct shared_table Mem[4];
 
     Interp interp;
 } MetalCool;
@@ -281,18 +285,19 @@ InitMetalCooling(const char * MetalCoolFile)
     }
 
     int size;
+    struct shared_table metmem;
     //This is never used if MetalCoolFile == ""
-    double * tabbedmet = read_big_array(MetalCoolFile, "MetallicityInSolar_bins", &size);
+    double * tabbedmet = read_big_array(MetalCoolFile, "MetallicityInSolar_bins", &size, &metmem);
 
     if(size != 1 || tabbedmet[0] != 0.0) {
         endrun(123, "MetalCool file %s is wrongly tabulated\n", MetalCoolFile);
     }
-    myfree(tabbedmet);
+    shared_table_free(&metmem);
 
-    MetalCool.Redshift_bins = read_big_array(MetalCoolFile, "Redshift_bins", &MetalCool.NRedshift_bins);
-    MetalCool.HydrogenNumberDensity_bins = read_big_array(MetalCoolFile, "HydrogenNumberDensity_bins", &MetalCool.NHydrogenNumberDensity_bins);
-    MetalCool.Temperature_bins = read_big_array(MetalCoolFile, "Temperature_bins", &MetalCool.NTemperature_bins);
-    MetalCool.Lmet_table = read_big_array(MetalCoolFile, "NetCoolingRate", &size);
+    MetalCool.Redshift_bins = read_big_array(MetalCoolFile, "Redshift_bins", &MetalCool.NRedshift_bins, &MetalCool.Mem[0]);
+    MetalCool.HydrogenNumberDensity_bins = read_big_array(MetalCoolFile, "HydrogenNumberDensity_bins", &MetalCool.NHydrogenNumberDensity_bins, &MetalCool.Mem[1]);
+    MetalCool.Temperature_bins = read_big_array(MetalCoolFile, "Temperature_bins", &MetalCool.NTemperature_bins, &MetalCool.Mem[2]);
+    MetalCool.Lmet_table = read_big_array(MetalCoolFile, "NetCoolingRate", &size, &MetalCool.Mem[3]);
 
     int64_t dims[] = {MetalCool.NRedshift_bins, MetalCool.NHydrogenNumberDensity_bins, MetalCool.NTemperature_bins};
 
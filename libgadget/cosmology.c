@@ -1,7 +1,9 @@
 #include <math.h>
+#include <stdlib.h>
 #include <gsl/gsl_integration.h>
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_odeiv2.h>
+#include <gsl/gsl_interp.h>
 
 #include "cosmology.h"
 #include "physconst.h"
@@ -12,8 +14,26 @@
 
 static inline double OmegaFLD(const Cosmology * CP, const double a);
 
+/* Splines of the background in log a, built by init_cosmology_tables for one Cosmology.*/
+static struct {
+    const Cosmology * CP;
+    int n;
+    double * loga;
+    double * logD; /* log of the growth factor*/
+    double * fomega; /* d ln D / d ln a*/
+    double * chi; /* comoving distance to the last entry, in units of c/H0*/
+    gsl_interp * interp[3];
+} CosmoTab;
+
+/* Relative accuracy of the tables, checked half way between the entries*/
+#define COSMO_TAB_ACC 1e-6
+#define COSMO_TAB_MAXN (1 << 16)
+
 void init_cosmology(Cosmology * CP, const double TimeBegin, const struct UnitSystem units)
 {
+    /* Tables of the old cosmology are no longer valid*/
+    if(CosmoTab.CP == CP)
+        CosmoTab.CP = NULL;
     CP->Hubble = HUBBLE * units.UnitTime_in_s;
     CP->UnitTime_in_s = units.UnitTime_in_s;
     CP->GravInternal = GRAVITY / pow(units.UnitLength_in_cm, 3) * units.UnitMass_in_g * pow(units.UnitTime_in_s, 2);
@@ -87,8 +107,26 @@ double hubble_function(const Cosmology * CP, double a)
 
 static double growth(Cosmology * CP, double a, double *dDda);
 
+/* Evaluate table i at log a, if tables exist for CP and cover a.*/
+static int
+cosmo_tab_eval(const Cosmology * CP, const int i, const double a, double * value)
+{
+    if(CosmoTab.CP != CP || a <= 0)
+        return 0;
+    const double loga = log(a);
+    if(loga < CosmoTab.loga[0] || loga > CosmoTab.loga[CosmoTab.n - 1])
+        return 0;
+    const double * y[3] = {CosmoTab.logD, CosmoTab.fomega, CosmoTab.chi};
+    /* No accelerator, so this is thread safe*/
+    *value = gsl_interp_eval(CosmoTab.interp[i], CosmoTab.loga, y[i], loga, NULL);
+    return 1;
+}
+
 double GrowthFactor(Cosmology * CP, double astart, double aend)
 {
+    double logDstart, logDend;
+    if(cosmo_tab_eval(CP, 0, astart, &logDstart) && cosmo_tab_eval(CP, 0, aend, &logDend))
+        return exp(logDstart - logDend);
     return growth(CP, astart, NULL) / growth(CP, aend, NULL);
 }
 
@@ -116,7 +154,9 @@ int growth_ode(double a, const double yy[], double dyda[], void * params)
  * Define F = a^3 H dD/da
  * and we have: dF/da = 1.5 a H D
  */
-double growth(Cosmology * CP, double a, double * dDda)
+/* Integrate the growth ODE through n increasing scale factors, storing D and dD/da at each.*/
+static void
+growth_integrate(Cosmology * CP, const double * a, const int n, double * D, double * dDda)
 {
   gsl_odeiv2_system FF;
   FF.function = &growth_ode;
@@ -127,8 +167,8 @@ double growth(Cosmology * CP, double a, double * dDda)
    /* We start early to avoid lambda.*/
   double curtime = 1e-5;
   /* Handle even earlier times*/
-  if(a < curtime)
-      curtime = a / 10;
+  if(a[0] < curtime)
+      curtime = a[0] / 10;
   /* Initial velocity chosen so that D = Omegar + 3/2 Omega_m a,
    * the solution for a matter/radiation universe.*
    * Note the normalisation of D is arbitrary
@@ -137,16 +177,25 @@ double growth(Cosmology * CP, double a, double * dDda)
   if(CP->RadiationOn)
       yinit[0] += CP->OmegaG/pow(curtime, 4)+get_omega_nu(&CP->ONu, curtime);
 
-  int stat = gsl_odeiv2_driver_apply(drive, &curtime,a, yinit);
-  if (stat != GSL_SUCCESS) {
-      endrun(1,"gsl_odeiv in growth: %d. Result at %g is %g %g\n",stat, curtime, yinit[0], yinit[1]);
+  int i;
+  for(i = 0; i < n; i++) {
+      int stat = gsl_odeiv2_driver_apply(drive, &curtime, a[i], yinit);
+      if (stat != GSL_SUCCESS) {
+          endrun(1,"gsl_odeiv in growth: %d. Result at %g is %g %g\n",stat, curtime, yinit[0], yinit[1]);
+      }
+      D[i] = yinit[0];
+      /*Store derivative of D if needed.*/
+      if(dDda)
+          dDda[i] = yinit[1]/pow(a[i],3)/(hubble_function(CP, a[i])/CP->Hubble);
   }
   gsl_odeiv2_driver_free(drive);
-  /*Store derivative of D if needed.*/
-  if(dDda) {
-      *dDda = yinit[1]/pow(a,3)/(hubble_function(CP, a)/CP->Hubble);
-  }
-  return yinit[0];
+}
+
+double growth(Cosmology * CP, double a, double * dDda)
+{
+    double D;
+    growth_integrate(CP, &a, 1, &D, dDda);
+    return D;
 }
 
 /*
@@ -155,11 +204,128 @@ double growth(Cosmology * CP, double a, double * dDda)
  */
 double F_Omega(Cosmology * CP, double a)
 {
+    double fomega;
+    if(cosmo_tab_eval(CP, 1, a, &fomega))
+        return fomega;
     double dD1da=0;
     double D1 = growth(CP, a, &dD1da);
     return a / D1 * dD1da;
 }
 
+/* Integrand of the comoving distance in units of c/H0*/
+static double
+comoving_distance_integ(double a, void * param)
+{
+    Cosmology * CP = (Cosmology *) param;
+    return CP->Hubble / (hubble_function(CP, a) * a * a);
+}
+
+static double
+comoving_distance_direct(const Cosmology * CP, const double a0, const double a1)
+{
+    double result, abserr;
+    gsl_function F;
+    gsl_integration_workspace * workspace = gsl_integration_workspace_alloc(1000);
+    F.function = comoving_distance_integ;
+    F.params = (void *) CP;
+    gsl_integration_qag(&F, a0, a1, 0, 1.0e-8, 1000, GSL_INTEG_GAUSS61, workspace, &result, &abserr);
+    gsl_integration_workspace_free(workspace);
+    return result;
+}
+
+/* Function to compute the comoving distance between two scale factors */
+double compute_comoving_distance(const Cosmology * CP, double a0, double a1, const double UnitVelocity_in_cm_per_s)
+{
+    double chi0, chi1, chi;
+    if(cosmo_tab_eval(CP, 2, a0, &chi0) && cosmo_tab_eval(CP, 2, a1, &chi1))
+        chi = chi0 - chi1;
+    else
+        chi = comoving_distance_direct(CP, a0, a1);
+    /* chi is in units of c/H0*/
+    return (LIGHTCGS/UnitVelocity_in_cm_per_s) / CP->Hubble * chi;
+}
+
+/* Fill the tables with n entries, and return the largest relative error of the splines half way between them.*/
+static double
+cosmo_tab_fill(Cosmology * CP, const double amin, const double amax, const int n)
+{
+    int i, j;
+    const double dloga = (log(amax) - log(amin)) / (n - 1);
+    double * a = (double *) malloc(sizeof(double) * 4 * n);
+    double * mid = a + n;
+    double * D = a + 2 * n;
+    double * dDda = a + 3 * n;
+
+    CosmoTab.n = n;
+    CosmoTab.loga = (double *) realloc(CosmoTab.loga, sizeof(double) * 4 * n);
+    CosmoTab.logD = CosmoTab.loga + n;
+    CosmoTab.fomega = CosmoTab.loga + 2 * n;
+    CosmoTab.chi = CosmoTab.loga + 3 * n;
+    for(i = 0; i < n; i++) {
+        CosmoTab.loga[i] = log(amin) + i * dloga;
+        a[i] = exp(CosmoTab.loga[i]);
+    }
+    /* Avoid rounding the ends out of the range*/
+    CosmoTab.loga[n-1] = log(amax);
+    a[0] = amin;
+    a[n-1] = amax;
+
+    growth_integrate(CP, a, n, D, dDda);
+    for(i = 0; i < n; i++) {
+        CosmoTab.logD[i] = log(D[i]);
+        CosmoTab.fomega[i] = a[i] / D[i] * dDda[i];
+    }
+    CosmoTab.chi[n-1] = 0;
+    for(i = n - 2; i >= 0; i--)
+        CosmoTab.chi[i] = CosmoTab.chi[i+1] + comoving_distance_direct(CP, a[i], a[i+1]);
+
+    const double * y[3] = {CosmoTab.logD, CosmoTab.fomega, CosmoTab.chi};
+    for(j = 0; j < 3; j++) {
+        if(CosmoTab.interp[j])
+            gsl_interp_free(CosmoTab.interp[j]);
+        CosmoTab.interp[j] = gsl_interp_alloc(gsl_interp_cspline, n);
+        gsl_interp_init(CosmoTab.interp[j], CosmoTab.loga, y[j], n);
+    }
+
+    /* Compare with the direct calculation half way between the entries*/
+    for(i = 0; i < n - 1; i++)
+        mid[i] = exp(CosmoTab.loga[i] + dloga / 2);
+    growth_integrate(CP, mid, n - 1, D, dDda);
+    double maxerr = 0;
+    for(i = 0; i < n - 1; i++) {
+        const double loga = CosmoTab.loga[i] + dloga / 2;
+        double err[3];
+        err[0] = fabs(exp(gsl_interp_eval(CosmoTab.interp[0], CosmoTab.loga, CosmoTab.logD, loga, NULL)) / D[i] - 1);
+        err[1] = fabs(gsl_interp_eval(CosmoTab.interp[1], CosmoTab.loga, CosmoTab.fomega, loga, NULL) * D[i] / (mid[i] * dDda[i]) - 1);
+        /* The distance at the last entry is zero, so compare the distance across the interval*/
+        const double chi = CosmoTab.chi[i+1] + comoving_distance_direct(CP, mid[i], a[i+1]);
+        err[2] = fabs(gsl_interp_eval(CosmoTab.interp[2], CosmoTab.loga, CosmoTab.chi, loga, NULL) - chi) / (CosmoTab.chi[i] - CosmoTab.chi[i+1]);
+        for(j = 0; j < 3; j++)
+            if(err[j] > maxerr)
+                maxerr = err[j];
+    }
+    free(a);
+    return maxerr;
+}
+
+void init_cosmology_tables(Cosmology * CP, double amin, double amax)
+{
+    CosmoTab.CP = NULL;
+    if(amin <= 0 || amax <= amin)
+        endrun(1, "Cannot tabulate the cosmology between a = %g and %g\n", amin, amax);
+    int n = 64;
+    double err;
+    /* Refine until the splines are accurate*/
+    while((err = cosmo_tab_fill(CP, amin, amax, n)) > COSMO_TAB_ACC && 2 * n <= COSMO_TAB_MAXN)
+        n *= 2;
+    if(err > COSMO_TAB_ACC) {
+        message(0, "Cosmology tables with %d entries have error %g: using the direct calculation.\n", n, err);
+        return;
+    }
+    CosmoTab.CP = CP;
+    message(0, "Tabulated the growth factor and comoving distance between a = %g and %g with %d entries, error %g.\n", amin, amax, n, err);
+}
+
 /*Dark energy density as a function of time:
  * OmegaFLD(a)  ~ exp(-3 int((1+w(a))/a da)^a_1
  * and w(a) = w0 + (1-a) wa*/
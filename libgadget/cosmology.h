@@ -55,8 +55,15 @@ double function_of_k_tophat_sigma(FunctionOfK * fk, double R);
 double hubble_function(const Cosmology * CP, double a);
 /* Linear theory growth factor between astart and aend. */
 double GrowthFactor(Cosmology * CP, double astart, double aend);
-/*Note this is only used in GenIC*/
+/* Linear growth rate, d ln D / d ln a*/
 double F_Omega(Cosmology * CP, double a);
+/* Comoving distance between scale factors a0 and a1, in internal length units*/
+double compute_comoving_distance(const Cosmology * CP, double a0, double a1, const double UnitVelocity_in_cm_per_s);
+/* Tabulate the growth factor, growth rate and comoving distance in log a between amin and amax.
+ * The tables are refined until they agree with the direct calculation,
+ * and are then used by the functions above for this CP and scale factors in range.
+ * CP must not be changed afterwards.*/
+void init_cosmology_tables(Cosmology * CP, double amin, double amax);
 /* Returns 1 if the neutrino particles are 'tracers', not actively gravitating,
  * and 0 if they are actively gravitating particles.*/
 int hybrid_nu_tracer(const Cosmology * CP, double atime);
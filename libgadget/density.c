@@ -31,12 +31,14 @@ void
 set_density_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         DensityParams.DensityKernelType = (enum DensityKernelType) param_get_enum(ps, "DensityKernelType");
         DensityParams.MaxNumNgbDeviation = param_get_double(ps, "MaxNumNgbDeviation");
         DensityParams.DensityResolutionEta = param_get_double(ps, "DensityResolutionEta");
         DensityParams.MinGasHsmlFractional = param_get_double(ps, "MinGasHsmlFractional");
+        DensityParams.HsmlCandidates = param_get_int(ps, "DensityHsmlCandidates");
+        DensityParams.Offload = param_get_int(ps, "DensityOffload");
 
         DensityKernel kernel;
         density_kernel_init(&kernel, 1.0, DensityParams.DensityKernelType);
@@ -47,7 +49,7 @@ set_density_params(ParameterSet * ps)
         DensityParams.BlackHoleNgbFactor = param_get_double(ps, "BlackHoleNgbFactor");
         DensityParams.BlackHoleMaxAccretionRadius = param_get_double(ps, "BlackHoleMaxAccretionRadius");
     }
-    MPI_Bcast(&DensityParams, sizeof(struct density_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&DensityParams, sizeof(struct density_params), MPI_BYTE, 0, GadgetComm);
 }
 
 double
@@ -131,12 +133,28 @@ init_kick_factor_data(struct kick_factor_data * kf, const DriftKickTimes * const
     }
 }
 
+/* Number of trial smoothing lengths, as fractions of the current Hsml,
+ * at which the neighbour number is also measured. These let the Hsml loop
+ * interpolate to the desired neighbour number instead of bisecting.*/
+#define NHSMLCAND 4
+static const double HsmlCandFrac[NHSMLCAND] = {0.6, 0.7, 0.8, 0.9};
+/* Safeguards on the interpolated Hsml, as for a bracketed secant. Once the bracket is closed,
+ * bisect if the last step did not shrink it to HSMLBRACKETSHRINK of its old width, or if the
+ * guess is within HSMLEDGEFRAC of the width from either end. Otherwise on a lattice the guesses
+ * can alternate just inside Left and Right without the bracket ever shrinking.*/
+#define HSMLBRACKETSHRINK 0.5
+#define HSMLEDGEFRAC 0.01
+
 /*! Structure for communication during the density computation. Holds data that is sent to other processors.
 */
 typedef struct {
     TreeWalkNgbIterBase base;
     DensityKernel kernel;
     double kernel_volume;
+    /* Kernels for the candidate smoothing lengths. ncand is 0 if disabled.*/
+    DensityKernel candkernel[NHSMLCAND];
+    double candvolume[NHSMLCAND];
+    int ncand;
 } TreeWalkNgbIterDensity;
 
 typedef struct
@@ -145,7 +163,8 @@ typedef struct
     double Vel[3];
     MyFloat Hsml;
     int Type;
-    int alignment;
+    /* Compute the density gradient for this particle*/
+    int GradRho;
 } TreeWalkQueryDensity;
 
 typedef struct {
@@ -162,18 +181,62 @@ typedef struct {
     MyFloat Rot[3];
     /*Only used if sfr_need_to_compute_sph_grad_rho is true*/
     MyFloat GradRho[3];
+    /* Neighbour number at each candidate smoothing length*/
+    MyFloat NgbCand[NHSMLCAND];
 } TreeWalkResultDensity;
 
+/* Device copy of the local gas tree, for the offloaded density walk (see density_offload_init).
+ * Nodes are in walk order, so the first child of a node is the next node.*/
+struct DensityOffloadNode {
+    double center[3];
+    double len;
+    int sibling;
+    /* The gas of a leaf is Parts[first, first + noccupied)*/
+    int first;
+    int noccupied;
+    int ChildType;
+    int HasGas;
+};
+
+struct DensityOffloadPart {
+    double Pos[3];
+    double VelPred[3];
+    double Mass;
+    double EntVarPred;
+    /* Decoupled winds are excluded from the density of black holes*/
+    int Decoupled;
+};
+
+struct DensityOffloadConsts {
+    /* Kernel with H = 1*/
+    DensityKernel unit;
+    double CandFrac[NHSMLCAND];
+    int ncand;
+    int DoEgyDensity;
+    double BoxSize;
+};
+
+struct DensityOffload {
+    struct DensityOffloadNode * Nodes;
+    int64_t NumNodes;
+    struct DensityOffloadPart * Parts;
+    int64_t NumParts;
+    struct DensityOffloadConsts c;
+};
+
 struct DensityPriv {
     /* Predicted quantities computed during for density and reused during hydro.*/
     struct sph_pred_data * SPH_predicted;
     /* The gradient of the density, used sometimes during star formation.
-     * May be NULL.*/
+     * Stored only for the particles in GradRhoIndex. May be NULL.*/
     MyFloat * GradRho;
+    int * GradRhoIndex;
     /* Current number of neighbours*/
     MyFloat *NumNgb;
     /* Lower and upper bounds on smoothing length*/
     MyFloat *Left, *Right;
+    /* Neighbour numbers at the candidate smoothing lengths. May be NULL.*/
+    MyFloat (*NgbCand)[NHSMLCAND];
     MyFloat (*Rot)[3];
     /* This is the DhsmlDensityFactor for the pure density,
      * not the entropy weighted density.
@@ -193,6 +256,8 @@ struct DensityPriv {
     /* For computing the predicted quantities dynamically during the treewalk.*/
     DriftKickTimes const * times;
     struct kick_factor_data kf;
+    /* Device copy of the local gas, if the local walk is offloaded. May be NULL.*/
+    struct DensityOffload * Offload;
 };
 
 #define DENSITY_GET_PRIV(tw) ((struct DensityPriv*) ((tw)->priv))
@@ -204,6 +269,14 @@ density_ngbiter(
         TreeWalkNgbIterDensity * iter,
         LocalTreeWalk * lv);
 
+static void
+density_ngbiter_batch(
+        TreeWalkQueryDensity * I,
+        TreeWalkResultDensity * O,
+        TreeWalkNgbIterDensity * iter,
+        const TreeWalkNgbBatch * batch,
+        LocalTreeWalk * lv);
+
 static int density_haswork(int n, TreeWalk * tw);
 static void density_postprocess(int i, TreeWalk * tw);
 static int density_check_neighbours(int i, TreeWalk * tw);
@@ -211,6 +284,11 @@ static int density_check_neighbours(int i, TreeWalk * tw);
 static void density_reduce(int place, TreeWalkResultDensity * remote, enum TreeWalkReduceMode mode, TreeWalk * tw);
 static void density_copy(int place, TreeWalkQueryDensity * I, TreeWalk * tw);
 
+static void density_offload_init(struct DensityOffload * off, const ForceTree * tree, struct DensityPriv * priv);
+static void density_offload_free(struct DensityOffload * off);
+static void density_offload_begin(const TreeWalkQueryDensity * queries, TreeWalkResultDensity * results, int * ninteractions, const int64_t nquery, TreeWalk * tw);
+static void density_offload_end(TreeWalk * tw);
+
 /*! \file density.c
  *  \brief SPH density computation and smoothing length determination
  *
@@ -232,7 +310,7 @@ static void density_copy(int place, TreeWalkQueryDensity * I, TreeWalk * tw);
  * neighbours.)
  */
 void
-density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int BlackHoleOn, const DriftKickTimes times, Cosmology * CP, struct sph_pred_data * SPH_predicted, MyFloat * GradRho_mag, const ForceTree * const tree)
+density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int BlackHoleOn, const DriftKickTimes times, Cosmology * CP, struct sph_pred_data * SPH_predicted, struct sph_grad_rho * GradRho, const ForceTree * const tree)
 {
     TreeWalk tw[1] = {{0}};
     struct DensityPriv priv[1];
@@ -242,6 +320,7 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
     tw->NoNgblist = 1;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterDensity);
     tw->ngbiter = (TreeWalkNgbIterFunction) density_ngbiter;
+    tw->ngbiter_batch = (TreeWalkNgbBatchFunction) density_ngbiter_batch;
     tw->haswork = density_haswork;
     tw->fill = (TreeWalkFillQueryFunction) density_copy;
     tw->reduce = (TreeWalkReduceResultFunction) density_reduce;
@@ -250,6 +329,15 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
     tw->result_type_elsize = sizeof(TreeWalkResultDensity);
     tw->priv = priv;
     tw->tree = tree;
+    tw->UseExportPlan = 1;
+    /* The offloaded walk does not use the neighbour cache*/
+    tw->UseNgbCache = !DensityParams.Offload;
+    tw->WorkSteal = 1;
+    tw->StoreNgbCost = 1;
+    if(DensityParams.Offload) {
+        tw->offload_begin = (TreeWalkOffloadBeginFunction) density_offload_begin;
+        tw->offload_end = density_offload_end;
+    }
 
     DENSITY_GET_PRIV(tw)->Left = (MyFloat *) mymalloc("DENS_PRIV->Left", PartManager->NumPart * sizeof(MyFloat));
     DENSITY_GET_PRIV(tw)->Right = (MyFloat *) mymalloc("DENS_PRIV->Right", PartManager->NumPart * sizeof(MyFloat));
@@ -257,6 +345,10 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
     DENSITY_GET_PRIV(tw)->Rot = (MyFloat (*) [3]) mymalloc("DENS_PRIV->Rot", SlotsManager->info[0].size * sizeof(priv->Rot[0]));
     /* This one stores the gradient for h finding. The factor stored in SPHP->DhsmlEgyDensityFactor depends on whether PE SPH is enabled.*/
     DENSITY_GET_PRIV(tw)->DhsmlDensityFactor = (MyFloat *) mymalloc("DENSITY_GET_PRIV(tw)->DhsmlDensity", PartManager->NumPart * sizeof(MyFloat));
+    if(update_hsml && DensityParams.HsmlCandidates)
+        DENSITY_GET_PRIV(tw)->NgbCand = (MyFloat (*) [NHSMLCAND]) mymalloc("DENS_PRIV->NgbCand", PartManager->NumPart * sizeof(priv->NgbCand[0]));
+    else
+        DENSITY_GET_PRIV(tw)->NgbCand = NULL;
 
     DENSITY_GET_PRIV(tw)->update_hsml = update_hsml;
     DENSITY_GET_PRIV(tw)->DoEgyDensity = DoEgyDensity;
@@ -266,10 +358,12 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
 
     DENSITY_GET_PRIV(tw)->BlackHoleOn = BlackHoleOn;
     DENSITY_GET_PRIV(tw)->SPH_predicted = SPH_predicted;
-    if(GradRho_mag)
-        DENSITY_GET_PRIV(tw)->GradRho = (MyFloat *) mymalloc("SPH_GradRho", sizeof(MyFloat) * 3 * SlotsManager->info[0].size);
-    else
-        DENSITY_GET_PRIV(tw)->GradRho = NULL;
+    DENSITY_GET_PRIV(tw)->GradRho = NULL;
+    DENSITY_GET_PRIV(tw)->GradRhoIndex = NULL;
+    if(GradRho && GradRho->Index) {
+        DENSITY_GET_PRIV(tw)->GradRho = (MyFloat *) mymalloc("SPH_GradRho", sizeof(MyFloat) * 3 * GradRho->NumGrad);
+        DENSITY_GET_PRIV(tw)->GradRhoIndex = GradRho->Index;
+    }
 
     int i;
     /* Init Left and Right: this has to be done before treewalk */
@@ -281,6 +375,8 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
         DENSITY_GET_PRIV(tw)->Right[p_i] = tree->BoxSize;
         DENSITY_GET_PRIV(tw)->NumNgb[p_i] = 0;
         DENSITY_GET_PRIV(tw)->Left[p_i] = 0;
+        /* Accumulated over the density iterations and the hydro force*/
+        P[p_i].NgbCost = 0;
     }
 
     init_kick_factor_data(&priv->kf, &times, CP);
@@ -311,22 +407,34 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
 
     /* allocate buffers to arrange communication */
 
+    struct DensityOffload offload[1];
+    priv->Offload = NULL;
+    if(DensityParams.Offload) {
+        density_offload_init(offload, tree, priv);
+        priv->Offload = offload;
+    }
+
     walltime_measure("/SPH/Density/Init");
 
     /* Do the treewalk with looping for hsml*/
     treewalk_do_hsml_loop(tw, act->ActiveParticle, act->NumActiveParticle, update_hsml);
 
-    if(GradRho_mag) {
+    if(priv->Offload)
+        density_offload_free(priv->Offload);
+
+    if(DENSITY_GET_PRIV(tw)->GradRho) {
         #pragma omp parallel for
-        for(i = 0; i < SlotsManager->info[0].size; i++)
+        for(i = 0; i < GradRho->NumGrad; i++)
         {
             MyFloat * gr = DENSITY_GET_PRIV(tw)->GradRho + (3*i);
-            GradRho_mag[i] = sqrt(gr[0]*gr[0] + gr[1] * gr[1] + gr[2] * gr[2]);
+            GradRho->Mag[i] = sqrt(gr[0]*gr[0] + gr[1] * gr[1] + gr[2] * gr[2]);
         }
     }
 
     if(DENSITY_GET_PRIV(tw)->GradRho)
         myfree(DENSITY_GET_PRIV(tw)->GradRho);
+    if(DENSITY_GET_PRIV(tw)->NgbCand)
+        myfree(DENSITY_GET_PRIV(tw)->NgbCand);
     myfree(DENSITY_GET_PRIV(tw)->DhsmlDensityFactor);
     myfree(DENSITY_GET_PRIV(tw)->Rot);
     myfree(DENSITY_GET_PRIV(tw)->NumNgb);
@@ -355,6 +463,7 @@ density_copy(int place, TreeWalkQueryDensity * I, TreeWalk * tw)
     I->Hsml = P[place].Hsml;
 
     I->Type = P[place].Type;
+    I->GradRho = DENSITY_GET_PRIV(tw)->GradRhoIndex && P[place].Type == 0 && DENSITY_GET_PRIV(tw)->GradRhoIndex[P[place].PI] >= 0;
 
     if(P[place].Type != 0)
     {
@@ -371,6 +480,11 @@ density_reduce(int place, TreeWalkResultDensity * remote, enum TreeWalkReduceMod
 {
     TREEWALK_REDUCE(DENSITY_GET_PRIV(tw)->NumNgb[place], remote->Ngb);
     TREEWALK_REDUCE(DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[place], remote->DhsmlDensity);
+    if(DENSITY_GET_PRIV(tw)->NgbCand) {
+        int k;
+        for(k = 0; k < NHSMLCAND; k++)
+            TREEWALK_REDUCE(DENSITY_GET_PRIV(tw)->NgbCand[place][k], remote->NgbCand[k]);
+    }
 
     if(P[place].Type == 0)
     {
@@ -382,12 +496,11 @@ density_reduce(int place, TreeWalkResultDensity * remote, enum TreeWalkReduceMod
         TREEWALK_REDUCE(DENSITY_GET_PRIV(tw)->Rot[pi][1], remote->Rot[1]);
         TREEWALK_REDUCE(DENSITY_GET_PRIV(tw)->Rot[pi][2], remote->Rot[2]);
 
-        MyFloat * gradrho = DENSITY_GET_PRIV(tw)->GradRho;
-
-        if(gradrho) {
-            TREEWALK_REDUCE(gradrho[3*pi], remote->GradRho[0]);
-            TREEWALK_REDUCE(gradrho[3*pi+1], remote->GradRho[1]);
-            TREEWALK_REDUCE(gradrho[3*pi+2], remote->GradRho[2]);
+        if(DENSITY_GET_PRIV(tw)->GradRho && DENSITY_GET_PRIV(tw)->GradRhoIndex[pi] >= 0) {
+            MyFloat * gradrho = DENSITY_GET_PRIV(tw)->GradRho + 3 * DENSITY_GET_PRIV(tw)->GradRhoIndex[pi];
+            TREEWALK_REDUCE(gradrho[0], remote->GradRho[0]);
+            TREEWALK_REDUCE(gradrho[1], remote->GradRho[1]);
+            TREEWALK_REDUCE(gradrho[2], remote->GradRho[2]);
         }
 
         /*Only used for density independent SPH*/
@@ -416,6 +529,93 @@ density_reduce(int place, TreeWalkResultDensity * remote, enum TreeWalkReduceMod
  *
  */
 
+/* Add the contribution of one neighbour inside the kernel, given the kernel and its derivative at u = r / H.*/
+static inline void
+density_ngbiter_pair(
+        TreeWalkQueryDensity * I,
+        TreeWalkResultDensity * O,
+        TreeWalkNgbIterDensity * iter,
+        const double u, const double wk, const double dwk,
+        LocalTreeWalk * lv)
+{
+    const int other = iter->base.other;
+    const double r = iter->base.r;
+    const double * dist = iter->base.dist;
+
+    if(P[other].Mass == 0) {
+        endrun(12, "Density found zero mass particle %d type %d id %ld pos %g %g %g\n",
+               other, P[other].Type, P[other].ID, P[other].Pos[0], P[other].Pos[1], P[other].Pos[2]);
+    }
+
+    /* For the BH we wish to exclude wind particles from the density,
+     * because they are excluded from the accretion treewalk.*/
+    if(I->Type == 5 && winds_is_particle_decoupled(other))
+        return;
+
+    O->Ngb += wk * iter->kernel_volume;
+
+    int k;
+    for(k = 0; k < iter->ncand; k++) {
+        if(r < iter->candkernel[k].H)
+            O->NgbCand[k] += density_kernel_wk(&iter->candkernel[k], r * iter->candkernel[k].Hinv) * iter->candvolume[k];
+    }
+
+    const double mass_j = P[other].Mass;
+
+    O->Rho += (mass_j * wk);
+
+    /* Hinv is here because O->DhsmlDensity is drho / dH.
+     * nothing to worry here */
+    double density_dW = density_kernel_dW(&iter->kernel, u, wk, dwk);
+    O->DhsmlDensity += mass_j * density_dW;
+
+    double EntVarPred;
+    MyFloat VelPred[3];
+    struct DensityPriv * priv = DENSITY_GET_PRIV(lv->tw);
+    SPH_VelPred(other, VelPred, &priv->kf);
+
+    if(priv->SPH_predicted->EntVarPred) {
+        #pragma omp atomic read
+        EntVarPred = priv->SPH_predicted->EntVarPred[P[other].PI];
+        /* Lazily compute the predicted quantities. We can do this
+        * with minimal locking since nothing happens should we compute them twice.
+        * Zero can be the special value since there should never be zero entropy.*/
+        if(EntVarPred == 0) {
+            EntVarPred = SPH_EntVarPred(other, priv->times);
+            #pragma omp atomic write
+            priv->SPH_predicted->EntVarPred[P[other].PI] = EntVarPred;
+        }
+    }
+    else
+        EntVarPred = SPH_EntVarPred(other, priv->times);
+
+    if(DENSITY_GET_PRIV(lv->tw)->DoEgyDensity) {
+        O->EgyRho += mass_j * EntVarPred * wk;
+        O->DhsmlEgyDensity += mass_j * EntVarPred * density_dW;
+    }
+
+    if(r > 0)
+    {
+        double fac = mass_j * dwk / r;
+        double dv[3];
+        double rot[3];
+        int d;
+        for(d = 0; d < 3; d ++) {
+            dv[d] = I->Vel[d] - VelPred[d];
+        }
+        O->Div += -fac * dotproduct(dist, dv);
+
+        crossproduct(dv, dist, rot);
+        for(d = 0; d < 3; d ++) {
+            O->Rot[d] += fac * rot[d];
+        }
+        if(I->GradRho) {
+            for (d = 0; d < 3; d ++)
+                O->GradRho[d] += fac * dist[d];
+        }
+    }
+}
+
 static void
 density_ngbiter(
         TreeWalkQueryDensity * I,
@@ -427,92 +627,310 @@ density_ngbiter(
         const double h = I->Hsml;
         density_kernel_init(&iter->kernel, h, DensityParams.DensityKernelType);
         iter->kernel_volume = density_kernel_volume(&iter->kernel);
+        iter->ncand = 0;
+        if(DENSITY_GET_PRIV(lv->tw)->NgbCand) {
+            int k;
+            for(k = 0; k < NHSMLCAND; k++) {
+                density_kernel_init(&iter->candkernel[k], HsmlCandFrac[k] * h, DensityParams.DensityKernelType);
+                iter->candvolume[k] = density_kernel_volume(&iter->candkernel[k]);
+            }
+            iter->ncand = NHSMLCAND;
+        }
 
         iter->base.Hsml = h;
         iter->base.mask = GASMASK; /* gas only */
         iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
         return;
     }
-    const int other = iter->base.other;
-    const double r = iter->base.r;
-    const double r2 = iter->base.r2;
-    const double * dist = iter->base.dist;
+    if(iter->base.r2 < iter->kernel.HH) {
+        const double u = iter->base.r * iter->kernel.Hinv;
+        density_ngbiter_pair(I, O, iter, u, density_kernel_wk(&iter->kernel, u), density_kernel_dwk(&iter->kernel, u), lv);
+    }
+}
 
-    if(P[other].Mass == 0) {
-        endrun(12, "Density found zero mass particle %d type %d id %ld pos %g %g %g\n",
-               other, P[other].Type, P[other].ID, P[other].Pos[0], P[other].Pos[1], P[other].Pos[2]);
+/* Evaluate a block of neighbours. Calling density_ngbiter_pair directly lets the compiler inline it,
+ * avoiding an indirect call for each pair.*/
+static void
+density_ngbiter_batch(
+        TreeWalkQueryDensity * I,
+        TreeWalkResultDensity * O,
+        TreeWalkNgbIterDensity * iter,
+        const TreeWalkNgbBatch * batch,
+        LocalTreeWalk * lv)
+{
+    double u[NGB_BATCH_SIZE], wk[NGB_BATCH_SIZE], dwk[NGB_BATCH_SIZE];
+    int j;
+    /* Evaluate the kernel for the whole block at once. Pairs outside the kernel get zero and are skipped below.*/
+    for(j = 0; j < batch->n; j++)
+        u[j] = batch->r[j] * iter->kernel.Hinv;
+    density_kernel_wk_dwk_batch(&iter->kernel, batch->n, u, wk, dwk);
+    for(j = 0; j < batch->n; j++) {
+        /* Skip neighbours outside the kernel before touching the particle table*/
+        if(batch->r2[j] >= iter->kernel.HH)
+            continue;
+        iter->base.other = batch->other[j];
+        iter->base.r2 = batch->r2[j];
+        iter->base.r = batch->r[j];
+        iter->base.dist[0] = batch->dist[0][j];
+        iter->base.dist[1] = batch->dist[1][j];
+        iter->base.dist[2] = batch->dist[2][j];
+        density_ngbiter_pair(I, O, iter, u[j], wk[j], dwk[j], lv);
     }
+}
 
-    if(r2 < iter->kernel.HH)
-    {
-        /* For the BH we wish to exclude wind particles from the density,
-         * because they are excluded from the accretion treewalk.*/
-        if(I->Type == 5 && winds_is_particle_decoupled(other))
-            return;
+/* Offload of the local density walk to an accelerator, with OpenMP target offload as in gravshort-offload.c.
+ * The gas of the local tree, with the predicted velocities and entropies, is copied to the device once per call
+ * to density(). Each Hsml iteration walks its queries there, while the host walks the toptree and the imported
+ * queries and then rebuilds the queue of particles to redo.
+ * Needs a compiler with offload support, otherwise the target region runs on the host.*/
 
-        const double u = r * iter->kernel.Hinv;
-        const double wk = density_kernel_wk(&iter->kernel, u);
-        O->Ngb += wk * iter->kernel_volume;
+#define DENSITY_OFFLOAD_FACT1 0.366025403785    /* 0.5 * (sqrt(3)-1), as in treewalk.c*/
 
-        const double dwk = density_kernel_dwk(&iter->kernel, u);
+#pragma omp declare target
 
-        const double mass_j = P[other].Mass;
+/* As cull_node in treewalk.c for an asymmetric search*/
+static int
+density_offload_cull(const double * Pos, const double H, const struct DensityOffloadNode * node, const double BoxSize)
+{
+    double dist = H + 0.5 * node->len;
+    double r2 = 0;
+    int d;
+    for(d = 0; d < 3; d++) {
+        const double dx = NEAREST(node->center[d] - Pos[d], BoxSize);
+        if(dx > dist || dx < -dist)
+            return 0;
+        r2 += dx * dx;
+    }
+    dist += DENSITY_OFFLOAD_FACT1 * node->len;
+    return r2 <= dist * dist;
+}
 
-        O->Rho += (mass_j * wk);
+/* Walk the local tree for one query, as treewalk_visit_nolist_ngbiter with density_ngbiter.
+ * Pseudo nodes are skipped, as they are exported by the host. Returns the number of interactions.*/
+static int
+density_offload_walk(const TreeWalkQueryDensity * I, TreeWalkResultDensity * O, const struct DensityOffloadNode * Nodes,
+        const struct DensityOffloadPart * Parts, const struct DensityOffloadConsts * c)
+{
+    const double H = I->Hsml;
+    DensityKernel kernel, candkernel[NHSMLCAND];
+    double candvolume[NHSMLCAND];
+    density_kernel_rescale(&kernel, &c->unit, H);
+    double kernel_volume = NORM_COEFF;
+    int k, d;
+    for(d = 0; d < NUMDIMS; d++)
+        kernel_volume *= H;
+    for(k = 0; k < c->ncand; k++) {
+        density_kernel_rescale(&candkernel[k], &c->unit, c->CandFrac[k] * H);
+        candvolume[k] = kernel_volume;
+        for(d = 0; d < NUMDIMS; d++)
+            candvolume[k] *= c->CandFrac[k];
+    }
 
-        /* Hinv is here because O->DhsmlDensity is drho / dH.
-         * nothing to worry here */
-        double density_dW = density_kernel_dW(&iter->kernel, u, wk, dwk);
-        O->DhsmlDensity += mass_j * density_dW;
+    int ninteractions = 0;
+    int no = 0;
+    while(no >= 0) {
+        const struct DensityOffloadNode * node = &Nodes[no];
+        if(!node->HasGas || !density_offload_cull(I->base.Pos, H, node, c->BoxSize)) {
+            no = node->sibling;
+            continue;
+        }
+        if(node->ChildType == NODE_NODE_TYPE) {
+            no = no + 1;
+            continue;
+        }
+        no = node->sibling;
+        if(node->ChildType != PARTICLE_NODE_TYPE)
+            continue;
+        int i;
+        for(i = node->first; i < node->first + node->noccupied; i++) {
+            const struct DensityOffloadPart * part = &Parts[i];
+            double dist[3], r2 = 0;
+            for(d = 0; d < 3; d++) {
+                dist[d] = NEAREST(I->base.Pos[d] - part->Pos[d], c->BoxSize);
+                r2 += dist[d] * dist[d];
+            }
+            if(r2 >= kernel.HH)
+                continue;
+            ninteractions++;
+            /* As density_ngbiter_pair*/
+            if(I->Type == 5 && part->Decoupled)
+                continue;
+            const double r = sqrt(r2);
+            double u = r * kernel.Hinv, wk, dwk;
+            density_kernel_wk_dwk_batch(&kernel, 1, &u, &wk, &dwk);
+            O->Ngb += wk * kernel_volume;
+            for(k = 0; k < c->ncand; k++) {
+                if(r < candkernel[k].H) {
+                    double uc = r * candkernel[k].Hinv, wc, dwc;
+                    density_kernel_wk_dwk_batch(&candkernel[k], 1, &uc, &wc, &dwc);
+                    O->NgbCand[k] += wc * candvolume[k];
+                }
+            }
+            const double mass_j = part->Mass;
+            O->Rho += mass_j * wk;
+            const double density_dW = -(NUMDIMS * kernel.Hinv * wk + u * dwk);
+            O->DhsmlDensity += mass_j * density_dW;
+            if(c->DoEgyDensity) {
+                O->EgyRho += mass_j * part->EntVarPred * wk;
+                O->DhsmlEgyDensity += mass_j * part->EntVarPred * density_dW;
+            }
+            if(r > 0) {
+                const double fac = mass_j * dwk / r;
+                double dv[3];
+                for(d = 0; d < 3; d++)
+                    dv[d] = I->Vel[d] - part->VelPred[d];
+                O->Div += -fac * (dist[0] * dv[0] + dist[1] * dv[1] + dist[2] * dv[2]);
+                O->Rot[0] += fac * (dv[1] * dist[2] - dist[1] * dv[2]);
+                O->Rot[1] += fac * (dv[2] * dist[0] - dist[2] * dv[0]);
+                O->Rot[2] += fac * (dv[0] * dist[1] - dist[0] * dv[1]);
+                if(I->GradRho)
+                    for(d = 0; d < 3; d++)
+                        O->GradRho[d] += fac * dist[d];
+            }
+        }
+    }
+    return ninteractions;
+}
 
-        double EntVarPred;
-        MyFloat VelPred[3];
-        struct DensityPriv * priv = DENSITY_GET_PRIV(lv->tw);
-        SPH_VelPred(other, VelPred, &priv->kf);
+#pragma omp end declare target
 
-        if(priv->SPH_predicted->EntVarPred) {
-            #pragma omp atomic read
-            EntVarPred = priv->SPH_predicted->EntVarPred[P[other].PI];
-            /* Lazily compute the predicted quantities. We can do this
-            * with minimal locking since nothing happens should we compute them twice.
-            * Zero can be the special value since there should never be zero entropy.*/
-            if(EntVarPred == 0) {
-                EntVarPred = SPH_EntVarPred(other, priv->times);
-                #pragma omp atomic write
-                priv->SPH_predicted->EntVarPred[P[other].PI] = EntVarPred;
+/* Copy the gas of the local tree and its predicted quantities to the device.*/
+static void
+density_offload_init(struct DensityOffload * off, const ForceTree * tree, struct DensityPriv * priv)
+{
+    /* Number the nodes in walk order, as force_tree_make_walk_nodes*/
+    int * WalkIndex = ta_malloc("DensOffloadIndex", int, tree->numnodes);
+    int64_t nnodes = 0, nparts = 0;
+    int no = tree->firstnode;
+    while(no >= 0) {
+        const struct NODE * nop = &tree->Nodes[no];
+        WalkIndex[no - tree->firstnode] = nnodes++;
+        if(nop->f.ChildType == NODE_NODE_TYPE)
+            no = nop->s.suns[0];
+        else {
+            if(nop->f.ChildType == PARTICLE_NODE_TYPE)
+                nparts += nop->s.noccupied;
+            no = nop->sibling;
+        }
+    }
+    off->NumNodes = nnodes;
+    off->Nodes = (struct DensityOffloadNode *) mymalloc2("DensOffloadNodes", DMAX(nnodes, 1) * sizeof(struct DensityOffloadNode));
+    int * PartIndex = ta_malloc("DensOffloadParts", int, DMAX(nparts, 1));
+    /* Copy the nodes, keeping only the gas in the leaves*/
+    nparts = 0;
+    no = tree->firstnode;
+    while(no >= 0) {
+        const struct NODE * nop = &tree->Nodes[no];
+        struct DensityOffloadNode * node = &off->Nodes[WalkIndex[no - tree->firstnode]];
+        int j;
+        for(j = 0; j < 3; j++)
+            node->center[j] = nop->center[j];
+        node->len = nop->len;
+        node->sibling = nop->sibling >= 0 ? WalkIndex[nop->sibling - tree->firstnode] : -1;
+        node->ChildType = nop->f.ChildType;
+        node->HasGas = (nop->f.TypeMask & GASMASK) != 0;
+        node->first = nparts;
+        node->noccupied = 0;
+        if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+            for(j = 0; j < nop->s.noccupied; j++) {
+                const int other = nop->s.suns[j];
+                if(P[other].IsGarbage || P[other].Type != 0)
+                    continue;
+                if(P[other].Mass == 0)
+                    endrun(12, "Density found zero mass particle %d type %d id %ld pos %g %g %g\n",
+                        other, P[other].Type, P[other].ID, P[other].Pos[0], P[other].Pos[1], P[other].Pos[2]);
+                PartIndex[nparts++] = other;
+                node->noccupied++;
             }
         }
+        if(nop->f.ChildType == NODE_NODE_TYPE)
+            no = nop->s.suns[0];
         else
-            EntVarPred = SPH_EntVarPred(other, priv->times);
-
-        if(DENSITY_GET_PRIV(lv->tw)->DoEgyDensity) {
-            O->EgyRho += mass_j * EntVarPred * wk;
-            O->DhsmlEgyDensity += mass_j * EntVarPred * density_dW;
+            no = nop->sibling;
+    }
+    off->NumParts = nparts;
+    off->Parts = (struct DensityOffloadPart *) mymalloc2("DensOffloadParts", DMAX(nparts, 1) * sizeof(struct DensityOffloadPart));
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < nparts; i++) {
+        const int other = PartIndex[i];
+        struct DensityOffloadPart * part = &off->Parts[i];
+        MyFloat VelPred[3];
+        SPH_VelPred(other, VelPred, &priv->kf);
+        int j;
+        for(j = 0; j < 3; j++) {
+            part->Pos[j] = P[other].Pos[j];
+            part->VelPred[j] = VelPred[j];
         }
+        part->Mass = P[other].Mass;
+        part->EntVarPred = 0;
+        if(priv->DoEgyDensity) {
+            if(priv->SPH_predicted->EntVarPred && priv->SPH_predicted->EntVarPred[P[other].PI] != 0)
+                part->EntVarPred = priv->SPH_predicted->EntVarPred[P[other].PI];
+            else
+                part->EntVarPred = SPH_EntVarPred(other, priv->times);
+        }
+        part->Decoupled = winds_is_particle_decoupled(other);
+    }
+    ta_free(PartIndex);
+    ta_free(WalkIndex);
+
+    density_kernel_init(&off->c.unit, 1.0, DensityParams.DensityKernelType);
+    int k;
+    for(k = 0; k < NHSMLCAND; k++)
+        off->c.CandFrac[k] = HsmlCandFrac[k];
+    off->c.ncand = priv->NgbCand ? NHSMLCAND : 0;
+    off->c.DoEgyDensity = priv->DoEgyDensity;
+    off->c.BoxSize = tree->BoxSize;
+
+    #pragma omp target enter data map(to: off->Nodes[0:nnodes], off->Parts[0:nparts])
+    message(0, "Offloading the local density walk over %ld gas particles to %d devices.\n", nparts, omp_get_num_devices());
+}
 
-        if(r > 0)
-        {
-            double fac = mass_j * dwk / r;
-            double dv[3];
-            double rot[3];
-            int d;
-            for(d = 0; d < 3; d ++) {
-                dv[d] = I->Vel[d] - VelPred[d];
-            }
-            O->Div += -fac * dotproduct(dist, dv);
+static void
+density_offload_free(struct DensityOffload * off)
+{
+    #pragma omp target exit data map(release: off->Nodes[0:off->NumNodes], off->Parts[0:off->NumParts])
+    myfree(off->Parts);
+    myfree(off->Nodes);
+}
 
-            crossproduct(dv, dist, rot);
-            for(d = 0; d < 3; d ++) {
-                O->Rot[d] += fac * rot[d];
-            }
-            if(DENSITY_GET_PRIV(lv->tw)->GradRho) {
-                for (d = 0; d < 3; d ++)
-                    O->GradRho[d] += fac * dist[d];
-            }
-        }
+/* Start walking the queries of one Hsml iteration on the device. Waited for in density_offload_end.*/
+static void
+density_offload_begin(const TreeWalkQueryDensity * queries, TreeWalkResultDensity * results, int * ninteractions, const int64_t nquery, TreeWalk * tw)
+{
+    const struct DensityOffload * off = DENSITY_GET_PRIV(tw)->Offload;
+    /* Local copies, as the map clauses take variables. The constants are mapped through a pointer,
+     * as the device may copy them after this function returns.*/
+    const struct DensityOffloadNode * Nodes = off->Nodes;
+    const struct DensityOffloadPart * Parts = off->Parts;
+    const int64_t nnodes = off->NumNodes, nparts = off->NumParts;
+    const struct DensityOffloadConsts * c = &off->c;
+    int64_t i;
+    /* Without a device the target region runs on the host. A deferred host fallback can deadlock
+     * with the parallel regions of the host treewalk in some OpenMP runtimes, so it is not deferred.*/
+    if(omp_get_num_devices() > 0) {
+        #pragma omp target teams distribute parallel for nowait \
+            map(to: Nodes[0:nnodes], Parts[0:nparts], queries[0:nquery], c[0:1]) \
+            map(tofrom: results[0:nquery]) map(from: ninteractions[0:nquery])
+        for(i = 0; i < nquery; i++)
+            ninteractions[i] = density_offload_walk(&queries[i], &results[i], Nodes, Parts, c);
+    }
+    else {
+        #pragma omp target teams distribute parallel for \
+            map(to: Nodes[0:nnodes], Parts[0:nparts], queries[0:nquery], c[0:1]) \
+            map(tofrom: results[0:nquery]) map(from: ninteractions[0:nquery])
+        for(i = 0; i < nquery; i++)
+            ninteractions[i] = density_offload_walk(&queries[i], &results[i], Nodes, Parts, c);
     }
 }
 
+static void
+density_offload_end(TreeWalk * tw)
+{
+    #pragma omp taskwait
+}
+
 static int
 density_haswork(int n, TreeWalk * tw)
 {
@@ -580,6 +998,64 @@ density_postprocess(int i, TreeWalk * tw)
     }
 }
 
+/* Use the neighbour numbers at the candidate smoothing lengths to choose the next Hsml.
+ * If there are too many neighbours the candidates usually bracket the target, so we tighten
+ * Left and Right and interpolate assuming a power law between the bracketing pair.
+ * If there are too few we extrapolate using the power law slope between the outermost
+ * candidate and the current Hsml. oldwidth is the width of the bracket before this step.
+ * Returns 1 if a new Hsml was set, 0 to fall back on bisection.*/
+static int
+density_candidate_hsml(MyFloat * Hsml, const double numngb, const MyFloat * NgbCand, const double desnumngb, MyFloat * Left, MyFloat * Right, const double oldwidth, const double BoxSize)
+{
+    const double h = *Hsml;
+    double hnew;
+    if(numngb > desnumngb) {
+        double hl = 0, nl = 0, hr = h, nr = numngb;
+        int k;
+        for(k = NHSMLCAND - 1; k >= 0; k--) {
+            const double hk = HsmlCandFrac[k] * h;
+            if(NgbCand[k] > desnumngb) {
+                hr = hk;
+                nr = NgbCand[k];
+            }
+            else {
+                hl = hk;
+                nl = NgbCand[k];
+                break;
+            }
+        }
+        if(hr < *Right)
+            *Right = hr;
+        if(hl > *Left)
+            *Left = hl;
+        if(nl <= 0)
+            return 0;
+        hnew = hl * pow(hr / hl, log(desnumngb / nl) / log(nr / nl));
+        if(hnew <= *Left)
+            return 0;
+    }
+    else {
+        const double nc = NgbCand[NHSMLCAND - 1];
+        if(nc <= 0 || numngb <= nc)
+            return 0;
+        const double slope = log(numngb / nc) / log(1. / HsmlCandFrac[NHSMLCAND - 1]);
+        /* Do not grow too fast: the density profile may change beyond the current Hsml.*/
+        const double fac = DMIN(pow(desnumngb / numngb, 1. / slope), 1.5);
+        hnew = h * fac;
+    }
+    if(hnew >= *Right)
+        return 0;
+    if(*Left > 0 && *Right < BoxSize) {
+        const double width = *Right - *Left;
+        if(width > HSMLBRACKETSHRINK * oldwidth)
+            return 0;
+        if(hnew - *Left < HSMLEDGEFRAC * width || *Right - hnew < HSMLEDGEFRAC * width)
+            return 0;
+    }
+    *Hsml = hnew;
+    return 1;
+}
+
 /* Returns 1 if we are done and do not need to loop. 0 if we need to repeat.*/
 int
 density_check_neighbours (int i, TreeWalk * tw)
@@ -622,6 +1098,7 @@ density_check_neighbours (int i, TreeWalk * tw)
             return 1;
         }
 
+        const double oldwidth = Right[i] - Left[i];
         /* If we need more neighbours, move the lower bound up. If we need fewer, move the upper bound down.*/
         if(NumNgb[i] < desnumngb) {
                 Left[i] = P[i].Hsml;
@@ -629,29 +1106,35 @@ density_check_neighbours (int i, TreeWalk * tw)
                 Right[i] = P[i].Hsml;
         }
 
-        /* Next step is geometric mean of previous. */
-        if((Right[i] < tw->tree->BoxSize && Left[i] > 0) || (P[i].Hsml * 1.26 > 0.99 * tw->tree->BoxSize))
-            P[i].Hsml = cbrt(0.5 * (pow(Left[i], 3) + pow(Right[i], 3)));
-        else
-        {
-            if(!(Right[i] < tw->tree->BoxSize) && Left[i] == 0)
-                endrun(8188, "Cannot occur. Check for memory corruption: i=%d L = %g R = %g N=%g. Type %d, Pos %g %g %g hsml %g Box %g\n", i, Left[i], Right[i], NumNgb[i], P[i].Type, P[i].Pos[0], P[i].Pos[1], P[i].Pos[2], P[i].Hsml, tw->tree->BoxSize);
+        int guessed = 0;
+        if(DENSITY_GET_PRIV(tw)->NgbCand)
+            guessed = density_candidate_hsml(&P[i].Hsml, NumNgb[i], DENSITY_GET_PRIV(tw)->NgbCand[i], desnumngb, &Left[i], &Right[i], oldwidth, tw->tree->BoxSize);
 
-            MyFloat DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[i];
-            double fac = 1.26;
-            if(NumNgb[i] > 0)
-                fac = 1 - (NumNgb[i] - desnumngb) / (NUMDIMS * NumNgb[i]) * DensFac;
+        if(!guessed) {
+            /* Next step is geometric mean of previous. */
+            if((Right[i] < tw->tree->BoxSize && Left[i] > 0) || (P[i].Hsml * 1.26 > 0.99 * tw->tree->BoxSize))
+                P[i].Hsml = cbrt(0.5 * (pow(Left[i], 3) + pow(Right[i], 3)));
+            else
+            {
+                if(!(Right[i] < tw->tree->BoxSize) && Left[i] == 0)
+                    endrun(8188, "Cannot occur. Check for memory corruption: i=%d L = %g R = %g N=%g. Type %d, Pos %g %g %g hsml %g Box %g\n", i, Left[i], Right[i], NumNgb[i], P[i].Type, P[i].Pos[0], P[i].Pos[1], P[i].Pos[2], P[i].Hsml, tw->tree->BoxSize);
+
+                MyFloat DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[i];
+                double fac = 1.26;
+                if(NumNgb[i] > 0)
+                    fac = 1 - (NumNgb[i] - desnumngb) / (NUMDIMS * NumNgb[i]) * DensFac;
 
-            /* Find the initial bracket using the kernel gradients*/
-            if(Right[i] > 0.99 * tw->tree->BoxSize && Left[i] > 0)
-                if(DensFac <= 0 || fabs(NumNgb[i] - desnumngb) >= 0.5 * desnumngb || fac > 1.26)
-                    fac = 1.26;
+                /* Find the initial bracket using the kernel gradients*/
+                if(Right[i] > 0.99 * tw->tree->BoxSize && Left[i] > 0)
+                    if(DensFac <= 0 || fabs(NumNgb[i] - desnumngb) >= 0.5 * desnumngb || fac > 1.26)
+                        fac = 1.26;
 
-            if(Right[i] < 0.99*tw->tree->BoxSize && Left[i] == 0)
-                if(DensFac <=0 || fac < 1./3)
-                    fac = 1./3;
+                if(Right[i] < 0.99*tw->tree->BoxSize && Left[i] == 0)
+                    if(DensFac <=0 || fac < 1./3)
+                        fac = 1./3;
 
-            P[i].Hsml *= fac;
+                P[i].Hsml *= fac;
+            }
         }
 
         if(DENSITY_GET_PRIV(tw)->BlackHoleOn && P[i].Type == 5)
@@ -691,6 +1174,39 @@ slots_free_sph_pred_data(struct sph_pred_data * sph_scratch)
     sph_scratch->EntVarPred = NULL;
 }
 
+void
+density_grad_rho_alloc(struct sph_grad_rho * GradRho, const ActiveParticles * act, const double MinDensity)
+{
+    GradRho->Index = (int *) mymalloc2("SPH_GradRhoIndex", sizeof(int) * SlotsManager->info[0].size);
+    memset(GradRho->Index, -1, sizeof(int) * SlotsManager->info[0].size);
+
+    int64_t i, NumGrad = 0;
+    #pragma omp parallel for
+    for(i = 0; i < act->NumActiveParticle; i++) {
+        const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        if(P[p_i].Type != 0 || P[p_i].IsGarbage || SPHP(p_i).Density < MinDensity)
+            continue;
+        int64_t ind;
+        #pragma omp atomic capture
+        ind = NumGrad++;
+        GradRho->Index[P[p_i].PI] = ind;
+    }
+    GradRho->NumGrad = NumGrad;
+    GradRho->Mag = (MyFloat *) mymalloc2("SPH_GradRho", sizeof(MyFloat) * NumGrad);
+}
+
+void
+density_grad_rho_free(struct sph_grad_rho * GradRho)
+{
+    if(GradRho->Mag)
+        myfree(GradRho->Mag);
+    if(GradRho->Index)
+        myfree(GradRho->Index);
+    GradRho->Mag = NULL;
+    GradRho->Index = NULL;
+    GradRho->NumGrad = 0;
+}
+
 /* Set the initial smoothing length for gas and BH*/
 void
 set_init_hsml(ForceTree * tree, DomainDecomp * ddecomp, const double MeanGasSeparation)
@@ -21,6 +21,24 @@ struct density_params
 
     /*!< minimum allowed SPH smoothing length in units of SPH gravitational softening length */
     double MinGasHsmlFractional;
+
+    /* If true, measure the neighbour number at several trial smoothing lengths
+     * during each density iteration, and use them to pick the next Hsml.*/
+    int HsmlCandidates;
+
+    /* If true, the local part of the density walk is done on an accelerator with OpenMP target offload*/
+    int Offload;
+};
+
+/* Density gradients for the H2 star formation model. These are computed only for the
+ * active gas particles which may form stars, selected before the density walk.*/
+struct sph_grad_rho
+{
+    /* For each gas slot, the index into Mag, or -1 if the gradient is not computed.*/
+    int * Index;
+    /* Magnitude of the density gradient of the selected particles*/
+    MyFloat * Mag;
+    int64_t NumGrad;
 };
 
 struct sph_pred_data
@@ -49,7 +67,12 @@ void set_densitypar(struct density_params dp);
  * it just computes densities.
  * If DoEgyDensity is true it also computes the entropy-weighted density for
  * pressure-entropy SPH. */
-void density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int BlackHoleOn, const DriftKickTimes times, Cosmology * CP, struct sph_pred_data * SPH_predicted, MyFloat * GradRho_mag, const ForceTree * const tree);
+void density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int BlackHoleOn, const DriftKickTimes times, Cosmology * CP, struct sph_pred_data * SPH_predicted, struct sph_grad_rho * GradRho, const ForceTree * const tree);
+
+/* Select the active gas particles whose density, from their last density evaluation, is above MinDensity.
+ * density() will compute the density gradient for these only. Allocated high.*/
+void density_grad_rho_alloc(struct sph_grad_rho * GradRho, const ActiveParticles * act, const double MinDensity);
+void density_grad_rho_free(struct sph_grad_rho * GradRho);
 
 /* Get the desired nuber of neighbours for the supplied kernel*/
 double GetNumNgb(enum DensityKernelType KernelType);
@@ -21,72 +21,72 @@
  * the function density_kernel_wk and _dwk takes u to maintain compatibility
  * with volker's gadget.
  */
+/* The polynomials and the batch evaluation are also compiled for an accelerator, for density.c.*/
+#pragma omp declare target
+/* Polynomials written with kpos(x) = max(x, 0) instead of branches,
+ * so that loops over many pairs vectorise. */
+static inline double
+kpos(const double x)
+{
+    return x > 0 ? x : 0;
+}
+
+static inline void
+poly_cs(const double q, double * w, double * dw)
+{
+    const double a = kpos(2 - q), b = kpos(1 - q);
+    *w = 0.25 * a * a * a - b * b * b;
+    *dw = -0.75 * a * a + 3 * b * b;
+}
+
+static inline void
+poly_qus(const double q, double * w, double * dw)
+{
+    const double a = kpos(2.5 - q), b = kpos(1.5 - q), c = kpos(0.5 - q);
+    const double a3 = a * a * a, b3 = b * b * b, c3 = c * c * c;
+    *w = a3 * a - 5 * b3 * b + 10 * c3 * c;
+    *dw = -4 * a3 + 20 * b3 - 40 * c3;
+}
+
+static inline void
+poly_qs(const double q, double * w, double * dw)
+{
+    const double a = kpos(3 - q), b = kpos(2 - q), c = kpos(1 - q);
+    const double a4 = a * a * a * a, b4 = b * b * b * b, c4 = c * c * c * c;
+    *w = a4 * a - 6 * b4 * b + 15 * c4 * c;
+    *dw = -5 * a4 + 30 * b4 - 75 * c4;
+}
+#pragma omp end declare target
+
 double wk_cs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return 0.25 * pow(2 - q, 3) - pow(1 - q, 3);
-    }
-    if(q < 2.0) {
-        return 0.25 * pow(2 - q, 3);
-    }
-    return 0.0;
+    double w, dw;
+    poly_cs(q, &w, &dw);
+    return w;
 }
 double dwk_cs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return - 0.25 * 3 * pow(2 - q, 2) + 3 * pow(1 - q, 2);
-    }
-    if(q < 2.0) {
-        return -0.25 * 3 * pow(2 - q, 2);
-    }
-    return 0.0;
+    double w, dw;
+    poly_cs(q, &w, &dw);
+    return dw;
 }
 static double wk_qus(DensityKernel * kernel, double q) {
-    if(q < 0.5) {
-        return pow(2.5 - q, 4) - 5 * pow(1.5 - q, 4) + 10 * pow(0.5 - q, 4);
-    }
-    if(q < 1.5) {
-        return pow(2.5 - q, 4) - 5 * pow(1.5 - q, 4);
-    }
-    if(q < 2.5) {
-        return pow(2.5 - q, 4);
-    }
-    return 0.0;
+    double w, dw;
+    poly_qus(q, &w, &dw);
+    return w;
 }
 static double dwk_qus(DensityKernel * kernel, double q) {
-    if(q < 0.5) {
-        return -4 * pow(2.5 - q, 3) + 20 * pow(1.5 - q, 3) - 40 * pow(0.5 - q, 3);
-    }
-    if(q < 1.5) {
-        return -4 * pow(2.5 - q, 3) + 20 * pow(1.5 - q, 3);
-    }
-    if(q < 2.5) {
-        return -4 * pow(2.5 - q, 3);
-    }
-    return 0.0;
+    double w, dw;
+    poly_qus(q, &w, &dw);
+    return dw;
 }
 static double wk_qs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return pow(3 - q, 5) - 6 * pow(2 - q, 5) + 15 * pow(1 - q, 5);
-    }
-    if(q < 2.0) {
-        return pow(3 - q, 5)- 6 * pow(2 - q, 5);
-    }
-    if(q < 3.0) {
-        return pow(3 - q, 5);
-    }
-    return 0.0;
+    double w, dw;
+    poly_qs(q, &w, &dw);
+    return w;
 }
 static double dwk_qs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return -5 * pow(3 - q, 4) + 30 * pow(2 - q, 4)
-             - 75 * pow (1 - q, 4);
-    }
-    if(q < 2.0) {
-        return -5 * pow(3 - q, 4) + 30 * pow(2 - q, 4);
-    }
-    if(q < 3.0) {
-        return -5 * pow(3 - q, 4);
-    }
-    return 0.0;
+    double w, dw;
+    poly_qs(q, &w, &dw);
+    return dw;
 }
 
 static struct {
@@ -120,6 +120,80 @@ density_kernel_wk(DensityKernel * kernel, double u)
         KERNELS[kernel->type].wk(kernel, u * support);
 }
 
+#pragma omp declare target
+/* The type switch is outside the loops, so each loop is a branch-free polynomial the compiler can vectorise.*/
+#define KERNEL_BATCH_LOOP(poly) \
+    for(j = 0; j < n; j++) { \
+        double w, dw; \
+        poly(u[j] * support, &w, &dw); \
+        wk[j] = kernel->Wknorm * w; \
+        dwk[j] = kernel->dWknorm * dw; \
+    }
+
+void
+density_kernel_wk_dwk_batch(const DensityKernel * kernel, const int n, const double * u, double * wk, double * dwk)
+{
+    const double support = kernel->support;
+    int j;
+    switch(kernel->type) {
+        case 0:
+            KERNEL_BATCH_LOOP(poly_cs);
+            break;
+        case 1:
+            KERNEL_BATCH_LOOP(poly_qs);
+            break;
+        default:
+            KERNEL_BATCH_LOOP(poly_qus);
+    }
+}
+
+void
+density_kernel_rescale(DensityKernel * kernel, const DensityKernel * unit, const double H)
+{
+    *kernel = *unit;
+    kernel->H = H;
+    kernel->HH = H * H;
+    kernel->Hinv = 1. / H;
+    double norm = 1;
+    int d;
+    for(d = 0; d < NUMDIMS; d++)
+        norm *= kernel->Hinv;
+    kernel->Wknorm = unit->Wknorm * norm;
+    kernel->dWknorm = unit->dWknorm * norm * kernel->Hinv;
+}
+#pragma omp end declare target
+
+/* Here the normalisation depends on the smoothing length of each pair, dWknorm = sigma (support / H)^(NUMDIMS + 1).*/
+#define KERNEL_BATCH_VARH_LOOP(poly) \
+    for(j = 0; j < n; j++) { \
+        double w, dw; \
+        const double hinv = support / H[j]; \
+        double norm = sigma * hinv; \
+        int d; \
+        for(d = 0; d < NUMDIMS; d++) \
+            norm *= hinv; \
+        poly(r[j] * hinv, &w, &dw); \
+        dwk[j] = norm * dw; \
+    }
+
+void
+density_kernel_dwk_batch_varh(const DensityKernel * kernel, const int n, const double * r, const double * H, double * dwk)
+{
+    const double support = kernel->support;
+    const double sigma = KERNELS[kernel->type].sigma[NUMDIMS - 1];
+    int j;
+    switch(kernel->type) {
+        case 0:
+            KERNEL_BATCH_VARH_LOOP(poly_cs);
+            break;
+        case 1:
+            KERNEL_BATCH_VARH_LOOP(poly_qs);
+            break;
+        default:
+            KERNEL_BATCH_VARH_LOOP(poly_qus);
+    }
+}
+
 double
 density_kernel_desnumngb(DensityKernel * kernel, double eta)
 {
@@ -43,6 +43,22 @@ density_kernel_dwk(DensityKernel * kernel, double u);
 double
 density_kernel_volume(DensityKernel * kernel);
 
+#pragma omp declare target
+/* Evaluate the kernel and its derivative for n values of u = r / H, writing wk[j] and dwk[j].
+ * Faster than calling density_kernel_wk and density_kernel_dwk for each pair.*/
+void
+density_kernel_wk_dwk_batch(const DensityKernel * kernel, const int n, const double * u, double * wk, double * dwk);
+/* Set kernel to the kernel unit, made with H = 1, scaled to smoothing length H.
+ * Unlike density_kernel_init this does not use the table of kernels, so it can run on an accelerator.*/
+void
+density_kernel_rescale(DensityKernel * kernel, const DensityKernel * unit, const double H);
+#pragma omp end declare target
+/* Evaluate the kernel derivative for n pairs at distance r[j], each with its own smoothing length H[j].
+ * Only the type of kernel is used. Equivalent to density_kernel_dwk(kernel_j, r[j] / H[j]),
+ * without initialising a kernel for each pair.*/
+void
+density_kernel_dwk_batch_varh(const DensityKernel * kernel, const int n, const double * r, const double * H, double * dwk);
+
 static inline double
 density_kernel_dW(DensityKernel * kernel, double u, double wk, double dwk)
 {
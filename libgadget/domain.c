@@ -79,11 +79,16 @@ void set_domain_par(DomainParams dp)
     domain_params = dp;
 }
 
+DomainParams get_domain_par(void)
+{
+    return domain_params;
+}
+
 /*Set the parameters of the domain module*/
 void set_domain_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         domain_params.DomainOverDecompositionFactor = param_get_int(ps, "DomainOverDecompositionFactor");
         /* Create one domain per thread. This helps the balance and makes the treebuild merge faster*/
@@ -95,14 +100,49 @@ void set_domain_params(ParameterSet * ps)
             domain_params.DomainOverDecompositionFactor = 4;
         domain_params.TopNodeAllocFactor = param_get_double(ps, "TopNodeAllocFactor");
         domain_params.DomainUseGlobalSorting = param_get_int(ps, "DomainUseGlobalSorting");
+        domain_params.DomainHistogramTopTree = param_get_int(ps, "DomainHistogramTopTree");
         domain_params.SetAsideFactor = 1.;
+        domain_params.DomainUseGravCost = param_get_int(ps, "DomainUseGravCost");
+        domain_params.DomainWorkWeight = param_get_double(ps, "DomainWorkWeight");
+        domain_params.DomainGasWeight = param_get_double(ps, "DomainGasWeight");
+        domain_params.DomainMemoryWeight = param_get_double(ps, "DomainMemoryWeight");
+        domain_params.DomainNodeAware = param_get_int(ps, "DomainNodeAware");
+        domain_params.DomainIncremental = param_get_int(ps, "DomainIncremental");
+        domain_params.DomainEdgeBand = param_get_double(ps, "DomainEdgeBand");
+        if(domain_params.DomainEdgeBand < 0 || domain_params.DomainEdgeBand >= 0.5)
+            endrun(0, "DomainEdgeBand = %g must be between 0 and 0.5\n", domain_params.DomainEdgeBand);
+        if(domain_params.DomainWorkWeight < 0 || domain_params.DomainGasWeight < 0 || domain_params.DomainMemoryWeight < 0)
+            endrun(0, "Domain balance weights must be non-negative: work %g gas %g memory %g\n",
+                   domain_params.DomainWorkWeight, domain_params.DomainGasWeight, domain_params.DomainMemoryWeight);
     }
-    MPI_Bcast(&domain_params, sizeof(DomainParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&domain_params, sizeof(DomainParams), MPI_BYTE, 0, GadgetComm);
 }
 
 static void
 domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int NsegmentPerTask);
 
+/* The work estimate for a particle: one, plus the number of gravity interactions
+ * on the last PM step and of neighbour interactions when last active if DomainUseGravCost is set.
+ * Particles not yet walked count as one.*/
+static inline int64_t
+domain_particle_cost(const int i)
+{
+    if(!domain_params.DomainUseGravCost)
+        return 1;
+    return 1 + (int64_t) P[i].GravCost + (int64_t) P[i].NgbCost;
+}
+
+/* The memory used by a particle, in bytes, including its slot.*/
+static inline int64_t
+domain_particle_memory(const int i)
+{
+    int64_t mem = sizeof(struct particle_data);
+    const struct slot_info * info = &SlotsManager->info[P[i].Type];
+    if(info->enabled)
+        mem += info->elsize;
+    return mem;
+}
+
 static int domain_allocate(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy);
 
 static int
@@ -111,12 +151,12 @@ domain_check_memory_bound(const DomainDecomp * ddecomp, int64_t *TopLeafWork, in
 static int domain_attempt_decompose(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy, const int MaxTopNodes);
 
 static int
-domain_balance(DomainDecomp * ddecomp);
+domain_balance(DomainDecomp * ddecomp, const int incremental);
 
 static int domain_determine_global_toptree(DomainDecompositionPolicy * policy, struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes, MPI_Comm DomainComm);
 
 static void
-domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount);
+domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount, int64_t *TopLeafGas, int64_t *TopLeafMemory);
 
 static void
 domain_toptree_merge(struct local_topnode_data *treeA, struct local_topnode_data *treeB, int noA, int noB, int * treeASize, const int MaxTopNodes);
@@ -138,6 +178,9 @@ domain_layoutfunc(int n, const void * userdata);
 static int
 domain_policies_init(DomainDecompositionPolicy policies[], const int Npolicies);
 
+static void
+domain_mark_edge_particles(DomainDecomp * ddecomp);
+
 /*! This is the main routine for the domain decomposition.  It acts as a
  *  driver routine that allocates various temporary buffers, maps the
  *  particles back onto the periodic box if needed, and then does the
@@ -188,7 +231,7 @@ void domain_decompose_full(DomainDecomp * ddecomp)
         } while(decompose_failed);
 
         /* Still try an exchange if this is the last policy.*/
-        if(domain_balance(ddecomp) && (i < Npolicies-1))
+        if(domain_balance(ddecomp, 0) && (i < Npolicies-1))
             continue;
 
         /* copy the used nodes from temp to the true. */
@@ -206,7 +249,11 @@ void domain_decompose_full(DomainDecomp * ddecomp)
         myfree(OldTopLeaves);
         myfree(OldTopNodes);
 
-        if(domain_exchange(domain_layoutfunc, ddecomp, NULL, PartManager, SlotsManager, 10000, ddecomp->DomainComm)) {
+        /* The pseudo particle cache for the new top leaves. The first exchange marks it valid.*/
+        ddecomp->TopLeafMoments = (struct topleaf_momentsdata *) mymalloc2("TopLeafMoments", sizeof(ddecomp->TopLeafMoments[0]) * ddecomp->NTopLeaves);
+        ddecomp->TopLeafMomentsValid = 0;
+
+        if(domain_exchange(domain_layoutfunc, ddecomp, NULL, EXCHANGE_PERSISTENT, PartManager, SlotsManager, 10000, ddecomp->DomainComm)) {
             message(0,"Could not exchange particles\n");
             if(i == Npolicies - 1)
                 endrun(5, "Ran out of policies!\n");
@@ -227,6 +274,8 @@ void domain_decompose_full(DomainDecomp * ddecomp)
      *the same as the particles, garbage is at the end and all particles are in peano order.*/
     slots_gc_sorted(PartManager, SlotsManager);
 
+    domain_mark_edge_particles(ddecomp);
+
     /*Ensure collective*/
     MPIU_Barrier(ddecomp->DomainComm);
     message(0, "Domain decomposition done.\n");
@@ -258,6 +307,108 @@ static inline int inside_topleaf(const int topleaf, const double Pos[3], const F
     return inside;
 }
 
+/* Mark the particles closer than DomainEdgeBand times the smallest top leaf to the edge of their top leaf.
+ * Until some particle could have moved further than this, the others cannot have changed top leaf.*/
+static void
+domain_mark_edge_particles(DomainDecomp * ddecomp)
+{
+    ddecomp->EdgeBand = 0;
+    ddecomp->EdgeDrift = 0;
+    if(domain_params.DomainEdgeBand <= 0)
+        return;
+
+    int i;
+    ForceTree tree = force_tree_top_build(ddecomp, 1);
+    double minlen = PartManager->BoxSize;
+    for(i = 0; i < tree.NTopLeaves; i++) {
+        const struct NODE * const node = &tree.Nodes[tree.TopLeaves[i].treenode];
+        if(node->len < minlen)
+            minlen = node->len;
+    }
+    const double band = domain_params.DomainEdgeBand * minlen;
+
+    int64_t nedge = 0;
+    #pragma omp parallel for reduction(+: nedge)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        struct particle_data * pp = &PartManager->Base[i];
+        const int topleaf = pp->TopLeaf;
+        pp->NearDomainEdge = 1;
+        if(pp->IsGarbage || topleaf < 0 || topleaf >= tree.NTopLeaves)
+            continue;
+        const struct NODE * const node = &tree.Nodes[tree.TopLeaves[topleaf].treenode];
+        double dist = node->len;
+        int k;
+        for(k = 0; k < 3; k++) {
+            const double dk = node->len/2 - fabs(pp->Pos[k] - node->center[k]);
+            if(dk < dist)
+                dist = dk;
+        }
+        pp->NearDomainEdge = dist < band;
+        nedge += pp->NearDomainEdge;
+    }
+    force_tree_free(&tree);
+
+    MPI_Allreduce(MPI_IN_PLACE, &nedge, 1, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
+    message(0, "%ld particles are within %g of a domain edge\n", nedge, band);
+    ddecomp->EdgeBand = band;
+}
+
+/* Update the top leaf of a particle which has left it and
+ * return 1 if the particle now belongs on another task.*/
+static inline int
+domain_check_exchange(const int i, const DomainDecomp * ddecomp, const ForceTree * const tree)
+{
+    /* Garbage is not in the tree*/
+    if(PartManager->Base[i].IsGarbage)
+        return 0;
+    /* If we aren't using DM for the dynamic friction, we don't need to build a tree with inactive DM particles.
+     * Velocity dispersions are computed on a PM step only.
+     * In this case, keep the particles on this processor.*/
+    if(!(blackhole_dynfric_treemask() & DMMASK))
+        if(PartManager->Base[i].Type == 1 && !is_timebin_active(PartManager->Base[i].TimeBinGravity, PartManager->Base[i].Ti_drift))
+            return 0;
+    if(!inside_topleaf(PartManager->Base[i].TopLeaf, PartManager->Base[i].Pos, tree)) {
+        const int no = domain_get_topleaf(PEANO(PartManager->Base[i].Pos, PartManager->BoxSize), ddecomp);
+        /* Set the topleaf for layoutfunc.*/
+        PartManager->Base[i].TopLeaf = no;
+    }
+    return domain_layoutfunc(i, ddecomp) != tree->ThisTask;
+}
+
+/* Rebalance the domains without rebuilding the top tree. The top leaves are kept
+ * and re-assigned to tasks with the usual contiguous cut of the Peano-Hilbert curve.
+ * As the curve is cut where the cumulative cost reaches each task's share, a boundary only
+ * moves by the imbalance accumulated before it, and only particles in the leaves that
+ * change task are exchanged.*/
+int domain_rebalance(DomainDecomp * ddecomp)
+{
+    if(!domain_params.DomainIncremental || !ddecomp->domain_allocated_flag)
+        return 1;
+
+    message(0, "Attempting an incremental domain rebalance\n");
+
+    if(domain_balance(ddecomp, 1))
+        return 1;
+
+    /* Leaves may have been renumbered*/
+    ddecomp->TopLeafMomentsValid = 0;
+
+    if(domain_exchange(domain_layoutfunc, ddecomp, NULL, EXCHANGE_PERSISTENT, PartManager, SlotsManager, 10000, ddecomp->DomainComm)) {
+        message(0, "Could not exchange particles after rebalance\n");
+        return 1;
+    }
+
+    slots_gc_sorted(PartManager, SlotsManager);
+
+    domain_mark_edge_particles(ddecomp);
+
+    MPIU_Barrier(ddecomp->DomainComm);
+    message(0, "Domain rebalance done.\n");
+
+    walltime_measure("/Domain/PeanoSort");
+    return 0;
+}
+
 /* This is a cut-down version of the domain decomposition that leaves the
  * domain grid intact, but exchanges the particles and rebuilds the tree */
 int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
@@ -272,6 +423,11 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
     if(drift)
         ddrift = get_exact_drift_factor(drift->CP, drift->ti0, drift->ti1);
 
+    /* Only particles near the edge of their top leaf need be checked, while the band is wider than
+     * the distance the fastest particle has moved. Black holes may jump to the potential minimum.*/
+    const int useband = drift && ddecomp->EdgeBand > 0;
+    double vmax2 = 0;
+
     /*Garbage particles are counted so we have an accurate memory estimate*/
     int ngarbage = 0;
     gadget_thread_arrays gthread = gadget_setup_thread_arrays("exchangelist", 1, PartManager->NumPart);
@@ -283,37 +439,80 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
         size_t nexthr_local = 0;
         const int tid = omp_get_thread_num();
         int * threx_local = gthread.srcs[tid];
-    #pragma omp for schedule(static, gthread.schedsz) reduction(+: ngarbage)
+        struct DriftFactorCache cache = {0};
+    #pragma omp for schedule(static, gthread.schedsz) reduction(+: ngarbage) reduction(max: vmax2)
     for(i=0; i < PartManager->NumPart; i++) {
+        struct particle_data * pp = &PartManager->Base[i];
+        int deferred = 0;
         if(drift) {
-            real_drift_particle(&PartManager->Base[i], SlotsManager, ddrift, PartManager->BoxSize, rel_random_shift);
-            PartManager->Base[i].Ti_drift = drift->ti1;
+            deferred = drift_is_deferred(pp, drift);
+            if(!deferred) {
+                double pdrift = ddrift;
+                /* This particle had its drift deferred, so was not followed by the edge band*/
+                if(pp->Ti_drift != drift->ti0) {
+                    pdrift = drift_factor_cached(&cache, drift->CP, pp->Ti_drift, drift->ti1);
+                    pp->NearDomainEdge = 1;
+                }
+                real_drift_particle(pp, SlotsManager, pdrift, PartManager->BoxSize, rel_random_shift);
+                pp->Ti_drift = drift->ti1;
+            }
         }
-        /* Garbage is not in the tree*/
-        if(PartManager->Base[i].IsGarbage) {
+        if(pp->IsGarbage) {
             ngarbage++;
             continue;
         }
-        /* If we aren't using DM for the dynamic friction, we don't need to build a tree with inactive DM particles.
-         * Velocity dispersions are computed on a PM step only.
-         * In this case, keep the particles on this processor.*/
-        if(!(blackhole_dynfric_treemask() & DMMASK))
-            if(PartManager->Base[i].Type == 1 && !is_timebin_active(PartManager->Base[i].TimeBinGravity, PartManager->Base[i].Ti_drift))
+        if(useband) {
+            const double v2 = pp->Vel[0] * pp->Vel[0] + pp->Vel[1] * pp->Vel[1] + pp->Vel[2] * pp->Vel[2];
+            if(v2 > vmax2)
+                vmax2 = v2;
+            if(!pp->NearDomainEdge && pp->Type != 5)
                 continue;
-        if(!inside_topleaf(PartManager->Base[i].TopLeaf, PartManager->Base[i].Pos, &tree)) {
-            const int no = domain_get_topleaf(PEANO(PartManager->Base[i].Pos, PartManager->BoxSize), ddecomp);
-            /* Set the topleaf for layoutfunc.*/
-            PartManager->Base[i].TopLeaf = no;
         }
-        int target = domain_layoutfunc(i, ddecomp);
-        if(target != tree.ThisTask) {
+        /* Particles not drifted stay where they are*/
+        if(deferred)
+            continue;
+        if(domain_check_exchange(i, ddecomp, &tree)) {
             threx_local[nexthr_local] = i;
             nexthr_local++;
         }
     }
     gthread.sizes[tid] = nexthr_local;
     }
+
+    int checkall = 0;
+    if(useband) {
+        MPI_Allreduce(MPI_IN_PLACE, &vmax2, 1, MPI_DOUBLE, MPI_MAX, ddecomp->DomainComm);
+        ddecomp->EdgeDrift += sqrt(vmax2) * ddrift;
+        checkall = ddecomp->EdgeDrift >= ddecomp->EdgeBand;
+    }
+    /* Particles may have crossed the band: check the rest.
+     * The same static schedule gives each thread the same particles, so it can append to its list.*/
+    if(checkall) {
+        message(0, "Particles may have moved %g, further than the domain edge band %g. Checking all particles.\n",
+                ddecomp->EdgeDrift, ddecomp->EdgeBand);
+#pragma omp parallel
+        {
+            const int tid = omp_get_thread_num();
+            size_t nexthr_local = gthread.sizes[tid];
+            int * threx_local = gthread.srcs[tid];
+        #pragma omp for schedule(static, gthread.schedsz)
+        for(i=0; i < PartManager->NumPart; i++) {
+            const struct particle_data * pp = &PartManager->Base[i];
+            if(pp->NearDomainEdge || pp->Type == 5)
+                continue;
+            if(drift && drift_is_deferred(pp, drift))
+                continue;
+            if(domain_check_exchange(i, ddecomp, &tree)) {
+                threx_local[nexthr_local] = i;
+                nexthr_local++;
+            }
+        }
+        gthread.sizes[tid] = nexthr_local;
+        }
+    }
     force_tree_free(&tree);
+    if(drift)
+        drift_set_deferred(drift);
     PreExchangeList ExchangeData[1] = {0};
     ExchangeData->ngarbage = ngarbage;
     /*Merge step for the queue.*/
@@ -323,7 +522,10 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
     walltime_measure("/Domain/drift");
 
     /* Try a domain exchange. Note ExchangeList is freed inside.*/
-    int errno = domain_exchange(domain_layoutfunc, ddecomp, ExchangeData, PartManager, SlotsManager, 10000, ddecomp->DomainComm);
+    int errno = domain_exchange(domain_layoutfunc, ddecomp, ExchangeData, EXCHANGE_PERSISTENT, PartManager, SlotsManager, 10000, ddecomp->DomainComm);
+    /* Start a new band from the current positions*/
+    if(!errno && checkall)
+        domain_mark_edge_particles(ddecomp);
     return errno;
 }
 
@@ -334,7 +536,7 @@ domain_policies_init(DomainDecompositionPolicy policies[],
         const int NPolicy)
 {
     int NTask;
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_size(GadgetComm, &NTask);
     int i;
     for(i = 0; i < NPolicy; i ++) {
         /* Sort the local particle distribution before subsampling, and get rid of garbage.
@@ -367,13 +569,15 @@ domain_allocate(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy)
 
     /* Build the domain over the global all-processors communicator.
      * We use a symbol in case we want to do fancy things in the future.*/
-    ddecomp->DomainComm = MPI_COMM_WORLD;
+    ddecomp->DomainComm = GadgetComm;
 
     int NTask;
     MPI_Comm_size(ddecomp->DomainComm, &NTask);
 
     /* Add a tail item to avoid special treatments */
     ddecomp->Tasks = (struct task_data *) mymalloc2("Tasks", bytes = ((NTask + 1)* sizeof(ddecomp->Tasks[0])));
+    ddecomp->TopLeafMoments = NULL;
+    ddecomp->TopLeafMomentsValid = 0;
 
     all_bytes += bytes;
 
@@ -398,6 +602,9 @@ void domain_free(DomainDecomp * ddecomp)
 {
     if(ddecomp->domain_allocated_flag)
     {
+        if(ddecomp->TopLeafMoments)
+            myfree(ddecomp->TopLeafMoments);
+        ddecomp->TopLeafMoments = NULL;
         myfree(ddecomp->TopLeaves);
         myfree(ddecomp->TopNodes);
         myfree(ddecomp->Tasks);
@@ -461,27 +668,169 @@ domain_attempt_decompose(DomainDecomp * ddecomp, DomainDecompositionPolicy * pol
     return 0;
 }
 
+/* Largest value of the TopLeaf costs on any task, relative to the mean*/
+static double
+domain_max_imbalance(const DomainDecomp * ddecomp, const int64_t * cost)
+{
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+    int64_t max = 0, sum = 0;
+    int ta;
+    #pragma omp parallel for reduction(+: sum) reduction(max: max)
+    for(ta = 0; ta < NTask; ta++) {
+        int64_t tcost = 0;
+        int i;
+        for(i = ddecomp->Tasks[ta].StartLeaf; i < ddecomp->Tasks[ta].EndLeaf; i ++)
+            tcost += cost[i];
+        sum += tcost;
+        if(tcost > max)
+            max = tcost;
+    }
+    if(sum == 0)
+        return 1;
+    return max / ((double) sum / NTask);
+}
+
+static void
+domain_report_balance(const DomainDecomp * ddecomp, const int64_t * TopLeafGas, const int64_t * TopLeafMemory)
+{
+    message(0, "Largest load: gas=%g memory=%g\n",
+            domain_max_imbalance(ddecomp, TopLeafGas), domain_max_imbalance(ddecomp, TopLeafMemory));
+}
+
+/* Combine several costs per TopLeaf into one. Each cost is normalised so that its mean leaf cost is
+ * DOMAIN_COST_UNIT, then the costs are summed with the given weights.
+ * The segments are then cut on the weighted sum, which balances every objective with positive weight
+ * as long as they are correlated over the scale of a segment.*/
+#define DOMAIN_COST_UNIT (1L<<20)
+
+static void
+domain_combine_costs(const int NTopLeaves, int64_t * combined, int64_t ** costs, const double * weights, const int ncost)
+{
+    double norm[ncost];
+    double sumweight = 0;
+    int c, i;
+    for(c = 0; c < ncost; c++)
+        sumweight += weights[c];
+    for(c = 0; c < ncost; c++) {
+        int64_t total = 0;
+        #pragma omp parallel for reduction(+: total)
+        for(i = 0; i < NTopLeaves; i++)
+            total += costs[c][i];
+        norm[c] = 0;
+        if(total > 0)
+            norm[c] = weights[c] / sumweight * DOMAIN_COST_UNIT * NTopLeaves / total;
+    }
+    #pragma omp parallel for
+    for(i = 0; i < NTopLeaves; i++) {
+        double cost = 0;
+        for(c = 0; c < ncost; c++)
+            cost += norm[c] * costs[c][i];
+        combined[i] = llround(cost);
+    }
+}
+
+/* Check whether any top leaf holds more than twice the count or work that the
+ * refinement of a full decomposition would allow, so that the top tree needs rebuilding.*/
+static int
+domain_leaves_overloaded(const DomainDecomp * ddecomp, const int64_t * TopLeafWork, const int64_t * TopLeafCount)
+{
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+    const int64_t NTargetLeaves = (int64_t) domain_params.DomainOverDecompositionFactor * NTask;
+
+    int64_t totcount = 0, maxcount = 0, totwork = 0, maxwork = 0;
+    int i;
+    #pragma omp parallel for reduction(+: totcount, totwork) reduction(max: maxcount, maxwork)
+    for(i = 0; i < ddecomp->NTopLeaves; i++) {
+        totcount += TopLeafCount[i];
+        if(TopLeafCount[i] > maxcount)
+            maxcount = TopLeafCount[i];
+        if(TopLeafWork) {
+            totwork += TopLeafWork[i];
+            if(TopLeafWork[i] > maxwork)
+                maxwork = TopLeafWork[i];
+        }
+    }
+    if(maxcount > 2 * totcount / NTargetLeaves || maxwork > 2 * totwork / NTargetLeaves) {
+        message(0, "Largest top leaf has count %ld (mean %g) work %ld (mean %g), rebuilding top tree.\n",
+                maxcount, (double) totcount / NTargetLeaves, maxwork, (double) totwork / NTargetLeaves);
+        return 1;
+    }
+    return 0;
+}
+
+/* Assign the top leaves to tasks, trying the multi-constraint cost (if TopLeafGas is set),
+ * then the work (with DomainUseGravCost), then the particle count, until the memory bound is met.*/
+static int
+domain_assign_costs(DomainDecomp * ddecomp, int64_t * TopLeafWork, int64_t * TopLeafCount, int64_t * TopLeafGas, int64_t * TopLeafMemory)
+{
+    int status = 1;
+    /* first try the weighted balance of all objectives*/
+    if(TopLeafGas) {
+        int64_t * TopLeafCombined = (int64_t *) mymalloc("TopLeafCombined",  ddecomp->NTopLeaves * sizeof(TopLeafCombined[0]));
+        int64_t * costs[3] = {TopLeafWork, TopLeafGas, TopLeafMemory};
+        const double weights[3] = {domain_params.DomainWorkWeight, domain_params.DomainGasWeight, domain_params.DomainMemoryWeight};
+        domain_combine_costs(ddecomp->NTopLeaves, TopLeafCombined, costs, weights, 3);
+        domain_assign_balanced(ddecomp, TopLeafCombined, 1);
+        myfree(TopLeafCombined);
+        status = domain_check_memory_bound(ddecomp, TopLeafWork, TopLeafCount);
+        if(status == 0)
+            domain_report_balance(ddecomp, TopLeafGas, TopLeafMemory);
+        else
+            message(0, "Multi-constraint balanced domain is outside memory bounds, balancing work.\n");
+    }
+    /* then try work balance */
+    if(status != 0 && domain_params.DomainUseGravCost) {
+        domain_assign_balanced(ddecomp, TopLeafWork, 1);
+        status = domain_check_memory_bound(ddecomp, TopLeafWork, TopLeafCount);
+        if(status != 0)
+            message(0, "Work balanced domain is outside memory bounds, balancing particle load.\n");
+    }
+    if(status != 0) {
+        domain_assign_balanced(ddecomp, TopLeafCount, 1);
+        status = domain_check_memory_bound(ddecomp, TopLeafWork, TopLeafCount);
+    }
+    if(status != 0)
+        message(0, "Domain decomposition is outside memory bounds.\n");
+    return status;
+}
+
 /**
  * attempt to assign segments to tasks such that the load or work is balanced.
+ * If incremental is set, first check that the existing top leaves are still fine enough.
  *
  * */
 static int
-domain_balance(DomainDecomp * ddecomp)
+domain_balance(DomainDecomp * ddecomp, const int incremental)
 {
     /*!< a table that gives the total number of particles held by each processor */
     int64_t * TopLeafCount = (int64_t *) mymalloc("TopLeafCount",  ddecomp->NTopLeaves * sizeof(TopLeafCount[0]));
+    int64_t * TopLeafWork = NULL;
+    int64_t * TopLeafGas = NULL;
+    int64_t * TopLeafMemory = NULL;
+    const int multi = domain_params.DomainWorkWeight > 0 || domain_params.DomainGasWeight > 0 || domain_params.DomainMemoryWeight > 0;
+    if(domain_params.DomainUseGravCost || multi)
+        TopLeafWork = (int64_t *) mymalloc("TopLeafWork",  ddecomp->NTopLeaves * sizeof(TopLeafWork[0]));
+    if(multi) {
+        TopLeafGas = (int64_t *) mymalloc("TopLeafGas",  ddecomp->NTopLeaves * sizeof(TopLeafGas[0]));
+        TopLeafMemory = (int64_t *) mymalloc("TopLeafMemory",  ddecomp->NTopLeaves * sizeof(TopLeafMemory[0]));
+    }
 
-    domain_compute_costs(ddecomp, NULL, TopLeafCount);
-
-    /* first try work balance */
-    domain_assign_balanced(ddecomp, TopLeafCount, 1);
+    domain_compute_costs(ddecomp, TopLeafWork, TopLeafCount, TopLeafGas, TopLeafMemory);
 
-    int status = domain_check_memory_bound(ddecomp, NULL, TopLeafCount);
-    if(status != 0)
-        message(0, "Domain decomposition is outside memory bounds.\n");
+    int status = 1;
+    if(!incremental || !domain_leaves_overloaded(ddecomp, TopLeafWork, TopLeafCount))
+        status = domain_assign_costs(ddecomp, TopLeafWork, TopLeafCount, TopLeafGas, TopLeafMemory);
 
     walltime_measure("/Domain/Decompose");
 
+    if(TopLeafMemory)
+        myfree(TopLeafMemory);
+    if(TopLeafGas)
+        myfree(TopLeafGas);
+    if(TopLeafWork)
+        myfree(TopLeafWork);
     myfree(TopLeafCount);
 
     return status;
@@ -582,6 +931,45 @@ topleaf_ext_order_by_key(const void * c1, const void * c2)
 }
 
 
+/* Find the order in which the ranks of comm receive the Peano-Hilbert segments.
+ * Ranks are grouped by the shared memory node they run on, nodes ordered by their lowest rank,
+ * and ranks within a node are in order. If the ranks are placed on nodes in blocks this is the identity.*/
+static void
+domain_node_rank_order(MPI_Comm comm, int * order)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    MPI_Comm NodeComm;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &NodeComm);
+    /* The node is labelled by its lowest rank, which is rank 0 of NodeComm*/
+    int leader = ThisTask;
+    MPI_Bcast(&leader, 1, MPI_INT, 0, NodeComm);
+    MPI_Comm_free(&NodeComm);
+
+    int * leaders = ta_malloc("leaders", int, NTask);
+    int * offset = ta_malloc("offset", int, NTask);
+    MPI_Allgather(&leader, 1, MPI_INT, leaders, 1, MPI_INT, comm);
+
+    /* Counting sort of the ranks by leader, stable so ranks stay ordered within a node*/
+    int i;
+    memset(offset, 0, NTask * sizeof(offset[0]));
+    for(i = 0; i < NTask; i++)
+        offset[leaders[i]]++;
+    int total = 0;
+    for(i = 0; i < NTask; i++) {
+        const int count = offset[i];
+        offset[i] = total;
+        total += count;
+    }
+    for(i = 0; i < NTask; i++)
+        order[offset[leaders[i]]++] = i;
+
+    ta_free(offset);
+    ta_free(leaders);
+}
+
 /**
  * This function assigns TopLeaves to Segments, trying to ensure uniform cost
  * by assigning TopLeaves (contiguously) until a Segment has a desired size.
@@ -593,6 +981,9 @@ topleaf_ext_order_by_key(const void * c1, const void * c2)
  * This creates the index in Tasks[Task].StartLeaf and Tasks[Task].EndLeaf
  * cost is the cost per TopLeaves
  *
+ * With DomainNodeAware the segments are handed to the ranks grouped by node,
+ * so that the curve is split first between nodes and then between the ranks of each node.
+ *
  * */
 static void
 domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int NsegmentPerTask)
@@ -725,14 +1116,37 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
         endrun(0, "Assertion failed. Total cost is not fully assigned to all ranks\n");
     }
 
+    /* Hand the segments to the ranks in node order*/
+    if(domain_params.DomainNodeAware) {
+        int * order = ta_malloc("order", int, NTask);
+        domain_node_rank_order(ddecomp->DomainComm, order);
+        #pragma omp parallel for
+        for(i = 0; i < ddecomp->NTopLeaves; i ++)
+            TopLeafExt[i].Task = order[TopLeafExt[i].Task];
+        ta_free(order);
+    }
+
     /* lets rearrange the TopLeafExt by task, such that we can build the Tasks table */
     qsort_openmp(TopLeafExt, ddecomp->NTopLeaves, sizeof(TopLeafExt[0]), topleaf_ext_order_by_task_and_key);
+    /* The particle TopLeaf index refers to the old leaf order, which changes if the tasks are not in key order.*/
+    int * OldLeafNode = (int *) mymalloc("OldLeafNode", ddecomp->NTopLeaves * sizeof(OldLeafNode[0]));
+    for(i = 0; i < ddecomp->NTopLeaves; i ++)
+        OldLeafNode[i] = ddecomp->TopLeaves[i].topnode;
+
     for(i = 0; i < ddecomp->NTopLeaves; i ++) {
         ddecomp->TopNodes[TopLeafExt[i].topnode].Leaf = i;
         ddecomp->TopLeaves[i].Task = TopLeafExt[i].Task;
         ddecomp->TopLeaves[i].topnode = TopLeafExt[i].topnode;
     }
 
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage)
+            continue;
+        P[i].TopLeaf = ddecomp->TopNodes[OldLeafNode[P[i].TopLeaf]].Leaf;
+    }
+    myfree(OldLeafNode);
+
     myfree(TopLeafExt);
     /* here we reduce the number of code branches by adding an item to the end. */
     ddecomp->TopLeaves[ddecomp->NTopLeaves].Task = NTask;
@@ -942,20 +1356,6 @@ domain_toptree_truncate(
 }
 
 
-static int
-order_by_key(const void *a, const void *b)
-{
-    const struct local_particle_data * pa  = (const struct local_particle_data *) a;
-    const struct local_particle_data * pb  = (const struct local_particle_data *) b;
-    if(pa->Key < pb->Key)
-        return -1;
-
-    if(pa->Key > pb->Key)
-        return +1;
-
-    return 0;
-}
-
 static void
 mp_order_by_key(const void * data, void * radix, void * arg)
 {
@@ -1020,11 +1420,11 @@ domain_check_for_local_refine_subsample(
                 continue;
             }
             LPfull[i].Key = PEANO(P[i].Pos, PartManager->BoxSize);
-            LPfull[i].Cost = 1;
+            LPfull[i].Cost = domain_particle_cost(i);
         }
 
         /* First sort to ensure spatially 'even' subsamples and remove garbage.*/
-        qsort_openmp(LPfull, PartManager->NumPart, sizeof(struct local_particle_data), order_by_key);
+        radix_sort_openmp(LPfull, PartManager->NumPart, sizeof(struct local_particle_data), offsetof(struct local_particle_data, Key), sizeof(peano_t));
         Nsample = (PartManager->NumPart - garbage) / policy->SubSampleDistance;
         if(Nsample == 0 && PartManager->NumPart > garbage) Nsample = 1;
 
@@ -1044,18 +1444,18 @@ domain_check_for_local_refine_subsample(
         {
             int j = i * policy->SubSampleDistance;
             LP[i].Key = PEANO(P[j].Pos, PartManager->BoxSize);
-            LP[i].Cost = 1;
+            LP[i].Cost = domain_particle_cost(j);
         }
     }
 
     if(domain_params.DomainUseGlobalSorting) {
         mpsort_mpi(LP, Nsample, sizeof(struct local_particle_data), mp_order_by_key, 8, NULL, DomainComm);
+        walltime_measure_mpsort("/Domain/DetermineTopTree/Sort");
     } else {
-        qsort_openmp(LP, Nsample, sizeof(struct local_particle_data), order_by_key);
+        radix_sort_openmp(LP, Nsample, sizeof(struct local_particle_data), offsetof(struct local_particle_data, Key), sizeof(peano_t));
+        walltime_measure("/Domain/DetermineTopTree/Sort");
     }
 
-    walltime_measure("/Domain/DetermineTopTree/Sort");
-
     *topTreeSize = 1;
     topTree[0].Daughter = -1;
     topTree[0].Parent = -1;
@@ -1247,6 +1647,115 @@ domain_nonrecursively_combine_topTree(struct local_topnode_data * topTree, int *
     return errorflagall;
 }
 
+/* Build the global top tree from a histogram of the Peano keys of all particles.
+ * Every rank holds the same tree. In each round the leaves created in the last round that are above
+ * the count or cost limit are split, the particles in them are binned into the new leaves and the
+ * histogram of the new leaves is summed over all ranks. Each round descends one level, so there are
+ * at most BITS_PER_DIMENSION rounds. The memory needed is the tree, a key and leaf per particle and
+ * the histogram of one level. The counts are exact, so no further refinement is needed.*/
+static int
+domain_histogram_toptree(DomainDecompositionPolicy * policy,
+        struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes, MPI_Comm DomainComm)
+{
+    int i;
+    const int NumThreads = omp_get_max_threads();
+    struct local_particle_data * LP = (struct local_particle_data*) mymalloc("LocalParticleData", PartManager->NumPart * sizeof(LP[0]));
+    /* The leaf containing each particle, or -1 for garbage*/
+    int * PartLeaf = (int *) mymalloc("PartLeaf", PartManager->NumPart * sizeof(PartLeaf[0]));
+
+    int64_t TotCount = 0, TotCost = 0;
+    #pragma omp parallel for reduction(+: TotCount, TotCost)
+    for(i = 0; i < PartManager->NumPart; i ++)
+    {
+        if(P[i].IsGarbage) {
+            PartLeaf[i] = -1;
+            continue;
+        }
+        LP[i].Key = PEANO(P[i].Pos, PartManager->BoxSize);
+        LP[i].Cost = domain_particle_cost(i);
+        PartLeaf[i] = 0;
+        TotCount++;
+        TotCost += LP[i].Cost;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &TotCount, 1, MPI_INT64, MPI_SUM, DomainComm);
+    MPI_Allreduce(MPI_IN_PLACE, &TotCost, 1, MPI_INT64, MPI_SUM, DomainComm);
+
+    const int64_t costlimit = TotCost / (policy->NTopLeaves);
+    const int64_t countlimit = TotCount / (policy->NTopLeaves);
+
+    *topTreeSize = 1;
+    topTree[0].Daughter = -1;
+    topTree[0].Parent = -1;
+    topTree[0].Shift = BITS_PER_DIMENSION * 3;
+    topTree[0].StartKey = 0;
+    topTree[0].Count = TotCount;
+    topTree[0].Cost = TotCost;
+
+    int failed = 0, nrounds = 0;
+    int firstnew = 0, nnew = 1;
+    while(1) {
+        /* Split the heavy leaves made in the last round. The tree is the same on all ranks,
+         * but MaxTopNodes may not be.*/
+        const int start = *topTreeSize;
+        for(i = firstnew; i < firstnew + nnew; i++) {
+            if(topTree[i].Shift < 3) continue;
+            if(topTree[i].Count < countlimit && topTree[i].Cost < costlimit) continue;
+            if(domain_toptree_split(topTree, topTreeSize, MaxTopNodes, i)) {
+                failed = 1;
+                break;
+            }
+        }
+        if(MPIU_Any(failed, DomainComm))
+            break;
+        firstnew = start;
+        nnew = *topTreeSize - start;
+        if(nnew == 0)
+            break;
+
+        /* Histogram of the particles in the new leaves: count then cost, one per thread*/
+        int64_t * hist = (int64_t *) mymalloc("TopTreeHist", NumThreads * 2 * nnew * sizeof(hist[0]));
+        memset(hist, 0, NumThreads * 2 * nnew * sizeof(hist[0]));
+        #pragma omp parallel
+        {
+            int64_t * thist = hist + 2 * nnew * omp_get_thread_num();
+            int n;
+            #pragma omp for
+            for(n = 0; n < PartManager->NumPart; n++) {
+                const int leaf = PartLeaf[n];
+                if(leaf < 0 || topTree[leaf].Daughter < 0)
+                    continue;
+                const int sub = topTree[leaf].Daughter + ((LP[n].Key - topTree[leaf].StartKey) >> (topTree[leaf].Shift - 3));
+                PartLeaf[n] = sub;
+                thist[2 * (sub - firstnew)] ++;
+                thist[2 * (sub - firstnew) + 1] += LP[n].Cost;
+            }
+        }
+        int tid;
+        for(tid = 1; tid < NumThreads; tid++)
+            for(i = 0; i < 2 * nnew; i++)
+                hist[i] += hist[i + 2 * nnew * tid];
+        MPI_Allreduce(MPI_IN_PLACE, hist, 2 * nnew, MPI_INT64, MPI_SUM, DomainComm);
+        for(i = 0; i < nnew; i++) {
+            topTree[firstnew + i].Count = hist[2 * i];
+            topTree[firstnew + i].Cost = hist[2 * i + 1];
+        }
+        myfree(hist);
+        nrounds++;
+    }
+
+    myfree(PartLeaf);
+    myfree(LP);
+
+    walltime_measure("/Domain/DetermineTopTree/Histogram");
+
+    if(failed) {
+        message(0, "Histogram topTree needs more than %d nodes.\n", MaxTopNodes);
+        return 1;
+    }
+    message(0, "Histogram topTree size = %d after %d rounds, desired ntopleaves %d.\n", *topTreeSize, nrounds, policy->NTopLeaves);
+    return 0;
+}
+
 /*! This function constructs the global top-level tree node that is used
  *  for the domain decomposition. This is done by considering the string of
  *  Peano-Hilbert keys for all particles, which is recursively chopped off
@@ -1256,6 +1765,9 @@ domain_nonrecursively_combine_topTree(struct local_topnode_data * topTree, int *
 int domain_determine_global_toptree(DomainDecompositionPolicy * policy,
         struct local_topnode_data * topTree, int * topTreeSize, int MaxTopNodes, MPI_Comm DomainComm)
 {
+    if(domain_params.DomainHistogramTopTree)
+        return domain_histogram_toptree(policy, topTree, topTreeSize, MaxTopNodes, DomainComm);
+
     /*
      * Build local refinement with a subsample of particles
      * 1/16 is used because each local topTree node takes about 32 bytes.
@@ -1371,7 +1883,7 @@ domain_global_refine(
 
 
 static void
-domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount)
+domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount, int64_t *TopLeafGas, int64_t *TopLeafMemory)
 {
     int i;
     int NumThreads = omp_get_max_threads();
@@ -1382,6 +1894,13 @@ domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopL
     }
     int64_t * local_TopLeafCount = (int64_t *) mymalloc("local_TopLeafCount", NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafCount[0]));
     memset(local_TopLeafCount, 0, NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafCount[0]));
+    /* The gas and memory costs are computed together*/
+    int64_t * local_TopLeafGas = NULL, * local_TopLeafMemory = NULL;
+    if(TopLeafGas) {
+        local_TopLeafGas = (int64_t *) mymalloc("local_TopLeafGas", 2 * NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafGas[0]));
+        memset(local_TopLeafGas, 0, 2 * NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafGas[0]));
+        local_TopLeafMemory = local_TopLeafGas + NumThreads * ddecomp->NTopLeaves;
+    }
 
 #pragma omp parallel
     {
@@ -1401,9 +1920,15 @@ domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopL
             P[n].TopLeaf = leaf;
 
             if(local_TopLeafWork)
-                local_TopLeafWork[leaf + tid * ddecomp->NTopLeaves] += 1;
+                local_TopLeafWork[leaf + tid * ddecomp->NTopLeaves] += domain_particle_cost(n);
 
             local_TopLeafCount[leaf + tid * ddecomp->NTopLeaves] += 1;
+
+            if(local_TopLeafGas) {
+                if(P[n].Type == 0)
+                    local_TopLeafGas[leaf + tid * ddecomp->NTopLeaves] += 1;
+                local_TopLeafMemory[leaf + tid * ddecomp->NTopLeaves] += domain_particle_memory(n);
+            }
         }
     }
 
@@ -1420,15 +1945,27 @@ domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopL
         for(tid = 1; tid < NumThreads; tid++) {
             local_TopLeafCount[i] += local_TopLeafCount[i + tid * ddecomp->NTopLeaves];
         }
+        if(local_TopLeafGas)
+            for(tid = 1; tid < NumThreads; tid++) {
+                local_TopLeafGas[i] += local_TopLeafGas[i + tid * ddecomp->NTopLeaves];
+                local_TopLeafMemory[i] += local_TopLeafMemory[i + tid * ddecomp->NTopLeaves];
+            }
     }
 
-    if(local_TopLeafWork) {
-        MPI_Allreduce(local_TopLeafWork, TopLeafWork, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
-        myfree(local_TopLeafWork);
+    if(local_TopLeafGas) {
+        MPI_Allreduce(local_TopLeafGas, TopLeafGas, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
+        MPI_Allreduce(local_TopLeafMemory, TopLeafMemory, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
+        myfree(local_TopLeafGas);
     }
 
+    /* Freed in reverse order of allocation*/
     MPI_Allreduce(local_TopLeafCount, TopLeafCount, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
     myfree(local_TopLeafCount);
+
+    if(local_TopLeafWork) {
+        MPI_Allreduce(local_TopLeafWork, TopLeafWork, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
+        myfree(local_TopLeafWork);
+    }
 }
 
 /**
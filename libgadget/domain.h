@@ -23,6 +23,14 @@ struct topleaf_data {
     int treenode; /* used during life span of the tree for looking up in the tree Nodes */
 };
 
+/* Moments of the tree below a top leaf, exchanged to make the pseudo particles.*/
+struct topleaf_momentsdata
+{
+    MyFloat s[3];
+    MyFloat mass;
+    MyFloat hmax;
+};
+
 struct task_data {
     int StartLeaf;
     int EndLeaf;
@@ -37,8 +45,19 @@ typedef struct DomainDecomp {
     int NTopNodes;
     int NTopLeaves;
     struct task_data * Tasks;
+    /* The top leaf moments from the last exchange of the pseudo particles, identical on all tasks.
+     * Tasks whose top leaf moments have not changed since then need not send them again.
+     * Allocated for each full domain decomposition, or NULL if there is no cache.*/
+    struct topleaf_momentsdata * TopLeafMoments;
+    /* Set once TopLeafMoments holds the moments of every top leaf*/
+    int TopLeafMomentsValid;
+    /* Particles within EdgeBand of the edge of their top leaf are marked NearDomainEdge.
+     * EdgeDrift is the furthest any particle can have moved since, and while it is smaller than EdgeBand
+     * only marked particles need be checked for a change of top leaf. Zero EdgeBand means check all particles.*/
+    double EdgeBand;
+    double EdgeDrift;
     /* MPI Communicator over which to build the Domain.
-     * Currently this is always MPI_COMM_WORLD.*/
+     * Currently this is always GadgetComm, the communicator of this simulation.*/
     MPI_Comm DomainComm;
 } DomainDecomp;
 
@@ -51,19 +70,45 @@ typedef struct DomainParams
     int DomainOverDecompositionFactor;
     /** Use a global sort for the first few domain policies to try.*/
     int DomainUseGlobalSorting;
+    /** Build the top tree from a global histogram of the keys of all particles, refined level by level,
+     * instead of merging local trees built from a subsample.*/
+    int DomainHistogramTopTree;
     /** Initial number of Top level tree nodes as a fraction of particles */
     double TopNodeAllocFactor;
     /** Fraction of local particle slots to leave free for, eg, star formation*/
     double SetAsideFactor;
+    /** Balance the work measured by the gravity tree walk (P[].GravCost) rather than the particle number,
+     * as long as the memory bound is met.*/
+    int DomainUseGravCost;
+    /** Weights of the objectives for a multi-constraint balance: gravity work, number of gas particles
+     * (a proxy for the SPH work) and memory. If any is positive the TopLeaves are first assigned on the
+     * weighted sum of the three, each normalised by its total.*/
+    double DomainWorkWeight;
+    double DomainGasWeight;
+    double DomainMemoryWeight;
+    /** Order the ranks by shared memory node before assigning the Peano-Hilbert segments, so that
+     * neighbouring segments are on the same node.*/
+    int DomainNodeAware;
+    /** On PM steps, keep the top tree and only move the segment boundaries, unless a top leaf
+     * has grown too large or the new domains do not fit in memory.*/
+    int DomainIncremental;
+    /** Width of the band at the edge of each top leaf, as a fraction of the smallest top leaf.
+     * Particles inside the band are marked after each decomposition and only these are checked for a change
+     * of domain until the fastest particle has moved further than the band. Zero disables.*/
+    double DomainEdgeBand;
 } DomainParams;
 
 /*Set the parameters of the domain module*/
 void set_domain_params(ParameterSet * ps);
-/* Test helper*/
+/* Test helper, also used to change the parameters during a run*/
 void set_domain_par(DomainParams dp);
+DomainParams get_domain_par(void);
 
 /* Do a full domain decomposition, which splits the particles into even clumps*/
 void domain_decompose_full(DomainDecomp * ddecomp);
+/* Rebalance the existing top leaves between the tasks and exchange particles, keeping the top tree.
+ * Returns non-zero if a full domain decomposition is needed instead.*/
+int domain_rebalance(DomainDecomp * ddecomp);
 /* Exchange particles which have moved into the new domains, not re-doing the split unless we have to*/
 int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift);
 
@@ -83,6 +83,47 @@ void real_drift_particle(struct particle_data * pp, struct slots_manager_type *
     }
 }
 
+int
+drift_is_deferred(const struct particle_data * pp, const struct DriftData * drift)
+{
+    return (drift->DeferMask & (1 << pp->Type)) && !is_timebin_active(pp->TimeBinGravity, drift->ti1);
+}
+
+/* The last drift which may have deferred particles. DeferMask is zero once all particles are drifted.*/
+static struct DriftData LastDrift;
+
+void
+drift_set_deferred(const struct DriftData * drift)
+{
+    LastDrift = *drift;
+}
+
+void
+drift_deferred_particles(void)
+{
+    if(!LastDrift.DeferMask)
+        return;
+    const double noshift[3] = {0};
+    drift_all_particles(LastDrift.ti1, LastDrift.ti1, LastDrift.CP, noshift);
+}
+
+double
+drift_factor_cached(struct DriftFactorCache * cache, Cosmology * CP, const inttime_t ti0, const inttime_t ti1)
+{
+    int i;
+    for(i = 0; i < cache->n; i++)
+        if(cache->ti0[i] == ti0)
+            return cache->ddrift[i];
+    const double ddrift = get_exact_drift_factor(CP, ti0, ti1);
+    /* When full, overwrite the oldest entries*/
+    i = cache->n % DRIFT_FACTOR_CACHE;
+    cache->ti0[i] = ti0;
+    cache->ddrift[i] = ddrift;
+    if(cache->n < DRIFT_FACTOR_CACHE)
+        cache->n++;
+    return ddrift;
+}
+
 /* Update all particles to the current time, shifting them by a random vector.*/
 void drift_all_particles(inttime_t ti0, inttime_t ti1, Cosmology * CP, const double random_shift[3])
 {
@@ -91,16 +132,29 @@ void drift_all_particles(inttime_t ti0, inttime_t ti1, Cosmology * CP, const dou
         endrun(12, "Trying to reverse time: ti0=%ld ti1=%ld\n", ti0, ti1);
     }
     const double ddrift = get_exact_drift_factor(CP, ti0, ti1);
+    const int noshift = random_shift[0] == 0 && random_shift[1] == 0 && random_shift[2] == 0;
 
-#pragma omp parallel for
+#pragma omp parallel
+    {
+    struct DriftFactorCache cache = {0};
+#pragma omp for
     for(i = 0; i < PartManager->NumPart; i++) {
-#ifdef DEBUG
-        if(PartManager->Base[i].Ti_drift != ti0)
-            endrun(10, "Drift time mismatch: (ids = %ld %ld) %ld != %ld\n",PartManager->Base[0].ID, PartManager->Base[i].ID, ti0,  PartManager->Base[i].Ti_drift);
-#endif
-        real_drift_particle(&PartManager->Base[i], SlotsManager, ddrift, PartManager->BoxSize, random_shift);
-        PartManager->Base[i].Ti_drift = ti1;
+        struct particle_data * pp = &PartManager->Base[i];
+        /* Already synchronised: only the deferred particles are drifted when catching up*/
+        if(noshift && pp->Ti_drift == ti1)
+            continue;
+        double pdrift = ddrift;
+        /* Particles whose drift was deferred are behind the others*/
+        if(pp->Ti_drift != ti0) {
+            if(pp->Ti_drift > ti0)
+                endrun(10, "Drift time mismatch: (ids = %ld %ld) %ld > %ld\n",PartManager->Base[0].ID, pp->ID, pp->Ti_drift, ti0);
+            pdrift = drift_factor_cached(&cache, CP, pp->Ti_drift, ti1);
+        }
+        real_drift_particle(pp, SlotsManager, pdrift, PartManager->BoxSize, random_shift);
+        pp->Ti_drift = ti1;
+    }
     }
+    LastDrift.DeferMask = 0;
 
     walltime_measure("/Drift");
 }
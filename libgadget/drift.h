@@ -5,7 +5,8 @@
 #include "partmanager.h"
 #include "slotsmanager.h"
 
-/* Updates all particles to the current drift time*/
+/* Updates all particles to the current drift time.
+ * Particles whose drift was deferred are drifted from their own Ti_drift.*/
 void drift_all_particles(inttime_t ti0, inttime_t ti1, Cosmology * CP, const double random_shift[3]);
 
 void real_drift_particle(struct particle_data * pp, struct slots_manager_type * sman, const double ddrift, const double BoxSize, const double random_shift[3]);
@@ -15,6 +16,32 @@ struct DriftData
     inttime_t ti0;
     inttime_t ti1;
     Cosmology * CP;
+    /* Inactive particles of these types are not needed on this step, so their drift is deferred
+     * until they are active or all particles are drifted. Their Ti_drift stays before ti0.*/
+    int DeferMask;
 };
 
+/* Return 1 if the drift of particle pp to drift->ti1 is deferred*/
+int drift_is_deferred(const struct particle_data * pp, const struct DriftData * drift);
+
+/* Record the last drift of domain_maintain, so the particles it deferred can be caught up later*/
+void drift_set_deferred(const struct DriftData * drift);
+
+/* Drift the particles deferred by the last drift up to its end time, so all particles are synchronised.
+ * Called before a snapshot is written. Does nothing if no drift was deferred.*/
+void drift_deferred_particles(void);
+
+/* Cache of drift factors to one end time from the few start times of particles whose drift was deferred.
+ * Each thread needs its own.*/
+#define DRIFT_FACTOR_CACHE 16
+struct DriftFactorCache
+{
+    inttime_t ti0[DRIFT_FACTOR_CACHE];
+    double ddrift[DRIFT_FACTOR_CACHE];
+    int n;
+};
+
+/* Drift factor from ti0 to ti1, from the cache or computed and stored in it*/
+double drift_factor_cached(struct DriftFactorCache * cache, Cosmology * CP, const inttime_t ti0, const inttime_t ti1);
+
 #endif
@@ -1,5 +1,6 @@
 #include <mpi.h>
 #include <omp.h>
+#include <stddef.h>
 #include <string.h>
 #include "exchange.h"
 #include "forcetree.h"
@@ -7,6 +8,7 @@
 #include "partmanager.h"
 #include "walltime.h"
 #include "timefac.h"
+#include "timestep.h"
 
 #include "utils.h"
 #include "utils/mpsort.h"
@@ -18,7 +20,8 @@ typedef struct {
 } ExchangePlanEntry;
 
 static MPI_Datatype MPI_TYPE_PLAN_ENTRY = 0;
-static MPI_Datatype MPI_TYPE_PARTICLE = 0;
+/* Packed particles, with and without GrNr*/
+static MPI_Datatype MPI_TYPE_PARTICLE[2] = {0};
 static MPI_Datatype MPI_TYPE_SLOT[6] = {0};
 
 /*Small struct to cache the layout function and particle data*/
@@ -27,6 +30,14 @@ typedef struct {
     unsigned int target ;
 } ExchangePartCache;
 
+/* A contiguous range of struct particle_data which is sent in the exchange.*/
+struct ExchangeSpan {
+    size_t offset;
+    size_t size;
+};
+
+#define EXCHANGE_MAX_SPANS 3
+
 typedef struct {
     ExchangePlanEntry * toGo;
     ExchangePlanEntry * toGoOffset;
@@ -45,6 +56,11 @@ typedef struct {
      * Exchange stops when last == nexchange.*/
     size_t last;
     ExchangePartCache * layouts;
+    /* Parts of each particle which are sent, and their total size*/
+    struct ExchangeSpan spans[EXCHANGE_MAX_SPANS];
+    int nspan;
+    size_t packsize;
+    MPI_Datatype parttype;
 } ExchangePlan;
 /*
  *
@@ -56,25 +72,12 @@ static void domain_build_plan(int iter, ExchangeLayoutFunc layoutfunc, const voi
 static size_t domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pman, const struct slots_manager_type * sman);
 static void domain_build_exchange_list(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
 
-/* This function builds the count/displ arrays from
- * the rows stored in the entry struct of the plan.
- * MPI expects these numbers to be tightly packed in memory,
- * but our struct stores them as different columns.
- *
- * Technically speaking, the operation is therefore a transpose.
- * */
-static void
-_transpose_plan_entries(ExchangePlanEntry * entries, int * count, int ptype, int NTask)
-{
-    int i;
-    for(i = 0; i < NTask; i ++) {
-        if(ptype == -1) {
-            count[i] = entries[i].base;
-        } else {
-            count[i] = entries[i].slots[ptype];
-        }
-    }
-}
+/* Message tags of the plan entries and of the particle and slot data in the exchange*/
+#define EXCHANGE_TAG_PLAN 101933
+#define EXCHANGE_TAG_PARTICLE 101935
+#define EXCHANGE_TAG_SLOT(ptype) (101936 + (ptype))
+/* Requests needed per task: a send and a receive for the particles and each slot type*/
+#define EXCHANGE_REQUESTS_PER_TASK 14
 
 static ExchangePlan
 domain_init_exchangeplan(MPI_Comm Comm)
@@ -102,30 +105,62 @@ domain_free_exchangeplan(ExchangePlan * plan)
 }
 
 /*Plan and execute a domain exchange, also performing a garbage collection if requested*/
-int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, PreExchangeList * preexch, struct part_manager_type * pman, struct slots_manager_type * sman, int maxiter, MPI_Comm Comm) {
+/* Find the parts of struct particle_data which are sent: everything but the padding,
+ * and GrNr unless fields includes EXCHANGE_GRNR. Returns the packed size.*/
+static size_t
+exchange_particle_spans(struct ExchangeSpan * spans, int * nspan, const int fields)
+{
+    int n = 0;
+    /* Up to the end of the flags*/
+    spans[n].offset = 0;
+    spans[n].size = offsetof(struct particle_data, Type) + sizeof(((struct particle_data *) 0)->Type);
+    n++;
+    spans[n].offset = offsetof(struct particle_data, Vel);
+    if(fields & EXCHANGE_GRNR) {
+        spans[n].size = sizeof(struct particle_data) - spans[n].offset;
+        n++;
+    }
+    else {
+        spans[n].size = offsetof(struct particle_data, GrNr) - spans[n].offset;
+        n++;
+        spans[n].offset = offsetof(struct particle_data, Potential);
+        spans[n].size = sizeof(struct particle_data) - spans[n].offset;
+        n++;
+    }
+    *nspan = n;
+
+    size_t packsize = 0;
+    int i;
+    for(i = 0; i < n; i++)
+        packsize += spans[i].size;
+    return packsize;
+}
+
+int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, PreExchangeList * preexch, const int fields, struct part_manager_type * pman, struct slots_manager_type * sman, int maxiter, MPI_Comm Comm) {
     int failure = 0;
 
+    /*Structure for building a list of particles that will be exchanged*/
+    ExchangePlan plan = domain_init_exchangeplan(Comm);
+    plan.packsize = exchange_particle_spans(plan.spans, &plan.nspan, fields);
+
     /* register the MPI types used in communication if not yet. */
     if (MPI_TYPE_PLAN_ENTRY == 0) {
         MPI_Type_contiguous(sizeof(ExchangePlanEntry), MPI_BYTE, &MPI_TYPE_PLAN_ENTRY);
         MPI_Type_commit(&MPI_TYPE_PLAN_ENTRY);
     }
-    if (MPI_TYPE_PARTICLE == 0) {
-        MPI_Type_contiguous(sizeof(struct particle_data), MPI_BYTE, &MPI_TYPE_PARTICLE);
-        MPI_Type_commit(&MPI_TYPE_PARTICLE);
-        int ptype;
-        for(ptype = 0; ptype < 6; ptype++) {
-            if(!sman->info[ptype].enabled)
-                continue;
-            MPI_Type_contiguous(sman->info[ptype].elsize, MPI_BYTE, &MPI_TYPE_SLOT[ptype]);
-            MPI_Type_commit(&MPI_TYPE_SLOT[ptype]);
-        }
+    const int withgrnr = !!(fields & EXCHANGE_GRNR);
+    if (MPI_TYPE_PARTICLE[withgrnr] == 0) {
+        MPI_Type_contiguous(plan.packsize, MPI_BYTE, &MPI_TYPE_PARTICLE[withgrnr]);
+        MPI_Type_commit(&MPI_TYPE_PARTICLE[withgrnr]);
+    }
+    plan.parttype = MPI_TYPE_PARTICLE[withgrnr];
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!sman->info[ptype].enabled || MPI_TYPE_SLOT[ptype] != 0)
+            continue;
+        MPI_Type_contiguous(sman->info[ptype].elsize, MPI_BYTE, &MPI_TYPE_SLOT[ptype]);
+        MPI_Type_commit(&MPI_TYPE_SLOT[ptype]);
     }
-
-
-
-    /*Structure for building a list of particles that will be exchanged*/
-    ExchangePlan plan = domain_init_exchangeplan(Comm);
 
     int iter = 0;
 
@@ -200,19 +235,107 @@ shall_we_compact_slots(int * compact, ExchangePlan * plan, const struct slots_ma
         /* gc if we are low on slot memory. */
         if (sman->info[ptype].size + plan->toGetSum.slots[ptype] > 0.95 * sman->info[ptype].maxsize)
             lcompact[ptype] = 1;
-        /* gc if we had a very large exchange. */
-        if(plan->toGoSum.slots[ptype] > 0.1 * sman->info[ptype].size)
+        /* gc if many slots are garbage, eg, after a very large exchange.
+         * Below this the garbage slots are reused by new particles.*/
+        if(sman->info[ptype].ngarbage > sman->gc_fraction * sman->info[ptype].size)
             lcompact[ptype] = 1;
     }
     /*Make the slot compaction collective*/
     MPI_Allreduce(lcompact, compact, 6, MPI_INT, MPI_LOR, Comm);
 }
 
+/* Copy the sent parts of a particle to buf*/
+static void
+exchange_pack_particle(char * buf, const struct particle_data * part, const ExchangePlan * plan)
+{
+    int i;
+    for(i = 0; i < plan->nspan; i++) {
+        memcpy(buf, (const char *) part + plan->spans[i].offset, plan->spans[i].size);
+        buf += plan->spans[i].size;
+    }
+}
+
+/* Packed particles from a source are received into the end of the space they will be unpacked to.*/
+static char *
+exchange_packed_ptr(struct particle_data * dest, const int64_t n, const ExchangePlan * plan)
+{
+    return (char *) dest + n * (sizeof(struct particle_data) - plan->packsize);
+}
+
+/* Unpack n particles received with exchange_packed_ptr(dest, n). Unpacking forwards, particle i
+ * is written below the start of packed particle i + 1, so no packed particle is overwritten before it is read.
+ * Fields which are not sent are zero.*/
+static void
+exchange_unpack_particles(struct particle_data * dest, const int64_t n, const ExchangePlan * plan)
+{
+    const char * packed = exchange_packed_ptr(dest, n, plan);
+    int64_t i;
+    for(i = 0; i < n; i++) {
+        char tmp[sizeof(struct particle_data)];
+        memcpy(tmp, packed + i * plan->packsize, plan->packsize);
+        memset(&dest[i], 0, sizeof(struct particle_data));
+        const char * buf = tmp;
+        int j;
+        for(j = 0; j < plan->nspan; j++) {
+            memcpy((char *) &dest[i] + plan->spans[j].offset, buf, plan->spans[j].size);
+            buf += plan->spans[j].size;
+        }
+    }
+}
+
+/* Post the receives for the incoming particles, directly after the local particles.
+ * Stores the source of each receive in srcs and returns the number of receives.*/
+static int
+domain_post_particle_recvs(ExchangePlan * plan, struct part_manager_type * pman, MPI_Request * requests, int * srcs, MPI_Comm Comm)
+{
+    int src, nrecv = 0;
+    for(src = 0; src < plan->NTask; src++) {
+        if(plan->toGet[src].base == 0)
+            continue;
+        MPI_Irecv(exchange_packed_ptr(pman->Base + pman->NumPart + plan->toGetOffset[src].base, plan->toGet[src].base, plan),
+                  plan->toGet[src].base, plan->parttype,
+                  src, EXCHANGE_TAG_PARTICLE, Comm, &requests[nrecv]);
+        srcs[nrecv++] = src;
+    }
+    return nrecv;
+}
+
+/* Point the particles received from src at the slots they will be received into.*/
+static void
+domain_assign_recv_slots(ExchangePlan * plan, const int src, struct part_manager_type * pman, const struct slots_manager_type * sman)
+{
+    int64_t newPI[6];
+    int64_t i;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype ++) {
+        newPI[ptype] = sman->info[ptype].size + plan->toGetOffset[src].slots[ptype];
+    }
+
+    for(i = pman->NumPart + plan->toGetOffset[src].base;
+        i < pman->NumPart + plan->toGetOffset[src].base + plan->toGet[src].base;
+        i++) {
+        int ptype = pman->Base[i].Type;
+        pman->Base[i].PI = newPI[ptype];
+        newPI[ptype]++;
+    }
+    for(ptype = 0; ptype < 6; ptype ++) {
+        if(newPI[ptype] !=
+            sman->info[ptype].size + plan->toGetOffset[src].slots[ptype]
+          + plan->toGet[src].slots[ptype]) {
+            endrun(1, "N_slots mismatched\n");
+        }
+    }
+}
+
+/* Exchange the particles in the plan. The particles are packed one target at a time and each target's
+ * buffer is sent as soon as it is full, so communication overlaps the packing and the garbage collection.
+ * Particles are unpacked as they arrive. The slots are received once the slot memory has been reserved.
+ * No receive waits on anything but the posting of the matching receives, so there are no barriers.*/
 static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
 {
     size_t n;
     int ptype;
-    struct particle_data *partBuf;
+    char * partBuf;
     char * slotBuf[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
 
     /* Check whether the domain exchange will succeed.
@@ -226,52 +349,97 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
         return 1;
     }
 
+    /* Do a gc if we were asked to, or if we need one
+     * to have enough space for the incoming material.
+     * Decided before packing so that, without a gc, the particles are received while we pack.*/
+    int shall_we_gc = MPIU_Any(do_gc || (pman->NumPart + plan->toGetSum.base > pman->MaxPart), Comm);
+
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    int PTask;
+    for(PTask = 0; plan->NTask > (1 << PTask); PTask++);
+
+    MPI_Request * requests = (MPI_Request *) mymalloc2("requests", EXCHANGE_REQUESTS_PER_TASK * plan->NTask * sizeof(MPI_Request));
+    MPI_Request * partrecv = requests;
+    MPI_Request * partsend = requests + plan->NTask;
+    MPI_Request * slotreqs = requests + 2 * plan->NTask;
+    int nrecv = 0, nsend = 0, nslotreqs = 0;
+    int * recvsrc = ta_malloc("recvsrc", int, plan->NTask);
+
     for(ptype = 0; ptype < 6; ptype++) {
         if(!sman->info[ptype].enabled) continue;
         slotBuf[ptype] = (char *) mymalloc2("SlotBuf", plan->toGoSum.slots[ptype] * sman->info[ptype].elsize);
     }
 
-    partBuf = (struct particle_data *) mymalloc2("partBuf", plan->toGoSum.base * sizeof(struct particle_data));
+    partBuf = (char *) mymalloc2("partBuf", plan->toGoSum.base * plan->packsize);
+
+    if(!shall_we_gc)
+        nrecv = domain_post_particle_recvs(plan, pman, partrecv, recvsrc, Comm);
 
     ExchangePlanEntry * toGoPtr = ta_malloc("toGoPtr", ExchangePlanEntry, plan->NTask);
     memset(toGoPtr, 0, sizeof(toGoPtr[0]) * plan->NTask);
 
-    for(n = 0; n < plan->last; n++)
-    {
-        const int i = plan->ExchangeList[n];
-        /* preparing for export */
+    /* Order the exchange list by target*/
+    int * bytarget = (int *) mymalloc("bytarget", plan->last * sizeof(int));
+    for(n = 0; n < plan->last; n++) {
         const int target = plan->layouts[n].target;
+        bytarget[plan->toGoOffset[target].base + toGoPtr[target].base] = n;
+        toGoPtr[target].base++;
+    }
+    memset(toGoPtr, 0, sizeof(toGoPtr[0]) * plan->NTask);
 
-        int type = plan->layouts[n].ptype;
+    int ngrp;
+    for(ngrp = 0; ngrp < (1 << PTask); ngrp++)
+    {
+        const int target = ThisTask ^ ngrp;
+        if(target >= plan->NTask) continue;
+        if(plan->toGo[target].base == 0) continue;
 
-        /* watch out thread unsafe */
-        int bufPI = toGoPtr[target].slots[type];
-        toGoPtr[target].slots[type] ++;
-        size_t elsize = sman->info[type].elsize;
-        if(sman->info[type].enabled)
-            memcpy(slotBuf[type] + (bufPI + plan->toGoOffset[target].slots[type]) * elsize,
-                (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
-        /* now copy the base P; after PI has been updated */
-        memcpy(&(partBuf[plan->toGoOffset[target].base + toGoPtr[target].base]), pman->Base+i, sizeof(struct particle_data));
-        toGoPtr[target].base ++;
-        /* mark the particle for removal. Both secondary and base slots will be marked. */
-        slots_mark_garbage(i, pman, sman);
+        int64_t k;
+        for(k = plan->toGoOffset[target].base; k < plan->toGoOffset[target].base + plan->toGo[target].base; k++)
+        {
+            const int m = bytarget[k];
+            const int i = plan->ExchangeList[m];
+            /* preparing for export */
+            int type = plan->layouts[m].ptype;
+
+            /* watch out thread unsafe */
+            int bufPI = toGoPtr[target].slots[type];
+            toGoPtr[target].slots[type] ++;
+            size_t elsize = sman->info[type].elsize;
+            if(sman->info[type].enabled)
+                memcpy(slotBuf[type] + (bufPI + plan->toGoOffset[target].slots[type]) * elsize,
+                    (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
+            /* now copy the base P; after PI has been updated */
+            exchange_pack_particle(partBuf + k * plan->packsize, pman->Base + i, plan);
+            /* mark the particle for removal. Both secondary and base slots will be marked. */
+            timebin_lists_remove_particle(pman, i);
+            slots_mark_garbage(i, pman, sman);
+        }
+        /* This target is packed: send it*/
+        MPI_Isend(partBuf + plan->toGoOffset[target].base * plan->packsize, plan->toGo[target].base, plan->parttype,
+                  target, EXCHANGE_TAG_PARTICLE, Comm, &partsend[nsend++]);
+        for(ptype = 0; ptype < 6; ptype++) {
+            if(!sman->info[ptype].enabled || plan->toGo[target].slots[ptype] == 0) continue;
+            MPI_Isend(slotBuf[ptype] + plan->toGoOffset[target].slots[ptype] * sman->info[ptype].elsize,
+                      plan->toGo[target].slots[ptype], MPI_TYPE_SLOT[ptype],
+                      target, EXCHANGE_TAG_SLOT(ptype), Comm, &slotreqs[nslotreqs++]);
+        }
     }
 
+    myfree(bytarget);
     myfree(plan->layouts);
     ta_free(toGoPtr);
     walltime_measure("/Domain/exchange/makebuf");
 
-    /* Do a gc if we were asked to, or if we need one
-     * to have enough space for the incoming material*/
-    int shall_we_gc = do_gc || (pman->NumPart + plan->toGetSum.base > pman->MaxPart);
-    if(MPIU_Any(shall_we_gc, Comm)) {
+    if(shall_we_gc) {
         /*Find which slots to gc*/
         int compact[6] = {0};
         shall_we_compact_slots(compact, plan, sman, Comm);
         slots_gc(compact, pman, sman);
 
         walltime_measure("/Domain/exchange/garbage");
+        nrecv = domain_post_particle_recvs(plan, pman, partrecv, recvsrc, Comm);
     }
 
     int64_t newNumPart;
@@ -287,23 +455,16 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
         endrun(787878, "NumPart=%ld MaxPart=%ld\n", newNumPart, pman->MaxPart);
     }
 
-    int * sendcounts = (int*) ta_malloc("sendcounts", int, plan->NTask);
-    int * senddispls = (int*) ta_malloc("senddispls", int, plan->NTask);
-    int * recvcounts = (int*) ta_malloc("recvcounts", int, plan->NTask);
-    int * recvdispls = (int*) ta_malloc("recvdispls", int, plan->NTask);
-
-    _transpose_plan_entries(plan->toGo, sendcounts, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGoOffset, senddispls, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGet, recvcounts, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGetOffset, recvdispls, -1, plan->NTask);
-
-#ifdef DEBUG
-    message(0, "Starting particle data exchange\n");
-#endif
-    /* recv at the end */
-    MPI_Alltoallv_sparse(partBuf, sendcounts, senddispls, MPI_TYPE_PARTICLE,
-                 pman->Base + pman->NumPart, recvcounts, recvdispls, MPI_TYPE_PARTICLE,
-                 Comm);
+    /* Unpack the particles from each source as they arrive*/
+    int k;
+    for(k = 0; k < nrecv; k++) {
+        int which;
+        MPI_Waitany(nrecv, partrecv, &which, MPI_STATUS_IGNORE);
+        const int src = recvsrc[which];
+        exchange_unpack_particles(pman->Base + pman->NumPart + plan->toGetOffset[src].base, plan->toGet[src].base, plan);
+        domain_assign_recv_slots(plan, src, pman, sman);
+    }
+    MPI_Waitall(nsend, partsend, MPI_STATUSES_IGNORE);
 
     /* Do not need Particle buffer any more, make space for more slots*/
     myfree(partBuf);
@@ -311,83 +472,43 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
     message(0, "Done particle data exchange\n");
 
     slots_reserve(1, newSlots, sman);
-    /* Ensure the reservations are finished on all tasks before we start sending the data*/
-    MPI_Barrier(Comm);
 
+    /* recv at the end */
     for(ptype = 0; ptype < 6; ptype ++) {
         /* skip unused slot types */
         if(!sman->info[ptype].enabled) continue;
 
         size_t elsize = sman->info[ptype].elsize;
-        int N_slots = sman->info[ptype].size;
-        char * ptr = sman->info[ptype].ptr;
-        _transpose_plan_entries(plan->toGo, sendcounts, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGoOffset, senddispls, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGet, recvcounts, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGetOffset, recvdispls, ptype, plan->NTask);
-
-#ifdef DEBUG
-        message(0, "Starting exchange for slot %d\n", ptype);
-#endif
-
-        /* recv at the end */
-        MPI_Alltoallv_sparse(slotBuf[ptype], sendcounts, senddispls, MPI_TYPE_SLOT[ptype],
-                     ptr + N_slots * elsize,
-                     recvcounts, recvdispls, MPI_TYPE_SLOT[ptype],
-                     Comm);
-    }
-
-#ifdef DEBUG
-        message(0, "Done with AlltoAllv\n");
-#endif
-    int src;
-    for(src = 0; src < plan->NTask; src++) {
-        /* unpack each source rank */
-        int64_t newPI[6];
-        int64_t i;
-        for(ptype = 0; ptype < 6; ptype ++) {
-            newPI[ptype] = sman->info[ptype].size + plan->toGetOffset[src].slots[ptype];
+        char * ptr = sman->info[ptype].ptr + sman->info[ptype].size * elsize;
+        int src;
+        for(src = 0; src < plan->NTask; src++) {
+            if(plan->toGet[src].slots[ptype] == 0) continue;
+            MPI_Irecv(ptr + plan->toGetOffset[src].slots[ptype] * elsize, plan->toGet[src].slots[ptype], MPI_TYPE_SLOT[ptype],
+                      src, EXCHANGE_TAG_SLOT(ptype), Comm, &slotreqs[nslotreqs++]);
         }
-
-        for(i = pman->NumPart + plan->toGetOffset[src].base;
-            i < pman->NumPart + plan->toGetOffset[src].base + plan->toGet[src].base;
-            i++) {
-
-            int ptype = pman->Base[i].Type;
-
-
-            pman->Base[i].PI = newPI[ptype];
-
-            newPI[ptype]++;
-
-            if(!sman->info[ptype].enabled) continue;
+    }
+    MPI_Waitall(nslotreqs, slotreqs, MPI_STATUSES_IGNORE);
 
 #ifdef DEBUG
-            int PI = pman->Base[i].PI;
-            if(BASESLOT_PI(PI, ptype, sman)->ID != pman->Base[i].ID) {
-                endrun(1, "Exchange: P[%ld].ID = %ld (type %d) != SLOT ID = %ld. garbage: %d ReverseLink: %d\n",i,pman->Base[i].ID, pman->Base[i].Type, BASESLOT_PI(PI, ptype, sman)->ID, pman->Base[i].IsGarbage, BASESLOT_PI(PI, ptype, sman)->ReverseLink);
-            }
-#endif
-        }
-        for(ptype = 0; ptype < 6; ptype ++) {
-            if(newPI[ptype] !=
-                sman->info[ptype].size + plan->toGetOffset[src].slots[ptype]
-              + plan->toGet[src].slots[ptype]) {
-                endrun(1, "N_slots mismatched\n");
-            }
+    int64_t i;
+    for(i = pman->NumPart; i < newNumPart; i++) {
+        int ptype = pman->Base[i].Type;
+        if(!sman->info[ptype].enabled) continue;
+        int PI = pman->Base[i].PI;
+        if(BASESLOT_PI(PI, ptype, sman)->ID != pman->Base[i].ID) {
+            endrun(1, "Exchange: P[%ld].ID = %ld (type %d) != SLOT ID = %ld. garbage: %d ReverseLink: %d\n",i,pman->Base[i].ID, pman->Base[i].Type, BASESLOT_PI(PI, ptype, sman)->ID, pman->Base[i].IsGarbage, BASESLOT_PI(PI, ptype, sman)->ReverseLink);
         }
     }
+#endif
 
     walltime_measure("/Domain/exchange/alltoall");
 
-    myfree(recvdispls);
-    myfree(recvcounts);
-    myfree(senddispls);
-    myfree(sendcounts);
     for(ptype = 5; ptype >=0; ptype --) {
         if(!sman->info[ptype].enabled) continue;
         myfree(slotBuf[ptype]);
     }
+    ta_free(recvsrc);
+    myfree(requests);
 
     pman->NumPart = newNumPart;
 
@@ -452,10 +573,10 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
     int ptype;
     size_t n, nlimit = mymalloc_freebytes();
 
-    if (nlimit <  4096L * 6 + plan->NTask * 2 * sizeof(MPI_Request))
+    if (nlimit <  4096L * 6 + plan->NTask * EXCHANGE_REQUESTS_PER_TASK * sizeof(MPI_Request))
         endrun(1, "Not enough memory free to store requests!\n");
 
-    nlimit -= 4096 * 2L + plan->NTask * 2 * sizeof(MPI_Request);
+    nlimit -= 4096 * 2L + plan->NTask * EXCHANGE_REQUESTS_PER_TASK * sizeof(MPI_Request);
 
     /* Save some memory for memory headers and wasted space at the end of each allocation.
      * Need max. 2*4096 for each heap-allocated array.*/
@@ -483,7 +604,7 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
 
     /* Fast path: if we have enough space no matter what type the particles
      * are we don't need to check them.*/
-    if(plan->nexchange * (sizeof(pman->Base[0]) + maxsize + sizeof(ExchangePartCache)) < nlimit) {
+    if(plan->nexchange * (sizeof(pman->Base[0]) + maxsize + sizeof(ExchangePartCache) + sizeof(int)) < nlimit) {
         return plan->nexchange;
     }
 
@@ -492,7 +613,7 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
     {
         const int i = plan->ExchangeList[n];
         const int ptype = pman->Base[i].Type;
-        package += sizeof(pman->Base[0]) + sman->info[ptype].elsize + sizeof(ExchangePartCache);
+        package += sizeof(pman->Base[0]) + sman->info[ptype].elsize + sizeof(ExchangePartCache) + sizeof(int);
         if(package >= nlimit) {
 //             message(1,"Not enough space for particles: nlimit=%d, package=%d\n",nlimit,package);
             break;
@@ -501,6 +622,49 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
     return n;
 }
 
+/* Send the toGo entries to the ranks we export to and fill toGet, without an alltoall.
+ * This is the nonblocking consensus (NBX) of Hoefler, Siebert & Lumsdaine 2010:
+ * each non-empty entry is sent with a synchronous send, and we receive entries until all
+ * our sends have been matched. Then we enter a nonblocking barrier and keep receiving until
+ * every rank has entered it, at which point all entries have arrived.
+ * The cost scales with the number of ranks we exchange with rather than the total number of ranks.*/
+static void
+domain_exchange_plan_counts(ExchangePlan * plan, MPI_Comm Comm)
+{
+    memset(plan->toGet, 0, sizeof(plan->toGet[0]) * plan->NTask);
+
+    MPI_Request * requests = (MPI_Request *) mymalloc("planrequests", plan->NTask * sizeof(MPI_Request));
+    int nreq = 0;
+    int target;
+    for(target = 0; target < plan->NTask; target++) {
+        if(plan->toGo[target].base == 0)
+            continue;
+        MPI_Issend(&plan->toGo[target], 1, MPI_TYPE_PLAN_ENTRY, target, EXCHANGE_TAG_PLAN, Comm, &requests[nreq++]);
+    }
+
+    MPI_Request barrier;
+    int barrier_active = 0;
+    int done = 0;
+    while(!done) {
+        int flag;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, EXCHANGE_TAG_PLAN, Comm, &flag, &status);
+        if(flag)
+            MPI_Recv(&plan->toGet[status.MPI_SOURCE], 1, MPI_TYPE_PLAN_ENTRY, status.MPI_SOURCE, EXCHANGE_TAG_PLAN, Comm, MPI_STATUS_IGNORE);
+        if(barrier_active)
+            MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+        else {
+            int sent;
+            MPI_Testall(nreq, requests, &sent, MPI_STATUSES_IGNORE);
+            if(sent) {
+                MPI_Ibarrier(Comm, &barrier);
+                barrier_active = 1;
+            }
+        }
+    }
+    myfree(requests);
+}
+
 /*This function populates the toGo and toGet arrays*/
 static void
 domain_build_plan(int iter, ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, MPI_Comm Comm)
@@ -530,7 +694,7 @@ domain_build_plan(int iter, ExchangeLayoutFunc layoutfunc, const void * layout_u
         plan->toGo[plan->layouts[n].target].slots[plan->layouts[n].ptype]++;
     }
 
-    MPI_Alltoall(plan->toGo, 1, MPI_TYPE_PLAN_ENTRY, plan->toGet, 1, MPI_TYPE_PLAN_ENTRY, Comm);
+    domain_exchange_plan_counts(plan, Comm);
 
     memset(&plan->toGoOffset[0], 0, sizeof(plan->toGoOffset[0]));
     memset(&plan->toGetOffset[0], 0, sizeof(plan->toGetOffset[0]));
@@ -576,8 +740,8 @@ domain_test_id_uniqueness(struct part_manager_type * pman)
     int64_t i;
     MyIDType *ids;
     int NTask, ThisTask;
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
 
     message(0, "Testing ID uniqueness...\n");
 
@@ -590,7 +754,7 @@ domain_test_id_uniqueness(struct part_manager_type * pman)
             ids[i] = (MyIDType) -1;
     }
 
-    mpsort_mpi(ids, pman->NumPart, sizeof(MyIDType), mp_order_by_id, 8, NULL, MPI_COMM_WORLD);
+    mpsort_mpi(ids, pman->NumPart, sizeof(MyIDType), mp_order_by_id, 8, NULL, GadgetComm);
 
     /*Remove garbage from the end*/
     int64_t nids = pman->NumPart;
@@ -617,16 +781,16 @@ domain_test_id_uniqueness(struct part_manager_type * pman)
             if(nids > 0) {
                 ptr = ids;
             }
-            MPI_Send(ptr, sizeof(MyIDType), MPI_BYTE, ThisTask + 1, TAG, MPI_COMM_WORLD);
+            MPI_Send(ptr, sizeof(MyIDType), MPI_BYTE, ThisTask + 1, TAG, GadgetComm);
         }
         else if(ThisTask == NTask - 1) {
             MPI_Recv(prev, sizeof(MyIDType), MPI_BYTE,
-                    ThisTask - 1, TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                    ThisTask - 1, TAG, GadgetComm, MPI_STATUS_IGNORE);
         }
         else if(nids == 0) {
             /* simply pass through whatever we get */
-            MPI_Recv(prev, sizeof(MyIDType), MPI_BYTE, ThisTask - 1, TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            MPI_Send(prev, sizeof(MyIDType), MPI_BYTE, ThisTask + 1, TAG, MPI_COMM_WORLD);
+            MPI_Recv(prev, sizeof(MyIDType), MPI_BYTE, ThisTask - 1, TAG, GadgetComm, MPI_STATUS_IGNORE);
+            MPI_Send(prev, sizeof(MyIDType), MPI_BYTE, ThisTask + 1, TAG, GadgetComm);
         }
         else
         {
@@ -634,7 +798,7 @@ domain_test_id_uniqueness(struct part_manager_type * pman)
                     ids+(nids - 1), sizeof(MyIDType), MPI_BYTE,
                     ThisTask + 1, TAG,
                     prev, sizeof(MyIDType), MPI_BYTE,
-                    ThisTask - 1, TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                    ThisTask - 1, TAG, GadgetComm, MPI_STATUS_IGNORE);
         }
     }
 
@@ -16,7 +16,13 @@ typedef struct PreExchangeList{
     int64_t ngarbage;
 } PreExchangeList;
 
-int domain_exchange(ExchangeLayoutFunc, const void * layout_userdata, PreExchangeList * preexch, struct part_manager_type * pman, struct slots_manager_type * sman, int maxiter, MPI_Comm Comm);
+/* Optional particle fields sent by the exchange. Padding is never sent.*/
+enum ExchangeFields {
+    EXCHANGE_PERSISTENT = 0, /* Fields which are valid between timesteps*/
+    EXCHANGE_GRNR = 1, /* Also send GrNr, which is only meaningful during FOF. Otherwise it is zero after the exchange.*/
+};
+
+int domain_exchange(ExchangeLayoutFunc, const void * layout_userdata, PreExchangeList * preexch, const int fields, struct part_manager_type * pman, struct slots_manager_type * sman, int maxiter, MPI_Comm Comm);
 void domain_test_id_uniqueness(struct part_manager_type * pman);
 
 #endif
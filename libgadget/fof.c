@@ -43,6 +43,7 @@ struct FOFParams
     int FOFHaloMinLength;
     int FOFPrimaryLinkTypes;
     int FOFSecondaryLinkTypes;
+    int FOFCellLinking; /* Link particles on the same rank using a grid of cells instead of the tree*/
     int ExcursionSetReionOn;
 } fof_params;
 
@@ -50,7 +51,7 @@ struct FOFParams
 void set_fof_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         fof_params.FOFSaveParticles = param_get_int(ps, "FOFSaveParticles");
         fof_params.FOFHaloLinkingLength = param_get_double(ps, "FOFHaloLinkingLength");
@@ -59,19 +60,21 @@ void set_fof_params(ParameterSet * ps)
         fof_params.MinMStarForNewSeed = param_get_double(ps, "MinMStarForNewSeed");
         fof_params.FOFPrimaryLinkTypes = param_get_int(ps, "FOFPrimaryLinkTypes");
         fof_params.FOFSecondaryLinkTypes = param_get_int(ps, "FOFSecondaryLinkTypes");
+        fof_params.FOFCellLinking = param_get_int(ps, "FOFCellLinking");
         fof_params.ExcursionSetReionOn = param_get_int(ps, "ExcursionSetReionOn");
     }
-    MPI_Bcast(&fof_params, sizeof(struct FOFParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&fof_params, sizeof(struct FOFParams), MPI_BYTE, 0, GadgetComm);
 }
 
 /* Set parameters for the tests*/
-void set_fof_testpar(int FOFSaveParticles, double FOFHaloLinkingLength, int FOFHaloMinLength)
+void set_fof_testpar(int FOFSaveParticles, double FOFHaloLinkingLength, int FOFHaloMinLength, int FOFCellLinking)
 {
     fof_params.FOFSaveParticles = FOFSaveParticles;
     fof_params.FOFPrimaryLinkTypes = 2;
     fof_params.FOFSecondaryLinkTypes = 1+16+32;
     fof_params.FOFHaloLinkingLength = FOFHaloLinkingLength;
     fof_params.FOFHaloMinLength = FOFHaloMinLength;
+    fof_params.FOFCellLinking = FOFCellLinking;
     /* For seeding (not yet tested)*/
     fof_params.MinFoFMassForNewSeed = 2;
     fof_params.MinMStarForNewSeed = 5e-4;
@@ -101,10 +104,6 @@ struct fof_particle_list
 
 static void fof_label_secondary(struct fof_particle_list * HaloLabel, ForceTree * tree);
 static int fof_compare_HaloLabel_MinID(const void *a, const void *b);
-static int _fof_compare_Group_MinIDTask_ThisTask;
-static int fof_compare_Group_MinIDTask(const void *a, const void *b);
-static int fof_compare_Group_OriginalIndex(const void *a, const void *b);
-static int fof_compare_Group_MinID(const void *a, const void *b);
 static void fof_reduce_groups(
     void * groups,
     int nmemb,
@@ -114,7 +113,7 @@ static void fof_reduce_groups(
 static void fof_finish_group_properties(FOFGroups * fof, double BoxSize);
 
 static int fof_compile_base(struct BaseGroup * base, int NgroupsExt, struct fof_particle_list * HaloLabel, MPI_Comm Comm);
-static void fof_compile_catalogue(FOFGroups * fof, const int NgroupsExt, struct fof_particle_list * HaloLabel, MPI_Comm Comm);
+static void fof_compile_catalogue(FOFGroups * fof, const int NgroupsExt, struct fof_particle_list * HaloLabel, const int SeedOnly, MPI_Comm Comm);
 
 static struct Group *
 fof_alloc_group(const struct BaseGroup * base, const int NgroupsExt);
@@ -128,7 +127,8 @@ typedef struct {
     MyFloat Hsml;
     MyIDType MinID;
     int MinIDTask;
-    int pad;
+    /* Index of the particle on MinIDTask, for the primary treewalk*/
+    int Pindex;
 } TreeWalkQueryFOF;
 
 typedef struct {
@@ -141,10 +141,11 @@ typedef struct {
 
 typedef struct {
     TreeWalkNgbIterBase base;
+    /* First local neighbour of a ghost in the primary treewalk*/
+    int first;
 } TreeWalkNgbIterFOF;
 
 
-static MPI_Datatype MPI_TYPE_GROUP;
 
 /*
  * The FOF finder will produce Group[], which is allocated to the top side of the
@@ -153,7 +154,7 @@ static MPI_Datatype MPI_TYPE_GROUP;
  **/
 
 FOFGroups
-fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm)
+fof_fof(DomainDecomp * ddecomp, const int Flags, ForceTree * tree, MPI_Comm Comm)
 {
     int i;
 
@@ -161,6 +162,8 @@ fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm)
             mymalloc_usedbytes() / (1024.0 * 1024.0));
 
     message(0, "Comoving linking length: %g\n", fof_params.FOFHaloComovingLinkingLength);
+    /* The group properties read the star and black hole slots*/
+    slots_prefetch(ALLMASK, SlotsManager);
 
     struct fof_particle_list * HaloLabel = (struct fof_particle_list *) mymalloc("HaloLabel", PartManager->NumPart * sizeof(struct fof_particle_list));
 
@@ -172,16 +175,22 @@ fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm)
 
     /* We only need a tree containing primary linking particles only. No moments*/
     ForceTree dmtree = {0};
-    force_tree_rebuild_mask(&dmtree, ddecomp, fof_params.FOFPrimaryLinkTypes, NULL);
+    if(tree && force_tree_allocated(tree) && (tree->mask & fof_params.FOFPrimaryLinkTypes) == fof_params.FOFPrimaryLinkTypes)
+        message(0, "Reusing the existing tree for FOF.\n");
+    else {
+        force_tree_rebuild_mask(&dmtree, ddecomp, fof_params.FOFPrimaryLinkTypes, NULL);
+        tree = &dmtree;
+    }
     walltime_measure("/FOF/Build");
 
     /* Fill FOFP_List of primary */
-    fof_label_primary(HaloLabel, &dmtree, Comm);
+    fof_label_primary(HaloLabel, tree, Comm);
     walltime_measure("/FOF/Primary");
 
     /* Fill FOFP_List of secondary */
-    fof_label_secondary(HaloLabel, &dmtree);
-    force_tree_free(&dmtree);
+    fof_label_secondary(HaloLabel, tree);
+    if(force_tree_allocated(&dmtree))
+        force_tree_free(&dmtree);
 
     message(0, "Attached gas and star particles to nearest dm particles.\n");
 
@@ -204,10 +213,10 @@ fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm)
 
     message(0, "Compiled local group data and catalogue.\n");
 
-    fof_assign_grnr(base, NgroupsExt, Comm);
-
     /*Store the group number in the particle struct*/
-    if(StoreGrNr) {
+    if(Flags & FOF_STORE_GRNR) {
+        fof_assign_grnr(base, NgroupsExt, Comm);
+
         #pragma omp parallel for
         for(i = 0; i < PartManager->NumPart; i++)
             P[i].GrNr = -1;	/* will mark particles that are not in any group */
@@ -227,17 +236,21 @@ fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm)
             }
         }
     }
+    else {
+        /* The groups are only numbered for output*/
+        #pragma omp parallel for
+        for(i = 0; i < NgroupsExt; i++)
+            base[i].GrNr = -1;
+    }
 
     /*Initialise the Group object from the BaseGroup*/
     FOFGroups fof;
-    MPI_Type_contiguous(sizeof(fof.Group[0]), MPI_BYTE, &MPI_TYPE_GROUP);
-    MPI_Type_commit(&MPI_TYPE_GROUP);
 
     fof.Group = fof_alloc_group(base, NgroupsExt);
 
     myfree(base);
 
-    fof_compile_catalogue(&fof, NgroupsExt, HaloLabel, Comm);
+    fof_compile_catalogue(&fof, NgroupsExt, HaloLabel, Flags & FOF_SEED_ONLY, Comm);
 
     MPIU_Barrier(Comm);
     message(0, "Finished FoF. Group properties are now allocated.. (presently allocated=%g MB)\n",
@@ -253,20 +266,28 @@ fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm)
 void
 fof_finish(FOFGroups * fof)
 {
+    myfree(fof->SeedIndex);
     myfree(fof->Group);
 
     message(0, "Finished computing FoF groups.  (presently allocated=%g MB)\n",
             mymalloc_usedbytes() / (1024.0 * 1024.0));
 
-    MPI_Type_free(&MPI_TYPE_GROUP);
 }
 
+/* A link from a local particle to a particle on another rank, found by the primary treewalk.
+ * After fof_resolve_links both particles are replaced by their (local and remote) roots.*/
+struct fof_remote_link {
+    int local;
+    int task;
+    int remote;
+};
+
 struct FOFPrimaryPriv {
     int * Head;
-    struct SpinLocks * spin;
-    char * PrimaryActive;
-    MyIDType * OldMinID;
-    struct fof_particle_list * HaloLabel;
+    struct fof_remote_link * Links;
+    int64_t NLinks;
+    int64_t MaxLinks;
+    int ThisTask;
 };
 #define FOF_PRIMARY_GET_PRIV(tw) ((struct FOFPrimaryPriv *) (tw->priv))
 
@@ -335,24 +356,16 @@ HEAD(int i, const int * const Head)
 }
 
 static void fof_primary_copy(int place, TreeWalkQueryFOF * I, TreeWalk * tw) {
-    /* The copied data is *only* used for the
-     * secondary treewalk, so fill up garbage for the primary treewalk.
-     * The copy is a technical race otherwise. */
-    if(I->base.NodeList[0] == tw->tree->firstnode) {
-        I->MinID = IDTYPE_MAX;
-        I->MinIDTask = -1;
-        return;
-    }
-    /* Secondary treewalk, no need for locking here*/
-    int head = HEAD(place, FOF_PRIMARY_GET_PRIV(tw)->Head);
-    I->MinID = FOF_PRIMARY_GET_PRIV(tw)->HaloLabel[head].MinID;
-    I->MinIDTask = FOF_PRIMARY_GET_PRIV(tw)->HaloLabel[head].MinIDTask;
+    /* Identify the particle, so that ghosts can link to it*/
+    I->MinID = P[place].ID;
+    I->MinIDTask = FOF_PRIMARY_GET_PRIV(tw)->ThisTask;
+    I->Pindex = place;
 }
 
 static int fof_primary_haswork(int n, TreeWalk * tw) {
     if(P[n].IsGarbage || P[n].Swallowed)
         return 0;
-    return (((1 << P[n].Type) & (fof_params.FOFPrimaryLinkTypes))) && FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[n];
+    return ((1 << P[n].Type) & (fof_params.FOFPrimaryLinkTypes));
 }
 
 static void
@@ -361,10 +374,17 @@ fof_primary_ngbiter(TreeWalkQueryFOF * I,
         TreeWalkNgbIterFOF * iter,
         LocalTreeWalk * lv);
 
+static int fof_primary_visit(TreeWalkQueryBase * I, TreeWalkResultBase * O, LocalTreeWalk * lv);
+static void fof_link_cells(int * Head);
+static int64_t fof_resolve_links(struct FOFPrimaryPriv * priv, MPI_Comm Comm);
+static int fof_merge_remote_groups(struct fof_particle_list * HaloLabel, const struct fof_remote_link * Links, const int64_t NLinks, MPI_Comm Comm);
+
+/* Link the primary particles into groups. A single treewalk builds the local groups with a lock-free union-find,
+ * and records the links to particles on other ranks. The groups on different ranks are then merged
+ * by exchanging the labels of their roots along these links, without further treewalks.*/
 void fof_label_primary(struct fof_particle_list * HaloLabel, ForceTree * tree, MPI_Comm Comm)
 {
     int i;
-    int64_t link_across_tot;
     int ThisTask;
     MPI_Comm_rank(Comm, &ThisTask);
 
@@ -375,6 +395,9 @@ void fof_label_primary(struct fof_particle_list * HaloLabel, ForceTree * tree, M
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
     tw->ngbiter = (TreeWalkNgbIterFunction) fof_primary_ngbiter;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterFOF);
+    /* The local particles are linked by the cell grid, so the treewalk only handles particles from other ranks*/
+    if(fof_params.FOFCellLinking)
+        tw->visit = fof_primary_visit;
 
     tw->haswork = fof_primary_haswork;
     tw->fill = (TreeWalkFillQueryFunction) fof_primary_copy;
@@ -386,99 +409,81 @@ void fof_label_primary(struct fof_particle_list * HaloLabel, ForceTree * tree, M
     struct FOFPrimaryPriv priv[1];
     tw->priv = priv;
 
-    FOF_PRIMARY_GET_PRIV(tw)->Head = (int*) mymalloc("FOF_Links", PartManager->NumPart * sizeof(int));
-    FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive = (char*) mymalloc("FOFActive", PartManager->NumPart * sizeof(char));
-    FOF_PRIMARY_GET_PRIV(tw)->OldMinID = (MyIDType *) mymalloc("FOFActive", PartManager->NumPart * sizeof(MyIDType));
-    FOF_PRIMARY_GET_PRIV(tw)->HaloLabel = HaloLabel;
-    /* allocate buffers to arrange communication */
+    priv->ThisTask = ThisTask;
+    priv->Head = (int*) mymalloc("FOF_Links", PartManager->NumPart * sizeof(int));
 
     #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++)
     {
-        FOF_PRIMARY_GET_PRIV(tw)->Head[i] = i;
-        FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i]= P[i].ID;
-        FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 1;
-
+        priv->Head[i] = i;
         HaloLabel[i].MinID = P[i].ID;
         HaloLabel[i].MinIDTask = ThisTask;
     }
 
-    /* The lock is used to protect MinID*/
-    priv[0].spin = init_spinlocks(PartManager->NumPart);
-    do
-    {
+    if(fof_params.FOFCellLinking) {
         double t0 = second();
+        fof_link_cells(priv->Head);
+        message(0, "Linked local particles with cells in %g seconds\n", second() - t0);
+    }
 
+    /* Most particles have no remote neighbours. If the links do not fit,
+     * the treewalk is repeated with enough space: the local groups are then already complete.*/
+    priv->MaxLinks = PartManager->NumPart / 8 + 1024;
+    priv->Links = (struct fof_remote_link *) mymalloc("FOF_RemoteLinks", priv->MaxLinks * sizeof(struct fof_remote_link));
+    int overflow;
+    do {
+        double t0 = second();
+        priv->NLinks = 0;
         treewalk_run(tw, NULL, PartManager->NumPart);
-
-        double t1 = second();
-        /* This sets the MinID of the head particle to the minimum ID
-         * of the child particles. We set this inside the treewalk,
-         * but the locking allows a race, where the particle with MinID set
-         * is no longer the one which is the true Head of the group.
-         * So we must check it again here.*/
-        #pragma omp parallel for
-        for(i = 0; i < PartManager->NumPart; i++) {
-            int head = HEAD(i, FOF_PRIMARY_GET_PRIV(tw)->Head);
-            /* Don't check against ourself*/
-            if(head == i)
-                continue;
-            MyIDType headminid;
-            #pragma omp atomic read
-            headminid = HaloLabel[head].MinID;
-            /* No atomic needed for i as this is not a head*/
-            if(headminid > HaloLabel[i].MinID) {
-                lock_spinlock(head, priv->spin);
-                if(HaloLabel[head].MinID > HaloLabel[i].MinID) {
-                    #pragma omp atomic write
-                    HaloLabel[head].MinID = HaloLabel[i].MinID;
-                    HaloLabel[head].MinIDTask = HaloLabel[i].MinIDTask;
-                }
-                unlock_spinlock(head, priv->spin);
-            }
+        message(0, "Linked local particles in %g seconds\n", second() - t0);
+        overflow = MPIU_Any(priv->NLinks > priv->MaxLinks, Comm);
+        if(priv->NLinks > priv->MaxLinks) {
+            myfree(priv->Links);
+            priv->MaxLinks = priv->NLinks;
+            priv->Links = (struct fof_remote_link *) mymalloc("FOF_RemoteLinks", priv->MaxLinks * sizeof(struct fof_remote_link));
         }
-        /* let's check out which particles have changed their MinID,
-         * mark them for next round. */
-        int64_t link_across = 0;
-#pragma omp parallel for reduction(+: link_across)
-        for(i = 0; i < PartManager->NumPart; i++) {
-            int head = HEAD(i, FOF_PRIMARY_GET_PRIV(tw)->Head);
-            /* This loop sets the MinID of the children to the minID of the head.
-             * The minID of the head is set above and is stable at this point.*/
-            if(i != head) {
-                HaloLabel[i].MinID = HaloLabel[head].MinID;
-                HaloLabel[i].MinIDTask = HaloLabel[head].MinIDTask;
-            }
-            MyIDType newMinID = HaloLabel[head].MinID;
-            if(newMinID != FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i]) {
-                FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 1;
-                FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i] = newMinID;
-                link_across ++;
-            } else {
-                FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 0;
-            }
-        }
-        double t2 = second();
+    } while(overflow);
 
-        MPI_Allreduce(&link_across, &link_across_tot, 1, MPI_INT64, MPI_SUM, Comm);
-        message(0, "Linked %ld particles %g seconds postproc was %g seconds\n", link_across_tot, t1 - t0, t2 - t1);
+    /* Point every particle at its root*/
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        __atomic_store_n(&priv->Head[i], HEAD(i, priv->Head), __ATOMIC_RELAXED);
+    }
+    /* The label of a local group is its minimum ID. No locks are needed as only the MinID of the root changes.*/
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int head = priv->Head[i];
+        if(head == i)
+            continue;
+        MyIDType minid;
+        #pragma omp atomic read
+        minid = HaloLabel[head].MinID;
+        while(P[i].ID < minid && !__atomic_compare_exchange_n(&HaloLabel[head].MinID, &minid, P[i].ID, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
     }
-    while(link_across_tot > 0);
 
-    free_spinlocks(priv[0].spin);
+    int64_t nlinks = fof_resolve_links(priv, Comm);
+    fof_merge_remote_groups(HaloLabel, priv->Links, nlinks, Comm);
+
+    /* Copy the label of the root to the other particles in the group*/
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int head = priv->Head[i];
+        if(head == i)
+            continue;
+        HaloLabel[i].MinID = HaloLabel[head].MinID;
+        HaloLabel[i].MinIDTask = HaloLabel[head].MinIDTask;
+    }
 
     message(0, "Local groups found.\n");
 
-    myfree(FOF_PRIMARY_GET_PRIV(tw)->OldMinID);
-    myfree(FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive);
-    myfree(FOF_PRIMARY_GET_PRIV(tw)->Head);
+    myfree(priv->Links);
+    myfree(priv->Head);
 }
 
+/* Merge the trees containing target and other, using a compare and swap on the root so no locks are needed.*/
 static void
-fofp_merge(int target, int other, TreeWalk * tw)
+fofp_merge(int target, int other, int * Head)
 {
-    /* this will lock h1 */
-    int * Head = FOF_PRIMARY_GET_PRIV(tw)->Head;
     int h1, h2;
     do {
         h1 = HEADl(-1, target, Head);
@@ -499,42 +504,12 @@ fofp_merge(int target, int other, TreeWalk * tw)
       * Set Head[h2] = h1 iff Head[h2] is still h2. Otherwise loop.*/
     } while(!__atomic_compare_exchange(&Head[h2], &h2, &h1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    struct SpinLocks * spin = FOF_PRIMARY_GET_PRIV(tw)->spin;
-
-    /* update MinID of h1: h2 is now just another child of h1
-     * so we don't need to check that h2 changes its head.
-     * It might happen that h1 is added to another halo at this point
-     * and the addition gets the wrong MinID.
-     * For this reason we recompute the MinIDs after the main treewalk.
-     * We also lock h2 for a copy in case it is the h1 in another thread,
-     * and may have inconsistent MinID and MinIDTask.*/
-
-    /* Get a copy of h2 under the lock, which ensures
-     * that MinID and MinIDTask do not change independently. */
-    struct fof_particle_list * HaloLabel = FOF_PRIMARY_GET_PRIV(tw)->HaloLabel;
-    struct fof_particle_list h2label;
-    lock_spinlock(h2, spin);
-    h2label.MinID = HaloLabel[h2].MinID;
-    h2label.MinIDTask = HaloLabel[h2].MinIDTask;
-    unlock_spinlock(h2, spin);
-
-    /* Now lock h1 so we don't change MinID but not MinIDTask.*/
-    lock_spinlock(h1, spin);
-    if(HaloLabel[h1].MinID > h2label.MinID)
-    {
-        HaloLabel[h1].MinID = h2label.MinID;
-        HaloLabel[h1].MinIDTask = h2label.MinIDTask;
-    }
-    unlock_spinlock(h1, spin);
-
     /* h1 must be the root of other and target both:
      * do the splay to speed up future accesses.
-     * We do not need to have h2 locked, because h2 is
-     * now just another child of h1: these do not change the root,
+     * h2 is now just another child of h1: these do not change the root,
      * they make the tree shallow.*/
     update_root(target, h1, Head);
     update_root(other, h1, Head);
-
 }
 
 static void
@@ -548,32 +523,314 @@ fof_primary_ngbiter(TreeWalkQueryFOF * I,
         iter->base.Hsml = fof_params.FOFHaloComovingLinkingLength;
         iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
         iter->base.mask = fof_params.FOFPrimaryLinkTypes;
+        iter->first = -1;
         return;
     }
     int other = iter->base.other;
+    struct FOFPrimaryPriv * priv = FOF_PRIMARY_GET_PRIV(tw);
 
     if(lv->mode == TREEWALK_PRIMARY) {
         /* Local FOF */
-        if(lv->target <= other) {
-            // printf("locked merge %d %d by %d\n", lv->target, other, omp_get_thread_num());
-            fofp_merge(lv->target, other, tw);
+        if(lv->target <= other)
+            fofp_merge(lv->target, other, priv->Head);
+        return;
+    }
+    /* The target is a ghost. Its local neighbours are all in its group, so merge them here
+     * and record a single link from the first of them to the ghost.*/
+    if(iter->first >= 0) {
+        fofp_merge(iter->first, other, priv->Head);
+        return;
+    }
+    iter->first = other;
+    int64_t n = __atomic_fetch_add(&priv->NLinks, 1, __ATOMIC_RELAXED);
+    if(n < priv->MaxLinks) {
+        priv->Links[n].local = other;
+        priv->Links[n].task = I->MinIDTask;
+        priv->Links[n].remote = I->Pindex;
+    }
+}
+
+/* With cell linking, the primary treewalk only finds the exports. Ghosts are walked as usual.*/
+static int
+fof_primary_visit(TreeWalkQueryBase * I, TreeWalkResultBase * O, LocalTreeWalk * lv)
+{
+    if(lv->mode == TREEWALK_PRIMARY)
+        return 0;
+    return treewalk_visit_ngbiter(I, O, lv);
+}
+
+struct fof_cell_entry {
+    int64_t key;
+    int index;
+};
+
+/* Find the first entry of the cell with the given key in the sorted list of cell starts, or -1.*/
+static int64_t
+fof_find_cell(const struct fof_cell_entry * Cells, const int64_t * CellStart, const int64_t ncells, const int64_t key)
+{
+    int64_t lo = 0, hi = ncells;
+    while(lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+        if(Cells[CellStart[mid]].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < ncells && Cells[CellStart[lo]].key == key)
+        return lo;
+    return -1;
+}
+
+/* Link the local primary particles by sorting them into a periodic grid of cells at least
+ * one linking length wide, so that only particles in neighbouring cells need be compared.
+ * Each pair of cells is visited once, using half of the 26 neighbours.*/
+static void
+fof_link_cells(int * Head)
+{
+    const double BoxSize = PartManager->BoxSize;
+    const double b = fof_params.FOFHaloComovingLinkingLength;
+    /* 21 bits per dimension in the key*/
+    const int64_t ncell = DMAX(DMIN(floor(BoxSize / b), 1 << 20), 1);
+    const double cellsize = BoxSize / ncell;
+
+    struct fof_cell_entry * Cells = (struct fof_cell_entry *) mymalloc("FOF_Cells", PartManager->NumPart * sizeof(struct fof_cell_entry));
+    int64_t i, nprimary = 0;
+    #pragma omp parallel for reduction(+: nprimary)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        Cells[i].index = i;
+        if(P[i].IsGarbage || P[i].Swallowed || !((1 << P[i].Type) & fof_params.FOFPrimaryLinkTypes)) {
+            Cells[i].key = INT64_MAX;
+            continue;
+        }
+        int64_t key = 0;
+        int d;
+        for(d = 0; d < 3; d++) {
+            int64_t c = floor(P[i].Pos[d] / cellsize);
+            /* Positions are in the box, but wrap anyway so rounding cannot make a new cell*/
+            c = ((c % ncell) + ncell) % ncell;
+            key = (key << 21) + c;
         }
+        Cells[i].key = key;
+        nprimary++;
     }
-    else /* mode is 1, target is a ghost */
-    {
-        int head = HEAD(other, FOF_PRIMARY_GET_PRIV(tw)->Head);
-        struct fof_particle_list * HaloLabel = FOF_PRIMARY_GET_PRIV(tw)->HaloLabel;
-        struct SpinLocks * spin = FOF_PRIMARY_GET_PRIV(tw)->spin;
-//        printf("locking %d by %d in ngbiter\n", other, omp_get_thread_num());
-        lock_spinlock(head, spin);
-        if(HaloLabel[head].MinID > I->MinID)
-        {
-            HaloLabel[head].MinID = I->MinID;
-            HaloLabel[head].MinIDTask = I->MinIDTask;
+    radix_sort_openmp(Cells, PartManager->NumPart, sizeof(struct fof_cell_entry), offsetof(struct fof_cell_entry, key), sizeof(int64_t));
+
+    int64_t * CellStart = (int64_t *) mymalloc("FOF_CellStart", (nprimary + 1) * sizeof(int64_t));
+    int64_t ncells = 0;
+    for(i = 0; i < nprimary; i++) {
+        if(i == 0 || Cells[i].key != Cells[i-1].key)
+            CellStart[ncells++] = i;
+    }
+    CellStart[ncells] = nprimary;
+
+    const double b2 = b * b;
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(i = 0; i < ncells; i++) {
+        const int64_t key = Cells[CellStart[i]].key;
+        const int64_t c[3] = {(key >> 42) & 0x1fffff, (key >> 21) & 0x1fffff, key & 0x1fffff};
+        int n;
+        /* Offsets 13 to 26 of the 3x3x3 block: the cell itself and the neighbours with a larger linear offset*/
+        for(n = 13; n < 27; n++) {
+            const int off[3] = {n / 9 - 1, (n / 3) % 3 - 1, n % 3 - 1};
+            int64_t nkey = 0;
+            int d;
+            for(d = 0; d < 3; d++)
+                nkey = (nkey << 21) + (c[d] + off[d] + ncell) % ncell;
+            const int64_t j = (n == 13) ? i : fof_find_cell(Cells, CellStart, ncells, nkey);
+            if(j < 0)
+                continue;
+            int64_t p, q;
+            for(p = CellStart[i]; p < CellStart[i+1]; p++) {
+                const int a = Cells[p].index;
+                for(q = (n == 13) ? p + 1 : CellStart[j]; q < CellStart[j+1]; q++) {
+                    const int o = Cells[q].index;
+                    double r2 = 0;
+                    for(d = 0; d < 3; d++) {
+                        const double dx = NEAREST(P[a].Pos[d] - P[o].Pos[d], BoxSize);
+                        r2 += dx * dx;
+                    }
+                    if(r2 <= b2)
+                        fofp_merge(a, o, Head);
+                }
+            }
         }
-//        printf("unlocking %d by %d in ngbiter\n", other, omp_get_thread_num());
-        unlock_spinlock(head, spin);
     }
+    myfree(CellStart);
+    myfree(Cells);
+}
+
+static int
+fof_compare_remote_link(const void * a, const void * b)
+{
+    const struct fof_remote_link * la = (const struct fof_remote_link *) a;
+    const struct fof_remote_link * lb = (const struct fof_remote_link *) b;
+    if(la->task != lb->task)
+        return (la->task > lb->task) - (la->task < lb->task);
+    if(la->remote != lb->remote)
+        return (la->remote > lb->remote) - (la->remote < lb->remote);
+    return (la->local > lb->local) - (la->local < lb->local);
+}
+
+/* Sort links by task and remove duplicates. Returns the new number of links.*/
+static int64_t
+fof_unique_links(struct fof_remote_link * Links, int64_t NLinks)
+{
+    qsort_openmp(Links, NLinks, sizeof(struct fof_remote_link), fof_compare_remote_link);
+    int64_t i, nuniq = 0;
+    for(i = 0; i < NLinks; i++) {
+        if(nuniq > 0 && fof_compare_remote_link(&Links[nuniq-1], &Links[i]) == 0)
+            continue;
+        Links[nuniq++] = Links[i];
+    }
+    return nuniq;
+}
+
+/* Replace both ends of the remote links by their roots. The remote particle is looked up by its rank,
+ * which also records the link, so that both ranks hold every link between their groups.
+ * The links are sorted by task. Returns the number of links, which may be reallocated. Collective.*/
+static int64_t
+fof_resolve_links(struct FOFPrimaryPriv * priv, MPI_Comm Comm)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < priv->NLinks; i++)
+        priv->Links[i].local = priv->Head[priv->Links[i].local];
+    int64_t nlinks = fof_unique_links(priv->Links, priv->NLinks);
+
+    int * Send_count = ta_malloc("Send_count", int, NTask);
+    int * Recv_count = ta_malloc("Recv_count", int, NTask);
+    memset(Send_count, 0, sizeof(int) * NTask);
+    for(i = 0; i < nlinks; i++)
+        Send_count[priv->Links[i].task]++;
+    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+    int64_t nimport = 0;
+    for(i = 0; i < NTask; i++)
+        nimport += Recv_count[i];
+
+    /* Grow the link list to hold the imported links at the end*/
+    priv->Links = (struct fof_remote_link *) myrealloc(priv->Links, (nlinks + nimport) * sizeof(struct fof_remote_link));
+    struct fof_remote_link * Import = priv->Links + nlinks;
+
+    MPI_Datatype dtype;
+    MPI_Type_contiguous(sizeof(struct fof_remote_link), MPI_BYTE, &dtype);
+    MPI_Type_commit(&dtype);
+
+    /* Send the links to the rank of the remote particle, with our root in place of the task*/
+    struct fof_remote_link * Export = (struct fof_remote_link *) mymalloc("FOF_LinkExport", nlinks * sizeof(struct fof_remote_link));
+    #pragma omp parallel for
+    for(i = 0; i < nlinks; i++) {
+        Export[i].local = priv->Links[i].local;
+        Export[i].task = ThisTask;
+        Export[i].remote = priv->Links[i].remote;
+    }
+    MPI_Alltoallv_smart(Export, Send_count, NULL, dtype, Import, Recv_count, NULL, dtype, Comm);
+
+    /* Look up the root of the remote particle. The imported link becomes a link from that root to the sender's root,
+     * and the root is returned to the sender.*/
+    #pragma omp parallel for
+    for(i = 0; i < nimport; i++) {
+        int root = priv->Head[Import[i].remote];
+        Import[i].remote = Import[i].local;
+        Import[i].local = root;
+    }
+    MPI_Alltoallv_smart(Import, Recv_count, NULL, dtype, Export, Send_count, NULL, dtype, Comm);
+    #pragma omp parallel for
+    for(i = 0; i < nlinks; i++)
+        priv->Links[i].remote = Export[i].local;
+    myfree(Export);
+
+    MPI_Type_free(&dtype);
+    ta_free(Recv_count);
+    ta_free(Send_count);
+
+    return fof_unique_links(priv->Links, nlinks + nimport);
+}
+
+struct fof_root_label {
+    MyIDType MinID;
+    int MinIDTask;
+    int root;
+};
+
+/* Give connected groups on different ranks the smallest label of any of them,
+ * by sending the label of each root along its links until no label changes.
+ * The links must be sorted by task. Returns the number of rounds. Collective.*/
+static int
+fof_merge_remote_groups(struct fof_particle_list * HaloLabel, const struct fof_remote_link * Links, const int64_t NLinks, MPI_Comm Comm)
+{
+    int NTask;
+    MPI_Comm_size(Comm, &NTask);
+    int * Send_count = ta_malloc("Send_count", int, NTask);
+    int * Recv_count = ta_malloc("Recv_count", int, NTask);
+    /* Roots whose label changed in the last round, which need to send it again*/
+    char * Changed = (char *) mymalloc("FOF_Changed", PartManager->NumPart * sizeof(char));
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        Changed[i] = 1;
+
+    MPI_Datatype dtype;
+    MPI_Type_contiguous(sizeof(struct fof_root_label), MPI_BYTE, &dtype);
+    MPI_Type_commit(&dtype);
+
+    int round = 0;
+    int64_t nchanged_tot;
+    do {
+        memset(Send_count, 0, sizeof(int) * NTask);
+        int64_t nexport = 0, nimport = 0;
+        for(i = 0; i < NLinks; i++)
+            if(Changed[Links[i].local]) {
+                Send_count[Links[i].task]++;
+                nexport++;
+            }
+        MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+        for(i = 0; i < NTask; i++)
+            nimport += Recv_count[i];
+
+        struct fof_root_label * Export = (struct fof_root_label *) mymalloc("FOF_LabelExport", nexport * sizeof(struct fof_root_label));
+        struct fof_root_label * Import = (struct fof_root_label *) mymalloc("FOF_LabelImport", nimport * sizeof(struct fof_root_label));
+        nexport = 0;
+        for(i = 0; i < NLinks; i++) {
+            const int local = Links[i].local;
+            if(!Changed[local])
+                continue;
+            Export[nexport].MinID = HaloLabel[local].MinID;
+            Export[nexport].MinIDTask = HaloLabel[local].MinIDTask;
+            Export[nexport].root = Links[i].remote;
+            nexport++;
+        }
+        MPI_Alltoallv_smart(Export, Send_count, NULL, dtype, Import, Recv_count, NULL, dtype, Comm);
+
+        for(i = 0; i < NLinks; i++)
+            Changed[Links[i].local] = 0;
+        int64_t nchanged = 0;
+        for(i = 0; i < nimport; i++) {
+            const int root = Import[i].root;
+            if(Import[i].MinID < HaloLabel[root].MinID) {
+                HaloLabel[root].MinID = Import[i].MinID;
+                HaloLabel[root].MinIDTask = Import[i].MinIDTask;
+                nchanged += !Changed[root];
+                Changed[root] = 1;
+            }
+        }
+        myfree(Import);
+        myfree(Export);
+        MPI_Allreduce(&nchanged, &nchanged_tot, 1, MPI_INT64, MPI_SUM, Comm);
+        round++;
+    } while(nchanged_tot > 0);
+
+    int64_t nlinks_tot;
+    MPI_Reduce(&NLinks, &nlinks_tot, 1, MPI_INT64, MPI_SUM, 0, Comm);
+    message(0, "Merged groups across %ld links between ranks in %d rounds\n", nlinks_tot, round);
+
+    MPI_Type_free(&dtype);
+    myfree(Changed);
+    ta_free(Recv_count);
+    ta_free(Send_count);
+    return round;
 }
 
 static void fof_reduce_base_group(void * pdst, void * psrc) {
@@ -583,6 +840,10 @@ static void fof_reduce_base_group(void * pdst, void * psrc) {
     /* preserve the dst FirstPos so all other base group gets the same FirstPos */
 }
 
+/* Nothing to add: used to copy the properties of the prime to the ghosts */
+static void fof_copy_base_group(void * pdst, void * psrc) {
+}
+
 static void fof_reduce_group(void * pdst, void * psrc) {
     struct Group * gdst = (struct Group *) pdst;
     struct Group * gsrc = (struct Group *) psrc;
@@ -626,7 +887,28 @@ static void fof_reduce_group(void * pdst, void * psrc) {
 
 }
 
-static void add_particle_to_group(struct Group * gdst, int i, int ThisTask) {
+/* Reduce only the properties computed for FOF_SEED_ONLY*/
+static void fof_reduce_seed_group(void * pdst, void * psrc) {
+    struct Group * gdst = (struct Group *) pdst;
+    struct Group * gsrc = (struct Group *) psrc;
+    int j;
+    gdst->Length += gsrc->Length;
+    gdst->Mass += gsrc->Mass;
+
+    for(j = 0; j < 6; j++)
+    {
+        gdst->LenType[j] += gsrc->LenType[j];
+        gdst->MassType[j] += gsrc->MassType[j];
+    }
+    if(gsrc->MaxDens > gdst->MaxDens)
+    {
+        gdst->MaxDens = gsrc->MaxDens;
+        gdst->seed_index = gsrc->seed_index;
+        gdst->seed_task = gsrc->seed_task;
+    }
+}
+
+static void add_particle_to_group(struct Group * gdst, int i, int ThisTask, const int SeedOnly) {
 
     /* My local number of particles contributing to the full catalogue. */
     const int index = i;
@@ -642,6 +924,20 @@ static void add_particle_to_group(struct Group * gdst, int i, int ThisTask) {
     gdst->LenType[P[index].Type]++;
     gdst->MassType[P[index].Type] += P[index].Mass;
 
+    /*This used to depend on black holes being enabled, but I do not see why.
+     * I think because it is only useful for seeding*/
+    /* Don't make bh in wind.*/
+    if(P[index].Type == 0 && !winds_is_particle_decoupled(index))
+        if(SPHP(index).Density > gdst->MaxDens)
+        {
+            gdst->MaxDens = SPHP(index).Density;
+            gdst->seed_index = index;
+            gdst->seed_task = ThisTask;
+        }
+
+    if(SeedOnly)
+        return;
+
     if(P[index].Type == 0) {
         gdst->MassHeIonized += P[index].Mass * P[index].HeIIIionized;
         gdst->Sfr += SPHP(index).Sfr;
@@ -662,16 +958,6 @@ static void add_particle_to_group(struct Group * gdst, int i, int ThisTask) {
         gdst->BH_Mdot += BHP(index).Mdot;
         gdst->BH_Mass += BHP(index).Mass;
     }
-    /*This used to depend on black holes being enabled, but I do not see why.
-     * I think because it is only useful for seeding*/
-    /* Don't make bh in wind.*/
-    if(P[index].Type == 0 && !winds_is_particle_decoupled(index))
-        if(SPHP(index).Density > gdst->MaxDens)
-        {
-            gdst->MaxDens = SPHP(index).Density;
-            gdst->seed_index = index;
-            gdst->seed_task = ThisTask;
-        }
 
     int d1, d2;
     double xyz[3];
@@ -795,17 +1081,14 @@ fof_compile_base(struct BaseGroup * base, int NgroupsExt, struct fof_particle_li
     /* update global attributes */
     fof_reduce_groups(base, NgroupsExt, sizeof(base[0]), fof_reduce_base_group, Comm);
 
-    /* eliminate all groups that are too small */
+    /* eliminate all groups that are too small, keeping the rest sorted by MinID */
+    start = 0;
     for(i = 0; i < NgroupsExt; i++)
     {
-        if(base[i].Length < fof_params.FOFHaloMinLength)
-        {
-            base[i] = base[NgroupsExt - 1];
-            NgroupsExt--;
-            i--;
-        }
+        if(base[i].Length >= fof_params.FOFHaloMinLength)
+            base[start++] = base[i];
     }
-    return NgroupsExt;
+    return start;
 }
 
 /* Allocate memory for and initialise a Group object
@@ -868,8 +1151,38 @@ static void fof_set_escapefraction(struct FOFGroups * fof, const int NgroupsExt,
 }
 #endif
 
+/* Whether a group gets a new black hole, seeded at its densest gas particle*/
+static int
+fof_group_wants_seed(const struct Group * g)
+{
+    return (g->Mass >= fof_params.MinFoFMassForNewSeed)
+        && (g->MassType[4] >= fof_params.MinMStarForNewSeed)
+        && (g->LenType[5] == 0)
+        && (g->seed_index >= 0);
+}
+
+/* After the reduction every rank has the full properties of each group it holds particles of,
+ * including the ghosts. The rank hosting the seed particle thus knows whether to convert it,
+ * without sending the groups there.*/
 static void
-fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, struct fof_particle_list * HaloLabel, MPI_Comm Comm)
+fof_find_seeds(struct FOFGroups * fof, const int NgroupsExt, const int ThisTask)
+{
+    int i;
+    int64_t nseed = 0;
+    #pragma omp parallel for reduction(+: nseed)
+    for(i = 0; i < NgroupsExt; i++)
+        if(fof->Group[i].seed_task == ThisTask && fof_group_wants_seed(&fof->Group[i]))
+            nseed++;
+
+    fof->SeedIndex = (int *) mymalloc2("SeedIndex", sizeof(int) * (nseed + 1));
+    fof->NSeed = 0;
+    for(i = 0; i < NgroupsExt; i++)
+        if(fof->Group[i].seed_task == ThisTask && fof_group_wants_seed(&fof->Group[i]))
+            fof->SeedIndex[fof->NSeed++] = fof->Group[i].seed_index;
+}
+
+static void
+fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, struct fof_particle_list * HaloLabel, const int SeedOnly, MPI_Comm Comm)
 {
     int i, start, ThisTask;
 
@@ -887,32 +1200,38 @@ fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, struct fof_p
             if(HaloLabel[start].MinID != fof->Group[i].base.MinID) {
                 break;
             }
-            add_particle_to_group(&fof->Group[i], HaloLabel[start].Pindex, ThisTask);
+            add_particle_to_group(&fof->Group[i], HaloLabel[start].Pindex, ThisTask, SeedOnly);
         }
     }
 
     /* collect global properties */
-    fof_reduce_groups(fof->Group, NgroupsExt, sizeof(fof->Group[0]), fof_reduce_group, Comm);
+    fof_reduce_groups(fof->Group, NgroupsExt, sizeof(fof->Group[0]), SeedOnly ? fof_reduce_seed_group : fof_reduce_group, Comm);
+
+    fof_find_seeds(fof, NgroupsExt, ThisTask);
 
-    /* count Groups and number of particles hosted by me */
+    /* count Groups and number of particles hosted by me, and move them to the start of the list:
+     * the ghosts are no longer needed. */
     fof->Ngroups = 0;
     int64_t Nids = 0;
     for(i = 0; i < NgroupsExt; i ++) {
         if(fof->Group[i].base.MinIDTask != ThisTask) continue;
 
-        fof->Ngroups++;
         Nids += fof->Group[i].base.Length;
 
         if(fof->Group[i].base.Length != fof->Group[i].Length) {
             /* These two shall be consistent */
             endrun(3333, "i=%d Group base Length %d != Group Length %d\n", i, fof->Group[i].base.Length, fof->Group[i].Length);
         }
+        if(fof->Ngroups != i)
+            fof->Group[fof->Ngroups] = fof->Group[i];
+        fof->Ngroups++;
     }
 
-    fof_finish_group_properties(fof, PartManager->BoxSize);
+    if(!SeedOnly)
+        fof_finish_group_properties(fof, PartManager->BoxSize);
 #ifdef EXCUR_REION
     /* feed group property back to each particle. */
-    if(fof_params.ExcursionSetReionOn)
+    if(fof_params.ExcursionSetReionOn && !SeedOnly)
         fof_set_escapefraction(fof, NgroupsExt, HaloLabel);
 #endif
     int64_t TotNids;
@@ -927,7 +1246,7 @@ fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, struct fof_p
         double largestmass = 0;
         int largestlength = 0;
 
-        for(i = 0; i < NgroupsExt; i++)
+        for(i = 0; i < fof->Ngroups; i++)
             if(fof->Group[i].Length > largestlength) {
                 largestlength = fof->Group[i].Length;
                 largestmass = fof->Group[i].Mass;
@@ -945,6 +1264,27 @@ fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, struct fof_p
 }
 
 
+/* Find the prime group with MinID in the prime index, which is sorted by MinID*/
+static int
+fof_find_prime(const void * groups, const size_t elsize, const int * Prime, const int Nprime, const MyIDType MinID)
+{
+    int lo = 0, hi = Nprime;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        const struct BaseGroup * g = (const struct BaseGroup *) ((const char *) groups + Prime[mid] * elsize);
+        if(g->MinID < MinID)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == Nprime || ((const struct BaseGroup *) ((const char *) groups + Prime[lo] * elsize))->MinID != MinID)
+        return -1;
+    return Prime[lo];
+}
+
+/* Reduce the partial groups on every rank into full groups. The groups must be sorted by MinID,
+ * and keep their order: each ghost is sent to the rank hosting its group,
+ * reduced into the prime there, and the result is sent back to the same place.*/
 static void fof_reduce_groups(
     void * groups,
     int nmemb,
@@ -968,21 +1308,14 @@ static void fof_reduce_groups(
      **/
     int * Send_count = ta_malloc("Send_count", int, NTask);
     int * Recv_count = ta_malloc("Recv_count", int, NTask);
+    int * Send_offset = ta_malloc("Send_offset", int, NTask);
 
-    void * images = NULL;
-    void * ghosts = NULL;
     int i;
-    int start;
-
     MPI_Datatype dtype;
 
     MPI_Type_contiguous(elsize, MPI_BYTE, &dtype);
     MPI_Type_commit(&dtype);
 
-    /*Set global data for the comparison*/
-    _fof_compare_Group_MinIDTask_ThisTask = ThisTask;
-    /* local groups will be moved to the beginning, we skip them with offset */
-    qsort_openmp(groups, nmemb, elsize, fof_compare_Group_MinIDTask);
     /* count how many we have of each task */
     memset(Send_count, 0, sizeof(int) * NTask);
 
@@ -991,10 +1324,25 @@ static void fof_reduce_groups(
         Send_count[gi->MinIDTask]++;
     }
 
-    /* Skip local groups */
-    int Nmine = Send_count[ThisTask];
+    const int Nmine = Send_count[ThisTask];
+    const int nexport = nmemb - Nmine;
     Send_count[ThisTask] = 0;
 
+    /* The primes, still sorted by MinID, and the ghosts, ordered by destination*/
+    int * Prime = ta_malloc("Prime", int, nmemb);
+    int * Ghost = Prime + Nmine;
+    Send_offset[0] = 0;
+    for(i = 1; i < NTask; i++)
+        Send_offset[i] = Send_offset[i-1] + Send_count[i-1];
+    int nprime = 0;
+    for(i = 0; i < nmemb; i++) {
+        struct BaseGroup * gi = (struct BaseGroup *) (((char*) groups) + i * elsize);
+        if(gi->MinIDTask == ThisTask)
+            Prime[nprime++] = i;
+        else
+            Ghost[Send_offset[gi->MinIDTask]++] = i;
+    }
+
     MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
 
     int nimport = 0;
@@ -1002,153 +1350,165 @@ static void fof_reduce_groups(
         nimport += Recv_count[i];
     }
 
-    images = mymalloc("images", nimport * elsize);
-    ghosts = ((char*) groups) + elsize * Nmine;
+    void * images = mymalloc("images", nimport * elsize);
+    void * ghosts = mymalloc("ghosts", nexport * elsize);
+
+    #pragma omp parallel for
+    for(i = 0; i < nexport; i++)
+        memcpy((char *) ghosts + i * elsize, (char *) groups + Ghost[i] * elsize, elsize);
 
     MPI_Alltoallv_smart(ghosts, Send_count, NULL, dtype,
                         images, Recv_count, NULL, dtype, Comm);
 
+    /* find the prime of each image */
+    int * ImagePrime = ta_malloc("ImagePrime", int, nimport);
+    #pragma omp parallel for
     for(i = 0; i < nimport; i++) {
-        struct BaseGroup * gi = (struct BaseGroup*) ((char*) images + i * elsize);
-        gi->OriginalIndex = i;
+        struct BaseGroup * image = (struct BaseGroup*) ((char*) images + i * elsize);
+        ImagePrime[i] = fof_find_prime(groups, elsize, Prime, Nmine, image->MinID);
+        if(ImagePrime[i] < 0)
+            endrun(5, "Error in basegroup import: no prime for minid %lu minidtask %d\n", image->MinID, image->MinIDTask);
     }
 
-    /* sort the groups according to MinID */
-    qsort_openmp(groups, Nmine, elsize, fof_compare_Group_MinID);
-    qsort_openmp(images, nimport, elsize, fof_compare_Group_MinID);
-
-    /* merge the imported ones with the local ones */
-    start = 0;
-    for(i = 0; i < Nmine; i++) {
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start  * elsize);
-            if(image->MinID >= prime->MinID) {
-                break;
-            }
-        }
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start * elsize);
-            if(image->MinID != prime->MinID) {
-                break;
-            }
-            reduce_group(prime, image);
-        }
-    }
+    /* merge the imported ones with the local ones. Several images may share a prime. */
+    for(i = 0; i < nimport; i++)
+        reduce_group((char*) groups + ImagePrime[i] * elsize, (char*) images + i * elsize);
 
     /* update the images, such that they can be send back to the ghosts */
-    start = 0;
-    for(i = 0; i < Nmine; i++)
-    {
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start * elsize);
-            if(image->MinID >= prime->MinID) {
-                break;
-            }
-        }
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start * elsize);
-            if(image->MinID != prime->MinID) {
-                break;
-            }
-            int save = image->OriginalIndex;
-            memcpy(image, prime, elsize);
-            image->OriginalIndex = save;
-        }
-    }
+    #pragma omp parallel for
+    for(i = 0; i < nimport; i++)
+        memcpy((char*) images + i * elsize, (char*) groups + ImagePrime[i] * elsize, elsize);
 
-    /* reset the ordering of imported list, such that it can be properly returned */
-    qsort_openmp(images, nimport, elsize, fof_compare_Group_OriginalIndex);
-#ifdef DEBUG
-    for(i = 0; i < nimport; i++) {
-        struct BaseGroup * gi = (struct BaseGroup*) ((char*) images + i * elsize);
-        if(gi->MinIDTask != ThisTask) {
-            endrun(5, "Error in basegroup import: minidtask %d != ThisTask %d\n", gi->MinIDTask, ThisTask);
-        }
-    }
-#endif
-    void * ghosts2 = mymalloc("TMP", nmemb * elsize);
+    ta_free(ImagePrime);
 
     MPI_Alltoallv_smart(images, Recv_count, NULL, dtype,
-                        ghosts2, Send_count, NULL, dtype,
+                        ghosts, Send_count, NULL, dtype,
                         Comm);
-    for(i = 0; i < nmemb - Nmine; i ++) {
-        struct BaseGroup * g1 = (struct BaseGroup*) ((char*) ghosts + i * elsize);
-        struct BaseGroup * g2 = (struct BaseGroup*) ((char*) ghosts2 + i* elsize);
+    #pragma omp parallel for
+    for(i = 0; i < nexport; i ++) {
+        struct BaseGroup * g1 = (struct BaseGroup*) ((char*) groups + Ghost[i] * elsize);
+        struct BaseGroup * g2 = (struct BaseGroup*) ((char*) ghosts + i* elsize);
         if(g1->MinID != g2->MinID) {
             endrun(2, "g1 minID %lu, g2 minID %lu\n", g1->MinID, g2->MinID);
         }
         if(g1->MinIDTask != g2->MinIDTask) {
             endrun(2, "g1 minIDTask %d, g2 minIDTask %d\n", g1->MinIDTask, g2->MinIDTask);
         }
+        memcpy(g1, g2, elsize);
     }
-    memcpy(ghosts, ghosts2, elsize * (nmemb - Nmine));
-    myfree(ghosts2);
 
+    myfree(ghosts);
     myfree(images);
+    ta_free(Prime);
 
     MPI_Type_free(&dtype);
 
-    /* At this point, each Group entry has the reduced attribute of the full group */
-    /* And the local groups (MinIDTask == ThisTask) are placed at the begining of the list*/
+    /* At this point, each Group entry has the reduced attribute of the full group, in the original order */
+    ta_free(Send_offset);
     ta_free(Recv_count);
     ta_free(Send_count);
 }
 
-static void fof_radix_Group_TotalCountTaskDiffMinID(const void * a, void * radix, void * arg);
-static void fof_radix_Group_OriginalTaskMinID(const void * a, void * radix, void * arg);
+/* A group hosted on this rank, to be numbered*/
+struct fof_grnr_entry {
+    MyIDType MinID;
+    int64_t Length;
+    int OriginalTask;
+    int OriginalIndex;
+    int64_t GrNr;
+};
+
+static void fof_radix_grnr_entry(const void * a, void * radix, void * arg);
 
+/* Number the groups by decreasing length. Only the hosted groups are sorted:
+ * the ghosts get their numbers from the hosts. base stays sorted by MinID.*/
 static void fof_assign_grnr(struct BaseGroup * base, const int NgroupsExt, MPI_Comm Comm)
 {
-    int i, j, NTask, ThisTask;
-    int64_t ngr;
+    int i, NTask, ThisTask;
     MPI_Comm_size(Comm, &NTask);
     MPI_Comm_rank(Comm, &ThisTask);
 
-    #pragma omp parallel for
+    int64_t Nprime = 0;
+    #pragma omp parallel for reduction(+: Nprime)
     for(i = 0; i < NgroupsExt; i++)
-    {
-        base[i].OriginalTask = ThisTask;	/* original task */
-    }
-
-    mpsort_mpi(base, NgroupsExt, sizeof(base[0]),
-            fof_radix_Group_TotalCountTaskDiffMinID, 24, NULL, Comm);
+        if(base[i].MinIDTask == ThisTask)
+            Nprime++;
 
-    /* assign group numbers
-     * at this point, both Group are is sorted by length,
-     * and the every time OriginalTask == MinIDTask, a list of ghost base is stored.
-     * they shall get the same GrNr.
-     * */
-    ngr = 0;
+    struct fof_grnr_entry * Entries = (struct fof_grnr_entry *) mymalloc("GrNrEntries", sizeof(struct fof_grnr_entry) * (Nprime + 1));
+    Nprime = 0;
     for(i = 0; i < NgroupsExt; i++)
     {
-        if(base[i].OriginalTask == base[i].MinIDTask) {
-            ngr++;
-        }
-        base[i].GrNr = ngr;
+        if(base[i].MinIDTask != ThisTask)
+            continue;
+        Entries[Nprime].MinID = base[i].MinID;
+        Entries[Nprime].Length = base[i].Length;
+        Entries[Nprime].OriginalTask = ThisTask;
+        Entries[Nprime].OriginalIndex = i;
+        Nprime++;
     }
 
+    walltime_measure("/FOF/Compile");
+    mpsort_mpi(Entries, Nprime, sizeof(Entries[0]),
+            fof_radix_grnr_entry, 16, NULL, Comm);
+    walltime_measure_mpsort("/FOF/Sort");
+
+    /* assign group numbers: the entries are now sorted by length, then MinID. */
     int64_t * ngra = ta_malloc("NGRA", int64_t, NTask);
 
-    MPI_Allgather(&ngr, 1, MPI_INT64, ngra, 1, MPI_INT64, Comm);
+    MPI_Allgather(&Nprime, 1, MPI_INT64, ngra, 1, MPI_INT64, Comm);
 
     /* shift to the global grnr. */
     int64_t groffset = 0;
-    #pragma omp parallel for reduction(+: groffset)
-    for(j = 0; j < ThisTask; j++)
-        groffset += ngra[j];
-    #pragma omp parallel for
-    for(i = 0; i < NgroupsExt; i++)
-        base[i].GrNr += groffset;
+    for(i = 0; i < ThisTask; i++)
+        groffset += ngra[i];
 
     ta_free(ngra);
 
-    /* bring the group list back into the original task, sorted by MinID */
-    mpsort_mpi(base, NgroupsExt, sizeof(base[0]),
-            fof_radix_Group_OriginalTaskMinID, 16, NULL, Comm);
+    int * Send_count = ta_malloc("Send_count", int, NTask);
+    int * Recv_count = ta_malloc("Recv_count", int, NTask);
+    int * Send_offset = ta_malloc("Send_offset", int, NTask);
+    memset(Send_count, 0, sizeof(int) * NTask);
+    for(i = 0; i < Nprime; i++) {
+        Entries[i].GrNr = groffset + i + 1;
+        Send_count[Entries[i].OriginalTask]++;
+    }
+
+    /* bring the numbers back to the hosting task: the entries need only be grouped by task */
+    Send_offset[0] = 0;
+    for(i = 1; i < NTask; i++)
+        Send_offset[i] = Send_offset[i-1] + Send_count[i-1];
+    struct fof_grnr_entry * Export = (struct fof_grnr_entry *) mymalloc("GrNrExport", sizeof(struct fof_grnr_entry) * (Nprime + 1));
+    for(i = 0; i < Nprime; i++)
+        Export[Send_offset[Entries[i].OriginalTask]++] = Entries[i];
+
+    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+    int64_t nimport = 0;
+    for(i = 0; i < NTask; i++)
+        nimport += Recv_count[i];
+
+    /* Each task gets back as many entries as it sent for sorting*/
+    if(nimport > Nprime)
+        endrun(5, "Sent %ld groups for numbering but got %ld back\n", Nprime, nimport);
+
+    MPI_Datatype dtype;
+    MPI_Type_contiguous(sizeof(struct fof_grnr_entry), MPI_BYTE, &dtype);
+    MPI_Type_commit(&dtype);
+    MPI_Alltoallv_smart(Export, Send_count, NULL, dtype,
+                        Entries, Recv_count, NULL, dtype, Comm);
+    MPI_Type_free(&dtype);
+
+    #pragma omp parallel for
+    for(i = 0; i < nimport; i++)
+        base[Entries[i].OriginalIndex].GrNr = Entries[i].GrNr;
+
+    myfree(Export);
+    ta_free(Send_offset);
+    ta_free(Recv_count);
+    ta_free(Send_count);
+    myfree(Entries);
+
+    /* copy the numbers to the ghosts */
+    fof_reduce_groups(base, NgroupsExt, sizeof(base[0]), fof_copy_base_group, Comm);
 }
 
 int
@@ -1306,7 +1666,7 @@ static void fof_label_secondary(struct fof_particle_list * HaloLabel, ForceTree
         for(n = 1; n < NumThreads; n++) {
             FOF_SECONDARY_GET_PRIV(tw)->npleft[0] += FOF_SECONDARY_GET_PRIV(tw)->npleft[n];
         }
-        MPI_Allreduce(&FOF_SECONDARY_GET_PRIV(tw)->npleft[0], &ntot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&FOF_SECONDARY_GET_PRIV(tw)->npleft[0], &ntot, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
         if(ntot < 0 || (ntot > 0 && tw->Niteration > MAXITER))
             endrun(1159, "Failed to converge in fof-nearest: ntot %ld", ntot);
@@ -1321,93 +1681,24 @@ static void fof_label_secondary(struct fof_particle_list * HaloLabel, ForceTree
 /*
  * Deal with seeding of particles At each FOF stage,
  * if seed_index is >= 0,  then that particle on seed_task
- * will be converted to a seed.
+ * will be converted to a seed. The seeds were found on their
+ * own task by fof_find_seeds.
  *
  * */
-static int cmp_seed_task(const void * c1, const void * c2) {
-    const struct Group * g1 = (const struct Group *) c1;
-    const struct Group * g2 = (const struct Group *) c2;
-
-    return g1->seed_task - g2->seed_task;
-}
-
-static void fof_seed_make_one(struct Group * g, int ThisTask, const double atime, const RandTable * const rnd) {
-   if(g->seed_task != ThisTask) {
-        endrun(7771, "Seed does not belong to the right task");
-    }
-    int index = g->seed_index;
-    /* Random generator for the initial mass*/
-    blackhole_make_one(index, atime, rnd);
-}
-
 void fof_seed(FOFGroups * fof, ActiveParticles * act, double atime, const RandTable * const rnd, MPI_Comm Comm)
 {
-    int i, j, n, ntot;
+    int64_t n, ntot;
 
-    int NTask;
-    MPI_Comm_size(Comm, &NTask);
+    MPI_Allreduce(&fof->NSeed, &ntot, 1, MPI_INT64, MPI_SUM, Comm);
 
-    char * Marked = (char *) mymalloc2("SeedMark", fof->Ngroups);
+    message(0, "Making %ld new black hole particles.\n", ntot);
 
-    int Nexport = 0;
-    #pragma omp parallel for reduction(+:Nexport)
-    for(i = 0; i < fof->Ngroups; i++)
-    {
-        Marked[i] =
-            (fof->Group[i].Mass >= fof_params.MinFoFMassForNewSeed)
-        &&  (fof->Group[i].MassType[4] >= fof_params.MinMStarForNewSeed)
-        &&  (fof->Group[i].LenType[5] == 0)
-        &&  (fof->Group[i].seed_index >= 0);
-
-        if(Marked[i]) Nexport ++;
-    }
-    struct Group * ExportGroups = (struct Group *) mymalloc("Export", sizeof(fof->Group[0]) * Nexport);
-    j = 0;
-    for(i = 0; i < fof->Ngroups; i ++) {
-        if(Marked[i]) {
-            ExportGroups[j] = fof->Group[i];
-            j++;
-        }
-    }
-    myfree(Marked);
-
-    qsort_openmp(ExportGroups, Nexport, sizeof(ExportGroups[0]), cmp_seed_task);
-
-    int * Send_count = ta_malloc("Send_count", int, NTask);
-    int * Recv_count = ta_malloc("Recv_count", int, NTask);
-
-    memset(Send_count, 0, NTask * sizeof(int));
-    for(i = 0; i < Nexport; i++) {
-        Send_count[ExportGroups[i].seed_task]++;
-    }
-
-    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
-
-    int Nimport = 0;
-
-    for(j = 0;  j < NTask; j++)
-    {
-        Nimport += Recv_count[j];
-    }
-
-    struct Group * ImportGroups = (struct Group *)
-            mymalloc2("ImportGroups", Nimport * sizeof(struct Group));
-
-    MPI_Alltoallv_smart(ExportGroups, Send_count, NULL, MPI_TYPE_GROUP,
-                        ImportGroups, Recv_count, NULL, MPI_TYPE_GROUP,
-                        Comm);
-
-    myfree(ExportGroups);
-    ta_free(Recv_count);
-    ta_free(Send_count);
-
-    MPI_Allreduce(&Nimport, &ntot, 1, MPI_INT, MPI_SUM, Comm);
-
-    message(0, "Making %d new black hole particles.\n", ntot);
+    /* Garbage black hole slots, eg, from mergers, are reused first*/
+    int64_t nfree = slots_freelist_begin(5, PartManager, SlotsManager);
 
     /* Do we have enough black hole slots to create this many black holes?
      * If not, allocate more slots. */
-    if(Nimport + SlotsManager->info[5].size > SlotsManager->info[5].maxsize)
+    if(fof->NSeed + SlotsManager->info[5].size - nfree > SlotsManager->info[5].maxsize)
     {
         int *ActiveParticle_tmp=NULL;
         /* This is only called on a PM step, so the condition should never be true*/
@@ -1433,15 +1724,13 @@ void fof_seed(FOFGroups * fof, ActiveParticles * act, double atime, const RandTa
         }
     }
 
-    int ThisTask;
-    MPI_Comm_rank(Comm, &ThisTask);
+    for(n = 0; n < fof->NSeed; n++)
+        blackhole_make_one(fof->SeedIndex[n], atime, rnd);
 
-    for(n = 0; n < Nimport; n++)
-    {
-        fof_seed_make_one(&ImportGroups[n], ThisTask, atime, rnd);
-    }
+    slots_freelist_end(5, SlotsManager);
 
-    myfree(ImportGroups);
+    /* Each seed is made only once*/
+    fof->NSeed = 0;
 
     walltime_measure("/FOF/Seeding");
 }
@@ -1457,50 +1746,9 @@ static int fof_compare_HaloLabel_MinID(const void *a, const void *b)
     return 0;
 }
 
-static int fof_compare_Group_MinID(const void *a, const void *b)
-
-{
-    if(((struct BaseGroup *) a)->MinID < ((struct BaseGroup *) b)->MinID)
-        return -1;
-
-    if(((struct BaseGroup *) a)->MinID > ((struct BaseGroup *) b)->MinID)
-        return +1;
-
-    return 0;
-}
-
-static int fof_compare_Group_MinIDTask(const void *a, const void *b)
-{
-    const struct BaseGroup * p1 = (const struct BaseGroup *) a;
-    const struct BaseGroup * p2 = (const struct BaseGroup *) b;
-    int t1 = p1->MinIDTask;
-    int t2 = p2->MinIDTask;
-    if(t1 == _fof_compare_Group_MinIDTask_ThisTask) t1 = -1;
-    if(t2 == _fof_compare_Group_MinIDTask_ThisTask) t2 = -1;
-
-    if(t1 < t2) return -1;
-    if(t1 > t2) return +1;
-    return 0;
-
-}
-
-static int fof_compare_Group_OriginalIndex(const void *a, const void *b)
-
-{
-    return ((struct BaseGroup *) a)->OriginalIndex - ((struct BaseGroup *) b)->OriginalIndex;
-}
-
-static void fof_radix_Group_TotalCountTaskDiffMinID(const void * a, void * radix, void * arg) {
-    uint64_t * u = (uint64_t *) radix;
-    struct BaseGroup * f = (struct BaseGroup *) a;
-    u[0] = labs(f->OriginalTask - f->MinIDTask);
-    u[1] = f->MinID;
-    u[2] = UINT64_MAX - (f->Length);
-}
-
-static void fof_radix_Group_OriginalTaskMinID(const void * a, void * radix, void * arg) {
+static void fof_radix_grnr_entry(const void * a, void * radix, void * arg) {
     uint64_t * u = (uint64_t *) radix;
-    struct BaseGroup * f = (struct BaseGroup *) a;
+    const struct fof_grnr_entry * f = (const struct fof_grnr_entry *) a;
     u[0] = f->MinID;
-    u[1] = f->OriginalTask;
+    u[1] = UINT64_MAX - (f->Length);
 }
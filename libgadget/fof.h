@@ -10,11 +10,9 @@ void set_fof_params(ParameterSet * ps);
 
 void fof_init(double DMMeanSeparation);
 /* For the tests*/
-void set_fof_testpar(int FOFSaveParticles, double FOFHaloLinkingLength, int FOFHaloMinLength);
+void set_fof_testpar(int FOFSaveParticles, double FOFHaloLinkingLength, int FOFHaloMinLength, int FOFCellLinking);
 
 struct BaseGroup {
-    int OriginalTask;
-    int OriginalIndex;
     int Length;
     int GrNr;
     MyIDType MinID;
@@ -65,17 +63,31 @@ typedef struct FOFGroups
     struct Group * Group;
     int64_t Ngroups;
     int64_t TotNgroups;
+    /* Particles on this rank which seed a new black hole in their group.
+     * Found during the catalogue reduction.*/
+    int * SeedIndex;
+    int64_t NSeed;
 } FOFGroups;
 
-/* Computes the Group structure, saved as a global array below.
- * If StoreGrNr is true, this writes to GrNr in partmanager.h.
+/* Flags for fof_fof*/
+/* Number the groups and write to GrNr in partmanager.h.
+ * Otherwise the (sorted) group numbering is skipped and the GrNr of the groups is -1.*/
+#define FOF_STORE_GRNR 1
+/* Compute only the group properties needed by fof_seed: the lengths, masses and the seed particle.
+ * The other properties are zero and the groups cannot be saved.*/
+#define FOF_SEED_ONLY 2
+
+/* Computes the Group structure, saved as a global array below. Flags is a combination of the FOF_ flags above.
+ * If tree is allocated and contains the primary link types, it is used instead of building a new tree.
+ * The particles must not have moved or been reordered since it was built. tree may be NULL.
  * Note this over-writes PeanoKey and means the tree cannot be rebuilt.*/
-FOFGroups fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm);
+FOFGroups fof_fof(DomainDecomp * ddecomp, const int Flags, ForceTree * tree, MPI_Comm Comm);
 
 /*Frees the Group structure*/
 void fof_finish(FOFGroups * fof);
 
-/*Uses the Group structure to seed blackholes.
+/*Uses the Group structure to seed blackholes. The seeds are converted on the rank which hosts them,
+ * so this must be called before the particles are moved.
  * The active particle struct is used only because we may need to reallocate it. Randon number seeds the BH mass.*/
 void fof_seed(FOFGroups * fof, ActiveParticles * act, double atime, const RandTable * const rnd, MPI_Comm Comm);
 
@@ -83,6 +95,9 @@ void fof_seed(FOFGroups * fof, ActiveParticles * act, double atime, const RandTa
  Returns 1 if a domain_exchange is needed afterwards.*/
 int fof_save_groups(FOFGroups * fof, const char * OutputDir, const char * FOFFileBase, int num, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm);
 
+/* FOFSaveParticles value which writes members without sorting them by group*/
+#define FOF_SAVE_UNSORTED 2
+
 /* Does the actual saving of the particles
  Returns 1 if a domain_exchange is needed afterwards.*/
 int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm);
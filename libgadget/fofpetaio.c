@@ -15,13 +15,21 @@
 #include "petaio.h"
 #include "exchange.h"
 #include "fof.h"
+#include "subfind.h"
+#include "gravity.h"
 #include "walltime.h"
 
 static void fof_register_io_blocks(int MetalReturnOn, struct IOTable * IOTable);
-static void fof_write_header(BigFile * bf, int64_t TotNgroups, const double atime, const double * MassTable, Cosmology * CP, MPI_Comm Comm);
+static void fof_write_header(BigFile * bf, int64_t TotNgroups, const double atime, const double * MassTable, Cosmology * CP, int GroupOrdered, MPI_Comm Comm);
 static void build_buffer_fof(FOFGroups * fof, BigArray * array, IOTableEntry * ent, struct conversions * conv);
+static void subfind_register_io_blocks(struct IOTable * IOTable);
+static void build_buffer_subhalo(SubhaloCatalogue * sub, BigArray * array, IOTableEntry * ent, struct conversions * conv);
 /* Allocate a new halo structure and move particles there*/
 static int fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, int64_t NpigLocal, int64_t * atleast, MPI_Comm Comm);
+/* Order group members by subhalo*/
+static int order_by_type_grnr_and_subhalo(const void *a, const void *b);
+/* Write group members in place with an index of the rows of each group*/
+static void fof_save_particles_unsorted(BigFile * bf, struct conversions * conv, int MetalReturnOn, MPI_Comm Comm);
 
 static void fof_radix_Group_GrNr(const void * a, void * radix, void * arg) {
     uint64_t * u = (uint64_t *) radix;
@@ -39,9 +47,11 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
     struct IOTable FOFIOTable = {0};
 
     fof_register_io_blocks(MetalReturnOn, &FOFIOTable);
+    walltime_measure("/FOF/IO/WriteFOF");
     /* sort the groups according to group-number */
     mpsort_mpi(fof->Group, fof->Ngroups, sizeof(struct Group),
             fof_radix_Group_GrNr, 8, NULL, Comm);
+    walltime_measure_mpsort("/FOF/Sort");
 
     BigFile bf = {0};
     if(0 != big_file_mpi_create(&bf, fname, Comm)) {
@@ -52,7 +62,7 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
     conv.atime = atime;
     conv.hubble = hubble_function(CP, atime);
 
-    fof_write_header(&bf, fof->TotNgroups, atime, MassTable, CP, Comm);
+    fof_write_header(&bf, fof->TotNgroups, atime, MassTable, CP, SaveParticles != FOF_SAVE_UNSORTED, Comm);
 
     for(i = 0; i < FOFIOTable.used; i ++) {
         /* only process the particle blocks */
@@ -73,7 +83,10 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
 
     /* Store whether we need a new domain_maintain after we return*/
     int domain_needed = 0;
-    if(SaveParticles) {
+    if(SaveParticles == FOF_SAVE_UNSORTED) {
+        fof_save_particles_unsorted(&bf, &conv, MetalReturnOn, Comm);
+    }
+    else if(SaveParticles) {
         struct IOTable IOTable = {0};
         register_io_blocks(&IOTable, 1, MetalReturnOn);
         struct part_manager_type * halo_pman = NULL;
@@ -116,6 +129,14 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
             return domain_needed;
         }
 
+        /* Find the subhalos, now that each group is on one rank, and order the members of each group by subhalo*/
+        SubhaloCatalogue subhalos = {0};
+        if(subfind_enabled()) {
+            subhalos = subfind_find_subhalos(halo_pman, atime, conv.hubble, CP->GravInternal, FORCE_SOFTENING() / 2.8, Comm);
+            qsort_openmp(halo_pman->Base, halo_pman->NumPart, sizeof(struct particle_data), order_by_type_grnr_and_subhalo);
+            walltime_measure("/FOF/Subfind");
+        }
+
         int * selection = (int *) mymalloc("Selection", sizeof(int) * halo_pman->NumPart);
 
         int64_t ptype_offset[6]={0};
@@ -128,18 +149,29 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
             /* only process the particle blocks */
             char blockname[128];
             int ptype = IOTable.ent[i].ptype;
-            BigArray array = {0};
             if(ptype < 6 && ptype >= 0) {
                 sprintf(blockname, "%d/%s", ptype, IOTable.ent[i].name);
-                petaio_build_buffer(&array, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], halo_pman->Base, halo_sman, &conv);
-
                 message(0, "Writing Block %s\n", blockname);
 
+                petaio_save_selection(&bf, blockname, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], halo_pman->Base, halo_sman, &conv, 1);
+            }
+        }
+        myfree(selection);
+        if(subfind_enabled()) {
+            struct IOTable SubIOTable = {0};
+            subfind_register_io_blocks(&SubIOTable);
+            for(i = 0; i < SubIOTable.used; i ++) {
+                char blockname[128];
+                BigArray array = {0};
+                sprintf(blockname, "Subhalos/%s", SubIOTable.ent[i].name);
+                build_buffer_subhalo(&subhalos, &array, &SubIOTable.ent[i], &conv);
+                message(0, "Writing Block %s\n", blockname);
                 petaio_save_block(&bf, blockname, &array, 1);
                 petaio_destroy_buffer(&array);
             }
+            destroy_io_blocks(&SubIOTable);
+            subfind_free(&subhalos);
         }
-        myfree(selection);
         /* If we allocated new particle arrays, just free them*/
         if(halo_pman != PartManager) {
             myfree(halo_sman->Base);
@@ -157,6 +189,90 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
     return domain_needed;
 }
 
+static int
+order_selection_by_grnr(const void * a, const void * b)
+{
+    const int ia = *(const int *) a;
+    const int ib = *(const int *) b;
+    if(P[ia].GrNr != P[ib].GrNr)
+        return (P[ia].GrNr > P[ib].GrNr) - (P[ia].GrNr < P[ib].GrNr);
+    return (ia > ib) - (ia < ib);
+}
+
+/* Write the group members of each type without moving them between ranks.
+ * Each rank writes its own members, ordered by GrNr locally, as a contiguous
+ * range of rows. A group split between ranks has one range on each rank.
+ * GroupIndex/N stores (GrNr, first row, number of rows) for every range of type N,
+ * so a reader finds the members of a group by gathering its ranges.*/
+static void
+fof_save_particles_unsorted(BigFile * bf, struct conversions * conv, int MetalReturnOn, MPI_Comm Comm)
+{
+    int i;
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable, 1, MetalReturnOn);
+
+    int * selection = (int *) mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+    int64_t ptype_offset[6]={0};
+    int64_t ptype_count[6]={0};
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, fof_select_func);
+
+    /* The first row of this rank in each type block*/
+    int64_t ptype_start[6] = {0};
+    MPI_Exscan(ptype_count, ptype_start, 6, MPI_INT64, MPI_SUM, Comm);
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    if(ThisTask == 0)
+        memset(ptype_start, 0, sizeof(ptype_start));
+
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(ptype_count[ptype] > 1)
+            qsort_openmp(selection + ptype_offset[ptype], ptype_count[ptype], sizeof(int), order_selection_by_grnr);
+    }
+    walltime_measure("/FOF/IO/argind");
+
+    for(ptype = 0; ptype < 6; ptype++) {
+        const int * sel = selection + ptype_offset[ptype];
+        int64_t nrange = 0, j;
+        for(j = 0; j < ptype_count[ptype]; j++)
+            if(j == 0 || P[sel[j]].GrNr != P[sel[j-1]].GrNr)
+                nrange++;
+
+        int64_t (*range)[3] = (int64_t (*)[3]) mymalloc("GroupRange", sizeof(range[0]) * (nrange + 1));
+        nrange = 0;
+        for(j = 0; j < ptype_count[ptype]; j++) {
+            if(j == 0 || P[sel[j]].GrNr != P[sel[j-1]].GrNr) {
+                range[nrange][0] = P[sel[j]].GrNr;
+                range[nrange][1] = ptype_start[ptype] + j;
+                range[nrange][2] = 0;
+                nrange++;
+            }
+            range[nrange-1][2]++;
+        }
+        char blockname[128];
+        snprintf(blockname, 128, "GroupIndex/%d", ptype);
+        BigArray array = {0};
+        size_t dims[2] = {nrange, 3};
+        big_array_init(&array, range, "i8", 2, dims, NULL);
+        petaio_save_block(bf, blockname, &array, 1);
+        myfree(range);
+    }
+
+    for(i = 0; i < IOTable.used; i ++) {
+        /* only process the particle blocks */
+        char blockname[128];
+        ptype = IOTable.ent[i].ptype;
+        if(ptype < 6 && ptype >= 0) {
+            sprintf(blockname, "%d/%s", ptype, IOTable.ent[i].name);
+            message(0, "Writing Block %s\n", blockname);
+            petaio_save_selection(bf, blockname, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, conv, 1);
+        }
+    }
+    myfree(selection);
+    walltime_measure("/FOF/IO/WriteParticles");
+    destroy_io_blocks(&IOTable);
+}
+
 struct PartIndex {
     uint64_t origin;
     union {
@@ -216,26 +332,68 @@ order_by_type_and_grnr(const void *a, const void *b)
     return 0;
 }
 
-/* Build the target task structure by doing a double parallel sort */
+/* Order by subhalo within each group, with the unbound members last*/
+static int
+order_by_type_grnr_and_subhalo(const void *a, const void *b)
+{
+    int ret = order_by_type_and_grnr(a, b);
+    if(ret)
+        return ret;
+    const struct particle_data * pa  = (const struct particle_data *) a;
+    const struct particle_data * pb  = (const struct particle_data *) b;
+    return (pa->TopLeaf > pb->TopLeaf) - (pa->TopLeaf < pb->TopLeaf);
+}
+
+/* Build the target task structure by doing a double parallel sort.
+ * If WholeGroups is true, groups split between ranks by the sort are sent to the first rank with any of their particles.*/
 static void
-fof_find_target_task(struct PartIndex * pi, int64_t pi_size, const uint64_t task_origin_offset, MPI_Comm Comm)
+fof_find_target_task(struct PartIndex * pi, int64_t pi_size, const uint64_t task_origin_offset, const int WholeGroups, MPI_Comm Comm)
 {
     int64_t i;
-    int ThisTask;
+    int ThisTask, NTask;
     MPI_Comm_rank(Comm, &ThisTask);
+    MPI_Comm_size(Comm, &NTask);
 
+    walltime_measure("/FOF/IO/Distribute");
     /* sort pi to decide targetTask */
     mpsort_mpi(pi, pi_size, sizeof(struct PartIndex),
             fof_radix_sortkey, 8, NULL, Comm);
+    walltime_measure_mpsort("/FOF/Sort");
+
+    /* The first rank holding part of the group which starts this rank*/
+    int FirstTask = ThisTask;
+    if(WholeGroups) {
+        int64_t MyRange[2] = {-1, -1};
+        if(pi_size > 0) {
+            MyRange[0] = pi[0].sortKey;
+            MyRange[1] = pi[pi_size-1].sortKey;
+        }
+        int64_t * Ranges = (int64_t *) mymalloc("Ranges", 2 * NTask * sizeof(int64_t));
+        MPI_Allgather(MyRange, 2, MPI_INT64, Ranges, 2, MPI_INT64, Comm);
+        int t;
+        for(t = 0; t < ThisTask && pi_size > 0; t++) {
+            if(Ranges[2*t+1] >= 0 && Ranges[2*t] <= MyRange[0] && Ranges[2*t+1] >= MyRange[0]) {
+                FirstTask = t;
+                break;
+            }
+        }
+        myfree(Ranges);
+    }
 
+    /* targetTask overwrites the sort key*/
+    const int64_t FirstKey = pi_size > 0 ? pi[0].sortKey : -1;
     #pragma omp parallel for
     for(i = 0; i < pi_size; i ++) {
         /* YU: let's see if we keep the FOF particle load on the processes, IO would be faster
            (as at high z many ranks has no FOF), communication becomes sparse. */
-        pi[i].targetTask = ThisTask;
+        if(FirstTask != ThisTask && pi[i].sortKey == FirstKey)
+            pi[i].targetTask = FirstTask;
+        else
+            pi[i].targetTask = ThisTask;
     }
     /* return pi to the original processors */
     mpsort_mpi(pi, pi_size, sizeof(struct PartIndex), fof_radix_origin, 8, NULL, Comm);
+    walltime_measure_mpsort("/FOF/Sort");
     /* Target task is copied into the particle table, unioned with Dthsml.
      * This is a bit of a hack: probably the elegant thing to do is to unify slot
      * and main structure, then mpsort the combination directly. */
@@ -317,7 +475,7 @@ fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_mana
     MPI_Allreduce(&GrNrMax, &GrNrMaxGlobal, 1, MPI_INT64, MPI_MAX, Comm);
     message(0, "GrNrMax is %ld\n", GrNrMaxGlobal);
 
-    fof_find_target_task(pi, NpigLocal, task_origin_offset, Comm);
+    fof_find_target_task(pi, NpigLocal, task_origin_offset, subfind_enabled(), Comm);
     const double FOFPartAllocFactor = (double) PartManager->MaxPart / PartManager->NumPart;
 
     /* Initialise the new halo structure*/
@@ -375,7 +533,7 @@ fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_mana
             endrun(3, "Error in NpigLocal %ld != %ld!\n", NpigLocal, halo_pman->NumPart);
     }
     /* Do a domain exchange. No pre-computed list here. Maybe a different particle table.*/
-    if(domain_exchange(fof_sorted_layout, halo_pman, NULL, halo_pman, halo_sman, 10000, Comm)) {
+    if(domain_exchange(fof_sorted_layout, halo_pman, NULL, EXCHANGE_GRNR, halo_pman, halo_sman, 10000, Comm)) {
         message(1930, "Failed to exchange and write particles for the FOF. This is non-fatal, continuing.\n");
         if(halo_pman != PartManager) {
             myfree(halo_sman->Base);
@@ -415,7 +573,7 @@ static void build_buffer_fof(FOFGroups * fof, BigArray * array, IOTableEntry * e
     }
 }
 
-static void fof_write_header(BigFile * bf, int64_t TotNgroups, const double atime, const double * MassTable, Cosmology * CP, MPI_Comm Comm) {
+static void fof_write_header(BigFile * bf, int64_t TotNgroups, const double atime, const double * MassTable, Cosmology * CP, int GroupOrdered, MPI_Comm Comm) {
     BigBlock bh;
     if(0 != big_file_mpi_create_block(bf, &bh, "Header", NULL, 0, 0, 0, Comm)) {
         endrun(0, "Failed to create header\n");
@@ -456,6 +614,7 @@ static void fof_write_header(BigFile * bf, int64_t TotNgroups, const double atim
     big_block_set_attr(&bh, "CMBTemperature", &CP->CMBTemperature, "f8", 1);
     big_block_set_attr(&bh, "OmegaBaryon", &CP->OmegaBaryon, "f8", 1);
     big_block_set_attr(&bh, "UsePeculiarVelocity", &pecvel, "i4", 1);
+    big_block_set_attr(&bh, "GroupOrdered", &GroupOrdered, "i4", 1);
     big_block_mpi_close(&bh, Comm);
 }
 
@@ -565,3 +724,80 @@ static void fof_register_io_blocks(int MetalReturnOn, struct IOTable * IOTable)
     IO_REG(BlackholeMass, "f4", 1, PTYPE_FOF_GROUP, IOTable);
     IO_REG(BlackholeAccretionRate, "f4", 1, PTYPE_FOF_GROUP, IOTable);
 }
+
+static void build_buffer_subhalo(SubhaloCatalogue * sub, BigArray * array, IOTableEntry * ent, struct conversions * conv) {
+    petaio_alloc_buffer(array, ent, sub->Nsubhalos);
+    /* fill the buffer */
+    char * p = (char *) array->data;
+    int64_t i;
+    for(i = 0; i < sub->Nsubhalos; i ++) {
+        ent->getter(i, p, sub->Subhalo, NULL, conv);
+        p += array->strides[0];
+    }
+}
+
+/* Subhalos are only written, so there are no setters*/
+#define SIMPLE_PROPERTY_SUBHALO(name, field, type, items) \
+    SIMPLE_GETTER(GTSub ## name , field, type, items, struct Subhalo ) \
+
+SIMPLE_PROPERTY_SUBHALO(GroupID, GrNr, uint32_t, 1)
+SIMPLE_PROPERTY_SUBHALO(SubhaloRank, SubNr, uint32_t, 1)
+SIMPLE_PROPERTY_SUBHALO(Length, Length, uint32_t, 1)
+SIMPLE_PROPERTY_SUBHALO(LengthByType, LenType[0], uint32_t, 6)
+SIMPLE_PROPERTY_SUBHALO(Mass, Mass, float, 1)
+SIMPLE_PROPERTY_SUBHALO(MassByType, MassType[0], float, 6)
+SIMPLE_PROPERTY_SUBHALO(VelocityDispersion, VelDisp, float, 1)
+SIMPLE_PROPERTY_SUBHALO(MostBoundID, MostBoundID, uint64_t, 1)
+
+static void GTSubPosition(int i, double * out, void * baseptr, void * smanptr, const struct conversions * params) {
+    /* Remove the particle offset before saving*/
+    struct Subhalo * sub = (struct Subhalo *) baseptr;
+    int d;
+    for(d = 0; d < 3; d ++) {
+        out[d] = sub[i].Pos[d] - PartManager->CurrentParticleOffset[d];
+        while(out[d] > PartManager->BoxSize) out[d] -= PartManager->BoxSize;
+        while(out[d] <= 0) out[d] += PartManager->BoxSize;
+    }
+}
+
+static void GTSubMassCenterPosition(int i, double * out, void * baseptr, void * smanptr, const struct conversions * params) {
+    struct Subhalo * sub = (struct Subhalo *) baseptr;
+    int d;
+    for(d = 0; d < 3; d ++) {
+        out[d] = sub[i].CM[d] - PartManager->CurrentParticleOffset[d];
+        while(out[d] > PartManager->BoxSize) out[d] -= PartManager->BoxSize;
+        while(out[d] <= 0) out[d] += PartManager->BoxSize;
+    }
+}
+
+static void GTSubMassCenterVelocity(int i, float * out, void * baseptr, void * slotptr, const struct conversions * params) {
+    double fac = 1.0;
+    struct Subhalo * sub = (struct Subhalo *) baseptr;
+    if (GetUsePeculiarVelocity())
+        fac = 1.0 / params->atime;
+    int d;
+    for(d = 0; d < 3; d ++) {
+        out[d] = fac * sub[i].Vel[d];
+    }
+}
+
+#define IO_REG_SUBHALO(name, dtype, items, IOTable) \
+    io_register_io_block(# name, dtype, items, PTYPE_SUBHALO, (property_getter) GTSub ## name, NULL, 1, IOTable)
+
+static void subfind_register_io_blocks(struct IOTable * IOTable) {
+    IOTable->used = 0;
+    IOTable->allocated = 20;
+    IOTable->ent = (struct IOTableEntry *) mymalloc2("SubIOTable", IOTable->allocated* sizeof(IOTableEntry));
+
+    IO_REG_SUBHALO(GroupID, "u4", 1, IOTable);
+    IO_REG_SUBHALO(SubhaloRank, "u4", 1, IOTable);
+    IO_REG_SUBHALO(Length, "u4", 1, IOTable);
+    IO_REG_SUBHALO(LengthByType, "u4", 6, IOTable);
+    IO_REG_SUBHALO(Mass, "f4", 1, IOTable);
+    IO_REG_SUBHALO(MassByType, "f4", 6, IOTable);
+    IO_REG_SUBHALO(Position, "f8", 3, IOTable);
+    IO_REG_SUBHALO(MassCenterPosition, "f8", 3, IOTable);
+    IO_REG_SUBHALO(MassCenterVelocity, "f4", 3, IOTable);
+    IO_REG_SUBHALO(VelocityDispersion, "f4", 1, IOTable);
+    IO_REG_SUBHALO(MostBoundID, "u8", 1, IOTable);
+}
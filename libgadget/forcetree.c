@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <float.h>
 #include <math.h>
 #include <time.h>
 #include <omp.h>
@@ -15,6 +17,7 @@
 #include "utils/endrun.h"
 #include "utils/system.h"
 #include "utils/mymalloc.h"
+#include "utils/openmpsort.h"
 
 /*! \file forcetree.c
  *  \brief gravitational tree
@@ -35,8 +38,12 @@ static struct forcetree_params
     /* Each processor allocates a number of nodes which is TreeAllocFactor times
        the maximum(!) number of particles.  Note: A typical local tree for N
        particles needs usually about ~0.65*N nodes.
-       If the allocated memory is not sufficient, this parameter will be increased.*/
+       If the allocated memory is not sufficient, this parameter will be increased.
+       This is only the first guess: the node allocation grows during the tree build if needed.*/
     double TreeAllocFactor;
+    /* Largest number of nodes per local particle used so far by a tree with each type mask.
+     * Later trees with the same mask start with this many nodes.*/
+    double NodesHighWater[ALLMASK+1];
 } ForceTreeParams;
 
 void
@@ -44,6 +51,36 @@ init_forcetree_params(const double treeallocfactor)
 {
     /* This was increased due to the extra nodes created by subtrees*/
     ForceTreeParams.TreeAllocFactor = treeallocfactor;
+    memset(ForceTreeParams.NodesHighWater, 0, sizeof(ForceTreeParams.NodesHighWater));
+}
+
+/* Number of nodes to allocate at first for a tree with this type mask*/
+static int64_t
+force_tree_initial_nodes(const int mask, const DomainDecomp * ddecomp)
+{
+    double factor = ForceTreeParams.TreeAllocFactor;
+    /* A little more than the most this tree type has needed, but not more than the guess.*/
+    if(ForceTreeParams.NodesHighWater[mask] > 0)
+        factor = DMIN(factor, 1.05 * ForceTreeParams.NodesHighWater[mask]);
+    return factor * PartManager->NumPart + ddecomp->NTopNodes;
+}
+
+/* Let the node allocation of a tree which is about to be built grow into the free main memory,
+ * by moving lastnode (which is only used to label the pseudo particles) past the allocated nodes.
+ * The nodes are the last allocation at the bottom of the main memory, so they can grow in place.
+ * Not done with the libc allocator, which may move memory on realloc.*/
+static void
+force_tree_allow_growth(ForceTree * tree)
+{
+    if(A_MAIN->use_malloc)
+        return;
+    int64_t maxnodes = tree->nallocnodes + mymalloc_freebytes() / sizeof(struct NODE);
+    /* Pseudo particle indices must fit in an int*/
+    const int64_t maxlast = (1L<<30) + (1L<<29) - 1;
+    if(tree->firstnode + maxnodes > maxlast)
+        maxnodes = maxlast - tree->firstnode;
+    if(maxnodes > tree->nallocnodes)
+        tree->lastnode = tree->firstnode + maxnodes;
 }
 
 static ForceTree
@@ -56,11 +93,20 @@ static void
 force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, const DomainDecomp * ddecomp, const int bits, const int x, const int y, const int z, int *nextfree, const int lastnode);
 
 static void
-force_exchange_pseudodata(const ForceTree * const tree, const DomainDecomp * const ddecomp);
+force_exchange_pseudodata(const ForceTree * const tree, DomainDecomp * const ddecomp);
+
+static void
+force_tree_calc_type_masks(ForceTree * tree);
+
+static void
+force_exchange_topleaf_extent(ForceTree * tree, const DomainDecomp * const ddecomp);
 
 static void
 add_particle_moment_to_node(struct NODE * pnode, const struct particle_data * const part);
 
+static int64_t
+force_refit_node_recursive(const int no, const unsigned char * const keep, const int level, const ForceTree * const tree);
+
 #ifdef DEBUG
 /* Walk the constructed tree, validating sibling and nextnode as we go*/
 static void force_validate_nextlist(const ForceTree * tree)
@@ -176,6 +222,8 @@ force_tree_calc_moments(ForceTree * tree, DomainDecomp * ddecomp)
     force_update_node_parallel(tree, ddecomp);
     /* Exchange the pseudo-data*/
     force_exchange_pseudodata(tree, ddecomp);
+    if(tree->TopLeafExtent)
+        force_exchange_topleaf_extent(tree, ddecomp);
     #pragma omp parallel
     #pragma omp single nowait
     {
@@ -185,6 +233,58 @@ force_tree_calc_moments(ForceTree * tree, DomainDecomp * ddecomp)
     tree->hmax_computed_flag = 1;
 }
 
+/* Refit an existing tree to a subset of the particles it contains.
+ * The node topology, centers and sizes are kept. Particles not in act are removed
+ * from their leaves, empty internal nodes are turned into empty leaves (so that
+ * the moment calculation removes them from the walk) and the moments are recomputed
+ * bottom-up. The particles must not have moved since the tree was built, and act must
+ * be a subset of the particles used to build the tree. Collective.*/
+void
+force_tree_refit(ForceTree * tree, DomainDecomp * ddecomp, const ActiveParticles * act)
+{
+    if(!force_tree_allocated(tree) || !tree->moments_computed_flag)
+        endrun(5, "Tried to refit a tree which was not built with moments\n");
+
+    /* Nothing to do: the tree has all particles.*/
+    if(!act->ActiveParticle && tree->full_particle_tree_flag)
+        return;
+
+    unsigned char * keep = (unsigned char *) mymalloc2("RefitKeep", PartManager->NumPart * sizeof(unsigned char));
+    int64_t i;
+    if(act->ActiveParticle) {
+        memset(keep, 0, PartManager->NumPart * sizeof(unsigned char));
+        #pragma omp parallel for
+        for(i = 0; i < act->NumActiveParticle; i++)
+            keep[act->ActiveParticle[i]] = 1;
+    }
+    else
+        memset(keep, 1, PartManager->NumPart * sizeof(unsigned char));
+
+    int64_t NumParticles = 0;
+    #pragma omp parallel
+    #pragma omp single nowait
+    {
+        for(i = ddecomp->Tasks[tree->ThisTask].StartLeaf; i < ddecomp->Tasks[tree->ThisTask].EndLeaf; i ++) {
+            const int no = ddecomp->TopLeaves[i].treenode;
+            #pragma omp task default(none) firstprivate(no, keep, tree) shared(NumParticles)
+            {
+                const int64_t nkeep = force_refit_node_recursive(no, keep, 1, tree);
+                #pragma omp atomic update
+                NumParticles += nkeep;
+            }
+        }
+    }
+    myfree(keep);
+
+    tree->NumParticles = NumParticles;
+    if(act->ActiveParticle)
+        tree->full_particle_tree_flag = 0;
+    force_tree_calc_moments(tree, ddecomp);
+    if(tree->Quadrupoles)
+        force_tree_calc_quadrupoles(tree);
+    walltime_measure("/Tree/Refit");
+}
+
 /*! Constructs the gravitational oct-tree.
  *
  *  The index convention for accessing tree nodes is the following: the
@@ -200,9 +300,9 @@ ForceTree
 force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, const int DoMoments, const int alloc_father, const char * EmergencyOutputDir)
 {
     ForceTree tree;
-    int64_t maxnodes = ForceTreeParams.TreeAllocFactor * PartManager->NumPart + ddecomp->NTopNodes;
+    int64_t maxnodes = force_tree_initial_nodes(mask, ddecomp);
     /* int64_t maxmaxnodes;
-     MPI_Reduce(&maxnodes, &maxmaxnodes, 1, MPI_INT64, MPI_MAX,0, MPI_COMM_WORLD);
+     MPI_Reduce(&maxnodes, &maxmaxnodes, 1, MPI_INT64, MPI_MAX,0, GadgetComm);
     message(0, "Treebuild: Largest is %g MByte for %ld tree nodes. firstnode %ld. (presently allocated %g MB)\n",
          maxmaxnodes * sizeof(struct NODE) / (1024.0 * 1024.0), maxmaxnodes, PartManager->MaxPart,
          mymalloc_usedbytes() / (1024.0 * 1024.0));*/
@@ -212,6 +312,7 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
         /* Allocate memory: note that because node numbers are passed around between ranks,
          * this has to be something which is the same on all ranks. */
         tree = force_treeallocate(maxnodes, PartManager->MaxPart, ddecomp, alloc_father, 0);
+        force_tree_allow_growth(&tree);
         tree.mask = mask;
         tree.BoxSize = PartManager->BoxSize;
         force_tree_create_nodes(&tree, act, mask, ddecomp);
@@ -234,7 +335,7 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
     while(tree.numnodes >= tree.lastnode - tree.firstnode);
 
 #ifdef DEBUG
-    if(MPIU_Any(ForceTreeParams.TreeAllocFactor > 3.0, MPI_COMM_WORLD)) {
+    if(MPIU_Any(ForceTreeParams.TreeAllocFactor > 3.0, GadgetComm)) {
         /* Assume scale factor = 1 for dump as position is not affected.*/
         if(EmergencyOutputDir) {
             Cosmology CP = {0};
@@ -248,12 +349,19 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
 #endif
     report_memory_usage("FORCETREE");
     tree.Nodes_base = (struct NODE *) myrealloc(tree.Nodes_base, (tree.numnodes +1) * sizeof(struct NODE));
+    tree.nallocnodes = tree.numnodes;
 
     /*Update the oct-tree struct so it knows about the memory change*/
     tree.Nodes = tree.Nodes_base - tree.firstnode;
 
+    const double nodesperpart = (double) tree.numnodes / DMAX(PartManager->NumPart, 1);
+    if(nodesperpart > ForceTreeParams.NodesHighWater[mask])
+        ForceTreeParams.NodesHighWater[mask] = nodesperpart;
+
     tree.moments_computed_flag = 0;
 
+    force_tree_calc_type_masks(&tree);
+
     if(DoMoments) {
         walltime_measure("/Tree/Build/Nodes");
         force_tree_calc_moments(&tree, ddecomp);
@@ -264,11 +372,11 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
     int64_t maxnumnodes = tree.numnodes;
 #ifdef DEBUG
     force_validate_nextlist(&tree);
-    MPI_Reduce(&tree.NumParticles, &allact, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tree.numnodes, &maxnumnodes, 1, MPI_INT64, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&tree.NumParticles, &allact, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&tree.numnodes, &maxnumnodes, 1, MPI_INT64, MPI_MAX, 0, GadgetComm);
 #endif
-    message(0, "Tree constructed (type mask: %d moments: %d) with %ld particles. First node %ld, num nodes %ld, first pseudo %ld. NTopLeaves %d\n",
-            mask, tree.moments_computed_flag, allact, tree.firstnode, maxnumnodes, tree.lastnode, tree.NTopLeaves);
+    message(0, "Tree constructed (type mask: %d moments: %d) with %ld particles. First node %ld, num nodes %ld, first pseudo %ld. NTopLeaves %d. High-water %g nodes per particle.\n",
+            mask, tree.moments_computed_flag, allact, tree.firstnode, maxnumnodes, tree.lastnode, tree.NTopLeaves, ForceTreeParams.NodesHighWater[mask]);
     return tree;
 }
 
@@ -286,19 +394,6 @@ int get_subnode(const struct NODE * node, const double Pos[3])
             ((Pos[2] > node->center[2]) << 2);
 }
 
-/*Check whether a particle is inside the volume covered by a node,
- * by checking whether each dimension is close enough to center (L1 metric).*/
-static inline int inside_node(const struct NODE * node, const double Pos[3])
-{
-    /*One can also use a loop, but the compiler unrolls it only at -O3,
-     *so this is a little faster*/
-    int inside =
-        (fabs(2*(Pos[0] - node->center[0])) <= node->len) *
-        (fabs(2*(Pos[1] - node->center[1])) <= node->len) *
-        (fabs(2*(Pos[2] - node->center[2])) <= node->len);
-    return inside;
-}
-
 /*Initialise an internal node at nfreep. The parent is assumed to be locked, and
  * we have assured that nothing else will change nfreep while we are here.*/
 static void init_internal_node(struct NODE *nfreep, struct NODE *parent, int subnode)
@@ -312,6 +407,7 @@ static void init_internal_node(struct NODE *nfreep, struct NODE *parent, int sub
     nfreep->f.InternalTopLevel = 0;
     nfreep->f.DependsOnLocalMass = 0;
     nfreep->f.ChildType = PARTICLE_NODE_TYPE;
+    nfreep->f.TypeMask = 0;
     nfreep->f.unused = 0;
 
     for(j = 0; j < 3; j++) {
@@ -367,291 +463,6 @@ modify_internal_node(int parent, int subnode, int p_toplace, const ForceTree tb)
 }
 
 
-/* Create a new layer of nodes beneath the current node, and place the particle.
- * Must have node lock.*/
-static int
-create_new_node_layer(int firstparent, int p_toplace, const ForceTree tb, int *nnext, struct NodeCache *nc)
-{
-    /* This is so we can defer changing
-     * the type of the existing node until the end.*/
-    int parent = firstparent;
-
-    do {
-        int i;
-        struct NODE *nprnt = &tb.Nodes[parent];
-
-        /* Braces to scope oldsuns and newsuns*/
-        {
-        int newsuns[NMAXCHILD];
-
-        int * oldsuns = nprnt->s.suns;
-
-        /*We have two particles here, so create a new child node to store them both.*/
-        /* if we are here the node must be large enough, thus contain exactly one child. */
-        /* The parent is already a leaf, need to split */
-        /* Get memory for 8 extra nodes from our cache.*/
-        newsuns[0] = get_freenode(nnext, nc);
-        /*If we already have too many nodes, exit loop.*/
-        if(nc->nnext_thread >= tb.lastnode) {
-            /* This means that we have > NMAXCHILD particles in the same place,
-            * which usually indicates a bug in the particle evolution. Print some helpful debug information.*/
-            message(1, "Failed placing %d at %g %g %g, type %d, ID %ld. Others were %d (%g %g %g, t %d ID %ld) and %d (%g %g %g, t %d ID %ld).\n",
-                p_toplace, P[p_toplace].Pos[0], P[p_toplace].Pos[1], P[p_toplace].Pos[2], P[p_toplace].Type, P[p_toplace].ID,
-                oldsuns[0], P[oldsuns[0]].Pos[0], P[oldsuns[0]].Pos[1], P[oldsuns[0]].Pos[2], P[oldsuns[0]].Type, P[oldsuns[0]].ID,
-                oldsuns[1], P[oldsuns[1]].Pos[0], P[oldsuns[1]].Pos[1], P[oldsuns[1]].Pos[2], P[oldsuns[1]].Type, P[oldsuns[1]].ID
-            );
-            nc->nnext_thread = tb.lastnode + 10 * NODECACHE_SIZE;
-            /* If this is not the first layer created,
-                * we need to mark the overall parent as a node node
-                * while marking this one as a particle node */
-            if(firstparent != parent)
-            {
-                nprnt->f.ChildType = PARTICLE_NODE_TYPE;
-                nprnt->s.noccupied = NMAXCHILD;
-                tb.Nodes[firstparent].f.ChildType = NODE_NODE_TYPE;
-                tb.Nodes[firstparent].s.noccupied = NODEFULL;
-            }
-            return 1;
-        }
-        for(i=0; i<8; i++) {
-            newsuns[i] = newsuns[0] + i;
-            struct NODE *nfreep = &tb.Nodes[newsuns[i]];
-            /* We create a new leaf node.*/
-            init_internal_node(nfreep, nprnt, i);
-            /*Set father of new node*/
-            nfreep->father = parent;
-        }
-        /*Initialize the remaining entries to empty*/
-        for(i=8; i<NMAXCHILD;i++)
-            newsuns[i] = -1;
-
-        for(i=0; i < NMAXCHILD; i++) {
-            /* Re-attach each particle to the appropriate new leaf.
-            * Notice that since we have NMAXCHILD slots on each child and NMAXCHILD particles,
-            * we will always have a free slot. */
-            int subnode = get_subnode(nprnt, P[oldsuns[i]].Pos);
-            int child = newsuns[subnode];
-            struct NODE * nchild = &tb.Nodes[child];
-            modify_internal_node(child, nchild->s.noccupied, oldsuns[i], tb);
-            nchild->s.noccupied++;
-        }
-        /* Copy the new node array into the node*/
-        memcpy(nprnt->s.suns, newsuns, NMAXCHILD * sizeof(int));
-        } /* After this brace oldsuns and newsuns are invalid*/
-
-        /* Set sibling for the new rank. Since empty at this point, point onwards.*/
-        for(i=0; i<7; i++) {
-            int child = nprnt->s.suns[i];
-            struct NODE * nchild = &tb.Nodes[child];
-            nchild->sibling = nprnt->s.suns[i+1];
-        }
-        /* Final child needs special handling: set to the parent's sibling.*/
-        tb.Nodes[nprnt->s.suns[7]].sibling = nprnt->sibling;
-        /* Zero the momenta for the parent*/
-        memset(&nprnt->mom, 0, sizeof(nprnt->mom));
-
-        /* Now try again to add the new particle*/
-        int subnode = get_subnode(nprnt, P[p_toplace].Pos);
-        int child = nprnt->s.suns[subnode];
-        struct NODE * nchild = &tb.Nodes[child];
-        if(nchild->s.noccupied < NMAXCHILD) {
-            modify_internal_node(child, nchild->s.noccupied, p_toplace, tb);
-            nchild->s.noccupied++;
-            break;
-        }
-        /* The attached particles are already within one subnode of the new node.
-         * Iterate, creating a new layer beneath.*/
-        else {
-            /* The current child is going to have new nodes created beneath it,
-             * so mark it a Node-containing node. It cannot be accessed until
-             * we mark the top-level parent, so no need for atomics.*/
-            tb.Nodes[child].f.ChildType = NODE_NODE_TYPE;
-            tb.Nodes[child].s.noccupied = NODEFULL;
-            parent = child;
-        }
-    } while(1);
-
-    /* A new node is created. Mark the (original) parent as an internal node with node children.
-     * This goes last so that we don't access the child before it is constructed.*/
-    tb.Nodes[firstparent].f.ChildType = NODE_NODE_TYPE;
-    tb.Nodes[firstparent].s.noccupied = NODEFULL;
-    return 0;
-}
-
-/* Add a particle to the tree, extending the tree as necessary. Locking is done,
- * so may be called from a threaded context*/
-int add_particle_to_tree(int i, int cur_start, const ForceTree tb, struct NodeCache *nc, int* nnext)
-{
-    int child, nocc;
-    int cur = cur_start;
-    /*Walk the main tree until we get something that isn't an internal node.*/
-    do
-    {
-        /*No lock needed: if we have an internal node here it will be stable*/
-        nocc = tb.Nodes[cur].s.noccupied;
-
-        /* This node still has space for a particle (or needs conversion)*/
-        if(nocc < NODEFULL)
-            break;
-
-        /* This node has child subnodes: find them.*/
-        int subnode = get_subnode(&tb.Nodes[cur], P[i].Pos);
-        /*No lock needed: if we have an internal node here it will be stable*/
-        child = tb.Nodes[cur].s.suns[subnode];
-
-        if(child > tb.lastnode || child < tb.firstnode)
-            endrun(1,"Corruption in tree build: N[%d].[%d] = %d > lastnode (%ld)\n",cur, subnode, child, tb.lastnode);
-        cur = child;
-    }
-    while(child >= tb.firstnode);
-
-    /* We have a guaranteed spot.*/
-    nocc = tb.Nodes[cur].s.noccupied;
-    tb.Nodes[cur].s.noccupied++;
-
-    /* Now we have something that isn't an internal node. We can place the particle! */
-    if(nocc < NMAXCHILD)
-        modify_internal_node(cur, nocc, i, tb);
-    /* In this case we need to create a new layer of nodes beneath this one*/
-    else if(nocc < NODEFULL) {
-        if(create_new_node_layer(cur, i, tb, nnext, nc))
-            return -1;
-    } else
-        endrun(2, "Tried to convert already converted node %d with nocc = %d\n", cur, nocc);
-    return cur;
-}
-
-/* Merge two partial trees together. Trees are walked simultaneously.
- * A merge is done when a particle node is encountered in one of the side trees.
- * The merge rule is that the node node is attached to the
- * left-most old parent and the particles are re-attached to the node node*/
-int
-merge_partial_force_trees(int left, int right, struct NodeCache * nc, int * nnext, const struct ForceTree tb)
-{
-    int this_left = left;
-    int this_right = right;
-    const int left_end = tb.Nodes[left].sibling;
-    const int right_end = tb.Nodes[right].sibling;
-//     message(5, "Ends: %d %d\n", left_end, right_end);
-    while(this_left != left_end && this_right != right_end)
-    {
-        if(this_left < tb.firstnode || this_right < tb.firstnode)
-            endrun(10, "Encountered invalid node: %d %d < first %ld\n", this_left, this_right, tb.firstnode);
-        struct NODE * nleft = &tb.Nodes[this_left];
-        struct NODE * nright = &tb.Nodes[this_right];
-        if(nc->nnext_thread >= tb.lastnode)
-            return 1;
-#ifdef DEBUG
-        /* Stop when we reach another topnode*/
-        if((nleft->f.TopLevel && this_left != left) || (nright->f.TopLevel && this_right != right))
-            endrun(6, "Encountered another topnode: left %d == right %d! type %d\n", this_left, this_right, nleft->f.ChildType);
-        if(this_left == this_right)
-            endrun(6, "Odd: left %d == right %d! type %d\n", this_left, this_right, nleft->f.ChildType);
-//         message(1, "left %d right %d\n", this_left, this_right);
-        /* Trees should be synced*/
-        if(fabs(nleft->len / nright->len-1) > 1e-6)
-            endrun(6, "Merge unsynced trees: %d %d len %g %g\n", this_left, this_right, nleft->len, nright->len);
-#endif
-        /* Two node nodes: keep walking down*/
-        if(nleft->f.ChildType == NODE_NODE_TYPE && nright->f.ChildType == NODE_NODE_TYPE) {
-            if(tb.Nodes[nleft->s.suns[0]].father < 0 || tb.Nodes[nright->s.suns[0]].father < 0)
-                endrun(7, "Walking to nodes (%d %d) from (%d %d) fathers (%d %d)\n",
-                       nleft->s.suns[0], nright->s.suns[0], this_left, this_right, tb.Nodes[nleft->s.suns[0]].father, tb.Nodes[nright->s.suns[0]].father);
-            this_left = nleft->s.suns[0];
-            this_right = nright->s.suns[0];
-            continue;
-        }
-        /* If the right node has particles, add them to the left node, go to sibling on right and left.*/
-        else if(nright->f.ChildType == PARTICLE_NODE_TYPE) {
-            int i;
-            for(i = 0; i < nright->s.noccupied; i++) {
-                if(nright->s.suns[i] >= tb.firstnode)
-                    endrun(8, "Bad child %d of %d in %d\n", i, nright->s.suns[i], this_right);
-                if(add_particle_to_tree(nright->s.suns[i], this_left, tb, nc, nnext) < 0)
-                    return 1;
-            }
-            /* Make sure that nodes which have
-             * this_right as a sibling (there will
-             * be a max of one, as it is a particle node
-             * with no children) point to the replacement
-             * on the left*/
-            /* This condition is checking for the root node, which has no siblings*/
-            if(this_right > right) {
-                /* Find the father, then the next child*/
-                struct NODE * fat = &tb.Nodes[nright->father];
-                /* Find the position of this child in the father*/
-                int sunloc = 0;
-                for(i = 0; i < 8; i++)
-                {
-                    if(fat->s.suns[i] == this_right) {
-                        sunloc = i;
-                        break;
-                    }
-                }
-                /* Change the sibling of the child next to this one*/
-                if(sunloc > 0) {
-                    if(tb.Nodes[fat->s.suns[i-1]].sibling == this_right)
-                        tb.Nodes[fat->s.suns[i-1]].sibling = this_left;
-                }
-            }
-            /* Mark the right node as now invalid*/
-            nright->father = -5;
-            /* Now go to sibling*/
-            this_left = nleft->sibling;
-            this_right = nright->sibling;
-            continue;
-        }
-        /* If the left node has particles, add them to the right node,
-         * then copy the right node over the left node and go to (old) sibling on right and left.*/
-        else if(nleft->f.ChildType == PARTICLE_NODE_TYPE && nright->f.ChildType == NODE_NODE_TYPE) {
-            /* Add the left particles to the right*/
-            int i;
-            for(i = 0; i < nleft->s.noccupied; i++) {
-                if(nleft->s.suns[i] >= tb.firstnode)
-                    endrun(8, "Bad child %d of %d in left %d\n", i, nleft->s.suns[i], this_left);
-                if(add_particle_to_tree(nleft->s.suns[i], this_right, tb, nc, nnext) < 0)
-                    return 1;
-            }
-            /* Copy the right node over the left*/
-            memmove(&nleft->s, &nright->s, sizeof(nleft->s));
-            nleft->f.ChildType = NODE_NODE_TYPE;
-            /* Zero the momenta for the parent*/
-            memset(&nleft->mom, 0, sizeof(nleft->mom));
-            /* Reset children to the new parent:
-             * this assumes nright is a NODE NODE*/
-            for(i = 0; i < 8; i++) {
-                int child = nleft->s.suns[i];
-                tb.Nodes[child].father = this_left;
-            }
-            /* Make sure final child points to the parent's sibling.*/
-#ifdef DEBUG
-            int oldsib = tb.Nodes[nleft->s.suns[7]].sibling;
-#endif
-            /* Walk downwards making sure all the children point to the new sibling.
-             * Note also changes last particle node child. */
-            int nn = this_left;
-            while(tb.Nodes[nn].f.ChildType == NODE_NODE_TYPE) {
-                nn = tb.Nodes[nn].s.suns[7];
-#ifdef DEBUG
-                if(tb.Nodes[nn].sibling != oldsib)
-                    endrun(20, "Not the expected sibling %d != %d\n",tb.Nodes[nn].sibling, oldsib);
-#endif
-                tb.Nodes[nn].sibling = nleft->sibling;
-            }
-            /* Mark the right node as now invalid*/
-            nright->father = -5;
-            /* Next iteration is going to sibling*/
-            this_left = nleft->sibling;
-            this_right = nright->sibling;
-            continue;
-        }
-        else
-            endrun(6, "Nodes %d %d have unexpected type %d %d\n", this_left, this_right, nleft->f.ChildType, nright->f.ChildType);
-    }
-    return 0;
-}
-
-
 /* create an empty root node  */
 int
 force_tree_create_topnodes(ForceTree * tree, DomainDecomp * ddecomp)
@@ -659,7 +470,7 @@ force_tree_create_topnodes(ForceTree * tree, DomainDecomp * ddecomp)
     int nnext = tree->firstnode;       /* index of first free node */
     int i;
     struct NODE *nfreep = &tree->Nodes[nnext];	/* select first node */
-    MPI_Comm_rank(MPI_COMM_WORLD, &tree->ThisTask);
+    MPI_Comm_rank(GadgetComm, &tree->ThisTask);
 
     nfreep->len = PartManager->BoxSize*1.001;
     for(i = 0; i < 3; i++)
@@ -673,6 +484,7 @@ force_tree_create_topnodes(ForceTree * tree, DomainDecomp * ddecomp)
     nfreep->f.InternalTopLevel = 0;
     nfreep->f.DependsOnLocalMass = 0;
     nfreep->f.ChildType = PARTICLE_NODE_TYPE;
+    nfreep->f.TypeMask = 0;
     nfreep->f.unused = 0;
     memset(&(nfreep->mom.cofm),0,3*sizeof(MyFloat));
     nfreep->mom.mass = 0;
@@ -723,136 +535,234 @@ force_tree_find_topnode(const double * const pos, const ForceTree * const tree)
 #endif
     return no;
 }
+/* Particle to add to the tree, sorted by top-level leaf*/
+struct TreeBuildKey {
+    int topleaf;
+    int index;
+};
+
+/* The node memory during the tree build. Nodes up to capacity have memory.
+ * Past that the allocation grows in place, up to tb.lastnode.*/
+struct NodePool {
+    struct NODE * Nodes_base;
+    int64_t firstnode;
+    int64_t capacity;
+    int64_t lastnode;
+};
+
+/* Make sure nodes before end have memory, growing the allocation if needed. Returns 0 if there is not enough memory.*/
+static int
+force_tree_reserve_nodes(struct NodePool * pool, const int64_t end)
+{
+    int64_t capacity;
+    #pragma omp atomic read
+    capacity = pool->capacity;
+    if(end <= capacity)
+        return 1;
+    int success = 1;
+    #pragma omp critical (_treenodepool_)
+    {
+        if(end > pool->capacity) {
+            /* Grow by a fifth, but not past the end of the node labels or the free memory*/
+            int64_t newcap = DMAX(end, pool->capacity + 0.2 * (pool->capacity - pool->firstnode));
+            if(newcap > pool->lastnode)
+                newcap = pool->lastnode;
+            const int64_t freenodes = mymalloc_freebytes() / sizeof(struct NODE) - 1;
+            if(newcap - pool->capacity > freenodes)
+                newcap = pool->capacity + freenodes;
+            if(newcap < end)
+                success = 0;
+            else {
+                struct NODE * newbase = (struct NODE *) myrealloc(pool->Nodes_base, (newcap - pool->firstnode + 1) * sizeof(struct NODE));
+                /* Other threads are using the nodes, so they must not move*/
+                if(newbase != pool->Nodes_base)
+                    endrun(5, "Tree nodes moved from %p to %p when growing\n", pool->Nodes_base, newbase);
+                message(1, "Tree node allocation grown from %ld to %ld nodes\n", pool->capacity - pool->firstnode, newcap - pool->firstnode);
+                #pragma omp atomic write
+                pool->capacity = newcap;
+            }
+        }
+    }
+    return success;
+}
+
+/* Subtrees with more particles than this are built in a new task*/
+#define TREEBUILD_TASK_SIZE 2048
+/* A node this far below its top-level leaf is smaller than the precision of the particle positions*/
+#define TREEBUILD_MAX_DEPTH 60
+
+/* Build the subtree below node no, containing the n particles in keys, by recursively splitting
+ * the particle list among the 8 children. Each subtree is only touched by one task, so no locking is needed.
+ * The order of keys is changed. Nodes are taken from the cache of the current thread.*/
+static void
+force_tree_build_subtree(const int no, struct TreeBuildKey * keys, const int64_t n, const int depth, const ForceTree tb, struct NodeCache * caches, struct NodePool * pool, int * nnext, int * failed)
+{
+    struct NODE * node = &tb.Nodes[no];
+    int64_t i;
+    if(n <= NMAXCHILD) {
+        for(i = 0; i < n; i++)
+            modify_internal_node(no, i, keys[i].index, tb);
+        node->s.noccupied = n;
+        return;
+    }
+    if(depth >= TREEBUILD_MAX_DEPTH) {
+        /* This means that we have > NMAXCHILD particles in the same place,
+         * which usually indicates a bug in the particle evolution. Print some helpful debug information.*/
+        const int p0 = keys[0].index, p1 = keys[1].index;
+        message(1, "Failed placing %ld particles at %g %g %g. First were %d (t %d ID %ld) and %d (%g %g %g, t %d ID %ld).\n",
+            n, P[p0].Pos[0], P[p0].Pos[1], P[p0].Pos[2], p0, P[p0].Type, P[p0].ID,
+            p1, P[p1].Pos[0], P[p1].Pos[1], P[p1].Pos[2], P[p1].Type, P[p1].ID);
+        *failed = 1;
+        return;
+    }
+    struct NodeCache * nc = &caches[omp_get_thread_num()];
+    const int first = get_freenode(nnext, nc);
+    if(first + 8 > tb.lastnode || !force_tree_reserve_nodes(pool, first + 8)) {
+        *failed = 1;
+        return;
+    }
+    int suns[NMAXCHILD];
+    for(i = 0; i < 8; i++) {
+        suns[i] = first + i;
+        struct NODE *nfreep = &tb.Nodes[suns[i]];
+        init_internal_node(nfreep, node, i);
+        nfreep->father = no;
+    }
+    for(i=8; i<NMAXCHILD;i++)
+        suns[i] = -1;
+    /* Set siblings: the final child points to the parent's sibling.*/
+    for(i = 0; i < 7; i++)
+        tb.Nodes[suns[i]].sibling = suns[i+1];
+    tb.Nodes[suns[7]].sibling = node->sibling;
+
+    /* Partition the particles by child, in place: count, then swap each particle into its child's range.*/
+    int64_t start[9] = {0}, next[8];
+    for(i = 0; i < n; i++)
+        start[get_subnode(node, P[keys[i].index].Pos) + 1]++;
+    for(i = 0; i < 8; i++) {
+        start[i+1] += start[i];
+        next[i] = start[i];
+    }
+    int sub;
+    for(sub = 0; sub < 8; sub++) {
+        while(next[sub] < start[sub+1]) {
+            const int target = get_subnode(node, P[keys[next[sub]].index].Pos);
+            if(target == sub)
+                next[sub]++;
+            else {
+                struct TreeBuildKey tmp = keys[next[target]];
+                keys[next[target]++] = keys[next[sub]];
+                keys[next[sub]] = tmp;
+            }
+        }
+    }
+
+    memcpy(node->s.suns, suns, NMAXCHILD * sizeof(int));
+    memset(&node->mom, 0, sizeof(node->mom));
+    node->f.ChildType = NODE_NODE_TYPE;
+    node->s.noccupied = NODEFULL;
+
+    for(sub = 0; sub < 8; sub++) {
+        const int child = suns[sub];
+        struct TreeBuildKey * const childkeys = keys + start[sub];
+        const int64_t nchild = start[sub+1] - start[sub];
+        if(nchild > TREEBUILD_TASK_SIZE) {
+            #pragma omp task default(none) firstprivate(child, childkeys, nchild, depth, tb, caches, pool, nnext, failed)
+            force_tree_build_subtree(child, childkeys, nchild, depth + 1, tb, caches, pool, nnext, failed);
+        }
+        else
+            force_tree_build_subtree(child, childkeys, nchild, depth + 1, tb, caches, pool, nnext, failed);
+    }
+}
+
 /*! Does initial creation of the nodes for the gravitational oct-tree.
  * mask is a bitfield: Only types whose bit is set are added.
+ * The particles are sorted by top-level leaf, and the subtree of each local
+ * top-level leaf is then built independently, splitting large subtrees into tasks.
+ * The subtrees are attached to the top-level tree already, so no merge is needed.
  **/
 void
 force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask, DomainDecomp * ddecomp)
 {
     int nnext = force_tree_create_topnodes(tree, ddecomp);
 
-    /* Set up thread-local copies of the topnodes to anchor the subtrees. */
-    int ThisTask, j, t;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     const int StartLeaf = ddecomp->Tasks[ThisTask].StartLeaf;
     const int EndLeaf = ddecomp->Tasks[ThisTask].EndLeaf;
-    const int nthr = omp_get_max_threads();
-    int * topnodes = ta_malloc("topnodes", int, (EndLeaf - StartLeaf) * nthr);
-    /* Topnodes for each thread. For tid 0, just use the real tree. Saves copying the tree back.*/
-    for(j = 0; j < EndLeaf - StartLeaf; j++)
-        topnodes[j] = ddecomp->TopLeaves[j + StartLeaf].treenode;
-    /* Other threads need a copy*/
-    for(t = 1; t < nthr; t++) {
-        for(j = 0; j < EndLeaf - StartLeaf; j++) {
-            /* Make a local copy*/
-            topnodes[j + t * (EndLeaf - StartLeaf)] = nnext;
-            memmove(&tree->Nodes[nnext], &tree->Nodes[topnodes[j]], sizeof(struct NODE));
-            nnext++;
-        }
-    }
 
-/*     double tstart = second(); */
-    const int first_free = nnext;
-    /* Increment nnext for the threads we are about to initialise.*/
-    nnext += NODECACHE_SIZE * nthr;
-    /* now we insert all particles */
-    int numparticles=0;
+    /* Find the particles to add, and sort them by top-level leaf.
+     * Particles which are not added sort to the end.*/
+    struct TreeBuildKey * keys = (struct TreeBuildKey *) mymalloc2("TreeBuildKeys", DMAX(act->NumActiveParticle, 1) * sizeof(struct TreeBuildKey));
+    int64_t j, numparticles = 0;
+    #pragma omp parallel for reduction(+: numparticles)
+    for(j = 0; j < act->NumActiveParticle; j++)
+    {
+        /* Pick the next particle from the active list if there is one*/
+        const int i = act->ActiveParticle ? act->ActiveParticle[j] : j;
+        keys[j].index = i;
+        keys[j].topleaf = INT_MAX;
+        /* Do not add types that do not have their mask bit set.*/
+        if(!((1<<P[i].Type) & mask))
+            continue;
+        /* Do not add garbage/swallowed particles to the tree*/
+        if(P[i].IsGarbage || (P[i].Swallowed && P[i].Type==5))
+            continue;
+        if(P[i].Mass <= 0)
+            endrun(12, "Zero mass particle %d m %g type %d id %ld pos %g %g %g\n", i, P[i].Mass, P[i].Type, P[i].ID, P[i].Pos[0], P[i].Pos[1], P[i].Pos[2]);
+        /* Get the topnode to which a particle belongs.*/
+        const int topleaf = P[i].TopLeaf;
+        if(topleaf < StartLeaf || topleaf >= EndLeaf)
+            endrun(5, "Bad topleaf %d start %d end %d type %d ID %ld\n", topleaf, StartLeaf, EndLeaf, P[i].Type, P[i].ID);
+        keys[j].topleaf = topleaf;
+        numparticles++;
+    }
+    /* Particles are mostly in order already, as they are sorted by peano key in the domain*/
+    /* Sort by leaf, then by index: two passes of the stable radix sort, least significant first.*/
+    radix_sort_openmp(keys, act->NumActiveParticle, sizeof(struct TreeBuildKey), offsetof(struct TreeBuildKey, index), sizeof(int));
+    radix_sort_openmp(keys, act->NumActiveParticle, sizeof(struct TreeBuildKey), offsetof(struct TreeBuildKey, topleaf), sizeof(int));
+
+    /* Start of the particles for each local top-level leaf*/
+    int64_t * leafstart = ta_malloc("leafstart", int64_t, EndLeaf - StartLeaf + 1);
+    int64_t k = 0;
+    int leaf;
+    for(leaf = StartLeaf; leaf < EndLeaf; leaf++) {
+        leafstart[leaf - StartLeaf] = k;
+        while(k < numparticles && keys[k].topleaf == leaf)
+            k++;
+    }
+    leafstart[EndLeaf - StartLeaf] = k;
 
+    const int nthr = omp_get_max_threads();
+    struct NodeCache * caches = ta_malloc("NodeCaches", struct NodeCache, nthr);
+    for(j = 0; j < nthr; j++) {
+        caches[j].nnext_thread = 0;
+        caches[j].nrem_thread = 0;
+    }
+    int failed = 0;
+    const ForceTree tb = *tree;
+    struct NodePool pool = {tree->Nodes_base, tree->firstnode, tree->firstnode + tree->nallocnodes, tree->lastnode};
     #pragma omp parallel
+    #pragma omp single
     {
-        int j;
-        /* Local topnodes*/
-        int tid = omp_get_thread_num();
-        const int * const local_topnodes = topnodes + tid * (EndLeaf - StartLeaf);
-
-        /* This implements a small thread-local free Node cache.
-         * The cache ensures that Nodes from the same (or close) particles
-         * are created close to each other on the Node list and thus
-         * helps cache locality. I tried each thread getting a separate
-         * part of the tree, and it wasted too much memory. */
-        struct NodeCache nc;
-        nc.nnext_thread = first_free + tid * NODECACHE_SIZE;
-        nc.nrem_thread = NODECACHE_SIZE;
-
-        /* Stores the last-seen node on this thread.
-         * Since most particles are close to each other, this should save a number of tree walks.*/
-        int this_acc = local_topnodes[0];
-        // message(1, "Topnodes %d real %d\n", local_topnodes[0], topnodes[0]);
-
-        /* The default schedule is static with a chunk 1/4 the total.
-         * However, particles are sorted by type and then by peano order.
-         * Since we need to merge trees, it is advantageous to have all particles
-         * spatially close be processed by the same thread. This means that the threads should
-         * process particles at a constant offset from the start of the type.
-         * We do this with a static schedule. */
-        int chnksz = PartManager->NumPart/nthr;
-        if(SlotsManager->info[0].enabled && SlotsManager->info[0].size > 0)
-            chnksz = SlotsManager->info[0].size/nthr;
-        if(chnksz < 1000)
-            chnksz = 1000;
-        #pragma omp for schedule(static, chnksz) reduction(+: numparticles)
-        for(j = 0; j < act->NumActiveParticle; j++)
-        {
-            /*Can't break from openmp for*/
-            if(nc.nnext_thread >= tree->lastnode)
-                continue;
-
-            /* Pick the next particle from the active list if there is one*/
-            const int i = act->ActiveParticle ? act->ActiveParticle[j] : j;
-
-            /* Do not add types that do not have their mask bit set.*/
-            if(!((1<<P[i].Type) & mask)) {
-                continue;
-            }
-            /* Do not add garbage/swallowed particles to the tree*/
-            if(P[i].IsGarbage || (P[i].Swallowed && P[i].Type==5))
-                continue;
-
-            if(P[i].Mass <= 0)
-                endrun(12, "Zero mass particle %d m %g type %d id %ld pos %g %g %g\n", i, P[i].Mass, P[i].Type, P[i].ID, P[i].Pos[0], P[i].Pos[1], P[i].Pos[2]);
-            /*First find the Node for the TopLeaf */
-            int cur;
-            if(inside_node(&tree->Nodes[this_acc], P[i].Pos)) {
-                cur = this_acc;
-            } else {
-                /* Get the topnode to which a particle belongs. Each local tree
-                 * has a local set of treenodes copying the global topnodes, except tid 0
-                 * which has the real topnodes.*/
-                const int topleaf = P[i].TopLeaf;
-                if(topleaf < StartLeaf || topleaf >= EndLeaf)
-                    endrun(5, "Bad topleaf %d start %d end %d type %d ID %ld\n", topleaf, StartLeaf, EndLeaf, P[i].Type, P[i].ID);
-                //int treenode = ddecomp->TopLeaves[topleaf].treenode;
-                cur = local_topnodes[topleaf - StartLeaf];
-            }
-            numparticles++;
-            this_acc = add_particle_to_tree(i, cur, *tree, &nc, &nnext);
-        }
-        /* The implicit omp-barrier is important here!*/
-/*         double tend = second(); */
-/*         message(0, "Initial insertion: %.3g ms. First node %d\n", (tend - tstart)*1000, local_topnodes[0]); */
-
-        /* Merge each topnode separately, using a for loop.
-         * This wastes threads if NTHREAD > NTOPNODES, but it
-         * means only one merge is done per subtree and
-         * it requires no locking.*/
-        #pragma omp for schedule(static, 1)
-        for(j = 0; j < EndLeaf - StartLeaf; j++) {
-            int t;
-            /* These are the addresses of the real topnodes*/
-            const int target = topnodes[j];
-            if(nc.nnext_thread >= tree->lastnode)
-                continue;
-            for(t = 1; t < nthr; t++) {
-                const int righttop = topnodes[j + t * (EndLeaf - StartLeaf)];
-//                  message(1, "tid = %d i = %d t = %d Merging %d to %d addresses are %lx - %lx end is %lx\n", omp_get_thread_num(), i, t, righttop, target, &tb.Nodes[righttop], &tb.Nodes[target], &tb.Nodes[nnext]);
-                if(merge_partial_force_trees(target, righttop, &nc, &nnext, *tree))
-                    break;
-            }
+        for(leaf = StartLeaf; leaf < EndLeaf; leaf++) {
+            const int treenode = ddecomp->TopLeaves[leaf].treenode;
+            struct TreeBuildKey * const leafkeys = keys + leafstart[leaf - StartLeaf];
+            const int64_t nleaf = leafstart[leaf + 1 - StartLeaf] - leafstart[leaf - StartLeaf];
+            #pragma omp task default(none) firstprivate(treenode, leafkeys, nleaf, tb, caches) shared(pool, nnext, failed)
+            force_tree_build_subtree(treenode, leafkeys, nleaf, 0, tb, caches, &pool, &nnext, &failed);
         }
     }
+    ta_free(caches);
+    ta_free(leafstart);
+    myfree(keys);
+
     tree->NumParticles = numparticles;
+    tree->nallocnodes = pool.capacity - tree->firstnode;
     tree->numnodes = nnext - tree->firstnode;
-    ta_free(topnodes);
+    /* Tell the caller to allocate more nodes*/
+    if(failed)
+        tree->numnodes = tree->lastnode - tree->firstnode;
     return;
 }
 
@@ -898,7 +808,7 @@ void force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, con
                 const struct topnode_data curtopnode = ddecomp->TopNodes[curdaughter + sub];
                 if(curtopnode.Daughter == -1) {
                     int ThisTask;
-                    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+                    MPI_Comm_rank(GadgetComm, &ThisTask);
                     ddecomp->TopLeaves[curtopnode.Leaf].treenode = *nextfree;
                     /* We set the first child as a pointer to the topleaf, essentially constructing the pseudoparticles early.
                      * We do not set nocc, so this first child will be over-written on local nodes when we construct the full tree.*/
@@ -1032,7 +942,8 @@ force_update_node_recursive(const int no, const int sib, const int level, const
          * mess up the pseudo-data exchange.
          * This may happen for a pseudo particle host or, in very rare cases,
          * when one of the local domains is empty. */
-        while(jj < 8 && !tree->Nodes[suns[jj]].f.TopLevel &&
+        /* A refit tree was already compacted, so may have empty trailing slots*/
+        while(jj < 8 && suns[jj] >= 0 && !tree->Nodes[suns[jj]].f.TopLevel &&
             tree->Nodes[suns[jj]].f.ChildType == PARTICLE_NODE_TYPE &&
             tree->Nodes[suns[jj]].s.noccupied == 0) {
                     jj++;
@@ -1100,6 +1011,62 @@ force_update_node_recursive(const int no, const int sib, const int level, const
     return -1;
 }
 
+/* Remove particles not flagged in keep from the leaves below node no, and re-add the moments
+ * of the remaining particles. The moments of internal nodes are zeroed, ready for force_update_node_recursive.
+ * Internal nodes which are now empty become empty particle nodes, which force_update_node_recursive removes.
+ * Returns the number of particles remaining below this node.*/
+static int64_t
+force_refit_node_recursive(const int no, const unsigned char * const keep, const int level, const ForceTree * const tree)
+{
+    struct NODE * node = &tree->Nodes[no];
+    memset(&node->mom, 0, sizeof(node->mom));
+    int j;
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        int nkeep = 0;
+        for(j = 0; j < node->s.noccupied; j++) {
+            const int p = node->s.suns[j];
+            if(!keep[p])
+                continue;
+            node->s.suns[nkeep++] = p;
+            add_particle_moment_to_node(node, &P[p]);
+        }
+        node->s.noccupied = nkeep;
+        return nkeep;
+    }
+#ifdef DEBUG
+    if(node->f.ChildType != NODE_NODE_TYPE)
+        endrun(3, "force_refit_node_recursive called on node %d of type %d != %d!\n", no, node->f.ChildType, NODE_NODE_TYPE);
+#endif
+    int64_t nchild[8] = {0};
+    for(j = 0; j < 8; j++) {
+        const int p = node->s.suns[j];
+        if(p < 0)
+            continue;
+        if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE && level < 512) {
+            const int newlevel = level * 8;
+            #pragma omp task default(none) firstprivate(p, j, newlevel, keep, tree) shared(nchild)
+            nchild[j] = force_refit_node_recursive(p, keep, newlevel, tree);
+        }
+        else
+            nchild[j] = force_refit_node_recursive(p, keep, level, tree);
+    }
+    #pragma omp taskwait
+
+    int64_t nkeep = 0;
+    for(j = 0; j < 8; j++)
+        nkeep += nchild[j];
+    /* Turn empty internal nodes into empty leaves, so the walk never finds a node without children.
+     * This may also happen to a local top-level leaf, which is then an empty top-level leaf
+     * as for an empty domain. These are never removed from the tree.*/
+    if(nkeep == 0 && !node->f.InternalTopLevel) {
+        node->f.ChildType = PARTICLE_NODE_TYPE;
+        node->s.noccupied = 0;
+        for(j = 0; j < NMAXCHILD; j++)
+            node->s.suns[j] = -1;
+    }
+    return nkeep;
+}
+
 /*! This routine determines the multipole moments for a given internal node
  *  and all its subnodes in parallel, assigning the recursive algorithm to different threads using openmp's task api.
  *  The result is stored in tb.Nodes in the sequence of this tree-walk.
@@ -1116,7 +1083,7 @@ force_update_node_recursive(const int no, const int sib, const int level, const
 void force_update_node_parallel(const ForceTree * const tree, const DomainDecomp * const ddecomp)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
 
 #pragma omp parallel
 #pragma omp single nowait
@@ -1139,56 +1106,68 @@ void force_update_node_parallel(const ForceTree * const tree, const DomainDecomp
     }
 }
 
-struct topleaf_momentsdata
-{
-    MyFloat s[3];
-    MyFloat mass;
-    MyFloat hmax;
-};
-
 /*! This function communicates the values of the multipole moments of the
  *  top-level tree-nodes of the ddecomp grid.  This data can then be used to
  *  update the pseudo-particles on each CPU accordingly.
+ *  The moments sent at the last exchange are cached in the domain, so only the tasks whose
+ *  top leaf moments have changed since then (because the tree has different particles,
+ *  or the particles have moved) send them again.
  */
-static void force_exchange_pseudodata(const ForceTree * const tree, const DomainDecomp * const ddecomp)
+static void force_exchange_pseudodata(const ForceTree * const tree, DomainDecomp * const ddecomp)
 {
     int i;
+    int NTask;
+    MPI_Comm_size(GadgetComm, &NTask);
 
-    struct topleaf_momentsdata * TopLeafMoments = (struct topleaf_momentsdata *) mymalloc("TopLeafMoments", ddecomp->NTopLeaves * sizeof(TopLeafMoments[0]));
+    struct topleaf_momentsdata * TopLeafMoments = ddecomp->TopLeafMoments;
+    if(!TopLeafMoments)
+        TopLeafMoments = (struct topleaf_momentsdata *) mymalloc("TopLeafMoments", ddecomp->NTopLeaves * sizeof(TopLeafMoments[0]));
 
-    #pragma omp parallel for
+    int changed = !ddecomp->TopLeafMoments || !ddecomp->TopLeafMomentsValid;
+    #pragma omp parallel for reduction(|: changed)
     for(i = ddecomp->Tasks[tree->ThisTask].StartLeaf; i < ddecomp->Tasks[tree->ThisTask].EndLeaf; i ++) {
         int no = ddecomp->TopLeaves[i].treenode;
         if(ddecomp->TopLeaves[i].Task != tree->ThisTask)
             endrun(131231231, "TopLeaf %d Task table is corrupted: task is %d\n", i, ddecomp->TopLeaves[i].Task);
         /* read out the multipole moments from the local base cells */
-        TopLeafMoments[i].s[0] = tree->Nodes[no].mom.cofm[0];
-        TopLeafMoments[i].s[1] = tree->Nodes[no].mom.cofm[1];
-        TopLeafMoments[i].s[2] = tree->Nodes[no].mom.cofm[2];
-        TopLeafMoments[i].mass = tree->Nodes[no].mom.mass;
-        TopLeafMoments[i].hmax = tree->Nodes[no].mom.hmax;
+        struct topleaf_momentsdata mom;
+        mom.s[0] = tree->Nodes[no].mom.cofm[0];
+        mom.s[1] = tree->Nodes[no].mom.cofm[1];
+        mom.s[2] = tree->Nodes[no].mom.cofm[2];
+        mom.mass = tree->Nodes[no].mom.mass;
+        mom.hmax = tree->Nodes[no].mom.hmax;
+        if(memcmp(&mom, &TopLeafMoments[i], sizeof(mom)))
+            changed = 1;
+        TopLeafMoments[i] = mom;
     }
 
-    /* share the pseudo-particle data across CPUs */
-    int NTask;
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    /* Find which tasks need to send their moments*/
+    int * taskchanged = (int *) mymalloc("taskchanged", sizeof(int) * NTask);
+    MPI_Allgather(&changed, 1, MPI_INT, taskchanged, 1, MPI_INT, GadgetComm);
 
     int * recvcounts = (int *) mymalloc("recvcounts", sizeof(int) * NTask);
     int * recvoffset = (int *) mymalloc("recvoffset", sizeof(int) * NTask);
-    int recvTask;
+    int recvTask, nchanged = 0;
 
     for(recvTask = 0; recvTask < NTask; recvTask++)
     {
         recvoffset[recvTask] = ddecomp->Tasks[recvTask].StartLeaf * sizeof(TopLeafMoments[0]);
-        recvcounts[recvTask] = (ddecomp->Tasks[recvTask].EndLeaf - ddecomp->Tasks[recvTask].StartLeaf) * sizeof(TopLeafMoments[0]);
+        recvcounts[recvTask] = 0;
+        if(taskchanged[recvTask])
+            recvcounts[recvTask] = (ddecomp->Tasks[recvTask].EndLeaf - ddecomp->Tasks[recvTask].StartLeaf) * sizeof(TopLeafMoments[0]);
+        nchanged += taskchanged[recvTask];
     }
 
-    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL,
+    /* share the pseudo-particle data across CPUs */
+    if(nchanged > 0)
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL,
             &TopLeafMoments[0], recvcounts, recvoffset,
-            MPI_BYTE, MPI_COMM_WORLD);
+            MPI_BYTE, GadgetComm);
 
     myfree(recvoffset);
     myfree(recvcounts);
+    myfree(taskchanged);
+    ddecomp->TopLeafMomentsValid = 1;
 
     int ta;
     #pragma omp parallel for
@@ -1205,7 +1184,8 @@ static void force_exchange_pseudodata(const ForceTree * const tree, const Domain
             tree->Nodes[no].mom.hmax = TopLeafMoments[i].hmax;
          }
     }
-    myfree(TopLeafMoments);
+    if(!ddecomp->TopLeafMoments)
+        myfree(TopLeafMoments);
 }
 
 
@@ -1284,13 +1264,14 @@ force_treeupdate_pseudos(const int no, const int level, const ForceTree * const
     }
 }
 
-/* Update the hmax in the parent node of the particle p_i*/
+/* Update the hmax in the parent node of the particle p_i, and in the nodes above it up to the local top-level leaf.
+ * Every node already has at least the hmax of its children, so we stop at the first node which is not raised.*/
 void
 update_tree_hmax_father(const ForceTree * const tree, const int p_i, const double Pos[3], const double Hsml)
 {
     if(!tree->Father)
         endrun(4, "Father not allocated in tree_hmax_father\n");
-    const int no = tree->Father[p_i];
+    int no = tree->Father[p_i];
 #ifdef DEBUG
     if(no < 0)
         endrun(5, "Father for particle %d pos %g %g %g hsml %g not initialised, likely not in tree\n", p_i, Pos[0], Pos[1], Pos[2], Hsml);
@@ -1304,15 +1285,162 @@ update_tree_hmax_father(const ForceTree * const tree, const int p_i, const doubl
     for(j = 0; j < 3; j++)
         newhmax = DMAX(newhmax, fabs(Pos[j] - node->center[j]) + Hsml - node->len/2.);
 
-    MyFloat readhmax;
-    #pragma omp atomic read
-    readhmax = node->mom.hmax;
+    if(tree->TopLeafExtent) {
+        MyFloat * hsmlmax = &tree->TopLeafExtent[P[p_i].TopLeaf].hsmlmax;
+        MyFloat newhsml = Hsml, readhsml;
+        #pragma omp atomic read
+        readhsml = *hsmlmax;
+        do {
+            if(newhsml <= readhsml)
+                break;
+        } while(!__atomic_compare_exchange(hsmlmax, &readhsml, &newhsml, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
 
-    do {
-        if (newhmax <= readhmax)
-            break;
-        /* Swap in the new hmax only if the old one hasn't changed. */
-    } while(!__atomic_compare_exchange(&(node->mom.hmax), &readhmax, &newhmax, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    while(1) {
+        MyFloat readhmax;
+        #pragma omp atomic read
+        readhmax = node->mom.hmax;
+
+        do {
+            if (newhmax <= readhmax)
+                return;
+            /* Swap in the new hmax only if the old one hasn't changed. */
+        } while(!__atomic_compare_exchange(&(node->mom.hmax), &readhmax, &newhmax, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        /* The top-level nodes are updated by force_tree_exchange_hmax*/
+        if(node->f.TopLevel || node->father < 0)
+            return;
+        node = &tree->Nodes[node->father];
+    }
+}
+
+/* Set the hmax of the internal top-level node no from its 8 children.*/
+static void
+force_hmax_update_pseudos(const int no, const ForceTree * const tree)
+{
+    struct NODE * node = &tree->Nodes[no];
+    if(!node->f.InternalTopLevel)
+        return;
+    int j;
+    node->mom.hmax = 0;
+    for(j = 0; j < 8; j++) {
+        force_hmax_update_pseudos(node->s.suns[j], tree);
+        if(tree->Nodes[node->s.suns[j]].mom.hmax > node->mom.hmax)
+            node->mom.hmax = tree->Nodes[node->s.suns[j]].mom.hmax;
+    }
+}
+
+/* Send the hmax of the local top-level leaves to the other ranks and recompute the hmax of the
+ * internal top-level nodes. The local nodes must already be up to date: the tree build
+ * propagates the hmax of the inactive particles and update_tree_hmax_father that of the active particles.
+ * Unlike force_tree_calc_moments, this touches no particles and exchanges only hmax. Collective.*/
+void
+force_tree_exchange_hmax(ForceTree * tree, const DomainDecomp * const ddecomp)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+
+    MyFloat * hmax = (MyFloat *) mymalloc("TopLeafHmax", ddecomp->NTopLeaves * sizeof(MyFloat));
+    int * recvcounts = (int *) mymalloc("recvcounts", sizeof(int) * NTask);
+    int * recvoffset = (int *) mymalloc("recvoffset", sizeof(int) * NTask);
+
+    int i;
+    for(i = ddecomp->Tasks[ThisTask].StartLeaf; i < ddecomp->Tasks[ThisTask].EndLeaf; i ++)
+        hmax[i] = tree->Nodes[ddecomp->TopLeaves[i].treenode].mom.hmax;
+
+    int ta;
+    for(ta = 0; ta < NTask; ta++) {
+        recvoffset[ta] = ddecomp->Tasks[ta].StartLeaf * sizeof(MyFloat);
+        recvcounts[ta] = (ddecomp->Tasks[ta].EndLeaf - ddecomp->Tasks[ta].StartLeaf) * sizeof(MyFloat);
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, hmax, recvcounts, recvoffset, MPI_BYTE, GadgetComm);
+
+    for(ta = 0; ta < NTask; ta++) {
+        if(ta == ThisTask)
+            continue;
+        for(i = ddecomp->Tasks[ta].StartLeaf; i < ddecomp->Tasks[ta].EndLeaf; i ++)
+            tree->Nodes[ddecomp->TopLeaves[i].treenode].mom.hmax = hmax[i];
+    }
+    myfree(recvoffset);
+    myfree(recvcounts);
+    myfree(hmax);
+
+    force_hmax_update_pseudos(tree->firstnode, tree);
+    tree->hmax_computed_flag = 1;
+
+    if(tree->TopLeafExtent)
+        force_exchange_topleaf_extent(tree, ddecomp);
+}
+
+/* Send the extents of the local top-level leaves to the other ranks. Collective.*/
+static void
+force_exchange_topleaf_extent(ForceTree * tree, const DomainDecomp * const ddecomp)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+
+    int * recvcounts = (int *) mymalloc("recvcounts", sizeof(int) * NTask);
+    int * recvoffset = (int *) mymalloc("recvoffset", sizeof(int) * NTask);
+    int ta;
+    for(ta = 0; ta < NTask; ta++) {
+        recvoffset[ta] = ddecomp->Tasks[ta].StartLeaf * sizeof(struct TopLeafExtent);
+        recvcounts[ta] = (ddecomp->Tasks[ta].EndLeaf - ddecomp->Tasks[ta].StartLeaf) * sizeof(struct TopLeafExtent);
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, tree->TopLeafExtent, recvcounts, recvoffset, MPI_BYTE, GadgetComm);
+    myfree(recvoffset);
+    myfree(recvcounts);
+    tree->extent_computed_flag = 1;
+}
+
+/* Add the particles below node no to the extent of their top leaf*/
+static void
+force_topleaf_extent_recursive(const int no, const ForceTree * const tree, struct TopLeafExtent * ext)
+{
+    const struct NODE * node = &tree->Nodes[no];
+    int j, d;
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < node->s.noccupied; j++) {
+            const struct particle_data * part = &P[node->s.suns[j]];
+            for(d = 0; d < 3; d++) {
+                ext->min[d] = DMIN(ext->min[d], part->Pos[d]);
+                ext->max[d] = DMAX(ext->max[d], part->Pos[d]);
+            }
+            /* As for hmax, active particles are added when their hsml is updated in density.*/
+            if((part->Type == 0 || part->Type == 5) && !is_timebin_active(part->TimeBinHydro, part->Ti_drift))
+                ext->hsmlmax = DMAX(ext->hsmlmax, part->Hsml);
+        }
+        return;
+    }
+    if(node->f.ChildType != NODE_NODE_TYPE)
+        return;
+    for(j = 0; j < NMAXCHILD; j++)
+        if(node->s.suns[j] >= 0)
+            force_topleaf_extent_recursive(node->s.suns[j], tree, ext);
+}
+
+void
+force_tree_alloc_topleaf_extent(ForceTree * tree)
+{
+    if(!force_tree_allocated(tree) || !tree->Father || tree->TopLeafExtent)
+        return;
+    tree->TopLeafExtent = (struct TopLeafExtent *) mymalloc("TopLeafExtent", tree->NTopLeaves * sizeof(struct TopLeafExtent));
+    tree->extent_computed_flag = 0;
+    int i;
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < tree->NTopLeaves; i++) {
+        struct TopLeafExtent * ext = &tree->TopLeafExtent[i];
+        int d;
+        /* Empty leaves have min > max*/
+        for(d = 0; d < 3; d++) {
+            ext->min[d] = tree->BoxSize;
+            ext->max[d] = -tree->BoxSize;
+        }
+        ext->hsmlmax = 0;
+        if(tree->TopLeaves[i].Task == tree->ThisTask)
+            force_topleaf_extent_recursive(tree->TopLeaves[i].treenode, tree, ext);
+    }
 }
 
 /*! This function updates the hmax-values in tree nodes that hold SPH
@@ -1359,7 +1487,7 @@ void force_update_hmax(ActiveParticles * act, ForceTree * tree, DomainDecomp * d
 
     walltime_measure("/SPH/HmaxUpdate");
     int64_t totnumparticles;
-    MPI_Reduce(&tree->NumParticles, &totnumparticles, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&tree->NumParticles, &totnumparticles, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
     message(0, "Root hmax: %lg Tree Mean IPS: %lg\n", tree->Nodes[tree->firstnode].mom.hmax, tree->BoxSize / cbrt(totnumparticles));
 }
 
@@ -1391,6 +1519,7 @@ ForceTree force_treeallocate(const int64_t maxnodes, const int64_t maxpart, cons
     if(tb.lastnode >= (1L<<30) + (1L<<29))
         endrun(5, "Size of tree overflowed for maxpart = %ld, maxnodes = %ld!\n", maxpart, maxnodes);
     tb.numnodes = 0;
+    tb.nallocnodes = maxnodes;
     tb.Nodes = tb.Nodes_base - tb.firstnode;
     tb.tree_allocated_flag = 1;
     tb.NTopLeaves = ddecomp->NTopLeaves;
@@ -1398,6 +1527,548 @@ ForceTree force_treeallocate(const int64_t maxnodes, const int64_t maxpart, cons
     return tb;
 }
 
+void
+force_tree_alloc_export_plan(ForceTree * tree)
+{
+    if(!force_tree_allocated(tree) || tree->ExportPlan)
+        return;
+    /* Indexed by particle, like Father, so that queries from particles not in the tree can also use it*/
+    tree->ExportPlan = (MyFloat *) mymalloc("ExportPlan", tree->firstnode * sizeof(MyFloat));
+    memset(tree->ExportPlan, 0, tree->firstnode * sizeof(MyFloat));
+}
+
+void
+force_tree_alloc_ngb_cache(ForceTree * tree, const double skin, const double listsize)
+{
+    if(!force_tree_allocated(tree) || tree->NgbCache)
+        return;
+    struct NgbCache * cache = (struct NgbCache *) mymalloc("NgbCache", sizeof(struct NgbCache));
+    /* Indexed by particle, like the export plan*/
+    cache->Entries = (struct NgbCacheEntry *) mymalloc("NgbCacheEntries", tree->firstnode * sizeof(struct NgbCacheEntry));
+    cache->Size = DMAX(listsize * tree->NumParticles, 1);
+    cache->List = (int *) mymalloc("NgbCacheList", cache->Size * sizeof(int));
+    cache->Skin = skin;
+    tree->NgbCache = cache;
+    force_tree_invalidate_ngb_cache(tree);
+}
+
+void
+force_tree_invalidate_ngb_cache(ForceTree * tree)
+{
+    struct NgbCache * cache = tree->NgbCache;
+    if(!cache)
+        return;
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < tree->firstnode; i++)
+        cache->Entries[i].Count = -1;
+    cache->Used = 0;
+}
+
+void
+force_tree_free_ngb_cache(ForceTree * tree)
+{
+    struct NgbCache * cache = tree->NgbCache;
+    if(!cache)
+        return;
+    myfree(cache->List);
+    myfree(cache->Entries);
+    myfree(cache);
+    tree->NgbCache = NULL;
+}
+
+void
+force_tree_alloc_interaction_lists(ForceTree * tree, const double listsize)
+{
+    if(!force_tree_allocated(tree) || tree->InteractionLists)
+        return;
+    struct InteractionLists * lists = (struct InteractionLists *) mymalloc("InteractionLists", sizeof(struct InteractionLists));
+    lists->Size = DMAX(listsize * tree->NumParticles, 1);
+    int i;
+    for(i = 0; i < 2; i++) {
+        /* Indexed by particle, like the export plan*/
+        lists->Start[i] = (int64_t *) mymalloc("InteractionListStart", tree->firstnode * sizeof(int64_t));
+        lists->Count[i] = (int *) mymalloc("InteractionListCount", tree->firstnode * sizeof(int));
+        lists->List[i] = (int *) mymalloc("InteractionList", lists->Size * sizeof(int));
+        memset(lists->Count[i], -1, tree->firstnode * sizeof(int));
+        lists->Used[i] = 0;
+    }
+    lists->Read = 0;
+    tree->InteractionLists = lists;
+}
+
+void
+force_tree_swap_interaction_lists(ForceTree * tree)
+{
+    struct InteractionLists * lists = tree->InteractionLists;
+    if(!lists)
+        return;
+    const int write = lists->Read;
+    lists->Read = 1 - lists->Read;
+    memset(lists->Count[write], -1, tree->firstnode * sizeof(int));
+    lists->Used[write] = 0;
+}
+
+void
+force_tree_free_interaction_lists(ForceTree * tree)
+{
+    struct InteractionLists * lists = tree->InteractionLists;
+    if(!lists)
+        return;
+    int i;
+    for(i = 1; i >= 0; i--) {
+        myfree(lists->List[i]);
+        myfree(lists->Count[i]);
+        myfree(lists->Start[i]);
+    }
+    myfree(lists);
+    tree->InteractionLists = NULL;
+}
+
+void
+force_tree_free_export_plan(ForceTree * tree)
+{
+    if(tree->ExportPlan)
+        myfree(tree->ExportPlan);
+    tree->ExportPlan = NULL;
+}
+
+void
+force_tree_make_int_positions(ForceTree * tree)
+{
+    if(!force_tree_allocated(tree) || tree->IntPos)
+        return;
+    tree->IntPos = (MyIntPosType (*)[3]) mymalloc("IntPos", tree->firstnode * sizeof(tree->IntPos[0]));
+    tree->IntPosFac = intpos_fac(tree->BoxSize);
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int d;
+        for(d = 0; d < 3; d++)
+            tree->IntPos[i][d] = pos_to_intpos(P[i].Pos[d], tree->BoxSize);
+    }
+}
+
+void
+force_tree_free_int_positions(ForceTree * tree)
+{
+    if(tree->IntPos)
+        myfree(tree->IntPos);
+    tree->IntPos = NULL;
+}
+
+void
+force_tree_make_walk_nodes(ForceTree * tree)
+{
+    if(!force_tree_allocated(tree) || !tree->moments_computed_flag)
+        endrun(5, "Tried to make walk nodes for a tree without moments\n");
+    if(tree->WalkNodes)
+        return;
+    tree->WalkIndex = (int *) mymalloc("WalkIndex", tree->numnodes * sizeof(int));
+    memset(tree->WalkIndex, -1, tree->numnodes * sizeof(int));
+    /* Number the nodes in the order of the walk, which is depth-first.*/
+    int64_t nwalk = 0, nparticles = 0;
+    int no = tree->firstnode;
+    while(no >= 0) {
+        const struct NODE * nop = &tree->Nodes[no];
+        tree->WalkIndex[no - tree->firstnode] = nwalk++;
+        if(nop->f.ChildType == NODE_NODE_TYPE)
+            no = nop->s.suns[0];
+        else {
+            if(nop->f.ChildType == PARTICLE_NODE_TYPE)
+                nparticles += nop->s.noccupied;
+            no = nop->sibling;
+        }
+    }
+    tree->NumWalkNodes = nwalk;
+    tree->WalkNodes = (struct WalkNode *) mymalloc("WalkNodes", nwalk * sizeof(struct WalkNode));
+    tree->WalkParticles = (int *) mymalloc("WalkParticles", DMAX(nparticles, 1) * sizeof(int));
+    if(tree->Quadrupoles)
+        tree->WalkQuadrupoles = (float (*)[6]) mymalloc("WalkQuadrupoles", nwalk * sizeof(tree->WalkQuadrupoles[0]));
+
+    /* Copy the nodes, walking again so the particles are also in walk order.*/
+    int64_t first = 0;
+    no = tree->firstnode;
+    while(no >= 0) {
+        const struct NODE * nop = &tree->Nodes[no];
+        struct WalkNode * wnode = &tree->WalkNodes[tree->WalkIndex[no - tree->firstnode]];
+        int j;
+        for(j = 0; j < 3; j++) {
+            wnode->center[j] = nop->center[j];
+            wnode->cofm[j] = nop->mom.cofm[j] - nop->center[j];
+        }
+        wnode->len = nop->len;
+        wnode->mass = nop->mom.mass;
+        wnode->sibling = nop->sibling >= 0 ? tree->WalkIndex[nop->sibling - tree->firstnode] : -1;
+        wnode->ChildType = nop->f.ChildType;
+        wnode->TopLevel = nop->f.TopLevel;
+        wnode->unused = 0;
+        wnode->noccupied = 0;
+        wnode->first = 0;
+        if(tree->WalkQuadrupoles)
+            for(j = 0; j < 6; j++)
+                tree->WalkQuadrupoles[tree->WalkIndex[no - tree->firstnode]][j] = tree->Quadrupoles[no - tree->firstnode].q[j];
+        if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+            wnode->noccupied = nop->s.noccupied;
+            wnode->first = first;
+            for(j = 0; j < nop->s.noccupied; j++)
+                tree->WalkParticles[first++] = nop->s.suns[j];
+        }
+        if(nop->f.ChildType == NODE_NODE_TYPE)
+            no = nop->s.suns[0];
+        else
+            no = nop->sibling;
+    }
+    walltime_measure("/Tree/WalkNodes");
+}
+
+void
+force_tree_free_walk_nodes(ForceTree * tree)
+{
+    if(!tree->WalkNodes)
+        return;
+    if(tree->WalkQuadrupoles)
+        myfree(tree->WalkQuadrupoles);
+    tree->WalkQuadrupoles = NULL;
+    myfree(tree->WalkParticles);
+    myfree(tree->WalkNodes);
+    myfree(tree->WalkIndex);
+    tree->WalkParticles = NULL;
+    tree->WalkNodes = NULL;
+    tree->WalkIndex = NULL;
+    tree->NumWalkNodes = 0;
+}
+
+/* Type bits a particle sets in the nodes containing it. Gas may become stars or black holes
+ * (by star formation or black hole seeding) while the tree is still in use, so it also sets those.*/
+static int
+force_type_bits(const int type)
+{
+    if(type == 0)
+        return GASMASK | STARMASK | BHMASK;
+    return 1 << type;
+}
+
+/* Compute the type mask of node no from its children, which are done first.
+ * Also raise the hmax of internal nodes to that of their children. At this point the leaves
+ * hold the hmax of the inactive particles, so this makes hmax consistent up to the local top-level leaves,
+ * and the active particles need only be propagated up from their leaves by update_tree_hmax_father.*/
+static void
+force_type_mask_recursive(const int no, const int level, const ForceTree * const tree)
+{
+    struct NODE * node = &tree->Nodes[no];
+    int j, mask = 0;
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < node->s.noccupied; j++)
+            mask |= force_type_bits(P[node->s.suns[j]].Type);
+        node->f.TypeMask = mask;
+        return;
+    }
+    if(node->f.ChildType != NODE_NODE_TYPE)
+        return;
+    for(j = 0; j < NMAXCHILD; j++) {
+        const int p = node->s.suns[j];
+        if(p < 0)
+            continue;
+        if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE && level < 512) {
+            const int newlevel = level * 8;
+            #pragma omp task default(none) firstprivate(p, newlevel, tree)
+            force_type_mask_recursive(p, newlevel, tree);
+        }
+        else
+            force_type_mask_recursive(p, level, tree);
+    }
+    #pragma omp taskwait
+    for(j = 0; j < NMAXCHILD; j++) {
+        const int p = node->s.suns[j];
+        if(p < 0)
+            continue;
+        mask |= tree->Nodes[p].f.TypeMask;
+        if(tree->Nodes[p].mom.hmax > node->mom.hmax)
+            node->mom.hmax = tree->Nodes[p].mom.hmax;
+    }
+    node->f.TypeMask = mask;
+}
+
+/* Set the type mask of the top-level node no from its 8 children.*/
+static void
+force_type_mask_update_pseudos(const int no, const ForceTree * const tree)
+{
+    struct NODE * node = &tree->Nodes[no];
+    if(!node->f.InternalTopLevel)
+        return;
+    int j, mask = 0;
+    for(j = 0; j < 8; j++) {
+        force_type_mask_update_pseudos(node->s.suns[j], tree);
+        mask |= tree->Nodes[node->s.suns[j]].f.TypeMask;
+    }
+    node->f.TypeMask = mask;
+}
+
+/* Compute the type masks of all nodes, so that neighbour walks can skip nodes containing none of the types they want.
+ * Pseudo particles get the tree mask, as we do not know what they contain.
+ * Done for every tree after it is built: it needs no moments.*/
+static void
+force_tree_calc_type_masks(ForceTree * tree)
+{
+    int i;
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task != tree->ThisTask)
+            tree->Nodes[tree->TopLeaves[i].treenode].f.TypeMask = tree->mask;
+
+    #pragma omp parallel
+    #pragma omp single nowait
+    {
+        for(i = 0; i < tree->NTopLeaves; i++) {
+            if(tree->TopLeaves[i].Task != tree->ThisTask)
+                continue;
+            const int no = tree->TopLeaves[i].treenode;
+            #pragma omp task default(none) firstprivate(no, tree)
+            force_type_mask_recursive(no, 1, tree);
+        }
+    }
+
+    force_type_mask_update_pseudos(tree->firstnode, tree);
+}
+
+/* Add the quadrupole of a mass at offset dx from the center of mass, plus the quadrupole of its contents if childq is not NULL.*/
+static void
+add_quadrupole_moment(MyFloat * q, const double mass, const double dx[3], const MyFloat * childq)
+{
+    const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+    q[0] += mass * (3 * dx[0] * dx[0] - r2);
+    q[1] += mass * 3 * dx[0] * dx[1];
+    q[2] += mass * 3 * dx[0] * dx[2];
+    q[3] += mass * (3 * dx[1] * dx[1] - r2);
+    q[4] += mass * 3 * dx[1] * dx[2];
+    q[5] += mass * (3 * dx[2] * dx[2] - r2);
+    if(childq) {
+        int k;
+        for(k = 0; k < 6; k++)
+            q[k] += childq[k];
+    }
+}
+
+/* Compute the quadrupole of node no from its children, which are done first.
+ * Requires the centers of mass to have been computed.*/
+static void
+force_quadrupole_recursive(const int no, const int level, const ForceTree * const tree)
+{
+    const struct NODE * node = &tree->Nodes[no];
+    MyFloat * q = tree->Quadrupoles[no - tree->firstnode].q;
+    memset(q, 0, 6 * sizeof(MyFloat));
+    int j, k;
+    double dx[3];
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < node->s.noccupied; j++) {
+            const int p = node->s.suns[j];
+            for(k = 0; k < 3; k++)
+                dx[k] = P[p].Pos[k] - node->mom.cofm[k];
+            add_quadrupole_moment(q, P[p].Mass, dx, NULL);
+        }
+        return;
+    }
+    if(node->f.ChildType != NODE_NODE_TYPE)
+        return;
+    for(j = 0; j < NMAXCHILD; j++) {
+        const int p = node->s.suns[j];
+        if(p < 0)
+            continue;
+        if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE && level < 512) {
+            const int newlevel = level * 8;
+            #pragma omp task default(none) firstprivate(p, newlevel, tree)
+            force_quadrupole_recursive(p, newlevel, tree);
+        }
+        else
+            force_quadrupole_recursive(p, level, tree);
+    }
+    #pragma omp taskwait
+    for(j = 0; j < NMAXCHILD; j++) {
+        const int p = node->s.suns[j];
+        if(p < 0)
+            continue;
+        for(k = 0; k < 3; k++)
+            dx[k] = tree->Nodes[p].mom.cofm[k] - node->mom.cofm[k];
+        add_quadrupole_moment(q, tree->Nodes[p].mom.mass, dx, tree->Quadrupoles[p - tree->firstnode].q);
+    }
+}
+
+/* Compute the quadrupole of the top-level node no from its 8 children, after the pseudo particles are exchanged.*/
+static void
+force_quadrupole_update_pseudos(const int no, const int level, const ForceTree * const tree)
+{
+    if(!tree->Nodes[no].f.InternalTopLevel)
+        return;
+    const struct NODE * node = &tree->Nodes[no];
+    int j, k;
+    for(j = 0; j < 8; j++) {
+        const int p = node->s.suns[j];
+        if(tree->Nodes[p].f.InternalTopLevel) {
+            if(level < 512) {
+                #pragma omp task default(none) firstprivate(p, level, tree)
+                force_quadrupole_update_pseudos(p, level*8, tree);
+            }
+            else
+                force_quadrupole_update_pseudos(p, level, tree);
+        }
+    }
+    #pragma omp taskwait
+    MyFloat * q = tree->Quadrupoles[no - tree->firstnode].q;
+    memset(q, 0, 6 * sizeof(MyFloat));
+    for(j = 0; j < 8; j++) {
+        const int p = node->s.suns[j];
+        double dx[3];
+        for(k = 0; k < 3; k++)
+            dx[k] = tree->Nodes[p].mom.cofm[k] - node->mom.cofm[k];
+        add_quadrupole_moment(q, tree->Nodes[p].mom.mass, dx, tree->Quadrupoles[p - tree->firstnode].q);
+    }
+}
+
+void
+force_tree_calc_quadrupoles(ForceTree * tree)
+{
+    if(!force_tree_allocated(tree) || !tree->moments_computed_flag)
+        endrun(5, "Tried to compute quadrupoles for a tree without moments\n");
+    if(tree->WalkNodes)
+        endrun(5, "Quadrupoles must be computed before the walk nodes are made\n");
+    if(!tree->Quadrupoles)
+        tree->Quadrupoles = (struct NodeQuadrupole *) mymalloc("Quadrupoles", tree->numnodes * sizeof(struct NodeQuadrupole));
+
+    int NTask, i;
+    MPI_Comm_size(GadgetComm, &NTask);
+    /* The top leaves of each task are contiguous*/
+    int * recvcounts = (int *) mymalloc("recvcounts", sizeof(int) * NTask);
+    int * recvoffset = (int *) mymalloc("recvoffset", sizeof(int) * NTask);
+    memset(recvcounts, 0, sizeof(int) * NTask);
+    for(i = tree->NTopLeaves - 1; i >= 0; i--) {
+        const int task = tree->TopLeaves[i].Task;
+        recvcounts[task] += sizeof(struct NodeQuadrupole);
+        recvoffset[task] = i * sizeof(struct NodeQuadrupole);
+    }
+
+    /* The subtrees of the local top leaves*/
+    #pragma omp parallel
+    #pragma omp single nowait
+    {
+        for(i = 0; i < tree->NTopLeaves; i++) {
+            if(tree->TopLeaves[i].Task != tree->ThisTask)
+                continue;
+            const int no = tree->TopLeaves[i].treenode;
+            #pragma omp task default(none) firstprivate(no, tree)
+            force_quadrupole_recursive(no, 1, tree);
+        }
+    }
+
+    /* Exchange the quadrupoles of the pseudo particles*/
+    struct NodeQuadrupole * TopLeafQuadrupoles = (struct NodeQuadrupole *) mymalloc("TopLeafQuadrupoles", tree->NTopLeaves * sizeof(struct NodeQuadrupole));
+    #pragma omp parallel for
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task == tree->ThisTask)
+            TopLeafQuadrupoles[i] = tree->Quadrupoles[tree->TopLeaves[i].treenode - tree->firstnode];
+
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL,
+            TopLeafQuadrupoles, recvcounts, recvoffset,
+            MPI_BYTE, GadgetComm);
+
+    #pragma omp parallel for
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task != tree->ThisTask)
+            tree->Quadrupoles[tree->TopLeaves[i].treenode - tree->firstnode] = TopLeafQuadrupoles[i];
+    myfree(TopLeafQuadrupoles);
+    myfree(recvoffset);
+    myfree(recvcounts);
+
+    #pragma omp parallel
+    #pragma omp single nowait
+    {
+        force_quadrupole_update_pseudos(tree->firstnode, 1, tree);
+    }
+    walltime_measure("/Tree/Quadrupoles");
+}
+
+void
+force_tree_free_quadrupoles(ForceTree * tree)
+{
+    if(!tree->Quadrupoles)
+        return;
+    myfree(tree->Quadrupoles);
+    tree->Quadrupoles = NULL;
+}
+
+/* Compute the smallest old acceleration below node no, with the children done first.*/
+static MyFloat
+force_min_accel_recursive(const int no, const int level, const ForceTree * const tree)
+{
+    const struct NODE * node = &tree->Nodes[no];
+    double minacc = DBL_MAX;
+    int j, k;
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < node->s.noccupied; j++) {
+            const int p = node->s.suns[j];
+            double acc2 = 0;
+            for(k = 0; k < 3; k++) {
+                const double ax = P[p].FullTreeGravAccel[k] + P[p].GravPM[k];
+                acc2 += ax * ax;
+            }
+            minacc = DMIN(minacc, sqrt(acc2));
+        }
+    }
+    else if(node->f.ChildType == NODE_NODE_TYPE) {
+        double childacc[NMAXCHILD];
+        for(j = 0; j < NMAXCHILD; j++) {
+            const int p = node->s.suns[j];
+            if(p < 0)
+                continue;
+            if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE && level < 512) {
+                const int newlevel = level * 8;
+                #pragma omp task default(none) firstprivate(p, j, newlevel, tree) shared(childacc)
+                childacc[j] = force_min_accel_recursive(p, newlevel, tree);
+            }
+            else
+                childacc[j] = force_min_accel_recursive(p, level, tree);
+        }
+        #pragma omp taskwait
+        for(j = 0; j < NMAXCHILD; j++)
+            if(node->s.suns[j] >= 0)
+                minacc = DMIN(minacc, childacc[j]);
+    }
+    tree->MinAccel[no - tree->firstnode] = minacc;
+    return minacc;
+}
+
+void
+force_tree_calc_min_accel(ForceTree * tree)
+{
+    if(!force_tree_allocated(tree) || !tree->moments_computed_flag)
+        endrun(5, "Tried to compute node accelerations for a tree without moments\n");
+    if(!tree->MinAccel)
+        tree->MinAccel = (MyFloat *) mymalloc("MinAccel", tree->numnodes * sizeof(MyFloat));
+    /* Nodes which are not on this task never hold a sink, so are given no acceleration.*/
+    memset(tree->MinAccel, 0, tree->numnodes * sizeof(MyFloat));
+
+    int i;
+    #pragma omp parallel
+    #pragma omp single nowait
+    {
+        for(i = 0; i < tree->NTopLeaves; i++) {
+            if(tree->TopLeaves[i].Task != tree->ThisTask)
+                continue;
+            const int no = tree->TopLeaves[i].treenode;
+            #pragma omp task default(none) firstprivate(no, tree)
+            force_min_accel_recursive(no, 1, tree);
+        }
+    }
+}
+
+void
+force_tree_free_min_accel(ForceTree * tree)
+{
+    if(!tree->MinAccel)
+        return;
+    myfree(tree->MinAccel);
+    tree->MinAccel = NULL;
+}
+
 /*! This function frees the memory allocated for the tree, i.e. it frees
  *  the space allocated by the function force_treeallocate().
  */
@@ -1405,6 +2076,15 @@ void force_tree_free(ForceTree * tree)
 {
     if(!force_tree_allocated(tree))
         return;
+    force_tree_free_walk_nodes(tree);
+    force_tree_free_quadrupoles(tree);
+    force_tree_free_min_accel(tree);
+    force_tree_free_interaction_lists(tree);
+    force_tree_free_ngb_cache(tree);
+    force_tree_free_int_positions(tree);
+    if(tree->TopLeafExtent)
+        myfree(tree->TopLeafExtent);
+    force_tree_free_export_plan(tree);
     myfree(tree->Nodes_base);
     if(tree->Father)
         myfree(tree->Father);
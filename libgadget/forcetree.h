@@ -61,10 +61,96 @@ struct NODE
         unsigned int DependsOnLocalMass :1;  /* Intersects with local mass */
         unsigned int ChildType :2; /* Specify the type of children this node has: particles, other nodes, or pseudo-particles.
                                     * (should be an enum, but not standard in C).*/
+        unsigned int TypeMask :6; /* Bit (1<<type) is set if the node may contain particles of that type.
+                                   * Gas also sets the star and black hole bits, as gas may change type while the tree is in use.*/
         unsigned int unused : 3; /* Spare bits*/
     } f;
 };
 
+/* Compact copy of a tree node, holding only what the short-range gravity walk needs, in single precision.
+ * Made from the full nodes after the moments are computed, by force_tree_make_walk_nodes.
+ * The nodes are stored in depth-first walk order, so that the walk moves forward through memory:
+ * the first child of a node containing nodes is the next entry in the array. 44 bytes, against 120 for struct NODE.*/
+struct WalkNode
+{
+    float center[3];
+    float len;
+    /* Center of mass, relative to the geometric center so that single precision is enough*/
+    float cofm[3];
+    float mass;
+    /* Index of the next walk node if this node is not opened, or -1 at the end of the walk.*/
+    int sibling;
+    /* For particle nodes, the index of the first particle in WalkParticles.*/
+    int first;
+    unsigned char noccupied;
+    unsigned char ChildType;
+    unsigned char TopLevel;
+    unsigned char unused;
+};
+
+/* Traceless quadrupole tensor of a node about its center of mass, Q_ij = sum m (3 x_i x_j - r^2 delta_ij).
+ * The components are xx, xy, xz, yy, yz, zz.*/
+struct NodeQuadrupole
+{
+    MyFloat q[6];
+};
+
+/* Cached neighbour list of one particle, see struct NgbCache*/
+struct NgbCacheEntry
+{
+    /* Position of the particle when the list was made. The list is only used at the same position.*/
+    double Pos[3];
+    /* Every particle of the types in mask within Radius of Pos is in the list*/
+    double Radius;
+    int mask;
+    /* Number of neighbours in the list, or -1 if there is no list*/
+    int Count;
+    /* Start of the list in NgbCache.List*/
+    int64_t Start;
+};
+
+/* Lists of the neighbours of local particles, found by a tree walk at a radius Skin larger than the query.
+ * Later asymmetric treewalks on the same tree which search within the cached radius filter the list
+ * instead of walking the tree again, as in a Verlet list.*/
+struct NgbCache
+{
+    /* Indexed by particle*/
+    struct NgbCacheEntry * Entries;
+    /* Memory for the lists, and the amount used so far*/
+    int * List;
+    int64_t Size;
+    int64_t Used;
+    double Skin;
+};
+
+/* For each local particle, the tree nodes at which its primary short-range gravity walk stopped: those used as
+ * a monopole, those discarded and the leaves opened. On a refit of the tree (see force_tree_refit) the node
+ * indices are kept, so the walk for a subset of the particles can start from these nodes instead of the root,
+ * opening them further where needed. Two sets of lists are kept: those made by the last walk are read by
+ * the next walk, which writes the other set.*/
+struct InteractionLists
+{
+    /* Indexed by particle: start of each list in List and the number of nodes in it, or -1 if there is no list*/
+    int64_t * Start[2];
+    int * Count[2];
+    /* Memory for the lists, and the amount used so far*/
+    int * List[2];
+    int64_t Size;
+    int64_t Used[2];
+    /* Index of the set read by the next walk*/
+    int Read;
+};
+
+/* Bounding box of the particles in a top-level leaf. The pseudo node of a remote leaf is the whole
+ * leaf cube, so this lets the toptree walk skip exports to leaves whose particles are all out of range.*/
+struct TopLeafExtent
+{
+    MyFloat min[3];
+    MyFloat max[3];
+    /* Largest hsml of the gas and black holes in the leaf, for symmetric walks*/
+    MyFloat hsmlmax;
+};
+
 /*Structure containing the Node pointer, and various Tree metadata.*/
 /*The node index is an integer with unusual properties:
  * no = 0..ForceTree.firstnode  corresponds to a particle.
@@ -81,12 +167,17 @@ typedef struct ForceTree {
     int moments_computed_flag;
     /* Flags that the tree contains all active particles*/
     int full_particle_tree_flag;
+    /* Flags that TopLeafExtent has been exchanged and holds every top leaf*/
+    int extent_computed_flag;
     /*Index of first internal node. Difference between Nodes and Nodes_base. == MaxPart*/
     int64_t firstnode;
     /*Index of first pseudo-particle node*/
     int64_t lastnode;
     /* Number of actually allocated nodes*/
     int64_t numnodes;
+    /* Number of nodes with memory in Nodes_base. During the tree build this may be less than
+     * lastnode - firstnode: the allocation then grows in place as nodes are needed.*/
+    int64_t nallocnodes;
     /* Types which are included have their bits set to 1*/
     int mask;
     /* Number of particles stored in this tree*/
@@ -109,6 +200,35 @@ typedef struct ForceTree {
     int64_t nfather;
     /*!< Store the size of the box used to build the tree, for periodic walking.*/
     double BoxSize;
+    /* For each particle, the largest search radius for which a previous treewalk
+     * on this tree found that no exports were needed. Later treewalks searching within this
+     * radius can skip the toptree walk for the particle. NULL if not allocated.*/
+    MyFloat * ExportPlan;
+    /* Integer positions of the particles, indexed by particle like the export plan.
+     * Pair separations found from them need no periodic wrap. NULL if not made.*/
+    MyIntPosType (* IntPos)[3];
+    /* Box length of one integer position unit*/
+    double IntPosFac;
+    /* Neighbour lists of local particles for repeated searches. NULL if not allocated.*/
+    struct NgbCache * NgbCache;
+    /* Particle extent of each top leaf, indexed like TopLeaves. NULL if not allocated.*/
+    struct TopLeafExtent * TopLeafExtent;
+    /* Gravity interaction lists of local particles, for reuse on a refit tree. NULL if not allocated.*/
+    struct InteractionLists * InteractionLists;
+    /* Compact walk nodes, see struct WalkNode. NULL if not made.*/
+    struct WalkNode * WalkNodes;
+    /* Particles of the walk nodes, with those in each leaf contiguous*/
+    int * WalkParticles;
+    /* Index of each tree node (offset by firstnode) in WalkNodes, or -1 for nodes not in the walk.*/
+    int * WalkIndex;
+    int64_t NumWalkNodes;
+    /* Single precision quadrupoles of the walk nodes, indexed like WalkNodes. NULL if the tree has no quadrupoles.*/
+    float (* WalkQuadrupoles)[6];
+    /* Quadrupole moments of each tree node (offset by firstnode). NULL if not computed.*/
+    struct NodeQuadrupole * Quadrupoles;
+    /* Smallest old acceleration, |FullTreeGravAccel + GravPM|, of the particles below each
+     * local tree node (offset by firstnode). Zero for nodes not on this task. NULL if not computed.*/
+    MyFloat * MinAccel;
 } ForceTree;
 
 /*Initialize the internal parameters of the forcetree module*/
@@ -119,9 +239,14 @@ int force_tree_allocated(const ForceTree * tt);
 /* This function propagates changed SPH smoothing lengths up the tree*/
 void force_update_hmax(ActiveParticles * act, ForceTree * tt, DomainDecomp * ddecomp);
 
-/* Update the hmax in the parent node of a single particle at p_i*/
+/* Update the hmax in the parent node of a single particle at p_i, and in the nodes above it.*/
 void update_tree_hmax_father(const ForceTree * const tree, const int p_i, const double Pos[3], const double Hsml);
 
+/* Exchange the hmax of the top-level leaves and update the top-level nodes, after update_tree_hmax_father
+ * has been called for the active particles. A cheaper alternative to force_tree_calc_moments for trees
+ * which only need hmax. Collective.*/
+void force_tree_exchange_hmax(ForceTree * tree, const DomainDecomp * const ddecomp);
+
 /* Build a tree structure using all particles, compute moments and allocate a father array.
  * This is the fattest tree constructor, allows moments and walking up and down.*/
 void force_tree_full(ForceTree * tree, DomainDecomp * ddecomp, const int HybridNuTracer, const char * EmergencyOutputDir);
@@ -144,6 +269,72 @@ int force_tree_find_topnode(const double * const pos, const ForceTree * const tr
 /* Compute moments of the force tree, recursively, and update hmax.*/
 void force_tree_calc_moments(ForceTree * tree, DomainDecomp * ddecomp);
 
+/* Refit a tree with moments to a subset act of the particles it was built from,
+ * keeping the node topology and recomputing the moments. Particles must not have moved.*/
+void force_tree_refit(ForceTree * tree, DomainDecomp * ddecomp, const ActiveParticles * act);
+
+/* Allocate the export plan for a tree, which lets treewalks on the same tree
+ * skip re-walking the toptree for particles which have no exports.
+ * Must be called straight after the tree is built, as it is freed with the tree.*/
+void force_tree_alloc_export_plan(ForceTree * tree);
+
+/* Free the export plan, if allocated. Safe to call at any time: treewalks will just walk the toptree.*/
+void force_tree_free_export_plan(ForceTree * tree);
+
+/* Make the integer positions of the local particles, used by the neighbour treewalks on this tree.
+ * Must be called when the particles are at the positions the tree was built with. Freed with the tree.*/
+void force_tree_make_int_positions(ForceTree * tree);
+
+/* Free the integer positions, if made.*/
+void force_tree_free_int_positions(ForceTree * tree);
+
+/* Allocate the top leaf extents for a tree with a father array, and compute those of the local top leaves.
+ * The hsml of active particles is added by update_tree_hmax_father. The extents are exchanged
+ * along with hmax by force_tree_exchange_hmax or force_tree_calc_moments. Freed with the tree.*/
+void force_tree_alloc_topleaf_extent(ForceTree * tree);
+
+/* Allocate the neighbour cache for a tree, with space for listsize neighbours per tree particle.
+ * Lists are made with a search radius larger by the fraction skin. Freed with the tree.*/
+void force_tree_alloc_ngb_cache(ForceTree * tree, const double skin, const double listsize);
+
+/* Drop all cached neighbour lists, for example because particles changed type. The memory is kept.*/
+void force_tree_invalidate_ngb_cache(ForceTree * tree);
+
+/* Free the neighbour cache, if allocated.*/
+void force_tree_free_ngb_cache(ForceTree * tree);
+
+/* Allocate the gravity interaction lists for a tree, with space for listsize nodes per tree particle in each set.
+ * Freed with the tree.*/
+void force_tree_alloc_interaction_lists(ForceTree * tree, const double listsize);
+
+/* After a walk which made interaction lists, make them the lists read by the next walk, and empty the other set.*/
+void force_tree_swap_interaction_lists(ForceTree * tree);
+
+/* Free the interaction lists, if allocated.*/
+void force_tree_free_interaction_lists(ForceTree * tree);
+
+/* Make the compact walk nodes from a tree with moments. The full nodes are kept, as the
+ * toptree walk and other treewalks still use them. Must be remade if the moments change.*/
+void force_tree_make_walk_nodes(ForceTree * tree);
+
+/* Free the compact walk nodes, if made.*/
+void force_tree_free_walk_nodes(ForceTree * tree);
+
+/* Compute the quadrupole moments of a tree with moments, including those of the pseudo particles.
+ * Collective. Must be recomputed if the moments change. If walk nodes are wanted, make them afterwards.*/
+void force_tree_calc_quadrupoles(ForceTree * tree);
+
+/* Free the quadrupole moments, if computed.*/
+void force_tree_free_quadrupoles(ForceTree * tree);
+
+/* Compute the smallest old acceleration below each local node, used by the relative opening
+ * criterion to accept a node for a whole group of sinks with one test. Not collective.
+ * Must be recomputed if the particle accelerations change.*/
+void force_tree_calc_min_accel(ForceTree * tree);
+
+/* Free the node accelerations, if computed.*/
+void force_tree_free_min_accel(ForceTree * tree);
+
 /*Free the memory associated with the tree*/
 void   force_tree_free(ForceTree * tt);
 
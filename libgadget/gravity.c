@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <gsl/gsl_multifit.h>
 
 #include "utils.h"
 #include "gravity.h"
@@ -19,8 +20,82 @@
 /*! variables for short-range lookup table */
 static float shortrange_table[NTAB], shortrange_table_potential[NTAB], shortrange_table_tidal[NTAB];
 
+/* Number of Chebyshev coefficients in the polynomial fit to the short-range window.
+ * 32 fits the erfc window to better than 1e-9 for Asmth = 1.5, and to 2e-4 for Asmth = 0.5.*/
+#define SHORTRANGE_POLY_ORDER 32
+/* Largest allowed difference between the fit and the table. The calibrated table has Monte Carlo noise
+ * of a few times 1e-4, which the least squares fit smooths over.*/
+#define SHORTRANGE_POLY_TOL 1e-3
+
+/* If true, the window is evaluated from the Chebyshev fit rather than interpolated from the table.*/
+static int shortrange_use_poly;
+/* Chebyshev coefficients for the force, potential and tidal windows, in t = 2 x / x_max - 1,
+ * where x is the separation in mesh cells.*/
+static double shortrange_poly[3][SHORTRANGE_POLY_ORDER];
+static float shortrange_poly_float[2][SHORTRANGE_POLY_ORDER];
+
+/* Evaluate a Chebyshev series with the Clenshaw recurrence: no table lookups, so it vectorises.*/
+static inline double
+shortrange_poly_eval(const double * c, const double t)
+{
+    double b1 = 0, b2 = 0;
+    int k;
+    for(k = SHORTRANGE_POLY_ORDER - 1; k >= 1; k--) {
+        const double b = 2 * t * b1 - b2 + c[k];
+        b2 = b1;
+        b1 = b;
+    }
+    return t * b1 - b2 + c[0];
+}
+
+static inline float
+shortrange_poly_eval_float(const float * c, const float t)
+{
+    float b1 = 0, b2 = 0;
+    int k;
+    for(k = SHORTRANGE_POLY_ORDER - 1; k >= 1; k--) {
+        const float b = 2 * t * b1 - b2 + c[k];
+        b2 = b1;
+        b1 = b;
+    }
+    return t * b1 - b2 + c[0];
+}
+
+/* Least squares fit of a Chebyshev series to one column of the window table. Returns the largest difference at the table points.*/
+static double
+shortrange_poly_fit(const double * window, double * coeff)
+{
+    const double xmax = shortrange_force_kernels[NTAB-1][0];
+    gsl_matrix * X = gsl_matrix_alloc(NTAB, SHORTRANGE_POLY_ORDER);
+    gsl_matrix * cov = gsl_matrix_alloc(SHORTRANGE_POLY_ORDER, SHORTRANGE_POLY_ORDER);
+    gsl_vector_const_view y = gsl_vector_const_view_array(window, NTAB);
+    gsl_vector_view c = gsl_vector_view_array(coeff, SHORTRANGE_POLY_ORDER);
+    gsl_multifit_linear_workspace * work = gsl_multifit_linear_alloc(NTAB, SHORTRANGE_POLY_ORDER);
+    size_t i;
+    int k;
+    for(i = 0; i < NTAB; i++) {
+        const double t = 2 * shortrange_force_kernels[i][0] / xmax - 1;
+        gsl_matrix_set(X, i, 0, 1);
+        gsl_matrix_set(X, i, 1, t);
+        for(k = 2; k < SHORTRANGE_POLY_ORDER; k++)
+            gsl_matrix_set(X, i, k, 2 * t * gsl_matrix_get(X, i, k-1) - gsl_matrix_get(X, i, k-2));
+    }
+    double chisq;
+    gsl_multifit_linear(X, &y.vector, &c.vector, cov, &chisq, work);
+    gsl_multifit_linear_free(work);
+    gsl_matrix_free(cov);
+    gsl_matrix_free(X);
+
+    double maxerr = 0;
+    for(i = 0; i < NTAB; i++) {
+        const double t = 2 * shortrange_force_kernels[i][0] / xmax - 1;
+        maxerr = fmax(maxerr, fabs(shortrange_poly_eval(coeff, t) - window[i]));
+    }
+    return maxerr;
+}
+
 void
-gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowType, const double Asmth)
+gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowType, const double Asmth, const int UsePolynomial)
 {
     if (ShortRangeForceWindowType == SHORTRANGE_FORCE_WINDOW_TYPE_EXACT) {
         if(Asmth != 1.5) {
@@ -28,6 +103,8 @@ gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowTy
         }
     }
 
+    /* Double precision copy of the windows, for the fit*/
+    static double window[3][NTAB];
     size_t i;
     for(i = 0; i < NTAB; i++)
     {
@@ -36,18 +113,36 @@ gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowTy
         switch (ShortRangeForceWindowType) {
             case SHORTRANGE_FORCE_WINDOW_TYPE_EXACT:
                 /* Notice that the table is only calibrated for smth of 1.25*/
-                shortrange_table[i] = shortrange_force_kernels[i][2]; /* ~ erfc(u) + 2.0 * u / sqrt(M_PI) * exp(-u * u); */
+                window[0][i] = shortrange_force_kernels[i][2]; /* ~ erfc(u) + 2.0 * u / sqrt(M_PI) * exp(-u * u); */
                 /* The potential of the calibrated kernel is a bit off, so we still use erfc here; we do not use potential anyways.*/
-                shortrange_table_potential[i] = shortrange_force_kernels[i][1];
+                window[1][i] = shortrange_force_kernels[i][1];
             break;
             case SHORTRANGE_FORCE_WINDOW_TYPE_ERFC:
-                shortrange_table[i] = erfc(u) + 2.0 * u / sqrt(M_PI) * exp(-u * u);
-                shortrange_table_potential[i] = erfc(u);
+                window[0][i] = erfc(u) + 2.0 * u / sqrt(M_PI) * exp(-u * u);
+                window[1][i] = erfc(u);
             break;
         }
         /* we don't have a table for that and don't use it anyways. */
-        shortrange_table_tidal[i] = 4.0 * u * u * u / sqrt(M_PI) * exp(-u * u);
+        window[2][i] = 4.0 * u * u * u / sqrt(M_PI) * exp(-u * u);
+        shortrange_table[i] = window[0][i];
+        shortrange_table_potential[i] = window[1][i];
+        shortrange_table_tidal[i] = window[2][i];
     }
+
+    shortrange_use_poly = UsePolynomial;
+    if(!UsePolynomial)
+        return;
+
+    int j, k;
+    double maxerr = 0;
+    for(j = 0; j < 3; j++)
+        maxerr = fmax(maxerr, shortrange_poly_fit(window[j], shortrange_poly[j]));
+    for(j = 0; j < 2; j++)
+        for(k = 0; k < SHORTRANGE_POLY_ORDER; k++)
+            shortrange_poly_float[j][k] = shortrange_poly[j][k];
+    if(maxerr > SHORTRANGE_POLY_TOL)
+        endrun(0, "Polynomial fit to the short range window differs from the table by %g > %g. Use the table for Asmth = %g.\n", maxerr, SHORTRANGE_POLY_TOL, Asmth);
+    message(0, "Polynomial fit to the short range window differs from the table by at most %g\n", maxerr);
 }
 
 /* multiply force factor (*fac) and potential (*pot) by the shortrange force window function*/
@@ -59,9 +154,75 @@ grav_apply_short_range_window(double r, double * fac, double * pot, const double
     size_t tabindex = floor(i);
     if(tabindex >= NTAB - 1)
         return 1;
+    if(shortrange_use_poly) {
+        const double t = 2 * i / (NTAB - 1) - 1;
+        *fac *= shortrange_poly_eval(shortrange_poly[0], t);
+        *pot *= shortrange_poly_eval(shortrange_poly[1], t);
+        return 0;
+    }
     /* use a linear interpolation; */
     *fac *= (tabindex + 1 - i) * shortrange_table[tabindex] + (i - tabindex) * shortrange_table[tabindex + 1];
     *pot *= (tabindex + 1 - i) * shortrange_table_potential[tabindex] + (i - tabindex) * shortrange_table_potential[tabindex];
     return 0;
 }
 
+/* Branch-free, so that the loop is vectorised: interactions outside the table select a window of zero.*/
+void
+grav_apply_short_range_window_float(const int n, const float * r, float * fac, float * pot, const float cellsize)
+{
+    const float dxinv = 1 / (cellsize * shortrange_force_kernels[1][0]);
+    const float tabmax = NTAB - 1;
+    int j;
+    if(shortrange_use_poly) {
+        /* No gathers, so this vectorises fully*/
+        for(j = 0; j < n; j++) {
+            const float i = r[j] * dxinv;
+            const float t = fminf(2 * i / tabmax - 1, 1);
+            const float win = shortrange_poly_eval_float(shortrange_poly_float[0], t);
+            const float winpot = shortrange_poly_eval_float(shortrange_poly_float[1], t);
+            fac[j] *= i < tabmax ? win : 0;
+            pot[j] *= i < tabmax ? winpot : 0;
+        }
+        return;
+    }
+    for(j = 0; j < n; j++) {
+        const float i = r[j] * dxinv;
+        const int inside = i < tabmax;
+        /* r is positive, so truncation is floor*/
+        const int tabindex = inside ? (int) i : 0;
+        const float w = i - tabindex;
+        const float win = (1 - w) * shortrange_table[tabindex] + w * shortrange_table[tabindex + 1];
+        const float winpot = (1 - w) * shortrange_table_potential[tabindex] + w * shortrange_table_potential[tabindex + 1];
+        fac[j] *= inside ? win : 0;
+        pot[j] *= inside ? winpot : 0;
+    }
+}
+
+/* The force and potential window tables, for copying to an accelerator.
+ * Returns the number of entries: the spacing in mesh cells is stored in dx.*/
+int
+grav_get_short_range_window_table(const float ** fac, const float ** pot, double * dx)
+{
+    *fac = shortrange_table;
+    *pot = shortrange_table_potential;
+    *dx = shortrange_force_kernels[1][0];
+    return NTAB;
+}
+
+/* As grav_apply_short_range_window, also multiplying the tidal factor (*tidal) by -r dw/dr, for the gradient of the windowed force.*/
+int
+grav_apply_short_range_window_tidal(double r, double * fac, double * pot, double * tidal, const double cellsize)
+{
+    const double dx = shortrange_force_kernels[1][0];
+    double i = (r / cellsize / dx);
+    size_t tabindex = floor(i);
+    if(tabindex >= NTAB - 1)
+        return 1;
+    grav_apply_short_range_window(r, fac, pot, cellsize);
+    if(shortrange_use_poly)
+        *tidal *= shortrange_poly_eval(shortrange_poly[2], 2 * i / (NTAB - 1) - 1);
+    else
+        *tidal *= (tabindex + 1 - i) * shortrange_table_tidal[tabindex] + (i - tabindex) * shortrange_table_tidal[tabindex + 1];
+    return 0;
+}
+
@@ -19,6 +19,32 @@ struct gravshort_tree_params
     double Rcut;
     /* Softening as a fraction of DM mean separation. */
     double FractionalGravitySoftening;
+    /* If true, active particles in the same tree leaf walk the tree together, sharing one interaction list.*/
+    int BucketWalk;
+    /* If true, the local short-range walk uses the compact walk nodes of the tree.*/
+    int CompactWalk;
+    /* If true, the short-range walk uses node quadrupole moments, with a relative opening criterion for the octupole error.*/
+    int Quadrupole;
+    /* If true, on steps where all particles are active the interactions between local particles
+     * use a dual tree walk with local expansions (the fast multipole method).*/
+    int FMM;
+    /* If true, the softened kernel and short-range window for particle-particle interactions
+     * are evaluated in single precision, in blocks which the compiler can vectorise. Sums are kept in double.*/
+    int MixedPrecision;
+    /* If true, the walk of the local tree is done on an accelerator with OpenMP target offload,
+     * while the host walks the mass on other ranks.*/
+    int Offload;
+    /* If true, the pairwise short-range force evaluates each pair of local active particles once,
+     * adding the opposite force to the other particle.*/
+    int PairSymmetric;
+    /* If > 0, on PM steps the tree force of a sample of particles is compared with the pairwise force
+     * and ErrTolForceAcc is adjusted, between ErrTolForceAccMin and ErrTolForceAccMax,
+     * so that the RMS relative force error is close to this target.*/
+    double ErrTolTargetRMS;
+    double ErrTolForceAccMin;
+    double ErrTolForceAccMax;
+    /* Total number of particles in the calibration sample.*/
+    int ErrTolSamples;
 };
 
 enum ShortRangeForceWindowType {
@@ -26,8 +52,9 @@ enum ShortRangeForceWindowType {
     SHORTRANGE_FORCE_WINDOW_TYPE_ERFC = 1,
 };
 
-/* Fill the short-range gravity table*/
-void gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowType, const double Asmth);
+/* Fill the short-range gravity table. If UsePolynomial is true, also fit a Chebyshev series to the table,
+ * which is then used to evaluate the window instead of interpolating in the table.*/
+void gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowType, const double Asmth, const int UsePolynomial);
 
 /*! Sets the (comoving) softening length, converting from units of the mean DM separation to comoving internal units. */
 void gravshort_set_softenings(double MeanDMSeparation);
@@ -38,9 +65,35 @@ double FORCE_SOFTENING(void);
 
 /*Defined in gravpm.c*/
 void gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G);
+/* Set up the high resolution PM mesh around the zoom region, if PMHighResTypes is set.
+ * Needs the periodic mesh pm, and should be called once, just after it is initialised.*/
+void gravpm_init_highres(const PetaPM * pm);
+/* Free the high resolution PM mesh*/
+void gravpm_destroy_highres(void);
+/* Cell size of the high resolution PM mesh on the last PM step, or 0 if there is none.
+ * Particles with HighResPM set use it for the short-range force split.*/
+double gravpm_highres_cellsize(void);
+void set_gravpm_params(ParameterSet * ps);
+/* Helpers for the tests*/
+void set_gravpm_highres(const int Types, const int Nmesh);
+void set_gravpm_transforms(const int BatchTransforms, const int FiniteDifference);
+void set_gravpm_assignment(const int AssignmentOrder, const int Interlace);
+void set_gravpm_single_precision(const int SinglePrecision);
+void set_gravpm_memory(const int InPlace, const int ExchangeChunks);
 
 /* Apply the short-range window function, which includes the smoothing kernel.*/
 int grav_apply_short_range_window(double r, double * fac, double * pot, const double cellsize);
+/* Also apply the window to the tidal factor, for the gradient of the short-range force.
+ * The tidal window is that of the erfc window function.*/
+int grav_apply_short_range_window_tidal(double r, double * fac, double * pot, double * tidal, const double cellsize);
+
+/* Single precision version of grav_apply_short_range_window for n interactions at separations r.
+ * Interactions outside the window have fac and pot set to zero.*/
+void grav_apply_short_range_window_float(const int n, const float * r, float * fac, float * pot, const float cellsize);
+
+/* Get the short-range window tables, to evaluate the window on an accelerator.
+ * Returns the number of entries, which are spaced by dx mesh cells. The polynomial window is not used.*/
+int grav_get_short_range_window_table(const float ** fac, const float ** pot, double * dx);
 
 /* Set up the module*/
 void set_gravshort_tree_params(ParameterSet * ps);
@@ -51,16 +104,27 @@ struct gravshort_tree_params get_gravshort_treepar(void);
 /* Computes the gravitational force on the PM grid
  * and saves the total matter power spectrum.
  * Parameters: Cosmology, Time, UnitLength_in_cm and PowerOutputDir are used by the power spectrum output code.
- * TimeIC is used by the massive neutrino code. A tree is built and freed during this function*/
-void gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, double UnitLength_in_cm, const char * PowerOutputDir, double TimeIC);
+ * TimeIC is used by the massive neutrino code. A tree of all particles is built and freed during this function,
+ * unless KeepTree is not NULL, in which case the tree is returned in KeepTree for the caller to reuse and free.
+ * Keeping the tree raises the memory used by the PM step.*/
+void gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, double UnitLength_in_cm, const char * PowerOutputDir, double TimeIC, ForceTree * KeepTree);
 
 void grav_short_pair(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double Rcut, double rho0);
 void grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFloat (* AccelStore)[3], double rho0, inttime_t Ti_Current);
 
+/* Measure the auto and cross power spectra of the particle types in TypeMask (a bit field of types, 1 << type),
+ * without computing the forces. Each type is painted to its own mesh; the regions, the cell exchange and the FFT plans are shared.
+ * Spectra are saved to PowerOutputDir as powerspectrum-typeN-TIME.txt and powerspectrum-typeN-typeM-TIME.txt.
+ * Needs one Fourier space mesh per type in memory at once.*/
+void gravpm_power_spectra(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, double UnitLength_in_cm, const char * PowerOutputDir, const int TypeMask);
+
 /*Read the power spectrum, without changing the input value.*/
 void measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value);
 
 /* Compute the power spectrum of the Fourier transformed grid in value.*/
 void powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const value, const double invwindow, double Nmesh);
 
+/* As powerspectrum_add_mode, but for the cross spectrum of two grids. The normalisation is the product of the two means.*/
+void powerspectrum_add_cross_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const a, pfft_complex * const b, const double invwindow, double Nmesh);
+
 #endif
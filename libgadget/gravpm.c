@@ -37,6 +37,15 @@ static PetaPMFunctions functions [] =
     {"ForceZ", force_z_transfer, readout_force_z},
     {NULL, NULL, NULL},
 };
+/* The forces from finite differences of the potential mesh: one backward transform rather than four.*/
+static PetaPMFunctions functions_fd [] =
+{
+    {"Potential", NULL, readout_potential},
+    {"ForceX", NULL, readout_force_x, 1},
+    {"ForceY", NULL, readout_force_y, 2},
+    {"ForceZ", NULL, readout_force_z, 3},
+    {NULL, NULL, NULL},
+};
 
 static PetaPMRegion * _prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, void * userdata, int * Nregions);
 
@@ -46,11 +55,170 @@ static struct gravpm_params
     double TimeIC;
     Cosmology * CP;
     double UnitLength_in_cm;
+    /* Keep the tree after the regions are made, rather than freeing it*/
+    int KeepTree;
 } GravPM;
 
+/* A second PM mesh placed around the high resolution region of a zoom simulation, as PLACEHIGHRESREGION in Gadget-4.
+ * It computes the part of the long-range force between the split scale of this mesh and that of the periodic mesh,
+ * for the particles inside it, so that their tree force is cut off at the split scale of this mesh.
+ * The mesh is periodic but padded: the band limited force it computes is short range
+ * (the tree cutoff of the periodic mesh), and the mesh is large enough that the periodic images do not interact.*/
+static struct gravpm_highres
+{
+    /* Bit mask of the particle types which define the high resolution region. 0 disables the mesh.*/
+    int Types;
+    int Nmesh;
+    PetaPM pm[1];
+    int initialized;
+    /* Cell size of the mesh on the last PM step, or zero if it was not used.*/
+    double CellSize;
+    /* Centre of the mesh on the last PM step*/
+    double Center[3];
+    /* Half widths of the cube in which particles receive the force,
+     * and of the cube in which particles are put on the mesh*/
+    double HalfInner;
+    double HalfDeposit;
+    /* Squared split scale of the periodic mesh, in units of the high resolution mesh wavenumbers, (2 pi r_s / L)^2*/
+    double CoarseAsmth2;
+} HighResPM;
+
+static void gravpm_highres_force(PetaPM * pm, PetaPMParticleStruct * pstruct);
+
+/* If true, the potential and the three force components are transformed back to real space together.
+ * See petapm_init_batch.*/
+static int PMBatchTransforms;
+/* If true, the forces are finite differences of the potential mesh, rather than transformed separately.*/
+static int PMFiniteDifference;
+/* Order of the mass assignment (2 = CIC, 3 = TSC, 4 = PCS) and whether the density mesh is interlaced.
+ * See petapm_set_assignment.*/
+static int PMAssignmentOrder = 2;
+static int PMInterlace;
+/* Decomposition of the FFTs of the PM meshes*/
+static enum PetaPMFFTBackend PMFFTBackend;
+/* If true, the backward transforms of the forces are single precision. See petapm_init_single_precision.*/
+static int PMSinglePrecision;
+/* If true, the transforms are in place. See petapm_init_inplace.*/
+static int PMInPlace;
+/* Number of rounds of the PM cell exchanges. See petapm_set_exchange_chunks.*/
+static int PMExchangeChunks;
+/* Number of readout functions in the list of each mesh*/
+#define NPMFUNCTIONS (sizeof(functions) / sizeof(functions[0]) - 1)
+
+void
+set_gravpm_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        HighResPM.Types = param_get_int(ps, "PMHighResTypes");
+        HighResPM.Nmesh = param_get_int(ps, "PMHighResNmesh");
+        PMBatchTransforms = param_get_int(ps, "PMBatchTransforms");
+        PMFiniteDifference = param_get_int(ps, "PMFiniteDifference");
+        PMAssignmentOrder = param_get_int(ps, "PMAssignmentOrder");
+        PMInterlace = param_get_int(ps, "PMInterlace");
+        PMFFTBackend = (enum PetaPMFFTBackend) param_get_enum(ps, "PMFFTBackend");
+        PMSinglePrecision = param_get_int(ps, "PMSinglePrecision");
+        PMInPlace = param_get_int(ps, "PMInPlace");
+        PMExchangeChunks = param_get_int(ps, "PMExchangeChunks");
+    }
+    MPI_Bcast(&HighResPM.Types, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&HighResPM.Nmesh, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PMBatchTransforms, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PMFiniteDifference, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PMAssignmentOrder, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PMInterlace, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PMFFTBackend, sizeof(PMFFTBackend), MPI_BYTE, 0, GadgetComm);
+    MPI_Bcast(&PMSinglePrecision, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PMInPlace, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PMExchangeChunks, 1, MPI_INT, 0, GadgetComm);
+}
+
+void
+set_gravpm_transforms(const int BatchTransforms, const int FiniteDifference)
+{
+    PMBatchTransforms = BatchTransforms;
+    PMFiniteDifference = FiniteDifference;
+}
+
+void
+set_gravpm_single_precision(const int SinglePrecision)
+{
+    PMSinglePrecision = SinglePrecision;
+}
+
+void
+set_gravpm_memory(const int InPlace, const int ExchangeChunks)
+{
+    PMInPlace = InPlace;
+    PMExchangeChunks = ExchangeChunks;
+}
+
+void
+set_gravpm_assignment(const int AssignmentOrder, const int Interlace)
+{
+    PMAssignmentOrder = AssignmentOrder;
+    PMInterlace = Interlace;
+}
+
+/* Set up the mass assignment, and the batched transforms or the finite difference readout of a PM mesh*/
+static void
+gravpm_init_transforms(PetaPM * pm)
+{
+    petapm_set_assignment(pm, PMAssignmentOrder, PMInterlace);
+    petapm_set_exchange_chunks(pm, PMExchangeChunks);
+    if(PMInPlace)
+        petapm_init_inplace(pm);
+    if(PMSinglePrecision)
+        petapm_init_single_precision(pm);
+    /* With finite differences there is only one backward transform*/
+    if(PMFiniteDifference)
+        petapm_set_region_padding(pm, 2);
+    else if(PMBatchTransforms)
+        petapm_init_batch(pm, NPMFUNCTIONS);
+}
+
+void
+set_gravpm_highres(const int Types, const int Nmesh)
+{
+    HighResPM.Types = Types;
+    HighResPM.Nmesh = Nmesh;
+}
+
 void
 gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G) {
-    petapm_init(pm, BoxSize, Asmth, Nmesh, G, MPI_COMM_WORLD);
+    petapm_init_fft(pm, BoxSize, Asmth, Nmesh, G, GadgetComm, PMFFTBackend);
+    gravpm_init_transforms(pm);
+}
+
+void
+gravpm_init_highres(const PetaPM * pm)
+{
+    if(!HighResPM.Types)
+        return;
+    if(HighResPM.Nmesh <= 0)
+        HighResPM.Nmesh = pm->Nmesh;
+    /* The box size is set on each PM step, from the size of the region*/
+    petapm_init_fft(HighResPM.pm, pm->BoxSize, pm->Asmth, HighResPM.Nmesh, pm->G, GadgetComm, PMFFTBackend);
+    gravpm_init_transforms(HighResPM.pm);
+    HighResPM.initialized = 1;
+    message(0, "High resolution PM mesh with %d cells for particle types %d\n", HighResPM.Nmesh, HighResPM.Types);
+}
+
+void
+gravpm_destroy_highres(void)
+{
+    if(!HighResPM.initialized)
+        return;
+    petapm_destroy(HighResPM.pm);
+    HighResPM.initialized = 0;
+    HighResPM.CellSize = 0;
+}
+
+double
+gravpm_highres_cellsize(void)
+{
+    return HighResPM.CellSize;
 }
 
 /* Computes the gravitational force on the PM grid
@@ -58,7 +226,7 @@ gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, doubl
  * Parameters: Cosmology, Time, UnitLength_in_cm and PowerOutputDir are used by the power spectrum output code.
  * TimeIC is used by the massive neutrino code.*/
 void
-gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, double UnitLength_in_cm, const char * PowerOutputDir, double TimeIC) {
+gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, double UnitLength_in_cm, const char * PowerOutputDir, double TimeIC, ForceTree * KeepTree) {
     PetaPMParticleStruct pstruct = {
         P,
         sizeof(P[0]),
@@ -101,12 +269,18 @@ gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, d
     GravPM.TimeIC = TimeIC;
     GravPM.CP = CP;
     GravPM.UnitLength_in_cm = UnitLength_in_cm;
+    GravPM.KeepTree = KeepTree != NULL;
     /*
      * we apply potential transfer immediately after the R2C transform,
      * Therefore the force transfer functions are based on the potential,
      * not the density.
      * */
-    petapm_force(pm, _prepare, &global_functions, functions, &pstruct, &Tree);
+    petapm_force(pm, _prepare, &global_functions, PMFiniteDifference ? functions_fd : functions, &pstruct, &Tree);
+    if(KeepTree)
+        *KeepTree = Tree;
+    /* Add the band of the long-range force resolved by the high resolution mesh*/
+    if(HighResPM.initialized)
+        gravpm_highres_force(pm, &pstruct);
     powerspectrum_sum(pm->ps);
     /*Now save the power spectrum*/
     powerspectrum_save(pm->ps, PowerOutputDir, "powerspectrum", Time, GrowthFactor(CP, Time, 1.0));
@@ -164,7 +338,7 @@ static PetaPMRegion * _prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, void
 
     *Nregions = r;
     int maxNregions;
-    MPI_Reduce(&r, &maxNregions, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&r, &maxNregions, 1, MPI_INT, MPI_MAX, 0, GadgetComm);
     message(0, "max number of regions is %d\n", maxNregions);
 
     int64_t i;
@@ -201,7 +375,7 @@ static PetaPMRegion * _prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, void
         convert_node_to_region(pm, &regions[r], tree->Nodes);
     }
     /*This is done to conserve memory during the PM step*/
-    if(force_tree_allocated(tree)) force_tree_free(tree);
+    if(force_tree_allocated(tree) && !GravPM.KeepTree) force_tree_free(tree);
 
     /*Allocate memory for a power spectrum*/
     powerspectrum_alloc(pm->ps, pm->Nmesh, omp_get_max_threads(), GravPM.CP->MassiveNuLinRespOn, pm->BoxSize*GravPM.UnitLength_in_cm);
@@ -280,6 +454,188 @@ static void convert_node_to_region(PetaPM * pm, PetaPMRegion * r, struct NODE *
     r->len  = Nodes[no].len;
 }
 
+/* Position and mass of a particle relative to the corner of the high resolution mesh*/
+struct HighResPart {
+    double Pos[3];
+    float Mass;
+    /* True if the particle is put on the mesh*/
+    int OnMesh;
+};
+
+static void highres_potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
+static void readout_highres_potential(PetaPM * pm, int i, double * mesh, double weight);
+static void readout_highres_force_x(PetaPM * pm, int i, double * mesh, double weight);
+static void readout_highres_force_y(PetaPM * pm, int i, double * mesh, double weight);
+static void readout_highres_force_z(PetaPM * pm, int i, double * mesh, double weight);
+static PetaPMFunctions highres_functions [] =
+{
+    {"Potential", NULL, readout_highres_potential},
+    {"ForceX", force_x_transfer, readout_highres_force_x},
+    {"ForceY", force_y_transfer, readout_highres_force_y},
+    {"ForceZ", force_z_transfer, readout_highres_force_z},
+    {NULL, NULL, NULL},
+};
+static PetaPMFunctions highres_functions_fd [] =
+{
+    {"Potential", NULL, readout_highres_potential},
+    {"ForceX", NULL, readout_highres_force_x, 1},
+    {"ForceY", NULL, readout_highres_force_y, 2},
+    {"ForceZ", NULL, readout_highres_force_z, 3},
+    {NULL, NULL, NULL},
+};
+
+/* One region covering the local particles on the high resolution mesh.
+ * Ranks with no particles on the mesh get a small empty region.*/
+static PetaPMRegion *
+_prepare_highres(PetaPM * pm, PetaPMParticleStruct * pstruct, void * userdata, int * Nregions)
+{
+    const struct HighResPart * parts = (const struct HighResPart *) pstruct->Parts;
+    PetaPMRegion * regions = (PetaPMRegion *) mymalloc2("Regions", sizeof(PetaPMRegion));
+    memset(regions, 0, sizeof(PetaPMRegion));
+    pstruct->RegionInd = (int *) mymalloc2("RegionInd", pstruct->NumPart * sizeof(int));
+    double min[3] = {pm->BoxSize, pm->BoxSize, pm->BoxSize}, max[3] = {0, 0, 0};
+    int64_t i, numpart = 0;
+    for(i = 0; i < pstruct->NumPart; i++) {
+        pstruct->RegionInd[i] = parts[i].OnMesh ? 0 : -2;
+        if(!parts[i].OnMesh)
+            continue;
+        int k;
+        for(k = 0; k < 3; k++) {
+            min[k] = DMIN(min[k], parts[i].Pos[k]);
+            max[k] = DMAX(max[k], parts[i].Pos[k]);
+        }
+        numpart++;
+    }
+    if(numpart == 0) {
+        int k;
+        for(k = 0; k < 3; k++)
+            min[k] = max[k] = 0;
+    }
+    int k;
+    for(k = 0; k < 3; k ++) {
+        regions[0].offset[k] = floor(min[k] / pm->CellSize);
+        int end = (int) ceil(max[k] / pm->CellSize) + 1;
+        regions[0].size[k] = end - regions[0].offset[k] + 1;
+        regions[0].center[k] = (min[k] + max[k]) / 2;
+    }
+    petapm_region_init_strides(&regions[0]);
+    regions[0].len = DMAX(DMAX(max[0] - min[0], max[1] - min[1]), max[2] - min[2]);
+    regions[0].numpart = numpart;
+    regions[0].no = -1;
+    *Nregions = 1;
+    return regions;
+}
+
+/* Place the high resolution mesh around the particles of the high resolution types, mark the particles which receive its force,
+ * and compute the band of the long-range force between the split scales of the two meshes.
+ * Particles outside the mesh keep the force of the periodic mesh alone.*/
+static void
+gravpm_highres_force(PetaPM * pm, PetaPMParticleStruct * pstruct)
+{
+    const double BoxSize = pm->BoxSize;
+    int64_t i;
+    /* Find a reference point inside the region: the first high resolution particle on the lowest rank which has one.*/
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+    double ref[3] = {0};
+    int hasref = NTask;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage || P[i].Swallowed || !((1 << P[i].Type) & HighResPM.Types))
+            continue;
+        int k;
+        for(k = 0; k < 3; k++)
+            ref[k] = P[i].Pos[k];
+        hasref = ThisTask;
+        break;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &hasref, 1, MPI_INT, MPI_MIN, GadgetComm);
+    HighResPM.CellSize = 0;
+    if(hasref == NTask) {
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++)
+            P[i].HighResPM = 0;
+        message(0, "No particles of types %d for the high resolution PM mesh\n", HighResPM.Types);
+        return;
+    }
+    MPI_Bcast(ref, 3, MPI_DOUBLE, hasref, GadgetComm);
+    /* Extent of the region relative to the reference point. The region should be much smaller than the box.*/
+    double min[3] = {0}, max[3] = {0};
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage || P[i].Swallowed || !((1 << P[i].Type) & HighResPM.Types))
+            continue;
+        int k;
+        for(k = 0; k < 3; k++) {
+            const double dx = NEAREST(P[i].Pos[k] - ref[k], BoxSize);
+            min[k] = DMIN(min[k], dx);
+            max[k] = DMAX(max[k], dx);
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, min, 3, MPI_DOUBLE, MPI_MIN, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, max, 3, MPI_DOUBLE, MPI_MAX, GadgetComm);
+    double extent = 0;
+    int k;
+    for(k = 0; k < 3; k++) {
+        HighResPM.Center[k] = ref[k] + (min[k] + max[k]) / 2;
+        extent = DMAX(extent, max[k] - min[k]);
+    }
+    /* The band limited force is zero beyond the tree cutoff of the periodic mesh*/
+    const double range = get_gravshort_treepar().Rcut * pm->Asmth * pm->CellSize;
+    HighResPM.HalfInner = extent / 2 * 1.001;
+    HighResPM.HalfDeposit = HighResPM.HalfInner + range;
+    /* Periodic images of the deposited mass are at least one cutoff from the inner region.
+     * Leave two cells for the mass assignment.*/
+    const double MeshSize = 2 * HighResPM.HalfDeposit * (1 + 4. / HighResPM.Nmesh);
+    if(MeshSize >= BoxSize / 2) {
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++)
+            P[i].HighResPM = 0;
+        message(0, "High resolution region %g is too large for the high resolution PM mesh (size %g box %g)\n", extent, MeshSize, BoxSize);
+        return;
+    }
+    PetaPM * pmhr = HighResPM.pm;
+    pmhr->BoxSize = MeshSize;
+    pmhr->CellSize = MeshSize / pmhr->Nmesh;
+    pmhr->Asmth = pm->Asmth;
+    HighResPM.CoarseAsmth2 = pow(2 * M_PI * pm->Asmth * pm->CellSize / MeshSize, 2);
+
+    struct HighResPart * parts = (struct HighResPart *) mymalloc2("HighResParts", PartManager->NumPart * sizeof(struct HighResPart));
+    PetaPMParticleStruct hrstruct = {
+        parts,
+        sizeof(parts[0]),
+        (char*) &parts[0].Pos[0]  - (char*) parts,
+        (char*) &parts[0].Mass  - (char*) parts,
+        NULL,
+        pstruct->active,
+        PartManager->NumPart,
+    };
+    int64_t ninner = 0;
+    #pragma omp parallel for reduction(+: ninner)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int indeposit = !P[i].IsGarbage && !P[i].Swallowed, ininner = indeposit;
+        int d;
+        for(d = 0; d < 3; d++) {
+            const double dx = NEAREST(P[i].Pos[d] - HighResPM.Center[d], BoxSize);
+            parts[i].Pos[d] = dx + MeshSize / 2;
+            if(fabs(dx) >= HighResPM.HalfDeposit)
+                indeposit = 0;
+            if(fabs(dx) >= HighResPM.HalfInner)
+                ininner = 0;
+        }
+        parts[i].Mass = P[i].Mass;
+        parts[i].OnMesh = indeposit;
+        P[i].HighResPM = ininner;
+        ninner += ininner;
+    }
+    PetaPMGlobalFunctions global_functions = {NULL, NULL, highres_potential_transfer};
+    petapm_force(pmhr, _prepare_highres, &global_functions, PMFiniteDifference ? highres_functions_fd : highres_functions, &hrstruct, NULL);
+    myfree(parts);
+    HighResPM.CellSize = pmhr->CellSize;
+    message(0, "High resolution PM mesh: centre %g %g %g size %g cell %g; %ld particles inside (local).\n",
+            HighResPM.Center[0], HighResPM.Center[1], HighResPM.Center[2], MeshSize, pmhr->CellSize, ninner);
+    walltime_measure("/PMgrav/HighRes");
+}
+
 /********************
  * transfer functions for
  *
@@ -291,16 +647,6 @@ static void convert_node_to_region(PetaPM * pm, PetaPMRegion * r, struct NODE *
  *
  *********************/
 
-/* unnormalized sinc function sin(x) / x */
-static double sinc_unnormed(double x) {
-    if(x < 1e-5 && x > -1e-5) {
-        double x2 = x * x;
-        return 1.0 - x2 / 6. + x2  * x2 / 120.;
-    } else {
-        return sin(x) / x;
-    }
-}
-
 /* Update the model prediction of LinResp neutrino power spectrum.
  * This should happen after the CFT is computed,
  * and after powerspectrum_add_mode() has been called,
@@ -360,23 +706,115 @@ powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3
 
 }
 
+void
+powerspectrum_add_cross_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const a, pfft_complex * const b, const double invwindow, double Nmesh)
+{
+    if(k2 == 0) {
+        /* Product of the two means as the normalisation factor.*/
+        PowerSpectrum->Norm = sqrt((a[0][0] * a[0][0] + a[0][1] * a[0][1]) * (b[0][0] * b[0][0] + b[0][1] * b[0][1]));
+        return;
+    }
+    if(k2 > 0) {
+        const double binsperunit=(PowerSpectrum->size-1)/log(sqrt(3) * Nmesh/2.0);
+        int kint=floor(binsperunit*log(k2)/2.);
+        int w;
+        const double keff = sqrt(kpos[0]*kpos[0]+kpos[1]*kpos[1]+kpos[2]*kpos[2]);
+        /* Real part of a b*: the imaginary part cancels between k and -k*/
+        const double m = (a[0][0] * b[0][0] + a[0][1] * b[0][1]);
+        if(kint >= PowerSpectrum->size)
+            return;
+        if(kpos[2] == 0 || kpos[2] == Nmesh/2) w = 1;
+        else w = 2;
+        const int index = kint + omp_get_thread_num() * PowerSpectrum->size;
+        PowerSpectrum->Power[index] += w * m * invwindow * invwindow;
+        PowerSpectrum->Nmodes[index] += w;
+        PowerSpectrum->kk[index] += w * keff;
+    }
+}
+
+static void
+measure_cross_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * a, pfft_complex * b)
+{
+    /* deconvolve the mass assignment window */
+    const double f = petapm_inverse_window(pm, kpos);
+    powerspectrum_add_cross_mode(pm->ps, k2, kpos, a, b, f, pm->Nmesh);
+}
+
+/* Particle type painted by gravpm_power_spectra: the mask of all types, then one type at a time*/
+static int PowerTypeMask;
+
+static int
+power_type_is_active(int i)
+{
+    return !P[i].Swallowed && ((1 << P[i].Type) & PowerTypeMask);
+}
+
+void
+gravpm_power_spectra(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, double UnitLength_in_cm, const char * PowerOutputDir, const int TypeMask)
+{
+    PetaPMParticleStruct pstruct = {
+        P,
+        sizeof(P[0]),
+        (char*) &P[0].Pos[0]  - (char*) P,
+        (char*) &P[0].Mass  - (char*) P,
+        /* Regions allocated inside _prepare*/
+        NULL,
+        power_type_is_active,
+        PartManager->NumPart,
+    };
+    int types[6];
+    int ntypes = 0, i, j;
+    for(i = 0; i < 6; i++)
+        if(TypeMask & (1 << i))
+            types[ntypes++] = i;
+    if(ntypes == 0)
+        return;
+
+    /* The regions are made from a tree of all particles, and painted once with all the types*/
+    ForceTree Tree = {0};
+    force_tree_full(&Tree, ddecomp, 0, PowerOutputDir);
+    GravPM.Time = Time;
+    GravPM.CP = CP;
+    GravPM.UnitLength_in_cm = UnitLength_in_cm;
+    GravPM.KeepTree = 0;
+    PowerTypeMask = TypeMask;
+    int Nregions;
+    PetaPMRegion * regions = petapm_force_init(pm, _prepare, &pstruct, &Nregions, &Tree);
+
+    /* Then each type to its own mesh. These are on the top of the heap, above the regions.*/
+    pfft_complex * rho_k[6];
+    for(i = 0; i < ntypes; i++) {
+        PowerTypeMask = 1 << types[i];
+        rho_k[i] = petapm_force_r2c_active(pm, power_type_is_active);
+    }
+    PowerTypeMask = TypeMask;
+
+    const double D1 = GrowthFactor(CP, Time, 1.0);
+    for(i = 0; i < ntypes; i++) {
+        for(j = i; j < ntypes; j++) {
+            powerspectrum_zero(pm->ps);
+            petapm_readout_cross_modes(pm, rho_k[i], rho_k[j], measure_cross_power_spectrum);
+            powerspectrum_sum(pm->ps);
+            char * fname = (i == j) ? fastpm_strdup_printf("powerspectrum-type%d", types[i]) :
+                            fastpm_strdup_printf("powerspectrum-type%d-type%d", types[i], types[j]);
+            powerspectrum_save(pm->ps, PowerOutputDir, fname, Time, D1);
+            myfree(fname);
+        }
+    }
+    for(i = ntypes - 1; i >= 0; i--)
+        myfree(rho_k[i]);
+    myfree(pstruct.RegionInd);
+    myfree(regions);
+    petapm_force_finish(pm);
+    powerspectrum_free(pm->ps);
+    walltime_measure("/PMgrav/PowerSpec");
+}
+
 /*Just read the power spectrum, without changing the input value.*/
 void
 measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value) {
-    double f = 1.0;
-    /* the CIC deconvolution kernel is
-     *
-     * sinc_unnormed(k_x L / 2 Nmesh) ** 2
-     *
-     * k_x = kpos * 2pi / L
-     *
-     * */
-    int k;
-    for(k = 0; k < 3; k ++) {
-        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
-        tmp = sinc_unnormed(tmp);
-        f *= 1. / (tmp * tmp);
-    }
+    /* deconvolve the mass assignment window */
+    const double f = petapm_inverse_window(pm, kpos);
     powerspectrum_add_mode(pm->ps, k2, kpos, value, f, pm->Nmesh);
 }
 
@@ -384,7 +822,6 @@ static void
 potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
 {
     const double asmth2 = pow((2 * M_PI) * pm->Asmth / pm->Nmesh,2);
-    double f = 1.0;
     const double smth = exp(-k2 * asmth2) / k2;
         /* fac is - 4pi G     (L / 2pi) **2 / L ** 3
      *        Gravity       k2            DFT (dk **3, but )
@@ -392,21 +829,10 @@ potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
     const double pot_factor = - pm->G / (M_PI * pm->BoxSize);	/* to get potential */
 
 
-    /* the CIC deconvolution kernel is
-     *
-     * sinc_unnormed(k_x L / 2 Nmesh) ** 2
-     *
-     * k_x = kpos * 2pi / L
-     *
-     * */
-    int k;
-    for(k = 0; k < 3; k ++) {
-        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
-        tmp = sinc_unnormed(tmp);
-        f *= 1. / (tmp * tmp);
-    }
+    /* deconvolve the mass assignment window */
+    const double f = petapm_inverse_window(pm, kpos);
     /*
-     * first decovolution is CIC in par->mesh
+     * first decovolution is the mass assignment in par->mesh
      * second decovolution is correcting readout
      * I don't understand the second yet!
      * */
@@ -453,6 +879,24 @@ potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
     value[0][1] *= fac;
 }
 
+/* Potential of the band of the long-range force between the split scale of the high resolution mesh
+ * and that of the periodic mesh: the difference of the two Gaussian smoothed Green's functions.
+ * This is finite as k -> 0, so the mean is kept.*/
+static void
+highres_potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
+{
+    /* Split scale of this mesh, as in potential_transfer. The split scale of the periodic mesh is in CoarseAsmth2*/
+    const double asmth2 = pow((2 * M_PI) * pm->Asmth / pm->Nmesh,2);
+    const double f = petapm_inverse_window(pm, kpos);
+    const double pot_factor = - pm->G / (M_PI * pm->BoxSize);
+    double smth = HighResPM.CoarseAsmth2 - asmth2;
+    if(k2 > 0)
+        smth = (exp(-k2 * asmth2) - exp(-k2 * HighResPM.CoarseAsmth2)) / k2;
+    const double fac = pot_factor * smth * f * f;
+    value[0][0] *= fac;
+    value[0][1] *= fac;
+}
+
 /* the transfer functions for force in fourier space applied to potential */
 /* super lanzcos in CH6 P 122 Digital Filters by Richard W. Hamming */
 static double diff_kernel(double w) {
@@ -508,3 +952,21 @@ static void readout_force_y(PetaPM * pm, int i, double * mesh, double weight) {
 static void readout_force_z(PetaPM * pm, int i, double * mesh, double weight) {
     P[i].GravPM[2] += weight * mesh[0];
 }
+
+/* Only the particles inside the inner region of the high resolution mesh receive its force*/
+static void readout_highres_potential(PetaPM * pm, int i, double * mesh, double weight) {
+    if(P[i].HighResPM)
+        P[i].Potential += weight * mesh[0];
+}
+static void readout_highres_force_x(PetaPM * pm, int i, double * mesh, double weight) {
+    if(P[i].HighResPM)
+        P[i].GravPM[0] += weight * mesh[0];
+}
+static void readout_highres_force_y(PetaPM * pm, int i, double * mesh, double weight) {
+    if(P[i].HighResPM)
+        P[i].GravPM[1] += weight * mesh[0];
+}
+static void readout_highres_force_z(PetaPM * pm, int i, double * mesh, double weight) {
+    if(P[i].HighResPM)
+        P[i].GravPM[2] += weight * mesh[0];
+}
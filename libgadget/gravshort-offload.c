@@ -0,0 +1,308 @@
+#include <mpi.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "utils.h"
+
+#include "forcetree.h"
+#include "gravshort.h"
+#include "walltime.h"
+
+/*! \file gravshort-offload.c
+ *  \brief Local part of the short-range gravity tree walk on an accelerator.
+ *
+ *  The compact walk nodes of the tree (which are frozen during the walk), the positions and masses
+ *  of the tree particles in walk order and the active particles are copied to the device with
+ *  OpenMP target offload. The device walks the local tree for each active particle, while the host
+ *  walks the mass on other ranks with the usual treewalk, which skips the local mass as with the
+ *  fast multipole solver. The results are copied back and added to the accelerations at the end.
+ *
+ *  Needs a compiler built with offload support, eg, -foffload=nvptx-none for gcc or
+ *  -fopenmp-targets=nvptx64 for clang. Otherwise, or if there is no device, the target region
+ *  runs on the host.
+ */
+
+/* Tree particle, in walk order*/
+struct OffloadParticle {
+    double Pos[3];
+    double Mass;
+};
+
+/* Active particle: position and opening threshold*/
+struct OffloadQuery {
+    double Pos[3];
+    double aold;
+};
+
+struct OffloadResult {
+    double Acc[3];
+    double Potential;
+};
+
+/* Constants of the walk, copied to the device*/
+struct OffloadConsts {
+    double BoxSize;
+    double cellsize;
+    double rcut;
+    double rcut2;
+    /* Softening length*/
+    double h;
+    int TreeUseBH;
+    double BHOpeningAngle2;
+    /* Short-range window table*/
+    int ntab;
+    double wdx;
+};
+
+struct GravShortOffload {
+    const ForceTree * tree;
+    const int * ActiveParticle;
+    int64_t NumActive;
+    struct OffloadQuery * Queries;
+    struct OffloadParticle * Parts;
+    struct OffloadResult * Results;
+    int64_t NumParts;
+    struct OffloadConsts c;
+    /* Window tables, owned by gravity.c*/
+    const float * wfac;
+    const float * wpot;
+};
+
+#pragma omp declare target(shall_we_discard_node, shall_we_open_node)
+#pragma omp declare target
+
+/* Short-range window, linearly interpolated from the table. Returns 1 outside the table.*/
+static int
+offload_window(const double r, const struct OffloadConsts * c, const float * wfac, const float * wpot, double * fac, double * pot)
+{
+    const double i = r / c->cellsize / c->wdx;
+    const int tabindex = i;
+    if(tabindex >= c->ntab - 1)
+        return 1;
+    const double w = i - tabindex;
+    *fac *= (1 - w) * wfac[tabindex] + w * wfac[tabindex + 1];
+    *pot *= (1 - w) * wpot[tabindex] + w * wpot[tabindex + 1];
+    return 0;
+}
+
+/* As apply_accn_to_output in gravshort-tree.c*/
+static void
+offload_apply_accn(struct OffloadResult * out, const double dx[3], const double r2, const double mass,
+        const struct OffloadConsts * c, const float * wfac, const float * wpot)
+{
+    const double r = sqrt(r2);
+    const double h = c->h;
+    double fac = mass / (r2 * r);
+    double facpot = -mass / r;
+
+    if(r2 < h * h) {
+        double wp;
+        const double h3_inv = 1.0 / h / h / h;
+        const double u = r / h;
+        if(u < 0.5) {
+            fac = mass * h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
+            wp = -2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6));
+        }
+        else {
+            fac = mass * h3_inv * (21.333333333333 - 48.0 * u +
+                        38.4 * u * u - 10.666666666667 * u * u * u - 0.066666666667 / (u * u * u));
+            wp = -3.2 + 0.066666666667 / u + u * u * (10.666666666667 +
+                        u * (-16.0 + u * (9.6 - 2.133333333333 * u)));
+        }
+        facpot = mass / h * wp;
+    }
+
+    if(0 == offload_window(r, c, wfac, wpot, &fac, &facpot)) {
+        int i;
+        for(i = 0; i < 3; i++)
+            out->Acc[i] += dx[i] * fac;
+        out->Potential += facpot;
+    }
+}
+
+/* As apply_quadrupole_to_output in gravshort-tree.c*/
+static void
+offload_apply_quadrupole(struct OffloadResult * out, const double dx[3], const double r2, const float q[6],
+        const struct OffloadConsts * c, const float * wfac, const float * wpot)
+{
+    if(r2 < c->h * c->h)
+        return;
+    const double r = sqrt(r2);
+    double fac = 1, facpot = 1;
+    if(offload_window(r, c, wfac, wpot, &fac, &facpot))
+        return;
+    const double qdx[3] = {
+        q[0] * dx[0] + q[1] * dx[1] + q[2] * dx[2],
+        q[1] * dx[0] + q[3] * dx[1] + q[4] * dx[2],
+        q[2] * dx[0] + q[4] * dx[1] + q[5] * dx[2],
+    };
+    const double dxqdx = dx[0] * qdx[0] + dx[1] * qdx[1] + dx[2] * qdx[2];
+    const double r5inv = 1 / (r2 * r2 * r);
+    int i;
+    for(i = 0; i < 3; i++)
+        out->Acc[i] += fac * r5inv * (2.5 * dxqdx / r2 * dx[i] - qdx[i]);
+    out->Potential -= facpot * 0.5 * dxqdx * r5inv;
+}
+
+/* Walk the local tree for one particle, as force_treeev_shortrange_walknodes, evaluating the particles
+ * in opened leaves directly. Pseudo nodes are skipped: they are walked on the host.*/
+static void
+offload_walk_particle(const struct OffloadQuery * query, struct OffloadResult * out, const struct WalkNode * Nodes, const float (*Quad)[6],
+        const struct OffloadParticle * Parts, const struct OffloadConsts * c, const float * wfac, const float * wpot)
+{
+    const double * inpos = query->Pos;
+    const double BHOpeningAngle2 = c->BHOpeningAngle2;
+    const int Quadrupole = Quad != NULL;
+    int no = 0;
+    while(no >= 0)
+    {
+        const struct WalkNode * nop = &Nodes[no];
+        int i;
+        double center[3], dx[3];
+        for(i = 0; i < 3; i++) {
+            center[i] = nop->center[i];
+            dx[i] = NEAREST(center[i] + nop->cofm[i] - inpos[i], c->BoxSize);
+        }
+        const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+
+        if(shall_we_discard_node(nop->len, r2, center, inpos, c->BoxSize, c->rcut, c->rcut2)) {
+            no = nop->sibling;
+            continue;
+        }
+
+        if(!shall_we_open_node(nop->len, nop->mass, r2, center, inpos, c->BoxSize, query->aold, c->TreeUseBH, BHOpeningAngle2, Quadrupole)) {
+            offload_apply_accn(out, dx, r2, nop->mass, c, wfac, wpot);
+            if(Quadrupole)
+                offload_apply_quadrupole(out, dx, r2, Quad[no], c, wfac, wpot);
+            no = nop->sibling;
+            continue;
+        }
+
+        if(nop->ChildType == PARTICLE_NODE_TYPE) {
+            for(i = nop->first; i < nop->first + nop->noccupied; i++) {
+                double pdx[3];
+                int j;
+                for(j = 0; j < 3; j++)
+                    pdx[j] = NEAREST(Parts[i].Pos[j] - inpos[j], c->BoxSize);
+                const double pr2 = pdx[0] * pdx[0] + pdx[1] * pdx[1] + pdx[2] * pdx[2];
+                /* The self-interaction adds only the softened self-potential, which postprocess removes*/
+                offload_apply_accn(out, pdx, pr2, Parts[i].Mass, c, wfac, wpot);
+            }
+            no = nop->sibling;
+        }
+        else if(nop->ChildType == PSEUDO_NODE_TYPE)
+            no = nop->sibling;
+        else
+            /* The first child is the next node in walk order*/
+            no = no + 1;
+    }
+}
+
+#pragma omp end declare target
+
+struct GravShortOffload *
+grav_short_offload_begin(const ForceTree * tree, const int * ActiveParticle, const int64_t NumActive, const struct GravShortPriv * priv)
+{
+    if(!tree->WalkNodes)
+        endrun(5, "Offloaded gravity walk needs the compact walk nodes\n");
+
+    const struct gravshort_tree_params TreeParams = get_gravshort_treepar();
+    struct GravShortOffload * off = (struct GravShortOffload *) mymalloc2("GravOffload", sizeof(struct GravShortOffload));
+    off->tree = tree;
+    off->ActiveParticle = ActiveParticle;
+    off->NumActive = NumActive;
+
+    off->c.BoxSize = tree->BoxSize;
+    off->c.cellsize = priv->cellsize;
+    off->c.rcut = priv->Rcut;
+    off->c.rcut2 = priv->Rcut * priv->Rcut;
+    off->c.h = FORCE_SOFTENING();
+    off->c.TreeUseBH = TreeParams.TreeUseBH;
+    off->c.BHOpeningAngle2 = TreeParams.BHOpeningAngle * TreeParams.BHOpeningAngle;
+    /* Maximum opening angle for the relative acceleration criterion, as in force_treeev_shortrange*/
+    if(TreeParams.TreeUseBH == 0)
+        off->c.BHOpeningAngle2 = TreeParams.MaxBHOpeningAngle * TreeParams.MaxBHOpeningAngle;
+    off->c.ntab = grav_get_short_range_window_table(&off->wfac, &off->wpot, &off->c.wdx);
+
+    /* Tree particles in walk order, so a leaf is contiguous on the device*/
+    int64_t i, nparts = 0;
+    for(i = 0; i < tree->NumWalkNodes; i++)
+        if(tree->WalkNodes[i].ChildType == PARTICLE_NODE_TYPE)
+            nparts = DMAX(nparts, tree->WalkNodes[i].first + tree->WalkNodes[i].noccupied);
+    off->NumParts = nparts;
+    off->Parts = (struct OffloadParticle *) mymalloc2("OffloadParts", DMAX(nparts, 1) * sizeof(struct OffloadParticle));
+    #pragma omp parallel for
+    for(i = 0; i < nparts; i++) {
+        const int p = tree->WalkParticles[i];
+        int k;
+        for(k = 0; k < 3; k++)
+            off->Parts[i].Pos[k] = P[p].Pos[k];
+        off->Parts[i].Mass = P[p].Mass;
+    }
+
+    off->Queries = (struct OffloadQuery *) mymalloc2("OffloadQueries", DMAX(NumActive, 1) * sizeof(struct OffloadQuery));
+    off->Results = (struct OffloadResult *) mymalloc2("OffloadResults", DMAX(NumActive, 1) * sizeof(struct OffloadResult));
+    #pragma omp parallel for
+    for(i = 0; i < NumActive; i++) {
+        const int p = ActiveParticle ? ActiveParticle[i] : i;
+        int k;
+        for(k = 0; k < 3; k++)
+            off->Queries[i].Pos[k] = P[p].Pos[k];
+        off->Queries[i].aold = TreeParams.ErrTolForceAcc * grav_get_abs_accel(&P[p], priv->G);
+    }
+
+    message(0, "Offloading the local gravity walk of %ld particles to %d devices.\n", NumActive, omp_get_num_devices());
+
+    /* Local copies, as the map clauses take variables*/
+    const struct WalkNode * Nodes = tree->WalkNodes;
+    const float (*Quad)[6] = (const float (*)[6]) tree->WalkQuadrupoles;
+    const int64_t nnodes = tree->NumWalkNodes;
+    const int64_t nquad = Quad ? nnodes : 0;
+    const struct OffloadParticle * Parts = off->Parts;
+    const struct OffloadQuery * Queries = off->Queries;
+    struct OffloadResult * Results = off->Results;
+    const float * wfac = off->wfac;
+    const float * wpot = off->wpot;
+    const int ntab = off->c.ntab;
+    const struct OffloadConsts c = off->c;
+
+    /* Deferred: the host walks the mass on other ranks meanwhile. Waited for in grav_short_offload_end.*/
+    #pragma omp target teams distribute parallel for nowait \
+        map(to: Nodes[0:nnodes], Quad[0:nquad], Parts[0:nparts], Queries[0:NumActive], wfac[0:ntab], wpot[0:ntab], c) \
+        map(from: Results[0:NumActive])
+    for(i = 0; i < NumActive; i++) {
+        struct OffloadResult out = {{0}, 0};
+        offload_walk_particle(&Queries[i], &out, Nodes, nquad ? Quad : NULL, Parts, &c, wfac, wpot);
+        Results[i] = out;
+    }
+    walltime_measure("/Tree/Offload");
+    return off;
+}
+
+double
+grav_short_offload_end(struct GravShortOffload * off, MyFloat (*Accel)[3], const int Potential)
+{
+    const double tstart = MPI_Wtime();
+    #pragma omp taskwait
+    const double twait = MPI_Wtime() - tstart;
+
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < off->NumActive; i++) {
+        const int p = off->ActiveParticle ? off->ActiveParticle[i] : i;
+        if(P[p].IsGarbage || P[p].Swallowed)
+            continue;
+        int k;
+        for(k = 0; k < 3; k++)
+            Accel[p][k] += off->Results[i].Acc[k];
+        if(Potential)
+            P[p].Potential += off->Results[i].Potential;
+    }
+    myfree(off->Results);
+    myfree(off->Queries);
+    myfree(off->Parts);
+    myfree(off);
+    return twait;
+}
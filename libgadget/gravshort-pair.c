@@ -19,39 +19,128 @@ grav_short_pair_ngbiter(
         TreeWalkNgbIterGravShort * iter,
         LocalTreeWalk * lv);
 
+static void
+grav_short_pair_ngbiter_batch(
+        TreeWalkQueryGravShort * I,
+        TreeWalkResultGravShort * O,
+        TreeWalkNgbIterGravShort * iter,
+        const TreeWalkNgbBatch * batch,
+        LocalTreeWalk * lv);
+
+/* State for the symmetric pairwise walk. The short-range private data must come first,
+ * so that GRAV_GET_PRIV works.*/
+struct GravPairPriv {
+    struct GravShortPriv base;
+    /* Non-zero for local particles which are active in this walk.*/
+    char * Active;
+    /* Accelerations and potentials of the active particles from the pairs evaluated by their partner.*/
+    MyFloat (*PairAccel)[3];
+    MyFloat * PairPotential;
+};
+
+#define GRAV_GET_PAIR_PRIV(tw) ((struct GravPairPriv *) ((tw)->priv))
+
+/* True if the pair of the query and neighbour other should be evaluated once for both particles:
+ * only in the primary walk, where the query is the local particle lv->target, and if the neighbour is also active
+ * and uses the same force split.*/
+static inline int
+grav_short_pair_is_symmetric(const int other, const LocalTreeWalk * lv)
+{
+    const struct GravPairPriv * pair = GRAV_GET_PAIR_PRIV(lv->tw);
+    return pair->Active && lv->mode == TREEWALK_PRIMARY && other != lv->target && pair->Active[other]
+        && P[other].HighResPM == P[lv->target].HighResPM;
+}
+
+/* Add the force from the query to the neighbour other. dist points from the neighbour to the query,
+ * and fac and pot are for the mass of the query.*/
+static inline void
+grav_short_pair_scatter(struct GravPairPriv * pair, const int other, const double dist[3], const double fac, const double pot)
+{
+    int d;
+    for(d = 0; d < 3; d ++) {
+        #pragma omp atomic update
+        pair->PairAccel[other][d] += dist[d] * fac;
+    }
+    #pragma omp atomic update
+    pair->PairPotential[other] += pot;
+}
+
+static void
+grav_short_pair_postprocess(int i, TreeWalk * tw)
+{
+    struct GravPairPriv * pair = GRAV_GET_PAIR_PRIV(tw);
+    if(pair->Active) {
+        int d;
+        for(d = 0; d < 3; d++)
+            pair->base.Accel[i][d] += pair->PairAccel[i][d];
+        if(tw->tree->full_particle_tree_flag)
+            P[i].Potential += pair->PairPotential[i];
+    }
+    grav_short_postprocess(i, tw);
+}
+
 void
 grav_short_pair(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double Rcut, double rho0)
 {
     TreeWalk tw[1] = {{0}};
 
-    struct GravShortPriv priv;
-    priv.cellsize = tree->BoxSize / pm->Nmesh;
-    priv.Rcut = Rcut * pm->Asmth * priv.cellsize;
-    priv.G = pm->G;
-    priv.cbrtrho0 = pow(rho0, 1.0 / 3);
-    priv.Accel = (MyFloat (*) [3]) mymalloc2("GravAccel", PartManager->NumPart * sizeof(priv.Accel[0]));
+    struct GravPairPriv pair = {0};
+    struct GravShortPriv * priv = &pair.base;
+    priv->cellsize = tree->BoxSize / pm->Nmesh;
+    priv->Rcut = Rcut * pm->Asmth * priv->cellsize;
+    priv->cellsize_highres = gravpm_highres_cellsize();
+    priv->Rcut_highres = Rcut * pm->Asmth * priv->cellsize_highres;
+    priv->G = pm->G;
+    priv->cbrtrho0 = pow(rho0, 1.0 / 3);
+    priv->Accel = (MyFloat (*) [3]) mymalloc2("GravAccel", PartManager->NumPart * sizeof(priv->Accel[0]));
+    priv->FMM = 0;
+
+    /* In symmetric mode each pair of local active particles is evaluated once, by the particle with the lower index,
+     * and the opposite force is added to the partner. Pairs with inactive or remote particles are evaluated as before.*/
+    if(get_gravshort_treepar().PairSymmetric) {
+        int64_t i;
+        pair.Active = (char *) mymalloc("PairActive", PartManager->NumPart * sizeof(char));
+        pair.PairAccel = (MyFloat (*) [3]) mymalloc2("PairAccel", PartManager->NumPart * sizeof(pair.PairAccel[0]));
+        pair.PairPotential = (MyFloat *) mymalloc2("PairPotential", PartManager->NumPart * sizeof(pair.PairPotential[0]));
+        memset(pair.PairAccel, 0, PartManager->NumPart * sizeof(pair.PairAccel[0]));
+        memset(pair.PairPotential, 0, PartManager->NumPart * sizeof(pair.PairPotential[0]));
+        memset(pair.Active, act->ActiveParticle ? 0 : 1, PartManager->NumPart * sizeof(char));
+        if(act->ActiveParticle) {
+            #pragma omp parallel for
+            for(i = 0; i < act->NumActiveParticle; i++)
+                pair.Active[act->ActiveParticle[i]] = 1;
+        }
+    }
 
     message(0, "Starting pair-wise short range gravity...\n");
 
     tw->ev_label = "GRAV_SHORT";
+    tw->WritesNeighbours = 1;
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterGravShort);
     tw->ngbiter = (TreeWalkNgbIterFunction) grav_short_pair_ngbiter;
+    if(get_gravshort_treepar().MixedPrecision)
+        tw->ngbiter_batch = (TreeWalkNgbBatchFunction) grav_short_pair_ngbiter_batch;
 
     tw->haswork = NULL;
     tw->fill = (TreeWalkFillQueryFunction) grav_short_copy;
     tw->reduce = (TreeWalkReduceResultFunction) grav_short_reduce;
-    tw->postprocess = (TreeWalkProcessFunction) grav_short_postprocess;
+    tw->postprocess = (TreeWalkProcessFunction) grav_short_pair_postprocess;
     tw->query_type_elsize = sizeof(TreeWalkQueryGravShort);
     tw->result_type_elsize = sizeof(TreeWalkResultGravShort);
     tw->tree = tree;
-    tw->priv = &priv;
+    tw->priv = &pair;
 
     walltime_measure("/Misc");
 
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
 
-    myfree(priv.Accel);
+    if(pair.Active) {
+        myfree(pair.PairPotential);
+        myfree(pair.PairAccel);
+        myfree(pair.Active);
+    }
+    myfree(priv->Accel);
     walltime_measure("/Tree/Pairwise");
 }
 
@@ -63,10 +152,11 @@ grav_short_pair_ngbiter(
         TreeWalkNgbIterGravShort * iter,
         LocalTreeWalk * lv)
 {
-    const double cellsize = GRAV_GET_PRIV(lv->tw)->cellsize;
+    double cellsize, rcut;
+    grav_short_query_split(I, GRAV_GET_PRIV(lv->tw), &cellsize, &rcut);
 
     if(iter->base.other == -1) {
-        iter->base.Hsml = GRAV_GET_PRIV(lv->tw)->Rcut;
+        iter->base.Hsml = rcut;
         iter->base.mask = ALLMASK; /* all particles */
         iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
         return;
@@ -82,24 +172,28 @@ grav_short_pair_ngbiter(
                   " We haven't implemented tracer particles and this shall not happen\n");
     }
 
-    double mass = P[other].Mass;
+    /* The pair is evaluated only once, from the lower index.*/
+    const int symmetric = grav_short_pair_is_symmetric(other, lv);
+    if(symmetric && other < lv->target)
+        return;
 
     const double h = FORCE_SOFTENING();
+    /* Force and potential per unit mass of the source*/
     double fac, pot;
 
     if(r >= h) {
-        fac = mass / (r2 * r);
-        pot = -mass / r;
+        fac = 1 / (r2 * r);
+        pot = -1 / r;
     } else {
         double h_inv = 1.0 / h;
         double h3_inv = h_inv * h_inv * h_inv;
         double u = r * h_inv;
         double wp;
         if(u < 0.5)
-            fac = mass * h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
+            fac = h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
         else
             fac =
-                mass * h3_inv * (21.333333333333 - 48.0 * u +
+                h3_inv * (21.333333333333 - 48.0 * u +
                         38.4 * u * u - 10.666666666667 * u * u * u - 0.066666666667 / (u * u * u));
         if(u < 0.5)
             wp = -2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6));
@@ -108,14 +202,67 @@ grav_short_pair_ngbiter(
                 -3.2 + 0.066666666667 / u + u * u * (10.666666666667 +
                         u * (-16.0 + u * (9.6 - 2.133333333333 * u)));
 
-        pot = mass * h_inv * wp;
+        pot = h_inv * wp;
     }
 
     if (grav_apply_short_range_window(r, &fac, &pot, cellsize) == 0) {
+        const double mass = P[other].Mass;
         int d;
         for(d = 0; d < 3; d ++)
-            O->Acc[d] += - dist[d] * fac;
+            O->Acc[d] += - dist[d] * fac * mass;
+
+        O->Potential += pot * mass;
+        if(symmetric)
+            grav_short_pair_scatter(GRAV_GET_PAIR_PRIV(lv->tw), other, dist, fac * P[lv->target].Mass, pot * P[lv->target].Mass);
+    }
+}
 
-        O->Potential += pot;
+/* Mixed precision version of grav_short_pair_ngbiter for a batch of neighbours: the kernel is evaluated in single precision
+ * and summed in double.*/
+static void
+grav_short_pair_ngbiter_batch(
+        TreeWalkQueryGravShort * I,
+        TreeWalkResultGravShort * O,
+        TreeWalkNgbIterGravShort * iter,
+        const TreeWalkNgbBatch * batch,
+        LocalTreeWalk * lv)
+{
+    double cellsize, rcut;
+    grav_short_query_split(I, GRAV_GET_PRIV(lv->tw), &cellsize, &rcut);
+    float r2[NGB_BATCH_SIZE], mass[NGB_BATCH_SIZE], fac[NGB_BATCH_SIZE], pot[NGB_BATCH_SIZE];
+    /* Position in the batch of each evaluated neighbour, and whether the pair is symmetric*/
+    int index[NGB_BATCH_SIZE], symmetric[NGB_BATCH_SIZE];
+    int j, n = 0;
+    for(j = 0; j < batch->n; j++) {
+        if(P[batch->other[j]].Mass == 0)
+            endrun(12, "Encountered zero mass particle during density;"
+                  " We haven't implemented tracer particles and this shall not happen\n");
+        const int sym = grav_short_pair_is_symmetric(batch->other[j], lv);
+        if(sym && batch->other[j] < lv->target)
+            continue;
+        index[n] = j;
+        symmetric[n] = sym;
+        r2[n] = batch->r2[j];
+        /* Unit mass, so the factors can be used for both particles of the pair*/
+        mass[n] = 1;
+        n++;
+    }
+    grav_short_kernel_float(n, r2, mass, fac, pot, FORCE_SOFTENING(), cellsize);
+    double acc[3] = {0}, potential = 0;
+    for(j = 0; j < n; j++) {
+        const int k = index[j];
+        const double m = P[batch->other[k]].Mass;
+        acc[0] -= batch->dist[0][k] * fac[j] * m;
+        acc[1] -= batch->dist[1][k] * fac[j] * m;
+        acc[2] -= batch->dist[2][k] * fac[j] * m;
+        potential += pot[j] * m;
+        if(symmetric[j]) {
+            const double dist[3] = {batch->dist[0][k], batch->dist[1][k], batch->dist[2][k]};
+            grav_short_pair_scatter(GRAV_GET_PAIR_PRIV(lv->tw), batch->other[k], dist, fac[j] * P[lv->target].Mass, pot[j] * P[lv->target].Mass);
+        }
     }
+    int d;
+    for(d = 0; d < 3; d ++)
+        O->Acc[d] += acc[d];
+    O->Potential += potential;
 }
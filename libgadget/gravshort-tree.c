@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ipc.h>
@@ -29,6 +30,15 @@
 static struct gravshort_tree_params TreeParams;
 /*Softening length*/
 static double GravitySoftening;
+/* The spline softening length, FORCE_SOFTENING(), with its square and inverse powers,
+ * computed once so the walk does not divide by the softening on each interaction.
+ * The softening is the same for all particle types.*/
+static struct {
+    double h;
+    double h2;
+    double h_inv;
+    double h3_inv;
+} Softening;
 
 /* gravitational softening length
  * (given in terms of an `equivalent' Plummer softening length)
@@ -44,6 +54,10 @@ void
 gravshort_set_softenings(double MeanSeparation)
 {
     GravitySoftening = TreeParams.FractionalGravitySoftening * MeanSeparation;
+    Softening.h = FORCE_SOFTENING();
+    Softening.h2 = Softening.h * Softening.h;
+    Softening.h_inv = 1 / Softening.h;
+    Softening.h3_inv = Softening.h_inv * Softening.h_inv * Softening.h_inv;
     /* 0: Gas is collisional */
     message(0, "GravitySoftening = %g\n", GravitySoftening);
 }
@@ -64,7 +78,7 @@ void
 set_gravshort_tree_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         TreeParams.BHOpeningAngle = param_get_double(ps, "BHOpeningAngle");
         TreeParams.ErrTolForceAcc = param_get_double(ps, "ErrTolForceAcc");
@@ -72,8 +86,21 @@ set_gravshort_tree_params(ParameterSet * ps)
         TreeParams.Rcut = param_get_double(ps, "TreeRcut");
         TreeParams.FractionalGravitySoftening = param_get_double(ps, "GravitySoftening");
         TreeParams.MaxBHOpeningAngle = param_get_double(ps, "MaxBHOpeningAngle");
+        TreeParams.BucketWalk = param_get_int(ps, "TreeBucketWalk");
+        TreeParams.CompactWalk = param_get_int(ps, "TreeCompactWalk");
+        TreeParams.Quadrupole = param_get_int(ps, "TreeQuadrupole");
+        TreeParams.FMM = param_get_int(ps, "TreeFMM");
+        TreeParams.MixedPrecision = param_get_int(ps, "TreeMixedPrecision");
+        TreeParams.Offload = param_get_int(ps, "TreeOffload");
+        TreeParams.PairSymmetric = param_get_int(ps, "TreePairSymmetric");
+        TreeParams.ErrTolTargetRMS = param_get_double(ps, "ErrTolTargetRMS");
+        TreeParams.ErrTolForceAccMin = param_get_double(ps, "ErrTolForceAccMin");
+        TreeParams.ErrTolForceAccMax = param_get_double(ps, "ErrTolForceAccMax");
+        TreeParams.ErrTolSamples = param_get_int(ps, "ErrTolSamples");
+        if(TreeParams.ErrTolTargetRMS > 0 && TreeParams.ErrTolForceAccMin > TreeParams.ErrTolForceAccMax)
+            endrun(1, "ErrTolForceAccMin %g is larger than ErrTolForceAccMax %g\n", TreeParams.ErrTolForceAccMin, TreeParams.ErrTolForceAccMax);
     }
-    MPI_Bcast(&TreeParams, sizeof(struct gravshort_tree_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TreeParams, sizeof(struct gravshort_tree_params), MPI_BYTE, 0, GadgetComm);
 }
 
 int
@@ -81,6 +108,18 @@ force_treeev_shortrange(TreeWalkQueryGravShort * input,
         TreeWalkResultGravShort * output,
         LocalTreeWalk * lv);
 
+int
+force_treeev_shortrange_bucket(TreeWalkQueryGravShort * input,
+        TreeWalkResultGravShort * output,
+        const int nquery,
+        LocalTreeWalk * lv);
+
+static void
+grav_short_fmm(const ForceTree * tree, MyFloat (*Accel)[3], MyFloat * Potential, const struct GravShortPriv * priv);
+
+static void
+grav_short_calibrate_opening(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double rho0, inttime_t Ti_Current);
+
 /*! This function computes the gravitational forces for all active particles from all particles in the tree.
  * Particles are only exported to other processors when really
  *  needed, thereby allowing a good use of the communication buffer.
@@ -99,6 +138,9 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
     struct GravShortPriv priv;
     priv.cellsize = tree->BoxSize / pm->Nmesh;
     priv.Rcut = TreeParams.Rcut * pm->Asmth * priv.cellsize;;
+    /* Particles inside the high resolution PM mesh use its smaller split scale*/
+    priv.cellsize_highres = gravpm_highres_cellsize();
+    priv.Rcut_highres = TreeParams.Rcut * pm->Asmth * priv.cellsize_highres;
     priv.G = pm->G;
     priv.cbrtrho0 = pow(rho0, 1.0 / 3);
     priv.Ti_Current = Ti_Current;
@@ -123,9 +165,111 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
     tw->result_type_elsize = sizeof(TreeWalkResultGravShort);
     tw->fill = (TreeWalkFillQueryFunction) grav_short_copy;
     tw->tree = tree;
+    tw->WorkSteal = 1;
+    tw->ShareNodeTrees = 1;
+    /* On PM steps all particles are active and in the tree, so the interactions
+     * between local particles can be done by the fast multipole solver.
+     * Every particle walked must be a sink in the tree (hybrid neutrinos may not be).*/
+    priv.FMM = 0;
+    /* The dual tree walk, the accelerator walk and the bucketed walk assume one split scale for all particles.*/
+    if(TreeParams.FMM && tree->full_particle_tree_flag && !act->ActiveParticle && !priv.cellsize_highres) {
+        int64_t i, nwalk = 0;
+        #pragma omp parallel for reduction(+: nwalk)
+        for(i = 0; i < PartManager->NumPart; i++)
+            if(!P[i].IsGarbage && !P[i].Swallowed)
+                nwalk++;
+        priv.FMM = !MPIU_Any(nwalk != tree->NumParticles, GadgetComm);
+    }
+    /* The local tree is walked on the accelerator from the compact walk nodes.*/
+    priv.Offload = TreeParams.Offload && !priv.FMM && !priv.cellsize_highres;
+    /* On PM steps record the work done for each particle for the domain decomposition.
+     * The local interactions are not counted by the multipole and accelerator walks.*/
+    priv.StoreCost = tree->full_particle_tree_flag && !priv.FMM && !priv.Offload;
+    if(TreeParams.BucketWalk && !priv.FMM && !priv.Offload && !priv.cellsize_highres) {
+        tw->type = TREEWALK_BUCKET;
+        tw->visit_bucket = (TreeWalkVisitBucketFunction) force_treeev_shortrange_bucket;
+    }
     tw->priv = &priv;
 
+    /* The dual tree walk and the bucketed walk test the relative criterion once for a group of sinks*/
+    int minaccalloc = 0;
+    if(TreeParams.TreeUseBH == 0 && (priv.FMM || tw->type == TREEWALK_BUCKET) && !tree->MinAccel) {
+        force_tree_calc_min_accel(tree);
+        minaccalloc = 1;
+    }
+
+    MyFloat (*FMMAccel)[3] = NULL;
+    MyFloat * FMMPotential = NULL;
+    if(priv.FMM) {
+        FMMAccel = (MyFloat (*) [3]) mymalloc2("FMMAccel", PartManager->NumPart * sizeof(FMMAccel[0]));
+        FMMPotential = (MyFloat *) mymalloc2("FMMPotential", PartManager->NumPart * sizeof(MyFloat));
+        memset(FMMAccel, 0, PartManager->NumPart * sizeof(FMMAccel[0]));
+        memset(FMMPotential, 0, PartManager->NumPart * sizeof(MyFloat));
+        grav_short_fmm(tree, FMMAccel, FMMPotential, &priv);
+        /* The accelerations are only complete once the local part is added*/
+        tw->postprocess = NULL;
+    }
+
+    int quadalloc = 0;
+    if(TreeParams.Quadrupole && !tree->Quadrupoles) {
+        force_tree_calc_quadrupoles(tree);
+        quadalloc = 1;
+    }
+    /* The bucketed walk uses the full nodes*/
+    int walknodesalloc = 0;
+    if(((TreeParams.CompactWalk && !TreeParams.BucketWalk) || priv.Offload) && !tree->WalkNodes) {
+        force_tree_make_walk_nodes(tree);
+        walknodesalloc = 1;
+    }
+
+    struct GravShortOffload * off = NULL;
+    if(priv.Offload) {
+        off = grav_short_offload_begin(tree, act->ActiveParticle, act->NumActiveParticle, &priv);
+        /* The accelerations are only complete once the local part is added*/
+        tw->postprocess = NULL;
+    }
+
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
+    /* The lists made by this walk are read by the walk on the next refit*/
+    force_tree_swap_interaction_lists(tree);
+
+    double timeoffload = 0;
+    if(priv.Offload) {
+        timeoffload = grav_short_offload_end(off, priv.Accel, tree->full_particle_tree_flag);
+        int64_t i;
+        #pragma omp parallel for
+        for(i = 0; i < act->NumActiveParticle; i++) {
+            const int p = act->ActiveParticle ? act->ActiveParticle[i] : i;
+            if(P[p].IsGarbage || P[p].Swallowed)
+                continue;
+            grav_short_postprocess(p, tw);
+        }
+        walltime_add("/Tree/Offload", timeoffload);
+    }
+
+    if(walknodesalloc)
+        force_tree_free_walk_nodes(tree);
+    if(quadalloc)
+        force_tree_free_quadrupoles(tree);
+    if(minaccalloc)
+        force_tree_free_min_accel(tree);
+
+    if(priv.FMM) {
+        int64_t i;
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++) {
+            /* Same particles as the treewalk queue*/
+            if(P[i].IsGarbage || P[i].Swallowed)
+                continue;
+            int k;
+            for(k = 0; k < 3; k++)
+                priv.Accel[i][k] += FMMAccel[i][k];
+            P[i].Potential += FMMPotential[i];
+            grav_short_postprocess(i, tw);
+        }
+        myfree(FMMPotential);
+        myfree(FMMAccel);
+    }
 
     /* Now the force computation is finished */
     /*  gather some diagnostic information */
@@ -140,10 +284,15 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
 
     double timeall = walltime_measure(WALLTIME_IGNORE);
 
-    walltime_add("/Tree/Misc", timeall - (timetree + tw->timewait1 + tw->timecommsumm));
+    walltime_add("/Tree/Misc", timeall - (timetree + tw->timewait1 + tw->timecommsumm + timeoffload));
 
     treewalk_print_stats(tw);
 
+    /* On PM steps, tune the opening criterion for the next step from the force error of a sample.
+     * Only the relative acceleration criterion is tuned.*/
+    if(TreeParams.ErrTolTargetRMS > 0 && TreeParams.TreeUseBH == 0 && tree->full_particle_tree_flag)
+        grav_short_calibrate_opening(act, pm, tree, rho0, Ti_Current);
+
     /* TreeUseBH > 1 means use the BH criterion on the initial timestep only,
      * avoiding the fully open O(N^2) case.*/
     if(TreeParams.TreeUseBH > 1)
@@ -152,6 +301,83 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
         myfree(priv.Accel);
 }
 
+/* Compares the tree accelerations just computed with the pairwise accelerations for a sample of particles,
+ * and rescales ErrTolForceAcc so that the RMS error relative to the total acceleration approaches the target.
+ * The relative error scales roughly linearly with ErrTolForceAcc. The change on one step is limited to a factor of two,
+ * and the tolerance is kept within the user bounds. The sample particle accelerations and potentials are restored.*/
+static void
+grav_short_calibrate_opening(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double rho0, inttime_t Ti_Current)
+{
+    int64_t totpart = count_sum(act->NumActiveParticle);
+    int64_t stride = totpart / DMAX(TreeParams.ErrTolSamples, 1);
+    if(stride < 1)
+        stride = 1;
+    /* A different sample each time*/
+    const int64_t offset = Ti_Current % stride;
+
+    ActiveParticles sample = {0};
+    sample.MaxActiveParticle = act->NumActiveParticle / stride + 1;
+    sample.ActiveParticle = (int *) mymalloc("CalibrateSample", sample.MaxActiveParticle * sizeof(int));
+    int64_t i;
+    for(i = offset; i < act->NumActiveParticle; i += stride) {
+        const int p = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        if(P[p].IsGarbage || P[p].Swallowed)
+            continue;
+        sample.ActiveParticle[sample.NumActiveParticle++] = p;
+    }
+    sample.NumActiveGravity = sample.NumActiveParticle;
+    sample.Particles = PartManager->Base;
+
+    MyFloat (*TreeAccel)[3] = (MyFloat (*) [3]) mymalloc2("CalibrateAccel", (sample.NumActiveParticle + 1) * sizeof(TreeAccel[0]));
+    MyFloat * TreePotential = (MyFloat *) mymalloc2("CalibratePotential", (sample.NumActiveParticle + 1) * sizeof(MyFloat));
+    #pragma omp parallel for
+    for(i = 0; i < sample.NumActiveParticle; i++) {
+        const int p = sample.ActiveParticle[i];
+        int k;
+        for(k = 0; k < 3; k++)
+            TreeAccel[i][k] = P[p].FullTreeGravAccel[k];
+        TreePotential[i] = P[p].Potential;
+    }
+
+    grav_short_pair(&sample, pm, tree, TreeParams.Rcut, rho0);
+
+    double sumerr2 = 0;
+    int64_t nsample = 0;
+    #pragma omp parallel for reduction(+: sumerr2, nsample)
+    for(i = 0; i < sample.NumActiveParticle; i++) {
+        const int p = sample.ActiveParticle[i];
+        double err2 = 0, acc2 = 0;
+        int k;
+        for(k = 0; k < 3; k++) {
+            const double acc = P[p].FullTreeGravAccel[k] + P[p].GravPM[k];
+            err2 += pow(TreeAccel[i][k] - P[p].FullTreeGravAccel[k], 2);
+            acc2 += acc * acc;
+            P[p].FullTreeGravAccel[k] = TreeAccel[i][k];
+        }
+        P[p].Potential = TreePotential[i];
+        if(acc2 > 0) {
+            sumerr2 += err2 / acc2;
+            nsample++;
+        }
+    }
+    myfree(TreePotential);
+    myfree(TreeAccel);
+    myfree(sample.ActiveParticle);
+
+    MPI_Allreduce(MPI_IN_PLACE, &sumerr2, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &nsample, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    if(nsample == 0)
+        return;
+    const double rmserr = sqrt(sumerr2 / nsample);
+    double factor = rmserr > 0 ? TreeParams.ErrTolTargetRMS / rmserr : 2;
+    factor = DMAX(DMIN(factor, 2), 0.5);
+    const double oldtol = TreeParams.ErrTolForceAcc;
+    TreeParams.ErrTolForceAcc = DMAX(DMIN(oldtol * factor, TreeParams.ErrTolForceAccMax), TreeParams.ErrTolForceAccMin);
+    message(0, "Tree force RMS relative error %g from %ld particles (target %g). ErrTolForceAcc %g -> %g\n",
+            rmserr, nsample, TreeParams.ErrTolTargetRMS, oldtol, TreeParams.ErrTolForceAcc);
+    walltime_measure("/Tree/Calibrate");
+}
+
 /* Add the acceleration from a node or particle to the output structure,
  * computing the short-range kernel and softening.*/
 static void
@@ -159,15 +385,14 @@ apply_accn_to_output(TreeWalkResultGravShort * output, const double dx[3], const
 {
     const double r = sqrt(r2);
 
-    const double h = FORCE_SOFTENING();
     double fac = mass / (r2 * r);
     double facpot = -mass / r;
 
-    if(r2 < h*h)
+    if(r2 < Softening.h2)
     {
         double wp;
-        const double h3_inv = 1.0 / h / h / h;
-        const double u = r / h;
+        const double h3_inv = Softening.h3_inv;
+        const double u = r * Softening.h_inv;
         if(u < 0.5) {
             fac = mass * h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
             wp = -2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6));
@@ -180,7 +405,7 @@ apply_accn_to_output(TreeWalkResultGravShort * output, const double dx[3], const
                 -3.2 + 0.066666666667 / u + u * u * (10.666666666667 +
                         u * (-16.0 + u * (9.6 - 2.133333333333 * u)));
         }
-        facpot = mass / h * wp;
+        facpot = mass * Softening.h_inv * wp;
     }
 
     if(0 == grav_apply_short_range_window(r, &fac, &facpot, cellsize)) {
@@ -191,52 +416,140 @@ apply_accn_to_output(TreeWalkResultGravShort * output, const double dx[3], const
     }
 }
 
-/* Check whether a node should be discarded completely, its contents not contributing
- * to the acceleration. This happens if the node is further away than the short-range force cutoff.
- * Return 1 if the node should be discarded, 0 otherwise. */
+/* Add the acceleration from a list of particles to the output structure, as apply_accn_to_output in mixed precision.
+ * The separations from the query are computed in double and then rounded to single precision, as they are small
+ * compared to the positions. The kernel is evaluated in single precision for a block of particles at a time,
+ * and the block is summed into the output in double.*/
+static void
+apply_particles_to_output_float(TreeWalkResultGravShort * output, const int * list, const int numcand, const struct particle_data * const Parts,
+        const double inpos[3], const double BoxSize, const double cellsize)
+{
+    const float h = Softening.h;
+    int start;
+    for(start = 0; start < numcand; start += GRAV_FLOAT_BLOCK) {
+        const int n = (numcand - start < GRAV_FLOAT_BLOCK) ? numcand - start : GRAV_FLOAT_BLOCK;
+        float dx[3][GRAV_FLOAT_BLOCK], r2[GRAV_FLOAT_BLOCK], mass[GRAV_FLOAT_BLOCK];
+        float fac[GRAV_FLOAT_BLOCK], pot[GRAV_FLOAT_BLOCK];
+        int j, d;
+        for(j = 0; j < n; j++) {
+            const int pp = list[start + j];
+            for(d = 0; d < 3; d++)
+                dx[d][j] = NEAREST(Parts[pp].Pos[d] - inpos[d], BoxSize);
+            mass[j] = Parts[pp].Mass;
+        }
+        for(j = 0; j < n; j++)
+            r2[j] = dx[0][j] * dx[0][j] + dx[1][j] * dx[1][j] + dx[2][j] * dx[2][j];
+        grav_short_kernel_float(n, r2, mass, fac, pot, h, cellsize);
+        double acc[3] = {0}, potential = 0;
+        for(j = 0; j < n; j++) {
+            acc[0] += dx[0][j] * fac[j];
+            acc[1] += dx[1][j] * fac[j];
+            acc[2] += dx[2][j] * fac[j];
+            potential += pot[j];
+        }
+        for(d = 0; d < 3; d++)
+            output->Acc[d] += acc[d];
+        output->Potential += potential;
+    }
+}
+
+/* Add the acceleration from the quadrupole moment q of a node, at offset dx from the particle.
+ * Only applied outside the softening length, where the monopole kernel is Newtonian. The short-range
+ * window is applied as for the monopole, neglecting its gradient across the node.*/
+static void
+apply_quadrupole_to_output(TreeWalkResultGravShort * output, const double dx[3], const double r2, const double q[6], const double cellsize)
+{
+    if(r2 < Softening.h2)
+        return;
+    const double r = sqrt(r2);
+    double fac = 1, facpot = 1;
+    if(grav_apply_short_range_window(r, &fac, &facpot, cellsize))
+        return;
+    const double qdx[3] = {
+        q[0] * dx[0] + q[1] * dx[1] + q[2] * dx[2],
+        q[1] * dx[0] + q[3] * dx[1] + q[4] * dx[2],
+        q[2] * dx[0] + q[4] * dx[1] + q[5] * dx[2],
+    };
+    const double dxqdx = dx[0] * qdx[0] + dx[1] * qdx[1] + dx[2] * qdx[2];
+    const double r5inv = 1 / (r2 * r2 * r);
+    int i;
+    for(i = 0; i < 3; i++)
+        output->Acc[i] += fac * r5inv * (2.5 * dxqdx / r2 * dx[i] - qdx[i]);
+    output->Potential -= facpot * 0.5 * dxqdx * r5inv;
+}
+
+/* Local part of the short-range walk, using the compact walk nodes of the tree.
+ * Starts at the tree node startno. Nodes which are used are added to the output directly,
+ * and particles in opened leaves are added to the neighbour list. Returns the number of particles added.*/
 static int
-shall_we_discard_node(const double len, const double r2, const double center[3], const double inpos[3], const double BoxSize, const double rcut, const double rcut2)
+force_treeev_shortrange_walknodes(const ForceTree * tree, const int startno, const double inpos[3], TreeWalkResultGravShort * output,
+        const double aold, const int TreeUseBH, const double BHOpeningAngle2, const double rcut, const double rcut2, const double cellsize, LocalTreeWalk * lv)
 {
-    /* This checks the distance from the node center of mass
-     * is greater than the cutoff. */
-    if(r2 > rcut2)
+    const double BoxSize = tree->BoxSize;
+    const int start = tree->WalkIndex[startno - tree->firstnode];
+    const int Quadrupole = tree->WalkQuadrupoles != NULL;
+    int numcand = 0;
+    int no = start;
+    while(no >= 0)
     {
-        /* check whether we can stop walking along this branch */
-        const double eff_dist = rcut + 0.5 * len;
+        const struct WalkNode * nop = &tree->WalkNodes[no];
+
+        if(lv->mode == TREEWALK_GHOSTS && nop->TopLevel && no != start)  /* we reached a top-level node again, which means that we are done with the branch */
+            break;
+
         int i;
-        /*This checks whether we are also outside this region of the oct-tree*/
-        /* As long as one dimension is outside, we are fine*/
-        for(i=0; i < 3; i++)
-            if(fabs(NEAREST(center[i] - inpos[i], BoxSize)) > eff_dist)
-                return 1;
+        double center[3], dx[3];
+        for(i = 0; i < 3; i++) {
+            center[i] = nop->center[i];
+            dx[i] = NEAREST(center[i] + nop->cofm[i] - inpos[i], BoxSize);
+        }
+        const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+
+        /* Discard this node, move to sibling*/
+        if(shall_we_discard_node(nop->len, r2, center, inpos, BoxSize, rcut, rcut2))
+        {
+            no = nop->sibling;
+            continue;
+        }
+
+        /* This node accelerates the particle directly, and is not opened.*/
+        if(!shall_we_open_node(nop->len, nop->mass, r2, center, inpos, BoxSize, aold, TreeUseBH, BHOpeningAngle2, Quadrupole))
+        {
+            apply_accn_to_output(output, dx, r2, nop->mass, cellsize);
+            if(Quadrupole) {
+                double q[6];
+                for(i = 0; i < 6; i++)
+                    q[i] = tree->WalkQuadrupoles[no][i];
+                apply_quadrupole_to_output(output, dx, r2, q, cellsize);
+            }
+            no = nop->sibling;
+            continue;
+        }
+
+        if(nop->ChildType == PARTICLE_NODE_TYPE)
+        {
+            for(i = 0; i < nop->noccupied; i++)
+                lv->ngblist[numcand++] = tree->WalkParticles[nop->first + i];
+            no = nop->sibling;
+        }
+        else if (nop->ChildType == PSEUDO_NODE_TYPE)
+            /* Remote nodes are evaluated by the export*/
+            no = nop->sibling;
+        else
+            /* The first child is the next node in walk order*/
+            no = no + 1;
     }
-    return 0;
+    return numcand;
 }
 
-/* This function tests whether a node shall be opened (ie, should the next node be .
- * If it should be discarded, 0 is returned.
- * If it should be used, 1 is returned, otherwise zero is returned. */
-static int
-shall_we_open_node(const double len, const double mass, const double r2, const double center[3], const double inpos[3], const double BoxSize, const double aold, const int TreeUseBH, const double BHOpeningAngle2)
+/* Add a node to an interaction list of at most GRAV_MAX_INTERACTION_LIST nodes.
+ * The count keeps increasing past the end, to show that the list overflowed.*/
+static inline void
+add_to_interaction_list(int * list, int * nlist, const int no)
 {
-    /* Check the relative acceleration opening condition*/
-    if((TreeUseBH == 0) && (mass * len * len > r2 * r2 * aold))
-         return 1;
-
-    double bhangle = len * len  / r2;
-     /*Check Barnes-Hut opening angle*/
-    if(bhangle > BHOpeningAngle2)
-         return 1;
-
-    const double inside = 0.6 * len;
-    /* Open the cell if we are inside it, even if the opening criterion is not satisfied.*/
-    if(fabs(NEAREST(center[0] - inpos[0], BoxSize)) < inside &&
-        fabs(NEAREST(center[1] - inpos[1], BoxSize)) < inside &&
-        fabs(NEAREST(center[2] - inpos[2], BoxSize)) < inside)
-        return 1;
-
-    /* ok, node can be used */
-    return 0;
+    if(*nlist < GRAV_MAX_INTERACTION_LIST)
+        list[*nlist] = no;
+    (*nlist)++;
 }
 
 /*! In the TreePM algorithm, the tree is walked only locally around the
@@ -253,15 +566,20 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
         TreeWalkResultGravShort * output,
         LocalTreeWalk * lv)
 {
-    const ForceTree * tree = lv->tw->tree;
+    /* This may be the tree of another rank on this node: see ShareNodeTrees*/
+    const ForceTree * tree = lv->tree;
+    const struct particle_data * const Parts = lv->Parts;
     const double BoxSize = tree->BoxSize;
 
     /*Tree-opening constants*/
-    const double cellsize = GRAV_GET_PRIV(lv->tw)->cellsize;
-    const double rcut = GRAV_GET_PRIV(lv->tw)->Rcut;
+    double cellsize, rcut;
+    grav_short_query_split(input, GRAV_GET_PRIV(lv->tw), &cellsize, &rcut);
     const double rcut2 = rcut * rcut;
     const double aold = TreeParams.ErrTolForceAcc * input->OldAcc;
     const int TreeUseBH = TreeParams.TreeUseBH;
+    const int Quadrupole = tree->Quadrupoles != NULL;
+    /* The local mass was done by the fast multipole solver or on the accelerator*/
+    const int fmm = GRAV_GET_PRIV(lv->tw)->FMM || GRAV_GET_PRIV(lv->tw)->Offload;
     double BHOpeningAngle2 = TreeParams.BHOpeningAngle * TreeParams.BHOpeningAngle;
     /* Enforce a maximum opening angle even for relative acceleration criterion, to avoid
      * pathological cases. Default value is 0.9, from Volker Springel.*/
@@ -271,6 +589,20 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
     /*Input particle data*/
     const double * inpos = input->base.Pos;
 
+    /* On a refit tree, the primary walk of the local tree starts from the nodes at which the walk of this particle
+     * stopped on the parent tree, and records where it stops for the next walk. Not with the compact walk nodes.*/
+    struct InteractionLists * lists = NULL;
+    if(tree->InteractionLists && lv->mode == TREEWALK_PRIMARY && tree == lv->tw->tree && !fmm && !tree->WalkNodes)
+        lists = tree->InteractionLists;
+    const int * startlist = NULL;
+    int nstart = 0;
+    if(lists && lists->Count[lists->Read][lv->target] >= 0) {
+        startlist = lists->List[lists->Read] + lists->Start[lists->Read][lv->target];
+        nstart = lists->Count[lists->Read][lv->target];
+    }
+    int intlist[GRAV_MAX_INTERACTION_LIST];
+    int nintlist = 0;
+
     /*Start the tree walk*/
     int listindex, ninteractions=0;
 
@@ -285,14 +617,47 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
         if(no < 0)
             break;
 
-        while(no >= 0)
+        /* With the fast multipole solver the primary walk only visits the toptree*/
+        if(tree->WalkNodes && lv->mode != TREEWALK_TOPTREE && !(fmm && lv->mode == TREEWALK_PRIMARY)) {
+            numcand = force_treeev_shortrange_walknodes(tree, no, inpos, output, aold, TreeUseBH, BHOpeningAngle2, rcut, rcut2, cellsize, lv);
+            /* Skip the walk of the full nodes*/
+            no = -1;
+        }
+
+        /* The subtree of each node of a stored list ends at the sibling of the node*/
+        int nextstart = 0, endno = -1;
+        if(startlist)
+            no = -1;
+        while((no >= 0 && no != endno) || nextstart < nstart)
         {
+            if(no < 0 || no == endno) {
+                no = startlist[nextstart++];
+                endno = tree->Nodes[no].sibling;
+                /* Emptied by the refit*/
+                if(tree->Nodes[no].mom.mass == 0) {
+                    no = -1;
+                    continue;
+                }
+            }
             /* The tree always walks internal nodes*/
             struct NODE *nop = &tree->Nodes[no];
 
             if(lv->mode == TREEWALK_GHOSTS && nop->f.TopLevel && no != startno)  /* we reached a top-level node again, which means that we are done with the branch */
                 break;
 
+            /* The fast multipole solver has done the local mass, so find only the mass on other ranks:
+             * skip local top leaves and open every toptree node containing local mass.*/
+            if(fmm && lv->mode != TREEWALK_GHOSTS && nop->f.TopLevel) {
+                if(!nop->f.InternalTopLevel && nop->f.ChildType != PSEUDO_NODE_TYPE) {
+                    no = nop->sibling;
+                    continue;
+                }
+                if(nop->f.InternalTopLevel && nop->f.DependsOnLocalMass) {
+                    no = nop->s.suns[0];
+                    continue;
+                }
+            }
+
             int i;
             double dx[3];
             for(i = 0; i < 3; i++)
@@ -302,22 +667,32 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
             /* Discard this node, move to sibling*/
             if(shall_we_discard_node(nop->len, r2, nop->center, inpos, BoxSize, rcut, rcut2))
             {
+                if(lists)
+                    add_to_interaction_list(intlist, &nintlist, no);
                 no = nop->sibling;
                 /* Don't add this node*/
                 continue;
             }
 
             /* This node accelerates the particle directly, and is not opened.*/
-            int open_node = shall_we_open_node(nop->len, nop->mom.mass, r2, nop->center, inpos, BoxSize, aold, TreeUseBH, BHOpeningAngle2);
+            int open_node = shall_we_open_node(nop->len, nop->mom.mass, r2, nop->center, inpos, BoxSize, aold, TreeUseBH, BHOpeningAngle2, Quadrupole);
 
             if(!open_node)
             {
                 /* ok, node can be used */
-                no = nop->sibling;
                 if(lv->mode != TREEWALK_TOPTREE) {
                     /* Compute the acceleration and apply it to the output structure*/
                     apply_accn_to_output(output, dx, r2, nop->mom.mass, cellsize);
+                    if(Quadrupole) {
+                        double q[6];
+                        for(i = 0; i < 6; i++)
+                            q[i] = tree->Quadrupoles[no - tree->firstnode].q[i];
+                        apply_quadrupole_to_output(output, dx, r2, q, cellsize);
+                    }
                 }
+                if(lists)
+                    add_to_interaction_list(intlist, &nintlist, no);
+                no = nop->sibling;
                 continue;
             }
 
@@ -347,6 +722,8 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
                         int pp = nop->s.suns[i];
                         lv->ngblist[numcand++] = pp;
                     }
+                    if(lists)
+                        add_to_interaction_list(intlist, &nintlist, no);
                     no = nop->sibling;
                 }
                 else if (nop->f.ChildType == PSEUDO_NODE_TYPE)
@@ -359,6 +736,11 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
                     no = nop->s.suns[0];
             }
         }
+        if(TreeParams.MixedPrecision) {
+            apply_particles_to_output_float(output, lv->ngblist, numcand, Parts, inpos, BoxSize, cellsize);
+            ninteractions += numcand;
+            continue;
+        }
         int i;
         for(i = 0; i < numcand; i++)
         {
@@ -366,13 +748,546 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
             double dx[3];
             int j;
             for(j = 0; j < 3; j++)
-                dx[j] = NEAREST(P[pp].Pos[j] - inpos[j], BoxSize);
+                dx[j] = NEAREST(Parts[pp].Pos[j] - inpos[j], BoxSize);
             const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
             /* Compute the acceleration and apply it to the output structure*/
-            apply_accn_to_output(output, dx, r2, P[pp].Mass, cellsize);
+            apply_accn_to_output(output, dx, r2, Parts[pp].Mass, cellsize);
+        }
+        ninteractions += numcand;
+    }
+    /* Store the list, unless it or the list memory overflowed*/
+    if(lists && nintlist <= GRAV_MAX_INTERACTION_LIST) {
+        const int write = 1 - lists->Read;
+        const int64_t start = atomic_fetch_and_add_64(&lists->Used[write], nintlist);
+        if(start + nintlist <= lists->Size) {
+            memcpy(lists->List[write] + start, intlist, nintlist * sizeof(int));
+            lists->Start[write][lv->target] = start;
+            lists->Count[write][lv->target] = nintlist;
         }
-        ninteractions = numcand;
     }
+    output->Ninteractions = ninteractions;
     treewalk_add_counters(lv, ninteractions);
     return 1;
 }
+
+/* Distance along one axis from a point to the nearest point of a box with the given center and half-size.*/
+static inline double
+box_axis_distance(const double pos, const double center, const double half, const double BoxSize)
+{
+    const double dist = fabs(NEAREST(pos - center, BoxSize)) - half;
+    return dist > 0 ? dist : 0;
+}
+
+/* Evaluate the interaction list for each particle in a bucket.
+ * Entries below firstnode are particles, the others are tree nodes.*/
+static void
+apply_bucket_interactions(const TreeWalkQueryGravShort * input, TreeWalkResultGravShort * output, const int nquery,
+        const int * list, const int numcand, const ForceTree * tree, const double cellsize)
+{
+    const double BoxSize = tree->BoxSize;
+    int q;
+    for(q = 0; q < nquery; q++) {
+        const double * inpos = input[q].base.Pos;
+        int i;
+        for(i = 0; i < numcand; i++) {
+            const int no = list[i];
+            const double * pos;
+            double mass;
+            if(no < tree->firstnode) {
+                pos = P[no].Pos;
+                mass = P[no].Mass;
+            }
+            else {
+                pos = tree->Nodes[no].mom.cofm;
+                mass = tree->Nodes[no].mom.mass;
+            }
+            double dx[3];
+            int j;
+            for(j = 0; j < 3; j++)
+                dx[j] = NEAREST(pos[j] - inpos[j], BoxSize);
+            const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+            apply_accn_to_output(&output[q], dx, r2, mass, cellsize);
+            if(no >= tree->firstnode && tree->Quadrupoles) {
+                double quad[6];
+                for(j = 0; j < 6; j++)
+                    quad[j] = tree->Quadrupoles[no - tree->firstnode].q[j];
+                apply_quadrupole_to_output(&output[q], dx, r2, quad, cellsize);
+            }
+        }
+    }
+}
+
+/* Primary short-range treewalk for a bucket of particles sharing a tree leaf.
+ * The tree is walked once against the bounding box of the bucket. The discard and opening
+ * criteria use the nearest point of the box and the smallest old acceleration in the bucket,
+ * so a node is only used whole if every particle in the bucket would use it.
+ * The accepted nodes and particles form an interaction list shared by the bucket, which is then
+ * evaluated for each particle in turn. The list is stored in the thread-local neighbour list,
+ * and is evaluated early if it fills up.*/
+int force_treeev_shortrange_bucket(TreeWalkQueryGravShort * input,
+        TreeWalkResultGravShort * output,
+        const int nquery,
+        LocalTreeWalk * lv)
+{
+    if(lv->mode != TREEWALK_PRIMARY)
+        endrun(5, "Bucketed gravity treewalk called in mode %d\n", lv->mode);
+
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+
+    /*Tree-opening constants*/
+    const double cellsize = GRAV_GET_PRIV(lv->tw)->cellsize;
+    const double rcut = GRAV_GET_PRIV(lv->tw)->Rcut;
+    const double rcut2 = rcut * rcut;
+    const int TreeUseBH = TreeParams.TreeUseBH;
+    double BHOpeningAngle2 = TreeParams.BHOpeningAngle * TreeParams.BHOpeningAngle;
+    if(TreeUseBH == 0)
+        BHOpeningAngle2 = TreeParams.MaxBHOpeningAngle * TreeParams.MaxBHOpeningAngle;
+
+    /* If the bucket is the whole of its leaf, the smallest acceleration is that of the leaf.*/
+    const int leaf = (tree->MinAccel && tree->Father && lv->target < tree->nfather) ? tree->Father[lv->target] : -1;
+    const int wholeleaf = leaf >= tree->firstnode && tree->Nodes[leaf].s.noccupied == nquery;
+
+    /* Bounding box of the bucket, and the smallest acceleration*/
+    double lo[3], hi[3];
+    double aold = TreeParams.ErrTolForceAcc * input[0].OldAcc;
+    if(wholeleaf)
+        aold = TreeParams.ErrTolForceAcc * tree->MinAccel[leaf - tree->firstnode] / GRAV_GET_PRIV(lv->tw)->G;
+    int q, i;
+    for(i = 0; i < 3; i++)
+        lo[i] = hi[i] = input[0].base.Pos[i];
+    for(q = 1; q < nquery; q++) {
+        /* Particles in a bucket are in the same tree leaf, so are never wrapped around the box.*/
+        for(i = 0; i < 3; i++) {
+            lo[i] = DMIN(lo[i], input[q].base.Pos[i]);
+            hi[i] = DMAX(hi[i], input[q].base.Pos[i]);
+        }
+        if(!wholeleaf)
+            aold = DMIN(aold, TreeParams.ErrTolForceAcc * input[q].OldAcc);
+    }
+    double bcenter[3], bhalf[3];
+    for(i = 0; i < 3; i++) {
+        bcenter[i] = (lo[i] + hi[i]) / 2;
+        bhalf[i] = (hi[i] - lo[i]) / 2;
+    }
+
+    /* The neighbour list has space for all particles, but the list may also contain nodes.*/
+    const int maxcand = tree->NumParticles;
+    int numcand = 0;
+    int64_t ninteractions = 0;
+    int no = input[0].base.NodeList[0];
+
+    while(no >= 0)
+    {
+        struct NODE *nop = &tree->Nodes[no];
+
+        /* Distance from the nearest point of the bucket to the center of mass*/
+        double r2 = 0;
+        for(i = 0; i < 3; i++) {
+            const double dx = box_axis_distance(nop->mom.cofm[i], bcenter[i], bhalf[i], BoxSize);
+            r2 += dx * dx;
+        }
+
+        /* Discard the node if it is outside the cutoff for every particle in the bucket.*/
+        if(r2 > rcut2) {
+            const double eff_dist = rcut + 0.5 * nop->len;
+            int discard = 0;
+            for(i = 0; i < 3; i++)
+                if(box_axis_distance(nop->center[i], bcenter[i], bhalf[i], BoxSize) > eff_dist)
+                    discard = 1;
+            if(discard) {
+                no = nop->sibling;
+                continue;
+            }
+        }
+
+        /* Check the opening criteria for the nearest point of the bucket*/
+        int open_node = 0;
+        if((TreeUseBH == 0) && !tree->Quadrupoles && (nop->mom.mass * nop->len * nop->len > r2 * r2 * aold))
+            open_node = 1;
+        else if((TreeUseBH == 0) && tree->Quadrupoles && (nop->mom.mass * nop->len * nop->len * nop->len > r2 * r2 * sqrt(r2) * aold))
+            open_node = 1;
+        else if(nop->len * nop->len > r2 * BHOpeningAngle2)
+            open_node = 1;
+        else {
+            /* Open the cell if any of the bucket may be inside it*/
+            const double inside = 0.6 * nop->len;
+            if(box_axis_distance(nop->center[0], bcenter[0], bhalf[0], BoxSize) < inside &&
+                box_axis_distance(nop->center[1], bcenter[1], bhalf[1], BoxSize) < inside &&
+                box_axis_distance(nop->center[2], bcenter[2], bhalf[2], BoxSize) < inside)
+                open_node = 1;
+        }
+
+        if(!open_node) {
+            if(numcand == maxcand) {
+                apply_bucket_interactions(input, output, nquery, lv->ngblist, numcand, tree, cellsize);
+                ninteractions += numcand;
+                numcand = 0;
+            }
+            lv->ngblist[numcand++] = no;
+            no = nop->sibling;
+            continue;
+        }
+
+        if(nop->f.ChildType == PARTICLE_NODE_TYPE)
+        {
+            if(numcand + nop->s.noccupied > maxcand) {
+                apply_bucket_interactions(input, output, nquery, lv->ngblist, numcand, tree, cellsize);
+                ninteractions += numcand;
+                numcand = 0;
+            }
+            for(i = 0; i < nop->s.noccupied; i++)
+                lv->ngblist[numcand++] = nop->s.suns[i];
+            no = nop->sibling;
+        }
+        else if (nop->f.ChildType == PSEUDO_NODE_TYPE)
+            /* Remote nodes are evaluated by the export*/
+            no = nop->sibling;
+        else
+            no = nop->s.suns[0];
+    }
+    apply_bucket_interactions(input, output, nquery, lv->ngblist, numcand, tree, cellsize);
+    ninteractions += numcand;
+    for(q = 0; q < nquery; q++) {
+        output[q].Ninteractions = ninteractions;
+        treewalk_add_counters(lv, ninteractions);
+    }
+    return 1;
+}
+
+/* Local expansion of the short-range field about the center of a sink node, without the factor of G:
+ * the acceleration and potential at the center, and the gradient of the acceleration (xx, xy, xz, yy, yz, zz).*/
+struct FMMLocal {
+    double Acc[3];
+    double Tidal[6];
+    double Potential;
+};
+
+/* State of the fast multipole solver*/
+struct FMMWalk {
+    const ForceTree * tree;
+    /* Local expansion of each tree node (offset by firstnode)*/
+    struct FMMLocal * Local;
+    /* Output, for each particle*/
+    MyFloat (*Accel)[3];
+    MyFloat * Potential;
+    double cellsize;
+    double rcut;
+    double BHOpeningAngle2;
+    double G;
+    int TreeUseBH;
+    /* Number of node-node, particle-node and particle-particle interactions*/
+    int64_t Nm2l;
+    int64_t Nm2p;
+    int64_t Np2p;
+};
+
+/* Smallest acceptable acceleration error of the particles below a sink node.
+ * Only needed for the relative criterion, when the node accelerations are computed.*/
+static double
+fmm_sink_acc(const int no, const struct FMMWalk * fw)
+{
+    if(fw->TreeUseBH != 0)
+        return 0;
+    return TreeParams.ErrTolForceAcc * fw->tree->MinAccel[no - fw->tree->firstnode] / fw->G;
+}
+
+/* Check whether the source node src is far enough from the sink node sink that its field can be
+ * added to the local expansion of the sink. Uses the Barnes-Hut criterion for the sum of the node sizes,
+ * and, if TreeUseBH is 0, the relative acceleration criterion at the nearest point of the sink.
+ * r2 is the squared distance from the sink center to the source center of mass.*/
+static int
+fmm_well_separated(const struct NODE * sink, const struct NODE * src, const double r2, const double sinkacc, const struct FMMWalk * fw)
+{
+    const double len = sink->len + src->len;
+    if(len * len > fw->BHOpeningAngle2 * r2)
+        return 0;
+    /* Nearest point of the sink to the source: the sink is within half its diagonal of its center*/
+    const double rmin = sqrt(r2) - 0.5 * sqrt(3) * sink->len;
+    /* The expansion is not softened, and must not overlap the source*/
+    if(rmin < Softening.h || rmin < 0.6 * src->len)
+        return 0;
+    if((fw->TreeUseBH == 0) && (src->mom.mass * len * len > rmin * rmin * rmin * rmin * sinkacc))
+        return 0;
+    return 1;
+}
+
+/* Check whether the nodes are further apart than the short-range cutoff along one axis.*/
+static int
+fmm_discard(const struct NODE * sink, const struct NODE * src, const double BoxSize, const double rcut)
+{
+    const double halflen = 0.5 * (sink->len + src->len);
+    int i;
+    for(i = 0; i < 3; i++)
+        if(fabs(NEAREST(src->center[i] - sink->center[i], BoxSize)) - halflen > rcut)
+            return 1;
+    return 0;
+}
+
+/* Add the field of a mass at offset dx from the center of a sink node to its local expansion.*/
+static void
+fmm_add_local(struct FMMLocal * local, const double dx[3], const double r2, const double mass, const double cellsize)
+{
+    const double r = sqrt(r2);
+    double fac = mass / (r2 * r);
+    double facpot = -mass / r;
+    double tidal = fac;
+    if(grav_apply_short_range_window_tidal(r, &fac, &facpot, &tidal, cellsize))
+        return;
+    /* d a_i / d x_j = - fac delta_ij + (3 fac + tidal) dx_i dx_j / r^2*/
+    const double fac2 = (3 * fac + tidal) / r2;
+    int i;
+    for(i = 0; i < 3; i++)
+        local->Acc[i] += dx[i] * fac;
+    local->Potential += facpot;
+    local->Tidal[0] += fac2 * dx[0] * dx[0] - fac;
+    local->Tidal[1] += fac2 * dx[0] * dx[1];
+    local->Tidal[2] += fac2 * dx[0] * dx[2];
+    local->Tidal[3] += fac2 * dx[1] * dx[1] - fac;
+    local->Tidal[4] += fac2 * dx[1] * dx[2];
+    local->Tidal[5] += fac2 * dx[2] * dx[2] - fac;
+}
+
+/* Evaluate a local expansion at offset dx from its center: acc = Acc + Tidal dx and pot = Potential - Acc . dx*/
+static void
+fmm_eval_local(const struct FMMLocal * local, const double dx[3], double acc[3], double * pot)
+{
+    const double * T = local->Tidal;
+    acc[0] = local->Acc[0] + T[0] * dx[0] + T[1] * dx[1] + T[2] * dx[2];
+    acc[1] = local->Acc[1] + T[1] * dx[0] + T[3] * dx[1] + T[4] * dx[2];
+    acc[2] = local->Acc[2] + T[2] * dx[0] + T[4] * dx[1] + T[5] * dx[2];
+    *pot = local->Potential - (local->Acc[0] * dx[0] + local->Acc[1] * dx[1] + local->Acc[2] * dx[2]);
+}
+
+/* Direct interactions between the particles of two leaves*/
+static void
+fmm_p2p(const struct NODE * sink, const struct NODE * src, struct FMMWalk * fw)
+{
+    const double BoxSize = fw->tree->BoxSize;
+    int i, j, k;
+    for(i = 0; i < sink->s.noccupied; i++) {
+        const int p = sink->s.suns[i];
+        TreeWalkResultGravShort output;
+        memset(&output, 0, sizeof(output));
+        for(j = 0; j < src->s.noccupied; j++) {
+            const int q = src->s.suns[j];
+            double dx[3];
+            for(k = 0; k < 3; k++)
+                dx[k] = NEAREST(P[q].Pos[k] - P[p].Pos[k], BoxSize);
+            const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+            apply_accn_to_output(&output, dx, r2, P[q].Mass, fw->cellsize);
+        }
+        for(k = 0; k < 3; k++)
+            fw->Accel[p][k] += output.Acc[k];
+        fw->Potential[p] += output.Potential;
+    }
+    fw->Np2p += sink->s.noccupied * src->s.noccupied;
+}
+
+/* Walk the source subtree below no for a single particle p of a sink leaf, as the tree walk does.*/
+static void
+fmm_walk_particle(const int p, const int no, const double aold, TreeWalkResultGravShort * output, struct FMMWalk * fw)
+{
+    const ForceTree * tree = fw->tree;
+    const struct NODE * nop = &tree->Nodes[no];
+    const double BoxSize = tree->BoxSize;
+    double dx[3];
+    int j, k;
+    for(k = 0; k < 3; k++)
+        dx[k] = NEAREST(nop->mom.cofm[k] - P[p].Pos[k], BoxSize);
+    const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+    if(shall_we_discard_node(nop->len, r2, nop->center, P[p].Pos, BoxSize, fw->rcut, fw->rcut * fw->rcut))
+        return;
+    if(!shall_we_open_node(nop->len, nop->mom.mass, r2, nop->center, P[p].Pos, BoxSize, aold, fw->TreeUseBH, fw->BHOpeningAngle2, 0)) {
+        apply_accn_to_output(output, dx, r2, nop->mom.mass, fw->cellsize);
+        fw->Nm2p++;
+        return;
+    }
+    if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < nop->s.noccupied; j++) {
+            const int q = nop->s.suns[j];
+            for(k = 0; k < 3; k++)
+                dx[k] = NEAREST(P[q].Pos[k] - P[p].Pos[k], BoxSize);
+            apply_accn_to_output(output, dx, dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2], P[q].Mass, fw->cellsize);
+        }
+        fw->Np2p += nop->s.noccupied;
+    }
+    else if(nop->f.ChildType == NODE_NODE_TYPE) {
+        for(j = 0; j < NMAXCHILD; j++)
+            if(nop->s.suns[j] >= 0)
+                fmm_walk_particle(p, nop->s.suns[j], aold, output, fw);
+    }
+}
+
+/* Dual tree walk: add the field of the source node src to the sink node sink and its children.
+ * Well separated pairs go into the local expansion of the sink, and otherwise the larger node is opened.
+ * When the sink is a leaf its particles walk the source subtree one by one,
+ * which also handles sources within the softening length.*/
+static void
+fmm_interact(const int sink, const int src, struct FMMWalk * fw)
+{
+    const ForceTree * tree = fw->tree;
+    const struct NODE * snode = &tree->Nodes[sink];
+    const struct NODE * rnode = &tree->Nodes[src];
+    if(rnode->mom.mass == 0 || snode->mom.mass == 0)
+        return;
+    if(fmm_discard(snode, rnode, tree->BoxSize, fw->rcut))
+        return;
+    double dx[3];
+    int j;
+    for(j = 0; j < 3; j++)
+        dx[j] = NEAREST(rnode->mom.cofm[j] - snode->center[j], tree->BoxSize);
+    const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+    if(fmm_well_separated(snode, rnode, r2, fmm_sink_acc(sink, fw), fw)) {
+        fmm_add_local(&fw->Local[sink - tree->firstnode], dx, r2, rnode->mom.mass, fw->cellsize);
+        fw->Nm2l++;
+        return;
+    }
+    const int sinkleaf = snode->f.ChildType != NODE_NODE_TYPE;
+    const int srcleaf = rnode->f.ChildType != NODE_NODE_TYPE;
+    if(sinkleaf && srcleaf)
+        fmm_p2p(snode, rnode, fw);
+    else if(sinkleaf) {
+        for(j = 0; j < snode->s.noccupied; j++) {
+            const int p = snode->s.suns[j];
+            TreeWalkResultGravShort output;
+            memset(&output, 0, sizeof(output));
+            fmm_walk_particle(p, src, TreeParams.ErrTolForceAcc * grav_get_abs_accel(&P[p], fw->G), &output, fw);
+            int k;
+            for(k = 0; k < 3; k++)
+                fw->Accel[p][k] += output.Acc[k];
+            fw->Potential[p] += output.Potential;
+        }
+    }
+    else if(srcleaf || snode->len >= rnode->len) {
+        for(j = 0; j < NMAXCHILD; j++)
+            if(snode->s.suns[j] >= 0)
+                fmm_interact(snode->s.suns[j], src, fw);
+    }
+    else {
+        for(j = 0; j < NMAXCHILD; j++)
+            if(rnode->s.suns[j] >= 0)
+                fmm_interact(sink, rnode->s.suns[j], fw);
+    }
+}
+
+/* Shift the local expansion of each node to its children, and evaluate it for the particles in the leaves.*/
+static void
+fmm_downward(const int no, struct FMMWalk * fw)
+{
+    const ForceTree * tree = fw->tree;
+    const struct NODE * nop = &tree->Nodes[no];
+    const struct FMMLocal * local = &fw->Local[no - tree->firstnode];
+    int j, k;
+    if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < nop->s.noccupied; j++) {
+            const int p = nop->s.suns[j];
+            double dx[3], acc[3], pot;
+            for(k = 0; k < 3; k++)
+                dx[k] = P[p].Pos[k] - nop->center[k];
+            fmm_eval_local(local, dx, acc, &pot);
+            for(k = 0; k < 3; k++)
+                fw->Accel[p][k] += acc[k];
+            fw->Potential[p] += pot;
+        }
+        return;
+    }
+    if(nop->f.ChildType != NODE_NODE_TYPE)
+        return;
+    for(j = 0; j < NMAXCHILD; j++) {
+        const int c = nop->s.suns[j];
+        if(c < 0)
+            continue;
+        struct FMMLocal * clocal = &fw->Local[c - tree->firstnode];
+        double dx[3], acc[3], pot;
+        for(k = 0; k < 3; k++)
+            dx[k] = tree->Nodes[c].center[k] - nop->center[k];
+        fmm_eval_local(local, dx, acc, &pot);
+        for(k = 0; k < 3; k++)
+            clocal->Acc[k] += acc[k];
+        for(k = 0; k < 6; k++)
+            clocal->Tidal[k] += local->Tidal[k];
+        clocal->Potential += pot;
+        fmm_downward(c, fw);
+    }
+}
+
+/* Number of levels below each local top leaf at which the sink subtrees are split between threads*/
+#define FMM_SINK_LEVELS 2
+
+/* Add the sink subtrees below node no, FMM_SINK_LEVELS deep, to the list.*/
+static int
+fmm_find_sinks(const int no, const int level, const ForceTree * tree, int * sinks, int nsinks)
+{
+    const struct NODE * nop = &tree->Nodes[no];
+    if(level == FMM_SINK_LEVELS || nop->f.ChildType != NODE_NODE_TYPE) {
+        sinks[nsinks++] = no;
+        return nsinks;
+    }
+    int j;
+    for(j = 0; j < NMAXCHILD; j++)
+        if(nop->s.suns[j] >= 0)
+            nsinks = fmm_find_sinks(nop->s.suns[j], level + 1, tree, sinks, nsinks);
+    return nsinks;
+}
+
+/* Compute the short-range gravity between the particles of the local tree with the fast multipole method.
+ * The subtrees a few levels below each local top leaf are the sinks, and are shared between threads.
+ * Each sink is walked against the subtree of each local top leaf, then its local expansions are
+ * pushed down to the particles. The accelerations (without G) and potentials are added to Accel and Potential.*/
+static void
+grav_short_fmm(const ForceTree * tree, MyFloat (*Accel)[3], MyFloat * Potential, const struct GravShortPriv * priv)
+{
+    struct FMMWalk fw = {0};
+    fw.tree = tree;
+    fw.Accel = Accel;
+    fw.Potential = Potential;
+    fw.cellsize = priv->cellsize;
+    fw.rcut = priv->Rcut;
+    fw.G = priv->G;
+    fw.TreeUseBH = TreeParams.TreeUseBH;
+    fw.BHOpeningAngle2 = TreeParams.BHOpeningAngle * TreeParams.BHOpeningAngle;
+    if(fw.TreeUseBH == 0)
+        fw.BHOpeningAngle2 = TreeParams.MaxBHOpeningAngle * TreeParams.MaxBHOpeningAngle;
+
+    int i, nleaves = 0;
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task == tree->ThisTask)
+            nleaves++;
+    int * leaves = (int *) mymalloc("FMMLeaves", DMAX(nleaves, 1) * sizeof(int));
+    int * sinks = (int *) mymalloc("FMMSinks", DMAX(nleaves, 1) * (1 << (3 * FMM_SINK_LEVELS)) * sizeof(int));
+    fw.Local = (struct FMMLocal *) mymalloc("FMMLocal", tree->numnodes * sizeof(struct FMMLocal));
+    memset(fw.Local, 0, tree->numnodes * sizeof(struct FMMLocal));
+
+    int nsinks = 0;
+    nleaves = 0;
+    for(i = 0; i < tree->NTopLeaves; i++) {
+        if(tree->TopLeaves[i].Task != tree->ThisTask)
+            continue;
+        leaves[nleaves++] = tree->TopLeaves[i].treenode;
+        nsinks = fmm_find_sinks(tree->TopLeaves[i].treenode, 0, tree, sinks, nsinks);
+    }
+
+    int64_t Nm2l = 0, Nm2p = 0, Np2p = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+: Nm2l, Nm2p, Np2p)
+    for(i = 0; i < nsinks; i++) {
+        /* Each sink subtree is only written by this thread*/
+        struct FMMWalk lfw = fw;
+        lfw.Nm2l = lfw.Nm2p = lfw.Np2p = 0;
+        int j;
+        for(j = 0; j < nleaves; j++)
+            fmm_interact(sinks[i], leaves[j], &lfw);
+        fmm_downward(sinks[i], &lfw);
+        Nm2l += lfw.Nm2l;
+        Nm2p += lfw.Nm2p;
+        Np2p += lfw.Np2p;
+    }
+    myfree(fw.Local);
+    myfree(sinks);
+    myfree(leaves);
+
+    int64_t tot[3] = {Nm2l, Nm2p, Np2p};
+    MPI_Allreduce(MPI_IN_PLACE, tot, 3, MPI_INT64, MPI_SUM, GadgetComm);
+    message(0, "FMM: %ld node-node, %ld particle-node and %ld particle-particle interactions\n", tot[0], tot[1], tot[2]);
+    walltime_measure("/Tree/FMM");
+}
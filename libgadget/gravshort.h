@@ -13,12 +13,16 @@ typedef struct
 {
     TreeWalkQueryBase base;
     MyFloat OldAcc;
+    /* True if the particle uses the short-range split of the high resolution PM mesh*/
+    int HighRes;
 } TreeWalkQueryGravShort;
 
 typedef struct {
     TreeWalkResultBase base;
     MyFloat Acc[3];
     MyFloat Potential;
+    /* Number of interactions evaluated for this particle, see P[].GravCost*/
+    MyFloat Ninteractions;
 } TreeWalkResultGravShort;
 
 struct GravShortPriv {
@@ -27,6 +31,10 @@ struct GravShortPriv {
     /* How many PM cells do we go
      * before we stop calculating the tree?*/
     double Rcut;
+    /* Cell size and cutoff of the high resolution PM mesh, used for particles with HighResPM set.
+     * Zero if there is no high resolution mesh.*/
+    double cellsize_highres;
+    double Rcut_highres;
     /* Newton's constant in internal units*/
     double G;
     inttime_t Ti_Current;
@@ -39,11 +47,121 @@ struct GravShortPriv {
     double cbrtrho0;
     /* Pointer to the place to store accelerations*/
     MyFloat (*Accel)[3];
+    /* If true, the interactions with local mass were done by the fast multipole solver,
+     * and the primary treewalk only includes the mass on other ranks.*/
+    int FMM;
+    /* If true, the interactions with local mass are done on an accelerator, see gravshort-offload.c,
+     * and the primary treewalk only includes the mass on other ranks.*/
+    int Offload;
+    /* If true, the interactions counted for each particle are stored in P[].GravCost.*/
+    int StoreCost;
 };
 
 #define GRAV_GET_PRIV(tw) ((struct GravShortPriv *) ((tw)->priv))
 
-static void
+/* Start the walk of the local tree for the active particles on an accelerator. The tree must have walk nodes,
+ * which must not be freed until grav_short_offload_end. Defined in gravshort-offload.c*/
+struct GravShortOffload * grav_short_offload_begin(const ForceTree * tree, const int * ActiveParticle, const int64_t NumActive, const struct GravShortPriv * priv);
+/* Wait for the offloaded walk and add the accelerations to Accel, and the potentials to P[].Potential if Potential is true.
+ * Returns the time spent waiting.*/
+double grav_short_offload_end(struct GravShortOffload * off, MyFloat (*Accel)[3], const int Potential);
+
+/* Largest number of nodes in the interaction list of one particle, see struct InteractionLists.
+ * Longer lists are not stored.*/
+#define GRAV_MAX_INTERACTION_LIST 4096
+
+/* Largest number of interactions evaluated together by grav_short_kernel_float.
+ * Must be at least NGB_BATCH_SIZE, for the batched pairwise walk.*/
+#define GRAV_FLOAT_BLOCK 64
+
+/* Single precision softened force and potential factors, times the short-range window, for n <= GRAV_FLOAT_BLOCK
+ * interactions at squared separations r2 with masses mass. The same spline kernel as apply_accn_to_output,
+ * but all three cases are computed and selected so that the loop has no branches and can be vectorised.
+ * The arguments of each case are clamped to where it is used, so r2 = 0 is safe.*/
+static inline void
+grav_short_kernel_float(const int n, const float * r2, const float * mass, float * fac, float * pot, const float h, const float cellsize)
+{
+    float r[GRAV_FLOAT_BLOCK];
+    const float h_inv = 1 / h;
+    const float h3_inv = h_inv * h_inv * h_inv;
+    int j;
+    for(j = 0; j < n; j++) {
+        r[j] = sqrtf(r2[j]);
+        const float u = r[j] * h_inv;
+        /* Newtonian, for r >= h*/
+        const float rn = fmaxf(r[j], h);
+        const float facn = 1 / (rn * rn * rn);
+        const float potn = -1 / rn;
+        /* Inner spline, for u < 0.5*/
+        const float fac1 = h3_inv * (10.666666666667f + u * u * (32.0f * u - 38.4f));
+        const float pot1 = h_inv * (-2.8f + u * u * (5.333333333333f + u * u * (6.4f * u - 9.6f)));
+        /* Outer spline, for 0.5 <= u < 1*/
+        const float uo = fmaxf(u, 0.5f);
+        const float fac2 = h3_inv * (21.333333333333f - 48.0f * uo + 38.4f * uo * uo - 10.666666666667f * uo * uo * uo - 0.066666666667f / (uo * uo * uo));
+        const float pot2 = h_inv * (-3.2f + 0.066666666667f / uo + uo * uo * (10.666666666667f + uo * (-16.0f + uo * (9.6f - 2.133333333333f * uo))));
+        fac[j] = mass[j] * (u >= 1 ? facn : (u < 0.5f ? fac1 : fac2));
+        pot[j] = mass[j] * (u >= 1 ? potn : (u < 0.5f ? pot1 : pot2));
+    }
+    grav_apply_short_range_window_float(n, r, fac, pot, cellsize);
+}
+
+/* Check whether a node should be discarded completely, its contents not contributing
+ * to the acceleration. This happens if the node is further away than the short-range force cutoff.
+ * Return 1 if the node should be discarded, 0 otherwise. */
+static inline int
+shall_we_discard_node(const double len, const double r2, const double center[3], const double inpos[3], const double BoxSize, const double rcut, const double rcut2)
+{
+    /* This checks the distance from the node center of mass
+     * is greater than the cutoff. */
+    if(r2 > rcut2)
+    {
+        /* check whether we can stop walking along this branch */
+        const double eff_dist = rcut + 0.5 * len;
+        int i;
+        /*This checks whether we are also outside this region of the oct-tree*/
+        /* As long as one dimension is outside, we are fine*/
+        for(i=0; i < 3; i++)
+            if(fabs(NEAREST(center[i] - inpos[i], BoxSize)) > eff_dist)
+                return 1;
+    }
+    return 0;
+}
+
+/* This function tests whether a node shall be opened (ie, should the next node be .
+ * If it should be discarded, 0 is returned.
+ * If it should be used, 1 is returned, otherwise zero is returned.
+ * If Quadrupole is true the node quadrupoles are used, and the relative acceleration
+ * condition is for the octupole error term, M l^3 / r^5, rather than M l^2 / r^4.*/
+static inline int
+shall_we_open_node(const double len, const double mass, const double r2, const double center[3], const double inpos[3], const double BoxSize, const double aold, const int TreeUseBH, const double BHOpeningAngle2, const int Quadrupole)
+{
+    /* Check the relative acceleration opening condition*/
+    if(TreeUseBH == 0) {
+        if(Quadrupole) {
+            if(mass * len * len * len > r2 * r2 * sqrt(r2) * aold)
+                return 1;
+        }
+        else if(mass * len * len > r2 * r2 * aold)
+            return 1;
+    }
+
+    double bhangle = len * len  / r2;
+     /*Check Barnes-Hut opening angle*/
+    if(bhangle > BHOpeningAngle2)
+         return 1;
+
+    const double inside = 0.6 * len;
+    /* Open the cell if we are inside it, even if the opening criterion is not satisfied.*/
+    if(fabs(NEAREST(center[0] - inpos[0], BoxSize)) < inside &&
+        fabs(NEAREST(center[1] - inpos[1], BoxSize)) < inside &&
+        fabs(NEAREST(center[2] - inpos[2], BoxSize)) < inside)
+        return 1;
+
+    /* ok, node can be used */
+    return 0;
+}
+
+static inline void
 grav_short_postprocess(int i, TreeWalk * tw)
 {
     double G = GRAV_GET_PRIV(tw)->G;
@@ -66,7 +184,7 @@ grav_short_postprocess(int i, TreeWalk * tw)
 }
 
 /*Compute the absolute magnitude of the acceleration for a particle.*/
-static MyFloat
+static inline MyFloat
 grav_get_abs_accel(struct particle_data * PP, const double G)
 {
     double aold=0;
@@ -78,13 +196,28 @@ grav_get_abs_accel(struct particle_data * PP, const double G)
     return sqrt(aold) / G;
 }
 
-static void
+static inline void
 grav_short_copy(int place, TreeWalkQueryGravShort * input, TreeWalk * tw)
 {
     input->OldAcc = grav_get_abs_accel(&P[place], GRAV_GET_PRIV(tw)->G);
+    input->HighRes = GRAV_GET_PRIV(tw)->cellsize_highres > 0 && P[place].HighResPM;
+}
+
+/* Set the PM cell size and tree cutoff for a query, from the high resolution mesh if the particle is inside it.*/
+static inline void
+grav_short_query_split(const TreeWalkQueryGravShort * input, const struct GravShortPriv * priv, double * cellsize, double * rcut)
+{
+    if(input->HighRes) {
+        *cellsize = priv->cellsize_highres;
+        *rcut = priv->Rcut_highres;
+    }
+    else {
+        *cellsize = priv->cellsize;
+        *rcut = priv->Rcut;
+    }
 }
 
-static void
+static inline void
 grav_short_reduce(int place, TreeWalkResultGravShort * result, enum TreeWalkReduceMode mode, TreeWalk * tw)
 {
     TREEWALK_REDUCE(GRAV_GET_PRIV(tw)->Accel[place][0], result->Acc[0]);
@@ -92,6 +225,8 @@ grav_short_reduce(int place, TreeWalkResultGravShort * result, enum TreeWalkRedu
     TREEWALK_REDUCE(GRAV_GET_PRIV(tw)->Accel[place][2], result->Acc[2]);
     if(tw->tree->full_particle_tree_flag)
         TREEWALK_REDUCE(P[place].Potential, result->Potential);
+    if(GRAV_GET_PRIV(tw)->StoreCost)
+        TREEWALK_REDUCE(P[place].GravCost, result->Ninteractions);
 }
 
 #endif
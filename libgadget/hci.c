@@ -15,7 +15,7 @@ hci_now(HCIManager * manager)
     }
     manager->_now = MPI_Wtime();
     /* must be consistent between all ranks. */
-    MPI_Bcast(&manager->_now, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&manager->_now, 1, MPI_DOUBLE, 0, GadgetComm);
     return manager->_now;
 }
 
@@ -31,6 +31,8 @@ hci_init(HCIManager * manager, char * prefix, const double WallClockTimeLimit, c
     manager->TimeLastCheckPoint = manager->timer_begin;
     manager->FOFEnabled = FOFEnabled;
     manager->LongestTimeBetweenQueries = 0;
+    manager->PendingWriteTime = 0;
+    manager->WorkForecast = 1;
 }
 
 void
@@ -40,6 +42,8 @@ hci_action_init(HCIAction * action)
     action->write_snapshot = 0;
     action->write_fof = 0;
     action->write_plane = 0;
+    action->trace_steps = 0;
+    action->reconfigure = NULL;
 }
 
 /* override the result of hci_now; for unit testing -- we can't rely on MPI_Wtime there!
@@ -51,6 +55,22 @@ hci_override_now(HCIManager * manager, double now)
     manager->OVERRIDE_NOW = 1;
 }
 
+/* Record how long a snapshot written in the background still needs.
+ * The timeout leaves room for it, as it must complete before the final checkpoint. Collective. */
+void
+hci_set_pending_write_time(HCIManager * manager, double pending)
+{
+    manager->PendingWriteTime = pending;
+}
+
+/* Record how much more work the steps until the next query are expected to be than the steps since the last query.
+ * The timeout scales the time between queries up by it, so a run stops before a step it has no time for. Collective. */
+void
+hci_set_work_forecast(HCIManager * manager, double ratio)
+{
+    manager->WorkForecast = ratio;
+}
+
 static double
 hci_get_elapsed_time(HCIManager * manager)
 {
@@ -77,8 +97,8 @@ hci_query_filesystem(HCIManager * manager, const char * filename, char ** reques
 {
     int ThisTask;
     int NTask;
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     int size = 0;
     char * content = NULL;
     if(ThisTask == 0) {
@@ -92,13 +112,13 @@ hci_query_filesystem(HCIManager * manager, const char * filename, char ** reques
         }
         myfree(fullname);
     }
-    MPI_Bcast(&size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&size, 1, MPI_INT, 0, GadgetComm);
 
     if(size != -1) {
         if(ThisTask != 0) {
             content = ta_malloc("hcicontent", char, size + 1);
         }
-        MPI_Bcast(content, size+1, MPI_BYTE, 0, MPI_COMM_WORLD);
+        MPI_Bcast(content, size+1, MPI_BYTE, 0, GadgetComm);
     } else {
         content = NULL;
     }
@@ -118,10 +138,15 @@ hci_query_timeout(HCIManager * manager, char ** request)
      * for possible inconsistency between measured time and the true wallclock
      *
      * If there likely isn't time for a new query, then we shall timeout as well.
+     * A snapshot still being written in the background has to finish before
+     * the final checkpoint, so account for it too.
+     * The longest time between queries is only ever scaled up by the work forecast,
+     * as the forecast assumes the particles keep their timesteps.
      * */
 
     *request = NULL;
-    if (now + manager->LongestTimeBetweenQueries < manager->WallClockTimeLimit * 0.95) {
+    const double forecast = manager->WorkForecast > 1 ? manager->WorkForecast : 1;
+    if (now + manager->LongestTimeBetweenQueries * forecast + manager->PendingWriteTime < manager->WallClockTimeLimit * 0.95) {
         return 0;
     }
 
@@ -170,16 +195,23 @@ hci_query(HCIManager * manager, HCIAction * action)
         return 1;
     }
 
-    if(hci_query_filesystem(manager, "reconfigure", &request))
+    /* Is the trace-file present? If yes, record a timeline of the next steps. It contains the number of steps, default 1.
+     * This does not change what else happens in this step.*/
+    if(hci_query_filesystem(manager, "trace", &request))
     {
-        /* FIXME: This is not implemented
-         * it shall reread the configuration file and update the parameters of
-         * the module listed in the request.
-         * see the comment about update_IO_params
-         * */
-        message(0, "HCI: updating io parameters, this is not supported yet.\n");
+        action->trace_steps = atoi(request);
+        if(action->trace_steps <= 0)
+            action->trace_steps = 1;
+        message(0, "HCI: tracing the next %d steps.\n", action->trace_steps);
         myfree(request);
-        return 0;
+    }
+
+    /* Is the reconfigure-file present? If yes, pass its parameters to the caller, which applies them in this step.
+     * This does not change what else happens in this step.*/
+    if(hci_query_filesystem(manager, "reconfigure", &request))
+    {
+        message(0, "HCI: reconfiguring with: %s\n", request);
+        action->reconfigure = request;
     }
 
     if(hci_query_filesystem(manager, "checkpoint", &request))
@@ -244,40 +276,3 @@ hci_query(HCIManager * manager, HCIAction * action)
     message(0, "HCI: Nothing happened. \n");
     return 0;
 }
-
-/*
- * FIXME: rewrite update_IO_params with
- * the parser infrastructure. It probably shall occur
- * after we decentralize the initialization of the parser
- * to different modules.
- * */
-
-#if 0
-static void
-update_IO_params(const char * ioctlfname)
-{
-    if(ThisTask == 0) {
-        FILE * fd = fopen(ioctlfname, "r");
-         /* there is an ioctl file, parse it and update
-          * All.NumPartPerFile
-          * All.NumWriters
-          */
-        size_t n = 0;
-        char * line = NULL;
-        while(-1 != getline(&line, &n, fd)) {
-            sscanf(line, "BytesPerFile %lu", &All.IO.BytesPerFile);
-            sscanf(line, "NumWriters %d", &All.IO.NumWriters);
-        }
-        myfree(line);
-        fclose(fd);
-    }
-
-    MPI_Bcast(&All.IO, sizeof(All.IO), MPI_BYTE, 0, MPI_COMM_WORLD);
-    message(0, "New IO parameter recieved from %s:"
-               "NumPartPerfile %d"
-               "NumWriters %d\n",
-            ioctlfname,
-            All.IO.BytesPerFile,
-            All.IO.NumWriters);
-}
-#endif
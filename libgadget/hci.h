@@ -6,6 +6,10 @@ typedef struct HCIManager {
     double TimeLastCheckPoint;
     double AutoCheckPointTime;
     double LongestTimeBetweenQueries;
+    /* Expected time to finish a snapshot still being written in the background*/
+    double PendingWriteTime;
+    /* Expected work until the next query relative to the work since the last one*/
+    double WorkForecast;
     double WallClockTimeLimit;
     double timer_query_begin;
     double timer_begin;
@@ -32,6 +36,10 @@ typedef struct HCIAction
     char write_snapshot;
     char write_fof;
     char write_plane;
+    /* Number of steps to record a timeline trace for, or 0*/
+    int trace_steps;
+    /* Parameters to change at this step, in parameter file syntax, or NULL. The caller frees it.*/
+    char * reconfigure;
 } HCIAction;
 
 void
@@ -46,4 +54,10 @@ hci_query(HCIManager * manager, HCIAction * action);
 void
 hci_override_now(HCIManager * manager, double now);
 
+void
+hci_set_pending_write_time(HCIManager * manager, double pending);
+
+void
+hci_set_work_forecast(HCIManager * manager, double ratio);
+
 #endif
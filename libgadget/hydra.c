@@ -36,13 +36,13 @@ void
 set_hydro_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         HydroParams.ArtBulkViscConst = param_get_double(ps, "ArtBulkViscConst");
         HydroParams.DensityContrastLimit = param_get_double(ps, "DensityContrastLimit");
         HydroParams.DensityIndependentSphOn= param_get_int(ps, "DensityIndependentSphOn");
     }
-    MPI_Bcast(&HydroParams, sizeof(struct hydro_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&HydroParams, sizeof(struct hydro_params), MPI_BYTE, 0, GadgetComm);
 }
 
 int DensityIndependentSphOn(void)
@@ -74,8 +74,30 @@ PressurePred(MyFloat EOMDensityPred, double EntVarPred)
 //     return pow(EntVarPred * EOMDensityPred, GAMMA);
 }
 
+/* Predicted data of a gas particle needed when it is the neighbour in the hydro force,
+ * gathered from P, SphP and the predicted arrays into one 64-byte record.*/
+struct HydroNgbPart {
+    MyFloat VelPred[3];
+    float EntVarPred;
+    /* Predicted density*/
+    float Density;
+    /* Ratio of predicted EgyWtDensity (or Density) to Density*/
+    float EOMRatio;
+    /* Predicted pressure / eomdensity^2*/
+    float POverRho2;
+    float SoundSpeed;
+    /* Balsara switch factor for the viscosity*/
+    float F2;
+    float DhsmlEgyDensityFactor;
+    float dloga;
+    int Decoupled;
+    int pad;
+};
+
 struct HydraPriv {
     double * PressurePred;
+    /* Neighbour records indexed by slot. May be NULL, in which case they are computed for each pair.*/
+    struct HydroNgbPart * NgbParts;
     MyFloat * EntVarPred;
     /* Time-dependent constant factors, brought out here because
      * they need an expensive pow().*/
@@ -104,6 +126,8 @@ typedef struct {
     MyFloat F1;
     MyFloat SPH_DhsmlDensityFactor;
     MyFloat dloga;
+    /* Decoupled wind particle: only the signal velocity is needed*/
+    int Decoupled;
 } TreeWalkQueryHydro;
 
 typedef struct {
@@ -111,8 +135,40 @@ typedef struct {
     MyFloat Acc[3];
     MyFloat DtEntropy;
     MyFloat MaxSignalVel;
+    /* Minimum hydro timebin of the neighbours, for the timestep limiter*/
+    int MinNgbTimeBin;
 } TreeWalkResultHydro;
 
+/* Single precision versions of the above, sent to other ranks if TreeWalkPackExports is set*/
+typedef struct {
+    TreeWalkPackedQueryBase base;
+    float EgyRho;
+    float EntVarPred;
+    float Vel[3];
+    float Hsml;
+    float Mass;
+    float Density;
+    float Pressure;
+    float F1;
+    float SPH_DhsmlDensityFactor;
+    float dloga;
+    int Decoupled;
+    /* Keeps the wire size a multiple of 8, which the treewalk requires*/
+    int pad;
+} TreeWalkPackedQueryHydro;
+
+_Static_assert(sizeof(TreeWalkPackedQueryHydro) % 8 == 0, "Packed hydro query must be a multiple of 8 bytes");
+
+typedef struct {
+    TreeWalkResultBase base;
+    float Acc[3];
+    float DtEntropy;
+    float MaxSignalVel;
+    int MinNgbTimeBin;
+} TreeWalkPackedResultHydro;
+
+_Static_assert(sizeof(TreeWalkPackedResultHydro) % 8 == 0, "Packed hydro result must be a multiple of 8 bytes");
+
 typedef struct {
     TreeWalkNgbIterBase base;
     double p_over_rho2_i;
@@ -127,6 +183,9 @@ hydro_haswork(int n, TreeWalk * tw);
 static void
 hydro_postprocess(int i, TreeWalk * tw);
 
+static void
+hydro_ngb_part(const int other, struct HydroNgbPart * pj, struct HydraPriv * priv);
+
 static void
 hydro_ngbiter(
     TreeWalkQueryHydro * I,
@@ -135,12 +194,30 @@ hydro_ngbiter(
     LocalTreeWalk * lv
    );
 
+static void
+hydro_ngbiter_batch(
+    TreeWalkQueryHydro * I,
+    TreeWalkResultHydro * O,
+    TreeWalkNgbIterHydro * iter,
+    const TreeWalkNgbBatch * batch,
+    LocalTreeWalk * lv
+   );
+
 static void
 hydro_copy(int place, TreeWalkQueryHydro * input, TreeWalk * tw);
 
 static void
 hydro_reduce(int place, TreeWalkResultHydro * result, enum TreeWalkReduceMode mode, TreeWalk * tw);
 
+static void
+hydro_pack_query(const TreeWalkQueryHydro * query, TreeWalkPackedQueryHydro * packed, TreeWalk * tw);
+static void
+hydro_unpack_query(const TreeWalkPackedQueryHydro * packed, TreeWalkQueryHydro * query, TreeWalk * tw);
+static void
+hydro_pack_result(const TreeWalkResultHydro * result, TreeWalkPackedResultHydro * packed, TreeWalk * tw);
+static void
+hydro_unpack_result(const TreeWalkPackedResultHydro * packed, TreeWalkResultHydro * result, TreeWalk * tw);
+
 /*! This function is the driver routine for the calculation of hydrodynamical
  *  force and rate of change of entropy due to shock heating for all active
  *  particles .
@@ -156,6 +233,7 @@ hydro_force(const ActiveParticles * act, const double atime, struct sph_pred_dat
     tw->ev_label = "HYDRO";
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
     tw->ngbiter = (TreeWalkNgbIterFunction) hydro_ngbiter;
+    tw->ngbiter_batch = (TreeWalkNgbBatchFunction) hydro_ngbiter_batch;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterHydro);
     tw->haswork = hydro_haswork;
     tw->fill = (TreeWalkFillQueryFunction) hydro_copy;
@@ -163,7 +241,17 @@ hydro_force(const ActiveParticles * act, const double atime, struct sph_pred_dat
     tw->postprocess = (TreeWalkProcessFunction) hydro_postprocess;
     tw->query_type_elsize = sizeof(TreeWalkQueryHydro);
     tw->result_type_elsize = sizeof(TreeWalkResultHydro);
+    tw->pack_query = (TreeWalkPackQueryFunction) hydro_pack_query;
+    tw->unpack_query = (TreeWalkUnpackQueryFunction) hydro_unpack_query;
+    tw->pack_result = (TreeWalkPackResultFunction) hydro_pack_result;
+    tw->unpack_result = (TreeWalkUnpackResultFunction) hydro_unpack_result;
+    tw->query_packed_elsize = sizeof(TreeWalkPackedQueryHydro);
+    tw->result_packed_elsize = sizeof(TreeWalkPackedResultHydro);
     tw->tree = tree;
+    tw->UseExportPlan = 1;
+    /* Re-use the neighbour lists made by density, if the gas tree has a cache*/
+    tw->UseNgbCache = 1;
+    tw->StoreNgbCost = 1;
     tw->priv = priv;
 
     if(!tree->hmax_computed_flag)
@@ -171,11 +259,17 @@ hydro_force(const ActiveParticles * act, const double atime, struct sph_pred_dat
     /* Cache the pressure for speed*/
     HYDRA_GET_PRIV(tw)->EntVarPred = SPH_predicted->EntVarPred;
     HYDRA_GET_PRIV(tw)->PressurePred = NULL;
+    HYDRA_GET_PRIV(tw)->NgbParts = NULL;
+
+    /* If many particles are active, most gas particles will be a neighbour, often several times.
+     * Then gather the neighbour data of every gas particle into one record each, up front.
+     * This uses the same threshold as the predicted entropy in density().*/
+    const int PackNgbParts = !act->ActiveParticle || act->NumActiveHydro > 0.1 * (SlotsManager->info[0].size + SlotsManager->info[5].size);
 
     /* Compute pressure for particles used in density: if almost all particles are active, just pre-compute it and avoid thread contention.
      * For very small numbers of particles the memset is more expensive than just doing the exponential math,
-     * so we don't pre-compute at all.*/
-    if(HYDRA_GET_PRIV(tw)->EntVarPred) {
+     * so we don't pre-compute at all. The neighbour records hold the pressure, so it is not needed with them.*/
+    if(HYDRA_GET_PRIV(tw)->EntVarPred && !PackNgbParts) {
         HYDRA_GET_PRIV(tw)->PressurePred = (double *) mymalloc("PressurePred", SlotsManager->info[0].size * sizeof(double));
         /* Do it in slot order for memory locality*/
         #pragma omp parallel for
@@ -207,8 +301,19 @@ hydro_force(const ActiveParticles * act, const double atime, struct sph_pred_dat
             priv->drifts[i] = get_exact_drift_factor(CP, times.Ti_lastactivedrift[i], times.Ti_Current);
     }
 
+    if(PackNgbParts) {
+        priv->NgbParts = (struct HydroNgbPart *) mymalloc("HydroNgbParts", SlotsManager->info[0].size * sizeof(struct HydroNgbPart));
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++)
+            if(P[i].Type == 0 && !P[i].IsGarbage)
+                hydro_ngb_part(i, &priv->NgbParts[P[i].PI], priv);
+        walltime_measure("/SPH/Hydro/Pack");
+    }
+
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
 
+    if(priv->NgbParts)
+        myfree(priv->NgbParts);
     if(HYDRA_GET_PRIV(tw)->PressurePred)
         myfree(HYDRA_GET_PRIV(tw)->PressurePred);
     /* collect some timing information */
@@ -253,6 +358,7 @@ hydro_copy(int place, TreeWalkQueryHydro * input, TreeWalk * tw)
     else
         input->Pressure = PressurePred(eomdensity, input->EntVarPred);
     input->dloga = get_dloga_for_bin(P[place].TimeBinHydro, HYDRA_GET_PRIV(tw)->times->Ti_Current);
+    input->Decoupled = winds_is_particle_decoupled(place);
     /* calculation of F1 */
     soundspeed_i = sqrt(GAMMA * input->Pressure / eomdensity);
     input->F1 = fabs(SPHP(place).DivVel) /
@@ -275,6 +381,68 @@ hydro_reduce(int place, TreeWalkResultHydro * result, enum TreeWalkReduceMode mo
     if(mode == TREEWALK_PRIMARY || SPHP(place).MaxSignalVel < result->MaxSignalVel)
         SPHP(place).MaxSignalVel = result->MaxSignalVel;
 
+    if(mode == TREEWALK_PRIMARY || SPHP(place).MinNgbTimeBin > result->MinNgbTimeBin)
+        SPHP(place).MinNgbTimeBin = result->MinNgbTimeBin;
+
+}
+
+static void
+hydro_pack_query(const TreeWalkQueryHydro * query, TreeWalkPackedQueryHydro * packed, TreeWalk * tw)
+{
+    int k;
+    packed->EgyRho = query->EgyRho;
+    packed->EntVarPred = query->EntVarPred;
+    for(k = 0; k < 3; k++)
+        packed->Vel[k] = query->Vel[k];
+    packed->Hsml = query->Hsml;
+    packed->Mass = query->Mass;
+    packed->Density = query->Density;
+    packed->Pressure = query->Pressure;
+    packed->F1 = query->F1;
+    packed->SPH_DhsmlDensityFactor = query->SPH_DhsmlDensityFactor;
+    packed->dloga = query->dloga;
+    packed->Decoupled = query->Decoupled;
+    packed->pad = 0;
+}
+
+static void
+hydro_unpack_query(const TreeWalkPackedQueryHydro * packed, TreeWalkQueryHydro * query, TreeWalk * tw)
+{
+    int k;
+    query->EgyRho = packed->EgyRho;
+    query->EntVarPred = packed->EntVarPred;
+    for(k = 0; k < 3; k++)
+        query->Vel[k] = packed->Vel[k];
+    query->Hsml = packed->Hsml;
+    query->Mass = packed->Mass;
+    query->Density = packed->Density;
+    query->Pressure = packed->Pressure;
+    query->F1 = packed->F1;
+    query->SPH_DhsmlDensityFactor = packed->SPH_DhsmlDensityFactor;
+    query->dloga = packed->dloga;
+    query->Decoupled = packed->Decoupled;
+}
+
+static void
+hydro_pack_result(const TreeWalkResultHydro * result, TreeWalkPackedResultHydro * packed, TreeWalk * tw)
+{
+    int k;
+    for(k = 0; k < 3; k++)
+        packed->Acc[k] = result->Acc[k];
+    packed->DtEntropy = result->DtEntropy;
+    packed->MaxSignalVel = result->MaxSignalVel;
+    packed->MinNgbTimeBin = result->MinNgbTimeBin;
+}
+
+static void
+hydro_unpack_result(const TreeWalkPackedResultHydro * packed, TreeWalkResultHydro * result, TreeWalk * tw)
+{
+    int k;
+    for(k = 0; k < 3; k++)
+        result->Acc[k] = packed->Acc[k];
+    result->DtEntropy = packed->DtEntropy;
+    result->MaxSignalVel = packed->MaxSignalVel;
+    result->MinNgbTimeBin = packed->MinNgbTimeBin;
 }
 
 /* Find the density predicted forward to the current drift time.
@@ -295,70 +463,12 @@ SPH_DensityPred(MyFloat Density, MyFloat DivVel, double dtdrift)
         return 1e-6 * Density;
 }
 
-/*! This function is the 'core' of the SPH force computation. A target
- *  particle is specified which may either be local, or reside in the
- *  communication buffer.
- */
+/* Compute the neighbour record of gas particle other. The predicted entropy and pressure are
+ * taken from, or stored in, the lazily filled predicted arrays if they exist.*/
 static void
-hydro_ngbiter(
-    TreeWalkQueryHydro * I,
-    TreeWalkResultHydro * O,
-    TreeWalkNgbIterHydro * iter,
-    LocalTreeWalk * lv
-   )
+hydro_ngb_part(const int other, struct HydroNgbPart * pj, struct HydraPriv * priv)
 {
-    if(iter->base.other == -1) {
-        iter->base.Hsml = I->Hsml;
-        iter->base.mask = GASMASK;
-        iter->base.symmetric = NGB_TREEFIND_SYMMETRIC;
-
-        if(HydroParams.DensityIndependentSphOn)
-            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->EgyRho);
-        else
-            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->Density);
-
-        /* initialize variables before SPH loop is started */
-
-        O->Acc[0] = O->Acc[1] = O->Acc[2] = O->DtEntropy = 0;
-        density_kernel_init(&iter->kernel_i, I->Hsml, GetDensityKernelType());
-
-        if(HydroParams.DensityIndependentSphOn)
-            iter->p_over_rho2_i = I->Pressure / (I->EgyRho * I->EgyRho);
-        else
-            iter->p_over_rho2_i = I->Pressure / (I->Density * I->Density);
-
-        O->MaxSignalVel = iter->soundspeed_i;
-        return;
-    }
-
-    int other = iter->base.other;
-    double rsq = iter->base.r2;
-    double * dist = iter->base.dist;
-    double r = iter->base.r;
-
-    if(P[other].Mass == 0) {
-        endrun(12, "Encountered zero mass particle during hydro;"
-                  " We haven't implemented tracer particles and this shall not happen\n");
-    }
-
-    /* Wind particles do not interact hydrodynamically: don't produce hydro acceleration
-     * or change the signalvel.*/
-    if(winds_is_particle_decoupled(other))
-        return;
-
-    DensityKernel kernel_j;
-
-    density_kernel_init(&kernel_j, P[other].Hsml, GetDensityKernelType());
-
-    /* Check we are within the density kernel*/
-    if(rsq <= 0 || !(rsq < iter->kernel_i.HH || rsq < kernel_j.HH))
-        return;
-
-
-    struct HydraPriv * priv = HYDRA_GET_PRIV(lv->tw);
-
-    MyFloat VelPred[3];
-    SPH_VelPred(other, VelPred, &priv->kf);
+    SPH_VelPred(other, pj->VelPred, &priv->kf);
 
     double EntVarPred;
     if(priv->EntVarPred) {
@@ -382,14 +492,14 @@ hydro_ngbiter(
      * This improves on the technique used in Gadget-2 by being a linear prediction that does not become pathological in deep timebins.*/
     int bin = P[other].TimeBinHydro;
     const double density_j = SPH_DensityPred(SPHP(other).Density, SPHP(other).DivVel, priv->drifts[bin]);
-    const double eomdensity = SPH_DensityPred(SPH_EOMDensity(&SPHP(other)), SPHP(other).DivVel, priv->drifts[bin]);;
+    const double eomdensity = SPH_DensityPred(SPH_EOMDensity(&SPHP(other)), SPHP(other).DivVel, priv->drifts[bin]);
 
     /* Compute pressure lazily*/
     double Pressure_j;
 
-    if(HYDRA_GET_PRIV(lv->tw)->PressurePred) {
+    if(priv->PressurePred) {
         #pragma omp atomic read
-        Pressure_j = HYDRA_GET_PRIV(lv->tw)->PressurePred[P[other].PI];
+        Pressure_j = priv->PressurePred[P[other].PI];
         if(Pressure_j == 0) {
             Pressure_j = PressurePred(eomdensity, EntVarPred);
             #pragma omp atomic write
@@ -399,21 +509,82 @@ hydro_ngbiter(
     else
         Pressure_j = PressurePred(eomdensity, EntVarPred);
 
+    const double soundspeed_j = sqrt(GAMMA * Pressure_j / eomdensity);
+
+    pj->EntVarPred = EntVarPred;
+    pj->Density = density_j;
+    pj->EOMRatio = eomdensity / density_j;
+    pj->POverRho2 = Pressure_j / (eomdensity * eomdensity);
+    pj->SoundSpeed = soundspeed_j;
+    /* Note this uses the CurlVel of an inactive particle, which is not at the present drift time*/
+    pj->F2 = fabs(SPHP(other).DivVel) / (fabs(SPHP(other).DivVel) +
+                SPHP(other).CurlVel + 0.0001 * soundspeed_j / priv->fac_mu / P[other].Hsml);
+    pj->DhsmlEgyDensityFactor = SPHP(other).DhsmlEgyDensityFactor;
+    pj->dloga = get_dloga_for_bin(bin, priv->times->Ti_Current);
+    pj->Decoupled = winds_is_particle_decoupled(other);
+    pj->pad = 0;
+}
+
+/* Add the force from one neighbour inside either kernel, given the kernel derivatives
+ * dwk_i for the smoothing length of the query and dwk_j for that of the neighbour.*/
+static inline void
+hydro_ngbiter_pair(
+    TreeWalkQueryHydro * I,
+    TreeWalkResultHydro * O,
+    TreeWalkNgbIterHydro * iter,
+    const double dwk_i, const double dwk_j,
+    LocalTreeWalk * lv
+   )
+{
+    int other = iter->base.other;
+    double rsq = iter->base.r2;
+    double * dist = iter->base.dist;
+    double r = iter->base.r;
+
+    if(P[other].Mass == 0) {
+        endrun(12, "Encountered zero mass particle during hydro;"
+                  " We haven't implemented tracer particles and this shall not happen\n");
+    }
+
+    struct HydraPriv * priv = HYDRA_GET_PRIV(lv->tw);
+    struct HydroNgbPart local;
+    const struct HydroNgbPart * pj = &local;
+    if(priv->NgbParts)
+        pj = &priv->NgbParts[P[other].PI];
+    else
+        hydro_ngb_part(other, &local, priv);
+
+    /* Neighbours in the symmetric walk are inside either kernel, so this sees both the particles this one
+     * acts on and those which act on it.*/
+    if(P[other].TimeBinHydro < O->MinNgbTimeBin)
+        O->MinNgbTimeBin = P[other].TimeBinHydro;
 
-    double p_over_rho2_j = Pressure_j / (eomdensity * eomdensity);
-    double soundspeed_j = sqrt(GAMMA * Pressure_j / eomdensity);
+    /* Wind particles do not interact hydrodynamically: don't produce hydro acceleration
+     * or change the signalvel.*/
+    if(pj->Decoupled)
+        return;
 
     double dv[3];
     int d;
     for(d = 0; d < 3; d++) {
-        dv[d] = I->Vel[d] - VelPred[d];
+        dv[d] = I->Vel[d] - pj->VelPred[d];
     }
 
     double vdotr = dotproduct(dist, dv);
     double vdotr2 = vdotr + HYDRA_GET_PRIV(lv->tw)->hubble_a2 * rsq;
 
-    double dwk_i = density_kernel_dwk(&iter->kernel_i, r * iter->kernel_i.Hinv);
-    double dwk_j = density_kernel_dwk(&kernel_j, r * kernel_j.Hinv);
+    /* The hydro force on a decoupled wind particle is discarded in hydro_postprocess,
+     * which only uses the signal velocity.*/
+    if(I->Decoupled) {
+        if(vdotr2 < 0) {
+            const double mu_ij = HYDRA_GET_PRIV(lv->tw)->fac_mu * vdotr2 / r;
+            double vsig = iter->soundspeed_i + pj->SoundSpeed;
+            vsig -= 3 * mu_ij;
+            if(vsig > O->MaxSignalVel)
+                O->MaxSignalVel = vsig;
+        }
+        return;
+    }
 
     double visc = 0;
 
@@ -421,25 +592,21 @@ hydro_ngbiter(
     {
         /*See Gadget-2 paper: eq. 13*/
         const double mu_ij = HYDRA_GET_PRIV(lv->tw)->fac_mu * vdotr2 / r;	/* note: this is negative! */
-        const double rho_ij = 0.5 * (I->Density + density_j);
-        double vsig = iter->soundspeed_i + soundspeed_j;
+        const double rho_ij = 0.5 * (I->Density + pj->Density);
+        double vsig = iter->soundspeed_i + pj->SoundSpeed;
 
         vsig -= 3 * mu_ij;
 
         if(vsig > O->MaxSignalVel)
             O->MaxSignalVel = vsig;
 
-        /* Note this uses the CurlVel of an inactive particle, which is not at the present drift time*/
-        const double f2 = fabs(SPHP(other).DivVel) / (fabs(SPHP(other).DivVel) +
-                SPHP(other).CurlVel + 0.0001 * soundspeed_j / HYDRA_GET_PRIV(lv->tw)->fac_mu / P[other].Hsml);
-
         /*Gadget-2 paper, eq. 14*/
-        visc = 0.25 * HydroParams.ArtBulkViscConst * vsig * (-mu_ij) / rho_ij * (I->F1 + f2);
+        visc = 0.25 * HydroParams.ArtBulkViscConst * vsig * (-mu_ij) / rho_ij * (I->F1 + pj->F2);
         /* .... end artificial viscosity evaluation */
         /* now make sure that viscous acceleration is not too large */
 
         /*XXX: why is this dloga ?*/
-        double dloga = 2 * DMAX(I->dloga, get_dloga_for_bin(P[other].TimeBinHydro, HYDRA_GET_PRIV(lv->tw)->times->Ti_Current));
+        double dloga = 2 * DMAX(I->dloga, pj->dloga);
         if(dloga > 0 && (dwk_i + dwk_j) < 0)
         {
             if((I->Mass + P[other].Mass) > 0) {
@@ -457,13 +624,13 @@ hydro_ngbiter(
         rr1 = 0, rr2 = 0;
         /* leading-order term */
         hfc += P[other].Mass *
-            (dwk_i*iter->p_over_rho2_i*EntVarPred/I->EntVarPred +
-            dwk_j*p_over_rho2_j*I->EntVarPred/EntVarPred) / r;
+            (dwk_i*iter->p_over_rho2_i*pj->EntVarPred/I->EntVarPred +
+            dwk_j*pj->POverRho2*I->EntVarPred/pj->EntVarPred) / r;
 
         /* enable grad-h corrections only if contrastlimit is non negative */
         if(HydroParams.DensityContrastLimit >= 0) {
             rr1 = I->EgyRho / I->Density;
-            rr2 = eomdensity / density_j;
+            rr2 = pj->EOMRatio;
             if(HydroParams.DensityContrastLimit > 0) {
                 /* apply the limit if it is enabled > 0*/
                 rr1 = DMIN(rr1, HydroParams.DensityContrastLimit);
@@ -475,7 +642,7 @@ hydro_ngbiter(
     /* grad-h corrections: enabled if DensityIndependentSphOn = 0, or DensityConstrastLimit >= 0 */
     /* Formulation derived from the Lagrangian */
     hfc += P[other].Mass * (iter->p_over_rho2_i*I->SPH_DhsmlDensityFactor * dwk_i * rr1
-                + p_over_rho2_j*SPHP(other).DhsmlEgyDensityFactor * dwk_j * rr2) / r;
+                + pj->POverRho2 * pj->DhsmlEgyDensityFactor * dwk_j * rr2) / r;
 
     for(d = 0; d < 3; d ++)
         O->Acc[d] += (-hfc * dist[d]);
@@ -484,6 +651,89 @@ hydro_ngbiter(
 
 }
 
+/*! This function is the 'core' of the SPH force computation. A target
+ *  particle is specified which may either be local, or reside in the
+ *  communication buffer.
+ */
+static void
+hydro_ngbiter(
+    TreeWalkQueryHydro * I,
+    TreeWalkResultHydro * O,
+    TreeWalkNgbIterHydro * iter,
+    LocalTreeWalk * lv
+   )
+{
+    if(iter->base.other == -1) {
+        iter->base.Hsml = I->Hsml;
+        iter->base.mask = GASMASK;
+        iter->base.symmetric = NGB_TREEFIND_SYMMETRIC;
+
+        if(HydroParams.DensityIndependentSphOn)
+            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->EgyRho);
+        else
+            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->Density);
+
+        /* initialize variables before SPH loop is started */
+
+        O->Acc[0] = O->Acc[1] = O->Acc[2] = O->DtEntropy = 0;
+        density_kernel_init(&iter->kernel_i, I->Hsml, GetDensityKernelType());
+
+        if(HydroParams.DensityIndependentSphOn)
+            iter->p_over_rho2_i = I->Pressure / (I->EgyRho * I->EgyRho);
+        else
+            iter->p_over_rho2_i = I->Pressure / (I->Density * I->Density);
+
+        O->MaxSignalVel = iter->soundspeed_i;
+        O->MinNgbTimeBin = TIMEBINS;
+        return;
+    }
+
+    const double rsq = iter->base.r2;
+    const double r = iter->base.r;
+    DensityKernel kernel_j;
+
+    density_kernel_init(&kernel_j, P[iter->base.other].Hsml, GetDensityKernelType());
+
+    /* Check we are within the density kernel*/
+    if(rsq <= 0 || !(rsq < iter->kernel_i.HH || rsq < kernel_j.HH))
+        return;
+
+    hydro_ngbiter_pair(I, O, iter, density_kernel_dwk(&iter->kernel_i, r * iter->kernel_i.Hinv), density_kernel_dwk(&kernel_j, r * kernel_j.Hinv), lv);
+}
+
+/* Evaluate a block of neighbours. Calling hydro_ngbiter_pair directly lets the compiler inline it,
+ * avoiding an indirect call for each pair. The kernel derivatives are evaluated for the whole block at once.*/
+static void
+hydro_ngbiter_batch(
+    TreeWalkQueryHydro * I,
+    TreeWalkResultHydro * O,
+    TreeWalkNgbIterHydro * iter,
+    const TreeWalkNgbBatch * batch,
+    LocalTreeWalk * lv)
+{
+    double u[NGB_BATCH_SIZE], hsml_j[NGB_BATCH_SIZE], wk_i[NGB_BATCH_SIZE], dwk_i[NGB_BATCH_SIZE], dwk_j[NGB_BATCH_SIZE];
+    int j;
+    for(j = 0; j < batch->n; j++) {
+        u[j] = batch->r[j] * iter->kernel_i.Hinv;
+        hsml_j[j] = P[batch->other[j]].Hsml;
+    }
+    density_kernel_wk_dwk_batch(&iter->kernel_i, batch->n, u, wk_i, dwk_i);
+    density_kernel_dwk_batch_varh(&iter->kernel_i, batch->n, batch->r, hsml_j, dwk_j);
+    for(j = 0; j < batch->n; j++) {
+        const double rsq = batch->r2[j];
+        /* Check we are within the density kernel*/
+        if(rsq <= 0 || !(rsq < iter->kernel_i.HH || rsq < hsml_j[j] * hsml_j[j]))
+            continue;
+        iter->base.other = batch->other[j];
+        iter->base.r2 = rsq;
+        iter->base.r = batch->r[j];
+        iter->base.dist[0] = batch->dist[0][j];
+        iter->base.dist[1] = batch->dist[1][j];
+        iter->base.dist[2] = batch->dist[2][j];
+        hydro_ngbiter_pair(I, O, iter, dwk_i[j], dwk_j[j], lv);
+    }
+}
+
 static int
 hydro_haswork(int i, TreeWalk * tw)
 {
@@ -40,6 +40,8 @@ static struct init_params
 
     int ExcursionSetReionOn;
     double ExcursionSetZStart;
+    /* Skip the consistency checks of a restart, relying on the checksums verified on reading*/
+    int TrustedRestart;
 } InitParams;
 
 /*Set the global parameters*/
@@ -47,15 +49,16 @@ void
 set_init_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         InitParams.InitGasTemp = param_get_double(ps, "InitGasTemp");
         InitParams.PartAllocFactor = param_get_double(ps, "PartAllocFactor");
 
         InitParams.ExcursionSetReionOn = param_get_int(ps,"ExcursionSetReionOn");
         InitParams.ExcursionSetZStart = param_get_int(ps,"ExcursionSetZStart");
+        InitParams.TrustedRestart = param_get_int(ps, "TrustedRestart");
     }
-    MPI_Bcast(&InitParams, sizeof(InitParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&InitParams, sizeof(InitParams), MPI_BYTE, 0, GadgetComm);
 }
 
 /* Setup a list of sync points until the end of the simulation.*/
@@ -93,27 +96,33 @@ inttime_t init(int RestartSnapNum, const char * OutputDir, struct header_data *
 {
     int i;
 
-    init_alloc_particle_slot_memory(PartManager, SlotsManager, InitParams.PartAllocFactor, header, MPI_COMM_WORLD);
+    init_alloc_particle_slot_memory(PartManager, SlotsManager, InitParams.PartAllocFactor, header, GadgetComm);
 
     /*Read the snapshot*/
-    petaio_read_snapshot(RestartSnapNum, OutputDir, CP, header, PartManager, SlotsManager, MPI_COMM_WORLD);
+    petaio_read_snapshot(RestartSnapNum, OutputDir, CP, header, PartManager, SlotsManager, GadgetComm);
 
-    domain_test_id_uniqueness(PartManager);
+    /* A checkpoint written by this code, which was read intact, needs no checks*/
+    const int trusted = InitParams.TrustedRestart && RestartSnapNum >= 0;
+    if(!trusted) {
+        domain_test_id_uniqueness(PartManager);
 
-    check_omega(PartManager, CP, get_generations(), header->MassTable);
+        check_omega(PartManager, CP, get_generations(), header->MassTable);
 
-    check_positions(PartManager);
+        check_positions(PartManager);
+    }
+    else
+        message(0, "Trusted restart: skipping the checks of particle IDs, masses, positions and smoothing lengths.\n");
 
     double MeanSeparation[6] = {0};
 
     get_mean_separation(MeanSeparation, PartManager->BoxSize, header->NTotalInit);
 
-    if(RestartSnapNum >= 0)
+    if(RestartSnapNum >= 0 && !trusted)
         check_smoothing_length(PartManager, MeanSeparation);
 
     /* As the above will mostly take place
      * on Task 0, there will be a lot of imbalance*/
-    MPIU_Barrier(MPI_COMM_WORLD);
+    MPIU_Barrier(GadgetComm);
 
     gravshort_set_softenings(MeanSeparation[1]);
     fof_init(MeanSeparation[1]);
@@ -217,10 +226,10 @@ void check_omega(struct part_manager_type * PartManager, Cosmology * CP, int gen
         mass += P[i].Mass;
     }
 
-    MPI_Allreduce(&mass, &masstot, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &omegas, 6, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&mass, &masstot, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &omegas, 6, MPI_DOUBLE, MPI_SUM, GadgetComm);
 
-    MPI_Allreduce(&badmass, &totbad, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&badmass, &totbad, 1, MPI_INT64, MPI_SUM, GadgetComm);
     if(totbad)
         message(0, "Warning: recovering from %ld Mass entries corrupted on disc\n",totbad);
 
@@ -274,9 +283,12 @@ init_alloc_particle_slot_memory(struct part_manager_type * PartManager, struct s
     particle_alloc_memory(PartManager, header->BoxSize, MaxPart);
 
     for(ptype = 0; ptype < 6; ptype ++) {
-        int64_t start = ThisTask * header->NTotal[ptype] / NTask;
-        int64_t end = (ThisTask + 1) * header->NTotal[ptype] / NTask;
-        header->NLocal[ptype] = end - start;
+        /* Otherwise NLocal was already set from the rank index of the snapshot*/
+        if(!header->NLocalFromIndex) {
+            int64_t start = ThisTask * header->NTotal[ptype] / NTask;
+            int64_t end = (ThisTask + 1) * header->NTotal[ptype] / NTask;
+            header->NLocal[ptype] = end - start;
+        }
         PartManager->NumPart += header->NLocal[ptype];
     }
 
@@ -386,7 +398,7 @@ void check_density_entropy(Cosmology * CP, const double MinEgySpec, const double
         if(SphP[i].Entropy < minent)
             SphP[i].Entropy = minent;
     }
-    MPI_Allreduce(MPI_IN_PLACE, &bad, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &bad, 1, MPI_INT, MPI_SUM, GadgetComm);
     if(bad > 0)
         message(0, "Detected bad densities in %d particles on disc\n",bad);
 }
@@ -440,7 +452,7 @@ setup_density_indep_entropy(const ActiveParticles * act, ForceTree * Tree, Cosmo
             double value = fabs(SphP[i].EgyWtDensity - olddensity[i]) / SphP[i].EgyWtDensity;
             maxdiff = DMAX(maxdiff,value);
         }
-        MPI_Allreduce(MPI_IN_PLACE, &maxdiff, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &maxdiff, 1, MPI_DOUBLE, MPI_MAX, GadgetComm);
 
         message(0, "iteration %d, max relative change in EgyWtDensity = %g \n", j, maxdiff);
 
@@ -474,8 +486,8 @@ setup_smoothinglengths(int RestartSnapNum, DomainDecomp * ddecomp, Cosmology * C
     const double MeanGasSeparation = PartManager->BoxSize / pow(NTotGasInit, 1.0 / 3);
 
     int64_t tot_sph, tot_bh;
-    MPI_Allreduce(&SlotsManager->info[0].size, &tot_sph, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&SlotsManager->info[5].size, &tot_bh, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&SlotsManager->info[0].size, &tot_sph, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(&SlotsManager->info[5].size, &tot_bh, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
     /* Do nothing if we are a pure DM run*/
     if(tot_sph + tot_bh == 0)
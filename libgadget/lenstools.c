@@ -3,7 +3,9 @@
 #include <stdlib.h>
 #include <math.h>
 #include <fftw3.h> 
+#include <pfft.h>
 #include <string.h>
+#include <omp.h>
 
 #ifdef USE_CFITSIO
 #include "fitsio.h"
@@ -14,21 +16,8 @@
 #include "cosmology.h"
 #include "physconst.h"
 #include "utils.h"
-
-void linspace(double start, double stop, int num, double *result) {
-    double step = (stop - start) / (num - 1);
-    for (int i = 0; i < num; i++) {
-        result[i] = start + i * step;
-    }
-}
-
-// Function to allocate a 1D array to be used as a 3D array, and initialize elements to zero
-double *allocate_3d_array_as_1d(int Nx, int Ny, int Nz) {
-    double *array = (double *) mymalloc("3d", Nx * Ny * Nz * sizeof(double));
-    // Initialize elements with memset
-    memset(array, 0, Nx * Ny * Nz * sizeof(double));
-    return array;
-}
+#include "utils/openmpsort.h"
+#include "utils/system.h"
 
 // Function to allocate a 1D array to be used as a 2D array, and initialize elements to zero
 double *allocate_2d_array_as_1d(int Nx, int Ny) {
@@ -39,93 +28,69 @@ double *allocate_2d_array_as_1d(int Nx, int Ny) {
     return array;
 }
 
-typedef struct {
-    int nx, ny, nz;
-} GridDimensions;
-
-// Function to determine the bin index for a given value
-int find_bin(double value, double *bins, int resolution, const double L) { // L is the box size
-    // float index
-    double iflt = (value - bins[0]) / (bins[resolution] - bins[0]) * resolution;
-
-    // round down to the nearest integer
-    int index = (int)floor(iflt);
-
-    // check if the value is within the range
-    if (index >= 0 && index < resolution) {
-        return index;
+// Find the plane cell (row * plane_resolution + column) of a particle, or -1 if it is not in the plane.
+// Rows are along the first of the plane directions, as in the output plane.
+static int64_t find_plane_cell(const int p, const double Lbox, const int normal, const double center, const double thickness, const double *left_corner, const int plane_resolution) {
+    const int d0 = (normal == 0) ? 1 : 0;
+    const int d1 = (normal == 2) ? 1 : 2;
+    double position[3];
+    // remove offset
+    for(int d = 0; d < 3; d ++) {
+        position[d] = P[p].Pos[d] - PartManager->CurrentParticleOffset[d];
+        while(position[d] > Lbox) position[d] -= Lbox;
+        while(position[d] <= 0) position[d] += Lbox;
     }
-    else {
+    const int64_t iz = (int64_t) floor((position[normal] - (center - thickness / 2)) / thickness);
+    const int64_t ix = (int64_t) floor((position[d0] - left_corner[d0]) / Lbox * plane_resolution);
+    const int64_t iy = (int64_t) floor((position[d1] - left_corner[d1]) / Lbox * plane_resolution);
+    // continue if the particle is outside the grid
+    if (iz != 0 || ix < 0 || ix >= plane_resolution || iy < 0 || iy >= plane_resolution)
         return -1;
-    }
+    return ix * plane_resolution + iy;
 }
 
-void grid3d_ngb(const struct particle_data * Parts, int num_particles, double **binning, GridDimensions dims, double *density) { // adpated from grid3d_nfw in lenstools
-    
-    #pragma omp parallel for
-    // Process each particle
-    for (int p = 0; p < num_particles; p++) {
-        double position[3];
-        // remove offset
-        for(int d = 0; d < 3; d ++) {
-            position[d] = Parts[p].Pos[d] - PartManager->CurrentParticleOffset[d];
-            while(position[d] > PartManager->BoxSize) position[d] -= PartManager->BoxSize;
-            while(position[d] <= 0) position[d] += PartManager->BoxSize;
-        }
-        int ix = find_bin(position[0], binning[0], dims.nx, PartManager->BoxSize);
-        int iy = find_bin(position[1], binning[1], dims.ny, PartManager->BoxSize);
-        int iz = find_bin(position[2], binning[2], dims.nz, PartManager->BoxSize);
-
-        // continue if the particle is outside the grid
-        if (ix == -1 || iy == -1 || iz == -1) {
-            continue;
+// Find the plane cells of the local particles in the plane, sorted, so that the particles in each cell are adjacent.
+// The list is allocated on the top of the heap and returned in *cells. Returns the length of the list.
+static int64_t find_plane_cells(int64_t **cells, const double Lbox, const int normal, const double center, const double thickness, const double *left_corner, const int plane_resolution) {
+    gadget_thread_arrays gthread = gadget_setup_thread_arrays("PlaneParticles", 0, PartManager->NumPart);
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        int *thrqlocal = gthread.srcs[tid];
+        size_t nqthrlocal = 0;
+        #pragma omp for schedule(static, gthread.schedsz)
+        for (int p = 0; p < PartManager->NumPart; p++) {
+            if (find_plane_cell(p, Lbox, normal, center, thickness, left_corner, plane_resolution) >= 0)
+                thrqlocal[nqthrlocal++] = p;
         }
-        // Increment the density in the appropriate bin
-        #pragma omp atomic
-        ACCESS_3D(density, ix, iy, iz, dims.ny, dims.nz)++;
+        gthread.sizes[tid] = nqthrlocal;
     }
-
+    int *inplane;
+    const int64_t ncells = gadget_compact_thread_arrays(&inplane, &gthread);
+    *cells = (int64_t *) mymalloc2("PlaneCells", (ncells + 1) * sizeof(int64_t));
+    #pragma omp parallel for
+    for (int64_t i = 0; i < ncells; i++)
+        (*cells)[i] = find_plane_cell(inplane[i], Lbox, normal, center, thickness, left_corner, plane_resolution);
+    myfree(inplane);
+    radix_sort_openmp(*cells, ncells, sizeof(int64_t), 0, sizeof(int64_t));
+    return ncells;
 }
 
-void projectDensity(double *density, GridDimensions dims, int normal) {
-    // z; x, y corresponds to x, y (projected plane)
-    // y; x, z corresponds to x, y (projected plane)
-    // x; y, z corresponds to x, y (projected plane)
-    int DimNorm = (normal == 0) ? dims.nx : (normal == 1) ? dims.ny : dims.nz;
-    int Dim0 = (normal == 2) ? dims.nx : (normal == 0) ? dims.ny : dims.nx;
-    int Dim1 = (normal == 2) ? dims.ny : (normal == 1) ? dims.nz : dims.nz;
-
-    if (DimNorm == 1) {
-        return;
-    }
-
-    for (int i = 0; i < Dim0; i++) {
-        for (int j = 0; j < Dim1; j++) {
-            for (int k = 1; k < DimNorm; k++) {
-                if (normal == 0) {
-                    ACCESS_3D(density, 0, i, j, dims.ny, dims.nz) += ACCESS_3D(density, k, i, j, dims.ny, dims.nz);
-                } else if (normal == 1) {
-                    ACCESS_3D(density, i, 0, j, dims.ny, dims.nz) += ACCESS_3D(density, i, k, j, dims.ny, dims.nz);
-                } else {
-                    ACCESS_3D(density, i, j, 0, dims.ny, dims.nz) += ACCESS_3D(density, i, j, k, dims.ny, dims.nz);
-                }
-            }
-        }
-    }
-
-    // transform the 3D density array to a 2D density array (move the elements we need to the front of the array in memory)
-    for (int i = 0; i < Dim0; i++) {
-        for (int j = 0; j < Dim1; j++) {
-            if (normal == 0) {
-                ACCESS_2D(density, i, j, Dim1) = ACCESS_3D(density, 0, i, j, dims.ny, dims.nz);
-            } else if (normal == 2) {
-                ACCESS_2D(density, i, j, Dim1) = ACCESS_3D(density, i, j, 0, dims.ny, dims.nz);
-            } else
-            {
-                ACCESS_2D(density, i, j, Dim1) = ACCESS_3D(density, i, 0, j, dims.ny, dims.nz);
-            }
-            
-        }
+// Add weight times the number of particles in each cell of a sorted cell list to the plane.
+// Each thread takes a part of the list starting and ending on a change of cell, so no two threads write the same cell.
+static void deposit_plane_cells(const int64_t *cells, const int64_t ncells, const double weight, double *density) {
+    #pragma omp parallel
+    {
+        const int nthreads = omp_get_num_threads();
+        const int tid = omp_get_thread_num();
+        int64_t start = ncells * tid / nthreads;
+        int64_t end = ncells * (tid + 1) / nthreads;
+        while (start > 0 && start < ncells && cells[start] == cells[start - 1])
+            start++;
+        while (end > 0 && end < ncells && cells[end] == cells[end - 1])
+            end++;
+        for (int64_t i = start; i < end; i++)
+            density[cells[i]] += weight;
     }
 }
 
@@ -193,12 +158,10 @@ void calculate_lensing_potential(double *density_projected, int plane_resolution
 int64_t cutPlaneGaussianGrid(int num_particles_tot, double comoving_distance, double Lbox, const Cosmology * CP, const double atime, const int normal, const double center, const double thickness, const double *left_corner, const int plane_resolution, double *lensing_potential) {
     // Get the rank of the current process
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     // smooth
     double smooth = 1.0; // fixed in our case
 
-    int64_t num_particles_rank = PartManager->NumPart;  // dark matter-only simulation: NumPart = number of dark matter particles
-
     // double *density_projected = allocate_2d_array_as_1d(plane_resolution, plane_resolution);
     // double *density_projected;
 
@@ -208,19 +171,8 @@ int64_t cutPlaneGaussianGrid(int num_particles_tot, double comoving_distance, do
     double H0 = 100 * CP->HubbleParam * 3.2407793e-20;  // Hubble constant in cgs units
     double cosmo_normalization = 1.5 * pow(H0, 2) * CP->Omega0 / pow(LIGHTCGS, 2);  
 
-    // Binning for directions perpendicular to 'normal'
-    double *binning[3];
     int plane_directions[2] = { (normal + 1) % 3, (normal + 2) % 3 };
 
-    for (int i = 0; i < 3; i++) {
-        int resolution = (i == normal) ? thickness_resolution : plane_resolution;
-        binning[i] = (double *) mymalloc("lensbins", (resolution + 1) * sizeof(double));
-        double start = (i == normal) ? (center - thickness / 2) : left_corner[i];
-        double stop = (i == normal) ? (center + thickness / 2) : (left_corner[i] + Lbox);
-        linspace(start, stop, resolution + 1, binning[i]);
-    }
-
-
     // bin resolution (cell size in kpc/h)
     double bin_resolution[3];
     bin_resolution[plane_directions[0]] = Lbox / plane_resolution;
@@ -230,31 +182,14 @@ int64_t cutPlaneGaussianGrid(int num_particles_tot, double comoving_distance, do
     // density normalization
     double density_normalization = bin_resolution[normal] * comoving_distance * pow(CM_PER_KPC/CP->HubbleParam, 2) / atime;
 
-
-    // density 3D array
-    GridDimensions dims;
-    // Set dimensions based on the orientation specified by 'normal'
-    dims.nx = (normal == 0) ? thickness_resolution : plane_resolution;
-    dims.ny = (normal == 1) ? thickness_resolution : plane_resolution;
-    dims.nz = (normal == 2) ? thickness_resolution : plane_resolution;
-
-    double *density = allocate_3d_array_as_1d(dims.nx, dims.ny, dims.nz);
-
-    grid3d_ngb(P, num_particles_rank, binning, dims, density);
-
-    projectDensity(density, dims, normal);
-
-    //number of particles on the plane
-    int64_t num_particles_plane = 0;
-    // normalize the density to the density fluctuation
+    // Project the particles straight into the plane, normalized to the density fluctuation
     double density_norm_factor = 1. / num_particles_tot * (pow(Lbox,3) / (bin_resolution[0] * bin_resolution[1] * bin_resolution[2]));
-
-    for (int i = 0; i < plane_resolution; i++) {
-        for (int j = 0; j < plane_resolution; j++) {
-            num_particles_plane += ACCESS_2D(density, i, j, plane_resolution);
-            ACCESS_2D(density, i, j, plane_resolution) *= density_norm_factor;
-        }
-    }
+    double *density = allocate_2d_array_as_1d(plane_resolution, plane_resolution);
+    int64_t *cells;
+    //number of particles on the plane
+    int64_t num_particles_plane = find_plane_cells(&cells, Lbox, normal, center, thickness, left_corner, plane_resolution);
+    deposit_plane_cells(cells, num_particles_plane, density_norm_factor, density);
+    myfree(cells);
 
     if(num_particles_plane > 0) {
         // Calculate the lensing potential by solving the Poisson equation
@@ -269,10 +204,140 @@ int64_t cutPlaneGaussianGrid(int num_particles_tot, double comoving_distance, do
     }
 
     myfree(density);
-    // Free the binning arrays
-    for (int i = 2; i >= 0; i--) {
-        myfree(binning[i]);
+    return num_particles_plane;
+}
+
+// Number of particles in a cell of the plane, sent to the rank owning the cell
+struct plane_cell_count {
+    int64_t cell;
+    int64_t count;
+};
+
+int64_t cutPlaneGaussianGridSlab(int64_t num_particles_tot, double comoving_distance, double Lbox, const Cosmology * CP, const double atime, const int normal, const double center, const double thickness, const int plane_resolution, struct plane_slab *slab) {
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+    const ptrdiff_t N = plane_resolution;
+    double smooth = 1.0; // fixed in our case
+
+    // A 1d process mesh, not reordered so that the slabs are in the rank order of GadgetComm
+    MPI_Comm comm_cart_1d;
+    int periods[1] = {0};
+    MPI_Cart_create(GadgetComm, 1, &NTask, periods, 0, &comm_cart_1d);
+
+    ptrdiff_t n[2] = {N, N};
+    ptrdiff_t local_ni[2], local_i_start[2], local_no[2], local_o_start[2];
+    ptrdiff_t fftsize = 2 * pfft_local_size_dft_r2c(2, n, comm_cart_1d, PFFT_TRANSPOSED_NONE, local_ni, local_i_start, local_no, local_o_start);
+
+    // The real array is kept as the output slab, so it is allocated first
+    double *real = (double *) mymalloc("PlaneReal", fftsize * sizeof(double));
+    memset(real, 0, fftsize * sizeof(double));
+    pfft_complex *complx = (pfft_complex *) mymalloc("PlaneComplex", fftsize * sizeof(double));
+
+    slab->Nmesh = N;
+    slab->RowStart = local_i_start[0];
+    slab->NRows = local_ni[0];
+    slab->Data = real;
+
+    // The rank owning each row
+    ptrdiff_t *rowstart = (ptrdiff_t *) mymalloc("PlaneRowStart", (NTask + 1) * sizeof(ptrdiff_t));
+    MPI_Allgather(&local_i_start[0], sizeof(ptrdiff_t), MPI_BYTE, rowstart, sizeof(ptrdiff_t), MPI_BYTE, GadgetComm);
+    rowstart[NTask] = N;
+
+    // Find the cells of the local particles in the plane. Sorting the cells also groups them by the rank owning them.
+    const double left_corner[3] = {0, 0, 0};
+    int64_t *cells;
+    const int64_t ncells = find_plane_cells(&cells, Lbox, normal, center, thickness, left_corner, N);
+
+    // Count the particles in each distinct cell
+    struct plane_cell_count *send = (struct plane_cell_count *) mymalloc("PlaneSend", (ncells + 1) * sizeof(struct plane_cell_count));
+    int *send_count = (int *) mymalloc("PlaneSendCount", 2 * NTask * sizeof(int));
+    int *recv_count = send_count + NTask;
+    memset(send_count, 0, NTask * sizeof(int));
+    int64_t nsend = 0;
+    int owner = 0;
+    for (int64_t i = 0; i < ncells; i++) {
+        if (nsend > 0 && send[nsend - 1].cell == cells[i]) {
+            send[nsend - 1].count++;
+            continue;
+        }
+        const int64_t row = cells[i] / N;
+        while (row >= rowstart[owner + 1])
+            owner++;
+        send[nsend].cell = cells[i];
+        send[nsend].count = 1;
+        nsend++;
+        send_count[owner]++;
+    }
+    MPI_Alltoall(send_count, 1, MPI_INT, recv_count, 1, MPI_INT, GadgetComm);
+    int64_t nrecv = 0;
+    for (int i = 0; i < NTask; i++)
+        nrecv += recv_count[i];
+
+    struct plane_cell_count *recv = (struct plane_cell_count *) mymalloc("PlaneRecv", (nrecv + 1) * sizeof(struct plane_cell_count));
+    MPI_Datatype MPI_TYPE_CELL;
+    MPI_Type_contiguous(sizeof(struct plane_cell_count), MPI_BYTE, &MPI_TYPE_CELL);
+    MPI_Type_commit(&MPI_TYPE_CELL);
+    MPI_Alltoallv_smart(send, send_count, NULL, MPI_TYPE_CELL, recv, recv_count, NULL, MPI_TYPE_CELL, GadgetComm);
+    MPI_Type_free(&MPI_TYPE_CELL);
+
+    // normalize the density to the density fluctuation
+    const double bin_area = (Lbox / N) * (Lbox / N);
+    const double density_norm_factor = 1. / num_particles_tot * (pow(Lbox, 3) / (bin_area * thickness));
+    int64_t num_particles_plane = 0;
+    for (int64_t i = 0; i < nrecv; i++) {
+        const int64_t row = recv[i].cell / N - local_i_start[0];
+        const int64_t col = recv[i].cell % N;
+        if (row < 0 || row >= local_ni[0])
+            endrun(5, "Plane cell %ld is not in the slab [%td, %td)\n", recv[i].cell, local_i_start[0], local_i_start[0] + local_ni[0]);
+        ACCESS_2D(real, row, col, N) += recv[i].count * density_norm_factor;
+        num_particles_plane += recv[i].count;
+    }
+    myfree(recv);
+    myfree(send_count);
+    myfree(send);
+    myfree(rowstart);
+    myfree(cells);
+    MPI_Allreduce(MPI_IN_PLACE, &num_particles_plane, 1, MPI_INT64, MPI_SUM, GadgetComm);
+
+    if (num_particles_plane > 0) {
+        pfft_plan plan_forw = pfft_plan_dft_r2c(2, n, real, complx, comm_cart_1d, PFFT_FORWARD, PFFT_TRANSPOSED_NONE | PFFT_ESTIMATE | PFFT_DESTROY_INPUT);
+        pfft_plan plan_back = pfft_plan_dft_c2r(2, n, complx, real, comm_cart_1d, PFFT_BACKWARD, PFFT_TRANSPOSED_NONE | PFFT_ESTIMATE | PFFT_DESTROY_INPUT);
+        pfft_execute(plan_forw);
+
+        // Solve the Poisson equation and apply Gaussian smoothing, as in calculate_lensing_potential
+        const double bin_resolution = Lbox / N;
+        for (ptrdiff_t i = 0; i < local_no[0]; i++) {
+            const ptrdiff_t ki = i + local_o_start[0];
+            double lx = ki < N / 2 ? ki : -(N - ki);
+            lx /= N;
+            for (ptrdiff_t j = 0; j < local_no[1]; j++) {
+                const ptrdiff_t kj = j + local_o_start[1];
+                double ly = (double) kj / N;
+                double l_squared = lx * lx + ly * ly;
+                if (ki == 0 && kj == 0)
+                    l_squared = 1.0;  // Avoid division by zero at the DC component
+                const ptrdiff_t idx = i * local_no[1] + j;
+                double factor = -2.0 * (bin_resolution * bin_resolution / (comoving_distance * comoving_distance)) / (l_squared * 4 * M_PI * M_PI);
+                factor *= exp(-0.5 * ((2.0 * M_PI * smooth) * (2.0 * M_PI * smooth)) * l_squared);
+                complx[idx][0] *= factor;
+                complx[idx][1] *= factor;
+            }
+        }
+        pfft_execute(plan_back);
+        pfft_destroy_plan(plan_back);
+        pfft_destroy_plan(plan_forw);
+
+        // Normalize the inverse FFT and the lensing potential
+        const double H0 = 100 * CP->HubbleParam * 3.2407793e-20;  // Hubble constant in cgs units
+        const double cosmo_normalization = 1.5 * pow(H0, 2) * CP->Omega0 / pow(LIGHTCGS, 2);
+        const double density_normalization = thickness * comoving_distance * pow(CM_PER_KPC/CP->HubbleParam, 2) / atime;
+        const double norm = cosmo_normalization * density_normalization / (N * N);
+        for (ptrdiff_t i = 0; i < local_ni[0] * N; i++)
+            real[i] *= norm;
     }
+    myfree(complx);
+    MPI_Comm_free(&comm_cart_1d);
     return num_particles_plane;
 }
 
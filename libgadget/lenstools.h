@@ -4,9 +4,6 @@
 #include <stddef.h>
 #include "cosmology.h"
 
-// Macro to access the 3D array elements using the 1D array
-#define ACCESS_3D(array, i, j, k, Ny, Nz) ((array)[((i) * (Ny) + (j)) * (Nz) + (k)])
-
 // Macro to access the 2D array elements using the 1D array
 #define ACCESS_2D(array, i, j, Ny) ((array)[(i) * (Ny) + (j)])
 
@@ -15,13 +12,23 @@
 // Simulates cutting a plane with a Gaussian grid
 int64_t cutPlaneGaussianGrid(int num_particles_tot, double comoving_distance, double Lbox, const Cosmology * CP, const double atime, const int normal, const double center, const double thickness, const double *left_corner, const int plane_resolution, double *lensing_potential);
 
+// A slab of rows of a potential plane, distributed over the ranks
+struct plane_slab {
+    int Nmesh;          // the full plane is Nmesh x Nmesh
+    ptrdiff_t RowStart; // first row on this rank
+    ptrdiff_t NRows;    // number of rows on this rank
+    double *Data;       // NRows x Nmesh values, allocated with mymalloc
+};
+
+// As cutPlaneGaussianGrid, but with the plane split into slabs of rows over the ranks and solved with a parallel FFT.
+// Collective. Returns the total number of particles on the plane.
+int64_t cutPlaneGaussianGridSlab(int64_t num_particles_tot, double comoving_distance, double Lbox, const Cosmology * CP, const double atime, const int normal, const double center, const double thickness, const int plane_resolution, struct plane_slab *slab);
+
 // Saves the potential plane data
 void savePotentialPlane(double *data, int rows, int cols, const char * const filename, double Lbox, Cosmology * CP, double redshift, double comoving_distance, int64_t num_particles, const double UnitLength_in_cm);
 
 // Function to allocate a 2D array as a 1D array
 double *allocate_2d_array_as_1d(int Nx, int Ny);
 
-// Function to allocate a 3D array as a 1D array
-double *allocate_3d_array_as_1d(int Nx, int Ny, int Nz);
 
 #endif // LENSTOOLS_H
@@ -3,22 +3,81 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <gsl/gsl_integration.h>
+#include <stddef.h>
+#include <float.h>
+#include <limits.h>
+#include <omp.h>
+#include <bigfile.h>
+#include <bigfile-mpi.h>
 /*For mkdir*/
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "utils.h"
 
+#include "lightcone.h"
 #include "timefac.h"
 #include "partmanager.h"
 #include "cosmology.h"
 #include "physconst.h"
+#include "petaio.h"
+#include "walltime.h"
+
+static struct lightcone_params
+{
+    /* If true, buffer the crossings and write them to a bigfile in OutputDir/lightcone,
+     * otherwise append them to a raw file per rank*/
+    int BigFile;
+    /* Number of steps between writes of the buffered crossings*/
+    int FlushSteps;
+    /* Write all particles below this redshift; write a fraction above this. */
+    double ReferenceRedshift;
+    /* If false, do not write the crossing particles, only the maps*/
+    int OutputParticles;
+    /* HEALPix resolution of the mass maps. Zero disables the maps.*/
+    int64_t MapNside;
+    /* Comoving width of each map shell, in internal units*/
+    double MapShellWidth;
+    /* Also make maps of the mass-weighted radial peculiar velocity*/
+    int MapVelocity;
+} LightconeParams;
+
+/* A HEALPix map of the crossings in a shell of comoving distance [Index, Index + 1) * MapShellWidth*/
+struct LightconeShell
+{
+    int Index;
+    double * Mass;
+    double * Momentum;
+};
+
+/* Shells with crossings on this rank that are not yet complete*/
+static struct LightconeShell * Shells;
+static int NShells;
+/* Largest shell index not yet written. All ranks agree on this.*/
+static int NextShell = -1;
+
+/* A particle crossing the lightcone, as buffered for the bigfile output*/
+struct LightconeCrossing
+{
+    double Pos[3];
+    float Vel[3];
+    /* Scale factor of the step on which the particle crossed*/
+    float Aexp;
+    MyIDType ID;
+    float SampleFraction;
+};
+
+/* Crossings since the last write. Kept outside the memory heap, as it lives over several steps.*/
+static struct LightconeCrossing * Crossings;
+static int64_t NCrossings;
+static int64_t MaxCrossings;
+static int StepsSinceFlush;
+static char * LightconeDir;
+
+/* Cosmology and internal velocity unit, for the horizon distance*/
+static Cosmology * LightconeCP;
+static double UnitVelocity_in_cm_per_s;
 
-#define NENTRY 4096
-static double tab_loga[NENTRY];
-static double dloga;
-static double tab_Dc[NENTRY];
 /*
  * light cone on the fly:
  *
@@ -31,6 +90,9 @@ static double tab_Dc[NENTRY];
  *
  * */
 static int Nreplica;
+/* Each replica has its own random stream, purpose RND_LIGHTCONE + replica*/
+#define MAXREPLICA 1000
+_Static_assert(RND_LIGHTCONE + MAXREPLICA < RND_MAX_PURPOSE, "Lightcone replicas overflow the random number purpose");
 static int BoxBoost = 20;
 static double Reps[8192][3];
 static double HorizonDistance2;
@@ -40,95 +102,64 @@ static double HorizonDistance2Prev;
 static double HorizonDistanceRef;
 static double zmin = 0.1;
 static double zmax = 80.0;
-static double ReferenceRedshift = 2.0; /* write all particles below this redshift; write a fraction above this. */
 static double SampleFraction; /* current fraction of particle gets written */
 static FILE * fd_lightcone;
 
 static double lightcone_get_horizon(double a);
-static void lightcone_cross(int p, double ddrift, const RandTable * const rnd);
+static int lightcone_cross(int p, double ddrift, const RandTable * const rnd, const int * reps, const int nreps, double (*pos)[3]);
 static void lightcone_set_time(double a, const double BoxSize);
-/*
-M, L = self.M, self.L
-  logx = numpy.linspace(log10amin, 0, Np)
-  def kernel(log10a):
-    a = numpy.exp(log10a)
-    return 1 / self.Ea(a) * a ** -1 # dz = - 1 / a dlog10a
-  y = numpy.array( [romberg(kernel, log10a, 0, vec_func=True, divmax=10) for log10a in logx])
-*/
-static double kernel(double loga, void * params) {
-    double a = exp(loga);
-      Cosmology * CP = (Cosmology *) params;
-    return 1 / hubble_function(CP, a) * CP->Hubble / a;
-}
-
-static void lightcone_init_entry(Cosmology * CP, int i, const double UnitLength_in_cm) {
-    tab_loga[i] = - dloga * (NENTRY - i - 1);
 
-    gsl_integration_workspace * w = gsl_integration_workspace_alloc (1000);
-
-    double result, error;
-
-    gsl_function F;
-    F.function = &kernel;
-    F.params = CP;
-    gsl_integration_qags (&F, tab_loga[i], 0, 0, 1e-7, 1000,
-            w, &result, &error);
-
-    /* result is in DH, hubble distance */
-    /* convert to cm / h */
-    result *= LIGHTCGS / HUBBLE;
-    /* convert to Kpc/h or internal units */
-    result /= UnitLength_in_cm;
-
-    gsl_integration_workspace_free (w);
-    tab_Dc[i] = result;
-//    double a = exp(tab_loga[i]);
-//    double z = 1 / a - 1;
-//    printf("a = %g z = %g Dc = %g\n", a, z, result);
+void
+set_lightcone_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        LightconeParams.BigFile = param_get_int(ps, "LightconeBigFile");
+        LightconeParams.FlushSteps = param_get_int(ps, "LightconeFlushSteps");
+        LightconeParams.ReferenceRedshift = param_get_double(ps, "LightconeReferenceRedshift");
+        LightconeParams.OutputParticles = param_get_int(ps, "LightconeOutputParticles");
+        LightconeParams.MapNside = param_get_int(ps, "LightconeMapNside");
+        LightconeParams.MapShellWidth = param_get_double(ps, "LightconeMapShellWidth");
+        LightconeParams.MapVelocity = param_get_int(ps, "LightconeMapVelocity");
+        if(LightconeParams.MapNside > 0 && LightconeParams.MapShellWidth <= 0)
+            endrun(0, "LightconeMapShellWidth = %g must be positive to make lightcone maps\n", LightconeParams.MapShellWidth);
+    }
+    MPI_Bcast(&LightconeParams, sizeof(struct lightcone_params), MPI_BYTE, 0, GadgetComm);
 }
-
 void lightcone_init(Cosmology * CP, double timeBegin, const double UnitLength_in_cm, const char * OutputDir)
 {
-    int i;
-    dloga = (0.0 - log(timeBegin)) / (NENTRY - 1);
-    for(i = 0; i < NENTRY; i ++) {
-        lightcone_init_entry(CP, i, UnitLength_in_cm);
-    };
+    LightconeCP = CP;
+    UnitVelocity_in_cm_per_s = UnitLength_in_cm / CP->UnitTime_in_s;
     char buf[1024];
     int chunk = 100;
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
 
     sprintf(buf, "%s/lightcone/", OutputDir);
     mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/", OutputDir, (int)(ThisTask / chunk));
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/lightcone-%05d.raw", OutputDir, (int)(ThisTask / chunk), ThisTask);
+    if(LightconeParams.BigFile || LightconeParams.MapNside > 0)
+        LightconeDir = fastpm_strdup(buf);
+    if(LightconeParams.OutputParticles && !LightconeParams.BigFile) {
+        sprintf(buf, "%s/lightcone/%03d/", OutputDir, (int)(ThisTask / chunk));
+        mkdir(buf, 02755);
+        sprintf(buf, "%s/lightcone/%03d/lightcone-%05d.raw", OutputDir, (int)(ThisTask / chunk), ThisTask);
 
-    fd_lightcone = fopen(buf, "a+");
-    if(fd_lightcone == NULL) {
-        endrun(1, "failed to open %s\n", buf);
+        fd_lightcone = fopen(buf, "a+");
+        if(fd_lightcone == NULL) {
+            endrun(1, "failed to open %s\n", buf);
+        }
     }
-    HorizonDistanceRef = lightcone_get_horizon(1 / (1 + ReferenceRedshift));
-    printf("lightcone reference redshift = %g distance = %g\n",
-            ReferenceRedshift, HorizonDistanceRef);
+    HorizonDistanceRef = lightcone_get_horizon(1 / (1 + LightconeParams.ReferenceRedshift));
+    message(0, "lightcone reference redshift = %g distance = %g\n",
+            LightconeParams.ReferenceRedshift, HorizonDistanceRef);
 }
 
 /* returns the horizon distance */
 static double lightcone_get_horizon(double a) {
-    double loga = log(a);
-    int bin = (log(a) -tab_loga[0]) / dloga;
-    if (bin < 0) {
-        return tab_Dc[0];
-    }
-    if (bin >= NENTRY - 1) {
-        return tab_Dc[NENTRY - 1];
-    }
-    double u1 = loga - tab_loga[bin];
-    double u2 = tab_loga[bin + 1] - loga;
-    u1 /= (tab_loga[bin + 1] - tab_loga[bin]);
-    u2 /= (tab_loga[bin + 1] - tab_loga[bin]);
-    return tab_Dc[bin] * u2 + tab_Dc[bin + 1] * u1;
+    if(a >= 1)
+        return 0;
+    return compute_comoving_distance(LightconeCP, a, 1, UnitVelocity_in_cm_per_s);
 }
 
 /* fill in the table of box offsets for current time */
@@ -154,7 +185,7 @@ static void update_replicas(double a, double BoxSize) {
             Reps[Nreplica][1] = ry * BoxSize;
             Reps[Nreplica][2] = rz * BoxSize;
             Nreplica ++;
-            if(Nreplica > 1000) {
+            if(Nreplica > MAXREPLICA) {
                 endrun(951234, "too many replica");
             }
         }
@@ -170,21 +201,383 @@ static void update_replicas(double a, double BoxSize) {
     }
 }
 
+/* Add a crossing to the buffer, growing it if needed*/
+static void
+lightcone_add_crossing(const int p, const double pos[3], const double a)
+{
+    if(NCrossings >= MaxCrossings) {
+        MaxCrossings = DMAX(2 * MaxCrossings, 4096);
+        Crossings = (struct LightconeCrossing *) realloc(Crossings, MaxCrossings * sizeof(struct LightconeCrossing));
+        if(!Crossings)
+            endrun(1, "Could not allocate %ld lightcone crossings\n", MaxCrossings);
+    }
+    struct LightconeCrossing * cross = &Crossings[NCrossings++];
+    int k;
+    for(k = 0; k < 3; k++) {
+        cross->Pos[k] = pos[k];
+        /* Peculiar velocity, a dx/dt*/
+        cross->Vel[k] = P[p].Vel[k] / a;
+    }
+    cross->Aexp = a;
+    cross->ID = P[p].ID;
+    cross->SampleFraction = SampleFraction;
+}
+
+/* Save one column of the buffered crossings: items members of type dtype, at offset in the struct*/
+static void
+lightcone_save_column(BigFile * bf, const char * blockname, const char * dtype, const int items, const size_t offset)
+{
+    BigArray array = {0};
+    size_t dims[2] = {NCrossings, items};
+    ptrdiff_t strides[2] = {sizeof(struct LightconeCrossing), big_file_dtype_itemsize(dtype)};
+    big_array_init(&array, (char *) Crossings + offset, dtype, 2, dims, strides);
+    petaio_save_block(bf, blockname, &array, 0);
+}
+
+/* RING scheme HEALPix pixel containing the direction vec, following ang2pix_ring in the HEALPix library.*/
+static int64_t
+healpix_vec2pix_ring(const int64_t nside, const double vec[3])
+{
+    const double z = vec[2] / sqrt(vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2]);
+    const double za = fabs(z);
+    /* Azimuth in units of pi/2, in [0, 4)*/
+    double tt = atan2(vec[1], vec[0]) / M_PI_2;
+    if(tt < 0)
+        tt += 4;
+    if(tt >= 4)
+        tt = 0;
+
+    if(za <= 2./3) {
+        /* Equatorial region*/
+        const double temp1 = nside * (0.5 + tt);
+        const double temp2 = nside * z * 0.75;
+        const int64_t jp = temp1 - temp2;
+        const int64_t jm = temp1 + temp2;
+        const int64_t ir = nside + 1 + jp - jm;
+        const int64_t kshift = 1 - (ir & 1);
+        int64_t ip = (jp + jm - nside + kshift + 1) / 2;
+        ip = ((ip % (4 * nside)) + 4 * nside) % (4 * nside);
+        return 2 * nside * (nside - 1) + (ir - 1) * 4 * nside + ip;
+    }
+    /* Polar caps*/
+    const double tp = tt - (int) tt;
+    const double tmp = nside * sqrt(3 * (1 - za));
+    const int64_t jp = tp * tmp;
+    const int64_t jm = (1.0 - tp) * tmp;
+    const int64_t ir = jp + jm + 1;
+    int64_t ip = tt * ir;
+    ip = ((ip % (4 * ir)) + 4 * ir) % (4 * ir);
+    if(z > 0)
+        return 2 * ir * (ir - 1) + ip;
+    return 12 * nside * nside - 2 * ir * (ir + 1) + ip;
+}
+
+/* Find the map of a shell, allocating a new empty map if needed. The maps live over many steps,
+ * so are outside the memory heap.*/
+static struct LightconeShell *
+lightcone_get_shell(const int index)
+{
+    int i;
+    for(i = 0; i < NShells; i++)
+        if(Shells[i].Index == index)
+            return &Shells[i];
+    Shells = (struct LightconeShell *) realloc(Shells, (NShells + 1) * sizeof(struct LightconeShell));
+    struct LightconeShell * shell = &Shells[NShells++];
+    const int64_t npix = 12 * LightconeParams.MapNside * LightconeParams.MapNside;
+    shell->Index = index;
+    shell->Mass = (double *) calloc(npix, sizeof(double));
+    shell->Momentum = NULL;
+    if(LightconeParams.MapVelocity)
+        shell->Momentum = (double *) calloc(npix, sizeof(double));
+    if(!shell->Mass || (LightconeParams.MapVelocity && !shell->Momentum))
+        endrun(1, "Could not allocate lightcone map with %ld pixels\n", npix);
+    return shell;
+}
+
+/* Add the mass of a crossing to the shell maps. Mass is weighted by the inverse sampling fraction.*/
+static void
+lightcone_deposit(const int p, const double pos[3], const double a)
+{
+    const double r = sqrt(pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2]);
+    if(r <= 0)
+        return;
+    /* Interpolation may put a crossing just outside the shells still open*/
+    int index = r / LightconeParams.MapShellWidth;
+    if(index > NextShell)
+        index = NextShell;
+    struct LightconeShell * shell = lightcone_get_shell(index);
+    const int64_t pix = healpix_vec2pix_ring(LightconeParams.MapNside, pos);
+    const double mass = P[p].Mass / SampleFraction;
+    shell->Mass[pix] += mass;
+    if(shell->Momentum) {
+        int k;
+        double vr = 0;
+        for(k = 0; k < 3; k++)
+            vr += P[p].Vel[k] / a * pos[k] / r;
+        shell->Momentum[pix] += mass * vr;
+    }
+}
+
+/* Save one map, held by rank 0, as a block*/
+static void
+lightcone_save_map(BigFile * bf, const char * blockname, double * map, const int64_t npix)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    BigArray array = {0};
+    size_t dims[2] = {ThisTask == 0 ? npix : 0, 1};
+    ptrdiff_t strides[2] = {sizeof(double), sizeof(double)};
+    big_array_init(&array, map, "=f8", 2, dims, strides);
+    petaio_save_block(bf, blockname, &array, 0);
+}
+
+/* Sum the maps of a shell over all ranks, write them and free the shell. Collective.*/
+static void
+lightcone_write_shell(const int index, const double a)
+{
+    struct LightconeShell * shell = lightcone_get_shell(index);
+    const int64_t npix = 12 * LightconeParams.MapNside * LightconeParams.MapNside;
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Reduce(ThisTask == 0 ? MPI_IN_PLACE : shell->Mass, shell->Mass, npix, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+    if(shell->Momentum)
+        MPI_Reduce(ThisTask == 0 ? MPI_IN_PLACE : shell->Momentum, shell->Momentum, npix, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+
+    char * fname = fastpm_strdup_printf("%s/healpix-%04d", LightconeDir, index);
+    message(0, "Writing lightcone map shell %d to %s\n", index, fname);
+    BigFile bf;
+    if(0 != big_file_mpi_create(&bf, fname, GadgetComm))
+        endrun(0, "Failed to create lightcone map at %s: %s\n", fname, big_file_get_error_message());
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&bf, &bh, "Header", NULL, 0, 0, 0, GadgetComm))
+        endrun(0, "Failed to create block at %s:%s\n", "Header", big_file_get_error_message());
+    const double rmin = index * LightconeParams.MapShellWidth;
+    const double rmax = (index + 1) * LightconeParams.MapShellWidth;
+    if((0 != big_block_set_attr(&bh, "Nside", &LightconeParams.MapNside, "i8", 1)) ||
+       (0 != big_block_set_attr(&bh, "RMin", &rmin, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "RMax", &rmax, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Time", &a, "f8", 1)))
+        endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+    if(0 != big_block_mpi_close(&bh, GadgetComm))
+        endrun(0, "Failed to close block %s\n", big_file_get_error_message());
+    lightcone_save_map(&bf, "Mass", shell->Mass, npix);
+    if(shell->Momentum)
+        lightcone_save_map(&bf, "RadialMomentum", shell->Momentum, npix);
+    if(0 != big_file_mpi_close(&bf, GadgetComm))
+        endrun(0, "Failed to close lightcone map at %s: %s\n", fname, big_file_get_error_message());
+    myfree(fname);
+
+    free(shell->Mass);
+    free(shell->Momentum);
+    /* Remove the shell from the list*/
+    *shell = Shells[--NShells];
+    walltime_measure("/Lightcone/Map");
+}
+
+/* Write the shells which the horizon has left behind. If final, also write the shell the horizon is in.*/
+static void
+lightcone_write_shells(const double a, const int final)
+{
+    if(LightconeParams.MapNside <= 0 || NextShell < 0)
+        return;
+    const int last = final ? (int) (HorizonDistance / LightconeParams.MapShellWidth) : INT_MAX;
+    while(NextShell >= 0 && (NextShell * LightconeParams.MapShellWidth > HorizonDistance || NextShell >= last)) {
+        lightcone_write_shell(NextShell, a);
+        NextShell--;
+    }
+}
+
+void
+lightcone_flush(const double a, const int final)
+{
+    if(final)
+        lightcone_write_shells(a, final);
+    if(!LightconeParams.OutputParticles)
+        return;
+    if(!LightconeParams.BigFile) {
+        fflush(fd_lightcone);
+        return;
+    }
+    const int64_t ntot = count_sum(NCrossings);
+    StepsSinceFlush = 0;
+    if(ntot == 0)
+        return;
+    char * fname = fastpm_strdup_printf("%s/lightcone-%08.6f", LightconeDir, a);
+    message(0, "Writing %ld lightcone crossings to %s\n", ntot, fname);
+    BigFile bf;
+    if(0 != big_file_mpi_create(&bf, fname, GadgetComm))
+        endrun(0, "Failed to create lightcone at %s: %s\n", fname, big_file_get_error_message());
+    lightcone_save_column(&bf, "Position", "=f8", 3, offsetof(struct LightconeCrossing, Pos));
+    lightcone_save_column(&bf, "Velocity", "=f4", 3, offsetof(struct LightconeCrossing, Vel));
+    lightcone_save_column(&bf, "Aexp", "=f4", 1, offsetof(struct LightconeCrossing, Aexp));
+    lightcone_save_column(&bf, "ID", "=u8", 1, offsetof(struct LightconeCrossing, ID));
+    lightcone_save_column(&bf, "SampleFraction", "=f4", 1, offsetof(struct LightconeCrossing, SampleFraction));
+    if(0 != big_file_mpi_close(&bf, GadgetComm))
+        endrun(0, "Failed to close lightcone at %s: %s\n", fname, big_file_get_error_message());
+    myfree(fname);
+    NCrossings = 0;
+    walltime_measure("/Lightcone/Write");
+}
+
+/* Bounding box of the particles in a top leaf, at the start and end of the drift*/
+struct lightcone_box
+{
+    double min[3];
+    double max[3];
+};
+
+/* Group of a particle for the replica culling: its top leaf if local, or an extra final group.*/
+static inline int
+lightcone_group(const int p, const int StartLeaf, const int ngroup)
+{
+    const int g = P[p].TopLeaf - StartLeaf;
+    if(g < 0 || g >= ngroup - 1)
+        return ngroup - 1;
+    return g;
+}
+
+/* For each group of particles (local top leaf) find the replicas which may contain a crossing.
+ * A particle can cross only if its box is partly inside the old horizon and partly outside the new one.
+ * Returns the replica lists, which are stored in reps[offset[g]] ... reps[offset[g] + nreps[g]].*/
+static int *
+lightcone_cull_replicas(const double ddrift, const int StartLeaf, const int ngroup, int * nreps, int * offset)
+{
+    int64_t i;
+    int g, k;
+    const int NumThreads = omp_get_max_threads();
+    struct lightcone_box * boxes = (struct lightcone_box *) mymalloc("LightconeBoxes", NumThreads * ngroup * sizeof(struct lightcone_box));
+    for(i = 0; i < NumThreads * ngroup; i++) {
+        for(k = 0; k < 3; k++) {
+            boxes[i].min[k] = DBL_MAX;
+            boxes[i].max[k] = -DBL_MAX;
+        }
+    }
+    #pragma omp parallel
+    {
+        struct lightcone_box * thrboxes = boxes + omp_get_thread_num() * ngroup;
+        #pragma omp for
+        for(i = 0; i < PartManager->NumPart; i++) {
+            if(P[i].Type != 1 || P[i].IsGarbage)
+                continue;
+            struct lightcone_box * box = &thrboxes[lightcone_group(i, StartLeaf, ngroup)];
+            for(k = 0; k < 3; k++) {
+                const double pold = P[i].Pos[k] - PartManager->CurrentParticleOffset[k];
+                const double pnew = pold + P[i].Vel[k] * ddrift;
+                box->min[k] = DMIN(box->min[k], DMIN(pold, pnew));
+                box->max[k] = DMAX(box->max[k], DMAX(pold, pnew));
+            }
+        }
+    }
+    /* Reduce the thread boxes into the first*/
+    int t;
+    for(t = 1; t < NumThreads; t++)
+        for(g = 0; g < ngroup; g++)
+            for(k = 0; k < 3; k++) {
+                boxes[g].min[k] = DMIN(boxes[g].min[k], boxes[t * ngroup + g].min[k]);
+                boxes[g].max[k] = DMAX(boxes[g].max[k], boxes[t * ngroup + g].max[k]);
+            }
+
+    int * reps = (int *) mymalloc2("LightconeReps", ngroup * Nreplica * sizeof(int));
+    int64_t ntot = 0;
+    for(g = 0; g < ngroup; g++) {
+        offset[g] = g * Nreplica;
+        nreps[g] = 0;
+        /* Empty group*/
+        if(boxes[g].min[0] > boxes[g].max[0])
+            continue;
+        for(i = 0; i < Nreplica; i++) {
+            double dmin2 = 0, dmax2 = 0;
+            for(k = 0; k < 3; k++) {
+                const double lo = boxes[g].min[k] + Reps[i][k];
+                const double hi = boxes[g].max[k] + Reps[i][k];
+                const double dnear = (lo > 0) ? lo : ((hi < 0) ? -hi : 0);
+                const double dfar = DMAX(fabs(lo), fabs(hi));
+                dmin2 += dnear * dnear;
+                dmax2 += dfar * dfar;
+            }
+            if(dmin2 <= HorizonDistance2Prev && dmax2 >= HorizonDistance2)
+                reps[offset[g] + nreps[g]++] = i;
+        }
+        ntot += nreps[g];
+    }
+    myfree(boxes);
+    message(0, "Lightcone: %ld of %ld top leaf replicas are near the shell.\n", count_sum(ntot), count_sum((int64_t) ngroup * Nreplica));
+    return reps;
+}
+
 /* Compute a list of particles which crossed
  * the lightcone boundaries on this timestep and
  * write them to the lightcone file*/
-void lightcone_compute(double a, double BoxSize, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const RandTable * const rnd)
+void lightcone_compute(double a, double BoxSize, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const DomainDecomp * ddecomp, const RandTable * const rnd)
 {
-    int i;
+    int64_t i;
     lightcone_set_time(a, BoxSize);
     const double ddrift = get_exact_drift_factor(CP, ti_curr, ti_next);
-    #pragma omp parallel for
-    for(i = 0; i < PartManager->NumPart; i++)
-    {
-        lightcone_cross(i, ddrift, rnd);
+    if(SampleFraction > 0) {
+        /* Cull the replicas for the particles of each local top leaf, plus one group for any particle
+         * not in a local top leaf.*/
+        int ThisTask;
+        MPI_Comm_rank(ddecomp->DomainComm, &ThisTask);
+        const int StartLeaf = ddecomp->Tasks[ThisTask].StartLeaf;
+        const int ngroup = ddecomp->Tasks[ThisTask].EndLeaf - StartLeaf + 1;
+        int * nreps = (int *) mymalloc("LightconeNReps", 2 * ngroup * sizeof(int));
+        int * offset = nreps + ngroup;
+        int * reps = lightcone_cull_replicas(ddrift, StartLeaf, ngroup, nreps, offset);
+
+        /* First find the particles which cross in any replica. This is the expensive part,
+         * and needs no lock as only the particle index is stored.*/
+        gadget_thread_arrays gthread = gadget_setup_thread_arrays("LightconeCross", 0, PartManager->NumPart);
+        #pragma omp parallel
+        {
+            const int tid = omp_get_thread_num();
+            int * thrqlocal = gthread.srcs[tid];
+            size_t nqthrlocal = 0;
+            #pragma omp for schedule(static, gthread.schedsz)
+            for(i = 0; i < PartManager->NumPart; i++)
+            {
+                if(P[i].Type != 1 || P[i].IsGarbage)
+                    continue;
+                const int g = lightcone_group(i, StartLeaf, ngroup);
+                if(nreps[g] > 0 && lightcone_cross(i, ddrift, rnd, reps + offset[g], nreps[g], NULL) > 0)
+                    thrqlocal[nqthrlocal++] = i;
+            }
+            gthread.sizes[tid] = nqthrlocal;
+        }
+        int * crossed;
+        const int64_t ncrossed = gadget_compact_thread_arrays(&crossed, &gthread);
+        /* Shells beyond the horizon at the start of the step will never be reached*/
+        if(LightconeParams.MapNside > 0 && NextShell < 0)
+            NextShell = HorizonDistancePrev / LightconeParams.MapShellWidth;
+        /* Then record the crossings of these few particles*/
+        double (*pos)[3] = (double (*)[3]) mymalloc("LightconePos", (Nreplica + 1) * sizeof(pos[0]));
+        for(i = 0; i < ncrossed; i++) {
+            const int p = crossed[i];
+            const int g = lightcone_group(p, StartLeaf, ngroup);
+            const int n = lightcone_cross(p, ddrift, rnd, reps + offset[g], nreps[g], pos);
+            int j;
+            for(j = 0; j < n; j++) {
+                if(LightconeParams.MapNside > 0)
+                    lightcone_deposit(p, pos[j], a);
+                if(!LightconeParams.OutputParticles)
+                    continue;
+                if(LightconeParams.BigFile)
+                    lightcone_add_crossing(p, pos[j], a);
+                else {
+                    double p4[4] = {pos[j][0], pos[j][1], pos[j][2], SampleFraction};
+                    fwrite(p4, sizeof(double), 4, fd_lightcone);
+                }
+            }
+        }
+        myfree(pos);
+        myfree(crossed);
+        myfree(nreps);
+        myfree(reps);
+        walltime_measure("/Lightcone/Compute");
     }
+    lightcone_write_shells(a, 0);
+    if(LightconeParams.BigFile && ++StepsSinceFlush >= LightconeParams.FlushSteps)
+        lightcone_flush(a, 0);
 }
-
 void lightcone_set_time(double a, const double BoxSize) {
     double z = 1 / a - 1;
     if(z > zmin && z < zmax) {
@@ -193,8 +586,7 @@ void lightcone_set_time(double a, const double BoxSize) {
         HorizonDistance = lightcone_get_horizon(a);
         HorizonDistance2 = HorizonDistance * HorizonDistance;
         update_replicas(a, BoxSize);
-        fflush(fd_lightcone);
-        if (z < ReferenceRedshift) {
+        if (z < LightconeParams.ReferenceRedshift) {
             SampleFraction = 1.0;
         } else {
             /* write a smaller fraction of the points at high redshift
@@ -206,42 +598,47 @@ void lightcone_set_time(double a, const double BoxSize) {
             /* This is the luminosity resolution rule */
 #if 0
             SampleFraction = HorizonDistanceRef / HorizonDistance;
-            SampleFraction *= (1 + ReferenceRedshift) / (1 + z);
+            SampleFraction *= (1 + LightconeParams.ReferenceRedshift) / (1 + z);
             SampleFraction *= SampleFraction;
 
 #endif
         }
-        message(0,"RefRedeshit=%g, SampleFraction=%g HorizonDistance=%g\n", ReferenceRedshift, SampleFraction, HorizonDistance);
+        message(0,"RefRedeshit=%g, SampleFraction=%g HorizonDistance=%g\n", LightconeParams.ReferenceRedshift, SampleFraction, HorizonDistance);
     } else {
         SampleFraction = 0;
     }
 }
 
-/* check crossing of the horizon, write the particle */
-static void lightcone_cross(int p, double ddrift, const RandTable * const rnd) {
-    if(SampleFraction <= 0.0) return;
-    int i;
+/* Check crossing of the horizon in each of the nreps replicas listed in reps. If pos is not NULL, the interpolated positions
+ * of the crossings are stored in it, and it must have space for nreps entries. Returns the number of crossings.*/
+static int lightcone_cross(int p, double ddrift, const RandTable * const rnd, const int * reps, const int nreps, double (*pos)[3]) {
+    if(SampleFraction <= 0.0) return 0;
+    int ir;
     int k;
+    int ncross = 0;
     /* DM only */
-    if(P[p].Type != 1) return;
+    if(P[p].Type != 1) return 0;
 
-    for(i = 0; i < Nreplica; i++) {
-        double r = get_random_number(P[p].ID + i, rnd);
+    for(ir = 0; ir < nreps; ir++) {
+        const int i = reps[ir];
+        double r = get_random_number(P[p].ID, RND_LIGHTCONE + i, rnd);
         if(r > SampleFraction) continue;
 
         double pnew[3];
         double pold[3];
-        double p3[4];
         double dnew = 0, dold = 0;
         for(k = 0; k < 3; k ++) {
             pold[k] = P[p].Pos[k] + Reps[i][k] - PartManager->CurrentParticleOffset[k];
-            pnew[k] = P[p].Pos[k] + P[i].Vel[k] * ddrift - PartManager->CurrentParticleOffset[k];
+            pnew[k] = pold[k] + P[p].Vel[k] * ddrift;
             dnew += pnew[k] * pnew[k];
             dold += pold[k] * pold[k];
         }
         if(
             (dold <= HorizonDistance2Prev && dnew >= HorizonDistance2)
          ) {
+            ncross++;
+            if(!pos)
+                continue;
             double u1, u2;
             if(dold != dnew) {
                 double cnew, cold;
@@ -257,12 +654,11 @@ static void lightcone_cross(int p, double ddrift, const RandTable * const rnd) {
                 u1 = u2 = 0.5;
             }
 
-            /* write particle position */
+            /* particle position at the crossing */
             for(k = 0; k < 3; k ++) {
-                p3[k] = pold[k] * u2 + pnew[k] * u1;
+                pos[ncross-1][k] = pold[k] * u2 + pnew[k] * u1;
             }
-            p3[3] = SampleFraction;
-            fwrite(p3, sizeof(double), 4, fd_lightcone);
         }
     }
+    return ncross;
 }
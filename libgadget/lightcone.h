@@ -1,7 +1,19 @@
 #ifndef LIGHTCONE_H
 #define LIGHTCONE_H
 
+#include "types.h"
+#include "cosmology.h"
+#include "domain.h"
+#include "utils/paramset.h"
+#include "utils/system.h"
+
+/* Set the parameters of the lightcone module*/
+void set_lightcone_params(ParameterSet * ps);
+
 /* Initialise the lightcone code module. */
 void lightcone_init(Cosmology * CP, double timeBegin, const double UnitLength_in_cm, const char * OutputDir);
-void lightcone_compute(double a, double BoxSize, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const RandTable * const rnd);
+void lightcone_compute(double a, double BoxSize, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const DomainDecomp * ddecomp, const RandTable * const rnd);
+/* Write the buffered lightcone crossings to disc. Called at the end of the run and before snapshots.
+ * If final is true, also write the incomplete map shells.*/
+void lightcone_flush(const double a, const int final);
 #endif
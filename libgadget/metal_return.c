@@ -16,7 +16,6 @@
 #include "density.h"
 #include "cosmology.h"
 #include "winds.h"
-#include "utils/spinlocks.h"
 #include "metal_tables.h"
 
 /*! \file metal_return.c
@@ -59,13 +58,13 @@ void
 set_metal_return_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         MetalParams.Sn1aN0 = param_get_double(ps, "MetalsSn1aN0");
         MetalParams.SPHWeighting = param_get_int(ps, "MetalsSPHWeighting");
         MetalParams.MaxNgbDeviation = param_get_double(ps, "MetalsMaxNgbDeviation");
     }
-    MPI_Bcast(&MetalParams, sizeof(struct metal_return_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&MetalParams, sizeof(struct metal_return_params), MPI_BYTE, 0, GadgetComm);
 }
 
 /* Build the interpolators for each yield table. We use bilinear interpolation
@@ -130,6 +129,9 @@ metal_return_ngbiter(
     LocalTreeWalk * lv
    );
 
+static void
+metal_return_find_yields(const ActiveParticles * act, struct MetalReturnPriv * priv);
+
 static void
 metal_return_copy(int place, TreeWalkQueryMetals * input, TreeWalk * tw);
 
@@ -518,9 +520,10 @@ metal_return(const ActiveParticles * act, ForceTree * gasTree, Cosmology * CP, c
 {
     /* Do nothing if no stars yet*/
     int64_t totstar;
-    MPI_Allreduce(&SlotsManager->info[4].size, &totstar, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&SlotsManager->info[4].size, &totstar, 1, MPI_INT64, MPI_SUM, GadgetComm);
     if(totstar == 0)
         return;
+    slots_prefetch(STARMASK, SlotsManager);
 
     struct MetalReturnPriv priv[1];
 
@@ -533,7 +536,7 @@ metal_return(const ActiveParticles * act, ForceTree * gasTree, Cosmology * CP, c
     priv->MaxGasMass = 4* AvgGasMass;
 
     int64_t totwork;
-    MPI_Allreduce(&nwork, &totwork, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&nwork, &totwork, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
     walltime_measure("/SPH/Metals/Init");
 
@@ -547,10 +550,15 @@ metal_return(const ActiveParticles * act, ForceTree * gasTree, Cosmology * CP, c
     /* Compute total number of weights around each star for actively returning stars*/
     stellar_density(act, priv->StarVolumeSPH, priv->MassReturn, gasTree);
 
+    priv->Yields = (struct StarYields *) mymalloc("StarYields", SlotsManager->info[4].size * sizeof(struct StarYields));
+    metal_return_find_yields(act, priv);
+    walltime_measure("/SPH/Metals/Yield");
+
     /* Do the metal return*/
     TreeWalk tw[1] = {{0}};
 
     tw->ev_label = "METALS";
+    tw->WritesNeighbours = 1;
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
     tw->ngbiter = (TreeWalkNgbIterFunction) metal_return_ngbiter;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterMetals);
@@ -561,20 +569,61 @@ metal_return(const ActiveParticles * act, ForceTree * gasTree, Cosmology * CP, c
     tw->query_type_elsize = sizeof(TreeWalkQueryMetals);
     tw->result_type_elsize = sizeof(TreeWalkResultMetals);
     tw->tree = gasTree;
+    tw->UseExportPlan = 1;
+    tw->UseNgbCache = 1;
     tw->priv = priv;
 
-    priv->spin = init_spinlocks(SlotsManager->info[0].size);
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
-    free_spinlocks(priv->spin);
 
+    myfree(priv->Yields);
     metal_return_priv_free(priv);
 
     /* collect some timing information */
-    walltime_measure("/SPH/Metals/Yield");
+    walltime_measure("/SPH/Metals/Return");
 }
 
 /* This function is unusually important:
- * it computes the total amount of metals to be returned in this timestep.*/
+ * it computes the total amount of metals to be returned in this timestep.
+ * This is done once for each star before the treewalk, as the query is filled again for every export
+ * and the yields integrate over the tables for each species. The treewalk also overwrites MassReturn
+ * with the mass actually returned, which later export rounds should not see.*/
+static void
+metal_return_find_yields(const ActiveParticles * act, struct MetalReturnPriv * priv)
+{
+    int64_t j;
+    #pragma omp parallel for
+    for(j = 0; j < act->NumActiveParticle; j++)
+    {
+        const int place = act->ActiveParticle ? act->ActiveParticle[j] : j;
+        if(!metals_haswork(place, priv->MassReturn))
+            continue;
+        const int pi = P[place].PI;
+        struct StarYields * yield = &priv->Yields[pi];
+        double InitialMass = P[place].Mass + STARP(place).TotalMassReturned;
+        double dtmyrend = priv->StellarAges[pi];
+        double dtmyrstart = STARP(place).LastEnrichmentMyr;
+        int tid = omp_get_thread_num();
+        /* This is the total mass returned from this stellar population this timestep. Note this is already in the desired units.*/
+        yield->MassGenerated = priv->MassReturn[pi];
+        /* This returns the total amount of metal produced this timestep, and also fills out MetalSpeciesGenerated, which is an
+         * element by element table of the metal produced by dying stars this timestep.*/
+        double total_z_yield = metal_yield(dtmyrstart, dtmyrend, STARP(place).Metallicity, priv->hub, &priv->interp, yield->MetalSpeciesGenerated, priv->imf_norm, priv->gsl_work[tid], priv->LowDyingMass[pi], priv->HighDyingMass[pi]);
+        /* The total metal returned is the metal ejected into the ISM this timestep. total_z_yield is given as a fraction of the initial SSP.*/
+        yield->MetalGenerated = InitialMass * total_z_yield;
+        /* It should be positive! If it is not, this is some integration error
+         * in the yield table as we cannot destroy metal which is not present.*/
+        if(yield->MetalGenerated < 0)
+            yield->MetalGenerated = 0;
+        /* Similarly for all the other metal species*/
+        int i;
+        for(i = 0; i < NMETALS; i++) {
+            yield->MetalSpeciesGenerated[i] *= InitialMass;
+            if(yield->MetalSpeciesGenerated[i] < 0)
+                yield->MetalSpeciesGenerated[i] = 0;
+        }
+    }
+}
+
 static void
 metal_return_copy(int place, TreeWalkQueryMetals * input, TreeWalk * tw)
 {
@@ -583,29 +632,12 @@ metal_return_copy(int place, TreeWalkQueryMetals * input, TreeWalk * tw)
     input->Hsml = P[place].Hsml;
     int pi = P[place].PI;
     input->StarVolumeSPH = METALS_GET_PRIV(tw)->StarVolumeSPH[pi];
-    double InitialMass = P[place].Mass + STARP(place).TotalMassReturned;
-    double dtmyrend = METALS_GET_PRIV(tw)->StellarAges[pi];
-    double dtmyrstart = STARP(place).LastEnrichmentMyr;
-    int tid = omp_get_thread_num();
-    /* This is the total mass returned from this stellar population this timestep. Note this is already in the desired units.*/
-    input->MassGenerated = METALS_GET_PRIV(tw)->MassReturn[pi];
-    /* This returns the total amount of metal produced this timestep, and also fills out MetalSpeciesGenerated, which is an
-     * element by element table of the metal produced by dying stars this timestep.*/
-    double total_z_yield = metal_yield(dtmyrstart, dtmyrend, input->Metallicity, METALS_GET_PRIV(tw)->hub, &METALS_GET_PRIV(tw)->interp, input->MetalSpeciesGenerated, METALS_GET_PRIV(tw)->imf_norm, METALS_GET_PRIV(tw)->gsl_work[tid], METALS_GET_PRIV(tw)->LowDyingMass[pi], METALS_GET_PRIV(tw)->HighDyingMass[pi]);
-    /* The total metal returned is the metal ejected into the ISM this timestep. total_z_yield is given as a fraction of the initial SSP.*/
-    input->MetalGenerated = InitialMass * total_z_yield;
-    //message(3, "Particle %d PI %d z %g massgen %g metallicity %g\n", pi, P[pi].PI, total_z_yield, METALS_GET_PRIV(tw)->MassReturn[pi], STARP(place).Metallicity);
-    /* It should be positive! If it is not, this is some integration error
-     * in the yield table as we cannot destroy metal which is not present.*/
-    if(input->MetalGenerated < 0)
-        input->MetalGenerated = 0;
-    /* Similarly for all the other metal species*/
+    const struct StarYields * yield = &METALS_GET_PRIV(tw)->Yields[pi];
+    input->MassGenerated = yield->MassGenerated;
+    input->MetalGenerated = yield->MetalGenerated;
     int i;
-    for(i = 0; i < NMETALS; i++) {
-        input->MetalSpeciesGenerated[i] *= InitialMass;
-        if(input->MetalSpeciesGenerated[i] < 0)
-            input->MetalSpeciesGenerated[i] = 0;
-    }
+    for(i = 0; i < NMETALS; i++)
+        input->MetalSpeciesGenerated[i] = yield->MetalSpeciesGenerated[i];
 }
 
 /* Update the mass return variable to contain the amount of mass actually returned.*/
@@ -628,6 +660,31 @@ metal_return_postprocess(int place, TreeWalk * tw)
     STARP(place).LastEnrichmentMyr = METALS_GET_PRIV(tw)->StellarAges[P[place].PI];
 }
 
+/* A gas particle receiving metals is locked by setting the sign bit of its mass
+ * with a compare and swap, so no per-particle lock array is needed. This works
+ * because nothing else reads the gas masses during the metal return treewalk.
+ * Returns the (positive) mass of the particle.*/
+static float
+lock_gas_mass(float * mass)
+{
+    float old, locked;
+    do {
+        #pragma omp atomic read
+        old = *mass;
+        if(signbit(old))
+            continue;
+        locked = -old;
+        if(__atomic_compare_exchange(mass, &old, &locked, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return old;
+    } while(1);
+}
+
+static void
+unlock_gas_mass(float * mass, float newmass)
+{
+    __atomic_store(mass, &newmass, __ATOMIC_RELEASE);
+}
+
 /*! For all gas particles within the density radius of this star,
  * add a fraction of the total mass and metals generated,
  * weighted by the SPH kernel distance from the star.
@@ -665,18 +722,16 @@ metal_return_ngbiter(
         double ThisMetals[NMETALS];
         if(I->StarVolumeSPH ==0)
             endrun(3, "StarVolumeSPH %g hsml %g\n", I->StarVolumeSPH, I->Hsml);
-        double newmass;
-        int pi = P[other].PI;
-        lock_spinlock(pi, METALS_GET_PRIV(lv->tw)->spin);
+        const double oldmass = lock_gas_mass(&P[other].Mass);
         /* Volume of particle weighted by the SPH kernel*/
-        double volume = P[other].Mass / SPHP(other).Density;
+        double volume = oldmass / SPHP(other).Density;
         double returnfraction = wk * volume / I->StarVolumeSPH;
         double thismass = returnfraction * I->MassGenerated;
         /* Ensure that the gas particles don't become overweight.
          * If there are few gas particles around, the star clusters
          * will hold onto their metals.*/
-        if(P[other].Mass + thismass > METALS_GET_PRIV(lv->tw)->MaxGasMass) {
-            unlock_spinlock(pi, METALS_GET_PRIV(lv->tw)->spin);
+        if(oldmass + thismass > METALS_GET_PRIV(lv->tw)->MaxGasMass) {
+            unlock_gas_mass(&P[other].Mass, oldmass);
             return;
         }
         /* Add metals weighted by SPH kernel*/
@@ -686,20 +741,19 @@ metal_return_ngbiter(
         double thismetal = returnfraction * I->MetalGenerated;
         /* Add the metals to the particle.*/
         for(i = 0; i < NMETALS; i++)
-            SPHP(other).Metals[i] = (SPHP(other).Metals[i] * P[other].Mass + ThisMetals[i])/(P[other].Mass + thismass);
+            SPHP(other).Metals[i] = (SPHP(other).Metals[i] * oldmass + ThisMetals[i])/(oldmass + thismass);
         /* Update total metallicity*/
-        SPHP(other).Metallicity = (SPHP(other).Metallicity * P[other].Mass + thismetal)/(P[other].Mass + thismass);
+        SPHP(other).Metallicity = (SPHP(other).Metallicity * oldmass + thismetal)/(oldmass + thismass);
         /* Update mass*/
-        double massfrac = (P[other].Mass + thismass) / P[other].Mass;
-        P[other].Mass *= massfrac;
+        double massfrac = (oldmass + thismass) / oldmass;
         /* Density also needs a correction so the volume fraction is unchanged.
          * This ensures that volume = Mass/Density is unchanged for the next particle
          * and thus the weighting still sums to unity.*/
         SPHP(other).Density *= massfrac;
         /* Keep track of how much was returned for conservation purposes*/
         O->MassReturn += thismass;
-        newmass = P[other].Mass;
-        unlock_spinlock(pi, METALS_GET_PRIV(lv->tw)->spin);
+        const float newmass = oldmass * massfrac;
+        unlock_gas_mass(&P[other].Mass, newmass);
         if(newmass <= 0)
             endrun(3, "New mass %g new metal %g in particle %d id %ld from star mass %g metallicity %g\n",
                    newmass, SPHP(other).Metallicity, other, P[other].ID, I->Mass, I->Metallicity);
@@ -944,6 +998,8 @@ stellar_density(const ActiveParticles * act, MyFloat * StarVolumeSPH, MyFloat *
     tw->result_type_elsize = sizeof(TreeWalkResultStellarDensity);
     tw->priv = priv;
     tw->tree = tree;
+    tw->UseExportPlan = 1;
+    tw->UseNgbCache = 1;
 
     int i;
 
@@ -23,6 +23,13 @@ struct interps
  * so there is no extra memory allocation and we never free the tables*/
 void setup_metal_table_interp(struct interps * interp);
 
+/* Mass and metals returned by a star this timestep*/
+struct StarYields {
+    MyFloat MassGenerated;
+    MyFloat MetalGenerated;
+    MyFloat MetalSpeciesGenerated[NMETALS];
+};
+
 struct MetalReturnPriv {
     gsl_integration_workspace ** gsl_work;
     MyFloat * StellarAges;
@@ -35,8 +42,9 @@ struct MetalReturnPriv {
     double MaxGasMass;
     Cosmology *CP;
     MyFloat * StarVolumeSPH;
+    /* Yields of the stars returning metals, indexed by slot*/
+    struct StarYields * Yields;
     struct interps interp;
-    struct SpinLocks * spin;
 };
 
 void metal_return(const ActiveParticles * act, ForceTree * gasTree, Cosmology * CP, const double atime, const double AvgGasMass);
@@ -7,6 +7,7 @@
  */
 
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <bigfile-mpi.h>
 #include <gsl/gsl_integration.h>
@@ -241,7 +242,7 @@ void powerspectrum_nu_save(struct _powerspectrum * PowerSpectrum, const char * O
 {
     int i;
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask != 0)
         return;
 
@@ -276,7 +277,7 @@ void petaio_save_neutrinos(BigFile * bf, int ThisTask)
             delta_tot[ik*ia+i] = delta_tot_table.delta_tot[ik][i];
 
     BigBlock bn;
-    if(0 != big_file_mpi_create_block(bf, &bn, "Neutrino", NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create_block(bf, &bn, "Neutrino", NULL, 0, 0, 0, GadgetComm)) {
         endrun(0, "Failed to create block at %s:%s\n", "Neutrino",
                 big_file_get_error_message());
     }
@@ -286,7 +287,7 @@ void petaio_save_neutrinos(BigFile * bf, int ThisTask)
         endrun(0, "Failed to write neutrino attributes %s\n",
                     big_file_get_error_message());
     }
-    if(0 != big_block_mpi_close(&bn, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bn, GadgetComm)) {
         endrun(0, "Failed to close block %s\n",
                     big_file_get_error_message());
     }
@@ -322,10 +323,10 @@ void petaio_read_icnutransfer(BigFile * bf, int ThisTask)
     BigBlock bn;
     /* Read the size of the ICTransfer block.
      * If we can't read it, just set it to zero*/
-    if(0 == big_file_mpi_open_block(bf, &bn, "ICTransfers", MPI_COMM_WORLD)) {
+    if(0 == big_file_mpi_open_block(bf, &bn, "ICTransfers", GadgetComm)) {
         if(0 != big_block_get_attr(&bn, "Nentry", &t_init->NPowerTable, "u8", 1))
             endrun(0, "Failed to read attr: %s\n", big_file_get_error_message());
-        if(0 != big_block_mpi_close(&bn, MPI_COMM_WORLD))
+        if(0 != big_block_mpi_close(&bn, GadgetComm))
             endrun(0, "Failed to close block %s\n",big_file_get_error_message());
     }
     message(0,"Found transfer function, using %d rows.\n", t_init->NPowerTable);
@@ -368,7 +369,7 @@ void petaio_read_icnutransfer(BigFile * bf, int ThisTask)
         t_init->T_nu[i] /= T_cb[i];
     myfree(T_cb);
     /*Broadcast the arrays.*/
-    MPI_Bcast(t_init->logk,2*t_init->NPowerTable,MPI_DOUBLE,0,MPI_COMM_WORLD);
+    MPI_Bcast(t_init->logk,2*t_init->NPowerTable,MPI_DOUBLE,0,GadgetComm);
     }
 }
 
@@ -379,7 +380,7 @@ void petaio_read_neutrinos(BigFile * bf, int ThisTask)
     {
     size_t nk, ia, ik, i;
     BigBlock bn;
-    if(0 != big_file_mpi_open_block(bf, &bn, "Neutrino", MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_open_block(bf, &bn, "Neutrino", GadgetComm)) {
         endrun(0, "Failed to open block at %s:%s\n", "Neutrino",
                     big_file_get_error_message());
     }
@@ -393,7 +394,7 @@ void petaio_read_neutrinos(BigFile * bf, int ThisTask)
     /*Allocate list of scale factors, and space for delta_tot, in one operation.*/
     if(0 != big_block_get_attr(&bn, "scalefact", delta_tot_table.scalefact, "f8", ia))
         endrun(0, "Failed to read attr: %s\n", big_file_get_error_message());
-    if(0 != big_block_mpi_close(&bn, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bn, GadgetComm)) {
         endrun(0, "Failed to close block %s\n",
                     big_file_get_error_message());
     }
@@ -431,15 +432,15 @@ void petaio_read_neutrinos(BigFile * bf, int ThisTask)
     petaio_read_block(bf, "Neutrino/kvalue", &kvalue, 0);
 
     /*Broadcast the arrays.*/
-    MPI_Bcast(&(delta_tot_table.ia), 1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(&(delta_tot_table.nk), 1,MPI_INT,0,MPI_COMM_WORLD);
-    MPI_Bcast(delta_tot_table.delta_nu_init,delta_tot_table.nk,MPI_DOUBLE,0,MPI_COMM_WORLD);
-    MPI_Bcast(delta_tot_table.wavenum,delta_tot_table.nk,MPI_DOUBLE,0,MPI_COMM_WORLD);
+    MPI_Bcast(&(delta_tot_table.ia), 1,MPI_INT,0,GadgetComm);
+    MPI_Bcast(&(delta_tot_table.nk), 1,MPI_INT,0,GadgetComm);
+    MPI_Bcast(delta_tot_table.delta_nu_init,delta_tot_table.nk,MPI_DOUBLE,0,GadgetComm);
+    MPI_Bcast(delta_tot_table.wavenum,delta_tot_table.nk,MPI_DOUBLE,0,GadgetComm);
 
     if(delta_tot_table.ia > 0) {
         /*Broadcast data for scalefact and delta_tot, Delta_tot is allocated as the same block of memory as scalefact.
           Not all this memory will actually have been used, but it is easiest to bcast all of it.*/
-        MPI_Bcast(delta_tot_table.scalefact,delta_tot_table.namax*(delta_tot_table.nk+1),MPI_DOUBLE,0,MPI_COMM_WORLD);
+        MPI_Bcast(delta_tot_table.scalefact,delta_tot_table.namax*(delta_tot_table.nk+1),MPI_DOUBLE,0,GadgetComm);
     }
     }
 }
@@ -621,6 +622,94 @@ double specialJ(const double x, const double qc, const double nufrac_low)
   return specialJ_fit(x);
 }
 
+/* Cumulative free-streaming length since TimeTransfer, tabulated on a uniform grid in log a.
+ * It depends only on the background cosmology, so it is extended as the simulation
+ * advances and reused by every later PM step and every neutrino species.*/
+static struct fslength_table
+{
+    Cosmology * CP;
+    double logamin;
+    double light;
+    int n;
+    double * loga;
+    double * cumfs;
+    gsl_interp * spline;
+    gsl_interp_accel * acc;
+} FSTable;
+
+/** Spacing of the cumulative free-streaming length table in log a.*/
+#define FSTABLE_DLOGA 2e-3
+
+/* Make sure the cumulative free-streaming table covers [logamin, logamax].
+ * Only the new intervals are integrated.*/
+static void
+fslength_table_extend(Cosmology * CP, const double logamin, const double logamax, const double light)
+{
+    int i;
+    if(FSTable.CP != CP || FSTable.logamin != logamin || FSTable.light != light)
+        FSTable.n = 0;
+    int n = ceil((logamax - logamin)/FSTABLE_DLOGA) + 2;
+    if(n < 4)
+        n = 4;
+    if(n <= FSTable.n)
+        return;
+    FSTable.loga = (double *) realloc(FSTable.loga, 2 * n * sizeof(double));
+    if(!FSTable.loga)
+        endrun(2016, "Could not allocate %d entries for the free-streaming length table\n", n);
+    /* Move the cumulative values to the end of the enlarged buffer */
+    double * cumfs = FSTable.loga + n;
+    if(FSTable.n > 0)
+        memmove(cumfs, FSTable.loga + FSTable.n, FSTable.n * sizeof(double));
+    FSTable.cumfs = cumfs;
+    for(i = FSTable.n; i < n; i++) {
+        FSTable.loga[i] = logamin + i * FSTABLE_DLOGA;
+        if(i == 0)
+            FSTable.cumfs[i] = 0;
+        else
+            FSTable.cumfs[i] = FSTable.cumfs[i-1] + fslength(CP, FSTable.loga[i-1], FSTable.loga[i], light);
+    }
+    if(FSTable.spline)
+        gsl_interp_free(FSTable.spline);
+    if(!FSTable.acc)
+        FSTable.acc = gsl_interp_accel_alloc();
+    gsl_interp_accel_reset(FSTable.acc);
+    FSTable.spline = gsl_interp_alloc(gsl_interp_cspline, n);
+    if(!FSTable.spline || !FSTable.acc)
+        endrun(2016, "Error allocating free-streaming length interpolator.\n");
+    gsl_interp_init(FSTable.spline, FSTable.loga, FSTable.cumfs, n);
+    FSTable.n = n;
+    FSTable.CP = CP;
+    FSTable.logamin = logamin;
+    FSTable.light = light;
+}
+
+/* Cumulative free-streaming length from the start of the table to loga.
+ * The table must already cover loga.*/
+static double
+fslength_table_eval(const double loga)
+{
+    return gsl_interp_eval(FSTable.spline, FSTable.loga, FSTable.cumfs, loga, FSTable.acc);
+}
+
+/*Parameters for the linear response integrator*/
+static struct neutrinos_lra_params
+{
+    /* If > 0, start the history integral for each mode at the time
+     * when the free-streaming kernel J(k * fs) first exceeds this value.*/
+    double HistoryTolerance;
+} LRAParams;
+
+void
+set_neutrinos_lra_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        LRAParams.HistoryTolerance = param_get_double(ps, "MassiveNuLinRespHistoryTol");
+    }
+    MPI_Bcast(&LRAParams, sizeof(LRAParams), MPI_BYTE, 0, GadgetComm);
+}
+
 /**A structure for the parameters for the below integration kernel*/
 struct _delta_nu_int_params
 {
@@ -630,11 +719,13 @@ struct _delta_nu_int_params
     double mnubykT;
     gsl_interp_accel *acc;
     gsl_interp *spline;
-    Cosmology * CP;
-    /**Precomputed free-streaming lengths*/
+    /**Precomputed free-streaming lengths and the k-independent
+     * kernel factor fs(ai, a) / (ai H(ai)), both sampled at fsscales*/
     gsl_interp_accel *fs_acc;
-    gsl_interp *fs_spline;
+    const gsl_interp *fs_spline;
+    const gsl_interp *kern_spline;
     double * fslengths;
+    double * fskernel;
     double * fsscales;
     /**Make sure this is at the same k as above*/
     double * delta_tot;
@@ -653,10 +744,46 @@ double get_delta_nu_int(double logai, void * params)
 {
     delta_nu_int_params * p = (delta_nu_int_params *) params;
     double fsl_aia = gsl_interp_eval(p->fs_spline,p->fsscales,p->fslengths,logai,p->fs_acc);
+    double kern = gsl_interp_eval(p->kern_spline,p->fsscales,p->fskernel,logai,p->fs_acc);
     double delta_tot_at_a = gsl_interp_eval(p->spline,p->scale,p->delta_tot,logai,p->acc);
     double specJ = specialJ(p->k*fsl_aia/p->mnubykT, p->qc, p->nufrac_low);
-    double ai = exp(logai);
-    return fsl_aia/(ai*hubble_function(p->CP, ai)) * specJ * delta_tot_at_a;
+    return kern * specJ * delta_tot_at_a;
+}
+
+/* Largest x with specialJ_fit(x) >= tol, by bisection. specialJ_fit decreases monotonically.*/
+static double
+specialJ_fit_inverse(const double tol)
+{
+    double xlo = 0, xhi = 1;
+    while(specialJ_fit(xhi) > tol && xhi < 1e8)
+        xhi *= 2;
+    while(xhi - xlo > 1e-6 * xhi) {
+        double xmid = 0.5 * (xlo + xhi);
+        if(specialJ_fit(xmid) > tol)
+            xlo = xmid;
+        else
+            xhi = xmid;
+    }
+    return xhi;
+}
+
+/* Earliest sampled time at which the free-streaming length has dropped to fslmax.
+ * The free-streaming lengths decrease with fsscales.*/
+static double
+history_start(const delta_nu_int_params * p, const int Nfs, const double fslmax)
+{
+    int lo = 0, hi = Nfs - 1;
+    if(p->fslengths[0] <= fslmax)
+        return p->fsscales[0];
+    while(hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if(p->fslengths[mid] > fslmax)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    /* lo is the last sample still outside the tolerance: start there to be safe*/
+    return p->fsscales[lo];
 }
 
 /*
@@ -681,6 +808,7 @@ void get_delta_nu(Cosmology * CP, const _delta_tot_table * const d_tot, const do
   fsl_A0a = fslength(CP, log(d_tot->TimeTransfer), log(a),d_tot->light);
   /*Precompute factor used to get delta_nu_init. This assumes that delta ~ a, so delta-dot is roughly 1.*/
   deriv_prefac = d_tot->TimeTransfer*(hubble_function(CP, d_tot->TimeTransfer)/d_tot->light)* d_tot->TimeTransfer;
+  #pragma omp parallel for
   for (ik = 0; ik < d_tot->nk; ik++) {
       /* Initial condition piece, assuming linear evolution of delta with a up to startup redshift */
       /* This assumes that delta ~ a, so delta-dot is roughly 1. */
@@ -709,19 +837,7 @@ void get_delta_nu(Cosmology * CP, const _delta_tot_table * const d_tot, const do
   /*If neutrino mass is zero, we are not accurate, just use the initial conditions piece*/
   if(Na > 1 && mnubykT > 0){
         delta_nu_int_params params;
-        params.acc = gsl_interp_accel_alloc();
-        gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
-        gsl_function F;
-        F.function = &get_delta_nu_int;
-        F.params=&params;
-        /*Use cubic interpolation*/
-        if(Na > 2) {
-                params.spline=gsl_interp_alloc(gsl_interp_cspline,Na);
-        }
-        /*Unless we have only two points*/
-        else {
-                params.spline=gsl_interp_alloc(gsl_interp_linear,Na);
-        }
+        const double logTT = log(d_tot->TimeTransfer);
         params.scale=d_tot->scalefact;
         params.mnubykT=mnubykT;
         params.qc = qc;
@@ -731,36 +847,79 @@ void get_delta_nu(Cosmology * CP, const _delta_tot_table * const d_tot, const do
          * which is exactly where it doesn't matter, but
          * we still want to be safe. */
         int Nfs = Na*16;
-        params.fs_acc = gsl_interp_accel_alloc();
-        params.fs_spline=gsl_interp_alloc(gsl_interp_cspline,Nfs);
-        params.CP = CP;
-        /*Pre-compute the free-streaming lengths, which are scale-independent*/
-        double * fslengths = (double *) mymalloc("fslengths", Nfs* sizeof(double));
-        double * fsscales = (double *) mymalloc("fsscales", Nfs* sizeof(double));
+        gsl_interp * fs_spline = gsl_interp_alloc(gsl_interp_cspline,Nfs);
+        gsl_interp * kern_spline = gsl_interp_alloc(gsl_interp_cspline,Nfs);
+        /*Pre-compute the free-streaming lengths, which are scale-independent,
+         * as differences of the cached cumulative free-streaming length.*/
+        double * fsscales = (double *) mymalloc("fsscales", 3 * Nfs* sizeof(double));
+        double * fslengths = fsscales + Nfs;
+        double * fskernel = fsscales + 2 * Nfs;
+        if(!fs_spline || !kern_spline)
+              endrun(2016,"Error initialising and allocating memory for gsl interpolator and integrator.\n");
+        fslength_table_extend(CP, logTT, log(a), d_tot->light);
+        const double cumfs_a = fslength_table_eval(log(a));
         for(ik=0; ik < Nfs; ik++) {
-            fsscales[ik] = log(d_tot->TimeTransfer) + ik*(log(a) - log(d_tot->TimeTransfer))/(Nfs-1.);
-            fslengths[ik] = fslength(CP, fsscales[ik], log(a),d_tot->light);
+            fsscales[ik] = logTT + ik*(log(a) - logTT)/(Nfs-1.);
+            fslengths[ik] = cumfs_a - fslength_table_eval(fsscales[ik]);
+            const double ai = exp(fsscales[ik]);
+            fskernel[ik] = fslengths[ik]/(ai*hubble_function(CP, ai));
         }
+        /* Avoid rounding at the end point*/
+        fsscales[Nfs-1] = log(a);
+        fslengths[Nfs-1] = 0;
+        fskernel[Nfs-1] = 0;
+        gsl_interp_init(fs_spline,fsscales,fslengths,Nfs);
+        gsl_interp_init(kern_spline,fsscales,fskernel,Nfs);
+        params.fs_spline = fs_spline;
+        params.kern_spline = kern_spline;
         params.fslengths = fslengths;
+        params.fskernel = fskernel;
         params.fsscales = fsscales;
 
-        if(!params.spline || !params.acc || !w || !params.fs_spline || !params.fs_acc || !fslengths || !fsscales)
-              endrun(2016,"Error initialising and allocating memory for gsl interpolator and integrator.\n");
-
-        gsl_interp_init(params.fs_spline,params.fsscales,params.fslengths,Nfs);
-        for (ik = 0; ik < d_tot->nk; ik++) {
-            double abserr,d_nu_tmp;
-            params.k=d_tot->wavenum[ik];
-            params.delta_tot=d_tot->delta_tot[ik];
-            gsl_interp_init(params.spline,params.scale,params.delta_tot,Na);
-            gsl_integration_qag (&F, log(d_tot->TimeTransfer), log(a), 0, relerr,GSL_VAL,6,w,&d_nu_tmp, &abserr);
-            delta_nu_curr[ik] += d_tot->delta_nu_prefac * d_nu_tmp;
-         }
-         gsl_integration_workspace_free (w);
-         gsl_interp_free(params.spline);
-         gsl_interp_accel_free(params.acc);
-         myfree(fsscales);
-         myfree(fslengths);
+        /* Modes whose kernel J(k fs) has decayed below the tolerance
+         * receive nothing from early times. Not used for hybrid neutrinos,
+         * whose kernel is not monotonic.*/
+        double xmax = 0;
+        if(LRAParams.HistoryTolerance > 0 && qc == 0)
+            xmax = specialJ_fit_inverse(LRAParams.HistoryTolerance);
+
+        #pragma omp parallel
+        {
+            /* Accelerators, the delta_tot spline and the workspace are per-thread;
+             * the free-streaming tables are shared read-only.*/
+            delta_nu_int_params tparams = params;
+            tparams.acc = gsl_interp_accel_alloc();
+            tparams.fs_acc = gsl_interp_accel_alloc();
+            /*Use cubic interpolation, unless we have only two points*/
+            tparams.spline = gsl_interp_alloc(Na > 2 ? gsl_interp_cspline : gsl_interp_linear, Na);
+            gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
+            gsl_function F;
+            F.function = &get_delta_nu_int;
+            F.params=&tparams;
+            if(!tparams.spline || !tparams.acc || !w || !tparams.fs_acc)
+                endrun(2016,"Error initialising and allocating memory for gsl interpolator and integrator.\n");
+
+            int jk;
+            #pragma omp for schedule(dynamic)
+            for (jk = 0; jk < d_tot->nk; jk++) {
+                double abserr,d_nu_tmp;
+                double logastart = logTT;
+                tparams.k=d_tot->wavenum[jk];
+                tparams.delta_tot=d_tot->delta_tot[jk];
+                if(xmax > 0 && tparams.k > 0)
+                    logastart = history_start(&tparams, Nfs, xmax * mnubykT / tparams.k);
+                gsl_interp_init(tparams.spline,tparams.scale,tparams.delta_tot,Na);
+                gsl_integration_qag (&F, logastart, log(a), 0, relerr,GSL_VAL,6,w,&d_nu_tmp, &abserr);
+                delta_nu_curr[jk] += d_tot->delta_nu_prefac * d_nu_tmp;
+            }
+            gsl_integration_workspace_free (w);
+            gsl_interp_free(tparams.spline);
+            gsl_interp_accel_free(tparams.acc);
+            gsl_interp_accel_free(tparams.fs_acc);
+        }
+        gsl_interp_free(kern_spline);
+        gsl_interp_free(fs_spline);
+        myfree(fsscales);
    }
 //     for(ik=0; ik< 3; ik++)
 //         message(0,"k %g d_nu %g\n",wavenum[d_tot->nk/8*ik], delta_nu_curr[d_tot->nk/8*ik]);
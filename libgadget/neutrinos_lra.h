@@ -4,6 +4,7 @@
 #include <bigfile-mpi.h>
 #include "powerspectrum.h"
 #include "cosmology.h"
+#include "utils/paramset.h"
 
 /** Now we want to define a static object to store all previous delta_tot.
  * This object needs a constructor, a few private data members, and a way to be read and written from disk.
@@ -55,6 +56,9 @@ typedef struct _delta_tot_table _delta_tot_table;
  * @param UnitLength_in_cm Length unit of the simulation in cm*/
 void init_neutrinos_lra(const int nk_in, const double TimeTransfer, const double TimeMax, const double Omega0, const _omega_nu * const omnu, const double UnitTime_in_s, const double UnitLength_in_cm);
 
+/*Set the parameters of the linear response integrator*/
+void set_neutrinos_lra_params(ParameterSet * ps);
+
 /*Computes delta_nu from a CDM power spectrum.*/
 void delta_nu_from_power(struct _powerspectrum * PowerSpectrum, Cosmology * CP, const double Time, const double TimeIC);
 
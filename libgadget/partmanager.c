@@ -17,6 +17,7 @@ particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, in
     PartManager->Base = (struct particle_data *) mymalloc("P", bytes = MaxPart * sizeof(struct particle_data));
     PartManager->MaxPart = MaxPart;
     PartManager->NumPart = 0;
+    PartManager->ReorderCount++;
     if(MaxPart >= 1L<<31 || MaxPart < 0)
         endrun(5, "Trying to store %ld particles on a single node, more than fit in an int32, not supported\n", MaxPart);
     memset(PartManager->CurrentParticleOffset, 0, 3*sizeof(double));
@@ -29,8 +30,14 @@ particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, in
      * seems to be to do with how the struct is padded and
      * the missing holes being accessed by __kmp_atomic functions.
      * (memory lock etc?)
+     *
+     * This is also the first touch of the particle memory, so clear it with the static schedule
+     * used by the particle loops: each page then lands on the NUMA node of the thread using it.
      * */
-    memset(PartManager->Base, 0, sizeof(struct particle_data) * MaxPart);
+    int64_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < MaxPart; i++)
+        memset(&PartManager->Base[i], 0, sizeof(struct particle_data));
     message(0, "Allocated %g MByte for storing %ld particles.\n", bytes / (1024.0 * 1024.0), MaxPart);
 }
 
@@ -40,14 +47,14 @@ particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, in
  * stores the relative shift from the last offset in the rel_random_shift output
  * array. */
 void
-update_random_offset(struct part_manager_type * PartManager, double * rel_random_shift, double RandomParticleOffset, const uint64_t seed)
+update_random_offset(struct part_manager_type * PartManager, double * rel_random_shift, double RandomParticleOffset, const uint64_t seed, const uint64_t step)
 {
-    /* Note random number table is the same on all processors*/
-    RandTable rnd = set_random_numbers(seed, 3);
+    /* Note random numbers are the same on all processors*/
+    RandTable rnd = set_random_numbers(seed, step);
     int i;
     for (i = 0; i < 3; i++) {
-        /* Note random number table is the same on all processors*/
-        double rr = get_random_number(i, &rnd);
+        /* Note random numbers are the same on all processors*/
+        double rr = get_random_number(i, RND_PARTICLE_OFFSET, &rnd);
         /* Upstream Gadget uses a random fraction of the box, but since all we need
          * is to adjust the tree openings, and the tree force is zero anyway on the
          * scale of a few PM grid cells, this seems enough.*/
@@ -63,7 +70,7 @@ update_random_offset(struct part_manager_type * PartManager, double * rel_random
     double test_random_shift[3] = {0};
     for (i = 0; i < 3; i++)
         test_random_shift[i] = PartManager->CurrentParticleOffset[i];
-    MPI_Bcast(test_random_shift, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(test_random_shift, 3, MPI_DOUBLE, 0, GadgetComm);
     for (i = 0; i < 3; i++)
         if(test_random_shift[i] != PartManager->CurrentParticleOffset[i])
             endrun(44, "Random shift %d is %g != %g on task 0!\n", i, test_random_shift[i], PartManager->CurrentParticleOffset[i]);
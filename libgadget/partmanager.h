@@ -1,6 +1,7 @@
 #ifndef _PART_DATA_H
 #define _PART_DATA_H
 
+#include <math.h>
 #include "types.h"
 #include "utils/peano.h"
 #include "utils/system.h"
@@ -22,6 +23,10 @@ struct particle_data
         unsigned int Swallowed            :1; /* True if the particle is a black hole which has been swallowed; these particles stay around so we have a merger tree.*/
         unsigned int HeIIIionized        :1; /* True if the particle has undergone helium reionization.*/
         unsigned int BHHeated              :1; /* Flags that particle was heated by a BH this timestep*/
+        unsigned int HighResPM             :1; /* True if the particle was inside the high resolution PM mesh on the last PM step,
+                                                  so its tree force uses the short-range split of that mesh. See gravpm.c*/
+        unsigned int NearDomainEdge        :1; /* True if the particle was close to the edge of its top leaf at the last domain decomposition,
+                                                  so may leave it before the next. See domain_mark_edge_particles*/
         unsigned char Generation : 4; /* How many particles it has spawned; used to generate unique particle ID.
                                      We limit to sfr_params.Generations + 1 and enforce at max fitting into 4 bits in sfr_params. */
         unsigned char TimeBinHydro; /* Time step bin for hydro; 0 for unassigned. Must be smaller than the gravity timebin.
@@ -48,23 +53,29 @@ struct particle_data
                                  * but the Gadget-4 paper says this is a negligible effect (I suspect that where the artificial viscosity
                                  * is important the gravitational acceleration is small compared to hydro force anyway).
                                  */
-    MyFloat GravPM[3];      /* particle acceleration due to long-range PM gravity force */
+    /* Data above needed for the short-range kick*/
     inttime_t Ti_drift;       /*!< current time of the particle position. The same for all particles. */
     MyFloat Hsml;
-    /* Cacheline is here: data above needed for kick*/
     /* DtHsml is 1/3 DivVel * Hsml evaluated at the last active timestep for this particle.
      * This predicts Hsml during the current timestep in the way used in Gadget-4, more accurate
      * than the Gadget-2 prediction which could run away in deep timesteps. Used also
      * to limit timesteps by density change. */
     MyFloat DtHsml;
+    /* Data above needed for the drift, which so reads only the first 120 bytes.
+     * Below is only needed on PM steps or rarely.*/
+    MyFloat GravPM[3];      /* particle acceleration due to long-range PM gravity force */
     MyIDType ID;
     /* FOF Group number: only has meaning during FOF.*/
     /* Transient but hard to move to private arrays because it needs to 
      * travel with the particle during exchange*/
-    int64_t GrNr;
-    MyFloat Potential;		/* Gravitational potential. This is the total potential only on a PM timestep,
+    grnr_t GrNr;
+    DiagFloat Potential;		/* Gravitational potential. This is the total potential only on a PM timestep,
                              * after gravtree+gravpm is called. We do not save the potential on short timesteps
                              * for hierarchical gravity as it would only be from active particles.*/
+    float GravCost;         /* Number of particle-node interactions in the short-range tree walk on the last PM step,
+                             * summed over all ranks. Used as the work estimate by the domain decomposition.*/
+    float NgbCost;          /* Number of neighbour interactions evaluated on this rank in the density and hydro
+                             * treewalks the last time the particle was active. Added to the work estimate.*/
 #ifdef DEBUG
     /* Kick times for both hydro and grav*/
     inttime_t Ti_kick_hydro;
@@ -84,6 +95,10 @@ extern struct part_manager_type {
     double CurrentParticleOffset[3];
     /* Current box size so we can work out periodic boundaries*/
     double BoxSize;
+    /* Incremented whenever existing particles move in the Base array (gc or sort),
+     * so that stored lists of particle indices can tell they are stale.
+     * Adding particles at the end does not change it.*/
+    int64_t ReorderCount;
 } PartManager[1];
 
 /*Compatibility define*/
@@ -95,11 +110,42 @@ void particle_alloc_memory(struct part_manager_type * PartManager, double BoxSiz
 /* Updates the global storing the current random offset of the particles,
  * and stores the relative offset from the last random offset in rel_random_shift.
  * RandomParticleOffset is the max adjustment as a fraction of the box. */
-void update_random_offset(struct part_manager_type * PartManager, double * rel_random_shift, double RandomParticleOffset, const uint64_t seed);
+void update_random_offset(struct part_manager_type * PartManager, double * rel_random_shift, double RandomParticleOffset, const uint64_t seed, const uint64_t step);
 
 /* Finds the correct relative position accounting for periodicity*/
 #define NEAREST(x, BoxSize) (((x)>0.5*BoxSize)?((x)-BoxSize):(((x)<-0.5*BoxSize)?((x)+BoxSize):(x)))
 
+/* Integer positions map the box onto the whole range of MyIntPosType, so that the
+ * periodic wrap of a separation is the integer overflow, as in Gadget-4.
+ * 64 bits by default: the positions then keep the full precision of a double.*/
+#ifdef INTPOS_32BIT
+typedef uint32_t MyIntPosType;
+typedef int32_t MySignedIntPosType;
+#else
+typedef uint64_t MyIntPosType;
+typedef int64_t MySignedIntPosType;
+#endif
+#define INTPOS_BITS (8 * sizeof(MyIntPosType))
+
+/* Box length of one integer position unit*/
+static inline double intpos_fac(const double BoxSize) {
+    return BoxSize / ldexp(1, INTPOS_BITS);
+}
+
+/* Integer position of a coordinate, wrapped into the box*/
+static inline MyIntPosType pos_to_intpos(const double x, const double BoxSize) {
+    double f = x / BoxSize;
+    f -= floor(f);
+    const double scaled = f * ldexp(1, INTPOS_BITS);
+    /* Rounding can give exactly the box size, which is zero*/
+    if(scaled >= ldexp(1, INTPOS_BITS))
+        return 0;
+    return (MyIntPosType) scaled;
+}
+
+/* Nearest periodic separation a - b of two integer positions, like NEAREST.*/
+#define INTPOS_NEAREST(a, b, fac) ((double) (MySignedIntPosType) ((MyIntPosType) ((a) - (b))) * (fac))
+
 static inline double DMAX(double a, double b) {
     if(a > b) return a;
     return b;
@@ -0,0 +1,295 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <bigfile-mpi.h>
+
+#ifdef USE_HDF5
+#include <hdf5.h>
+#endif
+
+#include "utils.h"
+
+#include "partmanager.h"
+#include "slotsmanager.h"
+#include "petaio.h"
+
+/*! \file petaio-hdf5.c
+ *  \brief Writes snapshots in the Gadget HDF5 format, in parallel.
+ *
+ *  The layout matches tools/convert_bigfile_gadget_hdf5.py: a Header group
+ *  and one group per particle type, with the Gadget names for the common blocks
+ *  and Gadget-3 velocity units. Everything is in one file, written collectively with MPI-IO.
+ */
+
+#ifdef USE_HDF5
+
+#ifndef H5_HAVE_PARALLEL
+#error "USE_HDF5 needs an HDF5 library built with parallel (MPI-IO) support"
+#endif
+
+/* Rows in a chunk of a dataset. Each chunk is compressed separately.*/
+#define HDF5_CHUNK_ROWS (1024 * 1024)
+
+/* Gadget names of the blocks which are renamed. Others keep their names.*/
+static const char * petaio_hdf5_names[][2] = {
+    {"Position", "Coordinates"},
+    {"Velocity", "Velocities"},
+    {"Mass", "Masses"},
+    {"NeutralHydrogenFraction", "NeutralHydrogenAbundance"},
+    {"ID", "ParticleIDs"},
+};
+
+static const char *
+petaio_hdf5_name(const char * name)
+{
+    size_t i;
+    for(i = 0; i < sizeof(petaio_hdf5_names) / sizeof(petaio_hdf5_names[0]); i++)
+        if(0 == strcmp(petaio_hdf5_names[i][0], name))
+            return petaio_hdf5_names[i][1];
+    return name;
+}
+
+/* HDF5 type of a bigfile dtype*/
+static hid_t
+petaio_hdf5_type(const char * dtype)
+{
+    const int kind = big_file_dtype_kind(dtype);
+    const int size = dtype_itemsize(dtype);
+    if(kind == 'f' && size == 4)
+        return H5T_NATIVE_FLOAT;
+    if(kind == 'f' && size == 8)
+        return H5T_NATIVE_DOUBLE;
+    if(kind == 'i' && size == 1)
+        return H5T_NATIVE_INT8;
+    if(kind == 'i' && size == 4)
+        return H5T_NATIVE_INT32;
+    if(kind == 'i' && size == 8)
+        return H5T_NATIVE_INT64;
+    if(kind == 'u' && size == 1)
+        return H5T_NATIVE_UINT8;
+    if(kind == 'u' && size == 4)
+        return H5T_NATIVE_UINT32;
+    if(kind == 'u' && size == 8)
+        return H5T_NATIVE_UINT64;
+    endrun(1, "No HDF5 type for dtype %s\n", dtype);
+    return -1;
+}
+
+/* Write an attribute. Collective: all ranks must pass the same value.*/
+static void
+petaio_hdf5_attr(hid_t loc, const char * name, hid_t type, const void * data, hsize_t n)
+{
+    hid_t space = H5Screate_simple(1, &n, NULL);
+    hid_t attr = H5Acreate2(loc, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    if(attr < 0 || H5Awrite(attr, type, data) < 0)
+        endrun(1, "Failed to write HDF5 attribute %s\n", name);
+    H5Aclose(attr);
+    H5Sclose(space);
+}
+
+static void
+petaio_hdf5_write_header(hid_t file, const int64_t * NTotal, const double atime, const Cosmology * CP, const int DoublePrecision)
+{
+    const struct header_data * head = petaio_get_header();
+    hid_t group = H5Gcreate2(file, "Header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if(group < 0)
+        endrun(1, "Failed to create HDF5 Header group\n");
+
+    /* As a relic from Gadget-1, the total particle numbers are two 32 bit integers*/
+    uint32_t low[6], high[6];
+    int64_t ThisFile[6];
+    double MassTable[6] = {0};
+    int t;
+    for(t = 0; t < 6; t++) {
+        low[t] = NTotal[t] % (1LL << 32);
+        high[t] = NTotal[t] >> 32;
+        ThisFile[t] = NTotal[t];
+    }
+    petaio_hdf5_attr(group, "NumPart_Total", H5T_NATIVE_UINT32, low, 6);
+    petaio_hdf5_attr(group, "NumPart_Total_HighWord", H5T_NATIVE_UINT32, high, 6);
+    petaio_hdf5_attr(group, "NumPart_ThisFile", H5T_NATIVE_INT64, ThisFile, 6);
+    /* Every particle has its mass in the Masses dataset*/
+    petaio_hdf5_attr(group, "MassTable", H5T_NATIVE_DOUBLE, MassTable, 6);
+    const int nfiles = 1;
+    petaio_hdf5_attr(group, "NumFilesPerSnapshot", H5T_NATIVE_INT32, &nfiles, 1);
+    /* Assume star formation implies the rest.*/
+    const int flag_sfr = NTotal[4] > 0;
+    const int zero = 0;
+    petaio_hdf5_attr(group, "Flag_Sfr", H5T_NATIVE_INT32, &flag_sfr, 1);
+    petaio_hdf5_attr(group, "Flag_Cooling", H5T_NATIVE_INT32, &flag_sfr, 1);
+    petaio_hdf5_attr(group, "Flag_StellarAge", H5T_NATIVE_INT32, &flag_sfr, 1);
+    petaio_hdf5_attr(group, "Flag_Metals", H5T_NATIVE_INT32, &flag_sfr, 1);
+    petaio_hdf5_attr(group, "Flag_Feedback", H5T_NATIVE_INT32, &zero, 1);
+    petaio_hdf5_attr(group, "Flag_DoublePrecision", H5T_NATIVE_INT32, &DoublePrecision, 1);
+    petaio_hdf5_attr(group, "Flag_IC_Info", H5T_NATIVE_INT32, &zero, 1);
+    petaio_hdf5_attr(group, "Flag_Entropy_ICs", H5T_NATIVE_INT32, &zero, 1);
+    const double redshift = 1. / atime - 1;
+    petaio_hdf5_attr(group, "Time", H5T_NATIVE_DOUBLE, &atime, 1);
+    petaio_hdf5_attr(group, "Redshift", H5T_NATIVE_DOUBLE, &redshift, 1);
+    petaio_hdf5_attr(group, "BoxSize", H5T_NATIVE_DOUBLE, &head->BoxSize, 1);
+    petaio_hdf5_attr(group, "Omega0", H5T_NATIVE_DOUBLE, &CP->Omega0, 1);
+    petaio_hdf5_attr(group, "OmegaLambda", H5T_NATIVE_DOUBLE, &CP->OmegaLambda, 1);
+    petaio_hdf5_attr(group, "OmegaBaryon", H5T_NATIVE_DOUBLE, &CP->OmegaBaryon, 1);
+    petaio_hdf5_attr(group, "HubbleParam", H5T_NATIVE_DOUBLE, &CP->HubbleParam, 1);
+    petaio_hdf5_attr(group, "UnitLength_in_cm", H5T_NATIVE_DOUBLE, &head->UnitLength_in_cm, 1);
+    petaio_hdf5_attr(group, "UnitMass_in_g", H5T_NATIVE_DOUBLE, &head->UnitMass_in_g, 1);
+    petaio_hdf5_attr(group, "UnitVelocity_in_cm_per_s", H5T_NATIVE_DOUBLE, &head->UnitVelocity_in_cm_per_s, 1);
+    H5Gclose(group);
+}
+
+/* Gadget-3 velocities are a^{1/2} dx/dt*/
+static void
+petaio_hdf5_convert_velocity(BigArray * array, const double atime)
+{
+    const double fac = GetUsePeculiarVelocity() ? 1 / sqrt(atime) : pow(atime, -1.5);
+    const int64_t n = array->dims[0] * array->dims[1];
+    int64_t i;
+    if(dtype_itemsize(array->dtype) == 4) {
+        float * v = (float *) array->data;
+        #pragma omp parallel for
+        for(i = 0; i < n; i++)
+            v[i] *= fac;
+    }
+    else {
+        double * v = (double *) array->data;
+        #pragma omp parallel for
+        for(i = 0; i < n; i++)
+            v[i] *= fac;
+    }
+}
+
+/* Write the selected particles of one block as a dataset, each rank to its own rows, collectively.*/
+static void
+petaio_hdf5_write_dataset(hid_t group, IOTableEntry * ent, const int * selection, const int NumSelection, const int64_t offset, const int64_t NTotal, struct conversions * conv, const int compression)
+{
+    const int rank = ent->items > 1 ? 2 : 1;
+    hsize_t dims[2] = {NTotal, ent->items};
+    hsize_t start[2] = {offset, 0};
+    hsize_t count[2] = {NumSelection, ent->items};
+    const hid_t type = petaio_hdf5_type(ent->dtype);
+
+    hid_t fspace = H5Screate_simple(rank, dims, NULL);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    if(NTotal > 0) {
+        hsize_t chunk[2] = {NTotal < HDF5_CHUNK_ROWS ? NTotal : HDF5_CHUNK_ROWS, ent->items};
+        H5Pset_chunk(dcpl, rank, chunk);
+        if(compression > 0) {
+            H5Pset_shuffle(dcpl);
+            H5Pset_deflate(dcpl, compression);
+        }
+    }
+    hid_t dset = H5Dcreate2(group, petaio_hdf5_name(ent->name), type, fspace, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    if(dset < 0)
+        endrun(1, "Failed to create HDF5 dataset for %d/%s\n", ent->ptype, ent->name);
+
+    hid_t mspace = H5Screate_simple(rank, count, NULL);
+    if(NumSelection > 0)
+        H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count, NULL);
+    else {
+        H5Sselect_none(fspace);
+        H5Sselect_none(mspace);
+    }
+
+    BigArray array = {0};
+    petaio_build_buffer(&array, ent, selection, NumSelection, PartManager->Base, SlotsManager, conv);
+    if(0 == strcmp(ent->name, "Velocity"))
+        petaio_hdf5_convert_velocity(&array, conv->atime);
+
+    hid_t dxpl = H5Pcreate(H5P_DATASET_XFER);
+    H5Pset_dxpl_mpio(dxpl, H5FD_MPIO_COLLECTIVE);
+    if(H5Dwrite(dset, type, mspace, fspace, dxpl, array.data) < 0)
+        endrun(1, "Failed to write HDF5 dataset for %d/%s\n", ent->ptype, ent->name);
+    petaio_destroy_buffer(&array);
+
+    H5Pclose(dxpl);
+    H5Sclose(mspace);
+    H5Dclose(dset);
+    H5Pclose(dcpl);
+    H5Sclose(fspace);
+}
+
+void
+petaio_save_snapshot_hdf5(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP, const int compression)
+{
+    message(0, "saving HDF5 snapshot into %s\n", fname);
+
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_fapl_mpio(fapl, GadgetComm, MPI_INFO_NULL);
+    /* Metadata is written collectively, rather than one small write per rank*/
+    H5Pset_all_coll_metadata_ops(fapl, 1);
+    H5Pset_coll_metadata_write(fapl, 1);
+    hid_t file = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
+    if(file < 0)
+        endrun(0, "Failed to create HDF5 snapshot at %s\n", fname);
+
+    int64_t ptype_offset[6] = {0};
+    int64_t ptype_count[6] = {0};
+    int64_t NTotal[6] = {0};
+    int64_t Offset[6] = {0};
+
+    int * selection = (int *) mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+    petaio_build_selection(selection, ptype_offset, ptype_count, PartManager->Base, PartManager->NumPart, NULL);
+
+    MPI_Allreduce(ptype_count, NTotal, 6, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Exscan(ptype_count, Offset, 6, MPI_INT64, MPI_SUM, GadgetComm);
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    /* Exscan leaves the first rank undefined*/
+    if(ThisTask == 0)
+        memset(Offset, 0, sizeof(Offset));
+
+    struct conversions conv = {0};
+    conv.atime = atime;
+    conv.hubble = hubble_function(CP, atime);
+
+    int DoublePrecision = 0;
+    int i;
+    for(i = 0; i < IOTable->used; i++)
+        if(0 == strcmp(IOTable->ent[i].name, "Position"))
+            DoublePrecision = dtype_itemsize(IOTable->ent[i].dtype) == 8;
+    petaio_hdf5_write_header(file, NTotal, atime, CP, DoublePrecision);
+
+    hid_t groups[6];
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        char name[32];
+        snprintf(name, sizeof(name), "PartType%d", ptype);
+        groups[ptype] = H5Gcreate2(file, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if(groups[ptype] < 0)
+            endrun(1, "Failed to create HDF5 group %s\n", name);
+    }
+
+    for(i = 0; i < IOTable->used; i++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        ptype = ent->ptype;
+        /* Only particle blocks*/
+        if(!(ptype < 6 && ptype >= 0))
+            continue;
+        if(NTotal[ptype] == 0)
+            continue;
+        if(verbose)
+            message(0, "Writing %ld particles to HDF5 dataset PartType%d/%s\n", NTotal[ptype], ptype, petaio_hdf5_name(ent->name));
+        petaio_hdf5_write_dataset(groups[ptype], ent, selection + ptype_offset[ptype], ptype_count[ptype], Offset[ptype], NTotal[ptype], &conv, compression);
+    }
+
+    for(ptype = 0; ptype < 6; ptype++)
+        H5Gclose(groups[ptype]);
+    if(H5Fclose(file) < 0)
+        endrun(0, "Failed to close HDF5 snapshot at %s\n", fname);
+    myfree(selection);
+    message(0, "Finished saving HDF5 snapshot into %s\n", fname);
+}
+
+#else
+
+void
+petaio_save_snapshot_hdf5(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP, const int compression)
+{
+    endrun(0, "HDF5 snapshot output requested but HDF5 not enabled. Compile with -DUSE_HDF5.\n");
+}
+
+#endif
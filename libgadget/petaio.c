@@ -5,7 +5,16 @@
 #include <math.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <omp.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include <bigfile-mpi.h>
 
@@ -33,8 +42,20 @@ static struct petaio_params {
     int WritersPerFile;    /* Number of concurrent writers per file; this decides number of writers */
     int NumWriters;        /* Number of concurrent writers, this caps number of writers */
     int MinNumWriters;        /* Min Number of concurrent writers, this caps number of writers */
+    int AdaptiveNumWriters;   /* Choose the number of concurrent writers, between MinNumWriters and NumWriters, from the measured throughput.*/
     int EnableAggregatedIO;  /* Enable aggregated IO policy for small files.*/
     size_t AggregatedIOThreshold; /* bytes per writer above which to use non-aggregated IO (avoid OOM)*/
+    int AggregatorsPerNode; /* If > 0, only this many ranks per node write; the others send them their data.*/
+    int AsyncWrite; /* Stage checkpoints in memory and write them in a background thread while the run continues.*/
+    size_t WriteChunkBytes; /* Largest column on a rank written in one go. Larger columns are streamed to disk in chunks of this size. 0 disables streaming.*/
+    int DifferentialCheckpoint; /* Hard link blocks which are unchanged since the previous snapshot instead of writing them.*/
+    int HDF5Output; /* Also write each snapshot in the Gadget HDF5 format*/
+    int HDF5Compression; /* Deflate level of the HDF5 datasets. 0 is uncompressed.*/
+    int MmapRead; /* On restart, map the block files and copy the particles straight from the page cache, without a read buffer.*/
+    int VerifyChecksums; /* Compare the bytes of every block read with the checksums stored by bigfile.*/
+    int PipelinedRead; /* On restart, read the next block in a background thread while the previous one is copied into the particles.*/
+    char LocalCheckpointDir[256]; /* If set, checkpoints are first dumped to per-rank files in this node-local directory,
+                                   * then written to the snapshot in the background.*/
     /* Changes the comoving factors of the snapshot outputs. Set in the ICs.
      * If UsePeculiarVelocity = 1 then snapshots save to the velocity field the physical peculiar velocity, v = a dx/dt (where x is comoving distance).
      * If UsePeculiarVelocity = 0 then the velocity field is a * v = a^2 dx/dt in snapshots
@@ -44,6 +65,9 @@ static struct petaio_params {
     int OutputPotential;        /*!< Flag whether to include the potential in snapshots*/
     int OutputHeliumFractions;  /*!< Flag whether to output the helium ionic fractions in snapshots*/
     int OutputTimebins;         /* Flag whether to save the timebins*/
+    int OutputWorkCost;         /* Flag whether to save and restore the per-particle interaction counts*/
+    int OutputPositionBits;     /* Mantissa bits kept in saved positions. 0 keeps all.*/
+    int OutputVelocityBits;     /* Mantissa bits kept in saved velocities. 0 keeps all.*/
     char SnapshotFileBase[100]; /* Snapshots are written to OutputDir/SnapshotFileBase_$n*/
     char InitCondFile[100]; /* Path to read ICs from is InitCondFile */
 
@@ -54,30 +78,73 @@ static struct petaio_params {
 /* Struct to store constant information written to each snapshot header*/
 static struct header_data Header;
 
+/* Number of the checkpoint whose local copy is read on restart, or -1.*/
+static int LocalSnapshot = -1;
+
+/* Snapshot most recently written or read, which unchanged blocks are linked to. Empty if none.*/
+static char PrevSnapshot[1024];
+
+/* Ranks sharing an IO aggregator; the aggregator is rank 0. MPI_COMM_NULL if aggregation is off.*/
+static MPI_Comm AggComm = MPI_COMM_NULL;
+
+/* Blocks smaller than this measure the filesystem latency rather than its throughput,
+ * and do not change the number of writers.*/
+#define TUNE_MIN_BYTES (64L * 1024L * 1024L)
+
+/* State of the number of writers chosen by AdaptiveNumWriters. Kept between snapshots.*/
+static struct {
+    int NumWriters;
+    /* Throughput of the last measured block, in bytes per second*/
+    double Rate;
+    /* Sign of the next change to NumWriters*/
+    int Step;
+} WriterTune;
+
 /*Set the IO parameters*/
 void
 set_petaio_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         IO.BytesPerFile = param_get_int(ps, "BytesPerFile");
         IO.UsePeculiarVelocity = 0; /* Will be set by the Initial Condition File */
         IO.NumWriters = param_get_int(ps, "NumWriters");
         IO.MinNumWriters = param_get_int(ps, "MinNumWriters");
+        IO.AdaptiveNumWriters = param_get_int(ps, "AdaptiveNumWriters");
         IO.WritersPerFile = param_get_int(ps, "WritersPerFile");
         IO.AggregatedIOThreshold = param_get_int(ps, "AggregatedIOThreshold");
         /* Convert from MB to bytes*/
         IO.AggregatedIOThreshold *= 1024L * 1024L;
         IO.EnableAggregatedIO = param_get_int(ps, "EnableAggregatedIO");
+        IO.AsyncWrite = param_get_int(ps, "AsyncSnapshotWrite");
+        IO.AggregatorsPerNode = param_get_int(ps, "IOAggregatorsPerNode");
+        IO.WriteChunkBytes = param_get_int(ps, "WriteChunkSize");
+        /* Convert from MB to bytes*/
+        IO.WriteChunkBytes *= 1024L * 1024L;
+        IO.DifferentialCheckpoint = param_get_int(ps, "DifferentialCheckpoint");
+        IO.MmapRead = param_get_int(ps, "MmapRead");
+        /* A trusted restart skips the consistency checks, so the data must be intact*/
+        IO.VerifyChecksums = param_get_int(ps, "TrustedRestart");
+        IO.PipelinedRead = param_get_int(ps, "PipelinedRead");
+        param_get_string2(ps, "LocalCheckpointDir", IO.LocalCheckpointDir, sizeof(IO.LocalCheckpointDir));
+        IO.HDF5Output = param_get_int(ps, "HDF5Output");
+        IO.HDF5Compression = param_get_int(ps, "HDF5Compression");
+#ifndef USE_HDF5
+        if(IO.HDF5Output)
+            endrun(0, "HDF5Output = 1 but HDF5 not enabled. Compile with -DUSE_HDF5.\n");
+#endif
         IO.OutputPotential = param_get_int(ps, "OutputPotential");
         IO.OutputTimebins = param_get_int(ps, "OutputTimebins");
+        IO.OutputWorkCost = param_get_int(ps, "OutputWorkCost");
         IO.OutputHeliumFractions = param_get_int(ps, "OutputHeliumFractions");
+        IO.OutputPositionBits = param_get_int(ps, "OutputPositionBits");
+        IO.OutputVelocityBits = param_get_int(ps, "OutputVelocityBits");
         param_get_string2(ps, "SnapshotFileBase", IO.SnapshotFileBase, sizeof(IO.SnapshotFileBase));
         param_get_string2(ps, "InitCondFile", IO.InitCondFile, sizeof(IO.InitCondFile));
         IO.ExcursionSetReionOn = param_get_int(ps,"ExcursionSetReionOn");
     }
-    MPI_Bcast(&IO, sizeof(struct petaio_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&IO, sizeof(struct petaio_params), MPI_BYTE, 0, GadgetComm);
 }
 
 int GetUsePeculiarVelocity(void)
@@ -85,8 +152,43 @@ int GetUsePeculiarVelocity(void)
     return IO.UsePeculiarVelocity;
 }
 
+int GetAsyncSnapshotWrite(void)
+{
+    return IO.AsyncWrite;
+}
+
+int GetHDF5Output(void)
+{
+    return IO.HDF5Output;
+}
+
+int GetHDF5Compression(void)
+{
+    return IO.HDF5Compression;
+}
+
+const struct header_data *
+petaio_get_header(void)
+{
+    return &Header;
+}
+
+int GetLocalCheckpoint(void)
+{
+    return IO.LocalCheckpointDir[0] != '\0';
+}
+
 static void petaio_write_header(BigFile * bf, const double atime, const int64_t * NTotal, const Cosmology * CP, const struct header_data * data);
+static void petaio_write_rank_index(BigFile * bf, const int * selection, const int64_t * ptype_offset, const int64_t * ptype_count);
+static void GTPosition(int i, double * out, void * baseptr, void * smanptr, const struct conversions * params);
+static int petaio_read_rank_index(BigFile * bf, struct header_data * head);
+static int petaio_save_linked(const char * fname, const char * blockname, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv, uint64_t * hash);
+static void petaio_set_hash_attr(BigFile * bf, const char * blockname, const uint64_t * hash);
 static void petaio_read_header_internal(BigFile * bf, Cosmology * CP, struct header_data * data);
+static void petaio_verify_read(const BigBlock * bb, const char * blockname, const BigArray * array);
+static int petaio_read_local_counts(int num, const int64_t * NTotalSnap, int64_t * NLocal);
+static void petaio_read_local(int num, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager);
+static int petaio_read_block_mmap(BigFile * bf, const char * fname, const char * blockname, IOTableEntry * ent, const int64_t NLocal, struct conversions * conv, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager);
 
 /* these are only used in reading in */
 void petaio_init(void) {
@@ -99,7 +201,26 @@ void petaio_init(void) {
         big_file_mpi_set_aggregated_threshold(0);
     }
     if(IO.NumWriters == 0)
-        MPI_Comm_size(MPI_COMM_WORLD, &IO.NumWriters);
+        MPI_Comm_size(GadgetComm, &IO.NumWriters);
+    /* Start from the largest number of writers and try fewer first*/
+    if(WriterTune.NumWriters == 0) {
+        WriterTune.NumWriters = IO.NumWriters;
+        WriterTune.Step = -1;
+    }
+
+    /* Split each node into AggregatorsPerNode groups of consecutive ranks*/
+    if(IO.AggregatorsPerNode > 0 && AggComm == MPI_COMM_NULL) {
+        int ThisTask, NodeRank, NodeSize;
+        MPI_Comm NodeComm;
+        MPI_Comm_rank(GadgetComm, &ThisTask);
+        MPI_Comm_split_type(GadgetComm, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &NodeComm);
+        MPI_Comm_rank(NodeComm, &NodeRank);
+        MPI_Comm_size(NodeComm, &NodeSize);
+        int nagg = IO.AggregatorsPerNode < NodeSize ? IO.AggregatorsPerNode : NodeSize;
+        MPI_Comm_split(NodeComm, (int64_t) NodeRank * nagg / NodeSize, NodeRank, &AggComm);
+        MPI_Comm_free(&NodeComm);
+        message(0, "Snapshot blocks are written by %d aggregator ranks per node.\n", nagg);
+    }
 }
 
 /* Build a list of the first particle of each type on the current processor.
@@ -158,7 +279,7 @@ petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose,
     message(0, "saving snapshot into %s\n", fname);
 
     BigFile bf = {0};
-    if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create(&bf, fname, GadgetComm)) {
         endrun(0, "Failed to create snapshot at %s:%s\n", fname,
                     big_file_get_error_message());
     }
@@ -171,19 +292,19 @@ petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose,
 
     petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, NULL);
 
-    MPI_Allreduce(ptype_count, NTotal, 6, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(ptype_count, NTotal, 6, MPI_INT64, MPI_SUM, GadgetComm);
     struct conversions conv = {0};
     conv.atime = atime;
     conv.hubble = hubble_function(CP, atime);
 
     petaio_write_header(&bf, atime, NTotal, CP, &Header);
+    petaio_write_rank_index(&bf, selection, ptype_offset, ptype_count);
 
     int i;
     for(i = 0; i < IOTable->used; i ++) {
         /* only process the particle blocks */
         char blockname[128];
         int ptype = IOTable->ent[i].ptype;
-        BigArray array = {0};
         /*This exclude FOF blocks*/
         if(!(ptype < 6 && ptype >= 0)) {
             continue;
@@ -193,24 +314,34 @@ petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose,
         if(ptype_count[ptype] == 0 && ptype < 4)
             continue;
         sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
-        petaio_build_buffer(&array, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv);
-        petaio_save_block(&bf, blockname, &array, verbose);
-        petaio_destroy_buffer(&array);
+        if(IO.DifferentialCheckpoint) {
+            uint64_t hash[2];
+            if(petaio_save_linked(fname, blockname, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv, hash)) {
+                if(verbose)
+                    message(0, "Block %s is unchanged: linked to %s\n", blockname, PrevSnapshot);
+                continue;
+            }
+            petaio_save_selection(&bf, blockname, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv, verbose);
+            petaio_set_hash_attr(&bf, blockname, hash);
+        }
+        else
+            petaio_save_selection(&bf, blockname, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv, verbose);
     }
 
     if(CP->MassiveNuLinRespOn) {
         int ThisTask;
-        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+        MPI_Comm_rank(GadgetComm, &ThisTask);
         petaio_save_neutrinos(&bf, ThisTask);
     }
-    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)){
+    if(0 != big_file_mpi_close(&bf, GadgetComm)){
         endrun(0, "Failed to close snapshot at %s:%s\n", fname,
                     big_file_get_error_message());
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Barrier(GadgetComm);
     message(0, "Finished saving snapshot into %s\n", fname);
     myfree(selection);
+    strncpy(PrevSnapshot, fname, sizeof(PrevSnapshot) - 1);
 }
 
 char *
@@ -233,7 +364,7 @@ struct header_data
     char * fname = petaio_get_snapshot_fname(num, OutputDir);
     message(0, "Probing Header of snapshot file: %s\n", fname);
 
-    if(0 != big_file_mpi_open(&bf, fname, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_open(&bf, fname, GadgetComm)) {
         endrun(0, "Failed to open snapshot at %s:%s\n", fname,
                     big_file_get_error_message());
     }
@@ -245,14 +376,21 @@ struct header_data
      * If this fails then neutrinonk will be zero.*/
     if(num >= 0) {
         BigBlock bn;
-        if(0 == big_file_mpi_open_block(&bf, &bn, "Neutrino", MPI_COMM_WORLD)) {
+        if(0 == big_file_mpi_open_block(&bf, &bn, "Neutrino", GadgetComm)) {
             if(0 != big_block_get_attr(&bn, "Nkval", &head.neutrinonk, "u8", 1))
                 endrun(0, "Failed to read attr: %s\n", big_file_get_error_message());
-            big_block_mpi_close(&bn, MPI_COMM_WORLD);
+            big_block_mpi_close(&bn, GadgetComm);
         }
     }
-
-    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+    /* Decide which rows this rank reads, keeping the layout of the writing ranks if it is known.*/
+    head.NLocalFromIndex = 0;
+    if(num >= 0)
+        head.NLocalFromIndex = petaio_read_rank_index(&bf, &head);
+    /* A local copy of the checkpoint is read instead of the snapshot, in its own layout*/
+    if(num >= 0 && petaio_read_local_counts(num, head.NTotal, head.NLocal))
+        head.NLocalFromIndex = 1;
+
+    if(0 != big_file_mpi_close(&bf, GadgetComm)) {
         endrun(0, "Failed to close snapshot at %s:%s\n", fname,
                     big_file_get_error_message());
     }
@@ -261,6 +399,97 @@ struct header_data
     return head;
 }
 
+/* A block of a pipelined read: this rank's rows are read into array by a background thread*/
+struct petaio_pipelined_block {
+    BigBlock bb;
+    BigArray array;
+    char name[128];
+    /* Row of the block where this rank's data starts*/
+    int64_t offset;
+    int opened;
+    int rt;
+    pthread_t thread;
+};
+
+/* Body of the reader thread. Each rank reads its own rows, so no MPI calls are made here.*/
+static void *
+petaio_pipelined_reader(void * arg)
+{
+    struct petaio_pipelined_block * pb = (struct petaio_pipelined_block *) arg;
+    BigBlockPtr ptr;
+    if(pb->array.dims[0] == 0)
+        return NULL;
+    pb->rt = big_block_seek(&pb->bb, &ptr, pb->offset);
+    if(pb->rt == 0)
+        pb->rt = big_block_read(&pb->bb, &ptr, &pb->array);
+    return NULL;
+}
+
+static void
+petaio_pipelined_start(struct petaio_pipelined_block * pb, IOTableEntry * ent, const int64_t NLocal)
+{
+    /* Allocated here as the allocator is not thread safe*/
+    petaio_alloc_buffer(&pb->array, ent, NLocal);
+    pb->rt = 0;
+    if(0 != pthread_create(&pb->thread, NULL, petaio_pipelined_reader, pb))
+        endrun(1, "Could not start the snapshot reader thread\n");
+}
+
+/* Read the blocks toread of IOTable, with the next block read in a background thread
+ * while the previous one is checked and copied into the particles. Collective.*/
+static void
+petaio_read_pipelined(BigFile * bf, struct IOTable * IOTable, const int * toread, const int nread, const struct header_data * header,
+        struct conversions * conv, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    int64_t offset[6] = {0};
+    MPI_Exscan(header->NLocal, offset, 6, MPI_INT64, MPI_SUM, GadgetComm);
+    if(ThisTask == 0)
+        memset(offset, 0, sizeof(offset));
+
+    struct petaio_pipelined_block * pb = ta_malloc("PipelinedBlocks", struct petaio_pipelined_block, nread);
+    memset(pb, 0, sizeof(pb[0]) * nread);
+    int k;
+    /* Opening is collective, so all blocks are opened before reading*/
+    for(k = 0; k < nread; k++) {
+        IOTableEntry * ent = &IOTable->ent[toread[k]];
+        snprintf(pb[k].name, sizeof(pb[k].name), "%d/%s", ent->ptype, ent->name);
+        pb[k].opened = (0 == big_file_mpi_open_block(bf, &pb[k].bb, pb[k].name, GadgetComm));
+        if(!pb[k].opened && ent->required)
+            endrun(0, "Failed to open block at %s:%s\n", pb[k].name, big_file_get_error_message());
+        pb[k].offset = offset[ent->ptype];
+    }
+
+    /* The buffers are freed in read order, which is not the reverse of allocation order*/
+    mymalloc_scope_begin();
+    int next = 0;
+    while(next < nread && !pb[next].opened)
+        next++;
+    if(next < nread)
+        petaio_pipelined_start(&pb[next], &IOTable->ent[toread[next]], header->NLocal[IOTable->ent[toread[next]].ptype]);
+    for(k = next; k < nread; k = next) {
+        pthread_join(pb[k].thread, NULL);
+        next = k + 1;
+        while(next < nread && !pb[next].opened)
+            next++;
+        if(next < nread)
+            petaio_pipelined_start(&pb[next], &IOTable->ent[toread[next]], header->NLocal[IOTable->ent[toread[next]].ptype]);
+        if(pb[k].rt != 0)
+            endrun(1, "Failed to read from block %s: %s\n", pb[k].name, big_file_get_error_message());
+        petaio_verify_read(&pb[k].bb, pb[k].name, &pb[k].array);
+        petaio_readout_buffer(&pb[k].array, &IOTable->ent[toread[k]], conv, PartManager, SlotsManager);
+        petaio_destroy_buffer(&pb[k].array);
+    }
+    mymalloc_scope_end();
+
+    for(k = 0; k < nread; k++) {
+        if(pb[k].opened && 0 != big_block_mpi_close(&pb[k].bb, GadgetComm))
+            endrun(0, "Failed to close block at %s:%s\n", pb[k].name, big_file_get_error_message());
+    }
+    ta_free(pb);
+}
+
 void
 petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct header_data * header, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, MPI_Comm Comm)
 {
@@ -275,6 +504,10 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
                     big_file_get_error_message());
     }
 
+    /* Later checkpoints may link to the blocks of this snapshot*/
+    if(!ic)
+        strncpy(PrevSnapshot, fname, sizeof(PrevSnapshot) - 1);
+
     /*Read neutrinos from the snapshot if necessary*/
     if(CP->MassiveNuLinRespOn) {
         int ThisTask;
@@ -286,6 +519,11 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
             petaio_read_neutrinos(&bf, ThisTask);
     }
 
+    /* The particles come from the local copy of the checkpoint, if there is one*/
+    const int local = (num >= 0 && num == LocalSnapshot);
+    if(local)
+        petaio_read_local(num, PartManager, SlotsManager);
+
     struct conversions conv = {0};
     conv.atime = header->TimeSnapshot;
     conv.hubble = hubble_function(CP, header->TimeSnapshot);
@@ -296,6 +534,10 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
      * Note the metal fields are non-fatal so this does not break resuming without metals.*/
     register_io_blocks(IOTable, 0, 1);
 
+    /* Blocks left for the pipelined read*/
+    int * toread = ta_malloc("toread", int, IOTable->used);
+    int nread = 0;
+
     for(i = 0; i < IOTable->used; i ++) {
         /* only process the particle blocks */
         char blockname[128];
@@ -304,7 +546,7 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
         if(!(ptype < 6 && ptype >= 0)) {
             continue;
         }
-        if(header->NTotal[ptype] == 0) continue;
+        if(header->NTotal[ptype] == 0 || local) continue;
         if(ic) {
             /* for IC read in only three blocks */
             int keep = 0;
@@ -324,11 +566,28 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
             continue;
         }
         sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
+        if(IO.PipelinedRead && !IO.MmapRead) {
+            toread[nread++] = i;
+            continue;
+        }
+        if(IO.MmapRead) {
+            int ret = petaio_read_block_mmap(&bf, fname, blockname, &IOTable->ent[i], header->NLocal[ptype], &conv, PartManager, SlotsManager);
+            if(ret == 0)
+                continue;
+            if(ret == 1) {
+                if(IOTable->ent[i].required)
+                    endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
+                continue;
+            }
+        }
         petaio_alloc_buffer(&array, &IOTable->ent[i], header->NLocal[ptype]);
         if(0 == petaio_read_block(&bf, blockname, &array, IOTable->ent[i].required))
             petaio_readout_buffer(&array, &IOTable->ent[i], &conv, PartManager, SlotsManager);
         petaio_destroy_buffer(&array);
     }
+    if(nread > 0)
+        petaio_read_pipelined(&bf, IOTable, toread, nread, header, &conv, PartManager, SlotsManager);
+    ta_free(toread);
     destroy_io_blocks(IOTable);
 
     if(0 != big_file_mpi_close(&bf, Comm)) {
@@ -370,7 +629,7 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
 /* write a header block */
 static void petaio_write_header(BigFile * bf, const double atime, const int64_t * NTotal, const Cosmology * CP, const struct header_data * data) {
     BigBlock bh;
-    if(0 != big_file_mpi_create_block(bf, &bh, "Header", NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create_block(bf, &bh, "Header", NULL, 0, 0, 0, GadgetComm)) {
         endrun(0, "Failed to create block at %s:%s\n", "Header",
                 big_file_get_error_message());
     }
@@ -414,11 +673,407 @@ static void petaio_write_header(BigFile * bf, const double atime, const int64_t
                     big_file_get_error_message());
     }
 
-    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bh, GadgetComm)) {
         endrun(0, "Failed to close block %s\n",
                     big_file_get_error_message());
     }
 }
+/* Write one row per rank of a small per-rank table to a new block.*/
+static void
+petaio_write_rank_table(BigFile * bf, const char * blockname, const char * dtype, int nmemb, void * row)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+    BigArray array;
+    int NTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+
+    size_t dims[2] = {1, nmemb};
+    big_array_init(&array, row, dtype, 2, dims, NULL);
+    if(0 != big_file_mpi_create_block(bf, &bb, blockname, dtype, nmemb, 1, NTask, GadgetComm)) {
+        endrun(0, "Failed to create block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+    if(0 != big_block_seek(&bb, &ptr, 0)) {
+        endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_write(&bb, &ptr, &array, IO.NumWriters, GadgetComm)) {
+        endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bb, GadgetComm)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+}
+
+/* Save the number of particles of each type on each writing rank, in rank order,
+ * and the bounding box of the saved positions of each type on each rank.
+ * Each rank holds a compact Peano key range, so on restart the counts let every rank read
+ * the same region of space for all particle types, and the boxes form a coarse spatial
+ * index for reading a subregion.*/
+static void
+petaio_write_rank_index(BigFile * bf, const int * selection, const int64_t * ptype_offset, const int64_t * ptype_count)
+{
+    int64_t count[6];
+    memcpy(count, ptype_count, sizeof(count));
+    petaio_write_rank_table(bf, "RankIndex", "i8", 6, count);
+
+    /* Min and max of each coordinate for each type. Empty types have min > max.*/
+    double box[6][6];
+    int t;
+    for(t = 0; t < 6; t++) {
+        int k;
+        for(k = 0; k < 3; k++) {
+            box[t][k] = PartManager->BoxSize;
+            box[t][k+3] = 0;
+        }
+        int64_t i;
+        for(i = 0; i < ptype_count[t]; i++) {
+            double pos[3];
+            GTPosition(selection[ptype_offset[t] + i], pos, PartManager->Base, NULL, NULL);
+            for(k = 0; k < 3; k++) {
+                if(pos[k] < box[t][k])
+                    box[t][k] = pos[k];
+                if(pos[k] > box[t][k+3])
+                    box[t][k+3] = pos[k];
+            }
+        }
+    }
+    petaio_write_rank_table(bf, "RankBox", "f8", 36, box);
+}
+
+/* Read a per-rank table written by petaio_write_rank_table onto every rank.
+ * Returns NULL if the block does not exist. The table must be freed with myfree.*/
+static void *
+petaio_read_rank_table(BigFile * bf, const char * blockname, const char * dtype, int nmemb, int64_t * nrows)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, GadgetComm))
+        return NULL;
+
+    *nrows = bb.size;
+    const size_t rowsize = dtype_itemsize(dtype) * nmemb;
+    char * table = (char *) mymalloc(blockname, rowsize * (*nrows + 1));
+    size_t dims[2] = {ThisTask == 0 ? *nrows : 0, nmemb};
+    BigArray array;
+    big_array_init(&array, table, dtype, 2, dims, NULL);
+    if(0 != big_block_seek(&bb, &ptr, 0) ||
+       0 != big_block_mpi_read(&bb, &ptr, &array, IO.NumWriters, GadgetComm)) {
+        endrun(0, "Failed to read %s: %s\n", blockname, big_file_get_error_message());
+    }
+    big_block_mpi_close(&bb, GadgetComm);
+    MPI_Bcast(table, rowsize * *nrows, MPI_BYTE, 0, GadgetComm);
+    return table;
+}
+
+/* Set head->NLocal from the RankIndex of the snapshot, if there is one.
+ * With the same number of ranks, each rank reads what it wrote. Otherwise
+ * the writing ranks are spread evenly, by total particle number, over the reading ranks.
+ * A writing rank shared by several readers has each of its types split in the same proportion.
+ * Since the rows of each type on a writing rank are in key order, every reader gets
+ * approximately the same compact region for all types, whatever the rank count.
+ * Returns 1 on success, 0 if there is no usable index and the caller should split evenly. */
+static int
+petaio_read_rank_index(BigFile * bf, struct header_data * head)
+{
+    int ThisTask, NTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+
+    int64_t NWriter;
+    int64_t * count = (int64_t *) petaio_read_rank_table(bf, "RankIndex", "i8", 6, &NWriter);
+    if(!count)
+        return 0;
+
+    /* Check the index matches the particle blocks*/
+    int64_t tot[6] = {0};
+    int64_t r;
+    int t;
+    for(r = 0; r < NWriter; r++)
+        for(t = 0; t < 6; t++)
+            tot[t] += count[6 * r + t];
+    for(t = 0; t < 6; t++) {
+        if(tot[t] != head->NTotal[t]) {
+            message(0, "RankIndex has %ld particles of type %d, not %ld; ignoring it.\n", tot[t], t, head->NTotal[t]);
+            myfree(count);
+            return 0;
+        }
+    }
+
+    /* Same rank count: read back exactly what each rank wrote*/
+    if(NWriter == NTask) {
+        for(t = 0; t < 6; t++)
+            head->NLocal[t] = count[6 * ThisTask + t];
+        myfree(count);
+        return 1;
+    }
+
+    int64_t NTotal = 0;
+    for(t = 0; t < 6; t++)
+        NTotal += head->NTotal[t];
+
+    /* Row of each type at a point x of the cumulative total particle count*/
+    int64_t range[2][6];
+    int e;
+    for(e = 0; e < 2; e++) {
+        const int64_t x = (ThisTask + e) * NTotal / NTask;
+        int64_t before = 0;
+        int64_t rowstart[6] = {0};
+        for(r = 0; r < NWriter; r++) {
+            int64_t nr = 0;
+            for(t = 0; t < 6; t++)
+                nr += count[6 * r + t];
+            if(before + nr >= x)
+                break;
+            before += nr;
+            for(t = 0; t < 6; t++)
+                rowstart[t] += count[6 * r + t];
+        }
+        int64_t nr = 0;
+        if(r < NWriter)
+            for(t = 0; t < 6; t++)
+                nr += count[6 * r + t];
+        for(t = 0; t < 6; t++) {
+            range[e][t] = rowstart[t];
+            if(nr > 0)
+                range[e][t] += (int64_t) ((double) count[6 * r + t] * (x - before) / nr);
+        }
+    }
+    for(t = 0; t < 6; t++)
+        head->NLocal[t] = range[1][t] - range[0][t];
+    message(0, "Reading particles in the layout of the %ld ranks which wrote the snapshot.\n", NWriter);
+    myfree(count);
+    return 1;
+}
+
+/* Is the block with this IOTable entry wanted by the filter? Positions are always read for a box cut.*/
+static int
+petaio_filter_wants(const struct petaio_read_filter * filter, const IOTableEntry * ent)
+{
+    if(ent->ptype < 0 || ent->ptype >= 6 || !(filter->TypeMask & (1 << ent->ptype)))
+        return 0;
+    if(!filter->Blocks)
+        return 1;
+    if(filter->UseBox && 0 == strcmp(ent->name, "Position"))
+        return 1;
+    int b;
+    for(b = 0; filter->Blocks[b]; b++)
+        if(0 == strcmp(filter->Blocks[b], ent->name))
+            return 1;
+    return 0;
+}
+
+void
+petaio_filter_io_blocks(struct IOTable * IOTable, const struct petaio_read_filter * filter)
+{
+    int i, used = 0;
+    for(i = 0; i < IOTable->used; i++) {
+        if(petaio_filter_wants(filter, &IOTable->ent[i]))
+            IOTable->ent[used++] = IOTable->ent[i];
+    }
+    IOTable->used = used;
+}
+
+/* Do the boxes of two regions overlap? box holds min then max of each coordinate.*/
+static int
+petaio_box_overlaps(const double * box, const double * BoxMin, const double * BoxMax)
+{
+    int k;
+    for(k = 0; k < 3; k++) {
+        if(box[k] > box[k+3])
+            return 0;
+        if(box[k+3] < BoxMin[k] || box[k] >= BoxMax[k])
+            return 0;
+    }
+    return 1;
+}
+
+/* Read a subset of a snapshot: the particle types in filter->TypeMask, the blocks in filter->Blocks,
+ * and, if filter->UseBox, the particles with positions in [BoxMin, BoxMax).
+ * The rows of each writing rank whose bounding box (RankBox) misses the region are not read at all;
+ * the selected rows are shared evenly between the reading ranks, and the particles outside
+ * the region are then removed. Without a RankBox the whole type is read before the cut.
+ * Particle and slot memory is allocated here, sized to the largest local count: slots_init and
+ * slots_set_enabled must have been called, and header must come from petaio_read_header.
+ * Unlike petaio_read_snapshot, no derived quantities are set up.*/
+void
+petaio_read_snapshot_partial(int num, const char * OutputDir, Cosmology * CP, struct header_data * header, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, const struct petaio_read_filter * filter)
+{
+    int ThisTask, NTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+
+    char * fname = petaio_get_snapshot_fname(num, OutputDir);
+    BigFile bf = {0};
+    message(0, "Reading part of snapshot %s\n", fname);
+
+    if(0 != big_file_mpi_open(&bf, fname, GadgetComm)) {
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+    /* Free now, as the particles will be allocated above it*/
+    myfree(fname);
+
+    int64_t NWriter = 0, NBox = 0;
+    int64_t * count = (int64_t *) petaio_read_rank_table(&bf, "RankIndex", "i8", 6, &NWriter);
+    double * box = NULL;
+    if(count && filter->UseBox)
+        box = (double *) petaio_read_rank_table(&bf, "RankBox", "f8", 36, &NBox);
+    if(box && NBox != NWriter)
+        endrun(0, "RankBox has %ld rows but RankIndex has %ld\n", NBox, NWriter);
+
+    /* The rows of each type this rank reads: at most NWriter ranges per type*/
+    int64_t (*ranges)[2] = (int64_t (*)[2]) mymalloc2("ReadRanges", sizeof(ranges[0]) * 6 * (NWriter + 1));
+    int64_t nranges[6] = {0};
+    int t;
+    for(t = 0; t < 6; t++) {
+        int64_t (*myr)[2] = ranges + t * (NWriter + 1);
+        header->NLocal[t] = 0;
+        if(!(filter->TypeMask & (1 << t)) || header->NTotal[t] == 0)
+            continue;
+        /* Find the selected rows*/
+        int64_t (*sel)[2] = (int64_t (*)[2]) ta_malloc("SelRanges", int64_t, 2 * (NWriter + 1));
+        int64_t nsel = 0, nrows = 0;
+        if(box) {
+            int64_t r, start = 0;
+            for(r = 0; r < NWriter; r++) {
+                const int64_t n = count[6 * r + t];
+                if(n > 0 && petaio_box_overlaps(box + 36 * r + 6 * t, filter->BoxMin, filter->BoxMax)) {
+                    /* Merge adjacent ranges*/
+                    if(nsel > 0 && sel[nsel-1][1] == start)
+                        sel[nsel-1][1] = start + n;
+                    else {
+                        sel[nsel][0] = start;
+                        sel[nsel][1] = start + n;
+                        nsel++;
+                    }
+                    nrows += n;
+                }
+                start += n;
+            }
+        }
+        else {
+            sel[0][0] = 0;
+            sel[0][1] = header->NTotal[t];
+            nsel = 1;
+            nrows = header->NTotal[t];
+        }
+        /* Take an even share of the selected rows*/
+        const int64_t mystart = ThisTask * nrows / NTask;
+        const int64_t myend = (ThisTask + 1) * nrows / NTask;
+        int64_t s, before = 0;
+        for(s = 0; s < nsel; s++) {
+            const int64_t len = sel[s][1] - sel[s][0];
+            const int64_t lo = mystart > before ? mystart : before;
+            const int64_t hi = myend < before + len ? myend : before + len;
+            if(hi > lo) {
+                myr[nranges[t]][0] = sel[s][0] + lo - before;
+                myr[nranges[t]][1] = sel[s][0] + hi - before;
+                nranges[t]++;
+                header->NLocal[t] += hi - lo;
+            }
+            before += len;
+        }
+        ta_free(sel);
+        message(0, "Reading %ld of %ld particles of type %d in %ld ranges.\n", nrows, header->NTotal[t], t, nsel);
+    }
+    if(box)
+        myfree(box);
+    if(count)
+        myfree(count);
+
+    /* Allocate the particles and slots*/
+    int64_t NumPart = 0;
+    for(t = 0; t < 6; t++)
+        NumPart += header->NLocal[t];
+    int64_t MaxPart = NumPart + 1;
+    MPI_Allreduce(MPI_IN_PLACE, &MaxPart, 1, MPI_INT64, MPI_MAX, GadgetComm);
+    particle_alloc_memory(PartManager, header->BoxSize, MaxPart);
+    PartManager->NumPart = NumPart;
+    int64_t newSlots[6];
+    MPI_Allreduce(header->NLocal, newSlots, 6, MPI_INT64, MPI_MAX, GadgetComm);
+    slots_reserve(0, newSlots, SlotsManager);
+    slots_setup_topology(PartManager, header->NLocal, SlotsManager);
+
+    struct conversions conv = {0};
+    conv.atime = header->TimeSnapshot;
+    conv.hubble = hubble_function(CP, header->TimeSnapshot);
+
+    struct IOTable IOTable[1] = {0};
+    register_io_blocks(IOTable, 0, 1);
+    petaio_filter_io_blocks(IOTable, filter);
+
+    int i;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        const int ptype = ent->ptype;
+        if(header->NTotal[ptype] == 0 || ent->setter == NULL)
+            continue;
+        char blockname[128];
+        sprintf(blockname, "%d/%s", ptype, ent->name);
+        BigBlock bb;
+        if(0 != big_file_mpi_open_block(&bf, &bb, blockname, GadgetComm)) {
+            if(ent->required)
+                endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
+            continue;
+        }
+        BigArray array = {0};
+        petaio_alloc_buffer(&array, ent, header->NLocal[ptype]);
+        /* Each rank reads its own ranges*/
+        int64_t (*myr)[2] = ranges + ptype * (NWriter + 1);
+        int64_t s, done = 0;
+        int rt = 0;
+        for(s = 0; s < nranges[ptype] && rt == 0; s++) {
+            BigBlockPtr ptr;
+            BigArray part = {0};
+            size_t dims[2] = {myr[s][1] - myr[s][0], ent->items};
+            big_array_init(&part, (char *) array.data + done * array.strides[0], ent->dtype, 2, dims, array.strides);
+            rt = big_block_seek(&bb, &ptr, myr[s][0]);
+            if(rt == 0)
+                rt = big_block_read(&bb, &ptr, &part);
+            done += dims[0];
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &rt, 1, MPI_INT, MPI_MIN, GadgetComm);
+        if(rt != 0)
+            endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+        big_block_mpi_close(&bb, GadgetComm);
+        petaio_readout_buffer(&array, ent, &conv, PartManager, SlotsManager);
+        petaio_destroy_buffer(&array);
+    }
+    destroy_io_blocks(IOTable);
+    myfree(ranges);
+
+    if(0 != big_file_mpi_close(&bf, GadgetComm)) {
+        endrun(0, "Failed to close snapshot %d:%s\n", num,
+                    big_file_get_error_message());
+    }
+    slots_setup_id(PartManager, SlotsManager);
+
+    if(filter->UseBox) {
+        /* Exact cut: remove the particles outside the region*/
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++) {
+            int k;
+            for(k = 0; k < 3; k++) {
+                const double x = PartManager->Base[i].Pos[k];
+                if(x < filter->BoxMin[k] || x >= filter->BoxMax[k]) {
+                    slots_mark_garbage(i, PartManager, SlotsManager);
+                    break;
+                }
+            }
+        }
+        int compact[6] = {1, 1, 1, 1, 1, 1};
+        slots_gc(compact, PartManager, SlotsManager);
+    }
+    int64_t ntot = PartManager->NumPart;
+    MPI_Allreduce(MPI_IN_PLACE, &ntot, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    message(0, "Read %ld particles.\n", ntot);
+}
+
 static double
 _get_attr_double(BigBlock * bh, const char * name, const double def)
 {
@@ -441,7 +1096,7 @@ _get_attr_int(BigBlock * bh, const char * name, const int def)
 static void
 petaio_read_header_internal(BigFile * bf, Cosmology * CP, struct header_data * Header) {
     BigBlock bh;
-    if(0 != big_file_mpi_open_block(bf, &bh, "Header", MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_open_block(bf, &bh, "Header", GadgetComm)) {
         endrun(0, "Failed to create block at %s:%s\n", "Header",
                     big_file_get_error_message());
     }
@@ -512,7 +1167,7 @@ petaio_read_header_internal(BigFile * bf, Cosmology * CP, struct header_data * H
         }
     }
 
-    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bh, GadgetComm)) {
         endrun(0, "Failed to close block: %s\n",
                     big_file_get_error_message());
     }
@@ -543,25 +1198,172 @@ void petaio_readout_buffer(BigArray * array, IOTableEntry * ent, struct conversi
         p += array->strides[0];
     }
 }
-/* build an IO buffer for block, based on selection
- * only check P[ selection[i]]. If selection is NULL, just use P[i].
- * NOTE: selected range should contain only one particle type!
-*/
-void
-petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+
+/* True if a block stored with dtype filedtype can be read as bytes into memory of memdtype*/
+static int
+petaio_dtype_native(const char * filedtype, const char * memdtype)
 {
-    if(selection == NULL) {
-        endrun(-1, "NULL selection is not supported\n");
-    }
+    const union { uint16_t u; char c[2]; } endian = {1};
+    const char native = endian.c[0] ? '<' : '>';
+    return (filedtype[0] == native || filedtype[0] == '=')
+        && big_file_dtype_kind(filedtype) == big_file_dtype_kind(memdtype) && dtype_itemsize(filedtype) == dtype_itemsize(memdtype);
+}
 
-    /* don't forget to free buffer after its done*/
-    petaio_alloc_buffer(array, ent, NumSelection);
+/* Byte sum of read data, which bigfile also stores for each file of a block when writing*/
+static unsigned int
+petaio_sysvsum(const char * data, const size_t nbytes)
+{
+    unsigned int sum = 0;
+    size_t i;
+    #pragma omp parallel for reduction(+: sum)
+    for(i = 0; i < nbytes; i++)
+        sum += (unsigned char) data[i];
+    return sum;
+}
 
-    /* Fast code path if there are no such particles */
-    if(NumSelection == 0) {
+/* Compare the byte sum of the rows read on all ranks with the checksums of the block.
+ * Blocks not read whole cannot be checked. Collective.*/
+static void
+petaio_verify_checksum(const BigBlock * bb, const char * blockname, unsigned int localsum, int64_t nread)
+{
+    unsigned int sum = 0;
+    int64_t ntot = 0;
+    MPI_Allreduce(&localsum, &sum, 1, MPI_UNSIGNED, MPI_SUM, GadgetComm);
+    MPI_Allreduce(&nread, &ntot, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    if(ntot != (int64_t) bb->size)
+        return;
+    unsigned int expected = 0;
+    int f;
+    for(f = 0; f < bb->Nfile; f++)
+        expected += bb->fchecksum[f];
+    if(sum != expected)
+        endrun(1, "Block %s is corrupt: checksum %u but %u when written\n", blockname, sum, expected);
+}
+
+/* Compare a whole block read into array with its checksums, if this is enabled.
+ * The checksums are of the file bytes, so only a read without conversion can be checked. Collective.*/
+static void
+petaio_verify_read(const BigBlock * bb, const char * blockname, const BigArray * array)
+{
+    if(!IO.VerifyChecksums)
         return;
+    if(bb->nmemb == (array->ndim > 1 ? array->dims[1] : 1) && petaio_dtype_native(bb->dtype, array->dtype))
+        petaio_verify_checksum(bb, blockname, petaio_sysvsum(array->data, array->size * dtype_itemsize(array->dtype)), array->dims[0]);
+}
+
+/* Read a block by mapping its data files and passing each row of this rank straight to the setter.
+ * This avoids allocating a read buffer for the column and the copy out of the page cache.
+ * Returns 0 on success and 1 if the block does not exist. Returns -1 if the stored type
+ * differs from the in-memory type (or has foreign endianness), in which case the block
+ * should be read with petaio_read_block, which converts it.*/
+static int
+petaio_read_block_mmap(BigFile * bf, const char * fname, const char * blockname, IOTableEntry * ent, const int64_t NLocal,
+        struct conversions * conv, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager)
+{
+    BigBlock bb;
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, GadgetComm))
+        return 1;
+
+    const size_t rowsize = dtype_itemsize(ent->dtype) * ent->items;
+    int ret = 0;
+    if(bb.nmemb != ent->items || !petaio_dtype_native(bb.dtype, ent->dtype))
+        ret = -1;
+    unsigned int sum = 0;
+
+    int64_t start = 0;
+    MPI_Exscan(&NLocal, &start, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0)
+        start = 0;
+    if(ret == 0 && start + NLocal > (int64_t) bb.size)
+        endrun(1, "Block %s has %lu rows, fewer than the %ld expected\n", blockname, bb.size, start + NLocal);
+
+    const size_t pagesize = sysconf(_SC_PAGESIZE);
+    int64_t row = start, end = start + NLocal;
+    int f, i = 0;
+    for(f = 0; ret == 0 && f < bb.Nfile && row < end; f++) {
+        const int64_t fbegin = bb.foffset[f], fend = bb.foffset[f] + bb.fsize[f];
+        if(fend <= row)
+            continue;
+        const int64_t last = end < fend ? end : fend;
+        /* Map from the page containing the first row we need*/
+        const size_t offset = (row - fbegin) * rowsize;
+        const size_t mapoff = offset - offset % pagesize;
+        const size_t maplen = (last - fbegin) * rowsize - mapoff;
+        char * datafile = fastpm_strdup_printf("%s/%s/%06X", fname, blockname, f);
+        int fd = open(datafile, O_RDONLY);
+        if(fd < 0)
+            endrun(1, "Failed to open %s: %s\n", datafile, strerror(errno));
+        char * map = (char *) mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, mapoff);
+        if(map == MAP_FAILED)
+            endrun(1, "Failed to map %lu bytes of %s: %s\n", maplen, datafile, strerror(errno));
+        close(fd);
+        myfree(datafile);
+        madvise(map, maplen, MADV_SEQUENTIAL);
+
+        const char * p = map + offset - mapoff;
+        if(IO.VerifyChecksums)
+            sum += petaio_sysvsum(p, (last - row) * rowsize);
+        for(; row < last; row++) {
+            while(PartManager->Base[i].Type != ent->ptype)
+                i++;
+            ent->setter(i, (void *) p, PartManager->Base, SlotsManager, conv);
+            p += rowsize;
+            i++;
+        }
+        munmap(map, maplen);
+    }
+    if(ret == 0 && IO.VerifyChecksums)
+        petaio_verify_checksum(&bb, blockname, sum, NLocal);
+
+    if(0 != big_block_mpi_close(&bb, GadgetComm)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+    return ret;
+}
+
+/* Round a float column to ent->keepbits mantissa bits, zeroing the rest.
+ * Rows are contiguous, count values in total. Inf and NaN are left alone.
+ * The trailing zero bits make the files compress well with any byte compressor.*/
+static void
+petaio_trim_mantissa(char * data, const int64_t count, IOTableEntry * ent)
+{
+    int64_t i;
+    if(ent->dtype[1] == '4') {
+        if(ent->keepbits >= 23)
+            return;
+        const uint32_t drop = 23 - ent->keepbits;
+        const uint32_t mask = ~((UINT32_C(1) << drop) - 1);
+        uint32_t * u = (uint32_t *) data;
+        for(i = 0; i < count; i++) {
+            if((u[i] & 0x7f800000u) == 0x7f800000u)
+                continue;
+            uint32_t r = (u[i] + (UINT32_C(1) << (drop - 1))) & mask;
+            /* Do not round the largest values up to infinity*/
+            u[i] = ((r & 0x7f800000u) == 0x7f800000u) ? (u[i] & mask) : r;
+        }
     }
+    else {
+        if(ent->keepbits >= 52)
+            return;
+        const uint64_t drop = 52 - ent->keepbits;
+        const uint64_t mask = ~((UINT64_C(1) << drop) - 1);
+        uint64_t * u = (uint64_t *) data;
+        for(i = 0; i < count; i++) {
+            if((u[i] & UINT64_C(0x7ff0000000000000)) == UINT64_C(0x7ff0000000000000))
+                continue;
+            uint64_t r = (u[i] + (UINT64_C(1) << (drop - 1))) & mask;
+            u[i] = ((r & UINT64_C(0x7ff0000000000000)) == UINT64_C(0x7ff0000000000000)) ? (u[i] & mask) : r;
+        }
+    }
+}
 
+/* fill NumSelection rows of data, stride bytes apart, with the getter of ent. */
+static void
+petaio_fill_buffer(char * data, const ptrdiff_t stride, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+{
 #pragma omp parallel
     {
         int i;
@@ -570,17 +1372,65 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
         const int start = NumSelection * (size_t) tid / NT;
         const int end = NumSelection * ((size_t) tid + 1) / NT;
         /* fill the buffer */
-        char * p = (char *) array->data;
-        p += array->strides[0] * start;
+        char * p = data + stride * start;
         for(i = start; i < end; i ++) {
             const int j = selection[i];
             if(Parts[j].Type != ent->ptype) {
                 endrun(2, "Selection %d has type = %d != %d\n", j, Parts[j].Type, ent->ptype);
             }
             ent->getter(j, p, Parts, SlotsManager, conv);
-            p += array->strides[0];
+            p += stride;
         }
+        if(ent->keepbits > 0)
+            petaio_trim_mantissa(data + stride * start, (int64_t) (end - start) * ent->items, ent);
+    }
+}
+
+/* build an IO buffer for block, based on selection
+ * only check P[ selection[i]]. If selection is NULL, just use P[i].
+ * NOTE: selected range should contain only one particle type!
+*/
+void
+petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+{
+    if(selection == NULL) {
+        endrun(-1, "NULL selection is not supported\n");
+    }
+
+    /* don't forget to free buffer after its done*/
+    petaio_alloc_buffer(array, ent, NumSelection);
+
+    /* Fast code path if there are no such particles */
+    if(NumSelection == 0) {
+        return;
     }
+
+    petaio_fill_buffer((char *) array->data, array->strides[0], ent, selection, NumSelection, Parts, SlotsManager, conv);
+}
+
+/* If the selection is a contiguous range of Parts and ent is a plain particle_data field,
+ * point array at the particle table with a strided view and return 1. Nothing is copied.
+ * Otherwise return 0. */
+static int
+petaio_direct_array(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts)
+{
+    if(ent->direct_dtype[0] == '\0' || ent->keepbits > 0)
+        return 0;
+    /* selection is sorted, so this checks the range is contiguous*/
+    if(NumSelection > 0 && selection[NumSelection - 1] - selection[0] != NumSelection - 1)
+        return 0;
+
+    size_t dims[2];
+    ptrdiff_t strides[2];
+    dims[0] = NumSelection;
+    dims[1] = ent->items;
+    strides[0] = sizeof(struct particle_data);
+    strides[1] = dtype_itemsize(ent->direct_dtype);
+    char * data = (char *) Parts + ent->direct_offset;
+    if(NumSelection > 0)
+        data += sizeof(struct particle_data) * selection[0];
+    big_array_init(array, data, ent->direct_dtype, 2, dims, strides);
+    return 1;
 }
 
 /* destroy a buffer, freeing its memory */
@@ -594,7 +1444,7 @@ int petaio_read_block(BigFile * bf, const char * blockname, BigArray * array, in
     BigBlockPtr ptr;
 
     /* open the block */
-    if(0 != big_file_mpi_open_block(bf, &bb, blockname, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, GadgetComm)) {
         if(required)
             endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
         else
@@ -603,73 +1453,949 @@ int petaio_read_block(BigFile * bf, const char * blockname, BigArray * array, in
     if(0 != big_block_seek(&bb, &ptr, 0)) {
             endrun(1, "Failed to seek block %s: %s\n", blockname, big_file_get_error_message());
     }
-    if(0 != big_block_mpi_read(&bb, &ptr, array, IO.NumWriters, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_read(&bb, &ptr, array, IO.NumWriters, GadgetComm)) {
         endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
     }
-    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+    petaio_verify_read(&bb, blockname, array);
+    if(0 != big_block_mpi_close(&bb, GadgetComm)) {
         endrun(0, "Failed to close block at %s:%s\n", blockname,
                     big_file_get_error_message());
     }
     return 0;
 }
 
-/* save a block to disk */
-void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, int verbose)
+/* Decide how many files a block of size items is split into and how many ranks write it concurrently*/
+static void
+petaio_block_layout(const size_t size, const int elsize, int * NumFiles, int * NumWriters)
 {
-
-    BigBlock bb;
-    BigBlockPtr ptr;
-
-    int elsize = big_file_dtype_itemsize(array->dtype);
-
-    int NumWriters = IO.NumWriters;
-
-    size_t size = count_sum(array->dims[0]);
-    int NumFiles;
+    *NumWriters = IO.AdaptiveNumWriters ? WriterTune.NumWriters : IO.NumWriters;
 
     if(IO.EnableAggregatedIO) {
-        NumFiles = (size * elsize + IO.BytesPerFile - 1) / IO.BytesPerFile;
-        if(NumWriters > NumFiles * IO.WritersPerFile) {
-            NumWriters = NumFiles * IO.WritersPerFile;
+        *NumFiles = (size * elsize + IO.BytesPerFile - 1) / IO.BytesPerFile;
+        if(*NumWriters > *NumFiles * IO.WritersPerFile) {
+            *NumWriters = *NumFiles * IO.WritersPerFile;
         }
-        if(NumWriters < IO.MinNumWriters) {
-            message(0, "Throttling to %d NumWriters but could throttle to %d.\n", IO.MinNumWriters, NumWriters);
-            NumWriters = IO.MinNumWriters;
-            NumFiles = (NumWriters + IO.WritersPerFile - 1) / IO.WritersPerFile ;
+        if(*NumWriters < IO.MinNumWriters) {
+            message(0, "Throttling to %d NumWriters but could throttle to %d.\n", IO.MinNumWriters, *NumWriters);
+            *NumWriters = IO.MinNumWriters;
+            *NumFiles = (*NumWriters + IO.WritersPerFile - 1) / IO.WritersPerFile ;
         }
     } else {
-        NumFiles = NumWriters;
+        *NumFiles = *NumWriters;
     }
     /*Do not write empty files*/
     if(size == 0) {
-        NumFiles = 0;
+        *NumFiles = 0;
     }
+}
+
+/* Use the time taken to write a block to choose the number of writers for the next blocks.
+ * This is a hill climb: NumWriters keeps changing in the same direction while the throughput improves,
+ * and turns back when it drops or reaches MinNumWriters or NumWriters.*/
+static void
+petaio_tune_writers(const char * blockname, const size_t bytes, const double elapsed)
+{
+    if(!IO.AdaptiveNumWriters || bytes < TUNE_MIN_BYTES)
+        return;
+    /* The decision must be the same on every rank*/
+    double tmax = elapsed;
+    MPI_Allreduce(MPI_IN_PLACE, &tmax, 1, MPI_DOUBLE, MPI_MAX, GadgetComm);
+    if(tmax <= 0)
+        return;
+
+    const double rate = bytes / tmax;
+    if(WriterTune.Rate > 0 && rate < WriterTune.Rate)
+        WriterTune.Step = -WriterTune.Step;
+    WriterTune.Rate = rate;
+
+    int minwriters = IO.MinNumWriters > 1 ? IO.MinNumWriters : 1;
+    if(minwriters > IO.NumWriters)
+        minwriters = IO.NumWriters;
+    const int old = WriterTune.NumWriters;
+    int change = old / 4 > 1 ? old / 4 : 1;
+    int nwriters = old + WriterTune.Step * change;
+    if(nwriters >= IO.NumWriters) {
+        nwriters = IO.NumWriters;
+        WriterTune.Step = -1;
+    }
+    if(nwriters <= minwriters) {
+        nwriters = minwriters;
+        WriterTune.Step = 1;
+    }
+    WriterTune.NumWriters = nwriters;
+    message(0, "Wrote %s at %g MB/s with %d writers. Next blocks use %d writers.\n",
+            blockname, rate / (1024. * 1024.), old, nwriters);
+}
+
+/* save a block to disk */
+void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, int verbose)
+{
+
+    BigBlock bb;
+    BigBlockPtr ptr;
+
+    int elsize = big_file_dtype_itemsize(array->dtype);
+
+    size_t size = count_sum(array->dims[0]);
+    int NumFiles, NumWriters;
+
+    petaio_block_layout(size, elsize, &NumFiles, &NumWriters);
 
     if(verbose && size > 0) {
         message(0, "Will write %td particles to %d Files with %d writers for %s. \n", size, NumFiles, NumWriters, blockname);
     }
     /* create the block */
     /* dims[1] is the number of members per item */
-    if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], NumFiles, size, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], NumFiles, size, GadgetComm)) {
         endrun(0, "Failed to create block at %s:%s\n", blockname,
                     big_file_get_error_message());
     }
     if(0 != big_block_seek(&bb, &ptr, 0)) {
         endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
     }
-    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, MPI_COMM_WORLD)) {
+    double tstart = MPI_Wtime();
+    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, GadgetComm)) {
+        endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+    petaio_tune_writers(blockname, size * elsize * array->dims[1], MPI_Wtime() - tstart);
+
+    if(verbose && size > 0)
+        message(0, "Done writing %td particles to %d Files\n", size, NumFiles);
+
+    if(0 != big_block_mpi_close(&bb, GadgetComm)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+}
+
+/* Append the rows of array from every rank, in rank order, to the end of a block, creating it if needed.
+ * The new rows go in new files of the block, laid out as for petaio_save_block.*/
+void petaio_append_block(BigFile * bf, const char * blockname, BigArray * array)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+
+    int elsize = big_file_dtype_itemsize(array->dtype);
+    size_t size = count_sum(array->dims[0]);
+    if(size == 0)
+        return;
+    int NumFiles, NumWriters;
+    petaio_block_layout(size, elsize, &NumFiles, &NumWriters);
+
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, GadgetComm)) {
+        if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], 0, 0, GadgetComm))
+            endrun(0, "Failed to create block at %s:%s\n", blockname, big_file_get_error_message());
+    }
+    const size_t oldsize = bb.size;
+    if(0 != big_block_mpi_grow_simple(&bb, NumFiles, size, GadgetComm))
+        endrun(0, "Failed to grow block %s by %td: %s\n", blockname, size, big_file_get_error_message());
+    if(0 != big_block_seek(&bb, &ptr, oldsize))
+        endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, GadgetComm))
         endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    if(0 != big_block_mpi_close(&bb, GadgetComm))
+        endrun(0, "Failed to close block at %s:%s\n", blockname, big_file_get_error_message());
+}
+
+/* Record on the block how many mantissa bits were kept, so readers know the precision.*/
+static void
+petaio_set_keepbits_attr(BigBlock * bb, IOTableEntry * ent, const char * blockname)
+{
+    if(ent->keepbits <= 0)
+        return;
+    if(0 != big_block_set_attr(bb, "MantissaBits", &ent->keepbits, "i4", 1))
+        endrun(0, "Failed to set MantissaBits on %s: %s\n", blockname, big_file_get_error_message());
+}
+
+/* Write the local rows of a block from each rank at its own offset, NumWriters ranks at a time.
+ * Rows that cannot be written straight from the particle table are converted
+ * in chunks of at most WriteChunkBytes, so the column is never built in full.*/
+static int
+petaio_stream_block(BigBlock * bb, BigArray * direct, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv, const int NumWriters)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+
+    int64_t nlocal = NumSelection;
+    int64_t offset = 0;
+    MPI_Exscan(&nlocal, &offset, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    /* Exscan leaves the first rank undefined*/
+    if(ThisTask == 0)
+        offset = 0;
+
+    const size_t elsize = dtype_itemsize(ent->dtype) * ent->items;
+    int64_t chunksize = IO.WriteChunkBytes / elsize;
+    if(chunksize < 1)
+        chunksize = 1;
+    if(chunksize > NumSelection)
+        chunksize = NumSelection;
+
+    BigArray chunk = {0};
+    if(!direct && NumSelection > 0)
+        petaio_alloc_buffer(&chunk, ent, chunksize);
+
+    int nwriters = NumWriters > 0 ? NumWriters : NTask;
+    const int nrounds = (NTask + nwriters - 1) / nwriters;
+    int rt = 0;
+    int round;
+    for(round = 0; round < nrounds; round++) {
+        if(ThisTask % nrounds == round && NumSelection > 0) {
+            BigBlockPtr ptr;
+            rt = big_block_seek(bb, &ptr, offset);
+            if(direct && rt == 0)
+                rt = big_block_write(bb, &ptr, direct);
+            int64_t start;
+            for(start = 0; !direct && rt == 0 && start < NumSelection; start += chunksize) {
+                int64_t n = NumSelection - start;
+                if(n > chunksize)
+                    n = chunksize;
+                petaio_fill_buffer((char *) chunk.data, chunk.strides[0], ent, selection + start, n, Parts, SlotsManager, conv);
+                BigArray part = {0};
+                size_t dims[2] = {n, ent->items};
+                big_array_init(&part, chunk.data, ent->dtype, 2, dims, chunk.strides);
+                rt = big_block_write(bb, &ptr, &part);
+            }
+        }
+        MPI_Barrier(GadgetComm);
+    }
+    if(!direct && NumSelection > 0)
+        petaio_destroy_buffer(&chunk);
+    MPI_Allreduce(MPI_IN_PLACE, &rt, 1, MPI_INT, MPI_MIN, GadgetComm);
+    return rt;
+}
+
+/* Write a block through the IO aggregators: every rank converts its rows in chunks of WriteChunkBytes
+ * and sends them to the aggregator of its group, which writes them at the offset of the sender.
+ * Only the aggregators touch the files, so there are fewer and larger writes to each file.*/
+static int
+petaio_aggregate_block(BigBlock * bb, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+{
+    int AggRank, AggSize;
+    MPI_Comm_rank(AggComm, &AggRank);
+    MPI_Comm_size(AggComm, &AggSize);
+
+    int64_t nlocal = NumSelection;
+    int64_t offset = 0;
+    MPI_Exscan(&nlocal, &offset, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    /* Exscan leaves the first rank undefined*/
+    if(ThisTask == 0)
+        offset = 0;
+
+    const size_t elsize = dtype_itemsize(ent->dtype) * ent->items;
+    int64_t chunksize = IO.WriteChunkBytes / elsize;
+    if(IO.WriteChunkBytes == 0 || chunksize > INT_MAX / (int64_t) elsize)
+        chunksize = INT_MAX / elsize;
+    if(chunksize < 1)
+        chunksize = 1;
+
+    /* Sizes and offsets of all ranks in the group, known to the aggregator*/
+    int64_t * counts = NULL, * offsets = NULL;
+    if(AggRank == 0) {
+        counts = ta_malloc("AggCounts", int64_t, AggSize);
+        offsets = ta_malloc("AggOffsets", int64_t, AggSize);
     }
+    MPI_Gather(&nlocal, 1, MPI_INT64, counts, 1, MPI_INT64, 0, AggComm);
+    MPI_Gather(&offset, 1, MPI_INT64, offsets, 1, MPI_INT64, 0, AggComm);
+
+    int64_t maxcount = nlocal;
+    MPI_Allreduce(MPI_IN_PLACE, &maxcount, 1, MPI_INT64, MPI_MAX, AggComm);
+    if(chunksize > maxcount)
+        chunksize = maxcount;
+
+    BigArray chunk = {0};
+    if(chunksize > 0)
+        petaio_alloc_buffer(&chunk, ent, chunksize);
+
+    int rt = 0;
+    if(AggRank == 0) {
+        int m;
+        for(m = 0; m < AggSize; m++) {
+            BigBlockPtr ptr;
+            if(rt == 0 && counts[m] > 0)
+                rt = big_block_seek(bb, &ptr, offsets[m]);
+            int64_t start;
+            for(start = 0; start < counts[m]; start += chunksize) {
+                int64_t n = counts[m] - start;
+                if(n > chunksize)
+                    n = chunksize;
+                /* Keep receiving after an error so the senders are not left hanging*/
+                if(m == 0)
+                    petaio_fill_buffer((char *) chunk.data, chunk.strides[0], ent, selection + start, n, Parts, SlotsManager, conv);
+                else
+                    MPI_Recv(chunk.data, n * elsize, MPI_BYTE, m, 0, AggComm, MPI_STATUS_IGNORE);
+                if(rt != 0)
+                    continue;
+                BigArray part = {0};
+                size_t dims[2] = {n, ent->items};
+                big_array_init(&part, chunk.data, ent->dtype, 2, dims, chunk.strides);
+                rt = big_block_write(bb, &ptr, &part);
+            }
+        }
+        myfree(offsets);
+        myfree(counts);
+    }
+    else {
+        int64_t start;
+        for(start = 0; start < NumSelection; start += chunksize) {
+            int64_t n = NumSelection - start;
+            if(n > chunksize)
+                n = chunksize;
+            petaio_fill_buffer((char *) chunk.data, chunk.strides[0], ent, selection + start, n, Parts, SlotsManager, conv);
+            MPI_Send(chunk.data, n * elsize, MPI_BYTE, 0, 0, AggComm);
+        }
+    }
+    if(chunksize > 0)
+        petaio_destroy_buffer(&chunk);
+    MPI_Allreduce(MPI_IN_PLACE, &rt, 1, MPI_INT, MPI_MIN, GadgetComm);
+    return rt;
+}
+
+/* Save the selected particles to a block. Plain particle_data fields of a contiguous selection
+ * are written straight from Parts. If the column on any rank exceeds WriteChunkBytes
+ * it is streamed in chunks; otherwise the usual throttled collective write is used. */
+void
+petaio_save_selection(BigFile * bf, const char * blockname, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv, int verbose)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+
+    if(selection == NULL) {
+        endrun(-1, "NULL selection is not supported\n");
+    }
+
+    size_t size = count_sum(NumSelection);
+    int NumFiles, NumWriters;
+    petaio_block_layout(size, dtype_itemsize(ent->dtype), &NumFiles, &NumWriters);
+
+    int64_t maxbytes = (int64_t) NumSelection * dtype_itemsize(ent->dtype) * ent->items;
+    MPI_Allreduce(MPI_IN_PLACE, &maxbytes, 1, MPI_INT64, MPI_MAX, GadgetComm);
+    const int stream = IO.WriteChunkBytes > 0 && maxbytes > (int64_t) IO.WriteChunkBytes;
+
+    if(verbose && size > 0) {
+        message(0, "Will write %td particles to %d Files with %d writers for %s%s. \n", size, NumFiles, NumWriters, blockname, stream ? " (streaming)": "");
+    }
+    if(0 != big_file_mpi_create_block(bf, &bb, blockname, ent->dtype, ent->items, NumFiles, size, GadgetComm)) {
+        endrun(0, "Failed to create block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+
+    petaio_set_keepbits_attr(&bb, ent, blockname);
+
+    BigArray array = {0};
+    const int direct = petaio_direct_array(&array, ent, selection, NumSelection, Parts);
+
+    double tstart = MPI_Wtime();
+    if(AggComm != MPI_COMM_NULL) {
+        if(0 != petaio_aggregate_block(&bb, ent, selection, NumSelection, Parts, SlotsManager, conv)) {
+            endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+        }
+    }
+    else if(stream) {
+        if(0 != petaio_stream_block(&bb, direct ? &array : NULL, ent, selection, NumSelection, Parts, SlotsManager, conv, NumWriters)) {
+            endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+        }
+    }
+    else {
+        if(!direct)
+            petaio_build_buffer(&array, ent, selection, NumSelection, Parts, SlotsManager, conv);
+        if(0 != big_block_seek(&bb, &ptr, 0)) {
+            endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+        }
+        if(0 != big_block_mpi_write(&bb, &ptr, &array, NumWriters, GadgetComm)) {
+            endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+        }
+        if(!direct)
+            petaio_destroy_buffer(&array);
+    }
+    /* The aggregators do not use the number of writers*/
+    if(AggComm == MPI_COMM_NULL)
+        petaio_tune_writers(blockname, size * dtype_itemsize(ent->dtype) * ent->items, MPI_Wtime() - tstart);
 
     if(verbose && size > 0)
         message(0, "Done writing %td particles to %d Files\n", size, NumFiles);
 
-    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bb, GadgetComm)) {
         endrun(0, "Failed to close block at %s:%s\n", blockname,
                 big_file_get_error_message());
     }
 }
 
+/* Fold bytes into a two lane 64-bit hash of a column.*/
+static void
+petaio_hash_bytes(uint64_t * hash, const char * data, const size_t bytes)
+{
+    size_t i;
+    for(i = 0; i < bytes; i += sizeof(uint64_t)) {
+        uint64_t w = 0;
+        memcpy(&w, data + i, bytes - i < sizeof(uint64_t) ? bytes - i : sizeof(uint64_t));
+        hash[0] = (hash[0] ^ w) * 0x100000001b3ULL;
+        hash[1] = (hash[1] ^ (w >> 32 | w << 32)) * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL;
+    }
+}
+
+/* Hash the column of ent as it would be written: the converted values in rank order.
+ * The same on all ranks. The values are made in chunks, so this needs little memory.*/
+static void
+petaio_hash_column(uint64_t * hash, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+{
+    int NTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+
+    const size_t elsize = dtype_itemsize(ent->dtype) * ent->items;
+    int64_t chunksize = (IO.WriteChunkBytes > 0 ? IO.WriteChunkBytes : 64L * 1024 * 1024) / elsize;
+    if(chunksize < 1)
+        chunksize = 1;
+    if(chunksize > NumSelection)
+        chunksize = NumSelection;
+
+    /* Local hash, then the count*/
+    uint64_t local[3] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL, (uint64_t) NumSelection};
+    if(NumSelection > 0) {
+        BigArray chunk = {0};
+        petaio_alloc_buffer(&chunk, ent, chunksize);
+        int64_t start;
+        for(start = 0; start < NumSelection; start += chunksize) {
+            int64_t n = NumSelection - start;
+            if(n > chunksize)
+                n = chunksize;
+            petaio_fill_buffer((char *) chunk.data, chunk.strides[0], ent, selection + start, n, Parts, SlotsManager, conv);
+            petaio_hash_bytes(local, (char *) chunk.data, n * elsize);
+        }
+        petaio_destroy_buffer(&chunk);
+    }
+    uint64_t * all = (uint64_t *) ta_malloc("ColumnHashes", uint64_t, 3 * NTask);
+    MPI_Allgather(local, 3, MPI_UINT64_T, all, 3, MPI_UINT64_T, GadgetComm);
+    /* Combine in rank order. Mantissa trimming changes the meaning of the values, so include it.*/
+    hash[0] = 0xcbf29ce484222325ULL ^ (uint64_t) ent->keepbits;
+    hash[1] = 0x84222325cbf29ce4ULL;
+    petaio_hash_bytes(hash, (char *) all, 3 * NTask * sizeof(uint64_t));
+    ta_free(all);
+}
+
+/* Remove the files of a block directory. Files may be hard links shared with another snapshot,
+ * which would be overwritten by writing into them. Returns the number of files which could not be removed.*/
+static int
+petaio_unlink_block_files(const char * dirname)
+{
+    DIR * dir = opendir(dirname);
+    if(!dir)
+        return 0;
+    int bad = 0;
+    struct dirent * ent;
+    while((ent = readdir(dir))) {
+        if(ent->d_name[0] == '.')
+            continue;
+        char * path = fastpm_strdup_printf("%s/%s", dirname, ent->d_name);
+        if(0 != unlink(path))
+            bad++;
+        myfree(path);
+    }
+    closedir(dir);
+    return bad;
+}
+
+/* Hard link the files of the block olddir into newdir. Returns 0 on success.
+ * On failure the links made are removed again.*/
+static int
+petaio_link_block_files(const char * olddir, const char * newdir)
+{
+    DIR * dir = opendir(olddir);
+    if(!dir)
+        return 1;
+    char * header = fastpm_strdup_printf("%s/header", newdir);
+    fastpm_path_ensure_dirname(header);
+    myfree(header);
+    int bad = 0;
+    struct dirent * ent;
+    while(!bad && (ent = readdir(dir))) {
+        if(ent->d_name[0] == '.')
+            continue;
+        char * oldpath = fastpm_strdup_printf("%s/%s", olddir, ent->d_name);
+        char * newpath = fastpm_strdup_printf("%s/%s", newdir, ent->d_name);
+        if(0 != link(oldpath, newpath)) {
+            message(1, "Could not link %s to %s: %s\n", newpath, oldpath, strerror(errno));
+            bad = 1;
+        }
+        myfree(newpath);
+        myfree(oldpath);
+    }
+    closedir(dir);
+    if(bad)
+        petaio_unlink_block_files(newdir);
+    return bad;
+}
+
+/* For differential checkpoints: hash the column of ent, and if the block in PrevSnapshot
+ * has the same hash, type and size, hard link its files into the snapshot fname instead of writing it.
+ * Returns 1 if the block was linked. Otherwise returns 0 and the block should be written,
+ * and the hash stored with petaio_set_hash_attr. Restarting needs nothing special, as the links are ordinary files.*/
+static int
+petaio_save_linked(const char * fname, const char * blockname, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv, uint64_t * hash)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+
+    petaio_hash_column(hash, ent, selection, NumSelection, Parts, SlotsManager, conv);
+    const int64_t size = count_sum(NumSelection);
+
+    int linked = 0;
+    if(ThisTask == 0) {
+        char * newdir = fastpm_strdup_printf("%s/%s", fname, blockname);
+        /* Break any links from an older checkpoint with this name before writing over it*/
+        if(petaio_unlink_block_files(newdir))
+            endrun(1, "Could not remove old files of %s\n", newdir);
+        BigFile bf = {0};
+        if(PrevSnapshot[0] && strcmp(PrevSnapshot, fname) != 0 && 0 == big_file_open(&bf, PrevSnapshot)) {
+            BigBlock bb;
+            if(0 == big_file_open_block(&bf, &bb, blockname)) {
+                uint64_t oldhash[2] = {0};
+                if(bb.size == (size_t) size && bb.nmemb == ent->items
+                    && big_file_dtype_kind(bb.dtype) == big_file_dtype_kind(ent->dtype) && dtype_itemsize(bb.dtype) == dtype_itemsize(ent->dtype)
+                    && 0 == big_block_get_attr(&bb, "ColumnHash", oldhash, "u8", 2)
+                    && oldhash[0] == hash[0] && oldhash[1] == hash[1]) {
+                    char * olddir = fastpm_strdup_printf("%s/%s", PrevSnapshot, blockname);
+                    linked = (0 == petaio_link_block_files(olddir, newdir));
+                    myfree(olddir);
+                }
+                big_block_close(&bb);
+            }
+            big_file_close(&bf);
+        }
+        myfree(newdir);
+    }
+    MPI_Bcast(&linked, 1, MPI_INT, 0, GadgetComm);
+    return linked;
+}
+
+/* Store the column hash of a written block, so the next differential checkpoint can compare with it.*/
+static void
+petaio_set_hash_attr(BigFile * bf, const char * blockname, const uint64_t * hash)
+{
+    BigBlock bb;
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, GadgetComm)) {
+        endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
+    }
+    if(0 != big_block_set_attr(&bb, "ColumnHash", hash, "u8", 2)) {
+        endrun(0, "Failed to write ColumnHash to %s:%s\n", blockname, big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bb, GadgetComm)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname, big_file_get_error_message());
+    }
+}
+
+/* A block staged in memory, waiting to be written by the background thread*/
+struct petaio_staged_block {
+    BigBlock bb;
+    BigArray array;
+    /* Row of the block where this rank's data starts*/
+    int64_t offset;
+};
+
+/* State of the snapshot being written in the background. There is at most one.*/
+static struct petaio_async_write {
+    int active;
+    BigFile bf;
+    char fname[1024];
+    struct petaio_staged_block * blocks;
+    int nblocks;
+    pthread_t thread;
+    /* Set by the thread: error status and time taken to write*/
+    int rt;
+    double writetime;
+    /* Duration of the last completed background write*/
+    double lastwritetime;
+} AsyncWrite;
+
+static double
+petaio_monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Body of the background thread. Each rank writes its own rows at a fixed offset,
+ * so no MPI calls are made here and MPI thread support is not needed.*/
+static void *
+petaio_async_writer(void * arg)
+{
+    struct petaio_async_write * aw = (struct petaio_async_write *) arg;
+    double start = petaio_monotonic_time();
+    int i;
+    for(i = 0; i < aw->nblocks && aw->rt == 0; i++) {
+        struct petaio_staged_block * sb = &aw->blocks[i];
+        if(sb->array.dims[0] == 0)
+            continue;
+        BigBlockPtr ptr;
+        aw->rt = big_block_seek(&sb->bb, &ptr, sb->offset);
+        if(aw->rt == 0)
+            aw->rt = big_block_write(&sb->bb, &ptr, &sb->array);
+        free(sb->array.data);
+        sb->array.data = NULL;
+    }
+    aw->writetime = petaio_monotonic_time() - start;
+    return NULL;
+}
+
+/* Copy the particle blocks of a snapshot into a staging area and write them to disk in a background thread.
+ * Block creation and the header are done collectively here; the particle table may change as soon as this returns.
+ * The staging area is allocated outside the mymalloc arena, as it lives across timesteps:
+ * it is about as large as the snapshot on this rank.
+ * Call petaio_wait_snapshot to finish the write. */
+void
+petaio_save_snapshot_async(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP)
+{
+    /* Only one snapshot in flight at a time*/
+    petaio_wait_snapshot();
+
+    message(0, "staging snapshot for background write into %s\n", fname);
+
+    struct petaio_async_write * aw = &AsyncWrite;
+    memset(&aw->bf, 0, sizeof(aw->bf));
+    if(0 != big_file_mpi_create(&aw->bf, fname, GadgetComm)) {
+        endrun(0, "Failed to create snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+    strncpy(aw->fname, fname, sizeof(aw->fname) - 1);
+    aw->fname[sizeof(aw->fname) - 1] = '\0';
+
+    int64_t ptype_offset[6]={0};
+    int64_t ptype_count[6]={0};
+    int64_t NTotal[6]={0};
+    int64_t Offset[6]={0};
+
+    int * selection = (int *) mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, NULL);
+
+    MPI_Allreduce(ptype_count, NTotal, 6, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Exscan(ptype_count, Offset, 6, MPI_INT64, MPI_SUM, GadgetComm);
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    /* Exscan leaves the first rank undefined*/
+    if(ThisTask == 0)
+        memset(Offset, 0, sizeof(Offset));
+
+    struct conversions conv = {0};
+    conv.atime = atime;
+    conv.hubble = hubble_function(CP, atime);
+
+    petaio_write_header(&aw->bf, atime, NTotal, CP, &Header);
+    petaio_write_rank_index(&aw->bf, selection, ptype_offset, ptype_count);
+
+    aw->blocks = (struct petaio_staged_block *) malloc(sizeof(struct petaio_staged_block) * IOTable->used);
+    if(!aw->blocks)
+        endrun(1, "Failed to allocate %d staged blocks\n", IOTable->used);
+    aw->nblocks = 0;
+    size_t staged = 0;
+
+    int i;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        int ptype = ent->ptype;
+        if(!(ptype < 6 && ptype >= 0)) {
+            continue;
+        }
+        if(NTotal[ptype] == 0 && ptype < 4)
+            continue;
+        char blockname[128];
+        sprintf(blockname, "%d/%s", ptype, ent->name);
+
+        struct petaio_staged_block * sb = &aw->blocks[aw->nblocks++];
+        int NumFiles, NumWriters;
+        petaio_block_layout(NTotal[ptype], dtype_itemsize(ent->dtype), &NumFiles, &NumWriters);
+        if(0 != big_file_mpi_create_block(&aw->bf, &sb->bb, blockname, ent->dtype, ent->items, NumFiles, NTotal[ptype], GadgetComm)) {
+            endrun(0, "Failed to create block at %s:%s\n", blockname,
+                        big_file_get_error_message());
+        }
+        petaio_set_keepbits_attr(&sb->bb, ent, blockname);
+        sb->offset = Offset[ptype];
+
+        size_t dims[2] = {ptype_count[ptype], ent->items};
+        ptrdiff_t strides[2];
+        strides[1] = dtype_itemsize(ent->dtype);
+        strides[0] = strides[1] * ent->items;
+        char * data = (char *) malloc(dims[0] * strides[0] + 1);
+        if(!data)
+            endrun(1, "Failed to allocate %lu bytes to stage block %s\n", dims[0] * strides[0], blockname);
+        petaio_fill_buffer(data, strides[0], ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv);
+        big_array_init(&sb->array, data, ent->dtype, 2, dims, strides);
+        staged += dims[0] * strides[0];
+    }
+    myfree(selection);
+
+    if(CP->MassiveNuLinRespOn) {
+        petaio_save_neutrinos(&aw->bf, ThisTask);
+    }
+
+    int64_t totstaged = staged;
+    MPI_Allreduce(MPI_IN_PLACE, &totstaged, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    if(verbose)
+        message(0, "Staged %g MB in %d blocks, writing in the background.\n", totstaged / (1024. * 1024.), aw->nblocks);
+
+    aw->rt = 0;
+    aw->writetime = 0;
+    if(0 != pthread_create(&aw->thread, NULL, petaio_async_writer, aw))
+        endrun(1, "Failed to start the snapshot writer thread\n");
+    aw->active = 1;
+}
+
+/* Wait for the snapshot written in the background, if any, and close it collectively.
+ * Returns 1 if a snapshot was finished, 0 if none was in flight. */
+int
+petaio_wait_snapshot(void)
+{
+    struct petaio_async_write * aw = &AsyncWrite;
+    if(!aw->active)
+        return 0;
+
+    double start = MPI_Wtime();
+    pthread_join(aw->thread, NULL);
+    aw->active = 0;
+
+    int rt = aw->rt;
+    MPI_Allreduce(MPI_IN_PLACE, &rt, 1, MPI_INT, MPI_MIN, GadgetComm);
+    if(rt != 0)
+        endrun(0, "Failed to write snapshot %s in the background: %s\n", aw->fname, big_file_get_error_message());
+
+    MPI_Allreduce(&aw->writetime, &aw->lastwritetime, 1, MPI_DOUBLE, MPI_MAX, GadgetComm);
+
+    int i;
+    for(i = 0; i < aw->nblocks; i++) {
+        free(aw->blocks[i].array.data);
+        if(0 != big_block_mpi_close(&aw->blocks[i].bb, GadgetComm)) {
+            endrun(0, "Failed to close block in %s:%s\n", aw->fname,
+                    big_file_get_error_message());
+        }
+    }
+    free(aw->blocks);
+    aw->blocks = NULL;
+    aw->nblocks = 0;
+
+    if(0 != big_file_mpi_close(&aw->bf, GadgetComm)){
+        endrun(0, "Failed to close snapshot at %s:%s\n", aw->fname,
+                    big_file_get_error_message());
+    }
+    message(0, "Finished background write of %s in %g s (waited %g s)\n", aw->fname, aw->lastwritetime, MPI_Wtime() - start);
+    return 1;
+}
+
+/* Expected time left for the snapshot in flight: the duration of the last background write, or 0 if there is none in flight.*/
+double
+petaio_async_pending_time(void)
+{
+    if(!AsyncWrite.active)
+        return 0;
+    return AsyncWrite.lastwritetime;
+}
+
+/* Local checkpoints: each rank dumps its particles and slots to a file in LocalCheckpointDir,
+ * which is fast on node-local disks. The snapshot is then written from memory in the background.
+ * On restart each rank reads its own file back if all ranks have one, rather than reading the snapshot.*/
+#define PETAIO_LOCAL_MAGIC 0x4c4f43414c434b31ULL
+
+struct petaio_local_head {
+    uint64_t magic;
+    int32_t NTask;
+    int32_t ThisTask;
+    int32_t num;
+    int32_t partsize;
+    int32_t elsize[6];
+    int64_t NLocal[6];
+};
+
+static void
+petaio_local_fname(char * fname, size_t len, int num, int ThisTask)
+{
+    snprintf(fname, len, "%s/%s_%03d.%06d", IO.LocalCheckpointDir, IO.SnapshotFileBase, num, ThisTask);
+}
+
+/* Write this rank's particles to its local checkpoint file, ordered by type and without garbage,
+ * in the layout set up by slots_setup_topology. The particle offset is removed from the positions. Collective.*/
+void
+petaio_save_local(int num)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+
+    struct petaio_local_head head = {0};
+    head.magic = PETAIO_LOCAL_MAGIC;
+    head.NTask = NTask;
+    head.ThisTask = ThisTask;
+    head.num = num;
+    head.partsize = sizeof(struct particle_data);
+    int64_t i;
+    int t;
+    for(t = 0; t < 6; t++)
+        head.elsize[t] = SlotsManager->info[t].enabled ? SlotsManager->info[t].elsize : 0;
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(!P[i].IsGarbage)
+            head.NLocal[P[i].Type]++;
+
+    char fname[1024];
+    petaio_local_fname(fname, sizeof(fname), num, ThisTask);
+    int bad = 0;
+    FILE * fp = fopen(fname, "w");
+    if(!fp || 1 != fwrite(&head, sizeof(head), 1, fp))
+        bad = 1;
+
+    const int64_t chunk = 4096;
+    char * buf = (char *) mymalloc("LocalBuffer", chunk * sizeof(struct particle_data));
+    /* Particles first, then the slots of each type in the same order*/
+    for(t = -1; t < 6 && !bad; t++) {
+        const int slots = t >= 0;
+        if(slots && head.elsize[t] == 0)
+            continue;
+        const size_t elsize = slots ? head.elsize[t] : sizeof(struct particle_data);
+        if(elsize > sizeof(struct particle_data))
+            endrun(1, "Slot size %lu is larger than the particle size\n", elsize);
+        int ptype;
+        for(ptype = 0; ptype < 6 && !bad; ptype++) {
+            if(slots && ptype != t)
+                continue;
+            int64_t n = 0, newpi = 0;
+            for(i = 0; i < PartManager->NumPart && !bad; i++) {
+                if(P[i].IsGarbage || P[i].Type != ptype)
+                    continue;
+                if(slots)
+                    memcpy(buf + n * elsize, BASESLOT_PI(P[i].PI, ptype, SlotsManager), elsize);
+                else {
+                    struct particle_data * out = (struct particle_data *) buf + n;
+                    *out = P[i];
+                    if(head.elsize[ptype])
+                        out->PI = newpi++;
+                    GTPosition(i, out->Pos, P, SlotsManager, NULL);
+                }
+                if(++n == chunk) {
+                    bad = (1 != fwrite(buf, elsize * n, 1, fp));
+                    n = 0;
+                }
+            }
+            if(n > 0 && !bad)
+                bad = (1 != fwrite(buf, elsize * n, 1, fp));
+        }
+    }
+    myfree(buf);
+    if(fp) {
+        if(!bad)
+            bad = (0 != fflush(fp)) || (0 != fsync(fileno(fp)));
+        bad |= (0 != fclose(fp));
+    }
+    if(bad)
+        message(1, "Failed to write local checkpoint %s: %s\n", fname, strerror(errno));
+    MPI_Allreduce(MPI_IN_PLACE, &bad, 1, MPI_INT, MPI_MAX, GadgetComm);
+    if(bad)
+        endrun(1, "Failed to write local checkpoint %d\n", num);
+
+    /* Only the newest local copy is kept*/
+    if(LocalSnapshot >= 0 && LocalSnapshot != num) {
+        petaio_local_fname(fname, sizeof(fname), LocalSnapshot, ThisTask);
+        unlink(fname);
+    }
+    LocalSnapshot = num;
+    message(0, "Wrote local checkpoint %d to %s\n", num, IO.LocalCheckpointDir);
+}
+
+/* Check this rank's local copy of checkpoint num exists and matches this run. Not collective.*/
+static int
+petaio_check_local(int num, struct petaio_local_head * head)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+
+    char fname[1024];
+    petaio_local_fname(fname, sizeof(fname), num, ThisTask);
+    int ok = 0;
+    FILE * fp = fopen(fname, "r");
+    if(fp) {
+        ok = (1 == fread(head, sizeof(*head), 1, fp));
+        fclose(fp);
+    }
+    ok = ok && head->magic == PETAIO_LOCAL_MAGIC && head->NTask == NTask && head->ThisTask == ThisTask
+        && head->num == num && head->partsize == (int32_t) sizeof(struct particle_data);
+    int t;
+    for(t = 0; t < 6 && ok; t++)
+        if(head->elsize[t] && SlotsManager->info[t].elsize && head->elsize[t] != SlotsManager->info[t].elsize)
+            ok = 0;
+    return ok;
+}
+
+int
+petaio_local_available(int num)
+{
+    if(!GetLocalCheckpoint() || num < 0)
+        return 0;
+    struct petaio_local_head head = {0};
+    int ok = petaio_check_local(num, &head);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, GadgetComm);
+    return ok;
+}
+
+int
+petaio_local_snapshot(void)
+{
+    return LocalSnapshot;
+}
+
+/* Check for a local copy of checkpoint num on every rank, matching this run.
+ * If there is one, set NLocal from it and return 1. Collective.*/
+static int
+petaio_read_local_counts(int num, const int64_t * NTotalSnap, int64_t * NLocal)
+{
+    if(!petaio_local_available(num))
+        return 0;
+    struct petaio_local_head head = {0};
+    petaio_check_local(num, &head);
+    int t;
+    int64_t NTotal[6] = {0};
+    /* The counts must match the snapshot*/
+    MPI_Allreduce(head.NLocal, NTotal, 6, MPI_INT64, MPI_SUM, GadgetComm);
+    for(t = 0; t < 6; t++)
+        if(NTotal[t] != NTotalSnap[t]) {
+            message(0, "Local checkpoint %d has %ld particles of type %d, but the snapshot has %ld. Not using it.\n", num, NTotal[t], t, NTotalSnap[t]);
+            return 0;
+        }
+    memcpy(NLocal, head.NLocal, sizeof(head.NLocal));
+    LocalSnapshot = num;
+    message(0, "Restarting from the local copy of checkpoint %d in %s\n", num, IO.LocalCheckpointDir);
+    return 1;
+}
+
+/* Read the particles and slots of the local checkpoint into memory set up by slots_setup_topology.*/
+static void
+petaio_read_local(int num, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    char fname[1024];
+    petaio_local_fname(fname, sizeof(fname), num, ThisTask);
+    struct petaio_local_head head = {0};
+    int bad = 0;
+    FILE * fp = fopen(fname, "r");
+    if(!fp || 1 != fread(&head, sizeof(head), 1, fp))
+        bad = 1;
+    if(!bad && PartManager->NumPart > 0)
+        bad = (1 != fread(PartManager->Base, sizeof(struct particle_data) * PartManager->NumPart, 1, fp));
+    int t;
+    for(t = 0; t < 6 && !bad; t++) {
+        if(head.elsize[t] == 0 || head.NLocal[t] == 0)
+            continue;
+        if(!SlotsManager->info[t].enabled)
+            endrun(1, "Local checkpoint has slots of type %d, which are not enabled\n", t);
+        bad = (1 != fread(SlotsManager->info[t].ptr, (size_t) head.elsize[t] * head.NLocal[t], 1, fp));
+    }
+    if(fp)
+        fclose(fp);
+    MPI_Allreduce(MPI_IN_PLACE, &bad, 1, MPI_INT, MPI_MAX, GadgetComm);
+    if(bad)
+        endrun(1, "Failed to read local checkpoint %s\n", fname);
+}
+
 /*
  * register an IO block of name for particle type ptype.
  *
@@ -708,9 +2434,35 @@ void io_register_io_block(const char * name,
     ent->setter = setter;
     ent->items = items;
     ent->required = required;
+    ent->direct_offset = 0;
+    ent->direct_dtype[0] = '\0';
+    ent->keepbits = 0;
     IOTable->used ++;
 }
 
+/* Keep only keepbits mantissa bits of the last registered block when it is written.
+ * Only meaningful for f4 and f8 blocks; 0 keeps full precision.*/
+static void
+io_set_precision(struct IOTable * IOTable, int keepbits)
+{
+    IOTableEntry * ent = &IOTable->ent[IOTable->used - 1];
+    if(ent->dtype[0] != 'f' || keepbits < 0)
+        endrun(1, "Cannot set precision %d on block %s of type %s\n", keepbits, ent->name, ent->dtype);
+    ent->keepbits = keepbits;
+}
+
+/* Mark the last registered block as a plain copy of a particle_data field,
+ * of kind 'f', 'i' or 'u' and size bytes. Only valid for SIMPLE_GETTER blocks.*/
+static void
+io_set_direct_field(struct IOTable * IOTable, ptrdiff_t offset, char kind, size_t size)
+{
+    IOTableEntry * ent = &IOTable->ent[IOTable->used - 1];
+    ent->direct_offset = offset;
+    snprintf(ent->direct_dtype, sizeof(ent->direct_dtype), "%c%zu", kind, size);
+}
+#define IO_DIRECT(field, kind, IOTable) \
+    io_set_direct_field(IOTable, offsetof(struct particle_data, field), kind, sizeof(((struct particle_data *) 0)->field))
+
 static void GTPosition(int i, double * out, void * baseptr, void * smanptr, const struct conversions * params) {
     /* Remove the particle offset before saving*/
     struct particle_data * part = (struct particle_data *) baseptr;
@@ -804,6 +2556,8 @@ SIMPLE_PROPERTY(ID, ID, uint64_t, 1)
 SIMPLE_GETTER(GTPotential, Potential, float, 1, struct particle_data)
 SIMPLE_GETTER(GTTimeBinHydro, TimeBinHydro, int, 1, struct particle_data)
 SIMPLE_GETTER(GTTimeBinGravity, TimeBinGravity, int, 1, struct particle_data)
+SIMPLE_PROPERTY(GravCost, GravCost, float, 1)
+SIMPLE_PROPERTY(NgbCost, NgbCost, float, 1)
 SIMPLE_PROPERTY(SmoothingLength, Hsml, float, 1)
 SIMPLE_PROPERTY_PI(Density, Density, float, 1, struct sph_particle_data)
 SIMPLE_PROPERTY_PI(EgyWtDensity, EgyWtDensity, float, 1, struct sph_particle_data)
@@ -962,17 +2716,30 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
         /* We put Mass first because sometimes there is
          * corruption in the first array and we can recover from Mass corruption*/
         IO_REG(Mass,     "f4", 1, i, IOTable);
+        IO_DIRECT(Mass, 'f', IOTable);
         IO_REG(Position, "f8", 3, i, IOTable);
+        io_set_precision(IOTable, IO.OutputPositionBits);
         IO_REG(Velocity, "f4", 3, i, IOTable);
+        io_set_precision(IOTable, IO.OutputVelocityBits);
         IO_REG(ID,       "u8", 1, i, IOTable);
-        if(IO.OutputPotential)
+        IO_DIRECT(ID, 'u', IOTable);
+        if(IO.OutputPotential) {
             IO_REG_WRONLY(Potential, "f4", 1, i, IOTable);
-        if(WriteGroupID)
+            IO_DIRECT(Potential, 'f', IOTable);
+        }
+        if(WriteGroupID) {
             IO_REG_WRONLY(GroupID, "u4", 1, i, IOTable);
+            IO_DIRECT(GrNr, 'i', IOTable);
+        }
         if(IO.OutputTimebins) {
             IO_REG_WRONLY(TimeBinHydro,       "u4", 1, i, IOTable);
             IO_REG_WRONLY(TimeBinGravity,       "u4", 1, i, IOTable);
         }
+        /* Not fatal if missing: the costs are rebuilt on the first steps*/
+        if(IO.OutputWorkCost) {
+            IO_REG_NONFATAL(GravCost,  "f4", 1, i, IOTable);
+            IO_REG_NONFATAL(NgbCost,  "f4", 1, i, IOTable);
+        }
     }
 
     IO_REG(Generation,       "u1", 1, 0, IOTable);
@@ -980,6 +2747,7 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
     IO_REG(Generation,       "u1", 1, 5, IOTable);
     /* Bare Bone SPH*/
     IO_REG(SmoothingLength,  "f4", 1, 0, IOTable);
+    IO_DIRECT(Hsml, 'f', IOTable);
     IO_REG(Density,          "f4", 1, 0, IOTable);
 
     if(DensityIndependentSphOn())
@@ -1017,6 +2785,7 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
         IO_REG_TYPE(LastEnrichmentMyr, "f4", 1, 4, IOTable);
         IO_REG_TYPE(TotalMassReturned, "f4", 1, 4, IOTable);
         IO_REG_NONFATAL(SmoothingLength,  "f4", 1, 4, IOTable);
+        IO_DIRECT(Hsml, 'f', IOTable);
     }
     /* end SF */
 
@@ -1034,6 +2803,7 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
 
     /* Smoothing lengths for black hole: this is a new addition*/
     IO_REG_NONFATAL(SmoothingLength,  "f4", 1, 5, IOTable);
+    IO_DIRECT(Hsml, 'f', IOTable);
     /* Marks whether a BH particle has been swallowed*/
     IO_REG_NONFATAL(Swallowed, "u1", 1, 5, IOTable);
     /* ID of the swallowing black hole particle. If == -1, then particle is live*/
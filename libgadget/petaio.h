@@ -32,6 +32,8 @@ struct header_data
     double UnitVelocity_in_cm_per_s;
     /* Number of k values to use for the neutrinos.*/
     int neutrinonk;
+    /* Set if NLocal was computed from the rank index of the snapshot*/
+    int NLocalFromIndex;
 };
 
 /* Store parameters for unit conversions
@@ -55,6 +57,12 @@ typedef struct IOTableEntry {
     int required;
     property_getter getter;
     property_setter setter;
+    /* If direct_dtype is set, the getter is a plain copy of a particle_data field
+     * at direct_offset with native type direct_dtype, so the block can be written straight from the particle table.*/
+    ptrdiff_t direct_offset;
+    char direct_dtype[8];
+    /* Mantissa bits kept on write for float blocks; 0 keeps full precision*/
+    int keepbits;
 } IOTableEntry;
 
 struct IOTable {
@@ -64,6 +72,7 @@ struct IOTable {
 };
 
 #define PTYPE_FOF_GROUP  1024
+#define PTYPE_SUBHALO  1025
 
 /* Get the full path for a snapshot number. String returned must be freed.*/
 char * petaio_get_snapshot_fname(int num, const char * OutputDir);
@@ -76,6 +85,14 @@ void destroy_io_blocks(struct IOTable * IOTable);
 
 void set_petaio_params(ParameterSet *ps);
 int GetUsePeculiarVelocity(void);
+int GetAsyncSnapshotWrite(void);
+/* Whether snapshots are also written in the Gadget HDF5 format, and the deflate level to use*/
+int GetHDF5Output(void);
+int GetHDF5Compression(void);
+/* Constant header information of the snapshots*/
+const struct header_data * petaio_get_header(void);
+/* Whether checkpoints are also written to per-rank files in LocalCheckpointDir*/
+int GetLocalCheckpoint(void);
 void petaio_init();
 void petaio_alloc_buffer(BigArray * array, IOTableEntry * ent, int64_t npartLocal);
 void petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv);
@@ -83,9 +100,41 @@ void petaio_readout_buffer(BigArray * array, IOTableEntry * ent, struct conversi
 void petaio_destroy_buffer(BigArray * array);
 
 void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, int verbose);
+/* Append the rows of array on every rank to the end of a block, creating it if needed. Collective.*/
+void petaio_append_block(BigFile * bf, const char * blockname, BigArray * array);
+/* Save the selected particles of one IOTable entry to a block, without building the whole column in memory.*/
+void petaio_save_selection(BigFile * bf, const char * blockname, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv, int verbose);
 int petaio_read_block(BigFile * bf, const char * blockname, BigArray * array, int required);
 
 void petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP);
+/* Write the particle blocks of IOTable to a single Gadget format HDF5 file, collectively. Needs -DUSE_HDF5.*/
+void petaio_save_snapshot_hdf5(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP, const int compression);
+/* Stage the snapshot in memory and write it in a background thread. Finish it with petaio_wait_snapshot.*/
+void petaio_save_snapshot_async(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP);
+/* Block until the background snapshot write, if any, is complete. Collective. Returns 1 if a snapshot was finished.*/
+int petaio_wait_snapshot(void);
+/* Estimate of the time the background write still needs. 0 if nothing is in flight.*/
+double petaio_async_pending_time(void);
+/* Dump the particles of this rank to its local checkpoint file, which a restart from snapshot num reads instead of the snapshot.*/
+void petaio_save_local(int num);
+/* Whether every rank has a usable local copy of checkpoint num. Collective.*/
+int petaio_local_available(int num);
+/* Number of the checkpoint read from or last written to local files, or -1*/
+int petaio_local_snapshot(void);
+/* Restricts petaio_read_snapshot_partial to some particle types, blocks and a region*/
+struct petaio_read_filter {
+    /* Bit t set reads particle type t*/
+    int TypeMask;
+    /* NULL-terminated list of block names to read, or NULL for all blocks*/
+    const char * const * Blocks;
+    /* If set, only read particles with BoxMin <= Pos < BoxMax*/
+    int UseBox;
+    double BoxMin[3];
+    double BoxMax[3];
+};
+void petaio_read_snapshot_partial(int num, const char * OutputDir, Cosmology * CP, struct header_data * header, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, const struct petaio_read_filter * filter);
+/* Remove the blocks not selected by filter from an IOTable*/
+void petaio_filter_io_blocks(struct IOTable * IOTable, const struct petaio_read_filter * filter);
 void petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct header_data * header, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, MPI_Comm Comm);
 /* Returns a header struct. Note that this may also change the cosmology values in CP, if those are different from the ones in the parameter file*/
 struct header_data petaio_read_header(int num, const char * OutputDir, Cosmology * CP);
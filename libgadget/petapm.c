@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <omp.h>
 /* do NOT use complex.h it breaks the code */
 
 #include "types.h"
@@ -21,10 +22,14 @@ layout_prepare(PetaPM * pm,
 static void layout_finish(struct Layout * L);
 static void layout_build_and_exchange_cells_to_pfft(PetaPM * pm, struct Layout * L, double * meshbuf, double * real);
 static void layout_build_and_exchange_cells_to_local(PetaPM * pm, struct Layout * L, double * meshbuf, double * real);
+static void layout_start_exchange_cells_to_local(PetaPM * pm, struct Layout * L, void * real, const int single, MPI_Request * request);
+static void layout_finish_exchange_cells_to_local(struct Layout * L, double * meshbuf, MPI_Request * request);
+static void layout_exchange_cells_to_local_batch(PetaPM * pm, struct Layout * L, double * real, const int nfield);
 
-/* cell_iterator needs to be thread safe !*/
-typedef void (* cell_iterator)(double * cell_value, double * comm_buffer);
-static void layout_iterate_cells(PetaPM * pm, struct Layout * L, cell_iterator iter, double * real);
+/* cell_iterator needs to be thread safe ! The cell is element cell of real, which is single precision for to_region_single.*/
+typedef void (* cell_iterator)(void * real, const ptrdiff_t cell, double * comm_buffer, const int nfield);
+static void layout_iterate_cells(PetaPM * pm, struct Layout * L, cell_iterator iter, void * real, const int nfield, double * buf, const int * first);
+static void layout_exchange_cells_chunked(PetaPM * pm, struct Layout * L, double * meshbuf, void * real, const int single, const int topfft);
 
 struct Pencil { /* a pencil starting at offset, with lenght len */
     int offset[3];
@@ -33,7 +38,6 @@ struct Pencil { /* a pencil starting at offset, with lenght len */
     int meshbuf_first; /* first pixel in meshbuf */
     int task;
 };
-static int pencil_cmp_target(const void * v1, const void * v2);
 static int pos_get_target(PetaPM * pm, const int pos[2]);
 
 /* FIXME: move this to MPIU_. */
@@ -101,6 +105,32 @@ petapm_module_init(int Nthreads)
 
 void
 petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm)
+{
+    petapm_init_fft(pm, BoxSize, Asmth, Nmesh, G, comm, PETAPM_FFT_PENCIL);
+}
+
+/* Shape of the process mesh of the FFT backend*/
+static void
+pm_fft_procmesh(const enum PetaPMFFTBackend backend, const int NTask, const int Nmesh, ptrdiff_t np[2])
+{
+    if(backend == PETAPM_FFT_SLAB) {
+        if(NTask > Nmesh)
+            endrun(1, "Slab FFT needs no more ranks (%d) than mesh cells (%d) on a side\n", NTask, Nmesh);
+        np[0] = NTask;
+        np[1] = 1;
+        return;
+    }
+    /* try to find a square 2d decomposition */
+    int i;
+    for(i = sqrt(NTask) + 1; i >= 0; i --) {
+        if(NTask % i == 0) break;
+    }
+    np[0] = i;
+    np[1] = NTask / i;
+}
+
+void
+petapm_init_fft(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm, enum PetaPMFFTBackend backend)
 {
     /* define the global long / short range force cut */
     pm->BoxSize = BoxSize;
@@ -109,6 +139,15 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
     pm->G = G;
     pm->CellSize = BoxSize / Nmesh;
     pm->comm = comm;
+    pm->priv->NBatch = 0;
+    pm->priv->SingleBack = 0;
+    pm->priv->InPlace = 0;
+    pm->priv->ExchangeChunks = 1;
+    pm->priv->RegionPad = 0;
+    pm->priv->AssignOrder = 2;
+    pm->priv->Interlace = 0;
+    pm->priv->PaintShift = 0;
+    pm->priv->backend = backend;
 
     ptrdiff_t n[3] = {Nmesh, Nmesh, Nmesh};
     ptrdiff_t np[2];
@@ -122,14 +161,9 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
     MPI_Comm_rank(comm, &ThisTask);
     MPI_Comm_size(comm, &NTask);
 
-    /* try to find a square 2d decomposition */
     int i;
     int k;
-    for(i = sqrt(NTask) + 1; i >= 0; i --) {
-        if(NTask % i == 0) break;
-    }
-    np[0] = i;
-    np[1] = NTask / i;
+    pm_fft_procmesh(backend, NTask, Nmesh, np);
 
     message(0, "Using 2D Task mesh %td x %td \n", np[0], np[1]);
     if( pfft_create_procmesh_2d(comm, np[0], np[1], &pm->priv->comm_cart_2d) ){
@@ -220,11 +254,194 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
     myfree(tmp);
 }
 
+/* Plan a backward transform of NBatch interleaved fields, so that petapm_force_c2r
+ * does the transposes and the cell exchange for NBatch functions at once. The fields have
+ * the same layout as a single field, with the NBatch values for each cell stored together.
+ * This needs NBatch times the memory of a single field for the real and complex meshes.*/
+void
+petapm_init_batch(PetaPM * pm, const int NBatch)
+{
+    if(NBatch <= 1)
+        return;
+    if(pm->priv->InPlace)
+        endrun(1, "Batched PM transforms are not available with in place transforms\n");
+    ptrdiff_t n[3] = {pm->Nmesh, pm->Nmesh, pm->Nmesh};
+    ptrdiff_t local_ni[3], local_i_start[3], local_no[3], local_o_start[3];
+
+    ptrdiff_t batchsize = 2 * pfft_local_size_many_dft_c2r(3, n, n, n, NBatch,
+            PFFT_DEFAULT_BLOCKS, PFFT_DEFAULT_BLOCKS, pm->priv->comm_cart_2d,
+            PFFT_TRANSPOSED_IN, local_ni, local_i_start, local_no, local_o_start);
+
+    /* The readout assumes the batched fields are decomposed as a single field*/
+    int k;
+    for(k = 0; k < 3; k++)
+        if(local_no[k] != pm->real_space_region.size[k] || local_o_start[k] != pm->real_space_region.offset[k])
+            endrun(1, "Batched PM mesh has a different decomposition: dim %d size %td offset %td, not %td %td\n",
+                    k, local_no[k], local_o_start[k], pm->real_space_region.size[k], pm->real_space_region.offset[k]);
+    if(batchsize > (ptrdiff_t) NBatch * pm->priv->fftsize)
+        endrun(1, "Batched PM mesh needs %td doubles, more than %d x %d\n", batchsize, NBatch, pm->priv->fftsize);
+
+    double * real = (double * ) mymalloc("PMreal", (size_t) NBatch * pm->priv->fftsize * sizeof(double));
+    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", (size_t) NBatch * pm->priv->fftsize * sizeof(double));
+
+    pm->priv->plan_back_batch = pfft_plan_many_dft_c2r(3, n, n, n, NBatch,
+        PFFT_DEFAULT_BLOCKS, PFFT_DEFAULT_BLOCKS, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+        PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+    pm->priv->NBatch = NBatch;
+
+    myfree(complx);
+    myfree(real);
+    message(0, "PetaPM: backward transforms batched in groups of %d\n", NBatch);
+}
+
+/* Replace the transforms with in place transforms: the complex mesh overwrites the real mesh.
+ * The real mesh is then padded to 2 (Nmesh / 2 + 1) in z, which is in the strides of real_space_region,
+ * so the cell exchange is unchanged. The forward transform returns rho_k in the real mesh, and each
+ * backward transform needs one mesh rather than two. Call after petapm_init, before petapm_init_single_precision.
+ * Not compatible with petapm_init_batch.*/
+void
+petapm_init_inplace(PetaPM * pm)
+{
+    if(pm->priv->NBatch > 1 || pm->priv->SingleBack)
+        endrun(1, "In place PM transforms must be set up before the batched or single precision transforms\n");
+    ptrdiff_t n[3] = {pm->Nmesh, pm->Nmesh, pm->Nmesh};
+    ptrdiff_t local_ni[3], local_i_start[3], local_no[3], local_o_start[3];
+
+    ptrdiff_t size = 2 * pfft_local_size_dft_r2c_3d(n, pm->priv->comm_cart_2d,
+           PFFT_TRANSPOSED_OUT | PFFT_PADDED_R2C, local_ni, local_i_start, local_no, local_o_start);
+
+    /* The cell exchange assumes the padded mesh is decomposed as the unpadded one*/
+    int k;
+    for(k = 0; k < 3; k++)
+        if(local_ni[k] != pm->real_space_region.size[k] || local_i_start[k] != pm->real_space_region.offset[k])
+            endrun(1, "Padded PM mesh has a different decomposition: dim %d size %td offset %td, not %td %td\n",
+                    k, local_ni[k], local_i_start[k], pm->real_space_region.size[k], pm->real_space_region.offset[k]);
+    if(size > pm->priv->fftsize)
+        pm->priv->fftsize = size;
+
+    pfft_destroy_plan(pm->priv->plan_forw);
+    pfft_destroy_plan(pm->priv->plan_back);
+
+    double * real = (double * ) mymalloc("PMreal", pm->priv->fftsize * sizeof(double));
+    pm->priv->plan_forw = pfft_plan_dft_r2c_3d(
+        n, real, (pfft_complex *) real, pm->priv->comm_cart_2d, PFFT_FORWARD,
+        PFFT_TRANSPOSED_OUT | PFFT_PADDED_R2C | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+    pm->priv->plan_back = pfft_plan_dft_c2r_3d(
+        n, (pfft_complex *) real, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+        PFFT_TRANSPOSED_IN | PFFT_PADDED_C2R | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+    myfree(real);
+
+    /* z is not decomposed in real space*/
+    pm->real_space_region.strides[2] = 1;
+    pm->real_space_region.strides[1] = 2 * (pm->Nmesh / 2 + 1);
+    pm->real_space_region.strides[0] = pm->real_space_region.size[1] * pm->real_space_region.strides[1];
+    pm->priv->InPlace = 1;
+    message(0, "PetaPM: in place transforms\n");
+}
+
+void
+petapm_set_exchange_chunks(PetaPM * pm, const int nchunk)
+{
+    pm->priv->ExchangeChunks = nchunk > 1 ? nchunk : 1;
+}
+
+/* Plan a single precision backward transform, for the unbatched transforms of petapm_force_c2r.
+ * The complex and real meshes of the backward transforms then take half the memory and the transposes
+ * half the bandwidth. The forward transform, and so the power spectrum, stays in double precision.*/
+void
+petapm_init_single_precision(PetaPM * pm)
+{
+    ptrdiff_t n[3] = {pm->Nmesh, pm->Nmesh, pm->Nmesh};
+    ptrdiff_t local_ni[3], local_i_start[3], local_no[3], local_o_start[3];
+
+    /* In place transforms have a padded real mesh, see petapm_init_inplace*/
+    const unsigned padded = pm->priv->InPlace ? PFFT_PADDED_C2R : 0;
+    ptrdiff_t size = 2 * pfftf_local_size_dft_r2c_3d(n, pm->priv->comm_cart_2d,
+           PFFT_TRANSPOSED_OUT | padded, local_ni, local_i_start, local_no, local_o_start);
+
+    /* The cell exchange assumes the single precision mesh is decomposed as the double precision one*/
+    int k;
+    for(k = 0; k < 3; k++)
+        if(local_ni[k] != pm->real_space_region.size[k] || local_i_start[k] != pm->real_space_region.offset[k])
+            endrun(1, "Single precision PM mesh has a different decomposition: dim %d size %td offset %td, not %td %td\n",
+                    k, local_ni[k], local_i_start[k], pm->real_space_region.size[k], pm->real_space_region.offset[k]);
+    if(size > pm->priv->fftsize)
+        endrun(1, "Single precision PM mesh needs %td floats, more than %d\n", size, pm->priv->fftsize);
+
+    pfftf_complex * complx = (pfftf_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(float));
+    float * real = pm->priv->InPlace ? (float *) complx : (float * ) mymalloc("PMreal", pm->priv->fftsize * sizeof(float));
+
+    pm->priv->plan_back_single = pfftf_plan_dft_c2r_3d(
+        n, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+        PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT | padded);
+    pm->priv->SingleBack = 1;
+
+    if(!pm->priv->InPlace)
+        myfree(real);
+    myfree(complx);
+    message(0, "PetaPM: single precision backward transforms\n");
+}
+
+void
+petapm_set_region_padding(PetaPM * pm, const int pad)
+{
+    pm->priv->RegionPad = pad;
+}
+
+void
+petapm_set_assignment(PetaPM * pm, const int order, const int interlace)
+{
+    if(order < 2 || order > 4)
+        endrun(1, "Mass assignment order %d not supported: use 2 (CIC), 3 (TSC) or 4 (PCS)\n", order);
+    pm->priv->AssignOrder = order;
+    pm->priv->Interlace = interlace;
+}
+
+/* unnormalized sinc function sin(x) / x */
+static double sinc_unnormed(double x) {
+    if(x < 1e-5 && x > -1e-5) {
+        double x2 = x * x;
+        return 1.0 - x2 / 6. + x2  * x2 / 120.;
+    } else {
+        return sin(x) / x;
+    }
+}
+
+double
+petapm_inverse_window(PetaPM * pm, const int kpos[3])
+{
+    /* the window of an assignment of order p is
+     *
+     * sinc_unnormed(k_x L / 2 Nmesh) ** p
+     *
+     * k_x = kpos * 2pi / L
+     * */
+    double f = 1.0;
+    int k;
+    for(k = 0; k < 3; k ++) {
+        double tmp = sinc_unnormed((kpos[k] * M_PI) / pm->Nmesh);
+        f /= pow(tmp, pm->priv->AssignOrder);
+    }
+    return f;
+}
+
+/* Extra cells on each side of the regions: those asked for by petapm_set_region_padding,
+ * and one more for the wider kernels and the shifted interlaced mesh.*/
+static int
+pm_region_pad(PetaPM * pm)
+{
+    return pm->priv->RegionPad + (pm->priv->AssignOrder > 2 || pm->priv->Interlace);
+}
+
 void
 petapm_destroy(PetaPM * pm)
 {
     pfft_destroy_plan(pm->priv->plan_forw);
     pfft_destroy_plan(pm->priv->plan_back);
+    if(pm->priv->NBatch > 1)
+        pfft_destroy_plan(pm->priv->plan_back_batch);
+    if(pm->priv->SingleBack)
+        pfftf_destroy_plan(pm->priv->plan_back_single);
     MPI_Comm_free(&pm->priv->comm_cart_2d);
     myfree(pm->Mesh2Task[0]);
 }
@@ -235,14 +452,29 @@ petapm_destroy(PetaPM * pm)
  * */
 typedef void (* pm_iterator)(PetaPM * pm, int i, double * mesh, double weight);
 static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions, const int Nregions);
+static void pm_iterate_progress(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions, const int Nregions, MPI_Request * request);
 /* apply transfer function to value, kpos array is in x, y, z order */
 static void pm_apply_transfer_function(PetaPM * pm,
         pfft_complex * src,
         pfft_complex * dst, petapm_transfer_func H);
+/* As above, but the output is written to every stride-th element of dst, for the batched transforms*/
+static void pm_apply_transfer_function_strided(PetaPM * pm,
+        pfft_complex * src,
+        pfft_complex * dst, const int stride, petapm_transfer_func H);
+/* Call H on a copy of each mode of src, for fourier space analysis. src is not changed*/
+static void pm_readout_modes(PetaPM * pm, pfft_complex * src, petapm_transfer_func H);
+/* As above, but the output is rounded to single precision, for the single precision backward transforms*/
+static void pm_apply_transfer_function_single(PetaPM * pm,
+        pfft_complex * src,
+        pfftf_complex * dst, petapm_transfer_func H);
 
 static void put_particle_to_mesh(PetaPM * pm, int i, double * mesh, double weight);
+static void put_particle_to_mesh_private(PetaPM * pm, int i, double * mesh, double weight);
 static void put_star_to_mesh(PetaPM * pm, int i, double * mesh, double weight);
 static void put_sfr_to_mesh(PetaPM * pm, int i, double * mesh, double weight);
+static void pm_paint(PetaPM * pm, PetaPMRegion * regions, const int Nregions);
+static void pm_interlace(PetaPM * pm, pfft_complex * complx, pfft_complex * shifted);
+static int64_t pm_fourier_kpos(PetaPM * pm, const size_t ip, int kpos[3]);
 
 /*
  * 1. calls prepare to build the Regions covering particles
@@ -270,8 +502,10 @@ petapm_force_init(
     *Nregions = 0;
     PetaPMRegion * regions = prepare(pm, pstruct, userdata, Nregions);
     pm_init_regions(pm, regions, *Nregions);
+    pm->priv->regions = regions;
+    pm->priv->Nregions = *Nregions;
 
-    pm_iterate(pm, put_particle_to_mesh, regions, *Nregions);
+    pm_paint(pm, regions, *Nregions);
 
     layout_prepare(pm, &pm->priv->layout, pm->priv->meshbuf, regions, *Nregions, pm->comm);
 
@@ -289,7 +523,9 @@ pfft_complex * petapm_force_r2c(PetaPM * pm,
      * CFT = DFT * dx **3
      * CFT[rho] = DFT [rho * dx **3] = DFT[CIC]
      * */
-    double * real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
+    /* In place, the real mesh becomes rho_k*/
+    const int inplace = pm->priv->InPlace;
+    double * real = (double * ) mymalloc2(inplace ? "PMrho_k" : "PMreal", pm->priv->fftsize * sizeof(double));
     memset(real, 0, sizeof(double) * pm->priv->fftsize);
     layout_build_and_exchange_cells_to_pfft(pm, &pm->priv->layout, pm->priv->meshbuf, real);
     walltime_measure("/PMgrav/comm2");
@@ -299,16 +535,36 @@ pfft_complex * petapm_force_r2c(PetaPM * pm,
     walltime_measure("/PMgrav/Verify");
 #endif
 
-    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
+    pfft_complex * complx = inplace ? (pfft_complex *) real : (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
     pfft_execute_dft_r2c(pm->priv->plan_forw, real, complx);
-    myfree(real);
+    if(!inplace)
+        myfree(real);
+
+    if(pm->priv->Interlace) {
+        /* The cells have been sent, so the mesh buffer is free for the mesh shifted by half a cell*/
+        memset(pm->priv->meshbuf, 0, pm->priv->meshbufsize * sizeof(double));
+        pm->priv->PaintShift = 0.5;
+        pm_paint(pm, pm->priv->regions, pm->priv->Nregions);
+        pm->priv->PaintShift = 0;
+        real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
+        memset(real, 0, sizeof(double) * pm->priv->fftsize);
+        layout_build_and_exchange_cells_to_pfft(pm, &pm->priv->layout, pm->priv->meshbuf, real);
+        pfft_complex * shifted = inplace ? (pfft_complex *) real : (pfft_complex *) mymalloc("PMshifted", pm->priv->fftsize * sizeof(double));
+        pfft_execute_dft_r2c(pm->priv->plan_forw, real, shifted);
+        pm_interlace(pm, complx, shifted);
+        if(!inplace)
+            myfree(shifted);
+        myfree(real);
+        walltime_measure("/PMgrav/interlace");
+    }
 
-    pfft_complex * rho_k = (pfft_complex * ) mymalloc2("PMrho_k", pm->priv->fftsize * sizeof(double));
+    pfft_complex * rho_k = inplace ? complx : (pfft_complex * ) mymalloc2("PMrho_k", pm->priv->fftsize * sizeof(double));
 
-    /*Do any analysis that may be required before the transfer function is applied*/
+    /*Do any analysis that may be required before the transfer function is applied.
+     * This only reads the modes: rho_k is written once, by the transfer function.*/
     petapm_transfer_func global_readout = global_functions->global_readout;
     if(global_readout)
-        pm_apply_transfer_function(pm, complx, rho_k, global_readout);
+        pm_readout_modes(pm, complx, global_readout);
     if(global_functions->global_analysis)
         global_functions->global_analysis(pm);
     /*Apply the transfer function*/
@@ -316,10 +572,137 @@ pfft_complex * petapm_force_r2c(PetaPM * pm,
     pm_apply_transfer_function(pm, complx, rho_k, global_transfer);
     walltime_measure("/PMgrav/r2c");
 
-    myfree(complx);
+    if(!inplace)
+        myfree(complx);
+    return rho_k;
+}
+
+pfft_complex *
+petapm_force_r2c_active(PetaPM * pm, int (*active)(int i))
+{
+    int (*allactive)(int i) = CPS->active;
+    CPS->active = active;
+    memset(pm->priv->meshbuf, 0, pm->priv->meshbufsize * sizeof(double));
+    pm_paint(pm, pm->priv->regions, pm->priv->Nregions);
+    PetaPMGlobalFunctions global_functions = {NULL, NULL, NULL};
+    pfft_complex * rho_k = petapm_force_r2c(pm, &global_functions);
+    CPS->active = allactive;
     return rho_k;
 }
 
+void
+petapm_readout_cross_modes(PetaPM * pm, pfft_complex * a, pfft_complex * b, petapm_cross_func H)
+{
+    size_t ip = 0;
+
+    PetaPMRegion * region = &pm->fourier_space_region;
+
+#pragma omp parallel for
+    for(ip = 0; ip < region->totalsize; ip ++) {
+        int kpos[3];
+        int64_t k2 = pm_fourier_kpos(pm, ip, kpos);
+        H(pm, k2, kpos, &a[ip], &b[ip]);
+    }
+}
+
+double *
+petapm_c2r_mesh(PetaPM * pm, pfft_complex * rho_k, petapm_transfer_func H)
+{
+    if(pm->priv->InPlace)
+        endrun(1, "Real space meshes are not available with in place PM transforms\n");
+    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
+    pm_apply_transfer_function(pm, rho_k, complx, H);
+    double * real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
+    pfft_execute_dft_c2r(pm->priv->plan_back, complx, real);
+    myfree(complx);
+    return real;
+}
+
+pfft_complex *
+petapm_r2c_mesh(PetaPM * pm, double * real)
+{
+    if(pm->priv->InPlace)
+        endrun(1, "Real space meshes are not available with in place PM transforms\n");
+    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
+    pfft_execute_dft_r2c(pm->priv->plan_forw, real, complx);
+    return complx;
+}
+
+/* Transform NBatch functions back to real space together and read them out in turn.
+ * There is one transform and one cell exchange, but each field is copied to the mesh buffer for its readout.*/
+static void
+pm_force_c2r_batch(PetaPM * pm,
+        pfft_complex * rho_k,
+        PetaPMRegion * regions,
+        const int Nregions,
+        PetaPMFunctions * functions,
+        const int report)
+{
+    const int NBatch = pm->priv->NBatch;
+    struct Layout * L = &pm->priv->layout;
+    int j;
+
+    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", (size_t) NBatch * pm->priv->fftsize * sizeof(double));
+    /* apply the greens functions, interleaving the fields */
+    for(j = 0; j < NBatch; j++)
+        pm_apply_transfer_function_strided(pm, rho_k, complx + j, NBatch, functions[j].transfer);
+    walltime_measure("/PMgrav/calc");
+
+    double * real = (double * ) mymalloc2("PMreal", (size_t) NBatch * pm->priv->fftsize * sizeof(double));
+    pfft_execute_dft_c2r(pm->priv->plan_back_batch, complx, real);
+
+    walltime_measure("/PMgrav/c2r");
+    if(report)
+        report_memory_usage("PetaPM");
+    myfree(complx);
+    /* this will free real, leaving the cells of all fields in BufSend.*/
+    layout_exchange_cells_to_local_batch(pm, L, real, NBatch);
+    walltime_measure("/PMgrav/comm");
+
+    for(j = 0; j < NBatch; j++) {
+        /* distribute this field to meshbuf */
+        int64_t i, offset = 0;
+        for(i = 0; i < L->NpExport; i ++) {
+            struct Pencil * p = &L->PencilSend[i];
+            int k;
+            for(k = 0; k < p->len; k++)
+                pm->priv->meshbuf[p->meshbuf_first + k] = L->BufSend[(offset + k) * NBatch + j];
+            offset += p->len;
+        }
+        pm_iterate(pm, functions[j].readout, regions, Nregions);
+        walltime_measure("/PMgrav/readout");
+    }
+    myfree(L->BufSend);
+    myfree(L->BufRecv);
+}
+
+/* Sets the region meshes to the force along axis, - D phi, from the four point finite difference of the mesh pot,
+ * which has the layout of meshbuf. (2/3 (phi(i+1) - phi(i-1)) - 1/12 (phi(i+2) - phi(i-2))) is the same operator
+ * as the differentiation kernel 1/6 (8 sin(w) - sin(2w)) in k-space. Cells in the padding of the regions are set to zero:
+ * particles never read from them.*/
+static void
+pm_finite_difference(PetaPM * pm, const double * pot, const int axis, PetaPMRegion * regions, const int Nregions)
+{
+    const double fac = pm->Nmesh / pm->BoxSize;
+    int r;
+    for(r = 0; r < Nregions; r++) {
+        PetaPMRegion * region = &regions[r];
+        const ptrdiff_t s = region->strides[axis];
+        const double * phi = pot + (region->buffer - pm->priv->meshbuf);
+        double * force = region->buffer;
+        size_t ip;
+        #pragma omp parallel for
+        for(ip = 0; ip < region->totalsize; ip++) {
+            const ptrdiff_t pos = (ip / s) % region->size[axis];
+            if(pos < 2 || pos >= region->size[axis] - 2) {
+                force[ip] = 0;
+                continue;
+            }
+            force[ip] = - fac * (2. / 3 * (phi[ip + s] - phi[ip - s]) - 1. / 12 * (phi[ip + 2 * s] - phi[ip - 2 * s]));
+        }
+    }
+}
+
 void
 petapm_force_c2r(PetaPM * pm,
         pfft_complex * rho_k,
@@ -327,31 +710,102 @@ petapm_force_c2r(PetaPM * pm,
         const int Nregions,
         PetaPMFunctions * functions)
 {
+    /* Copy of the mesh differenced by the finite difference functions*/
+    double * pot = NULL;
+    /* The function in meshbuf whose readout is not yet done. It is read out while the cells of the next
+     * function are exchanged, so the communication overlaps with the readout.*/
+    PetaPMFunctions * pending = NULL;
 
     PetaPMFunctions * f = functions;
     for (f = functions; f->name; f ++) {
+        /* Only the plain transforms are pipelined*/
+        if(pending && (f->fd_axis || pm->priv->NBatch > 1)) {
+            pm_iterate(pm, pending->readout, regions, Nregions);
+            walltime_measure("/PMgrav/readout");
+            pending = NULL;
+        }
+        if(f->fd_axis) {
+            if(f == functions || pm->priv->RegionPad < 2)
+                endrun(1, "Finite difference readout %s needs a previous function and a region padding of 2, not %d\n", f->name, pm->priv->RegionPad);
+            if(!pot) {
+                pot = (double *) mymalloc2("PMpotential", pm->priv->meshbufsize * sizeof(double));
+                memcpy(pot, pm->priv->meshbuf, pm->priv->meshbufsize * sizeof(double));
+            }
+            pm_finite_difference(pm, pot, f->fd_axis - 1, regions, Nregions);
+            walltime_measure("/PMgrav/calc");
+            pm_iterate(pm, f->readout, regions, Nregions);
+            walltime_measure("/PMgrav/readout");
+            continue;
+        }
+        /* The mesh to difference is the one read out last*/
+        if(pot) {
+            myfree(pot);
+            pot = NULL;
+        }
+        /* Do the next NBatch functions together, if there are that many left*/
+        if(pm->priv->NBatch > 1) {
+            int nleft = 0;
+            while(nleft < pm->priv->NBatch && f[nleft].name && !f[nleft].fd_axis)
+                nleft++;
+            if(nleft == pm->priv->NBatch) {
+                pm_force_c2r_batch(pm, rho_k, regions, Nregions, f, f == functions);
+                f += pm->priv->NBatch - 1;
+                continue;
+            }
+        }
         petapm_transfer_func transfer = f->transfer;
-        petapm_readout_func readout = f->readout;
+        const int single = pm->priv->SingleBack;
+        const int inplace = pm->priv->InPlace;
+        const size_t elsize = single ? sizeof(float) : sizeof(double);
 
-        pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
+        /* In place, the mesh is on top of rho_k so that it can be freed while the exchange buffers are allocated*/
+        void * complx = inplace ? mymalloc2("PMcomplex", pm->priv->fftsize * elsize) : mymalloc("PMcomplex", pm->priv->fftsize * elsize);
         /* apply the greens function turn rho_k into potential in fourier space */
-        pm_apply_transfer_function(pm, rho_k, complx, transfer);
+        if(single)
+            pm_apply_transfer_function_single(pm, rho_k, complx, transfer);
+        else
+            pm_apply_transfer_function(pm, rho_k, complx, transfer);
         walltime_measure("/PMgrav/calc");
 
-        double * real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
-        pfft_execute_dft_c2r(pm->priv->plan_back, complx, real);
+        void * real = inplace ? complx : mymalloc2("PMreal", pm->priv->fftsize * elsize);
+        if(single)
+            pfftf_execute_dft_c2r(pm->priv->plan_back_single, complx, real);
+        else
+            pfft_execute_dft_c2r(pm->priv->plan_back, complx, real);
 
         walltime_measure("/PMgrav/c2r");
         if(f == functions) // Once
             report_memory_usage("PetaPM");
-        myfree(complx);
-        /* read out the potential: this will copy and free real.*/
-        layout_build_and_exchange_cells_to_local(pm, &pm->priv->layout, pm->priv->meshbuf, real);
+        if(!inplace)
+            myfree(complx);
+        if(pm->priv->ExchangeChunks > 1) {
+            /* The chunks are copied to meshbuf as they arrive, so the previous function is read out first*/
+            if(pending)
+                pm_iterate(pm, pending->readout, regions, Nregions);
+            layout_exchange_cells_chunked(pm, &pm->priv->layout, pm->priv->meshbuf, real, single, 0);
+            myfree(real);
+            walltime_measure("/PMgrav/comm");
+            pending = f;
+            continue;
+        }
+        /* send the cells back to the regions: this will copy and free real.*/
+        MPI_Request request;
+        layout_start_exchange_cells_to_local(pm, &pm->priv->layout, real, single, &request);
+        if(pending) {
+            /* the previous function is still in meshbuf*/
+            pm_iterate_progress(pm, pending->readout, regions, Nregions, &request);
+            walltime_measure("/PMgrav/readout");
+        }
+        layout_finish_exchange_cells_to_local(&pm->priv->layout, pm->priv->meshbuf, &request);
         walltime_measure("/PMgrav/comm");
-
-        pm_iterate(pm, readout, regions, Nregions);
+        pending = f;
+    }
+    if(pending) {
+        pm_iterate(pm, pending->readout, regions, Nregions);
         walltime_measure("/PMgrav/readout");
     }
+    if(pot)
+        myfree(pot);
 }
 
 void petapm_force_finish(PetaPM * pm) {
@@ -425,6 +879,9 @@ petapm_reion_c2r(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
     int last_step = 0;
     int f_count = 0;
     petapm_readout_func readout = f->readout;
+    /* If the mass mesh has a batched plan for all the fields, do one transform per radius*/
+    const int nfield = use_sfr ? 3 : 2;
+    const int batch = pm_mass->priv->NBatch == nfield;
 
     /* TODO: seriously re-think the allocation ordering in this function */
     double * mass_real = (double * ) mymalloc2("mass_real", pm_mass->priv->fftsize * sizeof(double));
@@ -445,41 +902,74 @@ petapm_reion_c2r(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
         pm_star->G = R;
         if(use_sfr)pm_sfr->G = R;
 
-        //TODO: maybe allocate and free these outside the loop
-        pfft_complex * mass_filtered = (pfft_complex *) mymalloc("mass_filtered", pm_mass->priv->fftsize * sizeof(double));
-        pfft_complex * star_filtered = (pfft_complex *) mymalloc("star_filtered", pm_star->priv->fftsize * sizeof(double));
-        pfft_complex * sfr_filtered;
-        if(use_sfr){
-            sfr_filtered = (pfft_complex *) mymalloc("sfr_filtered", pm_sfr->priv->fftsize * sizeof(double));
+        petapm_transfer_func transfer = last_step ? NULL : f->transfer;
+        double * star_real, * sfr_real = NULL;
+
+        if(batch) {
+            /* Filter all fields into one interleaved mesh and transform them together*/
+            pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", (size_t) nfield * pm_mass->priv->fftsize * sizeof(double));
+            pm_apply_transfer_function_strided(pm_mass, mass_unfiltered, complx, nfield, transfer);
+            pm_apply_transfer_function_strided(pm_star, star_unfiltered, complx + 1, nfield, transfer);
+            if(use_sfr)
+                pm_apply_transfer_function_strided(pm_sfr, sfr_unfiltered, complx + 2, nfield, transfer);
+            walltime_measure("/PMreion/calc");
+
+            star_real = (double * ) mymalloc2("star_real", pm_star->priv->fftsize * sizeof(double));
+            if(use_sfr)
+                sfr_real = (double * ) mymalloc2("sfr_real", pm_sfr->priv->fftsize * sizeof(double));
+            double * real = (double * ) mymalloc2("PMreal", (size_t) nfield * pm_mass->priv->fftsize * sizeof(double));
+            pfft_execute_dft_c2r(pm_mass->priv->plan_back_batch, complx, real);
+            myfree(complx);
+            /* Separate the fields again for the reion loop*/
+            const PetaPMRegion * reg = &pm_mass->real_space_region;
+            int ix;
+            #pragma omp parallel for
+            for(ix = 0; ix < reg->size[0]; ix++) {
+                int iy, iz;
+                for(iy = 0; iy < reg->size[1]; iy++)
+                    for(iz = 0; iz < reg->size[2]; iz++) {
+                        const ptrdiff_t ip = ix * reg->strides[0] + iy * reg->strides[1] + iz * reg->strides[2];
+                        mass_real[ip] = real[ip * nfield];
+                        star_real[ip] = real[ip * nfield + 1];
+                        if(use_sfr)
+                            sfr_real[ip] = real[ip * nfield + 2];
+                    }
+            }
+            myfree(real);
+            walltime_measure("/PMreion/c2r");
         }
+        else {
+            pfft_complex * mass_filtered = (pfft_complex *) mymalloc("mass_filtered", pm_mass->priv->fftsize * sizeof(double));
+            pfft_complex * star_filtered = (pfft_complex *) mymalloc("star_filtered", pm_star->priv->fftsize * sizeof(double));
+            pfft_complex * sfr_filtered = NULL;
+            if(use_sfr){
+                sfr_filtered = (pfft_complex *) mymalloc("sfr_filtered", pm_sfr->priv->fftsize * sizeof(double));
+            }
 
-        /* apply the filtering at this radius */
-        /*We want the last step to be unfiltered,
-         *  calling apply transfer with NULL should just copy the grids */
-
-        petapm_transfer_func transfer = last_step ? NULL : f->transfer;
+            /* apply the filtering at this radius */
+            /*We want the last step to be unfiltered,
+             *  calling apply transfer with NULL should just copy the grids */
+            pm_apply_transfer_function(pm_mass, mass_unfiltered, mass_filtered, transfer);
+            pm_apply_transfer_function(pm_star, star_unfiltered, star_filtered, transfer);
+            if(use_sfr){
+                pm_apply_transfer_function(pm_sfr, sfr_unfiltered, sfr_filtered, transfer);
+            }
+            walltime_measure("/PMreion/calc");
+
+            star_real = (double * ) mymalloc2("star_real", pm_star->priv->fftsize * sizeof(double));
+            /* back to real space */
+            pfft_execute_dft_c2r(pm_mass->priv->plan_back, mass_filtered, mass_real);
+            pfft_execute_dft_c2r(pm_star->priv->plan_back, star_filtered, star_real);
+            if(use_sfr){
+                sfr_real = (double * ) mymalloc2("sfr_real", pm_sfr->priv->fftsize * sizeof(double));
+                pfft_execute_dft_c2r(pm_sfr->priv->plan_back, sfr_filtered, sfr_real);
+                myfree(sfr_filtered);
+            }
+            walltime_measure("/PMreion/c2r");
 
-        pm_apply_transfer_function(pm_mass, mass_unfiltered, mass_filtered, transfer);
-        pm_apply_transfer_function(pm_star, star_unfiltered, star_filtered, transfer);
-        if(use_sfr){
-            pm_apply_transfer_function(pm_sfr, sfr_unfiltered, sfr_filtered, transfer);
-        }
-        walltime_measure("/PMreion/calc");
-
-        double * star_real = (double * ) mymalloc2("star_real", pm_star->priv->fftsize * sizeof(double));
-        /* back to real space */
-        pfft_execute_dft_c2r(pm_mass->priv->plan_back, mass_filtered, mass_real);
-        pfft_execute_dft_c2r(pm_star->priv->plan_back, star_filtered, star_real);
-        double * sfr_real = NULL;
-        if(use_sfr){
-            sfr_real = (double * ) mymalloc2("sfr_real", pm_sfr->priv->fftsize * sizeof(double));
-            pfft_execute_dft_c2r(pm_sfr->priv->plan_back, sfr_filtered, sfr_real);
-            myfree(sfr_filtered);
+            myfree(star_filtered);
+            myfree(mass_filtered);
         }
-        walltime_measure("/PMreion/c2r");
-
-        myfree(star_filtered);
-        myfree(mass_filtered);
 
         /* the reion loop calculates the J21 and stores it,
          * for now the mass_real grid will be reused to hold J21
@@ -577,7 +1067,7 @@ void petapm_reion(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
 
 /* build a communication layout */
 
-static void layout_build_pencils(PetaPM * pm, struct Layout * L, double * meshbuf, PetaPMRegion * regions, const int Nregions);
+static void layout_build_pencils(PetaPM * pm, struct Pencil * pencils, double * meshbuf, PetaPMRegion * regions, const int Nregions);
 static void layout_exchange_pencils(struct Layout * L);
 static void
 layout_prepare (PetaPM * pm,
@@ -618,31 +1108,50 @@ layout_prepare (PetaPM * pm,
     }
 
     L->PencilSend = (struct Pencil *) mymalloc("PencilSend", NpAlloc * sizeof(struct Pencil));
+    struct Pencil * pencils = (struct Pencil *) mymalloc2("PencilBuild", NpAlloc * sizeof(struct Pencil));
 
-    layout_build_pencils(pm, L, meshbuf, regions, Nregions);
-
-    /* sort the pencils by the target rank for ease of next step */
-    qsort_openmp(L->PencilSend, NpAlloc, sizeof(struct Pencil), pencil_cmp_target);
-    /* zero length pixels are moved to the tail */
-
-    /* now shrink NpExport*/
-    L->NpExport = NpAlloc;
-    while(L->NpExport > 0 && L->PencilSend[L->NpExport - 1].len == 0) {
-        L->NpExport --;
-    }
+    layout_build_pencils(pm, pencils, meshbuf, regions, Nregions);
 
-    /* count total number of cells to be exported */
+    /* count the pencils and cells to be exported to each rank. Zero length pencils are not sent. */
     int64_t NcExport = 0;
-    for(i = 0; i < L->NpExport; i++) {
-        int task = L->PencilSend[i].task;
-        L->NcSend[task] += L->PencilSend[i].len;
-        NcExport += L->PencilSend[i].len;
+    int64_t j;
+    for(j = 0; j < NpAlloc; j++) {
+        if(pencils[j].len == 0)
+            continue;
+        int task = pencils[j].task;
+        L->NcSend[task] += pencils[j].len;
+        NcExport += pencils[j].len;
         L->NpSend[task] ++;
     }
     L->NcExport = NcExport;
 
-    MPI_Alltoall(L->NpSend, 1, MPI_INT, L->NpRecv, 1, MPI_INT, L->comm);
-    MPI_Alltoall(L->NcSend, 1, MPI_INT, L->NcRecv, 1, MPI_INT, L->comm);
+    /* sort the pencils by the target rank for ease of next step. This is a counting sort:
+     * the pencils were built in meshbuf order, which is kept for each rank. */
+    int * fill = ta_malloc("PencilFill", int, NTask);
+    fill[0] = 0;
+    for(i = 1; i < NTask; i ++)
+        fill[i] = fill[i - 1] + L->NpSend[i - 1];
+    L->NpExport = fill[NTask - 1] + L->NpSend[NTask - 1];
+    for(j = 0; j < NpAlloc; j++) {
+        if(pencils[j].len == 0)
+            continue;
+        L->PencilSend[fill[pencils[j].task]++] = pencils[j];
+    }
+    ta_free(fill);
+    myfree(pencils);
+
+    /* one exchange for the numbers of pencils and of cells */
+    int * counts = ta_malloc("PencilCounts", int, 4 * NTask);
+    for(i = 0; i < NTask; i ++) {
+        counts[2 * i] = L->NpSend[i];
+        counts[2 * i + 1] = L->NcSend[i];
+    }
+    MPI_Alltoall(counts, 2, MPI_INT, counts + 2 * NTask, 2, MPI_INT, L->comm);
+    for(i = 0; i < NTask; i ++) {
+        L->NpRecv[i] = counts[2 * NTask + 2 * i];
+        L->NcRecv[i] = counts[2 * NTask + 2 * i + 1];
+    }
+    ta_free(counts);
 
     /* build the displacement array; why doesn't MPI build these automatically? */
     L->DpSend[0] = 0; L->DpRecv[0] = 0;
@@ -685,12 +1194,13 @@ layout_prepare (PetaPM * pm,
 
 static void
 layout_build_pencils(PetaPM * pm,
-                     struct Layout * L,
+                     struct Pencil * pencils,
                      double * meshbuf,
                      PetaPMRegion * regions,
                      const int Nregions)
 {
     /* now build pencils to be exported */
+    const int pad = pm_region_pad(pm);
     int p0 = 0;
     int r;
     for (r = 0; r < Nregions; r++) {
@@ -700,7 +1210,7 @@ layout_build_pencils(PetaPM * pm,
             int iy;
             for(iy = 0; iy < regions[r].size[1]; iy++) {
                 int poffset = ix * regions[r].size[1] + iy;
-                struct Pencil * p = &L->PencilSend[p0 + poffset];
+                struct Pencil * p = &pencils[p0 + poffset];
 
                 p->offset[0] = ix + regions[r].offset[0];
                 p->offset[1] = iy + regions[r].offset[1];
@@ -709,11 +1219,12 @@ layout_build_pencils(PetaPM * pm,
                 p->meshbuf_first = (regions[r].buffer - meshbuf) +
                     regions[r].strides[0] * ix +
                     regions[r].strides[1] * iy;
-                /* now lets compress the pencil */
-                while((p->len > 0) && (meshbuf[p->meshbuf_first + p->len - 1] == 0.0)) {
+                /* now lets compress the pencil, unless the empty cells are needed for finite differences
+                 * or will be painted by the interlaced mesh */
+                while(!pad && (p->len > 0) && (meshbuf[p->meshbuf_first + p->len - 1] == 0.0)) {
                     p->len --;
                 }
-                while((p->len > 0) && (meshbuf[p->meshbuf_first] == 0.0)) {
+                while(!pad && (p->len > 0) && (meshbuf[p->meshbuf_first] == 0.0)) {
                     p->len --;
                     p->meshbuf_first++;
                     p->offset[2] ++;
@@ -782,9 +1293,13 @@ static void layout_finish(struct Layout * L) {
 
 /* exchange cells to their pfft host, then reduce the cells to the pfft
  * array */
-static void to_pfft(double * cell, double * buf) {
+static void to_pfft(void * real, const ptrdiff_t cell, double * buf, const int nfield) {
+    double * value = (double *) real + cell * nfield;
+    int j;
+    for(j = 0; j < nfield; j++) {
 #pragma omp atomic update
-            cell[0] += buf[0];
+        value[j] += buf[j];
+    }
 }
 
 static void
@@ -794,6 +1309,10 @@ layout_build_and_exchange_cells_to_pfft(
         double * meshbuf,
         double * real)
 {
+    if(pm->priv->ExchangeChunks > 1) {
+        layout_exchange_cells_chunked(pm, L, meshbuf, real, 0, 1);
+        return;
+    }
     L->BufSend = (double *) mymalloc("PMBufSend", L->NcExport * sizeof(double));
     L->BufRecv = (double *) mymalloc("PMBufRecv", L->NcImport * sizeof(double));
 
@@ -832,15 +1351,26 @@ layout_build_and_exchange_cells_to_pfft(
     message(0, "totmassExport = %g totmassImport = %g\n", totmassExport, totmassImport);
 #endif
 
-    layout_iterate_cells(pm, L, to_pfft, real);
+    layout_iterate_cells(pm, L, to_pfft, real, 1, L->BufRecv, NULL);
     myfree(L->BufRecv);
     myfree(L->BufSend);
 }
 
 /* readout cells on their pfft host, then exchange the cells to the domain
  * host */
-static void to_region(double * cell, double * region) {
-    *region = *cell;
+static void to_region(void * real, const ptrdiff_t cell, double * region, const int nfield) {
+    const double * value = (double *) real + cell * nfield;
+    int j;
+    for(j = 0; j < nfield; j++)
+        region[j] = value[j];
+}
+
+/* As to_region, from a single precision mesh*/
+static void to_region_single(void * real, const ptrdiff_t cell, double * region, const int nfield) {
+    const float * value = (float *) real + cell * nfield;
+    int j;
+    for(j = 0; j < nfield; j++)
+        region[j] = value[j];
 }
 
 static void
@@ -849,13 +1379,31 @@ layout_build_and_exchange_cells_to_local(
         struct Layout * L,
         double * meshbuf,
         double * real)
+{
+    if(pm->priv->ExchangeChunks > 1) {
+        layout_exchange_cells_chunked(pm, L, meshbuf, real, 0, 0);
+        myfree(real);
+        return;
+    }
+    MPI_Request request;
+    layout_start_exchange_cells_to_local(pm, L, real, 0, &request);
+    layout_finish_exchange_cells_to_local(L, meshbuf, &request);
+}
+
+/* Copy real, which is single precision if single is true, to the exchange buffer, free it and start
+ * the non-blocking exchange of the cells. meshbuf is not touched until layout_finish_exchange_cells_to_local.*/
+static void
+layout_start_exchange_cells_to_local(
+        PetaPM * pm,
+        struct Layout * L,
+        void * real,
+        const int single,
+        MPI_Request * request)
 {
     L->BufRecv = (double *) mymalloc("PMBufRecv", L->NcImport * sizeof(double));
-    int64_t i;
-    int64_t offset;
 
     /*layout_iterate_cells transfers real to L->BufRecv*/
-    layout_iterate_cells(pm, L, to_region, real);
+    layout_iterate_cells(pm, L, single ? to_region_single : to_region, real, 1, L->BufRecv, NULL);
 
     /*Real is done now: reuse the memory for BufSend*/
     myfree(real);
@@ -864,10 +1412,22 @@ layout_build_and_exchange_cells_to_local(
 
     /* exchange cells */
     /* notice the order is reversed from to_pfft */
-    MPI_Alltoallv(
+    MPI_Ialltoallv(
             L->BufRecv, L->NcRecv, L->DcRecv, MPI_DOUBLE,
             L->BufSend, L->NcSend, L->DcSend, MPI_DOUBLE,
-            L->comm);
+            L->comm, request);
+}
+
+/* Wait for the exchange of the cells and distribute them to meshbuf*/
+static void
+layout_finish_exchange_cells_to_local(
+        struct Layout * L,
+        double * meshbuf,
+        MPI_Request * request)
+{
+    int64_t i;
+    int64_t offset;
+    MPI_Wait(request, MPI_STATUS_IGNORE);
 
     /* distribute BufSend to meshbuf */
     offset = 0;
@@ -882,6 +1442,32 @@ layout_build_and_exchange_cells_to_local(
     myfree(L->BufRecv);
 }
 
+/* As layout_build_and_exchange_cells_to_local, for nfield interleaved fields.
+ * The cells are left in BufSend, nfield values per cell, for the caller to distribute and free
+ * (BufSend, then BufRecv).*/
+static void
+layout_exchange_cells_to_local_batch(
+        PetaPM * pm,
+        struct Layout * L,
+        double * real,
+        const int nfield)
+{
+    L->BufRecv = (double *) mymalloc("PMBufRecv", nfield * L->NcImport * sizeof(double));
+    layout_iterate_cells(pm, L, to_region, real, nfield, L->BufRecv, NULL);
+    myfree(real);
+    L->BufSend = (double *) mymalloc("PMBufSend", nfield * L->NcExport * sizeof(double));
+
+    /* One message for all fields of a cell*/
+    MPI_Datatype MPI_CELL;
+    MPI_Type_contiguous(nfield, MPI_DOUBLE, &MPI_CELL);
+    MPI_Type_commit(&MPI_CELL);
+    MPI_Alltoallv(
+            L->BufRecv, L->NcRecv, L->DcRecv, MPI_CELL,
+            L->BufSend, L->NcSend, L->DcSend, MPI_CELL,
+            L->comm);
+    MPI_Type_free(&MPI_CELL);
+}
+
 /* iterate over the pairs of real field cells and RecvBuf cells
  *
  * !!! iter has to be thread safe. !!!
@@ -890,12 +1476,19 @@ static void
 layout_iterate_cells(PetaPM * pm,
                      struct Layout * L,
                      cell_iterator iter,
-                     double * real)
+                     void * real,
+                     const int nfield,
+                     double * buf,
+                     const int * first)
 {
     int64_t i;
 #pragma omp parallel for
     for(i = 0; i < L->NpImport; i ++) {
         struct Pencil * p = &L->PencilRecv[i];
+        /* If first is given, it is the position of the pencil in buf, or negative to skip it*/
+        const int pfirst = first ? first[i] : p->first;
+        if(pfirst < 0)
+            continue;
         int k;
         ptrdiff_t linear0 = 0;
         for(k = 0; k < 2; k ++) {
@@ -920,11 +1513,104 @@ layout_iterate_cells(PetaPM * pm,
             }
             ptrdiff_t linear = iz * pm->real_space_region.strides[2] + linear0;
             /*
-             * operate on the pencil, either modifying real or BufRecv
+             * operate on the pencil, either modifying real or buf
              * */
-            iter(&real[linear], &L->BufRecv[p->first + j]);
+            iter(real, linear, &buf[(pfirst + j) * nfield], nfield);
+        }
+    }
+}
+
+/* Chunk of the exchange of a pencil, from its x coordinate on the mesh*/
+static int
+layout_pencil_chunk(PetaPM * pm, const struct Pencil * p, const int nchunk)
+{
+    int ix = p->offset[0];
+    while(ix < 0) ix += pm->Nmesh;
+    while(ix >= pm->Nmesh) ix -= pm->Nmesh;
+    return ((int64_t) ix * nchunk) / pm->Nmesh;
+}
+
+/* Exchange the cells between meshbuf and real in ExchangeChunks rounds, each for the pencils in a range of x.
+ * The exchange buffers are only as large as one round. If topfft is true the cells of meshbuf are added to real,
+ * as in layout_build_and_exchange_cells_to_pfft; otherwise the cells of real, which is single precision if single
+ * is true, are copied to meshbuf, as in layout_build_and_exchange_cells_to_local. real is not freed.
+ * The pencils are in the same order on both sides, and the chunk of a pencil is known on both,
+ * so the counts of each round need no communication.*/
+static void
+layout_exchange_cells_chunked(PetaPM * pm, struct Layout * L, double * meshbuf, void * real, const int single, const int topfft)
+{
+    const int nchunk = pm->priv->ExchangeChunks;
+    int NTask;
+    MPI_Comm_size(L->comm, &NTask);
+    int * counts = ta_malloc("ChunkCounts", int, 4 * NTask);
+    int * NcSend = counts;
+    int * DcSend = counts + NTask;
+    int * NcRecv = counts + 2 * NTask;
+    int * DcRecv = counts + 3 * NTask;
+    int * first = (int *) mymalloc("ChunkFirst", L->NpImport * sizeof(int));
+
+    int c;
+    for(c = 0; c < nchunk; c++) {
+        int64_t i;
+        int r;
+        memset(counts, 0, 4 * NTask * sizeof(int));
+        for(i = 0; i < L->NpExport; i ++) {
+            struct Pencil * p = &L->PencilSend[i];
+            if(layout_pencil_chunk(pm, p, nchunk) == c)
+                NcSend[p->task] += p->len;
+        }
+        /* The received pencils are ordered by the sending rank*/
+        int64_t NcImport = 0;
+        for(r = 0; r < NTask; r ++) {
+            for(i = L->DpRecv[r]; i < L->DpRecv[r] + L->NpRecv[r]; i ++) {
+                struct Pencil * p = &L->PencilRecv[i];
+                first[i] = -1;
+                if(layout_pencil_chunk(pm, p, nchunk) != c)
+                    continue;
+                first[i] = NcImport;
+                NcImport += p->len;
+                NcRecv[r] += p->len;
+            }
+        }
+        int64_t NcExport = 0;
+        for(r = 0; r < NTask; r ++) {
+            DcSend[r] = NcExport;
+            DcRecv[r] = r > 0 ? DcRecv[r-1] + NcRecv[r-1] : 0;
+            NcExport += NcSend[r];
         }
+        double * BufLocal = (double *) mymalloc("PMBufSend", NcExport * sizeof(double));
+        double * BufPfft = (double *) mymalloc("PMBufRecv", NcImport * sizeof(double));
+        if(topfft) {
+            int64_t offset = 0;
+            for(i = 0; i < L->NpExport; i ++) {
+                struct Pencil * p = &L->PencilSend[i];
+                if(layout_pencil_chunk(pm, p, nchunk) != c)
+                    continue;
+                memcpy(BufLocal + offset, &meshbuf[p->meshbuf_first], sizeof(double) * p->len);
+                offset += p->len;
+            }
+            MPI_Alltoallv(BufLocal, NcSend, DcSend, MPI_DOUBLE,
+                    BufPfft, NcRecv, DcRecv, MPI_DOUBLE, L->comm);
+            layout_iterate_cells(pm, L, to_pfft, real, 1, BufPfft, first);
+        }
+        else {
+            layout_iterate_cells(pm, L, single ? to_region_single : to_region, real, 1, BufPfft, first);
+            MPI_Alltoallv(BufPfft, NcRecv, DcRecv, MPI_DOUBLE,
+                    BufLocal, NcSend, DcSend, MPI_DOUBLE, L->comm);
+            int64_t offset = 0;
+            for(i = 0; i < L->NpExport; i ++) {
+                struct Pencil * p = &L->PencilSend[i];
+                if(layout_pencil_chunk(pm, p, nchunk) != c)
+                    continue;
+                memcpy(&meshbuf[p->meshbuf_first], BufLocal + offset, sizeof(double) * p->len);
+                offset += p->len;
+            }
+        }
+        myfree(BufPfft);
+        myfree(BufLocal);
     }
+    myfree(first);
+    ta_free(counts);
 }
 
 static void
@@ -933,7 +1619,16 @@ pm_init_regions(PetaPM * pm, PetaPMRegion * regions, const int Nregions)
     if(regions) {
         int i;
         size_t size = 0;
+        const int pad = pm_region_pad(pm);
         for(i = 0 ; i < Nregions; i ++) {
+            if(pad > 0) {
+                int k;
+                for(k = 0; k < 3; k ++) {
+                    regions[i].offset[k] -= pad;
+                    regions[i].size[k] += 2 * pad;
+                }
+                petapm_region_init_strides(&regions[i]);
+            }
             size += regions[i].totalsize;
         }
         pm->priv->meshbufsize = size;
@@ -949,6 +1644,37 @@ pm_init_regions(PetaPM * pm, PetaPMRegion * regions, const int Nregions)
     }
 }
 
+/* Weights of the mesh points of the assignment kernel of order 2 (CIC), 3 (TSC) or 4 (PCS) for a particle
+ * at x, in cells. Returns the first mesh point: the weights are for the order points from there.*/
+static int
+pm_assignment_weights(const int order, const double x, double * W)
+{
+    int first;
+    double s;
+    switch(order) {
+        case 3:
+            first = floor(x + 0.5);
+            s = x - first;
+            W[0] = 0.5 * (0.5 - s) * (0.5 - s);
+            W[1] = 0.75 - s * s;
+            W[2] = 0.5 * (0.5 + s) * (0.5 + s);
+            return first - 1;
+        case 4:
+            first = floor(x);
+            s = x - first;
+            W[0] = (1 - s) * (1 - s) * (1 - s) / 6.;
+            W[1] = (4 - 6 * s * s + 3 * s * s * s) / 6.;
+            W[2] = (1 + 3 * s + 3 * s * s - 3 * s * s * s) / 6.;
+            W[3] = s * s * s / 6.;
+            return first - 1;
+        default:
+            first = floor(x);
+            s = x - first;
+            W[0] = 1 - s;
+            W[1] = s;
+            return first;
+    }
+}
 
 static void
 pm_iterate_one(PetaPM * pm,
@@ -958,8 +1684,9 @@ pm_iterate_one(PetaPM * pm,
                const int Nregions)
 {
     int k;
-    int iCell[3];  /* integer coordinate on the regional mesh */
-    double Res[3]; /* residual*/
+    int iCell[3];  /* integer coordinate of the first mesh point on the regional mesh */
+    double W[3][4]; /* weights of the mesh points*/
+    const int order = pm->priv->AssignOrder;
     double * Pos = POS(i);
     const int RegionInd = CPS->RegionInd ? CPS->RegionInd[i] : 0;
 
@@ -972,29 +1699,29 @@ pm_iterate_one(PetaPM * pm,
 
     PetaPMRegion * region = &regions[RegionInd];
     for(k = 0; k < 3; k++) {
-        double tmp = Pos[k] / pm->CellSize;
-        iCell[k] = floor(tmp);
-        Res[k] = tmp - iCell[k];
+        double tmp = Pos[k] / pm->CellSize + pm->priv->PaintShift;
+        iCell[k] = pm_assignment_weights(order, tmp, W[k]);
         iCell[k] -= region->offset[k];
         /* seriously?! particles are supposed to be contained in cells */
-        if(iCell[k] >= region->size[k] - 1 || iCell[k] < 0) {
+        if(iCell[k] > region->size[k] - order || iCell[k] < 0) {
             endrun(1, "particle out of cell better stop %d (k=%d) %g %g %g region: %td %td\n", iCell[k],k,
                 Pos[0], Pos[1], Pos[2],
                 region->offset[k], region->size[k]);
         }
     }
 
+    const int nconnection = order * order * order;
     int connection;
-    for(connection = 0; connection < 8; connection++) {
+    for(connection = 0; connection < nconnection; connection++) {
         double weight = 1.0;
         size_t linear = 0;
+        int rest = connection;
         for(k = 0; k < 3; k++) {
-            int offset = (connection >> k) & 1;
+            int offset = rest % order;
+            rest /= order;
             int tmp = iCell[k] + offset;
             linear += tmp * region->strides[k];
-            weight *= offset?
-                /* offset == 1*/ (Res[k])    :
-                /* offset == 0*/ (1 - Res[k]);
+            weight *= W[k][offset];
         }
         if(linear >= region->totalsize) {
             endrun(1, "particle linear index out of cell better stop\n");
@@ -1017,6 +1744,100 @@ static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions
     }
 }
 
+/* As pm_iterate, in chunks, testing a non-blocking request between them
+ * so that MPI progresses the communication while the particles are iterated.*/
+static void pm_iterate_progress(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions, const int Nregions, MPI_Request * request) {
+    const int64_t NumPart = CPS->NumPart;
+    const int64_t chunk = NumPart / 16 + 1;
+    int64_t start;
+    int done = 0;
+    for(start = 0; start < NumPart; start += chunk) {
+        const int64_t end = start + chunk < NumPart ? start + chunk : NumPart;
+        int64_t i;
+#pragma omp parallel for
+        for(i = start; i < end; i ++) {
+            pm_iterate_one(pm, i, iterator, regions, Nregions);
+        }
+        if(!done)
+            MPI_Test(request, &done, MPI_STATUS_IGNORE);
+    }
+}
+
+/* CIC the particles to the mesh. The regions have separate buffers, so the particles are grouped by region
+ * with a counting sort (keeping the particle order, which is Peano order within a region),
+ * and each region is painted by one thread without atomic updates. The few regions with more than
+ * a thread's share of the particles are painted by all threads, with atomic updates.*/
+static void pm_paint(PetaPM * pm, PetaPMRegion * regions, const int Nregions)
+{
+    if(!CPS->RegionInd || Nregions <= 1) {
+        pm_iterate(pm, put_particle_to_mesh, regions, Nregions);
+        return;
+    }
+    const int64_t NumPart = CPS->NumPart;
+    const int NumThreads = omp_get_max_threads();
+    /* Particles in each region from each thread, then the first particle of each region in the sorted list*/
+    int64_t * count = (int64_t *) mymalloc("PMPaintCount", (NumThreads + 1) * (int64_t) Nregions * sizeof(int64_t));
+    int64_t * start = count + NumThreads * (int64_t) Nregions;
+    memset(count, 0, NumThreads * (int64_t) Nregions * sizeof(int64_t));
+    int * order = (int *) mymalloc("PMPaintOrder", NumPart * sizeof(int));
+
+    /* Each thread sorts a contiguous block of particles: the same blocks in both passes*/
+#pragma omp parallel num_threads(NumThreads)
+    {
+        const int tid = omp_get_thread_num();
+        const int nthr = omp_get_num_threads();
+        const int64_t first = NumPart * tid / nthr;
+        const int64_t last = NumPart * (tid + 1) / nthr;
+        int64_t * mycount = count + tid * (int64_t) Nregions;
+        int64_t i;
+        for(i = first; i < last; i++)
+            if(CPS->RegionInd[i] >= 0 && CPS->RegionInd[i] < Nregions)
+                mycount[CPS->RegionInd[i]]++;
+#pragma omp barrier
+#pragma omp single
+        {
+            /* Exclusive prefix sum over regions, then threads*/
+            int64_t total = 0;
+            int r, t;
+            for(r = 0; r < Nregions; r++) {
+                start[r] = total;
+                for(t = 0; t < NumThreads; t++) {
+                    const int64_t c = count[t * (int64_t) Nregions + r];
+                    count[t * (int64_t) Nregions + r] = total;
+                    total += c;
+                }
+            }
+        }
+        for(i = first; i < last; i++)
+            if(CPS->RegionInd[i] >= 0 && CPS->RegionInd[i] < Nregions)
+                order[mycount[CPS->RegionInd[i]]++] = i;
+    }
+    /* The last thread's offsets now end each region*/
+    const int64_t * end = count + (NumThreads - 1) * (int64_t) Nregions;
+    int64_t nsorted = end[Nregions - 1];
+    int64_t large = nsorted / NumThreads + 1;
+
+    int r;
+#pragma omp parallel for schedule(dynamic)
+    for(r = 0; r < Nregions; r++) {
+        if(end[r] - start[r] >= large)
+            continue;
+        int64_t i;
+        for(i = start[r]; i < end[r]; i++)
+            pm_iterate_one(pm, order[i], put_particle_to_mesh_private, regions, Nregions);
+    }
+    for(r = 0; r < Nregions; r++) {
+        if(end[r] - start[r] < large)
+            continue;
+        int64_t i;
+#pragma omp parallel for
+        for(i = start[r]; i < end[r]; i++)
+            pm_iterate_one(pm, order[i], put_particle_to_mesh, regions, Nregions);
+    }
+    myfree(order);
+    myfree(count);
+}
+
 void petapm_region_init_strides(PetaPMRegion * region) {
     int k;
     size_t rt = 1;
@@ -1041,17 +1862,6 @@ static int pos_get_target(PetaPM * pm, const int pos[2]) {
     MPI_Cart_rank(pm->priv->comm_cart_2d, task2d, &rank);
     return rank;
 }
-static int pencil_cmp_target(const void * v1, const void * v2) {
-    const struct Pencil * p1 = (const struct Pencil *) v1;
-    const struct Pencil * p2 = (const struct Pencil *) v2;
-    /* move zero length pixels to the end */
-    if(p2->len == 0) return -1;
-    if(p1->len == 0) return 1;
-    int t1 = p1->task;
-    int t2 = p2->task;
-    return ((t2 < t1) - (t1 < t2)) * 2 +
-        ((p2->meshbuf_first < p1->meshbuf_first) - (p1->meshbuf_first < p2->meshbuf_first));
-}
 
 #ifdef DEBUG
 static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, const size_t meshsize) {
@@ -1077,7 +1887,7 @@ static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, c
     MPI_Allreduce(&mass_Region, &totmass_Region, 1, MPI_DOUBLE, MPI_SUM, pm->comm);
     double mass_CIC = 0;
 #pragma omp parallel for reduction(+: mass_CIC)
-    for(i = 0; i < pm->real_space_region.totalsize; i ++) {
+    for(i = 0; i < pm->real_space_region.size[0] * pm->real_space_region.strides[0]; i ++) {
         mass_CIC += real[i];
     }
     double totmass_CIC = 0;
@@ -1087,48 +1897,126 @@ static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, c
 }
 #endif
 
+/* Add the mesh painted half a cell up, which is shifted by exp(-i k.d), to the unshifted mesh and average.
+ * The aliased images of odd order cancel in the sum.*/
+static void
+pm_interlace(PetaPM * pm, pfft_complex * complx, pfft_complex * shifted)
+{
+    PetaPMRegion * region = &pm->fourier_space_region;
+    size_t ip;
+#pragma omp parallel for
+    for(ip = 0; ip < region->totalsize; ip ++) {
+        int kpos[3];
+        pm_fourier_kpos(pm, ip, kpos);
+        const int ksum = kpos[0] + kpos[1] + kpos[2];
+        /* The shift is half a cell in each direction: k.d = pi (kx + ky + kz) / Nmesh*/
+        const double phase = M_PI * ksum / pm->Nmesh;
+        const double c = cos(phase), s = sin(phase);
+        const double re = shifted[ip][0] * c - shifted[ip][1] * s;
+        const double im = shifted[ip][0] * s + shifted[ip][1] * c;
+        complx[ip][0] = 0.5 * (complx[ip][0] + re);
+        complx[ip][1] = 0.5 * (complx[ip][1] + im);
+    }
+}
+
 static void pm_apply_transfer_function(PetaPM * pm,
         pfft_complex * src,
         pfft_complex * dst, petapm_transfer_func H
         ){
+    pm_apply_transfer_function_strided(pm, src, dst, 1, H);
+}
+
+/* Wavenumbers of mode ip of the Fourier space region, in x, y, z order. Returns k^2.*/
+static int64_t
+pm_fourier_kpos(PetaPM * pm, const size_t ip, int kpos[3])
+{
+    PetaPMRegion * region = &pm->fourier_space_region;
+    ptrdiff_t tmp = ip;
+    int pos[3];
+    int64_t k2 = 0;
+    int k;
+    for(k = 0; k < 3; k ++) {
+        pos[k] = tmp / region->strides[k];
+        tmp -= pos[k] * region->strides[k];
+        /* lets get the abs pos on the grid*/
+        pos[k] += region->offset[k];
+        /* check */
+        if(pos[k] >= pm->Nmesh) {
+            endrun(1, "position didn't make sense\n");
+        }
+        pos[k] = petapm_mesh_to_k(pm, pos[k]);
+        /* Watch out the cast */
+        k2 += ((int64_t)pos[k]) * pos[k];
+    }
+    /* swap 0 and 1 because fourier space was transposed */
+    /* kpos is y, z, x */
+    kpos[0] = pos[2];
+    kpos[1] = pos[0];
+    kpos[2] = pos[1];
+    return k2;
+}
+
+static void pm_apply_transfer_function_strided(PetaPM * pm,
+        pfft_complex * src,
+        pfft_complex * dst, const int stride, petapm_transfer_func H
+        ){
     size_t ip = 0;
 
     PetaPMRegion * region = &pm->fourier_space_region;
 
 #pragma omp parallel for
     for(ip = 0; ip < region->totalsize; ip ++) {
-        ptrdiff_t tmp = ip;
-        int pos[3];
         int kpos[3];
-        int64_t k2 = 0.0;
-        int k;
-        for(k = 0; k < 3; k ++) {
-            pos[k] = tmp / region->strides[k];
-            tmp -= pos[k] * region->strides[k];
-            /* lets get the abs pos on the grid*/
-            pos[k] += region->offset[k];
-            /* check */
-            if(pos[k] >= pm->Nmesh) {
-                endrun(1, "position didn't make sense\n");
-            }
-            kpos[k] = petapm_mesh_to_k(pm, pos[k]);
-            /* Watch out the cast */
-            k2 += ((int64_t)kpos[k]) * kpos[k];
-        }
-        /* swap 0 and 1 because fourier space was transposed */
-        /* kpos is y, z, x */
-        pos[0] = kpos[2];
-        pos[1] = kpos[0];
-        pos[2] = kpos[1];
-        dst[ip][0] = src[ip][0];
-        dst[ip][1] = src[ip][1];
+        int64_t k2 = pm_fourier_kpos(pm, ip, kpos);
+        dst[ip * stride][0] = src[ip][0];
+        dst[ip * stride][1] = src[ip][1];
         if(H) {
-            H(pm, k2, pos, &dst[ip]);
+            H(pm, k2, kpos, &dst[ip * stride]);
         }
     }
 
 }
 
+static void pm_readout_modes(PetaPM * pm, pfft_complex * src, petapm_transfer_func H)
+{
+    size_t ip = 0;
+
+    PetaPMRegion * region = &pm->fourier_space_region;
+
+#pragma omp parallel for
+    for(ip = 0; ip < region->totalsize; ip ++) {
+        int kpos[3];
+        int64_t k2 = pm_fourier_kpos(pm, ip, kpos);
+        pfft_complex value;
+        value[0] = src[ip][0];
+        value[1] = src[ip][1];
+        H(pm, k2, kpos, &value);
+    }
+}
+
+static void pm_apply_transfer_function_single(PetaPM * pm,
+        pfft_complex * src,
+        pfftf_complex * dst, petapm_transfer_func H
+        ){
+    size_t ip = 0;
+
+    PetaPMRegion * region = &pm->fourier_space_region;
+
+#pragma omp parallel for
+    for(ip = 0; ip < region->totalsize; ip ++) {
+        int kpos[3];
+        int64_t k2 = pm_fourier_kpos(pm, ip, kpos);
+        pfft_complex value;
+        value[0] = src[ip][0];
+        value[1] = src[ip][1];
+        if(H) {
+            H(pm, k2, kpos, &value);
+        }
+        dst[ip][0] = value[0];
+        dst[ip][1] = value[1];
+    }
+}
+
 
 /**************
  * functions iterating over particle / mesh pairs
@@ -1140,6 +2028,13 @@ static void put_particle_to_mesh(PetaPM * pm, int i, double * mesh, double weigh
 #pragma omp atomic update
     mesh[0] += weight * Mass;
 }
+/* For a region painted by only one thread*/
+static void put_particle_to_mesh_private(PetaPM * pm, int i, double * mesh, double weight) {
+    double Mass = *MASS(i);
+    if(INACTIVE(i))
+        return;
+    mesh[0] += weight * Mass;
+}
 //escape fraction scaled GSM
 static void put_star_to_mesh(PetaPM * pm, int i, double * mesh, double weight) {
     if(INACTIVE(i) || *TYPE(i) != 4)
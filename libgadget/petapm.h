@@ -44,18 +44,50 @@ struct Layout {
     int * ibuffer;
 };
 
+/* Decomposition of the distributed FFT. The real and Fourier space meshes have the same layout in both,
+ * so the transfer and readout functions do not depend on it.*/
+enum PetaPMFFTBackend {
+    /* PFFT on a 2d process mesh: scales to many ranks*/
+    PETAPM_FFT_PENCIL = 0,
+    /* Slabs along x: PFFT on a NTask x 1 process mesh, which is transformed by FFTW-MPI.
+     * Fewer transposes, so faster for small numbers of ranks. Needs NTask <= Nmesh.*/
+    PETAPM_FFT_SLAB = 1,
+};
+
 /* Data which is private to the PetaPM structure. Don't access from outside.*/
 typedef struct PetaPMPriv {
     /* These varibles are initialized by petapm_init*/
 
     int fftsize;
+    enum PetaPMFFTBackend backend;
     pfft_plan plan_forw;
     pfft_plan plan_back;
+    /* Backward plan for NBatch interleaved fields. Only valid if NBatch > 1: see petapm_init_batch.*/
+    pfft_plan plan_back_batch;
+    int NBatch;
+    /* Single precision backward plan. Only valid if SingleBack is true: see petapm_init_single_precision.*/
+    pfftf_plan plan_back_single;
+    int SingleBack;
+    /* If true the transforms are in place, on a padded real mesh. See petapm_init_inplace.*/
+    int InPlace;
+    /* Number of rounds of the cell exchanges. See petapm_set_exchange_chunks.*/
+    int ExchangeChunks;
+    /* Number of cells added on each side of each region, for finite differences. See petapm_set_region_padding.*/
+    int RegionPad;
+    /* Order of the mass assignment and readout: 2 is CIC, 3 is TSC, 4 is PCS. See petapm_set_assignment.*/
+    int AssignOrder;
+    /* If true, the density is the mean of two meshes painted half a cell apart, which cancels the odd aliases.*/
+    int Interlace;
+    /* Shift of the particle positions in cells. Non-zero only while painting the second interlaced mesh.*/
+    double PaintShift;
     MPI_Comm comm_cart_2d;
 
     /* these variables are allocated every force calculation */
     double * meshbuf;
     size_t meshbufsize;
+    /* The regions, kept to paint the second interlaced mesh*/
+    PetaPMRegion * regions;
+    int Nregions;
     struct Layout layout;
 } PetaPMPriv;
 
@@ -107,6 +139,10 @@ typedef struct {
     const char * name;
     petapm_transfer_func transfer;
     petapm_readout_func readout;
+    /* If non-zero, there is no transform: the mesh read out is the force along axis fd_axis - 1,
+     * minus the four point finite difference gradient of the mesh of the last function with fd_axis == 0.
+     * This is the real space version of the Gadget-2 differentiation kernel. Needs a region padding of 2.*/
+    int fd_axis;
 } PetaPMFunctions;
 
 /* Reion Loop function, applied after c2r, doesn't iterate over all particles*/
@@ -127,6 +163,27 @@ typedef void * (*petapm_mfree_func)(void * ptr);
 void petapm_module_init(int Nthreads);
 
 void petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm);
+/* As petapm_init, choosing the decomposition of the FFT*/
+void petapm_init_fft(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm, enum PetaPMFFTBackend backend);
+/* Batch the backward transforms of petapm_force_c2r in groups of NBatch functions. Call after petapm_init.*/
+void petapm_init_batch(PetaPM * pm, const int NBatch);
+/* Do the unbatched backward transforms of petapm_force_c2r in single precision. Call after petapm_init.*/
+void petapm_init_single_precision(PetaPM * pm);
+/* Do the transforms in place, reusing the real mesh for the complex mesh.
+ * Call after petapm_init and before petapm_init_single_precision. Not compatible with petapm_init_batch.*/
+void petapm_init_inplace(PetaPM * pm);
+/* Exchange the cells between the regions and the FFT mesh in nchunk rounds, each for a range of x,
+ * so that the exchange buffers are only as large as one round.*/
+void petapm_set_exchange_chunks(PetaPM * pm, const int nchunk);
+/* Extend each region by pad cells on each side, and exchange all cells of the regions rather than only those with mass,
+ * so that finite differences can be taken on the region meshes. Call after petapm_init.*/
+void petapm_set_region_padding(PetaPM * pm, const int pad);
+/* Use mass assignment of the given order (2 = CIC, 3 = TSC, 4 = PCS) for painting and readout,
+ * optionally painting a second mesh shifted by half a cell (interlacing). Call after petapm_init.*/
+void petapm_set_assignment(PetaPM * pm, const int order, const int interlace);
+/* Inverse of the Fourier space window of the mass assignment of a mode, to deconvolve it in the transfer functions.
+ * The readout has the same window.*/
+double petapm_inverse_window(PetaPM * pm, const int kpos[3]);
 void petapm_destroy(PetaPM * pm);
 void petapm_region_init_strides(PetaPMRegion * region);
 
@@ -151,6 +208,24 @@ void petapm_force_c2r(PetaPM * pm,
         PetaPMFunctions * functions);
 void petapm_force_finish(PetaPM * pm);
 
+/* Paint only the particles for which active is true to the regions set up by petapm_force_init,
+ * and return the Fourier transform of their density, with no transfer function.
+ * The particles must be a subset of those painted by petapm_force_init, so that their cells are exchanged.
+ * The result is allocated on the top of the heap, above the regions: free it before them.*/
+pfft_complex * petapm_force_r2c_active(PetaPM * pm, int (*active)(int i));
+
+typedef void (*petapm_cross_func)(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * a, pfft_complex * b);
+/* Call H on each mode of the two Fourier space meshes a and b, for cross spectra. Neither is changed.*/
+void petapm_readout_cross_modes(PetaPM * pm, pfft_complex * a, pfft_complex * b, petapm_cross_func H);
+
+/* Apply H to a copy of rho_k and transform it to a real mesh with the layout of real_space_region,
+ * for operations on the whole mesh rather than at the particles. The mesh is allocated with mymalloc2.
+ * Not available with in place transforms.*/
+double * petapm_c2r_mesh(PetaPM * pm, pfft_complex * rho_k, petapm_transfer_func H);
+/* Forward transform of a real mesh with the layout of real_space_region. real is destroyed, but not freed.
+ * The result is allocated with mymalloc and is not normalised: divide by Nmesh^3 to invert petapm_c2r_mesh.*/
+pfft_complex * petapm_r2c_mesh(PetaPM * pm, double * real);
+
 PetaPMRegion * petapm_get_fourier_region(PetaPM * pm);
 PetaPMRegion * petapm_get_real_region(PetaPM * pm);
 int petapm_mesh_to_k(PetaPM * pm, int i);
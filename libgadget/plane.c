@@ -5,6 +5,7 @@
 #include <string.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <bigfile-mpi.h>
 // #include <time.h>
 #include "lenstools.h"
 #include "utils.h"
@@ -26,6 +27,7 @@ static struct plane_params
 
     int Resolution;
     double Thickness; // in kpc/h
+    int Distributed; // split the plane over the ranks and write bigfiles
 } PlaneParams;
 
 char *
@@ -89,7 +91,7 @@ void
 set_plane_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         // plane resolution
         PlaneParams.Resolution = param_get_int(ps, "PlaneResolution");
@@ -97,6 +99,8 @@ set_plane_params(ParameterSet * ps)
         // plane thickness
         PlaneParams.Thickness = param_get_double(ps, "PlaneThickness");
 
+        PlaneParams.Distributed = param_get_int(ps, "PlaneDistributed");
+
         // Plane normals
         set_plane_normals(ps);
 
@@ -109,7 +113,47 @@ set_plane_params(ParameterSet * ps)
         else
             BuildOutputList(ps, "PlaneCutPoints", PlaneParams.CutPoints, &PlaneParams.CutPointsLength, 1024);
     }
-    MPI_Bcast(&PlaneParams, sizeof(struct plane_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&PlaneParams, sizeof(struct plane_params), MPI_BYTE, 0, GadgetComm);
+}
+
+/* Save a plane split over the ranks to a bigfile, with the header of the FITS output as attributes. Collective.*/
+static void
+plane_save_slab(const struct plane_slab * slab, const char * fname, double Lbox, Cosmology * CP, double redshift, double comoving_distance, int64_t num_particles, const double UnitLength_in_cm)
+{
+    BigFile bf;
+    if(0 != big_file_mpi_create(&bf, fname, GadgetComm))
+        endrun(0, "Failed to create plane at %s: %s\n", fname, big_file_get_error_message());
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&bf, &bh, "Header", NULL, 0, 0, 0, GadgetComm))
+        endrun(0, "Failed to create block at %s:%s\n", "Header", big_file_get_error_message());
+    double H0 = CP->HubbleParam * 100;
+    double Lbox_Mpc = Lbox * UnitLength_in_cm / CM_PER_MPC;
+    double comoving_distance_Mpc = comoving_distance * UnitLength_in_cm / CM_PER_MPC;
+    double Ode0 = CP->OmegaLambda > 0 ? CP->OmegaLambda : CP->Omega_fld;
+    int64_t nmesh = slab->Nmesh;
+    if((0 != big_block_set_attr(&bh, "H0", &H0, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "h", &CP->HubbleParam, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "OMEGA_M", &CP->Omega0, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "OMEGA_L", &Ode0, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "W0", &CP->w0_fld, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "WA", &CP->wa_fld, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Z", &redshift, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "CHI", &comoving_distance_Mpc, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "SIDE", &Lbox_Mpc, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "NPART", &num_particles, "i8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Nmesh", &nmesh, "i8", 1)))
+        endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+    if(0 != big_block_mpi_close(&bh, GadgetComm))
+        endrun(0, "Failed to close block %s\n", big_file_get_error_message());
+
+    /* The slabs are in rank order, so the rows of the plane are written in order*/
+    BigArray array = {0};
+    size_t dims[2] = {slab->NRows * slab->Nmesh, 1};
+    ptrdiff_t strides[2] = {sizeof(double), sizeof(double)};
+    big_array_init(&array, slab->Data, "=f8", 2, dims, strides);
+    petaio_save_block(&bf, "Potential", &array, 0);
+    if(0 != big_file_mpi_close(&bf, GadgetComm))
+        endrun(0, "Failed to close plane at %s: %s\n", fname, big_file_get_error_message());
 }
 
 void write_plane(int snapnum, const double atime, Cosmology * CP, const char * OutputDir, const double UnitVelocity_in_cm_per_s, const double UnitLength_in_cm) {
@@ -120,7 +164,7 @@ void write_plane(int snapnum, const double atime, Cosmology * CP, const char * O
      * It is not generally the total number of particles*/
     int64_t num_particles_tot = 0; // number of dark matter particles
     // Use MPI_Allreduce to get the total number of particles on all ranks
-    MPI_Allreduce(&PartManager->NumPart, &num_particles_tot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&PartManager->NumPart, &num_particles_tot, 1, MPI_INT64, MPI_SUM, GadgetComm);
     // printf("Total number of particles: %ld\n", num_particles_tot);
 
     // plane parameters
@@ -146,49 +190,69 @@ void write_plane(int snapnum, const double atime, Cosmology * CP, const char * O
 
 
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
 
     double redshift = 1./atime - 1.;
     message(0, "Computing and writing potential planes.\n");
 
-    double *plane_result = allocate_2d_array_as_1d(plane_resolution, plane_resolution);
-    double *summed_plane_result = allocate_2d_array_as_1d(plane_resolution, plane_resolution);
-
     double comoving_distance = compute_comoving_distance(CP, atime, 1., UnitVelocity_in_cm_per_s);
 
     // print comoving distance
     message(0, "Comoving distance: %g\n", comoving_distance);
 
-    /* loop over cut points and normal directions to generate lensing potential planes */
-    for (int i = 0; i < PlaneParams.CutPointsLength; i++) {
-        for (int j = 0; j < PlaneParams.NormalsLength; j++) {
-            message(0, "Computing for cut point %g and normal %d\n", PlaneParams.CutPoints[i], PlaneParams.Normals[j]);
+    if (PlaneParams.Distributed) {
+        /* Each rank holds a slab of rows of the plane, which is solved with a parallel FFT and written with bigfile*/
+        for (int i = 0; i < PlaneParams.CutPointsLength; i++) {
+            for (int j = 0; j < PlaneParams.NormalsLength; j++) {
+                message(0, "Computing for cut point %g and normal %d\n", PlaneParams.CutPoints[i], PlaneParams.Normals[j]);
+                struct plane_slab slab;
+                int64_t num_particles_plane_tot = cutPlaneGaussianGridSlab(num_particles_tot, comoving_distance, BoxSize, CP, atime, PlaneParams.Normals[j], PlaneParams.CutPoints[i], thickness, plane_resolution, &slab);
+                char * file_path = fastpm_strdup_printf("%s/snap%d_potentialPlane%d_normal%d", OutputDir, snapnum, i, PlaneParams.Normals[j]);
+                plane_save_slab(&slab, file_path, BoxSize, CP, redshift, comoving_distance, num_particles_plane_tot, UnitLength_in_cm);
+                message(0, "Plane saved for cut %d and normal %d to %s\n", i, PlaneParams.Normals[j], file_path);
+                myfree(file_path);
+                myfree(slab.Data);
+            }
+        }
+    }
+    else {
+#ifndef USE_CFITSIO
+        endrun(0, "Plane writing requested but FITSIO not enabled. Set PlaneDistributed = 1 to write bigfile planes.\n");
+#endif
+        double *plane_result = allocate_2d_array_as_1d(plane_resolution, plane_resolution);
+        double *summed_plane_result = allocate_2d_array_as_1d(plane_resolution, plane_resolution);
 
-            double left_corner[3] = {0, 0, 0};
-            int64_t num_particles_plane = 0, num_particles_plane_tot = 0;
+        /* loop over cut points and normal directions to generate lensing potential planes */
+        for (int i = 0; i < PlaneParams.CutPointsLength; i++) {
+            for (int j = 0; j < PlaneParams.NormalsLength; j++) {
+                message(0, "Computing for cut point %g and normal %d\n", PlaneParams.CutPoints[i], PlaneParams.Normals[j]);
 
-            /*computing lensing potential planes*/
-            num_particles_plane = cutPlaneGaussianGrid(num_particles_tot,  comoving_distance, BoxSize, CP, atime, PlaneParams.Normals[j], PlaneParams.CutPoints[i], thickness, left_corner, plane_resolution, plane_result);
+                double left_corner[3] = {0, 0, 0};
+                int64_t num_particles_plane = 0, num_particles_plane_tot = 0;
 
-            /*sum up planes from all tasks*/
-            MPI_Reduce(plane_result, summed_plane_result, plane_resolution * plane_resolution, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-            MPI_Reduce(&num_particles_plane, &num_particles_plane_tot, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+                /*computing lensing potential planes*/
+                num_particles_plane = cutPlaneGaussianGrid(num_particles_tot,  comoving_distance, BoxSize, CP, atime, PlaneParams.Normals[j], PlaneParams.CutPoints[i], thickness, left_corner, plane_resolution, plane_result);
 
-            /*saving planes*/
-            if (ThisTask == 0) {
+                /*sum up planes from all tasks*/
+                MPI_Reduce(plane_result, summed_plane_result, plane_resolution * plane_resolution, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+                MPI_Reduce(&num_particles_plane, &num_particles_plane_tot, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+
+                /*saving planes*/
+                if (ThisTask == 0) {
 #ifdef USE_CFITSIO
-                char * file_path = plane_get_output_fname(snapnum, OutputDir, i, PlaneParams.Normals[j]);
-                savePotentialPlane(summed_plane_result, plane_resolution, plane_resolution, file_path, BoxSize, CP, redshift, comoving_distance, num_particles_plane_tot, UnitLength_in_cm);
-                message(0, "Plane saved for cut %d and normal %d to %s\n", i, PlaneParams.Normals[j], file_path + 1); // skip the '!' in the filename
-                myfree(file_path);
+                    char * file_path = plane_get_output_fname(snapnum, OutputDir, i, PlaneParams.Normals[j]);
+                    savePotentialPlane(summed_plane_result, plane_resolution, plane_resolution, file_path, BoxSize, CP, redshift, comoving_distance, num_particles_plane_tot, UnitLength_in_cm);
+                    message(0, "Plane saved for cut %d and normal %d to %s\n", i, PlaneParams.Normals[j], file_path + 1); // skip the '!' in the filename
+                    myfree(file_path);
 #endif
+                }
+                MPI_Barrier(GadgetComm);
             }
-            MPI_Barrier(MPI_COMM_WORLD);
         }
+        myfree(summed_plane_result);
+        myfree(plane_result);
     }
-    myfree(summed_plane_result);
-    myfree(plane_result);
-    
+
 
     if (ThisTask == 0) {
         double comoving_distance_Mpc  = comoving_distance * UnitLength_in_cm / CM_PER_MPC;
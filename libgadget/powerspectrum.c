@@ -64,10 +64,10 @@ void powerspectrum_sum(Power * ps)
     }
 
     /*Now sum power spectrum MPI storage*/
-    MPI_Allreduce(MPI_IN_PLACE, &(ps->Norm), 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, ps->kk, ps->size, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, ps->Power, ps->size, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, ps->Nmodes, ps->size, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &(ps->Norm), 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, ps->kk, ps->size, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, ps->Power, ps->size, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, ps->Nmodes, ps->size, MPI_INT64, MPI_SUM, GadgetComm);
 
     int nk_nz = 0;
     /*Now fix power spectrum units and remove zero entries.*/
@@ -93,7 +93,7 @@ void powerspectrum_save(Power * ps, const char * OutputDir, const char * filenam
 {
         int i;
         int ThisTask;
-        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+        MPI_Comm_rank(GadgetComm, &ThisTask);
         if(ThisTask != 0)
             return;
         char * fname = fastpm_strdup_printf("%s/%s-%0.4f.txt", OutputDir, filename, Time);
@@ -23,6 +23,8 @@
 #include "drift.h"
 #include "forcetree.h"
 #include "blackhole.h"
+#include "bhdynfric.h"
+#include "bhinfo.h"
 #include "hydra.h"
 #include "sfr_eff.h"
 #include "metal_return.h"
@@ -37,19 +39,38 @@
 #include "stats.h"
 #include "veldisp.h"
 #include "plane.h"
+#include "treewalk.h"
 
 static struct ClockTable Clocks;
-/* Size of table full of random numbers generated each timestep.*/
-#define  RNDTABLE 32768
 
 /*! \file run.c
  *  \brief  iterates over timesteps, main loop
  */
 
+/* The gas treewalks in a step are on nearly the same particles, so cache which particles need no exports,
+ * and where the particles of each top leaf are so that exports to leaves with none in range are skipped.
+ * They also search around the same particles at similar radii, so optionally cache the neighbour lists,
+ * with space for a few lists per particle to allow for them being remade at larger radii.*/
+static void
+gas_tree_alloc_caches(ForceTree * gasTree)
+{
+    force_tree_alloc_export_plan(gasTree);
+    force_tree_alloc_topleaf_extent(gasTree);
+    if(treewalk_int_positions_on())
+        force_tree_make_int_positions(gasTree);
+    const double skin = treewalk_ngb_cache_skin();
+    if(skin > 0)
+        force_tree_alloc_ngb_cache(gasTree, skin, 3 * GetNumNgb(GetDensityKernelType()) * pow(1 + skin, 3));
+}
+
 /*! This structure contains parameters local to the run module.*/
 static struct run_params
 {
     double SlotsIncreaseFactor; /* !< What percentage to increase the slot allocation by when requested*/
+    double SlotsGCFraction; /* !< Fraction of garbage slots at which the exchange compacts the slots*/
+    double SlotsVirtualReserveGB; /* !< If > 0, GB of address space reserved for each slot type, so growing slots never moves them*/
+    char SlotsSpillDir[512]; /* If set, the reserved slots of the types in SlotsSpillTypes are backed by files in this directory*/
+    int SlotsSpillTypes;
     int OutputDebugFields;      /* Flag whether to include a lot of debug output in snapshots*/
 
     double RandomParticleOffset; /* If > 0, a random shift of max RandomParticleOffset * BoxSize is applied to every particle
@@ -74,9 +95,13 @@ static struct run_params
     int MetalReturnOn; /* If late return of metals from AGB stars is enabled*/
     int LightconeOn;    /* Enable the light cone module,
                            which writes a list of particles to a file as they cross a light cone*/
+    int PowerSpectrumTypes; /* Bit field of the particle types for which auto and cross power spectra are measured at the PowerSpectrumOutputList times*/
     int HierarchicalGravity; /* Changes the main loop to enable the momentum conserving hierarchical timestepping, where only active particles gravitate.
                               * This is the algorithm from Gadget 4. It applies to the short-range gravity,
                               * and splits the hydro and gravitational timesteps. */
+    int DeferDriftOn; /* On steps which are not PM steps, do not drift the inactive particles of types which are in none of the trees of the step.
+                         They are drifted when they are next active or at the next full drift. Needs HierarchicalGravity.*/
+    int HydroSubcycleOn; /* Steps where only hydro timebins are active skip the extra domain decompositions and the gravity. Needs HierarchicalGravity.*/
     int MaxDomainTimeBinDepth; /* We should redo domain decompositions every timestep, after the timestep hierarchy gets deeper than this.
                                   Essentially forces a domain decompositon every 2^MaxDomainTimeBinDepth timesteps.*/
     int FastParticleType; /*!< flags a particle species to exclude timestep calculations.*/
@@ -92,30 +117,93 @@ static struct run_params
     /* variables that keep track of cumulative CPU consumption */
 
     double TimeLimitCPU;
+    int MaxNumSteps; /* Stop after this many steps, without a snapshot. For benchmarks; 0 is no limit.*/
 
     /*! The scale of the short-range/long-range force split in units of FFT-mesh cells */
     double Asmth;
+    /* If true, Asmth is adjusted on each PM step between AsmthMin and AsmthMax to minimise the measured PM and tree time*/
+    int AdaptiveAsmth;
+    double AsmthMin;
+    double AsmthMax;
     enum ShortRangeForceWindowType ShortRangeForceWindowType;
+    int ShortRangeForceWindowPolynomial; /* Evaluate the short-range window from a polynomial fit rather than the table*/
 
     /* some filenames */
     char OutputDir[100],
          FOFFileBase[100];
 
     int SnapshotWithFOF; /*Flag that doing FOF for snapshot outputs is on*/
+    int FOFReusePMTree; /* Keep the tree of a PM step for FOF, if FOF runs on that step*/
 
     uint64_t RandomSeed; /*Initial seed for the random number table*/
 
     int ExcursionSetReionOn; /*Flag for enabling the excursion set reionisation model*/
     int UVBGdim; /*Dimension of excursion set grids*/
 
+    /* Selection for RestartFlag 5, which writes a subset of a snapshot*/
+    int PartialReadTypes; /* Bitmask of particle types to keep*/
+    char PartialReadBlocks[512]; /* Comma separated list of blocks to keep, or empty for all*/
+    int PartialReadUseBox; /* If set, only keep particles inside PartialReadBox*/
+    double PartialReadBox[6]; /* Minimum then maximum corner of the region*/
+
 } All;
 
+/* Measured time of the PM and the gravity tree at the last PM step, for adapt_force_split*/
+static struct
+{
+    double PMTime;
+    double TreeTime;
+    double atime;
+} SplitCost;
+
+/* Choose the force split Asmth for this PM step, to minimise the time per unit log a spent in the PM and the gravity tree.
+ * Their time per unit log a is measured since the last PM step. The PM step is proportional to Asmth while the displacement
+ * criterion at the split scale sets it, and the tree walk time goes as the volume inside the cutoff, Asmth^3,
+ * so PM / Asmth + Tree * Asmth^3 is smallest at (PM / 3 Tree)^(1/4) times the current Asmth. If the PM step is set
+ * by something else a larger Asmth only costs tree time, so it shrinks. The change is at most 10% per PM step,
+ * so that noise in the timings does not make it oscillate. TreeRcut is in units of Asmth, so the cutoff follows it.
+ * Called at the start of a PM step, before any gravity, as all particles are then active.*/
+static void
+adapt_force_split(PetaPM * pm, const double atime)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    double Asmth = pm->Asmth;
+    if(ThisTask == 0) {
+        /* Accumulated times, reduced over ranks on the root at the end of each step*/
+        const double pmtime = walltime_accu_max("/PMgrav");
+        const double treetime = walltime_accu_max("/Tree");
+        const double dloga = log(atime / SplitCost.atime);
+        if(SplitCost.atime > 0 && dloga > 0) {
+            const double pmrate = (pmtime - SplitCost.PMTime) / dloga;
+            const double treerate = (treetime - SplitCost.TreeTime) / dloga;
+            double ratio = 1;
+            if(!pm_timestep_set_by_asmth())
+                ratio = 0.9;
+            else if(treerate > 0)
+                ratio = pow(pmrate / (3 * treerate), 0.25);
+            ratio = DMAX(DMIN(ratio, 1.1), 0.9);
+            Asmth = DMAX(DMIN(Asmth * ratio, All.AsmthMax), All.AsmthMin);
+            message(0, "PM time %g tree time %g per unit log a, PM step %s by Asmth. Asmth %g -> %g\n",
+                    pmrate, treerate, pm_timestep_set_by_asmth() ? "set" : "not set", pm->Asmth, Asmth);
+        }
+        SplitCost.PMTime = pmtime;
+        SplitCost.TreeTime = treetime;
+        SplitCost.atime = atime;
+    }
+    MPI_Bcast(&Asmth, 1, MPI_DOUBLE, 0, GadgetComm);
+    if(Asmth == pm->Asmth)
+        return;
+    pm->Asmth = Asmth;
+    gravshort_fill_ntab(All.ShortRangeForceWindowType, Asmth, All.ShortRangeForceWindowPolynomial);
+}
+
 /*Set the global parameters*/
 void
 set_all_global_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         /* Start reading the values */
         param_get_string2(ps, "OutputDir", All.OutputDir, sizeof(All.OutputDir));
@@ -138,7 +226,17 @@ set_all_global_params(ParameterSet * ps)
 
         All.TimeMax = param_get_double(ps, "TimeMax");
         All.Asmth = param_get_double(ps, "Asmth");
+        All.AdaptiveAsmth = param_get_int(ps, "AdaptiveAsmth");
+        All.AsmthMin = param_get_double(ps, "AsmthMin");
+        All.AsmthMax = param_get_double(ps, "AsmthMax");
         All.ShortRangeForceWindowType = (enum ShortRangeForceWindowType) param_get_enum(ps, "ShortRangeForceWindowType");
+        All.ShortRangeForceWindowPolynomial = param_get_int(ps, "ShortRangeForceWindowPolynomial");
+        if(All.AdaptiveAsmth) {
+            if(All.ShortRangeForceWindowType != SHORTRANGE_FORCE_WINDOW_TYPE_ERFC)
+                endrun(1, "AdaptiveAsmth needs ShortRangeForceWindowType = erfc, as the exact window only supports Asmth = 1.5\n");
+            if(All.AsmthMin <= 0 || All.AsmthMax < All.AsmthMin)
+                endrun(1, "AdaptiveAsmth needs 0 < AsmthMin <= AsmthMax, not %g %g\n", All.AsmthMin, All.AsmthMax);
+        }
         All.Nmesh = param_get_int(ps, "Nmesh");
 
         All.CoolingOn = param_get_int(ps, "CoolingOn");
@@ -146,16 +244,25 @@ set_all_global_params(ParameterSet * ps)
         All.DensityOn = param_get_int(ps, "DensityOn");
         All.TreeGravOn = param_get_int(ps, "TreeGravOn");
         All.LightconeOn = param_get_int(ps, "LightconeOn");
+        All.PowerSpectrumTypes = param_get_int(ps, "PowerSpectrumTypes");
         All.HierarchicalGravity = param_get_int(ps, "SplitGravityTimestepsOn");
+        All.DeferDriftOn = param_get_int(ps, "DeferDriftOn");
+        All.HydroSubcycleOn = param_get_int(ps, "HydroSubcycleOn");
         All.FastParticleType = param_get_int(ps, "FastParticleType");
         All.TimeLimitCPU = param_get_double(ps, "TimeLimitCPU");
+        All.MaxNumSteps = param_get_int(ps, "MaxNumSteps");
         All.AutoSnapshotTime = param_get_double(ps, "AutoSnapshotTime");
         All.TimeBetweenSeedingSearch = param_get_double(ps, "TimeBetweenSeedingSearch");
         All.RandomParticleOffset = param_get_double(ps, "RandomParticleOffset");
 
         All.SlotsIncreaseFactor = param_get_double(ps, "SlotsIncreaseFactor");
+        All.SlotsGCFraction = param_get_double(ps, "SlotsGCFraction");
+        All.SlotsVirtualReserveGB = param_get_double(ps, "SlotsVirtualReserveGB");
+        param_get_string2(ps, "SlotsSpillDir", All.SlotsSpillDir, sizeof(All.SlotsSpillDir));
+        All.SlotsSpillTypes = param_get_int(ps, "SlotsSpillTypes");
 
         All.SnapshotWithFOF = param_get_int(ps, "SnapshotWithFOF");
+        All.FOFReusePMTree = param_get_int(ps, "FOFReusePMTree");
 
         All.RandomSeed = param_get_int(ps, "RandomSeed");
 
@@ -184,13 +291,32 @@ set_all_global_params(ParameterSet * ps)
         }
         All.ExcursionSetReionOn = param_get_int(ps,"ExcursionSetReionOn");
         All.UVBGdim = param_get_int(ps, "UVBGdim");
+
+        All.PartialReadTypes = param_get_int(ps, "PartialReadTypes");
+        param_get_string2(ps, "PartialReadBlocks", All.PartialReadBlocks, sizeof(All.PartialReadBlocks));
+        char * Region = param_get_string(ps, "PartialReadRegion");
+        All.PartialReadUseBox = 0;
+        if(Region && strlen(Region) > 0) {
+            double * b = All.PartialReadBox;
+            if(6 != sscanf(Region, "%lg %lg %lg %lg %lg %lg", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]))
+                endrun(1, "PartialReadRegion should be six numbers: xmin ymin zmin xmax ymax zmax, not '%s'\n", Region);
+            All.PartialReadUseBox = 1;
+        }
     }
-    MPI_Bcast(&All, sizeof(All), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&All, sizeof(All), MPI_BYTE, 0, GadgetComm);
 }
 
 int find_last_snapshot(void)
 {
     int RestartSnapNum = find_last_snapnum(All.OutputDir);
+    /* The job may have ended while a checkpoint with a local copy was still being written out*/
+    const int LocalSnapNum = find_local_snapnum(All.OutputDir);
+    if(LocalSnapNum > RestartSnapNum) {
+        if(petaio_local_available(LocalSnapNum))
+            RestartSnapNum = LocalSnapNum;
+        else
+            message(0, "Checkpoint %d has no usable local copy on every rank; ignoring it.\n", LocalSnapNum);
+    }
     message(0, "Last Snapshot number is %d.\n", RestartSnapNum);
     return RestartSnapNum;
 }
@@ -205,6 +331,8 @@ begrun(const int RestartSnapNum, struct header_data * head)
     petapm_module_init(omp_get_max_threads());
     petaio_init();
     walltime_init(&Clocks);
+    /* Cooling tables are read in the background while the snapshot is read*/
+    prefetch_cooling_tables(All.CoolingOn);
 
     *head = petaio_read_header(RestartSnapNum, All.OutputDir, &All.CP);
     /*Set Nmesh to triple the mean grid spacing of the dark matter by default.*/
@@ -220,6 +348,9 @@ begrun(const int RestartSnapNum, struct header_data * head)
         head->neutrinonk = All.Nmesh;
 
     slots_init(All.SlotsIncreaseFactor * PartManager->MaxPart, SlotsManager);
+    slots_set_virtual_reserve(All.SlotsVirtualReserveGB * 1024 * 1024 * 1024, SlotsManager);
+    slots_set_spill(All.SlotsSpillDir, All.SlotsSpillTypes, SlotsManager);
+    slots_set_gc_fraction(All.SlotsGCFraction, SlotsManager);
     /* Enable the slots: stars and BHs are allocated if there are some,
      * or if some will form*/
     if(head->NTotalInit[0] > 0)
@@ -251,15 +382,18 @@ begrun(const int RestartSnapNum, struct header_data * head)
 
     init_cooling_and_star_formation(All.CoolingOn, All.StarformationOn, &All.CP, head->MassTable[0], head->BoxSize, units);
 
-    gravshort_fill_ntab(All.ShortRangeForceWindowType, All.Asmth);
-
-    if(All.LightconeOn)
-        lightcone_init(&All.CP, head->TimeSnapshot, head->UnitLength_in_cm, All.OutputDir);
+    gravshort_fill_ntab(All.ShortRangeForceWindowType, All.Asmth, All.ShortRangeForceWindowPolynomial);
 
     /* Ensure that the timeline runs at least to the current time*/
     if(head->TimeSnapshot > All.TimeMax)
         All.TimeMax = head->TimeSnapshot;
 
+    /* Growth factors and distances are needed from the ICs to today*/
+    init_cosmology_tables(&All.CP, head->TimeIC, All.TimeMax > 1 ? All.TimeMax : 1);
+
+    if(All.LightconeOn)
+        lightcone_init(&All.CP, head->TimeSnapshot, head->UnitLength_in_cm, All.OutputDir);
+
     init_timeline(&All.CP, RestartSnapNum, All.TimeMax, head, All.SnapshotWithFOF);
 
     /* Get the nk and do allocation. */
@@ -306,11 +440,87 @@ check_kick_drift_times(struct part_manager_type * PartManager, inttime_t ti_curr
 }
 #endif
 
+/* Change the performance parameters given, in parameter file syntax, in the HCI reconfigure file.
+ * Called on a PM step before the domain decomposition, where all of them are safe to change.
+ * Returns 1 if the domain needs a full decomposition. Collective: every rank has the same content.*/
+static int
+reconfigure_run(char * content)
+{
+    /* Threads can only be reduced from those at the start: some buffers are sized then*/
+    static int StartThreads = 0;
+    if(!StartThreads)
+        StartThreads = omp_get_max_threads();
+
+    /* Required parameters are nil unless set in the file*/
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "MaxExportBufferMB", REQUIRED, 0, "Largest export buffer of a treewalk, in MB.");
+    param_declare_int(ps, "DomainOverDecompositionFactor", REQUIRED, 0, "");
+    param_declare_double(ps, "ErrTolForceAcc", REQUIRED, 0, "");
+    param_declare_double(ps, "MaxSizeTimestep", REQUIRED, 0, "");
+    param_declare_double(ps, "MinSizeTimestep", REQUIRED, 0, "");
+    param_declare_double(ps, "SlotsIncreaseFactor", REQUIRED, 0, "");
+    param_declare_int(ps, "NumThreads", REQUIRED, 0, "OpenMP threads, at most the number at the start.");
+    int redomain = 0;
+    if(0 != param_parse(ps, content)) {
+        message(0, "HCI: could not parse the reconfigure request, ignoring it.\n");
+        parameter_set_free(ps);
+        return 0;
+    }
+    if(!param_is_nil(ps, "MaxExportBufferMB")) {
+        const int mb = param_get_int(ps, "MaxExportBufferMB");
+        if(mb > 0)
+            treewalk_set_max_export_buffer(mb * 1024L * 1024L);
+        message(0, "HCI: MaxExportBufferMB = %d\n", mb);
+    }
+    if(!param_is_nil(ps, "DomainOverDecompositionFactor")) {
+        DomainParams dp = get_domain_par();
+        const int dodf = param_get_int(ps, "DomainOverDecompositionFactor");
+        if(dodf > 0 && dodf != dp.DomainOverDecompositionFactor) {
+            dp.DomainOverDecompositionFactor = dodf;
+            set_domain_par(dp);
+            /* The incremental rebalance keeps the old top leaves*/
+            redomain = 1;
+        }
+        message(0, "HCI: DomainOverDecompositionFactor = %d\n", dp.DomainOverDecompositionFactor);
+    }
+    if(!param_is_nil(ps, "ErrTolForceAcc")) {
+        struct gravshort_tree_params tp = get_gravshort_treepar();
+        tp.ErrTolForceAcc = param_get_double(ps, "ErrTolForceAcc");
+        set_gravshort_treepar(tp);
+        message(0, "HCI: ErrTolForceAcc = %g\n", tp.ErrTolForceAcc);
+    }
+    if(!param_is_nil(ps, "MaxSizeTimestep") || !param_is_nil(ps, "MinSizeTimestep")) {
+        const double maxstep = param_is_nil(ps, "MaxSizeTimestep") ? -1 : param_get_double(ps, "MaxSizeTimestep");
+        const double minstep = param_is_nil(ps, "MinSizeTimestep") ? -1 : param_get_double(ps, "MinSizeTimestep");
+        set_timestep_pm_bounds(minstep, maxstep);
+        message(0, "HCI: PM timestep bounds min %g max %g (negative is unchanged)\n", minstep, maxstep);
+    }
+    if(!param_is_nil(ps, "SlotsIncreaseFactor")) {
+        SlotsManager->increase = param_get_double(ps, "SlotsIncreaseFactor");
+        message(0, "HCI: SlotsIncreaseFactor = %g\n", SlotsManager->increase);
+    }
+    if(!param_is_nil(ps, "NumThreads")) {
+        int nthreads = param_get_int(ps, "NumThreads");
+        if(nthreads <= 0 || nthreads > StartThreads)
+            nthreads = StartThreads;
+        omp_set_num_threads(nthreads);
+        message(0, "HCI: NumThreads = %d\n", nthreads);
+    }
+    parameter_set_free(ps);
+    return redomain;
+}
+
 /*! This routine contains the main simulation loop that iterates over
  * single timesteps. The loop terminates when the cpu-time limit is
  * reached, when a `stop' file is found in the output directory, or
  * when the simulation ends because we arrived at TimeMax.
  */
+static void
+print_gas_tree_stats(const char * label, const double * v)
+{
+    message(0, "Root hmax: %lg Tree Mean IPS: %lg\n", v[0], v[1] / cbrt(v[2]));
+}
+
 void
 run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data * header)
 {
@@ -328,6 +538,8 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
     PetaPM pm = {0};
     gravpm_init_periodic(&pm, PartManager->BoxSize, All.Asmth, All.Nmesh, All.CP.GravInternal);
+    /* The high resolution mesh around a zoom region, if enabled*/
+    gravpm_init_highres(&pm);
     /*define excursion set PetaPM structs*/
     /*because we need to FFT 3 grids, and we can't separate sets of regions, we need 3 PetaPM structs */
     /*also, we will need different pencils and layouts due to different zero cells*/
@@ -336,9 +548,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
     PetaPM pm_star = {0};
     PetaPM pm_sfr = {0};
     if(All.ExcursionSetReionOn){
-        petapm_init(&pm_mass, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, MPI_COMM_WORLD);
-        petapm_init(&pm_star, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, MPI_COMM_WORLD);
-        petapm_init(&pm_sfr, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, MPI_COMM_WORLD);
+        petapm_init(&pm_mass, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, GadgetComm);
+        petapm_init(&pm_star, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, GadgetComm);
+        petapm_init(&pm_sfr, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, GadgetComm);
+        uvbg_init_pm(&pm_mass);
     }
 
     DomainDecomp ddecomp[1] = {0};
@@ -350,11 +563,16 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
     open_outputfiles(RestartSnapNum, &fds, All.OutputDir, All.BlackHoleOn, All.StarformationOn);
 
     write_cpu_log(NumCurrentTiStep, header->TimeSnapshot, fds.FdCPU, Clocks.ElapsedTime); /* produce some CPU usage info */
+    write_memory_log(NumCurrentTiStep, header->TimeSnapshot, fds.FdMemory);
 
     DriftKickTimes times = init_driftkicktime(ti_init);
 
     double atime = get_atime(times.Ti_Current);
 
+    /* Finish writing out a checkpoint we restarted from its local copy, if the last job could not*/
+    if(RestartSnapNum >= 0 && petaio_local_snapshot() == RestartSnapNum && find_last_snapnum(All.OutputDir) < RestartSnapNum)
+        write_checkpoint(RestartSnapNum, 0, All.MetalReturnOn, atime, &All.CP, All.OutputDir, All.OutputDebugFields);
+
     while(1) /* main loop */
     {
         /* Find next synchronization point and the timebins active during this timestep.
@@ -387,39 +605,60 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         hci_action_init(action); /* init to no action */
 
         int stop = 0;
+        /* Whether the domain must be decomposed from scratch on this PM step*/
+        int redomain = 0;
 
         if(is_PM) {
             /* query HCI requests only on PM step; where kick and drifts are synced */
+            hci_set_pending_write_time(HCI_DEFAULT_MANAGER, petaio_async_pending_time());
+            hci_set_work_forecast(HCI_DEFAULT_MANAGER, timebin_forecast_work_ratio());
             stop = hci_query(HCI_DEFAULT_MANAGER, action);
 
             if(action->type == HCI_TERMINATE) {
                 endrun(0, "Human triggered termination.\n");
             }
+            if(action->reconfigure) {
+                redomain = reconfigure_run(action->reconfigure);
+                myfree(action->reconfigure);
+            }
+            if(action->trace_steps > 0) {
+                char * fname = fastpm_strdup_printf("%s/trace-%06d.json", All.OutputDir, NumCurrentTiStep);
+                walltime_trace_start(fname, action->trace_steps);
+                myfree(fname);
+            }
         }
 
-        /* We need to re-seed the random number table each timestep.
-         * The seed needs to be the same on all processors, and a different
-         * value each timestep. Only the lowest 32 bits are used in the GSL
-         * random number generator. The populated part of the timestep hierarchy
-         * is added to the random seed. The current snapshot is folded into
-         * bits 32 - 23 so that the random tables do not cycle after every snapshot.
-         * We may still cycle after 512 snapshots but that should be far enough apart. */
-        uint64_t seed = All.RandomSeed + (times.Ti_Current >> times.mintimebin) + ((times.Ti_Current >> TIMEBINS) << 23L);
-        message(0, "New step random seed: %ld Ti %lx\n", seed % (1L<<32L), times.Ti_Current);
+        /* We need a new random stream each timestep, the same on all processors.
+         * The step number is the populated part of the timestep hierarchy. The current snapshot is folded into
+         * bits 32 - 23 so that the random streams do not cycle after every snapshot. */
+        const uint64_t randstep = (times.Ti_Current >> times.mintimebin) + ((times.Ti_Current >> TIMEBINS) << 23L);
+        message(0, "New step random stream: %ld Ti %lx\n", randstep % (1L<<32L), times.Ti_Current);
 
         double rel_random_shift[3] = {0};
         if(NumCurrentTiStep > 0 && is_PM  && All.RandomParticleOffset > 0) {
-            update_random_offset(PartManager, rel_random_shift, All.RandomParticleOffset, seed);
+            update_random_offset(PartManager, rel_random_shift, All.RandomParticleOffset, All.RandomSeed, randstep);
         }
 
-        int extradomain = is_timebin_active(times.mintimebin + All.MaxDomainTimeBinDepth, times.Ti_Current);
+        /* With hierarchical gravity the hydro timebins may be shorter than every gravity timebin.
+         * Steps where no gravity timebin is active are hydro sub-cycles: the gravity-only particles are not needed,
+         * so the domain is just maintained for the particles which are drifted.*/
+        const int HydroOnly = All.HydroSubcycleOn && All.HierarchicalGravity && !is_PM &&
+            times.mingravtimebin > 0 && !is_timebin_active(times.mingravtimebin, times.Ti_Current);
+        if(HydroOnly)
+            message(0, "Hydro only step: no gravity timebin is active.\n");
+
+        int extradomain = !HydroOnly && is_timebin_active(times.mintimebin + All.MaxDomainTimeBinDepth, times.Ti_Current);
         /* drift and ddecomp decomposition */
         /* at first step this is a noop */
         if(extradomain || is_PM) {
+            /* The timebin lists are above the domain on the heap. They are rebuilt after the decomposition.*/
+            timebin_lists_free();
             /* Sync positions of all particles */
             drift_all_particles(Ti_Last, times.Ti_Current, &All.CP, rel_random_shift);
-            /* full decomposition rebuilds the domain, needs keys.*/
-            domain_decompose_full(ddecomp);
+            /* full decomposition rebuilds the domain, needs keys.
+             * An incremental rebalance keeps the top tree if it is still good enough.*/
+            if(redomain || domain_rebalance(ddecomp))
+                domain_decompose_full(ddecomp);
         } else {
             /* If it is not a PM step, do a shorter version
              * of the ddecomp decomp which just exchanges particles.
@@ -429,12 +668,28 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             drift.CP = &All.CP;
             drift.ti0 = Ti_Last;
             drift.ti1 = times.Ti_Current;
+            drift.DeferMask = 0;
+            /* With hierarchical gravity the inactive particles are only needed in the gas tree and the black hole trees,
+             * and the DM for the lightcone.*/
+            if(All.DeferDriftOn && All.HierarchicalGravity) {
+                int needmask = GASMASK | BHMASK;
+                if(All.BlackHoleOn)
+                    needmask |= blackhole_dynfric_ngb_treemask(0);
+                if(All.LightconeOn)
+                    needmask |= DMMASK;
+                drift.DeferMask = (ALLMASK) & ~needmask;
+            }
             int needfull = domain_maintain(ddecomp, &drift);
-            if(needfull)
+            if(needfull) {
+                timebin_lists_free();
                 domain_decompose_full(ddecomp);
+            }
         }
         update_lastactive_drift(&times);
 
+        /* Treewalks this step log their statistics with this step number*/
+        treewalk_set_log(fds.FdTreeWalk, NumCurrentTiStep);
+
         ActiveParticles Act = init_empty_active_particles(PartManager);
         build_active_particles(&Act, &times, NumCurrentTiStep, atime, PartManager);
 
@@ -442,11 +697,17 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
          * If so we need to add them to the tree.*/
         int HybridNuTracer = hybrid_nu_tracer(&All.CP, atime);
 
-        MyFloat * GradRho_mag = NULL;
+        /* Only the gas which may be star forming needs the density gradient*/
+        struct sph_grad_rho GradRho = {0};
         if(sfr_need_to_compute_sph_grad_rho())
-            GradRho_mag = (MyFloat *) mymalloc2("SPH_GradRho", sizeof(MyFloat) * SlotsManager->info[0].size);
+            density_grad_rho_alloc(&GradRho, &Act, sfr_grad_rho_min_density(atime));
 
         ForceTree gasTree = {0};
+        /* Black hole dynamical friction can reuse the gas tree if we add its types:
+         * the gas treewalks skip the tree nodes without gas.*/
+        int gasTreeMask = GASMASK | BHMASK;
+        if(All.BlackHoleOn)
+            gasTreeMask |= blackhole_dynfric_gastree_mask();
         /* density() happens before gravity because it also initializes the predicted variables.
         * This ensures that prediction consistently uses the grav and hydro accel from the
         * timestep before this one, which matches Gadget-2/3. It was tested to make a small difference,
@@ -458,24 +719,29 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         {
             /* Just gas. Note that the density() code computes hsml for black holes and gas.
              * However, hsml is the length that encloses NumNgb gas particles, so for density the tree needs only gas.
-             * We add BHs so we can re-use the tree for mergers.
+             * We add BHs so we can re-use the tree for mergers, and stars if dynamic friction can re-use it.
              * No moments (yet). We do need hmax for hydro, but we need to compute hsml first.*/
-            force_tree_rebuild_mask(&gasTree, ddecomp, GASMASK | BHMASK, All.OutputDir);
+            force_tree_rebuild_mask(&gasTree, ddecomp, gasTreeMask, All.OutputDir);
+            gas_tree_alloc_caches(&gasTree);
             walltime_measure("/SPH/Build");
 
             /*Predicted SPH data.*/
             struct sph_pred_data sph_predicted = {0};
             if(All.DensityOn)
-                density(&Act, 1, DensityIndependentSphOn(), All.BlackHoleOn, times, &All.CP, &sph_predicted, GradRho_mag, &gasTree);  /* computes density, and pressure */
+                density(&Act, 1, DensityIndependentSphOn(), All.BlackHoleOn, times, &All.CP, &sph_predicted, &GradRho, &gasTree);  /* computes density, and pressure */
 
             /* adds hydrodynamical accelerations and computes du/dt  */
             if(All.HydroOn) {
-                /* Calculate moments to propagate new hmax up the tree. */
-                force_tree_calc_moments(&gasTree, ddecomp);
+                /* Density has propagated the new hmax of the active particles up the local tree:
+                 * exchange the top-level hmax. On PM steps most particles are active, so just recompute everything.*/
+                if(is_PM)
+                    force_tree_calc_moments(&gasTree, ddecomp);
+                else
+                    force_tree_exchange_hmax(&gasTree, ddecomp);
                 walltime_measure("/SPH/HmaxUpdate");
-                int64_t totnumparticles;
-                MPI_Reduce(&gasTree.NumParticles, &totnumparticles, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-                message(0, "Root hmax: %lg Tree Mean IPS: %lg\n", gasTree.Nodes[gasTree.firstnode].mom.hmax, gasTree.BoxSize / cbrt(totnumparticles));
+                const double treestats[3] = {gasTree.Nodes[gasTree.firstnode].mom.hmax, gasTree.BoxSize, gasTree.NumParticles};
+                const enum DiagOp treeops[3] = {DIAG_MAX, DIAG_MAX, DIAG_SUM};
+                diagnostics_add("GasTree", treestats, treeops, 3, print_gas_tree_stats);
 
                 /***** hydro forces *****/
                 /* In Gadget-4 this is optionally split into two, with the pressure force
@@ -493,7 +759,7 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
             /* Hydro half-kick after hydro force, as not done with the gravity.*/
             if(All.HierarchicalGravity)
-                apply_hydro_half_kick(&Act, &All.CP, &times, atime);
+                apply_hydro_half_kick(&Act, &All.CP, &times, atime, 0);
         }
 
         /* The opening criterion for the gravtree
@@ -513,18 +779,32 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         * for opening angle or short-range timesteps,
         * or include hydro in the opening angle.*/
 
+        /* Will FOF be needed on this step, for black hole seeding or helium reionization?
+         * Nothing on these paths moves the particles before FOF.*/
+        const int PhysicsFOF = is_PM && GasEnabled && ((All.BlackHoleOn && atime >= TimeNextSeedingCheck) ||
+                (during_helium_reionization(1/atime - 1) && need_change_helium_ionization_fraction(atime)) ||
+                 (planned_sync && planned_sync->calc_uvbg && All.ExcursionSetReionOn));
+        /* Or for output?*/
+        const int OutputFOF = is_PM && ((planned_sync && planned_sync->write_fof) || action->write_fof);
+        /* If so, FOF can link with the PM tree instead of building its own.*/
+        ForceTree FOFTree = {0};
+
         if(is_PM)
         {
-            /* Tree freed in PM*/
-            gravpm_force(&pm, ddecomp, &All.CP, atime, units.UnitLength_in_cm, All.OutputDir, header->TimeIC);
-
-            /* compute and output energy statistics if desired. */
-            if(fds.FdEnergy)
-                energy_statistics(fds.FdEnergy, atime, PartManager);
+            if(All.AdaptiveAsmth)
+                adapt_force_split(&pm, atime);
+            /* Tree freed in PM, unless FOF will use it*/
+            gravpm_force(&pm, ddecomp, &All.CP, atime, units.UnitLength_in_cm, All.OutputDir, header->TimeIC,
+                (All.FOFReusePMTree && (PhysicsFOF || OutputFOF)) ? &FOFTree : NULL);
         }
 
-        int64_t totgravactive;
-        MPI_Allreduce(&Act.NumActiveGravity, &totgravactive, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        int64_t totgravactive = 0;
+        if(!HydroOnly)
+            MPI_Allreduce(&Act.NumActiveGravity, &totgravactive, 1, MPI_INT64, MPI_SUM, GadgetComm);
+#ifdef DEBUG
+        else if(Act.NumActiveGravity > 0)
+            endrun(5, "Hydro only step has %ld gravity active particles\n", Act.NumActiveGravity);
+#endif
 
         /* Some temporary memory for accelerations*/
         struct grav_accel_store GravAccel = {0};
@@ -540,44 +820,66 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
                     ForceTree Tree = {0};
                     /* Do a short range pairwise only step if desired*/
                     const double rho0 = All.CP.Omega0 * 3 * All.CP.Hubble * All.CP.Hubble / (8 * M_PI * All.CP.GravInternal);
-                    force_tree_full(&Tree, ddecomp, HybridNuTracer, All.OutputDir);
-                    grav_short_tree(&Act, &pm, &Tree, NULL, rho0, times.Ti_Current);
+                    /* A PM tree kept for FOF has all particles, so is the same tree unless neutrinos are tracers*/
+                    ForceTree * GravTree = &FOFTree;
+                    if(!force_tree_allocated(&FOFTree) || HybridNuTracer) {
+                        force_tree_full(&Tree, ddecomp, HybridNuTracer, All.OutputDir);
+                        GravTree = &Tree;
+                    }
+                    grav_short_tree(&Act, &pm, GravTree, NULL, rho0, times.Ti_Current);
+                    if(force_tree_allocated(&Tree))
+                        force_tree_free(&Tree);
             }
         }
         message(0, "Forces computed.\n");
 
+        /* Energy statistics of a PM step are summed by its closing PM half-kick*/
+        struct EnergySums EnergyStats;
+        struct EnergySums * energy = NULL;
+        if(is_PM && energy_statistics_on()) {
+            energy_statistics_begin(&EnergyStats, atime);
+            energy = &EnergyStats;
+        }
+
         if(!All.HierarchicalGravity){
             /* Do both short-range gravity and hydro kicks.
              * Need a scale factor for velocity limiter.
              * For hierarchical gravity the short-range kick is done above.
-             * Synchronises TiKick and TiDrift for the active particles. */
-            apply_half_kick(&Act, &All.CP, &times, atime);
+             * Synchronises TiKick and TiDrift for the active particles.
+             * On a PM step this also does the PM kick. */
+            apply_half_kick(&Act, &All.CP, &times, atime, is_PM, energy);
         }
 
         /* Sets Ti_Kick in the times structure.*/
         update_kick_times(&times);
 
-        if(is_PM) {
-            apply_PM_half_kick(&All.CP, &times);
+        if(is_PM && All.HierarchicalGravity) {
+            apply_PM_half_kick(&All.CP, &times, energy);
         }
 
+        /* Output energy statistics if desired, summed by the PM half-kick once the velocities are synchronised.*/
+        if(energy)
+            energy_statistics(fds.FdEnergy, energy);
+
         /* get syncpoint variables for Excursion set (here) and snapshot saving (later) */
 
         int WriteSnapshot = 0;
         int WriteFOF = 0;
         int CalcUVBG = 0;
         int WritePlane = 0;
+        int WritePower = 0;
 
         if(planned_sync) {
             WriteSnapshot |= planned_sync->write_snapshot;
             WriteFOF |= planned_sync->write_fof;
             CalcUVBG |= planned_sync->calc_uvbg;
             WritePlane |= planned_sync->write_plane;
+            WritePower |= planned_sync->write_power;
         }
 
         RandTable rnd = {0};
         if(GasEnabled || All.LightconeOn)
-            rnd = set_random_numbers(seed, RNDTABLE);
+            rnd = set_random_numbers(All.RandomSeed, randstep);
 
         /* Cooling and extra physics show up as a source term in the evolution equations.
          * Formally you can write the structure of the partial differential equations:
@@ -600,8 +902,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
          */
         if(GasEnabled)
         {
-            if(!gasTree.tree_allocated_flag)
-                force_tree_rebuild_mask(&gasTree, ddecomp, GASMASK | BHMASK, All.OutputDir);
+            if(!gasTree.tree_allocated_flag) {
+                force_tree_rebuild_mask(&gasTree, ddecomp, gasTreeMask, All.OutputDir);
+                gas_tree_alloc_caches(&gasTree);
+            }
 
             /* Do this before sfr and bh so the gas hsml always contains DesNumNgb neighbours.*/
             if(All.MetalReturnOn) {
@@ -614,14 +918,14 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
              * so ensure we do not have garbage present when we call this.
              * Also a good idea to only run it on a PM step.
              * This does not break the tree because the new black holes do not move or change mass, just type.*/
-            if (is_PM && ((All.BlackHoleOn && atime >= TimeNextSeedingCheck) ||
-                (during_helium_reionization(1/atime - 1) && need_change_helium_ionization_fraction(atime)) ||
-                 (CalcUVBG && All.ExcursionSetReionOn))) {
+            if (PhysicsFOF) {
 
-                /* Seeding: builds its own tree.*/
-                FOFGroups fof = fof_fof(ddecomp, 0, MPI_COMM_WORLD);
+                /* Seeding: builds its own tree, unless the PM tree was kept.*/
+                /* If the groups are only used for seeding, skip the other group properties*/
+                const int SeedOnly = !during_helium_reionization(1/atime - 1) && !All.ExcursionSetReionOn;
+                FOFGroups fof = fof_fof(ddecomp, SeedOnly ? FOF_SEED_ONLY : 0, &FOFTree, GadgetComm);
                 if(All.BlackHoleOn && atime >= TimeNextSeedingCheck) {
-                    fof_seed(&fof, &Act, atime, &rnd, MPI_COMM_WORLD);
+                    fof_seed(&fof, &Act, atime, &rnd, GadgetComm);
                     TimeNextSeedingCheck = atime * All.TimeBetweenSeedingSearch;
                 }
 
@@ -639,8 +943,15 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
                 fof_finish(&fof);
             }
 
-            if(is_PM && All.CoolingOn)
-                winds_find_vel_disp(&Act, atime, hubble_function(&All.CP, atime), &All.CP, &times, ddecomp);
+            /* DM tree shared by the wind velocity dispersions and the black hole neighbour walk on this step.
+             * Built by the first of them which needs it, with the types of both.*/
+            ForceTree DMTree = {0};
+            if(is_PM && All.CoolingOn) {
+                int DMTreeMask = DMMASK;
+                if(All.BlackHoleOn)
+                    DMTreeMask |= blackhole_dynfric_ngb_treemask(1);
+                winds_find_vel_disp(&Act, atime, hubble_function(&All.CP, atime), &All.CP, &times, ddecomp, &DMTree, DMTreeMask);
+            }
             /* Note that the tree here may be freed, if we are not a gravity-active timestep,
              * or if we are a PM step.*/
             /* If we didn't build a tree for gravity, we need to build one in BH or in winds.
@@ -653,11 +964,13 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             if(All.BlackHoleOn) {
                 /*Get a new BH details file if the current one is too large.*/
                 rotate_bhdetails_file(&fds, All.OutputDir, RestartSnapNum);
-                blackhole(&Act, atime, &All.CP, &gasTree, ddecomp, &times, &rnd, units, fds.FdBlackHoles, fds.FdBlackholeDetails, &fds.TotalBHDetailsBytesWritten);
+                blackhole(&Act, atime, &All.CP, &gasTree, &DMTree, ddecomp, &times, &rnd, units, fds.FdBlackHoles, fds.FdBlackholeDetails, &fds.TotalBHDetailsBytesWritten);
             }
+            /* Star formation reallocates the slots and frees the gas tree caches, which are below the DM tree.*/
+            force_tree_free(&DMTree);
             /**** radiative cooling and star formation *****/
             if(All.CoolingOn)
-                cooling_and_starformation(&Act, atime, get_dloga_for_bin(times.mintimebin, times.Ti_Current), &gasTree, GravAccel, ddecomp, &All.CP, GradRho_mag, &rnd, fds.FdSfr);
+                cooling_and_starformation(&Act, atime, get_dloga_for_bin(times.mintimebin, times.Ti_Current), &gasTree, GravAccel, ddecomp, &All.CP, &GradRho, &rnd, fds.FdSfr);
         }
         /* We don't need this timestep's tree anymore.*/
         force_tree_free(&gasTree);
@@ -665,10 +978,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         /* Compute the list of particles that cross a lightcone and write it to disc.
          * This should happen when kick and drift times are synchronised.*/
         if(All.LightconeOn)
-            lightcone_compute(atime, PartManager->BoxSize, &All.CP, Ti_Last, Ti_Next, &rnd);
+            lightcone_compute(atime, PartManager->BoxSize, &All.CP, Ti_Last, Ti_Next, ddecomp, &rnd);
 
         /* Now done with random numbers*/
-        if(rnd.Table)
+        if(rnd.Seeded)
             free_random_numbers(&rnd);
         /* If a snapshot is requested, write it.         *
          * We only attempt to output on sync points. This is the only chance where all variables are
@@ -680,28 +993,42 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             WriteFOF |= action->write_fof;
             WritePlane |= action->write_plane;
         }
+        /* Write out the buffered lightcone before snapshots and at the end of the run*/
+        if(All.LightconeOn && (WriteSnapshot || !next_sync || stop))
+            lightcone_flush(atime, !next_sync || stop);
+
         if(WriteSnapshot || WriteFOF) {
             /* Get a new snapshot*/
             SnapshotFileCount++;
             /* The accel may have created garbage -- collect them before writing a snapshot.
              * If we do collect, reset active list size.*/
             int compact[6] = {0};
-            if(slots_gc(compact, PartManager, SlotsManager))
+            if(slots_gc(compact, PartManager, SlotsManager)) {
                 Act.NumActiveParticle = PartManager->NumPart;
+                /* The particles have moved, so the kept tree is no longer valid*/
+                if(force_tree_allocated(&FOFTree))
+                    force_tree_free(&FOFTree);
+            }
         }
         FOFGroups fof = {0};
         if(WriteFOF) {
             /* Compute FOF and assign GrNr so it can be written in checkpoint.*/
-            fof = fof_fof(ddecomp, 1, MPI_COMM_WORLD);
+            fof = fof_fof(ddecomp, FOF_STORE_GRNR, &FOFTree, GadgetComm);
         }
+        /* Group is allocated at the top of the heap, so the tree can be freed now*/
+        if(force_tree_allocated(&FOFTree))
+            force_tree_free(&FOFTree);
 
         /* WriteFOF just reminds the checkpoint code to save GroupID*/
-        if(WriteSnapshot)
+        if(WriteSnapshot) {
+            /* Buffered BH details are written with the snapshot*/
+            bh_details_flush();
             write_checkpoint(SnapshotFileCount, WriteFOF, All.MetalReturnOn, atime, &All.CP, All.OutputDir, All.OutputDebugFields);
+        }
 
         /* Save FOF tables after checkpoint so that if there is a FOF save bug we have particle tables available to debug it*/
         if(WriteFOF) {
-            int domain_needed = fof_save_groups(&fof, All.OutputDir, All.FOFFileBase, SnapshotFileCount, &All.CP, atime, header->MassTable, All.MetalReturnOn, MPI_COMM_WORLD);
+            int domain_needed = fof_save_groups(&fof, All.OutputDir, All.FOFFileBase, SnapshotFileCount, &All.CP, atime, header->MassTable, All.MetalReturnOn, GadgetComm);
             /* In case we need to do a second exchange to get back to a sensible compact mass distribution*/
             fof_finish(&fof);
             if(domain_needed) {
@@ -719,21 +1046,34 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
         /* Write the potential planes*/
         if(WritePlane) {
-#ifdef USE_CFITSIO
             write_plane(planned_sync->plane_snapnum, atime, &All.CP, All.OutputDir, units.UnitVelocity_in_cm_per_s, units.UnitLength_in_cm);
             walltime_measure("/Lensing");
-#else
-            endrun(0, "Plane writing requested but FITSIO not enabled.\n");
-#endif
         }
 
+        /* Measure the power spectra of each particle type*/
+        if(WritePower)
+            gravpm_power_spectra(&pm, ddecomp, &All.CP, atime, units.UnitLength_in_cm, All.OutputDir, All.PowerSpectrumTypes);
+
 #ifdef DEBUG
         check_kick_drift_times(PartManager, times.Ti_Current);
 #endif
         write_cpu_log(NumCurrentTiStep, atime, fds.FdCPU, Clocks.ElapsedTime);    /* produce some CPU usage info */
+        /* Reduce the diagnostics of this step together. They are printed at the next flush.*/
+        diagnostics_flush();
+        /* The next sync point which writes a snapshot*/
+        SyncPoint * next_snap = next_sync;
+        while(next_snap && !next_snap->write_snapshot)
+            next_snap = find_next_sync_point(next_snap->ti);
+        write_status_file(All.OutputDir, NumCurrentTiStep, atime, All.TimeMax, next_snap ? next_snap->a : 0, &Clocks);
+        write_memory_log(NumCurrentTiStep, atime, fds.FdMemory);
 
         report_memory_usage("RUN");
 
+        if(All.MaxNumSteps > 0 && NumCurrentTiStep + 1 >= All.MaxNumSteps) {
+            message(0, "Stopping: completed MaxNumSteps = %d steps.\n", All.MaxNumSteps);
+            break;
+        }
+
         if(!next_sync || stop) {
             /* out of sync points, or a requested stop, the run has finally finished! Yay.*/
             if(action->type == HCI_TIMEOUT)
@@ -747,12 +1087,16 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
          * now that we know they have synched TiKick and TiDrift,
          * and advance the PM timestep.*/
         int badtimestep=0;
+        /* Whether the PM half-kick still needs doing*/
+        int PMkick = is_PM;
         if(!All.HierarchicalGravity) {
             const double asmth = pm.Asmth * PartManager->BoxSize / pm.Nmesh;
-            badtimestep = find_timesteps(&Act, &times, atime, All.FastParticleType, &All.CP, asmth, NumCurrentTiStep == 0);
+            find_timesteps(&Act, &times, atime, All.FastParticleType, &All.CP, asmth, NumCurrentTiStep == 0);
             /* Update velocity and ti_kick to the new step, with the newly computed step size. Unsyncs ti_kick and ti_drift.
-             * Both hydro and gravity are kicked.*/
-            apply_half_kick(&Act, &All.CP, &times, atime);
+             * Both hydro and gravity are kicked. The kick overlaps the global reduction of the timesteps.*/
+            apply_half_kick(&Act, &All.CP, &times, atime, PMkick, NULL);
+            PMkick = 0;
+            badtimestep = find_timesteps_wait(&times);
         } else {
             /* This finds the gravity timesteps, computes the gravitational forces
              * and kicks the particles on the gravitational timeline.
@@ -765,8 +1109,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
                 /* Find hydro timesteps and apply the hydro kick, unsyncing the drift and kick times. */
                 badtimestep += find_hydro_timesteps(&Act, &times, atime, &All.CP, NumCurrentTiStep == 0);
                 /* If there is no hydro kick to do we still need to update the kick times.*/
-                if(!badtimestep)
-                    apply_hydro_half_kick(&Act, &All.CP, &times, atime);
+                if(!badtimestep) {
+                    apply_hydro_half_kick(&Act, &All.CP, &times, atime, PMkick);
+                    PMkick = 0;
+                }
             }
         }
         if(badtimestep) {
@@ -778,24 +1124,31 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
 
         /* Delayed here because it is allocated high before GravAccel*/
-        if(GradRho_mag) {
-            myfree(GradRho_mag);
-            GradRho_mag = NULL;
-        }
+        density_grad_rho_free(&GradRho);
 
         /* Set ti_kick in the time structure*/
         update_kick_times(&times);
 
-        if(is_PM) {
-            apply_PM_half_kick(&All.CP, &times);
+        if(PMkick) {
+            apply_PM_half_kick(&All.CP, &times, NULL);
         }
 
         /* We can now free the active list: the new step have new active particles*/
         free_active_particles(&Act);
 
+        walltime_trace_step();
         NumCurrentTiStep++;
     }
+    /* Write the trace if the run stopped while tracing*/
+    walltime_trace_finish();
+    /* Print the diagnostics still being reduced*/
+    diagnostics_finish();
 
+    timebin_lists_free();
+    /* Finish any checkpoint still being written in the background*/
+    wait_checkpoint();
+
+    treewalk_set_log(NULL, NumCurrentTiStep);
     close_outputfiles(&fds);
 }
 
@@ -820,33 +1173,85 @@ runfof(const int RestartSnapNum, const inttime_t Ti_Current, const struct header
     /* Regenerate the star formation rate for the FOF table.*/
     if(All.StarformationOn) {
         ActiveParticles Act = init_empty_active_particles(PartManager);
-        MyFloat * GradRho = NULL;
+        struct sph_grad_rho GradRho = {0};
         if(sfr_need_to_compute_sph_grad_rho()) {
             ForceTree gasTree = {0};
-            GradRho = (MyFloat *) mymalloc2("SPH_GradRho", sizeof(MyFloat) * 3 * SlotsManager->info[0].size);
+            density_grad_rho_alloc(&GradRho, &Act, sfr_grad_rho_min_density(header->TimeSnapshot));
             /*Allocate the memory for predicted SPH data.*/
             struct sph_pred_data sph_predicted = {0};
             force_tree_rebuild_mask(&gasTree, ddecomp, GASMASK, All.OutputDir);
             /* computes GradRho with a treewalk. No hsml update as we are reading from a snapshot.*/
-            density(&Act, 0, 0, All.BlackHoleOn, times, &All.CP, &sph_predicted, GradRho, &gasTree);
+            density(&Act, 0, 0, All.BlackHoleOn, times, &All.CP, &sph_predicted, &GradRho, &gasTree);
             force_tree_free(&gasTree);
             slots_free_sph_pred_data(&sph_predicted);
         }
         ForceTree Tree = {0};
         struct grav_accel_store gg = {0};
         /* Cooling is just for the star formation rate, so does not actually use the random table*/
-        RandTable rnd = set_random_numbers(All.RandomSeed, RNDTABLE);
-        cooling_and_starformation(&Act, header->TimeSnapshot, 0, &Tree, gg, ddecomp, &All.CP, GradRho, &rnd, NULL);
+        RandTable rnd = set_random_numbers(All.RandomSeed, 0);
+        cooling_and_starformation(&Act, header->TimeSnapshot, 0, &Tree, gg, ddecomp, &All.CP, &GradRho, &rnd, NULL);
         free_random_numbers(&rnd);
 
-        if(GradRho)
-            myfree(GradRho);
+        density_grad_rho_free(&GradRho);
     }
-    FOFGroups fof = fof_fof(ddecomp, 1, MPI_COMM_WORLD);
-    fof_save_groups(&fof, All.OutputDir, All.FOFFileBase, RestartSnapNum, &All.CP, header->TimeSnapshot, header->MassTable, All.MetalReturnOn, MPI_COMM_WORLD);
+    FOFGroups fof = fof_fof(ddecomp, FOF_STORE_GRNR, NULL, GadgetComm);
+    fof_save_groups(&fof, All.OutputDir, All.FOFFileBase, RestartSnapNum, &All.CP, header->TimeSnapshot, header->MassTable, All.MetalReturnOn, GadgetComm);
     fof_finish(&fof);
 }
 
+/* Read part of a snapshot, selected by the PartialRead parameters, and write it out as a new snapshot.
+ * Only the selected particles are loaded, so this works for snapshots too large to read whole.*/
+void
+runsubset(const int RestartSnapNum)
+{
+    petaio_init();
+    walltime_init(&Clocks);
+    if(RestartSnapNum < 0)
+        endrun(0, "Need a snapshot number to take a subset of.\n");
+
+    struct header_data head = petaio_read_header(RestartSnapNum, All.OutputDir, &All.CP);
+    const struct UnitSystem units = get_unitsystem(head.UnitLength_in_cm, head.UnitMass_in_g, head.UnitVelocity_in_cm_per_s);
+    init_cosmology(&All.CP, head.TimeIC, units);
+
+    slots_init(All.SlotsIncreaseFactor * PartManager->MaxPart, SlotsManager);
+    slots_set_virtual_reserve(All.SlotsVirtualReserveGB * 1024 * 1024 * 1024, SlotsManager);
+    slots_set_spill(All.SlotsSpillDir, All.SlotsSpillTypes, SlotsManager);
+    if(head.NTotal[0] > 0)
+        slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    if(head.NTotal[4] > 0)
+        slots_set_enabled(4, sizeof(struct star_particle_data), SlotsManager);
+    if(head.NTotal[5] > 0)
+        slots_set_enabled(5, sizeof(struct bh_particle_data), SlotsManager);
+
+    /* Split the block list at the commas*/
+    char blocklist[sizeof(All.PartialReadBlocks)];
+    strncpy(blocklist, All.PartialReadBlocks, sizeof(blocklist));
+    const char * blocks[128] = {0};
+    int nblocks = 0;
+    char * token;
+    for(token = strtok(blocklist, ", "); token && nblocks < 127; token = strtok(NULL, ", "))
+        blocks[nblocks++] = token;
+
+    struct petaio_read_filter filter = {0};
+    filter.TypeMask = All.PartialReadTypes;
+    filter.Blocks = nblocks > 0 ? blocks : NULL;
+    filter.UseBox = All.PartialReadUseBox;
+    int k;
+    for(k = 0; k < 3; k++) {
+        filter.BoxMin[k] = All.PartialReadBox[k];
+        filter.BoxMax[k] = All.PartialReadBox[k+3];
+    }
+    petaio_read_snapshot_partial(RestartSnapNum, All.OutputDir, &All.CP, &head, PartManager, SlotsManager, &filter);
+
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable, 0, All.MetalReturnOn);
+    petaio_filter_io_blocks(&IOTable, &filter);
+    char * fname = fastpm_strdup_printf("%s/SUBSET_%03d", All.OutputDir, RestartSnapNum);
+    petaio_save_snapshot(fname, &IOTable, 1, head.TimeSnapshot, &All.CP);
+    destroy_io_blocks(&IOTable);
+    myfree(fname);
+}
+
 void
 runpower(const struct header_data * header)
 {
@@ -856,5 +1261,5 @@ runpower(const struct header_data * header)
     /* ... read in initial model */
     domain_decompose_full(ddecomp);	/* do initial domain decomposition (gives equal numbers of particles) */
     /*PM needs a tree*/
-    gravpm_force(&pm, ddecomp, &All.CP, header->TimeSnapshot, header->UnitLength_in_cm, All.OutputDir, header->TimeSnapshot);
+    gravpm_force(&pm, ddecomp, &All.CP, header->TimeSnapshot, header->UnitLength_in_cm, All.OutputDir, header->TimeSnapshot, NULL);
 }
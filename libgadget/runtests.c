@@ -37,8 +37,8 @@ double copy_and_mean_accn(double (* PairAccn)[3])
         }
     }
     int64_t tot_npart;
-    MPI_Allreduce(&PartManager->NumPart, &tot_npart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &meanacc, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&PartManager->NumPart, &tot_npart, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &meanacc, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
     meanacc/= (tot_npart*3.);
     return meanacc;
 }
@@ -79,12 +79,12 @@ void check_accns(double * meanerr_tot, double * maxerr_tot, double * meanangle_t
             maxerr = err;
         }
     }
-    MPI_Allreduce(&meanerr, meanerr_tot, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&maxerr, maxerr_tot, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
-    MPI_Allreduce(&meanangle, meanangle_tot, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&maxangle, maxangle_tot, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(&meanerr, meanerr_tot, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(&maxerr, maxerr_tot, 1, MPI_DOUBLE, MPI_MAX, GadgetComm);
+    MPI_Allreduce(&meanangle, meanangle_tot, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(&maxangle, maxangle_tot, 1, MPI_DOUBLE, MPI_MAX, GadgetComm);
     int64_t tot_npart;
-    MPI_Allreduce(&PartManager->NumPart, &tot_npart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&PartManager->NumPart, &tot_npart, 1, MPI_INT64, MPI_SUM, GadgetComm);
     *meanerr_tot /= (tot_npart);
     *meanangle_tot /= (tot_npart);
 }
@@ -106,17 +106,16 @@ run_gravity_test(int RestartSnapNum, Cosmology * CP, const double Asmth, const i
     gravpm_init_periodic(pm, PartManager->BoxSize, Asmth, Nmesh, CP->GravInternal);
 
     int NTask;
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_size(GadgetComm, &NTask);
 
     DriftKickTimes times = init_driftkicktime(Ti_Current);
     /* All particles are active*/
     ActiveParticles Act = init_empty_active_particles(PartManager);
     build_active_particles(&Act, &times, 0, header->TimeSnapshot, PartManager);
 
-    gravpm_force(pm, ddecomp, CP, header->TimeSnapshot, header->UnitLength_in_cm, OutputDir, header->TimeIC);
-
+    /* Reuse the PM tree for the short-range force*/
     ForceTree Tree = {0};
-    force_tree_full(&Tree, ddecomp, 0, OutputDir);
+    gravpm_force(pm, ddecomp, CP, header->TimeSnapshot, header->UnitLength_in_cm, OutputDir, header->TimeIC, &Tree);
 
     struct gravshort_tree_params origtreeacc = get_gravshort_treepar();
     /* Reset to normal tree */
@@ -179,6 +178,19 @@ run_gravity_test(int RestartSnapNum, Cosmology * CP, const double Asmth, const i
 
     const double defaultmeanerr = meanerr;
     const double defaultmaxerr = maxerr;
+    /* This checks the bucketed tree walk. Nodes are opened if any particle in the bucket would open them,
+     * so it should be at least as accurate as the default walk.*/
+    treeacc.BucketWalk = 1;
+    set_gravshort_treepar(treeacc);
+    grav_short_tree(&Act, pm, &Tree, NULL, rho0, times.Ti_Current);
+    grav_short_tree(&Act, pm, &Tree, NULL, rho0, times.Ti_Current);
+    check_accns(&meanerr,&maxerr,&meanangle, &maxangle, PairAccn);
+    message(0, "Force error, bucketed tree walk. max : %g mean: %g angle %g max angle %g\n", maxerr, meanerr, meanangle, maxangle);
+
+    if(meanerr > defaultmeanerr * 1.01)
+        endrun(2, "Bucketed tree walk less accurate than default: %g > %g\n", meanerr, defaultmeanerr);
+    treeacc.BucketWalk = 0;
+
     /* This checks the tree against a larger Rcut.*/
     treeacc.Rcut = 9.5;
     set_gravshort_treepar(treeacc);
@@ -200,8 +212,7 @@ run_gravity_test(int RestartSnapNum, Cosmology * CP, const double Asmth, const i
     petapm_destroy(pm);
 
     gravpm_init_periodic(pm, PartManager->BoxSize, Asmth, Nmesh/2., CP->GravInternal);
-    gravpm_force(pm, ddecomp, CP, header->TimeSnapshot, header->UnitLength_in_cm, OutputDir, header->TimeIC);
-    force_tree_full(&Tree, ddecomp, 0, OutputDir);
+    gravpm_force(pm, ddecomp, CP, header->TimeSnapshot, header->UnitLength_in_cm, OutputDir, header->TimeIC, &Tree);
     set_gravshort_treepar(treeacc);
     grav_short_tree(&Act, pm, &Tree, NULL, rho0, times.Ti_Current);
     grav_short_tree(&Act, pm, &Tree, NULL, rho0, times.Ti_Current);
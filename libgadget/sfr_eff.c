@@ -24,6 +24,8 @@
 #include "physconst.h"
 #include "sfr_eff.h"
 #include "cooling.h"
+#include "cooling_rates.h"
+#include "cooling_qso_lightup.h"
 #include "slotsmanager.h"
 #include "walltime.h"
 #include "winds.h"
@@ -113,7 +115,8 @@ struct sfr_eeqos_data
 static struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_particle_data * sph, double dtime, struct UVBG *local_uvbg, const double redshift, const double a3inv);
 
 /*Cooling only: no star formation*/
-static void cooling_direct(int i, const double redshift, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG);
+static int cooling_direct_setup(int i, const double redshift, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG, struct CoolingBatch * cool);
+static void cooling_direct_flush(const int * index, struct CoolingBatch * cool, const int n, const double redshift, const double a3inv);
 
 static void cooling_relaxed(int i, double dtime, struct UVBG * local_uvbg, const double redshift, const double a3inv, struct sfr_eeqos_data sfr_data, const struct UVBG * const GlobalUVBG);
 
@@ -122,11 +125,13 @@ static int add_new_particle_to_active(const int parent, const int child, ActiveP
 static int copy_gravaccel_new_particle(const int parent, const int child, MyFloat (* GravAccel)[3], int64_t nstoredgravaccel);
 
 static int make_particle_star(int child, int parent, int placement, double Time);
-static int starformation(int i, double *localsfr, MyFloat * sm_out, MyFloat * GradRho, const double redshift, const double a3inv, const double hubble, const double GravInternal, const struct UVBG * const GlobalUVBG, const RandTable * const rnd);
+/* Returned by starformation when a new star particle is to be split off the gas particle*/
+#define SPAWN_STAR (-2)
+static int starformation(int i, double *localsfr, MyFloat * sm_out, const struct sph_grad_rho * GradRho, const double redshift, const double a3inv, const double hubble, const double GravInternal, const struct UVBG * const GlobalUVBG, const RandTable * const rnd);
 static int quicklyastarformation(int i, const double a3inv, const RandTable * const rnd);
 static double get_sfr_factor_due_to_selfgravity(int i, const double atime, const double a3inv, const double hubble, const double GravInternal);
-static double get_sfr_factor_due_to_h2(int i, MyFloat * GradRho_mag, const double atime);
-static double get_starformation_rate_full(int i, MyFloat * GradRho, struct sfr_eeqos_data sfr_data, const double atime, const double a3inv, const double hubble, const double GravInternal);
+static double get_sfr_factor_due_to_h2(int i, const struct sph_grad_rho * GradRho, const double atime);
+static double get_starformation_rate_full(int i, const struct sph_grad_rho * GradRho, struct sfr_eeqos_data sfr_data, const double atime, const double a3inv, const double hubble, const double GravInternal);
 static double get_egyeff(double redshift, double dens, struct UVBG * uvbg);
 static double find_star_mass(int i, const double avg_baryon_mass);
 /*Get enough memory for new star slots. This may be excessively slow! Don't do it too often.*/
@@ -143,7 +148,7 @@ static double entropy_to_u(const double density, const double a3inv)
 void set_sfr_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         /*Star formation parameters*/
         sfr_params.StarformationCriterion = (enum StarformationCriterion) param_get_enum(ps, "StarformationCriterion");
@@ -177,12 +182,12 @@ void set_sfr_params(ParameterSet * ps)
         param_get_string2(ps, "MetalCoolFile", sfr_params.MetalCoolFile, sizeof(sfr_params.MetalCoolFile));
         param_get_string2(ps, "ReionHistFile", sfr_params.ReionHistFile, sizeof(sfr_params.ReionHistFile));
     }
-    MPI_Bcast(&sfr_params, sizeof(struct SFRParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&sfr_params, sizeof(struct SFRParams), MPI_BYTE, 0, GadgetComm);
 }
 
 /* cooling and star formation routine.*/
 void
-cooling_and_starformation(ActiveParticles * act, double Time, double dloga, ForceTree * tree, struct grav_accel_store GravAccel, DomainDecomp * ddecomp, Cosmology *CP, MyFloat * GradRho, RandTable * rnd, FILE * FdSfr)
+cooling_and_starformation(ActiveParticles * act, double Time, double dloga, ForceTree * tree, struct grav_accel_store GravAccel, DomainDecomp * ddecomp, Cosmology *CP, const struct sph_grad_rho * GradRho, RandTable * rnd, FILE * FdSfr)
 {
     /*This is a queue for the new stars and their parents, so we can reallocate the slots after the main cooling loop.*/
     gadget_thread_arrays NewStarThread = {0}, NewParentThread = {0}, MaybeWindThread = {0};
@@ -208,15 +213,21 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
     /* Get the global UVBG for this redshift. */
     const double redshift = 1./Time - 1;
     struct UVBG GlobalUVBG = get_global_UVBG(redshift);
+    /* Tabulate the cooling rates for this redshift, if enabled*/
+    update_cooling_table(redshift, &GlobalUVBG);
     double sum_sm = 0, sum_mass_stars = 0, localsfr = 0;
 
     /* First decide which stars are cooling and which starforming. If star forming we add them to a list.
      * Note the dynamic scheduling: individual particles may have very different loop iteration lengths.
-     * Cooling is much slower than sfr. I tried splitting it into a separate loop instead, but this was faster.*/
+     * Cooling is much slower than sfr. I tried splitting it into a separate loop instead, but this was faster.
+     * Cooling particles are buffered per thread and cooled COOLING_BLOCK at a time.*/
     #pragma omp parallel reduction(+:localsfr) reduction(+: sum_sm) reduction(+:sum_mass_stars)
     {
         int i;
         const int tid = omp_get_thread_num();
+        struct CoolingBatch cool[COOLING_BLOCK];
+        int coolindex[COOLING_BLOCK];
+        int ncool = 0;
         #pragma omp for schedule(static)
         for(i=0; i < nactive; i++)
         {
@@ -247,10 +258,14 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
                     sm = P[p_i].Mass;
                 } else {
                     newstar = starformation(p_i, &localsfr, &sm, GradRho, redshift, a3inv, hubble, CP->GravInternal, &GlobalUVBG, rnd);
-                    sum_sm += P[p_i].Mass * (1 - exp(-sm/P[p_i].Mass));
+                    /* The mass left in the gas particle once the star is split off*/
+                    double gasmass = P[p_i].Mass;
+                    if(newstar == SPAWN_STAR)
+                        gasmass -= find_star_mass(p_i, sfr_params.avg_baryon_mass);
+                    sum_sm += gasmass * (1 - exp(-sm/gasmass));
                 }
                 /*Add this particle to the stellar conversion queue if necessary.*/
-                if(newstar >= 0) {
+                if(newstar >= 0 || newstar == SPAWN_STAR) {
                     NewStarThread.srcs[tid][NewStarThread.sizes[tid]] = newstar;
                     NewStarThread.sizes[tid]++;
                     NewParentThread.srcs[tid][NewParentThread.sizes[tid]] = p_i;
@@ -258,15 +273,21 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
                 }
                 /* Add this particle to the queue for consideration to spawn a wind.
                  * Only for subgrid winds. */
-                if(MaybeWindThread.sizes && newstar < 0) {
+                if(MaybeWindThread.sizes && newstar == -1) {
                     MaybeWindThread.srcs[tid][MaybeWindThread.sizes[tid]] = p_i;
                     StellarMass[P[p_i].PI] = sm;
                     MaybeWindThread.sizes[tid]++;
                 }
             }
-            else
-                cooling_direct(p_i, redshift, a3inv, hubble, &GlobalUVBG);
+            else if(cooling_direct_setup(p_i, redshift, a3inv, hubble, &GlobalUVBG, &cool[ncool])) {
+                coolindex[ncool++] = p_i;
+                if(ncool == COOLING_BLOCK) {
+                    cooling_direct_flush(coolindex, cool, ncool, redshift, a3inv);
+                    ncool = 0;
+                }
+            }
         }
+        cooling_direct_flush(coolindex, cool, ncool, redshift, a3inv);
     }
 
     report_memory_usage("SFR");
@@ -284,7 +305,7 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
 
     int * NewStars = NewStarThread.dest;
     int * NewParents = NewParentThread.dest;
-    int64_t NumNewStar = 0;
+    int64_t NumNewStar = 0, NumSpawn = 0;
 
     /*Merge step for the queue.*/
     if(NewStars) {
@@ -294,22 +315,35 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
             endrun(3,"%lu new stars, but %lu new parents!\n",NumNewStar, NumNewParent);
         /*Shrink star memory as we keep it for the wind model*/
         NewStars = (int *) myrealloc(NewStars, sizeof(int) * NumNewStar);
+        /* The spawned stars go after the existing particles, in the order of their parents.
+         * They are split off when the stars are made, so the decision loop does not contend for NumPart.
+         * NumPart is only raised once they are initialised: until then the slot free list and
+         * sfr_reserve_slots must not see them.*/
+        int64_t i;
+        for(i = 0; i < NumNewStar; i++)
+            if(NewStars[i] == SPAWN_STAR)
+                NewStars[i] = PartManager->NumPart + NumSpawn++;
+        if(PartManager->NumPart + NumSpawn > PartManager->MaxPart)
+            endrun(8888, "Tried to spawn %ld stars: NumPart=%ld MaxPart = %ld. Sorry, no space left.\n", NumSpawn, PartManager->NumPart, PartManager->MaxPart);
     }
 
     if(!sfr_params.StarformationOn)
         return;
 
-    /*Get some empty slots for the stars*/
+    /*Get some empty slots for the stars: first reuse garbage star slots, then extend the slot list.*/
+    int64_t nreuse = slots_freelist_begin(4, PartManager, SlotsManager);
+    if(nreuse > NumNewStar)
+        nreuse = NumNewStar;
     int firststarslot = SlotsManager->info[4].size;
     /* We ran out of slots! We must be forming a lot of stars.
      * There are things in the way of extending the slot list, so we have to move them.
      * The code in sfr_reserve_slots is not elegant, but I cannot think of a better way.*/
-    if(sfr_params.StarformationOn && (SlotsManager->info[4].size + NumNewStar >= SlotsManager->info[4].maxsize)) {
+    if(sfr_params.StarformationOn && (SlotsManager->info[4].size + NumNewStar - nreuse >= SlotsManager->info[4].maxsize)) {
         if(NewParents)
             NewParents = (int *) myrealloc(NewParents, sizeof(int) * NumNewStar);
         NewStars = sfr_reserve_slots(act, NewStars, NumNewStar, tree);
     }
-    SlotsManager->info[4].size += NumNewStar;
+    SlotsManager->info[4].size += NumNewStar - nreuse;
 
     int64_t stars_converted = 0, stars_spawned = 0, stars_spawned_gravity = 0;
     int i;
@@ -320,7 +354,10 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
     {
         int child = NewStars[i];
         int parent = NewParents[i];
-        make_particle_star(child, parent, firststarslot+i, Time);
+        int placement = i < nreuse ? slots_freelist_pop(4, SlotsManager) : firststarslot + i - nreuse;
+        if(child != parent)
+            slots_split_particle_at(parent, child, find_star_mass(parent, sfr_params.avg_baryon_mass), PartManager);
+        make_particle_star(child, parent, placement, Time);
         sum_mass_stars += P[child].Mass;
         if(child == parent)
             stars_converted++;
@@ -332,15 +369,21 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
         }
     }
     act->NumActiveGravity += stars_spawned_gravity;
+    /* The children are now valid stars*/
+    PartManager->NumPart += NumSpawn;
+    slots_freelist_end(4, SlotsManager);
+    /* New stars may now have the types of cached neighbour lists which did not include them*/
+    if(NumNewStar > 0)
+        force_tree_invalidate_ngb_cache(tree);
 
     /*Done with the parents*/
     myfree(NewParents);
 
     double total_sum_mass_stars = 0, total_sm = 0, totsfrrate = 0;
 
-    MPI_Reduce(&localsfr, &totsfrrate, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&sum_sm, &total_sm, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&sum_mass_stars, &total_sum_mass_stars, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&localsfr, &totsfrrate, 1, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&sum_sm, &total_sm, 1, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&sum_mass_stars, &total_sum_mass_stars, 1, MPI_DOUBLE, MPI_SUM, 0, GadgetComm);
     if(FdSfr && total_sm > 0)
     {
         double rate = 0;
@@ -364,8 +407,8 @@ cooling_and_starformation(ActiveParticles * act, double Time, double dloga, Forc
     }
 
     int64_t tot_spawned=0, tot_converted=0;
-    MPI_Reduce(&stars_spawned, &tot_spawned, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&stars_converted, &tot_converted, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&stars_spawned, &tot_spawned, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&stars_converted, &tot_converted, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
 
     if(tot_spawned || tot_converted)
         message(0, "SFR: spawned %ld stars, converted %ld gas particles into stars\n", tot_spawned, tot_converted);
@@ -401,6 +444,9 @@ sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTr
         int *Father_tmp=NULL;
         int *ActiveParticle_tmp=NULL;
         if(force_tree_allocated(tree)) {
+            /* The export plan and neighbour cache are allocated above the tree. They are only caches, so just drop them.*/
+            force_tree_free_ngb_cache(tree);
+            force_tree_free_export_plan(tree);
             nodes_base_tmp = (struct NODE *) mymalloc2("nodesbasetmp", tree->numnodes * sizeof(struct NODE));
             memmove(nodes_base_tmp, tree->Nodes_base, tree->numnodes * sizeof(struct NODE));
             myfree(tree->Nodes_base);
@@ -445,15 +491,16 @@ sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTr
         return NewStars;
 }
 
-static void
-cooling_direct(int i, const double redshift, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG)
+/* Set up the cooling of particle i. Returns 1 if the particle needs the cooling solver,
+ * with the inputs stored in cool. Gas heated by reionization this timestep does not need
+ * the solver and has its entropy set directly.*/
+static int
+cooling_direct_setup(int i, const double redshift, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG, struct CoolingBatch * cool)
 {
     /*  the actual time-step */
     double dloga = get_dloga_for_bin(P[i].TimeBinHydro, P[i].Ti_drift);
     double dtime = dloga / hubble;
 
-    double ne = SPHP(i).Ne;	/* electron abundance (gives ionization state and mean molecular weight) */
-
     const double enttou = entropy_to_u(SPHP(i).Density, a3inv);
 
     /* Current internal energy including adiabatic change*/
@@ -467,7 +514,6 @@ cooling_direct(int i, const double redshift, const double a3inv, const double hu
     struct UVBG uvbg = get_local_UVBG(redshift, GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset, localJ21, zreion);
     double lasttime = exp(loga_from_ti(P[i].Ti_drift - dti_from_timebin(P[i].TimeBinHydro)));
     double lastred = 1/lasttime - 1;
-    double unew;
     /* The particle reionized this timestep, bump the temperature to the HI reionization temperature.
      * We only do this for non-star-forming gas.*/
     if(sfr_params.HIReionTemp > 0 && uvbg.zreion >= redshift && uvbg.zreion < lastred) {
@@ -480,22 +526,43 @@ cooling_direct(int i, const double redshift, const double a3inv, const double hu
         /* TODO: Make sure that not setting SPHP.Ne(i) here doesn't mess up anything between
          * now and the next cooling call when it gets set properly */
         const double meanweight = 4 / (8 - 6 * (1 - HYDROGEN_MASSFRAC));
-        unew = sfr_params.temp_to_u / meanweight * sfr_params.HIReionTemp;
+        double unew = sfr_params.temp_to_u / meanweight * sfr_params.HIReionTemp;
         //We don't want gas to cool by ionising
         if(uold > unew) unew = uold;
+        /* Update the entropy. This is done after synchronizing kicks and drifts, as per run.c.*/
+        SPHP(i).Entropy = unew / enttou;
+        /* Cooling gas is not forming stars*/
+        SPHP(i).Sfr = 0;
+        return 0;
     }
-    else {
-        /* mean molecular weight assuming ZERO ionization NEUTRAL GAS*/
-        const double meanweight = 4.0 / (1 + 3 * HYDROGEN_MASSFRAC);
-        const double MinEgySpec = sfr_params.temp_to_u/meanweight * sfr_params.MinGasTemp;
-        unew = DoCooling(redshift, uold, SPHP(i).Density * a3inv, dtime, &uvbg, &ne, SPHP(i).Metallicity, MinEgySpec, P[i].HeIIIionized);
-    }
+    /* mean molecular weight assuming ZERO ionization NEUTRAL GAS*/
+    const double meanweight = 4.0 / (1 + 3 * HYDROGEN_MASSFRAC);
+    cool->MinEgySpec = sfr_params.temp_to_u/meanweight * sfr_params.MinGasTemp;
+    cool->u_old = uold;
+    cool->rho = SPHP(i).Density * a3inv;
+    cool->dt = dtime;
+    cool->Z = SPHP(i).Metallicity;
+    cool->uvbg = uvbg;
+    /* electron abundance (gives ionization state and mean molecular weight) */
+    cool->ne_guess = SPHP(i).Ne;
+    cool->isHeIIIionized = P[i].HeIIIionized;
+    return 1;
+}
 
-    SPHP(i).Ne = ne;
-    /* Update the entropy. This is done after synchronizing kicks and drifts, as per run.c.*/
-    SPHP(i).Entropy = unew / enttou;
-    /* Cooling gas is not forming stars*/
-    SPHP(i).Sfr = 0;
+/* Cool the n particles set up by cooling_direct_setup and store the new entropies.*/
+static void
+cooling_direct_flush(const int * index, struct CoolingBatch * cool, const int n, const double redshift, const double a3inv)
+{
+    int j;
+    DoCoolingBatch(redshift, cool, n);
+    for(j = 0; j < n; j++) {
+        const int i = index[j];
+        SPHP(i).Ne = cool[j].ne_guess;
+        /* Update the entropy. This is done after synchronizing kicks and drifts, as per run.c.*/
+        SPHP(i).Entropy = cool[j].u / entropy_to_u(SPHP(i).Density, a3inv);
+        /* Cooling gas is not forming stars*/
+        SPHP(i).Sfr = 0;
+    }
 }
 
 /* Returns the density threshold for star formation in comoving units*/
@@ -703,18 +770,19 @@ quicklyastarformation(int i, const double a3inv, const RandTable * const rnd)
     if(temp >= sfr_params.QuickLymanAlphaTempThresh)
         return 0;
 
-    if(get_random_number(P[i].ID + 1, rnd) < sfr_params.QuickLymanAlphaProbability)
+    if(get_random_number(P[i].ID, RND_SFR_FORM, rnd) < sfr_params.QuickLymanAlphaProbability)
         return 1;
 
     return 0;
 }
 
 /* Forms stars and winds.
- * Returns -1 if no star formed, otherwise returns the index of the particle which is to be made a star.
- * The star slot is not actually created here, but a particle for it is.
+ * Returns -1 if no star formed, SPAWN_STAR if a new star particle is to be split off,
+ * otherwise returns the index of the particle which is to be made a star.
+ * Neither the new particle nor the star slot are created here.
  */
 static int
-starformation(int i, double *localsfr, MyFloat * sm_out, MyFloat * GradRho, const double redshift, const double a3inv, const double hubble, const double GravInternal, const struct UVBG * const GlobalUVBG, const RandTable * const rnd)
+starformation(int i, double *localsfr, MyFloat * sm_out, const struct sph_grad_rho * GradRho, const double redshift, const double a3inv, const double hubble, const double GravInternal, const struct UVBG * const GlobalUVBG, const RandTable * const rnd)
 {
     /*  the proper time-step */
     double dloga = get_dloga_for_bin(P[i].TimeBinHydro, P[i].Ti_drift);
@@ -743,7 +811,7 @@ starformation(int i, double *localsfr, MyFloat * sm_out, MyFloat * GradRho, cons
     SPHP(i).Ne = sfr_data.ne;
     *localsfr += SPHP(i).Sfr;
 
-    const double w = get_random_number(P[i].ID, rnd);
+    const double w = get_random_number(P[i].ID, RND_SFR_METALS, rnd);
     const double frac = (1 - exp(-p));
     SPHP(i).Metallicity += w * METAL_YIELD * frac / sfr_params.Generations;
 
@@ -754,14 +822,14 @@ starformation(int i, double *localsfr, MyFloat * sm_out, MyFloat * GradRho, cons
     double mass_of_star = find_star_mass(i, sfr_params.avg_baryon_mass);
     double prob = P[i].Mass / mass_of_star * (1 - exp(-p));
 
-    int form_star = (get_random_number(P[i].ID + 1, rnd) < prob);
+    int form_star = (get_random_number(P[i].ID, RND_SFR_FORM, rnd) < prob);
     if(form_star) {
         /* ok, make a star */
         newstar = i;
         /* If we get a fraction of the mass we need to create
          * a new particle for the star and remove mass from i.*/
         if(P[i].Mass >= 1.1 * mass_of_star)
-            newstar = slots_split_particle(i, mass_of_star, PartManager);
+            newstar = SPAWN_STAR;
     }
 
     /* Add the rest of the metals if we didn't form a star.
@@ -814,7 +882,7 @@ struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_part
     return data;
 }
 
-static double get_starformation_rate_full(int i, MyFloat * GradRho, struct sfr_eeqos_data sfr_data, const double atime, const double a3inv, const double hubble, const double GravInternal)
+static double get_starformation_rate_full(int i, const struct sph_grad_rho * GradRho, struct sfr_eeqos_data sfr_data, const double atime, const double a3inv, const double hubble, const double GravInternal)
 {
     if(!sfreff_on_eeqos(&SPHP(i), a3inv)) {
         return 0;
@@ -825,7 +893,7 @@ static double get_starformation_rate_full(int i, MyFloat * GradRho, struct sfr_e
     double rateOfSF = (1 - sfr_params.FactorSN) * cloudmass / sfr_data.tsfr;
 
     if (HAS(sfr_params.StarformationCriterion, SFR_CRITERION_MOLECULAR_H2)) {
-        if(!GradRho)
+        if(!GradRho || !GradRho->Index)
             endrun(1, "GradRho not allocated but has SFR_CRITERION_MOLECULAR_H2. Should never happen!\n");
         rateOfSF *= get_sfr_factor_due_to_h2(i, GradRho, atime);
     }
@@ -860,6 +928,13 @@ double get_MinEgySpec(void)
     return sfr_params.temp_to_u / meanweight * sfr_params.MinGasTemp;
 }
 
+void prefetch_cooling_tables(int CoolingOn)
+{
+    if(CoolingOn)
+        prefetch_cooling_rates(sfr_params.TreeCoolFile, sfr_params.J21CoeffFile);
+    prefetch_qso_lightup(sfr_params.ReionHistFile);
+}
+
 void init_cooling_and_star_formation(int CoolingOn, int StarformationOn, Cosmology * CP, const double avg_baryon_mass, const double BoxSize, const struct UnitSystem units)
 {
     struct cooling_units coolunits;
@@ -1012,6 +1087,13 @@ int sfr_need_to_compute_sph_grad_rho(void)
     }
     return 0;
 }
+
+/* Density above which grad rho is computed. The density used for the selection is from the last time the
+ * particle was active, so we allow for it to grow by a factor of two during the step.*/
+double sfr_grad_rho_min_density(const double atime)
+{
+    return 0.5 * sfr_density_threshold(atime);
+}
 static double ev_NH_from_GradRho(MyFloat gradrho_mag, double hsml, double rho, double include_h)
 {
     /* column density from GradRho, copied from gadget-p; what is it
@@ -1026,14 +1108,18 @@ static double ev_NH_from_GradRho(MyFloat gradrho_mag, double hsml, double rho, d
     return ev_NH; // *(Z/Zsolar) add metallicity dependence
 }
 
-static double get_sfr_factor_due_to_h2(int i, MyFloat * GradRho_mag, const double atime) {
+static double get_sfr_factor_due_to_h2(int i, const struct sph_grad_rho * GradRho, const double atime) {
     /*  Krumholz & Gnedin fitting function for f_H2 as a function of local
      *  properties, from gadget-p; we return the enhancement on SFR in this
      *  function */
     double tau_fmol;
     const double a2 = atime * atime;
     double zoverzsun = SPHP(i).Metallicity/METAL_YIELD;
-    double gradrho_mag = GradRho_mag[P[i].PI];
+    /* Particles which were well below the density threshold before this step's density
+     * did not have the gradient computed: use only the hsml part of the column density.*/
+    double gradrho_mag = 0;
+    if(GradRho->Index[P[i].PI] >= 0)
+        gradrho_mag = GradRho->Mag[GradRho->Index[P[i].PI]];
     //message(4, "GradRho %g rho %g hsml %g i %d\n", gradrho_mag, SPHP(i).Density, P[i].Hsml, i);
     tau_fmol = ev_NH_from_GradRho(gradrho_mag,P[i].Hsml,SPHP(i).Density,1) /a2;
     tau_fmol *= (0.1 + zoverzsun);
@@ -2,6 +2,7 @@
 #define __SFR_H
 
 #include "forcetree.h"
+#include "density.h"
 #include "utils/paramset.h"
 #include "timestep.h"
 #include "partmanager.h"
@@ -25,9 +26,12 @@ enum StarformationCriterion {
 /*Set the parameters of the star formation module*/
 void set_sfr_params(ParameterSet * ps);
 
+/* Start reading the cooling tables in the background, so they load while the snapshot is read.*/
+void prefetch_cooling_tables(int CoolingOn);
+
 void init_cooling_and_star_formation(int CoolingOn, int StarformationOn, Cosmology * CP, const double avg_baryon_mass, const double BoxSize, const struct UnitSystem units);
 /*Do the cooling and the star formation. The tree is required for the winds only.*/
-void cooling_and_starformation(ActiveParticles * act, double Time, double dloga, ForceTree * tree, struct grav_accel_store GravAccel, DomainDecomp * ddecomp, Cosmology *CP, MyFloat * GradRho, RandTable * rnd, FILE * FdSfr);
+void cooling_and_starformation(ActiveParticles * act, double Time, double dloga, ForceTree * tree, struct grav_accel_store GravAccel, DomainDecomp * ddecomp, Cosmology *CP, const struct sph_grad_rho * GradRho, RandTable * rnd, FILE * FdSfr);
 
 /*Get the neutral fraction of a particle correctly, even when on the star-forming equation of state.
  * This calls the cooling routines for the current internal energy when off the equation of state, but
@@ -41,6 +45,8 @@ double get_helium_neutral_fraction_sfreff(int ion, double redshift, double hubbl
 
 /* Return whether we are using a star formation model that needs grad rho computed for the gas particles*/
 int sfr_need_to_compute_sph_grad_rho(void);
+/* Density above which the gas needs grad rho computed, in comoving units*/
+double sfr_grad_rho_min_density(const double atime);
 
 /* Get the number of generations of stars that may form*/
 int get_generations(void);
@@ -1,3 +1,8 @@
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <string.h>
 #include "slotsmanager.h"
 #include "partmanager.h"
@@ -60,14 +65,18 @@ slots_convert(int parent, int ptype, int placement, struct part_manager_type * p
     /*Explicitly mark old slot as garbage*/
     int oldtype = pman->Base[parent].Type;
     int oldPI = pman->Base[parent].PI;
-    if(oldPI >= 0 && SLOTS_ENABLED(oldtype, sman))
+    if(oldPI >= 0 && SLOTS_ENABLED(oldtype, sman)) {
         BASESLOT_PI(oldPI, oldtype, sman)->ReverseLink = pman->MaxPart + 100;
+        atomic_fetch_and_add_64(&sman->info[oldtype].ngarbage, 1);
+    }
 
     /*Make a new slot*/
     if(SLOTS_ENABLED(ptype, sman)) {
         int newPI = placement;
-        /* if enabled, alloc a new Slot for secondary data */
+        /* if enabled, alloc a new Slot for secondary data, reusing a garbage slot if there is one. */
         if(placement < 0)
+            newPI = slots_freelist_pop(ptype, sman);
+        if(newPI < 0)
             newPI = atomic_fetch_and_add_64(&sman->info[ptype].size, 1);
 
         /* There is no way clearly to safely grow the slots during this, because the memory may be deep in the heap.*/
@@ -105,6 +114,14 @@ slots_split_particle(int parent, double childmass, struct part_manager_type * pm
     if(child >= pman->MaxPart)
         endrun(8888, "Tried to spawn: NumPart=%ld MaxPart = %ld. Sorry, no space left.\n", child, pman->MaxPart);
 
+    slots_split_particle_at(parent, child, childmass, pman);
+    return child;
+}
+
+/* As slots_split_particle, but the child goes at index child, which the caller has already added to NumPart.*/
+void
+slots_split_particle_at(int parent, int64_t child, double childmass, struct part_manager_type * pman)
+{
     pman->Base[parent].Generation ++;
     uint64_t g = pman->Base[parent].Generation;
     pman->Base[child] = pman->Base[parent];
@@ -119,8 +136,6 @@ slots_split_particle(int parent, double childmass, struct part_manager_type * pm
 
     /*Invalidate the slot of the child. Call slots_convert soon afterwards!*/
     pman->Base[child].PI = -1;
-
-    return child;
 }
 
 /* remove garbage particles, holes in sph chunk and holes in bh buffer.
@@ -141,7 +156,7 @@ slots_gc(int * compact_slots, struct part_manager_type * pman, struct slots_mana
     tree_invalid |= slots_gc_base(pman);
     tree_invalid |= slots_gc_slots(compact_slots, pman, sman);
 
-    MPI_Allreduce(MPI_IN_PLACE, &tree_invalid, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &tree_invalid, 1, MPI_INT, MPI_SUM, GadgetComm);
 
     return tree_invalid;
 }
@@ -221,15 +236,17 @@ slots_gc_base(struct part_manager_type * pman)
 {
     int64_t total0, total;
 
-    MPI_Allreduce(&pman->NumPart, &total0, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&pman->NumPart, &total0, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
     /*Compactify the P array: this invalidates the ReverseLink, so
         * that ReverseLink is valid only within gc.*/
     int64_t ngc = slots_gc_compact(pman->NumPart, -1, pman, NULL);
 
     pman->NumPart -= ngc;
+    if(ngc > 0)
+        pman->ReorderCount++;
 
-    MPI_Allreduce(&pman->NumPart, &total, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&pman->NumPart, &total, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
     if(total != total0) {
         message(0, "GC : Reducing Particle slots from %ld to %ld\n", total0, total);
@@ -238,12 +255,6 @@ slots_gc_base(struct part_manager_type * pman)
     return 0;
 }
 
-static int slot_cmp_reverse_link(const void * b1in, const void * b2in) {
-    const struct particle_data_ext * b1 = (struct particle_data_ext *) b1in;
-    const struct particle_data_ext * b2 = (struct particle_data_ext *) b2in;
-    return (b1->ReverseLink > b2->ReverseLink) - (b1->ReverseLink < b2->ReverseLink);
-}
-
 static int
 slots_gc_mark(const struct part_manager_type * pman, const struct slots_manager_type * sman)
 {
@@ -299,6 +310,7 @@ slots_gc_sweep(int ptype, struct part_manager_type * pman, struct slots_manager_
     int64_t ngc = slots_gc_compact(used, ptype, pman, sman);
 
     sman->info[ptype].size -= ngc;
+    sman->info[ptype].ngarbage = 0;
 
     return ngc;
 }
@@ -337,7 +349,7 @@ slots_gc_slots(int * compact_slots, struct part_manager_type * pman, struct slot
 
     int disabled = 1;
     for(ptype = 0; ptype < 6; ptype ++) {
-        MPI_Allreduce(&sman->info[ptype].size, &total0[ptype], 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&sman->info[ptype].size, &total0[ptype], 1, MPI_INT64, MPI_SUM, GadgetComm);
         if(compact_slots[ptype])
             disabled = 0;
     }
@@ -360,7 +372,7 @@ slots_gc_slots(int * compact_slots, struct part_manager_type * pman, struct slot
     slots_check_id_consistency(pman, sman);
 #endif
     for(ptype = 0; ptype < 6; ptype ++) {
-        MPI_Allreduce(&sman->info[ptype].size, &total1[ptype], 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&sman->info[ptype].size, &total1[ptype], 1, MPI_INT64, MPI_SUM, GadgetComm);
 
         if(total1[ptype] != total0[ptype])
             message(0, "GC: Reducing number of slots for %d from %ld to %ld\n", ptype, total0[ptype], total1[ptype]);
@@ -405,22 +417,43 @@ struct PeanoOrder
     int Pindex;
 };
 
-static int
-order_by_type_and_key(const void *a, const void *b)
+/* Move each live slot of ptype to the position of its particle among the particles of ptype,
+ * which are contiguous in the sorted P array starting at typestart, and garbage slots to the end.
+ * This is an in-place cycle-leader permutation, so needs no temporary copy of the slots.
+ * Returns the number of live slots.*/
+static int64_t
+slots_permute_sorted(int ptype, const int64_t typestart, const int64_t ntype, struct part_manager_type * pman, struct slots_manager_type * sman)
 {
-    const struct PeanoOrder * pa  = (const struct PeanoOrder *) a;
-    const struct PeanoOrder * pb  = (const struct PeanoOrder *) b;
-    /* Note garbage types have their values set to something large here*/
-    if(pa->TypeKey < pb->TypeKey)
-        return -1;
-    if(pa->TypeKey > pb->TypeKey)
-        return +1;
-    if(pa->Key < pb->Key)
-        return -1;
-    if(pa->Key > pb->Key)
-        return +1;
-
-    return 0;
+    const int64_t size = sman->info[ptype].size;
+    const size_t elsize = sman->info[ptype].elsize;
+    int64_t i, ngarbage = 0;
+    /* ReverseLink now stores the destination of each slot*/
+    for(i = 0; i < size; i++) {
+        struct particle_data_ext * sdata = BASESLOT_PI(i, ptype, sman);
+        if(sdata->ReverseLink > pman->MaxPart)
+            sdata->ReverseLink = ntype + ngarbage++;
+        else
+            sdata->ReverseLink -= typestart;
+    }
+    if(ntype + ngarbage != size)
+        endrun(1, "Type %d has %ld particles but %ld live slots\n", ptype, ntype, size - ngarbage);
+
+    char * tmp = ta_malloc("SlotTmp", char, elsize);
+    for(i = 0; i < size; i++) {
+        /* Each swap puts one slot in its final place*/
+        while(BASESLOT_PI(i, ptype, sman)->ReverseLink != i) {
+            const int dest = BASESLOT_PI(i, ptype, sman)->ReverseLink;
+            memcpy(tmp, BASESLOT_PI(dest, ptype, sman), elsize);
+            memcpy(BASESLOT_PI(dest, ptype, sman), BASESLOT_PI(i, ptype, sman), elsize);
+            memcpy(BASESLOT_PI(i, ptype, sman), tmp, elsize);
+        }
+    }
+    myfree(tmp);
+    /* Restore the links to the P array*/
+    #pragma omp parallel for
+    for(i = 0; i < size; i++)
+        BASESLOT_PI(i, ptype, sman)->ReverseLink = i < ntype ? typestart + i : pman->MaxPart + 100;
+    return ntype;
 }
 
 /* Sort the particles and their slots by type and peano order.
@@ -446,8 +479,9 @@ slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sma
         }
         peanokeys[i].Pindex = i;
     }
-    /* Sort the keys*/
-    qsort_openmp(peanokeys, pman->NumPart, sizeof(struct PeanoOrder), order_by_type_and_key);
+    /* Sort the keys: by peano key, then stably by type.*/
+    radix_sort_openmp(peanokeys, pman->NumPart, sizeof(struct PeanoOrder), offsetof(struct PeanoOrder, Key), sizeof(peano_t));
+    radix_sort_openmp(peanokeys, pman->NumPart, sizeof(struct PeanoOrder), offsetof(struct PeanoOrder, TypeKey), sizeof(int));
     /* Now sort the base with a cycle leader permutation algorithm, like qsort.*/
     for(i = 0; i < pman->NumPart; i++) {
         int k = peanokeys[i].Pindex;
@@ -474,23 +508,36 @@ slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sma
     // message(1, "garbage %ld\n", garbage);
     /*Remove garbage particles*/
     pman->NumPart -= garbage;
+    pman->ReorderCount++;
 
     myfree(peanokeys);
+
+    /* The particles of each type are now contiguous*/
+    int64_t typestart[7] = {0};
+    for(i = 0; i < pman->NumPart; i++)
+        typestart[pman->Base[i].Type + 1]++;
+    for(ptype = 0; ptype < 6; ptype++)
+        typestart[ptype + 1] += typestart[ptype];
+
+    /* Slots not linked from a particle must be garbage, so the permutation is well defined*/
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!SLOTS_ENABLED(ptype, sman))
+            continue;
+        int64_t j;
+        #pragma omp parallel for
+        for(j = 0; j < sman->info[ptype].size; j++)
+            BASESLOT_PI(j, ptype, sman)->ReverseLink = pman->MaxPart + 100;
+    }
     /*Set up ReverseLink*/
     slots_gc_mark(pman, sman);
 
     for(ptype = 0; ptype < 6; ptype++) {
         if(!SLOTS_ENABLED(ptype, sman))
             continue;
-        /* sort the used ones
-         * by their location in the P array */
-        qsort_openmp(sman->info[ptype].ptr,
-                 sman->info[ptype].size,
-                 sman->info[ptype].elsize,
-                 slot_cmp_reverse_link);
-
-        /*Reduce slots used*/
-        SlotsManager->info[ptype].size = slots_get_last_garbage(0, sman->info[ptype].size-1, ptype, pman, sman);
+        /* Put the used ones in the order of their particles in the P array,
+         * and reduce slots used*/
+        sman->info[ptype].size = slots_permute_sorted(ptype, typestart[ptype], typestart[ptype+1] - typestart[ptype], pman, sman);
+        sman->info[ptype].ngarbage = 0;
         slots_gc_collect(ptype, pman, sman);
     }
 #ifdef DEBUG
@@ -498,6 +545,58 @@ slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sma
 #endif
 }
 
+/* Reserve, but do not commit, the address space of every type: each type starts VirtualBytes after the last.*/
+static void
+slots_map_virtual(struct slots_manager_type * sman)
+{
+    sman->Base = (char *) mmap(NULL, 6 * sman->VirtualBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(sman->Base == MAP_FAILED)
+        endrun(1, "Failed to reserve %g GB of address space for the slots: %s\n", 6 * sman->VirtualBytes / (1024. * 1024. * 1024.), strerror(errno));
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        sman->info[ptype].ptr = sman->Base + ptype * sman->VirtualBytes;
+    /* Replace the reservation of the spilled types with a shared mapping of a sparse file of the same size.
+     * The file is unlinked straight away, so it is removed when the mapping is.*/
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!(sman->SpillMask & (1 << ptype)))
+            continue;
+        char fname[sizeof(sman->SpillDir) + 32];
+        snprintf(fname, sizeof(fname), "%s/slots-%d-XXXXXX", sman->SpillDir, ptype);
+        const int fd = mkstemp(fname);
+        if(fd < 0)
+            endrun(1, "Failed to create slot spill file %s: %s\n", fname, strerror(errno));
+        unlink(fname);
+        if(ftruncate(fd, sman->VirtualBytes) != 0)
+            endrun(1, "Failed to size slot spill file in %s to %g GB: %s\n", sman->SpillDir, sman->VirtualBytes / (1024. * 1024. * 1024.), strerror(errno));
+        if(mmap(sman->info[ptype].ptr, sman->VirtualBytes, PROT_NONE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+            endrun(1, "Failed to map slot spill file for type %d: %s\n", ptype, strerror(errno));
+        close(fd);
+    }
+}
+
+/* Make enough of the reserved space of each type usable for newMaxSlots. The slots never move.*/
+static void
+slots_commit_virtual(int where, int64_t newMaxSlots[6], size_t bytes[6], struct slots_manager_type * sman)
+{
+    const size_t pagesize = sysconf(_SC_PAGESIZE);
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!SLOTS_ENABLED(ptype, sman)) continue;
+        if(bytes[ptype] > sman->VirtualBytes)
+            endrun(1, "Need %ld slots of type %d, %g MB, more than the %g MB reserved. Increase SlotsVirtualReserveGB.\n",
+                newMaxSlots[ptype], ptype, bytes[ptype] / (1024.0 * 1024.0), sman->VirtualBytes / (1024.0 * 1024.0));
+        const size_t commit = ((bytes[ptype] + pagesize - 1) / pagesize) * pagesize;
+        if(commit > 0 && mprotect(sman->info[ptype].ptr, commit, PROT_READ | PROT_WRITE) != 0)
+            endrun(1, "Failed to commit %g MB for slots of type %d: %s\n", commit / (1024.0 * 1024.0), ptype, strerror(errno));
+        sman->info[ptype].maxsize = newMaxSlots[ptype];
+    }
+    message(where, "SLOTS: Committed space for %ld sph, %ld stars and %ld BHs (disabled: %ld %ld %ld)\n",
+            newMaxSlots[0], newMaxSlots[4], newMaxSlots[5], newMaxSlots[1], newMaxSlots[2], newMaxSlots[3]);
+    GDB_SphP = (struct sph_particle_data *) sman->info[0].ptr;
+    GDB_StarP = (struct star_particle_data *) sman->info[4].ptr;
+    GDB_BhP = (struct bh_particle_data *) sman->info[5].ptr;
+}
+
 size_t
 slots_reserve(int where, int64_t atleast[6], struct slots_manager_type * sman)
 {
@@ -505,6 +604,8 @@ slots_reserve(int where, int64_t atleast[6], struct slots_manager_type * sman)
     int ptype;
     int good = 1;
 
+    if(sman->Base == NULL && sman->VirtualBytes > 0)
+        slots_map_virtual(sman);
     if(sman->Base == NULL) {
         sman->Base = (char*) mymalloc("SlotsBase", sizeof(struct sph_particle_data));
         /* This is so the ptr is never null! Avoid undefined behaviour. */
@@ -540,6 +641,10 @@ slots_reserve(int where, int64_t atleast[6], struct slots_manager_type * sman)
     if (good) {
         return total_bytes;
     }
+    if(sman->VirtualBytes > 0) {
+        slots_commit_virtual(where, newMaxSlots, bytes, sman);
+        return total_bytes;
+    }
     char * newSlotsBase = (char *) myrealloc(sman->Base, total_bytes);
 
     /* If we are using VALGRIND the allocator is system malloc, and so realloc may move the base pointer.
@@ -578,6 +683,13 @@ slots_init(double increase, struct slots_manager_type * sman)
 {
     memset(sman, 0, sizeof(sman[0]));
     sman->increase = increase;
+    sman->gc_fraction = 0.1;
+}
+
+void
+slots_set_gc_fraction(double gc_fraction, struct slots_manager_type * sman)
+{
+    sman->gc_fraction = gc_fraction;
 }
 
 void
@@ -588,10 +700,51 @@ slots_set_enabled(int ptype, size_t elsize, struct slots_manager_type * sman)
 }
 
 
+void
+slots_set_virtual_reserve(size_t bytes, struct slots_manager_type * sman)
+{
+    const size_t pagesize = sysconf(_SC_PAGESIZE);
+    sman->VirtualBytes = ((bytes + pagesize - 1) / pagesize) * pagesize;
+}
+
+void
+slots_set_spill(const char * dir, int typemask, struct slots_manager_type * sman)
+{
+    if(!dir || !dir[0] || !typemask)
+        return;
+    if(sman->VirtualBytes == 0)
+        endrun(1, "Spilling slots to %s needs a virtual reservation: set SlotsVirtualReserveGB.\n", dir);
+    if(sman->Base)
+        endrun(1, "Slot spilling must be set before the slots are reserved\n");
+    strncpy(sman->SpillDir, dir, sizeof(sman->SpillDir) - 1);
+    sman->SpillDir[sizeof(sman->SpillDir) - 1] = '\0';
+    sman->SpillMask = typemask;
+}
+
+void
+slots_prefetch(int typemask, const struct slots_manager_type * sman)
+{
+    const size_t pagesize = sysconf(_SC_PAGESIZE);
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!(typemask & sman->SpillMask & (1 << ptype)) || !SLOTS_ENABLED(ptype, sman))
+            continue;
+        const size_t bytes = ((sman->info[ptype].size * sman->info[ptype].elsize + pagesize - 1) / pagesize) * pagesize;
+        /* Only a hint: failure just means the pages are read as they are touched*/
+        if(bytes > 0)
+            madvise(sman->info[ptype].ptr, bytes, MADV_WILLNEED);
+    }
+}
+
 void
 slots_free(struct slots_manager_type * sman)
 {
-    myfree(sman->Base);
+    if(sman->VirtualBytes > 0) {
+        munmap(sman->Base, 6 * sman->VirtualBytes);
+        sman->Base = NULL;
+    }
+    else
+        myfree(sman->Base);
 }
 
 /* mark the i-th base particle as a garbage. */
@@ -602,9 +755,53 @@ slots_mark_garbage(int i, struct part_manager_type * pman, struct slots_manager_
     int type = pman->Base[i].Type;
     if(SLOTS_ENABLED(type, sman)) {
         BASESLOT_PI(pman->Base[i].PI, type, sman)->ReverseLink = pman->MaxPart + 100;
+        atomic_fetch_and_add_64(&sman->info[type].ngarbage, 1);
     }
 }
 
+int64_t
+slots_freelist_begin(int ptype, struct part_manager_type * pman, struct slots_manager_type * sman)
+{
+    struct slot_info * info = &sman->info[ptype];
+    info->nfree = 0;
+    info->freelist = NULL;
+    if(!SLOTS_ENABLED(ptype, sman) || info->ngarbage == 0)
+        return 0;
+    /* ReverseLink of a live slot may be stale outside of gc, so set it from the particles*/
+    slots_gc_mark(pman, sman);
+    info->freelist = (int *) mymalloc2("SlotFreeList", info->ngarbage * sizeof(int));
+    int64_t i;
+    /* Reversed so that the lowest slots are reused first*/
+    for(i = info->size - 1; i >= 0 && info->nfree < info->ngarbage; i--)
+        if(BASESLOT_PI(i, ptype, sman)->ReverseLink > pman->MaxPart)
+            info->freelist[info->nfree++] = i;
+    return info->nfree;
+}
+
+int
+slots_freelist_pop(int ptype, struct slots_manager_type * sman)
+{
+    struct slot_info * info = &sman->info[ptype];
+    if(info->nfree <= 0)
+        return -1;
+    /* The list only shrinks while it is in use, so a fetch and add is enough*/
+    const int64_t n = atomic_fetch_and_add_64(&info->nfree, -1) - 1;
+    if(n < 0)
+        return -1;
+    atomic_fetch_and_add_64(&info->ngarbage, -1);
+    return info->freelist[n];
+}
+
+void
+slots_freelist_end(int ptype, struct slots_manager_type * sman)
+{
+    struct slot_info * info = &sman->info[ptype];
+    if(info->freelist)
+        myfree(info->freelist);
+    info->freelist = NULL;
+    info->nfree = 0;
+}
+
 #ifdef DEBUG
 void
 slots_check_id_consistency(struct part_manager_type * pman, struct slots_manager_type * sman)
@@ -631,7 +828,7 @@ slots_check_id_consistency(struct part_manager_type * pman, struct slots_manager
     }
     int64_t NTotal[6];
 
-    MPI_Allreduce(used, NTotal, 6, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(used, NTotal, 6, MPI_INT64, MPI_SUM, GadgetComm);
 
     int ptype;
     for(ptype = 0; ptype < 6; ptype ++) {
@@ -12,6 +12,9 @@ struct slot_info {
     int64_t size; /* currently used slots*/
     size_t elsize; /* itemsize */
     int enabled;
+    int64_t ngarbage; /* garbage slots below size, not yet collected or reused */
+    int * freelist; /* garbage slots to reuse for new slots, between slots_freelist_begin and end */
+    int64_t nfree; /* entries left in freelist */
 };
 
 /* Slot particle data structures: first the base extension slot, then black holes,
@@ -49,9 +52,9 @@ struct bh_particle_data {
     /*******************************************************/
     /* Dynamic friction helpers*/
     MyFloat DFAccel[3];
-    MyFloat DF_SurroundingVel[3]; /* Mass and kernel weighted velocity of DF contributing particles around BH.*/
-    MyFloat DF_SurroundingRmsVel; /* Mass and kernel weighted RMS velocity of DF contributing particles around BH */
-    MyFloat DF_SurroundingDensity; /* Kernel weighted mass of DF contributing particles around BH.*/
+    DiagFloat DF_SurroundingVel[3]; /* Mass and kernel weighted velocity of DF contributing particles around BH.*/
+    DiagFloat DF_SurroundingRmsVel; /* Mass and kernel weighted RMS velocity of DF contributing particles around BH */
+    DiagFloat DF_SurroundingDensity; /* Kernel weighted mass of DF contributing particles around BH.*/
     MyFloat DragAccel[3];
     /* Merger time of the black hole.
      * After this, all values are fixed. */
@@ -61,9 +64,9 @@ struct bh_particle_data {
     MyFloat Mseed; /*Log the seed mass of BH, would be useful in case of the powerlaw seeding*/
     MyFloat FormationTime;  /*!< formation time of black hole. */
     /* Minimum potential reposition helpers*/
-    MyFloat MinPot; /* Minimum potential, for diagnostics */
+    DiagFloat MinPot; /* Minimum potential, for diagnostics */
     double MinPotPos[3];
-    MyFloat MinPotVel[3];
+    DiagFloat MinPotVel[3];
 
     int CountProgs;
 };
@@ -94,7 +97,8 @@ struct star_particle_data
 struct sph_particle_data
 {
     struct particle_data_ext base;
-    /* int sized 4-bytes gap*/
+    /* Minimum hydro timebin of the neighbours at the last hydro force, for the timestep limiter. 0 if unset.*/
+    unsigned char MinNgbTimeBin;
     MyFloat       Density;		/*!< current baryonic mass density of particle */
     /*This is only used if DensityIndependentSph is on.
      * If DensityIndependentSph is off then Density is used instead.*/
@@ -134,6 +138,10 @@ extern struct slots_manager_type {
     char * Base; /* memory ptr that holds of all slots */
     double increase; /* Percentage amount to increase
                       * slot reservation by when requested.*/
+    double gc_fraction; /* Fraction of the slots of a type which must be garbage before the exchange compacts them.*/
+    size_t VirtualBytes; /* If > 0, address space reserved for each type outside the heap, so the slots never move when they grow.*/
+    int SpillMask; /* Bit field of the types whose reserved space is backed by a file in SpillDir instead of anonymous memory.*/
+    char SpillDir[512];
 } SlotsManager[1];
 
 /* shortcuts for accessing different slots directly by the index */
@@ -153,10 +161,31 @@ void slots_init(double increase, struct slots_manager_type * sman);
 /*Enable a slot on type ptype. All slots are disabled after slots_init().*/
 void slots_set_enabled(int ptype, size_t elsize, struct slots_manager_type * sman);
 void slots_free(struct slots_manager_type * sman);
+/* Reserve bytes of address space for each slot type, outside the memory heap, before the first slots_reserve.
+ * Growing the slots then commits more of the reservation instead of reallocating and moving the later types.*/
+void slots_set_virtual_reserve(size_t bytes, struct slots_manager_type * sman);
+/* Back the reserved space of the types in typemask by files in dir, for example on node-local NVMe.
+ * The kernel can then write the pages of these slots out under memory pressure instead of keeping them in memory.
+ * Needs a virtual reservation, and must be called after slots_set_virtual_reserve and before the first slots_reserve.*/
+void slots_set_spill(const char * dir, int typemask, struct slots_manager_type * sman);
+/* Start reading the spilled slots of the types in typemask back into memory, before a phase which uses all of them.
+ * Does nothing for slots which are not spilled.*/
+void slots_prefetch(int typemask, const struct slots_manager_type * sman);
+/* Set the fraction of garbage slots at which the domain exchange compacts the slots. Default is 0.1.*/
+void slots_set_gc_fraction(double gc_fraction, struct slots_manager_type * sman);
+/* Collect the garbage slots of ptype in a free list, so that new slots of this type reuse them
+ * before the slot array grows. slots_convert with placement < 0 takes slots from the free list.
+ * Not thread safe: call outside of parallel regions. Returns the number of free slots.*/
+int64_t slots_freelist_begin(int ptype, struct part_manager_type * pman, struct slots_manager_type * sman);
+/* Take a slot from the free list: returns -1 if the list is empty. Thread safe.*/
+int slots_freelist_pop(int ptype, struct slots_manager_type * sman);
+/* Free the free list. The slots not reused stay garbage.*/
+void slots_freelist_end(int ptype, struct slots_manager_type * sman);
 void slots_mark_garbage(int i, struct part_manager_type * pman, struct slots_manager_type * sman);
 void slots_setup_topology(struct part_manager_type * pman, int64_t * NLocal, struct slots_manager_type * sman);
 void slots_setup_id(const struct part_manager_type * pman, struct slots_manager_type * sman);
 int slots_split_particle(int parent, double childmass, struct part_manager_type * pman);
+void slots_split_particle_at(int parent, int64_t child, double childmass, struct part_manager_type * pman);
 int slots_convert(int parent, int ptype, int placement, struct part_manager_type * pman, struct slots_manager_type * sman);
 int slots_gc(int * compact_slots, struct part_manager_type * pman, struct slots_manager_type * sman);
 void slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sman);
@@ -14,57 +14,41 @@
 #include "stats.h"
 #include "walltime.h"
 #include "cooling_qso_lightup.h"
+#include "treewalk.h"
+#include "bhinfo.h"
 
 /* global state of system
 */
-struct state_of_system
-{
-    double Mass;
-    double EnergyKin;
-    double EnergyPot;
-    double EnergyInt;
-    double EnergyTot;
-
-    double Momentum[4];
-    double AngMomentum[4];
-    double CenterOfMass[4];
-    double MassComp[6];
-    /* Only Gas is used */
-    double TemperatureComp[6];
-
-    double EnergyKinComp[6];
-    double EnergyPotComp[6];
-    double EnergyIntComp[6];
-    double EnergyTotComp[6];
-    double MomentumComp[6][4];
-    double AngMomentumComp[6][4];
-    double CenterOfMassComp[6][4];
-};
-
 static struct stats_params
 {
     /* some filenames */
     char EnergyFile[100];
     char CpuFile[100];
+    char MemoryFile[100];
+    char StatusFile[100];
     /*Should we store the energy to EnergyFile on PM timesteps.*/
     int OutputEnergyDebug;
     int WriteBlackHoleDetails; /* write BH details every time step*/
     size_t MaxBlackHoleDetails; /* Max size of bh details file*/
+    size_t BlackHoleDetailsBuffer; /* Bytes of bh details to buffer per rank before appending them to a bigfile. 0 writes per-rank files.*/
 } StatsParams;
 
 void
 set_stats_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         param_get_string2(ps, "EnergyFile", StatsParams.EnergyFile, sizeof(StatsParams.EnergyFile));
         param_get_string2(ps, "CpuFile", StatsParams.CpuFile, sizeof(StatsParams.CpuFile));
+        param_get_string2(ps, "MemoryFile", StatsParams.MemoryFile, sizeof(StatsParams.MemoryFile));
+        param_get_string2(ps, "StatusFile", StatsParams.StatusFile, sizeof(StatsParams.StatusFile));
         StatsParams.OutputEnergyDebug = param_get_int(ps, "OutputEnergyDebug");
         StatsParams.WriteBlackHoleDetails = param_get_int(ps,"WriteBlackHoleDetails");
         StatsParams.MaxBlackHoleDetails = 1024L*1024L*1024L*param_get_int(ps, "MaxBlackHoleDetails");
+        StatsParams.BlackHoleDetailsBuffer = 1024L*1024L*param_get_int(ps, "BlackHoleDetailsBufferMB");
     }
-    MPI_Bcast(&StatsParams, sizeof(struct stats_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&StatsParams, sizeof(struct stats_params), MPI_BYTE, 0, GadgetComm);
 }
 
 /*!  This function opens various log-files that report on the status and
@@ -78,9 +62,10 @@ open_outputfiles(int RestartSnapNum, struct OutputFD * fds, const char * OutputD
     char * buf;
     char * postfix;
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     memset(fds, 0, sizeof(struct OutputFD));
     fds->FdCPU = NULL;
+    fds->FdMemory = NULL;
     fds->FdEnergy = NULL;
     fds->FdBlackHoles = NULL;
     fds->FdSfr = NULL;
@@ -88,6 +73,7 @@ open_outputfiles(int RestartSnapNum, struct OutputFD * fds, const char * OutputD
     fds->TotalBHDetailsBytesWritten = 0;
     fds->BHDetailNumber = 0;
     fds->FdHelium = NULL;
+    fds->FdTreeWalk = NULL;
 
     if(RestartSnapNum != -1) {
         postfix = fastpm_strdup_printf("-R%03d", RestartSnapNum);
@@ -96,7 +82,9 @@ open_outputfiles(int RestartSnapNum, struct OutputFD * fds, const char * OutputD
     }
 
     /* all the processors write to separate files*/
-    if(BlackHoleOn && StatsParams.WriteBlackHoleDetails){
+    if(BlackHoleOn && StatsParams.WriteBlackHoleDetails && StatsParams.BlackHoleDetailsBuffer > 0)
+        bh_details_buffer_init(StatsParams.BlackHoleDetailsBuffer, OutputDir);
+    else if(BlackHoleOn && StatsParams.WriteBlackHoleDetails){
         buf = fastpm_strdup_printf("%s/%s%s/%06X", OutputDir,"BlackholeDetails",postfix,ThisTask);
         fastpm_path_ensure_dirname(buf);
         if(!(fds->FdBlackholeDetails = fopen(buf,"a")))
@@ -124,6 +112,12 @@ open_outputfiles(int RestartSnapNum, struct OutputFD * fds, const char * OutputD
         endrun(1, "error in opening file '%s'\n", buf);
     myfree(buf);
 
+    buf = fastpm_strdup_printf("%s/%s%s", OutputDir, StatsParams.MemoryFile, postfix);
+    fastpm_path_ensure_dirname(buf);
+    if(!(fds->FdMemory = fopen(buf, mode)))
+        endrun(1, "error in opening file '%s'\n", buf);
+    myfree(buf);
+
     if(StatsParams.OutputEnergyDebug) {
         buf = fastpm_strdup_printf("%s/%s%s", OutputDir, StatsParams.EnergyFile, postfix);
         fastpm_path_ensure_dirname(buf);
@@ -147,6 +141,14 @@ open_outputfiles(int RestartSnapNum, struct OutputFD * fds, const char * OutputD
             endrun(1, "error in opening file '%s'\n", buf);
         myfree(buf);
     }
+
+    if(treewalk_log_on()) {
+        buf = fastpm_strdup_printf("%s/%s%s", OutputDir, "treewalk.jsonl", postfix);
+        fastpm_path_ensure_dirname(buf);
+        if(!(fds->FdTreeWalk = fopen(buf, mode)))
+            endrun(1, "error in opening file '%s'\n", buf);
+        myfree(buf);
+    }
     myfree(postfix);
 }
 
@@ -166,7 +168,7 @@ rotate_bhdetails_file(struct OutputFD * fds, const char * OutputDir, const int R
         postfix = fastpm_strdup_printf("%s", "");
     }
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     char * buf = fastpm_strdup_printf("%s/BlackholeDetails%s.%d/%06X", OutputDir, postfix, fds->BHDetailNumber, ThisTask);
     fastpm_path_ensure_dirname(buf);
     if(!(fds->FdBlackholeDetails = fopen(buf,"a")))
@@ -185,6 +187,8 @@ close_outputfiles(struct OutputFD * fds)
 {
     if(fds->FdCPU)
         fclose(fds->FdCPU);
+    if(fds->FdMemory)
+        fclose(fds->FdMemory);
     if(fds->FdEnergy)
         fclose(fds->FdEnergy);
     if(fds->FdSfr)
@@ -193,205 +197,338 @@ close_outputfiles(struct OutputFD * fds)
         fclose(fds->FdBlackHoles);
     if(fds->FdBlackholeDetails)
         fclose(fds->FdBlackholeDetails);
+    /* Collective*/
+    bh_details_flush();
+    if(fds->FdTreeWalk)
+        fclose(fds->FdTreeWalk);
 }
 
 
 void write_cpu_log(int NumCurrentTiStep, const double atime, FILE * FdCPU, double ElapsedTime)
 {
-    walltime_summary(0, MPI_COMM_WORLD);
+    walltime_summary(0, GadgetComm);
 
     if(FdCPU)
     {
         int NTask;
-        MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+        MPI_Comm_size(GadgetComm, &NTask);
         fprintf(FdCPU, "Step %d, Time: %g, MPIs: %d Threads: %d Elapsed: %g\n", NumCurrentTiStep, atime, NTask, omp_get_max_threads(), ElapsedTime);
-        walltime_report(FdCPU, 0, MPI_COMM_WORLD);
+        const TimebinForecast * forecast = get_timebin_forecast();
+        if(forecast->Ti_NextFull > 0)
+            fprintf(FdCPU, "Forecast: Next step active: %ld Next full step: %lx Active this PM step: %ld next PM step: %ld\n",
+                forecast->NextActive, forecast->Ti_NextFull, forecast->PMWork, forecast->NextPMWork);
+        walltime_report(FdCPU, 0, GadgetComm);
         fflush(FdCPU);
     }
 }
 
-/* This routine computes various global properties of the particle
- * distribution and stores the result in the struct `SysState'.
- * Currently, not all the information that's computed here is
- * actually used (e.g. momentum is not really used anywhere),
- * just the energies are written to a log-file every once in a while.
- */
-struct state_of_system compute_global_quantities_of_system(const double Time,  struct part_manager_type * PartManager)
+/* Peak memory of one block name, combined over ranks*/
+struct MemoryPeak
 {
-    int i, j;
-    struct state_of_system sys;
-    struct state_of_system SysState;
-    double a1, a2, a3;
-    int ThisTask;
+    char name[24];
+    int64_t peakmax;
+    int64_t peakmin;
+    int64_t sizemax;
+    int nrank; /* Number of ranks which allocated a block of this name*/
+};
 
-    a1 = Time;
-    a2 = Time * Time;
-    a3 = Time * Time * Time;
+struct MemoryPeakTable
+{
+    int n;
+    struct MemoryPeak p[ALLOC_NPEAK];
+};
 
-    double redshift = 1. / Time - 1;
-    memset(&sys, 0, sizeof(sys));
-    struct UVBG GlobalUVBG = get_global_UVBG(redshift);
+static int
+memory_peak_cmp_name(const void * a, const void * b)
+{
+    return strcmp(((const struct MemoryPeak *) a)->name, ((const struct MemoryPeak *) b)->name);
+}
 
-    #pragma omp parallel for
-    for(i = 0; i < PartManager->NumPart; i++)
-    {
-        int j;
-        double entr = 0, egyspec;
+static int
+memory_peak_cmp_peak(const void * a, const void * b)
+{
+    const struct MemoryPeak * pa = a, * pb = b;
+    return (pa->peakmax < pb->peakmax) - (pa->peakmax > pb->peakmax);
+}
 
-        sys.MassComp[P[i].Type] += P[i].Mass;
+/* MPI reduction merging tables sorted by name. Names past the end of the table are dropped.*/
+static void
+memory_peak_merge(void * invec, void * inoutvec, int * len, MPI_Datatype * type)
+{
+    struct MemoryPeakTable * in = invec;
+    struct MemoryPeakTable * inout = inoutvec;
+    int t;
+    for(t = 0; t < *len; t++) {
+        struct MemoryPeakTable out = {0};
+        int i = 0, j = 0;
+        while(out.n < ALLOC_NPEAK && (i < in[t].n || j < inout[t].n)) {
+            int cmp;
+            if(i == in[t].n)
+                cmp = 1;
+            else if(j == inout[t].n)
+                cmp = -1;
+            else
+                cmp = memory_peak_cmp_name(&in[t].p[i], &inout[t].p[j]);
+            struct MemoryPeak * res = &out.p[out.n++];
+            if(cmp < 0)
+                *res = in[t].p[i++];
+            else if(cmp > 0)
+                *res = inout[t].p[j++];
+            else {
+                const struct MemoryPeak * a = &in[t].p[i++];
+                const struct MemoryPeak * b = &inout[t].p[j++];
+                *res = *a;
+                res->peakmax = a->peakmax > b->peakmax ? a->peakmax : b->peakmax;
+                res->peakmin = a->peakmin < b->peakmin ? a->peakmin : b->peakmin;
+                res->sizemax = a->sizemax > b->sizemax ? a->sizemax : b->sizemax;
+                res->nrank = a->nrank + b->nrank;
+            }
+        }
+        inout[t] = out;
+    }
+}
 
-        sys.EnergyPotComp[P[i].Type] += 0.5 * P[i].Mass * P[i].Potential / a1;
+void
+write_memory_log(int NumCurrentTiStep, const double atime, FILE * FdMemory)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+
+    int64_t peak[2] = {A_MAIN->peak, -(int64_t) A_MAIN->peak};
+    MPI_Allreduce(MPI_IN_PLACE, peak, 2, MPI_INT64, MPI_MAX, GadgetComm);
+
+    struct MemoryPeakTable local = {0}, global = {0};
+    int i;
+    for(i = 0; i < A_MAIN->npeak; i++) {
+        struct MemoryPeak * p = &local.p[local.n++];
+        strncpy(p->name, A_MAIN->peaks[i].name, sizeof(p->name));
+        p->peakmax = p->peakmin = A_MAIN->peaks[i].peak;
+        p->sizemax = A_MAIN->peaks[i].size;
+        p->nrank = 1;
+    }
+    qsort(local.p, local.n, sizeof(local.p[0]), memory_peak_cmp_name);
 
-        sys.EnergyKinComp[P[i].Type] +=
-            0.5 * P[i].Mass * (P[i].Vel[0] * P[i].Vel[0] + P[i].Vel[1] * P[i].Vel[1] + P[i].Vel[2] * P[i].Vel[2]) / a2;
+    MPI_Datatype MPI_PEAKTABLE;
+    MPI_Type_contiguous(sizeof(struct MemoryPeakTable), MPI_BYTE, &MPI_PEAKTABLE);
+    MPI_Type_commit(&MPI_PEAKTABLE);
+    MPI_Op merge;
+    MPI_Op_create(memory_peak_merge, 1, &merge);
+    MPI_Reduce(&local, &global, 1, MPI_PEAKTABLE, merge, 0, GadgetComm);
+    MPI_Op_free(&merge);
+    MPI_Type_free(&MPI_PEAKTABLE);
 
-        if(P[i].Type == 0)
-        {
-            double localJ21 = 0;
-            double zreion = 0;
-#ifdef EXCUR_REION
-            localJ21 = SPHP(i).local_J21;
-            zreion = SPHP(i).zreion;
-#endif
-            struct UVBG uvbg = get_local_UVBG(redshift, &GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset, localJ21, zreion);
-            entr = SPHP(i).Entropy;
-            egyspec = entr / (GAMMA_MINUS1) * pow(SPHP(i).Density / a3, GAMMA_MINUS1);
-            sys.EnergyIntComp[0] += P[i].Mass * egyspec;
-            double ne = SPHP(i).Ne;
-            sys.TemperatureComp[0] += P[i].Mass * get_temp(SPHP(i).Density, egyspec, (1 - HYDROGEN_MASSFRAC), &uvbg, &ne);
-        }
+    allocator_reset_peaks(A_MAIN);
 
-        for(j = 0; j < 3; j++)
-        {
-            sys.MomentumComp[P[i].Type][j] += P[i].Mass * P[i].Vel[j];
-            sys.CenterOfMassComp[P[i].Type][j] += P[i].Mass * P[i].Pos[j];
-        }
+    if(!FdMemory)
+        return;
 
-        sys.AngMomentumComp[P[i].Type][0] += P[i].Mass * (P[i].Pos[1] * P[i].Vel[2] - P[i].Pos[2] * P[i].Vel[1]);
-        sys.AngMomentumComp[P[i].Type][1] += P[i].Mass * (P[i].Pos[2] * P[i].Vel[0] - P[i].Pos[0] * P[i].Vel[2]);
-        sys.AngMomentumComp[P[i].Type][2] += P[i].Mass * (P[i].Pos[0] * P[i].Vel[1] - P[i].Pos[1] * P[i].Vel[0]);
+    /* Largest peak first: the top entry is the block which set the peak memory on the fullest rank*/
+    qsort(global.p, global.n, sizeof(global.p[0]), memory_peak_cmp_peak);
+    const double MB = 1024. * 1024.;
+    fprintf(FdMemory, "Step %d, Time: %g, MPIs: %d Peak: %g MB (max) %g MB (min)\n", NumCurrentTiStep, atime, NTask, peak[0] / MB, -peak[1] / MB);
+    fprintf(FdMemory, "    %-24s %12s %12s %12s\n", "Name", "Peak Max MB", "Peak Min MB", "Size Max MB");
+    for(i = 0; i < global.n; i++) {
+        struct MemoryPeak * p = &global.p[i];
+        /* Ranks which never allocated this block have a minimum of zero*/
+        if(p->nrank < NTask)
+            p->peakmin = 0;
+        fprintf(FdMemory, "    %-24s %12.2f %12.2f %12.2f\n", p->name, p->peakmax / MB, p->peakmin / MB, p->sizemax / MB);
     }
+    fflush(FdMemory);
+}
 
+/* Start of the projection of the remaining run time: the first step written*/
+static double StatusStartLoga, StatusStartTime;
+static int StatusStarted;
 
-    /* some the stuff over all processors */
-    MPI_Reduce(&sys.MassComp[0], &SysState.MassComp[0], 6, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&sys.EnergyPotComp[0], &SysState.EnergyPotComp[0], 6, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&sys.EnergyIntComp[0], &SysState.EnergyIntComp[0], 6, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&sys.EnergyKinComp[0], &SysState.EnergyKinComp[0], 6, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&sys.TemperatureComp[0], &SysState.TemperatureComp[0], 6, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&sys.MomentumComp[0][0], &SysState.MomentumComp[0][0], 6 * 4, MPI_DOUBLE, MPI_SUM, 0,
-            MPI_COMM_WORLD);
-    MPI_Reduce(&sys.AngMomentumComp[0][0], &SysState.AngMomentumComp[0][0], 6 * 4, MPI_DOUBLE, MPI_SUM, 0,
-            MPI_COMM_WORLD);
-    MPI_Reduce(&sys.CenterOfMassComp[0][0], &SysState.CenterOfMassComp[0][0], 6 * 4, MPI_DOUBLE, MPI_SUM, 0,
-            MPI_COMM_WORLD);
-
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
-    {
-        for(i = 0; i < 6; i++) {
-            SysState.EnergyTotComp[i] = SysState.EnergyKinComp[i] +
-                SysState.EnergyPotComp[i] + SysState.EnergyIntComp[i];
-        }
-
-        SysState.Mass = SysState.EnergyKin = SysState.EnergyPot = SysState.EnergyInt = SysState.EnergyTot = 0;
+/* Seconds to evolve from atime to aend at the mean rate in loga of this run so far, or -1 if unknown*/
+static double
+status_projected_time(const double atime, const double aend, const double ElapsedTime)
+{
+    const double dloga = log(atime) - StatusStartLoga;
+    if(aend <= 0 || dloga <= 0 || ElapsedTime <= StatusStartTime)
+        return -1;
+    if(aend <= atime)
+        return 0;
+    return (log(aend) - log(atime)) * (ElapsedTime - StatusStartTime) / dloga;
+}
 
-        for(i = 0; i < 6; i++)
-        {
-            if(SysState.MassComp[i] > 0) {
-                SysState.TemperatureComp[i] /= SysState.MassComp[i];
-            }
-        }
+static void
+status_print_time(FILE * fd, const char * name, const double t)
+{
+    if(t < 0)
+        fprintf(fd, "\"%s\": null,\n", name);
+    else
+        fprintf(fd, "\"%s\": %g,\n", name, t);
+}
 
-        for(j = 0; j < 3; j++)
-            SysState.Momentum[j] = SysState.AngMomentum[j] = SysState.CenterOfMass[j] = 0;
-
-        for(i = 0; i < 6; i++)
-        {
-            SysState.Mass += SysState.MassComp[i];
-            SysState.EnergyKin += SysState.EnergyKinComp[i];
-            SysState.EnergyPot += SysState.EnergyPotComp[i];
-            SysState.EnergyInt += SysState.EnergyIntComp[i];
-            SysState.EnergyTot += SysState.EnergyTotComp[i];
-
-            for(j = 0; j < 3; j++)
-            {
-                SysState.Momentum[j] += SysState.MomentumComp[i][j];
-                SysState.AngMomentum[j] += SysState.AngMomentumComp[i][j];
-                SysState.CenterOfMass[j] += SysState.CenterOfMassComp[i][j];
-            }
-        }
+void
+write_status_file(const char * OutputDir, int NumCurrentTiStep, const double atime, const double TimeMax, const double NextSnapshotTime, const struct ClockTable * CT)
+{
+    if(strlen(StatsParams.StatusFile) == 0)
+        return;
+    int NTask, ThisTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    /* Must be before write_memory_log, which resets the peak*/
+    int64_t mem[2] = {A_MAIN->peak, A_MAIN->size}, memmax[2];
+    MPI_Reduce(mem, memmax, 2, MPI_INT64, MPI_MAX, 0, GadgetComm);
+    if(!StatusStarted) {
+        StatusStartLoga = log(atime);
+        StatusStartTime = CT->ElapsedTime;
+        StatusStarted = 1;
+    }
+    if(ThisTask != 0)
+        return;
 
-        for(i = 0; i < 6; i++)
-            for(j = 0; j < 3; j++)
-                if(SysState.MassComp[i] > 0)
-                    SysState.CenterOfMassComp[i][j] /= SysState.MassComp[i];
-
-        for(j = 0; j < 3; j++)
-            if(SysState.Mass > 0)
-                SysState.CenterOfMass[j] /= SysState.Mass;
-
-        for(i = 0; i < 6; i++)
-        {
-            SysState.CenterOfMassComp[i][3] = SysState.MomentumComp[i][3] = SysState.AngMomentumComp[i][3] = 0;
-            for(j = 0; j < 3; j++)
-            {
-                SysState.CenterOfMassComp[i][3] +=
-                    SysState.CenterOfMassComp[i][j] * SysState.CenterOfMassComp[i][j];
-                SysState.MomentumComp[i][3] += SysState.MomentumComp[i][j] * SysState.MomentumComp[i][j];
-                SysState.AngMomentumComp[i][3] +=
-                    SysState.AngMomentumComp[i][j] * SysState.AngMomentumComp[i][j];
-            }
-            SysState.CenterOfMassComp[i][3] = sqrt(SysState.CenterOfMassComp[i][3]);
-            SysState.MomentumComp[i][3] = sqrt(SysState.MomentumComp[i][3]);
-            SysState.AngMomentumComp[i][3] = sqrt(SysState.AngMomentumComp[i][3]);
-        }
+    /* The five slowest leaf clocks of this step, and the time ranks wait for the slowest in each*/
+    int top[5], ntop = 0;
+    double waiting = 0;
+    int i, j;
+    for(i = 0; i < CT->N; i++) {
+        const int id = CT->Order[i];
+        if(CT->Nchildren[id] > 0)
+            continue;
+        waiting += CT->C[id].max - CT->C[id].mean;
+        if(ntop == 5 && CT->C[top[4]].mean >= CT->C[id].mean)
+            continue;
+        for(j = ntop < 5 ? ntop : 4; j > 0 && CT->C[top[j-1]].mean < CT->C[id].mean; j--)
+            top[j] = top[j-1];
+        top[j] = id;
+        if(ntop < 5)
+            ntop++;
+    }
 
-        SysState.CenterOfMass[3] = SysState.Momentum[3] = SysState.AngMomentum[3] = 0;
+    char * fname = fastpm_strdup_printf("%s/%s", OutputDir, StatsParams.StatusFile);
+    char * tmpname = fastpm_strdup_printf("%s.tmp", fname);
+    FILE * fd = fopen(tmpname, "w");
+    if(!fd) {
+        message(1, "Could not write status file %s\n", tmpname);
+        myfree(tmpname);
+        myfree(fname);
+        return;
+    }
+    const double MB = 1024. * 1024.;
+    fprintf(fd, "{\n\"step\": %d,\n\"time\": %g,\n\"redshift\": %g,\n", NumCurrentTiStep, atime, 1/atime - 1);
+    fprintf(fd, "\"ntask\": %d,\n\"nthread\": %d,\n", NTask, omp_get_max_threads());
+    fprintf(fd, "\"step_seconds\": %g,\n\"elapsed_seconds\": %g,\n", CT->StepTime, CT->ElapsedTime);
+    /* Fraction of the step the average rank spends waiting for the slowest one*/
+    fprintf(fd, "\"imbalance\": %g,\n", CT->StepTime > 0 ? waiting / CT->StepTime : 0);
+    fprintf(fd, "\"memory_peak_mb\": %g,\n\"memory_total_mb\": %g,\n", memmax[0] / MB, memmax[1] / MB);
+    status_print_time(fd, "seconds_to_timemax", status_projected_time(atime, TimeMax, CT->ElapsedTime));
+    status_print_time(fd, "seconds_to_snapshot", status_projected_time(atime, NextSnapshotTime, CT->ElapsedTime));
+    if(NextSnapshotTime > 0)
+        fprintf(fd, "\"next_snapshot_time\": %g,\n", NextSnapshotTime);
+    fprintf(fd, "\"clocks\": [");
+    for(i = 0; i < ntop; i++) {
+        const struct Clock * c = &CT->C[top[i]];
+        fprintf(fd, "%s\n  {\"name\": \"%s\", \"mean\": %g, \"max\": %g, \"min\": %g}", i ? "," : "", c->name, c->mean, c->max, c->min);
+    }
+    fprintf(fd, "\n]\n}\n");
+    fclose(fd);
+    /* Readers see either the old or the new file*/
+    if(rename(tmpname, fname))
+        message(1, "Could not rename status file to %s\n", fname);
+    myfree(tmpname);
+    myfree(fname);
+}
 
-        for(j = 0; j < 3; j++)
-        {
-            SysState.CenterOfMass[3] += SysState.CenterOfMass[j] * SysState.CenterOfMass[j];
-            SysState.Momentum[3] += SysState.Momentum[j] * SysState.Momentum[j];
-            SysState.AngMomentum[3] += SysState.AngMomentum[j] * SysState.AngMomentum[j];
-        }
+/* Offsets of each per-type quantity in EnergySums.sum*/
+enum EnergySum {
+    ENERGY_MASS = 0,
+    ENERGY_KIN = 6,
+    ENERGY_POT = 12,
+    ENERGY_INT = 18,
+    /* Mass weighted temperature, for gas*/
+    ENERGY_TEMP = 24,
+};
 
-        SysState.CenterOfMass[3] = sqrt(SysState.CenterOfMass[3]);
-        SysState.Momentum[3] = sqrt(SysState.Momentum[3]);
-        SysState.AngMomentum[3] = sqrt(SysState.AngMomentum[3]);
-    }
+int
+energy_statistics_on(void)
+{
+    return StatsParams.OutputEnergyDebug;
+}
 
-    /* give everyone the result, maybe the want to do something with it */
-    MPI_Bcast(&SysState, sizeof(struct state_of_system), MPI_BYTE, 0, MPI_COMM_WORLD);
-    return SysState;
+void
+energy_statistics_begin(struct EnergySums * energy, const double Time)
+{
+    memset(energy, 0, sizeof(struct EnergySums));
+    energy->Time = Time;
+    energy->GlobalUVBG = get_global_UVBG(1. / Time - 1);
 }
 
-/*! This routine first calls a computation of various global
- * quantities of the particle distribution, and then writes some
- * statistics about the energies in the various particle components to
- * the file FdEnergy.
- */
-void energy_statistics(FILE * FdEnergy, const double Time, struct part_manager_type * PartManager)
+void
+energy_statistics_add(const struct EnergySums * energy, double * sum, const int i)
 {
-    if(!FdEnergy)
-        return;
+    const double a1 = energy->Time;
+    const double a2 = a1 * a1;
+    const double a3 = a2 * a1;
+    const int type = P[i].Type;
+
+    sum[ENERGY_MASS + type] += P[i].Mass;
+    sum[ENERGY_POT + type] += 0.5 * P[i].Mass * P[i].Potential / a1;
+    sum[ENERGY_KIN + type] += 0.5 * P[i].Mass * (P[i].Vel[0] * P[i].Vel[0] + P[i].Vel[1] * P[i].Vel[1] + P[i].Vel[2] * P[i].Vel[2]) / a2;
+
+    if(type == 0) {
+        double localJ21 = 0;
+        double zreion = 0;
+#ifdef EXCUR_REION
+        localJ21 = SPHP(i).local_J21;
+        zreion = SPHP(i).zreion;
+#endif
+        const double redshift = 1. / a1 - 1;
+        struct UVBG uvbg = get_local_UVBG(redshift, &energy->GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset, localJ21, zreion);
+        const double egyspec = SPHP(i).Entropy / (GAMMA_MINUS1) * pow(SPHP(i).Density / a3, GAMMA_MINUS1);
+        sum[ENERGY_INT] += P[i].Mass * egyspec;
+        double ne = SPHP(i).Ne;
+        sum[ENERGY_TEMP] += P[i].Mass * get_temp(SPHP(i).Density, egyspec, (1 - HYDROGEN_MASSFRAC), &uvbg, &ne);
+    }
+}
+
+/* Energy log file, set on rank 0 for print_energy_statistics*/
+static FILE * EnergyFd;
 
-    struct state_of_system SysState = compute_global_quantities_of_system(Time, PartManager);
+/* Write a line of the energy log from the reduced sums: the time, then the sums.*/
+static void
+print_energy_statistics(const char * label, const double * v)
+{
+    const double Time = v[0];
+    const double * sum = v + 1;
+    double EnergyInt = 0, EnergyPot = 0, EnergyKin = 0;
+    int i;
+    for(i = 0; i < 6; i++) {
+        EnergyInt += sum[ENERGY_INT + i];
+        EnergyPot += sum[ENERGY_POT + i];
+        EnergyKin += sum[ENERGY_KIN + i];
+    }
+    const double Temperature = sum[ENERGY_MASS] > 0 ? sum[ENERGY_TEMP] / sum[ENERGY_MASS] : 0;
 
-    message(0, "Time %g Mean Temperature of Gas %g\n",
-                Time, SysState.TemperatureComp[0]);
+    message(0, "Time %g Mean Temperature of Gas %g\n", Time, Temperature);
 
-    fprintf(FdEnergy,
-            "%g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g\n",
-            Time, SysState.TemperatureComp[0], SysState.EnergyInt, SysState.EnergyPot, SysState.EnergyKin, SysState.EnergyIntComp[0],
-            SysState.EnergyPotComp[0], SysState.EnergyKinComp[0], SysState.EnergyIntComp[1],
-            SysState.EnergyPotComp[1], SysState.EnergyKinComp[1], SysState.EnergyIntComp[2],
-            SysState.EnergyPotComp[2], SysState.EnergyKinComp[2], SysState.EnergyIntComp[3],
-            SysState.EnergyPotComp[3], SysState.EnergyKinComp[3], SysState.EnergyIntComp[4],
-            SysState.EnergyPotComp[4], SysState.EnergyKinComp[4], SysState.EnergyIntComp[5],
-            SysState.EnergyPotComp[5], SysState.EnergyKinComp[5], SysState.MassComp[0],
-            SysState.MassComp[1], SysState.MassComp[2], SysState.MassComp[3], SysState.MassComp[4],
-            SysState.MassComp[5]);
+    if(!EnergyFd)
+        return;
+    fprintf(EnergyFd, "%g %g %g %g %g", Time, Temperature, EnergyInt, EnergyPot, EnergyKin);
+    for(i = 0; i < 6; i++)
+        fprintf(EnergyFd, " %g %g %g", sum[ENERGY_INT + i], sum[ENERGY_POT + i], sum[ENERGY_KIN + i]);
+    for(i = 0; i < 6; i++)
+        fprintf(EnergyFd, " %g", sum[ENERGY_MASS + i]);
+    fprintf(EnergyFd, "\n");
+    fflush(EnergyFd);
+}
 
-    fflush(FdEnergy);
+void
+energy_statistics(FILE * FdEnergy, const struct EnergySums * energy)
+{
+    EnergyFd = FdEnergy;
+    double values[ENERGY_NSUM + 1];
+    enum DiagOp ops[ENERGY_NSUM + 1];
+    values[0] = energy->Time;
+    ops[0] = DIAG_MAX;
+    int i;
+    for(i = 0; i < ENERGY_NSUM; i++) {
+        values[i + 1] = energy->sum[i];
+        ops[i + 1] = DIAG_SUM;
+    }
+    diagnostics_add("Energy", values, ops, ENERGY_NSUM + 1, print_energy_statistics);
 }
@@ -3,17 +3,21 @@
 
 /* Header for writing statistics*/
 
+#include "cooling.h"
+
 /* Structs and functions to open file descriptors for logging output*/
 struct OutputFD
 {
     FILE *FdEnergy;     /*!< file handle for energy.txt log-file. */
     FILE *FdCPU;    /*!< file handle for cpu.txt log-file. */
+    FILE *FdMemory;    /*!< file handle for memory.txt log-file. */
     FILE *FdSfr;     /*!< file handle for sfr.txt log-file. */
     FILE *FdBlackHoles;  /*!< file handle for blackholes.txt log-file. */
     FILE *FdBlackholeDetails;  /*!< file handle for BlackholeDetails binary file. */
     size_t TotalBHDetailsBytesWritten; /* total number of bytes written to blackhole details*/
     int BHDetailNumber; /* Records how many times we opened a new BH details file in this run*/
     FILE *FdHelium; /* < file handle for the Helium reionization log file helium.txt */
+    FILE *FdTreeWalk; /* < file handle for the treewalk statistics log file treewalk.jsonl */
 };
 
 void set_stats_params(ParameterSet * ps);
@@ -24,8 +28,40 @@ void close_outputfiles(struct OutputFD *fds);
 /* Write out a CPU log file*/
 void write_cpu_log(int NumCurrentTiStep, const double atime, FILE * FdCPU, double ElapsedTime);
 
-/* Write out overall statistics of the energy of the simulation */
-void energy_statistics(FILE * FdEnergy, const double Time,  struct part_manager_type * PartManager);
+/* Write out the peak memory usage of this step, attributed to the allocated block names, and start a new peak. Collective.*/
+void write_memory_log(int NumCurrentTiStep, const double atime, FILE * FdMemory);
+
+struct ClockTable;
+/* Rewrite a small JSON summary of the latest step (StatusFile in OutputDir): the slowest clocks,
+ * imbalance, peak memory and the projected time to TimeMax and the next snapshot (NextSnapshotTime, 0 if none).
+ * For schedulers and dashboards. Collective, and must be called before write_memory_log.*/
+void write_status_file(const char * OutputDir, int NumCurrentTiStep, const double atime, const double TimeMax, const double NextSnapshotTime, const struct ClockTable * CT);
+
+/* Number of running sums of the energy statistics: for each particle type the mass,
+ * the kinetic, potential and thermal energy and the mass weighted temperature.*/
+#define ENERGY_NSUM (5 * 6)
+
+/* Energy statistics of a PM step. They are summed by the closing PM half-kick, which visits every particle,
+ * so that they need no pass over the particles or collectives of their own.*/
+struct EnergySums
+{
+    double Time;
+    struct UVBG GlobalUVBG;
+    double sum[ENERGY_NSUM];
+};
+
+/* True if OutputEnergyDebug is set, so energy statistics should be collected on PM steps. Same on all ranks.*/
+int energy_statistics_on(void);
+
+/* Start collecting energy statistics at Time*/
+void energy_statistics_begin(struct EnergySums * energy, const double Time);
+
+/* Add particle i to sum, which is laid out like EnergySums.sum. Thread safe if each thread has its own sum.*/
+void energy_statistics_add(const struct EnergySums * energy, double * sum, const int i);
+
+/* Reduce the energy statistics with the other diagnostics of the step, and write them to FdEnergy,
+ * which is only open on rank 0, when they are printed. Collective.*/
+void energy_statistics(FILE * FdEnergy, const struct EnergySums * energy);
 
 /* Checks whether we have  written a large BH details file and, if so, closes the current file and opens a new one.*/
 void rotate_bhdetails_file(struct OutputFD * fds, const char * OutputDir, const int RestartSnapNum);
@@ -0,0 +1,717 @@
+/* A SUBFIND-like subhalo finder, run on the particles of each FOF group once they have been
+ * gathered onto one rank for output. See Springel et al 2001 (astro-ph/0012055).
+ * For each group:
+ *  - the density of every member is estimated with the SPH kernel over its DesLinkNgb nearest members,
+ *  - members are added in order of decreasing density: a member whose two nearest denser neighbours
+ *    are in different substructures is a saddle point, where both substructures become candidates,
+ *  - candidates are cleaned of unbound particles, smallest first, and each particle is kept by the
+ *    smallest subhalo in which it is bound.*/
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "utils.h"
+#include "subfind.h"
+#include "densitykernel.h"
+#include "density.h"
+
+/* Largest number of neighbours used for the densities*/
+#define SUBFIND_MAXNGB 64
+/* Groups with more members than this are done one at a time with all threads*/
+#define SUBFIND_SMALL_GROUP 4096
+/* Above this many members the potential is computed from a regular sample of the members*/
+#define SUBFIND_NDIRECT 4096
+
+static struct subfind_params
+{
+    int SubfindOn;
+    /* Number of neighbours for the density estimate and the saddle points*/
+    int DesLinkNgb;
+    /* Smallest number of bound particles in a subhalo*/
+    int MinLength;
+} SubfindParams;
+
+void
+set_subfind_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        SubfindParams.SubfindOn = param_get_int(ps, "SubfindOn");
+        SubfindParams.DesLinkNgb = param_get_int(ps, "SubfindDesLinkNgb");
+        SubfindParams.MinLength = param_get_int(ps, "SubfindMinLength");
+        if(SubfindParams.DesLinkNgb < 2 || SubfindParams.DesLinkNgb > SUBFIND_MAXNGB)
+            endrun(0, "SubfindDesLinkNgb = %d should be between 2 and %d\n", SubfindParams.DesLinkNgb, SUBFIND_MAXNGB);
+    }
+    MPI_Bcast(&SubfindParams, sizeof(struct subfind_params), MPI_BYTE, 0, GadgetComm);
+}
+
+void
+set_subfind_testpar(int SubfindOn, int DesLinkNgb, int MinLength)
+{
+    SubfindParams.SubfindOn = SubfindOn;
+    SubfindParams.DesLinkNgb = DesLinkNgb;
+    SubfindParams.MinLength = MinLength;
+}
+
+int
+subfind_enabled(void)
+{
+    return SubfindParams.SubfindOn;
+}
+
+struct subfind_consts
+{
+    double atime;
+    double hubble;
+    double G;
+    double eps2;
+    double BoxSize;
+    int nngb;
+    int MinLength;
+};
+
+struct subfind_sortkey
+{
+    double key;
+    int index;
+};
+
+/* Scratch space for one group. Members are numbered by their position in index.*/
+struct subfind_scratch
+{
+    int64_t size;
+    /* Index of each member in the particle table*/
+    int * index;
+    /* Position relative to the first member*/
+    double (*pos)[3];
+    /* Nearest neighbours of each member, nearest first*/
+    int * ngb;
+    double * dens;
+    /* Position of each member in order of decreasing density*/
+    int * rank;
+    /* Substructures: linked lists of members, with the length and tail stored at the head*/
+    int * head;
+    int * next;
+    int * tail;
+    int * len;
+    /* Candidate substructures as the head and length of their list*/
+    int * cand_head;
+    int * cand_len;
+    /* Cells of the neighbour search grid*/
+    int * cellstart;
+    int * cellpart;
+    /* Subhalo of each member in this group, or -1*/
+    int * bound;
+    int * members;
+    double * energy;
+    struct subfind_sortkey * sortkey;
+    /* Subhalos of the group*/
+    struct Subhalo * sub;
+};
+
+/* Carve the scratch for groups of up to n members out of mem. With mem = NULL, just returns the size.*/
+static size_t
+subfind_scratch_init(struct subfind_scratch * s, char * mem, int64_t n, int nngb)
+{
+    size_t off = 0;
+    /* Each saddle point makes at most two candidates, and there is at most one saddle point per member*/
+    const int64_t ncand = 2 * n + 1;
+#define SUBFIND_CARVE(field, type, count) { if(s) s->field = (type) (mem + off); off += (count) * sizeof(*s->field); }
+    SUBFIND_CARVE(sub, struct Subhalo *, n / 2 + 1);
+    SUBFIND_CARVE(pos, double (*)[3], n);
+    SUBFIND_CARVE(dens, double *, n);
+    SUBFIND_CARVE(energy, double *, n);
+    SUBFIND_CARVE(sortkey, struct subfind_sortkey *, ncand);
+    SUBFIND_CARVE(index, int *, n);
+    SUBFIND_CARVE(ngb, int *, n * nngb);
+    SUBFIND_CARVE(rank, int *, n);
+    SUBFIND_CARVE(head, int *, n);
+    SUBFIND_CARVE(next, int *, n);
+    SUBFIND_CARVE(tail, int *, n);
+    SUBFIND_CARVE(len, int *, n);
+    SUBFIND_CARVE(cand_head, int *, ncand);
+    SUBFIND_CARVE(cand_len, int *, ncand);
+    SUBFIND_CARVE(cellstart, int *, n + 1);
+    SUBFIND_CARVE(cellpart, int *, n);
+    SUBFIND_CARVE(bound, int *, n);
+    SUBFIND_CARVE(members, int *, n);
+#undef SUBFIND_CARVE
+    if(s)
+        s->size = n;
+    /* Keep the next block aligned*/
+    return (off + 7) / 8 * 8;
+}
+
+static int
+subfind_cmp_sortkey(const void * a, const void * b)
+{
+    const struct subfind_sortkey * ka = (const struct subfind_sortkey *) a;
+    const struct subfind_sortkey * kb = (const struct subfind_sortkey *) b;
+    if(ka->key != kb->key)
+        return (ka->key > kb->key) - (ka->key < kb->key);
+    return (ka->index > kb->index) - (ka->index < kb->index);
+}
+
+/* Push a neighbour onto a max-heap of the nearest neighbours found so far*/
+static void
+subfind_heap_push(double * hd, int * hi, int * nheap, const int maxheap, const double d, const int j)
+{
+    int c;
+    if(*nheap < maxheap) {
+        /* Sift up*/
+        c = (*nheap)++;
+        while(c > 0 && hd[(c - 1) / 2] < d) {
+            hd[c] = hd[(c - 1) / 2];
+            hi[c] = hi[(c - 1) / 2];
+            c = (c - 1) / 2;
+        }
+    }
+    else {
+        if(d >= hd[0])
+            return;
+        /* Replace the root and sift down*/
+        c = 0;
+        while(2 * c + 1 < maxheap) {
+            int child = 2 * c + 1;
+            if(child + 1 < maxheap && hd[child + 1] > hd[child])
+                child++;
+            if(hd[child] <= d)
+                break;
+            hd[c] = hd[child];
+            hi[c] = hi[child];
+            c = child;
+        }
+    }
+    hd[c] = d;
+    hi[c] = j;
+}
+
+/* Find the nearest neighbours of each member with a grid over the group, and estimate the densities.*/
+static void
+subfind_densities(struct subfind_scratch * s, const int n, const struct part_manager_type * pman, const struct subfind_consts * c, const int parallel)
+{
+    const int nngb = c->nngb;
+    double lo[3], hi[3];
+    int64_t i;
+    int d;
+    for(d = 0; d < 3; d++) {
+        lo[d] = hi[d] = 0;
+        for(i = 0; i < n; i++) {
+            lo[d] = DMIN(lo[d], s->pos[i][d]);
+            hi[d] = DMAX(hi[d], s->pos[i][d]);
+        }
+    }
+    /* About 8 members per cell, and so at most one cell per member*/
+    const int nc = DMAX(1, floor(cbrt(n / 8.)));
+    double cellsize[3], mincell = 0;
+    for(d = 0; d < 3; d++) {
+        cellsize[d] = DMAX((hi[d] - lo[d]) / nc, 1e-10 * c->BoxSize);
+        mincell = (d == 0) ? cellsize[d] : DMIN(mincell, cellsize[d]);
+    }
+    const int ncells = nc * nc * nc;
+    /* Counting sort of the members into cells. rank is used for the cell of each member.*/
+    memset(s->cellstart, 0, (ncells + 1) * sizeof(int));
+    for(i = 0; i < n; i++) {
+        int cell = 0;
+        for(d = 0; d < 3; d++) {
+            int ci = DMIN((s->pos[i][d] - lo[d]) / cellsize[d], nc - 1);
+            cell = cell * nc + ci;
+        }
+        s->rank[i] = cell;
+        s->cellstart[cell + 1]++;
+    }
+    for(i = 0; i < ncells; i++)
+        s->cellstart[i + 1] += s->cellstart[i];
+    for(i = 0; i < n; i++)
+        s->cellpart[s->cellstart[s->rank[i]]++] = i;
+    /* Shift the starts back*/
+    for(i = ncells; i > 0; i--)
+        s->cellstart[i] = s->cellstart[i - 1];
+    s->cellstart[0] = 0;
+
+    const int maxheap = nngb;
+    const enum DensityKernelType ktype = GetDensityKernelType();
+    #pragma omp parallel for schedule(dynamic, 256) if(parallel)
+    for(i = 0; i < n; i++) {
+        double hd[SUBFIND_MAXNGB];
+        int hidx[SUBFIND_MAXNGB];
+        int nheap = 0;
+        int ci[3], sh, k;
+        for(k = 0; k < 3; k++)
+            ci[k] = DMIN((s->pos[i][k] - lo[k]) / cellsize[k], nc - 1);
+        /* Search shells of cells around the member until no closer member can be found*/
+        for(sh = 0; sh < nc; sh++) {
+            int dx, dy, dz;
+            for(dx = -sh; dx <= sh; dx++) {
+                if(ci[0] + dx < 0 || ci[0] + dx >= nc)
+                    continue;
+                for(dy = -sh; dy <= sh; dy++) {
+                    if(ci[1] + dy < 0 || ci[1] + dy >= nc)
+                        continue;
+                    for(dz = -sh; dz <= sh; dz++) {
+                        if(ci[2] + dz < 0 || ci[2] + dz >= nc)
+                            continue;
+                        /* Only the surface of the shell*/
+                        if(abs(dx) != sh && abs(dy) != sh && abs(dz) != sh)
+                            continue;
+                        const int cell = ((ci[0] + dx) * nc + ci[1] + dy) * nc + ci[2] + dz;
+                        int q;
+                        for(q = s->cellstart[cell]; q < s->cellstart[cell + 1]; q++) {
+                            const int j = s->cellpart[q];
+                            if(j == i)
+                                continue;
+                            double r2 = 0;
+                            for(k = 0; k < 3; k++)
+                                r2 += (s->pos[i][k] - s->pos[j][k]) * (s->pos[i][k] - s->pos[j][k]);
+                            subfind_heap_push(hd, hidx, &nheap, maxheap, r2, j);
+                        }
+                    }
+                }
+            }
+            if(nheap == maxheap && hd[0] <= sh * sh * mincell * mincell)
+                break;
+        }
+        /* Sort the neighbours by distance: the heap is small*/
+        for(k = 1; k < nheap; k++) {
+            double dk = hd[k];
+            int ik = hidx[k];
+            int m = k - 1;
+            while(m >= 0 && hd[m] > dk) {
+                hd[m + 1] = hd[m];
+                hidx[m + 1] = hidx[m];
+                m--;
+            }
+            hd[m + 1] = dk;
+            hidx[m + 1] = ik;
+        }
+        const struct particle_data * pi = &pman->Base[s->index[i]];
+        const double h = sqrt(hd[nheap - 1]) * (1 + 1e-6);
+        DensityKernel kernel;
+        density_kernel_init(&kernel, h, ktype);
+        double dens = pi->Mass * density_kernel_wk(&kernel, 0);
+        for(k = 0; k < nngb; k++) {
+            const int j = (k < nheap) ? hidx[k] : -1;
+            s->ngb[i * nngb + k] = j;
+            if(j >= 0)
+                dens += pman->Base[s->index[j]].Mass * density_kernel_wk(&kernel, sqrt(hd[k]) / h);
+        }
+        s->dens[i] = dens;
+    }
+}
+
+/* Add the members in order of decreasing density, building substructures and recording candidates at the saddle points.
+ * Returns the number of candidates, sorted by length.*/
+static int
+subfind_find_candidates(struct subfind_scratch * s, const int n, const struct subfind_consts * c, const int parallel)
+{
+    int64_t i;
+    for(i = 0; i < n; i++) {
+        s->sortkey[i].key = -s->dens[i];
+        s->sortkey[i].index = i;
+    }
+    if(parallel)
+        qsort_openmp(s->sortkey, n, sizeof(struct subfind_sortkey), subfind_cmp_sortkey);
+    else
+        qsort(s->sortkey, n, sizeof(struct subfind_sortkey), subfind_cmp_sortkey);
+    for(i = 0; i < n; i++)
+        s->rank[s->sortkey[i].index] = i;
+
+    int ncand = 0;
+    for(i = 0; i < n; i++) {
+        const int p = s->sortkey[i].index;
+        /* The two nearest neighbours which are denser*/
+        int a = -1, b = -1, k;
+        for(k = 0; k < c->nngb; k++) {
+            const int j = s->ngb[p * c->nngb + k];
+            if(j < 0 || s->rank[j] > i)
+                continue;
+            if(a < 0)
+                a = j;
+            else {
+                b = j;
+                break;
+            }
+        }
+        s->next[p] = -1;
+        if(a < 0) {
+            /* A density peak: start a new substructure*/
+            s->head[p] = p;
+            s->tail[p] = p;
+            s->len[p] = 1;
+            continue;
+        }
+        int ha = s->head[a];
+        if(b >= 0 && s->head[b] != ha) {
+            /* A saddle point: both substructures are candidates, and are then joined*/
+            int hb = s->head[b];
+            if(s->len[ha] >= c->MinLength) {
+                s->cand_head[ncand] = ha;
+                s->cand_len[ncand++] = s->len[ha];
+            }
+            if(s->len[hb] >= c->MinLength) {
+                s->cand_head[ncand] = hb;
+                s->cand_len[ncand++] = s->len[hb];
+            }
+            if(s->len[ha] < s->len[hb]) {
+                int tmp = ha;
+                ha = hb;
+                hb = tmp;
+            }
+            /* Relabel the smaller one and append it: the earlier members of each list stay in place*/
+            int q;
+            for(q = hb; q >= 0; q = s->next[q])
+                s->head[q] = ha;
+            s->next[s->tail[ha]] = hb;
+            s->tail[ha] = s->tail[hb];
+            s->len[ha] += s->len[hb];
+        }
+        s->head[p] = ha;
+        s->next[s->tail[ha]] = p;
+        s->tail[ha] = p;
+        s->len[ha]++;
+    }
+    /* What is left at the end is also a candidate*/
+    for(i = 0; i < n; i++) {
+        if(s->head[i] == i && s->len[i] >= c->MinLength) {
+            s->cand_head[ncand] = i;
+            s->cand_len[ncand++] = s->len[i];
+        }
+    }
+    /* Sort by length and remove candidates recorded twice*/
+    for(i = 0; i < ncand; i++) {
+        s->sortkey[i].key = s->cand_len[i];
+        s->sortkey[i].index = s->cand_head[i];
+    }
+    qsort(s->sortkey, ncand, sizeof(struct subfind_sortkey), subfind_cmp_sortkey);
+    int nuniq = 0;
+    for(i = 0; i < ncand; i++) {
+        if(nuniq > 0 && s->cand_head[nuniq - 1] == s->sortkey[i].index && s->cand_len[nuniq - 1] == s->sortkey[i].key)
+            continue;
+        s->cand_head[nuniq] = s->sortkey[i].index;
+        s->cand_len[nuniq] = s->sortkey[i].key;
+        nuniq++;
+    }
+    return nuniq;
+}
+
+/* Remove unbound particles from members until all are bound. At most a quarter of the particles,
+ * the least bound, are removed each iteration, as the centre and bulk velocity change as particles are removed.
+ * Returns the number of bound members, which are moved to the start of members with their energy in s->energy.*/
+static int
+subfind_unbind(struct subfind_scratch * s, int * members, int nmem, const struct part_manager_type * pman, const struct subfind_consts * c, const int parallel)
+{
+    while(nmem >= c->MinLength) {
+        int64_t i;
+        /* Potential from all members, or from a regular sample with the mass scaled up*/
+        const int stride = (nmem + SUBFIND_NDIRECT - 1) / SUBFIND_NDIRECT;
+        double mtot = 0, msample = 0, vbulk[3] = {0};
+        for(i = 0; i < nmem; i++) {
+            const struct particle_data * pi = &pman->Base[s->index[members[i]]];
+            mtot += pi->Mass;
+            if(i % stride == 0)
+                msample += pi->Mass;
+            int d;
+            for(d = 0; d < 3; d++)
+                vbulk[d] += pi->Mass * pi->Vel[d];
+        }
+        int d;
+        for(d = 0; d < 3; d++)
+            vbulk[d] /= mtot;
+        const double massfac = mtot / msample;
+
+        #pragma omp parallel for schedule(static) if(parallel)
+        for(i = 0; i < nmem; i++) {
+            const double * xi = s->pos[members[i]];
+            double pot = 0;
+            int64_t j;
+            for(j = 0; j < nmem; j += stride) {
+                if(j == i)
+                    continue;
+                const double * xj = s->pos[members[j]];
+                const double r2 = (xi[0] - xj[0]) * (xi[0] - xj[0]) + (xi[1] - xj[1]) * (xi[1] - xj[1]) + (xi[2] - xj[2]) * (xi[2] - xj[2]);
+                pot -= pman->Base[s->index[members[j]]].Mass / sqrt(r2 + c->eps2);
+            }
+            /* Physical potential*/
+            s->energy[i] = pot * massfac * c->G / c->atime;
+        }
+        /* Hubble flow is about the potential minimum*/
+        int imin = 0;
+        for(i = 1; i < nmem; i++)
+            if(s->energy[i] < s->energy[imin])
+                imin = i;
+        const double * xmin = s->pos[members[imin]];
+
+        int64_t nunbound = 0;
+        #pragma omp parallel for schedule(static) reduction(+: nunbound) if(parallel)
+        for(i = 0; i < nmem; i++) {
+            const struct particle_data * pi = &pman->Base[s->index[members[i]]];
+            double v2 = 0;
+            int k;
+            for(k = 0; k < 3; k++) {
+                const double v = (pi->Vel[k] - vbulk[k]) / c->atime + c->hubble * c->atime * (s->pos[members[i]][k] - xmin[k]);
+                v2 += v * v;
+            }
+            s->energy[i] += 0.5 * v2;
+            if(s->energy[i] > 0)
+                nunbound++;
+        }
+        if(nunbound == 0)
+            break;
+        /* Keep the most bound particles*/
+        for(i = 0; i < nmem; i++) {
+            s->sortkey[i].key = s->energy[i];
+            s->sortkey[i].index = members[i];
+        }
+        if(parallel)
+            qsort_openmp(s->sortkey, nmem, sizeof(struct subfind_sortkey), subfind_cmp_sortkey);
+        else
+            qsort(s->sortkey, nmem, sizeof(struct subfind_sortkey), subfind_cmp_sortkey);
+        if(nunbound > nmem / 4)
+            nunbound = DMAX(nmem / 4, 1);
+        nmem -= nunbound;
+        for(i = 0; i < nmem; i++) {
+            members[i] = s->sortkey[i].index;
+            s->energy[i] = s->sortkey[i].key;
+        }
+    }
+    return nmem;
+}
+
+/* Fill the properties of a subhalo from its bound members*/
+static void
+subfind_make_subhalo(struct Subhalo * sub, const struct subfind_scratch * s, const int * members, const int nmem, const struct part_manager_type * pman, const struct subfind_consts * c, const int GrNr)
+{
+    int i, d, imin = 0;
+    memset(sub, 0, sizeof(struct Subhalo));
+    sub->GrNr = GrNr;
+    sub->Length = nmem;
+    for(i = 0; i < nmem; i++) {
+        const struct particle_data * pi = &pman->Base[s->index[members[i]]];
+        sub->LenType[pi->Type]++;
+        sub->MassType[pi->Type] += pi->Mass;
+        sub->Mass += pi->Mass;
+        for(d = 0; d < 3; d++) {
+            sub->CM[d] += pi->Mass * s->pos[members[i]][d];
+            sub->Vel[d] += pi->Mass * pi->Vel[d];
+        }
+        if(s->energy[i] < s->energy[imin])
+            imin = i;
+    }
+    for(d = 0; d < 3; d++) {
+        sub->CM[d] /= sub->Mass;
+        sub->Vel[d] /= sub->Mass;
+    }
+    double disp = 0;
+    for(i = 0; i < nmem; i++) {
+        const struct particle_data * pi = &pman->Base[s->index[members[i]]];
+        for(d = 0; d < 3; d++)
+            disp += pi->Mass * pow((pi->Vel[d] - sub->Vel[d]) / c->atime, 2);
+    }
+    sub->VelDisp = sqrt(disp / (3 * sub->Mass));
+    /* Positions are relative to the first member: move them back into the box*/
+    const struct particle_data * first = &pman->Base[s->index[0]];
+    for(d = 0; d < 3; d++) {
+        sub->Pos[d] = first->Pos[d] + s->pos[members[imin]][d];
+        sub->CM[d] += first->Pos[d];
+        while(sub->Pos[d] >= c->BoxSize) sub->Pos[d] -= c->BoxSize;
+        while(sub->Pos[d] < 0) sub->Pos[d] += c->BoxSize;
+        while(sub->CM[d] >= c->BoxSize) sub->CM[d] -= c->BoxSize;
+        while(sub->CM[d] < 0) sub->CM[d] += c->BoxSize;
+    }
+    sub->MostBoundID = pman->Base[s->index[members[imin]]].ID;
+}
+
+/* Find the subhalos of one group, whose members are index[0..n). Returns the number of subhalos, stored in s->sub.*/
+static int
+subfind_group(struct subfind_scratch * s, const int * index, const int n, struct part_manager_type * pman, const struct subfind_consts * c, const int parallel)
+{
+    int64_t i;
+    if(n < c->MinLength)
+        return 0;
+    const int GrNr = pman->Base[index[0]].GrNr;
+    const double * first = pman->Base[index[0]].Pos;
+    #pragma omp parallel for if(parallel)
+    for(i = 0; i < n; i++) {
+        int d;
+        s->index[i] = index[i];
+        for(d = 0; d < 3; d++)
+            s->pos[i][d] = NEAREST(pman->Base[index[i]].Pos[d] - first[d], c->BoxSize);
+        s->bound[i] = -1;
+    }
+    subfind_densities(s, n, pman, c, parallel);
+    const int ncand = subfind_find_candidates(s, n, c, parallel);
+
+    /* Unbind the candidates, smallest first, without the members already in a smaller subhalo*/
+    int nsub = 0, k;
+    for(k = 0; k < ncand; k++) {
+        int nmem = 0, q = s->cand_head[k];
+        for(i = 0; i < s->cand_len[k]; i++) {
+            if(s->bound[q] < 0)
+                s->members[nmem++] = q;
+            q = s->next[q];
+        }
+        if(nmem < c->MinLength)
+            continue;
+        nmem = subfind_unbind(s, s->members, nmem, pman, c, parallel);
+        if(nmem < c->MinLength)
+            continue;
+        for(i = 0; i < nmem; i++)
+            s->bound[s->members[i]] = nsub;
+        subfind_make_subhalo(&s->sub[nsub], s, s->members, nmem, pman, c, GrNr);
+        nsub++;
+    }
+    /* Rank the subhalos by length, largest first*/
+    for(k = 0; k < nsub; k++) {
+        s->sortkey[k].key = -s->sub[k].Length;
+        s->sortkey[k].index = k;
+    }
+    qsort(s->sortkey, nsub, sizeof(struct subfind_sortkey), subfind_cmp_sortkey);
+    for(k = 0; k < nsub; k++)
+        s->cand_head[s->sortkey[k].index] = k;
+    for(k = 0; k < nsub; k++)
+        s->sub[k].SubNr = s->cand_head[k];
+    for(i = 0; i < n; i++)
+        pman->Base[index[i]].TopLeaf = (s->bound[i] >= 0) ? s->cand_head[s->bound[i]] : SUBFIND_UNBOUND;
+    return nsub;
+}
+
+static int
+subfind_cmp_subhalo(const void * a, const void * b)
+{
+    const struct Subhalo * sa = (const struct Subhalo *) a;
+    const struct Subhalo * sb = (const struct Subhalo *) b;
+    if(sa->GrNr != sb->GrNr)
+        return (sa->GrNr > sb->GrNr) - (sa->GrNr < sb->GrNr);
+    return (sa->SubNr > sb->SubNr) - (sa->SubNr < sb->SubNr);
+}
+
+struct subfind_member {
+    int GrNr;
+    int index;
+};
+
+static int
+subfind_cmp_member(const void * a, const void * b)
+{
+    const struct subfind_member * ma = (const struct subfind_member *) a;
+    const struct subfind_member * mb = (const struct subfind_member *) b;
+    if(ma->GrNr != mb->GrNr)
+        return (ma->GrNr > mb->GrNr) - (ma->GrNr < mb->GrNr);
+    return (ma->index > mb->index) - (ma->index < mb->index);
+}
+
+SubhaloCatalogue
+subfind_find_subhalos(struct part_manager_type * pman, const double atime, const double hubble, const double G, const double Softening, MPI_Comm Comm)
+{
+    SubhaloCatalogue sub = {0};
+    struct subfind_consts c = {0};
+    c.atime = atime;
+    c.hubble = hubble;
+    c.G = G;
+    c.eps2 = Softening * Softening;
+    c.BoxSize = pman->BoxSize;
+    c.nngb = SubfindParams.DesLinkNgb;
+    c.MinLength = DMAX(SubfindParams.MinLength, 2);
+
+    double tstart = second();
+    /* List the group members, sorted by group*/
+    int64_t i, nmember = 0;
+    #pragma omp parallel for reduction(+: nmember)
+    for(i = 0; i < pman->NumPart; i++)
+        if(pman->Base[i].GrNr >= 0 && !pman->Base[i].Swallowed && !pman->Base[i].IsGarbage)
+            nmember++;
+    /* At most this many subhalos*/
+    const int64_t maxsub = nmember / c.MinLength + 1;
+    sub.Subhalo = (struct Subhalo *) mymalloc2("Subhalo", maxsub * sizeof(struct Subhalo));
+    struct subfind_member * Members = (struct subfind_member *) mymalloc("SubfindMembers", (nmember + 1) * sizeof(struct subfind_member));
+    nmember = 0;
+    for(i = 0; i < pman->NumPart; i++) {
+        if(pman->Base[i].GrNr < 0)
+            continue;
+        pman->Base[i].TopLeaf = SUBFIND_UNBOUND;
+        if(pman->Base[i].Swallowed || pman->Base[i].IsGarbage)
+            continue;
+        Members[nmember].GrNr = pman->Base[i].GrNr;
+        Members[nmember].index = i;
+        nmember++;
+    }
+    qsort_openmp(Members, nmember, sizeof(struct subfind_member), subfind_cmp_member);
+    /* Start of each group in Members*/
+    int * index = (int *) mymalloc("SubfindIndex", (nmember + 1) * sizeof(int));
+    int64_t ngroups = 0, maxsize = 0;
+    for(i = 0; i < nmember; i++) {
+        if(i == 0 || Members[i].GrNr != Members[i - 1].GrNr) {
+            if(ngroups > 0)
+                maxsize = DMAX(maxsize, i - index[ngroups - 1]);
+            index[ngroups++] = i;
+        }
+    }
+    if(ngroups > 0)
+        maxsize = DMAX(maxsize, nmember - index[ngroups - 1]);
+    index[ngroups] = nmember;
+    /* Compact the sorted list to the particle indices, in place*/
+    int * PartIndex = (int *) Members;
+    for(i = 0; i < nmember; i++)
+        PartIndex[i] = Members[i].index;
+
+    const int NumThreads = omp_get_max_threads();
+    const int64_t smallsize = DMIN(maxsize, SUBFIND_SMALL_GROUP);
+    const size_t smallbytes = subfind_scratch_init(NULL, NULL, smallsize, c.nngb);
+    char * ThreadScratch = (char *) mymalloc("SubfindScratch", DMAX(NumThreads * smallbytes, 1));
+    int64_t nsub = 0;
+
+    /* Small groups, one per thread*/
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        struct subfind_scratch s;
+        subfind_scratch_init(&s, ThreadScratch + tid * smallbytes, smallsize, c.nngb);
+        int64_t g;
+        #pragma omp for schedule(dynamic, 1)
+        for(g = 0; g < ngroups; g++) {
+            const int n = index[g + 1] - index[g];
+            if(n > SUBFIND_SMALL_GROUP)
+                continue;
+            const int nlocal = subfind_group(&s, PartIndex + index[g], n, pman, &c, 0);
+            const int64_t start = __atomic_fetch_add(&nsub, nlocal, __ATOMIC_RELAXED);
+            memcpy(sub.Subhalo + start, s.sub, nlocal * sizeof(struct Subhalo));
+        }
+    }
+    myfree(ThreadScratch);
+
+    /* Large groups, one at a time*/
+    if(maxsize > SUBFIND_SMALL_GROUP) {
+        char * Scratch = (char *) mymalloc("SubfindScratch", subfind_scratch_init(NULL, NULL, maxsize, c.nngb));
+        struct subfind_scratch s;
+        subfind_scratch_init(&s, Scratch, maxsize, c.nngb);
+        int64_t g;
+        for(g = 0; g < ngroups; g++) {
+            const int n = index[g + 1] - index[g];
+            if(n <= SUBFIND_SMALL_GROUP)
+                continue;
+            const int nlocal = subfind_group(&s, PartIndex + index[g], n, pman, &c, 1);
+            memcpy(sub.Subhalo + nsub, s.sub, nlocal * sizeof(struct Subhalo));
+            nsub += nlocal;
+        }
+        myfree(Scratch);
+    }
+    myfree(index);
+    myfree(Members);
+
+    qsort_openmp(sub.Subhalo, nsub, sizeof(struct Subhalo), subfind_cmp_subhalo);
+    sub.Nsubhalos = nsub;
+    MPI_Allreduce(&sub.Nsubhalos, &sub.TotNsubhalos, 1, MPI_INT64, MPI_SUM, Comm);
+    message(0, "Found %ld subhalos in %g seconds\n", sub.TotNsubhalos, second() - tstart);
+    return sub;
+}
+
+void
+subfind_free(SubhaloCatalogue * sub)
+{
+    myfree(sub->Subhalo);
+    sub->Subhalo = NULL;
+}
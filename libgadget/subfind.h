@@ -0,0 +1,61 @@
+#ifndef SUBFIND_H
+#define SUBFIND_H
+
+#include <mpi.h>
+#include "utils/paramset.h"
+#include "partmanager.h"
+
+/* A gravitationally self-bound substructure of a FOF group*/
+struct Subhalo
+{
+    /* FOF group of the subhalo, and its rank in the group: 0 is the largest.*/
+    int GrNr;
+    int SubNr;
+    int Length;
+    int LenType[6];
+    double Mass;
+    double MassType[6];
+    /* Position of the most bound particle and the centre of mass.
+     * Note: these are in the translated frame,
+     * subtract CurrentParticleOffset to get the physical frame.*/
+    double Pos[3];
+    double CM[3];
+    /* Mass weighted mean velocity, in internal units like the particle velocities*/
+    double Vel[3];
+    /* One dimensional physical peculiar velocity dispersion*/
+    double VelDisp;
+    MyIDType MostBoundID;
+};
+
+/* Structure to hold the local subhalos, ordered by group and rank in the group*/
+typedef struct SubhaloCatalogue
+{
+    struct Subhalo * Subhalo;
+    int64_t Nsubhalos;
+    int64_t TotNsubhalos;
+} SubhaloCatalogue;
+
+/* Value of TopLeaf for group members which are not in any subhalo*/
+#define SUBFIND_UNBOUND 0x7fffffff
+
+void set_subfind_params(ParameterSet * ps);
+/* For the tests*/
+void set_subfind_testpar(int SubfindOn, int DesLinkNgb, int MinLength);
+
+/* Is the subhalo finder switched on?*/
+int subfind_enabled(void);
+
+/* Find the self-bound subhalos of the FOF groups in pman, which must each be entirely on one rank.
+ * Densities are estimated from the DesLinkNgb nearest group members, substructures are found at the
+ * saddle points of the density field and then cleaned of unbound particles.
+ * The TopLeaf of every group member is set to the rank of its subhalo in the group,
+ * or SUBFIND_UNBOUND, so that members can be ordered by subhalo.
+ * hubble is the Hubble function at atime, G the gravitational constant and
+ * Softening the comoving Plummer softening, all in internal units.
+ * The catalogue is allocated at the top of the heap. Collective.*/
+SubhaloCatalogue subfind_find_subhalos(struct part_manager_type * pman, const double atime, const double hubble, const double G, const double Softening, MPI_Comm Comm);
+
+/* Free the subhalo catalogue*/
+void subfind_free(SubhaloCatalogue * sub);
+
+#endif
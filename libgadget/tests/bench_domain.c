@@ -0,0 +1,304 @@
+/* Replay the domain decomposition on the particles of a saved snapshot or PIG, to choose the
+ * domain parameters before a production run. Only the positions, velocities and (if saved) gravity
+ * timebins are read. For each DomainOverDecompositionFactor given, this does a full decomposition from
+ * the file order, a number of domain_maintain steps drifting the particles with their velocities,
+ * and a second full decomposition, as on the next PM step.
+ * For each stage the top tree size, the particle imbalance (max / mean), the number of particles
+ * which changed rank and the time taken are reported.
+ *
+ * Usage: bench_domain <snapshot> [DomainOverDecompositionFactor,...] [TopNodeAllocFactor] [maintain steps] [dloga per step] [DomainEdgeBand]
+ * Setting BENCH_DOMAIN_SORT=1 or BENCH_DOMAIN_HISTOGRAM=1 in the environment selects the other
+ * top tree builds.*/
+
+#include <math.h>
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bigfile-mpi.h>
+
+#include <libgadget/utils.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/domain.h>
+#include <libgadget/drift.h>
+#include <libgadget/petaio.h>
+#include <libgadget/cosmology.h>
+#include <libgadget/timebinmgr.h>
+
+static struct ClockTable CT;
+
+/* The rank a particle was on before the last stage is kept in the top bits of its ID*/
+#define TASKSHIFT 40
+
+static double
+get_attr_double(BigBlock * bh, const char * name, const double def)
+{
+    double foo;
+    if(0 != big_block_get_attr(bh, name, &foo, "f8", 1))
+        foo = def;
+    return foo;
+}
+
+/* Read a block of this type, split evenly over the ranks, into a new buffer.*/
+static char *
+read_block(BigFile * bf, const int ptype, const char * name, const char * dtype, const int items, const int64_t nlocal, int required)
+{
+    IOTableEntry ent = {0};
+    strncpy(ent.dtype, dtype, sizeof(ent.dtype) - 1);
+    ent.items = items;
+    char blockname[128];
+    snprintf(blockname, sizeof(blockname), "%d/%s", ptype, name);
+    BigArray array = {0};
+    petaio_alloc_buffer(&array, &ent, nlocal);
+    if(0 != petaio_read_block(bf, blockname, &array, required)) {
+        petaio_destroy_buffer(&array);
+        return NULL;
+    }
+    return (char *) array.data;
+}
+
+/* Load the particles and set up the cosmology. Returns the scale factor of the snapshot.*/
+static double
+load_particles(const char * fname, Cosmology * CP, int64_t * NTotal)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, fname, MPI_COMM_WORLD))
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname, big_file_get_error_message());
+
+    BigBlock bh;
+    if(0 != big_file_mpi_open_block(&bf, &bh, "Header", MPI_COMM_WORLD))
+        endrun(0, "Failed to open header at %s:%s\n", fname, big_file_get_error_message());
+    double BoxSize = 0, atime = 0;
+    int UsePeculiarVelocity = 0;
+    /* PIGs store the number of particles in groups*/
+    if(0 != big_block_get_attr(&bh, "TotNumPart", NTotal, "u8", 6) &&
+       0 != big_block_get_attr(&bh, "NumPartInGroupTotal", NTotal, "u8", 6))
+        endrun(0, "Failed to read particle numbers: %s\n", big_file_get_error_message());
+    if(0 != big_block_get_attr(&bh, "BoxSize", &BoxSize, "f8", 1) ||
+       0 != big_block_get_attr(&bh, "Time", &atime, "f8", 1))
+        endrun(0, "Failed to read attr: %s\n", big_file_get_error_message());
+    if(0 != big_block_get_attr(&bh, "UsePeculiarVelocity", &UsePeculiarVelocity, "i4", 1))
+        UsePeculiarVelocity = 0;
+    CP->Omega0 = get_attr_double(&bh, "Omega0", 0.3);
+    CP->OmegaLambda = get_attr_double(&bh, "OmegaLambda", 0.7);
+    CP->OmegaBaryon = get_attr_double(&bh, "OmegaBaryon", 0.045);
+    CP->HubbleParam = get_attr_double(&bh, "HubbleParam", 0.7);
+    CP->CMBTemperature = get_attr_double(&bh, "CMBTemperature", 2.7255);
+    const double UnitLength_in_cm = get_attr_double(&bh, "UnitLength_in_cm", 3.085678e21);
+    const double UnitMass_in_g = get_attr_double(&bh, "UnitMass_in_g", 1.989e43);
+    const double UnitVelocity_in_cm_per_s = get_attr_double(&bh, "UnitVelocity_in_cm_per_s", 1e5);
+    big_block_mpi_close(&bh, MPI_COMM_WORLD);
+
+    CP->OmegaCDM = CP->Omega0 - CP->OmegaBaryon;
+    CP->w0_fld = -1;
+    struct UnitSystem units = get_unitsystem(UnitLength_in_cm, UnitMass_in_g, UnitVelocity_in_cm_per_s);
+    init_cosmology(CP, atime, units);
+
+    int64_t NLocal[6], numpart = 0;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        NLocal[ptype] = (ThisTask + 1) * NTotal[ptype] / NTask - ThisTask * NTotal[ptype] / NTask;
+        numpart += NLocal[ptype];
+    }
+    int64_t ntot = 0;
+    for(ptype = 0; ptype < 6; ptype++)
+        ntot += NTotal[ptype];
+
+    /* Leave room for an imbalanced decomposition*/
+    const int64_t maxpart = 1.5 * numpart + 1000;
+    particle_alloc_memory(PartManager, BoxSize, maxpart);
+    message(0, "Read %ld particles from %s at a = %g, box %g\n", ntot, fname, atime, BoxSize);
+
+    const double velfac = UsePeculiarVelocity ? atime : 1;
+    const double hsml = BoxSize / cbrt(ntot);
+    int64_t offset = 0, fileoffset = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        /* Index of the first local particle of this type in the file, which makes a unique ID*/
+        const int64_t firstid = fileoffset + ThisTask * NTotal[ptype] / NTask;
+        fileoffset += NTotal[ptype];
+        if(NTotal[ptype] == 0)
+            continue;
+        /* Read in reverse stack order so the buffers can be freed*/
+        unsigned int * timebin = (unsigned int *) read_block(&bf, ptype, "TimeBinGravity", "u4", 1, NLocal[ptype], 0);
+        float * vel = (float *) read_block(&bf, ptype, "Velocity", "f4", 3, NLocal[ptype], 0);
+        double * pos = (double *) read_block(&bf, ptype, "Position", "f8", 3, NLocal[ptype], 1);
+        int64_t i;
+        #pragma omp parallel for
+        for(i = 0; i < NLocal[ptype]; i++) {
+            struct particle_data * pp = &P[offset + i];
+            memset(pp, 0, sizeof(struct particle_data));
+            int j;
+            for(j = 0; j < 3; j++) {
+                pp->Pos[j] = pos[3 * i + j];
+                pp->Vel[j] = vel ? vel[3 * i + j] * velfac : 0;
+            }
+            pp->Type = ptype;
+            pp->Mass = 1;
+            pp->TimeBinGravity = timebin ? timebin[i] : 0;
+            pp->Hsml = hsml;
+            pp->ID = ((MyIDType) ThisTask << TASKSHIFT) + firstid + i;
+        }
+        offset += NLocal[ptype];
+        myfree(pos);
+        if(vel)
+            myfree(vel);
+        if(timebin)
+            myfree(timebin);
+    }
+    PartManager->NumPart = numpart;
+
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD))
+        endrun(0, "Failed to close snapshot at %s:%s\n", fname, big_file_get_error_message());
+    return atime;
+}
+
+/* Count the particles which changed rank since the last call, and mark them as on this rank.*/
+static int64_t
+count_moved(void)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const MyIDType mask = ((MyIDType) 1 << TASKSHIFT) - 1;
+    int64_t moved = 0;
+    int64_t i;
+    #pragma omp parallel for reduction(+: moved)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage)
+            continue;
+        if((P[i].ID >> TASKSHIFT) != (MyIDType) ThisTask)
+            moved++;
+        P[i].ID = ((MyIDType) ThisTask << TASKSHIFT) + (P[i].ID & mask);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &moved, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    return moved;
+}
+
+static void
+report(const char * stage, const int dodf, const DomainDecomp * ddecomp, const double time)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int64_t moved = count_moved();
+    int64_t i, nlocal = 0;
+    for(i = 0; i < PartManager->NumPart; i++)
+        nlocal += !P[i].IsGarbage;
+    int64_t nmax = nlocal, ntot = nlocal;
+    MPI_Allreduce(MPI_IN_PLACE, &nmax, 1, MPI_INT64, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &ntot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    double tmax = time;
+    MPI_Allreduce(MPI_IN_PLACE, &tmax, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    message(0, "BENCH %-9s dodf=%d topnodes=%d topleaves=%d imbalance=%6.4f moved=%ld (%6.4f) %10.4g s\n",
+            stage, dodf, ddecomp->NTopNodes, ddecomp->NTopLeaves, nmax * NTask / (double) ntot,
+            moved, moved / (double) ntot, tmax);
+}
+
+static void
+bench_dodf(const int dodf, DomainParams dp, Cosmology * CP, const double atime, const int nsteps, const double dloga)
+{
+    dp.DomainOverDecompositionFactor = dodf;
+    set_domain_par(dp);
+    DomainDecomp ddecomp = {0};
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    domain_decompose_full(&ddecomp);
+    report("full", dodf, &ddecomp, MPI_Wtime() - start);
+
+    inttime_t ti = ti_from_loga(log(atime));
+    int step;
+    for(step = 0; step < nsteps; step++) {
+        struct DriftData drift;
+        drift.CP = CP;
+        drift.ti0 = ti;
+        drift.ti1 = ti + dti_from_dloga(dloga, ti);
+        drift.DeferMask = 0;
+        ti = drift.ti1;
+        MPI_Barrier(MPI_COMM_WORLD);
+        start = MPI_Wtime();
+        if(domain_maintain(&ddecomp, &drift))
+            endrun(5, "Particle exchange failed on maintain step %d\n", step);
+        report("maintain", dodf, &ddecomp, MPI_Wtime() - start);
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+    domain_decompose_full(&ddecomp);
+    report("refull", dodf, &ddecomp, MPI_Wtime() - start);
+    domain_free(&ddecomp);
+}
+
+int main(int argc, char ** argv)
+{
+    MPI_Init(&argc, &argv);
+    init_endrun(1);
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    if(argc < 2) {
+        message(0, "Usage: bench_domain <snapshot> [DomainOverDecompositionFactor,...] [TopNodeAllocFactor] [maintain steps] [dloga per step] [DomainEdgeBand]\n");
+        MPI_Finalize();
+        return 1;
+    }
+    const char * fname = argv[1];
+    const char * dodflist = (argc > 2) ? argv[2] : "4";
+    const double TopNodeAllocFactor = (argc > 3) ? atof(argv[3]) : 0.5;
+    const int nsteps = (argc > 4) ? atoi(argv[4]) : 4;
+    const double dloga = (argc > 5) ? atof(argv[5]) : 1e-3;
+    const double EdgeBand = (argc > 6) ? atof(argv[6]) : 0;
+
+    /* Room for two copies of the particles plus the domain and exchange buffers*/
+    size_t MemoryBytes = 1024L * 1024 * 1024;
+    const char * mem = getenv("BENCH_DOMAIN_MB");
+    if(mem)
+        MemoryBytes = atol(mem) * 1024L * 1024;
+    allocator_init(A_MAIN, "MAIN", MemoryBytes, 0, NULL);
+    allocator_init(A_TEMP, "TEMP", 8 * 1024 * 1024, 0, A_MAIN);
+    walltime_init(&CT);
+    petaio_init();
+    /* No slots: only the positions are read*/
+    slots_init(0, SlotsManager);
+
+    Cosmology CP = {0};
+    int64_t NTotal[6] = {0};
+    const double atime = load_particles(fname, &CP, NTotal);
+    setup_sync_points(&CP, atime, 1.1 * atime * exp(nsteps * dloga), 0.0, 0);
+
+    /* Keep the particles as read, so each configuration starts from the file order*/
+    const int64_t numpart = PartManager->NumPart;
+    struct particle_data * Pfile = (struct particle_data *) mymalloc2("Pfile", numpart * sizeof(struct particle_data));
+    memcpy(Pfile, P, numpart * sizeof(struct particle_data));
+
+    DomainParams dp = {0};
+    dp.TopNodeAllocFactor = TopNodeAllocFactor;
+    dp.SetAsideFactor = 1;
+    dp.DomainEdgeBand = EdgeBand;
+    dp.DomainUseGlobalSorting = getenv("BENCH_DOMAIN_SORT") ? atoi(getenv("BENCH_DOMAIN_SORT")) : 0;
+    dp.DomainHistogramTopTree = getenv("BENCH_DOMAIN_HISTOGRAM") ? atoi(getenv("BENCH_DOMAIN_HISTOGRAM")) : 0;
+    message(0, "Replaying the domain decomposition on %d ranks, %d threads, TopNodeAllocFactor %g GlobalSort %d Histogram %d EdgeBand %g, %d steps of dloga %g.\n",
+            NTask, omp_get_max_threads(), TopNodeAllocFactor, dp.DomainUseGlobalSorting, dp.DomainHistogramTopTree, EdgeBand, nsteps, dloga);
+
+    const char * s = dodflist;
+    while(*s) {
+        const int dodf = atoi(s);
+        if(dodf <= 0)
+            endrun(1, "Bad DomainOverDecompositionFactor list %s\n", dodflist);
+        memcpy(P, Pfile, numpart * sizeof(struct particle_data));
+        PartManager->NumPart = numpart;
+        bench_dodf(dodf, dp, &CP, atime, nsteps, dloga);
+        s = strchr(s, ',');
+        if(!s)
+            break;
+        s++;
+    }
+
+    myfree(Pfile);
+    MPI_Finalize();
+    return 0;
+}
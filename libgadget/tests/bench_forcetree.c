@@ -0,0 +1,363 @@
+/* Benchmark for the tree build, moments, short-range gravity and density treewalks.
+ * Particles are drawn from uniform, glass-like and NFW-clustered distributions, and each stage
+ * is timed for 1, 2, 4, ... up to the maximum number of OpenMP threads.
+ *
+ * Usage: bench_forcetree [total particles] [repeats]
+ * The fastest of the repeats is reported, in seconds and in particles per second.*/
+
+#include <math.h>
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gsl/gsl_rng.h>
+
+#include <libgadget/utils.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/density.h>
+#include <libgadget/gravity.h>
+#include <libgadget/petapm.h>
+#include <libgadget/timestep.h>
+#include <libgadget/timebinmgr.h>
+
+static struct ClockTable CT;
+static const double G = 43.0071;
+static const double BoxSize = 8;
+
+enum BenchDistribution {
+    BENCH_UNIFORM = 0,
+    BENCH_GLASS = 1,
+    BENCH_NFW = 2,
+};
+static const char * DistributionNames[] = {"uniform", "glass", "nfw"};
+
+/* Stages timed for each distribution and thread count*/
+enum BenchStage {
+    STAGE_BUILD = 0,
+    STAGE_MOMENTS = 1,
+    STAGE_GRAVITY = 2,
+    STAGE_DENSITY = 3,
+    NSTAGE = 4,
+};
+static const char * StageNames[] = {"build", "moments", "gravity", "density"};
+
+static double
+wrap(double x)
+{
+    while(x >= BoxSize)
+        x -= BoxSize;
+    while(x < 0)
+        x += BoxSize;
+    return x;
+}
+
+static void
+make_uniform(gsl_rng * r, const int64_t numpart)
+{
+    int64_t i;
+    for(i = 0; i < numpart; i++) {
+        int j;
+        for(j = 0; j < 3; j++)
+            P[i].Pos[j] = BoxSize * gsl_rng_uniform(r);
+    }
+}
+
+/* A grid with small random displacements. This stands in for a glass: the neighbour counts are
+ * nearly uniform, as in a glass, without the cost of relaxing one. Each rank makes a slab of the grid.*/
+static void
+make_glass(gsl_rng * r, const int64_t numpart, const int64_t numpart_tot)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int64_t ncbrt = ceil(cbrt(numpart_tot));
+    const double spacing = BoxSize / ncbrt;
+    const int64_t start = ThisTask * numpart;
+    int64_t i;
+    for(i = 0; i < numpart; i++) {
+        const int64_t g = start + i;
+        const int64_t grid[3] = {g / ncbrt / ncbrt, (g / ncbrt) % ncbrt, g % ncbrt};
+        int j;
+        for(j = 0; j < 3; j++)
+            P[i].Pos[j] = wrap(spacing * (grid[j] + 0.5 + 0.2 * (gsl_rng_uniform(r) - 0.5)));
+    }
+}
+
+/* Enclosed mass of an NFW profile, in units of 4 pi rho_s r_s^3*/
+static double
+nfw_mass(const double x)
+{
+    return log(1 + x) - x / (1 + x);
+}
+
+/* A tenth of the particles are a uniform background, the rest are in NFW halos with concentration 10.
+ * The halo centres come from a fixed seed so they are the same on all ranks.*/
+static void
+make_nfw(gsl_rng * r, const int64_t numpart)
+{
+    const int NHalo = 8;
+    const double conc = 10;
+    const double rvir = BoxSize / 16;
+    double centre[8][3];
+    gsl_rng * rc = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(rc, 42);
+    int h, j;
+    for(h = 0; h < NHalo; h++)
+        for(j = 0; j < 3; j++)
+            centre[h][j] = BoxSize * gsl_rng_uniform(rc);
+    gsl_rng_free(rc);
+
+    const int64_t nback = numpart / 10;
+    make_uniform(r, nback);
+    const double mvir = nfw_mass(conc);
+    int64_t i;
+    for(i = nback; i < numpart; i++) {
+        /* Invert the enclosed mass by bisection to get the radius*/
+        const double m = mvir * gsl_rng_uniform(r);
+        double lo = 0, hi = conc;
+        int k;
+        for(k = 0; k < 50; k++) {
+            const double mid = (lo + hi) / 2;
+            if(nfw_mass(mid) < m)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        const double rad = (lo + hi) / 2 * rvir / conc;
+        const double cost = 2 * gsl_rng_uniform(r) - 1;
+        const double sint = sqrt(1 - cost * cost);
+        const double phi = 2 * M_PI * gsl_rng_uniform(r);
+        h = gsl_rng_uniform_int(r, NHalo);
+        P[i].Pos[0] = wrap(centre[h][0] + rad * sint * cos(phi));
+        P[i].Pos[1] = wrap(centre[h][1] + rad * sint * sin(phi));
+        P[i].Pos[2] = wrap(centre[h][2] + rad * cost);
+    }
+}
+
+/* Make the particles and decompose the domain. All particles are gas, so that one tree serves both the gravity and density walks.*/
+static void
+make_particles(enum BenchDistribution dist, const int64_t numpart_tot, DomainDecomp * ddecomp)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int64_t numpart = numpart_tot / NTask;
+
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(r, 1 + ThisTask);
+    if(dist == BENCH_UNIFORM)
+        make_uniform(r, numpart);
+    else if(dist == BENCH_GLASS)
+        make_glass(r, numpart, numpart_tot);
+    else
+        make_nfw(r, numpart);
+    gsl_rng_free(r);
+
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < numpart; i++) {
+        P[i].Type = 0;
+        P[i].PI = i;
+        P[i].ID = ThisTask * numpart + i;
+        P[i].Mass = 1;
+        P[i].IsGarbage = 0;
+        P[i].TimeBinHydro = 0;
+        P[i].TimeBinGravity = 0;
+        P[i].Ti_drift = 0;
+        P[i].Hsml = BoxSize / cbrt(numpart_tot);
+        int j;
+        for(j = 0; j < 3; j++)
+            P[i].Vel[j] = 0;
+        SPHP(i).Entropy = 1;
+        SPHP(i).DtEntropy = 0;
+        SPHP(i).Density = 1;
+    }
+    PartManager->NumPart = numpart;
+    SlotsManager->info[0].size = numpart;
+
+    domain_decompose_full(ddecomp);
+}
+
+/* Time each stage once. The density walk starts from the same smoothing lengths each time, so it does the same work.*/
+static void
+run_stages(DomainDecomp * ddecomp, PetaPM * pm, Cosmology * CP, const MyFloat * Hsml0, double * times)
+{
+    const double rho0 = CP->Omega0 * 3 * CP->Hubble * CP->Hubble / (8 * M_PI * G);
+    ForceTree tree = {0};
+    ActiveParticles act = init_empty_active_particles(PartManager);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    force_tree_rebuild_mask(&tree, ddecomp, GASMASK, NULL);
+    MPI_Barrier(MPI_COMM_WORLD);
+    double end = MPI_Wtime();
+    times[STAGE_BUILD] = end - start;
+
+    start = end;
+    force_tree_calc_moments(&tree, ddecomp);
+    MPI_Barrier(MPI_COMM_WORLD);
+    end = MPI_Wtime();
+    times[STAGE_MOMENTS] = end - start;
+
+    start = end;
+    grav_short_tree(&act, pm, &tree, NULL, rho0, 0);
+    MPI_Barrier(MPI_COMM_WORLD);
+    end = MPI_Wtime();
+    times[STAGE_GRAVITY] = end - start;
+
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        P[i].Hsml = Hsml0[i];
+    DriftKickTimes kick = {0};
+    struct sph_pred_data sph_pred = {0};
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+    density(&act, 1, 0, 0, kick, CP, &sph_pred, NULL, &tree);
+    MPI_Barrier(MPI_COMM_WORLD);
+    end = MPI_Wtime();
+    times[STAGE_DENSITY] = end - start;
+    slots_free_sph_pred_data(&sph_pred);
+
+    force_tree_free(&tree);
+}
+
+static void
+bench_distribution(enum BenchDistribution dist, const int64_t numpart_tot, const int nrepeat, PetaPM * pm, Cosmology * CP)
+{
+    DomainDecomp ddecomp = {0};
+    make_particles(dist, numpart_tot, &ddecomp);
+
+    /* Initial smoothing lengths for the density walk, and an untimed gravity walk so that
+     * the timed walks use the relative opening criterion, as on all but the first step of a run.*/
+    ForceTree tree = {0};
+    force_tree_rebuild_mask(&tree, &ddecomp, GASMASK, NULL);
+    set_init_hsml(&tree, &ddecomp, BoxSize / cbrt(numpart_tot));
+    const double rho0 = CP->Omega0 * 3 * CP->Hubble * CP->Hubble / (8 * M_PI * G);
+    ActiveParticles act = init_empty_active_particles(PartManager);
+    grav_short_tree(&act, pm, &tree, NULL, rho0, 0);
+    force_tree_free(&tree);
+
+    MyFloat * Hsml0 = (MyFloat *) mymalloc2("Hsml0", PartManager->NumPart * sizeof(MyFloat));
+    int64_t i;
+    for(i = 0; i < PartManager->NumPart; i++)
+        Hsml0[i] = P[i].Hsml;
+
+    const int MaxThreads = omp_get_max_threads();
+    int nthreads = 1;
+    while(1) {
+        omp_set_num_threads(nthreads);
+        double best[NSTAGE];
+        int s, rep;
+        for(s = 0; s < NSTAGE; s++)
+            best[s] = 1e30;
+        for(rep = 0; rep < nrepeat; rep++) {
+            double times[NSTAGE];
+            run_stages(&ddecomp, pm, CP, Hsml0, times);
+            for(s = 0; s < NSTAGE; s++)
+                if(times[s] < best[s])
+                    best[s] = times[s];
+        }
+        for(s = 0; s < NSTAGE; s++)
+            message(0, "BENCH %-8s N=%ld threads=%d %-8s %10.4g s %12.4g particles/s\n", DistributionNames[dist],
+                    numpart_tot, nthreads, StageNames[s], best[s], numpart_tot / best[s]);
+        if(nthreads == MaxThreads)
+            break;
+        nthreads *= 2;
+        if(nthreads > MaxThreads)
+            nthreads = MaxThreads;
+    }
+    omp_set_num_threads(MaxThreads);
+
+    myfree(Hsml0);
+    domain_free(&ddecomp);
+}
+
+int main(int argc, char ** argv)
+{
+    MPI_Init(&argc, &argv);
+    init_endrun(1);
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    const int64_t numpart_tot = (argc > 1) ? atol(argv[1]) : 64 * 64 * 64;
+    const int nrepeat = (argc > 2) ? atoi(argv[2]) : 3;
+    const int64_t numpart = numpart_tot / NTask;
+
+    /* Room for the particles, tree and treewalk buffers*/
+    const size_t MemoryBytes = 256L * 1024 * 1024 + 4096L * numpart;
+    allocator_init(A_MAIN, "MAIN", MemoryBytes, 0, NULL);
+    allocator_init(A_TEMP, "TEMP", 8 * 1024 * 1024, 0, A_MAIN);
+    walltime_init(&CT);
+    message(0, "Benchmarking the tree with %ld particles on %d ranks, up to %d threads, best of %d.\n",
+            numpart_tot, NTask, omp_get_max_threads(), nrepeat);
+
+    /* Set aside some slots so the domain exchange has room*/
+    slots_init(0.01 * numpart, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    const int64_t maxpart = 1.2 * numpart + 1000;
+    particle_alloc_memory(PartManager, BoxSize, maxpart);
+    int64_t atleast[6] = {0};
+    atleast[0] = maxpart;
+    slots_reserve(1, atleast, SlotsManager);
+
+    setup_sync_points(NULL, 0.01, 0.1, 0.0, 0);
+    DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(0.7);
+
+    struct density_params densp = {0};
+    densp.DensityResolutionEta = 1.;
+    densp.BlackHoleNgbFactor = 2;
+    densp.MaxNumNgbDeviation = 2;
+    densp.DensityKernelType = DENSITY_KERNEL_CUBIC_SPLINE;
+    densp.BlackHoleMaxAccretionRadius = 99999.;
+    set_densitypar(densp);
+
+    struct gravshort_tree_params treeacc = {0};
+    treeacc.ErrTolForceAcc = 0.002;
+    treeacc.BHOpeningAngle = 0.175;
+    treeacc.MaxBHOpeningAngle = 0.9;
+    /* Barnes-Hut on the first walk only*/
+    treeacc.TreeUseBH = 2;
+    treeacc.Rcut = 7;
+    treeacc.FractionalGravitySoftening = 1./30.;
+    set_gravshort_treepar(treeacc);
+    gravshort_set_softenings(BoxSize / cbrt(numpart_tot));
+
+    /* The PM grid is not computed: the short-range walk only needs its smoothing scale*/
+    petapm_module_init(omp_get_max_threads());
+    PetaPM pm = {0};
+    const int Nmesh = 2 * cbrt(numpart_tot);
+    gravpm_init_periodic(&pm, BoxSize, 1.5, Nmesh, G);
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, 1.5, 0);
+
+    Cosmology CP = {0};
+    CP.CMBTemperature = 2.7255;
+    CP.Omega0 = 0.3;
+    CP.OmegaCDM = 0.255;
+    CP.OmegaLambda = 0.7;
+    CP.OmegaBaryon = 0.045;
+    CP.HubbleParam = 0.7;
+    CP.w0_fld = -1;
+    struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
+    init_cosmology(&CP, 0.01, units);
+
+    int dist;
+    for(dist = BENCH_UNIFORM; dist <= BENCH_NFW; dist++) {
+        /* The first gravity walk switches TreeUseBH off, so set it again for the new particles*/
+        set_gravshort_treepar(treeacc);
+        bench_distribution(dist, numpart_tot, nrepeat, &pm, &CP);
+    }
+
+    petapm_destroy(&pm);
+    MPI_Finalize();
+    return 0;
+}
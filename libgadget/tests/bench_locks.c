@@ -0,0 +1,177 @@
+/* Benchmark of the per-particle locking used when a treewalk writes to its neighbours.
+ * Compares the spinlock array from utils/spinlocks.c with the compare and swap lock on the
+ * sign bit of the particle mass used by the metal return. Each update adds mass and metals
+ * to a target drawn from a small clustered set, so that threads contend for the same particles.
+ *
+ * Usage: bench_locks [targets] [updates] [repeats]
+ * Times include the allocation and initialisation of the locks, and the best of the repeats is reported.*/
+
+#include <math.h>
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgadget/utils.h>
+
+#define NMETAL 9
+
+struct target {
+    float Mass;
+    float Density;
+    float Metallicity;
+    float Metals[NMETAL];
+};
+
+/* Same as the metal return lock*/
+static float
+lock_mass(float * mass)
+{
+    float old, locked;
+    do {
+        #pragma omp atomic read
+        old = *mass;
+        if(signbit(old))
+            continue;
+        locked = -old;
+        if(__atomic_compare_exchange(mass, &old, &locked, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return old;
+    } while(1);
+}
+
+static void
+unlock_mass(float * mass, float newmass)
+{
+    __atomic_store(mass, &newmass, __ATOMIC_RELEASE);
+}
+
+static void
+add_metals(struct target * t, const float oldmass, const double thismass)
+{
+    int k;
+    for(k = 0; k < NMETAL; k++)
+        t->Metals[k] = (t->Metals[k] * oldmass + 0.01 * thismass) / (oldmass + thismass);
+    t->Metallicity = (t->Metallicity * oldmass + 0.02 * thismass) / (oldmass + thismass);
+    t->Density *= (oldmass + thismass) / oldmass;
+}
+
+static void
+init_targets(struct target * t, const int64_t ntarget)
+{
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < ntarget; i++) {
+        memset(&t[i], 0, sizeof(t[i]));
+        t[i].Mass = 1;
+        t[i].Density = 1;
+    }
+}
+
+/* Targets cluster around a few hot spots, as gas near star forming regions*/
+static int64_t
+pick(const int64_t * idx, const int64_t ntarget, const int64_t u)
+{
+    return (idx[u] % 64) * (ntarget / 64) + idx[u] / 64 % 32;
+}
+
+static double
+run_spinlock(struct target * t, const int64_t ntarget, const int64_t * idx, const int64_t nupdate)
+{
+    int64_t u;
+    double start = MPI_Wtime();
+    struct SpinLocks * spin = init_spinlocks(ntarget);
+    #pragma omp parallel for
+    for(u = 0; u < nupdate; u++) {
+        const int64_t i = pick(idx, ntarget, u);
+        lock_spinlock(i, spin);
+        const float oldmass = t[i].Mass;
+        const double thismass = 1e-3;
+        add_metals(&t[i], oldmass, thismass);
+        t[i].Mass = oldmass + thismass;
+        unlock_spinlock(i, spin);
+    }
+    free_spinlocks(spin);
+    return MPI_Wtime() - start;
+}
+
+static double
+run_cas(struct target * t, const int64_t ntarget, const int64_t * idx, const int64_t nupdate)
+{
+    int64_t u;
+    double start = MPI_Wtime();
+    #pragma omp parallel for
+    for(u = 0; u < nupdate; u++) {
+        const int64_t i = pick(idx, ntarget, u);
+        const float oldmass = lock_mass(&t[i].Mass);
+        const double thismass = 1e-3;
+        add_metals(&t[i], oldmass, thismass);
+        unlock_mass(&t[i].Mass, oldmass + thismass);
+    }
+    return MPI_Wtime() - start;
+}
+
+static double
+total_mass(const struct target * t, const int64_t ntarget)
+{
+    double mass = 0;
+    int64_t i;
+    #pragma omp parallel for reduction(+: mass)
+    for(i = 0; i < ntarget; i++)
+        mass += t[i].Mass;
+    return mass;
+}
+
+int main(int argc, char ** argv)
+{
+    MPI_Init(&argc, &argv);
+    init_endrun(1);
+
+    const int64_t ntarget = (argc > 1) ? atol(argv[1]) : 4 * 1024 * 1024;
+    const int64_t nupdate = (argc > 2) ? atol(argv[2]) : 8 * 1024 * 1024;
+    const int nrepeat = (argc > 3) ? atoi(argv[3]) : 3;
+
+    const size_t MemoryBytes = 64L * 1024 * 1024 + (sizeof(struct target) + 16) * ntarget + sizeof(int64_t) * nupdate;
+    allocator_init(A_MAIN, "MAIN", MemoryBytes, 0, NULL);
+    allocator_init(A_TEMP, "TEMP", 8 * 1024 * 1024, 0, A_MAIN);
+
+    message(0, "Benchmarking locks with %ld targets, %ld updates, up to %d threads, best of %d.\n",
+            ntarget, nupdate, omp_get_max_threads(), nrepeat);
+
+    struct target * t = (struct target *) mymalloc("Targets", sizeof(struct target) * ntarget);
+    int64_t * idx = (int64_t *) mymalloc("Index", sizeof(int64_t) * nupdate);
+    int64_t u;
+    srandom(42);
+    for(u = 0; u < nupdate; u++)
+        idx[u] = random();
+
+    const int MaxThreads = omp_get_max_threads();
+    int nthreads;
+    for(nthreads = 1; nthreads <= MaxThreads; nthreads *= 2) {
+        omp_set_num_threads(nthreads);
+        double best[2] = {1e30, 1e30};
+        int r;
+        for(r = 0; r < nrepeat; r++) {
+            init_targets(t, ntarget);
+            double dt = run_spinlock(t, ntarget, idx, nupdate);
+            if(fabs(total_mass(t, ntarget) - ntarget - 1e-3 * nupdate) > 1e-6 * nupdate)
+                endrun(1, "Spinlock updates lost mass\n");
+            if(dt < best[0])
+                best[0] = dt;
+            init_targets(t, ntarget);
+            dt = run_cas(t, ntarget, idx, nupdate);
+            if(fabs(total_mass(t, ntarget) - ntarget - 1e-3 * nupdate) > 1e-6 * nupdate)
+                endrun(1, "CAS updates lost mass\n");
+            if(dt < best[1])
+                best[1] = dt;
+        }
+        message(0, "BENCH threads=%d spinlock %10.4g s cas %10.4g s speedup %.3g\n",
+                nthreads, best[0], best[1], best[0] / best[1]);
+    }
+    omp_set_num_threads(MaxThreads);
+
+    myfree(idx);
+    myfree(t);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,386 @@
+/* Benchmark of one treewalk kernel on one rank with all threads, to profile the density, hydro
+ * and short-range gravity neighbour loops without a full run. The particles are either a
+ * jittered grid of gas or the gas, dark matter and stars of a saved snapshot. The tree is built
+ * once and the chosen treewalk is repeated, each time doing the same work.
+ *
+ * Usage: bench_treewalk <density|hydro|gravity> [particles or snapshot] [repeats]
+ * The fastest of the repeats is reported, with the time per interaction, and the time per
+ * interaction per thread. BENCH_TREEWALK_MB sets the memory size.*/
+
+#include <math.h>
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gsl/gsl_rng.h>
+#include <bigfile-mpi.h>
+
+#include <libgadget/utils.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/treewalk.h>
+#include <libgadget/density.h>
+#include <libgadget/hydra.h>
+#include <libgadget/gravity.h>
+#include <libgadget/petapm.h>
+#include <libgadget/petaio.h>
+#include <libgadget/timestep.h>
+#include <libgadget/timebinmgr.h>
+#include <libgadget/physconst.h>
+
+static struct ClockTable CT;
+static const double G = 43.0071;
+
+enum BenchKernel {
+    KERNEL_DENSITY = 0,
+    KERNEL_HYDRO = 1,
+    KERNEL_GRAVITY = 2,
+};
+static const char * KernelNames[] = {"density", "hydro", "gravity"};
+
+/* A grid of gas with small random displacements, in a box of side 1000*/
+static double
+make_grid(const int64_t numpart)
+{
+    const double BoxSize = 1000;
+    const int64_t ncbrt = ceil(cbrt(numpart));
+    const double spacing = BoxSize / ncbrt;
+    particle_alloc_memory(PartManager, BoxSize, numpart);
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(r, 42);
+    int64_t i;
+    for(i = 0; i < numpart; i++) {
+        const int64_t grid[3] = {i / ncbrt / ncbrt, (i / ncbrt) % ncbrt, i % ncbrt};
+        int j;
+        memset(&P[i], 0, sizeof(P[i]));
+        for(j = 0; j < 3; j++)
+            P[i].Pos[j] = spacing * (grid[j] + 0.5 + 0.2 * (gsl_rng_uniform(r) - 0.5));
+        P[i].Type = 0;
+        P[i].Mass = 1;
+        P[i].ID = i;
+        /* Internal energy, see init_gas_slots*/
+        P[i].Hsml = 1;
+    }
+    gsl_rng_free(r);
+    PartManager->NumPart = numpart;
+    return BoxSize;
+}
+
+/* Read a block of this type into a new buffer*/
+static void *
+read_block(BigFile * bf, const int ptype, const char * name, const char * dtype, const int items, const int64_t n, int required)
+{
+    IOTableEntry ent = {0};
+    strncpy(ent.dtype, dtype, sizeof(ent.dtype) - 1);
+    ent.items = items;
+    char blockname[128];
+    snprintf(blockname, sizeof(blockname), "%d/%s", ptype, name);
+    BigArray array = {0};
+    petaio_alloc_buffer(&array, &ent, n);
+    if(0 != petaio_read_block(bf, blockname, &array, required)) {
+        petaio_destroy_buffer(&array);
+        return NULL;
+    }
+    return array.data;
+}
+
+/* Read the gas, dark matter and stars of a snapshot. Returns the scale factor.
+ * The internal energy of the gas is stored in the entropy, until the density is known.*/
+static double
+load_snapshot(const char * fname, Cosmology * CP)
+{
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, fname, MPI_COMM_WORLD))
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname, big_file_get_error_message());
+    BigBlock bh;
+    if(0 != big_file_mpi_open_block(&bf, &bh, "Header", MPI_COMM_WORLD))
+        endrun(0, "Failed to open header at %s:%s\n", fname, big_file_get_error_message());
+    int64_t NTotal[6];
+    double MassTable[6], BoxSize, atime;
+    if(0 != big_block_get_attr(&bh, "TotNumPart", NTotal, "u8", 6) ||
+       0 != big_block_get_attr(&bh, "MassTable", MassTable, "f8", 6) ||
+       0 != big_block_get_attr(&bh, "BoxSize", &BoxSize, "f8", 1) ||
+       0 != big_block_get_attr(&bh, "Time", &atime, "f8", 1))
+        endrun(0, "Failed to read attr: %s\n", big_file_get_error_message());
+    if(0 != big_block_get_attr(&bh, "Omega0", &CP->Omega0, "f8", 1))
+        CP->Omega0 = 0.3;
+    if(0 != big_block_get_attr(&bh, "OmegaBaryon", &CP->OmegaBaryon, "f8", 1))
+        CP->OmegaBaryon = 0.045;
+    if(0 != big_block_get_attr(&bh, "HubbleParam", &CP->HubbleParam, "f8", 1))
+        CP->HubbleParam = 0.7;
+    big_block_mpi_close(&bh, MPI_COMM_WORLD);
+    CP->OmegaLambda = 1 - CP->Omega0;
+
+    const int types[3] = {0, 1, 4};
+    int64_t numpart = NTotal[0] + NTotal[1] + NTotal[4];
+    particle_alloc_memory(PartManager, BoxSize, numpart);
+    message(0, "Read %ld gas, %ld dark matter, %ld stars from %s at a = %g, box %g\n", NTotal[0], NTotal[1], NTotal[4], fname, atime, BoxSize);
+
+    int64_t offset = 0;
+    int t;
+    for(t = 0; t < 3; t++) {
+        const int ptype = types[t];
+        if(NTotal[ptype] == 0)
+            continue;
+        /* Read in reverse stack order so the buffers can be freed*/
+        float * mass = (float *) read_block(&bf, ptype, "Mass", "f4", 1, NTotal[ptype], 0);
+        float * ie = ptype == 0 ? (float *) read_block(&bf, ptype, "InternalEnergy", "f4", 1, NTotal[ptype], 0) : NULL;
+        double * pos = (double *) read_block(&bf, ptype, "Position", "f8", 3, NTotal[ptype], 1);
+        int64_t i;
+        #pragma omp parallel for
+        for(i = 0; i < NTotal[ptype]; i++) {
+            struct particle_data * pp = &P[offset + i];
+            memset(pp, 0, sizeof(struct particle_data));
+            int j;
+            for(j = 0; j < 3; j++)
+                pp->Pos[j] = pos[3 * i + j];
+            pp->Type = ptype;
+            pp->Mass = mass ? mass[i] : MassTable[ptype];
+            pp->ID = offset + i;
+            if(ptype == 0)
+                pp->Hsml = ie ? ie[i] : 1;
+        }
+        offset += NTotal[ptype];
+        myfree(pos);
+        if(ie)
+            myfree(ie);
+        if(mass)
+            myfree(mass);
+    }
+    PartManager->NumPart = numpart;
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD))
+        endrun(0, "Failed to close snapshot at %s:%s\n", fname, big_file_get_error_message());
+    return atime;
+}
+
+/* Set up the gas slots, which follow the gas particles in order*/
+static void
+init_gas_slots(void)
+{
+    int64_t i, ngas = 0;
+    for(i = 0; i < PartManager->NumPart; i++)
+        ngas += P[i].Type == 0;
+    int64_t atleast[6] = {0};
+    atleast[0] = ngas;
+    slots_reserve(1, atleast, SlotsManager);
+    #pragma omp parallel for
+    for(i = 0; i < ngas; i++) {
+        P[i].PI = i;
+        /* The snapshot loader keeps the internal energy in Hsml*/
+        SPHP(i).Entropy = P[i].Hsml;
+        SPHP(i).DtEntropy = 0;
+        SPHP(i).Density = 1;
+    }
+    SlotsManager->info[0].size = ngas;
+}
+
+/* Run one walk and return the time taken, storing the number of interactions of the timed walk*/
+static double
+run_kernel(enum BenchKernel kernel, ForceTree * tree, PetaPM * pm, Cosmology * CP, const double atime, int64_t * ninteractions)
+{
+    ActiveParticles act = init_empty_active_particles(PartManager);
+    DriftKickTimes kick = {0};
+    struct sph_pred_data sph_pred = {0};
+    double start = 0, end = 0;
+    int64_t n0 = 0;
+    if(kernel == KERNEL_DENSITY) {
+        n0 = treewalk_total_interactions();
+        start = MPI_Wtime();
+        density(&act, 0, DensityIndependentSphOn(), 0, kick, CP, &sph_pred, NULL, tree);
+        end = MPI_Wtime();
+    }
+    else if(kernel == KERNEL_HYDRO) {
+        /* The hydro walk needs the predicted entropies from the density walk*/
+        density(&act, 0, DensityIndependentSphOn(), 0, kick, CP, &sph_pred, NULL, tree);
+        n0 = treewalk_total_interactions();
+        start = MPI_Wtime();
+        hydro_force(&act, atime, &sph_pred, kick, CP, tree);
+        end = MPI_Wtime();
+    }
+    else {
+        const double rho0 = CP->Omega0 * 3 * CP->Hubble * CP->Hubble / (8 * M_PI * G);
+        n0 = treewalk_total_interactions();
+        start = MPI_Wtime();
+        grav_short_tree(&act, pm, tree, NULL, rho0, 0);
+        end = MPI_Wtime();
+    }
+    *ninteractions = treewalk_total_interactions() - n0;
+    slots_free_sph_pred_data(&sph_pred);
+    return end - start;
+}
+
+/* Hydro parameters as in a production run*/
+static void
+set_bench_hydro_params(void)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_double(ps, "ArtBulkViscConst", OPTIONAL, 0.75, "");
+    param_declare_double(ps, "DensityContrastLimit", OPTIONAL, 100, "");
+    param_declare_int(ps, "DensityIndependentSphOn", OPTIONAL, 1, "");
+    char content[] = "";
+    param_parse(ps, content);
+    set_hydro_params(ps);
+    parameter_set_free(ps);
+}
+
+int main(int argc, char ** argv)
+{
+    MPI_Init(&argc, &argv);
+    init_endrun(1);
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    if(argc < 2 || NTask != 1) {
+        message(0, "Usage: bench_treewalk <density|hydro|gravity> [particles or snapshot] [repeats]. Runs on one rank.\n");
+        MPI_Finalize();
+        return 1;
+    }
+    int kernel;
+    for(kernel = KERNEL_DENSITY; kernel <= KERNEL_GRAVITY; kernel++)
+        if(!strcmp(argv[1], KernelNames[kernel]))
+            break;
+    if(kernel > KERNEL_GRAVITY)
+        endrun(1, "Unknown kernel %s\n", argv[1]);
+    const char * source = (argc > 2) ? argv[2] : "262144";
+    const int nrepeat = (argc > 3) ? atoi(argv[3]) : 5;
+
+    size_t MemoryBytes = 2048L * 1024 * 1024;
+    const char * mem = getenv("BENCH_TREEWALK_MB");
+    if(mem)
+        MemoryBytes = atol(mem) * 1024L * 1024;
+    allocator_init(A_MAIN, "MAIN", MemoryBytes, 0, NULL);
+    allocator_init(A_TEMP, "TEMP", 8 * 1024 * 1024, 0, A_MAIN);
+    walltime_init(&CT);
+    petaio_init();
+    slots_init(0.01, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+
+    Cosmology CP = {0};
+    CP.CMBTemperature = 2.7255;
+    CP.Omega0 = 0.3;
+    CP.OmegaLambda = 0.7;
+    CP.OmegaBaryon = 0.045;
+    CP.HubbleParam = 0.7;
+    double atime = 0.1;
+    /* A number is a particle count, anything else a snapshot*/
+    char * endp;
+    const int64_t npart = strtol(source, &endp, 10);
+    double BoxSize;
+    if(*endp == '\0' && npart > 0)
+        BoxSize = make_grid(npart);
+    else {
+        atime = load_snapshot(source, &CP);
+        BoxSize = PartManager->BoxSize;
+    }
+    CP.OmegaCDM = CP.Omega0 - CP.OmegaBaryon;
+    CP.w0_fld = -1;
+    struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
+    init_cosmology(&CP, atime, units);
+    setup_sync_points(&CP, atime, 1.1 * atime, 0.0, 0);
+    init_gas_slots();
+
+    int64_t ntot = PartManager->NumPart;
+    const double meansep = BoxSize / cbrt(ntot);
+    DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 1;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(0.7);
+
+    struct density_params densp = {0};
+    densp.DensityResolutionEta = 1.;
+    densp.BlackHoleNgbFactor = 2;
+    densp.MaxNumNgbDeviation = 2;
+    densp.DensityKernelType = DENSITY_KERNEL_CUBIC_SPLINE;
+    densp.MinGasHsmlFractional = 0.01;
+    densp.BlackHoleMaxAccretionRadius = 99999.;
+    set_densitypar(densp);
+    set_bench_hydro_params();
+
+    struct gravshort_tree_params treeacc = {0};
+    treeacc.ErrTolForceAcc = 0.002;
+    treeacc.BHOpeningAngle = 0.175;
+    treeacc.MaxBHOpeningAngle = 0.9;
+    /* Barnes-Hut on the first walk only*/
+    treeacc.TreeUseBH = 2;
+    treeacc.Rcut = 7;
+    treeacc.FractionalGravitySoftening = 1./30.;
+    set_gravshort_treepar(treeacc);
+    gravshort_set_softenings(meansep);
+
+    /* The PM grid is not computed: the short-range walk only needs its smoothing scale*/
+    petapm_module_init(omp_get_max_threads());
+    PetaPM pm = {0};
+    gravpm_init_periodic(&pm, BoxSize, 1.5, 2 * cbrt(ntot), G);
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, 1.5, 0);
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+
+    /* The gas walks use a tree of gas only, as in a run*/
+    ForceTree tree = {0};
+    if(kernel == KERNEL_GRAVITY) {
+        force_tree_rebuild_mask(&tree, &ddecomp, ALLMASK, NULL);
+        force_tree_calc_moments(&tree, &ddecomp);
+    }
+    else
+        force_tree_rebuild_mask(&tree, &ddecomp, GASMASK, NULL);
+
+    /* Untimed walks: find the smoothing lengths and densities, convert the internal energy
+     * of a snapshot to entropy, and do one gravity walk so that the timed walks use the
+     * relative opening criterion, as on all but the first step of a run.*/
+    ActiveParticles act = init_empty_active_particles(PartManager);
+    DriftKickTimes kick = {0};
+    if(SlotsManager->info[0].size > 0) {
+        struct sph_pred_data sph_pred = {0};
+        ForceTree gastree = {0};
+        if(kernel == KERNEL_GRAVITY)
+            force_tree_rebuild_mask(&gastree, &ddecomp, GASMASK, NULL);
+        ForceTree * gt = kernel == KERNEL_GRAVITY ? &gastree : &tree;
+        set_init_hsml(gt, &ddecomp, meansep);
+        density(&act, 1, 0, 0, kick, &CP, &sph_pred, NULL, gt);
+        slots_free_sph_pred_data(&sph_pred);
+        if(kernel == KERNEL_GRAVITY)
+            force_tree_free(&gastree);
+        if(*endp != '\0') {
+            const double a3 = pow(atime, 3);
+            int64_t i;
+            #pragma omp parallel for
+            for(i = 0; i < SlotsManager->info[0].size; i++)
+                SphP[i].Entropy = GAMMA_MINUS1 * SphP[i].Entropy / pow(SphP[i].Density / a3, GAMMA_MINUS1);
+        }
+    }
+    if(kernel == KERNEL_GRAVITY) {
+        int64_t nfirst;
+        run_kernel(KERNEL_GRAVITY, &tree, &pm, &CP, atime, &nfirst);
+        treeacc.TreeUseBH = 0;
+        set_gravshort_treepar(treeacc);
+    }
+
+    message(0, "Benchmarking the %s treewalk on %ld particles with %d threads, best of %d.\n",
+            KernelNames[kernel], ntot, omp_get_max_threads(), nrepeat);
+    double best = 1e30;
+    int64_t ninteractions = 0;
+    int rep;
+    for(rep = 0; rep < nrepeat; rep++) {
+        int64_t nthis;
+        const double dt = run_kernel(kernel, &tree, &pm, &CP, atime, &nthis);
+        if(dt < best) {
+            best = dt;
+            ninteractions = nthis;
+        }
+    }
+    message(0, "BENCH %-8s N=%ld threads=%d %10.4g s interactions=%ld %8.4g ns/interaction %8.4g thread-ns/interaction\n",
+            KernelNames[kernel], ntot, omp_get_max_threads(), best, ninteractions,
+            best * 1e9 / ninteractions, best * 1e9 * omp_get_max_threads() / ninteractions);
+
+    force_tree_free(&tree);
+    domain_free(&ddecomp);
+    petapm_destroy(&pm);
+    MPI_Finalize();
+    return 0;
+}
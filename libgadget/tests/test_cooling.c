@@ -151,12 +151,12 @@ static double tcool_table[NSTEP * NSTEP] = {
 };
 
 struct part_manager_type PartManager[1];
-/* Check that DoCooling and GetCoolingTime both return
- * a stable value over a wide range of internal energies and densities.*/
-static void test_DoCooling(void ** state)
+
+/* Initialise the cooling module with the Gadget-2 rates. Returns the minimum internal energy.*/
+static double
+setup_cooling(void)
 {
-    int i, j;
-    struct cooling_params coolpar;
+    struct cooling_params coolpar = {0};
     coolpar.CMBTemperature = 2.7255;
     coolpar.PhotoIonizeFactor = 1;
     coolpar.SelfShieldingOn = 0;
@@ -202,6 +202,15 @@ static void test_DoCooling(void ** state)
 
     set_coolpar(coolpar);
     init_cooling(TreeCool, NULL, MetalCool, NULL, coolunits, &CP);
+    return MinEgySpec;
+}
+
+/* Check that DoCooling and GetCoolingTime both return
+ * a stable value over a wide range of internal energies and densities.*/
+static void test_DoCooling(void ** state)
+{
+    int i, j;
+    double MinEgySpec = setup_cooling();
     struct UVBG uvbg = get_global_UVBG(0);
     assert_true(fabs(uvbg.epsH0/3.65296e-25 -1) < 1e-5);
     assert_true(fabs(uvbg.epsHe0/3.98942e-25 -1) < 1e-5);
@@ -240,9 +249,41 @@ static void test_DoCooling(void ** state)
 //    printf("\n");
 }
 
+/* Check that cooling particles in batches gives exactly the answer of cooling them one at a time,
+ * including a partial block and particles which converge at different iterations.*/
+static void test_DoCoolingBatch(void ** state)
+{
+    int i;
+    double MinEgySpec = setup_cooling();
+    struct UVBG uvbg = get_global_UVBG(0);
+    const int n = 3 * COOLING_BLOCK + 3;
+    struct CoolingBatch cool[3 * COOLING_BLOCK + 3];
+    for(i = 0; i < n; i++) {
+        cool[i].u_old = exp(log(200) + i * (log(36000) - log(200)) / n);
+        cool[i].rho = exp(log(1e-9) + ((7 * i) % n) * (log(1e-2) - log(1e-9)) / n);
+        cool[i].dt = 0.05 * (1 + i % 4);
+        cool[i].Z = 0;
+        cool[i].MinEgySpec = MinEgySpec;
+        cool[i].uvbg = uvbg;
+        cool[i].ne_guess = (i % 3) * 0.5;
+        cool[i].isHeIIIionized = 1;
+    }
+    double unew[3 * COOLING_BLOCK + 3], ne[3 * COOLING_BLOCK + 3];
+    for(i = 0; i < n; i++) {
+        ne[i] = cool[i].ne_guess;
+        unew[i] = DoCooling(0, cool[i].u_old, cool[i].rho, cool[i].dt, &uvbg, &ne[i], 0, MinEgySpec, 1);
+    }
+    DoCoolingBatch(0, cool, n);
+    for(i = 0; i < n; i++) {
+        assert_true(cool[i].u == unew[i]);
+        assert_true(cool[i].ne_guess == ne[i]);
+    }
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_DoCooling),
+        cmocka_unit_test(test_DoCoolingBatch),
 
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
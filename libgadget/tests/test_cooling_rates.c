@@ -252,6 +252,52 @@ static void test_heatingcooling_rate(void ** state)
     assert_true(fabs(LambdaNet/ (-1.64834) - 1) < 1e-3);
 }
 
+/* Check that rates interpolated from the cooling table are close to the rate network,
+ * and that particles with a different UVB do not use the table.*/
+static void test_cooling_table(void ** state)
+{
+    struct cooling_params coolpar = get_test_coolpar();
+    const char * TreeCool = GADGET_TESTDATA_ROOT "/examples/TREECOOL_ep_2018p";
+    const char * MetalCool = "";
+    Cosmology CP = {0};
+    CP.OmegaCDM = 0.3;
+    CP.OmegaBaryon = coolpar.fBar * CP.OmegaCDM;
+    CP.HubbleParam = 0.7;
+    set_coolpar(coolpar);
+    init_cooling_rates(TreeCool,NULL,MetalCool,&CP);
+
+    const double redshift = 2;
+    struct UVBG uvbg = get_global_UVBG(redshift);
+    struct UVBG nouvbg = {0};
+    const double helium = 1 - HYDROGEN_MASSFRAC;
+    double exact[400], exactne[400], noexact[400];
+    int i;
+    for(i = 0; i < 400; i++) {
+        /* Density from 1e-8 to 10, internal energy from 10^10 to 10^16*/
+        double dens = pow(10, -8 + 9 * (i / 20) / 20.);
+        double ienergy = pow(10, 10 + 6 * (i % 20) / 20.);
+        exactne[i] = 1;
+        exact[i] = get_heatingcooling_rate(dens, ienergy, helium, redshift, 0, &uvbg, &exactne[i]);
+        double ne = 1;
+        noexact[i] = get_heatingcooling_rate(dens, ienergy, helium, redshift, 0, &nouvbg, &ne);
+    }
+    coolpar.CoolingTableTolerance = 0.01;
+    set_coolpar(coolpar);
+    init_cooling_rates(TreeCool,NULL,MetalCool,&CP);
+    update_cooling_table(redshift, &uvbg);
+    for(i = 0; i < 400; i++) {
+        double dens = pow(10, -8 + 9 * (i / 20) / 20.);
+        double ienergy = pow(10, 10 + 6 * (i % 20) / 20.);
+        double ne = 1;
+        double LambdaNet = get_heatingcooling_rate(dens, ienergy, helium, redshift, 0, &uvbg, &ne);
+        assert_true(fabs(LambdaNet - exact[i]) <= 0.02 * fabs(exact[i]));
+        assert_true(fabs(ne - exactne[i]) <= 0.02);
+        ne = 1;
+        LambdaNet = get_heatingcooling_rate(dens, ienergy, helium, redshift, 0, &nouvbg, &ne);
+        assert_true(LambdaNet == noexact[i]);
+    }
+}
+
 #if 0
 /* This test checks that the heating and cooling rate is as expected.
  * In particular the physical density threshold is checked. */
@@ -323,7 +369,8 @@ int main(void) {
         cmocka_unit_test(test_recomb_rates),
         cmocka_unit_test(test_rate_network),
         cmocka_unit_test(test_heatingcooling_rate),
-        cmocka_unit_test(test_uvbg_loader)
+        cmocka_unit_test(test_uvbg_loader),
+        cmocka_unit_test(test_cooling_table)
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -93,9 +93,35 @@ static void test_cosmology(void ** state)
     assert_true(fabs(0.01*log(GrowthFactor(&CP, 0.01+1e-5,0.01-1e-5))/2e-5 -  F_Omega(&CP, 0.01)) < 1e-3);
 }
 
+static void test_cosmology_tables(void ** state)
+{
+    Cosmology CP = {0};
+    double omegam = 0.5;
+    setup_cosmology(&CP, omegam, 0.0455, 0.7);
+    CP.RadiationOn = 0;
+    const double direct = F_Omega(&CP, 0.3);
+    init_cosmology_tables(&CP, 0.01, 1);
+    assert_true(fabs(1/GrowthFactor(&CP, 0.5, 1.) - growth(1., omegam)/growth(0.5, omegam)) < 1e-3);
+    assert_true(fabs(1/GrowthFactor(&CP, 0.01, 1.) - growth(1, omegam)/growth(0.01, omegam)) < 1e-3);
+    assert_true(fabs(F_Omega(&CP, 0.3) / direct - 1) < 1e-5);
+    /* Outside the tables*/
+    assert_true(fabs(GrowthFactor(&CP, 1.5, 1.) - growth(1.5, omegam)/growth(1, omegam)) < 1e-3);
+
+    /* Matter domination: the comoving distance is 2 c/H0 (1 - sqrt(a))*/
+    setup_cosmology(&CP, 1., 0.0455, 0.7);
+    CP.RadiationOn = 0;
+    init_cosmology_tables(&CP, 0.01, 1);
+    const double UnitVelocity_in_cm_per_s = 1e5;
+    const double hubbledist = LIGHTCGS / UnitVelocity_in_cm_per_s / CP.Hubble;
+    assert_true(fabs(compute_comoving_distance(&CP, 0.25, 1, UnitVelocity_in_cm_per_s) / hubbledist - 1) < 1e-6);
+    assert_true(fabs(compute_comoving_distance(&CP, 0.04, 0.25, UnitVelocity_in_cm_per_s) / hubbledist - 0.6) < 1e-6);
+    assert_true(fabs(GrowthFactor(&CP, 0.5, 1.)/0.5 - 1) < 2e-4);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_cosmology),
+        cmocka_unit_test(test_cosmology_tables),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -31,6 +31,9 @@ struct density_testdata
     gsl_rng * r;
 };
 
+/* If true, the gas tree in do_density_test has integer positions*/
+static int IntPositions = 0;
+
 /* Perform some simple checks on the densities*/
 static void check_densities(double MinGasHsml)
 {
@@ -41,6 +44,7 @@ static void check_densities(double MinGasHsml)
         assert_true(isfinite(P[i].Hsml));
         assert_true(isfinite(SPHP(i).Density));
         assert_true(SPHP(i).Density > 0);
+        assert_true(P[i].NgbCost > 0);
         if(P[i].Hsml < minHsml)
             minHsml = P[i].Hsml;
         if(P[i].Hsml > maxHsml)
@@ -103,6 +107,12 @@ static void do_density_test(void ** state, const int numpart, double expectedhsm
 
     /* Rebuild without moments to check it works*/
     force_tree_rebuild_mask(&tree, &ddecomp, GASMASK, NULL);
+    /* The second density call below re-uses the export plan recorded by the first,
+     * and the neighbour lists cached by the first where its search radius is still covered.*/
+    force_tree_alloc_export_plan(&tree);
+    if(IntPositions)
+        force_tree_make_int_positions(&tree);
+    force_tree_alloc_ngb_cache(&tree, 0.1, 2 * GetNumNgb(GetDensityKernelType()) * pow(1.1, 3));
     density(&act, 1, 0, 0, kick, &CP, &data->sph_pred, NULL, &tree);
     end = MPI_Wtime();
     double ms = (end - start)*1000;
@@ -151,12 +161,10 @@ static void do_density_test(void ** state, const int numpart, double expectedhsm
     check_densities(data->dp.MinGasHsmlFractional);
 }
 
-static void test_density_flat(void ** state) {
-    /*Set up the particle data*/
-    int ncbrt = 32;
+/* Create a regular grid of particles, all of type 0, in a box 8 kpc across.*/
+static void setup_flat(const int ncbrt)
+{
     int numpart = ncbrt*ncbrt*ncbrt;
-    /* Create a regular grid of particles, 8x8x8, all of type 1,
-     * in a box 8 kpc across.*/
     int i;
     #pragma omp parallel for
     for(i=0; i<numpart; i++) {
@@ -167,7 +175,25 @@ static void test_density_flat(void ** state) {
         P[i].Pos[1] = (PartManager->BoxSize/ncbrt) * ((i/ncbrt) % ncbrt);
         P[i].Pos[2] = (PartManager->BoxSize/ncbrt) * (i % ncbrt);
     }
+}
+
+static void test_density_flat(void ** state) {
+    int ncbrt = 32;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    struct density_testdata * data = * (struct density_testdata **) state;
+    const double maxdev = data->dp.MaxNumNgbDeviation;
+    /* Bisection only*/
+    data->dp.HsmlCandidates = 0;
+    set_densitypar(data->dp);
+    setup_flat(ncbrt);
     do_density_test(state, numpart, 0.501747, 1e-4);
+    /* Interpolating from the trial smoothing lengths converges to different Hsml,
+     * within MaxNumNgbDeviation of the bisection result.*/
+    data->dp.MaxNumNgbDeviation = maxdev;
+    data->dp.HsmlCandidates = 1;
+    set_densitypar(data->dp);
+    setup_flat(ncbrt);
+    do_density_test(state, numpart, 0.501356, 1e-4);
 }
 
 static void test_density_close(void ** state) {
@@ -203,6 +229,42 @@ static void test_density_close(void ** state) {
     do_density_test(state, numpart, 0.131726, 1e-4);
 }
 
+/* The offloaded local walk runs on the host without a device, and should find the same densities*/
+static void test_density_offload(void ** state) {
+    struct density_testdata * data = * (struct density_testdata **) state;
+    data->dp.Offload = 1;
+    set_densitypar(data->dp);
+    test_density_close(state);
+    data->dp.Offload = 0;
+    set_densitypar(data->dp);
+}
+
+/* Separations from integer positions should match the floating point periodic wrap*/
+static void test_intpos_nearest(void ** state) {
+    const double BoxSize = PartManager->BoxSize;
+    const double fac = intpos_fac(BoxSize);
+    /* No two are half a box apart, where the sign of the separation is ambiguous*/
+    const double pos[6] = {0, 0.001, 0.3, 0.45, 0.7, 0.9999};
+    int i, j;
+    for(i = 0; i < 6; i++) {
+        /* Positions outside the box are wrapped*/
+        const MyIntPosType wrapped = pos_to_intpos((pos[i] + 1) * BoxSize, BoxSize);
+        assert_true(fabs(INTPOS_NEAREST(wrapped, pos_to_intpos(pos[i] * BoxSize, BoxSize), fac)) < 1e-12 * BoxSize);
+        for(j = 0; j < 6; j++) {
+            const double x = pos[i] * BoxSize, y = pos[j] * BoxSize;
+            const double sep = INTPOS_NEAREST(pos_to_intpos(x, BoxSize), pos_to_intpos(y, BoxSize), fac);
+            assert_true(fabs(sep - NEAREST(x - y, BoxSize)) < 1e-6 * BoxSize);
+        }
+    }
+}
+
+/* Density with integer positions on the gas tree should find the same densities*/
+static void test_density_intpos(void ** state) {
+    IntPositions = 1;
+    test_density_close(state);
+    IntPositions = 0;
+}
+
 void do_random_test(void **state, gsl_rng * r, const int numpart)
 {
     /* Create a randomly space set of particles, 8x8x8, all of type 0. */
@@ -271,6 +333,9 @@ void trivial_domain(DomainDecomp * ddecomp)
     ddecomp->Tasks = mymalloc("task",sizeof(struct task_data));
     ddecomp->Tasks[0].StartLeaf = 0;
     ddecomp->Tasks[0].EndLeaf = 1;
+    /* No cache of the pseudo particles*/
+    ddecomp->TopLeafMoments = NULL;
+    ddecomp->TopLeafMomentsValid = 0;
 }
 
 static int teardown_density(void **state) {
@@ -314,6 +379,7 @@ static int setup_density(void **state) {
     data->dp.MaxNumNgbDeviation = 2;
     data->dp.DensityKernelType = DENSITY_KERNEL_CUBIC_SPLINE;
     data->dp.MinGasHsmlFractional = 0.006;
+    data->dp.HsmlCandidates = 1;
     struct gravshort_tree_params tree_params = {0};
     tree_params.FractionalGravitySoftening = 1;
     set_gravshort_treepar(tree_params);
@@ -332,6 +398,9 @@ int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_density_flat),
         cmocka_unit_test(test_density_close),
+        cmocka_unit_test(test_density_offload),
+        cmocka_unit_test(test_intpos_nearest),
+        cmocka_unit_test(test_density_intpos),
         cmocka_unit_test(test_density_random),
     };
     return cmocka_run_group_tests_mpi(tests, setup_density, teardown_density);
@@ -0,0 +1,83 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+
+#include "stub.h"
+
+#include <mpi.h>
+#include "../utils/system.h"
+#include "../utils/diagnostics.h"
+
+static double Printed[4];
+static int NPrinted;
+
+static void
+record(const char * label, const double * values)
+{
+    int i;
+    for(i = 0; i < 4; i++)
+        Printed[i] = values[i];
+    NPrinted++;
+}
+
+static void
+test_diagnostics_reduce(void ** state)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+
+    NPrinted = 0;
+    const double values[4] = {ThisTask + 1, ThisTask + 1, ThisTask + 1, -ThisTask};
+    const enum DiagOp ops[4] = {DIAG_SUM, DIAG_MIN, DIAG_MAX, DIAG_MIN};
+    diagnostics_add("test", values, ops, 4, record);
+    /* Nothing is printed until the reduction completes*/
+    diagnostics_flush();
+    assert_int_equal(NPrinted, 0);
+    diagnostics_finish();
+    if(ThisTask == 0) {
+        assert_int_equal(NPrinted, 1);
+        assert_true(Printed[0] == NTask * (NTask + 1) / 2);
+        assert_true(Printed[1] == 1);
+        assert_true(Printed[2] == NTask);
+        assert_true(Printed[3] == -(NTask - 1));
+    }
+    else
+        assert_int_equal(NPrinted, 0);
+}
+
+static void
+test_diagnostics_overflow(void ** state)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+
+    /* More entries than fit in one buffer are reduced in several collectives*/
+    NPrinted = 0;
+    int i;
+    for(i = 0; i < 1000; i++) {
+        const double values[4] = {i, ThisTask, ThisTask, 1};
+        const enum DiagOp ops[4] = {DIAG_MAX, DIAG_MIN, DIAG_MAX, DIAG_SUM};
+        diagnostics_add("overflow", values, ops, 4, record);
+    }
+    diagnostics_finish();
+    if(ThisTask == 0) {
+        assert_int_equal(NPrinted, 1000);
+        assert_true(Printed[0] == 999);
+        assert_true(Printed[1] == 0);
+        assert_true(Printed[2] == NTask - 1);
+        assert_true(Printed[3] == NTask);
+    }
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_diagnostics_reduce),
+        cmocka_unit_test(test_diagnostics_overflow),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
@@ -0,0 +1,175 @@
+/* Tests for drifting particles whose drift was deferred, so they have different Ti_drift*/
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/domain.h>
+#include <libgadget/drift.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/timefac.h>
+#include <libgadget/timebinmgr.h>
+#include <libgadget/walltime.h>
+#include "stub.h"
+
+static struct ClockTable CT;
+static Cosmology CP;
+
+#define NUMPART 4096
+#define BOXSIZE 20000.
+/* ti0 is the end of the last drift, tiold of the one before, and ti1 is active only for bins <= 5*/
+#define TIOLD (10L << 12)
+#define TI0 (TIOLD + (1L << 12))
+#define TI1 (TI0 + (1L << 5))
+
+/* The initial state of each particle is a function of its ID, so it can be found after an exchange*/
+static void
+initial_state(const MyIDType id, const int64_t ntot, double * pos, double * vel, inttime_t * ti, int * type, int * bin)
+{
+    int j;
+    for(j = 0; j < 3; j++) {
+        pos[j] = fmod(BOXSIZE * (j+1) * (id + 0.5) / ntot, BOXSIZE);
+        vel[j] = 10. * (j+1) * ((int)(id % 7) - 3);
+    }
+    /* Types 1 and 2, inactive on a long bin or always active*/
+    *type = 1 + (id % 2);
+    *bin = (id / 2) % 2 ? 10 : 0;
+    /* A quarter were left behind at an earlier drift*/
+    *ti = (id / 4) % 2 ? TIOLD : TI0;
+}
+
+static void
+setup_particles(void)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int64_t numpart = NUMPART / NTask;
+    particle_alloc_memory(PartManager, BOXSIZE, 1.5 * numpart);
+    PartManager->NumPart = numpart;
+    /* No slots: the particles are dark matter*/
+    slots_init(0, SlotsManager);
+    int64_t newSlots[6] = {0};
+    slots_reserve(1, newSlots, SlotsManager);
+    int64_t i;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        P[i].ID = i + numpart * ThisTask;
+        P[i].Mass = 1;
+        P[i].IsGarbage = 0;
+        double pos[3], vel[3];
+        int type, bin, j;
+        initial_state(P[i].ID, numpart * NTask, pos, vel, &P[i].Ti_drift, &type, &bin);
+        for(j = 0; j < 3; j++) {
+            P[i].Pos[j] = pos[j];
+            P[i].Vel[j] = vel[j];
+        }
+        P[i].Type = type;
+        P[i].TimeBinGravity = bin;
+        P[i].TimeBinHydro = bin;
+    }
+}
+
+/* Check that each particle is at the position of its initial state drifted from its Ti_drift to ti,
+ * or not moved if it should still be behind.*/
+static void
+check_drifted(const inttime_t ti, const int defermask)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int64_t ntot = NUMPART / NTask * NTask;
+    int64_t i;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        double pos[3], vel[3];
+        inttime_t ti_drift;
+        int type, bin, j;
+        initial_state(P[i].ID, ntot, pos, vel, &ti_drift, &type, &bin);
+        const int deferred = (defermask & (1 << type)) && bin > 5;
+        assert_int_equal(P[i].Ti_drift, deferred ? ti_drift : ti);
+        const double ddrift = deferred ? 0 : get_exact_drift_factor(&CP, ti_drift, ti);
+        for(j = 0; j < 3; j++) {
+            double dx = P[i].Pos[j] - pos[j] - vel[j] * ddrift;
+            dx -= BOXSIZE * round(dx / BOXSIZE);
+            assert_true(fabs(dx) < 1e-6 * BOXSIZE);
+        }
+    }
+}
+
+static void
+setup_timeline(void)
+{
+    walltime_init(&CT);
+    memset(&CP, 0, sizeof(CP));
+    CP.CMBTemperature = 2.7255;
+    CP.Omega0 = 0.3;
+    CP.OmegaLambda = 1- CP.Omega0;
+    CP.OmegaBaryon = 0.045;
+    CP.HubbleParam = 0.7;
+    CP.RadiationOn = 0;
+    CP.w0_fld = -1;
+    struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
+    init_cosmology(&CP, 0.1, units);
+    setup_sync_points(&CP, 0.1, 0.2, 0.0, 0);
+}
+
+static void
+test_drift_all_particles(void ** state)
+{
+    setup_timeline();
+    setup_particles();
+    /* The particles left at TIOLD are drifted from there*/
+    const double noshift[3] = {0};
+    drift_all_particles(TI0, TI1, &CP, noshift);
+    check_drifted(TI1, 0);
+    /* Drifting again to the same time changes nothing*/
+    drift_all_particles(TI1, TI1, &CP, noshift);
+    check_drifted(TI1, 0);
+    /* Nothing was deferred*/
+    drift_deferred_particles();
+    check_drifted(TI1, 0);
+    slots_free(SlotsManager);
+    myfree(P);
+}
+
+static void
+test_domain_maintain_deferred(void ** state)
+{
+    setup_timeline();
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 1;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(0.7);
+    setup_particles();
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+
+    struct DriftData drift;
+    drift.CP = &CP;
+    drift.ti0 = TI0;
+    drift.ti1 = TI1;
+    /* Only type 1 may be deferred, and only while inactive*/
+    drift.DeferMask = 1 << 1;
+    assert_int_equal(domain_maintain(&ddecomp, &drift), 0);
+    check_drifted(TI1, drift.DeferMask);
+    /* Catching up, as for a snapshot, drifts the deferred particles from their own Ti_drift*/
+    drift_deferred_particles();
+    check_drifted(TI1, 0);
+    domain_free(&ddecomp);
+    slots_free(SlotsManager);
+    myfree(P);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_drift_all_particles),
+        cmocka_unit_test(test_domain_maintain_deferred),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
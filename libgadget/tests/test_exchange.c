@@ -105,7 +105,7 @@ test_exchange(void **state)
 
     setup_particles(newSlots);
 
-    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, PartManager, SlotsManager,10000, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, EXCHANGE_PERSISTENT, PartManager, SlotsManager,10000, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 #ifdef DEBUG
@@ -123,7 +123,7 @@ test_exchange_zero_slots(void **state)
 
     setup_particles(newSlots);
 
-    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, EXCHANGE_PERSISTENT, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 #ifdef DEBUG
@@ -135,6 +135,40 @@ test_exchange_zero_slots(void **state)
     return;
 }
 
+/* The sent fields arrive intact, and GrNr only if asked for*/
+static void
+test_exchange_fields(void **state)
+{
+    int64_t newSlots[6] = {NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1};
+    int fields;
+    for(fields = EXCHANGE_PERSISTENT; fields <= EXCHANGE_GRNR; fields++) {
+        setup_particles(newSlots);
+        int i;
+        for(i = 0; i < PartManager->NumPart; i ++) {
+            P[i].Mass = P[i].ID + 0.5;
+            P[i].Vel[2] = P[i].ID;
+            P[i].Potential = -1. * P[i].ID;
+            P[i].GrNr = P[i].ID + 1;
+        }
+        int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, fields, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
+        assert_all_true(!fail);
+        int moved = 0;
+        for(i = 0; i < PartManager->NumPart; i ++) {
+            assert_true(P[i].Mass == P[i].ID + 0.5);
+            assert_true(P[i].Vel[2] == P[i].ID);
+            assert_true(P[i].Potential == -1. * P[i].ID);
+            if(fields & EXCHANGE_GRNR)
+                assert_true(P[i].GrNr == (grnr_t) P[i].ID + 1);
+            else
+                assert_true(P[i].GrNr == (grnr_t) P[i].ID + 1 || P[i].GrNr == 0);
+            moved += P[i].GrNr == 0;
+        }
+        if(NTask > 1 && !(fields & EXCHANGE_GRNR))
+            assert_true(moved > 0);
+        teardown_particles(state);
+    }
+}
+
 static void
 test_exchange_with_garbage(void **state)
 {
@@ -144,7 +178,7 @@ test_exchange_with_garbage(void **state)
 
     slots_mark_garbage(0, PartManager, SlotsManager); /* watch out! this propagates the garbage flag to children */
     TotNumPart -= NTask;
-    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, EXCHANGE_PERSISTENT, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 
@@ -173,7 +207,7 @@ test_exchange_uneven(void **state)
     int i;
 
     /* this will trigger a slot growth on slot type 0 due to the inbalance */
-    int fail = domain_exchange(&test_exchange_layout_func_uneven, NULL, NULL, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func_uneven, NULL, NULL, EXCHANGE_PERSISTENT, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 
@@ -214,6 +248,7 @@ int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_exchange_with_garbage),
         cmocka_unit_test(test_exchange),
+        cmocka_unit_test(test_exchange_fields),
         cmocka_unit_test(test_exchange_zero_slots),
         cmocka_unit_test(test_exchange_uneven),
     };
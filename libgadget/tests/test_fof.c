@@ -62,7 +62,7 @@ setup_particles(int NumPart, double BoxSize)
 }
 
 static void
-test_fof(void **state)
+do_test_fof(int FOFCellLinking)
 {
     int NTask;
     walltime_init(&CT);
@@ -73,7 +73,7 @@ test_fof(void **state)
     dp.TopNodeAllocFactor = 1.;
     dp.SetAsideFactor = 1;
     set_domain_par(dp);
-    set_fof_testpar(1, 0.2, 5);
+    set_fof_testpar(1, 0.2, 5, FOFCellLinking);
     init_forcetree_params(0.7);
 
     MPI_Comm_size(MPI_COMM_WORLD, &NTask);
@@ -86,14 +86,26 @@ test_fof(void **state)
     DomainDecomp ddecomp = {0};
     domain_decompose_full(&ddecomp);
 
-    FOFGroups fof = fof_fof(&ddecomp, 1, MPI_COMM_WORLD);
+    FOFGroups fof = fof_fof(&ddecomp, FOF_STORE_GRNR, NULL, MPI_COMM_WORLD);
 
     /* Example assertion: this checks that the groups were allocated. */
     assert_all_true(fof.Group);
     assert_true(fof.TotNgroups == 1);
     /* Assert some more things about the particles,
      * maybe checking the halo properties*/
+    double mass = 0;
+    int i;
+    for(i = 0; i < fof.Ngroups; i++)
+        mass += fof.Group[i].Mass;
+    fof_finish(&fof);
 
+    /* The seeding groups have the same masses*/
+    fof = fof_fof(&ddecomp, FOF_SEED_ONLY, NULL, MPI_COMM_WORLD);
+    assert_true(fof.TotNgroups == 1);
+    double seedmass = 0;
+    for(i = 0; i < fof.Ngroups; i++)
+        seedmass += fof.Group[i].Mass;
+    assert_true(seedmass == mass);
     fof_finish(&fof);
     domain_free(&ddecomp);
     slots_free(SlotsManager);
@@ -101,9 +113,22 @@ test_fof(void **state)
     return;
 }
 
+static void
+test_fof(void **state)
+{
+    do_test_fof(0);
+}
+
+static void
+test_fof_cells(void **state)
+{
+    do_test_fof(1);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_fof),
+        cmocka_unit_test(test_fof_cells),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
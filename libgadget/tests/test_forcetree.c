@@ -256,7 +256,7 @@ static int check_hmax(const ForceTree * tb, const int numpart)
 
 static void do_tree_mask_hmax_update_test(const int numpart, ForceTree * tb, DomainDecomp * ddecomp)
 {
-    RandTable rnd = set_random_numbers(23, 8192);
+    RandTable rnd = set_random_numbers(23, 0);
 
     /*Sort by peano key so this is more realistic*/
     int i;
@@ -266,7 +266,7 @@ static void do_tree_mask_hmax_update_test(const int numpart, ForceTree * tb, Dom
         P[i].PI = 0;
         P[i].IsGarbage = 0;
         P[i].Type = 0;
-        P[i].Hsml = PartManager->BoxSize/cbrt(numpart) * get_random_number(i, &rnd);
+        P[i].Hsml = PartManager->BoxSize/cbrt(numpart) * get_random_number(i, 0, &rnd);
     }
     free_random_numbers(&rnd);
     PartManager->MaxPart = numpart;
@@ -427,6 +427,483 @@ void trivial_domain(DomainDecomp * ddecomp)
     ddecomp->Tasks = malloc(sizeof(struct task_data));
     ddecomp->Tasks[0].StartLeaf = 0;
     ddecomp->Tasks[0].EndLeaf = 1;
+    /* No cache of the pseudo particles*/
+    ddecomp->TopLeafMoments = NULL;
+    ddecomp->TopLeafMomentsValid = 0;
+}
+
+/* Check that refitting a tree to a subset of its particles gives the same moments
+ * as a tree built for that subset, and that the walk only finds the subset.*/
+/* Walk a refitted tree: every particle found should be kept and found once,
+ * and every internal node should have children. Returns the number of particles found
+ * and stores the number of internal nodes with empty child slots in nempty.*/
+static int64_t walk_refit_tree(const ForceTree * tb, const unsigned char * keep, const int numpart, int64_t * nempty)
+{
+    char * found = calloc(numpart, sizeof(char));
+    int64_t nfound = 0;
+    *nempty = 0;
+    int node = tb->firstnode;
+    while(node >= 0) {
+        const struct NODE * nop = &tb->Nodes[node];
+        if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+            int i;
+            for(i = 0; i < nop->s.noccupied; i++) {
+                const int p = nop->s.suns[i];
+                assert_true(keep[p]);
+                assert_false(found[p]);
+                found[p] = 1;
+                nfound++;
+            }
+            node = nop->sibling;
+        }
+        else {
+            assert_true(nop->s.suns[0] >= tb->firstnode);
+            if(nop->s.suns[7] < 0)
+                (*nempty)++;
+            node = nop->s.suns[0];
+        }
+    }
+    free(found);
+    return nfound;
+}
+
+static void test_tree_refit(void ** state) {
+    int ncbrt = 32;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    ForceTree tb = force_treeallocate(numpart, numpart, &ddecomp, 1, 0);
+    ddecomp.TopLeaves[0].treenode = tb.firstnode;
+    int i;
+    for(i=0; i<numpart; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    ActiveParticles AllAct = init_empty_active_particles(PartManager);
+    tb.mask = ALLMASK;
+    force_tree_create_nodes(&tb, &AllAct, ALLMASK, &ddecomp);
+    force_tree_calc_moments(&tb, &ddecomp);
+    assert_true(fabs(tb.Nodes[tb.firstnode].mom.mass - numpart) < 0.5);
+    /* Keep particles in one half of the box and one in three of the rest,
+     * so that some internal nodes become empty.*/
+    ActiveParticles Act = {0};
+    Act.ActiveParticle = (int *) mymalloc("ActiveParticle", numpart * sizeof(int));
+    unsigned char * keep = calloc(numpart, sizeof(unsigned char));
+    double cofm[3] = {0};
+    for(i = 0; i < numpart; i++) {
+        if(P[i].Pos[0] < PartManager->BoxSize/2 || i % 3 == 0) {
+            Act.ActiveParticle[Act.NumActiveParticle++] = i;
+            keep[i] = 1;
+            int j;
+            for(j = 0; j < 3; j++)
+                cofm[j] += P[i].Pos[j];
+        }
+    }
+    force_tree_refit(&tb, &ddecomp, &Act);
+    assert_int_equal(tb.NumParticles, Act.NumActiveParticle);
+    assert_true(fabs(tb.Nodes[tb.firstnode].mom.mass - Act.NumActiveParticle) < 0.5);
+    for(i = 0; i < 3; i++)
+        assert_true(fabs(tb.Nodes[tb.firstnode].mom.cofm[i] - cofm[i] / Act.NumActiveParticle) < 1e-4);
+    int64_t nempty;
+    assert_int_equal(walk_refit_tree(&tb, keep, numpart, &nempty), Act.NumActiveParticle);
+    /* The moments have compacted the children, so some internal nodes now have empty slots*/
+    assert_true(nempty > 0);
+
+    /* Refit the compacted tree again, keeping only the particles in the far half of the box,
+     * so that the compaction runs over nodes which already have empty slots.*/
+    int64_t nkeep = 0;
+    memset(cofm, 0, sizeof(cofm));
+    for(i = 0; i < Act.NumActiveParticle; i++) {
+        const int p = Act.ActiveParticle[i];
+        keep[p] = P[p].Pos[0] >= PartManager->BoxSize/2;
+        if(!keep[p])
+            continue;
+        Act.ActiveParticle[nkeep++] = p;
+        int j;
+        for(j = 0; j < 3; j++)
+            cofm[j] += P[p].Pos[j];
+    }
+    Act.NumActiveParticle = nkeep;
+    force_tree_refit(&tb, &ddecomp, &Act);
+    assert_int_equal(tb.NumParticles, nkeep);
+    assert_true(fabs(tb.Nodes[tb.firstnode].mom.mass - nkeep) < 0.5);
+    for(i = 0; i < 3; i++)
+        assert_true(fabs(tb.Nodes[tb.firstnode].mom.cofm[i] - cofm[i] / nkeep) < 1e-4);
+    assert_int_equal(walk_refit_tree(&tb, keep, numpart, &nempty), nkeep);
+    assert_true(nempty > 0);
+
+    free(keep);
+    myfree(Act.ActiveParticle);
+    force_tree_free(&tb);
+    myfree(PartManager->Base);
+}
+
+/* Check the compact walk nodes against the full tree*/
+static void test_walk_nodes(void ** state) {
+    int ncbrt = 32;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    ForceTree tb = force_treeallocate(numpart, numpart, &ddecomp, 0, 0);
+    ddecomp.TopLeaves[0].treenode = tb.firstnode;
+    int i;
+    for(i=0; i<numpart; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r) * gsl_rng_uniform(r);
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    ActiveParticles AllAct = init_empty_active_particles(PartManager);
+    tb.mask = ALLMASK;
+    force_tree_create_nodes(&tb, &AllAct, ALLMASK, &ddecomp);
+    force_tree_calc_moments(&tb, &ddecomp);
+    force_tree_make_walk_nodes(&tb);
+    assert_true(tb.WalkNodes != NULL);
+    assert_int_equal(tb.WalkIndex[0], 0);
+
+    /* Walk both trees together*/
+    char * found = calloc(numpart, sizeof(char));
+    int64_t nwalk = 0;
+    int no = tb.firstnode, w = 0;
+    while(no >= 0) {
+        const struct NODE * nop = &tb.Nodes[no];
+        const struct WalkNode * wnode = &tb.WalkNodes[w];
+        assert_int_equal(tb.WalkIndex[no - tb.firstnode], w);
+        assert_int_equal(wnode->ChildType, nop->f.ChildType);
+        assert_true(fabs(wnode->mass - nop->mom.mass) <= 1e-6 * nop->mom.mass);
+        for(i = 0; i < 3; i++)
+            assert_true(fabs(wnode->center[i] + wnode->cofm[i] - nop->mom.cofm[i]) < 1e-5 * PartManager->BoxSize);
+        nwalk++;
+        if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+            assert_int_equal(wnode->noccupied, nop->s.noccupied);
+            for(i = 0; i < nop->s.noccupied; i++) {
+                const int p = tb.WalkParticles[wnode->first + i];
+                assert_int_equal(p, nop->s.suns[i]);
+                assert_false(found[p]);
+                found[p] = 1;
+            }
+        }
+        if(nop->f.ChildType == NODE_NODE_TYPE) {
+            no = nop->s.suns[0];
+            w = w + 1;
+        }
+        else {
+            no = nop->sibling;
+            w = wnode->sibling;
+        }
+        assert_int_equal(no < 0, w < 0);
+    }
+    assert_int_equal(nwalk, tb.NumWalkNodes);
+    for(i = 0; i < numpart; i++)
+        assert_true(found[i]);
+    free(found);
+    force_tree_free(&tb);
+    assert_true(tb.WalkNodes == NULL);
+    myfree(PartManager->Base);
+}
+
+/* Check the quadrupole of node no against a direct sum over the particles beneath it*/
+static void
+check_node_quadrupole(const ForceTree * tb, const int no)
+{
+    double q[6] = {0};
+    const struct NODE * nop = &tb->Nodes[no];
+    /* The particles below no are the leaves between no and its sibling in walk order*/
+    int cur = no;
+    while(cur >= 0 && cur != nop->sibling) {
+        const struct NODE * cnode = &tb->Nodes[cur];
+        if(cnode->f.ChildType == NODE_NODE_TYPE) {
+            cur = cnode->s.suns[0];
+            continue;
+        }
+        int i;
+        for(i = 0; i < cnode->s.noccupied; i++) {
+            const int p = cnode->s.suns[i];
+            double dx[3];
+            int k;
+            for(k = 0; k < 3; k++)
+                dx[k] = P[p].Pos[k] - nop->mom.cofm[k];
+            const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+            q[0] += P[p].Mass * (3 * dx[0] * dx[0] - r2);
+            q[1] += P[p].Mass * 3 * dx[0] * dx[1];
+            q[2] += P[p].Mass * 3 * dx[0] * dx[2];
+            q[3] += P[p].Mass * (3 * dx[1] * dx[1] - r2);
+            q[4] += P[p].Mass * 3 * dx[1] * dx[2];
+            q[5] += P[p].Mass * (3 * dx[2] * dx[2] - r2);
+        }
+        cur = cnode->sibling;
+    }
+    const MyFloat * tq = tb->Quadrupoles[no - tb->firstnode].q;
+    const double scale = nop->mom.mass * nop->len * nop->len;
+    int k;
+    for(k = 0; k < 6; k++)
+        assert_true(fabs(tq[k] - q[k]) <= 1e-6 * scale);
+    /* Traceless*/
+    assert_true(fabs(tq[0] + tq[3] + tq[5]) <= 1e-6 * scale);
+}
+
+static void test_tree_quadrupoles(void ** state) {
+    int ncbrt = 32;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    ForceTree tb = force_treeallocate(numpart, numpart, &ddecomp, 0, 0);
+    ddecomp.TopLeaves[0].treenode = tb.firstnode;
+    int i;
+    for(i=0; i<numpart; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1 + gsl_rng_uniform(r);
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r) * gsl_rng_uniform(r);
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    ActiveParticles AllAct = init_empty_active_particles(PartManager);
+    tb.mask = ALLMASK;
+    force_tree_create_nodes(&tb, &AllAct, ALLMASK, &ddecomp);
+    force_tree_calc_moments(&tb, &ddecomp);
+    force_tree_calc_quadrupoles(&tb);
+    assert_true(tb.Quadrupoles != NULL);
+    /* Check the root and a chain of first children down to a leaf*/
+    int no = tb.firstnode;
+    while(no >= 0) {
+        check_node_quadrupole(&tb, no);
+        if(tb.Nodes[no].f.ChildType != NODE_NODE_TYPE)
+            break;
+        no = tb.Nodes[no].s.suns[0];
+    }
+    /* The walk nodes carry the quadrupoles*/
+    force_tree_make_walk_nodes(&tb);
+    assert_true(tb.WalkQuadrupoles != NULL);
+    for(i = 0; i < 6; i++)
+        assert_true(fabs(tb.WalkQuadrupoles[0][i] - tb.Quadrupoles[0].q[i]) <= 1e-5 * fabs(tb.Quadrupoles[0].q[i]) + 1e-5);
+    force_tree_free(&tb);
+    assert_true(tb.Quadrupoles == NULL);
+    myfree(PartManager->Base);
+}
+
+/* Check the minimum acceleration of a node is the smallest of its children, and return it.
+ * Only nodes reachable from no are checked: unused node slots may hold stale data.*/
+static double
+check_node_min_accel(const ForceTree * tb, const int no)
+{
+    const struct NODE * node = &tb->Nodes[no];
+    double nodeacc = 1e30;
+    int j;
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < node->s.noccupied; j++) {
+            const int p = node->s.suns[j];
+            nodeacc = DMIN(nodeacc, sqrt(pow(P[p].FullTreeGravAccel[0] + P[p].GravPM[0], 2)
+                        + pow(P[p].FullTreeGravAccel[1] + P[p].GravPM[1], 2) + pow(P[p].FullTreeGravAccel[2] + P[p].GravPM[2], 2)));
+        }
+        /* Empty leaves have no acceleration to check*/
+        if(node->s.noccupied == 0)
+            return tb->MinAccel[no - tb->firstnode];
+    }
+    else {
+        for(j = 0; j < NMAXCHILD; j++)
+            if(node->s.suns[j] >= 0)
+                nodeacc = DMIN(nodeacc, check_node_min_accel(tb, node->s.suns[j]));
+    }
+    assert_true(fabs(tb->MinAccel[no - tb->firstnode] - nodeacc) <= 1e-12 * nodeacc);
+    return nodeacc;
+}
+
+static void test_tree_min_accel(void ** state) {
+    int ncbrt = 16;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    ForceTree tb = force_treeallocate(numpart, numpart, &ddecomp, 0, 0);
+    ddecomp.TopLeaves[0].treenode = tb.firstnode;
+    int i, j;
+    double minacc = 1e30;
+    for(i=0; i<numpart; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        double acc2 = 0;
+        for(j=0; j<3; j++) {
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+            P[i].FullTreeGravAccel[j] = gsl_rng_uniform(r) - 0.5;
+            P[i].GravPM[j] = 0.1 * (gsl_rng_uniform(r) - 0.5);
+            acc2 += pow(P[i].FullTreeGravAccel[j] + P[i].GravPM[j], 2);
+        }
+        minacc = DMIN(minacc, sqrt(acc2));
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    ActiveParticles AllAct = init_empty_active_particles(PartManager);
+    tb.mask = ALLMASK;
+    force_tree_create_nodes(&tb, &AllAct, ALLMASK, &ddecomp);
+    force_tree_calc_moments(&tb, &ddecomp);
+    force_tree_calc_min_accel(&tb);
+    assert_true(tb.MinAccel != NULL);
+    assert_true(fabs(tb.MinAccel[0] - minacc) <= 1e-12 * minacc);
+    /* Each node reachable from the root has the smallest acceleration of its children*/
+    check_node_min_accel(&tb, tb.firstnode);
+    force_tree_free(&tb);
+    assert_true(tb.MinAccel == NULL);
+    myfree(PartManager->Base);
+}
+
+/* Check the type mask of a node is the union of those of its children, and return it.*/
+static int
+check_node_type_mask(const ForceTree * tb, const int no)
+{
+    const struct NODE * node = &tb->Nodes[no];
+    int j, mask = 0;
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(j = 0; j < node->s.noccupied; j++) {
+            const int type = P[node->s.suns[j]].Type;
+            mask |= (1 << type);
+            if(type == 0)
+                mask |= STARMASK | BHMASK;
+        }
+    }
+    else {
+        for(j = 0; j < NMAXCHILD; j++)
+            if(node->s.suns[j] >= 0)
+                mask |= check_node_type_mask(tb, node->s.suns[j]);
+    }
+    assert_int_equal(node->f.TypeMask, mask);
+    return mask;
+}
+
+static void test_tree_type_masks(void ** state) {
+    int ncbrt = 16;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    /* Dark matter in the lower half of the box, stars in the upper half and a little gas everywhere*/
+    for(i=0; i<numpart; i++) {
+        P[i].Mass = 1;
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+        if(i % 16 == 0)
+            P[i].Type = 0;
+        else
+            P[i].Type = P[i].Pos[0] < PartManager->BoxSize/2 ? 1 : 4;
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    ForceTree tb = {0};
+    force_tree_rebuild_mask(&tb, &ddecomp, DMMASK | STARMASK, NULL);
+    /* The gas is not in the tree*/
+    assert_int_equal(check_node_type_mask(&tb, tb.firstnode), DMMASK | STARMASK);
+    /* The first child of the root is in the lower half of the box, so has only dark matter*/
+    assert_int_equal(tb.Nodes[tb.Nodes[tb.firstnode].s.suns[0]].f.TypeMask, DMMASK);
+    force_tree_rebuild_mask(&tb, &ddecomp, ALLMASK, NULL);
+    assert_int_equal(check_node_type_mask(&tb, tb.firstnode), GASMASK | DMMASK | STARMASK | BHMASK);
+    force_tree_free(&tb);
+    myfree(PartManager->Base);
+}
+
+/* Check the cache of the top leaf moments in the domain follows the tree moments*/
+static void test_tree_topleaf_cache(void ** state) {
+    int ncbrt = 16;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    for(i=0; i<numpart; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    struct topleaf_momentsdata cache[1];
+    ddecomp.TopLeafMoments = cache;
+    ddecomp.TopLeafMomentsValid = 0;
+    ForceTree tb = {0};
+    force_tree_full(&tb, &ddecomp, 0, NULL);
+    assert_int_equal(ddecomp.TopLeafMomentsValid, 1);
+    assert_true(cache[0].mass == numpart);
+    assert_true(cache[0].s[0] == tb.Nodes[tb.firstnode].mom.cofm[0]);
+    /* A second tree with the same particles keeps the cache*/
+    force_tree_free(&tb);
+    force_tree_full(&tb, &ddecomp, 0, NULL);
+    assert_true(cache[0].mass == numpart);
+    /* A change of mass updates it*/
+    force_tree_free(&tb);
+    P[0].Mass = 2;
+    force_tree_full(&tb, &ddecomp, 0, NULL);
+    assert_true(cache[0].mass == numpart + 1);
+    assert_true(tb.Nodes[tb.firstnode].mom.mass == numpart + 1);
+    force_tree_free(&tb);
+    myfree(PartManager->Base);
+}
+
+/* Check that a tree with too few nodes allocated grows the node allocation during the build*/
+static void test_tree_node_growth(void ** state) {
+    int ncbrt = 32;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    for(i=0; i<numpart; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    /* Far too few nodes for this tree*/
+    init_forcetree_params(0.01);
+    ForceTree tb = {0};
+    force_tree_rebuild_mask(&tb, &ddecomp, ALLMASK, NULL);
+    assert_true(tb.numnodes > 0.01 * numpart);
+    assert_int_equal(tb.nallocnodes, tb.numnodes);
+    force_tree_calc_moments(&tb, &ddecomp);
+    assert_true(fabs(tb.Nodes[tb.firstnode].mom.mass - numpart) < 0.5);
+    /* The grown memory is not initialised, so unused nodes cannot be told apart: just walk the tree*/
+    check_moments(&tb, numpart, tb.numnodes);
+    force_tree_free(&tb);
+    myfree(PartManager->Base);
+    init_forcetree_params(0.5);
 }
 
 static struct ClockTable Clocks;
@@ -463,6 +940,13 @@ int main(void) {
         cmocka_unit_test(test_rebuild_flat),
         cmocka_unit_test(test_rebuild_close),
         cmocka_unit_test(test_rebuild_random),
+        cmocka_unit_test(test_tree_refit),
+        cmocka_unit_test(test_walk_nodes),
+        cmocka_unit_test(test_tree_quadrupoles),
+        cmocka_unit_test(test_tree_min_accel),
+        cmocka_unit_test(test_tree_type_masks),
+        cmocka_unit_test(test_tree_topleaf_cache),
+        cmocka_unit_test(test_tree_node_growth),
     };
     return cmocka_run_group_tests_mpi(tests, setup_tree, teardown_tree);
 }
@@ -159,7 +159,7 @@ static int check_against_force_direct(double ErrTolForceAcc)
     return 0;
 }
 
-static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int direct)
+static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int direct, int fmm, int mixed, int offload)
 {
     /*Sort by peano key so this is more realistic*/
     int i;
@@ -175,10 +175,14 @@ static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int di
 
     DomainDecomp ddecomp = {0};
     domain_decompose_full(&ddecomp);
+    /* Does nothing unless a test enabled DomainIncremental*/
+    domain_rebalance(&ddecomp);
 
     PetaPM pm = {0};
     gravpm_init_periodic(&pm, PartManager->BoxSize, Asmth, Nmesh, G);
-    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, Asmth);
+    /* Does nothing unless a test enabled it*/
+    gravpm_init_highres(&pm);
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, Asmth, 0);
     /* Setup cosmology*/
     Cosmology CP ={0};
     CP.MNu[0] = CP.MNu[1] = CP.MNu[2] = 0;
@@ -191,7 +195,7 @@ static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int di
     struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
     init_cosmology(&CP, 0.01, units);
 
-    gravpm_force(&pm, &ddecomp, &CP, 0.1, CM_PER_MPC/1000., ".", 0.01);
+    gravpm_force(&pm, &ddecomp, &CP, 0.1, CM_PER_MPC/1000., ".", 0.01, NULL);
     ForceTree Tree = {0};
     force_tree_full(&Tree, &ddecomp, 1, NULL);
     const double rho0 = CP.Omega0 * 3 * CP.Hubble * CP.Hubble / (8 * M_PI * G);
@@ -203,6 +207,9 @@ static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int di
     treeacc.Rcut = 7;
     treeacc.ErrTolForceAcc = ErrTolForceAcc;
     treeacc.FractionalGravitySoftening = 1./30.;
+    treeacc.FMM = fmm;
+    treeacc.MixedPrecision = mixed;
+    treeacc.Offload = offload;
 
     set_gravshort_treepar(treeacc);
     gravshort_set_softenings(PartManager->BoxSize / cbrt(PartManager->NumPart));
@@ -211,8 +218,13 @@ static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int di
     ActiveParticles act = init_empty_active_particles(PartManager);
     grav_short_tree(&act, &pm, &Tree, NULL, rho0, 0);
     grav_short_tree(&act, &pm, &Tree, NULL, rho0, 0);
+    /* The work of each particle is recorded for the domain decomposition: it includes at least the particle itself*/
+    if(!fmm && !offload)
+        for(i = 0; i < PartManager->NumPart; i++)
+            assert_true(P[i].GravCost > 0);
 
     force_tree_free(&Tree);
+    gravpm_destroy_highres();
     petapm_destroy(&pm);
     domain_free(&ddecomp);
     if(direct)
@@ -234,7 +246,7 @@ static void test_force_flat(void ** state) {
         P[i].Pos[2] = (PartManager->BoxSize/ncbrt) * (i % ncbrt);
     }
     PartManager->NumPart = numpart;
-    do_force_test(48, 1.5, 0.002, 0);
+    do_force_test(48, 1.5, 0.002, 0, 0, 0, 0);
     /* For a homogeneous mass distribution, the force should be zero*/
     double meanerr=0, maxerr=-1;
     #pragma omp parallel for reduction(+: meanerr) reduction(max: maxerr)
@@ -276,11 +288,39 @@ static void test_force_close(void ** state) {
         P[i].Pos[2] = 4. + (i % ncbrt)/close;
     }
     PartManager->NumPart = numpart;
-    do_force_test(48, 1.5, 0.002, 1);
+    do_force_test(48, 1.5, 0.002, 1, 0, 0, 0);
     myfree(P);
 }
 
-void do_random_test(gsl_rng * r, const int numpart)
+/* A clump in a high resolution PM mesh: the tree force is cut off at the split scale of the finer mesh,
+ * and the total force should still match the direct sum.*/
+static void test_force_highres(void ** state) {
+    int numpart = PartManager->NumPart;
+    int ncbrt = cbrt(numpart);
+    double close = 5000;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    #pragma omp parallel for
+    for(i=0; i<numpart; i++) {
+        P[i].Pos[0] = 4. + (i/ncbrt/ncbrt)/close;
+        P[i].Pos[1] = 4. + ((i/ncbrt) % ncbrt) /close;
+        P[i].Pos[2] = 4. + (i % ncbrt)/close;
+    }
+    PartManager->NumPart = numpart;
+    set_gravpm_highres(1 << 1, 48);
+    do_force_test(48, 1.5, 0.002, 1, 0, 0, 0);
+    set_gravpm_highres(0, 0);
+    int64_t nhighres = 0;
+    for(i = 0; i < numpart; i++)
+        nhighres += P[i].HighResPM;
+    MPI_Allreduce(MPI_IN_PLACE, &nhighres, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    assert_true(nhighres > 0);
+    for(i = 0; i < numpart; i++)
+        P[i].HighResPM = 0;
+    myfree(P);
+}
+
+void do_random_test(gsl_rng * r, const int numpart, const int fmm, const int mixed, const int offload)
 {
     /* Create a regular grid of particles, 8x8x8, all of type 1,
      * in a box 8 kpc across.*/
@@ -301,7 +341,97 @@ void do_random_test(gsl_rng * r, const int numpart)
             P[i].Pos[j] = PartManager->BoxSize*0.1 + PartManager->BoxSize/32 * exp(pow(gsl_rng_uniform(r)-0.5,2));
     }
     PartManager->NumPart = numpart;
-    do_force_test(48, 1.5, 0.002, 1);
+    do_force_test(48, 1.5, 0.002, 1, fmm, mixed, offload);
+}
+
+static void test_force_batch(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* The PM forces from the batched backward transforms*/
+    set_gravpm_transforms(1, 0);
+    do_random_test(r, numpart, 0, 0, 0);
+    set_gravpm_transforms(0, 0);
+    myfree(P);
+}
+
+static void test_force_finite_difference(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* The PM forces from finite differences of the potential mesh*/
+    set_gravpm_transforms(0, 1);
+    do_random_test(r, numpart, 0, 0, 0);
+    set_gravpm_transforms(0, 0);
+    myfree(P);
+}
+
+static void test_force_tsc_interlaced(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* The PM forces with TSC assignment on an interlaced mesh*/
+    set_gravpm_assignment(3, 1);
+    do_random_test(r, numpart, 0, 0, 0);
+    set_gravpm_assignment(2, 0);
+    myfree(P);
+}
+
+static void test_force_single_precision(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* The PM forces from single precision backward transforms should still meet the force accuracy*/
+    set_gravpm_single_precision(1);
+    do_random_test(r, numpart, 0, 0, 0);
+    set_gravpm_single_precision(0);
+    myfree(P);
+}
+
+static void test_force_inplace_chunked(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* The PM forces from in place transforms, with the cells exchanged in rounds*/
+    set_gravpm_memory(1, 4);
+    do_random_test(r, numpart, 0, 0, 0);
+    set_gravpm_memory(0, 1);
+    myfree(P);
+}
+
+static void test_force_domain_balance(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* Balance the domains on work and memory together with a histogram top tree, then again keeping the top tree*/
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    dp.DomainWorkWeight = 1;
+    dp.DomainMemoryWeight = 1;
+    dp.DomainIncremental = 1;
+    dp.DomainHistogramTopTree = 1;
+    set_domain_par(dp);
+    do_random_test(r, numpart, 0, 0, 0);
+    dp.DomainWorkWeight = 0;
+    dp.DomainMemoryWeight = 0;
+    dp.DomainIncremental = 0;
+    dp.DomainHistogramTopTree = 0;
+    set_domain_par(dp);
+    myfree(P);
 }
 
 static void test_force_random(void ** state) {
@@ -312,11 +442,282 @@ static void test_force_random(void ** state) {
     particle_alloc_memory(PartManager, 8, numpart);
     int i;
     for(i=0; i<2; i++) {
-        do_random_test(r, numpart);
+        do_random_test(r, numpart, 0, 0, 0);
     }
     myfree(P);
 }
 
+static void test_force_fmm(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    do_random_test(r, numpart, 1, 0, 0);
+    myfree(P);
+}
+
+static void test_force_mixed(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* Single precision interactions should still meet the force accuracy*/
+    do_random_test(r, numpart, 0, 1, 0);
+    myfree(P);
+}
+
+static void test_force_offload(void ** state) {
+    /*Set up the particle data*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* The local tree walked on the device (or the host, if there is none)*/
+    do_random_test(r, numpart, 0, 0, 1);
+    myfree(P);
+}
+
+/* Walks on a refit tree which start from the interaction lists of the walk on the parent tree
+ * should agree with walks from the root*/
+static void test_force_interaction_lists(void ** state) {
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    /* Sets the old accelerations for the opening criterion*/
+    do_random_test(r, numpart, 0, 0, 0);
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    PetaPM pm = {0};
+    gravpm_init_periodic(&pm, PartManager->BoxSize, 1.5, 48, G);
+    struct gravshort_tree_params treeacc = get_gravshort_treepar();
+    treeacc.TreeUseBH = 0;
+    set_gravshort_treepar(treeacc);
+
+    ActiveParticles all = init_empty_active_particles(PartManager);
+    ActiveParticles sub = {0};
+    sub.ActiveParticle = (int *) mymalloc2("ActiveParticle", PartManager->NumPart * sizeof(int));
+    int i;
+    for(i = 0; i < PartManager->NumPart; i += 2)
+        sub.ActiveParticle[sub.NumActiveParticle++] = i;
+    sub.NumActiveGravity = sub.NumActiveParticle;
+    sub.Particles = PartManager->Base;
+    MyFloat (*Accel)[3] = (MyFloat (*) [3]) mymalloc2("GravAccel", PartManager->NumPart * sizeof(Accel[0]));
+    MyFloat (*ListAccel)[3] = (MyFloat (*) [3]) mymalloc2("ListAccel", PartManager->NumPart * sizeof(ListAccel[0]));
+
+    ForceTree Tree = {0};
+    force_tree_active_moments(&Tree, &ddecomp, &all, 0, 0, ".");
+    force_tree_alloc_interaction_lists(&Tree, 2000);
+    grav_short_tree(&all, &pm, &Tree, Accel, 1, 0);
+    struct InteractionLists * lists = Tree.InteractionLists;
+    assert_true(lists->Count[lists->Read][0] > 0);
+
+    force_tree_refit(&Tree, &ddecomp, &sub);
+    grav_short_tree(&sub, &pm, &Tree, ListAccel, 1, 0);
+    force_tree_free_interaction_lists(&Tree);
+    grav_short_tree(&sub, &pm, &Tree, Accel, 1, 0);
+
+    double meanacc = 0, maxerr = 0;
+    for(i = 0; i < sub.NumActiveParticle; i++) {
+        const int p = sub.ActiveParticle[i];
+        int k;
+        for(k = 0; k < 3; k++) {
+            meanacc += fabs(Accel[p][k]);
+            maxerr = DMAX(maxerr, fabs(Accel[p][k] - ListAccel[p][k]));
+        }
+    }
+    meanacc /= 3 * sub.NumActiveParticle;
+    message(0, "Max difference with interaction lists %g mean acceleration %g\n", maxerr, meanacc);
+    assert_true(maxerr < 0.006 * meanacc);
+
+    force_tree_free(&Tree);
+    myfree(ListAccel);
+    myfree(Accel);
+    myfree(sub.ActiveParticle);
+    petapm_destroy(&pm);
+    domain_free(&ddecomp);
+    myfree(P);
+}
+
+/* The symmetric pairwise force, which evaluates each pair of active particles once, should match the pairwise force
+ * evaluated from both sides. Half the particles are active, so that pairs with inactive particles are tested.*/
+static void test_force_pair_symmetric(void ** state) {
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    do_random_test(r, numpart, 0, 0, 0);
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    PetaPM pm = {0};
+    gravpm_init_periodic(&pm, PartManager->BoxSize, 1.5, 48, G);
+
+    ActiveParticles sub = {0};
+    sub.ActiveParticle = (int *) mymalloc2("ActiveParticle", PartManager->NumPart * sizeof(int));
+    int i;
+    for(i = 0; i < PartManager->NumPart; i += 2)
+        sub.ActiveParticle[sub.NumActiveParticle++] = i;
+    sub.NumActiveGravity = sub.NumActiveParticle;
+    sub.Particles = PartManager->Base;
+    double (*PairAccel)[3] = (double (*) [3]) mymalloc2("PairAccel", PartManager->NumPart * sizeof(PairAccel[0]));
+
+    ForceTree Tree = {0};
+    force_tree_full(&Tree, &ddecomp, 0, NULL);
+    struct gravshort_tree_params treeacc = get_gravshort_treepar();
+    int mixed;
+    for(mixed = 0; mixed < 2; mixed++) {
+        treeacc.MixedPrecision = mixed;
+        treeacc.PairSymmetric = 0;
+        set_gravshort_treepar(treeacc);
+        grav_short_pair(&sub, &pm, &Tree, treeacc.Rcut, 1);
+        for(i = 0; i < sub.NumActiveParticle; i++) {
+            const int p = sub.ActiveParticle[i];
+            int k;
+            for(k = 0; k < 3; k++)
+                PairAccel[p][k] = P[p].FullTreeGravAccel[k];
+        }
+        treeacc.PairSymmetric = 1;
+        set_gravshort_treepar(treeacc);
+        grav_short_pair(&sub, &pm, &Tree, treeacc.Rcut, 1);
+
+        double meanacc = 0, maxerr = 0;
+        for(i = 0; i < sub.NumActiveParticle; i++) {
+            const int p = sub.ActiveParticle[i];
+            int k;
+            for(k = 0; k < 3; k++) {
+                meanacc += fabs(PairAccel[p][k]);
+                maxerr = DMAX(maxerr, fabs(P[p].FullTreeGravAccel[k] - PairAccel[p][k]));
+            }
+        }
+        meanacc /= 3 * sub.NumActiveParticle;
+        message(0, "Max difference of symmetric pairwise force %g mean acceleration %g (mixed %d)\n", maxerr, meanacc, mixed);
+        assert_true(maxerr < 1e-5 * meanacc);
+    }
+    treeacc.MixedPrecision = 0;
+    treeacc.PairSymmetric = 0;
+    set_gravshort_treepar(treeacc);
+
+    force_tree_free(&Tree);
+    myfree(PairAccel);
+    myfree(sub.ActiveParticle);
+    petapm_destroy(&pm);
+    domain_free(&ddecomp);
+    myfree(P);
+}
+
+/* The calibration of the opening criterion should move ErrTolForceAcc towards the target error,
+ * without changing the accelerations of the sampled particles.*/
+static void test_force_calibrate_opening(void ** state) {
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    do_random_test(r, numpart, 0, 0, 0);
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    PetaPM pm = {0};
+    gravpm_init_periodic(&pm, PartManager->BoxSize, 1.5, 48, G);
+    MyFloat (*TreeAccel)[3] = (MyFloat (*) [3]) mymalloc2("TreeAccel", PartManager->NumPart * sizeof(TreeAccel[0]));
+    ForceTree Tree = {0};
+    force_tree_full(&Tree, &ddecomp, 0, NULL);
+
+    struct gravshort_tree_params treeacc = get_gravshort_treepar();
+    treeacc.TreeUseBH = 0;
+    treeacc.ErrTolForceAcc = 0.002;
+    set_gravshort_treepar(treeacc);
+    ActiveParticles act = init_empty_active_particles(PartManager);
+    grav_short_tree(&act, &pm, &Tree, NULL, 1, 0);
+
+    /* A target much larger than the error: the tolerance should increase to the maximum*/
+    treeacc.ErrTolTargetRMS = 0.5;
+    treeacc.ErrTolForceAccMin = 0.001;
+    treeacc.ErrTolForceAccMax = 0.003;
+    treeacc.ErrTolSamples = 500;
+    set_gravshort_treepar(treeacc);
+    grav_short_tree(&act, &pm, &Tree, TreeAccel, 1, 0);
+    double newtol = get_gravshort_treepar().ErrTolForceAcc;
+    message(0, "Calibrated ErrTolForceAcc %g\n", newtol);
+    assert_true(newtol == treeacc.ErrTolForceAccMax);
+    /* The stored accelerations are those of the tree walk*/
+    int i;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int k;
+        for(k = 0; k < 3; k++)
+            assert_true(TreeAccel[i][k] == P[i].FullTreeGravAccel[k]);
+    }
+    /* A tiny target: the tolerance should decrease, by at most a factor of two*/
+    treeacc.ErrTolTargetRMS = 1e-9;
+    set_gravshort_treepar(treeacc);
+    grav_short_tree(&act, &pm, &Tree, NULL, 1, 0);
+    newtol = get_gravshort_treepar().ErrTolForceAcc;
+    assert_true(newtol == 0.5 * treeacc.ErrTolForceAccMax);
+
+    treeacc.ErrTolTargetRMS = 0;
+    set_gravshort_treepar(treeacc);
+    force_tree_free(&Tree);
+    myfree(TreeAccel);
+    petapm_destroy(&pm);
+    domain_free(&ddecomp);
+    myfree(P);
+}
+
+/* Compare the polynomial fit to the short-range window with the table and with the erfc window it approximates*/
+#define NWINDOW 1600
+static void test_short_range_window(void ** state) {
+    const double Asmth = 1.25;
+    static double tabfac[NWINDOW], tabpot[NWINDOW];
+    static int tabout[NWINDOW];
+    int i;
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_ERFC, Asmth, 0);
+    for(i = 0; i < NWINDOW; i++) {
+        tabfac[i] = tabpot[i] = 1;
+        tabout[i] = grav_apply_short_range_window(i * 0.01, &tabfac[i], &tabpot[i], 1);
+    }
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_ERFC, Asmth, 1);
+    for(i = 0; i < NWINDOW; i++) {
+        const double r = i * 0.01;
+        double fac = 1, pot = 1, tidal = 1;
+        int out = grav_apply_short_range_window_tidal(r, &fac, &pot, &tidal, 1);
+        assert_int_equal(out, tabout[i]);
+        if(out)
+            continue;
+        const double u = r * 0.5 / Asmth;
+        assert_true(fabs(fac - erfc(u) - 2 * u / sqrt(M_PI) * exp(-u * u)) < 1e-6);
+        assert_true(fabs(pot - erfc(u)) < 1e-6);
+        assert_true(fabs(tidal - 4 * u * u * u / sqrt(M_PI) * exp(-u * u)) < 1e-6);
+        /* The table is linearly interpolated*/
+        assert_true(fabs(fac - tabfac[i]) < 1e-4);
+        /* Single precision*/
+        float rf = r, facf = 1, potf = 1;
+        grav_apply_short_range_window_float(1, &rf, &facf, &potf, 1);
+        assert_true(fabs(facf - fac) < 1e-5);
+        assert_true(fabs(potf - pot) < 1e-5);
+    }
+    /* Outside the window*/
+    float rf = NWINDOW * 0.01, facf = 1, potf = 1;
+    grav_apply_short_range_window_float(1, &rf, &facf, &potf, 1);
+    assert_true(facf == 0 && potf == 0);
+
+    /* The calibrated table is noisy, and the fit smooths it*/
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, 1.5, 0);
+    for(i = 0; i < NWINDOW; i++) {
+        tabfac[i] = tabpot[i] = 1;
+        tabout[i] = grav_apply_short_range_window(i * 0.01, &tabfac[i], &tabpot[i], 1);
+    }
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, 1.5, 1);
+    for(i = 0; i < NWINDOW; i++) {
+        double fac = 1, pot = 1;
+        assert_int_equal(grav_apply_short_range_window(i * 0.01, &fac, &pot, 1), tabout[i]);
+        assert_true(fabs(fac - tabfac[i]) < 1e-3);
+    }
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, 1.5, 0);
+}
+
 static int setup_tree(void **state) {
     walltime_init(&CT);
     /*Set up the important parts of the All structure.*/
@@ -351,7 +752,21 @@ int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_force_flat),
         cmocka_unit_test(test_force_close),
+        cmocka_unit_test(test_force_highres),
         cmocka_unit_test(test_force_random),
+        cmocka_unit_test(test_force_fmm),
+        cmocka_unit_test(test_force_batch),
+        cmocka_unit_test(test_force_finite_difference),
+        cmocka_unit_test(test_force_tsc_interlaced),
+        cmocka_unit_test(test_force_single_precision),
+        cmocka_unit_test(test_force_inplace_chunked),
+        cmocka_unit_test(test_force_domain_balance),
+        cmocka_unit_test(test_force_mixed),
+        cmocka_unit_test(test_force_offload),
+        cmocka_unit_test(test_force_interaction_lists),
+        cmocka_unit_test(test_force_pair_symmetric),
+        cmocka_unit_test(test_force_calibrate_opening),
+        cmocka_unit_test(test_short_range_window),
     };
     return cmocka_run_group_tests_mpi(tests, setup_tree, teardown_tree);
 }
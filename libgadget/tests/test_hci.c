@@ -110,6 +110,44 @@ test_hci_timeout(void ** state)
     assert_int_equal(action->write_snapshot, 1);
 }
 
+static void
+test_hci_timeout_pending_write(void ** state)
+{
+    HCIAction action[1];
+    hci_override_now(manager, 1.0);
+    hci_init(manager, prefix, 10.0, 1.0, 1);
+
+    /* Same as above, but a background write still needs 2 units: no time for another step.*/
+    hci_set_pending_write_time(manager, 2.0);
+    hci_override_now(manager, 5.0);
+    hci_query(manager, action);
+    assert_int_equal(action->type, HCI_TIMEOUT);
+    assert_int_equal(action->write_snapshot, 1);
+}
+
+static void
+test_hci_timeout_work_forecast(void ** state)
+{
+    HCIAction action[1];
+    hci_override_now(manager, 1.0);
+    hci_init(manager, prefix, 10.0, 1.0, 1);
+
+    /* A smaller forecast does not shorten the time for the next step*/
+    hci_set_work_forecast(manager, 0.5);
+    hci_override_now(manager, 5.0);
+    hci_query(manager, action);
+    assert_true(action->type != HCI_TIMEOUT);
+
+    /* The next steps are expected to take 1.5 times longer: 4 + 4 * 1.5 leaves no time for another step.*/
+    hci_override_now(manager, 1.0);
+    hci_init(manager, prefix, 10.0, 1.0, 1);
+    hci_set_work_forecast(manager, 1.5);
+    hci_override_now(manager, 5.0);
+    hci_query(manager, action);
+    assert_int_equal(action->type, HCI_TIMEOUT);
+    assert_int_equal(action->write_snapshot, 1);
+}
+
 static void
 test_hci_stop(void ** state)
 {
@@ -158,6 +196,65 @@ test_hci_terminate(void ** state)
     assert_int_equal(action->write_snapshot, 0);
 }
 
+static void
+test_hci_trace(void ** state)
+{
+    HCIAction action[1];
+    hci_override_now(manager, 0.0);
+    hci_init(manager, prefix, 10.0, 1.0, 1);
+
+    /* An empty file traces one step, and does not stop the run*/
+    touch(prefix, "trace");
+    hci_override_now(manager, 0.5);
+    hci_query(manager, action);
+    assert_false(exists(prefix, "trace"));
+    assert_int_equal(action->type, HCI_NO_ACTION);
+    assert_int_equal(action->trace_steps, 1);
+
+    char * fn = fastpm_strdup_printf("%s/%s", prefix, "trace");
+    FILE * fp = fopen(fn, "w");
+    fprintf(fp, "3\n");
+    fclose(fp);
+    myfree(fn);
+    hci_override_now(manager, 0.6);
+    hci_query(manager, action);
+    assert_int_equal(action->trace_steps, 3);
+    /* Tracing does not hide other requests*/
+    touch(prefix, "trace");
+    touch(prefix, "stop");
+    hci_override_now(manager, 0.7);
+    hci_query(manager, action);
+    assert_int_equal(action->type, HCI_STOP);
+    assert_int_equal(action->trace_steps, 1);
+}
+
+static void
+test_hci_reconfigure(void ** state)
+{
+    HCIAction action[1];
+    hci_override_now(manager, 0.0);
+    hci_init(manager, prefix, 10.0, 1.0, 1);
+
+    hci_override_now(manager, 0.5);
+    hci_query(manager, action);
+    assert_null(action->reconfigure);
+
+    char * fn = fastpm_strdup_printf("%s/%s", prefix, "reconfigure");
+    FILE * fp = fopen(fn, "w");
+    fprintf(fp, "ErrTolForceAcc = 0.001\n");
+    fclose(fp);
+    myfree(fn);
+    /* The parameters are returned with other requests*/
+    touch(prefix, "stop");
+    hci_override_now(manager, 0.6);
+    hci_query(manager, action);
+    assert_false(exists(prefix, "reconfigure"));
+    assert_int_equal(action->type, HCI_STOP);
+    assert_non_null(action->reconfigure);
+    assert_string_equal(action->reconfigure, "ErrTolForceAcc = 0.001\n");
+    myfree(action->reconfigure);
+}
+
 static int setup(void ** state)
 {
     char * ret = mkdtemp(prefix);
@@ -177,9 +274,13 @@ int main(void) {
         cmocka_unit_test(test_hci_auto_checkpoint),
         cmocka_unit_test(test_hci_auto_checkpoint2),
         cmocka_unit_test(test_hci_timeout),
+        cmocka_unit_test(test_hci_timeout_pending_write),
+        cmocka_unit_test(test_hci_timeout_work_forecast),
         cmocka_unit_test(test_hci_stop),
         cmocka_unit_test(test_hci_checkpoint),
         cmocka_unit_test(test_hci_terminate),
+        cmocka_unit_test(test_hci_trace),
+        cmocka_unit_test(test_hci_reconfigure),
     };
     return cmocka_run_group_tests_mpi(tests, setup, teardown);
 }
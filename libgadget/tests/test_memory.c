@@ -4,6 +4,7 @@
 #include <cmocka.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "stub.h"
 
@@ -107,12 +108,96 @@ test_allocator_malloc(void ** state)
     allocator_destroy(A0);
 }
 
+static void
+test_allocator_external(void ** state)
+{
+    Allocator A0[1];
+    const size_t size = 4096 * 1024;
+    char * buf = malloc(size + 2 * 4096);
+    allocator_init_external(A0, "External", buf, size, 1);
+
+    int * p1 = allocator_alloc_bot(A0, "M+1", 1024*sizeof(int));
+    int * q1 = allocator_alloc_top(A0, "M-1", 1024*sizeof(int));
+    /* All allocations must be inside the caller's buffer*/
+    assert_true((char *) p1 >= buf && (char *) (p1 + 1024) <= buf + size + 2 * 4096);
+    assert_true((char *) q1 >= buf && (char *) (q1 + 1024) <= buf + size + 2 * 4096);
+    p1[1023] = 1;
+    q1[1023] = 1;
+
+    allocator_free(q1);
+    allocator_free(p1);
+    /* Does not free the buffer*/
+    allocator_destroy(A0);
+    free(buf);
+}
+
+static void
+test_allocator_scope(void ** state)
+{
+    Allocator A0[1];
+    allocator_init(A0, "Default", 4096 * 1024, 1, NULL);
+
+    allocator_scope_begin(A0);
+    int * p1 = allocator_alloc_bot(A0, "M+1", 1024*sizeof(int));
+    int * p2 = allocator_alloc_bot(A0, "M+2", 1024*sizeof(int));
+    int * p3 = allocator_alloc_bot(A0, "M+3", 1024*sizeof(int));
+    const size_t used = allocator_get_used_size(A0, ALLOC_DIR_BOT);
+    /* Freeing out of order inside a scope is deferred*/
+    assert_int_equal(allocator_dealloc(A0, p2), 0);
+    assert_int_equal(allocator_get_used_size(A0, ALLOC_DIR_BOT), used);
+    /* Freeing the top block also reclaims the deferred block below it*/
+    assert_int_equal(allocator_dealloc(A0, p3), 0);
+    assert_true(allocator_get_used_size(A0, ALLOC_DIR_BOT) < used);
+    /* A block cannot be freed twice*/
+    assert_int_equal(allocator_dealloc(A0, p2), ALLOC_ENOTALLOC);
+    allocator_free(p1);
+    assert_int_equal(allocator_get_used_size(A0, ALLOC_DIR_BOT), 0);
+    allocator_scope_end(A0);
+
+    /* Outside a scope, out of order frees are still an error*/
+    p1 = allocator_alloc_bot(A0, "M+1", 1024*sizeof(int));
+    p2 = allocator_alloc_bot(A0, "M+2", 1024*sizeof(int));
+    assert_int_equal(allocator_dealloc(A0, p1), ALLOC_EMISMATCH);
+    allocator_free(p2);
+    allocator_free(p1);
+
+    allocator_destroy(A0);
+}
+
+static void
+test_allocator_peaks(void ** state)
+{
+    Allocator A0[1];
+    allocator_init(A0, "Default", 4096 * 1024, 1, NULL);
+
+    int * p1 = allocator_alloc_bot(A0, "Small", 1024*sizeof(int));
+    int * p2 = allocator_alloc_bot(A0, "Large", 4096*sizeof(int));
+    const size_t used = allocator_get_used_size(A0, ALLOC_DIR_BOTH);
+    allocator_free(p2);
+    allocator_free(p1);
+    assert_int_equal(A0->peak, used);
+    assert_int_equal(A0->npeak, 2);
+    /* The peak is attributed to the block allocated last*/
+    assert_string_equal(A0->peaks[1].name, "Large");
+    assert_int_equal(A0->peaks[1].peak, used);
+    assert_int_equal(A0->peaks[1].size, 4096*sizeof(int));
+    assert_true(A0->peaks[0].peak < used);
+    allocator_reset_peaks(A0);
+    assert_int_equal(A0->peak, 0);
+    assert_int_equal(A0->npeak, 0);
+
+    allocator_destroy(A0);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_allocator),
         cmocka_unit_test(test_allocator_malloc),
         cmocka_unit_test(test_sub_allocator),
+        cmocka_unit_test(test_allocator_external),
+        cmocka_unit_test(test_allocator_scope),
+        cmocka_unit_test(test_allocator_peaks),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -334,6 +334,29 @@ test_mpsort_gather(void ** state)
     do_mpsort_test(2000, 32, 0, 0);
 }
 
+static void
+test_mpsort_sample(void ** state)
+{
+    /* With forced sample sort on every rank*/
+    mpsort_mpi_set_options(MPSORT_REQUIRE_SAMPLE_SORT);
+    do_mpsort_test(2000, 64, 0, 0);
+    do_mpsort_test(2000, 16, 0, 0);
+    do_mpsort_test(1999, 32, 1, 0);
+    mpsort_mpi_set_options(MPSORT_DISABLE_GATHER_SORT);
+    do_long_radix_test(50);
+    mpsort_mpi_unset_options(MPSORT_REQUIRE_SAMPLE_SORT + MPSORT_DISABLE_GATHER_SORT);
+}
+
+static void
+test_mpsort_lean(void ** state)
+{
+    /* In place exchange in rounds, with enough items for more than one round*/
+    mpsort_mpi_set_options(MPSORT_LEAN_MEMORY | MPSORT_DISABLE_GATHER_SORT);
+    do_long_radix_test(50);
+    do_long_radix_test(100000);
+    mpsort_mpi_unset_options(MPSORT_LEAN_MEMORY | MPSORT_DISABLE_GATHER_SORT);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
@@ -341,6 +364,8 @@ int main(void)
         cmocka_unit_test(test_mpsort_stagger),
         cmocka_unit_test(test_basegroup),
         cmocka_unit_test(test_mpsort_gather),
+        cmocka_unit_test(test_mpsort_sample),
+        cmocka_unit_test(test_mpsort_lean),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
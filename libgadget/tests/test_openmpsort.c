@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <omp.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "stub.h"
 
@@ -99,10 +100,43 @@ static void test_openmpsort(void ** state) {
 
 }
 
+struct __radix
+{
+    uint64_t key;
+    int index;
+};
+
+static void test_radix_sort(void ** state) {
+    int i;
+    int size = 187763;
+    struct __radix *a = (struct __radix *) mymalloc2("radix", size * sizeof(struct __radix));
+
+    srand48(8675309);
+    for(i = 0; i < size; i++) {
+        /* Few distinct high bits, so there are many ties*/
+        a[i].key = ((uint64_t) (16 * drand48()) << 40) + (uint64_t) (size * drand48()) % 64;
+        a[i].index = i;
+    }
+
+    double start = omp_get_wtime();
+    radix_sort_openmp(a, size, sizeof(struct __radix), offsetof(struct __radix, key), sizeof(uint64_t));
+    double end = omp_get_wtime();
+    message(1,"parallel radix sort time = %g s %d threads\n",end-start, omp_get_max_threads());
+
+    for(i=1; i<size; i++) {
+        assert_true(a[i-1].key <= a[i].key);
+        /* Stable*/
+        if(a[i-1].key == a[i].key)
+            assert_true(a[i-1].index < a[i].index);
+    }
+    myfree(a);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_openmpsort),
         cmocka_unit_test(test_openmpsort_struct),
+        cmocka_unit_test(test_radix_sort),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -144,9 +144,27 @@ test_peano(void **state)
     return;
 }
 
+static void
+test_morton(void **state)
+{
+    /* x is the most significant bit of each level*/
+    assert_true(morton_key(1, 0, 0, 1) == 4);
+    assert_true(morton_key(0, 1, 0, 1) == 2);
+    assert_true(morton_key(0, 0, 1, 1) == 1);
+    /* x = 10, y = 11, z = 01: the top level is xyz = 110 = 6 and the bottom 011 = 3*/
+    assert_true(morton_key(2, 3, 1, 2) == 063);
+    const int top = (1 << BITS_PER_DIMENSION) - 1;
+    assert_true(morton_key(top, top, top, BITS_PER_DIMENSION) == PEANOCELLS - 1);
+    /* The first level of the Hilbert key is the first level of the Morton key, rotated*/
+    int i;
+    for(i = 0; i < 8; i++)
+        assert_true(peano_hilbert_key(i >> 2, (i >> 1) & 1, i & 1, 1) == peano_hilbert_key_old(i >> 2, (i >> 1) & 1, i & 1, 1));
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_peano),
+        cmocka_unit_test(test_morton),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
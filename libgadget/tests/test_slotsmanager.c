@@ -162,6 +162,75 @@ test_slots_reserve(void **state)
 
 }
 
+/* With a virtual reservation the slots grow in place*/
+static void
+test_slots_virtual(void **state)
+{
+    PartManager->MaxPart = 1024;
+    PartManager->NumPart = 0;
+    slots_init(0.01 * PartManager->MaxPart, SlotsManager);
+    slots_set_virtual_reserve(64L * 1024 * 1024, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    slots_set_enabled(4, sizeof(struct star_particle_data), SlotsManager);
+    slots_set_enabled(5, sizeof(struct bh_particle_data), SlotsManager);
+
+    int64_t newSlots[6] = {128, 0, 0, 0, 128, 128};
+    slots_reserve(1, newSlots, SlotsManager);
+    char * oldptr[6];
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        oldptr[ptype] = SlotsManager->info[ptype].ptr;
+        assert_true(SlotsManager->info[ptype].maxsize >= newSlots[ptype]);
+    }
+    StarP[100].FormationTime = 0.5;
+    BhP[100].Mass = 3;
+
+    newSlots[0] += 20000;
+    slots_reserve(1, newSlots, SlotsManager);
+    for(ptype = 0; ptype < 6; ptype++)
+        assert_ptr_equal(oldptr[ptype], SlotsManager->info[ptype].ptr);
+    assert_true(SlotsManager->info[0].maxsize >= newSlots[0]);
+    /* The new gas slots are usable and nothing was moved*/
+    SphP[20000].Density = 1;
+    assert_true(StarP[100].FormationTime == 0.5);
+    assert_true(BhP[100].Mass == 3);
+
+    slots_free(SlotsManager);
+}
+
+/* Spilled slots are backed by a file but behave like the others*/
+static void
+test_slots_spill(void **state)
+{
+    PartManager->MaxPart = 1024;
+    PartManager->NumPart = 0;
+    slots_init(0.01 * PartManager->MaxPart, SlotsManager);
+    slots_set_virtual_reserve(64L * 1024 * 1024, SlotsManager);
+    slots_set_spill("/tmp", (1 << 4) | (1 << 5), SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    slots_set_enabled(4, sizeof(struct star_particle_data), SlotsManager);
+    slots_set_enabled(5, sizeof(struct bh_particle_data), SlotsManager);
+
+    int64_t newSlots[6] = {128, 0, 0, 0, 128, 128};
+    slots_reserve(1, newSlots, SlotsManager);
+    StarP[100].FormationTime = 0.5;
+    BhP[100].Mass = 3;
+    SlotsManager->info[4].size = 128;
+    SlotsManager->info[5].size = 128;
+    slots_prefetch((1 << 6) - 1, SlotsManager);
+
+    newSlots[4] += 20000;
+    slots_reserve(1, newSlots, SlotsManager);
+    assert_true(SlotsManager->info[4].maxsize >= newSlots[4]);
+    StarP[20000].FormationTime = 0.25;
+    assert_true(StarP[100].FormationTime == 0.5);
+    assert_true(BhP[100].Mass == 3);
+    SlotsManager->info[4].size = 0;
+    SlotsManager->info[5].size = 0;
+
+    slots_free(SlotsManager);
+}
+
 /*Check that we behave correctly when the slot is empty*/
 static void
 test_slots_zero(void **state)
@@ -237,14 +306,75 @@ test_slots_convert(void **state)
     return;
 }
 
+static void
+test_slots_freelist(void **state)
+{
+    setup_particles(state);
+    /* Make a star slot garbage*/
+    const int star = 128 * 4 + 3;
+    const int oldPI = P[star].PI;
+    slots_mark_garbage(star, PartManager, SlotsManager);
+    assert_int_equal(SlotsManager->info[4].ngarbage, 1);
+
+    assert_int_equal(slots_freelist_begin(4, PartManager, SlotsManager), 1);
+    /* The first new star reuses the garbage slot*/
+    slots_convert(0, 4, -1, PartManager, SlotsManager);
+    assert_int_equal(P[0].PI, oldPI);
+    assert_int_equal(SlotsManager->info[4].size, 128);
+    assert_int_equal(SlotsManager->info[4].ngarbage, 0);
+    assert_int_equal(SlotsManager->info[0].ngarbage, 1);
+    /* The next one extends the slots*/
+    slots_convert(1, 4, -1, PartManager, SlotsManager);
+    assert_int_equal(P[1].PI, 128);
+    assert_int_equal(SlotsManager->info[4].size, 129);
+    slots_freelist_end(4, SlotsManager);
+
+    teardown_particles(state);
+    return;
+}
+
+/* As cooling_and_starformation: a star is spawned into a reserved index past NumPart
+ * while there is star slot garbage to reuse.*/
+static void
+test_slots_freelist_spawn(void **state)
+{
+    setup_particles(state);
+    const int star = 128 * 4 + 3;
+    const int oldPI = P[star].PI;
+    slots_mark_garbage(star, PartManager, SlotsManager);
+
+    const int64_t child = PartManager->NumPart;
+    /* The child is not counted yet, so its unset slot is not walked*/
+    assert_int_equal(slots_freelist_begin(4, PartManager, SlotsManager), 1);
+    slots_split_particle_at(0, child, P[0].Mass / 2, PartManager);
+    slots_convert(child, 4, slots_freelist_pop(4, SlotsManager), PartManager, SlotsManager);
+    PartManager->NumPart++;
+    slots_freelist_end(4, SlotsManager);
+
+    assert_int_equal(P[child].Type, 4);
+    assert_int_equal(P[child].PI, oldPI);
+    assert_int_equal(SlotsManager->info[4].size, 128);
+    assert_int_equal(SlotsManager->info[4].ngarbage, 0);
+    assert_int_equal(SlotsManager->info[0].ngarbage, 0);
+    assert_int_equal(P[0].Type, 0);
+    assert_int_equal(PartManager->NumPart, 128 * 6 + 1);
+
+    teardown_particles(state);
+    return;
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_slots_gc),
         cmocka_unit_test(test_slots_gc_sorted),
         cmocka_unit_test(test_slots_reserve),
+        cmocka_unit_test(test_slots_virtual),
+        cmocka_unit_test(test_slots_spill),
         cmocka_unit_test(test_slots_fork),
         cmocka_unit_test(test_slots_convert),
         cmocka_unit_test(test_slots_zero),
+        cmocka_unit_test(test_slots_freelist),
+        cmocka_unit_test(test_slots_freelist_spawn),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
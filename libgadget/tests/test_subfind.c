@@ -0,0 +1,150 @@
+/*Tests for the subhalo finder*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <gsl/gsl_rng.h>
+
+#include <libgadget/subfind.h>
+#include <libgadget/density.h>
+#include <libgadget/partmanager.h>
+#include "stub.h"
+
+#define NCLUMP 300
+#define NSMALL 100
+#define NFAST 30
+
+/* Gaussian deviate by Box-Muller*/
+static double
+gaussian(gsl_rng * r)
+{
+    double u = gsl_rng_uniform(r);
+    while(u == 0)
+        u = gsl_rng_uniform(r);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * gsl_rng_uniform(r));
+}
+
+/* Add n particles of mass M/n, in an isothermal sphere of radius R with a Maxwellian velocity dispersion sigma*/
+static int
+add_clump(gsl_rng * r, int start, int n, const double * centre, double R, double M, double sigma, int GrNr)
+{
+    int i;
+    for(i = start; i < start + n; i++) {
+        double x[3], r2;
+        int d;
+        /* Random direction*/
+        do {
+            r2 = 0;
+            for(d = 0; d < 3; d++) {
+                x[d] = 2 * gsl_rng_uniform(r) - 1;
+                r2 += x[d] * x[d];
+            }
+        } while(r2 > 1 || r2 == 0);
+        /* Uniform in radius, so the density goes as r^-2*/
+        const double rad = R * gsl_rng_uniform(r) / sqrt(r2);
+        for(d = 0; d < 3; d++) {
+            P[i].Pos[d] = centre[d] + rad * x[d];
+            P[i].Vel[d] = sigma * gaussian(r);
+        }
+        P[i].Mass = M / n;
+        P[i].Type = 1;
+        P[i].ID = i;
+        P[i].GrNr = GrNr;
+    }
+    return start + n;
+}
+
+static void
+test_subfind(void ** state)
+{
+    const int NumPart = 2 * NCLUMP + NFAST + NSMALL + 10;
+    particle_alloc_memory(PartManager, 10., NumPart);
+    PartManager->NumPart = NumPart;
+    memset(P, 0, NumPart * sizeof(struct particle_data));
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_ranlxd1);
+    gsl_rng_set(r, 42);
+
+    /* Group 0 has two clumps and some particles too fast to be bound, group 1 has a clump crossing the box edge.
+     * With G = 1, GM/R = 10 for the larger clumps, and the velocities are about virial.*/
+    const double c1[3] = {5, 5, 5}, c2[3] = {5.8, 5, 5}, c3[3] = {0.05, 2, 2};
+    int n = add_clump(r, 0, NCLUMP, c1, 0.1, 1, 1.4, 0);
+    n = add_clump(r, n, NCLUMP, c2, 0.1, 1, 1.4, 0);
+    int fast = n;
+    n = add_clump(r, n, NFAST, c1, 0.1, 1e-3, 100, 0);
+    int small = n;
+    n = add_clump(r, n, NSMALL, c3, 0.1, 0.5, 1, 1);
+    /* Particles outside groups*/
+    n = add_clump(r, n, 10, c3, 1, 1, 1, -1);
+    int i;
+    for(i = 0; i < NumPart; i++) {
+        int d;
+        for(d = 0; d < 3; d++) {
+            while(P[i].Pos[d] < 0) P[i].Pos[d] += PartManager->BoxSize;
+            while(P[i].Pos[d] >= PartManager->BoxSize) P[i].Pos[d] -= PartManager->BoxSize;
+        }
+    }
+
+    set_subfind_testpar(1, 32, 20);
+    SubhaloCatalogue sub = subfind_find_subhalos(PartManager, 1, 0, 1, 0.005, MPI_COMM_WORLD);
+
+    /* Two subhalos in group 0, one in group 1*/
+    assert_int_equal(sub.Nsubhalos, 3);
+    assert_int_equal(sub.TotNsubhalos, 3);
+    assert_int_equal(sub.Subhalo[0].GrNr, 0);
+    assert_int_equal(sub.Subhalo[0].SubNr, 0);
+    assert_int_equal(sub.Subhalo[1].GrNr, 0);
+    assert_int_equal(sub.Subhalo[1].SubNr, 1);
+    assert_int_equal(sub.Subhalo[2].GrNr, 1);
+    assert_true(sub.Subhalo[0].Length >= sub.Subhalo[1].Length);
+    for(i = 0; i < 2; i++) {
+        /* Most of each clump is bound and the fast particles are not*/
+        assert_true(sub.Subhalo[i].Length > 0.9 * NCLUMP);
+        assert_true(sub.Subhalo[i].Length <= NCLUMP);
+        assert_true(sub.Subhalo[i].LenType[1] == sub.Subhalo[i].Length);
+        assert_true(fabs(sub.Subhalo[i].Pos[1] - 5) < 0.1);
+        assert_true(fabs(sub.Subhalo[i].Mass - sub.Subhalo[i].Length * 1. / NCLUMP) < 1e-6);
+        assert_true(sub.Subhalo[i].VelDisp > 1 && sub.Subhalo[i].VelDisp < 1.8);
+    }
+    /* The subhalo of the clump across the box edge is in the box*/
+    assert_true(sub.Subhalo[2].Length > 0.9 * NSMALL);
+    assert_true(sub.Subhalo[2].Pos[0] >= 0 && sub.Subhalo[2].Pos[0] < PartManager->BoxSize);
+    assert_true(sub.Subhalo[2].CM[0] < 0.1 || sub.Subhalo[2].CM[0] > PartManager->BoxSize - 0.1);
+
+    /* Members are labelled with their subhalo*/
+    for(i = 0; i < NumPart; i++) {
+        if(i >= fast && i < small)
+            assert_int_equal(P[i].TopLeaf, SUBFIND_UNBOUND);
+        if(P[i].TopLeaf == SUBFIND_UNBOUND || P[i].GrNr < 0)
+            continue;
+        assert_true(P[i].TopLeaf < 2);
+        const struct Subhalo * s = &sub.Subhalo[P[i].GrNr == 0 ? P[i].TopLeaf : 2];
+        assert_int_equal(s->GrNr, P[i].GrNr);
+        /* Members of a subhalo come from one clump*/
+        assert_true(fabs(NEAREST(P[i].Pos[0] - s->Pos[0], PartManager->BoxSize)) < 0.3);
+    }
+    subfind_free(&sub);
+    gsl_rng_free(r);
+    myfree(P);
+}
+
+static int
+setup_subfind(void **state)
+{
+    struct density_params dp = {0};
+    dp.DensityKernelType = DENSITY_KERNEL_CUBIC_SPLINE;
+    dp.DensityResolutionEta = 1.;
+    set_densitypar(dp);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_subfind),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_subfind, NULL);
+}
@@ -0,0 +1,58 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stub.h"
+
+/* Known answers for Philox2x64-10 from the Random123 kat_vectors file: counter, key, result*/
+static void
+test_philox_kat(void ** state)
+{
+    const uint64_t kat[3][5] = {
+        {0, 0, 0, 0xca00a0459843d731ULL, 0x66c24222c9a845b5ULL},
+        {0xffffffffffffffffULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, 0x65b021d60cd8310fULL, 0x4d02f3222f86df20ULL},
+        {0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0xa4093822299f31d0ULL, 0x0a5e742c2997341cULL, 0xb0f883d38000de5dULL},
+    };
+    int i;
+    for(i = 0; i < 3; i++) {
+        uint64_t ctr[2] = {kat[i][0], kat[i][1]};
+        philox2x64_10(ctr, kat[i][2]);
+        assert_true(ctr[0] == kat[i][3]);
+        assert_true(ctr[1] == kat[i][4]);
+    }
+}
+
+static void
+test_random_streams(void ** state)
+{
+    RandTable rnd = set_random_numbers(0x243f6a8885a308d3ULL, 1234);
+    /* The id is the first counter word, and the step and purpose the second*/
+    uint64_t ctr[2] = {42, (1234 << 16) | RND_SFR_FORM};
+    philox2x64_10(ctr, 0x243f6a8885a308d3ULL);
+    assert_true(get_random_number(42, RND_SFR_FORM, &rnd) == (ctr[0] >> 11) * (1.0 / 9007199254740992.0));
+    int64_t id;
+    double sum = 0;
+    for(id = 0; id < 100000; id++) {
+        const double r = get_random_number(id, RND_SFR_METALS, &rnd);
+        assert_true(r >= 0 && r < 1);
+        sum += r;
+        /* Neighbouring ids with neighbouring purposes do not share a deviate*/
+        assert_true(get_random_number(id + 1, RND_SFR_METALS, &rnd) != get_random_number(id, RND_SFR_FORM, &rnd));
+    }
+    assert_true(fabs(sum / 100000 - 0.5) < 0.01);
+    /* A new step gives new numbers*/
+    RandTable rnd2 = set_random_numbers(0x243f6a8885a308d3ULL, 1235);
+    assert_true(get_random_number(42, RND_SFR_FORM, &rnd) != get_random_number(42, RND_SFR_FORM, &rnd2));
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_philox_kat),
+        cmocka_unit_test(test_random_streams),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
@@ -15,7 +15,6 @@
 
 #define AMIN 0.005
 #define AMAX 1.0
-#define LTIMEBINS 29
 
 /*Hubble function at scale factor a, in dimensions of All.Hubble*/
 double hubble_function(const Cosmology * CP, double a)
@@ -50,14 +49,14 @@ double fac_integ(double a, void *param)
 /*Get integer from real time*/
 double loga_from_ti(inttime_t ti)
 {
-    double logDTime = (log(AMAX) - log(AMIN)) / (1 << LTIMEBINS);
+    double logDTime = (log(AMAX) - log(AMIN)) / TIMEBASE;
     return log(AMIN) + ti * logDTime;
 }
 
 /*Get integer from real time*/
 static inline inttime_t get_ti(double aa)
 {
-    double logDTime = (log(AMAX) - log(AMIN)) / (1 << LTIMEBINS);
+    double logDTime = (log(AMAX) - log(AMIN)) / TIMEBASE;
     return (log(aa) - log(AMIN))/logDTime;
 }
 
@@ -94,9 +93,9 @@ void test_drift_factor(void ** state)
     assert_true(fabs(get_exact_drift_factor(&CP, get_ti(0.95), get_ti(0.98)) - exact_drift_factor(&CP, 0.95, 0.98,3)) < 5e-5);
     assert_true(fabs(get_exact_drift_factor(&CP, get_ti(0.05), get_ti(0.06)) - exact_drift_factor(&CP, 0.05, 0.06,3)) < 5e-5);
     /*Check boundary conditions*/
-    double logDtime = (log(AMAX)-log(AMIN))/(1<<LTIMEBINS);
-    assert_true(fabs(get_exact_drift_factor(&CP, ((1<<LTIMEBINS)-1), 1<<LTIMEBINS) - exact_drift_factor(&CP, AMAX-logDtime, AMAX,3)) < 5e-5);
-    assert_true(fabs(get_exact_drift_factor(&CP, 0, 1) - exact_drift_factor(&CP, 1.0 - exp(log(AMAX)-log(AMIN))/(1<<LTIMEBINS), 1.0,3)) < 5e-5);
+    double logDtime = (log(AMAX)-log(AMIN))/TIMEBASE;
+    assert_true(fabs(get_exact_drift_factor(&CP, TIMEBASE-1, TIMEBASE) - exact_drift_factor(&CP, AMAX-logDtime, AMAX,3)) < 5e-5);
+    assert_true(fabs(get_exact_drift_factor(&CP, 0, 1) - exact_drift_factor(&CP, 1.0 - exp(log(AMAX)-log(AMIN))/TIMEBASE, 1.0,3)) < 5e-5);
     /*Gravkick*/
     assert_true(fabs(get_exact_gravkick_factor(&CP, get_ti(0.8), get_ti(0.85)) - exact_drift_factor(&CP, 0.8, 0.85, 2)) < 5e-5);
     assert_true(fabs(get_exact_gravkick_factor(&CP, get_ti(0.05), get_ti(0.06)) - exact_drift_factor(&CP, 0.05, 0.06, 2)) < 5e-5);
@@ -106,9 +105,30 @@ void test_drift_factor(void ** state)
 
 }
 
+/* The factors come from a table on the integer timeline: check it against direct integration,
+ * across cells, inside one cell and at the cell boundaries.*/
+void test_factor_table(void ** state)
+{
+    Cosmology CP = {0};
+    CP.Omega0 = 0.3;
+    const inttime_t cell = TIMEBASE >> 12;
+    inttime_t ti[][2] = {{get_ti(0.01), get_ti(0.5)}, {get_ti(0.3), get_ti(0.3) + cell / 3}, {5 * cell, 9 * cell},
+                         {5 * cell + 17, 5 * cell + cell / 2}, {get_ti(0.9), TIMEBASE}, {get_ti(0.6), get_ti(0.2)}};
+    int i;
+    for(i = 0; i < 6; i++) {
+        const double a0 = exp(loga_from_ti(ti[i][0]));
+        const double a1 = exp(loga_from_ti(ti[i][1]));
+        const double drift = exact_drift_factor(&CP, a0, a1, 3);
+        const double gravkick = exact_drift_factor(&CP, a0, a1, 2);
+        assert_true(fabs(get_exact_drift_factor(&CP, ti[i][0], ti[i][1]) / drift - 1) < 1e-7);
+        assert_true(fabs(get_exact_gravkick_factor(&CP, ti[i][0], ti[i][1]) / gravkick - 1) < 1e-7);
+    }
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_drift_factor),
+        cmocka_unit_test(test_factor_table),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -0,0 +1,197 @@
+/* Tests for the export rounds of the distributed treewalk*/
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/treewalk.h>
+#include <libgadget/walltime.h>
+#include "stub.h"
+
+static struct ClockTable CT;
+
+#define NUMPART 8192
+#define BOXSIZE 1000.
+/* About 34 neighbours each, and many particles near a domain boundary*/
+#define RADIUS (BOXSIZE / 10.)
+
+typedef struct {
+    TreeWalkQueryBase base;
+} TreeWalkQueryCount;
+
+typedef struct {
+    TreeWalkResultBase base;
+    int64_t Ngb;
+} TreeWalkResultCount;
+
+typedef struct {
+    TreeWalkNgbIterBase base;
+} TreeWalkNgbIterCount;
+
+static int64_t * Ngb;
+
+static void
+count_ngbiter(TreeWalkQueryCount * I, TreeWalkResultCount * O, TreeWalkNgbIterCount * iter, LocalTreeWalk * lv)
+{
+    if(iter->base.other == -1) {
+        iter->base.Hsml = RADIUS;
+        iter->base.mask = DMMASK;
+        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+        return;
+    }
+    O->Ngb++;
+}
+
+static void
+count_reduce(int place, TreeWalkResultCount * remote, enum TreeWalkReduceMode mode, TreeWalk * tw)
+{
+    TREEWALK_REDUCE(Ngb[place], remote->Ngb);
+}
+
+static void
+count_copy(int place, TreeWalkQueryCount * I, TreeWalk * tw)
+{
+}
+
+/* Count the neighbours of every particle, returning the largest number of export rounds of any rank*/
+static int64_t
+count_neighbours(const ForceTree * tree)
+{
+    TreeWalk tw[1] = {{0}};
+    tw->ev_label = "COUNT";
+    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterCount);
+    tw->ngbiter = (TreeWalkNgbIterFunction) count_ngbiter;
+    tw->fill = (TreeWalkFillQueryFunction) count_copy;
+    tw->reduce = (TreeWalkReduceResultFunction) count_reduce;
+    tw->query_type_elsize = sizeof(TreeWalkQueryCount);
+    tw->result_type_elsize = sizeof(TreeWalkResultCount);
+    tw->tree = tree;
+    treewalk_run(tw, NULL, PartManager->NumPart);
+    int64_t Nexportfull;
+    MPI_Allreduce(&tw->Nexportfull, &Nexportfull, 1, MPI_INT64, MPI_MAX, MPI_COMM_WORLD);
+    return Nexportfull;
+}
+
+/* Gather all particle positions and count the neighbours of the local particles directly*/
+static void
+count_neighbours_direct(int64_t * direct)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    int * recvcounts = ta_malloc("recvcounts", int, 2 * NTask);
+    int * displs = recvcounts + NTask;
+    const int sendcount = 3 * PartManager->NumPart;
+    MPI_Allgather(&sendcount, 1, MPI_INT, recvcounts, 1, MPI_INT, MPI_COMM_WORLD);
+    int64_t ntot = 0;
+    int i;
+    for(i = 0; i < NTask; i++) {
+        displs[i] = ntot;
+        ntot += recvcounts[i];
+    }
+    double * pos = ta_malloc("allpos", double, ntot);
+    double * mypos = ta_malloc("mypos", double, sendcount);
+    for(i = 0; i < PartManager->NumPart; i++)
+        memcpy(&mypos[3 * i], P[i].Pos, 3 * sizeof(double));
+    MPI_Allgatherv(mypos, sendcount, MPI_DOUBLE, pos, recvcounts, displs, MPI_DOUBLE, MPI_COMM_WORLD);
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int64_t j;
+        direct[i] = 0;
+        for(j = 0; j < ntot / 3; j++) {
+            double r2 = 0;
+            int d;
+            for(d = 0; d < 3; d++) {
+                double dx = pos[3 * j + d] - P[i].Pos[d];
+                dx -= BOXSIZE * round(dx / BOXSIZE);
+                r2 += dx * dx;
+            }
+            if(r2 <= RADIUS * RADIUS)
+                direct[i]++;
+        }
+    }
+    myfree(mypos);
+    myfree(pos);
+    myfree(recvcounts);
+}
+
+static void
+test_treewalk_export_rounds(void ** state)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    walltime_init(&CT);
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 1;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(0.7);
+
+    const int64_t numpart = NUMPART / NTask;
+    particle_alloc_memory(PartManager, BOXSIZE, 1.5 * numpart);
+    PartManager->NumPart = numpart;
+    slots_init(0, SlotsManager);
+    int64_t newSlots[6] = {0};
+    slots_reserve(1, newSlots, SlotsManager);
+    int64_t i;
+    /* A quasi-random (R2) sequence, so no two separations are the same*/
+    const double alpha[3] = {0.7548776662466927, 0.5698402909980532, 0.3819660112501051};
+    for(i = 0; i < numpart; i++) {
+        P[i].ID = i + numpart * ThisTask;
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].IsGarbage = 0;
+        int j;
+        for(j = 0; j < 3; j++)
+            P[i].Pos[j] = BOXSIZE * fmod(0.5 + alpha[j] * (P[i].ID + 1), 1.);
+    }
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    ForceTree tree = {0};
+    force_tree_rebuild_mask(&tree, &ddecomp, DMMASK, NULL);
+
+    Ngb = mymalloc("Ngb", PartManager->NumPart * sizeof(int64_t));
+    int64_t * direct = mymalloc("direct", PartManager->NumPart * sizeof(int64_t));
+    count_neighbours_direct(direct);
+
+    /* Everything fits in the export buffer*/
+    int64_t Nexportfull = count_neighbours(&tree);
+    assert_int_equal(Nexportfull, 1);
+    for(i = 0; i < PartManager->NumPart; i++)
+        assert_int_equal(Ngb[i], direct[i]);
+
+    /* The smallest export buffer allowed: the exports left after the first round are streamed in many fragments*/
+    treewalk_set_max_export_buffer(100 * omp_get_max_threads() * sizeof(TreeWalkQueryCount));
+    Nexportfull = count_neighbours(&tree);
+    message(0, "Export buffer filled %ld times\n", Nexportfull);
+    if(NTask > 1)
+        assert_true(Nexportfull > 2);
+    for(i = 0; i < PartManager->NumPart; i++)
+        assert_int_equal(Ngb[i], direct[i]);
+    treewalk_set_max_export_buffer(3584*1024*1024L);
+
+    myfree(direct);
+    myfree(Ngb);
+    force_tree_free(&tree);
+    domain_free(&ddecomp);
+    slots_free(SlotsManager);
+    myfree(P);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_treewalk_export_rounds),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
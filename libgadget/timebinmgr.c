@@ -21,6 +21,9 @@ static struct sync_params
     int64_t PlaneOutputListLength;
     double PlaneOutputListTimes[MAXTIMES];
 
+    int64_t PowerOutputListLength;
+    double PowerOutputListTimes[MAXTIMES];
+
     int ExcursionSetReionOn; 
     double ExcursionSetZStart;
     double ExcursionSetZStop;
@@ -91,7 +94,7 @@ int BuildOutputList(ParameterSet* ps, const char* name, double * outputlist, int
 //set the other sync params we can't get using the action
 void set_sync_params(ParameterSet * ps){
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask==0)
     {
         Sync.ExcursionSetReionOn = param_get_int(ps,"ExcursionSetReionOn");
@@ -100,9 +103,10 @@ void set_sync_params(ParameterSet * ps){
         Sync.UVBGTimestep = param_get_double(ps,"UVBGTimestep");
         BuildOutputList(ps, "OutputList", Sync.OutputListTimes, &Sync.OutputListLength, MAXTIMES);
         BuildOutputList(ps, "PlaneOutputList", Sync.PlaneOutputListTimes, &Sync.PlaneOutputListLength, MAXTIMES);
+        BuildOutputList(ps, "PowerSpectrumOutputList", Sync.PowerOutputListTimes, &Sync.PowerOutputListLength, MAXTIMES);
     }
 
-    MPI_Bcast(&Sync, sizeof(struct sync_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&Sync, sizeof(struct sync_params), MPI_BYTE, 0, GadgetComm);
     return;
 }
 
@@ -171,11 +175,12 @@ setup_sync_points(Cosmology * CP, double TimeIC, double TimeMax, double no_snaps
 
     qsort_openmp(Sync.OutputListTimes, Sync.OutputListLength, sizeof(double), cmp_double);
     qsort_openmp(Sync.PlaneOutputListTimes, Sync.PlaneOutputListLength, sizeof(double), cmp_double);
+    qsort_openmp(Sync.PowerOutputListTimes, Sync.PowerOutputListLength, sizeof(double), cmp_double);
 
     if(NSyncPoints > 0)
         myfree(SyncPoints);
 
-    int64_t NSyncPointsAlloc = Sync.OutputListLength + Sync.PlaneOutputListLength + 2;
+    int64_t NSyncPointsAlloc = Sync.OutputListLength + Sync.PlaneOutputListLength + Sync.PowerOutputListLength + 2;
 
     /* Excursion set sync points ensure that the reionization excursion set model is run frequently*/
     const double ExcursionSet_delta_a = 0.0001;
@@ -207,6 +212,7 @@ setup_sync_points(Cosmology * CP, double TimeIC, double TimeMax, double no_snaps
     SyncPoints[0].calc_uvbg = 0;
     SyncPoints[0].write_plane = 0;
     SyncPoints[0].plane_snapnum = -1;
+    SyncPoints[0].write_power = 0;
     NSyncPoints = 1;
 
     // set up UVBG syncpoints at given intervals
@@ -218,6 +224,9 @@ setup_sync_points(Cosmology * CP, double TimeIC, double TimeMax, double no_snaps
             SyncPoints[NSyncPoints].write_snapshot = 0;
             SyncPoints[NSyncPoints].write_fof = 0;
             SyncPoints[NSyncPoints].calc_uvbg = 1;
+            SyncPoints[NSyncPoints].write_plane = 0;
+            SyncPoints[NSyncPoints].plane_snapnum = -1;
+            SyncPoints[NSyncPoints].write_power = 0;
             NSyncPoints++;
             if(NSyncPoints > NSyncPointsAlloc)
                 endrun(1, "Tried to generate %ld syncpoints, %ld allocated\n", NSyncPoints, NSyncPointsAlloc);
@@ -242,6 +251,7 @@ setup_sync_points(Cosmology * CP, double TimeIC, double TimeMax, double no_snaps
     SyncPoints[NSyncPoints].write_fof = 1;
     SyncPoints[NSyncPoints].write_plane = 0;
     SyncPoints[NSyncPoints].plane_snapnum = -1;
+    SyncPoints[NSyncPoints].write_power = 0;
     NSyncPoints++;
 
     /* we do an insertion sort here. A heap is faster but who cares the speed for this? */
@@ -316,6 +326,31 @@ setup_sync_points(Cosmology * CP, double TimeIC, double TimeMax, double no_snaps
         SyncPoints[j].plane_snapnum = i;
     }
 
+    /* Now insert the power spectrum outputs*/
+    for(i = 0; i < Sync.PowerOutputListLength; i ++) {
+        int64_t j = 0;
+        double a = Sync.PowerOutputListTimes[i];
+        double loga = log(a);
+        if(a < TimeIC || a > TimeMax)
+            continue;
+
+        for(j = 0; j < NSyncPoints; j ++) {
+            if(a <= SyncPoints[j].a) {
+                break;
+            }
+        }
+        /* As for the planes, reuse a nearby sync point*/
+        if(fabs(loga - SyncPoints[j].loga) > 1e-4) {
+            memmove(&SyncPoints[j + 1], &SyncPoints[j], sizeof(SyncPoints[0]) * (NSyncPoints - j));
+            memset(&SyncPoints[j], 0, sizeof(SyncPoints[0]));
+            SyncPoints[j].a = a;
+            SyncPoints[j].loga = loga;
+            SyncPoints[j].plane_snapnum = -1;
+            NSyncPoints ++;
+        }
+        SyncPoints[j].write_power = 1;
+    }
+
     for(i = 0; i < NSyncPoints; i++) {
         SyncPoints[i].ti = (i * 1L) << (TIMEBINS);
     }
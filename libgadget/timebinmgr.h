@@ -29,6 +29,7 @@ struct SyncPoint
     int calc_uvbg;  //! Calculate the UV background
     int write_plane;  //! Write a plane
     int plane_snapnum;  //! The snapshot number for the plane
+    int write_power;  //! Measure the power spectra of each particle type
     inttime_t ti;
 };
 
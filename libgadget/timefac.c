@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <omp.h>
 #include <gsl/gsl_integration.h>
 
 #include "physconst.h"
@@ -42,7 +43,7 @@ static double hydrokick_integ(double a, void *param)
 }
 
 /*Do the integral required to get a factor.*/
-static double get_exact_factor(Cosmology * CP, inttime_t t0, inttime_t t1, double (*factor) (double, void *))
+static double get_exact_factor_integ(Cosmology * CP, inttime_t t0, inttime_t t1, double (*factor) (double, void *))
 {
     double result, abserr;
     if(t0 == t1)
@@ -59,45 +60,120 @@ static double get_exact_factor(Cosmology * CP, inttime_t t0, inttime_t t1, doubl
     return result;
 }
 
-/*Get the exact drift factor*/
-double get_exact_drift_factor(Cosmology * CP, inttime_t ti0, inttime_t ti1)
+/* Table of the cumulative factors on the integer timeline of one sync point interval.
+ * Nodes are evenly spaced in ti, and so in loga. Within a cell the factor is a cubic
+ * Hermite interpolant in loga, using the integrand as the derivative: the error is ~dloga^4
+ * for cells of width dloga. The position in the cell is exact on the integer timeline, so
+ * short intervals do not lose precision to exp(loga) as the direct integration does.*/
+#define FAC_TABLE_BITS 12
+#define FAC_TABLE_SIZE (1 << FAC_TABLE_BITS)
+#define FAC_CELL_BITS (TIMEBINS - FAC_TABLE_BITS)
+
+enum FacType {
+    FAC_DRIFT = 0,
+    FAC_GRAVKICK = 1,
+    FAC_HYDROKICK = 2,
+    NFAC = 3,
+};
+
+static struct FacTable {
+    /* Sync point interval of the table, or -1 if not built*/
+    int64_t interval;
+    Cosmology CP;
+    /* Width of a cell in loga, and the scale factor at each node*/
+    double dloga;
+    double a[FAC_TABLE_SIZE + 1];
+    /* Factor from the start of the interval to each node, the factor across each cell,
+     * and d factor / d loga at each node*/
+    double cum[NFAC][FAC_TABLE_SIZE + 1];
+    double cell[NFAC][FAC_TABLE_SIZE];
+    double deriv[NFAC][FAC_TABLE_SIZE + 1];
+} FacTable = {-1};
+
+static double (*FacInteg[NFAC]) (double, void *) = {drift_integ, gravkick_integ, hydrokick_integ};
+
+static int
+fac_table_build(Cosmology * CP, const int64_t interval)
 {
-    return get_exact_factor(CP, ti0, ti1, &drift_integ);
+    const inttime_t tistart = interval << TIMEBINS;
+    double * a = FacTable.a;
+    int i, f;
+    FacTable.interval = -1;
+    for(i = 0; i <= FAC_TABLE_SIZE; i++) {
+        a[i] = exp(loga_from_ti(tistart + ((inttime_t) i << FAC_CELL_BITS)));
+        if(!isfinite(a[i]))
+            return 0;
+    }
+    FacTable.dloga = (loga_from_ti(tistart + TIMEBASE) - loga_from_ti(tistart)) / FAC_TABLE_SIZE;
+    gsl_integration_glfixed_table * gltable = gsl_integration_glfixed_table_alloc(8);
+    for(f = 0; f < NFAC; f++) {
+        gsl_function F;
+        F.function = FacInteg[f];
+        F.params = CP;
+        FacTable.cum[f][0] = 0;
+        for(i = 0; i < FAC_TABLE_SIZE; i++) {
+            FacTable.cell[f][i] = gsl_integration_glfixed(&F, a[i], a[i+1], gltable);
+            FacTable.cum[f][i+1] = FacTable.cum[f][i] + FacTable.cell[f][i];
+        }
+        for(i = 0; i <= FAC_TABLE_SIZE; i++)
+            FacTable.deriv[f][i] = FacInteg[f](a[i], CP) * a[i];
+    }
+    gsl_integration_glfixed_table_free(gltable);
+    FacTable.CP = *CP;
+    FacTable.interval = interval;
+    return 1;
 }
 
-/*Get the exact drift factor*/
-double get_exact_gravkick_factor(Cosmology * CP, inttime_t ti0, inttime_t ti1)
+/* Factor from the start of cell k to offset rem inside it*/
+static double
+fac_table_in_cell(const enum FacType f, const int64_t k, const inttime_t rem)
 {
-    return get_exact_factor(CP, ti0, ti1, &gravkick_integ);
+    if(rem == 0)
+        return 0;
+    const double t = (double) rem / (double) (1Lu << FAC_CELL_BITS);
+    const double t2 = t * t, t3 = t2 * t;
+    const double h = FacTable.dloga;
+    return (-2 * t3 + 3 * t2) * FacTable.cell[f][k] + (t3 - 2 * t2 + t) * h * FacTable.deriv[f][k] + (t3 - t2) * h * FacTable.deriv[f][k+1];
 }
 
-double get_exact_hydrokick_factor(Cosmology * CP, inttime_t ti0, inttime_t ti1)
+/* Get a factor from the table, building it for a new interval if not inside a parallel region.
+ * Pairs of times not inside one interval are integrated directly.*/
+static double get_exact_factor(Cosmology * CP, inttime_t t0, inttime_t t1, const enum FacType f)
 {
-    return get_exact_factor(CP, ti0, ti1, &hydrokick_integ);
+    if(t0 == t1)
+        return 0;
+    const inttime_t tmin = t0 < t1 ? t0 : t1;
+    const inttime_t tmax = t0 < t1 ? t1 : t0;
+    const int64_t interval = tmin >> TIMEBINS;
+    if(tmax - (interval << TIMEBINS) > (inttime_t) TIMEBASE)
+        return get_exact_factor_integ(CP, t0, t1, FacInteg[f]);
+    if(FacTable.interval != interval || memcmp(&FacTable.CP, CP, sizeof(Cosmology))) {
+        if(omp_in_parallel() || !fac_table_build(CP, interval))
+            return get_exact_factor_integ(CP, t0, t1, FacInteg[f]);
+    }
+    const inttime_t off0 = t0 - (interval << TIMEBINS);
+    const inttime_t off1 = t1 - (interval << TIMEBINS);
+    const int64_t k0 = off0 >> FAC_CELL_BITS;
+    const int64_t k1 = off1 >> FAC_CELL_BITS;
+    const inttime_t cellmask = (1Lu << FAC_CELL_BITS) - 1;
+    return FacTable.cum[f][k1] - FacTable.cum[f][k0] + fac_table_in_cell(f, k1, off1 & cellmask) - fac_table_in_cell(f, k0, off0 & cellmask);
 }
 
-/* Integrand for comoving distance */
-static double comoving_distance_integ(double a, void *param)
+/*Get the exact drift factor*/
+double get_exact_drift_factor(Cosmology * CP, inttime_t ti0, inttime_t ti1)
 {
-    Cosmology *CP = (Cosmology *) param;
-    double h = hubble_function(CP, a);
-    return 1. / (h * a * a); 
+    return get_exact_factor(CP, ti0, ti1, FAC_DRIFT);
 }
 
-/* Function to compute the comoving distance between two scale factors */
-double compute_comoving_distance(Cosmology *CP, double a0, double a1, const double UnitVelocity_in_cm_per_s)
+/*Get the exact drift factor*/
+double get_exact_gravkick_factor(Cosmology * CP, inttime_t ti0, inttime_t ti1)
 {
-    double result, abserr;
-    gsl_function F;
-    gsl_integration_workspace *workspace = gsl_integration_workspace_alloc(WORKSIZE);
-    
-    F.function = comoving_distance_integ;
-    F.params = CP;
-
-    // Using GSL to perform the integration
-    gsl_integration_qag(&F, a0, a1, 0, 1.0e-8, WORKSIZE, GSL_INTEG_GAUSS61, workspace, &result, &abserr);
-    gsl_integration_workspace_free(workspace);
+    return get_exact_factor(CP, ti0, ti1, FAC_GRAVKICK);
+}
 
-    return (LIGHTCGS/UnitVelocity_in_cm_per_s) * result;
+double get_exact_hydrokick_factor(Cosmology * CP, inttime_t ti0, inttime_t ti1)
+{
+    return get_exact_factor(CP, ti0, ti1, FAC_HYDROKICK);
 }
 
+
@@ -18,6 +18,7 @@
 #include "walltime.h"
 #include "timestep.h"
 #include "gravity.h"
+#include "stats.h"
 
 /*! \file timestep.c
  *  \brief routines for 'kicking' particles in
@@ -44,14 +45,37 @@ static struct timestep_params
 
     double MaxGasVel; /* Limit on Gas velocity */
     double CourantFac;		/*!< SPH-Courant factor */
+    int TimeBinLimiter; /* Maximum number of timebins a gas particle may be above its shortest neighbour. 0 disables.*/
+    double TreeRefitFraction; /* Refit the gravity tree for a lower timebin if it has at least this fraction of the tree particles. 0 disables.*/
+    double TreeInteractionListSize; /* Nodes per tree particle stored for the gravity walks on a refit tree. 0 disables.*/
 } TimestepParams;
 
+/* True if the last PM timestep was set by the displacement criterion at the force split scale,
+ * rather than at the mean particle spacing or by the step bounds.*/
+static int PMStepSetByAsmth = 0;
+
+int
+pm_timestep_set_by_asmth(void)
+{
+    return PMStepSetByAsmth;
+}
+
+/* Change the bounds of the PM timestep during a run. A negative value keeps the current bound.*/
+void
+set_timestep_pm_bounds(const double MinSizeTimestep, const double MaxSizeTimestep)
+{
+    if(MinSizeTimestep >= 0)
+        TimestepParams.MinSizeTimestep = MinSizeTimestep;
+    if(MaxSizeTimestep >= 0)
+        TimestepParams.MaxSizeTimestep = MaxSizeTimestep;
+}
+
 /*Set the parameters of the hydro module*/
 void
 set_timestep_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         TimestepParams.ErrTolIntAccuracy = param_get_double(ps, "ErrTolIntAccuracy");
         TimestepParams.MaxGasVel = param_get_double(ps, "MaxGasVel");
@@ -61,8 +85,11 @@ set_timestep_params(ParameterSet * ps)
         TimestepParams.ForceEqualTimesteps = param_get_int(ps, "ForceEqualTimesteps");
         TimestepParams.MaxRMSDisplacementFac = param_get_double(ps, "MaxRMSDisplacementFac");
         TimestepParams.CourantFac = param_get_double(ps, "CourantFac");
+        TimestepParams.TimeBinLimiter = param_get_int(ps, "TimeBinLimiter");
+        TimestepParams.TreeRefitFraction = param_get_double(ps, "TreeRefitFraction");
+        TimestepParams.TreeInteractionListSize = param_get_double(ps, "TreeInteractionListSize");
     }
-    MPI_Bcast(&TimestepParams, sizeof(struct timestep_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TimestepParams, sizeof(struct timestep_params), MPI_BYTE, 0, GadgetComm);
 }
 
 static inline int get_active_particle(const ActiveParticles * act, int pa)
@@ -205,7 +232,7 @@ find_global_timestep(DriftKickTimes * times, const inttime_t dti_max, const doub
             if(dti <= 1 || dti > (inttime_t) TIMEBASE)
                 print_bad_timebin(dloga, dti, i, P[i].FullTreeGravAccel, dti_max, titype);
         }
-        MPI_Allreduce(MPI_IN_PLACE, &dti_min, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &dti_min, 1, MPI_INT, MPI_MIN, GadgetComm);
         return dti_min;
 }
 
@@ -372,7 +399,7 @@ hierarchical_gravity_and_timesteps(const ActiveParticles * act, PetaPM * pm, Dom
             timebincounts[ti] += timebincounts [i * TIMEBINS + ti];
     }
     int64_t alltimebincounts[TIMEBINS];
-    MPI_Allreduce(timebincounts, alltimebincounts, TIMEBINS, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(timebincounts, alltimebincounts, TIMEBINS, MPI_INT64, MPI_SUM, GadgetComm);
     myfree(timebincounts);
     /* Find largest bin with particles in.*/
     for(ti = largest_active; ti >= 1; ti--)
@@ -415,6 +442,13 @@ hierarchical_gravity_and_timesteps(const ActiveParticles * act, PetaPM * pm, Dom
     if(StoredGravAccel.GravAccel)
         myfree(StoredGravAccel.GravAccel);
 
+    /* Memory for the accelerations so we don't over-write the acceleration from the longest timestep.
+     * Need all particles as the index in the tree is the particle index.
+     * Allocated once, below all the active lists, so that the tree can be freed in order.*/
+    MyFloat (*GravAccel)[3] = NULL;
+    if(largest_active > 1)
+        GravAccel = (MyFloat (*) [3]) mymalloc2("GravAccel", PartManager->NumPart * sizeof(GravAccel[0]));
+
     /* Copy over active list to some new memory so we can free the old one in order*/
     ActiveParticles lastact[1] = {0};
     memcpy(lastact, subact, sizeof(ActiveParticles));
@@ -427,8 +461,20 @@ hierarchical_gravity_and_timesteps(const ActiveParticles * act, PetaPM * pm, Dom
             myfree(subact->ActiveParticle);
     }
 
+    /* Nothing is drifted between the lower timebins and each is a subset of the one above,
+     * so the tree built for the first of them can be refit for the rest, as in hierarchical_gravity_accelerations.
+     * Stars formed since the last tree contain no new mass: they sit at the position of their parent gas particle.*/
+    ForceTree Tree = {0};
+    int64_t tree_tot_particles = 0;
+    /* Number of particles in the last timebin for which GravAccel was computed.
+     * Each timebin is a subset of the one above, so a timebin with as many particles is the same set,
+     * and its accelerations are already in GravAccel.*/
+    int64_t computed_tot_active = -1;
+
     /* Then do the below loop with largest_active = the new topmost bin - 1*/
     int64_t badstepsizecount = 0;
+    /* The lowest occupied gravity timebin, if every bin down to the first has particles*/
+    times->mingravtimebin = 1;
     /* Now loop over all lower timebins*/
     for(ti = largest_active-1; ti > 0; ti--) {
         ActiveParticles subact[1] = {0};
@@ -438,7 +484,7 @@ hierarchical_gravity_and_timesteps(const ActiveParticles * act, PetaPM * pm, Dom
             myfree(lastact->ActiveParticle);
         /* Check whether we need to do any more work*/
         int64_t tot_active;
-        MPI_Allreduce(&subact->NumActiveGravity, &tot_active, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&subact->NumActiveGravity, &tot_active, 1, MPI_INT64, MPI_SUM, GadgetComm);
         walltime_measure("/Timeline/HierGrav/Wait");
         /* Do nothing if no particles are active*/
         if(tot_active == 0) {
@@ -447,11 +493,40 @@ hierarchical_gravity_and_timesteps(const ActiveParticles * act, PetaPM * pm, Dom
             break;
         }
 
-        /* Allocate memory for the accelerations so we don't over-write the acceleration from the longest timestep.
-         * Need all particles as the index in the tree is the particle index. */
-        MyFloat (*GravAccel)[3] = (MyFloat (*) [3]) mymalloc2("GravAccel", PartManager->NumPart * sizeof(GravAccel[0]));
-        /* Do the accelerations and build the tree*/
-        grav_short_tree_build_tree(subact, pm, ddecomp, GravAccel, times->Ti_Current, rho0, HybridNuGrav, EmergencyOutputDir);
+        /* Set if the active list has already been moved to high memory*/
+        int subact_high = 0;
+        /* No particle left the timebin above, so nothing to compute*/
+        if(tot_active != computed_tot_active) {
+            if(force_tree_allocated(&Tree) && tot_active >= TimestepParams.TreeRefitFraction * tree_tot_particles) {
+                force_tree_refit(&Tree, ddecomp, subact);
+                grav_short_tree(subact, pm, &Tree, GravAccel, rho0, times->Ti_Current);
+            }
+            else {
+                /* Free the stored tree or build a tree to keep: either way the active list must first be moved
+                 * to high memory, as it is above the tree.*/
+                if(subact->ActiveParticle && (force_tree_allocated(&Tree) || TimestepParams.TreeRefitFraction > 0)) {
+                    int * newActiveParticle = (int *) mymalloc2("Last_active", sizeof(int)*subact->NumActiveParticle);
+                    memcpy(newActiveParticle, subact->ActiveParticle, sizeof(int)*subact->NumActiveParticle);
+                    myfree(subact->ActiveParticle);
+                    subact->ActiveParticle = newActiveParticle;
+                    subact_high = 1;
+                }
+                if(force_tree_allocated(&Tree))
+                    force_tree_free(&Tree);
+                if(TimestepParams.TreeRefitFraction > 0) {
+                    /* Tree with only particle timesteps below this value, kept for the lower timebins*/
+                    force_tree_active_moments(&Tree, ddecomp, subact, HybridNuGrav, 0, EmergencyOutputDir);
+                    if(TimestepParams.TreeInteractionListSize > 0)
+                        force_tree_alloc_interaction_lists(&Tree, TimestepParams.TreeInteractionListSize);
+                    grav_short_tree(subact, pm, &Tree, GravAccel, rho0, times->Ti_Current);
+                    MPI_Allreduce(&Tree.NumParticles, &tree_tot_particles, 1, MPI_INT64, MPI_SUM, GadgetComm);
+                }
+                else
+                    /* Do the accelerations and build the tree*/
+                    grav_short_tree_build_tree(subact, pm, ddecomp, GravAccel, times->Ti_Current, rho0, HybridNuGrav, EmergencyOutputDir);
+            }
+            computed_tot_active = tot_active;
+        }
 
         /* We need to compute the new timestep here based on the acceleration at the current level,
          * because we will over-write the acceleration*/
@@ -474,10 +549,14 @@ hierarchical_gravity_and_timesteps(const ActiveParticles * act, PetaPM * pm, Dom
         }
         /* Do the half-kicks*/
         apply_hierarchical_grav_kick(subact, CP, times, GravAccel, ti, largest_active);
-        myfree(GravAccel);
 
         memcpy(lastact, subact, sizeof(ActiveParticles));
-        if(subact->ActiveParticle){
+        if(subact_high) {
+            /* Already in high memory: free it here if this is the last timebin*/
+            if(ti == 1 && subact->ActiveParticle != act->ActiveParticle)
+                myfree(subact->ActiveParticle);
+        }
+        else if(subact->ActiveParticle){
             /* Allocate high so we can free in order.*/
             if(ti > 1) {
                 lastact->ActiveParticle = (int*) mymalloc2("Last_active", sizeof(int)*lastact->NumActiveParticle);
@@ -488,10 +567,13 @@ hierarchical_gravity_and_timesteps(const ActiveParticles * act, PetaPM * pm, Dom
                 myfree(subact->ActiveParticle);
         }
     }
+    force_tree_free(&Tree);
+    if(GravAccel)
+        myfree(GravAccel);
     /* Ensure explicitly that we are collective, although this should not be necessary.*/
-    MPI_Allreduce(MPI_IN_PLACE, &times->mingravtimebin, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &times->mingravtimebin, 1, MPI_INT, MPI_MIN, GadgetComm);
     times->mintimebin = times->mingravtimebin;
-    MPI_Allreduce(MPI_IN_PLACE, &badstepsizecount, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &badstepsizecount, 1, MPI_INT, MPI_SUM, GadgetComm);
     return badstepsizecount;
 }
 
@@ -524,17 +606,16 @@ int hierarchical_gravity_accelerations(const ActiveParticles * act, PetaPM * pm,
         lastact[0] = build_active_sublist(act, ti, times->Ti_Current);
     }
     walltime_measure("/Timeline/HierGrav/Init2");
-    /* Tree with moments but only particle timesteps below this value.
-     * Done for all currently active gravitational particles.
-     * Stores acceleration in P[i].GravAccel.*/
-    grav_short_tree_build_tree(lastact, pm, ddecomp, StoredGravAccel.GravAccel, times->Ti_Current, rho0, HybridNuGrav, EmergencyOutputDir);
 
-    /* We need to do the kick here based on the acceleration at the current level,
-        * because we will over-write the acceleration*/
-    apply_hierarchical_grav_kick(lastact, CP, times, StoredGravAccel.GravAccel, ti, largest_active);
+    /* Some temporary memory for accelerations. Allocated once, below all the active lists,
+     * so that the tree can be freed in order.*/
+    MyFloat (* GravAccel) [3] = NULL;
+    if(largest_active-1 >= times->mingravtimebin)
+        GravAccel = (MyFloat (*) [3]) mymalloc2("GravAccel", PartManager->NumPart * sizeof(GravAccel[0]));
 
     if(lastact->ActiveParticle && lastact->ActiveParticle != act->ActiveParticle){
-        /* Allocate high so we can free in order.*/
+        /* Allocate high so we can free in order. Done before the tree is built,
+         * so the tree can be kept for the lower timebins.*/
         int * newActiveParticle = (int *) mymalloc2("Last_active", sizeof(int)*lastact->NumActiveParticle);
         memcpy(newActiveParticle, lastact->ActiveParticle, sizeof(int)*lastact->NumActiveParticle);
         /* Free previous copy*/
@@ -542,8 +623,31 @@ int hierarchical_gravity_accelerations(const ActiveParticles * act, PetaPM * pm,
         lastact->ActiveParticle = newActiveParticle;
     }
 
-    /* Some temporary memory for accelerations*/
-    MyFloat (* GravAccel) [3] = NULL;
+    /* Tree with moments but only particle timesteps below this value.
+     * Done for all currently active gravitational particles.
+     * Stores acceleration in P[i].GravAccel.
+     * No Father array here*/
+    ForceTree Tree = {0};
+    force_tree_active_moments(&Tree, ddecomp, lastact, HybridNuGrav, 0, EmergencyOutputDir);
+    /* The walks on the refit trees for the lower timebins start from where the walk on the parent tree stopped*/
+    if(TimestepParams.TreeRefitFraction > 0 && TimestepParams.TreeInteractionListSize > 0)
+        force_tree_alloc_interaction_lists(&Tree, TimestepParams.TreeInteractionListSize);
+    grav_short_tree(lastact, pm, &Tree, StoredGravAccel.GravAccel, rho0, times->Ti_Current);
+    /* Particles have not moved, and each lower timebin is a subset of this one,
+     * so the tree can be refit for the lower timebins instead of rebuilt.
+     * Store the size of the tree when built, which sets the cost of a refit.*/
+    int64_t tree_tot_particles = 0;
+    if(TimestepParams.TreeRefitFraction > 0)
+        MPI_Allreduce(&Tree.NumParticles, &tree_tot_particles, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    else
+        force_tree_free(&Tree);
+
+    /* We need to do the kick here based on the acceleration at the current level,
+        * because we will over-write the acceleration*/
+    apply_hierarchical_grav_kick(lastact, CP, times, StoredGravAccel.GravAccel, ti, largest_active);
+
+    /* Set once accelerations are computed for a lower timebin*/
+    int GravAccel_computed = 0;
     for(ti = largest_active-1; ti >= times->mingravtimebin; ti--) {
         /* Note we can't just use largest_active
          * because some particles may be only hydro active.*/
@@ -553,26 +657,43 @@ int hierarchical_gravity_accelerations(const ActiveParticles * act, PetaPM * pm,
             myfree(lastact->ActiveParticle);
 
         int64_t tot_active, last_tot_active;
-        MPI_Allreduce(&subact.NumActiveGravity, &tot_active, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-        MPI_Allreduce(&lastact->NumActiveGravity, &last_tot_active, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&subact.NumActiveGravity, &tot_active, 1, MPI_INT64, MPI_SUM, GadgetComm);
+        MPI_Allreduce(&lastact->NumActiveGravity, &last_tot_active, 1, MPI_INT64, MPI_SUM, GadgetComm);
         walltime_measure("/Timeline/HierGrav/Wait2");
+        /* Set if the active list has already been moved to high memory*/
+        int subact_high = 0;
         /* No need to recompute accelerations if the particle number is the same as an earlier computation*/
         if(tot_active != last_tot_active) {
-            if(GravAccel)
-                myfree(GravAccel);
-            /* Allocate memory for the accelerations so we don't over-write the acceleration from the longest timestep*/
-            GravAccel = (MyFloat (*) [3]) mymalloc2("GravAccel", PartManager->NumPart * sizeof(GravAccel[0]));
-            /* Tree with moments but only particle timesteps below this value*/
-            grav_short_tree_build_tree(&subact, pm, ddecomp, GravAccel, times->Ti_Current, rho0, HybridNuGrav, EmergencyOutputDir);
+            if(force_tree_allocated(&Tree) && tot_active >= TimestepParams.TreeRefitFraction * tree_tot_particles) {
+                force_tree_refit(&Tree, ddecomp, &subact);
+                grav_short_tree(&subact, pm, &Tree, GravAccel, rho0, times->Ti_Current);
+            }
+            else {
+                /* Too few particles remain for a refit to be cheaper than a new tree.
+                 * Free the stored tree, moving the active list (which is above it) to high memory first.*/
+                if(force_tree_allocated(&Tree)) {
+                    if(subact.ActiveParticle) {
+                        int * newActiveParticle = (int *) mymalloc2("Last_active", sizeof(int)*subact.NumActiveParticle);
+                        memcpy(newActiveParticle, subact.ActiveParticle, sizeof(int)*subact.NumActiveParticle);
+                        myfree(subact.ActiveParticle);
+                        subact.ActiveParticle = newActiveParticle;
+                        subact_high = 1;
+                    }
+                    force_tree_free(&Tree);
+                }
+                /* Tree with moments but only particle timesteps below this value*/
+                grav_short_tree_build_tree(&subact, pm, ddecomp, GravAccel, times->Ti_Current, rho0, HybridNuGrav, EmergencyOutputDir);
+            }
+            GravAccel_computed = 1;
         }
 
         report_memory_usage("GRAVITY-SHORT");
 
         /* This dance is just in case the top bin has the same number of particles
-         * as the bin below and so computation is skipped. Don't want to set GravAccel
-         * because we should not free the stored memory.*/
+         * as the bin below and so computation is skipped. Use the stored accelerations
+         * until GravAccel contains something.*/
         MyFloat (* tmpGA) [3] = GravAccel;
-        if(!GravAccel)
+        if(!GravAccel_computed)
             tmpGA = StoredGravAccel.GravAccel;
         /* We need to do the kick here based on the acceleration at the current level,
          * because we will over-write the acceleration*/
@@ -580,7 +701,7 @@ int hierarchical_gravity_accelerations(const ActiveParticles * act, PetaPM * pm,
 
         /* Copy over active list to some new memory so we can free the old one in order*/
         memcpy(lastact, &subact, sizeof(ActiveParticles));
-        if(subact.ActiveParticle){
+        if(subact.ActiveParticle && !subact_high){
             /* Allocate high so we can free in order.*/
             lastact->ActiveParticle = (int*) mymalloc2("Last_active", sizeof(int)*lastact->NumActiveParticle);
             memcpy(lastact->ActiveParticle, subact.ActiveParticle, sizeof(int)*lastact->NumActiveParticle);
@@ -590,6 +711,7 @@ int hierarchical_gravity_accelerations(const ActiveParticles * act, PetaPM * pm,
     }
     if(lastact->ActiveParticle && lastact->ActiveParticle != act->ActiveParticle)
         myfree(lastact->ActiveParticle);
+    force_tree_free(&Tree);
     if(GravAccel)
         myfree(GravAccel);
 
@@ -690,17 +812,17 @@ find_hydro_timesteps(const ActiveParticles * act, DriftKickTimes * times, const
 
     }
 
-    MPI_Allreduce(MPI_IN_PLACE, &dynratio, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &nbh, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &dynratio, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &nbh, 1, MPI_INT64, MPI_SUM, GadgetComm);
     if(nbh > 0)
         message(0, "Avg bh dyn fric timebin: %g max %d\n", ((double) dynratio )/ nbh, maxdyndiff);
-    MPI_Allreduce(MPI_IN_PLACE, &mTimeBin, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &mTimeBin, 1, MPI_INT, MPI_MIN, GadgetComm);
 
-    MPI_Allreduce(MPI_IN_PLACE, &ntiaccel, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &nticourant, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &ntihsml, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &ntiaccrete, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &ntineighbour, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &ntiaccel, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &nticourant, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &ntihsml, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &ntiaccrete, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    MPI_Allreduce(MPI_IN_PLACE, &ntineighbour, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
     message(0, "Hydro timesteps: Accel: %ld Soundspeed: %ld DivVel: %ld Accrete: %ld Neighbour: %ld\n", ntiaccel, nticourant, ntihsml, ntiaccrete, ntineighbour);
 
@@ -727,10 +849,10 @@ find_hydro_timesteps(const ActiveParticles * act, DriftKickTimes * times, const
             if(P[i].TimeBinHydro < mTimeBin && P[i].TimeBinHydro >= 1)
                 mTimeBin = P[i].TimeBinHydro;
         }
-        MPI_Allreduce(MPI_IN_PLACE, &mTimeBin, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &mTimeBin, 1, MPI_INT, MPI_MIN, GadgetComm);
     }
 
-    MPI_Allreduce(MPI_IN_PLACE, &badstepsizecount, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &badstepsizecount, 1, MPI_INT, MPI_SUM, GadgetComm);
 
     if(isFirstTimeStep)
         set_bh_first_timestep(mTimeBin);
@@ -746,10 +868,28 @@ find_hydro_timesteps(const ActiveParticles * act, DriftKickTimes * times, const
     return badstepsizecount;
 }
 
+/* Global reduction of the timesteps found by find_timesteps, started with nonblocking collectives
+ * and completed by find_timesteps_wait.*/
+static struct TimestepReduction
+{
+    /* Bad steps, then the timestep criteria counts: accel, courant, hsml, accrete, neighbour*/
+    int64_t counts[6];
+    /* Minus the min bin, and the max bin, so both reduce with MPI_MAX*/
+    int bins[2];
+    MPI_Request requests[2];
+    int pending;
+    int isPM;
+    int isFirstTimeStep;
+    int badstepsizecount;
+} TimestepReduction;
+
 /* This function assigns new short-range timesteps to particles.
  * It will also shrink the PM timestep to the longest short-range timestep.
- * Stores the maximum and minimum timesteps in the DriftKickTimes structure.*/
-int
+ * Stores the maximum and minimum timesteps in the DriftKickTimes structure.
+ * The global reduction is only started: until find_timesteps_wait, times->mintimebin is the local minimum,
+ * which is enough for the short-range kick. On PM steps and the first step the kick needs
+ * the global values, so the reduction is completed before returning.*/
+void
 find_timesteps(const ActiveParticles * act, DriftKickTimes * times, const double atime, int FastParticleType, const Cosmology * CP, const double asmth, const int isFirstTimeStep)
 {
     int pa;
@@ -837,35 +977,59 @@ find_timesteps(const ActiveParticles * act, DriftKickTimes * times, const double
             maxTimeBin = bin;
     }
 
-    MPI_Allreduce(MPI_IN_PLACE, &badstepsizecount, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &mTimeBin, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &maxTimeBin, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    struct TimestepReduction * red = &TimestepReduction;
+    red->counts[0] = badstepsizecount;
+    red->counts[1] = ntiaccel;
+    red->counts[2] = nticourant;
+    red->counts[3] = ntihsml;
+    red->counts[4] = ntiaccrete;
+    red->counts[5] = ntineighbour;
+    red->bins[0] = -mTimeBin;
+    red->bins[1] = maxTimeBin;
+    MPI_Iallreduce(MPI_IN_PLACE, red->counts, 6, MPI_INT64, MPI_SUM, GadgetComm, &red->requests[0]);
+    MPI_Iallreduce(MPI_IN_PLACE, red->bins, 2, MPI_INT, MPI_MAX, GadgetComm, &red->requests[1]);
+    red->pending = 1;
+    red->isPM = isPM;
+    red->isFirstTimeStep = isFirstTimeStep;
+    /* Local values, which bound the bins of the particles on this rank*/
+    times->mintimebin = mTimeBin;
+    times->maxtimebin = maxTimeBin;
+    walltime_measure("/Timeline");
+    if(isPM || isFirstTimeStep)
+        find_timesteps_wait(times);
+}
 
-    MPI_Allreduce(MPI_IN_PLACE, &ntiaccel, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &nticourant, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &ntihsml, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &ntiaccrete, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &ntineighbour, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+int
+find_timesteps_wait(DriftKickTimes * times)
+{
+    struct TimestepReduction * red = &TimestepReduction;
+    if(!red->pending)
+        return red->badstepsizecount;
+    MPI_Waitall(2, red->requests, MPI_STATUSES_IGNORE);
+    red->pending = 0;
+    red->badstepsizecount = red->counts[0];
+    const int mTimeBin = -red->bins[0];
+    const int maxTimeBin = red->bins[1];
 
     /* Ensure that the PM timestep is not longer than the longest tree timestep;
      * this prevents particles in the longest timestep being active and moving into a higher bin
      * between PM timesteps, thus skipping the PM step entirely.*/
-    if(isPM && times->PM_length > dti_from_timebin(maxTimeBin))
+    if(red->isPM && times->PM_length > dti_from_timebin(maxTimeBin))
         times->PM_length = dti_from_timebin(maxTimeBin);
     message(0, "PM timebin: %lx (dloga: %g Max: %g). Criteria: Accel: %ld Soundspeed: %ld DivVel: %ld Accrete: %ld Neighbour: %ld\n",
             times->PM_length, dloga_from_dti(times->PM_length, times->Ti_Current), TimestepParams.MaxSizeTimestep,
-            ntiaccel, nticourant, ntihsml, ntiaccrete, ntineighbour);
+            red->counts[1], red->counts[2], red->counts[3], red->counts[4], red->counts[5]);
 
     /* BH particles have their timesteps set by a timestep limiter.
      * On the first timestep this is not effective because all the particles have zero timestep.
      * So on the first timestep only set all BH particles to the smallest allowable timestep.
      * Note we can leave the gravitational timestep as set by the acceleration: repositioning may take care of it.*/
-    if(isFirstTimeStep)
+    if(red->isFirstTimeStep)
         set_bh_first_timestep(mTimeBin);
-    walltime_measure("/Timeline");
     times->mintimebin = mTimeBin;
     times->maxtimebin = maxTimeBin;
-    return badstepsizecount;
+    walltime_measure("/Timeline/Wait");
+    return red->badstepsizecount;
 }
 
 /* Update the last active drift times for all bins*/
@@ -882,12 +1046,32 @@ update_lastactive_drift(DriftKickTimes * times)
     }
 }
 
+/* Long-range kick factor for half a PM step. Advances the PM kick time.*/
+static double
+PM_half_kick_factor(Cosmology * CP, DriftKickTimes * times)
+{
+    const inttime_t tistart = times->PM_kick;
+    const inttime_t tiend =  tistart + times->PM_length / 2;
+    times->PM_kick = tiend;
+    return get_exact_gravkick_factor(CP, tistart, tiend);
+}
+
+/* The PM kick can share the sweep of the short-range kick if every particle is in the active list,
+ * as it is on a PM step.*/
+static int
+can_fuse_PM_kick(const ActiveParticles * act)
+{
+    return !act->ActiveParticle && act->NumActiveParticle == PartManager->NumPart;
+}
+
 /* Apply half a kick, for the second half of the timestep.*/
 void
-apply_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime)
+apply_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime, const int PMkick, struct EnergySums * energy)
 {
     int pa, bin;
     walltime_measure("/Misc");
+    const int fusePM = PMkick && can_fuse_PM_kick(act);
+    const double pmkick = fusePM ? PM_half_kick_factor(CP, times) : 0;
     double gravkick[TIMEBINS+1] = {0}, hydrokick[TIMEBINS+1] = {0};
     #pragma omp parallel for
     for(bin = times->mintimebin; bin <= TIMEBINS; bin++) {
@@ -901,8 +1085,9 @@ apply_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * ti
         hydrokick[bin] = get_exact_hydrokick_factor(CP, times->Ti_kick[bin], newkick);
     }
     //    message(0, "drift %ld bin %d kick: %ld\n", times->Ti_Current, bin, times->Ti_kick[bin]);
+    double esum[ENERGY_NSUM] = {0};
     /* Now assign new timesteps and kick */
-    #pragma omp parallel for
+    #pragma omp parallel for reduction(+: esum[:ENERGY_NSUM])
     for(pa = 0; pa < act->NumActiveParticle; pa++)
     {
         const int i = get_active_particle(act, pa);
@@ -935,15 +1120,29 @@ apply_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * ti
             P[i].Ti_kick_hydro = times->Ti_kick[bin_hydro] +  dti_from_timebin(bin_gravity)/2;
 #endif
         }
+        if(fusePM) {
+            do_grav_short_range_kick(&P[i], P[i].GravPM, pmkick);
+            if(energy)
+                energy_statistics_add(energy, esum, i);
+        }
     }
     walltime_measure("/Timeline/HalfKick/Short");
+    if(PMkick && !fusePM)
+        apply_PM_half_kick(CP, times, energy);
+    else if(fusePM && energy) {
+        int k;
+        for(k = 0; k < ENERGY_NSUM; k++)
+            energy->sum[k] += esum[k];
+    }
 }
 
 /* Apply half a hydro timestep kick.*/
 void
-apply_hydro_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime)
+apply_hydro_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime, const int PMkick)
 {
     int pa, bin;
+    const int fusePM = PMkick && can_fuse_PM_kick(act);
+    const double pmkick = fusePM ? PM_half_kick_factor(CP, times) : 0;
     double gravkick[TIMEBINS+1] = {0}, hydrokick[TIMEBINS+1] = {0};
     #pragma omp parallel for
     for(bin = times->mintimebin; bin <= TIMEBINS; bin++) {
@@ -978,20 +1177,23 @@ apply_hydro_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTime
             P[i].Ti_kick_hydro = times->Ti_kick[bin_hydro] + dti_from_timebin(bin_hydro)/2;
 #endif
         }
+        if(fusePM)
+            do_grav_short_range_kick(&P[i], P[i].GravPM, pmkick);
     }
     walltime_measure("/Timeline/HalfKick/Short");
+    if(PMkick && !fusePM)
+        apply_PM_half_kick(CP, times, NULL);
 }
 void
-apply_PM_half_kick(Cosmology * CP, DriftKickTimes * times)
+apply_PM_half_kick(Cosmology * CP, DriftKickTimes * times, struct EnergySums * energy)
 {
     /*Always do a PM half-kick, because this should be called just after a PM step*/
-    const inttime_t tistart = times->PM_kick;
-    const inttime_t tiend =  tistart + times->PM_length / 2;
     /* Do long-range kick */
     int i;
-    const double Fgravkick = get_exact_gravkick_factor(CP, tistart, tiend);
+    const double Fgravkick = PM_half_kick_factor(CP, times);
+    double esum[ENERGY_NSUM] = {0};
 
-    #pragma omp parallel for
+    #pragma omp parallel for reduction(+: esum[:ENERGY_NSUM])
     for(i = 0; i < PartManager->NumPart; i++)
     {
         int j;
@@ -999,8 +1201,12 @@ apply_PM_half_kick(Cosmology * CP, DriftKickTimes * times)
             continue;
         for(j = 0; j < 3; j++)	/* do the kick */
             P[i].Vel[j] += P[i].GravPM[j] * Fgravkick;
+        if(energy)
+            energy_statistics_add(energy, esum, i);
     }
-    times->PM_kick = tiend;
+    if(energy)
+        for(i = 0; i < ENERGY_NSUM; i++)
+            energy->sum[i] += esum[i];
     walltime_measure("/Timeline/HalfKick/Long");
 }
 
@@ -1104,6 +1310,16 @@ get_timestep_hydro_dloga(const int p, const inttime_t Ti_Current, const double a
             dt = dt_hsml;
             *titype = TI_HSML;
         }
+        /* Timestep limiter (Saitoh & Makino 2009): do not be too much longer than the neighbours,
+         * which could otherwise move through this particle's kernel or hit it with feedback between its force evaluations.*/
+        const int limitbin = SPHP(p).MinNgbTimeBin + TimestepParams.TimeBinLimiter;
+        if(TimestepParams.TimeBinLimiter > 0 && SPHP(p).MinNgbTimeBin > 0 && limitbin < TIMEBINS) {
+            double dt_limiter = get_dloga_for_bin(limitbin, Ti_Current) / hubble;
+            if(dt_limiter < dt) {
+                dt = dt_limiter;
+                *titype = TI_NEIGH;
+            }
+        }
     }
     else if(P[p].Type == 5)
     {
@@ -1219,6 +1435,7 @@ get_long_range_timestep_dloga(const double atime, const Cosmology * CP, const in
     int64_t count_sum[6] ={0};
     double v[6] = {0}, v_sum[6], mim[6], min_mass[6];
     double dloga = TimestepParams.MaxSizeTimestep;
+    int byasmth = 0;
 
     for(type = 0; type < 6; type++)
         mim[type] = 1.0e30;
@@ -1237,9 +1454,9 @@ get_long_range_timestep_dloga(const double atime, const Cosmology * CP, const in
         count[P[i].Type]++;
     }
 
-    MPI_Allreduce(v, v_sum, 6, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(mim, min_mass, 6, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
-    MPI_Allreduce(count, count_sum, 6, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(v, v_sum, 6, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    MPI_Allreduce(mim, min_mass, 6, MPI_DOUBLE, MPI_MIN, GadgetComm);
+    MPI_Allreduce(count, count_sum, 6, MPI_INT64, MPI_SUM, GadgetComm);
 
     /* add star, gas and black hole particles together to treat them on equal footing,
      * using the original gas particle spacing. */
@@ -1279,13 +1496,17 @@ get_long_range_timestep_dloga(const double atime, const Cosmology * CP, const in
                 type, dmean, asmth, min_mass[type], atime, sqrt(v_sum[type] / count_sum[type]), dloga1);
 
         /* don't constrain the step to the neutrinos */
-        if(type != FastParticleType && dloga1 < dloga)
+        if(type != FastParticleType && dloga1 < dloga) {
             dloga = dloga1;
+            byasmth = asmth < dmean;
+        }
     }
 
     if(dloga < TimestepParams.MinSizeTimestep) {
         dloga = TimestepParams.MinSizeTimestep;
+        byasmth = 0;
     }
+    PMStepSetByAsmth = byasmth;
 
     return dloga;
 }
@@ -1342,6 +1563,209 @@ inttime_t find_next_kick(inttime_t Ti_Current, int minTimeBin)
 
 static void print_timebin_statistics(const DriftKickTimes * const times, const int NumCurrentTiStep, int * TimeBinCountType, const double Time, const int64_t ActiveGravityCount);
 
+/* Particle indices ordered by timebin, so that the active particles can be found without looking
+ * at the inactive ones. The bins are in descending order, so the particles active on a step are a suffix
+ * of the sorted indices. Only active particles change bin, so at the next build only the suffix used by
+ * the last step needs sorting again. Particles added since the last build, and particles whose type
+ * changed to one with an inactive bin, wait unsorted at the top of Index until their bin is active.
+ * A particle is listed under its hydro bin if it is gas or a BH, which is never larger than
+ * its gravity bin, and under its gravity bin otherwise.
+ * The lists are rebuilt on the first step after the domain is decomposed, or if the particles are reordered.
+ * They are allocated at the top of the heap, above the domain, and persist between steps.*/
+static struct timebin_lists
+{
+    int * Index;
+    /* Sorted indices are in [0, NSorted), the unsorted ones in [MaxIndex - NExtra, MaxIndex)*/
+    int64_t MaxIndex;
+    int64_t NSorted;
+    int64_t NExtra;
+    /* Start of each bin in the sorted indices*/
+    int64_t BinStart[TIMEBINS+1];
+    /* Largest bin active at the last build. Particles up to this bin may have changed bin since.
+     * The unsorted particles are all in larger bins.*/
+    int DirtyBin;
+    /* Particles with larger indices were added after the last build*/
+    int64_t NumPartListed;
+    /* Number of live particles by type and bin, for the statistics*/
+    int Count[6 * (TIMEBINS+1)];
+    /* Particle table the lists are for, and its ReorderCount when they were built*/
+    const struct part_manager_type * pman;
+    int64_t ReorderCount;
+} TimeBinLists;
+
+static inline int
+timebin_list_key(const struct particle_data * pp)
+{
+    if(pp->Type == 0 || pp->Type == 5)
+        return pp->TimeBinHydro;
+    return pp->TimeBinGravity;
+}
+
+static int
+timebin_lists_valid(const struct part_manager_type * pman)
+{
+    return TimeBinLists.Index && TimeBinLists.pman == pman && TimeBinLists.ReorderCount == pman->ReorderCount;
+}
+
+void
+timebin_lists_free(void)
+{
+    if(TimeBinLists.Index)
+        myfree(TimeBinLists.Index);
+    TimeBinLists.Index = NULL;
+}
+
+void
+timebin_lists_remove_particle(const struct part_manager_type * pman, const int i)
+{
+    if(!timebin_lists_valid(pman) || i >= TimeBinLists.NumPartListed)
+        return;
+    const struct particle_data * pp = &pman->Base[i];
+    if(pp->IsGarbage || pp->Swallowed)
+        return;
+    /* Particles in the bins active at the last build are counted again at the next build*/
+    const int key = timebin_list_key(pp);
+    if(key <= TimeBinLists.DirtyBin)
+        return;
+    #pragma omp atomic
+    TimeBinLists.Count[(TIMEBINS + 1) * pp->Type + key]--;
+}
+
+/* Sort all the live particles into the lists*/
+static void
+timebin_lists_rebuild(const struct part_manager_type * pman)
+{
+    int64_t i;
+    int b;
+    timebin_lists_free();
+    TimeBinLists.Index = (int *) mymalloc2("TimeBinLists", pman->MaxPart * sizeof(int));
+    TimeBinLists.MaxIndex = pman->MaxPart;
+    TimeBinLists.NExtra = 0;
+    TimeBinLists.DirtyBin = -1;
+    TimeBinLists.NumPartListed = pman->NumPart;
+    TimeBinLists.pman = pman;
+    TimeBinLists.ReorderCount = pman->ReorderCount;
+
+    int64_t binsize[TIMEBINS+1] = {0};
+    int count[6 * (TIMEBINS+1)] = {0};
+    #pragma omp parallel for reduction(+: binsize[: TIMEBINS+1]) reduction(+: count[: 6 * (TIMEBINS+1)])
+    for(i = 0; i < pman->NumPart; i++) {
+        const struct particle_data * pp = &pman->Base[i];
+        if(pp->IsGarbage || pp->Swallowed)
+            continue;
+        const int key = timebin_list_key(pp);
+        binsize[key]++;
+        count[(TIMEBINS + 1) * pp->Type + key]++;
+    }
+    memcpy(TimeBinLists.Count, count, sizeof(count));
+    int64_t offset = 0;
+    for(b = TIMEBINS; b >= 0; b--) {
+        TimeBinLists.BinStart[b] = offset;
+        offset += binsize[b];
+        binsize[b] = TimeBinLists.BinStart[b];
+    }
+    TimeBinLists.NSorted = offset;
+    for(i = 0; i < pman->NumPart; i++) {
+        const struct particle_data * pp = &pman->Base[i];
+        if(pp->IsGarbage || pp->Swallowed)
+            continue;
+        TimeBinLists.Index[binsize[timebin_list_key(pp)]++] = i;
+    }
+}
+
+/* Sort again the particles in the bins active at the last build, as their bins may have changed.
+ * Removed particles are dropped and particles now in a larger bin join the unsorted particles.*/
+static void
+timebin_lists_resort(void)
+{
+    const int dirty = TimeBinLists.DirtyBin;
+    if(dirty < 0)
+        return;
+    const struct particle_data * Base = TimeBinLists.pman->Base;
+    const int64_t start = TimeBinLists.BinStart[dirty];
+    const int64_t n = TimeBinLists.NSorted - start;
+    int * sorted = TimeBinLists.Index + start;
+    int * tmp = (int *) mymalloc2("TimeBinSort", n * sizeof(int) + 1);
+    memcpy(tmp, sorted, n * sizeof(int));
+
+    int64_t binsize[TIMEBINS+1] = {0};
+    int64_t j;
+    int b, type;
+    for(type = 0; type < 6; type++)
+        for(b = 0; b <= dirty; b++)
+            TimeBinLists.Count[(TIMEBINS + 1) * type + b] = 0;
+    for(j = 0; j < n; j++) {
+        const struct particle_data * pp = &Base[tmp[j]];
+        const int key = timebin_list_key(pp);
+        const int live = !pp->IsGarbage && !pp->Swallowed;
+        if(key > dirty) {
+            /* If it was removed since the last build, this undoes the removal*/
+            TimeBinLists.Count[(TIMEBINS + 1) * pp->Type + key]++;
+            if(live)
+                TimeBinLists.Index[TimeBinLists.MaxIndex - ++TimeBinLists.NExtra] = tmp[j];
+            tmp[j] = -1;
+            continue;
+        }
+        if(!live) {
+            tmp[j] = -1;
+            continue;
+        }
+        binsize[key]++;
+        TimeBinLists.Count[(TIMEBINS + 1) * pp->Type + key]++;
+    }
+    int64_t offset = start;
+    for(b = dirty; b >= 0; b--) {
+        TimeBinLists.BinStart[b] = offset;
+        offset += binsize[b];
+        binsize[b] = TimeBinLists.BinStart[b];
+    }
+    TimeBinLists.NSorted = offset;
+    for(j = 0; j < n; j++) {
+        if(tmp[j] < 0)
+            continue;
+        TimeBinLists.Index[binsize[timebin_list_key(&Base[tmp[j]])]++] = tmp[j];
+    }
+    myfree(tmp);
+}
+
+/* Add the particles created or received since the last build to the unsorted particles*/
+static void
+timebin_lists_add_new(const struct part_manager_type * pman)
+{
+    int64_t i;
+    for(i = TimeBinLists.NumPartListed; i < pman->NumPart; i++) {
+        const struct particle_data * pp = &pman->Base[i];
+        if(pp->IsGarbage || pp->Swallowed)
+            continue;
+        TimeBinLists.Index[TimeBinLists.MaxIndex - ++TimeBinLists.NExtra] = i;
+        TimeBinLists.Count[(TIMEBINS + 1) * pp->Type + timebin_list_key(pp)]++;
+    }
+    TimeBinLists.NumPartListed = pman->NumPart;
+}
+
+/* Move the unsorted particles in active bins to the end of the sorted indices.
+ * Returns the start of the particles in the bins up to maxactive, which run to NSorted.*/
+static int64_t
+timebin_lists_activate(const int maxactive)
+{
+    const int64_t start = TimeBinLists.BinStart[maxactive];
+    const int64_t nextra = TimeBinLists.NExtra;
+    int * extra = TimeBinLists.Index + TimeBinLists.MaxIndex - nextra;
+    int * tmp = (int *) mymalloc2("TimeBinExtra", nextra * sizeof(int) + 1);
+    memcpy(tmp, extra, nextra * sizeof(int));
+    int64_t j;
+    TimeBinLists.NExtra = 0;
+    for(j = 0; j < nextra; j++) {
+        if(timebin_list_key(&TimeBinLists.pman->Base[tmp[j]]) <= maxactive)
+            TimeBinLists.Index[TimeBinLists.NSorted++] = tmp[j];
+        else
+            TimeBinLists.Index[TimeBinLists.MaxIndex - ++TimeBinLists.NExtra] = tmp[j];
+    }
+    myfree(tmp);
+    TimeBinLists.DirtyBin = maxactive;
+    return start;
+}
+
 /* mark the bins that will be active before the next kick*/
 void
 build_active_particles(ActiveParticles * act, const DriftKickTimes * const times, const int NumCurrentTiStep, const double Time, const struct part_manager_type * const PartManager)
@@ -1372,8 +1796,19 @@ build_active_particles(ActiveParticles * act, const DriftKickTimes * const times
         }
     }
     else {
-        /*We want a lockless algorithm which preserves the ordering of the particle list.*/
-        gadget_thread_arrays gthread = gadget_setup_thread_arrays("ActiveParticle", 0, PartManager->NumPart);
+        if(!timebin_lists_valid(PartManager))
+            timebin_lists_rebuild(PartManager);
+        else {
+            timebin_lists_resort();
+            timebin_lists_add_new(PartManager);
+        }
+        /* The particles in bins up to the largest active bin are active*/
+        int maxactive = TIMEBINS;
+        while(!is_timebin_active(maxactive, times->Ti_Current))
+            maxactive--;
+        const int64_t start = timebin_lists_activate(maxactive);
+        /*We want a lockless algorithm.*/
+        gadget_thread_arrays gthread = gadget_setup_thread_arrays("ActiveParticle", 0, TimeBinLists.NSorted - start);
 
         /* We enforce schedule static to imply monotonic, ensure that each thread executes on contiguous particles
         * and ensure no thread gets more than narr particles.*/
@@ -1385,19 +1820,20 @@ build_active_particles(ActiveParticles * act, const DriftKickTimes * const times
             size_t nthreadlocal = 0;
             int * activepartthread = gthread.srcs[tid];
             #pragma omp for schedule(static, gthread.schedsz) reduction(+: nactivegrav) reduction(+: nactivehydro) reduction(+: TimeBinCountType[: 6 * (TIMEBINS+1)])
-            for(i = 0; i < PartManager->NumPart; i++)
+            for(i = start; i < TimeBinLists.NSorted; i++)
             {
-                const int bin_hydro = PartManager->Base[i].TimeBinHydro;
-                const int bin_gravity = PartManager->Base[i].TimeBinGravity;
-                if(PartManager->Base[i].IsGarbage || PartManager->Base[i].Swallowed)
+                const int pi = TimeBinLists.Index[i];
+                const int bin_hydro = PartManager->Base[pi].TimeBinHydro;
+                const int bin_gravity = PartManager->Base[pi].TimeBinGravity;
+                if(PartManager->Base[pi].IsGarbage || PartManager->Base[pi].Swallowed)
                     continue;
-                const int type = PartManager->Base[i].Type;
+                const int type = PartManager->Base[pi].Type;
                 /* For now build active particles with either hydro or gravity active*/
                 const int hydro_particle = type == 0 || type == 5;
                 /* All particles must have been synced in drift. */
 #ifdef DEBUG
-                if (PartManager->Base[i].Ti_drift != times->Ti_Current) {
-                    endrun(5, "Particle %d type %d has drift time %lx not ti_current %lx!",i, type, PartManager->Base[i].Ti_drift, times->Ti_Current);
+                if (PartManager->Base[pi].Ti_drift != times->Ti_Current) {
+                    endrun(5, "Particle %d type %d has drift time %lx not ti_current %lx!",pi, type, PartManager->Base[pi].Ti_drift, times->Ti_Current);
                 }
 #endif
                 /* Make sure we only add hydro particles: the DM can have hydro bin 0
@@ -1408,7 +1844,7 @@ build_active_particles(ActiveParticles * act, const DriftKickTimes * const times
                     nactivegrav++;
                 if((hydro_active || gravity_active)) {
                     /* Store this particle in the ActiveSet for this thread*/
-                    activepartthread[nthreadlocal] = i;
+                    activepartthread[nthreadlocal] = pi;
                     nthreadlocal++;
     #ifdef DEBUG
                     if(nthreadlocal > gthread.total_size)
@@ -1417,10 +1853,7 @@ build_active_particles(ActiveParticles * act, const DriftKickTimes * const times
                     nactivehydro++;
                 }
                 /* Account gas and BHs to their hydro bin and other particles to their gravity bin*/
-                int bin = bin_gravity;
-                if(hydro_particle)
-                    bin = bin_hydro;
-                TimeBinCountType[(TIMEBINS + 1) * type + bin] ++;
+                TimeBinCountType[(TIMEBINS + 1) * type + timebin_list_key(&PartManager->Base[pi])] ++;
             }
             gthread.sizes[tid] = nthreadlocal;
         }
@@ -1429,6 +1862,14 @@ build_active_particles(ActiveParticles * act, const DriftKickTimes * const times
         act->NumActiveGravity = nactivegrav;
         act->NumActiveHydro = nactivehydro;
         act->Particles = PartManager->Base;
+        /* The lists are ordered by bin: put the active particles back in memory order*/
+        radix_sort_openmp(act->ActiveParticle, act->NumActiveParticle, sizeof(int), 0, sizeof(int));
+        /* The counts of the active bins are new, the inactive bins have not changed*/
+        int b;
+        for(i = 0; i < 6; i++)
+            for(b = maxactive + 1; b <= TIMEBINS; b++)
+                TimeBinCountType[(TIMEBINS + 1) * i + b] = TimeBinLists.Count[(TIMEBINS + 1) * i + b];
+        memcpy(TimeBinLists.Count, TimeBinCountType, 6 * (TIMEBINS+1) * sizeof(TimeBinCountType[0]));
         /* Shrink the ActiveParticle array. We still need extra space for star formation,
          * but we do not need space for the known-inactive particles*/
         act->ActiveParticle = (int *) myrealloc(act->ActiveParticle, sizeof(int)*(act->NumActiveParticle + PartManager->MaxPart - PartManager->NumPart));
@@ -1501,22 +1942,87 @@ void free_active_particles(ActiveParticles * act)
  * FdCPU the cumulative cpu-time consumption in various parts of the
  * code is stored.
  */
+static TimebinForecast Forecast;
+
+const TimebinForecast *
+get_timebin_forecast(void)
+{
+    return &Forecast;
+}
+
+double
+timebin_forecast_work_ratio(void)
+{
+    if(Forecast.PMWork <= 0 || Forecast.NextPMWork <= 0)
+        return 1;
+    return (double) Forecast.NextPMWork / Forecast.PMWork;
+}
+
+/* Update the forecast from the global occupancy of the bins on this step*/
+static void
+update_timebin_forecast(const DriftKickTimes * const times, const int64_t * tot_count_type)
+{
+    int64_t count[TIMEBINS+1] = {0};
+    int64_t active = 0;
+    int type, bin, maxbin = 0;
+    for(bin = 0; bin <= TIMEBINS; bin++) {
+        for(type = 0; type < 6; type++)
+            count[bin] += tot_count_type[(TIMEBINS+1) * type + bin];
+        if(count[bin] > 0)
+            maxbin = bin;
+        if(is_timebin_active(bin, times->Ti_Current))
+            active += count[bin];
+    }
+    /* The work of a PM step is wanted at the query on the next PM step, which comes before its particles are counted.
+     * So count the steps after the PM step.*/
+    if(is_PM_timestep(times))
+        Forecast.PMWork = 0;
+    else
+        Forecast.PMWork += active;
+
+    /* There is no step length on the first step*/
+    if(times->mintimebin <= 0) {
+        Forecast.NextActive = 0;
+        Forecast.Ti_NextFull = 0;
+        Forecast.NextPMWork = 0;
+        return;
+    }
+    const inttime_t next = times->Ti_Current + dti_from_timebin(times->mintimebin);
+    Forecast.NextActive = 0;
+    for(bin = 0; bin <= TIMEBINS; bin++)
+        if(is_timebin_active(bin, next))
+            Forecast.NextActive += count[bin];
+    /* Steps are spaced by the smallest bin and a bin is active when the time is a multiple of its length*/
+    const inttime_t dtimax = dti_from_timebin(maxbin > times->mintimebin ? maxbin : times->mintimebin);
+    Forecast.Ti_NextFull = (times->Ti_Current / dtimax + 1) * dtimax;
+    const inttime_t PM_end = times->PM_start + times->PM_length;
+    Forecast.NextPMWork = 0;
+    for(bin = 0; bin <= TIMEBINS; bin++) {
+        const inttime_t dti = dti_from_timebin(bin > times->mintimebin ? bin : times->mintimebin);
+        /* Number of times the bin is active strictly between the two PM steps*/
+        Forecast.NextPMWork += count[bin] * ((PM_end + times->PM_length - 1) / dti - PM_end / dti);
+    }
+}
+
 static void print_timebin_statistics(const DriftKickTimes * const times, const int NumCurrentTiStep, int * TimeBinCountType, const double Time, const int64_t ActiveGravityCount)
 {
     int i;
-    int64_t * tot_count_type = ta_malloc("totcounttype", int64_t, 6 * (TIMEBINS+1));
-    int64_t * tot_count_type_loc = ta_malloc("totcounttype_loc", int64_t, 6 * (TIMEBINS+1));
+    /* The active gravity count goes at the end, so one reduction does both*/
+    int64_t * tot_count_type = ta_malloc("totcounttype", int64_t, 6 * (TIMEBINS+1) + 1);
+    int64_t * tot_count_type_loc = ta_malloc("totcounttype_loc", int64_t, 6 * (TIMEBINS+1) + 1);
     #pragma omp parallel for
     for(i = 0; i < 6 * (TIMEBINS+1); i++) {
         tot_count_type_loc[i] = TimeBinCountType[i];
     }
-    MPI_Reduce(tot_count_type_loc, tot_count_type, 6 * (TIMEBINS+1), MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    tot_count_type_loc[6 * (TIMEBINS+1)] = ActiveGravityCount;
+    /* All ranks need the counts for the forecast*/
+    MPI_Allreduce(tot_count_type_loc, tot_count_type, 6 * (TIMEBINS+1) + 1, MPI_INT64, MPI_SUM, GadgetComm);
     myfree(tot_count_type_loc);
-    int64_t TotActiveGravityCount;
-    MPI_Reduce(&ActiveGravityCount, &TotActiveGravityCount, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    update_timebin_forecast(times, tot_count_type);
+    const int64_t TotActiveGravityCount = tot_count_type[6 * (TIMEBINS+1)];
 
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     /* Only do the work on the root rank*/
     if(ThisTask != 0) {
         myfree(tot_count_type);
@@ -47,9 +47,34 @@ void build_active_particles(ActiveParticles * act, const DriftKickTimes * const
 
 /* Free the active particle list if necessary*/
 void free_active_particles(ActiveParticles * act);
+
+/* Free the particle lists by timebin which build_active_particles keeps between steps.
+ * They are at the top of the heap, so must be freed before the domain is decomposed.*/
+void timebin_lists_free(void);
+/* Tell the timebin lists that particle i is about to be marked garbage or swallowed. Thread safe.*/
+void timebin_lists_remove_particle(const struct part_manager_type * pman, const int i);
 /* Get the current scale factor*/
 double get_atime(const inttime_t Ti_Current);
 
+/* Forecast of the active particle counts on the coming steps, assuming the particles keep their bins.
+ * Updated by build_active_particles and the same on all ranks.*/
+typedef struct TimebinForecast
+{
+    /* Particles active on the next step*/
+    int64_t NextActive;
+    /* Time of the next step on which every particle is active*/
+    inttime_t Ti_NextFull;
+    /* Active particles summed over the steps between the end of this PM step and the end of the next*/
+    int64_t NextPMWork;
+    /* Active particles summed over the steps since the last PM step*/
+    int64_t PMWork;
+} TimebinForecast;
+
+/* Get the forecast from the last call to build_active_particles*/
+const TimebinForecast * get_timebin_forecast(void);
+/* Predicted work of the next PM step relative to the work of the current one, or 1 if not known.*/
+double timebin_forecast_work_ratio(void);
+
 /* This function assigns new short-range timesteps to particles.
  * It will also advance the PM timestep and set the new timestep length.
  * Arguments:
@@ -60,16 +85,24 @@ double get_atime(const inttime_t Ti_Current);
  * Cosmology: to compute hubble scaling factors.
  * asmth: size of PM smoothing cell in internal units. asmth = All.Asmth * PartManager->BoxSize / Nmesh
  * isFirstTimeStep: Flags to do special things for BHs on first time step.
- * Returns 0 if success, 1 if timestep is bad.*/
-int find_timesteps(const ActiveParticles * act, DriftKickTimes * times, const double atime, int FastParticleType, const Cosmology * CP, const double asmth, const int isFirstTimeStep);
+ * The global minimum and maximum bins are reduced with nonblocking collectives:
+ * call find_timesteps_wait before using times->mintimebin for anything but the half kick.*/
+void find_timesteps(const ActiveParticles * act, DriftKickTimes * times, const double atime, int FastParticleType, const Cosmology * CP, const double asmth, const int isFirstTimeStep);
+/* Complete the reduction started by find_timesteps, setting the global min and max timebins.
+ * Returns 0 if success, non-zero if a timestep is bad.*/
+int find_timesteps_wait(DriftKickTimes * times);
 int find_hydro_timesteps(const ActiveParticles * act, DriftKickTimes * times, const double atime, const Cosmology * CP, const int isFirstTimeStep);
 
+struct EnergySums;
+
 /* Apply half a kick to the particles: short-range and long-range.
- * These functions sync drift and kick times.*/
-void apply_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime);
+ * These functions sync drift and kick times.
+ * If PMkick is set they also do the PM half-kick, in the same sweep when every particle is active.
+ * If energy is not NULL, the PM half-kick adds each particle to it once kicked.*/
+void apply_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime, const int PMkick, struct EnergySums * energy);
 /* Do hydro kick only*/
-void apply_hydro_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime);
-void apply_PM_half_kick(Cosmology * CP, DriftKickTimes * times);
+void apply_hydro_half_kick(const ActiveParticles * act, Cosmology * CP, DriftKickTimes * times, const double atime, const int PMkick);
+void apply_PM_half_kick(Cosmology * CP, DriftKickTimes * times, struct EnergySums * energy);
 
 int is_timebin_active(int i, inttime_t current);
 
@@ -85,6 +118,10 @@ DriftKickTimes init_driftkicktime(inttime_t Ti_Current);
 int is_PM_timestep(const DriftKickTimes * const times);
 
 void set_timestep_params(ParameterSet * ps);
+/* Change the bounds of the PM timestep during a run. A negative value keeps the current bound.*/
+void set_timestep_pm_bounds(const double MinSizeTimestep, const double MaxSizeTimestep);
+/* True if the last PM timestep was limited by the force split scale Asmth, so that a larger Asmth would lengthen it.*/
+int pm_timestep_set_by_asmth(void);
 
 /* Stored accelerations.*/
 struct grav_accel_store
@@ -4,12 +4,14 @@
 #include <stdlib.h>
 #include <omp.h>
 #include <alloca.h>
+#include <pthread.h>
 #include "utils.h"
 
 #include "treewalk.h"
 #include "partmanager.h"
 #include "domain.h"
 #include "forcetree.h"
+#include "walltime.h"
 
 #include <signal.h>
 #define BREAKPOINT raise(SIGTRAP)
@@ -21,15 +23,147 @@ static double ImportBufferBoost;
 /* 7/9/24: The code segfaults if the send/recv buffer is larger than 4GB in size.
  * Likely a 32-bit variable is overflowing but it is hard to debug. Easier to enforce a maximum buffer size.*/
 static size_t MaxExportBufferBytes = 3584*1024*1024L;
+/* If true, imported ghost queries which arrive during the primary treewalk are evaluated
+ * in between chunks of local work, and their results sent back immediately.*/
+static int OverlapImports = 1;
+/* If true, treewalks which opt in record which particles need no exports in the tree's export plan,
+ * and skip the toptree walk for these particles in later treewalks on the same tree.*/
+static int ReuseExportPlan = 1;
+/* Fraction by which the search radius is enlarged when making the tree's cached neighbour lists. 0 disables the cache.*/
+static double NgbCacheSkin = 0;
+/* If true, neighbour treewalks on the gas tree find pair separations from integer positions.*/
+static int IntPositions = 0;
+/* Order of the treewalk queue. The default keeps the particle order, which after star formation
+ * and slot garbage collection no longer follows the spatial order.*/
+enum TreeWalkQueueOrder {
+    QUEUE_PARTICLE_ORDER = 0,
+    /* Sort by the tree node containing the particle*/
+    QUEUE_TREE_LEAF_ORDER = 1,
+    /* Sort by the Peano-Hilbert key of the particle position*/
+    QUEUE_PEANO_ORDER = 2,
+    /* Most expensive particles first, by the interactions they needed when last active.
+     * As the queue is handed out dynamically this is a longest-processing-time schedule,
+     * so a few expensive particles do not leave one thread running after the others finish.*/
+    QUEUE_COST_ORDER = 3,
+};
+static int SortQueue = QUEUE_PARTICLE_ORDER;
+/* If true, treewalks which provide pack functions send their exported queries and results in a compact wire format.*/
+static int PackExports = 0;
+/* If true, main memory is shared between ranks on a node and treewalks which support it walk the trees of those ranks directly.*/
+static int SharedMemory = 0;
+/* If true, append statistics for every treewalk to the treewalk log file*/
+static int LogStats = 0;
+/* Treewalks with fewer than this many queued particles per rank, summed over all ranks,
+ * exchange their export counts only with the ranks they export to, instead of with an alltoall.*/
+static double SparseThreshold = 1;
+/* If true, treewalks give bitwise identical results at any thread count, at some cost in speed.*/
+static int Deterministic = 0;
+/* If true, the thread count of each treewalk label is tuned on its first calls, see ev_tune_update*/
+static int TuneThreads = 0;
+/* If true, and MPI provides MPI_THREAD_MULTIPLE, a communication thread drives the import and result
+ * requests during the primary treewalk, so the compute threads never call MPI. See ev_progress_thread.*/
+static int ProgressThread = 0;
+/* If true, the results of imported queries are written with MPI_Put straight into the export result buffer
+ * of the exporting rank, exposed as an RMA window, instead of with a send matched by a posted receive.*/
+static int ResultRMA = 0;
+
+/* Thread count tuning of the treewalks with one label*/
+#define TUNE_CALLS 2
+#define TUNE_NLABEL 64
+struct ThreadTune {
+    char label[32];
+    /* Thread count being measured, or the chosen count once settled*/
+    int nthreads;
+    int settled;
+    int ncalls;
+    /* Walk time and queued particles of the calls with this thread count, summed over ranks*/
+    double time;
+    double work;
+    double bestcost;
+    int bestthreads;
+};
+static struct ThreadTune ThreadTunes[TUNE_NLABEL];
+static int NThreadTunes;
+
+/* Tag for the sparse export counts. Consecutive rounds alternate between two tags, see ev_sparse_import_counts.*/
+#define TREEWALK_TAG_COUNTS 101920
+static int SparseRound = 0;
+/* Tags for the export fragments streamed after the first export round, and their results. See ev_stream_exports.*/
+#define TREEWALK_TAG_STREAM_QUERY 101924
+#define TREEWALK_TAG_STREAM_RESULT 101925
+/* Treewalk log file. Only open on rank 0. Set by treewalk_set_log, with the current step number.*/
+static FILE * LogFile = NULL;
+static int LogStep = 0;
+/* Interactions done by all treewalks on this rank*/
+static int64_t TotalInteractions = 0;
 
 /*Initialise global treewalk parameters*/
 void set_treewalk_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
         ImportBufferBoost = param_get_double(ps, "ImportBufferBoost");
-    MPI_Bcast(&ImportBufferBoost, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        OverlapImports = param_get_int(ps, "TreeWalkOverlapImports");
+        ReuseExportPlan = param_get_int(ps, "TreeWalkReuseExportPlan");
+        NgbCacheSkin = param_get_double(ps, "TreeWalkNgbCacheSkin");
+        IntPositions = param_get_int(ps, "TreeWalkIntPositions");
+        SortQueue = param_get_int(ps, "TreeWalkSortQueue");
+        PackExports = param_get_int(ps, "TreeWalkPackExports");
+        LogStats = param_get_int(ps, "TreeWalkLogStats");
+        SharedMemory = param_get_int(ps, "TreeWalkSharedMemory");
+        SparseThreshold = param_get_double(ps, "TreeWalkSparseThreshold");
+        Deterministic = param_get_int(ps, "TreeWalkDeterministic");
+        TuneThreads = param_get_int(ps, "TreeWalkTuneThreads");
+        ProgressThread = param_get_int(ps, "TreeWalkProgressThread");
+        ResultRMA = param_get_int(ps, "TreeWalkResultRMA");
+        int provided;
+        MPI_Query_thread(&provided);
+        if(ProgressThread && provided < MPI_THREAD_MULTIPLE) {
+            message(0, "TreeWalkProgressThread needs MPI_THREAD_MULTIPLE, which MPI did not provide. Set GADGET_MPI_THREAD_MULTIPLE in the environment to request it. Disabling.\n");
+            ProgressThread = 0;
+        }
+    }
+    MPI_Bcast(&ImportBufferBoost, 1, MPI_DOUBLE, 0, GadgetComm);
+    MPI_Bcast(&OverlapImports, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&ReuseExportPlan, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&NgbCacheSkin, 1, MPI_DOUBLE, 0, GadgetComm);
+    MPI_Bcast(&IntPositions, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&SortQueue, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&PackExports, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&LogStats, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&SharedMemory, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&SparseThreshold, 1, MPI_DOUBLE, 0, GadgetComm);
+    MPI_Bcast(&Deterministic, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&TuneThreads, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&ProgressThread, 1, MPI_INT, 0, GadgetComm);
+    MPI_Bcast(&ResultRMA, 1, MPI_INT, 0, GadgetComm);
+}
+
+int treewalk_shared_memory_on(void)
+{
+    return SharedMemory;
+}
+
+double treewalk_ngb_cache_skin(void)
+{
+    return NgbCacheSkin;
+}
+
+int treewalk_int_positions_on(void)
+{
+    return IntPositions;
+}
+
+int treewalk_log_on(void)
+{
+    return LogStats;
+}
+
+void treewalk_set_log(FILE * fd, const int step)
+{
+    LogFile = fd;
+    LogStep = step;
 }
 
 /* This function is to allow a test which fills up the exchange buffer*/
@@ -38,14 +172,21 @@ void treewalk_set_max_export_buffer(const size_t maxbuf)
     MaxExportBufferBytes = maxbuf;
 }
 
-static void ev_primary(TreeWalk * tw);
-static int ev_ndone(TreeWalk * tw, MPI_Comm comm);
+struct ImportOverlap;
+static void ev_primary(TreeWalk * tw, struct ImportOverlap * ov);
+static void treewalk_write_log(const TreeWalk * tw, const double * times0);
 
 static int
 ngb_treefind_threads(TreeWalkQueryBase * I,
         TreeWalkNgbIterBase * iter,
         int startnode,
         LocalTreeWalk * lv);
+static int
+ngb_treefind_hmax(TreeWalkQueryBase * I,
+        TreeWalkNgbIterBase * iter,
+        const double radius,
+        int numcand,
+        LocalTreeWalk * lv);
 
 #ifdef DEBUG
 /*
@@ -62,11 +203,19 @@ ev_init_thread(TreeWalk * const tw, LocalTreeWalk * lv)
 {
     const size_t thread_id = omp_get_thread_num();
     lv->tw = tw;
+    lv->tree = tw->tree;
+    lv->Parts = P;
     lv->maxNinteractions = 0;
     lv->minNinteractions = 1L<<45;
     lv->Ninteractions = 0;
+    lv->NExportPlanHits = 0;
+    lv->NExtentCulls = 0;
+    lv->NNgbCacheHits = 0;
     lv->Nexport = 0;
     lv->NThisParticleExport = 0;
+    lv->NThisParticleNodes = 0;
+    lv->NThisParticleExtentCulls = 0;
+    lv->NExportSkip = 0;
     lv->nodelistindex = 0;
     if(tw->ExportTable_thread)
         lv->DataIndexTable = tw->ExportTable_thread[thread_id];
@@ -76,12 +225,21 @@ ev_init_thread(TreeWalk * const tw, LocalTreeWalk * lv)
         lv->ngblist = tw->Ngblist + thread_id * tw->tree->NumParticles;
 }
 
+static void
+ev_print_balance(const char * label, const double * v)
+{
+    int NTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    message(0, "Treewalk %s iter %ld: total part %ld max/MPI: %ld min/MPI: %ld balance: %g query %ld result %ld BunchSize %ld.\n",
+            label, (int64_t) v[0], (int64_t) v[1], (int64_t) v[2], (int64_t) v[3], v[2]/((v[1]+0.001)/NTask), (int64_t) v[4], (int64_t) v[5], (int64_t) v[6]);
+}
+
 static void
 ev_begin(TreeWalk * tw, int * active_set, const size_t size)
 {
     /* Needs to be 64-bit so that the multiplication in Ngblist malloc doesn't overflow*/
     const size_t NumThreads = omp_get_max_threads();
-    MPI_Comm_size(MPI_COMM_WORLD, &tw->NTask);
+    MPI_Comm_size(GadgetComm, &tw->NTask);
     /* The last argument is may_have_garbage: in practice the only
      * trivial haswork is the gravtree. This has no (active) garbage because
      * the active list was just rebuilt, but on a PM step the active list is NULL
@@ -96,7 +254,22 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
     /* Start first iteration at the beginning*/
     tw->WorkSetStart = 0;
 
-    if(!tw->NoNgblist)
+    /* The export plan is only valid for a symmetric walk if it covers the hmax of all remote toptree leaves.*/
+    tw->MaxRemoteHmax = 0;
+    if(tw->UseExportPlan && tw->tree->ExportPlan && tw->tree->hmax_computed_flag) {
+        const ForceTree * tree = tw->tree;
+        int i;
+        for(i = 0; i < tree->NTopLeaves; i++) {
+            if(tree->TopLeaves[i].Task == tree->ThisTask)
+                continue;
+            const double hmax = tree->Nodes[tree->TopLeaves[i].treenode].mom.hmax;
+            if(hmax > tw->MaxRemoteHmax)
+                tw->MaxRemoteHmax = hmax;
+        }
+    }
+
+    /* The neighbour cache is filled from the neighbour list, so walks using it need one.*/
+    if(!tw->NoNgblist || (tw->UseNgbCache && tw->tree->NgbCache))
         tw->Ngblist = (int*) mymalloc("Ngblist", tw->tree->NumParticles * NumThreads * sizeof(int));
     else
         tw->Ngblist = NULL;
@@ -108,6 +281,14 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
     if(tw->result_type_elsize % 8 != 0)
         endrun(0, "Result structure has size %ld, not aligned to 64-bit boundary.\n", tw->result_type_elsize);
 
+    /* Choose the format used to send queries and results to other ranks*/
+    tw->PackQueries = PackExports && tw->pack_query && tw->unpack_query;
+    tw->PackResults = PackExports && tw->pack_result && tw->unpack_result;
+    tw->query_wire_elsize = tw->PackQueries ? tw->query_packed_elsize : tw->query_type_elsize;
+    tw->result_wire_elsize = tw->PackResults ? tw->result_packed_elsize : tw->result_type_elsize;
+    if(tw->query_wire_elsize % 8 != 0 || tw->result_wire_elsize % 8 != 0)
+        endrun(0, "Packed query (%ld) or result (%ld) not aligned to 64-bit boundary.\n", tw->query_wire_elsize, tw->result_wire_elsize);
+
     /*The amount of memory eventually allocated per tree buffer*/
     size_t bytesperbuffer = sizeof(struct data_index) + tw->query_type_elsize + tw->result_type_elsize;
     /*This memory scales like the number of imports. In principle this could be much larger than Nexport
@@ -128,13 +309,16 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
         endrun(1231245, "Not enough free memory in %s to export particles: needed %ld bytes have %ld. can export %ld \n", tw->ev_label, bytesperbuffer, freebytes, tw->BunchSize);
     }
 
-    /* Print some balance numbers*/
-    int64_t nmin, nmax, total;
-    MPI_Reduce(&tw->WorkSetSize, &nmin, 1, MPI_INT64, MPI_MIN, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->WorkSetSize, &nmax, 1, MPI_INT64, MPI_MAX, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->WorkSetSize, &total, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    message(0, "Treewalk %s iter %ld: total part %ld max/MPI: %ld min/MPI: %ld balance: %g query %ld result %ld BunchSize %ld.\n",
-            tw->ev_label, tw->Niteration, total, nmax, nmin, (double)nmax/((total+0.001)/tw->NTask), tw->query_type_elsize, tw->result_type_elsize, tw->BunchSize);
+    /* The total is needed on every rank to choose the count exchange.*/
+    int64_t total;
+    MPI_Allreduce(&tw->WorkSetSize, &total, 1, MPI_INT64, MPI_SUM, GadgetComm);
+    /* On deep timebins only a few particles (usually black holes) are active, and most ranks export nothing.
+     * The alltoall of the export counts then dominates the walk, so exchange them sparsely.*/
+    tw->SparseCounts = total < SparseThreshold * tw->NTask;
+    /* Print some balance numbers, once reduced with the other diagnostics of the step*/
+    const double balance[7] = {tw->Niteration, total, tw->WorkSetSize, tw->WorkSetSize, tw->query_type_elsize, tw->result_type_elsize, tw->BunchSize};
+    const enum DiagOp balanceops[7] = {DIAG_MAX, DIAG_MAX, DIAG_MAX, DIAG_MIN, DIAG_MAX, DIAG_MAX, DIAG_MIN};
+    diagnostics_add(tw->ev_label, balance, balanceops, 7, ev_print_balance);
 
     report_memory_usage(tw->ev_label);
 }
@@ -169,6 +353,50 @@ treewalk_init_query(TreeWalk * tw, TreeWalkQueryBase * query, int i, const int *
     tw->fill(i, query, tw);
 }
 
+/* Convert a query to the packed wire format. The node list entries must fit in 16-bit offsets from the first entry:
+ * this is guaranteed by treewalk_export_particle.*/
+static void
+treewalk_pack_query(TreeWalk * tw, const TreeWalkQueryBase * query, TreeWalkPackedQueryBase * packed)
+{
+    const ForceTree * tree = tw->tree;
+    const struct NODE * node = &tree->Nodes[query->NodeList[0]];
+    int d;
+    for(d = 0; d < 3; d++)
+        packed->Pos[d] = NEAREST(query->Pos[d] - node->center[d], tree->BoxSize);
+    packed->NodeList0 = query->NodeList[0];
+    for(d = 1; d < NODELISTLENGTH; d++)
+        packed->NodeListDelta[d-1] = query->NodeList[d] >= 0 ? query->NodeList[d] - query->NodeList[0] : PACKED_NODELIST_END;
+#ifdef DEBUG
+    packed->ID = query->ID;
+#endif
+    tw->pack_query(query, packed, tw);
+}
+
+/* Convert a query from the packed wire format*/
+static void
+treewalk_unpack_query(TreeWalk * tw, const TreeWalkPackedQueryBase * packed, TreeWalkQueryBase * query)
+{
+    const ForceTree * tree = tw->tree;
+    const struct NODE * node = &tree->Nodes[packed->NodeList0];
+    int d;
+    for(d = 0; d < 3; d++) {
+        double pos = node->center[d] + packed->Pos[d];
+        /* Wrap back into the box*/
+        while(pos < 0)
+            pos += tree->BoxSize;
+        while(pos >= tree->BoxSize)
+            pos -= tree->BoxSize;
+        query->Pos[d] = pos;
+    }
+    query->NodeList[0] = packed->NodeList0;
+    for(d = 1; d < NODELISTLENGTH; d++)
+        query->NodeList[d] = packed->NodeListDelta[d-1] != PACKED_NODELIST_END ? packed->NodeList0 + packed->NodeListDelta[d-1] : -1;
+#ifdef DEBUG
+    query->ID = packed->ID;
+#endif
+    tw->unpack_query(packed, query, tw);
+}
+
 static void
 treewalk_init_result(TreeWalk * tw, TreeWalkResultBase * result, TreeWalkQueryBase * query)
 {
@@ -189,12 +417,57 @@ treewalk_reduce_result(TreeWalk * tw, TreeWalkResultBase * result, int i, enum T
 #endif
 }
 
+struct QueueKey
+{
+    peano_t key;
+    int index;
+};
+
+/* Sort the WorkSet spatially, so that neighbouring queue entries walk overlapping parts of the tree
+ * and the threads re-use the cached tree nodes and neighbours, or by decreasing cost.
+ * Ties are broken by particle index so the ordering is deterministic.*/
+static void
+treewalk_sort_queue(TreeWalk * tw)
+{
+    const ForceTree * tree = tw->tree;
+    int mode = SortQueue;
+    /* Buckets are formed from consecutive particles in the same tree leaf*/
+    if(tw->type == TREEWALK_BUCKET)
+        mode = QUEUE_TREE_LEAF_ORDER;
+    /* The tree leaves are only known if the tree stored the father of each particle*/
+    if(mode == QUEUE_TREE_LEAF_ORDER && !tree->Father)
+        mode = QUEUE_PEANO_ORDER;
+    struct QueueKey * keys = (struct QueueKey *) mymalloc("QueueKeys", tw->WorkSetSize * sizeof(struct QueueKey));
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < tw->WorkSetSize; i++) {
+        const int p_i = tw->WorkSet[i];
+        keys[i].index = p_i;
+        if(mode == QUEUE_TREE_LEAF_ORDER && p_i < tree->nfather)
+            keys[i].key = tree->Father[p_i];
+        else if(mode == QUEUE_COST_ORDER)
+            keys[i].key = ~((peano_t) P[p_i].GravCost + (peano_t) P[p_i].NgbCost);
+        else
+            keys[i].key = PEANO(P[p_i].Pos, tree->BoxSize);
+    }
+    /* Sort by key, then by index: two passes of the stable radix sort, least significant first.*/
+    radix_sort_openmp(keys, tw->WorkSetSize, sizeof(struct QueueKey), offsetof(struct QueueKey, index), sizeof(int));
+    radix_sort_openmp(keys, tw->WorkSetSize, sizeof(struct QueueKey), offsetof(struct QueueKey, key), sizeof(peano_t));
+    #pragma omp parallel for
+    for(i = 0; i < tw->WorkSetSize; i++)
+        tw->WorkSet[i] = keys[i].index;
+    myfree(keys);
+}
+
 void
 treewalk_build_queue(TreeWalk * tw, int * active_set, const size_t size, int may_have_garbage)
 {
     tw->NThread = omp_get_max_threads();
+    /* Sorting needs the tree, which is not set if we only want the list of active particles*/
+    const int sort_queue = (SortQueue != QUEUE_PARTICLE_ORDER || tw->type == TREEWALK_BUCKET) && tw->tree;
 
-    if(!tw->haswork && !may_have_garbage)
+    /* If the queue is sorted we need our own copy of the active set*/
+    if(!tw->haswork && !may_have_garbage && !sort_queue)
     {
         tw->WorkSetSize = size;
         tw->WorkSet = active_set;
@@ -258,61 +531,530 @@ treewalk_build_queue(TreeWalk * tw, int * active_set, const size_t size, int may
     }
 #endif
     tw->WorkSetSize = nqueue;
+    if(sort_queue && tw->WorkSetSize > 1)
+        treewalk_sort_queue(tw);
+}
+
+struct ImpExpCounts
+{
+    int64_t * Export_count;
+    int64_t * Import_count;
+    int64_t * Export_offset;
+    int64_t * Import_offset;
+    /* Offset of our imports from each rank in the export buffer of that rank. Used to put results with RMA.*/
+    int64_t * Import_remote_offset;
+    MPI_Comm comm;
+    int NTask;
+    /* Number of particles exported to this processor*/
+    size_t Nimport;
+    /* Number of particles exported from this processor*/
+    size_t Nexport;
+    /* Number of processors which finished their toptree walk this round*/
+    int Ndone;
+};
+
+struct CommBuffer
+{
+    char * databuf;
+    int * rqst_task;
+    MPI_Request * rdata_all;
+    int nrequest_all;
+    /* If true, databuf is exposed in win, in a passive target epoch opened with MPI_Win_lock_all*/
+    int rma;
+    MPI_Win win;
+};
+
+void alloc_commbuffer(struct CommBuffer * buffer, int NTask, int alloc_high)
+{
+    if(alloc_high) {
+        buffer->rdata_all = ta_malloc2("requests", MPI_Request, NTask);
+        buffer->rqst_task = ta_malloc2("rqst", int, NTask);
+    }
+    else {
+        buffer->rdata_all = ta_malloc("requests", MPI_Request, NTask);
+        buffer->rqst_task = ta_malloc("rqst", int, NTask);
+    }
+    buffer->nrequest_all = 0;
+    buffer->databuf = NULL;
 }
 
-/* returns struct containing export counts */
+void free_impexpcount(struct ImpExpCounts * count)
+{
+    ta_free(count->Export_count);
+}
+
+void free_commbuffer(struct CommBuffer * buffer)
+{
+    if(buffer->databuf) {
+        myfree(buffer->databuf);
+        buffer->databuf = NULL;
+    }
+    ta_free(buffer->rqst_task);
+    ta_free(buffer->rdata_all);
+}
+
+/* State for evaluating imported ghost queries while the primary treewalk is running.
+ * The master thread polls the import requests between chunks of local work
+ * and appends newly arrived buffers to the ready list. Any thread may then claim
+ * chunks of a ready buffer. When a buffer is fully evaluated the master thread
+ * sends the results back, so the exporting rank does not need to wait for our primary to complete.*/
+struct ImportOverlap
+{
+    struct CommBuffer * imports;
+    struct CommBuffer * res_imports;
+    struct ImpExpCounts * counts;
+    MPI_Datatype result_type;
+    /* Window of the export result buffers, or MPI_WIN_NULL to send the results*/
+    MPI_Win result_win;
+    /* Request indices of the import buffers which have arrived, in order of arrival.*/
+    int * ready;
+    int nready;
+    /* Number of queries of each import request handed out to a thread.*/
+    int64_t * claimed;
+    /* Number of queries of each import request which have been evaluated.*/
+    int64_t * finished;
+    /* Flags whether the results for each import request have been sent back.*/
+    int * sent;
+    int nsent;
+    /* If true a communication thread, not the master thread, polls the requests. See ev_progress_thread.*/
+    int progress;
+    /* Requests of our exports and their results, tested by the communication thread to drive their progress*/
+    struct CommBuffer * exports;
+    struct CommBuffer * res_exports;
+    /* Size of the chunks of ghost queries handed out to threads*/
+    int64_t chnksz;
+};
+
+/* Evaluate a range of imported queries into the corresponding result buffer.
+ * The buffers are in the wire format, so packed queries are unpacked and results packed as needed.*/
+static void
+ev_secondary_range(TreeWalk * tw, LocalTreeWalk * lv, char * databufstart, char * dataresultstart, const int64_t start, const int64_t end)
+{
+    TreeWalkQueryBase * unpacked = tw->PackQueries ? (TreeWalkQueryBase *) alloca(tw->query_type_elsize) : NULL;
+    TreeWalkResultBase * unpackedres = tw->PackResults ? (TreeWalkResultBase *) alloca(tw->result_type_elsize) : NULL;
+    int64_t j;
+    for(j = start; j < end; j++) {
+        TreeWalkQueryBase * input = (TreeWalkQueryBase *) (databufstart + j * tw->query_wire_elsize);
+        TreeWalkResultBase * output = (TreeWalkResultBase *) (dataresultstart + j * tw->result_wire_elsize);
+        if(tw->PackQueries) {
+            treewalk_unpack_query(tw, (TreeWalkPackedQueryBase *) input, unpacked);
+            input = unpacked;
+        }
+        if(tw->PackResults) {
+            TreeWalkResultBase * packed = output;
+            output = unpackedres;
+            treewalk_init_result(tw, output, input);
+            lv->target = -1;
+            tw->visit(input, output, lv);
+#ifdef DEBUG
+            packed->ID = output->ID;
+#endif
+            tw->pack_result(output, packed, tw);
+            continue;
+        }
+        treewalk_init_result(tw, output, input);
+        lv->target = -1;
+        tw->visit(input, output, lv);
+    }
+}
+
+/* Send the evaluated results for the imports from task back. Not thread safe: must be called from the master thread.
+ * If win is not MPI_WIN_NULL the results are put directly into the export result buffer of task.*/
+static void
+ev_send_import_result(struct CommBuffer * res_imports, struct ImpExpCounts * counts, TreeWalk * tw, const int task, MPI_Datatype type, MPI_Win win)
+{
+    char * dataresultstart = res_imports->databuf + counts->Import_offset[task] * tw->result_wire_elsize;
+    if(win != MPI_WIN_NULL) {
+        MPI_Put(dataresultstart, counts->Import_count[task], type, task, counts->Import_remote_offset[task], counts->Import_count[task], type, win);
+        return;
+    }
+    res_imports->rqst_task[res_imports->nrequest_all] = task;
+    MPI_Isend(dataresultstart, counts->Import_count[task], type, task, 101923, counts->comm, &res_imports->rdata_all[res_imports->nrequest_all++]);
+}
+
+/* Send back the results of any imports which have been fully evaluated.
+ * Must be called from the master thread only, as we use MPI_THREAD_FUNNELED,
+ * or from the communication thread only, if there is one.*/
+static void
+ev_send_finished_imports(TreeWalk * tw, struct ImportOverlap * ov)
+{
+    int nready;
+    #pragma omp atomic read
+    nready = ov->nready;
+
+    int r;
+    for(r = 0; r < nready; r++) {
+        const int i = ov->ready[r];
+        if(ov->sent[i])
+            continue;
+        int64_t finished;
+        #pragma omp atomic read
+        finished = ov->finished[i];
+        const int task = ov->imports->rqst_task[i];
+        if(finished < ov->counts->Import_count[task])
+            continue;
+        ev_send_import_result(ov->res_imports, ov->counts, tw, task, ov->result_type, ov->result_win);
+        ov->sent[i] = 1;
+        ov->nsent++;
+    }
+}
+
+/* Check for newly arrived imports and send back the results of any completed imports.
+ * Must be called from the master thread only, as we use MPI_THREAD_FUNNELED,
+ * or from the communication thread only, if there is one.*/
+static void
+ev_poll_imports(TreeWalk * tw, struct ImportOverlap * ov)
+{
+    const int nready = ov->nready;
+    if(nready < ov->imports->nrequest_all) {
+        int outcount = MPI_UNDEFINED;
+        /* Completed requests are written directly to the end of the ready list,
+         * and only become visible to other threads once nready is updated.*/
+        MPI_Testsome(ov->imports->nrequest_all, ov->imports->rdata_all, &outcount, ov->ready + nready, MPI_STATUSES_IGNORE);
+        if(outcount != MPI_UNDEFINED && outcount > 0) {
+            #pragma omp atomic write
+            ov->nready = nready + outcount;
+        }
+    }
+    ev_send_finished_imports(tw, ov);
+}
+
+/* Arguments of the communication thread*/
+struct ProgressThreadArgs
+{
+    TreeWalk * tw;
+    struct ImportOverlap * ov;
+};
+
+/* Communication thread: polls the import requests, publishing arrived buffers to the ready list
+ * for the compute threads, and sends back each buffer's results once they are evaluated.
+ * It also tests our own export and result requests, so they progress without hardware support.
+ * Exits once the results of every import have been sent. It is the only thread calling MPI
+ * while the primary treewalk runs. It does not use OpenMP.*/
+static void *
+ev_progress_thread(void * arg)
+{
+    struct ProgressThreadArgs * pa = (struct ProgressThreadArgs *) arg;
+    struct ImportOverlap * ov = pa->ov;
+    while(ov->nsent < ov->imports->nrequest_all) {
+        ev_poll_imports(pa->tw, ov);
+        int flag;
+        MPI_Testall(ov->exports->nrequest_all, ov->exports->rdata_all, &flag, MPI_STATUSES_IGNORE);
+        MPI_Testall(ov->res_exports->nrequest_all, ov->res_exports->rdata_all, &flag, MPI_STATUSES_IGNORE);
+    }
+    return NULL;
+}
+
+/* True if some import buffers have not yet arrived*/
+static int
+ev_imports_pending(const struct ImportOverlap * ov)
+{
+    int nready;
+    #pragma omp atomic read
+    nready = ov->nready;
+    return nready < ov->imports->nrequest_all;
+}
+
+/* Claim and evaluate a chunk of ghost queries from an import buffer which has arrived.
+ * cursor is the thread-local position in the ready list before which all buffers are fully claimed.
+ * Returns 1 if some work was done, 0 if there were no ghost queries left to claim.*/
+static int
+ev_ghost_work(TreeWalk * tw, LocalTreeWalk * lv, struct ImportOverlap * ov, int * cursor)
+{
+    int nready;
+    #pragma omp atomic read
+    nready = ov->nready;
+
+    for(; *cursor < nready; (*cursor)++) {
+        const int i = ov->ready[*cursor];
+        const int task = ov->imports->rqst_task[i];
+        const int64_t nimports_task = ov->counts->Import_count[task];
+        const int64_t start = atomic_fetch_and_add_64(&ov->claimed[i], ov->chnksz);
+        if(start >= nimports_task)
+            continue;
+        int64_t end = start + ov->chnksz;
+        if(end > nimports_task)
+            end = nimports_task;
+        char * databufstart = ov->imports->databuf + ov->counts->Import_offset[task] * tw->query_wire_elsize;
+        char * dataresultstart = ov->res_imports->databuf + ov->counts->Import_offset[task] * tw->result_wire_elsize;
+        ev_secondary_range(tw, lv, databufstart, dataresultstart, start, end);
+        atomic_fetch_and_add_64(&ov->finished[i], end - start);
+        return 1;
+    }
+    return 0;
+}
+
+/* Stride between the work-stealing ranges of different threads, so each is on its own cache line.*/
+#define STEAL_STRIDE 8
+/* A work-stealing range is stored as a single 64-bit integer so it can be updated with one compare-and-swap.
+ * The start is in the high 32 bits and the end in the low 32 bits.*/
+#define STEAL_PACK(lo, hi) ((((int64_t) (lo)) << 32) | ((int64_t) (hi)))
+#define STEAL_LO(range) ((range) >> 32)
+#define STEAL_HI(range) ((range) & 0xffffffffL)
+
+/* Get the next range of the WorkSet to evaluate from the work-stealing scheduler.
+ * Each thread owns a contiguous range of the WorkSet and takes grain particles at a time from the front.
+ * A thread whose range is empty steals the back half of the largest remaining range of another thread.
+ * Ranges can thus be split down to single particles, so one expensive chunk does not leave the other threads idle.
+ * Returns 0 when there is no work left.*/
+static int
+ev_steal_work(int64_t * ranges, const int tid, const int NThread, const int64_t grain, int64_t * start, int64_t * end)
+{
+    int64_t * own = ranges + tid * STEAL_STRIDE;
+    while(1) {
+        /* Take work from the front of our own range*/
+        int64_t old = __atomic_load_n(own, __ATOMIC_RELAXED);
+        const int64_t lo = STEAL_LO(old), hi = STEAL_HI(old);
+        if(lo < hi) {
+            int64_t newlo = lo + grain;
+            if(newlo > hi)
+                newlo = hi;
+            if(__atomic_compare_exchange_n(own, &old, STEAL_PACK(newlo, hi), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *start = lo;
+                *end = newlo;
+                return 1;
+            }
+            /* Someone stole from us, try again*/
+            continue;
+        }
+        /* Find the thread with the most work left*/
+        int victim = -1, t;
+        int64_t vold = 0, maxleft = 0;
+        for(t = 0; t < NThread; t++) {
+            if(t == tid)
+                continue;
+            const int64_t range = __atomic_load_n(ranges + t * STEAL_STRIDE, __ATOMIC_RELAXED);
+            const int64_t left = STEAL_HI(range) - STEAL_LO(range);
+            if(left > maxleft) {
+                maxleft = left;
+                victim = t;
+                vold = range;
+            }
+        }
+        if(victim < 0)
+            return 0;
+        /* Steal the back half of the range, rounding up so we can steal the last particle.
+         * Stolen particles are never returned to a range, so the packed range cannot take the same value twice.*/
+        const int64_t vlo = STEAL_LO(vold), vhi = STEAL_HI(vold);
+        const int64_t newhi = vhi - (vhi - vlo + 1)/2;
+        if(__atomic_compare_exchange_n(ranges + victim * STEAL_STRIDE, &vold, STEAL_PACK(vlo, newhi), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            __atomic_store_n(own, STEAL_PACK(newhi, vhi), __ATOMIC_RELAXED);
+    }
+}
+
+/* Evaluate a range of the WorkSet in buckets of particles which share a tree leaf.
+ * The WorkSet is sorted by tree leaf for bucketed treewalks, so these are consecutive.
+ * input and output have space for TREEWALK_BUCKET_MAX queries and results.*/
+static void
+ev_primary_buckets(TreeWalk * tw, LocalTreeWalk * lv, char * input, char * output, const int64_t start, const int64_t end)
+{
+    const ForceTree * tree = tw->tree;
+    int64_t k = start;
+    while(k < end) {
+        int nquery = 0;
+        int father = -1;
+        while(k + nquery < end && nquery < TREEWALK_BUCKET_MAX) {
+            const int i = tw->WorkSet ? tw->WorkSet[k + nquery] : k + nquery;
+            const int thisfather = (tree->Father && i < tree->nfather) ? tree->Father[i] : -1;
+            if(nquery > 0 && (thisfather < 0 || thisfather != father))
+                break;
+            father = thisfather;
+            TreeWalkQueryBase * query = (TreeWalkQueryBase *) (input + nquery * tw->query_type_elsize);
+            TreeWalkResultBase * result = (TreeWalkResultBase *) (output + nquery * tw->result_type_elsize);
+            treewalk_init_query(tw, query, i, NULL);
+            treewalk_init_result(tw, result, query);
+            nquery++;
+            /* Particles not in the tree have no bucket*/
+            if(thisfather < 0)
+                break;
+        }
+        lv->target = tw->WorkSet ? tw->WorkSet[k] : k;
+        tw->visit_bucket((TreeWalkQueryBase *) input, (TreeWalkResultBase *) output, nquery, lv);
+        int q;
+        for(q = 0; q < nquery; q++) {
+            const int i = tw->WorkSet ? tw->WorkSet[k + q] : k + q;
+            treewalk_reduce_result(tw, (TreeWalkResultBase *) (output + q * tw->result_type_elsize), i, TREEWALK_PRIMARY);
+        }
+        k += nquery;
+    }
+}
+
+/* returns struct containing export counts.
+ * If ov is not NULL, imported ghost queries are evaluated as they arrive, interleaved with the local work.*/
 static void
-ev_primary(TreeWalk * tw)
+ev_primary(TreeWalk * tw, struct ImportOverlap * ov)
 {
     int64_t maxNinteractions = 0, minNinteractions = 1L << 45, Ninteractions=0;
-#pragma omp parallel reduction(min:minNinteractions) reduction(max:maxNinteractions) reduction(+: Ninteractions)
+    int64_t NNgbCacheHits = 0;
+    int64_t currentIndex = 0;
+    /* We must schedule dynamically so that we have reduced imbalance.
+    * We do not need to worry about the export buffer filling up.*/
+    /* chunk size: 1 and 1000 were slightly (3 percent) slower than 8.
+    * FoF treewalk needs a larger chnksz to avoid contention.*/
+    int64_t chnksz = tw->WorkSetSize / (4*tw->NThread);
+    if(chnksz < 1)
+        chnksz = 1;
+    if(chnksz > 100)
+        chnksz = 100;
+    if(ov)
+        ov->chnksz = chnksz;
+    /* Ranges for the work-stealing scheduler: each thread starts with an equal contiguous part of the WorkSet.
+     * Particles are taken a few at a time so that expensive particles can be stolen individually.*/
+    int64_t * ranges = NULL;
+    int64_t grain = chnksz / 8;
+    /* Do not split buckets more than needed*/
+    if(tw->type == TREEWALK_BUCKET)
+        grain = chnksz;
+    if(grain < 1)
+        grain = 1;
+    if(tw->WorkSteal) {
+        ranges = ta_malloc("StealRanges", int64_t, STEAL_STRIDE * tw->NThread);
+        int t;
+        for(t = 0; t < tw->NThread; t++)
+            ranges[t * STEAL_STRIDE] = STEAL_PACK(tw->WorkSetSize * t / tw->NThread, tw->WorkSetSize * (t+1) / tw->NThread);
+    }
+    /* Busy time of each thread, for the load imbalance report*/
+    char clockname[128];
+    snprintf(clockname, sizeof(clockname), "/Threads/%s", tw->ev_label);
+    const int clock = walltime_clock(clockname);
+#pragma omp parallel reduction(min:minNinteractions) reduction(max:maxNinteractions) reduction(+: Ninteractions) reduction(+: NNgbCacheHits)
     {
+        const double tstart = MPI_Wtime();
         LocalTreeWalk lv[1];
         /* Note: exportflag is local to each thread */
         ev_init_thread(tw, lv);
         lv->mode = TREEWALK_PRIMARY;
+        /* Ghost queries evaluated on this thread. Kept separate so they do not count towards the primary interaction counters.*/
+        LocalTreeWalk lvghost[1];
+        ev_init_thread(tw, lvghost);
+        lvghost->mode = TREEWALK_GHOSTS;
+        const int tid = omp_get_thread_num();
+        int cursor = 0;
 
         /* use old index to recover from a buffer overflow*/;
         TreeWalkQueryBase * input = (TreeWalkQueryBase *) alloca(tw->query_type_elsize);
         TreeWalkResultBase * output = (TreeWalkResultBase *) alloca(tw->result_type_elsize);
-        /* We must schedule dynamically so that we have reduced imbalance.
-        * We do not need to worry about the export buffer filling up.*/
-        /* chunk size: 1 and 1000 were slightly (3 percent) slower than 8.
-        * FoF treewalk needs a larger chnksz to avoid contention.*/
-        int64_t chnksz = tw->WorkSetSize / (4*tw->NThread);
-        if(chnksz < 1)
-            chnksz = 1;
-        if(chnksz > 100)
-            chnksz = 100;
-        int k;
-        #pragma omp for schedule(dynamic, chnksz)
-        for(k = 0; k < tw->WorkSetSize; k++) {
-            const int i = tw->WorkSet ? tw->WorkSet[k] : k;
-            /* Primary never uses node list */
-            treewalk_init_query(tw, input, i, NULL);
-            treewalk_init_result(tw, output, input);
-            lv->target = i;
-            tw->visit(input, output, lv);
-            treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+        /* Space for a bucket of queries*/
+        char * bucketinput = NULL, * bucketoutput = NULL;
+        if(tw->type == TREEWALK_BUCKET) {
+            bucketinput = (char *) alloca(TREEWALK_BUCKET_MAX * tw->query_type_elsize);
+            bucketoutput = (char *) alloca(TREEWALK_BUCKET_MAX * tw->result_type_elsize);
+        }
+        /* This is a hand-rolled version of openmp dynamic scheduling,
+         * so that we can interleave the ghost queries.*/
+        while(1) {
+            if(ov) {
+                if(tid == 0 && !ov->progress)
+                    ev_poll_imports(tw, ov);
+                /* Ghost queries take priority, as a remote rank is waiting for them.*/
+                if(ev_ghost_work(tw, lvghost, ov, &cursor))
+                    continue;
+            }
+            int64_t chnk, end;
+            if(ranges) {
+                if(!ev_steal_work(ranges, tid, tw->NThread, grain, &chnk, &end))
+                    break;
+            }
+            else {
+                chnk = atomic_fetch_and_add_64(&currentIndex, chnksz);
+                if(chnk >= tw->WorkSetSize)
+                    break;
+                end = chnk + chnksz;
+                if(end > tw->WorkSetSize)
+                    end = tw->WorkSetSize;
+            }
+            if(tw->type == TREEWALK_BUCKET) {
+                ev_primary_buckets(tw, lv, bucketinput, bucketoutput, chnk, end);
+                continue;
+            }
+            int64_t k;
+            for(k = chnk; k < end; k++) {
+                const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+                /* Primary never uses node list */
+                treewalk_init_query(tw, input, i, NULL);
+                treewalk_init_result(tw, output, input);
+                lv->target = i;
+                tw->visit(input, output, lv);
+                treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+            }
         }
+        /* Finish any ghost buffers which have arrived. No new buffers are added
+         * once the master thread reaches here, so all ready buffers are complete after the barrier.
+         * With a communication thread, instead wait for and evaluate every import, so there is no secondary treewalk.*/
+        if(ov)
+            while(ev_ghost_work(tw, lvghost, ov, &cursor) || (ov->progress && ev_imports_pending(ov))) {}
+
         if(maxNinteractions < lv->maxNinteractions)
             maxNinteractions = lv->maxNinteractions;
         if(minNinteractions > lv->maxNinteractions)
             minNinteractions = lv->minNinteractions;
         Ninteractions = lv->Ninteractions;
+        NNgbCacheHits += lv->NNgbCacheHits;
+        walltime_thread_add(clock, MPI_Wtime() - tstart);
     }
+    if(ranges)
+        myfree(ranges);
+    /* Send the results for the imports completed during the primary walk*/
+    if(ov)
+        ev_send_finished_imports(tw, ov);
     tw->maxNinteractions = maxNinteractions;
     tw->minNinteractions = minNinteractions;
     tw->Ninteractions += Ninteractions;
+    tw->NNgbCacheHits += NNgbCacheHits;
     tw->Nlistprimary += tw->WorkSetSize;
 }
 
-static int ev_ndone(TreeWalk * tw, MPI_Comm comm)
+/* Make the queries of the whole WorkSet and start the offloaded primary treewalk on them.
+ * The host meanwhile evaluates the imported queries. Waited for in ev_offload_end.*/
+static void
+ev_offload_begin(TreeWalk * tw)
 {
-    int ndone;
-    int done = !(tw->BufferFullFlag);
-    MPI_Allreduce(&done, &ndone, 1, MPI_INT, MPI_SUM, comm);
-    return ndone;
+    const int64_t nquery = tw->WorkSetSize;
+    tw->OffloadQueries = (char *) mymalloc("OffloadQueries", DMAX(nquery, 1) * tw->query_type_elsize);
+    tw->OffloadResults = (char *) mymalloc("OffloadResults", DMAX(nquery, 1) * tw->result_type_elsize);
+    tw->OffloadNinteractions = (int *) mymalloc("OffloadNinter", DMAX(nquery, 1) * sizeof(int));
+    int64_t k;
+    #pragma omp parallel for
+    for(k = 0; k < nquery; k++) {
+        const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+        TreeWalkQueryBase * query = (TreeWalkQueryBase *) (tw->OffloadQueries + k * tw->query_type_elsize);
+        treewalk_init_query(tw, query, i, NULL);
+        treewalk_init_result(tw, (TreeWalkResultBase *) (tw->OffloadResults + k * tw->result_type_elsize), query);
+        tw->OffloadNinteractions[k] = 0;
+    }
+    tw->offload_begin((TreeWalkQueryBase *) tw->OffloadQueries, (TreeWalkResultBase *) tw->OffloadResults, tw->OffloadNinteractions, nquery, tw);
+}
+
+/* Wait for the offloaded primary treewalk and reduce its results.*/
+static void
+ev_offload_end(TreeWalk * tw)
+{
+    tw->offload_end(tw);
+    int64_t maxNinteractions = 0, minNinteractions = 1L << 45, Ninteractions = 0;
+    int64_t k;
+    #pragma omp parallel for reduction(min:minNinteractions) reduction(max:maxNinteractions) reduction(+: Ninteractions)
+    for(k = 0; k < tw->WorkSetSize; k++) {
+        const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+        treewalk_reduce_result(tw, (TreeWalkResultBase *) (tw->OffloadResults + k * tw->result_type_elsize), i, TREEWALK_PRIMARY);
+        const int64_t ninteractions = tw->OffloadNinteractions[k];
+        if(tw->StoreNgbCost)
+            P[i].NgbCost += ninteractions;
+        if(maxNinteractions < ninteractions)
+            maxNinteractions = ninteractions;
+        if(minNinteractions > ninteractions)
+            minNinteractions = ninteractions;
+        Ninteractions += ninteractions;
+    }
+    myfree(tw->OffloadNinteractions);
+    myfree(tw->OffloadResults);
+    myfree(tw->OffloadQueries);
+    tw->OffloadNinteractions = NULL;
+    tw->OffloadResults = NULL;
+    tw->OffloadQueries = NULL;
+    tw->maxNinteractions = maxNinteractions;
+    tw->minNinteractions = minNinteractions;
+    tw->Ninteractions += Ninteractions;
+    tw->Nlistprimary += tw->WorkSetSize;
 }
 
 /* export a particle at target and no, thread safely
@@ -329,26 +1071,40 @@ int treewalk_export_particle(LocalTreeWalk * lv, int no)
         endrun(1, "DataIndexTable not allocated, treewalk_export_particle called in the wrong way\n");
     if(no - lv->tw->tree->lastnode > lv->tw->tree->NTopLeaves)
         endrun(1, "Bad export leaf: no = %d lastnode %ld ntop %d target %d\n", no, lv->tw->tree->lastnode, lv->tw->tree->NTopLeaves, lv->target);
+    /* This particle was resumed after the export buffer filled, and the first NExportSkip
+     * exports were already sent in an earlier round. The toptree walk is deterministic so they are in the same order.*/
+    if(lv->NThisParticleNodes < lv->NExportSkip) {
+        lv->NThisParticleNodes++;
+        return 0;
+    }
     const int target = lv->target;
     TreeWalk * tw = lv->tw;
     const int task = tw->tree->TopLeaves[no - tw->tree->lastnode].Task;
     /* This index is a unique entry in the global DataIndexTable.*/
     size_t nexp = lv->Nexport;
     /* If the last export was to this task, we can perhaps just add this export to the existing NodeList. We can
-     * be sure that all exports of this particle are contiguous.*/
-    if(lv->NThisParticleExport >= 1 && lv->DataIndexTable[nexp-1].Task == task) {
+     * be sure that all exports of this particle are contiguous.
+     * In deterministic mode each node is exported separately: which nodes share an export depends on
+     * where the per-thread export buffer filled, and so would change the order in which the results are summed.*/
+    if(!Deterministic && lv->NThisParticleExport >= 1 && lv->DataIndexTable[nexp-1].Task == task) {
 #ifdef DEBUG
         /* This is just to be safe: only happens if our indices are off.*/
         if(lv->DataIndexTable[nexp - 1].Index != target)
             endrun(1, "Previous of %ld exports is target %d not current %d\n", lv->NThisParticleExport, lv->DataIndexTable[nexp-1].Index, target);
 #endif
-        if(lv->nodelistindex < NODELISTLENGTH) {
+        /* The packed wire format stores the node list as 16-bit offsets from the first entry.
+         * If this node does not fit, start a new export entry instead.*/
+        const int firstnode = lv->DataIndexTable[nexp-1].NodeList[0];
+        const int delta = tw->tree->TopLeaves[no - tw->tree->lastnode].treenode - firstnode;
+        const int fits = !tw->PackQueries || (delta > PACKED_NODELIST_END && delta <= INT16_MAX);
+        if(lv->nodelistindex < NODELISTLENGTH && fits) {
 #ifdef DEBUG
             if(lv->DataIndexTable[nexp-1].NodeList[lv->nodelistindex] != -1)
                 endrun(1, "Current nodelist %ld entry (%d) not empty!\n", lv->nodelistindex, lv->DataIndexTable[nexp-1].NodeList[lv->nodelistindex]);
 #endif
             lv->DataIndexTable[nexp-1].NodeList[lv->nodelistindex] = tw->tree->TopLeaves[no - tw->tree->lastnode].treenode;
             lv->nodelistindex++;
+            lv->NThisParticleNodes++;
             return 0;
         }
     }
@@ -365,6 +1121,7 @@ int treewalk_export_particle(LocalTreeWalk * lv, int no)
     lv->Nexport++;
     lv->nodelistindex = 1;
     lv->NThisParticleExport++;
+    lv->NThisParticleNodes++;
     return 0;
 }
 
@@ -373,38 +1130,215 @@ alloc_export_memory(TreeWalk * tw)
 {
     tw->Nexport_thread = ta_malloc2("localexports", size_t, tw->NThread);
     tw->ExportTable_thread = ta_malloc2("localexports", data_index *, tw->NThread);
+    /* One block, cut into a table for each thread*/
+    data_index * ExportTable = (data_index*) mymalloc("DataIndexTable", sizeof(data_index) * tw->BunchSize * tw->NThread);
     int i;
     for(i = 0; i < tw->NThread; i++)
-        tw->ExportTable_thread[i] = (data_index*) mymalloc("DataIndexTable", sizeof(data_index) * tw->BunchSize);
+        tw->ExportTable_thread[i] = ExportTable + i * tw->BunchSize;
     tw->QueueChunkEnd = ta_malloc2("queueend", int64_t, tw->NThread);
     for(i = 0; i < tw->NThread; i++)
         tw->QueueChunkEnd[i] = -1;
     tw->QueueChunkRestart = ta_malloc2("queuerestart", int, tw->NThread);
+    tw->QueueChunkSkip = ta_malloc2("queueskip", size_t, tw->NThread);
 }
 
 void
 free_export_memory(TreeWalk * tw)
 {
+    myfree(tw->QueueChunkSkip);
     myfree(tw->QueueChunkRestart);
     myfree(tw->QueueChunkEnd);
-    int i;
-    for(i = tw->NThread - 1; i >= 0; i--)
-        myfree(tw->ExportTable_thread[i]);
+    myfree(tw->ExportTable_thread[0]);
     myfree(tw->ExportTable_thread);
     myfree(tw->Nexport_thread);
 }
 
+/* Information about the tree of a rank on this node, exchanged so that its tree can be walked through shared memory.*/
+struct SharedTreeInfo {
+    int64_t task;
+    int64_t valid;
+    int64_t NumParticles;
+    /* Offsets from the start of the rank's main memory*/
+    int64_t nodes;
+    int64_t parts;
+    /* Compact walk nodes, or -1 if the tree has none*/
+    int64_t walknodes;
+    int64_t walkparticles;
+    int64_t walkindex;
+    /* Quadrupoles of the nodes and of the walk nodes, or -1 if the tree has none*/
+    int64_t quadrupoles;
+    int64_t walkquadrupoles;
+};
+
+/* The trees of the other ranks on this node, in the address space of this rank*/
+struct SharedNodeTrees {
+    MPI_Comm comm;
+    /* For each task, its index in comm, or -1 if it is not on this node or is this rank.*/
+    int * NodeRank;
+    /* Tree and particle table for each rank in comm. Only the Nodes pointer of the trees differs from the local tree.*/
+    ForceTree * trees;
+    struct particle_data ** Parts;
+    /* Largest number of particles in a tree on this node, for the neighbour list*/
+    int64_t MaxNumParticles;
+};
+
+/* Map the trees of the other ranks on this node, if main memory is shared and the treewalk supports it.
+ * Collective on the ranks of the node. Returns NULL if the trees are not shared.
+ * Exchanging the tree locations also ensures the other ranks have finished building their trees.*/
+static struct SharedNodeTrees *
+ev_shared_begin(TreeWalk * tw)
+{
+    if(!SharedMemory || !tw->ShareNodeTrees || !tw->tree)
+        return NULL;
+    MPI_Comm comm = mymalloc_shared_comm();
+    if(comm == MPI_COMM_NULL)
+        return NULL;
+    int NNode, i;
+    MPI_Comm_size(comm, &NNode);
+    if(NNode == 1)
+        return NULL;
+
+    struct SharedTreeInfo mine = {0};
+    mine.task = tw->tree->ThisTask;
+    mine.nodes = mymalloc_shared_offset(tw->tree->Nodes_base);
+    mine.parts = mymalloc_shared_offset(P);
+    mine.valid = mine.nodes >= 0 && mine.parts >= 0;
+    mine.walknodes = mine.walkparticles = mine.walkindex = -1;
+    if(tw->tree->WalkNodes) {
+        mine.walknodes = mymalloc_shared_offset(tw->tree->WalkNodes);
+        mine.walkparticles = mymalloc_shared_offset(tw->tree->WalkParticles);
+        mine.walkindex = mymalloc_shared_offset(tw->tree->WalkIndex);
+        mine.valid = mine.valid && mine.walknodes >= 0 && mine.walkparticles >= 0 && mine.walkindex >= 0;
+    }
+    mine.quadrupoles = mine.walkquadrupoles = -1;
+    if(tw->tree->Quadrupoles) {
+        mine.quadrupoles = mymalloc_shared_offset(tw->tree->Quadrupoles);
+        mine.valid = mine.valid && mine.quadrupoles >= 0;
+    }
+    if(tw->tree->WalkQuadrupoles) {
+        mine.walkquadrupoles = mymalloc_shared_offset(tw->tree->WalkQuadrupoles);
+        mine.valid = mine.valid && mine.walkquadrupoles >= 0;
+    }
+    mine.NumParticles = tw->tree->NumParticles;
+
+    struct SharedNodeTrees * shared = ta_malloc("SharedTrees", struct SharedNodeTrees, 1);
+    shared->NodeRank = ta_malloc("SharedNodeRank", int, tw->NTask);
+    shared->trees = ta_malloc("SharedForceTrees", ForceTree, NNode);
+    shared->Parts = ta_malloc("SharedParts", struct particle_data *, NNode);
+    struct SharedTreeInfo * info = ta_malloc("SharedTreeInfo", struct SharedTreeInfo, NNode);
+    /* Make the trees built on this rank visible to the others*/
+    mymalloc_shared_sync();
+    MPI_Allgather(&mine, sizeof(mine), MPI_BYTE, info, sizeof(mine), MPI_BYTE, comm);
+    mymalloc_shared_sync();
+    /* All ranks on this node see the same info, so agree whether to share*/
+    int valid = 1;
+    for(i = 0; i < NNode; i++)
+        valid = valid && info[i].valid && (info[i].walknodes >= 0) == (info[0].walknodes >= 0)
+            && (info[i].quadrupoles >= 0) == (info[0].quadrupoles >= 0)
+            && (info[i].walkquadrupoles >= 0) == (info[0].walkquadrupoles >= 0);
+    if(!valid) {
+        myfree(info);
+        myfree(shared->Parts);
+        myfree(shared->trees);
+        myfree(shared->NodeRank);
+        myfree(shared);
+        return NULL;
+    }
+    shared->comm = comm;
+    shared->MaxNumParticles = 0;
+    for(i = 0; i < tw->NTask; i++)
+        shared->NodeRank[i] = -1;
+    for(i = 0; i < NNode; i++) {
+        char * base = mymalloc_shared_base(i);
+        if(info[i].task != tw->tree->ThisTask)
+            shared->NodeRank[info[i].task] = i;
+        shared->trees[i] = *tw->tree;
+        shared->trees[i].Nodes_base = (struct NODE *) (base + info[i].nodes);
+        shared->trees[i].Nodes = shared->trees[i].Nodes_base - tw->tree->firstnode;
+        shared->trees[i].NumParticles = info[i].NumParticles;
+        if(info[i].walknodes >= 0) {
+            shared->trees[i].WalkNodes = (struct WalkNode *) (base + info[i].walknodes);
+            shared->trees[i].WalkParticles = (int *) (base + info[i].walkparticles);
+            shared->trees[i].WalkIndex = (int *) (base + info[i].walkindex);
+        }
+        if(info[i].quadrupoles >= 0)
+            shared->trees[i].Quadrupoles = (struct NodeQuadrupole *) (base + info[i].quadrupoles);
+        if(info[i].walkquadrupoles >= 0)
+            shared->trees[i].WalkQuadrupoles = (float (*)[6]) (base + info[i].walkquadrupoles);
+        shared->Parts[i] = (struct particle_data *) (base + info[i].parts);
+        shared->MaxNumParticles = DMAX(shared->MaxNumParticles, info[i].NumParticles);
+    }
+    myfree(info);
+    return shared;
+}
+
+/* Wait until all ranks on this node have finished walking the shared trees, and free them.*/
+static void
+ev_shared_end(TreeWalk * tw)
+{
+    struct SharedNodeTrees * shared = tw->Shared;
+    if(!shared)
+        return;
+    MPI_Barrier(shared->comm);
+    myfree(shared->Parts);
+    myfree(shared->trees);
+    myfree(shared->NodeRank);
+    myfree(shared);
+    tw->Shared = NULL;
+}
+
+/* Evaluate the exports to other ranks on this node by walking their trees through shared memory.
+ * The results are reduced as if they were ghosts returned by the other rank.*/
+static void
+ev_shared_walk(TreeWalk * tw)
+{
+    struct SharedNodeTrees * shared = tw->Shared;
+    int * ngblist = NULL;
+    if(tw->Ngblist)
+        ngblist = (int *) mymalloc("SharedNgblist", shared->MaxNumParticles * tw->NThread * sizeof(int));
+    int64_t i;
+    /* Each particle is exported from only one thread in each round, so the tables can be reduced in parallel.*/
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(i = 0; i < tw->NThread; i++)
+    {
+        LocalTreeWalk lv[1];
+        ev_init_thread(tw, lv);
+        lv->mode = TREEWALK_GHOSTS;
+        lv->target = -1;
+        if(ngblist)
+            lv->ngblist = ngblist + omp_get_thread_num() * shared->MaxNumParticles;
+        TreeWalkQueryBase * input = (TreeWalkQueryBase *) alloca(tw->query_type_elsize);
+        TreeWalkResultBase * output = (TreeWalkResultBase *) alloca(tw->result_type_elsize);
+        size_t k;
+        for(k = 0; k < tw->Nexport_thread[i]; k++) {
+            const data_index * exp = &tw->ExportTable_thread[i][k];
+            const int noderank = shared->NodeRank[exp->Task];
+            if(noderank < 0)
+                continue;
+            lv->tree = &shared->trees[noderank];
+            lv->Parts = shared->Parts[noderank];
+            treewalk_init_query(tw, input, exp->Index, exp->NodeList);
+            treewalk_init_result(tw, output, input);
+            tw->visit(input, output, lv);
+            treewalk_reduce_result(tw, output, exp->Index, TREEWALK_GHOSTS);
+        }
+    }
+    if(ngblist)
+        myfree(ngblist);
+}
+
 int
 ev_toptree(TreeWalk * tw)
 {
     tw->BufferFullFlag = 0;
     int64_t currentIndex = tw->WorkSetStart;
     int BufferFullFlag = 0;
+    int64_t NExportPlanHits = 0, NExtentCulls = 0;
 
     if(tw->Nexportfull > 0)
         message(0, "Toptree %s, iter %ld. First particle %ld size %ld.\n", tw->ev_label, tw->Nexportfull, tw->WorkSetStart, tw->WorkSetSize);
 
-#pragma omp parallel reduction(+: BufferFullFlag)
+#pragma omp parallel reduction(+: BufferFullFlag) reduction(+: NExportPlanHits) reduction(+: NExtentCulls)
     {
         LocalTreeWalk lv[1];
         /* Note: exportflag is local to each thread */
@@ -430,10 +1364,13 @@ ev_toptree(TreeWalk * tw)
             chnksz = 1000;
         do {
             int64_t end;
+            /* Number of exports of the first particle in the chunk which were already sent*/
+            size_t skip = 0;
             /* Restart a previously partially evaluated chunk if there is one*/
             if(tw->Nexportfull > 0 && tw->QueueChunkEnd[tid] > 0) {
                 chnk = tw->QueueChunkRestart[tid];
                 end = tw->QueueChunkEnd[tid];
+                skip = tw->QueueChunkSkip[tid];
                 tw->QueueChunkEnd[tid] = -1;
                 //message(1, "T%d Restarting chunk %ld -> %ld\n", tid, chnk, end);
             }
@@ -457,35 +1394,37 @@ ev_toptree(TreeWalk * tw)
                 lv->target = i;
                 /* Reset the number of exported particles.*/
                 lv->NThisParticleExport = 0;
+                lv->NThisParticleNodes = 0;
+                lv->NThisParticleExtentCulls = 0;
+                lv->NExportSkip = skip;
+                skip = 0;
                 const int rt = tw->visit(input, output, lv);
+                /* Particles resumed in the next round are counted then*/
+                if(rt >= 0)
+                    lv->NExtentCulls += lv->NThisParticleExtentCulls;
                 if(lv->NThisParticleExport > 1000)
                     message(5, "%ld exports for particle %d! Odd.\n", lv->NThisParticleExport, i);
-                /* If we filled up, we need to remove the partially evaluated last particle from the export list,
-                 * save the partially evaluated chunk, and leave this loop.*/
+                /* If we filled up, save the partially evaluated chunk and leave this loop.
+                 * The exports already made for the current particle are kept and sent this round:
+                 * the next round resumes this particle at the first export which did not fit.
+                 * This means any particle makes progress, no matter how many exports it has.*/
                 if(rt < 0) {
                     //message(5, "Export buffer full for particle %d chnk: %ld -> %ld on thread %d with %ld exports\n", i, chnk, end, tid, lv->NThisParticleExport);
                     /* export buffer has filled up, can't do more work.*/
                     BufferFull_thread = 1;
-                    /* Drop partial exports on the current particle, whose toptree will be re-evaluated*/
-                    lv->Nexport -= lv->NThisParticleExport;
-                    /* Check that the final export in the list is indeed from a different particle*/
-                    if(lv->NThisParticleExport > 0 && lv->DataIndexTable[lv->Nexport-1].Index >= i)
-                        endrun(5, "Something screwed up in export queue: nexp %ld (local %ld) last %d < index %d\n", lv->Nexport,
-                            lv->NThisParticleExport, i, lv->DataIndexTable[lv->Nexport-1].Index);
-                    /* Check that the earliest dropped export in the list is from the same particle*/
-                    if(lv->NThisParticleExport > 0 && lv->DataIndexTable[lv->Nexport].Index != i)
-                        endrun(5, "Something screwed up in export queue: nexp %ld (local %ld) last %d != index %d\n", lv->Nexport,
-                            lv->NThisParticleExport, i, lv->DataIndexTable[lv->Nexport].Index);
                     /* Store information for the current chunk, so we can resume successfully exactly where we left off.
                         Each thread stores chunk information */
                     tw->QueueChunkRestart[tid] = k;
                     tw->QueueChunkEnd[tid] = end;
+                    tw->QueueChunkSkip[tid] = lv->NThisParticleNodes;
                     break;
                 }
             }
         } while(chnk < tw->WorkSetSize && BufferFull_thread == 0);
         tw->Nexport_thread[tid] = lv->Nexport;
         BufferFullFlag += BufferFull_thread;
+        NExportPlanHits += lv->NExportPlanHits;
+        NExtentCulls += lv->NExtentCulls;
     }
 
     if(BufferFullFlag > 0) {
@@ -495,68 +1434,19 @@ ev_toptree(TreeWalk * tw)
             Nexport += tw->Nexport_thread[i];
         message(1, "Tree export buffer full on %d of %ld threads with %lu exports (%lu Mbytes). First particle %ld new start: %ld size %ld.\n",
                         BufferFullFlag, tw->NThread, Nexport, Nexport*tw->query_type_elsize/1024/1024, tw->WorkSetStart, currentIndex, tw->WorkSetSize);
-        if(currentIndex == tw->WorkSetStart)
+        if(Nexport == 0)
             endrun(5, "Not enough export space to make progress! lastsuc %ld Bunchsize: %ld \n", currentIndex, tw->BunchSize);
     }
     // else
         // message(1, "Finished toptree on %d threads. First particle %ld next start: %ld size %ld.\n", BufferFullFlag, tw->WorkSetStart, currentIndex, tw->WorkSetSize);
+    tw->NExportPlanHits += NExportPlanHits;
+    tw->NExtentCulls += NExtentCulls;
     /* Start again with the next chunk not yet evaluated*/
     tw->WorkSetStart = currentIndex;
     tw->BufferFullFlag = BufferFullFlag;
     return tw->BufferFullFlag;
 }
 
-struct ImpExpCounts
-{
-    int64_t * Export_count;
-    int64_t * Import_count;
-    int64_t * Export_offset;
-    int64_t * Import_offset;
-    MPI_Comm comm;
-    int NTask;
-    /* Number of particles exported to this processor*/
-    size_t Nimport;
-    /* Number of particles exported from this processor*/
-    size_t Nexport;
-};
-
-struct CommBuffer
-{
-    char * databuf;
-    int * rqst_task;
-    MPI_Request * rdata_all;
-    int nrequest_all;
-};
-
-void alloc_commbuffer(struct CommBuffer * buffer, int NTask, int alloc_high)
-{
-    if(alloc_high) {
-        buffer->rdata_all = ta_malloc2("requests", MPI_Request, NTask);
-        buffer->rqst_task = ta_malloc2("rqst", int, NTask);
-    }
-    else {
-        buffer->rdata_all = ta_malloc("requests", MPI_Request, NTask);
-        buffer->rqst_task = ta_malloc("rqst", int, NTask);
-    }
-    buffer->nrequest_all = 0;
-    buffer->databuf = NULL;
-}
-
-void free_impexpcount(struct ImpExpCounts * count)
-{
-    ta_free(count->Export_count);
-}
-
-void free_commbuffer(struct CommBuffer * buffer)
-{
-    if(buffer->databuf) {
-        myfree(buffer->databuf);
-        buffer->databuf = NULL;
-    }
-    ta_free(buffer->rqst_task);
-    ta_free(buffer->rdata_all);
-}
-
 #define COMM_RECV 1
 #define COMM_SEND 0
 
@@ -598,24 +1488,49 @@ void wait_commbuffer(struct CommBuffer * buffer)
     MPI_Waitall(buffer->nrequest_all, buffer->rdata_all, MPI_STATUSES_IGNORE);
 }
 
-static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExpCounts* counts, TreeWalk * tw)
+/* Allocate the buffer for the results of the imported queries.*/
+/* Wait until all ranks have put their results into our export result buffer, then close the window*/
+static void
+ev_wait_rma_result(struct CommBuffer * exportbuf, MPI_Comm comm)
+{
+    /* Complete our own puts at their targets*/
+    MPI_Win_flush_all(exportbuf->win);
+    /* Once every rank has flushed, all results for us have arrived*/
+    MPI_Barrier(comm);
+    MPI_Win_sync(exportbuf->win);
+    MPI_Win_unlock_all(exportbuf->win);
+    MPI_Win_free(&exportbuf->win);
+    exportbuf->rma = 0;
+}
+
+static struct CommBuffer ev_alloc_import_result(struct ImpExpCounts* counts, TreeWalk * tw)
 {
     struct CommBuffer res_imports = {0};
     alloc_commbuffer(&res_imports, counts->NTask, 1);
-    res_imports.databuf = (char *) mymalloc2("ImportResult", counts->Nimport * tw->result_type_elsize);
+    res_imports.databuf = (char *) mymalloc2("ImportResult", counts->Nimport * tw->result_wire_elsize);
+    return res_imports;
+}
 
-    MPI_Datatype type;
-    MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &type);
-    MPI_Type_commit(&type);
+/* Evaluate the imported queries as they arrive and send the results back.
+ * tot_completed is the number of import requests which were already completed and sent during the primary treewalk.*/
+static void ev_secondary(struct CommBuffer * imports, struct CommBuffer * res_imports, struct ImpExpCounts* counts, TreeWalk * tw, int tot_completed, MPI_Datatype type, MPI_Win win)
+{
     int * complete_array = ta_malloc("completes", int, imports->nrequest_all);
 
-    int tot_completed = 0;
     /* Test each request in turn until it completes*/
     while(tot_completed < imports->nrequest_all) {
         int complete_cnt = MPI_UNDEFINED;
+        /* In deterministic mode evaluate the imports in a fixed rank order, not the order they arrive,
+         * so that walks adding to neighbouring particles do so in the same order each run.*/
+        if(Deterministic) {
+            complete_array[0] = tot_completed;
+            complete_cnt = 1;
+            MPI_Wait(&imports->rdata_all[tot_completed], MPI_STATUS_IGNORE);
+        }
         /* Check for some completed requests: note that cleanup is performed if the requests are complete.
          * There may be only 1 completed request, and we need to wait again until we have more.*/
-        MPI_Waitsome(imports->nrequest_all, imports->rdata_all, &complete_cnt, complete_array, MPI_STATUSES_IGNORE);
+        else
+            MPI_Waitsome(imports->nrequest_all, imports->rdata_all, &complete_cnt, complete_array, MPI_STATUSES_IGNORE);
         /* This happens if all requests are MPI_REQUEST_NULL. It should never be hit*/
         if (complete_cnt == MPI_UNDEFINED)
             break;
@@ -626,8 +1541,8 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
             const int task = imports->rqst_task[i];
             const int64_t nimports_task = counts->Import_count[task];
             // message(1, "starting at %d with %d for iport %d task %d\n", counts->Import_offset[task], counts->Import_count[task], i, task);
-            char * databufstart = imports->databuf + counts->Import_offset[task] * tw->query_type_elsize;
-            char * dataresultstart = res_imports.databuf + counts->Import_offset[task] * tw->result_type_elsize;
+            char * databufstart = imports->databuf + counts->Import_offset[task] * tw->query_wire_elsize;
+            char * dataresultstart = res_imports->databuf + counts->Import_offset[task] * tw->result_wire_elsize;
             /* This sends each set of imports to a parallel for loop. This may lead to suboptimal resource allocation if only a small number of imports come from a processor.
             * If there are a large number of importing ranks each with a small number of imports, a better scheme could be to send each chunk to a separate openmp task.
             * However, each openmp task by default only uses 1 thread. One may explicitly enable openmp nested parallelism, but I think that is not safe,
@@ -640,41 +1555,94 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
                     ev_init_thread(tw, lv);
                     lv->mode = TREEWALK_GHOSTS;
                     #pragma omp for
-                    for(j = 0; j < nimports_task; j++) {
-                        TreeWalkQueryBase * input = (TreeWalkQueryBase *) (databufstart + j * tw->query_type_elsize);
-                        TreeWalkResultBase * output = (TreeWalkResultBase *) (dataresultstart + j * tw->result_type_elsize);
-                        treewalk_init_result(tw, output, input);
-                        lv->target = -1;
-                        tw->visit(input, output, lv);
-                    }
+                    for(j = 0; j < nimports_task; j++)
+                        ev_secondary_range(tw, lv, databufstart, dataresultstart, j, j+1);
                 }
             /* Send the completed data back*/
-            res_imports.rqst_task[res_imports.nrequest_all] = task;
-            MPI_Isend(dataresultstart, nimports_task, type, task, 101923, counts->comm, &res_imports.rdata_all[res_imports.nrequest_all++]);
+            ev_send_import_result(res_imports, counts, tw, task, type, win);
             tot_completed++;
         }
     };
     myfree(complete_array);
-    MPI_Type_free(&type);
-    return res_imports;
 }
 
+/* Fill the import counts by sending the non-zero export counts to their ranks, with the nonblocking
+ * consensus used for the exchange plan in exchange.c. The cost scales with the number of ranks
+ * we export to, not the total number of ranks. A rank leaves once the barrier completes, and may then
+ * send the counts of the next round to a rank which has not yet seen the barrier complete:
+ * consecutive rounds use different tags so these are not mistaken for the current round.*/
+static void
+ev_sparse_import_counts(struct ImpExpCounts * counts, TreeWalk * tw)
+{
+    const int tag = TREEWALK_TAG_COUNTS + (SparseRound++ % 2);
+    MPI_Request * requests = ta_malloc("sparsecounts", MPI_Request, counts->NTask);
+    /* Each message has the count and the offset of the exports in our export buffer*/
+    int64_t * sendbuf = ta_malloc("sparsesend", int64_t, 2 * counts->NTask);
+    int nreq = 0;
+    int target;
+    int64_t offset = 0;
+    for(target = 0; target < counts->NTask; target++) {
+        sendbuf[2 * target] = counts->Export_count[target];
+        sendbuf[2 * target + 1] = offset;
+        offset += counts->Export_count[target];
+    }
+    for(target = 0; target < counts->NTask; target++) {
+        if(counts->Export_count[target] == 0)
+            continue;
+        MPI_Issend(&sendbuf[2 * target], 2, MPI_INT64, target, tag, counts->comm, &requests[nreq++]);
+    }
+
+    MPI_Request barrier;
+    int barrier_active = 0;
+    int done = 0;
+    while(!done) {
+        int flag;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, tag, counts->comm, &flag, &status);
+        if(flag) {
+            int64_t recv[2];
+            MPI_Recv(recv, 2, MPI_INT64, status.MPI_SOURCE, tag, counts->comm, MPI_STATUS_IGNORE);
+            counts->Import_count[status.MPI_SOURCE] = recv[0];
+            counts->Import_remote_offset[status.MPI_SOURCE] = recv[1];
+        }
+        if(barrier_active)
+            MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+        else {
+            int sent;
+            MPI_Testall(nreq, requests, &sent, MPI_STATUSES_IGNORE);
+            if(sent) {
+                MPI_Ibarrier(counts->comm, &barrier);
+                barrier_active = 1;
+            }
+        }
+    }
+    myfree(sendbuf);
+    myfree(requests);
+    /* Whether another export round is needed*/
+    int finished = !(tw->BufferFullFlag);
+    MPI_Allreduce(&finished, &counts->Ndone, 1, MPI_INT, MPI_SUM, counts->comm);
+}
+
+/* Count the exports to each rank in the export tables, and their offsets in the export buffer.
+ * Exports to ranks whose tree we can walk through shared memory are not sent, so not counted.*/
 static struct ImpExpCounts
-ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
+ev_count_exports(TreeWalk * tw, MPI_Comm comm)
 {
     int NTask;
     struct ImpExpCounts counts = {0};
     MPI_Comm_size(comm, &NTask);
     counts.NTask = NTask;
     counts.comm = comm;
-    counts.Export_count = ta_malloc("Tree_counts", int64_t, 4*NTask);
+    counts.Export_count = ta_malloc("Tree_counts", int64_t, 5*NTask);
     counts.Export_offset = counts.Export_count + NTask;
     counts.Import_count = counts.Export_offset + NTask;
     counts.Import_offset = counts.Import_count + NTask;
-    memset(counts.Export_count, 0, sizeof(int64_t)*4*NTask);
+    counts.Import_remote_offset = counts.Import_offset + NTask;
+    memset(counts.Export_count, 0, sizeof(int64_t)*5*NTask);
 
     int64_t i;
     counts.Nexport=0;
+    int64_t Nshared = 0;
     /* Calculate the amount of data to send. */
     for(i = 0; i < tw->NThread; i++)
     {
@@ -688,41 +1656,73 @@ ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
         /* This is the export count*/
         counts.Nexport += tw->Nexport_thread[i];
     }
-    /* Exchange the counts. Note this is synchronous so we need to ensure the toptree walk, which happens before this, is balanced.*/
-    MPI_Alltoall(counts.Export_count, 1, MPI_INT64, counts.Import_count, 1, MPI_INT64, counts.comm);
+    /* Exports to ranks whose tree we can walk through shared memory are evaluated here, not sent.*/
+    if(tw->Shared) {
+        for(i = 0; i < NTask; i++) {
+            if(tw->Shared->NodeRank[i] < 0)
+                continue;
+            Nshared += counts.Export_count[i];
+            counts.Export_count[i] = 0;
+        }
+        tw->Nexport_sum -= Nshared;
+        counts.Nexport -= Nshared;
+        tw->NSharedWalks += Nshared;
+    }
+    tw->NExportTargets = (counts.Export_count[0] > 0);
+    for(i = 1; i < NTask; i++) {
+        counts.Export_offset[i] = counts.Export_offset[i - 1] + counts.Export_count[i - 1];
+        tw->NExportTargets += (counts.Export_count[i] > 0);
+    }
+    return counts;
+}
+
+static struct ImpExpCounts
+ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
+{
+    struct ImpExpCounts counts = ev_count_exports(tw, comm);
+    const int NTask = counts.NTask;
+    int64_t i;
+    if(tw->SparseCounts)
+        ev_sparse_import_counts(&counts, tw);
+    else {
+        /* Exchange the counts. Note this is synchronous so we need to ensure the toptree walk, which happens before this, is balanced.
+         * Each rank also sends a flag saying whether its toptree walk is finished, so we do not need
+         * a separate global reduction to decide whether another export round is needed.*/
+        int64_t * sendcount = ta_malloc("Tree_sendcount", int64_t, 6*NTask);
+        int64_t * recvcount = sendcount + 3 * NTask;
+        int64_t offset = 0;
+        for(i = 0; i < NTask; i++) {
+            sendcount[3*i] = counts.Export_count[i];
+            sendcount[3*i+1] = !(tw->BufferFullFlag);
+            sendcount[3*i+2] = offset;
+            offset += counts.Export_count[i];
+        }
+        MPI_Alltoall(sendcount, 3, MPI_INT64, recvcount, 3, MPI_INT64, counts.comm);
+        counts.Ndone = 0;
+        for(i = 0; i < NTask; i++) {
+            counts.Import_count[i] = recvcount[3*i];
+            counts.Ndone += recvcount[3*i+1];
+            counts.Import_remote_offset[i] = recvcount[3*i+2];
+        }
+        myfree(sendcount);
+    }
     // message(1, "Exporting %ld particles. Thread 0 is %ld\n", counts.Nexport, tw->Nexport_thread[0]);
 
     counts.Nimport = counts.Import_count[0];
-    tw->NExportTargets = (counts.Export_count[0] > 0);
     for(i = 1; i < NTask; i++)
     {
         counts.Nimport += counts.Import_count[i];
-        counts.Export_offset[i] = counts.Export_offset[i - 1] + counts.Export_count[i - 1];
         counts.Import_offset[i] = counts.Import_offset[i - 1] + counts.Import_count[i - 1];
-        tw->NExportTargets += (counts.Export_count[i] > 0);
     }
     return counts;
 }
 
-/* Builds the list of exported particles and async sends the export queries. */
-static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk * tw, struct CommBuffer * exports, struct CommBuffer * imports)
+/* Builds the list of exported particles in databuf, ordered by destination rank.*/
+static void ev_fill_exports(struct ImpExpCounts * counts, TreeWalk * tw, char * databuf)
 {
-    alloc_commbuffer(exports, counts->NTask, 0);
-    exports->databuf = (char *) mymalloc("ExportQuery", counts->Nexport * tw->query_type_elsize);
-
-    alloc_commbuffer(imports, counts->NTask, 0);
-    imports->databuf = (char *) mymalloc("ImportQuery", counts->Nimport * tw->query_type_elsize);
-
-    MPI_Datatype type;
-    MPI_Type_contiguous(tw->query_type_elsize, MPI_BYTE, &type);
-    MPI_Type_commit(&type);
-
-    /* Post recvs before sends. This sometimes allows for a fastpath.*/
-    MPI_fill_commbuffer(imports, counts->Import_count, counts->Import_offset, type, COMM_RECV, 101922, counts->comm);
-
-    /* prepare particle data for export */
     int64_t * real_send_count = ta_malloc("tmp_send_count", int64_t, tw->NTask);
     memset(real_send_count, 0, sizeof(int64_t)*tw->NTask);
+    TreeWalkQueryBase * unpacked = tw->PackQueries ? (TreeWalkQueryBase *) alloca(tw->query_type_elsize) : NULL;
     int64_t i;
     for(i = 0; i < tw->NThread; i++)
     {
@@ -730,10 +1730,17 @@ static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk *
         for(k = 0; k < tw->Nexport_thread[i]; k++) {
             const int place = tw->ExportTable_thread[i][k].Index;
             const int task = tw->ExportTable_thread[i][k].Task;
+            if(tw->Shared && tw->Shared->NodeRank[task] >= 0)
+                continue;
             const int64_t bufpos = real_send_count[task] + counts->Export_offset[task];
-            TreeWalkQueryBase * input = (TreeWalkQueryBase*) (exports->databuf + bufpos * tw->query_type_elsize);
+            char * wire = databuf + bufpos * tw->query_wire_elsize;
             real_send_count[task]++;
-            treewalk_init_query(tw, input, place, tw->ExportTable_thread[i][k].NodeList);
+            if(tw->PackQueries) {
+                treewalk_init_query(tw, unpacked, place, tw->ExportTable_thread[i][k].NodeList);
+                treewalk_pack_query(tw, unpacked, (TreeWalkPackedQueryBase *) wire);
+            }
+            else
+                treewalk_init_query(tw, (TreeWalkQueryBase *) wire, place, tw->ExportTable_thread[i][k].NodeList);
         }
     }
 #ifdef DEBUG
@@ -743,6 +1750,25 @@ static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk *
             endrun(6, "Inconsistent export to task %ld of %d: %ld expected %ld\n", i, tw->NTask, real_send_count[i], counts->Export_count[i]);
 #endif
     myfree(real_send_count);
+}
+
+/* Builds the list of exported particles and async sends the export queries. */
+static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk * tw, struct CommBuffer * exports, struct CommBuffer * imports)
+{
+    alloc_commbuffer(exports, counts->NTask, 0);
+    exports->databuf = (char *) mymalloc("ExportQuery", counts->Nexport * tw->query_wire_elsize);
+
+    alloc_commbuffer(imports, counts->NTask, 0);
+    imports->databuf = (char *) mymalloc("ImportQuery", counts->Nimport * tw->query_wire_elsize);
+
+    MPI_Datatype type;
+    MPI_Type_contiguous(tw->query_wire_elsize, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+
+    /* Post recvs before sends. This sometimes allows for a fastpath.*/
+    MPI_fill_commbuffer(imports, counts->Import_count, counts->Import_offset, type, COMM_RECV, 101922, counts->comm);
+
+    ev_fill_exports(counts, tw, exports->databuf);
     MPI_fill_commbuffer(exports, counts->Export_count, counts->Export_offset, type, COMM_SEND, 101922, counts->comm);
     MPI_Type_free(&type);
     return;
@@ -752,9 +1778,17 @@ static void ev_recv_export_result(struct CommBuffer * exportbuf, struct ImpExpCo
 {
     alloc_commbuffer(exportbuf, counts->NTask, 1);
     MPI_Datatype type;
-    MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &type);
+    MPI_Type_contiguous(tw->result_wire_elsize, MPI_BYTE, &type);
     MPI_Type_commit(&type);
-    exportbuf->databuf = (char*) mymalloc2("ExportResult", counts->Nexport * tw->result_type_elsize);
+    exportbuf->databuf = (char*) mymalloc2("ExportResult", counts->Nexport * tw->result_wire_elsize);
+    /* Expose the buffer so the importing ranks put the results into it. Collective, but so is the count exchange just before.*/
+    if(ResultRMA) {
+        MPI_Win_create(exportbuf->databuf, counts->Nexport * tw->result_wire_elsize, tw->result_wire_elsize, MPI_INFO_NULL, counts->comm, &exportbuf->win);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, exportbuf->win);
+        exportbuf->rma = 1;
+        MPI_Type_free(&type);
+        return;
+    }
     /* Post the receives first so we can hit a zero-copy fastpath.*/
     MPI_fill_commbuffer(exportbuf, counts->Export_count, counts->Export_offset, type, COMM_RECV, 101923, counts->comm);
     // alloc_commbuffer(&res_imports, counts.NTask, 0);
@@ -770,15 +1804,26 @@ static void ev_reduce_export_result(struct CommBuffer * exportbuf, struct ImpExp
     if(tw->reduce != NULL) {
         int * real_recv_count = ta_malloc("tmp_recv_count", int, tw->NTask);
         memset(real_recv_count, 0, sizeof(int)*tw->NTask);
+        TreeWalkResultBase * unpacked = tw->PackResults ? (TreeWalkResultBase *) alloca(tw->result_type_elsize) : NULL;
         for(i = 0; i < tw->NThread; i++)
         {
             size_t k;
             for(k = 0; k < tw->Nexport_thread[i]; k++) {
                 const int place = tw->ExportTable_thread[i][k].Index;
                 const int task = tw->ExportTable_thread[i][k].Task;
+                if(tw->Shared && tw->Shared->NodeRank[task] >= 0)
+                    continue;
                 const int64_t bufpos = real_recv_count[task] + counts->Export_offset[task];
                 real_recv_count[task]++;
-                TreeWalkResultBase * output = (TreeWalkResultBase*) (exportbuf->databuf + tw->result_type_elsize * bufpos);
+                TreeWalkResultBase * output = (TreeWalkResultBase*) (exportbuf->databuf + tw->result_wire_elsize * bufpos);
+                if(tw->PackResults) {
+                    memset(unpacked, 0, tw->result_type_elsize);
+#ifdef DEBUG
+                    unpacked->ID = output->ID;
+#endif
+                    tw->unpack_result(output, unpacked, tw);
+                    output = unpacked;
+                }
                 treewalk_reduce_result(tw, output, place, TREEWALK_GHOSTS);
 #ifdef DEBUG
                 if(output->ID != P[place].ID)
@@ -790,12 +1835,186 @@ static void ev_reduce_export_result(struct CommBuffer * exportbuf, struct ImpExp
     }
 }
 
+/* Find the thread count tuning of a label, adding it if new. Every rank runs the same treewalks, so the tables agree.*/
+static struct ThreadTune *
+ev_tune_find(const char * label, const int NThreadMax)
+{
+    int i;
+    for(i = 0; i < NThreadTunes; i++)
+        if(!strncmp(ThreadTunes[i].label, label, sizeof(ThreadTunes[i].label) - 1))
+            return &ThreadTunes[i];
+    if(NThreadTunes == TUNE_NLABEL)
+        return NULL;
+    struct ThreadTune * tune = &ThreadTunes[NThreadTunes++];
+    memset(tune, 0, sizeof(*tune));
+    strncpy(tune->label, label, sizeof(tune->label) - 1);
+    tune->nthreads = NThreadMax;
+    return tune;
+}
+
+/* Record a call which took dt for work queued particles. After TUNE_CALLS calls the cost per particle
+ * is compared with the best so far: while it improves the thread count is halved,
+ * and at the first thread count which is no better the best is kept for good. Collective.*/
+static void
+ev_tune_update(struct ThreadTune * tune, const double dt, const int64_t work, const int NThreadMax)
+{
+    double sum[2] = {dt, work};
+    MPI_Allreduce(MPI_IN_PLACE, sum, 2, MPI_DOUBLE, MPI_SUM, GadgetComm);
+    tune->time += sum[0];
+    tune->work += sum[1];
+    if(++tune->ncalls < TUNE_CALLS)
+        return;
+    const double cost = tune->time / DMAX(tune->work, 1);
+    tune->ncalls = 0;
+    tune->time = 0;
+    tune->work = 0;
+    if(tune->bestthreads == 0 || cost < tune->bestcost) {
+        tune->bestcost = cost;
+        tune->bestthreads = tune->nthreads;
+        if(tune->nthreads > 1) {
+            tune->nthreads /= 2;
+            return;
+        }
+    }
+    tune->nthreads = tune->bestthreads;
+    tune->settled = 1;
+    message(0, "Treewalk %s will run on %d of %d threads (%g s per particle)\n", tune->label, tune->nthreads, NThreadMax, tune->bestcost);
+}
+
 /* run a treewalk on an active_set.
  *
  * active_set : a list of indices of particles. If active_set is NULL,
  *              all (NumPart) particles are used.
  *
  * */
+/* Add a phase of this treewalk to the timeline trace*/
+static void
+ev_trace(const TreeWalk * tw, const char * phase, const double tstart, const double tend)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%s", tw->ev_label, phase);
+    walltime_trace_event(name, tstart, tend);
+}
+
+/* Evaluate a fragment of exports streamed to us by another rank, if one has arrived, and send back the results.
+ * The send may block: this is safe as the exporting rank posts its receive before sending the fragment.
+ * Returns the time spent evaluating, or zero if there was no fragment.*/
+static double
+ev_stream_serve(TreeWalk * tw, MPI_Datatype query_type, MPI_Datatype result_type)
+{
+    int flag;
+    MPI_Status status;
+    MPI_Iprobe(MPI_ANY_SOURCE, TREEWALK_TAG_STREAM_QUERY, GadgetComm, &flag, &status);
+    if(!flag)
+        return 0;
+    const double tstart = second();
+    int nimport;
+    MPI_Get_count(&status, query_type, &nimport);
+    char * databuf = (char *) mymalloc("StreamImport", nimport * tw->query_wire_elsize);
+    char * dataresult = (char *) mymalloc("StreamResult", nimport * tw->result_wire_elsize);
+    MPI_Recv(databuf, nimport, query_type, status.MPI_SOURCE, TREEWALK_TAG_STREAM_QUERY, GadgetComm, MPI_STATUS_IGNORE);
+    #pragma omp parallel
+    {
+        int64_t j;
+        LocalTreeWalk lv[1];
+        ev_init_thread(tw, lv);
+        lv->mode = TREEWALK_GHOSTS;
+        #pragma omp for
+        for(j = 0; j < nimport; j++)
+            ev_secondary_range(tw, lv, databuf, dataresult, j, j+1);
+    }
+    MPI_Send(dataresult, nimport, result_type, status.MPI_SOURCE, TREEWALK_TAG_STREAM_RESULT, GadgetComm);
+    myfree(dataresult);
+    myfree(databuf);
+    return timediff(tstart, second());
+}
+
+/* Send the exports left after the first export round without synchronising the ranks.
+ * Each time the export buffer fills, its contents are sent straight to their ranks, one fragment per rank,
+ * and the toptree walk resumes once the results of the fragment are back and reduced. While waiting,
+ * and once its own walk is done, each rank evaluates the fragments sent to it. A rank whose walk is done
+ * enters a non-blocking barrier: when that completes every rank has the results of all its fragments,
+ * so no fragment is left unanswered. The next treewalk cannot send fragments to a rank still polling here,
+ * as its first export round contains a blocking collective.
+ * finished is true if this rank already sent all its exports in the first round.*/
+static void
+ev_stream_exports(TreeWalk * tw, int finished)
+{
+    MPI_Datatype query_type, result_type;
+    MPI_Type_contiguous(tw->query_wire_elsize, MPI_BYTE, &query_type);
+    MPI_Type_commit(&query_type);
+    MPI_Type_contiguous(tw->result_wire_elsize, MPI_BYTE, &result_type);
+    MPI_Type_commit(&result_type);
+
+    while(!finished) {
+        double tstart = second();
+        finished = !ev_toptree(tw);
+        struct ImpExpCounts counts = ev_count_exports(tw, GadgetComm);
+        struct CommBuffer exports = {0}, res_exports = {0};
+        alloc_commbuffer(&exports, counts.NTask, 0);
+        exports.databuf = (char *) mymalloc("ExportQuery", counts.Nexport * tw->query_wire_elsize);
+        ev_fill_exports(&counts, tw, exports.databuf);
+        alloc_commbuffer(&res_exports, counts.NTask, 1);
+        res_exports.databuf = (char *) mymalloc2("ExportResult", counts.Nexport * tw->result_wire_elsize);
+        /* Post the receives for the results before the queries go out*/
+        MPI_fill_commbuffer(&res_exports, counts.Export_count, counts.Export_offset, result_type, COMM_RECV, TREEWALK_TAG_STREAM_RESULT, counts.comm);
+        MPI_fill_commbuffer(&exports, counts.Export_count, counts.Export_offset, query_type, COMM_SEND, TREEWALK_TAG_STREAM_QUERY, counts.comm);
+        double tend = second();
+        tw->timecomp0 += timediff(tstart, tend);
+        ev_trace(tw, "Toptree", tstart, tend);
+
+        /* Evaluate fragments from other ranks until our results are back*/
+        tstart = second();
+        double tserve = 0;
+        int done = 0;
+        while(1) {
+            MPI_Testall(res_exports.nrequest_all, res_exports.rdata_all, &done, MPI_STATUSES_IGNORE);
+            if(done)
+                break;
+            tserve += ev_stream_serve(tw, query_type, result_type);
+        }
+        tend = second();
+        tw->timecomp2 += tserve;
+        tw->timewait1 += timediff(tstart, tend) - tserve;
+        ev_trace(tw, "Wait", tstart, tend);
+
+        tstart = second();
+        ev_reduce_export_result(&res_exports, &counts, tw);
+        wait_commbuffer(&exports);
+        free_commbuffer(&res_exports);
+        free_commbuffer(&exports);
+        free_impexpcount(&counts);
+        tend = second();
+        tw->timecommsumm += timediff(tstart, tend);
+        ev_trace(tw, "Reduce", tstart, tend);
+        tstart = second();
+        if(tw->Shared) {
+            ev_shared_walk(tw);
+            tend = second();
+            tw->timecomp2 += timediff(tstart, tend);
+            ev_trace(tw, "Shared", tstart, tend);
+        }
+        tw->Nexportfull++;
+    }
+
+    /* Keep evaluating fragments until every rank is done*/
+    double tstart = second();
+    double tserve = 0;
+    MPI_Request barrier;
+    MPI_Ibarrier(GadgetComm, &barrier);
+    int done = 0;
+    while(!done) {
+        tserve += ev_stream_serve(tw, query_type, result_type);
+        MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+    }
+    double tend = second();
+    tw->timecomp2 += tserve;
+    tw->timewait1 += timediff(tstart, tend) - tserve;
+    ev_trace(tw, "WaitStream", tstart, tend);
+    MPI_Type_free(&result_type);
+    MPI_Type_free(&query_type);
+}
+
 void
 treewalk_run(TreeWalk * tw, int * active_set, size_t size)
 {
@@ -808,6 +2027,25 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
     GDB_current_ev = tw;
 #endif
 
+    /* Timers are cumulative over calls: store their values so the log records only this call.*/
+    const double times0[5] = {tw->timecomp0, tw->timecomp1, tw->timecomp2, tw->timecomp3, tw->timewait1};
+
+    /* In deterministic mode, walks which add to neighbouring particles run on one thread,
+     * so the neighbours are updated in queue order. Everything else is already independent of thread count
+     * once exports are not merged and imports are evaluated in rank order.*/
+    const int NThreadSaved = omp_get_max_threads();
+    const int serial = Deterministic && tw->WritesNeighbours && NThreadSaved > 1;
+    const double tserial = second();
+    if(serial)
+        omp_set_num_threads(1);
+    struct ThreadTune * tune = NULL;
+    if(TuneThreads && !serial && NThreadSaved > 1) {
+        tune = ev_tune_find(tw->ev_label, NThreadSaved);
+        /* The thread count may have been lowered since the tuning started*/
+        if(tune)
+            omp_set_num_threads(tune->nthreads < NThreadSaved ? tune->nthreads : NThreadSaved);
+    }
+
     tstart = second();
     ev_begin(tw, active_set, size);
 
@@ -826,62 +2064,149 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
     if(tw->visit) {
         tw->Nexportfull = 0;
         tw->Nexport_sum = 0;
+        tw->NimportOverlap = 0;
+        tw->NExportPlanHits = 0;
+        tw->NExtentCulls = 0;
+        tw->NNgbCacheHits = 0;
+        tw->NSharedWalks = 0;
         tw->Ninteractions = 0;
         int Ndone = 0;
+        /* Map the trees of other ranks on this node. Allocated before the export memory, as it is freed after it.*/
+        tw->Shared = ev_shared_begin(tw);
+        /* The buffers of each iteration are freed as soon as they are done with, in any order*/
+        mymalloc_scope_begin();
         /* Needs to be outside loop because it allocates restart information*/
         alloc_export_memory(tw);
+        /* The first export round sends what fits in the export buffer and evaluates the local particles.
+         * If the buffer filled on any rank, the remaining exports are streamed without further
+         * collectives, see ev_stream_exports. In deterministic mode the imports must be evaluated
+         * in rank order, so instead every rank does further rounds until all are done.*/
         do
         {
             tstart = second();
             /* First do the toptree and export particles for sending.*/
             ev_toptree(tw);
-            /* All processes sync via alltoall.*/
-            struct ImpExpCounts counts = ev_export_import_counts(tw, MPI_COMM_WORLD);
-            Ndone = ev_ndone(tw, MPI_COMM_WORLD);
+            /* All processes sync via alltoall. This also tells us whether any rank needs another round.*/
+            struct ImpExpCounts counts = ev_export_import_counts(tw, GadgetComm);
+            Ndone = counts.Ndone;
             /* Send the exported particle data */
             struct CommBuffer exports = {0}, imports = {0};
             /* exports is allocated first, then imports*/
             ev_send_recv_export_import(&counts, tw, &exports, &imports);
             tend = second();
             tw->timecomp0 += timediff(tstart, tend);
-            /* Only do this on the first iteration, as we only need to do it once.*/
+            ev_trace(tw, "Toptree", tstart, tend);
+            /* Posts recvs to get the export results (which are sent in ev_secondary, or during ev_primary).*/
+            struct CommBuffer res_exports = {0};
+            ev_recv_export_result(&res_exports, &counts, tw);
+            struct CommBuffer res_imports = ev_alloc_import_result(&counts, tw);
+            MPI_Datatype result_type;
+            MPI_Type_contiguous(tw->result_wire_elsize, MPI_BYTE, &result_type);
+            MPI_Type_commit(&result_type);
+            int ncompleted = 0;
+            /* Only do this on the first iteration, as we only need to do it once.
+             * If offloaded, the local particles are evaluated while the host does the imports, and reduced after.*/
             tstart = second();
-            if(tw->Nexportfull == 0)
-                ev_primary(tw); /* do local particles and prepare export list */
+            const int offload = tw->offload_begin && tw->Nexportfull == 0;
+            if(offload)
+                ev_offload_begin(tw);
+            else if(tw->Nexportfull == 0) {
+                /* do local particles, evaluating imports as they arrive */
+                if(OverlapImports && !Deterministic && imports.nrequest_all > 0) {
+                    struct ImportOverlap ov[1] = {0};
+                    ov->imports = &imports;
+                    ov->res_imports = &res_imports;
+                    ov->counts = &counts;
+                    ov->result_type = result_type;
+                    ov->result_win = res_exports.rma ? res_exports.win : MPI_WIN_NULL;
+                    ov->ready = ta_malloc("ready", int, imports.nrequest_all);
+                    ov->claimed = ta_malloc("claimed", int64_t, 2 * imports.nrequest_all);
+                    ov->finished = ov->claimed + imports.nrequest_all;
+                    ov->sent = ta_malloc("sent", int, imports.nrequest_all);
+                    memset(ov->claimed, 0, 2 * imports.nrequest_all * sizeof(int64_t));
+                    memset(ov->sent, 0, imports.nrequest_all * sizeof(int));
+                    ov->exports = &exports;
+                    ov->res_exports = &res_exports;
+                    pthread_t progress;
+                    struct ProgressThreadArgs pa = {tw, ov};
+                    ov->progress = ProgressThread && 0 == pthread_create(&progress, NULL, ev_progress_thread, &pa);
+                    ev_primary(tw, ov);
+                    if(ov->progress)
+                        pthread_join(progress, NULL);
+                    ncompleted = ov->nready;
+                    tw->NimportOverlap += ncompleted;
+                    myfree(ov->sent);
+                    myfree(ov->claimed);
+                    myfree(ov->ready);
+                }
+                else
+                    ev_primary(tw, NULL);
+            }
             tend = second();
             tw->timecomp1 += timediff(tstart, tend);
+            ev_trace(tw, "Primary", tstart, tend);
             /* Do processing of received particles. We implement a queue that
              * checks each incoming task in turn and processes them as they arrive.*/
             tstart = second();
-            /* Posts recvs to get the export results (which are sent in ev_secondary).*/
-            struct CommBuffer res_exports = {0};
-            ev_recv_export_result(&res_exports, &counts, tw);
-            struct CommBuffer res_imports = ev_secondary(&imports, &counts, tw);
+            ev_secondary(&imports, &res_imports, &counts, tw, ncompleted, result_type, res_exports.rma ? res_exports.win : MPI_WIN_NULL);
+            MPI_Type_free(&result_type);
             // report_memory_usage(tw->ev_label);
             free_commbuffer(&imports);
             tend = second();
             tw->timecomp2 += timediff(tstart, tend);
+            ev_trace(tw, "Secondary", tstart, tend);
+            /* Before the exported results are added to the local particles*/
+            if(offload) {
+                tstart = second();
+                ev_offload_end(tw);
+                tend = second();
+                tw->timecomp1 += timediff(tstart, tend);
+                ev_trace(tw, "Offload", tstart, tend);
+            }
             /* Now clear the sent data buffer, waiting for the send to complete.
              * This needs to be after the other end has called recv.*/
             tstart = second();
-            wait_commbuffer(&res_exports);
+            if(res_exports.rma)
+                ev_wait_rma_result(&res_exports, counts.comm);
+            else
+                wait_commbuffer(&res_exports);
             tend = second();
             tw->timewait1 += timediff(tstart, tend);
+            ev_trace(tw, "Wait", tstart, tend);
             tstart = second();
             ev_reduce_export_result(&res_exports, &counts, tw);
             wait_commbuffer(&exports);
             free_commbuffer(&exports);
+            tend = second();
+            tw->timecommsumm += timediff(tstart, tend);
+            ev_trace(tw, "Reduce", tstart, tend);
+            /* Evaluate exports to ranks on this node on their trees. This is after the primary treewalk
+             * and the reduction of the sent exports, as they add to the same particles.*/
+            tstart = second();
+            if(tw->Shared)
+                ev_shared_walk(tw);
+            tend = second();
+            tw->timecomp2 += timediff(tstart, tend);
+            if(tw->Shared)
+                ev_trace(tw, "Shared", tstart, tend);
+            tstart = second();
             wait_commbuffer(&res_imports);
             tend = second();
             tw->timecommsumm += timediff(tstart, tend);
+            ev_trace(tw, "WaitResults", tstart, tend);
             free_commbuffer(&res_imports);
             free_commbuffer(&res_exports);
             free_impexpcount(&counts);
             /* Free export memory*/
             tw->Nexportfull++;
             /* Note there is no sync at the end!*/
-        } while(Ndone < tw->NTask);
+        } while(Ndone < tw->NTask && Deterministic);
+        if(Ndone < tw->NTask)
+            ev_stream_exports(tw, !tw->BufferFullFlag);
+        TotalInteractions += tw->Ninteractions;
         free_export_memory(tw);
+        mymalloc_scope_end();
+        ev_shared_end(tw);
     }
 
     tstart = second();
@@ -896,9 +2221,108 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
     tend = second();
     tw->timecomp3 += timediff(tstart, tend);
     ev_finish(tw);
+    if(serial) {
+        omp_set_num_threads(NThreadSaved);
+        /* The walk would have taken at best 1/NThread of this time in parallel, which bounds the overhead*/
+        message(0, "Deterministic treewalk %s ran on 1 of %d threads in %g s\n", tw->ev_label, NThreadSaved, timediff(tserial, second()));
+    }
+    if(tune) {
+        if(!tune->settled)
+            ev_tune_update(tune, timediff(tserial, second()), tw->WorkSetSize, NThreadSaved);
+        omp_set_num_threads(NThreadSaved);
+    }
+    if(LogStats)
+        treewalk_write_log(tw, times0);
     tw->Niteration++;
 }
 
+static int
+int64_cmp(const void * a, const void * b)
+{
+    const int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Write the mean and maximum over ranks of a per-rank quantity. The imbalance is max / mean.*/
+static void
+write_log_meanmax(FILE * fd, const char * name, const double * values, const int NTask)
+{
+    double mean = 0, max = 0;
+    int i;
+    for(i = 0; i < NTask; i++) {
+        mean += values[i];
+        max = DMAX(max, values[i]);
+    }
+    mean /= NTask;
+    fprintf(fd, ", \"%s\": {\"mean\": %g, \"max\": %g}", name, mean, max);
+}
+
+/* Append one JSON line of statistics for this call of treewalk_run to the treewalk log.
+ * Collective: per-rank values are gathered onto rank 0, which writes them.*/
+static void
+treewalk_write_log(const TreeWalk * tw, const double * times0)
+{
+    enum {LOG_NTIMES = 5};
+    const char * timenames[LOG_NTIMES] = {"timecomp0", "timecomp1", "timecomp2", "timecomp3", "timewait1"};
+    double mytimes[LOG_NTIMES] = {tw->timecomp0, tw->timecomp1, tw->timecomp2, tw->timecomp3, tw->timewait1};
+    int i, k;
+    for(k = 0; k < LOG_NTIMES; k++)
+        mytimes[k] -= times0[k];
+    /* Streamed exports fill the buffer a different number of times on each rank*/
+    int64_t mycounts[4] = {tw->Ninteractions, tw->Nexport_sum, tw->NExportTargets, tw->Nexportfull};
+
+    double * times = NULL;
+    int64_t * counts = NULL;
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        times = ta_malloc("logtimes", double, LOG_NTIMES * tw->NTask);
+        counts = ta_malloc("logcounts", int64_t, 4 * tw->NTask);
+    }
+    MPI_Gather(mytimes, LOG_NTIMES, MPI_DOUBLE, times, LOG_NTIMES, MPI_DOUBLE, 0, GadgetComm);
+    MPI_Gather(mycounts, 4, MPI_INT64, counts, 4, MPI_INT64, 0, GadgetComm);
+    if(ThisTask != 0)
+        return;
+
+    if(LogFile) {
+        /* Reorder so each quantity is contiguous*/
+        double * column = ta_malloc("logcolumn", double, tw->NTask);
+        int64_t * ninter = ta_malloc("logninter", int64_t, tw->NTask);
+        int64_t Nexport = 0, NExportTargets = 0, Ninteractions = 0, Nexportfull = 0;
+        for(i = 0; i < tw->NTask; i++) {
+            ninter[i] = counts[4 * i];
+            Ninteractions += ninter[i];
+            Nexport += counts[4 * i + 1];
+            NExportTargets += counts[4 * i + 2];
+            if(counts[4 * i + 3] > Nexportfull)
+                Nexportfull = counts[4 * i + 3];
+        }
+        fprintf(LogFile, "{\"step\": %d, \"label\": \"%s\", \"iteration\": %ld, \"exportiterations\": %ld, \"NTask\": %d",
+                LogStep, tw->ev_label, tw->Niteration, Nexportfull, tw->NTask);
+        for(k = 0; k < LOG_NTIMES; k++) {
+            for(i = 0; i < tw->NTask; i++)
+                column[i] = times[LOG_NTIMES * i + k];
+            write_log_meanmax(LogFile, timenames[k], column, tw->NTask);
+        }
+        fprintf(LogFile, ", \"Nexport_sum\": %ld, \"NExportTargets\": %ld, \"deterministic\": %d", Nexport, NExportTargets, Deterministic);
+        /* Percentiles of the per-rank interaction counts*/
+        qsort(ninter, tw->NTask, sizeof(int64_t), int64_cmp);
+        fprintf(LogFile, ", \"Ninteractions\": {\"sum\": %ld, \"min\": %ld, \"p10\": %ld, \"p50\": %ld, \"p90\": %ld, \"max\": %ld}}\n",
+                Ninteractions, ninter[0], ninter[(tw->NTask - 1) / 10], ninter[(tw->NTask - 1) / 2], ninter[(9 * (tw->NTask - 1)) / 10], ninter[tw->NTask - 1]);
+        fflush(LogFile);
+        ta_free(ninter);
+        ta_free(column);
+    }
+    ta_free(counts);
+    ta_free(times);
+}
+
+int64_t
+treewalk_total_interactions(void)
+{
+    return TotalInteractions;
+}
+
 void
 treewalk_add_counters(LocalTreeWalk * lv, const int64_t ninteractions)
 {
@@ -907,6 +2331,290 @@ treewalk_add_counters(LocalTreeWalk * lv, const int64_t ninteractions)
     if(lv->minNinteractions > ninteractions)
         lv->minNinteractions = ninteractions;
     lv->Ninteractions += ninteractions;
+    /* Record the work of local queries, for load balancing and queue ordering*/
+    if(lv->tw->StoreNgbCost && lv->mode == TREEWALK_PRIMARY && lv->target >= 0)
+        P[lv->target].NgbCost += ninteractions;
+}
+
+/* Check whether the export plan says this query needs no exports, so the toptree walk can be skipped.
+ * The plan stores the largest radius for which the toptree walk found no exports. Culling is monotonic
+ * in the search radius, so any smaller search will not find exports either. For a symmetric search,
+ * the search radius is at most the larger of Hsml and the hmax of any remote toptree leaf.*/
+static int
+ev_export_plan_skip(const TreeWalkNgbIterBase * iter, const LocalTreeWalk * lv)
+{
+    const TreeWalk * tw = lv->tw;
+    if(!ReuseExportPlan || lv->mode != TREEWALK_TOPTREE || !tw->UseExportPlan || !tw->tree->ExportPlan || lv->target < 0)
+        return 0;
+    double radius = iter->Hsml;
+    if(iter->symmetric == NGB_TREEFIND_SYMMETRIC)
+        radius = DMAX(radius, tw->MaxRemoteHmax);
+    return radius <= tw->tree->ExportPlan[lv->target];
+}
+
+/* Record in the export plan that a toptree walk with this radius needed no exports.
+ * Each particle is only walked by one thread in the toptree, so this need not be atomic.*/
+static void
+ev_export_plan_record(const TreeWalkNgbIterBase * iter, const LocalTreeWalk * lv)
+{
+    const TreeWalk * tw = lv->tw;
+    if(!ReuseExportPlan || lv->mode != TREEWALK_TOPTREE || !tw->UseExportPlan || !tw->tree->ExportPlan || lv->target < 0)
+        return;
+    /* Leaves skipped by their particle extent may need exports at a radius the plan would allow,
+     * for a symmetric walk or after the extents change, so only record walks which skipped none.*/
+    if(lv->NThisParticleExtentCulls > 0)
+        return;
+    if(lv->NThisParticleNodes == 0 && tw->tree->ExportPlan[lv->target] < iter->Hsml)
+        tw->tree->ExportPlan[lv->target] = iter->Hsml;
+}
+
+/* Position of a query, for its separations from the particles in a tree.
+ * If the tree has integer positions, the query position is converted once here.*/
+struct QueryPos
+{
+    const double * Pos;
+    MyIntPosType IntPos[3];
+    const ForceTree * tree;
+};
+
+static inline void
+ev_query_pos_init(struct QueryPos * q, const TreeWalkQueryBase * I, const ForceTree * tree)
+{
+    q->Pos = I->Pos;
+    q->tree = tree;
+    if(tree->IntPos) {
+        int d;
+        for(d = 0; d < 3; d++)
+            q->IntPos[d] = pos_to_intpos(I->Pos[d], tree->BoxSize);
+    }
+}
+
+/* Periodic separation of particle other from the query in dimension d, as NEAREST(I->Pos[d] - P[other].Pos[d]).*/
+static inline double
+ev_query_sep(const struct QueryPos * q, const int other, const int d)
+{
+    if(q->tree->IntPos)
+        return INTPOS_NEAREST(q->IntPos[d], q->tree->IntPos[other][d], q->tree->IntPosFac);
+    return NEAREST(q->Pos[d] - P[other].Pos[d], q->tree->BoxSize);
+}
+
+/* Put the local neighbour candidates of a primary query into lv->ngblist using the tree's neighbour cache.
+ * If the cached list of the particle covers the search, it is copied. Otherwise the local tree is walked
+ * with the search radius enlarged by the skin, and the candidates inside the enlarged radius are stored
+ * as the new list of the particle, as in a Verlet list. The list is only re-used at the position it was
+ * made at: the cache lives only as long as the tree, and particles are not drifted during that time,
+ * so a moved query means the list is stale.
+ * Symmetric queries, such as hydro, re-use the lists made by earlier asymmetric walks (density) but do not make them,
+ * since their radius depends on the hsml of the neighbours. The list holds every particle inside its radius,
+ * so the only neighbours missing from it are those outside the radius whose own hsml reaches the query.
+ * These are found by walking only the tree nodes with an hmax larger than the list radius.
+ * Returns the number of candidates, or -1 if the cache cannot be used for this query.*/
+static int
+ev_ngb_cache_fill(TreeWalkQueryBase * I, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv)
+{
+    const TreeWalk * tw = lv->tw;
+    struct NgbCache * cache = tw->tree->NgbCache;
+    if(!cache || !tw->UseNgbCache || lv->mode != TREEWALK_PRIMARY || lv->tree != tw->tree || lv->target < 0)
+        return -1;
+
+    struct NgbCacheEntry * entry = &cache->Entries[lv->target];
+    if(entry->Count >= 0 && entry->Radius >= iter->Hsml && (entry->mask & iter->mask) == iter->mask
+        && entry->Pos[0] == I->Pos[0] && entry->Pos[1] == I->Pos[1] && entry->Pos[2] == I->Pos[2]) {
+        memcpy(lv->ngblist, cache->List + entry->Start, entry->Count * sizeof(int));
+        int n = entry->Count;
+        if(iter->symmetric == NGB_TREEFIND_SYMMETRIC)
+            n = ngb_treefind_hmax(I, iter, entry->Radius, n, lv);
+        lv->NNgbCacheHits++;
+        return n;
+    }
+    /* Symmetric searches depend on the hsml of the neighbours, which changes between treewalks.*/
+    if(iter->symmetric == NGB_TREEFIND_SYMMETRIC)
+        return -1;
+
+    /* Walk the local tree at the enlarged radius*/
+    const double Hsml = iter->Hsml;
+    const double radius = Hsml * (1 + cache->Skin);
+    iter->Hsml = radius;
+    int numcand = ngb_treefind_threads(I, iter, tw->tree->firstnode, lv);
+    iter->Hsml = Hsml;
+    if(numcand < 0)
+        return -1;
+
+    /* Keep only the candidates which can be neighbours of a later search within the enlarged radius*/
+    struct QueryPos q;
+    ev_query_pos_init(&q, I, tw->tree);
+    int i, n = 0;
+    for(i = 0; i < numcand; i++) {
+        const int other = lv->ngblist[i];
+        if(P[other].IsGarbage || !((1<<P[other].Type) & iter->mask))
+            continue;
+        double r2 = 0;
+        int d;
+        for(d = 0; d < 3; d++) {
+            const double dx = ev_query_sep(&q, other, d);
+            r2 += dx * dx;
+        }
+        if(r2 > radius * radius)
+            continue;
+        lv->ngblist[n++] = other;
+    }
+
+    /* Store the list if there is space. Space used by an older list for this particle is not re-used.*/
+    const int64_t start = atomic_fetch_and_add_64(&cache->Used, n);
+    if(start + n <= cache->Size) {
+        memcpy(cache->List + start, lv->ngblist, n * sizeof(int));
+        for(i = 0; i < 3; i++)
+            entry->Pos[i] = I->Pos[i];
+        entry->Radius = radius;
+        entry->mask = iter->mask;
+        entry->Start = start;
+        entry->Count = n;
+    }
+    return n;
+}
+
+/* Gathered candidate neighbours waiting to be checked against the search radius.*/
+struct NgbCandidates
+{
+    int n;
+    int other[NGB_BATCH_SIZE];
+    double pos[3][NGB_BATCH_SIZE];
+    /* Used instead of pos if the tree has integer positions*/
+    MyIntPosType intpos[3][NGB_BATCH_SIZE];
+    double h[NGB_BATCH_SIZE];
+    struct QueryPos q;
+};
+
+/* Check a block of gathered candidates against the search radius, and pass those inside it to ngbiter_batch.
+ * The distances are computed for the whole block in simple loops over the gathered positions, which the compiler can vectorise.
+ * Returns the number of neighbours found.*/
+static int64_t
+ev_flush_ngb_candidates(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, struct NgbCandidates * cand, LocalTreeWalk * lv)
+{
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+    const int n = cand->n;
+    double dist[3][NGB_BATCH_SIZE];
+    double r2[NGB_BATCH_SIZE];
+    int j, d;
+    if(tree->IntPos) {
+        for(d = 0; d < 3; d++)
+            for(j = 0; j < n; j++)
+                dist[d][j] = INTPOS_NEAREST(cand->q.IntPos[d], cand->intpos[d][j], tree->IntPosFac);
+    }
+    else {
+        for(d = 0; d < 3; d++)
+            for(j = 0; j < n; j++)
+                /* the distance vector points to 'other' */
+                dist[d][j] = NEAREST(I->Pos[d] - cand->pos[d][j], BoxSize);
+    }
+    for(j = 0; j < n; j++)
+        r2[j] = dist[0][j] * dist[0][j] + dist[1][j] * dist[1][j] + dist[2][j] * dist[2][j];
+
+    TreeWalkNgbBatch batch;
+    batch.n = 0;
+    for(j = 0; j < n; j++) {
+        if(r2[j] > cand->h[j] * cand->h[j])
+            continue;
+        const int other = cand->other[j];
+        const int k = batch.n++;
+        batch.other[k] = other;
+        for(d = 0; d < 3; d++)
+            batch.dist[d][k] = dist[d][j];
+        batch.r2[k] = r2[j];
+        batch.r[k] = sqrt(r2[j]);
+    }
+    cand->n = 0;
+    if(batch.n > 0)
+        lv->tw->ngbiter_batch(I, O, iter, &batch, lv);
+    return batch.n;
+}
+
+/* Add a candidate neighbour to the gathered block, evaluating the block if it is full.
+ * Returns the number of neighbours found.*/
+static int64_t
+ev_add_ngb_candidate(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, struct NgbCandidates * cand, const int other, const double h, LocalTreeWalk * lv)
+{
+    const int k = cand->n++;
+    cand->other[k] = other;
+    const ForceTree * tree = lv->tw->tree;
+    int d;
+    if(tree->IntPos)
+        for(d = 0; d < 3; d++)
+            cand->intpos[d][k] = tree->IntPos[other][d];
+    else
+        for(d = 0; d < 3; d++)
+            cand->pos[d][k] = P[other].Pos[d];
+    cand->h[k] = h;
+    if(cand->n == NGB_BATCH_SIZE)
+        return ev_flush_ngb_candidates(I, O, iter, cand, lv);
+    return 0;
+}
+
+/* Call ngbiter for the candidates in lv->ngblist which are inside the search radius.
+ * Returns the number of candidates checked.*/
+static int64_t
+ev_visit_ngblist(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, const int numcand, LocalTreeWalk * lv)
+{
+    struct QueryPos q;
+    ev_query_pos_init(&q, I, lv->tw->tree);
+    int numngb;
+
+    if(lv->tw->ngbiter_batch) {
+        struct NgbCandidates cand;
+        cand.n = 0;
+        cand.q = q;
+        for(numngb = 0; numngb < numcand; numngb ++) {
+            const int other = lv->ngblist[numngb];
+            if(P[other].IsGarbage || !((1<<P[other].Type) & iter->mask))
+                continue;
+            const double dist = (iter->symmetric == NGB_TREEFIND_SYMMETRIC) ? DMAX(P[other].Hsml, iter->Hsml) : iter->Hsml;
+            ev_add_ngb_candidate(I, O, iter, &cand, other, dist, lv);
+        }
+        ev_flush_ngb_candidates(I, O, iter, &cand, lv);
+        return numngb;
+    }
+
+    for(numngb = 0; numngb < numcand; numngb ++) {
+        int other = lv->ngblist[numngb];
+
+        /* Skip garbage*/
+        if(P[other].IsGarbage)
+            continue;
+        /* In case the type of the particle has changed since the tree was built.
+         * Happens for wind treewalk for gas turned into stars on this timestep.*/
+        if(!((1<<P[other].Type) & iter->mask)) {
+            continue;
+        }
+
+        double dist;
+
+        if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
+            dist = DMAX(P[other].Hsml, iter->Hsml);
+        } else {
+            dist = iter->Hsml;
+        }
+
+        double r2 = 0;
+        int d;
+        double h2 = dist * dist;
+        for(d = 0; d < 3; d ++) {
+            /* the distance vector points to 'other' */
+            iter->dist[d] = ev_query_sep(&q, other, d);
+            r2 += iter->dist[d] * iter->dist[d];
+            if(r2 > h2) break;
+        }
+        if(r2 > h2) continue;
+
+        /* update the iter and call the iteration function*/
+        iter->r2 = r2;
+        iter->r = sqrt(r2);
+        iter->other = other;
+
+        lv->tw->ngbiter(I, O, iter, lv);
+    }
+
+    return numngb;
 }
 
 /**********
@@ -941,64 +2649,34 @@ int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
     /* If symmetric, make sure we did hmax first*/
     if(iter->symmetric == NGB_TREEFIND_SYMMETRIC && !lv->tw->tree->hmax_computed_flag)
         endrun(3, "%s tried to do a symmetric treewalk without computing hmax!\n", lv->tw->ev_label);
-    const double BoxSize = lv->tw->tree->BoxSize;
+
+    if(ev_export_plan_skip(iter, lv)) {
+        lv->NExportPlanHits++;
+        return 0;
+    }
 
     int64_t ninteractions = 0;
     int inode = 0;
 
-    for(inode = 0; inode < NODELISTLENGTH && I->NodeList[inode] >= 0; inode++)
-    {
-        int numcand = ngb_treefind_threads(I, iter, I->NodeList[inode], lv);
-        /* Export buffer is full end prematurally */
-        if(numcand < 0)
-            return numcand;
-
-        /* If we are here, export is successful. Work on this particle -- first
-         * filter out all of the candidates that are actually outside. */
-        int numngb;
-
-        for(numngb = 0; numngb < numcand; numngb ++) {
-            int other = lv->ngblist[numngb];
-
-            /* Skip garbage*/
-            if(P[other].IsGarbage)
-                continue;
-            /* In case the type of the particle has changed since the tree was built.
-             * Happens for wind treewalk for gas turned into stars on this timestep.*/
-            if(!((1<<P[other].Type) & iter->mask)) {
-                continue;
-            }
-
-            double dist;
-
-            if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
-                dist = DMAX(P[other].Hsml, iter->Hsml);
-            } else {
-                dist = iter->Hsml;
-            }
-
-            double r2 = 0;
-            int d;
-            double h2 = dist * dist;
-            for(d = 0; d < 3; d ++) {
-                /* the distance vector points to 'other' */
-                iter->dist[d] = NEAREST(I->Pos[d] - P[other].Pos[d], BoxSize);
-                r2 += iter->dist[d] * iter->dist[d];
-                if(r2 > h2) break;
-            }
-            if(r2 > h2) continue;
-
-            /* update the iter and call the iteration function*/
-            iter->r2 = r2;
-            iter->r = sqrt(r2);
-            iter->other = other;
-
-            lv->tw->ngbiter(I, O, iter, lv);
+    /* Primary queries may take their candidates from the neighbour cache instead of walking the tree*/
+    const int numcached = ev_ngb_cache_fill(I, iter, lv);
+    if(numcached >= 0)
+        ninteractions += ev_visit_ngblist(I, O, iter, numcached, lv);
+    else {
+        for(inode = 0; inode < NODELISTLENGTH && I->NodeList[inode] >= 0; inode++)
+        {
+            int numcand = ngb_treefind_threads(I, iter, I->NodeList[inode], lv);
+            /* Export buffer is full end prematurally */
+            if(numcand < 0)
+                return numcand;
+
+            /* If we are here, export is successful. Work on this particle -- first
+             * filter out all of the candidates that are actually outside. */
+            ninteractions += ev_visit_ngblist(I, O, iter, numcand, lv);
         }
-
-        ninteractions += numngb;
     }
 
+    ev_export_plan_record(iter, lv);
     treewalk_add_counters(lv, ninteractions);
 
     return 0;
@@ -1038,6 +2716,35 @@ cull_node(const TreeWalkQueryBase * const I, const TreeWalkNgbIterBase * const i
     }
     return 1;
 }
+/* Check whether the particles of the remote top leaf behind pseudo node no may be in range of the query.
+ * The pseudo node is culled with the cube of the top leaf: this uses the box around its particles,
+ * so a query near a leaf with little gas near the boundary needs no export. Returns 1 if the leaf may have neighbours.*/
+static int
+cull_topleaf_extent(const TreeWalkQueryBase * const I, const TreeWalkNgbIterBase * const iter, const ForceTree * const tree, const int no)
+{
+    if(!tree->extent_computed_flag)
+        return 1;
+    const struct TopLeafExtent * ext = &tree->TopLeafExtent[no - tree->lastnode];
+    /* No particles*/
+    if(ext->min[0] > ext->max[0])
+        return 0;
+    /* A symmetric search also finds particles whose hsml reaches the query*/
+    double radius = iter->Hsml;
+    if(iter->symmetric == NGB_TREEFIND_SYMMETRIC)
+        radius = DMAX(radius, ext->hsmlmax);
+    double r2 = 0;
+    int d;
+    for(d = 0; d < 3; d++) {
+        const double center = 0.5 * (ext->min[d] + ext->max[d]);
+        const double dx = fabs(NEAREST(I->Pos[d] - center, tree->BoxSize)) - 0.5 * (ext->max[d] - ext->min[d]);
+        if(dx > radius)
+            return 0;
+        if(dx > 0)
+            r2 += dx * dx;
+    }
+    return r2 <= radius * radius;
+}
+
 /*****
  * This is the internal code that looks for particles in the ngb tree from
  * searchcenter upto hsml. if iter->symmetric is NGB_TREE_FIND_SYMMETRIC, then upto
@@ -1088,8 +2795,10 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
             }
         }
 
-        /* Cull the node */
-        if(0 == cull_node(I, iter, current, BoxSize)) {
+        /* Cull the node. Nodes with none of the wanted types are skipped, except in the toptree,
+         * where the exports must not depend on the type so that they can be reused by the export plan.*/
+        if(0 == cull_node(I, iter, current, BoxSize) ||
+            (lv->mode != TREEWALK_TOPTREE && !(current->f.TypeMask & iter->mask))) {
             /* in case the node can be discarded */
             no = current->sibling;
             continue;
@@ -1097,6 +2806,12 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
 
         if(lv->mode == TREEWALK_TOPTREE) {
             if(current->f.ChildType == PSEUDO_NODE_TYPE) {
+                /* Skip leaves whose particles are all out of range*/
+                if(!cull_topleaf_extent(I, iter, tree, current->s.suns[0])) {
+                    lv->NThisParticleExtentCulls++;
+                    no = current->sibling;
+                    continue;
+                }
                 /* Export the pseudo particle*/
                 if(-1 == treewalk_export_particle(lv, current->s.suns[0]))
                     return -1;
@@ -1140,6 +2855,58 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
     return numcand;
 }
 
+/* Append to lv->ngblist the local particles outside radius which may still be neighbours of a symmetric query,
+ * because their hsml is larger than their distance. Only nodes with hmax larger than radius can contain them.
+ * Used to complete a cached list of the particles inside radius. Returns the new number of candidates.*/
+static int
+ngb_treefind_hmax(TreeWalkQueryBase * I,
+        TreeWalkNgbIterBase * iter,
+        const double radius,
+        int numcand,
+        LocalTreeWalk * lv)
+{
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+    struct QueryPos q;
+    ev_query_pos_init(&q, I, tree);
+    int no = tree->firstnode;
+
+    while(no >= 0)
+    {
+        const struct NODE *current = &tree->Nodes[no];
+
+        if(current->mom.hmax <= radius || !(current->f.TypeMask & iter->mask)
+            || 0 == cull_node(I, iter, current, BoxSize)) {
+            no = current->sibling;
+            continue;
+        }
+        if(current->f.ChildType == PARTICLE_NODE_TYPE) {
+            int i;
+            for (i = 0; i < current->s.noccupied; i++) {
+                const int other = current->s.suns[i];
+                double r2 = 0;
+                int d;
+                for(d = 0; d < 3; d++) {
+                    const double dx = ev_query_sep(&q, other, d);
+                    r2 += dx * dx;
+                }
+                /* Particles inside the radius are already in the list*/
+                if(r2 > radius * radius)
+                    lv->ngblist[numcand++] = other;
+            }
+            no = current->sibling;
+            continue;
+        }
+        /* Remote particles were handled by the toptree walk*/
+        if(current->f.ChildType == PSEUDO_NODE_TYPE) {
+            no = current->sibling;
+            continue;
+        }
+        no = current->s.suns[0];
+    }
+    return numcand;
+}
+
 /*****
  * Variant of ngbiter that doesn't use the Ngblist.
  * The ngblist is generally preferred for memory locality reasons.
@@ -1157,7 +2924,23 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
     iter->other = -1;
     lv->tw->ngbiter(I, O, iter, lv);
 
+    if(ev_export_plan_skip(iter, lv)) {
+        lv->NExportPlanHits++;
+        return 0;
+    }
+
+    /* Primary queries may take their candidates from the neighbour cache instead of walking the tree*/
+    const int numcached = ev_ngb_cache_fill(I, iter, lv);
+    if(numcached >= 0) {
+        treewalk_add_counters(lv, ev_visit_ngblist(I, O, iter, numcached, lv));
+        return 0;
+    }
+
     int64_t ninteractions = 0;
+    /* Candidates gathered for ngbiter_batch*/
+    struct NgbCandidates cand;
+    cand.n = 0;
+    ev_query_pos_init(&cand.q, I, lv->tw->tree);
     int inode;
     for(inode = 0; inode < NODELISTLENGTH && I->NodeList[inode] >= 0; inode++)
     {
@@ -1181,14 +2964,21 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
                 }
             }
 
-            /* Cull the node */
-            if(0 == cull_node(I, iter, current, BoxSize)) {
+            /* Cull the node, and in the local tree nodes with none of the wanted types*/
+            if(0 == cull_node(I, iter, current, BoxSize) ||
+                (lv->mode != TREEWALK_TOPTREE && !(current->f.TypeMask & iter->mask))) {
                 /* in case the node can be discarded */
                 no = current->sibling;
                 continue;
             }
             if(lv->mode == TREEWALK_TOPTREE) {
                 if(current->f.ChildType == PSEUDO_NODE_TYPE) {
+                    /* Skip leaves whose particles are all out of range*/
+                    if(!cull_topleaf_extent(I, iter, tree, current->s.suns[0])) {
+                        lv->NThisParticleExtentCulls++;
+                        no = current->sibling;
+                        continue;
+                    }
                     /* Export the pseudo particle*/
                     if(-1 == treewalk_export_particle(lv, current->s.suns[0]))
                         return -1;
@@ -1218,13 +3008,18 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
                         if(!((1<<P[other].Type) & iter->mask))
                             continue;
 
+                        if(lv->tw->ngbiter_batch) {
+                            ninteractions += ev_add_ngb_candidate(I, O, iter, &cand, other, iter->Hsml, lv);
+                            continue;
+                        }
+
                         double dist = iter->Hsml;
                         double r2 = 0;
                         int d;
                         double h2 = dist * dist;
                         for(d = 0; d < 3; d ++) {
                             /* the distance vector points to 'other' */
-                            iter->dist[d] = NEAREST(I->Pos[d] - P[other].Pos[d], BoxSize);
+                            iter->dist[d] = ev_query_sep(&cand.q, other, d);
                             r2 += iter->dist[d] * iter->dist[d];
                             if(r2 > h2) break;
                         }
@@ -1256,7 +3051,10 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
             no = current->s.suns[0];
         }
     }
+    if(cand.n > 0)
+        ninteractions += ev_flush_ngb_candidates(I, O, iter, &cand, lv);
 
+    ev_export_plan_record(iter, lv);
     treewalk_add_counters(lv, ninteractions);
 
     return 0;
@@ -1264,6 +3062,12 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
 
 /* This function does treewalk_run in a loop, allocating a queue to allow some particles to be redone.
  * This loop is used primarily in density estimation.*/
+static void
+treewalk_print_ngb(const char * label, const double * v)
+{
+    message(0, "%s Max ngb=%g, min ngb=%g\n", label, v[0], v[1]);
+}
+
 void
 treewalk_do_hsml_loop(TreeWalk * tw, int * queue, int64_t queuesize, int update_hsml)
 {
@@ -1313,7 +3117,7 @@ treewalk_do_hsml_loop(TreeWalk * tw, int * queue, int64_t queuesize, int update_
 
         size = gadget_compact_thread_arrays(&ReDoQueue, &loop);
         /* We can stop if we are not updating hsml or if we are done.*/
-        if(!update_hsml || !MPIU_Any(size > 0, MPI_COMM_WORLD)) {
+        if(!update_hsml || !MPIU_Any(size > 0, GadgetComm)) {
             myfree(ReDoQueue);
             break;
         }
@@ -1323,10 +3127,9 @@ treewalk_do_hsml_loop(TreeWalk * tw, int * queue, int64_t queuesize, int update_
             if(tw->minnumngb[0] > tw->minnumngb[i])
                 tw->minnumngb[0] = tw->minnumngb[i];
         }
-        double minngb, maxngb;
-        MPI_Reduce(&tw->maxnumngb[0], &maxngb, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
-        MPI_Reduce(&tw->minnumngb[0], &minngb, 1, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
-        message(0, "Max ngb=%g, min ngb=%g\n", maxngb, minngb);
+        const double ngb[2] = {tw->maxnumngb[0], tw->minnumngb[0]};
+        const enum DiagOp ngbops[2] = {DIAG_MAX, DIAG_MIN};
+        diagnostics_add(tw->ev_label, ngb, ngbops, 2, treewalk_print_ngb);
 #ifdef DEBUG
         treewalk_print_stats(tw);
 #endif
@@ -1431,17 +3234,21 @@ ngb_narrow_down(double *right, double *left, const double *radius, const double
     return hsml;
 }
 
+static void
+treewalk_print_stats_reduced(const char * label, const double * v)
+{
+    int NTask;
+    MPI_Comm_size(GadgetComm, &NTask);
+    message(0, "%s Ngblist: min %ld max %ld avg %g average exports: %g avg target ranks: %g exports skipped by leaf extent: %g toptree skipped by export plan: %g node-local walks: %g neighbours from cache: %g\n", label, (int64_t) v[0], (int64_t) v[1],
+            v[2] / v[3], v[4] / NTask, v[5] / NTask, v[6] / NTask, v[7] / v[3], v[8] / NTask, v[9] / v[3]);
+}
+
+/* The statistics are printed once reduced with the other diagnostics of the step*/
 void
 treewalk_print_stats(const TreeWalk * tw)
 {
-    int64_t NExportTargets;
-    int64_t minNinteractions, maxNinteractions, Ninteractions, Nlistprimary, Nexport;
-    MPI_Reduce(&tw->minNinteractions, &minNinteractions, 1, MPI_INT64, MPI_MIN, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->maxNinteractions, &maxNinteractions, 1, MPI_INT64, MPI_MAX, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->Ninteractions, &Ninteractions, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->WorkSetSize, &Nlistprimary, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->Nexport_sum, &Nexport, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->NExportTargets, &NExportTargets, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    message(0, "%s Ngblist: min %ld max %ld avg %g average exports: %g avg target ranks: %g\n", tw->ev_label, minNinteractions, maxNinteractions,
-            (double) Ninteractions / Nlistprimary, ((double) Nexport)/ tw->NTask, ((double) NExportTargets)/ tw->NTask);
+    const double values[10] = {tw->minNinteractions, tw->maxNinteractions, tw->Ninteractions, tw->WorkSetSize,
+        tw->Nexport_sum, tw->NExportTargets, tw->NExtentCulls, tw->NExportPlanHits, tw->NSharedWalks, tw->NNgbCacheHits};
+    const enum DiagOp ops[10] = {DIAG_MIN, DIAG_MAX, DIAG_SUM, DIAG_SUM, DIAG_SUM, DIAG_SUM, DIAG_SUM, DIAG_SUM, DIAG_SUM, DIAG_SUM};
+    diagnostics_add(tw->ev_label, values, ops, 10, treewalk_print_stats_reduced);
 }
@@ -37,6 +37,21 @@ typedef struct {
 #endif
 } TreeWalkResultBase;
 
+/* Compact form of TreeWalkQueryBase sent to other ranks when the treewalk packs its exports.
+ * The position is stored relative to the centre of the first node in the NodeList,
+ * and the other NodeList entries as offsets from the first.*/
+typedef struct {
+    float Pos[3];
+    int NodeList0;
+    int16_t NodeListDelta[NODELISTLENGTH-1];
+#ifdef DEBUG
+    MyIDType ID;
+#endif
+} TreeWalkPackedQueryBase;
+
+/* Marks an empty NodeList entry in TreeWalkPackedQueryBase*/
+#define PACKED_NODELIST_END INT16_MIN
+
 typedef struct {
     int mask;
     int other;
@@ -47,6 +62,21 @@ typedef struct {
     enum NgbTreeFindSymmetric symmetric;
 } TreeWalkNgbIterBase;
 
+/* Number of neighbours passed to ngbiter_batch at once*/
+#define NGB_BATCH_SIZE 16
+
+/* A block of neighbours of a query which are inside the search radius, stored as a structure of arrays
+ * so that modules can loop over the block with vector instructions.
+ * dist points from the neighbour to the query, as in TreeWalkNgbIterBase.
+ * Modules gather any particle properties they need from other.*/
+typedef struct {
+    int n;
+    int other[NGB_BATCH_SIZE];
+    double dist[3][NGB_BATCH_SIZE];
+    double r2[NGB_BATCH_SIZE];
+    double r[NGB_BATCH_SIZE];
+} TreeWalkNgbBatch;
+
 /*!< Thread-local list of the particles to be exported,
  * and the destination tasks. This table allows the
 results to be disentangled again and to be
@@ -68,33 +98,73 @@ typedef struct {
     size_t Nexport;
     /* Number of entries in the export table for this particle*/
     size_t NThisParticleExport;
+    /* Number of toptree leaves this particle was exported to, including those skipped on resume*/
+    size_t NThisParticleNodes;
+    /* Number of toptree leaves not exported to for this particle because their particles were out of range*/
+    size_t NThisParticleExtentCulls;
+    /* Number of exports to skip because they were sent in a previous export round*/
+    size_t NExportSkip;
     /* Index to use in the current node list*/
     size_t nodelistindex;
     /* Pointer to memory for exports*/
     data_index * DataIndexTable;
 
     int * ngblist;
+    /* Tree and particle table walked by this thread. These are the local tree and P,
+     * except when walking the tree of another rank on this node through shared memory.*/
+    const ForceTree * tree;
+    struct particle_data * Parts;
     int64_t maxNinteractions;
     int64_t minNinteractions;
     int64_t Ninteractions;
+    /* Number of toptree walks skipped using the export plan*/
+    int64_t NExportPlanHits;
+    /* Number of exports skipped because the particles of the top leaf were out of range*/
+    int64_t NExtentCulls;
+    /* Number of local tree walks replaced by a cached neighbour list*/
+    int64_t NNgbCacheHits;
 } LocalTreeWalk;
 
 typedef int (*TreeWalkVisitFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, LocalTreeWalk * lv);
 
+/* Visit a bucket of nquery primary queries which share a tree leaf. input and output are arrays of nquery elements.*/
+typedef int (*TreeWalkVisitBucketFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, const int nquery, LocalTreeWalk * lv);
+
 typedef void (*TreeWalkNgbIterFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv);
 
+typedef void (*TreeWalkNgbBatchFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, TreeWalkNgbIterBase * iter, const TreeWalkNgbBatch * batch, LocalTreeWalk * lv);
+
 typedef int (*TreeWalkHasWorkFunction) (const int i, TreeWalk * tw);
 typedef void (*TreeWalkProcessFunction) (const int i, TreeWalk * tw);
 
 typedef void (*TreeWalkFillQueryFunction)(const int j, TreeWalkQueryBase * query, TreeWalk * tw);
+/* Convert the module part of a query to and from the packed wire format. The base part is handled by the treewalk.*/
+typedef void (*TreeWalkPackQueryFunction)(const TreeWalkQueryBase * query, TreeWalkPackedQueryBase * packed, TreeWalk * tw);
+typedef void (*TreeWalkUnpackQueryFunction)(const TreeWalkPackedQueryBase * packed, TreeWalkQueryBase * query, TreeWalk * tw);
+/* Convert the module part of a result to and from the packed wire format.*/
+typedef void (*TreeWalkPackResultFunction)(const TreeWalkResultBase * result, TreeWalkResultBase * packed, TreeWalk * tw);
+typedef void (*TreeWalkUnpackResultFunction)(const TreeWalkResultBase * packed, TreeWalkResultBase * result, TreeWalk * tw);
 typedef void (*TreeWalkReduceResultFunction)(const int j, TreeWalkResultBase * result, const enum TreeWalkReduceMode mode, TreeWalk * tw);
 
+/* Start evaluating nquery primary queries against the local tree, eg, on an accelerator, without waiting for the result.
+ * results is zeroed. Once the end function returns, it must hold the result of each query,
+ * and ninteractions the number of neighbours each query interacted with.*/
+typedef void (*TreeWalkOffloadBeginFunction)(const TreeWalkQueryBase * queries, TreeWalkResultBase * results, int * ninteractions, const int64_t nquery, TreeWalk * tw);
+/* Wait for the queries started by the begin function.*/
+typedef void (*TreeWalkOffloadEndFunction)(TreeWalk * tw);
+
 enum TreeWalkType {
     TREEWALK_ACTIVE = 0,
     TREEWALK_ALL,
     TREEWALK_SPLIT,
+    /* The primary treewalk groups queries whose particles share a tree leaf into buckets,
+     * and walks the tree once per bucket using visit_bucket. Toptree and ghost walks use visit.*/
+    TREEWALK_BUCKET,
 };
 
+/* Largest number of queries in a bucket: the number of particles in a tree leaf.*/
+#define TREEWALK_BUCKET_MAX NMAXCHILD
+
 struct TreeWalk {
     void * priv;
 
@@ -110,15 +180,32 @@ struct TreeWalk {
     size_t query_type_elsize;
     size_t result_type_elsize;
     size_t ngbiter_type_elsize;
+    /* Sizes of the packed wire format for queries and results. Only used if the pack functions are set.*/
+    size_t query_packed_elsize;
+    size_t result_packed_elsize;
 
     TreeWalkVisitFunction visit;                /* Function to be called between a tree node and a particle */
+    TreeWalkVisitBucketFunction visit_bucket;   /* Function to be called between a tree node and a bucket of particles, for TREEWALK_BUCKET */
     TreeWalkHasWorkFunction haswork; /* Is the particle part of this interaction? */
     TreeWalkFillQueryFunction fill;       /* Copy the useful attributes of a particle to a query.
                                             Note: This may be called multiple times including after a reduce and so MUST NOT copy attributes modified by reduce. */
     TreeWalkReduceResultFunction reduce;  /* Reduce a partial result to the local particle storage */
     TreeWalkNgbIterFunction ngbiter;     /* called for each pair of particles if visit is set to ngbiter */
+    TreeWalkNgbBatchFunction ngbiter_batch; /* If set, called with blocks of neighbours instead of calling ngbiter for each pair.
+                                               ngbiter is still called with other == -1 to initialise the iterator. */
     TreeWalkProcessFunction postprocess; /* postprocess finalizes quantities for each particle, e.g. divide the normalization */
     TreeWalkProcessFunction preprocess; /* Preprocess initializes quantities for each particle */
+    /* Optional functions converting exported queries and results to a smaller wire format.
+     * They are used if TreeWalkPackExports is set, and shrink the volume of the export communication.*/
+    TreeWalkPackQueryFunction pack_query;
+    TreeWalkUnpackQueryFunction unpack_query;
+    TreeWalkPackResultFunction pack_result;
+    TreeWalkUnpackResultFunction unpack_result;
+    /* Optional functions evaluating the local part of the primary treewalk elsewhere, eg, on an accelerator.
+     * If set, they are used instead of visit for the local queries, while the host walks the toptree
+     * and evaluates the imported queries as usual. The results are reduced with TREEWALK_PRIMARY.*/
+    TreeWalkOffloadBeginFunction offload_begin;
+    TreeWalkOffloadEndFunction offload_end;
     int64_t NThread; /*Number of OpenMP threads*/
 
     /* performance metrics */
@@ -143,6 +230,16 @@ struct TreeWalk {
     int64_t Nexportfull;
     /* Number of MPI ranks we export to from this rank.*/
     int64_t NExportTargets;
+    /* Number of import buffers from other ranks which were evaluated during the primary treewalk.*/
+    int64_t NimportOverlap;
+    /* Number of particles whose toptree walk was skipped using the export plan.*/
+    int64_t NExportPlanHits;
+    /* Number of exports skipped because the particles of the top leaf were out of range, see TopLeafExtent.*/
+    int64_t NExtentCulls;
+    /* Number of primary queries which used a cached neighbour list instead of walking the local tree.*/
+    int64_t NNgbCacheHits;
+    /* Number of exports which walked the tree of a rank on this node through shared memory instead of being sent.*/
+    int64_t NSharedWalks;
     /* Number of times we needed to re-run the treewalk.
      * Convenience variable for density. */
     int64_t Niteration;
@@ -157,16 +254,46 @@ struct TreeWalk {
     /* Information allowing the toptree walk to restart successfully after the export buffer fills up*/
     int * QueueChunkRestart;
     int64_t * QueueChunkEnd;
+    /* Number of exports of the restarted particle which were already sent*/
+    size_t * QueueChunkSkip;
     /* Pointer to a particle export table for each thread.*/
     data_index ** ExportTable_thread;
     /* Flags that our export buffer is full*/
     int BufferFullFlag;
+    /* Set if so few particles are active that the export counts are exchanged only with the ranks exported to*/
+    int SparseCounts;
     /* Number of particles we can fit into the export buffer*/
     size_t BunchSize;
     /* List of neighbour candidates.*/
     int *Ngblist;
     /* Flag not allocating neighbour list*/
     int NoNgblist;
+    /* Set if the queries and results are sent in the packed wire format, and the size of each element sent.*/
+    int PackQueries;
+    int PackResults;
+    size_t query_wire_elsize;
+    size_t result_wire_elsize;
+    /* Use a work-stealing scheduler for the primary treewalk, which can split the queue down to single particles.
+     * Reduces thread imbalance when a few particles are much more expensive than the rest, as in clustered regions.*/
+    int WorkSteal;
+    /* Flags that this treewalk may use and update the export plan of the tree, if the tree has one.
+     * Only set this if queries are particles at P[i].Pos, as the plan is indexed by particle.*/
+    int UseExportPlan;
+    /* Flags that this treewalk may use and fill the neighbour cache of the tree, if the tree has one.
+     * Only set this if queries are particles at P[i].Pos. Symmetric searches re-use the lists but do not make them.*/
+    int UseNgbCache;
+    /* Flags that the ngbiter of this treewalk adds to the neighbouring particles, rather than only to its result.
+     * The order of these updates depends on thread scheduling, so with TreeWalkDeterministic the walk runs on one thread.*/
+    int WritesNeighbours;
+    /* Flags that the interactions of each primary query are added to P[].NgbCost.*/
+    int StoreNgbCost;
+    /* Largest hmax of the toptree leaves on other ranks, used to check the export plan for symmetric treewalks.*/
+    double MaxRemoteHmax;
+    /* Flags that the ghost walk of this treewalk reads only lv->tree and lv->Parts, and no other particle data,
+     * so that with TreeWalkSharedMemory exports to ranks on the same node can be evaluated here on their tree.*/
+    int ShareNodeTrees;
+    /* Trees of the other ranks on this node, if they are being shared during this treewalk. Internal.*/
+    struct SharedNodeTrees * Shared;
     /*Did we use the active_set array as the WorkSet?*/
     int work_set_stolen_from_active;
     /* Index into WorkSet to start iteration.
@@ -176,6 +303,10 @@ struct TreeWalk {
     int * WorkSet;
     /* Size of the workset list*/
     int64_t WorkSetSize;
+    /* Queries and results of the offloaded primary treewalk, while it runs.*/
+    char * OffloadQueries;
+    char * OffloadResults;
+    int * OffloadNinteractions;
     /* Redo counters and queues*/
     size_t *NPLeft;
     int **NPRedo;
@@ -230,9 +361,28 @@ void treewalk_build_queue(TreeWalk * tw, int * active_set, const size_t size, in
 
 /* Print some counters for a completed treewalk*/
 void treewalk_print_stats(const TreeWalk * tw);
+
+/* Returns true if TreeWalkSharedMemory is set, so main memory should be allocated with mymalloc_init_shared*/
+int treewalk_shared_memory_on(void);
+
+/* Returns true if TreeWalkLogStats is set, so the treewalk log file should be opened*/
+int treewalk_log_on(void);
+
+/* Returns the fractional skin of the neighbour cache set by TreeWalkNgbCacheSkin. If zero, no cache should be allocated.*/
+double treewalk_ngb_cache_skin(void);
+
+/* Returns true if TreeWalkIntPositions is set, so the gas tree should make integer positions*/
+int treewalk_int_positions_on(void);
+
+/* Set the file each treewalk appends a line of JSON statistics to, and the step number recorded.
+ * The file should be non-NULL only on rank 0.*/
+void treewalk_set_log(FILE * fd, const int step);
 /* Increment some counters in the ngbiter function*/
 void treewalk_add_counters(LocalTreeWalk * lv, const int64_t ninteractions);
 
+/* Returns the number of interactions done by all treewalks on this rank so far, for benchmarks*/
+int64_t treewalk_total_interactions(void);
+
 /* Change the size of the export buffer, for tests*/
 void treewalk_set_max_export_buffer(size_t maxbuf);
 
@@ -16,6 +16,17 @@ typedef uint64_t MyIDType;
 
 typedef LOW_PRECISION MyFloat;
 
+/* With LEAN_PARTICLES, some rarely used fields of every particle or slot are stored in smaller types:
+ * the FOF group number is 32-bit, as it is in the snapshots,
+ * and the potential and black hole dynamical friction fields are single precision.*/
+#ifdef LEAN_PARTICLES
+typedef int32_t grnr_t;
+typedef float DiagFloat;
+#else
+typedef int64_t grnr_t;
+typedef MyFloat DiagFloat;
+#endif
+
 #define HAS(val, flag) ((flag & (val)) == (flag))
 
 #endif
@@ -21,4 +21,6 @@
 #include "utils/endrun.h"
 #include "utils/interp.h"
 #include "utils/spinlocks.h"
+#include "utils/sharedtable.h"
+#include "utils/diagnostics.h"
 #endif
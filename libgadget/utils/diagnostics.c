@@ -0,0 +1,142 @@
+#include <mpi.h>
+#include <string.h>
+
+#include "diagnostics.h"
+#include "system.h"
+#include "endrun.h"
+
+#define DIAG_MAX_ENTRIES 256
+#define DIAG_MAX_VALUES 2048
+
+struct DiagEntry
+{
+    char label[64];
+    diag_print_func print;
+    /* Position and number of the values in the buffer*/
+    int start;
+    int n;
+};
+
+/* A value and how it is reduced. The op travels with the value,
+ * as MPI may apply the reduction to any part of the buffer.*/
+struct DiagValue
+{
+    double value;
+    double op;
+};
+
+/* Entries and values of one reduction, in the order they were added.*/
+struct DiagBuffer
+{
+    struct DiagEntry entries[DIAG_MAX_ENTRIES];
+    int nentry;
+    struct DiagValue values[DIAG_MAX_VALUES];
+    struct DiagValue recv[DIAG_MAX_VALUES];
+    int nvalue;
+    MPI_Request request;
+    int active;
+};
+
+/* One buffer is filled while the other is being reduced*/
+static struct DiagBuffer Buffers[2];
+static int Current = 0;
+
+static void
+diag_reduce_op(void * invec, void * inoutvec, int * len, MPI_Datatype * datatype)
+{
+    const struct DiagValue * in = (const struct DiagValue *) invec;
+    struct DiagValue * inout = (struct DiagValue *) inoutvec;
+    int i;
+    for(i = 0; i < *len; i++) {
+        switch((int) in[i].op) {
+            case DIAG_SUM:
+                inout[i].value += in[i].value;
+                break;
+            case DIAG_MIN:
+                if(in[i].value < inout[i].value)
+                    inout[i].value = in[i].value;
+                break;
+            case DIAG_MAX:
+                if(in[i].value > inout[i].value)
+                    inout[i].value = in[i].value;
+                break;
+        }
+    }
+}
+
+static void
+diag_start(struct DiagBuffer * buf)
+{
+    static MPI_Op op = MPI_OP_NULL;
+    static MPI_Datatype type = MPI_DATATYPE_NULL;
+    if(op == MPI_OP_NULL) {
+        MPI_Op_create(diag_reduce_op, 1, &op);
+        MPI_Type_contiguous(2, MPI_DOUBLE, &type);
+        MPI_Type_commit(&type);
+    }
+    MPI_Ireduce(buf->values, buf->recv, buf->nvalue, type, op, 0, GadgetComm, &buf->request);
+    buf->active = 1;
+}
+
+static void
+diag_complete(struct DiagBuffer * buf)
+{
+    if(!buf->active)
+        return;
+    MPI_Wait(&buf->request, MPI_STATUS_IGNORE);
+    buf->active = 0;
+
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask == 0) {
+        double values[DIAG_MAX_VALUES];
+        int i;
+        for(i = 0; i < buf->nvalue; i++)
+            values[i] = buf->recv[i].value;
+        for(i = 0; i < buf->nentry; i++)
+            buf->entries[i].print(buf->entries[i].label, values + buf->entries[i].start);
+    }
+    buf->nentry = 0;
+    buf->nvalue = 0;
+}
+
+void
+diagnostics_add(const char * label, const double * values, const enum DiagOp * ops, const int n, diag_print_func print)
+{
+    if(n > DIAG_MAX_VALUES)
+        endrun(5, "Diagnostic %s has %d values, more than the maximum %d\n", label, n, DIAG_MAX_VALUES);
+    if(Buffers[Current].nentry >= DIAG_MAX_ENTRIES || Buffers[Current].nvalue + n > DIAG_MAX_VALUES)
+        diagnostics_finish();
+    struct DiagBuffer * buf = &Buffers[Current];
+
+    struct DiagEntry * entry = &buf->entries[buf->nentry++];
+    strncpy(entry->label, label, sizeof(entry->label) - 1);
+    entry->label[sizeof(entry->label) - 1] = '\0';
+    entry->print = print;
+    entry->start = buf->nvalue;
+    entry->n = n;
+    int i;
+    for(i = 0; i < n; i++) {
+        buf->values[buf->nvalue + i].value = values[i];
+        buf->values[buf->nvalue + i].op = ops[i];
+    }
+    buf->nvalue += n;
+}
+
+void
+diagnostics_flush(void)
+{
+    struct DiagBuffer * buf = &Buffers[Current];
+    diag_complete(&Buffers[!Current]);
+    if(buf->nentry == 0)
+        return;
+    diag_start(buf);
+    Current = !Current;
+}
+
+void
+diagnostics_finish(void)
+{
+    diagnostics_flush();
+    diag_complete(&Buffers[!Current]);
+}
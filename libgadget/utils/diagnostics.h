@@ -0,0 +1,32 @@
+#ifndef __UTILS_DIAGNOSTICS_H
+#define __UTILS_DIAGNOSTICS_H
+
+/* Deferred diagnostics. Printed statistics which need a reduction over ranks are not reduced
+ * one collective at a time: each is added to a buffer with diagnostics_add, and all the values
+ * of a step are reduced to rank 0 together by one nonblocking reduction, started by diagnostics_flush.
+ * Once it completes, at the next flush or at diagnostics_finish, the print function of each entry
+ * is called on rank 0 with the reduced values.
+ *
+ * All ranks must add the same entries in the same order. Values are stored as doubles,
+ * so integer counts are exact below 2^53.*/
+
+enum DiagOp {
+    DIAG_SUM = 0,
+    DIAG_MIN = 1,
+    DIAG_MAX = 2,
+};
+
+/* Called on rank 0 with the reduced values of an entry, in the order they were added.*/
+typedef void (*diag_print_func)(const char * label, const double * values);
+
+/* Add an entry of n values, each reduced with the matching element of ops.
+ * label is copied, and passed to print. If the buffer is full, all pending entries are reduced and printed first.*/
+void diagnostics_add(const char * label, const double * values, const enum DiagOp * ops, const int n, diag_print_func print);
+
+/* Start reducing the entries added since the last flush, after printing those of the last flush.*/
+void diagnostics_flush(void);
+
+/* Reduce and print all pending entries.*/
+void diagnostics_finish(void);
+
+#endif
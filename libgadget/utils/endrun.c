@@ -98,7 +98,7 @@ OsSigHandler(int no)
     const char btline[] = "Task %d Killed by Signal %d. Use eu-addr2line to get function names.\n";
     char linebuf[128];
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     sprintf(linebuf, btline, ThisTask, no);
     write(STDERR_FILENO, linebuf, strlen(linebuf));
     void * buf[BT_BUF_SIZE];
@@ -106,7 +106,7 @@ OsSigHandler(int no)
     backtrace_symbols_fd(buf, nlines, STDERR_FILENO);
     if(ShowBacktrace)
         show_backtrace();
-    MPI_Abort(MPI_COMM_WORLD, no);
+    MPI_Abort(GadgetComm, no);
 }
 
 void
@@ -140,12 +140,12 @@ endrun(int where, const char * fmt, ...)
 {
     va_list va;
     va_start(va, fmt);
-    MPIU_Tracev(MPI_COMM_WORLD, where, 1, fmt, va);
+    MPIU_Tracev(GadgetComm, where, 1, fmt, va);
     va_end(va);
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0 || where > 0) {
-        MPI_Abort(MPI_COMM_WORLD, where);
+        MPI_Abort(GadgetComm, where);
     }
     /* This is here so the compiler knows this
      * function never returns. */
@@ -165,7 +165,7 @@ void message(int where, const char * fmt, ...)
 {
     va_list va;
     va_start(va, fmt);
-    MPIU_Tracev(MPI_COMM_WORLD, where, 0, fmt, va);
+    MPIU_Tracev(GadgetComm, where, 0, fmt, va);
     va_end(va);
 }
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
 
@@ -16,7 +17,7 @@ void interp_init(Interp * obj, int Ndim, int64_t * dims) {
     /* alloc memory */
     obj->Ndim = Ndim;
     obj->data = mymalloc("interp_data", 0
-        +   sizeof(double) * Ndim * 3
+        +   sizeof(double) * Ndim * 4
         +   sizeof(ptrdiff_t) * Ndim
         +   sizeof(int) * Ndim);
 
@@ -25,6 +26,7 @@ void interp_init(Interp * obj, int Ndim, int64_t * dims) {
     obj->Min = (double*) (obj->strides + Ndim);
     obj->Step = obj->Min + Ndim;
     obj->Max = obj->Step + Ndim;
+    obj->InvStep = obj->Max + Ndim;
 
     /* fillin strides */
     N = 1;
@@ -51,16 +53,96 @@ void interp_init_dim(Interp * obj, int d, double Min, double Max) {
     obj->Min[d] = Min;
     obj->Max[d] = Max;
     obj->Step[d] = (Max - Min) / (obj->dims[d] - 1);
+    obj->InvStep[d] = 1. / obj->Step[d];
 }
 
+/* Find the cell containing x on dimension d, the fractional offset f within it
+ * and the stride to the second point, which is 0 if that point is not needed. */
+static inline ptrdiff_t
+interp_locate(const Interp * obj, const int d, const double x, double * f, ptrdiff_t * step, int * status)
+{
+    *step = 0;
+    *f = 0;
+    if (x < obj->Min[d]) {
+        *status = -1;
+        return 0;
+    }
+    if (x > obj->Max[d]) {
+        *status = 1;
+        return (ptrdiff_t) (obj->dims[d] - 1) * obj->strides[d];
+    }
+    *status = 0;
+    const double xd = (x - obj->Min[d]) * obj->InvStep[d];
+    int xi = floor(xd);
+    /* On the upper boundary, up to rounding*/
+    if(xi >= obj->dims[d] - 1)
+        return (ptrdiff_t) (obj->dims[d] - 1) * obj->strides[d];
+    *f = xd - xi;
+    if(*f > 0)
+        *step = obj->strides[d];
+    return (ptrdiff_t) xi * obj->strides[d];
+}
 
-static ptrdiff_t linearindex(ptrdiff_t * strides, int * xi, int Ndim) {
-    int d;
-    ptrdiff_t rt = 0;
-    for(d = 0; d < Ndim; d++) {
-        rt += strides[d] * xi[d] ;
+/* As above, with a periodic boundary: the index of the second point wraps around. */
+static inline ptrdiff_t
+interp_locate_periodic(const Interp * obj, const int d, const double x, double * f, ptrdiff_t * step)
+{
+    const double xd = (x - obj->Min[d]) * obj->InvStep[d];
+    const double fl = floor(xd);
+    *f = xd - fl;
+    int xi = ((int64_t) fl) % obj->dims[d];
+    if(xi < 0)
+        xi += obj->dims[d];
+    const int xi1 = (xi + 1 < obj->dims[d]) ? xi + 1 : 0;
+    *step = (ptrdiff_t) (xi1 - xi) * obj->strides[d];
+    return (ptrdiff_t) xi * obj->strides[d];
+}
+
+/* Multi-linear interpolation from the located cell. The tables are small and
+ * the common cases are 1 to 3 dimensions, so these are written out. */
+static inline double
+interp_combine(const int Ndim, const double * ydata, const ptrdiff_t l, const double * f, const ptrdiff_t * step)
+{
+    const double * y = ydata + l;
+    switch(Ndim) {
+        case 1:
+            return y[0] * (1 - f[0]) + y[step[0]] * f[0];
+        case 2:
+            return (y[0] * (1 - f[1]) + y[step[1]] * f[1]) * (1 - f[0])
+                 + (y[step[0]] * (1 - f[1]) + y[step[0] + step[1]] * f[1]) * f[0];
+        case 3:
+        {
+            const double * y1 = y + step[0];
+            const double c0 = (y[0] * (1 - f[2]) + y[step[2]] * f[2]) * (1 - f[1])
+                            + (y[step[1]] * (1 - f[2]) + y[step[1] + step[2]] * f[2]) * f[1];
+            const double c1 = (y1[0] * (1 - f[2]) + y1[step[2]] * f[2]) * (1 - f[1])
+                            + (y1[step[1]] * (1 - f[2]) + y1[step[1] + step[2]] * f[2]) * f[1];
+            return c0 * (1 - f[0]) + c1 * f[0];
+        }
     }
-    return rt;
+    double ret = 0;
+    int i, d;
+    /* for each point covered by the filter */
+    for(i = 0; i < (1 << Ndim); i ++) {
+        double filter = 1.0;
+        ptrdiff_t li = 0;
+        for(d = 0; d < Ndim; d++ ) {
+            /*
+             * are we on this point or next point?
+             *
+             * weight on next point is f[d]
+             * weight on this point is 1 - f[d]
+             * */
+            if(i & (1 << d)) {
+                filter *= f[d];
+                li += step[d];
+            }
+            else
+                filter *= 1 - f[d];
+        }
+        ret += y[li] * filter;
+    }
+    return ret;
 }
 
 /* status:
@@ -74,99 +156,28 @@ double interp_eval(Interp * obj, double * x, double * ydata, int * status) {
     if(status == NULL) {
         status = (int *) alloca(sizeof(int) * obj->Ndim);
     }
-    int * xi = (int *) alloca(sizeof(int) * obj->Ndim);
     double * f = (double *) alloca(sizeof(double) * obj->Ndim);
+    ptrdiff_t * step = (ptrdiff_t *) alloca(sizeof(ptrdiff_t) * obj->Ndim);
 
-    for(d = 0; d < obj->Ndim; d++) {
-        double xd = (x[d] - obj->Min[d]) / obj->Step[d];
-        if (x[d] < obj->Min[d]) {
-            status[d] = -1;
-            xi[d] = 0;
-            f[d] = 0;
-        } else
-        if (x[d] > obj->Max[d]) {
-            status[d] = 1;
-            xi[d] = obj->dims[d] - 1;
-            f[d] = 0;
-        } else {
-            xi[d] = floor(xd);
-            f[d] = xd - xi[d];
-            status[d] = 0;
-        }
-    }
-
-    double ret = 0;
     /* the origin, "this point" */
-    ptrdiff_t l0 = linearindex(obj->strides, xi, obj->Ndim);
+    ptrdiff_t l0 = 0;
+    for(d = 0; d < obj->Ndim; d++)
+        l0 += interp_locate(obj, d, x[d], &f[d], &step[d], &status[d]);
 
-    int i;
-    /* for each point covered by the filter */
-    for(i = 0; i < obj->fsize; i ++) {
-        double filter = 1.0;
-        ptrdiff_t l = l0;
-        int skip = 0;
-        for(d = 0; d < obj->Ndim; d++ ) {
-            int foffset = (i & (1 << d))?1:0;
-            if(f[d] == 0 && foffset == 1) {
-                /* on this dimension the second data point 
-                 * is not needed */
-                skip = 1;
-                break;
-            }
-
-            /* 
-             * are we on this point or next point?
-             *
-             * weight on next point is f[d]
-             * weight on this point is 1 - f[d] 
-             * */
-            filter *= foffset?f[d] : (1 - f[d]);
-            l += foffset * obj->strides[d];
-        }
-        if(!skip) {
-            ret += ydata[l] * filter;
-        }
-    }
-    return ret;
+    return interp_combine(obj->Ndim, ydata, l0, f, step);
 }
 
 /* interpolation assuming periodic boundary */
 double interp_eval_periodic(Interp * obj, double * x, double * ydata) {
-    int * xi = (int *) alloca(sizeof(int) * obj->Ndim);
-    int * xi1 = (int *) alloca(sizeof(int) * obj->Ndim);
     double * f = (double *) alloca(sizeof(double) * obj->Ndim);
+    ptrdiff_t * step = (ptrdiff_t *) alloca(sizeof(ptrdiff_t) * obj->Ndim);
 
     int d;
-    for(d = 0; d < obj->Ndim; d++) {
-        double xd = (x[d] - obj->Min[d]) / obj->Step[d];
-        xi[d] = floor(xd);
-        f[d] = xd - xi[d];
-    }
+    ptrdiff_t l0 = 0;
+    for(d = 0; d < obj->Ndim; d++)
+        l0 += interp_locate_periodic(obj, d, x[d], &f[d], &step[d]);
 
-    double ret = 0;
-    /* the origin, "this point" */
-
-    int i;
-    /* for each point covered by the filter */
-    for(i = 0; i < obj->fsize; i ++) {
-        double filter = 1.0;
-        for(d = 0; d < obj->Ndim; d++ ) {
-            int foffset = (i & (1 << d))?1:0;
-            xi1[d] = xi[d] + foffset;
-            while(xi1[d] >= obj->dims[d]) xi1[d] -= obj->dims[d];
-            while(xi1[d] < 0 ) xi1[d] += obj->dims[d];
-            /* 
-             * are we on this point or next point?
-             *
-             * weight on next point is f[d]
-             * weight on this point is 1 - f[d] 
-             * */
-            filter *= foffset?f[d] : (1 - f[d]);
-        }
-        ptrdiff_t l = linearindex(obj->strides, xi1, obj->Ndim);
-        ret += ydata[l] * filter;
-    }
-    return ret;
+    return interp_combine(obj->Ndim, ydata, l0, f, step);
 }
 
 void interp_destroy(Interp * obj) {
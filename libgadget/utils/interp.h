@@ -10,6 +10,7 @@ typedef struct {
     double * Min;
     double * Step;
     double * Max; 
+    double * InvStep; /* 1 / Step, so that locating a point needs no division */
 
     void * data; /* internal buffer for all pointer data */
     int fsize;
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include "memory.h"
 #include "endrun.h"
 
@@ -17,6 +18,8 @@ struct BlockHeader {
     size_t request_size;
     char name[127];
     int dir;
+    int scoped; /* allocated inside a scope, so may be freed out of order */
+    int dead; /* freed out of order; reclaimed when the blocks above it are freed */
     char annotation[];
 } ;
 
@@ -40,6 +43,7 @@ allocator_init(Allocator * alloc, const char * name, const size_t request_size,
     alloc->base = rawbase + ALIGNMENT - ((size_t) rawbase % ALIGNMENT);
     alloc->size = size;
     alloc->use_malloc = 0;
+    alloc->external = 0;
     strncpy(alloc->name, name, 11);
     alloc->refcount = 1;
     alloc->top = alloc->size;
@@ -68,6 +72,7 @@ allocator_malloc_init(Allocator * alloc, const char * name, const size_t request
 
     alloc->parent = parent;
     alloc->use_malloc = 1;
+    alloc->external = 0;
     alloc->rawbase = rawbase;
     alloc->base = rawbase;
     alloc->size = size;
@@ -81,6 +86,27 @@ allocator_malloc_init(Allocator * alloc, const char * name, const size_t request
     return 0;
 }
 
+int
+allocator_init_external(Allocator * alloc, const char * name, char * rawbase, const size_t request_size, const int zero)
+{
+    size_t size = (request_size / ALIGNMENT + 1) * ALIGNMENT;
+
+    alloc->parent = NULL;
+    alloc->rawbase = rawbase;
+    alloc->base = rawbase + ALIGNMENT - ((size_t) rawbase % ALIGNMENT);
+    alloc->size = size;
+    alloc->use_malloc = 0;
+    alloc->external = 1;
+    strncpy(alloc->name, name, 11);
+    alloc->refcount = 1;
+    alloc->top = alloc->size;
+    alloc->bottom = 0;
+
+    allocator_reset(alloc, zero);
+
+    return 0;
+}
+
 int
 allocator_reset(Allocator * alloc, int zero)
 {
@@ -95,13 +121,63 @@ allocator_reset(Allocator * alloc, int zero)
     alloc->refcount = 1;
     alloc->top = alloc->size;
     alloc->bottom = 0;
+    alloc->nscope = 0;
+    alloc->ndead = 0;
+    allocator_reset_peaks(alloc);
 
     if(zero) {
-        memset(alloc->base, 0, alloc->size);
+        /* Zero in parallel, so that each page is first touched, and so placed, by a thread
+         * on the socket which will use it under a static schedule.*/
+        const int64_t npages = alloc->size / ALIGNMENT;
+        int64_t i;
+        #pragma omp parallel for schedule(static)
+        for(i = 0; i < npages; i++)
+            memset(alloc->base + i * ALIGNMENT, 0, ALIGNMENT);
     }
     return 0;
 }
 
+void
+allocator_reset_peaks(Allocator * alloc)
+{
+    alloc->peak = allocator_get_used_size(alloc, ALLOC_DIR_BOTH);
+    alloc->npeak = 0;
+}
+
+/* Attribute the current usage of the allocator to a newly allocated block.
+ * Names beyond the size of the table are counted together.*/
+static void
+allocator_update_peak(Allocator * alloc, const char * name, const size_t request_size)
+{
+    const size_t used = allocator_get_used_size(alloc, ALLOC_DIR_BOTH);
+    if(used > alloc->peak)
+        alloc->peak = used;
+    struct AllocatorPeak * entry = NULL;
+    int i;
+    for(i = 0; i < alloc->npeak; i++)
+        if(0 == strncmp(alloc->peaks[i].name, name, sizeof(entry->name) - 1)) {
+            entry = &alloc->peaks[i];
+            break;
+        }
+    if(!entry) {
+        if(alloc->npeak < ALLOC_NPEAK) {
+            entry = &alloc->peaks[alloc->npeak++];
+            strncpy(entry->name, name, sizeof(entry->name) - 1);
+        }
+        else {
+            entry = &alloc->peaks[ALLOC_NPEAK - 1];
+            strncpy(entry->name, "(other)", sizeof(entry->name) - 1);
+        }
+        entry->name[sizeof(entry->name) - 1] = '\0';
+        entry->size = 0;
+        entry->peak = 0;
+    }
+    if(request_size > entry->size)
+        entry->size = request_size;
+    if(used > entry->peak)
+        entry->peak = used;
+}
+
 static void *
 allocator_alloc_va(Allocator * alloc, const char * name, const size_t request_size, const int dir, const char * fmt, va_list va)
 {
@@ -142,6 +218,8 @@ allocator_alloc_va(Allocator * alloc, const char * name, const size_t request_si
     header->size = size;
     header->request_size = request_size;
     header->dir = dir;
+    header->scoped = alloc->nscope > 0;
+    header->dead = 0;
     header->alloc = alloc;
     strncpy(header->name, name, 126);
     header->name[126] = '\0';
@@ -160,6 +238,7 @@ allocator_alloc_va(Allocator * alloc, const char * name, const size_t request_si
         cptr = ptr + ALIGNMENT;
         header->ptr = cptr;
     }
+    allocator_update_peak(alloc, name, request_size);
     return cptr;
 }
 void *
@@ -181,7 +260,7 @@ allocator_destroy(Allocator * alloc)
     }
     if(alloc->parent)
         allocator_dealloc(alloc->parent, alloc->rawbase);
-    else
+    else if(!alloc->external)
         free(alloc->rawbase);
     return 0;
 }
@@ -308,6 +387,9 @@ allocator_print(Allocator * alloc)
     }
 }
 
+static int
+allocator_dealloc_internal(Allocator * alloc, void * ptr, const int allow_deferred);
+
 void *
 allocator_realloc_int(Allocator * alloc, void * ptr, const size_t new_size, const char * fmt, ...)
 {
@@ -331,10 +413,11 @@ allocator_realloc_int(Allocator * alloc, void * ptr, const size_t new_size, cons
         vsprintf(header2->annotation, fmt, va);
         va_end(va);
         memcpy(header2->self, header2, sizeof(header2[0]));
+        allocator_update_peak(alloc, header2->name, new_size);
         return header2->ptr;
     }
 
-    if(0 != allocator_dealloc(alloc, ptr)) {
+    if(0 != allocator_dealloc_internal(alloc, ptr, 0)) {
         allocator_print(header->alloc);
         endrun(1, "Mismatched Free: %s : %s\n", header->name, header->annotation);
     }
@@ -372,8 +455,56 @@ allocator_free (void * ptr)
     }
 }
 
-int
-allocator_dealloc (Allocator * alloc, void * ptr)
+/* Remove a block which is at the top of its stack from the allocator.*/
+static void
+allocator_release(Allocator * alloc, struct BlockHeader * header)
+{
+    if(header->dir == ALLOC_DIR_BOT)
+        alloc->bottom -= header->size;
+    else
+        alloc->top += header->size;
+    if(header->dead)
+        alloc->ndead--;
+    /* remove the link to the memory. */
+    header->ptr = NULL;
+    header->self = NULL;
+    header->alloc = NULL;
+    header->dead = 0;
+    alloc->refcount --;
+}
+
+/* Reclaim dead blocks which are now at the top of either stack.*/
+static void
+allocator_pop_dead(Allocator * alloc)
+{
+    /* The bottom stack can only be walked upwards: find the end of the last live block.*/
+    size_t off = 0, live_end = 0;
+    while(off < alloc->bottom) {
+        struct BlockHeader * header = (struct BlockHeader *) (alloc->base + off);
+        off += header->size;
+        if(!header->dead)
+            live_end = off;
+    }
+    while(alloc->bottom > live_end) {
+        /* Walk again to the last block: there are few dead blocks and few blocks*/
+        size_t last = live_end;
+        off = live_end;
+        while(off < alloc->bottom) {
+            last = off;
+            off += ((struct BlockHeader *) (alloc->base + off))->size;
+        }
+        allocator_release(alloc, (struct BlockHeader *) (alloc->base + last));
+    }
+    while(alloc->top < alloc->size) {
+        struct BlockHeader * header = (struct BlockHeader *) (alloc->base + alloc->top);
+        if(!header->dead)
+            break;
+        allocator_release(alloc, header);
+    }
+}
+
+static int
+allocator_dealloc_internal(Allocator * alloc, void * ptr, const int allow_deferred)
 {
     char * cptr = (char *) ptr;
     struct BlockHeader * header = (struct BlockHeader*) (cptr - ALIGNMENT);
@@ -383,31 +514,54 @@ allocator_dealloc (Allocator * alloc, void * ptr)
     }
 
     /* ->self is always the header in the allocator; header maybe a duplicate in use_malloc */
-    ptr = header->self;
-    if(header->dir == ALLOC_DIR_BOT) {
-        if(ptr != alloc->bottom - header->size + alloc->base) {
-            return ALLOC_EMISMATCH;
-        }
-        alloc->bottom -= header->size;
-    } else if(header->dir == ALLOC_DIR_TOP) {
-        if(ptr != alloc->top + alloc->base) {
-            return ALLOC_EMISMATCH;
-        }
-        alloc->top += header->size;
-    } else {
+    struct BlockHeader * self = (struct BlockHeader *) header->self;
+    if(self == NULL || self->dead)
+        return ALLOC_ENOTALLOC;
+    int ontop;
+    if(self->dir == ALLOC_DIR_BOT)
+        ontop = ((char *) self == alloc->bottom - self->size + alloc->base);
+    else if(self->dir == ALLOC_DIR_TOP)
+        ontop = ((char *) self == alloc->top + alloc->base);
+    else
         return ALLOC_ENOTALLOC;
-    }
+
+    if(!ontop && !(allow_deferred && self->scoped))
+        return ALLOC_EMISMATCH;
 
     if(alloc->use_malloc) {
         free(header);
     }
 
-    /* remove the link to the memory. */
-    header = (struct BlockHeader *) ptr; /* modify the true header in the allocator */
-    header->ptr = NULL;
-    header->self = NULL;
-    header->alloc = NULL;
-    alloc->refcount --;
+    if(!ontop) {
+        /* Freed out of order inside a scope: reclaimed when the blocks above are freed.*/
+        self->dead = 1;
+        alloc->ndead++;
+        return 0;
+    }
+
+    allocator_release(alloc, self);
+    if(alloc->ndead > 0)
+        allocator_pop_dead(alloc);
 
     return 0;
 }
+
+int
+allocator_dealloc (Allocator * alloc, void * ptr)
+{
+    return allocator_dealloc_internal(alloc, ptr, 1);
+}
+
+void
+allocator_scope_begin(Allocator * alloc)
+{
+    alloc->nscope++;
+}
+
+void
+allocator_scope_end(Allocator * alloc)
+{
+    if(alloc->nscope <= 0)
+        endrun(1, "Closing a scope on allocator %s which has none open\n", alloc->name);
+    alloc->nscope--;
+}
@@ -13,6 +13,16 @@ typedef struct Allocator Allocator;
 #define ALLOC_DIR_BOT +1
 #define ALLOC_DIR_BOTH 0
 
+/* Maximum number of distinct block names whose peak usage is tracked*/
+#define ALLOC_NPEAK 64
+
+/* High water mark attributed to one block name*/
+struct AllocatorPeak {
+    char name[24];
+    size_t size; /* largest block of this name */
+    size_t peak; /* largest total usage of the allocator just after a block of this name was allocated */
+};
+
 struct Allocator {
     char name[12];
     Allocator * parent;
@@ -26,6 +36,12 @@ struct Allocator {
 
     int refcount;
     int use_malloc; /* only do the book keeping. delegate to libc malloc/free */
+    int external; /* memory is owned by the caller and not freed by allocator_destroy */
+    int nscope; /* number of open scopes: blocks allocated in a scope may be freed in any order */
+    int ndead; /* number of scoped blocks freed out of order, not yet reclaimed */
+    size_t peak; /* largest total usage since the last allocator_reset_peaks */
+    int npeak;
+    struct AllocatorPeak peaks[ALLOC_NPEAK];
 };
 
 typedef struct AllocatorIter AllocatorIter;
@@ -50,12 +66,27 @@ allocator_init(Allocator * alloc, const char * name, const size_t size, const in
 int
 allocator_malloc_init(Allocator * alloc, const char * name, const size_t size, const int zero, Allocator * parent);
 
+/* Initialize an allocator using memory owned by the caller, which must be at least size + 2 * 4096 bytes.*/
+int
+allocator_init_external(Allocator * alloc, const char * name, char * rawbase, const size_t size, const int zero);
+
 int
 allocator_split(Allocator * alloc, Allocator * parent, const char * name, const size_t request_size, const int zero);
 
 int
 allocator_destroy(Allocator * alloc);
 
+/* Open a scope on the allocator. Blocks allocated while a scope is open may be freed in any order:
+ * a block freed before the blocks above it is marked dead and its memory is reclaimed as soon as
+ * every block above it has been freed. Scopes nest. Blocks allocated outside a scope must still be
+ * freed in stack order, and a scoped block may not be realloced once blocks are allocated above it.*/
+void
+allocator_scope_begin(Allocator * alloc);
+
+/* Close the innermost scope. Blocks allocated in the scope which are still live stay valid.*/
+void
+allocator_scope_end(Allocator * alloc);
+
 void *
 allocator_alloc(Allocator * alloc, const char * name, const size_t size, const int dir, const char * fmt, ...);
 
@@ -105,6 +136,10 @@ allocator_get_used_size(Allocator * alloc, int dir);
 void
 allocator_print(Allocator * alloc);
 
+/* Forget the high water marks of the allocator, eg, at the start of a step. The total peak restarts from the current usage.*/
+void
+allocator_reset_peaks(Allocator * alloc);
+
 int
 allocator_reset(Allocator * alloc, int zero);
 
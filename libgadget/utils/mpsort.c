@@ -580,10 +580,8 @@ _assign_colors(size_t glocalsize, size_t * sizes, int * ncolor, MPI_Comm comm)
             current_color ++;
         }
     }
-    /* no data for color of -1; exclude them later with special cases */
-    if(sizes[ThisTask] == 0) {
-        mycolor = -1;
-    }
+    /* Ranks without data stay in the segment of their neighbours: they may still
+     * expect output, which must come from the same place in the global order. */
 
     *ncolor = lastcolor + 1;
     return mycolor;
@@ -719,9 +717,39 @@ _destroy_segment_group(struct SegmentGroupDescr * descr)
     MPI_Comm_free(&descr->Leaders);
 }
 
+/* Time spent by this rank in each phase of the last sort*/
+static const char * _mpsort_phase_names[MPSORT_NPHASE] = {"Gather", "LocalSort", "Bisect", "Layout", "Exchange"};
+static double _mpsort_phase_time[MPSORT_NPHASE];
+static double _mpsort_phase_start;
+
+static void
+_mpsort_phase_reset(void)
+{
+    memset(_mpsort_phase_time, 0, sizeof(_mpsort_phase_time));
+    _mpsort_phase_start = MPI_Wtime();
+}
+
+/* Charge the time since the end of the previous phase to phase*/
+static void
+_mpsort_phase_end(enum MPSortPhase phase)
+{
+    double now = MPI_Wtime();
+    _mpsort_phase_time[phase] += now - _mpsort_phase_start;
+    _mpsort_phase_start = now;
+}
+
+double
+mpsort_mpi_last_run_time(enum MPSortPhase phase, const char ** name)
+{
+    if(name)
+        *name = _mpsort_phase_names[phase];
+    return _mpsort_phase_time[phase];
+}
+
 static void
-mpsort_increment_timer(const char * name, int erase)
+mpsort_increment_timer(const char * name, int erase, enum MPSortPhase phase)
 {
+    _mpsort_phase_end(phase);
     if(!(_TIMERS.tmr))
         return;
     struct TIMER * tmr = _TIMERS.tmr+_TIMERS.curtmr;
@@ -744,7 +772,7 @@ void mpsort_setup_timers(int ntimers)
 
 void mpsort_free_timers(void)
 {
-    if(!(_TIMERS.tmr)) {
+    if(_TIMERS.tmr) {
         myfree(_TIMERS.tmr);
         _TIMERS.tmr = NULL;
         _TIMERS.ntimer = 0;
@@ -786,6 +814,28 @@ mpsort_mpi_impl (void * mybase, size_t mynmemb, size_t size,
 
 static int
 mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o);
+static int
+mpsort_mpi_sample_sort(struct crstruct d, struct crmpistruct o);
+
+/* Total size below which all the data is gathered to one rank and sorted there.*/
+#define MPSORT_GATHER_SORT_BYTES (4 * 1024 * 1024)
+
+/* The histogram sort needs one pair of allreduces per bisection, up to one per bit of the radix.
+ * Beyond this many ranks (for radixes of more than 4 bytes; four times as many for narrower radixes)
+ * the sample sort, which needs an allgather and two alltoalls, is used instead.*/
+#define MPSORT_SAMPLE_SORT_MIN_TASKS 64
+
+static int
+_use_sample_sort(int NTask, size_t rsize)
+{
+    if(mpsort_mpi_has_options(MPSORT_REQUIRE_SAMPLE_SORT))
+        return 1;
+    if(mpsort_mpi_has_options(MPSORT_DISABLE_SAMPLE_SORT | MPSORT_LEAN_MEMORY))
+        return 0;
+    if(rsize > 4)
+        return NTask >= MPSORT_SAMPLE_SORT_MIN_TASKS;
+    return NTask >= 4 * MPSORT_SAMPLE_SORT_MIN_TASKS;
+}
 
 static void
 MPIU_Scatter (MPI_Comm comm, int root, const void * sendbuffer, void * recvbuffer, int nrecv, size_t elsize, int * totalnsend);
@@ -823,6 +873,8 @@ mpsort_mpi_newarray_impl (void * mybase, size_t mynmemb,
 
     struct SegmentGroupDescr seggrp[1];
 
+    _mpsort_phase_reset();
+
     uint64_t sum1 = checksum(mybase, elsize * mynmemb, comm);
 
     int NTask;
@@ -856,6 +908,10 @@ mpsort_mpi_newarray_impl (void * mybase, size_t mynmemb,
         /* do not use more than 4MB in a segment */
         avgsegsize = 4 * 1024 * 1024 / elsize;
     }
+    /* Small sorts are cheapest on one rank*/
+    if(totalsize * elsize <= MPSORT_GATHER_SORT_BYTES)
+        avgsegsize = totalsize;
+
     if(mpsort_mpi_has_options(MPSORT_REQUIRE_GATHER_SORT)) {
         message(0, "MPSort: gathering all data to a single rank for sorting due to MPSORT_REQUIRE_GATHER_SORT. "
                    "Total number of items is %ld. Caller site: %s:%d\n",
@@ -910,7 +966,10 @@ mpsort_mpi_newarray_impl (void * mybase, size_t mynmemb,
 
         _setup_mpsort_mpi(&o, &d, myoutsegmentbase, myoutsegmentnmemb, seggrp->Leaders);
 
-        mpsort_mpi_histogram_sort(d, o);
+        if(_use_sample_sort(o.NTask, rsize))
+            mpsort_mpi_sample_sort(d, o);
+        else
+            mpsort_mpi_histogram_sort(d, o);
 
         _destroy_mpsort_mpi(&o);
     }
@@ -941,6 +1000,7 @@ mpsort_mpi_newarray_impl (void * mybase, size_t mynmemb,
     if (sum1 != sum2) {
         endrun(5, "Data changed after sorting; checksum mismatch.\n");
     }
+    _mpsort_phase_end(MPSORT_PHASE_GATHER);
 }
 
 static void
@@ -1018,6 +1078,92 @@ MPIU_Scatter (MPI_Comm comm, int root, const void * sendbuffer, void * recvbuffe
     MPI_Type_free(&dtype);
 }
 
+/* Scratch space of the lean in place exchange: a fraction of the local array, but at least this many bytes.*/
+#define MPSORT_LEAN_SCRATCH_FRACTION 16
+#define MPSORT_LEAN_SCRATCH_MIN_BYTES (1024 * 1024)
+
+/* Exchange an array in place using a bounded scratch buffer instead of a full copy.
+ * The items for rank j are the SendCount[j] items at SendDispl[j]. Each round the
+ * receivers grant the senders as much as fits in their scratch; the received items
+ * then fill the slots vacated by the items already sent. The order of the items is
+ * not kept: the local sort afterwards restores it. The exchange always progresses,
+ * because in place every rank receives as many items as it sends.*/
+static void
+_exchange_in_place_lean(struct crstruct * d, struct crmpistruct * o, int * SendCount, int * SendDispl)
+{
+    char * base = (char *) o->mybase;
+    size_t nscratch = o->mynmemb / MPSORT_LEAN_SCRATCH_FRACTION;
+    if(nscratch * d->size < MPSORT_LEAN_SCRATCH_MIN_BYTES)
+        nscratch = MPSORT_LEAN_SCRATCH_MIN_BYTES / d->size;
+    if(nscratch > o->mynmemb)
+        nscratch = o->mynmemb;
+
+    char * scratch = (char *) mymalloc("mpsortscratch", d->size * nscratch + 1);
+    int * Sent = ta_malloc("Sent", int, 7 * o->NTask);
+    int * Filled = Sent + o->NTask;
+    int * Offer = Filled + o->NTask;
+    int * Want = Offer + o->NTask;
+    int * Grant = Want + o->NTask;
+    int * Granted = Grant + o->NTask;
+    int * Displ = Granted + o->NTask;
+    /* Items received but not yet placed; they are at the start of scratch*/
+    size_t nleft = 0;
+    int i, round;
+
+    memset(Sent, 0, sizeof(int) * 2 * o->NTask);
+    /* Items kept on this rank do not move*/
+    Sent[o->ThisTask] = Filled[o->ThisTask] = SendCount[o->ThisTask];
+
+    for(round = 0; ; round ++) {
+        int64_t pending = nleft;
+        for(i = 0; i < o->NTask; i ++) {
+            Offer[i] = SendCount[i] - Sent[i];
+            pending += Offer[i];
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &pending, 1, MPI_INT64_T, MPI_SUM, o->comm);
+        if(pending == 0)
+            break;
+
+        MPI_Alltoall(Offer, 1, MPI_INT, Want, 1, MPI_INT, o->comm);
+        /* Share the free scratch among the senders, starting from a different one each round*/
+        size_t room = nscratch - nleft;
+        for(i = 0; i < o->NTask; i ++) {
+            int src = (o->ThisTask + round + i) % o->NTask;
+            Grant[src] = Want[src] < room ? Want[src] : room;
+            room -= Grant[src];
+        }
+        MPI_Alltoall(Grant, 1, MPI_INT, Granted, 1, MPI_INT, o->comm);
+
+        for(i = 0; i < o->NTask; i ++)
+            Offer[i] = SendDispl[i] + Sent[i];
+        Displ[0] = nleft;
+        for(i = 1; i < o->NTask; i ++)
+            Displ[i] = Displ[i - 1] + Grant[i - 1];
+
+        MPI_Alltoallv_smart(
+                base, Granted, Offer, o->MPI_TYPE_DATA,
+                scratch, Grant, Displ, o->MPI_TYPE_DATA,
+                o->comm);
+
+        nleft = Displ[o->NTask - 1] + Grant[o->NTask - 1];
+        for(i = 0; i < o->NTask; i ++) {
+            Sent[i] += Granted[i];
+            /* Move items from the end of scratch into the vacated slots of segment i*/
+            size_t nfill = Sent[i] - Filled[i];
+            if(nfill > nleft)
+                nfill = nleft;
+            nleft -= nfill;
+            memcpy(base + (SendDispl[i] + Filled[i]) * d->size, scratch + nleft * d->size, nfill * d->size);
+            Filled[i] += nfill;
+        }
+    }
+    if(nleft != 0)
+        endrun(8, "Lean exchange left %ld items unplaced\n", nleft);
+
+    myfree(Sent);
+    myfree(scratch);
+}
+
 static int
 mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
 {
@@ -1037,14 +1183,14 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
     char * buffer;
     int i;
 
-    mpsort_increment_timer("START", 0);
+    mpsort_increment_timer("START", 0, MPSORT_PHASE_GATHER);
 
     /* and sort the local array */
     radix_sort(d.base, d.nmemb, d.size, d.radix, d.rsize, d.arg);
 
     MPI_Barrier(o.comm);
 
-    mpsort_increment_timer("FirstSort", 0);
+    mpsort_increment_timer("FirstSort", 0, MPSORT_PHASE_LOCALSORT);
 
     char * P = ta_malloc("PP", char, d.rsize * (o.NTask - 1));
     memset(P, 0, d.rsize * (o.NTask -1));
@@ -1054,7 +1200,7 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
 
     _find_Pmax_Pmin_C(o.mybase, o.mynmemb, o.myoutnmemb, Pmax, Pmin, C, &d, &o);
 
-    mpsort_increment_timer("PmaxPmin", 0);
+    mpsort_increment_timer("PmaxPmin", 0, MPSORT_PHASE_BISECT);
 
     struct piter pi;
 
@@ -1073,7 +1219,7 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
 
         char bisectnum[20];
         snprintf(bisectnum, 20, "bisect%04d", iter);
-        mpsort_increment_timer(bisectnum, iter > 10);
+        mpsort_increment_timer(bisectnum, iter > 10, MPSORT_PHASE_BISECT);
 
         piter_accept(&pi, P, C, CLT, CLE);
 #if 0
@@ -1122,7 +1268,7 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
 
     ta_free(P);
 
-    mpsort_increment_timer("findP", 0);
+    mpsort_increment_timer("findP", 0, MPSORT_PHASE_BISECT);
 
     ptrdiff_t * myT_C = (ptrdiff_t *) mymalloc("myhistT_C", (o.NTask) * sizeof(ptrdiff_t));
     ptrdiff_t * myT_CLT = (ptrdiff_t *) mymalloc("myhistCLT", (o.NTask) * sizeof(ptrdiff_t));
@@ -1141,7 +1287,7 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
     MPI_Alltoall(myCLE + 1, 1, MPI_TYPE_PTRDIFF,
             myT_CLE, 1, MPI_TYPE_PTRDIFF, o.comm);
 
-    mpsort_increment_timer("LayDistr", 0);
+    mpsort_increment_timer("LayDistr", 0, MPSORT_PHASE_LAYOUT);
 
     _solve_for_layout_mpi(o.NTask, C, myT_CLT, myT_CLE, myT_C, o.comm);
 
@@ -1183,7 +1329,7 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
     int * RecvCount = ta_malloc("RecvCount", int, o.NTask);
     int * RecvDispl = ta_malloc("RecvDispl", int, o.NTask);
 
-    mpsort_increment_timer("LaySolve", 0);
+    mpsort_increment_timer("LaySolve", 0, MPSORT_PHASE_LAYOUT);
 
     for(i = 0; i < o.NTask; i ++) {
         SendCount[i] = myC[i + 1] - myC[i];
@@ -1266,19 +1412,24 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
         }
     }
 #endif
-    if(o.myoutbase == o.mybase)
-        buffer = (char *) mymalloc("mpsortbuffer", d.size * o.myoutnmemb);
-    else
-        buffer = (char *) o.myoutbase;
-
-    MPI_Alltoallv_smart(
-            o.mybase, SendCount, SendDispl, o.MPI_TYPE_DATA,
-            buffer, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
-            o.comm);
-
-    if(o.myoutbase == o.mybase) {
-        memcpy(o.myoutbase, buffer, o.myoutnmemb * d.size);
-        myfree(buffer);
+    if(o.myoutbase == o.mybase && mpsort_mpi_has_options(MPSORT_LEAN_MEMORY)) {
+        _exchange_in_place_lean(&d, &o, SendCount, SendDispl);
+    }
+    else {
+        if(o.myoutbase == o.mybase)
+            buffer = (char *) mymalloc("mpsortbuffer", d.size * o.myoutnmemb);
+        else
+            buffer = (char *) o.myoutbase;
+
+        MPI_Alltoallv_smart(
+                o.mybase, SendCount, SendDispl, o.MPI_TYPE_DATA,
+                buffer, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
+                o.comm);
+
+        if(o.myoutbase == o.mybase) {
+            memcpy(o.myoutbase, buffer, o.myoutnmemb * d.size);
+            myfree(buffer);
+        }
     }
 
     myfree(RecvDispl);
@@ -1288,15 +1439,159 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
 
     myfree(myC);
     MPI_Barrier(o.comm);
-    mpsort_increment_timer("Exchange", 0);
+    mpsort_increment_timer("Exchange", 0, MPSORT_PHASE_EXCHANGE);
 
     radix_sort(o.myoutbase, o.myoutnmemb, d.size, d.radix, d.rsize, d.arg);
 
     MPI_Barrier(o.comm);
 
-    mpsort_increment_timer("SecondSort", 0);
+    mpsort_increment_timer("SecondSort", 0, MPSORT_PHASE_LOCALSORT);
+
+    mpsort_increment_timer("End", 0, MPSORT_PHASE_LOCALSORT);
+
+    return 0;
+}
+
+/* The radix of a radix is itself: used to sort the samples.*/
+static void _radix_copy(const void * ptr, void * radix, void * arg) {
+    memcpy(radix, ptr, *(size_t *) arg);
+}
+
+/* Maximum number of keys sampled from each rank.*/
+#define MPSORT_MAX_SAMPLES 64
+
+/* Sample sort: each rank sorts its data and contributes regularly spaced samples,
+ * from which the NTask - 1 splitters are chosen. The data is exchanged into the buckets
+ * between the splitters, each bucket is sorted and the sorted buckets are
+ * moved to the requested output layout. The buckets are not balanced exactly,
+ * so it is the last exchange that gives every rank myoutnmemb items.*/
+static int
+mpsort_mpi_sample_sort(struct crstruct d, struct crmpistruct o)
+{
+    int i;
+
+    mpsort_increment_timer("START", 0, MPSORT_PHASE_GATHER);
 
-    mpsort_increment_timer("End", 0);
+    radix_sort(d.base, d.nmemb, d.size, d.radix, d.rsize, d.arg);
+
+    mpsort_increment_timer("FirstSort", 0, MPSORT_PHASE_LOCALSORT);
+
+    int mynsample = o.NTask < MPSORT_MAX_SAMPLES ? o.NTask : MPSORT_MAX_SAMPLES;
+    if((size_t) mynsample > o.mynmemb)
+        mynsample = o.mynmemb;
+
+    char * mysamples = ta_malloc("mysamples", char, d.rsize * (mynsample + 1));
+    for(i = 0; i < mynsample; i ++) {
+        size_t j = (2 * (size_t) i + 1) * o.mynmemb / (2 * mynsample);
+        d.radix((char *) o.mybase + j * d.size, mysamples + i * d.rsize, d.arg);
+    }
+
+    int * SampleCount = ta_malloc("SampleCount", int, o.NTask);
+    int * SampleDispl = ta_malloc("SampleDispl", int, o.NTask + 1);
+    MPI_Allgather(&mynsample, 1, MPI_INT, SampleCount, 1, MPI_INT, o.comm);
+    SampleDispl[0] = 0;
+    for(i = 0; i < o.NTask; i ++)
+        SampleDispl[i + 1] = SampleDispl[i] + SampleCount[i];
+    const int nsample = SampleDispl[o.NTask];
+
+    char * samples = ta_malloc("samples", char, d.rsize * (nsample + 1));
+    MPI_Allgatherv(mysamples, mynsample, o.MPI_TYPE_RADIX,
+            samples, SampleCount, SampleDispl, o.MPI_TYPE_RADIX, o.comm);
+
+    radix_sort(samples, nsample, d.rsize, _radix_copy, d.rsize, &d.rsize);
+
+    char * P = ta_malloc("PP", char, d.rsize * (o.NTask - 1));
+    memset(P, 0, d.rsize * (o.NTask - 1));
+    if(nsample > 0)
+        for(i = 1; i < o.NTask; i ++)
+            memcpy(P + (i - 1) * d.rsize, samples + ((int64_t) i * nsample / o.NTask) * d.rsize, d.rsize);
+
+    mpsort_increment_timer("findP", 0, MPSORT_PHASE_BISECT);
+
+    ptrdiff_t * myCLT = ta_malloc("myCLT", ptrdiff_t, o.NTask + 1);
+    _histogram(P, o.NTask - 1, o.mybase, o.mynmemb, myCLT, NULL, &d);
+
+    int * SendCount = ta_malloc("SendCount", int, o.NTask);
+    int * SendDispl = ta_malloc("SendDispl", int, o.NTask);
+    int * RecvCount = ta_malloc("RecvCount", int, o.NTask);
+    int * RecvDispl = ta_malloc("RecvDispl", int, o.NTask);
+
+    for(i = 0; i < o.NTask; i ++) {
+        SendCount[i] = myCLT[i + 1] - myCLT[i];
+        SendDispl[i] = myCLT[i];
+    }
+    MPI_Alltoall(SendCount, 1, MPI_INT, RecvCount, 1, MPI_INT, o.comm);
+    size_t nbucket = 0;
+    for(i = 0; i < o.NTask; i ++) {
+        RecvDispl[i] = nbucket;
+        nbucket += RecvCount[i];
+    }
+
+    char * bucket = (char *) mymalloc("mpsortbucket", d.size * nbucket);
+
+    MPI_Alltoallv_smart(
+            o.mybase, SendCount, SendDispl, o.MPI_TYPE_DATA,
+            bucket, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
+            o.comm);
+
+    mpsort_increment_timer("Exchange", 0, MPSORT_PHASE_EXCHANGE);
+
+    radix_sort(bucket, nbucket, d.size, d.radix, d.rsize, d.arg);
+
+    mpsort_increment_timer("SecondSort", 0, MPSORT_PHASE_LOCALSORT);
+
+    /* Global offsets of the sorted bucket and of the output array on each rank*/
+    ptrdiff_t mybucketstart = 0;
+    MPI_Exscan(&nbucket, &mybucketstart, 1, MPI_TYPE_PTRDIFF, MPI_SUM, o.comm);
+    if(o.ThisTask == 0)
+        mybucketstart = 0;
+
+    ptrdiff_t * OutStart = ta_malloc("OutStart", ptrdiff_t, o.NTask + 1);
+    MPI_Allgather(&o.myoutnmemb, 1, MPI_TYPE_PTRDIFF, OutStart + 1, 1, MPI_TYPE_PTRDIFF, o.comm);
+    OutStart[0] = 0;
+    for(i = 0; i < o.NTask; i ++)
+        OutStart[i + 1] += OutStart[i];
+
+    const ptrdiff_t mybucketend = mybucketstart + nbucket;
+    for(i = 0; i < o.NTask; i ++) {
+        ptrdiff_t start = OutStart[i] > mybucketstart ? OutStart[i] : mybucketstart;
+        ptrdiff_t end = OutStart[i + 1] < mybucketend ? OutStart[i + 1] : mybucketend;
+        SendCount[i] = end > start ? end - start : 0;
+        SendDispl[i] = end > start ? start - mybucketstart : 0;
+    }
+    myfree(OutStart);
+
+    MPI_Alltoall(SendCount, 1, MPI_INT, RecvCount, 1, MPI_INT, o.comm);
+    size_t totrecv = 0;
+    for(i = 0; i < o.NTask; i ++) {
+        RecvDispl[i] = totrecv;
+        totrecv += RecvCount[i];
+    }
+    if(totrecv != o.myoutnmemb) {
+        endrun(8, "totrecv = %td, mismatch with %td\n", totrecv, o.myoutnmemb);
+    }
+
+    MPI_Alltoallv_smart(
+            bucket, SendCount, SendDispl, o.MPI_TYPE_DATA,
+            o.myoutbase, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
+            o.comm);
+
+    myfree(bucket);
+
+    myfree(RecvDispl);
+    myfree(RecvCount);
+    myfree(SendDispl);
+    myfree(SendCount);
+    myfree(myCLT);
+    myfree(P);
+    myfree(samples);
+    myfree(SampleDispl);
+    myfree(SampleCount);
+    myfree(mysamples);
+
+    MPI_Barrier(o.comm);
+    mpsort_increment_timer("Layout", 0, MPSORT_PHASE_LAYOUT);
+    mpsort_increment_timer("End", 0, MPSORT_PHASE_LOCALSORT);
 
     return 0;
 }
@@ -1429,8 +1724,14 @@ static void _mpsort_mpi_parse_env()
     _mpsort_env_parsed = 1;
     if(getenv("MPSORT_DISABLE_GATHER_SORT"))
         mpsort_mpi_set_options(MPSORT_DISABLE_GATHER_SORT);
-    if(getenv("MPSORT_REQUIRE_GATHER_SORT "))
-        mpsort_mpi_set_options(MPSORT_REQUIRE_GATHER_SORT );
+    if(getenv("MPSORT_REQUIRE_GATHER_SORT"))
+        mpsort_mpi_set_options(MPSORT_REQUIRE_GATHER_SORT);
+    if(getenv("MPSORT_DISABLE_SAMPLE_SORT"))
+        mpsort_mpi_set_options(MPSORT_DISABLE_SAMPLE_SORT);
+    if(getenv("MPSORT_REQUIRE_SAMPLE_SORT"))
+        mpsort_mpi_set_options(MPSORT_REQUIRE_SAMPLE_SORT);
+    if(getenv("MPSORT_LEAN_MEMORY"))
+        mpsort_mpi_set_options(MPSORT_LEAN_MEMORY);
 }
 
 void
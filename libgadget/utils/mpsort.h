@@ -4,6 +4,12 @@
 /* MPI support */
 #define MPSORT_DISABLE_GATHER_SORT (1 << 3)
 #define MPSORT_REQUIRE_GATHER_SORT (1 << 4)
+/* By default the sample sort is used for wide communicators and the histogram sort otherwise.*/
+#define MPSORT_DISABLE_SAMPLE_SORT (1 << 5)
+#define MPSORT_REQUIRE_SAMPLE_SORT (1 << 6)
+/* In place sorts exchange data in rounds through a small scratch buffer instead of a full copy of the array.
+ * This also implies the histogram sort.*/
+#define MPSORT_LEAN_MEMORY (1 << 7)
 
 void mpsort_mpi_set_options(int options);
 int mpsort_mpi_has_options(int options);
@@ -34,6 +40,20 @@ void mpsort_mpi_newarray_impl(void * base, size_t nmemb,
 
 void mpsort_mpi_report_last_run();
 
+/* Phases of a parallel sort. Gather includes the setup, the gather to
+ * the segment leaders and the final scatter; Bisect finds the splitters.*/
+enum MPSortPhase {
+    MPSORT_PHASE_GATHER,
+    MPSORT_PHASE_LOCALSORT,
+    MPSORT_PHASE_BISECT,
+    MPSORT_PHASE_LAYOUT,
+    MPSORT_PHASE_EXCHANGE,
+    MPSORT_NPHASE,
+};
+
+/* Returns the time this rank spent in phase during the last sort. If name is not NULL it is set to the name of the phase.*/
+double mpsort_mpi_last_run_time(enum MPSortPhase phase, const char ** name);
+
 void mpsort_setup_timers(int ntimers);
 
 void mpsort_free_timers(void);
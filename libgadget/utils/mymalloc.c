@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <sys/mman.h>
 
 #include <omp.h>
 #include "mymalloc.h"
@@ -21,6 +22,12 @@ Allocator A_MAIN[1];
  * */
 Allocator A_TEMP[1];
 
+/* Shared memory window containing the main allocator, if mymalloc_init_shared was used.*/
+static MPI_Win MainWin = MPI_WIN_NULL;
+static MPI_Comm MainNodeComm = MPI_COMM_NULL;
+/* Size of the window on each rank: the allocator needs two extra alignment pages.*/
+#define SHARED_PAD (2 * 4096)
+
 #ifdef VALGRIND
 #define allocator_init allocator_malloc_init
 #endif
@@ -30,27 +37,28 @@ tamalloc_init(void)
 {
     int Nt = omp_get_max_threads();
     int NTask;
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_size(GadgetComm, &NTask);
 
     /* Reserve 4MB, 512 bytes per thread, 128 bytes per task and 128 bytes per thread per task (for export) for TEMP storage.*/
     size_t n = 4096 * 1024 + 128 * NTask + 128 * Nt * NTask + 512 * Nt;
 
     message(0, "Reserving %td bytes per rank for TEMP memory allocator. \n", n);
 
-    if (MPIU_Any(ALLOC_ENOMEMORY == allocator_init(A_TEMP, "TEMP", n, 1, NULL), MPI_COMM_WORLD)) {
+    if (MPIU_Any(ALLOC_ENOMEMORY == allocator_init(A_TEMP, "TEMP", n, 1, NULL), GadgetComm)) {
         endrun(0, "Insufficient memory for the TEMP allocator on at least one nodes."
                   "Requestion %td bytes. Try reducing MaxMemSizePerNode. Also check the node health status.\n", n);
 
     }
 }
 
-void
-mymalloc_init(double MaxMemSizePerNode)
+/* Size of the main memory block on each rank*/
+static size_t
+mymalloc_size(double MaxMemSizePerNode)
 {
     /* Warning: this uses ta_malloc*/
     size_t Nhost = cluster_get_num_hosts();
 
-    MPI_Comm comm = MPI_COMM_WORLD;
+    MPI_Comm comm = GadgetComm;
 
     int NTask;
 
@@ -62,14 +70,160 @@ mymalloc_init(double MaxMemSizePerNode)
     message(0, "Reserving %td bytes per rank for MAIN memory allocator. \n", n);
     if(n < 1)
         endrun(2, "Mem too small! MB/node=%g, nodespercpu = %g NTask = %d\n", MaxMemSizePerNode, nodespercpu, NTask);
+    return n;
+}
 
+/* If true, do not touch the main memory block when it is created, so that each page is placed
+ * on the NUMA node of the thread which first writes to it, rather than all on the node of the master thread.*/
+static int MemoryFirstTouch = 1;
+
+void
+mymalloc_set_first_touch(int FirstTouch)
+{
+    MemoryFirstTouch = FirstTouch;
+}
+
+/* Page backing of the main memory block: 0 is the default, 1 transparent huge pages,
+ * 2 explicit 2MB huge pages and 3 explicit 1GB huge pages.*/
+static int MemoryHugePages = 0;
+/* Allocate the main memory block with MPI_Alloc_mem, so the MPI library may register it once for RDMA*/
+static int MemoryPinned = 0;
+
+void
+mymalloc_set_page_backing(int HugePages, int Pinned)
+{
+    MemoryHugePages = HugePages;
+    MemoryPinned = Pinned;
+}
 
-    if (MPIU_Any(ALLOC_ENOMEMORY == allocator_init(A_MAIN, "MAIN", n, 1, NULL), MPI_COMM_WORLD)) {
+#define HUGEPAGE_2MB (2L * 1024 * 1024)
+#define HUGEPAGE_1GB (1024L * 1024 * 1024)
+
+/* Allocate the raw memory for the main block according to MemoryHugePages and MemoryPinned.
+ * Explicit huge pages fall back to transparent huge pages if the system has none free.
+ * Returns NULL on failure.*/
+static char *
+mymalloc_alloc_main(const size_t bytes)
+{
+    char * rawbase = NULL;
+    if(MemoryPinned) {
+        if(MPI_SUCCESS != MPI_Alloc_mem(bytes, MPI_INFO_NULL, &rawbase))
+            return NULL;
+    }
+#ifdef MAP_HUGETLB
+    else if(MemoryHugePages >= 2) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+        size_t pagesize = HUGEPAGE_2MB;
+#ifdef MAP_HUGE_1GB
+        if(MemoryHugePages == 3) {
+            flags |= MAP_HUGE_1GB;
+            pagesize = HUGEPAGE_1GB;
+        }
+#endif
+        const size_t size = (bytes + pagesize - 1) / pagesize * pagesize;
+        void * ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if(ptr != MAP_FAILED)
+            return (char *) ptr;
+        message(1, "Could not map %td bytes of explicit huge pages, using transparent huge pages.\n", size);
+    }
+#endif
+    if(!rawbase) {
+        if(posix_memalign((void **) &rawbase, HUGEPAGE_2MB, bytes))
+            return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if(MemoryHugePages > 0) {
+        /* madvise needs whole pages*/
+        char * start = rawbase + (HUGEPAGE_2MB - (size_t) rawbase % HUGEPAGE_2MB) % HUGEPAGE_2MB;
+        const size_t len = (rawbase + bytes - start) / HUGEPAGE_2MB * HUGEPAGE_2MB;
+        if(len > 0 && madvise(start, len, MADV_HUGEPAGE))
+            message(1, "Transparent huge pages are not available for the main memory.\n");
+    }
+#endif
+    return rawbase;
+}
+
+void
+mymalloc_init(double MaxMemSizePerNode)
+{
+    size_t n = mymalloc_size(MaxMemSizePerNode);
+
+    if(MemoryFirstTouch)
+        message(0, "MAIN memory pages will be placed by first touch.\n");
+    int failed;
+    if(MemoryHugePages || MemoryPinned) {
+        message(0, "MAIN memory uses huge pages mode %d, pinned %d.\n", MemoryHugePages, MemoryPinned);
+        /* The allocator needs two extra alignment pages*/
+        char * rawbase = mymalloc_alloc_main(n + SHARED_PAD);
+        failed = (rawbase == NULL);
+        if(!failed)
+            allocator_init_external(A_MAIN, "MAIN", rawbase, n, !MemoryFirstTouch);
+    }
+    else
+        failed = ALLOC_ENOMEMORY == allocator_init(A_MAIN, "MAIN", n, !MemoryFirstTouch, NULL);
+    if (MPIU_Any(failed, GadgetComm)) {
         endrun(0, "Insufficient memory for the MAIN allocator on at least one nodes."
                   "Requestion %td bytes. Try reducing MaxMemSizePerNode. Also check the node health status.\n", n);
     }
 }
 
+void
+mymalloc_init_shared(double MaxMemSizePerNode)
+{
+    size_t n = mymalloc_size(MaxMemSizePerNode);
+
+    MPI_Comm_split_type(GadgetComm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &MainNodeComm);
+    /* Each rank's memory is separate, so let the MPI library place it in pages close to the rank.*/
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    char * rawbase = NULL;
+    int failed = MPI_SUCCESS != MPI_Win_allocate_shared(n + SHARED_PAD, 1, info, MainNodeComm, &rawbase, &MainWin);
+    MPI_Info_free(&info);
+    if (MPIU_Any(failed, GadgetComm)) {
+        endrun(0, "Insufficient shared memory for the MAIN allocator on at least one nodes."
+                  "Requestion %td bytes. Try reducing MaxMemSizePerNode. Also check the node health status.\n", n);
+    }
+    int NNode;
+    MPI_Comm_size(MainNodeComm, &NNode);
+    message(0, "MAIN memory allocator is shared between %d ranks on each node.\n", NNode);
+    /* A passive epoch for the lifetime of the window, so other ranks may be read with load instructions.*/
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, MainWin);
+    allocator_init_external(A_MAIN, "MAIN", rawbase, n, 1);
+}
+
+MPI_Comm
+mymalloc_shared_comm(void)
+{
+    return MainNodeComm;
+}
+
+char *
+mymalloc_shared_base(int noderank)
+{
+    MPI_Aint size;
+    int disp;
+    char * base = NULL;
+    MPI_Win_shared_query(MainWin, noderank, &size, &disp, &base);
+    return base;
+}
+
+ptrdiff_t
+mymalloc_shared_offset(const void * ptr)
+{
+    const char * cptr = (const char *) ptr;
+    if(MainWin == MPI_WIN_NULL || cptr < A_MAIN->base || cptr >= A_MAIN->base + A_MAIN->size)
+        return -1;
+    return cptr - A_MAIN->rawbase;
+}
+
+void
+mymalloc_shared_sync(void)
+{
+    if(MainWin != MPI_WIN_NULL)
+        MPI_Win_sync(MainWin);
+}
+
 static size_t highest_memory_usage = 0;
 
 void report_detailed_memory_usage(const char *label, const char * fmt, ...)
@@ -78,7 +232,7 @@ void report_detailed_memory_usage(const char *label, const char * fmt, ...)
         return;
     }
 
-    MPI_Comm comm = MPI_COMM_WORLD;
+    MPI_Comm comm = GadgetComm;
 
     int NTask;
     int ThisTask;
@@ -1,6 +1,7 @@
 #ifndef _MYMALLOC_H_
 #define _MYMALLOC_H_
 
+#include <mpi.h>
 #include "memory.h"
 
 extern Allocator A_MAIN[1];
@@ -8,6 +9,24 @@ extern Allocator A_TEMP[1];
 
 /* Initialize the main memory block*/
 void mymalloc_init(double MemoryMB);
+/* Leave the pages of the main memory block untouched until first used, so on multi-socket nodes they are
+ * placed next to the thread that first writes them. On by default; call before mymalloc_init.*/
+void mymalloc_set_first_touch(int FirstTouch);
+/* Back the main memory block with huge pages: 1 for transparent huge pages, 2 for explicit 2MB pages,
+ * 3 for explicit 1GB pages. If Pinned, allocate it with MPI_Alloc_mem so the MPI library can register it
+ * for RDMA. Call before mymalloc_init.*/
+void mymalloc_set_page_backing(int HugePages, int Pinned);
+/* Initialize the main memory block inside an MPI-3 shared memory window,
+ * so that ranks on the same node can read each other's main memory.*/
+void mymalloc_init_shared(double MemoryMB);
+/* Communicator of the ranks sharing main memory with this one, or MPI_COMM_NULL if main memory is not shared.*/
+MPI_Comm mymalloc_shared_comm(void);
+/* Start of the main memory of a rank in mymalloc_shared_comm, in the address space of this rank.*/
+char * mymalloc_shared_base(int noderank);
+/* Offset of a pointer from the start of the main memory of this rank, or -1 if the pointer is not in main memory.*/
+ptrdiff_t mymalloc_shared_offset(const void * ptr);
+/* Synchronise the shared memory window: call before and after a barrier so that writes are visible to other ranks.*/
+void mymalloc_shared_sync(void);
 /* Initialize the small temporary memory block*/
 void tamalloc_init(void);
 void report_detailed_memory_usage(const char *label, const char * fmt, ...);
@@ -18,6 +37,10 @@ void report_detailed_memory_usage(const char *label, const char * fmt, ...);
 #define  myrealloc(ptr, size)     allocator_realloc(A_MAIN, ptr, size)
 #define  myfree(x)                 allocator_free(x)
 
+/* Scopes inside which main and temporary memory may be freed in any order. See allocator_scope_begin*/
+#define  mymalloc_scope_begin()    do { allocator_scope_begin(A_MAIN); allocator_scope_begin(A_TEMP); } while(0)
+#define  mymalloc_scope_end()      do { allocator_scope_end(A_TEMP); allocator_scope_end(A_MAIN); } while(0)
+
 #define  ma_malloc(name, type, nele)            (type*) allocator_alloc_bot(A_MAIN, name, sizeof(type) * (nele))
 #define  ma_malloc2(name, type, nele)           (type*) allocator_alloc_top(A_MAIN, name, sizeof(type) * (nele))
 #define  ma_free(p) allocator_free(p)
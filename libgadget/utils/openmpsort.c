@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdint.h>
 #include "mymalloc.h"
+#include "endrun.h"
 /* Below is a merge-sort routine copied directly from glibc version 2.26
  * (although the code is the same since Dec. 2010, glibc 2.13).
  * The copy is so that we can control our memory allocation
@@ -379,3 +380,84 @@ void qsort_openmp(void *base, size_t nmemb, size_t size,
     }
     myfree(tmp);
 }
+
+static inline uint64_t
+radix_key(const char * elem, const size_t keyoffset, const int keybytes)
+{
+    if(keybytes == 8) {
+        uint64_t key;
+        memcpy(&key, elem + keyoffset, sizeof(key));
+        return key;
+    }
+    uint32_t key;
+    memcpy(&key, elem + keyoffset, sizeof(key));
+    return key;
+}
+
+void
+radix_sort_openmp(void * base, size_t nmemb, size_t size, size_t keyoffset, int keybytes)
+{
+    if(nmemb < 2)
+        return;
+    if(keybytes != 4 && keybytes != 8)
+        endrun(1, "Radix sort keys must have 4 or 8 bytes, not %d\n", keybytes);
+
+    /* Find the bits which differ between the keys: a digit which is the same everywhere needs no pass.*/
+    uint64_t kor = 0, kand = ~(uint64_t) 0;
+    size_t i;
+    #pragma omp parallel for reduction(|: kor) reduction(&: kand)
+    for(i = 0; i < nmemb; i++) {
+        const uint64_t key = radix_key((char *) base + i * size, keyoffset, keybytes);
+        kor |= key;
+        kand &= key;
+    }
+    const uint64_t differ = kor ^ kand;
+    if(!differ)
+        return;
+
+    const int NThread = omp_get_max_threads();
+    char * tmp = mymalloc("RadixTmp", nmemb * size);
+    size_t * hist = ta_malloc("RadixHist", size_t, 256 * NThread);
+    char * src = (char *) base, * dst = tmp;
+    int shift;
+    for(shift = 0; shift < 8 * keybytes; shift += 8) {
+        if(!((differ >> shift) & 0xff))
+            continue;
+        #pragma omp parallel
+        {
+            const int tid = omp_get_thread_num();
+            const int nt = omp_get_num_threads();
+            const size_t start = nmemb * tid / nt;
+            const size_t end = nmemb * (tid + 1) / nt;
+            size_t * thist = hist + 256 * tid;
+            size_t j;
+            memset(thist, 0, 256 * sizeof(size_t));
+            for(j = start; j < end; j++)
+                thist[(radix_key(src + j * size, keyoffset, keybytes) >> shift) & 0xff]++;
+            #pragma omp barrier
+            /* Offsets ordered by digit, then by thread, so the sort is stable.*/
+            #pragma omp single
+            {
+                size_t offset = 0;
+                int b, t;
+                for(b = 0; b < 256; b++)
+                    for(t = 0; t < nt; t++) {
+                        const size_t count = hist[256 * t + b];
+                        hist[256 * t + b] = offset;
+                        offset += count;
+                    }
+            }
+            for(j = start; j < end; j++) {
+                const int digit = (radix_key(src + j * size, keyoffset, keybytes) >> shift) & 0xff;
+                memcpy(dst + (thist[digit]++) * size, src + j * size, size);
+            }
+        }
+        char * swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if(src != base)
+        memcpy(base, src, nmemb * size);
+    myfree(hist);
+    myfree(tmp);
+}
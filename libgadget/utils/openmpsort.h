@@ -6,4 +6,9 @@
 void qsort_openmp(void *base, size_t nmemb, size_t size,
                          int(*compar)(const void *, const void *));
 
+/* Stable parallel LSD radix sort, by an unsigned integer key of keybytes (4 or 8) bytes
+ * at keyoffset in each element. Digits which are the same for every key are skipped.
+ * Uses a temporary copy of the array.*/
+void radix_sort_openmp(void * base, size_t nmemb, size_t size, size_t keyoffset, int keybytes);
+
 #endif
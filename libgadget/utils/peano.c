@@ -1,4 +1,7 @@
 #include "peano.h"
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 /*  The following rewrite of the original function
  *  peano_hilbert_key_old() has been written by MARTIN REINECKE. 
@@ -106,23 +109,259 @@ static const unsigned char subpix3[48][8] = {
     {2, 5, 1, 6, 3, 4, 0, 7}
 };
 
+/* The tables above applied twice, for two levels (6 bits of the Morton key) at a time.
+ * rottable6[r][p] is the rotation after pixels p >> 3 then p & 7, subpix6[r][p] the two key digits.*/
+static const unsigned char rottable6[48][64] = {
+    {0, 18, 8, 22, 38, 18, 38, 22, 16, 0, 20, 8, 16, 30, 20, 30, 5, 35, 0, 0, 13, 35, 2, 2, 33, 15, 0, 0, 33, 7, 2, 2,
+     33, 35, 0, 0, 33, 35, 30, 38, 33, 35, 0, 0, 33, 35, 30, 38, 5, 35, 0, 0, 13, 35, 2, 2, 33, 15, 0, 0, 33, 7, 2, 2},
+    {1, 31, 9, 31, 17, 17, 21, 21, 32, 32, 1, 39, 34, 34, 1, 31, 12, 4, 1, 3, 34, 34, 1, 3, 12, 4, 1, 3, 34, 34, 1, 3,
+     19, 19, 23, 23, 1, 39, 9, 39, 32, 32, 1, 39, 34, 34, 1, 31, 32, 32, 1, 3, 6, 14, 1, 3, 32, 32, 1, 3, 6, 14, 1, 3},
+    {33, 35, 36, 28, 33, 35, 2, 2, 33, 35, 36, 28, 33, 35, 2, 2, 5, 35, 0, 0, 13, 35, 2, 2, 33, 15, 0, 0, 33, 7, 2, 2,
+     28, 18, 28, 22, 2, 18, 10, 22, 16, 36, 20, 36, 16, 2, 20, 10, 5, 35, 0, 0, 13, 35, 2, 2, 33, 15, 0, 0, 33, 7, 2, 2},
+    {32, 32, 29, 3, 34, 34, 37, 3, 37, 3, 37, 11, 17, 17, 21, 21, 12, 4, 1, 3, 34, 34, 1, 3, 12, 4, 1, 3, 34, 34, 1, 3,
+     32, 32, 29, 3, 34, 34, 37, 3, 19, 19, 23, 23, 29, 3, 29, 11, 32, 32, 1, 3, 6, 14, 1, 3, 32, 32, 1, 3, 6, 14, 1, 3},
+    {4, 17, 4, 46, 14, 19, 14, 46, 12, 4, 1, 3, 34, 34, 1, 3, 4, 42, 4, 21, 14, 42, 14, 23, 9, 11, 12, 4, 9, 11, 26, 26,
+     4, 17, 4, 46, 14, 19, 14, 46, 4, 42, 4, 46, 26, 42, 34, 46, 4, 42, 4, 21, 14, 42, 14, 23, 4, 42, 4, 46, 26, 42, 34, 46},
+    {5, 35, 0, 0, 13, 35, 2, 2, 43, 43, 47, 47, 5, 27, 5, 35, 8, 8, 5, 27, 10, 10, 13, 27, 43, 43, 47, 47, 5, 27, 5, 35,
+     18, 16, 47, 47, 5, 15, 5, 15, 18, 16, 47, 47, 5, 15, 5, 15, 43, 43, 22, 20, 5, 15, 5, 15, 43, 43, 22, 20, 5, 15, 5, 15},
+    {40, 24, 44, 32, 40, 6, 44, 6, 17, 12, 44, 12, 19, 6, 44, 6, 40, 24, 44, 32, 40, 6, 44, 6, 40, 12, 21, 12, 40, 6, 23, 6,
+     32, 32, 1, 3, 6, 14, 1, 3, 17, 12, 44, 12, 19, 6, 44, 6, 9, 11, 24, 24, 9, 11, 6, 14, 40, 12, 21, 12, 40, 6, 23, 6},
+    {13, 7, 13, 7, 18, 16, 45, 45, 13, 7, 13, 7, 18, 16, 45, 45, 13, 7, 13, 7, 41, 41, 22, 20, 13, 7, 13, 7, 41, 41, 22, 20,
+     25, 7, 33, 7, 41, 41, 45, 45, 33, 15, 0, 0, 33, 7, 2, 2, 25, 7, 33, 7, 41, 41, 45, 45, 8, 8, 25, 15, 10, 10, 25, 7},
+    {8, 8, 5, 27, 10, 10, 13, 27, 8, 8, 25, 15, 10, 10, 25, 7, 0, 18, 8, 22, 38, 18, 38, 22, 16, 0, 20, 8, 16, 30, 20, 30,
+     8, 8, 5, 27, 10, 10, 13, 27, 8, 8, 25, 15, 10, 10, 25, 7, 8, 8, 25, 27, 30, 38, 25, 27, 8, 8, 25, 27, 30, 38, 25, 27},
+    {9, 11, 12, 4, 9, 11, 26, 26, 9, 11, 12, 4, 9, 11, 26, 26, 1, 31, 9, 31, 17, 17, 21, 21, 9, 39, 24, 24, 9, 31, 26, 26,
+     9, 11, 24, 24, 9, 11, 6, 14, 9, 11, 24, 24, 9, 11, 6, 14, 19, 19, 23, 23, 1, 39, 9, 39, 9, 39, 24, 24, 9, 31, 26, 26},
+    {8, 8, 5, 27, 10, 10, 13, 27, 8, 8, 25, 15, 10, 10, 25, 7, 36, 28, 25, 27, 10, 10, 25, 27, 36, 28, 25, 27, 10, 10, 25, 27,
+     8, 8, 5, 27, 10, 10, 13, 27, 8, 8, 25, 15, 10, 10, 25, 7, 28, 18, 28, 22, 2, 18, 10, 22, 16, 36, 20, 36, 16, 2, 20, 10},
+    {9, 11, 12, 4, 9, 11, 26, 26, 9, 11, 12, 4, 9, 11, 26, 26, 29, 11, 24, 24, 37, 11, 26, 26, 37, 3, 37, 11, 17, 17, 21, 21,
+     9, 11, 24, 24, 9, 11, 6, 14, 9, 11, 24, 24, 9, 11, 6, 14, 29, 11, 24, 24, 37, 11, 26, 26, 19, 19, 23, 23, 29, 3, 29, 11},
+    {12, 4, 1, 3, 34, 34, 1, 3, 17, 12, 44, 12, 19, 6, 44, 6, 9, 11, 12, 4, 9, 11, 26, 26, 40, 12, 21, 12, 40, 6, 23, 6,
+     40, 12, 44, 12, 40, 26, 44, 34, 17, 12, 44, 12, 19, 6, 44, 6, 40, 12, 44, 12, 40, 26, 44, 34, 40, 12, 21, 12, 40, 6, 23, 6},
+    {13, 7, 13, 7, 18, 16, 45, 45, 13, 7, 13, 7, 18, 16, 45, 45, 13, 7, 13, 7, 41, 41, 22, 20, 13, 7, 13, 7, 41, 41, 22, 20,
+     5, 35, 0, 0, 13, 35, 2, 2, 13, 27, 13, 35, 41, 41, 45, 45, 8, 8, 5, 27, 10, 10, 13, 27, 13, 27, 13, 35, 41, 41, 45, 45},
+    {4, 17, 4, 46, 14, 19, 14, 46, 24, 42, 32, 46, 14, 42, 14, 46, 4, 42, 4, 21, 14, 42, 14, 23, 24, 42, 32, 46, 14, 42, 14, 46,
+     4, 17, 4, 46, 14, 19, 14, 46, 32, 32, 1, 3, 6, 14, 1, 3, 4, 42, 4, 21, 14, 42, 14, 23, 9, 11, 24, 24, 9, 11, 6, 14},
+    {43, 43, 47, 47, 25, 15, 33, 15, 33, 15, 0, 0, 33, 7, 2, 2, 43, 43, 47, 47, 25, 15, 33, 15, 8, 8, 25, 15, 10, 10, 25, 7,
+     18, 16, 47, 47, 5, 15, 5, 15, 18, 16, 47, 47, 5, 15, 5, 15, 43, 43, 22, 20, 5, 15, 5, 15, 43, 43, 22, 20, 5, 15, 5, 15},
+    {16, 0, 20, 8, 16, 30, 20, 30, 18, 16, 47, 47, 5, 15, 5, 15, 16, 0, 20, 8, 16, 30, 20, 30, 16, 36, 45, 36, 16, 30, 47, 30,
+     16, 36, 20, 36, 16, 2, 20, 10, 13, 7, 13, 7, 18, 16, 45, 45, 16, 36, 20, 36, 16, 2, 20, 10, 16, 36, 45, 36, 16, 30, 47, 30},
+    {17, 12, 44, 12, 19, 6, 44, 6, 4, 17, 4, 46, 14, 19, 14, 46, 37, 31, 37, 31, 17, 17, 46, 44, 37, 31, 37, 31, 17, 17, 46, 44,
+     1, 31, 9, 31, 17, 17, 21, 21, 37, 3, 37, 11, 17, 17, 21, 21, 1, 31, 9, 31, 17, 17, 21, 21, 37, 3, 37, 11, 17, 17, 21, 21},
+    {18, 16, 47, 47, 5, 15, 5, 15, 0, 18, 8, 22, 38, 18, 38, 22, 28, 18, 28, 45, 38, 18, 38, 47, 0, 18, 8, 22, 38, 18, 38, 22,
+     13, 7, 13, 7, 18, 16, 45, 45, 28, 18, 28, 22, 2, 18, 10, 22, 28, 18, 28, 45, 38, 18, 38, 47, 28, 18, 28, 22, 2, 18, 10, 22},
+    {19, 19, 23, 23, 1, 39, 9, 39, 19, 19, 23, 23, 29, 3, 29, 11, 19, 19, 23, 23, 1, 39, 9, 39, 19, 19, 23, 23, 29, 3, 29, 11,
+     17, 12, 44, 12, 19, 6, 44, 6, 4, 17, 4, 46, 14, 19, 14, 46, 19, 19, 46, 44, 29, 39, 29, 39, 19, 19, 46, 44, 29, 39, 29, 39},
+    {16, 0, 20, 8, 16, 30, 20, 30, 41, 36, 20, 36, 43, 30, 20, 30, 16, 0, 20, 8, 16, 30, 20, 30, 43, 43, 22, 20, 5, 15, 5, 15,
+     16, 36, 20, 36, 16, 2, 20, 10, 41, 36, 20, 36, 43, 30, 20, 30, 16, 36, 20, 36, 16, 2, 20, 10, 13, 7, 13, 7, 41, 41, 22, 20},
+    {37, 31, 37, 31, 42, 40, 21, 21, 37, 31, 37, 31, 42, 40, 21, 21, 40, 12, 21, 12, 40, 6, 23, 6, 4, 42, 4, 21, 14, 42, 14, 23,
+     1, 31, 9, 31, 17, 17, 21, 21, 37, 3, 37, 11, 17, 17, 21, 21, 1, 31, 9, 31, 17, 17, 21, 21, 37, 3, 37, 11, 17, 17, 21, 21},
+    {28, 41, 28, 22, 38, 43, 38, 22, 0, 18, 8, 22, 38, 18, 38, 22, 43, 43, 22, 20, 5, 15, 5, 15, 0, 18, 8, 22, 38, 18, 38, 22,
+     28, 41, 28, 22, 38, 43, 38, 22, 28, 18, 28, 22, 2, 18, 10, 22, 13, 7, 13, 7, 41, 41, 22, 20, 28, 18, 28, 22, 2, 18, 10, 22},
+    {19, 19, 23, 23, 1, 39, 9, 39, 19, 19, 23, 23, 29, 3, 29, 11, 19, 19, 23, 23, 1, 39, 9, 39, 19, 19, 23, 23, 29, 3, 29, 11,
+     42, 40, 23, 23, 29, 39, 29, 39, 42, 40, 23, 23, 29, 39, 29, 39, 40, 12, 21, 12, 40, 6, 23, 6, 4, 42, 4, 21, 14, 42, 14, 23},
+    {24, 42, 32, 46, 14, 42, 14, 46, 40, 24, 44, 32, 40, 6, 44, 6, 29, 11, 24, 24, 37, 11, 26, 26, 9, 39, 24, 24, 9, 31, 26, 26,
+     9, 11, 24, 24, 9, 11, 6, 14, 9, 11, 24, 24, 9, 11, 6, 14, 29, 11, 24, 24, 37, 11, 26, 26, 9, 39, 24, 24, 9, 31, 26, 26},
+    {25, 7, 33, 7, 41, 41, 45, 45, 8, 8, 25, 15, 10, 10, 25, 7, 36, 28, 25, 27, 10, 10, 25, 27, 36, 28, 25, 27, 10, 10, 25, 27,
+     43, 43, 47, 47, 25, 15, 33, 15, 8, 8, 25, 15, 10, 10, 25, 7, 8, 8, 25, 27, 30, 38, 25, 27, 8, 8, 25, 27, 30, 38, 25, 27},
+    {9, 11, 12, 4, 9, 11, 26, 26, 9, 11, 12, 4, 9, 11, 26, 26, 29, 11, 24, 24, 37, 11, 26, 26, 9, 39, 24, 24, 9, 31, 26, 26,
+     4, 42, 4, 46, 26, 42, 34, 46, 40, 12, 44, 12, 40, 26, 44, 34, 29, 11, 24, 24, 37, 11, 26, 26, 9, 39, 24, 24, 9, 31, 26, 26},
+    {8, 8, 5, 27, 10, 10, 13, 27, 13, 27, 13, 35, 41, 41, 45, 45, 36, 28, 25, 27, 10, 10, 25, 27, 36, 28, 25, 27, 10, 10, 25, 27,
+     8, 8, 5, 27, 10, 10, 13, 27, 43, 43, 47, 47, 5, 27, 5, 35, 8, 8, 25, 27, 30, 38, 25, 27, 8, 8, 25, 27, 30, 38, 25, 27},
+    {28, 41, 28, 22, 38, 43, 38, 22, 36, 28, 25, 27, 10, 10, 25, 27, 28, 18, 28, 45, 38, 18, 38, 47, 33, 35, 36, 28, 33, 35, 2, 2,
+     28, 41, 28, 22, 38, 43, 38, 22, 28, 18, 28, 22, 2, 18, 10, 22, 28, 18, 28, 45, 38, 18, 38, 47, 28, 18, 28, 22, 2, 18, 10, 22},
+    {29, 11, 24, 24, 37, 11, 26, 26, 19, 19, 23, 23, 29, 3, 29, 11, 32, 32, 29, 3, 34, 34, 37, 3, 19, 19, 23, 23, 29, 3, 29, 11,
+     42, 40, 23, 23, 29, 39, 29, 39, 42, 40, 23, 23, 29, 39, 29, 39, 19, 19, 46, 44, 29, 39, 29, 39, 19, 19, 46, 44, 29, 39, 29, 39},
+    {16, 0, 20, 8, 16, 30, 20, 30, 41, 36, 20, 36, 43, 30, 20, 30, 16, 0, 20, 8, 16, 30, 20, 30, 16, 36, 45, 36, 16, 30, 47, 30,
+     8, 8, 25, 27, 30, 38, 25, 27, 41, 36, 20, 36, 43, 30, 20, 30, 33, 35, 0, 0, 33, 35, 30, 38, 16, 36, 45, 36, 16, 30, 47, 30},
+    {37, 31, 37, 31, 42, 40, 21, 21, 37, 31, 37, 31, 42, 40, 21, 21, 37, 31, 37, 31, 17, 17, 46, 44, 37, 31, 37, 31, 17, 17, 46, 44,
+     1, 31, 9, 31, 17, 17, 21, 21, 9, 39, 24, 24, 9, 31, 26, 26, 1, 31, 9, 31, 17, 17, 21, 21, 32, 32, 1, 39, 34, 34, 1, 31},
+    {32, 32, 29, 3, 34, 34, 37, 3, 32, 32, 1, 39, 34, 34, 1, 31, 24, 42, 32, 46, 14, 42, 14, 46, 40, 24, 44, 32, 40, 6, 44, 6,
+     32, 32, 29, 3, 34, 34, 37, 3, 32, 32, 1, 39, 34, 34, 1, 31, 32, 32, 1, 3, 6, 14, 1, 3, 32, 32, 1, 3, 6, 14, 1, 3},
+    {33, 35, 36, 28, 33, 35, 2, 2, 33, 35, 36, 28, 33, 35, 2, 2, 25, 7, 33, 7, 41, 41, 45, 45, 33, 15, 0, 0, 33, 7, 2, 2,
+     33, 35, 0, 0, 33, 35, 30, 38, 33, 35, 0, 0, 33, 35, 30, 38, 43, 43, 47, 47, 25, 15, 33, 15, 33, 15, 0, 0, 33, 7, 2, 2},
+    {32, 32, 29, 3, 34, 34, 37, 3, 32, 32, 1, 39, 34, 34, 1, 31, 12, 4, 1, 3, 34, 34, 1, 3, 12, 4, 1, 3, 34, 34, 1, 3,
+     32, 32, 29, 3, 34, 34, 37, 3, 32, 32, 1, 39, 34, 34, 1, 31, 4, 42, 4, 46, 26, 42, 34, 46, 40, 12, 44, 12, 40, 26, 44, 34},
+    {33, 35, 36, 28, 33, 35, 2, 2, 33, 35, 36, 28, 33, 35, 2, 2, 5, 35, 0, 0, 13, 35, 2, 2, 13, 27, 13, 35, 41, 41, 45, 45,
+     33, 35, 0, 0, 33, 35, 30, 38, 33, 35, 0, 0, 33, 35, 30, 38, 5, 35, 0, 0, 13, 35, 2, 2, 43, 43, 47, 47, 5, 27, 5, 35},
+    {36, 28, 25, 27, 10, 10, 25, 27, 41, 36, 20, 36, 43, 30, 20, 30, 33, 35, 36, 28, 33, 35, 2, 2, 16, 36, 45, 36, 16, 30, 47, 30,
+     16, 36, 20, 36, 16, 2, 20, 10, 41, 36, 20, 36, 43, 30, 20, 30, 16, 36, 20, 36, 16, 2, 20, 10, 16, 36, 45, 36, 16, 30, 47, 30},
+    {37, 31, 37, 31, 42, 40, 21, 21, 37, 31, 37, 31, 42, 40, 21, 21, 37, 31, 37, 31, 17, 17, 46, 44, 37, 31, 37, 31, 17, 17, 46, 44,
+     29, 11, 24, 24, 37, 11, 26, 26, 37, 3, 37, 11, 17, 17, 21, 21, 32, 32, 29, 3, 34, 34, 37, 3, 37, 3, 37, 11, 17, 17, 21, 21},
+    {28, 41, 28, 22, 38, 43, 38, 22, 0, 18, 8, 22, 38, 18, 38, 22, 28, 18, 28, 45, 38, 18, 38, 47, 0, 18, 8, 22, 38, 18, 38, 22,
+     28, 41, 28, 22, 38, 43, 38, 22, 8, 8, 25, 27, 30, 38, 25, 27, 28, 18, 28, 45, 38, 18, 38, 47, 33, 35, 0, 0, 33, 35, 30, 38},
+    {19, 19, 23, 23, 1, 39, 9, 39, 9, 39, 24, 24, 9, 31, 26, 26, 19, 19, 23, 23, 1, 39, 9, 39, 32, 32, 1, 39, 34, 34, 1, 31,
+     42, 40, 23, 23, 29, 39, 29, 39, 42, 40, 23, 23, 29, 39, 29, 39, 19, 19, 46, 44, 29, 39, 29, 39, 19, 19, 46, 44, 29, 39, 29, 39},
+    {40, 24, 44, 32, 40, 6, 44, 6, 42, 40, 23, 23, 29, 39, 29, 39, 40, 24, 44, 32, 40, 6, 44, 6, 40, 12, 21, 12, 40, 6, 23, 6,
+     40, 12, 44, 12, 40, 26, 44, 34, 37, 31, 37, 31, 42, 40, 21, 21, 40, 12, 44, 12, 40, 26, 44, 34, 40, 12, 21, 12, 40, 6, 23, 6},
+    {41, 36, 20, 36, 43, 30, 20, 30, 28, 41, 28, 22, 38, 43, 38, 22, 13, 7, 13, 7, 41, 41, 22, 20, 13, 7, 13, 7, 41, 41, 22, 20,
+     25, 7, 33, 7, 41, 41, 45, 45, 13, 27, 13, 35, 41, 41, 45, 45, 25, 7, 33, 7, 41, 41, 45, 45, 13, 27, 13, 35, 41, 41, 45, 45},
+    {42, 40, 23, 23, 29, 39, 29, 39, 24, 42, 32, 46, 14, 42, 14, 46, 4, 42, 4, 21, 14, 42, 14, 23, 24, 42, 32, 46, 14, 42, 14, 46,
+     37, 31, 37, 31, 42, 40, 21, 21, 4, 42, 4, 46, 26, 42, 34, 46, 4, 42, 4, 21, 14, 42, 14, 23, 4, 42, 4, 46, 26, 42, 34, 46},
+    {43, 43, 47, 47, 25, 15, 33, 15, 43, 43, 47, 47, 5, 27, 5, 35, 43, 43, 47, 47, 25, 15, 33, 15, 43, 43, 47, 47, 5, 27, 5, 35,
+     41, 36, 20, 36, 43, 30, 20, 30, 28, 41, 28, 22, 38, 43, 38, 22, 43, 43, 22, 20, 5, 15, 5, 15, 43, 43, 22, 20, 5, 15, 5, 15},
+    {40, 24, 44, 32, 40, 6, 44, 6, 17, 12, 44, 12, 19, 6, 44, 6, 40, 24, 44, 32, 40, 6, 44, 6, 19, 19, 46, 44, 29, 39, 29, 39,
+     40, 12, 44, 12, 40, 26, 44, 34, 17, 12, 44, 12, 19, 6, 44, 6, 40, 12, 44, 12, 40, 26, 44, 34, 37, 31, 37, 31, 17, 17, 46, 44},
+    {13, 7, 13, 7, 18, 16, 45, 45, 13, 7, 13, 7, 18, 16, 45, 45, 16, 36, 45, 36, 16, 30, 47, 30, 28, 18, 28, 45, 38, 18, 38, 47,
+     25, 7, 33, 7, 41, 41, 45, 45, 13, 27, 13, 35, 41, 41, 45, 45, 25, 7, 33, 7, 41, 41, 45, 45, 13, 27, 13, 35, 41, 41, 45, 45},
+    {4, 17, 4, 46, 14, 19, 14, 46, 24, 42, 32, 46, 14, 42, 14, 46, 19, 19, 46, 44, 29, 39, 29, 39, 24, 42, 32, 46, 14, 42, 14, 46,
+     4, 17, 4, 46, 14, 19, 14, 46, 4, 42, 4, 46, 26, 42, 34, 46, 37, 31, 37, 31, 17, 17, 46, 44, 4, 42, 4, 46, 26, 42, 34, 46},
+    {43, 43, 47, 47, 25, 15, 33, 15, 43, 43, 47, 47, 5, 27, 5, 35, 43, 43, 47, 47, 25, 15, 33, 15, 43, 43, 47, 47, 5, 27, 5, 35,
+     18, 16, 47, 47, 5, 15, 5, 15, 18, 16, 47, 47, 5, 15, 5, 15, 16, 36, 45, 36, 16, 30, 47, 30, 28, 18, 28, 45, 38, 18, 38, 47}
+};
+
+static const unsigned char subpix6[48][64] = {
+    {0, 1, 7, 6, 3, 2, 4, 5, 62, 63, 57, 56, 61, 60, 58, 59, 8, 11, 9, 10, 15, 12, 14, 13, 52, 55, 53, 54, 51, 48, 50, 49,
+     26, 29, 27, 28, 25, 30, 24, 31, 34, 37, 35, 36, 33, 38, 32, 39, 16, 19, 17, 18, 23, 20, 22, 21, 44, 47, 45, 46, 43, 40, 42, 41},
+    {63, 60, 56, 59, 62, 61, 57, 58, 37, 38, 36, 39, 34, 33, 35, 32, 55, 48, 54, 49, 52, 51, 53, 50, 47, 40, 46, 41, 44, 43, 45, 42,
+     1, 2, 6, 5, 0, 3, 7, 4, 29, 30, 28, 31, 26, 25, 27, 24, 11, 12, 10, 13, 8, 15, 9, 14, 19, 20, 18, 21, 16, 23, 17, 22},
+    {38, 33, 39, 32, 37, 34, 36, 35, 30, 25, 31, 24, 29, 26, 28, 27, 40, 43, 41, 42, 47, 44, 46, 45, 20, 23, 21, 22, 19, 16, 18, 17,
+     60, 61, 59, 58, 63, 62, 56, 57, 2, 3, 5, 4, 1, 0, 6, 7, 48, 51, 49, 50, 55, 52, 54, 53, 12, 15, 13, 14, 11, 8, 10, 9},
+    {25, 26, 24, 27, 30, 29, 31, 28, 3, 0, 4, 7, 2, 1, 5, 6, 23, 16, 22, 17, 20, 19, 21, 18, 15, 8, 14, 9, 12, 11, 13, 10,
+     33, 34, 32, 35, 38, 37, 39, 36, 61, 62, 58, 57, 60, 63, 59, 56, 43, 44, 42, 45, 40, 47, 41, 46, 51, 52, 50, 53, 48, 55, 49, 54},
+    {9, 8, 10, 11, 14, 15, 13, 12, 7, 0, 6, 1, 4, 3, 5, 2, 53, 52, 54, 55, 50, 51, 49, 48, 57, 62, 56, 63, 58, 61, 59, 60,
+     17, 16, 18, 19, 22, 23, 21, 20, 27, 26, 28, 29, 24, 25, 31, 30, 45, 44, 46, 47, 42, 43, 41, 40, 35, 34, 36, 37, 32, 33, 39, 38},
+    {0, 3, 1, 2, 7, 4, 6, 5, 26, 25, 29, 30, 27, 24, 28, 31, 62, 61, 63, 60, 57, 58, 56, 59, 34, 33, 37, 38, 35, 32, 36, 39,
+     8, 15, 11, 12, 9, 14, 10, 13, 16, 23, 19, 20, 17, 22, 18, 21, 52, 51, 55, 48, 53, 50, 54, 49, 44, 43, 47, 40, 45, 42, 46, 41},
+    {25, 24, 30, 31, 26, 27, 29, 28, 23, 22, 20, 21, 16, 17, 19, 18, 33, 32, 38, 39, 34, 35, 37, 36, 43, 42, 40, 41, 44, 45, 47, 46,
+     3, 4, 2, 5, 0, 7, 1, 6, 15, 14, 12, 13, 8, 9, 11, 10, 61, 58, 60, 59, 62, 57, 63, 56, 51, 50, 48, 49, 52, 53, 55, 54},
+    {22, 17, 21, 18, 23, 16, 20, 19, 14, 9, 13, 10, 15, 8, 12, 11, 42, 45, 41, 46, 43, 44, 40, 47, 50, 53, 49, 54, 51, 52, 48, 55,
+     24, 27, 31, 28, 25, 26, 30, 29, 4, 7, 5, 6, 3, 0, 2, 1, 32, 35, 39, 36, 33, 34, 38, 37, 58, 57, 59, 56, 61, 62, 60, 63},
+    {54, 53, 55, 52, 49, 50, 48, 51, 10, 9, 11, 8, 13, 14, 12, 15, 56, 57, 63, 62, 59, 58, 60, 61, 6, 7, 1, 0, 5, 4, 2, 3,
+     46, 45, 47, 44, 41, 42, 40, 43, 18, 17, 19, 16, 21, 22, 20, 23, 36, 35, 37, 34, 39, 32, 38, 33, 28, 27, 29, 26, 31, 24, 30, 25},
+    {9, 14, 8, 15, 10, 13, 11, 12, 17, 22, 16, 23, 18, 21, 19, 20, 7, 4, 0, 3, 6, 5, 1, 2, 27, 24, 26, 25, 28, 31, 29, 30,
+     53, 50, 52, 51, 54, 49, 55, 48, 45, 42, 44, 43, 46, 41, 47, 40, 57, 58, 62, 61, 56, 59, 63, 60, 35, 32, 34, 33, 36, 39, 37, 38},
+    {22, 21, 23, 20, 17, 18, 16, 19, 42, 41, 43, 40, 45, 46, 44, 47, 24, 31, 25, 30, 27, 28, 26, 29, 32, 39, 33, 38, 35, 36, 34, 37,
+     14, 13, 15, 12, 9, 10, 8, 11, 50, 49, 51, 48, 53, 54, 52, 55, 4, 5, 3, 2, 7, 6, 0, 1, 58, 59, 61, 60, 57, 56, 62, 63},
+    {41, 46, 40, 47, 42, 45, 43, 44, 49, 54, 48, 55, 50, 53, 51, 52, 39, 36, 38, 37, 32, 35, 33, 34, 59, 56, 60, 63, 58, 57, 61, 62,
+     21, 18, 20, 19, 22, 17, 23, 16, 13, 10, 12, 11, 14, 9, 15, 8, 31, 28, 30, 29, 24, 27, 25, 26, 5, 6, 2, 1, 4, 7, 3, 0},
+    {63, 56, 62, 57, 60, 59, 61, 58, 55, 54, 52, 53, 48, 49, 51, 50, 1, 6, 0, 7, 2, 5, 3, 4, 11, 10, 8, 9, 12, 13, 15, 14,
+     37, 36, 34, 35, 38, 39, 33, 32, 47, 46, 44, 45, 40, 41, 43, 42, 29, 28, 26, 27, 30, 31, 25, 24, 19, 18, 16, 17, 20, 21, 23, 22},
+    {54, 49, 53, 50, 55, 48, 52, 51, 46, 41, 45, 42, 47, 40, 44, 43, 10, 13, 9, 14, 11, 12, 8, 15, 18, 21, 17, 22, 19, 20, 16, 23,
+     56, 59, 57, 58, 63, 60, 62, 61, 36, 39, 35, 32, 37, 38, 34, 33, 6, 5, 7, 4, 1, 2, 0, 3, 28, 31, 27, 24, 29, 30, 26, 25},
+    {41, 40, 42, 43, 46, 47, 45, 44, 39, 38, 32, 33, 36, 37, 35, 34, 21, 20, 22, 23, 18, 19, 17, 16, 31, 30, 24, 25, 28, 29, 27, 26,
+     49, 48, 50, 51, 54, 55, 53, 52, 59, 60, 58, 61, 56, 63, 57, 62, 13, 12, 14, 15, 10, 11, 9, 8, 5, 2, 4, 3, 6, 1, 7, 0},
+    {38, 37, 33, 34, 39, 36, 32, 35, 60, 63, 61, 62, 59, 56, 58, 57, 30, 29, 25, 26, 31, 28, 24, 27, 2, 1, 3, 0, 5, 6, 4, 7,
+     40, 47, 43, 44, 41, 46, 42, 45, 48, 55, 51, 52, 49, 54, 50, 53, 20, 19, 23, 16, 21, 18, 22, 17, 12, 11, 15, 8, 13, 10, 14, 9},
+    {54, 55, 49, 48, 53, 52, 50, 51, 56, 63, 59, 60, 57, 62, 58, 61, 46, 47, 41, 40, 45, 44, 42, 43, 36, 37, 39, 38, 35, 34, 32, 33,
+     10, 11, 13, 12, 9, 8, 14, 15, 6, 1, 5, 2, 7, 0, 4, 3, 18, 19, 21, 20, 17, 16, 22, 23, 28, 29, 31, 30, 27, 26, 24, 25},
+    {63, 62, 60, 61, 56, 57, 59, 58, 1, 0, 2, 3, 6, 7, 5, 4, 37, 34, 38, 33, 36, 35, 39, 32, 29, 26, 30, 25, 28, 27, 31, 24,
+     55, 52, 48, 51, 54, 53, 49, 50, 11, 8, 12, 15, 10, 9, 13, 14, 47, 44, 40, 43, 46, 45, 41, 42, 19, 16, 20, 23, 18, 17, 21, 22},
+    {0, 7, 3, 4, 1, 6, 2, 5, 8, 9, 15, 14, 11, 10, 12, 13, 26, 27, 25, 24, 29, 28, 30, 31, 16, 17, 23, 22, 19, 18, 20, 21,
+     62, 57, 61, 58, 63, 56, 60, 59, 52, 53, 51, 50, 55, 54, 48, 49, 34, 35, 33, 32, 37, 36, 38, 39, 44, 45, 43, 42, 47, 46, 40, 41},
+    {9, 10, 14, 13, 8, 11, 15, 12, 53, 54, 50, 49, 52, 55, 51, 48, 17, 18, 22, 21, 16, 19, 23, 20, 45, 46, 42, 41, 44, 47, 43, 40,
+     7, 6, 4, 5, 0, 1, 3, 2, 57, 56, 58, 59, 62, 63, 61, 60, 27, 28, 24, 31, 26, 29, 25, 30, 35, 36, 32, 39, 34, 37, 33, 38},
+    {22, 23, 17, 16, 21, 20, 18, 19, 24, 25, 27, 26, 31, 30, 28, 29, 14, 15, 9, 8, 13, 12, 10, 11, 4, 3, 7, 0, 5, 2, 6, 1,
+     42, 43, 45, 44, 41, 40, 46, 47, 32, 33, 35, 34, 39, 38, 36, 37, 50, 51, 53, 52, 49, 48, 54, 55, 58, 61, 57, 62, 59, 60, 56, 63},
+    {25, 30, 26, 29, 24, 31, 27, 28, 33, 38, 34, 37, 32, 39, 35, 36, 3, 2, 0, 1, 4, 5, 7, 6, 61, 60, 62, 63, 58, 59, 57, 56,
+     23, 20, 16, 19, 22, 21, 17, 18, 43, 40, 44, 47, 42, 41, 45, 46, 15, 12, 8, 11, 14, 13, 9, 10, 51, 48, 52, 55, 50, 49, 53, 54},
+    {38, 39, 37, 36, 33, 32, 34, 35, 40, 41, 47, 46, 43, 42, 44, 45, 60, 59, 63, 56, 61, 58, 62, 57, 48, 49, 55, 54, 51, 50, 52, 53,
+     30, 31, 29, 28, 25, 24, 26, 27, 20, 21, 19, 18, 23, 22, 16, 17, 2, 5, 1, 6, 3, 4, 0, 7, 12, 13, 11, 10, 15, 14, 8, 9},
+    {41, 42, 46, 45, 40, 43, 47, 44, 21, 22, 18, 17, 20, 23, 19, 16, 49, 50, 54, 53, 48, 51, 55, 52, 13, 14, 10, 9, 12, 15, 11, 8,
+     39, 32, 36, 35, 38, 33, 37, 34, 31, 24, 28, 27, 30, 25, 29, 26, 59, 58, 56, 57, 60, 61, 63, 62, 5, 4, 6, 7, 2, 3, 1, 0},
+    {63, 62, 56, 57, 60, 61, 59, 58, 1, 0, 6, 7, 2, 3, 5, 4, 55, 52, 54, 53, 48, 51, 49, 50, 11, 8, 10, 9, 12, 15, 13, 14,
+     37, 34, 36, 35, 38, 33, 39, 32, 29, 26, 28, 27, 30, 25, 31, 24, 47, 44, 46, 45, 40, 43, 41, 42, 19, 16, 18, 17, 20, 23, 21, 22},
+    {0, 3, 7, 4, 1, 2, 6, 5, 26, 25, 27, 24, 29, 30, 28, 31, 8, 15, 9, 14, 11, 12, 10, 13, 16, 23, 17, 22, 19, 20, 18, 21,
+     62, 61, 57, 58, 63, 60, 56, 59, 34, 33, 35, 32, 37, 38, 36, 39, 52, 51, 53, 50, 55, 48, 54, 49, 44, 43, 45, 42, 47, 40, 46, 41},
+    {25, 30, 24, 31, 26, 29, 27, 28, 33, 38, 32, 39, 34, 37, 35, 36, 23, 20, 22, 21, 16, 19, 17, 18, 43, 40, 42, 41, 44, 47, 45, 46,
+     3, 2, 4, 5, 0, 1, 7, 6, 61, 60, 58, 59, 62, 63, 57, 56, 15, 12, 14, 13, 8, 11, 9, 10, 51, 48, 50, 49, 52, 55, 53, 54},
+    {38, 37, 39, 36, 33, 34, 32, 35, 60, 63, 59, 56, 61, 62, 58, 57, 40, 47, 41, 46, 43, 44, 42, 45, 48, 55, 49, 54, 51, 52, 50, 53,
+     30, 29, 31, 28, 25, 26, 24, 27, 2, 1, 5, 6, 3, 0, 4, 7, 20, 19, 21, 18, 23, 16, 22, 17, 12, 11, 13, 10, 15, 8, 14, 9},
+    {54, 55, 53, 52, 49, 48, 50, 51, 56, 63, 57, 62, 59, 60, 58, 61, 10, 11, 9, 8, 13, 12, 14, 15, 6, 1, 7, 0, 5, 2, 4, 3,
+     46, 47, 45, 44, 41, 40, 42, 43, 36, 37, 35, 34, 39, 38, 32, 33, 18, 19, 17, 16, 21, 20, 22, 23, 28, 29, 27, 26, 31, 30, 24, 25},
+    {63, 60, 62, 61, 56, 59, 57, 58, 37, 38, 34, 33, 36, 39, 35, 32, 1, 2, 0, 3, 6, 5, 7, 4, 29, 30, 26, 25, 28, 31, 27, 24,
+     55, 48, 52, 51, 54, 49, 53, 50, 47, 40, 44, 43, 46, 41, 45, 42, 11, 12, 8, 15, 10, 13, 9, 14, 19, 20, 16, 23, 18, 21, 17, 22},
+    {38, 39, 33, 32, 37, 36, 34, 35, 40, 41, 43, 42, 47, 46, 44, 45, 30, 31, 25, 24, 29, 28, 26, 27, 20, 21, 23, 22, 19, 18, 16, 17,
+     60, 59, 61, 58, 63, 56, 62, 57, 48, 49, 51, 50, 55, 54, 52, 53, 2, 5, 3, 4, 1, 6, 0, 7, 12, 13, 15, 14, 11, 10, 8, 9},
+    {41, 46, 42, 45, 40, 47, 43, 44, 49, 54, 50, 53, 48, 55, 51, 52, 21, 18, 22, 17, 20, 19, 23, 16, 13, 10, 14, 9, 12, 11, 15, 8,
+     39, 36, 32, 35, 38, 37, 33, 34, 59, 56, 58, 57, 60, 63, 61, 62, 31, 28, 24, 27, 30, 29, 25, 26, 5, 6, 4, 7, 2, 1, 3, 0},
+    {9, 10, 8, 11, 14, 13, 15, 12, 53, 54, 52, 55, 50, 49, 51, 48, 7, 6, 0, 1, 4, 5, 3, 2, 57, 56, 62, 63, 58, 59, 61, 60,
+     17, 18, 16, 19, 22, 21, 23, 20, 45, 46, 44, 47, 42, 41, 43, 40, 27, 28, 26, 29, 24, 31, 25, 30, 35, 36, 34, 37, 32, 39, 33, 38},
+    {54, 49, 55, 48, 53, 50, 52, 51, 46, 41, 47, 40, 45, 42, 44, 43, 56, 59, 63, 60, 57, 58, 62, 61, 36, 39, 37, 38, 35, 32, 34, 33,
+     10, 13, 11, 12, 9, 14, 8, 15, 18, 21, 19, 20, 17, 22, 16, 23, 6, 5, 1, 2, 7, 4, 0, 3, 28, 31, 29, 30, 27, 24, 26, 25},
+    {41, 42, 40, 43, 46, 45, 47, 44, 21, 22, 20, 23, 18, 17, 19, 16, 39, 32, 38, 33, 36, 35, 37, 34, 31, 24, 30, 25, 28, 27, 29, 26,
+     49, 50, 48, 51, 54, 53, 55, 52, 13, 14, 12, 15, 10, 9, 11, 8, 59, 58, 60, 61, 56, 57, 63, 62, 5, 4, 2, 3, 6, 7, 1, 0},
+    {22, 17, 23, 16, 21, 18, 20, 19, 14, 9, 15, 8, 13, 10, 12, 11, 24, 27, 25, 26, 31, 28, 30, 29, 4, 7, 3, 0, 5, 6, 2, 1,
+     42, 45, 43, 44, 41, 46, 40, 47, 50, 53, 51, 52, 49, 54, 48, 55, 32, 35, 33, 34, 39, 36, 38, 37, 58, 57, 61, 62, 59, 56, 60, 63},
+    {0, 7, 1, 6, 3, 4, 2, 5, 8, 9, 11, 10, 15, 14, 12, 13, 62, 57, 63, 56, 61, 58, 60, 59, 52, 53, 55, 54, 51, 50, 48, 49,
+     26, 27, 29, 28, 25, 24, 30, 31, 16, 17, 19, 18, 23, 22, 20, 21, 34, 35, 37, 36, 33, 32, 38, 39, 44, 45, 47, 46, 43, 42, 40, 41},
+    {9, 14, 10, 13, 8, 15, 11, 12, 17, 22, 18, 21, 16, 23, 19, 20, 53, 50, 54, 49, 52, 51, 55, 48, 45, 42, 46, 41, 44, 43, 47, 40,
+     7, 4, 6, 5, 0, 3, 1, 2, 27, 24, 28, 31, 26, 25, 29, 30, 57, 58, 56, 59, 62, 61, 63, 60, 35, 32, 36, 39, 34, 33, 37, 38},
+    {22, 23, 21, 20, 17, 16, 18, 19, 24, 25, 31, 30, 27, 26, 28, 29, 42, 43, 41, 40, 45, 44, 46, 47, 32, 33, 39, 38, 35, 34, 36, 37,
+     14, 15, 13, 12, 9, 8, 10, 11, 4, 3, 5, 2, 7, 0, 6, 1, 50, 51, 49, 48, 53, 52, 54, 55, 58, 61, 59, 60, 57, 62, 56, 63},
+    {25, 26, 30, 29, 24, 27, 31, 28, 3, 0, 2, 1, 4, 7, 5, 6, 33, 34, 38, 37, 32, 35, 39, 36, 61, 62, 60, 63, 58, 57, 59, 56,
+     23, 16, 20, 19, 22, 17, 21, 18, 15, 8, 12, 11, 14, 9, 13, 10, 43, 44, 40, 47, 42, 45, 41, 46, 51, 52, 48, 55, 50, 53, 49, 54},
+    {9, 8, 14, 15, 10, 11, 13, 12, 7, 0, 4, 3, 6, 1, 5, 2, 17, 16, 22, 23, 18, 19, 21, 20, 27, 26, 24, 25, 28, 29, 31, 30,
+     53, 52, 50, 51, 54, 55, 49, 48, 57, 62, 58, 61, 56, 63, 59, 60, 45, 44, 42, 43, 46, 47, 41, 40, 35, 34, 32, 33, 36, 37, 39, 38},
+    {0, 1, 3, 2, 7, 6, 4, 5, 62, 63, 61, 60, 57, 56, 58, 59, 26, 29, 25, 30, 27, 28, 24, 31, 34, 37, 33, 38, 35, 36, 32, 39,
+     8, 11, 15, 12, 9, 10, 14, 13, 52, 55, 51, 48, 53, 54, 50, 49, 16, 19, 23, 20, 17, 18, 22, 21, 44, 47, 43, 40, 45, 46, 42, 41},
+    {63, 56, 60, 59, 62, 57, 61, 58, 55, 54, 48, 49, 52, 53, 51, 50, 37, 36, 38, 39, 34, 35, 33, 32, 47, 46, 40, 41, 44, 45, 43, 42,
+     1, 6, 2, 5, 0, 7, 3, 4, 11, 10, 12, 13, 8, 9, 15, 14, 29, 28, 30, 31, 26, 27, 25, 24, 19, 18, 20, 21, 16, 17, 23, 22},
+    {54, 53, 49, 50, 55, 52, 48, 51, 10, 9, 13, 14, 11, 8, 12, 15, 46, 45, 41, 42, 47, 44, 40, 43, 18, 17, 21, 22, 19, 16, 20, 23,
+     56, 57, 59, 58, 63, 62, 60, 61, 6, 7, 5, 4, 1, 0, 2, 3, 36, 35, 39, 32, 37, 34, 38, 33, 28, 27, 31, 24, 29, 26, 30, 25},
+    {41, 40, 46, 47, 42, 43, 45, 44, 39, 38, 36, 37, 32, 33, 35, 34, 49, 48, 54, 55, 50, 51, 53, 52, 59, 60, 56, 63, 58, 61, 57, 62,
+     21, 20, 18, 19, 22, 23, 17, 16, 31, 30, 28, 29, 24, 25, 27, 26, 13, 12, 10, 11, 14, 15, 9, 8, 5, 2, 6, 1, 4, 3, 7, 0},
+    {38, 33, 37, 34, 39, 32, 36, 35, 30, 25, 29, 26, 31, 24, 28, 27, 60, 61, 63, 62, 59, 58, 56, 57, 2, 3, 1, 0, 5, 4, 6, 7,
+     40, 43, 47, 44, 41, 42, 46, 45, 20, 23, 19, 16, 21, 22, 18, 17, 48, 51, 55, 52, 49, 50, 54, 53, 12, 15, 11, 8, 13, 14, 10, 9},
+    {25, 24, 26, 27, 30, 31, 29, 28, 23, 22, 16, 17, 20, 21, 19, 18, 3, 4, 0, 7, 2, 5, 1, 6, 15, 14, 8, 9, 12, 13, 11, 10,
+     33, 32, 34, 35, 38, 39, 37, 36, 43, 42, 44, 45, 40, 41, 47, 46, 61, 58, 62, 57, 60, 59, 63, 56, 51, 50, 52, 53, 48, 49, 55, 54},
+    {22, 21, 17, 18, 23, 20, 16, 19, 42, 41, 45, 46, 43, 40, 44, 47, 14, 13, 9, 10, 15, 12, 8, 11, 50, 49, 53, 54, 51, 48, 52, 55,
+     24, 31, 27, 28, 25, 30, 26, 29, 32, 39, 35, 36, 33, 38, 34, 37, 4, 5, 7, 6, 3, 2, 0, 1, 58, 59, 57, 56, 61, 60, 62, 63}
+};
+
+/* Spread the lowest 21 bits of x so there are two zero bits between each*/
+static inline uint64_t
+spread_bits3(uint64_t x)
+{
+#ifdef __BMI2__
+    return _pdep_u64(x, 0x1249249249249249ULL);
+#else
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+#endif
+}
+
+/*! This function computes the Morton (z-order) key for an integer triplet (x,y,z),
+ *  with x,y,z in the range between 0 and 2^bits-1. The bits of x, y and z are interleaved,
+ *  x most significant, so each octal digit is the pixel of one level of the oct-tree.
+ */
+peano_t morton_key(const int x, const int y, const int z, const int bits)
+{
+    const uint64_t mask = (((uint64_t) 1) << bits) - 1;
+    return (spread_bits3(x & mask) << 2) | (spread_bits3(y & mask) << 1) | spread_bits3(z & mask);
+}
+
 /*! This function computes a Peano-Hilbert key for an integer triplet (x,y,z),
  *  with x,y,z in the range between 0 and 2^bits-1.
+ *  The coordinates are first interleaved into a Morton key, which is then
+ *  rotated into Hilbert order two levels at a time.
  */
 peano_t peano_hilbert_key(const int x, const int y, const int z, const int bits)
 {
-    int bit;
+    const peano_t morton = morton_key(x, y, z, bits);
     unsigned char rotation = 0;
     peano_t key = 0;
+    int bit = bits - 1;
 
-    for(bit = (bits - 1); bit >= 0; bit -= 1)
-    {
-        const int mask = 1 << bit;
-        const unsigned char pix = (4*((x & mask) >> bit)) | (2*((y & mask) >> bit)) | ((z & mask) >> bit);
-
-        key <<= 3;
-        key |= subpix3[rotation][pix];
+    /* With an odd number of levels do the first one on its own*/
+    if(bits % 2) {
+        const unsigned char pix = (morton >> (3 * bit)) & 7;
+        key = subpix3[rotation][pix];
         rotation = rottable3[rotation][pix];
+        bit--;
+    }
+
+    for(; bit > 0; bit -= 2)
+    {
+        const unsigned char pix = (morton >> (3 * (bit - 1))) & 63;
+        key <<= 6;
+        key |= subpix6[rotation][pix];
+        rotation = rottable6[rotation][pix];
     }
 
     return key;
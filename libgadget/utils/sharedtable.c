@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sharedtable.h"
+#include "endrun.h"
+#include "system.h"
+
+#define MAX_PREFETCH 16
+
+/* A file being read in the background. size is -1 if it could not be read.*/
+static struct prefetch
+{
+    char path[512];
+    char * data;
+    int64_t size;
+    pthread_t thread;
+} Prefetch[MAX_PREFETCH];
+static int NPrefetch;
+
+/* Read a whole file into a malloc'd buffer. Uses malloc as this runs in a thread.*/
+static int64_t
+read_whole_file(const char * path, char ** data)
+{
+    *data = NULL;
+    FILE * fd = fopen(path, "r");
+    if(!fd)
+        return -1;
+    int64_t size = -1;
+    if(0 == fseek(fd, 0, SEEK_END))
+        size = ftell(fd);
+    if(size >= 0 && 0 == fseek(fd, 0, SEEK_SET)) {
+        *data = malloc(size + 1);
+        if(!*data || fread(*data, 1, size, fd) != (size_t) size)
+            size = -1;
+    }
+    fclose(fd);
+    if(size < 0) {
+        free(*data);
+        *data = NULL;
+    }
+    return size;
+}
+
+static void *
+prefetch_thread(void * arg)
+{
+    struct prefetch * pf = (struct prefetch *) arg;
+    pf->size = read_whole_file(pf->path, &pf->data);
+    return NULL;
+}
+
+void
+shared_table_prefetch(const char * path)
+{
+    int ThisTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    if(ThisTask != 0 || !path || strlen(path) == 0 || strlen(path) >= sizeof(Prefetch[0].path) || NPrefetch >= MAX_PREFETCH)
+        return;
+    struct prefetch * pf = &Prefetch[NPrefetch];
+    strncpy(pf->path, path, sizeof(pf->path) - 1);
+    pf->data = NULL;
+    pf->size = -1;
+    /* If no thread can be started the file is read when it is loaded*/
+    if(0 != pthread_create(&pf->thread, NULL, prefetch_thread, pf))
+        return;
+    NPrefetch++;
+}
+
+/* Wait for a prefetch of path and take its contents. Returns 0 if there was no prefetch.*/
+static int
+prefetch_take(const char * path, char ** data, int64_t * size)
+{
+    int i;
+    for(i = 0; i < NPrefetch; i++) {
+        if(Prefetch[i].path[0] == '\0' || strcmp(Prefetch[i].path, path) != 0)
+            continue;
+        pthread_join(Prefetch[i].thread, NULL);
+        *data = Prefetch[i].data;
+        *size = Prefetch[i].size;
+        /* The contents are handed over only once*/
+        Prefetch[i].path[0] = '\0';
+        Prefetch[i].data = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/* Ranks are ordered within a node, so rank 0 of Comm leads its node*/
+static MPI_Comm
+node_comm(MPI_Comm Comm, int * NodeRank)
+{
+    int ThisTask;
+    MPI_Comm NodeComm;
+    MPI_Comm_rank(Comm, &ThisTask);
+    MPI_Comm_split_type(Comm, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &NodeComm);
+    MPI_Comm_rank(NodeComm, NodeRank);
+    return NodeComm;
+}
+
+int
+shared_table_alloc(struct shared_table * st, size_t size, MPI_Comm Comm)
+{
+    int NodeRank;
+    MPI_Comm NodeComm = node_comm(Comm, &NodeRank);
+    char * base;
+    if(MPI_SUCCESS != MPI_Win_allocate_shared(NodeRank == 0 ? size : 0, 1, MPI_INFO_NULL, NodeComm, &base, &st->win))
+        endrun(1, "Failed to allocate %lu bytes of node shared memory\n", size);
+    if(NodeRank != 0) {
+        MPI_Aint segsize;
+        int disp;
+        MPI_Win_shared_query(st->win, 0, &segsize, &disp, &base);
+    }
+    MPI_Comm_free(&NodeComm);
+    st->data = base;
+    st->size = size;
+    return NodeRank == 0;
+}
+
+void
+shared_table_ready(struct shared_table * st)
+{
+    /* The fence is collective over the node and makes the writes of the leader visible*/
+    MPI_Win_fence(0, st->win);
+}
+
+void
+shared_table_bcast(struct shared_table * st, const void * data, size_t size, MPI_Comm Comm)
+{
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    uint64_t nbytes = size;
+    MPI_Bcast(&nbytes, 1, MPI_UINT64, 0, Comm);
+
+    int leader = shared_table_alloc(st, nbytes, Comm);
+    MPI_Comm LeaderComm;
+    MPI_Comm_split(Comm, leader ? 0 : MPI_UNDEFINED, ThisTask, &LeaderComm);
+    if(leader) {
+        if(ThisTask == 0 && nbytes > 0)
+            memcpy(st->data, data, nbytes);
+        /* MPI counts are ints, so send in chunks*/
+        uint64_t sent;
+        for(sent = 0; sent < nbytes; sent += (1u << 30)) {
+            int chunk = nbytes - sent < (1u << 30) ? nbytes - sent : (1u << 30);
+            MPI_Bcast(st->data + sent, chunk, MPI_BYTE, 0, LeaderComm);
+        }
+        MPI_Comm_free(&LeaderComm);
+    }
+    shared_table_ready(st);
+}
+
+int
+shared_table_load_file(struct shared_table * st, const char * path, MPI_Comm Comm)
+{
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    char * data = NULL;
+    int64_t size = -1;
+    if(ThisTask == 0 && !prefetch_take(path, &data, &size))
+        size = read_whole_file(path, &data);
+    MPI_Bcast(&size, 1, MPI_INT64, 0, Comm);
+    if(size < 0) {
+        st->data = NULL;
+        st->size = 0;
+        st->win = MPI_WIN_NULL;
+        return 1;
+    }
+    shared_table_bcast(st, data, size, Comm);
+    free(data);
+    return 0;
+}
+
+void
+shared_table_free(struct shared_table * st)
+{
+    if(st->win != MPI_WIN_NULL)
+        MPI_Win_free(&st->win);
+    st->data = NULL;
+    st->size = 0;
+}
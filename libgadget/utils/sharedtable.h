@@ -0,0 +1,44 @@
+#ifndef __UTILS_SHAREDTABLE_H__
+#define __UTILS_SHAREDTABLE_H__
+
+#include <stddef.h>
+#include <mpi.h>
+
+/* A read-only table held once per node, in memory shared by the ranks of the node.
+ * Tables are either read on rank 0 and sent to one rank per node, instead of to every rank,
+ * or computed by one rank per node. A zeroed struct is not a valid table:
+ * initialise statics with SHARED_TABLE_INIT so they can be freed before being allocated.*/
+struct shared_table
+{
+    char * data;
+    size_t size;
+    MPI_Win win;
+};
+
+#define SHARED_TABLE_INIT {NULL, 0, MPI_WIN_NULL}
+
+/* Collective. Allocate size bytes of memory shared by the ranks of each node.
+ * Returns 1 on the one rank of each node which should fill the table and 0 on the others.
+ * No rank may read the table until shared_table_ready has been called.*/
+int shared_table_alloc(struct shared_table * st, size_t size, MPI_Comm Comm);
+
+/* Collective. Wait until the table has been filled and make it visible to the whole node.*/
+void shared_table_ready(struct shared_table * st);
+
+/* Start reading a file on rank 0 of GadgetComm in a background thread,
+ * so that the read overlaps with other start up work. Not collective.
+ * A later shared_table_load_file of the same path picks up the contents.*/
+void shared_table_prefetch(const char * path);
+
+/* Collective. Load the whole file at path into st, using the prefetched contents if there are any.
+ * Returns 0 on success and nonzero on all ranks if the file could not be read.*/
+int shared_table_load_file(struct shared_table * st, const char * path, MPI_Comm Comm);
+
+/* Collective. Copy size bytes of data on rank 0 of Comm into st on every rank.
+ * data is only read on rank 0.*/
+void shared_table_bcast(struct shared_table * st, const void * data, size_t size, MPI_Comm Comm);
+
+/* Collective. Free the shared memory of st.*/
+void shared_table_free(struct shared_table * st);
+
+#endif
@@ -11,7 +11,6 @@
 #include <sys/resource.h>
 #include <unistd.h>
 #include <signal.h>
-#include <gsl/gsl_rng.h>
 #include <omp.h>
 
 #define __UTILS_SYSTEM_C
@@ -19,6 +18,14 @@
 #include "mymalloc.h"
 #include "endrun.h"
 
+MPI_Comm GadgetComm = MPI_COMM_WORLD;
+
+void
+gadget_set_comm(MPI_Comm comm)
+{
+    GadgetComm = comm;
+}
+
 /* NOTE:
  *
  * The MPIU_xxx functions must be called after the memory module is initalized.
@@ -52,36 +59,51 @@ void enable_core_dumps_and_fpu_exceptions(void)
 
 #endif
 
-double get_random_number(const uint64_t id, const RandTable * const rnd)
+/* One Philox round: a 64x64->128 bit multiply, with the high half mixed into the other word*/
+static inline void
+philox2x64_round(uint64_t ctr[2], const uint64_t key)
+{
+    const __uint128_t prod = (__uint128_t) 0xD2B74407B1CE6E93ULL * ctr[0];
+    const uint64_t hi = (uint64_t) (prod >> 64);
+    const uint64_t lo = (uint64_t) prod;
+    ctr[0] = hi ^ key ^ ctr[1];
+    ctr[1] = lo;
+}
+
+void
+philox2x64_10(uint64_t ctr[2], uint64_t key)
+{
+    int r;
+    for(r = 0; r < 10; r++) {
+        philox2x64_round(ctr, key);
+        /* Weyl sequence key schedule*/
+        key += 0x9E3779B97F4A7C15ULL;
+    }
+}
+
+double get_random_number(const uint64_t id, const int purpose, const RandTable * const rnd)
 {
-    if(!rnd->Table)
-        endrun(1, "Random number called with non-allocated random table\n")
-    /* Draw from the table: note that only the lowest bits of the ID are used*/;
-    return rnd->Table[id % rnd->tablesize];
+    if(!rnd->Seeded)
+        endrun(1, "Random number called with unseeded generator\n");
+    /* The purpose is kept out of the id word, so neighbouring ids do not share streams*/
+    uint64_t ctr[2] = {id, (rnd->Step << RND_PURPOSE_BITS) | (uint64_t) purpose};
+    philox2x64_10(ctr, rnd->Key);
+    /* Top 53 bits give a uniform double in [0, 1)*/
+    return (ctr[0] >> 11) * (1.0 / 9007199254740992.0);
 }
 
-RandTable set_random_numbers(uint64_t seed, const size_t rndtablesize)
+RandTable set_random_numbers(uint64_t seed, uint64_t step)
 {
     RandTable rnd;
-    rnd.Table = (double *) mymalloc2("Random", rndtablesize * sizeof(double));
-    rnd.tablesize = rndtablesize;
-    /* start-up seed */
-    gsl_rng * random_generator = gsl_rng_alloc(gsl_rng_ranlxd1);
-    gsl_rng_set(random_generator, seed);
-
-    /* Populate a table with uniform random numbers between 0 and 1*/
-    size_t i;
-    for(i = 0; i < rndtablesize; i++)
-        rnd.Table[i] = gsl_rng_uniform(random_generator);
-
-    gsl_rng_free(random_generator);
+    rnd.Key = seed;
+    rnd.Step = step;
+    rnd.Seeded = 1;
     return rnd;
 }
 
 void free_random_numbers(RandTable * rnd)
 {
-    myfree(rnd->Table);
-    rnd->Table = NULL;
+    rnd->Seeded = 0;
 }
 
 
@@ -206,7 +228,7 @@ MPIU_cumsum(int64_t countLocal, MPI_Comm comm)
     int64_t offsetLocal;
     int64_t * count = ta_malloc("counts", int64_t, NTask);
     int64_t * offset = ta_malloc("offsets", int64_t, NTask);
-    MPI_Gather(&countLocal, 1, MPI_INT64, &count[0], 1, MPI_INT64, 0, MPI_COMM_WORLD);
+    MPI_Gather(&countLocal, 1, MPI_INT64, &count[0], 1, MPI_INT64, 0, GadgetComm);
     if(ThisTask == 0) {
         offset[0] = 0;
         int i;
@@ -214,7 +236,7 @@ MPIU_cumsum(int64_t countLocal, MPI_Comm comm)
             offset[i] = offset[i-1] + count[i-1];
         }
     }
-    MPI_Scatter(&offset[0], 1, MPI_INT64, &offsetLocal, 1, MPI_INT64, 0, MPI_COMM_WORLD);
+    MPI_Scatter(&offset[0], 1, MPI_INT64, &offsetLocal, 1, MPI_INT64, 0, GadgetComm);
     ta_free(offset);
     ta_free(count);
     return offsetLocal;
@@ -222,7 +244,7 @@ MPIU_cumsum(int64_t countLocal, MPI_Comm comm)
 
 int64_t count_sum(int64_t countLocal) {
     int64_t sum = 0;
-    MPI_Allreduce(&countLocal, &sum, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&countLocal, &sum, 1, MPI_INT64, MPI_SUM, GadgetComm);
     return sum;
 }
 
@@ -377,8 +399,8 @@ cluster_get_num_hosts(void)
     /* Find a unique hostid for the computing rank. */
     int NTask;
     int ThisTask;
-    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
 
     /* Size is set by the size of the temp heap:
      * this fills it and should be changed if needed.*/
@@ -388,7 +410,7 @@ cluster_get_num_hosts(void)
     int i, j;
     gethostname(&buffer[bufsz*ThisTask], bufsz);
     buffer[bufsz * ThisTask + bufsz - 1] = '\0';
-    MPI_Allgather(MPI_IN_PLACE, bufsz, MPI_CHAR, buffer, bufsz, MPI_CHAR, MPI_COMM_WORLD);
+    MPI_Allgather(MPI_IN_PLACE, bufsz, MPI_CHAR, buffer, bufsz, MPI_CHAR, GadgetComm);
 
     int nunique = 0;
     /* Count unique entries*/
@@ -492,7 +514,7 @@ MPIU_Any(int condition, MPI_Comm comm)
 void
 MPIU_write_pids(char * filename)
 {
-    MPI_Comm comm = MPI_COMM_WORLD;
+    MPI_Comm comm = GadgetComm;
     int NTask;
     int ThisTask;
     MPI_Comm_size(comm, &NTask);
@@ -16,26 +16,55 @@
 #error MP-Gadget requires OpenMP >= 4.5. Use a newer compiler (gcc >= 6.0, intel >= 17 clang >= 7).
 #endif
 
+/* Key for the counter-based random number generator. No table is stored:
+ * each random number is a pure function of (Key, Step, purpose, id).*/
 typedef struct _Rnd_Table
 {
-  double * Table;
-  size_t tablesize;
+  uint64_t Key;
+  uint64_t Step;
+  int Seeded;
 } RandTable;
 
+/* What a random number is for. Each purpose has its own stream, so that the numbers
+ * drawn for one particle for different purposes, or for neighbouring ids, are independent.
+ * Purposes must be less than RND_MAX_PURPOSE: above it they would spill into the step.*/
+#define RND_PURPOSE_BITS 16
+#define RND_MAX_PURPOSE (1 << RND_PURPOSE_BITS)
+enum RandomPurpose {
+    RND_SFR_METALS = 0, /* Metal enrichment of star forming gas*/
+    RND_SFR_FORM = 1, /* Star formation and the quick Lyman alpha conversion*/
+    RND_WIND_AFTER_SF = 2, /* Wind launch from newly formed stars*/
+    RND_DIR_THETA = 3, /* Random directions of wind and black hole kicks*/
+    RND_DIR_PHI = 4,
+    RND_WIND_KICK = 5, /* Wind kick of a gas particle by a nearby star*/
+    RND_BH_SWALLOW = 6, /* Gas swallowed by a black hole*/
+    RND_BH_SEED_MASS = 7, /* Black hole seed mass*/
+    RND_QSO_BUBBLE = 8, /* Two deviates for the helium reionization bubble radius*/
+    RND_QSO_CHOOSE = 10, /* Choice of the next quasar halo*/
+    RND_PARTICLE_OFFSET = 11, /* Random offset of the whole particle grid*/
+    RND_LIGHTCONE = 16, /* Lightcone sampling, plus the replica number*/
+};
+
+/* Communicator of this simulation. It is MPI_COMM_WORLD unless the job runs an ensemble,
+ * in which case each member simulation has its own sub-communicator.*/
+extern MPI_Comm GadgetComm;
+/* Set the communicator of this simulation. Must be called before anything else uses it.*/
+void gadget_set_comm(MPI_Comm comm);
+
 int cluster_get_num_hosts(void);
 double get_physmem_bytes(void);
 
-/* Gets a random number in the range [0, 1) from the table. The id is used modulo the size of the table,
- * so only the lowest bits are used.
- * Random deviates are taken from a pre-seeded table generated in set_random_numbers, so that they are
- * independent of processor.*/
-double get_random_number(const uint64_t id, const RandTable * const rnd);
-/* Generate the random number table. The seed should be the same on each processor so the output is invariant to
- * To quote the GSL documentation: 'Note that the most generators only accept 32-bit seeds, with higher values being reduced modulo 2^32.'
- * It is important that each timestep uses a new seed value, so the seed should change by less than 2^32 each timestep.
- * The random number table is heap-allocated high, and random numbers are uniform doubles between 0 and 1.*/
-RandTable set_random_numbers(uint64_t seed, const size_t rndtablesize);
-/* Free the random number table and set Table to NULL*/
+/* Gets a random number in the range [0, 1) for a given id, usually a particle ID, and purpose.
+ * Deviates are generated by a counter-based generator (Philox2x64-10) with the id as the first
+ * counter word, the step and purpose as the second and the seed as the key. They are independent
+ * of processor, thread and the order of calls, and distinct (id, purpose) pairs never share a deviate.*/
+double get_random_number(const uint64_t id, const int purpose, const RandTable * const rnd);
+/* Seed the random number generator. The seed should be the same on each processor,
+ * and each timestep should have a new step number, less than 2^48. Nothing is allocated.*/
+RandTable set_random_numbers(uint64_t seed, uint64_t step);
+/* The Philox2x64 bijection with 10 rounds, as in Random123, applied to ctr in place*/
+void philox2x64_10(uint64_t ctr[2], uint64_t key);
+/* Mark the random number generator as unseeded*/
 void free_random_numbers(RandTable * rnd);
 int64_t count_sum(int64_t countLocal);
 
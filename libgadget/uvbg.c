@@ -48,6 +48,8 @@ static struct UVBGParams {
     int ReionUseParticleSFR;
     double ReionSFRTimescale;
     int UVBGdim;
+    /*If true, interpolate J21 to the particles instead of taking the maximum of the nearby cells*/
+    int ReionInterpolateJ21;
 
     double Time;
     Cosmology *CP;
@@ -63,7 +65,7 @@ struct UVBGgrids_type UVBGgrids;
 void set_uvbg_params(ParameterSet * ps) {
 
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask==0)
     {
         uvbg_params.ReionFilterType = param_get_int(ps, "ReionFilterType");
@@ -79,9 +81,17 @@ void set_uvbg_params(ParameterSet * ps) {
         uvbg_params.ReionUseParticleSFR = param_get_int(ps, "ReionUseParticleSFR");
         uvbg_params.ReionSFRTimescale = param_get_double(ps, "ReionSFRTimescale");
         uvbg_params.UVBGdim = param_get_int(ps,"UVBGdim");
+        uvbg_params.ReionInterpolateJ21 = param_get_int(ps, "ReionInterpolateJ21");
     }
 
-    MPI_Bcast(&uvbg_params, sizeof(struct UVBGParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&uvbg_params, sizeof(struct UVBGParams), MPI_BYTE, 0, GadgetComm);
+}
+
+/* Plan a batched backward transform on the mass mesh for the mass, star and (optionally) SFR fields,
+ * so that each filtering radius needs one distributed transform rather than one per field.*/
+void uvbg_init_pm(PetaPM * pm_mass)
+{
+    petapm_init_batch(pm_mass, uvbg_params.ReionUseParticleSFR ? 3 : 2);
 }
 
 int grid_index(int i, int j, int k, ptrdiff_t strides[3])
@@ -95,8 +105,8 @@ void save_uvbg_grids(int SnapshotFileCount, char * OutputDir, PetaPM * pm)
     int n_ranks;
     int this_rank=-1;
     int grid_n = pm->real_space_region.size[0] * pm->real_space_region.size[1] * pm->real_space_region.size[2];
-    MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
-    MPI_Comm_rank(MPI_COMM_WORLD, &this_rank);
+    MPI_Comm_size(GadgetComm, &n_ranks);
+    MPI_Comm_rank(GadgetComm, &this_rank);
 
     //TODO(jdavies): finish this grid writing function, it outputs fine but in the wrong rank order
     BigFile fout;
@@ -104,13 +114,13 @@ void save_uvbg_grids(int SnapshotFileCount, char * OutputDir, PetaPM * pm)
     sprintf(fname, "%s/UVgrids_%03d", OutputDir,SnapshotFileCount);
     message(0, "saving uv grids to %s \n", fname);
 
-    if(0 != big_file_mpi_create(&fout, fname, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create(&fout, fname, GadgetComm)) {
         endrun(0, "Failed to create snapshot at %s:%s\n", fname,
                     big_file_get_error_message());
     }
 
     BigBlock bh;
-    if(0 != big_file_mpi_create_block(&fout, &bh, "Header", NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create_block(&fout, &bh, "Header", NULL, 0, 0, 0, GadgetComm)) {
         endrun(0, "Failed to create block at %s:%s\n", "Header",
                 big_file_get_error_message());
     }
@@ -123,7 +133,7 @@ void save_uvbg_grids(int SnapshotFileCount, char * OutputDir, PetaPM * pm)
                     big_file_get_error_message());
     }
 
-    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bh, GadgetComm)) {
         endrun(0, "Failed to close block %s\n",
                     big_file_get_error_message());
     }
@@ -146,7 +156,7 @@ void save_uvbg_grids(int SnapshotFileCount, char * OutputDir, PetaPM * pm)
 
     message(0,"saved XHI\n");
 
-    if(0 != big_file_mpi_close(&fout, MPI_COMM_WORLD)){
+    if(0 != big_file_mpi_close(&fout, GadgetComm)){
         endrun(0, "Failed to close snapshot at %s:%s\n", fname,
                     big_file_get_error_message());
     }
@@ -251,6 +261,16 @@ static void filter_pm(PetaPM * pm, int64_t k2, int k[3], pfft_complex * value)
 
 #ifdef DEBUG
 //print some statistics of the reion grids for debugging
+static void
+print_reion_debug(const char * label, const double * v)
+{
+    message(0,"neutral cells : %ld, ion cells %ld, ratio(%ld) N %f ion %f\n", (int64_t) v[0], (int64_t) v[1], (int64_t) v[2], v[0] / v[2], v[1] / v[2]);
+    message(0,"min J21 : %e | max J21 %e\n", v[3], v[4]);
+    message(0,"min mass : %e | max mass : %e | total mass %e\n", v[5], v[6], v[11]);
+    message(0,"min star : %e | max star %e | total star : %e\n", v[7], v[8], v[12]);
+    message(0,"min sfr : %e | max sfr %e\n", v[9], v[10]);
+}
+
 static void print_reion_debug_info(PetaPM * pm_mass, float * J21, float * xHI, double * mass_real, double * star_real, double * sfr_real)
 {
     double min_J21 = 1e30;
@@ -293,26 +313,11 @@ static void print_reion_debug_info(PetaPM * pm_mass, float * J21, float * xHI, d
             }
 
     message(1,"rank total mass : %e | rank total star : %e\n",total_mass,total_star);
-    MPI_Allreduce(MPI_IN_PLACE, &neutral_count, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &ion_count, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &min_J21, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &max_J21, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &min_mass, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &max_mass, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &min_star, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &max_star, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &min_sfr, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &max_sfr, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &total_mass, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, &total_star, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    double n_ratio = (double)neutral_count / (double)grid_n_real;
-    double i_ratio = (double)ion_count / (double)grid_n_real;
-
-    message(0,"neutral cells : %d, ion cells %d, ratio(%d) N %f ion %f\n",neutral_count, ion_count, grid_n_real, n_ratio, i_ratio);
-    message(0,"min J21 : %e | max J21 %e\n",min_J21,max_J21);
-    message(0,"min mass : %e | max mass : %e | total mass %e\n",min_mass,max_mass,total_mass);
-    message(0,"min star : %e | max star %e | total star : %e\n",min_star,max_star,total_star);
-    message(0,"min sfr : %e | max sfr %e\n",min_sfr,max_sfr);
+    const double values[13] = {neutral_count, ion_count, grid_n_real, min_J21, max_J21, min_mass, max_mass,
+        min_star, max_star, min_sfr, max_sfr, total_mass, total_star};
+    const enum DiagOp ops[13] = {DIAG_SUM, DIAG_SUM, DIAG_MAX, DIAG_MIN, DIAG_MAX, DIAG_MIN, DIAG_MAX,
+        DIAG_MIN, DIAG_MAX, DIAG_MIN, DIAG_MAX, DIAG_SUM, DIAG_SUM};
+    diagnostics_add("UVBG", values, ops, 13, print_reion_debug);
 }
 #endif
 
@@ -442,9 +447,9 @@ static void reion_loop_pm(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
                     mass_real[pm_idx] = (double)(J21[pm_idx]);
                 }
 
-        MPI_Allreduce(MPI_IN_PLACE, &volume_weighted_global_xHI, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-        MPI_Allreduce(MPI_IN_PLACE, &mass_weighted_global_xHI, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-        MPI_Allreduce(MPI_IN_PLACE, &mass_weight, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &volume_weighted_global_xHI, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
+        MPI_Allreduce(MPI_IN_PLACE, &mass_weighted_global_xHI, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
+        MPI_Allreduce(MPI_IN_PLACE, &mass_weight, 1, MPI_DOUBLE, MPI_SUM, GadgetComm);
 
         volume_weighted_global_xHI /= grid_n_real;
         mass_weighted_global_xHI /= mass_weight;
@@ -458,10 +463,21 @@ static void reion_loop_pm(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
 
 //readout J21 from grid to particle
 static void readout_J21(PetaPM * pm, int i, double * mesh, double weight) {
+    if(P[i].Type != 0)
+        return;
+    // On a coarse grid, interpolate J21 with the mesh assignment weights (trilinear for CIC).
+    // local_J21 is zeroed in init_particle_uvbg and all cells of a particle are visited by the same thread.
+    // A particle is ionised if any of its cells is.
+    if(uvbg_params.ReionInterpolateJ21) {
+        SPHP(i).local_J21 += weight * mesh[0];
+        if(mesh[0] > 0 && weight > 0 && SPHP(i).zreion == -1)
+            SPHP(i).zreion = 1/uvbg_params.Time - 1;
+        return;
+    }
     // Since we need to decide whether particles on the boundary are ionised or not,
     // We choose to take the maximum J21 (of 8 cells) here.
     //TODO: change the iterator in petapm for reionisation to use NGP to avoid the (minor) resolution effects
-    if (P[i].Type == 0 && mesh[0] > SPHP(i).local_J21){
+    if (mesh[0] > SPHP(i).local_J21){
         SPHP(i).local_J21 = mesh[0];
         //if particle has not been ionised yet, set its zreion
         //the above conditional makes sure the particle is (partially) in an ionsied cell
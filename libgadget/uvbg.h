@@ -18,5 +18,7 @@ struct UVBGgrids_type {
 
 void calculate_uvbg(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr, int WriteSnapshot, int SnapshotFileCount, char * Outputdir, double Time, Cosmology * CP, const struct UnitSystem units);
 void set_uvbg_params(ParameterSet * ps);
+/*Set up the batched excursion set transforms. Call after petapm_init on the mass mesh.*/
+void uvbg_init_pm(PetaPM * pm_mass);
 
 #endif
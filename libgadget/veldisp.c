@@ -1,169 +1,17 @@
 #include <math.h>
+#include <string.h>
 #include <omp.h>
 #include "veldisp.h"
 #include "treewalk.h"
 #include "walltime.h"
 #include "sfr_eff.h"
 
-/* Compute the DM velocity dispersion for black holes*/
-static void blackhole_veldisp(const ActiveParticles * act, Cosmology * CP, ForceTree * tree, struct kick_factor_data * kf);
-
 /* For the wind hsml loop*/
 #define NWINDHSML 5 /* Number of densities to evaluate for wind weight ngbiter*/
 #define NUMDMNGB 40 /*Number of DM ngb to evaluate vel dispersion */
 #define MAXDMDEVIATION 1
 
 
-/* Computes the BH velocity dispersion for kinetic feedback*/
-
-struct BHVelDispPriv {
-    /* temporary computed for kinetic feedback energy threshold*/
-    MyFloat * NumDM;
-    MyFloat (*V1sumDM)[3];
-    MyFloat * V2sumDM;
-    /* Time factors*/
-    struct kick_factor_data * kf;
-};
-#define BHVDISP_GET_PRIV(tw) ((struct BHVelDispPriv *) (tw->priv))
-
-typedef struct {
-    TreeWalkQueryBase base;
-    MyFloat Hsml;
-    MyFloat Vel[3];
-} TreeWalkQueryBHVelDisp;
-
-typedef struct {
-    TreeWalkResultBase base;
-    /* used for AGN kinetic feedback */
-    MyFloat V2sumDM;
-    MyFloat V1sumDM[3];
-    MyFloat NumDM;
-} TreeWalkResultBHVelDisp;
-
-typedef struct {
-    TreeWalkNgbIterBase base;
-    DensityKernel feedback_kernel;
-} TreeWalkNgbIterBHVelDisp;
-
-/*******************************************************************/
-static int
-blackhole_dynfric_haswork(int n, TreeWalk * tw){
-    /*Black hole not being swallowed*/
-    return (P[n].Type == 5) && (!P[n].Swallowed);
-}
-
-static void
-blackhole_veldisp_postprocess(int i, TreeWalk * tw)
-{
-    int PI = P[i].PI;
-    /*************************************************************************/
-    /* decide whether to release KineticFdbkEnergy*/
-    double vdisp = 0;
-    double numdm = BHVDISP_GET_PRIV(tw)->NumDM[PI];
-    if (numdm>0){
-        vdisp = BHVDISP_GET_PRIV(tw)->V2sumDM[PI]/numdm;
-        int d;
-        for(d = 0; d<3; d++){
-            vdisp -= pow(BHVDISP_GET_PRIV(tw)->V1sumDM[PI][d]/numdm,2);
-        }
-        if(vdisp > 0)
-            BHP(i).VDisp = sqrt(vdisp / 3);
-    }
-}
-
-static void
-blackhole_veldisp_ngbiter(TreeWalkQueryBHVelDisp * I,
-        TreeWalkResultBHVelDisp * O,
-        TreeWalkNgbIterBHVelDisp * iter,
-        LocalTreeWalk * lv)
-{
-    if(iter->base.other == -1) {
-        iter->base.mask = DMMASK;
-        iter->base.Hsml = I->Hsml;
-        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
-        density_kernel_init(&iter->feedback_kernel, I->Hsml, GetDensityKernelType());
-        return;
-    }
-
-    int other = iter->base.other;
-    double r2 = iter->base.r2;
-
-    /* collect info for sigmaDM and Menc for kinetic feedback */
-    if(P[other].Type == 1 && r2 < iter->feedback_kernel.HH){
-        O->NumDM += 1;
-        MyFloat VelPred[3];
-        DM_VelPred(other, VelPred, BHVDISP_GET_PRIV(lv->tw)->kf);
-        int d;
-        for(d = 0; d < 3; d++){
-            double vel = VelPred[d] - I->Vel[d];
-            O->V1sumDM[d] += vel;
-            O->V2sumDM += vel * vel;
-        }
-    }
-}
-
-static void
-blackhole_veldisp_reduce(int place, TreeWalkResultBHVelDisp * remote, enum TreeWalkReduceMode mode, TreeWalk * tw)
-{
-    int k;
-
-    int PI = P[place].PI;
-    for (k = 0; k < 3; k++){
-        TREEWALK_REDUCE(BHVDISP_GET_PRIV(tw)->V1sumDM[PI][k], remote->V1sumDM[k]);
-    }
-    TREEWALK_REDUCE(BHVDISP_GET_PRIV(tw)->NumDM[PI], remote->NumDM);
-    TREEWALK_REDUCE(BHVDISP_GET_PRIV(tw)->V2sumDM[PI], remote->V2sumDM);
-}
-
-static void
-blackhole_veldisp_copy(int place, TreeWalkQueryBHVelDisp * I, TreeWalk * tw)
-{
-    int k;
-    for(k = 0; k < 3; k++)
-        I->Vel[k] = P[place].Vel[k];
-    I->Hsml = P[place].Hsml;
-}
-
-static void
-blackhole_veldisp(const ActiveParticles * act, Cosmology * CP, ForceTree * tree, struct kick_factor_data * kf)
-{
-    struct BHVelDispPriv priv[1] = {0};
-
-    TreeWalk tw_veldisp[1] = {{0}};
-    tw_veldisp->ev_label = "BH_VDISP";
-    tw_veldisp->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
-    tw_veldisp->ngbiter_type_elsize = sizeof(TreeWalkNgbIterBHVelDisp);
-    tw_veldisp->ngbiter = (TreeWalkNgbIterFunction) blackhole_veldisp_ngbiter;
-    tw_veldisp->haswork = blackhole_dynfric_haswork;
-    tw_veldisp->postprocess = (TreeWalkProcessFunction) blackhole_veldisp_postprocess;
-    tw_veldisp->fill = (TreeWalkFillQueryFunction) blackhole_veldisp_copy;
-    tw_veldisp->reduce = (TreeWalkReduceResultFunction) blackhole_veldisp_reduce;
-    tw_veldisp->query_type_elsize = sizeof(TreeWalkQueryBHVelDisp);
-    tw_veldisp->result_type_elsize = sizeof(TreeWalkResultBHVelDisp);
-    tw_veldisp->tree = tree;
-    tw_veldisp->priv = priv;
-
-    /* This treewalk uses only DM */
-    if(!tree->tree_allocated_flag)
-        endrun(0, "DM Tree not allocated for veldisp\n");
-
-    /* For AGN kinetic feedback */
-    priv->NumDM = (MyFloat *) mymalloc("NumDM", SlotsManager->info[5].size * sizeof(MyFloat));
-    priv->V2sumDM = (MyFloat *) mymalloc("V2sumDM", SlotsManager->info[5].size * sizeof(MyFloat));
-    priv->V1sumDM = (MyFloat (*) [3]) mymalloc("V1sumDM", 3* SlotsManager->info[5].size * sizeof(priv->V1sumDM[0]));
-    priv->kf = kf;
-
-    /* This allocates memory*/
-    treewalk_run(tw_veldisp, act->ActiveParticle, act->NumActiveParticle);
-
-    walltime_measure("/BH/VDisp");
-
-    myfree(priv->V1sumDM);
-    myfree(priv->V2sumDM);
-    myfree(priv->NumDM);
-}
-
-
 /* Code to compute velocity dispersions*/
 
 typedef struct {
@@ -369,11 +217,10 @@ winds_veldisp_haswork(int n, TreeWalk * tw)
 /* Find the 1D DM velocity dispersion of all gas particles by running a density loop.
  * Stores it in VDisp in the slots structure.*/
 void
-winds_find_vel_disp(const ActiveParticles * act, const double Time, const double hubble, Cosmology * CP, DriftKickTimes * times, DomainDecomp * ddecomp)
+winds_find_vel_disp(const ActiveParticles * act, const double Time, const double hubble, Cosmology * CP, DriftKickTimes * times, DomainDecomp * ddecomp, ForceTree * tree, const int DMTreeMask)
 {
     TreeWalk tw[1] = {0};
     struct WindVDispPriv priv[1] = {0};
-    ForceTree tree[1] = {0};
     /* Types used: gas*/
     tw->ev_label = "WIND_VDISP";
     tw->fill = (TreeWalkFillQueryFunction) wind_vdisp_copy;
@@ -400,28 +247,29 @@ winds_find_vel_disp(const ActiveParticles * act, const double Time, const double
 
     int * ActiveVDisp = tw->WorkSet;
     int64_t NumVDisp = tw->WorkSetSize;
-    int64_t totvdisp, totbh;
-    /* Check for black holes*/
-    MPI_Allreduce(&SlotsManager->info[5].size, &totbh, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-    /* If this queue is empty, nothing to do for winds.*/
-    MPI_Allreduce(&NumVDisp, &totvdisp, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
-
-    if(totvdisp > 0 || totbh > 0) {
-        force_tree_rebuild_mask(tree, ddecomp, DMMASK, NULL);
-        tw->haswork = NULL;
-        init_kick_factor_data(&priv->kf, times, CP);
-    }
-
-    /* Compute the black hole velocity dispersions if needed*/
-    if(totbh)
-        blackhole_veldisp(act, CP, tree, &priv->kf);
+    int64_t totvdisp;
+    /* If this queue is empty, nothing to do for winds.
+     * The black hole velocity dispersions are found in the black hole neighbour walk.*/
+    MPI_Allreduce(&NumVDisp, &totvdisp, 1, MPI_INT64, MPI_SUM, GadgetComm);
 
     if(totvdisp == 0) {
-        force_tree_free(tree);
         myfree(ActiveVDisp);
         return;
     }
 
+    /* Move the queue high, so the tree built after it can be kept for the rest of the step.*/
+    ActiveVDisp = (int *) mymalloc2("ActiveVDisp", DMAX(NumVDisp, 1) * sizeof(int));
+    memcpy(ActiveVDisp, tw->WorkSet, NumVDisp * sizeof(int));
+    myfree(tw->WorkSet);
+
+    /* Other walks on this step may add their types to the tree: the walk skips nodes without DM.*/
+    if(!force_tree_allocated(tree))
+        force_tree_rebuild_mask(tree, ddecomp, DMTreeMask | DMMASK, NULL);
+    else if(!(tree->mask & DMMASK))
+        endrun(5, "DM tree of the step has types %d, no DM\n", tree->mask);
+    tw->haswork = NULL;
+    init_kick_factor_data(&priv->kf, times, CP);
+
     priv->Left = (MyFloat *) mymalloc("VDISP->Left", SlotsManager->info[0].size * sizeof(MyFloat));
     priv->Right = (MyFloat *) mymalloc("VDISP->Right", SlotsManager->info[0].size * sizeof(MyFloat));
     priv->DMRadius = (MyFloat *) mymalloc("VDISP->DMRadius", SlotsManager->info[0].size * sizeof(MyFloat));
@@ -455,7 +303,6 @@ winds_find_vel_disp(const ActiveParticles * act, const double Time, const double
     myfree(priv->Right);
     myfree(priv->Left);
 
-    force_tree_free(tree);
     myfree(ActiveVDisp);
     walltime_measure("/Cooling/VDisp");
 
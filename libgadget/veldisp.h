@@ -6,10 +6,12 @@
 #include "timestep.h"
 #include "density.h"
 
-/* Find the 1D DM velocity dispersion of all nearly star-forming gas and black hole particles.
- * Gas is done by running a density loop for find Vdisp of nearest 40 DM particles.
- * BH is done by finding VDisp of all DM particles inside the SPH kernel.
- * Stores it in VDisp in the slots structure.*/
-void winds_find_vel_disp(const ActiveParticles * act, const double Time, const double hubble, Cosmology * CP, DriftKickTimes * times, DomainDecomp * ddecomp);
+/* Find the 1D DM velocity dispersion of all nearly star-forming gas particles.
+ * This is done by running a density loop for find Vdisp of nearest 40 DM particles.
+ * Black holes find VDisp of all DM particles inside the SPH kernel in blackhole_dynfric.
+ * Stores it in VDisp in the slots structure.
+ * DMTree is the DM tree of this step: if it is not allocated and there is gas to do,
+ * it is built with the types in DMTreeMask, which must include DM, and left for the caller to free.*/
+void winds_find_vel_disp(const ActiveParticles * act, const double Time, const double hubble, Cosmology * CP, DriftKickTimes * times, DomainDecomp * ddecomp, ForceTree * DMTree, const int DMTreeMask);
 
 #endif
@@ -1,16 +1,49 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <mpi.h>
+#include <omp.h>
 #include <string.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include "walltime.h"
 
 #include "utils.h"
+#include "utils/mpsort.h"
 
 static struct ClockTable * CT = NULL;
 
 static double WallTimeClock;
 static double LastReportTime;
 
+/* Busy time of each thread in each clock: NThreadTime rows of CT->Nmax*/
+static double * ThreadTime;
+static int NThreadTime;
+
+/* perf_event group leader of each thread, or NULL if counters are off*/
+static int * CounterFd;
+static double LastCounters[WALLTIME_NCOUNTER];
+
+/* Timeline of regions for the trace, allocated only while tracing*/
+struct TraceEvent {
+    double begin;
+    double end;
+    int tid;
+    char name[60];
+};
+static struct {
+    struct TraceEvent * events;
+    int64_t N;
+    int64_t Nmax;
+    int64_t Ndropped;
+    int nsteps;
+    double t0;
+    char fname[512];
+} Trace;
+
 static void walltime_clock_insert(const char * name);
 static void walltime_summary_clocks(struct Clock * C, int N, int root, MPI_Comm comm);
 static void walltime_update_parents(void);
@@ -21,31 +54,137 @@ void walltime_init(struct ClockTable * ct) {
     CT->Nmax = 512;
     CT->N = 0;
     CT->ElapsedTime = 0;
+    if(!ThreadTime) {
+        /* The counters may have been opened first, for this many threads*/
+        if(!CounterFd)
+            NThreadTime = omp_get_max_threads();
+        ThreadTime = (double *) malloc(sizeof(double) * NThreadTime * CT->Nmax);
+    }
+    memset(ThreadTime, 0, sizeof(double) * NThreadTime * CT->Nmax);
     walltime_reset();
     walltime_clock_insert("/");
     LastReportTime = seconds();
 }
 
+#ifdef __linux__
+static int
+open_counter(const uint64_t config, const int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    /* pid 0, cpu -1: the calling thread on any cpu*/
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/* Sum of the counters over all threads*/
+static void
+read_counters(double * counters)
+{
+    int t, k;
+    for(k = 0; k < WALLTIME_NCOUNTER; k++)
+        counters[k] = 0;
+#ifdef __linux__
+    for(t = 0; t < NThreadTime; t++) {
+        uint64_t values[WALLTIME_NCOUNTER + 1];
+        if(read(CounterFd[t], values, sizeof(values)) != sizeof(values))
+            continue;
+        for(k = 0; k < WALLTIME_NCOUNTER; k++)
+            counters[k] += values[k + 1];
+    }
+#endif
+}
+
+int walltime_enable_counters(void) {
+    if(CounterFd)
+        return 1;
+    if(!ThreadTime)
+        NThreadTime = omp_get_max_threads();
+    int * fds = (int *) malloc(sizeof(int) * NThreadTime * WALLTIME_NCOUNTER);
+    int failed = 0;
+#ifdef __linux__
+    const uint64_t config[WALLTIME_NCOUNTER] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    /* Each thread counts itself, so open the counters from each thread*/
+    #pragma omp parallel num_threads(NThreadTime) reduction(+: failed)
+    {
+        const int tid = omp_get_thread_num();
+        int k;
+        fds[tid * WALLTIME_NCOUNTER] = open_counter(config[0], -1);
+        for(k = 1; k < WALLTIME_NCOUNTER; k++)
+            fds[tid * WALLTIME_NCOUNTER + k] = open_counter(config[k], fds[tid * WALLTIME_NCOUNTER]);
+        for(k = 0; k < WALLTIME_NCOUNTER; k++)
+            if(fds[tid * WALLTIME_NCOUNTER + k] < 0)
+                failed++;
+    }
+    if(failed) {
+        int i;
+        for(i = 0; i < NThreadTime * WALLTIME_NCOUNTER; i++)
+            if(fds[i] >= 0)
+                close(fds[i]);
+    }
+#else
+    failed = 1;
+#endif
+    if(failed) {
+        free(fds);
+        message(0, "Hardware counters are not available (perf_event_open failed). Check /proc/sys/kernel/perf_event_paranoid.\n");
+        return 0;
+    }
+    CounterFd = (int *) malloc(sizeof(int) * NThreadTime);
+    int t;
+    for(t = 0; t < NThreadTime; t++)
+        CounterFd[t] = fds[t * WALLTIME_NCOUNTER];
+    free(fds);
+    read_counters(LastCounters);
+    return 1;
+}
+
 static void walltime_summary_clocks(struct Clock * C, int N, int root, MPI_Comm comm) {
-    double * t = ta_malloc("clocks", double, 4 * N);
+    double * t = ta_malloc("clocks", double, (7 + WALLTIME_NCOUNTER) * N);
     double * min = t + N;
     double * max = t + 2 * N;
     double * sum = t + 3 * N;
-    int i;
+    double * tmax = t + 4 * N;
+    double * tsum = t + 5 * N;
+    double * cnt = t + 6 * N;
+    double * cntsum = t + (6 + WALLTIME_NCOUNTER) * N;
+    int i, k;
     for(i = 0; i < CT->N; i ++) {
-        t[i] = C[i].time;
+        const struct Clock * c = &C[CT->Order[i]];
+        t[i] = c->time;
+        tmax[i] = c->thread_max;
+        tsum[i] = c->thread_mean;
+        for(k = 0; k < WALLTIME_NCOUNTER; k++)
+            cnt[k * N + i] = c->counters[k];
     }
     MPI_Reduce(t, min, N, MPI_DOUBLE, MPI_MIN, root, comm);
     MPI_Reduce(t, max, N, MPI_DOUBLE, MPI_MAX, root, comm);
     MPI_Reduce(t, sum, N, MPI_DOUBLE, MPI_SUM, root, comm);
+    /* t is free now: reuse it as the receive buffer*/
+    MPI_Reduce(tmax, t, N, MPI_DOUBLE, MPI_MAX, root, comm);
+    memcpy(tmax, t, sizeof(double) * N);
+    MPI_Reduce(tsum, t, N, MPI_DOUBLE, MPI_SUM, root, comm);
+    memcpy(tsum, t, sizeof(double) * N);
+    MPI_Reduce(cnt, cntsum, WALLTIME_NCOUNTER * N, MPI_DOUBLE, MPI_SUM, root, comm);
 
     int NTask;
     MPI_Comm_size(comm, &NTask);
     /* min, max and mean are good only on process 0 */
     for(i = 0; i < CT->N; i ++) {
-        C[i].min = min[i];
-        C[i].max = max[i];
-        C[i].mean = sum[i] / NTask;
+        struct Clock * c = &C[CT->Order[i]];
+        c->min = min[i];
+        c->max = max[i];
+        c->mean = sum[i] / NTask;
+        c->thread_max = tmax[i];
+        c->thread_mean = tsum[i] / NTask;
+        for(k = 0; k < WALLTIME_NCOUNTER; k++)
+            c->counters[k] = cntsum[k * N + i];
     }
     ta_free(t);
 }
@@ -54,10 +193,27 @@ static void walltime_summary_clocks(struct Clock * C, int N, int root, MPI_Comm
 /* AC will have the total timing, C will have the current step information */
 void walltime_summary(int root, MPI_Comm comm) {
     walltime_update_parents();
-    int i;
+    int i, k, t;
+    /* Per-thread times of this step*/
+    for(i = 0; i < CT->N; i ++) {
+        double tmax = 0, tsum = 0;
+        for(t = 0; t < NThreadTime; t++) {
+            const double tt = ThreadTime[t * CT->Nmax + i];
+            if(tt > tmax)
+                tmax = tt;
+            tsum += tt;
+        }
+        CT->C[i].thread_max = tmax;
+        CT->C[i].thread_mean = tsum / NThreadTime;
+    }
+    memset(ThreadTime, 0, sizeof(double) * NThreadTime * CT->Nmax);
     /* add to the cumulative time */
     for(i = 0; i < CT->N; i ++) {
         CT->AC[i].time += CT->C[i].time;
+        CT->AC[i].thread_max += CT->C[i].thread_max;
+        CT->AC[i].thread_mean += CT->C[i].thread_mean;
+        for(k = 0; k < WALLTIME_NCOUNTER; k++)
+            CT->AC[i].counters[k] += CT->C[i].counters[k];
     }
     walltime_summary_clocks(CT->C, CT->N, root, comm);
     walltime_summary_clocks(CT->AC, CT->N, root, comm);
@@ -65,6 +221,8 @@ void walltime_summary(int root, MPI_Comm comm) {
     /* clear .time for next step */
     for(i = 0; i < CT->N; i ++) {
         CT->C[i].time = 0;
+        for(k = 0; k < WALLTIME_NCOUNTER; k++)
+            CT->C[i].counters[k] = 0;
     }
     MPI_Barrier(comm);
     /* wo do this here because all processes are sync after summary_clocks*/
@@ -74,10 +232,22 @@ void walltime_summary(int root, MPI_Comm comm) {
     CT->StepTime = step_all;
 }
 
-static int clockcmp(const void * c1, const void * c2) {
-    const struct Clock * p1 = (const struct Clock *) c1;
-    const struct Clock * p2 = (const struct Clock *) c2;
-    return strcmp(p1->name, p2->name);
+/* Binary search of the clocks by name. Returns the position in Order, or -(insertion point) - 1.*/
+static int
+walltime_find(const char * name)
+{
+    int lo = 0, hi = CT->N;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strncmp(CT->C[CT->Order[mid]].name, name, sizeof(CT->C[0].name) - 1);
+        if(c == 0)
+            return mid;
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -lo - 1;
 }
 
 static void walltime_clock_insert(const char * name) {
@@ -99,26 +269,30 @@ static void walltime_clock_insert(const char * name) {
         abort();
     }
     const int nmsz = sizeof(CT->C[CT->N].name);
+    memset(&CT->C[CT->N], 0, sizeof(CT->C[CT->N]));
+    memset(&CT->AC[CT->N], 0, sizeof(CT->AC[CT->N]));
     strncpy(CT->C[CT->N].name, name, nmsz);
     CT->C[CT->N].name[nmsz-1] = '\0';
     strncpy(CT->AC[CT->N].name, CT->C[CT->N].name, nmsz);
     CT->AC[CT->N].name[nmsz-1] = '\0';
+    /* Keep Order sorted by name*/
+    int pos = -walltime_find(CT->C[CT->N].name) - 1;
+    memmove(&CT->Order[pos + 1], &CT->Order[pos], sizeof(int) * (CT->N - pos));
+    CT->Order[pos] = CT->N;
     CT->N ++;
-    qsort_openmp(CT->C, CT->N, sizeof(struct Clock), clockcmp);
-    qsort_openmp(CT->AC, CT->N, sizeof(struct Clock), clockcmp);
 }
 
 int walltime_clock(const char * name) {
-    struct Clock dummy;
-    strncpy(dummy.name, name, sizeof(dummy.name));
-    dummy.name[sizeof(dummy.name)-1]='\0';
-
-    struct Clock * rt = (struct Clock *) bsearch(&dummy, CT->C, CT->N, sizeof(struct Clock), clockcmp);
-    if(rt == NULL) {
-        walltime_clock_insert(name);
-        rt = (struct Clock *) bsearch(&dummy, CT->C, CT->N, sizeof(struct Clock), clockcmp);
+    char tmp[sizeof(CT->C[0].name)];
+    strncpy(tmp, name, sizeof(tmp));
+    tmp[sizeof(tmp)-1]='\0';
+
+    int pos = walltime_find(tmp);
+    if(pos < 0) {
+        walltime_clock_insert(tmp);
+        pos = walltime_find(tmp);
     }
-    return rt - CT->C;
+    return CT->Order[pos];
 };
 
 char walltime_get_symbol(const char * name) {
@@ -154,41 +328,188 @@ static void walltime_update_parents() {
     /* returns the sum of every clock with the same prefix */
     int i = 0;
     for(i = 0; i < CT->N; i ++) {
-        CT->Nchildren[i] = 0;
-        int j;
-        char * prefix = CT->C[i].name;
+        struct Clock * parent = &CT->C[CT->Order[i]];
+        CT->Nchildren[CT->Order[i]] = 0;
+        int j, k;
+        char * prefix = parent->name;
         int l = strlen(prefix);
         double t = 0;
+        double cnt[WALLTIME_NCOUNTER] = {0};
         for(j = i + 1; j < CT->N; j++) {
-            if(0 == strncmp(prefix, CT->C[j].name, l)) {
-                t += CT->C[j].time;
-                CT->Nchildren[i] ++;
+            const struct Clock * child = &CT->C[CT->Order[j]];
+            if(0 == strncmp(prefix, child->name, l)) {
+                t += child->time;
+                for(k = 0; k < WALLTIME_NCOUNTER; k++)
+                    cnt[k] += child->counters[k];
+                CT->Nchildren[CT->Order[i]] ++;
             } else {
                 break;
             }
         }
         /* update only if there are children */
-        if (t > 0) CT->C[i].time = t;
+        if (t > 0) {
+            parent->time = t;
+            for(k = 0; k < WALLTIME_NCOUNTER; k++)
+                parent->counters[k] = cnt[k];
+        }
     }
 }
 
 void walltime_reset() {
     WallTimeClock = seconds();
+    if(CounterFd)
+        read_counters(LastCounters);
 }
 
-double walltime_add_internal(const char * name, const double dt) {
-    int id = walltime_clock(name);
+/* Charge the counters since the last measurement to a clock*/
+static void
+walltime_add_counters(const int id)
+{
+    double now[WALLTIME_NCOUNTER];
+    int k;
+    read_counters(now);
+    for(k = 0; k < WALLTIME_NCOUNTER; k++) {
+        CT->C[id].counters[k] += now[k] - LastCounters[k];
+        LastCounters[k] = now[k];
+    }
+}
+
+void walltime_trace_start(const char * fname, const int nsteps) {
+    if(Trace.events)
+        return;
+    Trace.Nmax = 1 << 18;
+    Trace.events = (struct TraceEvent *) malloc(sizeof(struct TraceEvent) * Trace.Nmax);
+    Trace.N = 0;
+    Trace.Ndropped = 0;
+    Trace.nsteps = nsteps > 0 ? nsteps : 1;
+    strncpy(Trace.fname, fname, sizeof(Trace.fname) - 1);
+    Trace.fname[sizeof(Trace.fname) - 1] = '\0';
+    /* Timestamps are relative to a common start, so that ranks line up*/
+    MPI_Barrier(GadgetComm);
+    Trace.t0 = seconds();
+    message(0, "Tracing %d steps to %s\n", Trace.nsteps, Trace.fname);
+}
+
+void walltime_trace_event(const char * name, const double begin, const double end) {
+    if(!Trace.events)
+        return;
+    int64_t n;
+    #pragma omp atomic capture
+    n = Trace.N++;
+    if(n >= Trace.Nmax) {
+        #pragma omp atomic
+        Trace.Ndropped++;
+        return;
+    }
+    struct TraceEvent * ev = &Trace.events[n];
+    ev->begin = begin;
+    ev->end = end;
+    /* Thread 0 is the rank: regions measured outside parallel sections*/
+    ev->tid = omp_in_parallel() ? omp_get_thread_num() + 1 : 0;
+    strncpy(ev->name, name, sizeof(ev->name) - 1);
+    ev->name[sizeof(ev->name) - 1] = '\0';
+}
+
+/* Each rank formats its own events, and they are written at consecutive offsets of one file.*/
+static void
+walltime_trace_write(void)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(GadgetComm, &ThisTask);
+    MPI_Comm_size(GadgetComm, &NTask);
+    const int64_t N = Trace.N < Trace.Nmax ? Trace.N : Trace.Nmax;
+    const size_t maxsize = (N + 2) * (sizeof(Trace.events[0].name) + 128);
+    char * buf = (char *) malloc(maxsize);
+    size_t len = 0;
+    /* Only the first rank opens the array, and only the last closes it*/
+    len += snprintf(buf + len, maxsize - len, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"Rank %d\"}}",
+            ThisTask == 0 ? "[\n" : ",\n", ThisTask, ThisTask);
+    int64_t i;
+    for(i = 0; i < N; i++) {
+        const struct TraceEvent * ev = &Trace.events[i];
+        /* The first region may have begun before the trace*/
+        const double begin = ev->begin > Trace.t0 ? ev->begin : Trace.t0;
+        len += snprintf(buf + len, maxsize - len, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                ev->name, ThisTask, ev->tid, (begin - Trace.t0) * 1e6, (ev->end - begin) * 1e6);
+    }
+    if(ThisTask == NTask - 1)
+        len += snprintf(buf + len, maxsize - len, "\n]\n");
+
+    int64_t mylen = len, offset = 0;
+    MPI_Exscan(&mylen, &offset, 1, MPI_INT64_T, MPI_SUM, GadgetComm);
+    if(ThisTask == 0)
+        offset = 0;
+    MPI_File fh;
+    if(MPI_SUCCESS != MPI_File_open(GadgetComm, Trace.fname, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh)) {
+        message(0, "Could not open trace file %s\n", Trace.fname);
+    }
+    else {
+        MPI_File_set_size(fh, 0);
+        MPI_File_write_at_all(fh, offset, buf, len, MPI_BYTE, MPI_STATUS_IGNORE);
+        MPI_File_close(&fh);
+    }
+    free(buf);
+
+    int64_t Ndropped = Trace.Ndropped;
+    MPI_Allreduce(MPI_IN_PLACE, &Ndropped, 1, MPI_INT64_T, MPI_SUM, GadgetComm);
+    if(Ndropped > 0)
+        message(0, "Trace buffer was full: %ld regions were not recorded.\n", Ndropped);
+    message(0, "Wrote trace to %s\n", Trace.fname);
+}
+
+void walltime_trace_finish(void) {
+    if(!Trace.events)
+        return;
+    walltime_trace_write();
+    free(Trace.events);
+    Trace.events = NULL;
+}
+
+void walltime_trace_step(void) {
+    if(!Trace.events)
+        return;
+    if(--Trace.nsteps > 0)
+        return;
+    walltime_trace_finish();
+}
+
+double walltime_add_id(const int id, const double dt) {
     CT->C[id].time += dt;
     return dt;
 }
-double walltime_measure_internal(const char * name) {
+
+double walltime_measure_id(const int id) {
     double t = seconds();
     double dt = t - WallTimeClock;
+    walltime_trace_event(CT->C[id].name, WallTimeClock, t);
     WallTimeClock = seconds();
-    if(name[0] != '.') {
-        int id = walltime_clock(name);
-        CT->C[id].time += dt;
+    CT->C[id].time += dt;
+    if(CounterFd)
+        walltime_add_counters(id);
+    return dt;
+}
+
+void walltime_thread_add(const int id, const double dt) {
+    const int tid = omp_get_thread_num();
+    if(tid < NThreadTime)
+        ThreadTime[tid * CT->Nmax + id] += dt;
+    if(Trace.events) {
+        const double now = seconds();
+        walltime_trace_event(CT->C[id].name, now - dt, now);
     }
+}
+
+double walltime_add_internal(const char * name, const double dt) {
+    return walltime_add_id(walltime_clock(name), dt);
+}
+double walltime_measure_internal(const char * name) {
+    if(name[0] != '.')
+        return walltime_measure_id(walltime_clock(name));
+    double t = seconds();
+    double dt = t - WallTimeClock;
+    WallTimeClock = seconds();
+    if(CounterFd)
+        read_counters(LastCounters);
     return dt;
 }
 double walltime_measure_full(const char * name, const char * file, const int line) {
@@ -209,6 +530,29 @@ double walltime_add_full(const char * name, const double dt, const char * file,
 
 }
 
+/* Measure the time since the last measurement, splitting it between the phases of
+ * the last parallel sort as children of the named clock. The rest goes to name/Other.*/
+double walltime_measure_mpsort_full(const char * name, const char * file, const int line) {
+    char fullname[128] = {0};
+    double dt = walltime_measure_internal(WALLTIME_IGNORE);
+    const double now = seconds();
+    walltime_trace_event(name, now - dt, now);
+    double rest = dt;
+    int i;
+    for(i = 0; i < MPSORT_NPHASE; i ++) {
+        const char * phase;
+        double t = mpsort_mpi_last_run_time(i, &phase);
+        if(t > rest)
+            t = rest;
+        rest -= t;
+        snprintf(fullname, 128, "%s/%s", name, phase);
+        walltime_add_full(fullname, t, file, line);
+    }
+    snprintf(fullname, 128, "%s/Other", name);
+    walltime_add_full(fullname, rest, file, line);
+    return dt;
+}
+
 /* returns the number of cpu-ticks in seconds that
  * have elapsed. (or the wall-clock time)
  */
@@ -222,7 +566,8 @@ void walltime_report(FILE * fp, int root, MPI_Comm comm) {
     if(rank != root) return;
     int i;
     for(i = 0; i < CT->N; i ++) {
-        char * name = CT->C[i].name;
+        const int id = CT->Order[i];
+        char * name = CT->C[id].name;
         int level = 0;
         char * p = name;
         while(*p) {
@@ -233,17 +578,25 @@ void walltime_report(FILE * fp, int root, MPI_Comm comm) {
             p++;
         }
         /* if there is just one child, don't print it*/
-        if(CT->Nchildren[i] == 1) continue;
-        fprintf(fp, "%*s%-26s  %10.2f %4.1f%%  %10.2f %4.1f%%  %10.2f %10.2f\n",
+        if(CT->Nchildren[id] == 1) continue;
+        fprintf(fp, "%*s%-26s  %10.2f %4.1f%%  %10.2f %4.1f%%  %10.2f %10.2f",
                 level, "",  /* indents */
                 name,   /* just the last seg of name*/
-                CT->AC[i].mean,
-                CT->AC[i].mean / CT->ElapsedTime * 100.,
-                CT->C[i].mean,
-                CT->C[i].mean / CT->StepTime * 100.,
-                CT->C[i].min,
-                CT->C[i].max
+                CT->AC[id].mean,
+                CT->AC[id].mean / CT->ElapsedTime * 100.,
+                CT->C[id].mean,
+                CT->C[id].mean / CT->StepTime * 100.,
+                CT->C[id].min,
+                CT->C[id].max
                 );
+        /* Thread imbalance: max / mean busy time over threads*/
+        if(CT->C[id].thread_mean > 0)
+            fprintf(fp, "  imb %5.2f", CT->C[id].thread_max / CT->C[id].thread_mean);
+        /* Instructions per cycle and last level cache misses per thousand instructions*/
+        if(CounterFd && CT->C[id].counters[0] > 0 && CT->C[id].counters[1] > 0)
+            fprintf(fp, "  ipc %5.2f  llcmpki %6.2f", CT->C[id].counters[1] / CT->C[id].counters[0],
+                    1000 * CT->C[id].counters[2] / CT->C[id].counters[1]);
+        fprintf(fp, "\n");
     }
 }
 #if 0
@@ -1,16 +1,38 @@
 #ifndef GADGET_WALLTIME_H
 #define GADGET_WALLTIME_H
 
+/* Returns the id of a named clock, creating it if needed. Ids are stable until
+ * walltime_init, so clocks measured often can be looked up once.
+ * Not thread safe: call outside parallel regions.*/
 int walltime_clock(const char * name);
 void walltime_reset(void);
+double walltime_measure_id(const int id);
+double walltime_add_id(const int id, const double dt);
+/* Adds the busy time of the calling thread inside a parallel region to a clock.
+ * The report shows the imbalance, max / mean over threads, of this time.*/
+void walltime_thread_add(const int id, const double dt);
+/* Count cycles, instructions and last level cache misses of every thread with perf_event,
+ * and report them per clock. Returns 0 if the counters are not available.*/
+int walltime_enable_counters(void);
+/* Record a timeline of every measured region and thread for the next nsteps steps,
+ * written as Chrome trace JSON (chrome://tracing, Perfetto) to fname. Collective.*/
+void walltime_trace_start(const char * fname, const int nsteps);
+/* Call once at the end of each step. Writes the trace after the last traced step. Collective.*/
+void walltime_trace_step(void);
+/* Writes the trace now, if one is being recorded. Collective.*/
+void walltime_trace_finish(void);
+/* Add a region between two MPI_Wtime values to the timeline, if tracing. Thread safe.*/
+void walltime_trace_event(const char * name, const double begin, const double end);
 #define WALLTIME_IGNORE "."
 #define LINENO(a, b) a ":" # b
 #define walltime_measure(name) walltime_measure_full(name, __FILE__ , __LINE__)
 #define walltime_add(name, dt) walltime_add_full(name, dt,  __FILE__, __LINE__)
+#define walltime_measure_mpsort(name) walltime_measure_mpsort_full(name, __FILE__ , __LINE__)
 double walltime_measure_internal(const char * name);
 double walltime_add_internal(const char * name, const double dt);
 double walltime_measure_full(const char * name, const char * file, const int line);
 double walltime_add_full(const char * name, const double dt, const char * file, const int line);
+double walltime_measure_mpsort_full(const char * name, const char * file, const int line);
 
 enum clocktype {
     CLOCK_STEP_MEAN ,
@@ -36,12 +58,19 @@ double walltime_get(const char * name, const enum clocktype type);
 void walltime_summary(const int root, MPI_Comm comm);
 void walltime_report(FILE * fd, const int root, MPI_Comm comm);
 
+#define WALLTIME_NCOUNTER 3
+
 struct Clock {
     char name[128];
     double time;
     double max;
     double min;
     double mean;
+    /* Maximum and mean over threads of the per-thread time*/
+    double thread_max;
+    double thread_mean;
+    /* Cycles, instructions and cache misses, summed over ranks*/
+    double counters[WALLTIME_NCOUNTER];
     char symbol;
 };
 
@@ -50,6 +79,8 @@ struct ClockTable {
     int N;
     struct Clock C[512];
     struct Clock AC[512];
+    /* Clocks are stored in creation order: this is the order by name*/
+    int Order[512];
     int Nchildren[512];
     double ElapsedTime;
     double StepTime;
@@ -62,7 +62,7 @@ typedef struct {
 void set_winds_params(ParameterSet * ps)
 {
     int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_rank(GadgetComm, &ThisTask);
     if(ThisTask == 0) {
         /*Wind model parameters*/
         wind_params.WindModel = (enum WindModel) param_get_enum(ps, "WindModel");
@@ -80,7 +80,7 @@ void set_winds_params(ParameterSet * ps)
         wind_params.WindFreeTravelLength = param_get_double(ps, "WindFreeTravelLength");
         wind_params.WindFreeTravelDensFac = param_get_double(ps, "WindFreeTravelDensFac");
     }
-    MPI_Bcast(&wind_params, sizeof(struct WindParams), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&wind_params, sizeof(struct WindParams), MPI_BYTE, 0, GadgetComm);
 }
 
 void
@@ -193,6 +193,8 @@ struct WindPriv {
     double * TotalWeight;
     struct StarKick * kicks;
     int64_t nkicks;
+    /* Index in kicks of the kick used for each gas particle, indexed by PI. -1 if not kicked.*/
+    int64_t * BestKick;
     double Time;
     int64_t maxkicks;
     int * nvisited;
@@ -202,25 +204,15 @@ struct WindPriv {
     RandTable * rnd;
 };
 
-/* Comparison function to sort the StarKicks by particle id, distance and star ID.
- * The closest star is used. */
-int cmp_by_part_id(const void * a, const void * b)
+/* True if stara should be used over starb to kick the same particle.
+ * The closest star is used, with ties broken by star ID,
+ * so the choice does not depend on the order the kicks were found. */
+static int
+kick_is_better(const struct StarKick * stara, const struct StarKick * starb)
 {
-    const struct StarKick * stara = (const struct StarKick * ) a;
-    const struct StarKick * starb = (const struct StarKick *) b;
-    if(stara->part_index > starb->part_index)
-        return 1;
-    if(stara->part_index < starb->part_index)
-        return -1;
-    if(stara->StarDistance > starb->StarDistance)
-        return 1;
-    if(stara->StarDistance < starb->StarDistance)
-        return -1;
-    if(stara->StarID > starb->StarID)
-        return 1;
-    if(stara->StarID < starb->StarID)
-        return -1;
-    return 0;
+    if(stara->StarDistance != starb->StarDistance)
+        return stara->StarDistance < starb->StarDistance;
+    return stara->StarID < starb->StarID;
 }
 
 #define WIND_GET_PRIV(tw) ((struct WindPriv *) (tw->priv))
@@ -245,6 +237,8 @@ winds_find_weights(TreeWalk * tw, struct WindPriv * priv, int * NewStars, const
     tw->query_type_elsize = sizeof(TreeWalkQueryWind);
     tw->result_type_elsize = sizeof(TreeWalkResultWind);
     tw->tree = tree;
+    tw->UseExportPlan = 1;
+    tw->UseNgbCache = 1;
 
     /* sum the total weight of surrounding gas */
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterWind);
@@ -279,7 +273,7 @@ winds_subgrid(int * MaybeWind, int NumMaybeWind, const double Time, MyFloat * St
     if(!HAS(wind_params.WindModel, WIND_SUBGRID))
         return;
 
-    if(!MPIU_Any(NumMaybeWind > 0, MPI_COMM_WORLD))
+    if(!MPIU_Any(NumMaybeWind > 0, GadgetComm))
         return;
 
     int n;
@@ -302,7 +296,7 @@ winds_and_feedback(int * NewStars, const int64_t NumNewStars, const double Time,
     if(HAS(wind_params.WindModel, WIND_SUBGRID))
         return;
 
-    if(!MPIU_Any(NumNewStars > 0, MPI_COMM_WORLD))
+    if(!MPIU_Any(NumNewStars > 0, GadgetComm))
         return;
 
     TreeWalk tw[1] = {{0}};
@@ -320,8 +314,11 @@ winds_and_feedback(int * NewStars, const int64_t NumNewStars, const double Time,
     * which the loops are executed, particles are kicked by the nearest new star.
     * This struct stores all such possible kicks, and we sort it out after the treewalk.*/
     priv->kicks = (struct StarKick * ) mymalloc("StarKicks", (priv->maxkicks+1) * sizeof(struct StarKick));
-    priv->kicks[0].StarKickVelocity = 0;
     priv->nkicks = 0;
+    priv->BestKick = (int64_t *) mymalloc("BestKick", SlotsManager->info[0].size * sizeof(int64_t));
+    #pragma omp parallel for
+    for(i = 0; i < SlotsManager->info[0].size; i++)
+        priv->BestKick[i] = -1;
     priv->rnd = rnd;
     ta_free(priv->nvisited);
 
@@ -334,35 +331,36 @@ winds_and_feedback(int * NewStars, const int64_t NumNewStars, const double Time,
 
     treewalk_run(tw, NewStars, NumNewStars);
 
-    /* Sort the possible kicks*/
-    qsort_openmp(priv->kicks, priv->nkicks, sizeof(struct StarKick), cmp_by_part_id);
-    /* Not parallel as the number of kicked particles should be pretty small*/
-    int64_t last_part = -1;
+    /* Each particle is kicked once, by the kick chosen during the treewalk*/
     int64_t nkicked = 0;
-    for(i = 0; i < priv->nkicks; i++) {
-        /* Only do the kick for the first particle, which is the closest*/
-        if(priv->kicks[i].part_index == last_part)
+    double maxkickvel = 0;
+    int64_t k;
+    #pragma omp parallel for reduction(+: nkicked) reduction(max: maxkickvel)
+    for(k = 0; k < priv->nkicks; k++) {
+        const int other = priv->kicks[k].part_index;
+        if(priv->BestKick[P[other].PI] != k)
             continue;
-        int other = priv->kicks[i].part_index;
-        last_part = other;
         nkicked++;
-        wind_do_kick(other, priv->kicks[i].StarKickVelocity, priv->kicks[i].StarTherm, Time, rnd);
-        if(priv->kicks[i].StarKickVelocity <= 0 || !isfinite(priv->kicks[i].StarKickVelocity) || !isfinite(SPHP(other).DelayTime))
+        if(priv->kicks[k].StarKickVelocity > maxkickvel)
+            maxkickvel = priv->kicks[k].StarKickVelocity;
+        wind_do_kick(other, priv->kicks[k].StarKickVelocity, priv->kicks[k].StarTherm, Time, rnd);
+        if(priv->kicks[k].StarKickVelocity <= 0 || !isfinite(priv->kicks[k].StarKickVelocity) || !isfinite(SPHP(other).DelayTime))
         {
-            endrun(5, "Odd v: other = %d, DT = %g v = %g i = %d, nkicks %ld maxkicks %ld dist %g id %ld\n",
-                   other, SPHP(other).DelayTime, priv->kicks[i].StarKickVelocity, i, priv->nkicks, priv->maxkicks,
-                   priv->kicks[i].StarDistance, priv->kicks[i].StarID);
+            endrun(5, "Odd v: other = %d, DT = %g v = %g k = %ld, nkicks %ld maxkicks %ld dist %g id %ld\n",
+                   other, SPHP(other).DelayTime, priv->kicks[k].StarKickVelocity, k, priv->nkicks, priv->maxkicks,
+                   priv->kicks[k].StarDistance, priv->kicks[k].StarID);
         }
     }
     /* Get total number of potential new stars to allocate memory.*/
     int64_t tot_newstars, tot_kicks, tot_applied;
     double maxvel;
-    MPI_Reduce(&NumNewStars, &tot_newstars, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&priv->nkicks, &tot_kicks, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&nkicked, &tot_applied, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&priv->kicks[0].StarKickVelocity, &maxvel, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&NumNewStars, &tot_newstars, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&priv->nkicks, &tot_kicks, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&nkicked, &tot_applied, 1, MPI_INT64, MPI_SUM, 0, GadgetComm);
+    MPI_Reduce(&maxkickvel, &maxvel, 1, MPI_DOUBLE, MPI_MAX, 0, GadgetComm);
     message(0, "Made %ld gas wind, discarded %ld kicks from %ld stars. Vel %g\n", tot_applied, tot_kicks - tot_applied, tot_newstars, maxvel);
 
+    myfree(priv->BestKick);
     myfree(priv->kicks);
     myfree(priv->TotalWeight);
     if(priv->tree_alloc_in_wind)
@@ -480,8 +478,8 @@ get_wind_dir(int i, double dir[3], const RandTable * const rnd) {
     /* returns 0 if particle i is converted to wind. */
     // message(1, "%ld Making ID=%ld (%g %g %g) to wind with v= %g\n", ID, P[i].ID, P[i].Pos[0], P[i].Pos[1], P[i].Pos[2], v);
     /* ok, make the particle go into the wind */
-    double theta = acos(2 * get_random_number(P[i].ID + 3, rnd) - 1);
-    double phi = 2 * M_PI * get_random_number(P[i].ID + 4, rnd);
+    double theta = acos(2 * get_random_number(P[i].ID, RND_DIR_THETA, rnd) - 1);
+    double phi = 2 * M_PI * get_random_number(P[i].ID, RND_DIR_PHI, rnd);
 
     dir[0] = sin(theta) * cos(phi);
     dir[1] = sin(theta) * sin(phi);
@@ -547,7 +545,7 @@ sfr_wind_feedback_ngbiter(TreeWalkQueryWind * I,
     get_wind_params(&v, &windeff, &utherm, I->Vdisp, WIND_GET_PRIV(lv->tw)->Time);
 
     double p = windeff * I->Mass / I->TotalWeight;
-    double random = get_random_number(I->ID + P[other].ID, WIND_GET_PRIV(lv->tw)->rnd);
+    double random = get_random_number(I->ID + P[other].ID, RND_WIND_KICK, WIND_GET_PRIV(lv->tw)->rnd);
 
     if (random < p && v > 0) {
         /* Store a potential kick. This might not be the kick actually used,
@@ -565,6 +563,13 @@ sfr_wind_feedback_ngbiter(TreeWalkQueryWind * I,
         kick->StarKickVelocity = v;
         kick->StarTherm = utherm;
         kick->part_index = other;
+        /* Keep the best kick for this particle. The release makes the kick visible to threads comparing against it.*/
+        int64_t * best = &WIND_GET_PRIV(lv->tw)->BestKick[P[other].PI];
+        int64_t readbest = __atomic_load_n(best, __ATOMIC_ACQUIRE);
+        do {
+            if(readbest >= 0 && !kick_is_better(kick, &WIND_GET_PRIV(lv->tw)->kicks[readbest]))
+                break;
+        } while(!__atomic_compare_exchange_n(best, &readbest, ikick, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
     }
 }
 
@@ -582,7 +587,7 @@ winds_make_after_sf(int i, double sm, double vdisp, double atime, const RandTabl
     /* Notice that this is the mass of the gas particle after forking a star, Mass - Mass/GENERATIONS.*/
     double pw = windeff * sm / P[i].Mass;
     double prob = 1 - exp(-pw);
-    if(get_random_number(P[i].ID + 2, rnd) < prob) {
+    if(get_random_number(P[i].ID, RND_WIND_AFTER_SF, rnd) < prob) {
         wind_do_kick(i, vel, utherm, atime, rnd);
     }
     return 0;
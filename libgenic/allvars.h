@@ -14,21 +14,36 @@ struct ic_part_data
   float Mass;
 };
 
+/* Generator of the random phases and amplitudes of the initial gaussian field.*/
+enum GaussianRNG {
+    GAUSSIAN_RNG_NGENIC = 0, /* Serial seed table and per-row ranlxd1 streams, agreeing with N-GenIC and fastpm.*/
+    GAUSSIAN_RNG_PHILOX = 1, /* Counter based Philox keyed on the mode: parallel and independent of the decomposition.*/
+};
+
 struct genic_config {
     int Ngrid, NgridGas, NGridNu;
     int Nmesh;
+    /* Number of fields transformed back to real space together. See petapm_init_batch.*/
+    int PMBatchTransforms;
     double BoxSize;
     int ProduceGas;
     int Seed;
     int UnitaryAmplitude;
     int InvertPhase;
+    enum GaussianRNG GaussianRNG;
     int PrePosGridCenter;
     double Max_nuvel;
     double WDM_therm_mass;
     int MakeGlassGas;
     int MakeGlassCDM;
+    /* Fraction of the initial rms force at which the glass relaxation stops*/
+    double GlassTolerance;
+    /* Directory of reusable glasses, or empty*/
+    char GlassCacheDir[100];
     int NumFiles;
     int NumWriters;
+    /* Number of chunks in which the particles of each type are generated and written, to save memory.*/
+    int NumPartChunks;
     /* Whether to save the pre-displacement positions to the snapshot*/
     int SavePrePos;
     struct power_params PowerP;
@@ -37,6 +52,8 @@ struct genic_config {
     char InitCondFile[100];
     double TimeIC;
     int UsePeculiarVelocity;
+    /* Order of Lagrangian perturbation theory for the displacements: 1 (Zel'dovich) or 2*/
+    int LPTOrder;
 };
 
 #endif
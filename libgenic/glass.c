@@ -5,6 +5,7 @@
 #include <omp.h>
 
 #include <gsl/gsl_rng.h>
+#include <bigfile-mpi.h>
 
 #include "allvars.h"
 #include "proto.h"
@@ -35,11 +36,28 @@ static PetaPMGlobalFunctions global_functions = {measure_power_spectrum, NULL, p
 static PetaPMRegion * _prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, void * userdata, int * Nregions);
 
 static void glass_force(PetaPM * pm, double t_f, struct ic_part_data * ICP, const int NumPart);
-static void glass_stats(struct ic_part_data * ICP, int NumPart);
+static double glass_stats(struct ic_part_data * ICP, int NumPart);
+static int glass_cache_read(const char * fn, IDGenerator * idgen, PetaPM * pm, double shift, int seed, struct ic_part_data * ICP);
+static void glass_cache_write(const char * fn, IDGenerator * idgen, PetaPM * pm, double shift, int seed, struct ic_part_data * ICP);
 
 int
-setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP, const double UnitLength_in_cm, const char * OutputDir)
+setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP, const double UnitLength_in_cm, const char * OutputDir, const double GlassTolerance, const char * GlassCacheDir)
 {
+    char * cachefn = NULL;
+    if(GlassCacheDir && strlen(GlassCacheDir) > 0) {
+        cachefn = fastpm_strdup_printf("%s/glass-%d-%08X", GlassCacheDir, idgen->Ngrid, seed);
+        memset(ICP, 0, idgen->NumPart*sizeof(struct ic_part_data));
+        if(glass_cache_read(cachefn, idgen, pm, shift, seed, ICP)) {
+            int i;
+            #pragma omp parallel for
+            for(i = 0; i < idgen->NumPart; i ++)
+                ICP[i].Mass = mass;
+            message(0, "Read glass from %s\n", cachefn);
+            myfree(cachefn);
+            return idgen->NumPart;
+        }
+    }
+
     gsl_rng * rng = gsl_rng_alloc(gsl_rng_ranlxd1);
     int ThisTask;
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
@@ -64,13 +82,109 @@ setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mas
     gsl_rng_free(rng);
 
     char * fn = fastpm_strdup_printf("powerspectrum-glass-%08X", seed);
-    glass_evolve(pm, 14, fn, ICP, idgen->NumPart, UnitLength_in_cm, OutputDir);
+    glass_evolve(pm, 14, GlassTolerance, fn, ICP, idgen->NumPart, UnitLength_in_cm, OutputDir);
     myfree(fn);
 
+    if(cachefn) {
+        glass_cache_write(cachefn, idgen, pm, shift, seed, ICP);
+        myfree(cachefn);
+    }
     return idgen->NumPart;
 }
 
-void glass_evolve(PetaPM * pm, int nsteps, const char * pkoutname, struct ic_part_data * ICP, const int NumPart, const double UnitLength_in_cm, const char * OutputDir)
+/* The glass depends on the grid, the seed, the PM mesh and, through the per-rank random offsets
+ * and the decomposition, the number of ranks. These are stored with the cached positions,
+ * which are in units of the box so the glass can be reused for other box sizes.*/
+#define GLASS_CACHE_NATTR 4
+
+static void
+glass_cache_key(IDGenerator * idgen, PetaPM * pm, int seed, int key[GLASS_CACHE_NATTR])
+{
+    key[0] = idgen->Ngrid;
+    key[1] = seed;
+    key[2] = pm->Nmesh;
+    MPI_Comm_size(MPI_COMM_WORLD, &key[3]);
+}
+
+/* Returns 1 if a glass matching this setup was read into ICP.*/
+static int
+glass_cache_read(const char * fn, IDGenerator * idgen, PetaPM * pm, double shift, int seed, struct ic_part_data * ICP)
+{
+    BigFile bf;
+    BigBlock bb;
+    if(0 != big_file_mpi_open(&bf, fn, MPI_COMM_WORLD))
+        return 0;
+    if(0 != big_file_mpi_open_block(&bf, &bb, "Position", MPI_COMM_WORLD)) {
+        big_file_mpi_close(&bf, MPI_COMM_WORLD);
+        return 0;
+    }
+    int key[GLASS_CACHE_NATTR], stored[GLASS_CACHE_NATTR] = {0};
+    glass_cache_key(idgen, pm, seed, key);
+    int64_t TotNumPart = idgen->NumPart;
+    MPI_Allreduce(MPI_IN_PLACE, &TotNumPart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    int found = (0 == big_block_get_attr(&bb, "GlassKey", stored, "i4", GLASS_CACHE_NATTR))
+        && (0 == memcmp(key, stored, sizeof(key)))
+        && bb.size == TotNumPart;
+    if(found) {
+        BigArray array;
+        BigBlockPtr ptr;
+        size_t dims[2] = {idgen->NumPart, 3};
+        ptrdiff_t strides[2] = {sizeof(ICP[0]), sizeof(double)};
+        big_array_init(&array, &ICP[0].Pos[0], "f8", 2, dims, strides);
+        if(0 != big_block_seek(&bb, &ptr, 0) || 0 != big_block_mpi_read(&bb, &ptr, &array, 0, MPI_COMM_WORLD))
+            endrun(1, "Failed to read glass from %s: %s\n", fn, big_file_get_error_message());
+        int i;
+        #pragma omp parallel for
+        for(i = 0; i < idgen->NumPart; i ++) {
+            int k;
+            for(k = 0; k < 3; k++)
+                ICP[i].Pos[k] = ICP[i].Pos[k] * idgen->BoxSize + shift;
+        }
+    }
+    big_block_mpi_close(&bb, MPI_COMM_WORLD);
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    return found;
+}
+
+static void
+glass_cache_write(const char * fn, IDGenerator * idgen, PetaPM * pm, double shift, int seed, struct ic_part_data * ICP)
+{
+    BigFile bf;
+    BigBlock bb;
+    BigBlockPtr ptr;
+    if(0 != big_file_mpi_create(&bf, fn, MPI_COMM_WORLD)) {
+        message(0, "Could not create glass cache %s: %s\n", fn, big_file_get_error_message());
+        return;
+    }
+    int64_t TotNumPart = idgen->NumPart;
+    MPI_Allreduce(MPI_IN_PLACE, &TotNumPart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+
+    double * pos = (double *) mymalloc("GlassPos", 3 * idgen->NumPart * sizeof(double));
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < idgen->NumPart; i ++) {
+        int k;
+        for(k = 0; k < 3; k++)
+            pos[3*i+k] = (ICP[i].Pos[k] - shift) / idgen->BoxSize;
+    }
+    BigArray array;
+    size_t dims[2] = {idgen->NumPart, 3};
+    big_array_init(&array, pos, "f8", 2, dims, NULL);
+
+    int key[GLASS_CACHE_NATTR];
+    glass_cache_key(idgen, pm, seed, key);
+    if(0 != big_file_mpi_create_block(&bf, &bb, "Position", "f8", 3, 1, TotNumPart, MPI_COMM_WORLD)
+        || 0 != big_block_set_attr(&bb, "GlassKey", key, "i4", GLASS_CACHE_NATTR)
+        || 0 != big_block_seek(&bb, &ptr, 0)
+        || 0 != big_block_mpi_write(&bb, &ptr, &array, 0, MPI_COMM_WORLD)
+        || 0 != big_block_mpi_close(&bb, MPI_COMM_WORLD))
+        endrun(1, "Failed to write glass to %s: %s\n", fn, big_file_get_error_message());
+    myfree(pos);
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    message(0, "Saved glass to %s\n", fn);
+}
+
+void glass_evolve(PetaPM * pm, int nsteps, const double tolerance, const char * pkoutname, struct ic_part_data * ICP, const int NumPart, const double UnitLength_in_cm, const char * OutputDir)
 {
     int i;
     int step = 0;
@@ -82,6 +196,7 @@ void glass_evolve(PetaPM * pm, int nsteps, const char * pkoutname, struct ic_par
     powerspectrum_alloc(pm->ps, pm->Nmesh, omp_get_max_threads(), 0, pm->BoxSize*UnitLength_in_cm);
 
     glass_force(pm, t_x, ICP, NumPart);
+    const double force0 = glass_stats(ICP, NumPart);
 
     /* Our pick of the units ensures there is an oscillation period of 2 * M_PI.
      *
@@ -133,10 +248,16 @@ void glass_evolve(PetaPM * pm, int nsteps, const char * pkoutname, struct ic_par
 
         t_x += hdt;
         message(0, "Generating glass, step = %d, t_f= %g, t_v = %g, t_x = %g\n", step, t_f / (2 * M_PI), t_v / (2 *M_PI), t_x / (2 * M_PI));
-        glass_stats(ICP, NumPart);
+        const double force = glass_stats(ICP, NumPart);
 
         /*Now save the power spectrum*/
         powerspectrum_save(pm->ps, OutputDir, pkoutname, t_f, 1.0);
+
+        /*Stop once the residual force is small enough*/
+        if(force < tolerance * force0) {
+            message(0, "Glass force reduced by %g after %d steps: stopping.\n", force / force0, step + 1);
+            break;
+        }
     }
 
     /*We are done with the power spectrum, free it*/
@@ -144,7 +265,8 @@ void glass_evolve(PetaPM * pm, int nsteps, const char * pkoutname, struct ic_par
 }
 
 
-static void
+/* Prints and returns the rms force on the particles.*/
+static double
 glass_stats(struct ic_part_data * ICP, int NumPart) {
     int i;
     double disp2 = 0;
@@ -166,6 +288,7 @@ glass_stats(struct ic_part_data * ICP, int NumPart) {
     MPI_Allreduce(MPI_IN_PLACE, &n, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 
     message(0, "Force std = %g, vel std = %g\n", sqrt(disp2 / n), sqrt(vel2 / n));
+    return sqrt(disp2 / n);
 }
 
 struct ic_prep_data
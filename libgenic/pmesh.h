@@ -1,5 +1,6 @@
 #ifndef PMESH_H
 #define PMESH_H
+#include <stdint.h>
 #include <gsl/gsl_rng.h>
 #include <libgadget/petapm.h>
 #include <libgadget/utils.h>
@@ -197,4 +198,96 @@ pmic_fill_gaussian_gadget(PMDesc * pm, double * delta_k, int seed, int setUnitar
     fwrite(pm->canvas, sizeof(pm->canvas[0]), pm->ORegion.total * 2, fopen(fn, "w"));
 */
 }
+/*
+ * Counter based generator of the gaussian field: each mode draws its own
+ * random numbers from Philox4x32-10 (Salmon et al 2011), with the mode index as counter
+ * and the seed as key. There is no generator state, so the field does not depend on the
+ * decomposition or the number of threads and every mode can be made in parallel.
+ * It does not agree with N-GenIC.
+ * */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static inline void
+philox4x32(const uint32_t ctr_in[4], const uint32_t key_in[2], uint32_t out[4])
+{
+    uint32_t ctr[4] = {ctr_in[0], ctr_in[1], ctr_in[2], ctr_in[3]};
+    uint32_t key[2] = {key_in[0], key_in[1]};
+    int r;
+    for(r = 0; r < 10; r++) {
+        const uint64_t p0 = (uint64_t) PHILOX_M0 * ctr[0];
+        const uint64_t p1 = (uint64_t) PHILOX_M1 * ctr[2];
+        const uint32_t hi0 = p0 >> 32, lo0 = (uint32_t) p0;
+        const uint32_t hi1 = p1 >> 32, lo1 = (uint32_t) p1;
+        ctr[0] = hi1 ^ ctr[1] ^ key[0];
+        ctr[1] = lo1;
+        ctr[2] = hi0 ^ ctr[3] ^ key[1];
+        ctr[3] = lo0;
+        key[0] += PHILOX_W0;
+        key[1] += PHILOX_W1;
+    }
+    out[0] = ctr[0]; out[1] = ctr[1]; out[2] = ctr[2]; out[3] = ctr[3];
+}
+
+/* Uniform double in (0, 1) from 64 random bits.*/
+static inline double
+philox_uniform(uint32_t hi, uint32_t lo)
+{
+    const uint64_t bits = (((uint64_t) hi) << 21) ^ (lo >> 11);
+    return (bits + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+static void
+pmic_fill_gaussian_philox(PMDesc * pm, double * delta_k, int seed, int setUnitaryAmplitude, int setInvertPhase)
+{
+    const uint32_t key[2] = {(uint32_t) seed, 0x6e6f6973u};
+    const ptrdiff_t N0 = pm->Nmesh[0], N1 = pm->Nmesh[1], N2 = pm->Nmesh[2];
+    ptrdiff_t ij;
+
+    #pragma omp parallel for
+    for(ij = 0; ij < pm->ORegion.size[0] * pm->ORegion.size[1]; ij++) {
+        const ptrdiff_t i = ij / pm->ORegion.size[1] + pm->ORegion.start[0];
+        const ptrdiff_t j = ij % pm->ORegion.size[1] + pm->ORegion.start[1];
+        const ptrdiff_t ci = (N0 - i) % N0;
+        const ptrdiff_t cj = (N1 - j) % N1;
+        /* On the k = 0 and k = N/2 planes (i, j) and (ci, cj) are the same mode:
+         * draw both from the lower index of the pair and conjugate the other.*/
+        const int conj = ci < i || (ci == i && cj < j);
+        const int selfconj = ci == i && cj == j;
+        ptrdiff_t krel;
+        for(krel = 0; krel < pm->ORegion.size[2]; krel++) {
+            const ptrdiff_t k = krel + pm->ORegion.start[2];
+            const ptrdiff_t ip = pm->ORegion.strides[0] * (i - pm->ORegion.start[0])
+                               + pm->ORegion.strides[1] * (j - pm->ORegion.start[1])
+                               + pm->ORegion.strides[2] * krel;
+            const int onplane = (k == 0 || 2 * k == N2);
+            const int use_conj = onplane && conj;
+            const uint64_t mode = use_conj ? (ci * N1 + cj) * N2 + k : (i * N1 + j) * N2 + k;
+            const uint32_t ctr[4] = {(uint32_t) mode, (uint32_t) (mode >> 32), 0, 0};
+            uint32_t rnd[4];
+            philox4x32(ctr, key, rnd);
+
+            /* we want two numbers that are of std ~ 1/sqrt(2) */
+            double ampl = sqrt(- log(philox_uniform(rnd[0], rnd[1])));
+            double phase = philox_uniform(rnd[2], rnd[3]) * 2 * M_PI;
+            if (setUnitaryAmplitude) ampl = 1.0;
+            if (setInvertPhase) phase += M_PI;
+
+            (delta_k + 2 * ip)[0] = ampl * cos(phase);
+            (delta_k + 2 * ip)[1] = ampl * sin(phase);
+            if(use_conj)
+                (delta_k + 2 * ip)[1] *= -1;
+            /* The mode is self conjugate, thus imaginary mode must be zero */
+            if(onplane && selfconj)
+                (delta_k + 2 * ip)[1] = 0;
+            /* the mean is zero */
+            if(i == 0 && j == 0 && k == 0) {
+                (delta_k + 2 * ip)[0] = 0;
+                (delta_k + 2 * ip)[1] = 0;
+            }
+        }
+    }
+}
 #endif
@@ -30,12 +30,17 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
 /* Fill ICP with NumPart particles spaced on a regular 3D grid, whose structure is stored in the IDGenerator. */
 int setup_grid(IDGenerator * idgen, double shift, double mass, struct ic_part_data * ICP);
 
+/* As setup_grid, but fill ICP with only the NumPart grid particles starting at index start. */
+int setup_grid_range(IDGenerator * idgen, const int start, const int NumPart, double shift, double mass, struct ic_part_data * ICP);
+
 /* Fill ICP with NumPart particles spaced out as a Lagrangian glass, calling glass_evolve
- * to move the particles with reversed gravity. */
-int setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP, const double UnitLength_in_cm, const char * OutputDir);
+ * to move the particles with reversed gravity. If GlassCacheDir is not empty, the glass
+ * is read from there if a matching one exists, and saved there otherwise. */
+int setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP, const double UnitLength_in_cm, const char * OutputDir, const double GlassTolerance, const char * GlassCacheDir);
 
-/* Evolve a distribution of particles with a reversed gravitational force. */
-void glass_evolve(PetaPM * pm, int nsteps, const char * pkoutname, struct ic_part_data * ICP, const int NumPart, const double UnitLength_in_cm, const char * OutputDir);
+/* Evolve a distribution of particles with a reversed gravitational force, for at most nsteps,
+ * stopping early once the rms force is below tolerance times the initial rms force. */
+void glass_evolve(PetaPM * pm, int nsteps, const double tolerance, const char * pkoutname, struct ic_part_data * ICP, const int NumPart, const double UnitLength_in_cm, const char * OutputDir);
 
 /* Save the header of the ICs. */
 void saveheader(BigFile * bf, int64_t TotNumPartCDM, int64_t TotNumPartGas, int64_t TotNuPart, double nufrac, const double BoxSize, Cosmology * CP, const struct genic_config GenicConfig);
@@ -43,6 +48,23 @@ void saveheader(BigFile * bf, int64_t TotNumPartCDM, int64_t TotNumPartGas, int6
 /*Compute the mass array from the cosmology*/
 void compute_mass(double * mass, int64_t TotNumPartCDM, int64_t TotNumPartGas, int64_t TotNuPart, double nufrac, const double BoxSize, Cosmology * CP, const struct genic_config GenicConfig);
 
+/* Writer for the particle blocks of one type, so that the particles can be generated and written in chunks.
+ * Each chunk is written collectively: all ranks must call ic_writer_write the same number of times.*/
+#define IC_NCOLUMN 5
+struct ic_writer {
+    BigBlock blocks[IC_NCOLUMN];
+    BigBlockPtr ptrs[IC_NCOLUMN];
+    int active[IC_NCOLUMN];
+    uint64_t FirstID;
+    int NumWriters;
+};
+
+/* Create the blocks for all the particles of this type in idgen. */
+void ic_writer_open(struct ic_writer * w, IDGenerator * idgen, const int Type, BigFile * bf, const uint64_t FirstID, const int SavePrePos, int NumFiles, int NumWriters);
+/* Write NumPart particles, which are the particles of idgen starting at index start. */
+void ic_writer_write(struct ic_writer * w, IDGenerator * idgen, const int start, struct ic_part_data * curICP, const int NumPart);
+void ic_writer_close(struct ic_writer * w);
+
 /* Save positions, velocities and IDs of a particle type to the ICs. */
 void
 write_particle_data(IDGenerator * idgen,
@@ -46,16 +46,88 @@ void _bigfile_utils_create_block_from_c_array(BigFile * bf, void * baseptr, cons
     }
 }
 
-static void saveblock(BigFile * bf, void * baseptr, int ptype, const char * bname, const char * dtype, int items_per_particle, const int NumPart, ptrdiff_t elsize, int NumFiles, int NumWriters) {
-    size_t dims[2];
-    char name[128];
-    snprintf(name, 128, "%d/%s", ptype, bname);
-
-    dims[0] = NumPart;
-    dims[1] = items_per_particle;
-    _bigfile_utils_create_block_from_c_array(bf, baseptr, name, dtype, dims, elsize, NumFiles, NumWriters, MPI_COMM_WORLD);
+/* Columns of the particle table written to the ICs, and their offsets in struct ic_part_data.
+ * The IDs are generated at write time.*/
+static const struct {
+    const char * name;
+    const char * dtype;
+    int items;
+    ptrdiff_t offset;
+} ICColumns[IC_NCOLUMN] = {
+    {"PrePosition", "f8", 3, offsetof(struct ic_part_data, PrePos)},
+    {"ICDensity", "f4", 1, offsetof(struct ic_part_data, Density)},
+    {"Position", "f8", 3, offsetof(struct ic_part_data, Pos)},
+    {"Velocity", "f4", 3, offsetof(struct ic_part_data, Vel)},
+    {"ID", "u8", 1, -1},
+};
+
+void
+ic_writer_open(struct ic_writer * w, IDGenerator * idgen, const int Type, BigFile * bf, const uint64_t FirstID, const int SavePrePos, int NumFiles, int NumWriters)
+{
+    int64_t TotNumPart = idgen->NumPart;
+    MPI_Allreduce(MPI_IN_PLACE, &TotNumPart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    w->FirstID = FirstID;
+    w->NumWriters = NumWriters;
+    int c;
+    for(c = 0; c < IC_NCOLUMN; c++) {
+        char name[128];
+        w->active[c] = SavePrePos || c != 0;
+        if(!w->active[c])
+            continue;
+        snprintf(name, 128, "%d/%s", Type, ICColumns[c].name);
+        if(0 != big_file_mpi_create_block(bf, &w->blocks[c], name, ICColumns[c].dtype, ICColumns[c].items, NumFiles, TotNumPart, MPI_COMM_WORLD))
+            endrun(0, "%s:%s\n", big_file_get_error_message(), name);
+        if(0 != big_block_seek(&w->blocks[c], &w->ptrs[c], 0))
+            endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+    }
+}
+
+void
+ic_writer_write(struct ic_writer * w, IDGenerator * idgen, const int start, struct ic_part_data * curICP, const int NumPart)
+{
+    /*Generate the IDs*/
+    uint64_t * ids = (uint64_t *) mymalloc("IDs", NumPart * sizeof(uint64_t));
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++)
+    {
+        ids[i] = idgen_create_id_from_index(idgen, start + i) + w->FirstID;
+    }
+    int c;
+    for(c = 0; c < IC_NCOLUMN; c++) {
+        if(!w->active[c])
+            continue;
+        BigArray array;
+        size_t dims[2] = {NumPart, ICColumns[c].items};
+        ptrdiff_t strides[2];
+        void * baseptr;
+        strides[1] = dtype_itemsize(ICColumns[c].dtype);
+        if(ICColumns[c].offset >= 0) {
+            baseptr = (char *) curICP + ICColumns[c].offset;
+            strides[0] = sizeof(curICP[0]);
+        } else {
+            baseptr = ids;
+            strides[0] = sizeof(uint64_t);
+        }
+        big_array_init(&array, baseptr, ICColumns[c].dtype, 2, dims, strides);
+        if(0 != big_block_mpi_write(&w->blocks[c], &w->ptrs[c], &array, w->NumWriters, MPI_COMM_WORLD))
+            endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+    myfree(ids);
+    walltime_measure("/Write");
 }
 
+void
+ic_writer_close(struct ic_writer * w)
+{
+    int c;
+    for(c = 0; c < IC_NCOLUMN; c++) {
+        if(!w->active[c])
+            continue;
+        if(0 != big_block_mpi_close(&w->blocks[c], MPI_COMM_WORLD))
+            endrun(0, "%s:%s\n", big_file_get_error_message(), ICColumns[c].name);
+    }
+}
 
 void
 write_particle_data(IDGenerator * idgen,
@@ -66,24 +138,10 @@ write_particle_data(IDGenerator * idgen,
                     int NumFiles, int NumWriters,
                     struct ic_part_data * curICP)
 {
-    /* Write particles */
-    if(SavePrePos)
-        saveblock(bf, &curICP[0].PrePos, Type, "PrePosition", "f8", 3, idgen->NumPart, sizeof(curICP[0]), NumFiles, NumWriters);
-    saveblock(bf, &curICP[0].Density, Type, "ICDensity", "f4", 1, idgen->NumPart, sizeof(curICP[0]), NumFiles, NumWriters);
-    saveblock(bf, &curICP[0].Pos, Type, "Position", "f8", 3, idgen->NumPart, sizeof(curICP[0]), NumFiles, NumWriters);
-    saveblock(bf, &curICP[0].Vel, Type, "Velocity", "f4", 3, idgen->NumPart, sizeof(curICP[0]), NumFiles, NumWriters);
-    /*Generate and write IDs*/
-    uint64_t * ids = (uint64_t *) mymalloc("IDs", idgen->NumPart * sizeof(uint64_t));
-    memset(ids, 0, idgen->NumPart * sizeof(uint64_t));
-    int i;
-    #pragma omp parallel for
-    for(i = 0; i < idgen->NumPart; i++)
-    {
-        ids[i] = idgen_create_id_from_index(idgen, i) + FirstID;
-    }
-    saveblock(bf, ids, Type, "ID", "u8", 1, idgen->NumPart, sizeof(uint64_t), NumFiles, NumWriters);
-    myfree(ids);
-    walltime_measure("/Write");
+    struct ic_writer w;
+    ic_writer_open(&w, idgen, Type, bf, FirstID, SavePrePos, NumFiles, NumWriters);
+    ic_writer_write(&w, idgen, 0, curICP, idgen->NumPart);
+    ic_writer_close(&w);
 }
 
 /*Compute the mass array from the cosmology and the total number of particles.*/
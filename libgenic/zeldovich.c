@@ -30,7 +30,14 @@ static void readout_vel_z(PetaPM * pm, int i, double * mesh, double weight);
 static void readout_disp_x(PetaPM * pm, int i, double * mesh, double weight);
 static void readout_disp_y(PetaPM * pm, int i, double * mesh, double weight);
 static void readout_disp_z(PetaPM * pm, int i, double * mesh, double weight);
-static void gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int UnitaryAmplitude, int InvertPhase, const int Seed);
+static void hessian_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
+static void lpt2_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
+static void lpt2_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
+static void lpt2_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
+static void readout_lpt2_x(PetaPM * pm, int i, double * mesh, double weight);
+static void readout_lpt2_y(PetaPM * pm, int i, double * mesh, double weight);
+static void readout_lpt2_z(PetaPM * pm, int i, double * mesh, double weight);
+static void gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int UnitaryAmplitude, int InvertPhase, const int Seed, enum GaussianRNG RNG);
 
 static inline double periodic_wrap(double x, const double BoxSize)
 {
@@ -90,18 +97,24 @@ idgen_create_pos_from_index(IDGenerator * idgen, int index, double pos[3])
 int
 setup_grid(IDGenerator * idgen, double shift, double mass, struct ic_part_data * ICP)
 {
-    memset(ICP, 0, idgen->NumPart*sizeof(struct ic_part_data));
+    return setup_grid_range(idgen, 0, idgen->NumPart, shift, mass, ICP);
+}
+
+int
+setup_grid_range(IDGenerator * idgen, const int start, const int NumPart, double shift, double mass, struct ic_part_data * ICP)
+{
+    memset(ICP, 0, NumPart*sizeof(struct ic_part_data));
 
     int i;
     #pragma omp parallel for
-    for(i = 0; i < idgen->NumPart; i ++) {
-        idgen_create_pos_from_index(idgen, i, &ICP[i].Pos[0]);
+    for(i = 0; i < NumPart; i ++) {
+        idgen_create_pos_from_index(idgen, start + i, &ICP[i].Pos[0]);
         ICP[i].Pos[0] += shift;
         ICP[i].Pos[1] += shift;
         ICP[i].Pos[2] +=  shift;
         ICP[i].Mass = mass;
     }
-    return idgen->NumPart;
+    return NumPart;
 }
 
 struct ic_prep_data
@@ -146,6 +159,72 @@ static PetaPMRegion * makeregion(PetaPM * pm, PetaPMParticleStruct * pstruct, vo
 static enum TransferType ptype;
 /*Global to pass the particle data to the readout functions*/
 static struct ic_part_data * curICP;
+/*Globals to pass the axes of the second derivative to hessian_transfer*/
+static int hess_i, hess_j;
+/*Globals to pass the growth and velocity factors of the second order displacement to the readout*/
+static double lpt2_disp_fac, lpt2_vel_fac;
+
+/* Second order LPT source, S = sum_{i < j} (phi_ii phi_jj - phi_ij^2), where the laplacian of phi is the
+ * linear density, computed on the mesh and returned in Fourier space (not normalised).
+ * Only three real meshes are held at once.*/
+static pfft_complex *
+lpt2_source(PetaPM * pm, pfft_complex * rho_k)
+{
+    const ptrdiff_t ncell = pm->real_space_region.totalsize;
+    ptrdiff_t ip;
+    hess_i = hess_j = 0;
+    double * source = petapm_c2r_mesh(pm, rho_k, hessian_transfer);
+    hess_i = hess_j = 1;
+    double * trace = petapm_c2r_mesh(pm, rho_k, hessian_transfer);
+    #pragma omp parallel for
+    for(ip = 0; ip < ncell; ip++) {
+        const double phixx = source[ip];
+        source[ip] = phixx * trace[ip];
+        trace[ip] += phixx;
+    }
+    hess_i = hess_j = 2;
+    double * phi = petapm_c2r_mesh(pm, rho_k, hessian_transfer);
+    #pragma omp parallel for
+    for(ip = 0; ip < ncell; ip++)
+        source[ip] += trace[ip] * phi[ip];
+    myfree(phi);
+    myfree(trace);
+    for(hess_i = 0; hess_i < 3; hess_i++)
+        for(hess_j = hess_i + 1; hess_j < 3; hess_j++) {
+            phi = petapm_c2r_mesh(pm, rho_k, hessian_transfer);
+            #pragma omp parallel for
+            for(ip = 0; ip < ncell; ip++)
+                source[ip] -= phi[ip] * phi[ip];
+            myfree(phi);
+        }
+    walltime_measure("/Disp/LPT2Source");
+    pfft_complex * source_k = petapm_r2c_mesh(pm, source);
+    myfree(source);
+    return source_k;
+}
+
+/* Add the second order displacements and velocities: x = q + psi1 + D2 psi2, where the divergence
+ * of psi2 is -S, and D2 = -3/7 Omega^(-1/143) D1^2. The velocity uses f2 = 2 Omega^(6/11).
+ * See Scoccimarro 1998, Bouchet et al 1995.*/
+static void
+lpt2_displacement(PetaPM * pm, pfft_complex * rho_k, PetaPMRegion * regions, const int Nregions, Cosmology * CP, const double Time, const double hubble_a, const double vel_base)
+{
+    const double hubble_ratio = hubble_a / CP->Hubble;
+    const double Omega_a = CP->Omega0 / (Time * Time * Time) / (hubble_ratio * hubble_ratio);
+    lpt2_disp_fac = - 3. / 7. * pow(Omega_a, -1. / 143);
+    lpt2_vel_fac = lpt2_disp_fac * 2 * pow(Omega_a, 6. / 11) * vel_base;
+
+    PetaPMFunctions functions[] = {
+        {"LPT2X", lpt2_x_transfer, readout_lpt2_x},
+        {"LPT2Y", lpt2_y_transfer, readout_lpt2_y},
+        {"LPT2Z", lpt2_z_transfer, readout_lpt2_z},
+        {NULL, NULL, NULL },
+    };
+    pfft_complex * source_k = lpt2_source(pm, rho_k);
+    petapm_force_c2r(pm, source_k, regions, Nregions, functions);
+    myfree(source_k);
+    message(0, "Added second order displacements: Omega(a) = %g D2 = %g\n", Omega_a, lpt2_disp_fac);
+}
 
 void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_data * dispICP, const int NumPart, Cosmology * CP, const struct genic_config GenicConfig) {
 
@@ -192,14 +271,15 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
     /*Set up the velocity pre-factors*/
     const double hubble_a = hubble_function(CP, GenicConfig.TimeIC);
 
-    double vel_prefac = GenicConfig.TimeIC * hubble_a;
+    double vel_base = GenicConfig.TimeIC * hubble_a;
 
     if(GenicConfig.UsePeculiarVelocity) {
         /* already for peculiar velocity */
         message(0, "Producing Peculiar Velocity in the output.\n");
     } else {
-        vel_prefac /= sqrt(GenicConfig.TimeIC);	/* converts to Gadget velocity */
+        vel_base /= sqrt(GenicConfig.TimeIC);	/* converts to Gadget velocity */
     }
+    double vel_prefac = vel_base;
 
     if(!GenicConfig.PowerP.ScaleDepVelocity) {
         vel_prefac *= F_Omega(CP, GenicConfig.TimeIC);
@@ -220,10 +300,28 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
     pfft_complex * rho_k = petapm_alloc_rhok(pm);
 
     gaussian_fill(pm->Nmesh, petapm_get_fourier_region(pm),
-		  rho_k, GenicConfig.UnitaryAmplitude, GenicConfig.InvertPhase, GenicConfig.Seed);
+		  rho_k, GenicConfig.UnitaryAmplitude, GenicConfig.InvertPhase, GenicConfig.Seed, GenicConfig.GaussianRNG);
 
     petapm_force_c2r(pm, rho_k, regions, Nregions, functions);
 
+    /*Velocities of the first order displacements*/
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++)
+    {
+        int k;
+        for(k = 0; k < 3; k++)
+        {
+            /*Copy displacements to velocities if not done already*/
+            if(!GenicConfig.PowerP.ScaleDepVelocity)
+                curICP[i].Vel[k] = curICP[i].Disp[k];
+            curICP[i].Vel[k] *= vel_prefac;
+        }
+    }
+
+    /*Neutrino particles are too hot for the second order terms to matter*/
+    if(GenicConfig.LPTOrder >= 2 && ptype != DELTA_NU)
+        lpt2_displacement(pm, rho_k, regions, Nregions, CP, GenicConfig.TimeIC, hubble_a, vel_base);
+
     myfree(rho_k);
     myfree(regions);
     petapm_force_finish(pm);
@@ -242,10 +340,6 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
                 maxdisp = dis;
             /*Copy displacements to positions.*/
             curICP[i].Pos[k] += curICP[i].Disp[k];
-            /*Copy displacements to velocities if not done already*/
-            if(!GenicConfig.PowerP.ScaleDepVelocity)
-                curICP[i].Vel[k] = curICP[i].Disp[k];
-            curICP[i].Vel[k] *= vel_prefac;
             absv += curICP[i].Vel[k] * curICP[i].Vel[k];
             curICP[i].Pos[k] = periodic_wrap(curICP[i].Pos[k], pm->BoxSize);
         }
@@ -332,6 +426,46 @@ static void disp_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *
     disp_transfer(pm, k2, kpos[2], value, 0);
 }
 
+/* Second derivative of the potential whose laplacian is the density, phi_ij = k_i k_j / k^2 delta_k.*/
+static void hessian_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+    if(k2) {
+        double kmag = sqrt(k2) * 2 * M_PI / pm->BoxSize;
+        double fac = DeltaSpec(kmag, ptype) / sqrt(pm->BoxSize * pm->BoxSize * pm->BoxSize);
+        fac *= kpos[hess_i] * (double) kpos[hess_j] / k2;
+        value[0][0] *= fac;
+        value[0][1] *= fac;
+    }
+    else {
+        value[0][0] = 0;
+        value[0][1] = 0;
+    }
+}
+
+/* Second order displacement psi2 = - i k / k^2 S_k from the un-normalised transform of the source.*/
+static void lpt2_transfer(PetaPM * pm, int64_t k2, int kaxis, pfft_complex * value) {
+    if(k2) {
+        const double ncell = (double) pm->Nmesh * pm->Nmesh * pm->Nmesh;
+        const double fac = pm->BoxSize / (2 * M_PI) * kaxis / k2 / ncell;
+        double tmp = value[0][0];
+        value[0][0] = value[0][1] * fac;
+        value[0][1] = - tmp * fac;
+    }
+    else {
+        value[0][0] = 0;
+        value[0][1] = 0;
+    }
+}
+
+static void lpt2_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+    lpt2_transfer(pm, k2, kpos[0], value);
+}
+static void lpt2_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+    lpt2_transfer(pm, k2, kpos[1], value);
+}
+static void lpt2_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+    lpt2_transfer(pm, k2, kpos[2], value);
+}
+
 /**************
  * functions iterating over particle / mesh pairs
  ***************/
@@ -358,8 +492,21 @@ static void readout_disp_z(PetaPM * pm, int i, double * mesh, double weight) {
     curICP[i].Disp[2] += weight * mesh[0];
 }
 
+static void readout_lpt2_x(PetaPM * pm, int i, double * mesh, double weight) {
+    curICP[i].Disp[0] += lpt2_disp_fac * weight * mesh[0];
+    curICP[i].Vel[0] += lpt2_vel_fac * weight * mesh[0];
+}
+static void readout_lpt2_y(PetaPM * pm, int i, double * mesh, double weight) {
+    curICP[i].Disp[1] += lpt2_disp_fac * weight * mesh[0];
+    curICP[i].Vel[1] += lpt2_vel_fac * weight * mesh[0];
+}
+static void readout_lpt2_z(PetaPM * pm, int i, double * mesh, double weight) {
+    curICP[i].Disp[2] += lpt2_disp_fac * weight * mesh[0];
+    curICP[i].Vel[2] += lpt2_vel_fac * weight * mesh[0];
+}
+
 static void
-gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int setUnitaryAmplitude, int setInvertPhase, const int Seed)
+gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int setUnitaryAmplitude, int setInvertPhase, const int Seed, enum GaussianRNG RNG)
 {
     /* fastpm deals with strides properly; petapm not. So we translate it here. */
     PMDesc pm[1];
@@ -379,7 +526,10 @@ gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int setUni
     pm->ORegion.strides[2] = region->strides[1];
 
     pm->ORegion.total = region->totalsize;
-    pmic_fill_gaussian_gadget(pm, (double*) rho_k, Seed, setUnitaryAmplitude, setInvertPhase);
+    if(RNG == GAUSSIAN_RNG_PHILOX)
+        pmic_fill_gaussian_philox(pm, (double*) rho_k, Seed, setUnitaryAmplitude, setInvertPhase);
+    else
+        pmic_fill_gaussian_gadget(pm, (double*) rho_k, Seed, setUnitaryAmplitude, setInvertPhase);
 
 #if 0
     /* dump the gaussian field for debugging
@@ -4,7 +4,9 @@ import glob
 import os
 import re
 import collections
-import matplotlib.pyplot as plt
+import json
+import argparse
+import sys
 import numpy as np
 
 def parse_step_header(line, compiled_regex):
@@ -173,9 +175,35 @@ def get_total_time(directory, endsf = None):
         sf = headstart["Scale"]
     return totals, steptot
 
+def parse_treewalk_log(fname, label=None):
+    """Parse a treewalk.jsonl file, written if TreeWalkLogStats is set.
+    Returns a dictionary of treewalk labels, each a dictionary of numpy arrays, one entry per treewalk call.
+    Nested entries are flattened, so the maximum of timecomp1 over ranks is 'timecomp1_max'.
+    If label is not None, only that treewalk is returned."""
+    walks = collections.defaultdict(lambda: collections.defaultdict(list))
+    with open(fname) as fn:
+        for line in fn:
+            entry = json.loads(line)
+            if label is not None and entry["label"] != label:
+                continue
+            thiswalk = walks[entry["label"]]
+            for key, value in entry.items():
+                if key == "label":
+                    continue
+                if isinstance(value, dict):
+                    for subkey, subvalue in value.items():
+                        thiswalk[key+"_"+subkey].append(subvalue)
+                else:
+                    thiswalk[key].append(value)
+    walks = {lab: {key: np.array(val) for key, val in data.items()} for lab, data in walks.items()}
+    if label is not None:
+        return walks.get(label, {})
+    return walks
+
 def plot_sim_cost(directory):
     """Make a plot showing how much time a simulation takes as a function of scale factor.
     """
+    import matplotlib.pyplot as plt
     cpus = sorted(glob.glob(os.path.join(directory, "cpu.tx*")))
     #Find start and end scale factors
     headstart, _ = parse_file(cpus[0], step = 0)
@@ -227,3 +255,121 @@ def plot_sim_cost(directory):
     plt.legend(loc="upper left", ncol=3)
     plt.ylabel("SUs")
     plt.xlabel("a")
+
+def flatten_tree(tree, prefix=""):
+    """Flatten a tree of times into a dictionary of leaf times keyed by the full clock path."""
+    flat = {}
+    for key, value in tree.items():
+        if isinstance(value, dict):
+            flat.update(flatten_tree(value, prefix + key + "/"))
+        else:
+            flat[prefix + key] = value
+    return flat
+
+def parse_memory_log(fname):
+    """Largest peak memory over ranks and steps in a memory.txt file, in MB."""
+    regex = re.compile(r"Step ([0-9]*), Time: ([\.0-9e\-]*), MPIs: ([0-9]*) Peak: ([\.0-9e\+]*) MB")
+    peak = 0
+    with open(fname) as fn:
+        for line in fn:
+            reg = re.match(regex, line)
+            if reg is not None:
+                peak = max(peak, float(reg.groups()[3]))
+    return peak
+
+def benchmark_summary(directory, **meta):
+    """Summarise a benchmark run in directory as a dictionary: the run metadata,
+    the accumulated time of each clock and of each top level section, the peak memory
+    and the interactions per second of each treewalk.
+    Times are mean over ranks, in seconds. Keyword arguments are stored as metadata."""
+    head, stepd = parse_file(os.path.join(directory, "cpu.txt"))
+    summary = dict(meta)
+    summary.update({"MPI": head["MPI"], "Thread": head["Thread"], "Step": head["Step"], "Scale": head["Scale"], "Elapsed": head["Time"]})
+    # The line numbers in clock names change between versions: drop them so runs can be compared.
+    clocks = {}
+    for key, value in flatten_tree(stepd).items():
+        key = re.sub(r"@[^/]*", "", key)
+        clocks[key] = clocks.get(key, 0) + value
+    summary["clocks"] = clocks
+    summary["sections"] = {key: TreeTime(value) for key, value in stepd.items()}
+    memfile = os.path.join(directory, "memory.txt")
+    if os.path.exists(memfile):
+        summary["PeakMemoryMB"] = parse_memory_log(memfile)
+    twfile = os.path.join(directory, "treewalk.jsonl")
+    if os.path.exists(twfile):
+        treewalks = {}
+        for label, data in parse_treewalk_log(twfile).items():
+            if "Ninteractions_sum" not in data:
+                continue
+            interactions = int(np.sum(data["Ninteractions_sum"]))
+            # Compute time of the slowest rank in the primary and secondary walks
+            seconds = float(np.sum(data["timecomp1_max"] + data["timecomp2_max"]))
+            treewalks[label] = {"calls": len(data["Ninteractions_sum"]), "Ninteractions": interactions,
+                                "InteractionsPerSecond": interactions / seconds if seconds > 0 else 0}
+        summary["treewalks"] = treewalks
+    return summary
+
+def compare_benchmarks(old, new, tolerance=0.05, out=sys.stdout):
+    """Print the times of two benchmark summaries and their ratio.
+    Returns the list of sections which are slower in new by more than tolerance."""
+    slower = []
+    for kind in ("MPI", "Thread", "problem", "scaling", "ngrid", "steps"):
+        if old.get(kind) != new.get(kind):
+            print("WARNING: %s differs: %s vs %s" % (kind, old.get(kind), new.get(kind)), file=out)
+    print("%-48s %12s %12s %8s" % ("Section", old.get("version", "old"), new.get("version", "new"), "ratio"), file=out)
+    rows = [("Elapsed", old["Elapsed"], new["Elapsed"])]
+    rows += [(key, old["sections"][key], new["sections"][key]) for key in sorted(old["sections"]) if key in new["sections"]]
+    if "PeakMemoryMB" in old and "PeakMemoryMB" in new:
+        rows += [("PeakMemoryMB", old["PeakMemoryMB"], new["PeakMemoryMB"])]
+    for key, told, tnew in rows:
+        ratio = tnew / told if told > 0 else float("nan")
+        print("%-48s %12.4g %12.4g %8.3f" % (key, told, tnew, ratio), file=out)
+        if ratio > 1 + tolerance:
+            slower.append(key)
+    for label in sorted(old.get("treewalks", {})):
+        if label not in new.get("treewalks", {}):
+            continue
+        rold = old["treewalks"][label]["InteractionsPerSecond"]
+        rnew = new["treewalks"][label]["InteractionsPerSecond"]
+        ratio = rnew / rold if rold > 0 else float("nan")
+        print("%-48s %12.4g %12.4g %8.3f" % (label + " interactions/s", rold, rnew, ratio), file=out)
+        if ratio < 1 - tolerance:
+            slower.append(label)
+    return slower
+
+def main():
+    """Write the JSON summary of a benchmark run, or compare two summaries."""
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("directory", nargs="?", help="Output directory of the run to summarise")
+    parser.add_argument("--json", help="Write the summary to this file")
+    parser.add_argument("--problem", help="Name of the benchmark problem")
+    parser.add_argument("--scaling", help="strong or weak")
+    parser.add_argument("--ngrid", type=int, help="Particle grid size")
+    parser.add_argument("--steps", type=int, help="Number of steps run")
+    parser.add_argument("--version", help="Code version")
+    parser.add_argument("--compare", nargs=2, metavar=("OLD", "NEW"), help="Compare two summaries. Exits with 1 if NEW is slower.")
+    parser.add_argument("--tolerance", type=float, default=0.05, help="Fractional slowdown allowed by --compare")
+    args = parser.parse_args()
+    if args.compare:
+        with open(args.compare[0]) as fn:
+            old = json.load(fn)
+        with open(args.compare[1]) as fn:
+            new = json.load(fn)
+        slower = compare_benchmarks(old, new, args.tolerance)
+        if slower:
+            print("Slower by more than %g: %s" % (args.tolerance, ", ".join(slower)))
+            return 1
+        return 0
+    if args.directory is None:
+        parser.error("Need a directory to summarise")
+    summary = benchmark_summary(args.directory, problem=args.problem, scaling=args.scaling,
+                                ngrid=args.ngrid, steps=args.steps, version=args.version)
+    if args.json:
+        with open(args.json, "w") as fn:
+            json.dump(summary, fn, indent=1, sort_keys=True)
+    else:
+        json.dump(summary, sys.stdout, indent=1, sort_keys=True)
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())